@@ -30,8 +30,27 @@ public final class LibMiscStuff {
 
     public static native String getBootImageRomId(String filename) throws IOException;
 
+    /**
+     * Get the ROM IDs of several boot images in one call
+     *
+     * @param filenames Boot image paths
+     * @return For each boot image, its ROM ID, an empty string if the ramdisk has no /romid, or
+     *         null if the boot image could not be read
+     */
+    public static native String[] getBootImageRomIds(String[] filenames);
+
     public static native boolean bootImagesEqual(String filename1, String filename2) throws IOException;
 
+    /**
+     * Compare several pairs of boot images in one call
+     *
+     * @param filenames1 First boot image of each pair
+     * @param filenames2 Second boot image of each pair
+     * @return For each pair, 1 if the boot images are equal, 0 if they differ, or -1 if either
+     *         could not be read
+     */
+    public static native int[] bootImagesEqualBatch(String[] filenames1, String[] filenames2);
+
     static {
         System.loadLibrary("miscstuff-jni");
     }
@@ -0,0 +1,49 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class FileCopyRangeRequest extends Table {
+  public static FileCopyRangeRequest getRootAsFileCopyRangeRequest(ByteBuffer _bb) { return getRootAsFileCopyRangeRequest(_bb, new FileCopyRangeRequest()); }
+  public static FileCopyRangeRequest getRootAsFileCopyRangeRequest(ByteBuffer _bb, FileCopyRangeRequest obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public FileCopyRangeRequest __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public int sourceId() { int o = __offset(4); return o != 0 ? bb.getInt(o + bb_pos) : 0; }
+  public int targetId() { int o = __offset(6); return o != 0 ? bb.getInt(o + bb_pos) : 0; }
+  public long sourceOffset() { int o = __offset(8); return o != 0 ? bb.getLong(o + bb_pos) : -1L; }
+  public long targetOffset() { int o = __offset(10); return o != 0 ? bb.getLong(o + bb_pos) : -1L; }
+  public long count() { int o = __offset(12); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+
+  public static int createFileCopyRangeRequest(FlatBufferBuilder builder,
+      int source_id,
+      int target_id,
+      long source_offset,
+      long target_offset,
+      long count) {
+    builder.startObject(5);
+    FileCopyRangeRequest.addCount(builder, count);
+    FileCopyRangeRequest.addTargetOffset(builder, target_offset);
+    FileCopyRangeRequest.addSourceOffset(builder, source_offset);
+    FileCopyRangeRequest.addTargetId(builder, target_id);
+    FileCopyRangeRequest.addSourceId(builder, source_id);
+    return FileCopyRangeRequest.endFileCopyRangeRequest(builder);
+  }
+
+  public static void startFileCopyRangeRequest(FlatBufferBuilder builder) { builder.startObject(5); }
+  public static void addSourceId(FlatBufferBuilder builder, int sourceId) { builder.addInt(0, sourceId, 0); }
+  public static void addTargetId(FlatBufferBuilder builder, int targetId) { builder.addInt(1, targetId, 0); }
+  public static void addSourceOffset(FlatBufferBuilder builder, long sourceOffset) { builder.addLong(2, sourceOffset, -1L); }
+  public static void addTargetOffset(FlatBufferBuilder builder, long targetOffset) { builder.addLong(3, targetOffset, -1L); }
+  public static void addCount(FlatBufferBuilder builder, long count) { builder.addLong(4, count, 0L); }
+  public static int endFileCopyRangeRequest(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
@@ -0,0 +1,38 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class FileCopyRangeResponse extends Table {
+  public static FileCopyRangeResponse getRootAsFileCopyRangeResponse(ByteBuffer _bb) { return getRootAsFileCopyRangeResponse(_bb, new FileCopyRangeResponse()); }
+  public static FileCopyRangeResponse getRootAsFileCopyRangeResponse(ByteBuffer _bb, FileCopyRangeResponse obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public FileCopyRangeResponse __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public long bytesCopied() { int o = __offset(4); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public FileCopyRangeError error() { return error(new FileCopyRangeError()); }
+  public FileCopyRangeError error(FileCopyRangeError obj) { int o = __offset(6); return o != 0 ? obj.__assign(__indirect(o + bb_pos), bb) : null; }
+
+  public static int createFileCopyRangeResponse(FlatBufferBuilder builder,
+      long bytes_copied,
+      int errorOffset) {
+    builder.startObject(2);
+    FileCopyRangeResponse.addBytesCopied(builder, bytes_copied);
+    FileCopyRangeResponse.addError(builder, errorOffset);
+    return FileCopyRangeResponse.endFileCopyRangeResponse(builder);
+  }
+
+  public static void startFileCopyRangeResponse(FlatBufferBuilder builder) { builder.startObject(2); }
+  public static void addBytesCopied(FlatBufferBuilder builder, long bytesCopied) { builder.addLong(0, bytesCopied, 0L); }
+  public static void addError(FlatBufferBuilder builder, int errorOffset) { builder.addOffset(1, errorOffset, 0); }
+  public static int endFileCopyRangeResponse(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
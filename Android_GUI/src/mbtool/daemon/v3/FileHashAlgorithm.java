@@ -0,0 +1,14 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+public final class FileHashAlgorithm {
+  private FileHashAlgorithm() { }
+  public static final short SHA256 = 0;
+  public static final short SHA512 = 1;
+
+  public static final String[] names = { "SHA256", "SHA512", };
+
+  public static String name(int e) { return names[e]; }
+}
+
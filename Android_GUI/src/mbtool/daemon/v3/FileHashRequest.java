@@ -0,0 +1,50 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class FileHashRequest extends Table {
+  public static FileHashRequest getRootAsFileHashRequest(ByteBuffer _bb) { return getRootAsFileHashRequest(_bb, new FileHashRequest()); }
+  public static FileHashRequest getRootAsFileHashRequest(ByteBuffer _bb, FileHashRequest obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public FileHashRequest __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public int id() { int o = __offset(4); return o != 0 ? bb.getInt(o + bb_pos) : 0; }
+  public String path() { int o = __offset(6); return o != 0 ? __string(o + bb_pos) : null; }
+  public ByteBuffer pathAsByteBuffer() { return __vector_as_bytebuffer(6, 1); }
+  public long offset() { int o = __offset(8); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public long count() { int o = __offset(10); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public short algorithm() { int o = __offset(12); return o != 0 ? bb.getShort(o + bb_pos) : 0; }
+
+  public static int createFileHashRequest(FlatBufferBuilder builder,
+      int id,
+      int pathOffset,
+      long offset,
+      long count,
+      short algorithm) {
+    builder.startObject(5);
+    FileHashRequest.addCount(builder, count);
+    FileHashRequest.addOffset(builder, offset);
+    FileHashRequest.addPath(builder, pathOffset);
+    FileHashRequest.addId(builder, id);
+    FileHashRequest.addAlgorithm(builder, algorithm);
+    return FileHashRequest.endFileHashRequest(builder);
+  }
+
+  public static void startFileHashRequest(FlatBufferBuilder builder) { builder.startObject(5); }
+  public static void addId(FlatBufferBuilder builder, int id) { builder.addInt(0, id, 0); }
+  public static void addPath(FlatBufferBuilder builder, int pathOffset) { builder.addOffset(1, pathOffset, 0); }
+  public static void addOffset(FlatBufferBuilder builder, long offset) { builder.addLong(2, offset, 0L); }
+  public static void addCount(FlatBufferBuilder builder, long count) { builder.addLong(3, count, 0L); }
+  public static void addAlgorithm(FlatBufferBuilder builder, short algorithm) { builder.addShort(4, algorithm, 0); }
+  public static int endFileHashRequest(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
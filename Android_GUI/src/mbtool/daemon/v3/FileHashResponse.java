@@ -0,0 +1,46 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class FileHashResponse extends Table {
+  public static FileHashResponse getRootAsFileHashResponse(ByteBuffer _bb) { return getRootAsFileHashResponse(_bb, new FileHashResponse()); }
+  public static FileHashResponse getRootAsFileHashResponse(ByteBuffer _bb, FileHashResponse obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public FileHashResponse __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public int digest(int j) { int o = __offset(4); return o != 0 ? bb.get(__vector(o) + j * 1) & 0xFF : 0; }
+  public int digestLength() { int o = __offset(4); return o != 0 ? __vector_len(o) : 0; }
+  public ByteBuffer digestAsByteBuffer() { return __vector_as_bytebuffer(4, 1); }
+  public long bytesHashed() { int o = __offset(6); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public FileHashError error() { return error(new FileHashError()); }
+  public FileHashError error(FileHashError obj) { int o = __offset(8); return o != 0 ? obj.__assign(__indirect(o + bb_pos), bb) : null; }
+
+  public static int createFileHashResponse(FlatBufferBuilder builder,
+      int digestOffset,
+      long bytes_hashed,
+      int errorOffset) {
+    builder.startObject(3);
+    FileHashResponse.addBytesHashed(builder, bytes_hashed);
+    FileHashResponse.addError(builder, errorOffset);
+    FileHashResponse.addDigest(builder, digestOffset);
+    return FileHashResponse.endFileHashResponse(builder);
+  }
+
+  public static void startFileHashResponse(FlatBufferBuilder builder) { builder.startObject(3); }
+  public static void addDigest(FlatBufferBuilder builder, int digestOffset) { builder.addOffset(0, digestOffset, 0); }
+  public static int createDigestVector(FlatBufferBuilder builder, byte[] data) { builder.startVector(1, data.length, 1); for (int i = data.length - 1; i >= 0; i--) builder.addByte(data[i]); return builder.endVector(); }
+  public static void startDigestVector(FlatBufferBuilder builder, int numElems) { builder.startVector(1, numElems, 1); }
+  public static void addBytesHashed(FlatBufferBuilder builder, long bytesHashed) { builder.addLong(1, bytesHashed, 0L); }
+  public static void addError(FlatBufferBuilder builder, int errorOffset) { builder.addOffset(2, errorOffset, 0); }
+  public static int endFileHashResponse(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
@@ -0,0 +1,34 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class FileOpenFdResponse extends Table {
+  public static FileOpenFdResponse getRootAsFileOpenFdResponse(ByteBuffer _bb) { return getRootAsFileOpenFdResponse(_bb, new FileOpenFdResponse()); }
+  public static FileOpenFdResponse getRootAsFileOpenFdResponse(ByteBuffer _bb, FileOpenFdResponse obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public FileOpenFdResponse __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public FileOpenFdError error() { return error(new FileOpenFdError()); }
+  public FileOpenFdError error(FileOpenFdError obj) { int o = __offset(4); return o != 0 ? obj.__assign(__indirect(o + bb_pos), bb) : null; }
+
+  public static int createFileOpenFdResponse(FlatBufferBuilder builder,
+      int errorOffset) {
+    builder.startObject(1);
+    FileOpenFdResponse.addError(builder, errorOffset);
+    return FileOpenFdResponse.endFileOpenFdResponse(builder);
+  }
+
+  public static void startFileOpenFdResponse(FlatBufferBuilder builder) { builder.startObject(1); }
+  public static void addError(FlatBufferBuilder builder, int errorOffset) { builder.addOffset(0, errorOffset, 0); }
+  public static int endFileOpenFdResponse(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
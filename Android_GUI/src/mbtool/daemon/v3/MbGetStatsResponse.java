@@ -0,0 +1,41 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class MbGetStatsResponse extends Table {
+  public static MbGetStatsResponse getRootAsMbGetStatsResponse(ByteBuffer _bb) { return getRootAsMbGetStatsResponse(_bb, new MbGetStatsResponse()); }
+  public static MbGetStatsResponse getRootAsMbGetStatsResponse(ByteBuffer _bb, MbGetStatsResponse obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public MbGetStatsResponse __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public long connections() { int o = __offset(4); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public MbRequestStats stats(int j) { return stats(new MbRequestStats(), j); }
+  public MbRequestStats stats(MbRequestStats obj, int j) { int o = __offset(6); return o != 0 ? obj.__assign(__indirect(__vector(o) + j * 4), bb) : null; }
+  public int statsLength() { int o = __offset(6); return o != 0 ? __vector_len(o) : 0; }
+
+  public static int createMbGetStatsResponse(FlatBufferBuilder builder,
+      long connections,
+      int statsOffset) {
+    builder.startObject(2);
+    MbGetStatsResponse.addConnections(builder, connections);
+    MbGetStatsResponse.addStats(builder, statsOffset);
+    return MbGetStatsResponse.endMbGetStatsResponse(builder);
+  }
+
+  public static void startMbGetStatsResponse(FlatBufferBuilder builder) { builder.startObject(2); }
+  public static void addConnections(FlatBufferBuilder builder, long connections) { builder.addLong(0, connections, 0L); }
+  public static void addStats(FlatBufferBuilder builder, int statsOffset) { builder.addOffset(1, statsOffset, 0); }
+  public static int createStatsVector(FlatBufferBuilder builder, int[] data) { builder.startVector(4, data.length, 4); for (int i = data.length - 1; i >= 0; i--) builder.addOffset(data[i]); return builder.endVector(); }
+  public static void startStatsVector(FlatBufferBuilder builder, int numElems) { builder.startVector(4, numElems, 4); }
+  public static int endMbGetStatsResponse(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
@@ -0,0 +1,66 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class MbRequestStats extends Table {
+  public static MbRequestStats getRootAsMbRequestStats(ByteBuffer _bb) { return getRootAsMbRequestStats(_bb, new MbRequestStats()); }
+  public static MbRequestStats getRootAsMbRequestStats(ByteBuffer _bb, MbRequestStats obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public MbRequestStats __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public long requestType() { int o = __offset(4); return o != 0 ? (long)bb.getInt(o + bb_pos) & 0xFFFFFFFFL : 0L; }
+  public String name() { int o = __offset(6); return o != 0 ? __string(o + bb_pos) : null; }
+  public ByteBuffer nameAsByteBuffer() { return __vector_as_bytebuffer(6, 1); }
+  public long count() { int o = __offset(8); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public long totalLatencyUs() { int o = __offset(10); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public long maxLatencyUs() { int o = __offset(12); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public long latencyHistogram(int j) { int o = __offset(14); return o != 0 ? bb.getLong(__vector(o) + j * 8) : 0; }
+  public int latencyHistogramLength() { int o = __offset(14); return o != 0 ? __vector_len(o) : 0; }
+  public ByteBuffer latencyHistogramAsByteBuffer() { return __vector_as_bytebuffer(14, 8); }
+  public long bytesIn() { int o = __offset(16); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public long bytesOut() { int o = __offset(18); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+
+  public static int createMbRequestStats(FlatBufferBuilder builder,
+      long request_type,
+      int nameOffset,
+      long count,
+      long total_latency_us,
+      long max_latency_us,
+      int latency_histogramOffset,
+      long bytes_in,
+      long bytes_out) {
+    builder.startObject(8);
+    MbRequestStats.addBytesOut(builder, bytes_out);
+    MbRequestStats.addBytesIn(builder, bytes_in);
+    MbRequestStats.addMaxLatencyUs(builder, max_latency_us);
+    MbRequestStats.addTotalLatencyUs(builder, total_latency_us);
+    MbRequestStats.addCount(builder, count);
+    MbRequestStats.addLatencyHistogram(builder, latency_histogramOffset);
+    MbRequestStats.addName(builder, nameOffset);
+    MbRequestStats.addRequestType(builder, request_type);
+    return MbRequestStats.endMbRequestStats(builder);
+  }
+
+  public static void startMbRequestStats(FlatBufferBuilder builder) { builder.startObject(8); }
+  public static void addRequestType(FlatBufferBuilder builder, long requestType) { builder.addInt(0, (int)requestType, (int)0L); }
+  public static void addName(FlatBufferBuilder builder, int nameOffset) { builder.addOffset(1, nameOffset, 0); }
+  public static void addCount(FlatBufferBuilder builder, long count) { builder.addLong(2, count, 0L); }
+  public static void addTotalLatencyUs(FlatBufferBuilder builder, long totalLatencyUs) { builder.addLong(3, totalLatencyUs, 0L); }
+  public static void addMaxLatencyUs(FlatBufferBuilder builder, long maxLatencyUs) { builder.addLong(4, maxLatencyUs, 0L); }
+  public static void addLatencyHistogram(FlatBufferBuilder builder, int latencyHistogramOffset) { builder.addOffset(5, latencyHistogramOffset, 0); }
+  public static int createLatencyHistogramVector(FlatBufferBuilder builder, long[] data) { builder.startVector(8, data.length, 8); for (int i = data.length - 1; i >= 0; i--) builder.addLong(data[i]); return builder.endVector(); }
+  public static void startLatencyHistogramVector(FlatBufferBuilder builder, int numElems) { builder.startVector(8, numElems, 8); }
+  public static void addBytesIn(FlatBufferBuilder builder, long bytesIn) { builder.addLong(6, bytesIn, 0L); }
+  public static void addBytesOut(FlatBufferBuilder builder, long bytesOut) { builder.addLong(7, bytesOut, 0L); }
+  public static int endMbRequestStats(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
@@ -0,0 +1,34 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class PathListDirectoryRequest extends Table {
+  public static PathListDirectoryRequest getRootAsPathListDirectoryRequest(ByteBuffer _bb) { return getRootAsPathListDirectoryRequest(_bb, new PathListDirectoryRequest()); }
+  public static PathListDirectoryRequest getRootAsPathListDirectoryRequest(ByteBuffer _bb, PathListDirectoryRequest obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public PathListDirectoryRequest __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public String path() { int o = __offset(4); return o != 0 ? __string(o + bb_pos) : null; }
+  public ByteBuffer pathAsByteBuffer() { return __vector_as_bytebuffer(4, 1); }
+
+  public static int createPathListDirectoryRequest(FlatBufferBuilder builder,
+      int pathOffset) {
+    builder.startObject(1);
+    PathListDirectoryRequest.addPath(builder, pathOffset);
+    return PathListDirectoryRequest.endPathListDirectoryRequest(builder);
+  }
+
+  public static void startPathListDirectoryRequest(FlatBufferBuilder builder) { builder.startObject(1); }
+  public static void addPath(FlatBufferBuilder builder, int pathOffset) { builder.addOffset(0, pathOffset, 0); }
+  public static int endPathListDirectoryRequest(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
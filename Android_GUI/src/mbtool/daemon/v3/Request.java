@@ -16,19 +16,23 @@ public final class Request extends Table {
 
   public byte requestType() { int o = __offset(4); return o != 0 ? bb.get(o + bb_pos) : 0; }
   public Table request(Table obj) { int o = __offset(6); return o != 0 ? __union(obj, o) : null; }
+  public long requestId() { int o = __offset(8); return o != 0 ? (long)bb.getInt(o + bb_pos) & 0xFFFFFFFFL : 0L; }
 
   public static int createRequest(FlatBufferBuilder builder,
       byte request_type,
-      int requestOffset) {
-    builder.startObject(2);
+      int requestOffset,
+      long request_id) {
+    builder.startObject(3);
+    Request.addRequestId(builder, request_id);
     Request.addRequest(builder, requestOffset);
     Request.addRequestType(builder, request_type);
     return Request.endRequest(builder);
   }
 
-  public static void startRequest(FlatBufferBuilder builder) { builder.startObject(2); }
+  public static void startRequest(FlatBufferBuilder builder) { builder.startObject(3); }
   public static void addRequestType(FlatBufferBuilder builder, byte requestType) { builder.addByte(0, requestType, 0); }
   public static void addRequest(FlatBufferBuilder builder, int requestOffset) { builder.addOffset(1, requestOffset, 0); }
+  public static void addRequestId(FlatBufferBuilder builder, long requestId) { builder.addInt(2, (int)requestId, (int)0L); }
   public static int endRequest(FlatBufferBuilder builder) {
     int o = builder.endObject();
     return o;
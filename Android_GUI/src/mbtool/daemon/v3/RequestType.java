@@ -34,8 +34,13 @@ public final class RequestType {
   public static final byte CryptoDecryptRequest = 27;
   public static final byte CryptoGetPwTypeRequest = 28;
   public static final byte PathReadlinkRequest = 29;
+  public static final byte FileOpenFdRequest = 30;
+  public static final byte PathListDirectoryRequest = 31;
+  public static final byte MbGetStatsRequest = 32;
+  public static final byte FileCopyRangeRequest = 33;
+  public static final byte FileHashRequest = 34;
 
-  public static final String[] names = { "NONE", "FileChmodRequest", "FileCloseRequest", "FileOpenRequest", "FileReadRequest", "FileSeekRequest", "FileStatRequest", "FileWriteRequest", "FileSELinuxGetLabelRequest", "FileSELinuxSetLabelRequest", "PathChmodRequest", "PathCopyRequest", "PathSELinuxGetLabelRequest", "PathSELinuxSetLabelRequest", "PathGetDirectorySizeRequest", "MbGetVersionRequest", "MbGetInstalledRomsRequest", "MbGetBootedRomIdRequest", "MbSwitchRomRequest", "MbSetKernelRequest", "MbWipeRomRequest", "MbGetPackagesCountRequest", "RebootRequest", "SignedExecRequest", "ShutdownRequest", "PathDeleteRequest", "PathMkdirRequest", "CryptoDecryptRequest", "CryptoGetPwTypeRequest", "PathReadlinkRequest", };
+  public static final String[] names = { "NONE", "FileChmodRequest", "FileCloseRequest", "FileOpenRequest", "FileReadRequest", "FileSeekRequest", "FileStatRequest", "FileWriteRequest", "FileSELinuxGetLabelRequest", "FileSELinuxSetLabelRequest", "PathChmodRequest", "PathCopyRequest", "PathSELinuxGetLabelRequest", "PathSELinuxSetLabelRequest", "PathGetDirectorySizeRequest", "MbGetVersionRequest", "MbGetInstalledRomsRequest", "MbGetBootedRomIdRequest", "MbSwitchRomRequest", "MbSetKernelRequest", "MbWipeRomRequest", "MbGetPackagesCountRequest", "RebootRequest", "SignedExecRequest", "ShutdownRequest", "PathDeleteRequest", "PathMkdirRequest", "CryptoDecryptRequest", "CryptoGetPwTypeRequest", "PathReadlinkRequest", "FileOpenFdRequest", "PathListDirectoryRequest", "MbGetStatsRequest", "FileCopyRangeRequest", "FileHashRequest", };
 
   public static String name(int e) { return names[e]; }
 }
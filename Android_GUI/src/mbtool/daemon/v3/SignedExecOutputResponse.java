@@ -16,16 +16,20 @@ public final class SignedExecOutputResponse extends Table {
 
   public String line() { int o = __offset(4); return o != 0 ? __string(o + bb_pos) : null; }
   public ByteBuffer lineAsByteBuffer() { return __vector_as_bytebuffer(4, 1); }
+  public boolean streamFd() { int o = __offset(6); return o != 0 ? 0!=bb.get(o + bb_pos) : false; }
 
   public static int createSignedExecOutputResponse(FlatBufferBuilder builder,
-      int lineOffset) {
-    builder.startObject(1);
+      int lineOffset,
+      boolean stream_fd) {
+    builder.startObject(2);
     SignedExecOutputResponse.addLine(builder, lineOffset);
+    SignedExecOutputResponse.addStreamFd(builder, stream_fd);
     return SignedExecOutputResponse.endSignedExecOutputResponse(builder);
   }
 
-  public static void startSignedExecOutputResponse(FlatBufferBuilder builder) { builder.startObject(1); }
+  public static void startSignedExecOutputResponse(FlatBufferBuilder builder) { builder.startObject(2); }
   public static void addLine(FlatBufferBuilder builder, int lineOffset) { builder.addOffset(0, lineOffset, 0); }
+  public static void addStreamFd(FlatBufferBuilder builder, boolean streamFd) { builder.addBoolean(1, streamFd, false); }
   public static int endSignedExecOutputResponse(FlatBufferBuilder builder) {
     int o = builder.endObject();
     return o;
@@ -22,27 +22,35 @@ public final class SignedExecRequest extends Table {
   public int argsLength() { int o = __offset(8); return o != 0 ? __vector_len(o) : 0; }
   public String arg0() { int o = __offset(10); return o != 0 ? __string(o + bb_pos) : null; }
   public ByteBuffer arg0AsByteBuffer() { return __vector_as_bytebuffer(10, 1); }
+  public boolean streamFd() { int o = __offset(12); return o != 0 ? 0!=bb.get(o + bb_pos) : false; }
+  public boolean background() { int o = __offset(14); return o != 0 ? 0!=bb.get(o + bb_pos) : false; }
 
   public static int createSignedExecRequest(FlatBufferBuilder builder,
       int binary_pathOffset,
       int signature_pathOffset,
       int argsOffset,
-      int arg0Offset) {
-    builder.startObject(4);
+      int arg0Offset,
+      boolean stream_fd,
+      boolean background) {
+    builder.startObject(6);
     SignedExecRequest.addArg0(builder, arg0Offset);
     SignedExecRequest.addArgs(builder, argsOffset);
     SignedExecRequest.addSignaturePath(builder, signature_pathOffset);
     SignedExecRequest.addBinaryPath(builder, binary_pathOffset);
+    SignedExecRequest.addBackground(builder, background);
+    SignedExecRequest.addStreamFd(builder, stream_fd);
     return SignedExecRequest.endSignedExecRequest(builder);
   }
 
-  public static void startSignedExecRequest(FlatBufferBuilder builder) { builder.startObject(4); }
+  public static void startSignedExecRequest(FlatBufferBuilder builder) { builder.startObject(6); }
   public static void addBinaryPath(FlatBufferBuilder builder, int binaryPathOffset) { builder.addOffset(0, binaryPathOffset, 0); }
   public static void addSignaturePath(FlatBufferBuilder builder, int signaturePathOffset) { builder.addOffset(1, signaturePathOffset, 0); }
   public static void addArgs(FlatBufferBuilder builder, int argsOffset) { builder.addOffset(2, argsOffset, 0); }
   public static int createArgsVector(FlatBufferBuilder builder, int[] data) { builder.startVector(4, data.length, 4); for (int i = data.length - 1; i >= 0; i--) builder.addOffset(data[i]); return builder.endVector(); }
   public static void startArgsVector(FlatBufferBuilder builder, int numElems) { builder.startVector(4, numElems, 4); }
   public static void addArg0(FlatBufferBuilder builder, int arg0Offset) { builder.addOffset(3, arg0Offset, 0); }
+  public static void addStreamFd(FlatBufferBuilder builder, boolean streamFd) { builder.addBoolean(4, streamFd, false); }
+  public static void addBackground(FlatBufferBuilder builder, boolean background) { builder.addBoolean(5, background, false); }
   public static int endSignedExecRequest(FlatBufferBuilder builder) {
     int o = builder.endObject();
     return o;
@@ -17,13 +17,19 @@
  * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
 #include <limits>
 #include <memory>
 #include <string>
+#include <thread>
 #include <type_traits>
 #include <unordered_map>
+#include <vector>
 
 #include <cassert>
+#include <cinttypes>
 #include <climits>
 #include <cstdarg>
 #include <cstdio>
@@ -32,9 +38,24 @@
 
 #include <getopt.h>
 
+// libarchive
+#include <archive.h>
+
+// zlib
+#include <zlib.h>
+
+// LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+
+// OpenSSL
+#include <openssl/evp.h>
+
 // libmbcommon
 #include <mbcommon/common.h>
 #include <mbcommon/libc/stdio.h>
+#include <mbcommon/string.h>
+#include <mbcommon/thread_pool.h>
 
 // libmbbootimg
 #include <mbbootimg/entry.h>
@@ -60,9 +81,11 @@
 #define FIELD_APPSBL_ADDRESS            "appsbl_address"
 #define FIELD_ENTRYPOINT                "entrypoint"
 #define FIELD_PAGE_SIZE                 "page_size"
+#define FIELD_FORMAT                    "format"
 
 #define IMAGE_KERNEL                    "kernel"
 #define IMAGE_RAMDISK                   "ramdisk"
+#define IMAGE_RAMDISK_CPIO              "ramdisk.cpio"
 #define IMAGE_SECOND                    "second"
 #define IMAGE_DT                        "dt"
 #define IMAGE_ABOOT                     "aboot"
@@ -72,10 +95,15 @@
 #define IMAGE_RPM                       "rpm"
 #define IMAGE_APPSBL                    "appsbl"
 
+// Magic and uncompressed block size of the LZ4 legacy format
+#define LZ4_LEGACY_MAGIC                0x184C2102u
+#define LZ4_LEGACY_BLOCK_SIZE           (8 * 1024 * 1024)
+
 
 typedef std::unique_ptr<FILE, decltype(fclose) *> ScopedFILE;
 typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
 typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+typedef std::unique_ptr<archive, decltype(archive_read_free) *> ScopedArchive;
 
 #define HELP_HEADERS \
     "Header fields:\n" \
@@ -118,7 +146,11 @@ typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
     "\n" \
     "Available commands:\n" \
     "  unpack         Unpack a boot image\n" \
+    "  unpack-batch   Unpack multiple boot images in parallel\n" \
     "  pack           Assemble boot image from unpacked files\n" \
+    "  info           Print boot image headers and entries as JSON\n" \
+    "  store          Add boot images to a deduplicating image store\n" \
+    "  restore        Rebuild a boot image from an image store\n" \
     "\n" \
     "Pass -h/--help as a argument to a command to see it's available options.\n"
 
@@ -135,6 +167,13 @@ typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
     "  -t, --type <type>\n" \
     "                  Input type of the boot image (autodetect if unspecified)\n" \
     "                  (one of: android, bump, loki, mtk, sonyelf)\n" \
+    "  -j, --jobs <count>\n" \
+    "                  Number of items to extract in parallel\n" \
+    "                  (number of CPUs if unspecified)\n" \
+    "  -d, --decompress-ramdisk\n" \
+    "                  Also write the decompressed ramdisk to ramdisk.cpio (or\n" \
+    "                  the path given by --output-ramdisk_cpio). gzip, lz4,\n" \
+    "                  lzma, and xz compressed ramdisks are supported.\n" \
     "  --output-<item> <item path>\n" \
     "                  Custom path for a particular item\n" \
     "\n" \
@@ -174,6 +213,47 @@ typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
     "        bootimgtool unpack boot.img -o extracted --output-kernel /tmp/kernel.img\n" \
     "\n"
 
+#define HELP_UNPACK_BATCH_USAGE \
+    "Usage: bootimgtool unpack-batch [<option>...] [<input file>...]\n" \
+    "\n" \
+    "Options:\n" \
+    "  -o, --output <output directory>\n" \
+    "                  Output directory (current directory if unspecified)\n" \
+    "  -m, --manifest <manifest file>\n" \
+    "                  File containing the list of boot images to unpack\n" \
+    "  -j, --jobs <count>\n" \
+    "                  Number of images to unpack in parallel\n" \
+    "                  (number of CPUs if unspecified)\n" \
+    "  -t, --type <type>\n" \
+    "                  Input type of the boot images (autodetect if unspecified)\n" \
+    "                  (one of: android, bump, loki, mtk, sonyelf)\n" \
+    "\n" \
+    "The boot images are taken from the command line and from the manifest file.\n" \
+    "The manifest is a list of newline-separated paths where lines containing\n" \
+    "only whitespace and lines that begin with '#' following any leading\n" \
+    "whitespace are ignored.\n" \
+    "\n" \
+    "Each boot image is unpacked the same way as with the unpack command and the\n" \
+    "default \"<input file>-\" prefix. The output files are stored in the\n" \
+    "following paths:\n" \
+    "\n" \
+    "    <output directory>/<input file>-header.txt\n" \
+    "    <output directory>/<input file>-<image>\n" \
+    "\n" \
+    "Since the prefix is derived from the filename of the boot image, all of the\n" \
+    "boot images must have unique filenames.\n" \
+    "\n" \
+    "Examples:\n" \
+    "\n" \
+    "1. Unpack all boot images in the images directory to extracted/\n" \
+    "\n" \
+    "        bootimgtool unpack-batch -o extracted images/*.img\n" \
+    "\n" \
+    "2. Unpack the boot images listed in images.txt using 4 threads\n" \
+    "\n" \
+    "        bootimgtool unpack-batch -j 4 -m images.txt\n" \
+    "\n"
+
 #define HELP_PACK_USAGE \
     "Usage: bootimgtool pack <output file> [<option>...]\n" \
     "\n" \
@@ -187,6 +267,10 @@ typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
     "  -t, --type <type>\n" \
     "                  Output type of the boot image (use header.txt if unspecified)\n" \
     "                  (one of: android, bump, loki, mtk, sonyelf)\n" \
+    "  -c, --ramdisk-compression <compression>\n" \
+    "                  Recompress the ramdisk before adding it to the boot\n" \
+    "                  image (one of: lz4-legacy, none). The kernel must\n" \
+    "                  support LZ4 ramdisks (CONFIG_RD_LZ4) for lz4-legacy.\n" \
     "  --input-<item> <item path>\n" \
     "                  Custom path for a particular item\n" \
     "\n" \
@@ -227,6 +311,97 @@ typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
     "        bootimgtool pack boot.img -i /tmp/android --input-kernel /tmp/newkernel\n" \
     "\n"
 
+#define HELP_INFO_USAGE \
+    "Usage: bootimgtool info [<option>...] [<input file>...]\n" \
+    "\n" \
+    "Options:\n" \
+    "  -m, --manifest <manifest file>\n" \
+    "                  File containing the list of boot images to inspect\n" \
+    "  -j, --jobs <count>\n" \
+    "                  Number of images to inspect in parallel\n" \
+    "                  (number of CPUs if unspecified)\n" \
+    "  -t, --type <type>\n" \
+    "                  Input type of the boot images (autodetect if unspecified)\n" \
+    "                  (one of: android, bump, loki, mtk, sonyelf)\n" \
+    "  -H, --hash      Compute the CRC32 checksum of each image\n" \
+    "\n" \
+    "The boot images are taken from the command line and from the manifest file,\n" \
+    "which has the same format as the one used by the unpack-batch command.\n" \
+    "\n" \
+    "Only the header and the list of images are read. The image data is skipped\n" \
+    "unless --hash is specified. The output is a JSON array with one object per\n" \
+    "boot image, in the same order as the inputs. The header fields use the same\n" \
+    "names and offset conventions as the header.txt file written by the unpack\n" \
+    "command. If a boot image cannot be read, its object contains an \"error\"\n" \
+    "field instead.\n" \
+    "\n" \
+    "Examples:\n" \
+    "\n" \
+    "1. Print the sizes and checksums of the images in all boot images in the\n" \
+    "   images directory\n" \
+    "\n" \
+    "        bootimgtool info --hash images/*.img\n" \
+    "\n"
+
+#define HELP_STORE_USAGE \
+    "Usage: bootimgtool store -s <store directory> [<option>...] [<input file>...]\n" \
+    "\n" \
+    "Options:\n" \
+    "  -s, --store <store directory>\n" \
+    "                  Directory containing the image store\n" \
+    "  -o, --output <output directory>\n" \
+    "                  Output directory for the manifests (current directory if\n" \
+    "                  unspecified)\n" \
+    "  -m, --manifest <manifest file>\n" \
+    "                  File containing the list of boot images to store\n" \
+    "  -j, --jobs <count>\n" \
+    "                  Number of images to store in parallel\n" \
+    "                  (number of CPUs if unspecified)\n" \
+    "  -t, --type <type>\n" \
+    "                  Input type of the boot images (autodetect if unspecified)\n" \
+    "                  (one of: android, bump, loki, mtk, sonyelf)\n" \
+    "\n" \
+    "Each image in a boot image is stored once in the store directory, under the\n" \
+    "path given by its SHA-256 digest:\n" \
+    "\n" \
+    "    <store directory>/objects/<first 2 digits>/<remaining 62 digits>\n" \
+    "\n" \
+    "Images that are already in the store, such as a kernel shared by several\n" \
+    "boot images, are not written again. For each boot image, a small manifest\n" \
+    "is written to <output directory>/<input file>.manifest. It has the same\n" \
+    "format as the header.txt file written by the unpack command, with an\n" \
+    "additional \"format=<type>\" line and an \"<image>=<digest>\" line for each\n" \
+    "image. The boot image can be rebuilt from the manifest with the restore\n" \
+    "command.\n" \
+    "\n" \
+    "The input files are taken from the command line and from the manifest file\n" \
+    "passed via --manifest, which has the same format as the one used by the\n" \
+    "unpack-batch command.\n" \
+    "\n" \
+    "Examples:\n" \
+    "\n" \
+    "1. Add all boot images in the images directory to the store in /srv/store\n" \
+    "\n" \
+    "        bootimgtool store -s /srv/store -o manifests images/*.img\n" \
+    "\n"
+
+#define HELP_RESTORE_USAGE \
+    "Usage: bootimgtool restore -s <store directory> <manifest> <output file>\n" \
+    "\n" \
+    "Options:\n" \
+    "  -s, --store <store directory>\n" \
+    "                  Directory containing the image store\n" \
+    "\n" \
+    "The boot image described by <manifest> (as written by the store command) is\n" \
+    "rebuilt from the images in the store and written to <output file>.\n" \
+    "\n" \
+    "Examples:\n" \
+    "\n" \
+    "1. Rebuild boot.img from a manifest\n" \
+    "\n" \
+    "        bootimgtool restore -s /srv/store manifests/boot.img.manifest boot.img\n" \
+    "\n"
+
 template <typename F>
 class Finally {
 public:
@@ -277,6 +452,7 @@ struct Paths
     std::string header;
     std::string kernel;
     std::string ramdisk;
+    std::string ramdisk_cpio;
     std::string second;
     std::string dt;
     std::string aboot;
@@ -296,6 +472,8 @@ static void prepend_if_empty(Paths &paths, const std::string &dir,
         paths.kernel = io::pathJoin({dir, prefix + IMAGE_KERNEL});
     if (paths.ramdisk.empty())
         paths.ramdisk = io::pathJoin({dir, prefix + IMAGE_RAMDISK});
+    if (paths.ramdisk_cpio.empty())
+        paths.ramdisk_cpio = io::pathJoin({dir, prefix + IMAGE_RAMDISK_CPIO});
     if (paths.second.empty())
         paths.second = io::pathJoin({dir, prefix + IMAGE_SECOND});
     if (paths.dt.empty())
@@ -421,7 +599,20 @@ static bool offset_to_absolute(uint32_t *base_ptr,
     return true;
 }
 
-static bool read_header(const std::string &path, MbBiHeader *header)
+/*!
+ * \brief Callback for handling keys that are not header fields
+ *
+ * \param key Key
+ * \param value Value
+ * \param[out] valid Set to false if \p value is invalid for \p key
+ *
+ * \return Whether the key is recognized
+ */
+typedef std::function<bool(const char *key, const char *value, bool &valid)>
+        ExtraKeyHandler;
+
+static bool read_header(const std::string &path, MbBiHeader *header,
+                        const ExtraKeyHandler &extra_key_handler = nullptr)
 {
     static const char *fmt_unknown_key =
             "Unknown key: '%s'\n";
@@ -540,7 +731,8 @@ static bool read_header(const std::string &path, MbBiHeader *header)
             if (valid) {
                 ret = mb_bi_header_set_page_size(header, page_size);
             }
-        } else {
+        } else if (!extra_key_handler
+                || !extra_key_handler(key, value, valid)) {
             fprintf(stderr, fmt_unknown_key, key);
             return false;
         }
@@ -607,7 +799,7 @@ static bool read_header(const std::string &path, MbBiHeader *header)
     return true;
 }
 
-static bool write_header(const std::string &path, MbBiHeader *header)
+static bool write_header_fields(FILE *fp, MbBiHeader *header)
 {
     // Try to use base relative to the default kernel offset
     uint32_t base;
@@ -639,48 +831,53 @@ static bool write_header(const std::string &path, MbBiHeader *header)
                        have_second_offset ? &second_offset : nullptr,
                        have_tags_offset ? &tags_offset : nullptr);
 
-    ScopedFILE fp(fopen(path.c_str(), "wb"), fclose);
-    if (!fp) {
-        fprintf(stderr, "%s: Failed to open for writing: %s\n",
-                path.c_str(), strerror(errno));
-        return false;
-    }
-
     const char *cmdline = mb_bi_header_kernel_cmdline(header);
     const char *board_name = mb_bi_header_board_name(header);
 
     bool failed =
             (cmdline && *cmdline && fprintf(
-                    fp.get(), "%s=%s\n", FIELD_CMDLINE, cmdline) < 0)
+                    fp, "%s=%s\n", FIELD_CMDLINE, cmdline) < 0)
             || (board_name && *board_name && fprintf(
-                    fp.get(), "%s=%s\n", FIELD_BOARD, board_name) < 0)
+                    fp, "%s=%s\n", FIELD_BOARD, board_name) < 0)
             || (fprintf(
-                    fp.get(), "%s=%08x\n", FIELD_BASE, base) < 0)
+                    fp, "%s=%08x\n", FIELD_BASE, base) < 0)
             || (have_kernel_offset && fprintf(
-                    fp.get(), "%s=%08x\n", FIELD_KERNEL_OFFSET, kernel_offset) < 0)
+                    fp, "%s=%08x\n", FIELD_KERNEL_OFFSET, kernel_offset) < 0)
             || (have_ramdisk_offset && fprintf(
-                    fp.get(), "%s=%08x\n", FIELD_RAMDISK_OFFSET, ramdisk_offset) < 0)
+                    fp, "%s=%08x\n", FIELD_RAMDISK_OFFSET, ramdisk_offset) < 0)
             || (have_second_offset && fprintf(
-                    fp.get(), "%s=%08x\n", FIELD_SECOND_OFFSET, second_offset) < 0)
+                    fp, "%s=%08x\n", FIELD_SECOND_OFFSET, second_offset) < 0)
             || (have_tags_offset && fprintf(
-                    fp.get(), "%s=%08x\n", FIELD_TAGS_OFFSET, tags_offset) < 0)
+                    fp, "%s=%08x\n", FIELD_TAGS_OFFSET, tags_offset) < 0)
             || (mb_bi_header_sony_ipl_address_is_set(header) && fprintf(
-                    fp.get(), "%s=%08x\n", FIELD_IPL_ADDRESS,
+                    fp, "%s=%08x\n", FIELD_IPL_ADDRESS,
                             mb_bi_header_sony_ipl_address(header)) < 0)
             || (mb_bi_header_sony_rpm_address_is_set(header) && fprintf(
-                    fp.get(), "%s=%08x\n", FIELD_RPM_ADDRESS,
+                    fp, "%s=%08x\n", FIELD_RPM_ADDRESS,
                             mb_bi_header_sony_rpm_address(header)) < 0)
             || (mb_bi_header_sony_appsbl_address_is_set(header) && fprintf(
-                    fp.get(), "%s=%08x\n", FIELD_APPSBL_ADDRESS,
+                    fp, "%s=%08x\n", FIELD_APPSBL_ADDRESS,
                             mb_bi_header_sony_appsbl_address(header)) < 0)
             || (mb_bi_header_entrypoint_address_is_set(header) && fprintf(
-                    fp.get(), "%s=%08x\n", FIELD_ENTRYPOINT,
+                    fp, "%s=%08x\n", FIELD_ENTRYPOINT,
                             mb_bi_header_entrypoint_address(header)) < 0)
             || (mb_bi_header_page_size_is_set(header) && fprintf(
-                    fp.get(), "%s=%u\n", FIELD_PAGE_SIZE,
+                    fp, "%s=%u\n", FIELD_PAGE_SIZE,
                             mb_bi_header_page_size(header)) < 0);
 
-    if (failed) {
+    return !failed;
+}
+
+static bool write_header(const std::string &path, MbBiHeader *header)
+{
+    ScopedFILE fp(fopen(path.c_str(), "wb"), fclose);
+    if (!fp) {
+        fprintf(stderr, "%s: Failed to open for writing: %s\n",
+                path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!write_header_fields(fp.get(), header)) {
         fprintf(stderr, "%s: Failed to write file: %s\n",
                 path.c_str(), strerror(errno));
         return false;
@@ -747,12 +944,12 @@ static bool write_data_entry_to_file(const std::string &path, MbBiReader *bir)
     }
 
     int ret;
-    char buf[10240];
+    const void *data;
     size_t n;
 
-    while ((ret = mb_bi_reader_read_data(bir, buf, sizeof(buf), &n))
+    while ((ret = mb_bi_reader_read_data_view(bir, &data, SIZE_MAX, &n))
             == MB_BI_OK) {
-        if (fwrite(buf, 1, n, fp.get()) != n) {
+        if (fwrite(data, 1, n, fp.get()) != n) {
             fprintf(stderr, "%s: Failed to write data: %s\n",
                     path.c_str(), strerror(errno));
             return false;
@@ -774,8 +971,301 @@ static bool write_data_entry_to_file(const std::string &path, MbBiReader *bir)
     return true;
 }
 
+struct RamdiskTeeCtx
+{
+    MbBiReader *bir;
+    FILE *fp;
+    const std::string *path;
+};
+
+static la_ssize_t ramdisk_tee_read_cb(archive *a, void *userdata,
+                                      const void **buffer)
+{
+    RamdiskTeeCtx *ctx = static_cast<RamdiskTeeCtx *>(userdata);
+    size_t n;
+
+    // libarchive only needs the buffer until the next read callback, which is
+    // as long as the reader's view remains valid
+    int ret = mb_bi_reader_read_data_view(ctx->bir, buffer, SIZE_MAX, &n);
+    if (ret == MB_BI_EOF) {
+        return 0;
+    } else if (ret != MB_BI_OK) {
+        archive_set_error(a, ARCHIVE_FAILED, "Failed to read entry data: %s",
+                          mb_bi_reader_error_string(ctx->bir));
+        return -1;
+    }
+
+    // Write the compressed data as it passes through
+    if (fwrite(*buffer, 1, n, ctx->fp) != n) {
+        archive_set_error(a, errno, "%s: Failed to write data: %s",
+                          ctx->path->c_str(), strerror(errno));
+        return -1;
+    }
+
+    return static_cast<la_ssize_t>(n);
+}
+
+/*!
+ * \brief Write ramdisk to a file and its decompressed contents to another
+ *
+ * Both files are written in a single pass over the entry data.
+ */
+static bool write_ramdisk_entry_to_files(const std::string &path,
+                                         const std::string &cpio_path,
+                                         MbBiReader *bir)
+{
+    ScopedFILE fp(fopen(path.c_str(), "wb"), fclose);
+    if (!fp) {
+        fprintf(stderr, "%s: Failed to open for writing: %s\n",
+                path.c_str(), strerror(errno));
+        return false;
+    }
+
+    ScopedFILE fp_cpio(fopen(cpio_path.c_str(), "wb"), fclose);
+    if (!fp_cpio) {
+        fprintf(stderr, "%s: Failed to open for writing: %s\n",
+                cpio_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    ScopedArchive a(archive_read_new(), archive_read_free);
+    if (!a) {
+        fprintf(stderr, "Failed to allocate archive reader\n");
+        return false;
+    }
+
+    archive_read_support_filter_gzip(a.get());
+    archive_read_support_filter_lz4(a.get());
+    archive_read_support_filter_lzma(a.get());
+    archive_read_support_filter_xz(a.get());
+    archive_read_support_format_raw(a.get());
+
+    RamdiskTeeCtx ctx;
+    ctx.bir = bir;
+    ctx.fp = fp.get();
+    ctx.path = &path;
+
+    archive_entry *entry;
+    char buf[10240];
+    la_ssize_t n;
+
+    if (archive_read_open(a.get(), &ctx, nullptr, &ramdisk_tee_read_cb,
+                          nullptr) != ARCHIVE_OK
+            || archive_read_next_header(a.get(), &entry) != ARCHIVE_OK) {
+        fprintf(stderr, "%s: Failed to open ramdisk: %s\n",
+                path.c_str(), archive_error_string(a.get()));
+        return false;
+    }
+
+    while ((n = archive_read_data(a.get(), buf, sizeof(buf))) > 0) {
+        if (fwrite(buf, 1, static_cast<size_t>(n), fp_cpio.get())
+                != static_cast<size_t>(n)) {
+            fprintf(stderr, "%s: Failed to write data: %s\n",
+                    cpio_path.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    if (n < 0) {
+        fprintf(stderr, "%s: Failed to decompress ramdisk: %s\n",
+                path.c_str(), archive_error_string(a.get()));
+        return false;
+    }
+
+    // The decompressor may stop before the end of the entry (eg. if there is
+    // padding after the compressed stream), so copy whatever is left
+    while (true) {
+        const void *data;
+        la_ssize_t remain = ramdisk_tee_read_cb(a.get(), &ctx, &data);
+        if (remain < 0) {
+            fprintf(stderr, "%s\n", archive_error_string(a.get()));
+            return false;
+        } else if (remain == 0) {
+            break;
+        }
+    }
+
+    if (fclose(fp.release()) < 0) {
+        fprintf(stderr, "%s: Failed to close file: %s\n",
+                path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (fclose(fp_cpio.release()) < 0) {
+        fprintf(stderr, "%s: Failed to close file: %s\n",
+                cpio_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+enum class RamdiskCompression
+{
+    Original,
+    Lz4Legacy,
+    None,
+};
+
+static bool read_file_to_buf(const std::string &path, FILE *fp,
+                             std::vector<unsigned char> &buf)
+{
+    unsigned char chunk[10240];
+    size_t n;
+
+    buf.clear();
+
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        buf.insert(buf.end(), chunk, chunk + n);
+    }
+
+    if (ferror(fp)) {
+        fprintf(stderr, "%s: Failed to read file: %s\n",
+                path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static bool decompress_ramdisk(const std::string &path,
+                               const std::vector<unsigned char> &in,
+                               std::vector<unsigned char> &out)
+{
+    ScopedArchive a(archive_read_new(), archive_read_free);
+    if (!a) {
+        fprintf(stderr, "Failed to allocate archive reader\n");
+        return false;
+    }
+
+    archive_read_support_filter_gzip(a.get());
+    archive_read_support_filter_lz4(a.get());
+    archive_read_support_filter_lzma(a.get());
+    archive_read_support_filter_xz(a.get());
+    archive_read_support_format_raw(a.get());
+
+    archive_entry *entry;
+    char buf[10240];
+    la_ssize_t n;
+
+    if (archive_read_open_memory(a.get(), const_cast<unsigned char *>(
+            in.data()), in.size()) != ARCHIVE_OK
+            || archive_read_next_header(a.get(), &entry) != ARCHIVE_OK) {
+        fprintf(stderr, "%s: Failed to open ramdisk: %s\n",
+                path.c_str(), archive_error_string(a.get()));
+        return false;
+    }
+
+    out.clear();
+
+    while ((n = archive_read_data(a.get(), buf, sizeof(buf))) > 0) {
+        out.insert(out.end(), buf, buf + n);
+    }
+
+    if (n < 0) {
+        fprintf(stderr, "%s: Failed to decompress ramdisk: %s\n",
+                path.c_str(), archive_error_string(a.get()));
+        return false;
+    }
+
+    return true;
+}
+
+static void write_le32(std::vector<unsigned char> &buf, size_t offset,
+                       uint32_t value)
+{
+    buf[offset] = value & 0xff;
+    buf[offset + 1] = (value >> 8) & 0xff;
+    buf[offset + 2] = (value >> 16) & 0xff;
+    buf[offset + 3] = (value >> 24) & 0xff;
+}
+
+/*!
+ * \brief Compress data with the LZ4 legacy format (same as `lz4 -l`)
+ */
+static bool compress_lz4_legacy(const std::vector<unsigned char> &in,
+                                std::vector<unsigned char> &out)
+{
+    out.resize(4);
+    write_le32(out, 0, LZ4_LEGACY_MAGIC);
+
+    for (size_t offset = 0; offset < in.size();
+            offset += LZ4_LEGACY_BLOCK_SIZE) {
+        int in_size = static_cast<int>(std::min<size_t>(
+                LZ4_LEGACY_BLOCK_SIZE, in.size() - offset));
+        int bound = LZ4_compressBound(in_size);
+        size_t header = out.size();
+
+        out.resize(header + 4 + bound);
+
+        int n = LZ4_compress_HC(
+                reinterpret_cast<const char *>(in.data() + offset),
+                reinterpret_cast<char *>(out.data() + header + 4),
+                in_size, bound, LZ4HC_CLEVEL_DEFAULT);
+        if (n <= 0) {
+            fprintf(stderr, "Failed to LZ4 compress ramdisk\n");
+            return false;
+        }
+
+        out.resize(header + 4 + n);
+        write_le32(out, header, static_cast<uint32_t>(n));
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Decompress a ramdisk file and write it to an entry with a different
+ *        compression
+ */
+static bool write_recompressed_ramdisk_to_entry(const std::string &path,
+                                                MbBiWriter *biw,
+                                                RamdiskCompression compression)
+{
+    ScopedFILE fp(fopen(path.c_str(), "rb"), fclose);
+    if (!fp) {
+        // Entries are optional
+        if (errno == ENOENT) {
+            return true;
+        } else {
+            fprintf(stderr, "%s: Failed to open for reading: %s\n",
+                    path.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    std::vector<unsigned char> data;
+    std::vector<unsigned char> cpio;
+
+    if (!read_file_to_buf(path, fp.get(), data)
+            || !decompress_ramdisk(path, data, cpio)) {
+        return false;
+    }
+
+    if (compression == RamdiskCompression::Lz4Legacy) {
+        if (!compress_lz4_legacy(cpio, data)) {
+            return false;
+        }
+    } else {
+        data.swap(cpio);
+    }
+
+    size_t bytes_written;
+
+    if (mb_bi_writer_write_data(biw, data.data(), data.size(), &bytes_written)
+            != MB_BI_OK || bytes_written != data.size()) {
+        fprintf(stderr, "Failed to write entry data: %s\n",
+                mb_bi_writer_error_string(biw));
+        return false;
+    }
+
+    return true;
+}
+
 static bool write_file_to_entry(const Paths &paths, MbBiWriter *biw,
-                                MbBiEntry *entry)
+                                MbBiEntry *entry,
+                                RamdiskCompression compression
+                                        = RamdiskCompression::Original)
 {
     std::string path;
 
@@ -826,11 +1316,16 @@ static bool write_file_to_entry(const Paths &paths, MbBiWriter *biw,
         return false;
     }
 
+    if (mb_bi_entry_type(entry) == MB_BI_ENTRY_RAMDISK
+            && compression != RamdiskCompression::Original) {
+        return write_recompressed_ramdisk_to_entry(path, biw, compression);
+    }
+
     return write_data_file_to_entry(path, biw);
 }
 
 static bool write_entry_to_file(const Paths &paths, MbBiReader *bir,
-                                MbBiEntry *entry)
+                                MbBiEntry *entry, bool decompress_ramdisk)
 {
     std::string path;
 
@@ -875,46 +1370,205 @@ static bool write_entry_to_file(const Paths &paths, MbBiReader *bir,
         return false;
     }
 
+    if (decompress_ramdisk && mb_bi_entry_type(entry) == MB_BI_ENTRY_RAMDISK) {
+        return write_ramdisk_entry_to_files(path, paths.ramdisk_cpio, bir);
+    }
+
     return write_data_entry_to_file(path, bir);
 }
 
-bool unpack_main(int argc, char *argv[])
+static bool enable_reader_formats(MbBiReader *bir, const char *type)
 {
-    int opt;
-    bool no_prefix = false;
-    std::string input_file;
-    std::string output_dir;
-    std::string prefix;
-    const char *type = nullptr;
-    Paths paths;
-
-    // Arguments with no short options
-    enum unpack_options : int
-    {
-        OPT_OUTPUT_HEADER         = 10000 + 1,
-        OPT_OUTPUT_KERNEL         = 10000 + 2,
-        OPT_OUTPUT_RAMDISK        = 10000 + 3,
-        OPT_OUTPUT_SECOND         = 10000 + 4,
-        OPT_OUTPUT_DT             = 10000 + 5,
-        OPT_OUTPUT_KERNEL_MTKHDR  = 10000 + 6,
-        OPT_OUTPUT_RAMDISK_MTKHDR = 10000 + 7,
-        OPT_OUTPUT_IPL            = 10000 + 8,
-        OPT_OUTPUT_RPM            = 10000 + 9,
-        OPT_OUTPUT_APPSBL         = 10000 + 10,
-    };
-
-    static const char short_options[] = "o:p:n" "h";
+    int ret;
 
-    static struct option long_options[] = {
+    if (type) {
+        ret = mb_bi_reader_enable_format_by_name(bir, type);
+        if (ret != MB_BI_OK) {
+            fprintf(stderr, "Failed to enable format '%s': %s\n",
+                    type, mb_bi_reader_error_string(bir));
+            return false;
+        }
+    } else {
+        ret = mb_bi_reader_enable_format_all(bir);
+        if (ret != MB_BI_OK) {
+            fprintf(stderr, "Failed to enable all formats: %s\n",
+                    mb_bi_reader_error_string(bir));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Extract entries concurrently, with one reader per worker
+ *
+ * Each worker opens the image with its own reader (and thus its own file
+ * handle) and seeks directly to the entries that it picks up, so no state is
+ * shared between the workers.
+ */
+static bool unpack_entries_parallel(const std::string &input_file,
+                                    const char *format_name,
+                                    const std::vector<int> &types,
+                                    const Paths &paths, unsigned int jobs,
+                                    bool decompress_ramdisk)
+{
+    std::atomic<size_t> next_index(0);
+    std::atomic<size_t> failed(0);
+
+    auto worker = [&]{
+        ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+        MbBiHeader *header;
+        MbBiEntry *entry;
+        int ret;
+
+        if (!bir) {
+            fprintf(stderr, "Failed to allocate reader: %s\n",
+                    strerror(errno));
+        } else if (mb_bi_reader_set_format_by_name(bir.get(), format_name)
+                != MB_BI_OK) {
+            fprintf(stderr, "Failed to set format '%s': %s\n",
+                    format_name, mb_bi_reader_error_string(bir.get()));
+            bir.reset();
+        } else if (mb_bi_reader_open_filename(bir.get(), input_file.c_str())
+                != MB_BI_OK
+                || mb_bi_reader_read_header(bir.get(), &header) != MB_BI_OK) {
+            fprintf(stderr, "%s: Failed to open for reading: %s\n",
+                    input_file.c_str(), mb_bi_reader_error_string(bir.get()));
+            bir.reset();
+        }
+
+        size_t i;
+        while ((i = next_index++) < types.size()) {
+            if (!bir) {
+                ++failed;
+                continue;
+            }
+
+            ret = mb_bi_reader_go_to_entry(bir.get(), &entry, types[i]);
+            if (ret != MB_BI_OK) {
+                fprintf(stderr, "%s: Failed to go to entry: %s\n",
+                        input_file.c_str(),
+                        mb_bi_reader_error_string(bir.get()));
+                ++failed;
+            } else if (!write_entry_to_file(paths, bir.get(), entry,
+                                            decompress_ramdisk)) {
+                ++failed;
+            }
+        }
+    };
+
+    mb::run_concurrently(jobs, worker);
+
+    return failed == 0;
+}
+
+static bool unpack_image(MbBiReader *bir, const std::string &input_file,
+                         const Paths &paths, unsigned int jobs,
+                         bool decompress_ramdisk)
+{
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+
+    ret = mb_bi_reader_open_filename(bir, input_file.c_str());
+    if (ret != MB_BI_OK) {
+        fprintf(stderr, "%s: Failed to open for reading: %s\n",
+                input_file.c_str(), mb_bi_reader_error_string(bir));
+        return false;
+    }
+
+    ret = mb_bi_reader_read_header(bir, &header);
+    if (ret != MB_BI_OK) {
+        fprintf(stderr, "%s: Failed to read header: %s\n",
+                input_file.c_str(), mb_bi_reader_error_string(bir));
+        return false;
+    }
+
+    if (!write_header(paths.header, header)) {
+        return false;
+    }
+
+    std::vector<int> types;
+
+    while ((ret = mb_bi_reader_read_entry(bir, &entry)) == MB_BI_OK) {
+        if (jobs > 1 && mb_bi_entry_type_is_set(entry)) {
+            // Only list the entries. They are extracted below.
+            types.push_back(mb_bi_entry_type(entry));
+        } else if (!write_entry_to_file(paths, bir, entry,
+                                        decompress_ramdisk)) {
+            return false;
+        }
+    }
+
+    if (ret != MB_BI_EOF) {
+        fprintf(stderr, "%s: Failed to read entry: %s\n",
+                input_file.c_str(), mb_bi_reader_error_string(bir));
+        return false;
+    }
+
+    if (types.size() > 1) {
+        return unpack_entries_parallel(
+                input_file, mb_bi_reader_format_name(bir), types, paths,
+                std::min<unsigned int>(jobs, types.size()),
+                decompress_ramdisk);
+    } else if (!types.empty()) {
+        // Not worth spawning a thread for a single entry
+        ret = mb_bi_reader_go_to_entry(bir, &entry, types[0]);
+        if (ret != MB_BI_OK) {
+            fprintf(stderr, "%s: Failed to go to entry: %s\n",
+                    input_file.c_str(), mb_bi_reader_error_string(bir));
+            return false;
+        }
+        return write_entry_to_file(paths, bir, entry, decompress_ramdisk);
+    }
+
+    return true;
+}
+
+bool unpack_main(int argc, char *argv[])
+{
+    int opt;
+    bool no_prefix = false;
+    std::string input_file;
+    std::string output_dir;
+    std::string prefix;
+    const char *type = nullptr;
+    unsigned int jobs = 0;
+    bool decompress_ramdisk = false;
+    Paths paths;
+
+    // Arguments with no short options
+    enum unpack_options : int
+    {
+        OPT_OUTPUT_HEADER         = 10000 + 1,
+        OPT_OUTPUT_KERNEL         = 10000 + 2,
+        OPT_OUTPUT_RAMDISK        = 10000 + 3,
+        OPT_OUTPUT_SECOND         = 10000 + 4,
+        OPT_OUTPUT_DT             = 10000 + 5,
+        OPT_OUTPUT_KERNEL_MTKHDR  = 10000 + 6,
+        OPT_OUTPUT_RAMDISK_MTKHDR = 10000 + 7,
+        OPT_OUTPUT_IPL            = 10000 + 8,
+        OPT_OUTPUT_RPM            = 10000 + 9,
+        OPT_OUTPUT_APPSBL         = 10000 + 10,
+        OPT_OUTPUT_RAMDISK_CPIO   = 10000 + 11,
+    };
+
+    static const char short_options[] = "o:p:nt:j:d" "h";
+
+    static struct option long_options[] = {
         // Arguments with short versions
         {"output",                required_argument, 0, 'o'},
         {"prefix",                required_argument, 0, 'p'},
         {"noprefix",              required_argument, 0, 'n'},
         {"type",                  required_argument, 0, 't'},
+        {"jobs",                  required_argument, 0, 'j'},
+        {"decompress-ramdisk",    no_argument,       0, 'd'},
         // Arguments without short versions
         {"output-header",         required_argument, 0, OPT_OUTPUT_HEADER},
         {"output-kernel",         required_argument, 0, OPT_OUTPUT_KERNEL},
         {"output-ramdisk",        required_argument, 0, OPT_OUTPUT_RAMDISK},
+        {"output-ramdisk_cpio",   required_argument, 0, OPT_OUTPUT_RAMDISK_CPIO},
         {"output-second",         required_argument, 0, OPT_OUTPUT_SECOND},
         {"output-dt",             required_argument, 0, OPT_OUTPUT_DT},
         {"output-kernel_mtkhdr",  required_argument, 0, OPT_OUTPUT_KERNEL_MTKHDR},
@@ -932,112 +1586,1203 @@ bool unpack_main(int argc, char *argv[])
     while ((opt = getopt_long(argc, argv, short_options,
                               long_options, &long_index)) != -1) {
         switch (opt) {
-        case 'o':                       output_dir = optarg;           break;
-        case 'p':                       prefix = optarg;               break;
-        case 'n':                       no_prefix = true;              break;
-        case 't':                       type = optarg;                 break;
-        case OPT_OUTPUT_HEADER:         paths.header = optarg;         break;
-        case OPT_OUTPUT_KERNEL:         paths.kernel = optarg;         break;
-        case OPT_OUTPUT_RAMDISK:        paths.ramdisk = optarg;        break;
-        case OPT_OUTPUT_SECOND:         paths.second = optarg;         break;
-        case OPT_OUTPUT_DT:             paths.dt = optarg;             break;
-        case OPT_OUTPUT_KERNEL_MTKHDR:  paths.kernel_mtkhdr = optarg;  break;
-        case OPT_OUTPUT_RAMDISK_MTKHDR: paths.ramdisk_mtkhdr = optarg; break;
-        case OPT_OUTPUT_IPL:            paths.ipl = optarg;            break;
-        case OPT_OUTPUT_RPM:            paths.rpm = optarg;            break;
-        case OPT_OUTPUT_APPSBL:         paths.appsbl = optarg;         break;
+        case 'o':                       output_dir = optarg;           break;
+        case 'p':                       prefix = optarg;               break;
+        case 'n':                       no_prefix = true;              break;
+        case 't':                       type = optarg;                 break;
+        case 'd':                       decompress_ramdisk = true;     break;
+        case OPT_OUTPUT_HEADER:         paths.header = optarg;         break;
+        case OPT_OUTPUT_KERNEL:         paths.kernel = optarg;         break;
+        case OPT_OUTPUT_RAMDISK:        paths.ramdisk = optarg;        break;
+        case OPT_OUTPUT_RAMDISK_CPIO:   paths.ramdisk_cpio = optarg;   break;
+        case OPT_OUTPUT_SECOND:         paths.second = optarg;         break;
+        case OPT_OUTPUT_DT:             paths.dt = optarg;             break;
+        case OPT_OUTPUT_KERNEL_MTKHDR:  paths.kernel_mtkhdr = optarg;  break;
+        case OPT_OUTPUT_RAMDISK_MTKHDR: paths.ramdisk_mtkhdr = optarg; break;
+        case OPT_OUTPUT_IPL:            paths.ipl = optarg;            break;
+        case OPT_OUTPUT_RPM:            paths.rpm = optarg;            break;
+        case OPT_OUTPUT_APPSBL:         paths.appsbl = optarg;         break;
+
+        case 'j':
+            if (!str_to_unum(optarg, 10, &jobs) || jobs == 0) {
+                fprintf(stderr, "Invalid job count: '%s'\n", optarg);
+                return false;
+            }
+            break;
+
+        case 'h':
+            fputs(HELP_UNPACK_USAGE, stdout);
+            return true;
+
+        default:
+            fputs(HELP_UNPACK_USAGE, stderr);
+            return false;
+        }
+    }
+
+    // There should be one other arguments
+    if (argc - optind != 1) {
+        fputs(HELP_UNPACK_USAGE, stderr);
+        return false;
+    }
+
+    input_file = argv[optind];
+
+    if (no_prefix) {
+        prefix.clear();
+    } else if (prefix.empty()) {
+        prefix = io::baseName(input_file);
+        prefix += "-";
+    }
+
+    if (output_dir.empty()) {
+        output_dir = ".";
+    }
+
+    prepend_if_empty(paths, output_dir, prefix);
+
+    if (!io::createDirectories(output_dir)) {
+        fprintf(stderr, "%s: Failed to create directory: %s\n",
+                output_dir.c_str(), io::lastErrorString().c_str());
+        return false;
+    }
+
+    // Load the boot image
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+
+    if (!bir) {
+        fprintf(stderr, "Failed to allocate reader: %s\n", strerror(errno));
+        return false;
+    }
+
+    if (!enable_reader_formats(bir.get(), type)) {
+        return false;
+    }
+
+    if (jobs == 0) {
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    return unpack_image(bir.get(), input_file, paths, jobs,
+                        decompress_ramdisk);
+}
+
+static bool read_manifest(const std::string &path,
+                          std::vector<std::string> &inputs)
+{
+    ScopedFILE fp(fopen(path.c_str(), "rb"), fclose);
+    if (!fp) {
+        fprintf(stderr, "%s: Failed to open for reading: %s\n",
+                path.c_str(), strerror(errno));
+        return false;
+    }
+
+    char *line = nullptr;
+    size_t len = 0;
+    ssize_t read;
+
+    auto free_line = finally([&]{
+        free(line);
+    });
+
+    while ((read = mb_getline(&line, &len, fp.get())) >= 0) {
+        char *ptr = line;
+
+        // Strip newline
+        while (read > 0 && (line[read - 1] == '\n' || line[read - 1] == '\r')) {
+            line[read - 1] = '\0';
+            --read;
+        }
+
+        // Skip leading whitespace
+        while (*ptr && isspace(*ptr)) {
+            ++ptr;
+        }
+
+        // Skip empty and commented lines
+        if (*ptr == '\0' || *ptr == '#') {
+            continue;
+        }
+
+        inputs.emplace_back(ptr);
+    }
+
+    if (ferror(fp.get())) {
+        fprintf(stderr, "%s: Failed to read file: %s\n",
+                path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+bool unpack_batch_main(int argc, char *argv[])
+{
+    int opt;
+    std::string output_dir;
+    std::string manifest;
+    unsigned int jobs = 0;
+    const char *type = nullptr;
+    std::vector<std::string> inputs;
+
+    static const char short_options[] = "o:m:j:t:" "h";
+
+    static struct option long_options[] = {
+        {"output",   required_argument, 0, 'o'},
+        {"manifest", required_argument, 0, 'm'},
+        {"jobs",     required_argument, 0, 'j'},
+        {"type",     required_argument, 0, 't'},
+        // Misc
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'o': output_dir = optarg; break;
+        case 'm': manifest = optarg;   break;
+        case 't': type = optarg;       break;
+
+        case 'j':
+            if (!str_to_unum(optarg, 10, &jobs) || jobs == 0) {
+                fprintf(stderr, "Invalid job count: '%s'\n", optarg);
+                return false;
+            }
+            break;
+
+        case 'h':
+            fputs(HELP_UNPACK_BATCH_USAGE, stdout);
+            return true;
+
+        default:
+            fputs(HELP_UNPACK_BATCH_USAGE, stderr);
+            return false;
+        }
+    }
+
+    for (int i = optind; i < argc; ++i) {
+        inputs.emplace_back(argv[i]);
+    }
+
+    if (!manifest.empty() && !read_manifest(manifest, inputs)) {
+        return false;
+    }
+
+    if (inputs.empty()) {
+        fputs(HELP_UNPACK_BATCH_USAGE, stderr);
+        return false;
+    }
+
+    if (output_dir.empty()) {
+        output_dir = ".";
+    }
+
+    // Compute the output paths up front so that conflicts are detected before
+    // anything is written
+    std::vector<Paths> paths(inputs.size());
+    std::unordered_map<std::string, size_t> prefixes;
+
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        std::string prefix = io::baseName(inputs[i]);
+        prefix += "-";
+
+        auto it = prefixes.find(prefix);
+        if (it != prefixes.end()) {
+            fprintf(stderr, "%s: Output paths conflict with %s\n",
+                    inputs[i].c_str(), inputs[it->second].c_str());
+            return false;
+        }
+        prefixes.emplace(prefix, i);
+
+        prepend_if_empty(paths[i], output_dir, prefix);
+    }
+
+    if (!io::createDirectories(output_dir)) {
+        fprintf(stderr, "%s: Failed to create directory: %s\n",
+                output_dir.c_str(), io::lastErrorString().c_str());
+        return false;
+    }
+
+    if (jobs == 0) {
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (jobs > inputs.size()) {
+        jobs = static_cast<unsigned int>(inputs.size());
+    }
+
+    std::atomic<size_t> next_index(0);
+    std::atomic<size_t> failed(0);
+
+    // Each worker owns a reader that is reset and reused for every image that
+    // it picks up
+    auto worker = [&]{
+        ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+
+        if (!bir) {
+            fprintf(stderr, "Failed to allocate reader: %s\n",
+                    strerror(errno));
+        } else if (!enable_reader_formats(bir.get(), type)) {
+            bir.reset();
+        }
+
+        size_t i;
+        while ((i = next_index++) < inputs.size()) {
+            if (!bir) {
+                ++failed;
+                continue;
+            }
+
+            // Images are already unpacked in parallel, so extract their
+            // entries sequentially
+            if (!unpack_image(bir.get(), inputs[i], paths[i], 1, false)) {
+                ++failed;
+            }
+
+            if (mb_bi_reader_reset(bir.get()) <= MB_BI_FATAL) {
+                fprintf(stderr, "Failed to reset reader: %s\n",
+                        mb_bi_reader_error_string(bir.get()));
+                bir.reset();
+            }
+        }
+    };
+
+    mb::run_concurrently(jobs, worker);
+
+    if (failed > 0) {
+        fprintf(stderr, "Failed to unpack %zu of %zu boot images\n",
+                failed.load(), inputs.size());
+        return false;
+    }
+
+    return true;
+}
+
+static const char * entry_type_to_name(int type)
+{
+    switch (type) {
+    case MB_BI_ENTRY_KERNEL:
+        return IMAGE_KERNEL;
+    case MB_BI_ENTRY_RAMDISK:
+        return IMAGE_RAMDISK;
+    case MB_BI_ENTRY_SECONDBOOT:
+        return IMAGE_SECOND;
+    case MB_BI_ENTRY_DEVICE_TREE:
+        return IMAGE_DT;
+    case MB_BI_ENTRY_ABOOT:
+        return IMAGE_ABOOT;
+    case MB_BI_ENTRY_MTK_KERNEL_HEADER:
+        return IMAGE_KERNEL_MTKHDR;
+    case MB_BI_ENTRY_MTK_RAMDISK_HEADER:
+        return IMAGE_RAMDISK_MTKHDR;
+    case MB_BI_ENTRY_SONY_IPL:
+        return IMAGE_IPL;
+    case MB_BI_ENTRY_SONY_RPM:
+        return IMAGE_RPM;
+    case MB_BI_ENTRY_SONY_APPSBL:
+        return IMAGE_APPSBL;
+    default:
+        return nullptr;
+    }
+}
+
+static void json_append_string(std::string &out, const char *str)
+{
+    out += '"';
+
+    for (const char *ptr = str; *ptr; ++ptr) {
+        unsigned char c = static_cast<unsigned char>(*ptr);
+
+        switch (c) {
+        case '"':  out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\b': out += "\\b";  break;
+        case '\f': out += "\\f";  break;
+        case '\n': out += "\\n";  break;
+        case '\r': out += "\\r";  break;
+        case '\t': out += "\\t";  break;
+        default:
+            if (c < 0x20) {
+                mb::append_format(out, "\\u%04x", c);
+            } else {
+                out += static_cast<char>(c);
+            }
+            break;
+        }
+    }
+
+    out += '"';
+}
+
+static void json_append_key(std::string &out, bool &first, const char *key)
+{
+    if (!first) {
+        out += ", ";
+    }
+    first = false;
+
+    json_append_string(out, key);
+    out += ": ";
+}
+
+static void header_to_json(std::string &out, MbBiHeader *header)
+{
+    uint32_t base;
+    uint32_t kernel_offset;
+    uint32_t ramdisk_offset;
+    uint32_t second_offset;
+    uint32_t tags_offset;
+    bool have_kernel_offset = mb_bi_header_kernel_address_is_set(header);
+    bool have_ramdisk_offset = mb_bi_header_ramdisk_address_is_set(header);
+    bool have_second_offset = mb_bi_header_secondboot_address_is_set(header);
+    bool have_tags_offset = mb_bi_header_kernel_tags_address_is_set(header);
+
+    if (have_kernel_offset) {
+        kernel_offset = mb_bi_header_kernel_address(header);
+    }
+    if (have_ramdisk_offset) {
+        ramdisk_offset = mb_bi_header_ramdisk_address(header);
+    }
+    if (have_second_offset) {
+        second_offset = mb_bi_header_secondboot_address(header);
+    }
+    if (have_tags_offset) {
+        tags_offset = mb_bi_header_kernel_tags_address(header);
+    }
+
+    absolute_to_offset(&base,
+                       have_kernel_offset ? &kernel_offset : nullptr,
+                       have_ramdisk_offset ? &ramdisk_offset : nullptr,
+                       have_second_offset ? &second_offset : nullptr,
+                       have_tags_offset ? &tags_offset : nullptr);
+
+    const char *cmdline = mb_bi_header_kernel_cmdline(header);
+    const char *board_name = mb_bi_header_board_name(header);
+    bool first = true;
+
+    auto append_uint = [&](const char *key, uint32_t value) {
+        json_append_key(out, first, key);
+        mb::append_format(out, "%" PRIu32, value);
+    };
+
+    out += '{';
+
+    if (cmdline) {
+        json_append_key(out, first, FIELD_CMDLINE);
+        json_append_string(out, cmdline);
+    }
+    if (board_name) {
+        json_append_key(out, first, FIELD_BOARD);
+        json_append_string(out, board_name);
+    }
+    append_uint(FIELD_BASE, base);
+    if (have_kernel_offset) {
+        append_uint(FIELD_KERNEL_OFFSET, kernel_offset);
+    }
+    if (have_ramdisk_offset) {
+        append_uint(FIELD_RAMDISK_OFFSET, ramdisk_offset);
+    }
+    if (have_second_offset) {
+        append_uint(FIELD_SECOND_OFFSET, second_offset);
+    }
+    if (have_tags_offset) {
+        append_uint(FIELD_TAGS_OFFSET, tags_offset);
+    }
+    if (mb_bi_header_sony_ipl_address_is_set(header)) {
+        append_uint(FIELD_IPL_ADDRESS, mb_bi_header_sony_ipl_address(header));
+    }
+    if (mb_bi_header_sony_rpm_address_is_set(header)) {
+        append_uint(FIELD_RPM_ADDRESS, mb_bi_header_sony_rpm_address(header));
+    }
+    if (mb_bi_header_sony_appsbl_address_is_set(header)) {
+        append_uint(FIELD_APPSBL_ADDRESS,
+                    mb_bi_header_sony_appsbl_address(header));
+    }
+    if (mb_bi_header_entrypoint_address_is_set(header)) {
+        append_uint(FIELD_ENTRYPOINT, mb_bi_header_entrypoint_address(header));
+    }
+    if (mb_bi_header_page_size_is_set(header)) {
+        append_uint(FIELD_PAGE_SIZE, mb_bi_header_page_size(header));
+    }
+
+    out += '}';
+}
+
+static bool hash_entry_data(MbBiReader *bir, uint32_t *crc_out)
+{
+    const void *data;
+    size_t n;
+    int ret;
+    uLong crc = crc32(0L, Z_NULL, 0);
+
+    // Limit the view size so that it fits in zlib's uInt
+    while ((ret = mb_bi_reader_read_data_view(bir, &data, UINT_MAX, &n))
+            == MB_BI_OK) {
+        crc = crc32(crc, static_cast<const Bytef *>(data),
+                    static_cast<uInt>(n));
+    }
+
+    if (ret != MB_BI_EOF) {
+        return false;
+    }
+
+    *crc_out = static_cast<uint32_t>(crc);
+    return true;
+}
+
+/*!
+ * \brief Describe a boot image as a JSON object
+ *
+ * The entry data is not read unless \p hash is true. Readers skip over the
+ * data of entries that have not been read when moving to the next entry.
+ *
+ * \return Whether the boot image was successfully read. If false, \p out
+ *         contains an object with an "error" field.
+ */
+static bool info_image(MbBiReader *bir, const std::string &input_file,
+                       bool hash, std::string &out)
+{
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+    bool first = true;
+
+    out = '{';
+    json_append_key(out, first, "file");
+    json_append_string(out, input_file.c_str());
+
+    auto fail = [&](const char *what) {
+        fprintf(stderr, "%s: %s: %s\n", input_file.c_str(), what,
+                mb_bi_reader_error_string(bir));
+
+        json_append_key(out, first, "error");
+        json_append_string(out, mb::format(
+                "%s: %s", what, mb_bi_reader_error_string(bir)).c_str());
+        out += '}';
+        return false;
+    };
+
+    ret = mb_bi_reader_open_filename(bir, input_file.c_str());
+    if (ret != MB_BI_OK) {
+        return fail("Failed to open for reading");
+    }
+
+    ret = mb_bi_reader_read_header(bir, &header);
+    if (ret != MB_BI_OK) {
+        return fail("Failed to read header");
+    }
+
+    json_append_key(out, first, "format");
+    json_append_string(out, mb_bi_reader_format_name(bir));
+    json_append_key(out, first, "header");
+    header_to_json(out, header);
+
+    std::string entries;
+
+    while ((ret = mb_bi_reader_read_entry(bir, &entry)) == MB_BI_OK) {
+        const char *name = entry_type_to_name(mb_bi_entry_type(entry));
+        bool entry_first = true;
+
+        entries += entries.empty() ? "{" : ", {";
+        json_append_key(entries, entry_first, "type");
+        if (name) {
+            json_append_string(entries, name);
+        } else {
+            mb::append_format(entries, "%d", mb_bi_entry_type(entry));
+        }
+
+        if (mb_bi_entry_size_is_set(entry)) {
+            json_append_key(entries, entry_first, "size");
+            mb::append_format(entries, "%" PRIu64, mb_bi_entry_size(entry));
+        }
+
+        if (hash) {
+            uint32_t crc;
+
+            if (!hash_entry_data(bir, &crc)) {
+                return fail("Failed to read entry data");
+            }
+
+            json_append_key(entries, entry_first, "crc32");
+            mb::append_format(entries, "\"%08" PRIx32 "\"", crc);
+        }
+
+        entries += '}';
+    }
+
+    if (ret != MB_BI_EOF) {
+        return fail("Failed to read entry");
+    }
+
+    json_append_key(out, first, "entries");
+    out += '[';
+    out += entries;
+    out += "]}";
+
+    return true;
+}
+
+bool info_main(int argc, char *argv[])
+{
+    int opt;
+    std::string manifest;
+    unsigned int jobs = 0;
+    const char *type = nullptr;
+    bool hash = false;
+    std::vector<std::string> inputs;
+
+    static const char short_options[] = "m:j:t:H" "h";
+
+    static struct option long_options[] = {
+        {"manifest", required_argument, 0, 'm'},
+        {"jobs",     required_argument, 0, 'j'},
+        {"type",     required_argument, 0, 't'},
+        {"hash",     no_argument,       0, 'H'},
+        // Misc
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'm': manifest = optarg; break;
+        case 't': type = optarg;     break;
+        case 'H': hash = true;       break;
+
+        case 'j':
+            if (!str_to_unum(optarg, 10, &jobs) || jobs == 0) {
+                fprintf(stderr, "Invalid job count: '%s'\n", optarg);
+                return false;
+            }
+            break;
+
+        case 'h':
+            fputs(HELP_INFO_USAGE, stdout);
+            return true;
+
+        default:
+            fputs(HELP_INFO_USAGE, stderr);
+            return false;
+        }
+    }
+
+    for (int i = optind; i < argc; ++i) {
+        inputs.emplace_back(argv[i]);
+    }
+
+    if (!manifest.empty() && !read_manifest(manifest, inputs)) {
+        return false;
+    }
+
+    if (inputs.empty()) {
+        fputs(HELP_INFO_USAGE, stderr);
+        return false;
+    }
+
+    if (jobs == 0) {
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (jobs > inputs.size()) {
+        jobs = static_cast<unsigned int>(inputs.size());
+    }
+
+    std::vector<std::string> results(inputs.size());
+    std::atomic<size_t> next_index(0);
+    std::atomic<size_t> failed(0);
+
+    auto worker = [&]{
+        ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+
+        if (!bir) {
+            fprintf(stderr, "Failed to allocate reader: %s\n",
+                    strerror(errno));
+        } else if (!enable_reader_formats(bir.get(), type)) {
+            bir.reset();
+        }
+
+        size_t i;
+        while ((i = next_index++) < inputs.size()) {
+            if (!bir) {
+                ++failed;
+                continue;
+            }
+
+            if (!info_image(bir.get(), inputs[i], hash, results[i])) {
+                ++failed;
+            }
+
+            if (mb_bi_reader_reset(bir.get()) <= MB_BI_FATAL) {
+                fprintf(stderr, "Failed to reset reader: %s\n",
+                        mb_bi_reader_error_string(bir.get()));
+                bir.reset();
+            }
+        }
+    };
+
+    mb::run_concurrently(jobs, worker);
+
+    fputs("[\n", stdout);
+    for (size_t i = 0; i < results.size(); ++i) {
+        if (results[i].empty()) {
+            // The worker could not set up its reader
+            results[i] = "{\"file\": ";
+            json_append_string(results[i], inputs[i].c_str());
+            results[i] += ", \"error\": \"Failed to initialize reader\"}";
+        }
+
+        fprintf(stdout, "  %s%s\n", results[i].c_str(),
+                i + 1 < results.size() ? "," : "");
+    }
+    fputs("]\n", stdout);
+
+    if (failed > 0) {
+        fprintf(stderr, "Failed to read %zu of %zu boot images\n",
+                failed.load(), inputs.size());
+        return false;
+    }
+
+    return true;
+}
+
+static std::string * image_path(Paths &paths, const char *name)
+{
+    if (strcmp(name, IMAGE_KERNEL) == 0) {
+        return &paths.kernel;
+    } else if (strcmp(name, IMAGE_RAMDISK) == 0) {
+        return &paths.ramdisk;
+    } else if (strcmp(name, IMAGE_SECOND) == 0) {
+        return &paths.second;
+    } else if (strcmp(name, IMAGE_DT) == 0) {
+        return &paths.dt;
+    } else if (strcmp(name, IMAGE_ABOOT) == 0) {
+        return &paths.aboot;
+    } else if (strcmp(name, IMAGE_KERNEL_MTKHDR) == 0) {
+        return &paths.kernel_mtkhdr;
+    } else if (strcmp(name, IMAGE_RAMDISK_MTKHDR) == 0) {
+        return &paths.ramdisk_mtkhdr;
+    } else if (strcmp(name, IMAGE_IPL) == 0) {
+        return &paths.ipl;
+    } else if (strcmp(name, IMAGE_RPM) == 0) {
+        return &paths.rpm;
+    } else if (strcmp(name, IMAGE_APPSBL) == 0) {
+        return &paths.appsbl;
+    } else {
+        return nullptr;
+    }
+}
+
+static bool is_digest(const char *str)
+{
+    size_t i = 0;
+
+    for (; str[i]; ++i) {
+        if (!isxdigit(static_cast<unsigned char>(str[i]))
+                || isupper(static_cast<unsigned char>(str[i]))) {
+            return false;
+        }
+    }
+
+    // Hex-encoded SHA-256 digest
+    return i == 2 * 32;
+}
+
+static std::string store_object_path(const std::string &store_dir,
+                                     const std::string &digest)
+{
+    return io::pathJoin({store_dir, "objects", digest.substr(0, 2),
+                         digest.substr(2)});
+}
+
+/*!
+ * \brief Add the data of the current entry to the store
+ *
+ * The data is written to a temporary file while its SHA-256 digest is
+ * computed. The temporary file is then moved to the object path or discarded
+ * if the object already exists.
+ */
+static bool store_entry_data(const std::string &store_dir, MbBiReader *bir,
+                             std::string &digest_out)
+{
+    static std::atomic<unsigned int> counter(0);
+
+    std::string temp_path = io::pathJoin({store_dir, "objects", mb::format(
+            ".tmp-%zx-%u",
+            std::hash<std::thread::id>()(std::this_thread::get_id()),
+            counter++)});
+
+    // Runs after the file is closed below
+    auto remove_temp = finally([&]{
+        if (!temp_path.empty()) {
+            remove(temp_path.c_str());
+        }
+    });
+
+    ScopedFILE fp(fopen(temp_path.c_str(), "wb"), fclose);
+    if (!fp) {
+        fprintf(stderr, "%s: Failed to open for writing: %s\n",
+                temp_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::unique_ptr<EVP_MD_CTX, decltype(EVP_MD_CTX_free) *> ctx(
+            EVP_MD_CTX_new(), EVP_MD_CTX_free);
+    if (!ctx || !EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr)) {
+        fprintf(stderr, "Failed to initialize SHA-256 context\n");
+        return false;
+    }
+
+    const void *data;
+    size_t n;
+    int ret;
+
+    while ((ret = mb_bi_reader_read_data_view(bir, &data, SIZE_MAX, &n))
+            == MB_BI_OK) {
+        if (!EVP_DigestUpdate(ctx.get(), data, n)) {
+            fprintf(stderr, "Failed to update SHA-256 digest\n");
+            return false;
+        }
+
+        if (fwrite(data, 1, n, fp.get()) != n) {
+            fprintf(stderr, "%s: Failed to write data: %s\n",
+                    temp_path.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    if (ret != MB_BI_EOF) {
+        fprintf(stderr, "Failed to read entry data: %s\n",
+                mb_bi_reader_error_string(bir));
+        return false;
+    }
+
+    if (fclose(fp.release()) < 0) {
+        fprintf(stderr, "%s: Failed to close file: %s\n",
+                temp_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_size;
+
+    if (!EVP_DigestFinal_ex(ctx.get(), digest, &digest_size)) {
+        fprintf(stderr, "Failed to finalize SHA-256 digest\n");
+        return false;
+    }
+
+    digest_out.clear();
+    for (unsigned int i = 0; i < digest_size; ++i) {
+        mb::append_format(digest_out, "%02x", digest[i]);
+    }
+
+    std::string object_path = store_object_path(store_dir, digest_out);
+    std::string object_dir = io::dirName(object_path);
+
+    if (!io::createDirectories(object_dir)) {
+        fprintf(stderr, "%s: Failed to create directory: %s\n",
+                object_dir.c_str(), io::lastErrorString().c_str());
+        return false;
+    }
+
+    // If another worker or process stored the same object in the meantime,
+    // the rename may fail (on Windows) or replace the object with the same
+    // contents. Either way, the object exists afterwards.
+    ScopedFILE existing(fopen(object_path.c_str(), "rb"), fclose);
+    if (!existing) {
+        if (rename(temp_path.c_str(), object_path.c_str()) == 0) {
+            temp_path.clear();
+        } else if (!(existing = ScopedFILE(
+                fopen(object_path.c_str(), "rb"), fclose))) {
+            fprintf(stderr, "%s: Failed to move to %s: %s\n",
+                    temp_path.c_str(), object_path.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool store_image(MbBiReader *bir, const std::string &input_file,
+                        const std::string &store_dir,
+                        const std::string &manifest_path)
+{
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+
+    ret = mb_bi_reader_open_filename(bir, input_file.c_str());
+    if (ret != MB_BI_OK) {
+        fprintf(stderr, "%s: Failed to open for reading: %s\n",
+                input_file.c_str(), mb_bi_reader_error_string(bir));
+        return false;
+    }
+
+    ret = mb_bi_reader_read_header(bir, &header);
+    if (ret != MB_BI_OK) {
+        fprintf(stderr, "%s: Failed to read header: %s\n",
+                input_file.c_str(), mb_bi_reader_error_string(bir));
+        return false;
+    }
+
+    std::vector<std::pair<const char *, std::string>> objects;
+
+    while ((ret = mb_bi_reader_read_entry(bir, &entry)) == MB_BI_OK) {
+        const char *name = entry_type_to_name(mb_bi_entry_type(entry));
+        if (!name) {
+            fprintf(stderr, "%s: Unknown entry type: %d\n",
+                    input_file.c_str(), mb_bi_entry_type(entry));
+            return false;
+        }
+
+        std::string digest;
+
+        if (!store_entry_data(store_dir, bir, digest)) {
+            return false;
+        }
+
+        objects.emplace_back(name, std::move(digest));
+    }
+
+    if (ret != MB_BI_EOF) {
+        fprintf(stderr, "%s: Failed to read entry: %s\n",
+                input_file.c_str(), mb_bi_reader_error_string(bir));
+        return false;
+    }
+
+    ScopedFILE fp(fopen(manifest_path.c_str(), "wb"), fclose);
+    if (!fp) {
+        fprintf(stderr, "%s: Failed to open for writing: %s\n",
+                manifest_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    bool failed = fprintf(fp.get(), "%s=%s\n", FIELD_FORMAT,
+                          mb_bi_reader_format_name(bir)) < 0
+            || !write_header_fields(fp.get(), header);
+
+    for (auto it = objects.begin(); !failed && it != objects.end(); ++it) {
+        failed = fprintf(fp.get(), "%s=%s\n",
+                         it->first, it->second.c_str()) < 0;
+    }
+
+    if (failed) {
+        fprintf(stderr, "%s: Failed to write file: %s\n",
+                manifest_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (fclose(fp.release()) < 0) {
+        fprintf(stderr, "%s: Failed to close file: %s\n",
+                manifest_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+bool store_main(int argc, char *argv[])
+{
+    int opt;
+    std::string store_dir;
+    std::string output_dir;
+    std::string manifest;
+    unsigned int jobs = 0;
+    const char *type = nullptr;
+    std::vector<std::string> inputs;
+
+    static const char short_options[] = "s:o:m:j:t:" "h";
+
+    static struct option long_options[] = {
+        {"store",    required_argument, 0, 's'},
+        {"output",   required_argument, 0, 'o'},
+        {"manifest", required_argument, 0, 'm'},
+        {"jobs",     required_argument, 0, 'j'},
+        {"type",     required_argument, 0, 't'},
+        // Misc
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 's': store_dir = optarg;  break;
+        case 'o': output_dir = optarg; break;
+        case 'm': manifest = optarg;   break;
+        case 't': type = optarg;       break;
+
+        case 'j':
+            if (!str_to_unum(optarg, 10, &jobs) || jobs == 0) {
+                fprintf(stderr, "Invalid job count: '%s'\n", optarg);
+                return false;
+            }
+            break;
 
         case 'h':
-            fputs(HELP_UNPACK_USAGE, stdout);
+            fputs(HELP_STORE_USAGE, stdout);
             return true;
 
         default:
-            fputs(HELP_UNPACK_USAGE, stderr);
+            fputs(HELP_STORE_USAGE, stderr);
             return false;
         }
     }
 
-    // There should be one other arguments
-    if (argc - optind != 1) {
-        fputs(HELP_UNPACK_USAGE, stderr);
-        return false;
+    for (int i = optind; i < argc; ++i) {
+        inputs.emplace_back(argv[i]);
     }
 
-    input_file = argv[optind];
+    if (!manifest.empty() && !read_manifest(manifest, inputs)) {
+        return false;
+    }
 
-    if (no_prefix) {
-        prefix.clear();
-    } else if (prefix.empty()) {
-        prefix = io::baseName(input_file);
-        prefix += "-";
+    if (store_dir.empty() || inputs.empty()) {
+        fputs(HELP_STORE_USAGE, stderr);
+        return false;
     }
 
     if (output_dir.empty()) {
         output_dir = ".";
     }
 
-    prepend_if_empty(paths, output_dir, prefix);
+    std::vector<std::string> manifest_paths(inputs.size());
+    std::unordered_map<std::string, size_t> names;
 
-    if (!io::createDirectories(output_dir)) {
-        fprintf(stderr, "%s: Failed to create directory: %s\n",
-                output_dir.c_str(), io::lastErrorString().c_str());
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        std::string name = io::baseName(inputs[i]);
+
+        auto it = names.find(name);
+        if (it != names.end()) {
+            fprintf(stderr, "%s: Manifest path conflicts with %s\n",
+                    inputs[i].c_str(), inputs[it->second].c_str());
+            return false;
+        }
+        names.emplace(name, i);
+
+        manifest_paths[i] = io::pathJoin({output_dir, name + ".manifest"});
+    }
+
+    std::string objects_dir = io::pathJoin({store_dir, "objects"});
+
+    for (const std::string *dir : { &objects_dir, &output_dir }) {
+        if (!io::createDirectories(*dir)) {
+            fprintf(stderr, "%s: Failed to create directory: %s\n",
+                    dir->c_str(), io::lastErrorString().c_str());
+            return false;
+        }
+    }
+
+    if (jobs == 0) {
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (jobs > inputs.size()) {
+        jobs = static_cast<unsigned int>(inputs.size());
+    }
+
+    std::atomic<size_t> next_index(0);
+    std::atomic<size_t> failed(0);
+
+    auto worker = [&]{
+        ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+
+        if (!bir) {
+            fprintf(stderr, "Failed to allocate reader: %s\n",
+                    strerror(errno));
+        } else if (!enable_reader_formats(bir.get(), type)) {
+            bir.reset();
+        }
+
+        size_t i;
+        while ((i = next_index++) < inputs.size()) {
+            if (!bir) {
+                ++failed;
+                continue;
+            }
+
+            if (!store_image(bir.get(), inputs[i], store_dir,
+                             manifest_paths[i])) {
+                ++failed;
+            }
+
+            if (mb_bi_reader_reset(bir.get()) <= MB_BI_FATAL) {
+                fprintf(stderr, "Failed to reset reader: %s\n",
+                        mb_bi_reader_error_string(bir.get()));
+                bir.reset();
+            }
+        }
+    };
+
+    mb::run_concurrently(jobs, worker);
+
+    if (failed > 0) {
+        fprintf(stderr, "Failed to store %zu of %zu boot images\n",
+                failed.load(), inputs.size());
         return false;
     }
 
-    // Load the boot image
-    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
-    MbBiHeader *header;
-    MbBiEntry *entry;
-    int ret;
+    return true;
+}
 
-    if (!bir) {
-        fprintf(stderr, "Failed to allocate reader: %s\n", strerror(errno));
+bool restore_main(int argc, char *argv[])
+{
+    int opt;
+    std::string store_dir;
+
+    static const char short_options[] = "s:" "h";
+
+    static struct option long_options[] = {
+        {"store", required_argument, 0, 's'},
+        // Misc
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 's': store_dir = optarg; break;
+
+        case 'h':
+            fputs(HELP_RESTORE_USAGE, stdout);
+            return true;
+
+        default:
+            fputs(HELP_RESTORE_USAGE, stderr);
+            return false;
+        }
+    }
+
+    if (store_dir.empty() || argc - optind != 2) {
+        fputs(HELP_RESTORE_USAGE, stderr);
         return false;
     }
 
-    if (type) {
-        ret = mb_bi_reader_enable_format_by_name(bir.get(), type);
-        if (ret != MB_BI_OK) {
-            fprintf(stderr, "Failed to enable format '%s': %s\n",
-                    type, mb_bi_reader_error_string(bir.get()));
+    std::string manifest_file = argv[optind];
+    std::string output_file = argv[optind + 1];
+
+    // The format must be known before the writer's header instance can be
+    // obtained, so the manifest is first parsed into a standalone header to
+    // get the format and the list of images
+    std::unique_ptr<MbBiHeader, decltype(mb_bi_header_free) *> scratch(
+            mb_bi_header_new(), mb_bi_header_free);
+    std::string type;
+    Paths paths;
+
+    if (!scratch) {
+        fprintf(stderr, "Failed to allocate header: %s\n", strerror(errno));
+        return false;
+    }
+
+    auto handle_manifest_key = [&](const char *key, const char *value,
+                                   bool &valid) {
+        if (strcmp(key, FIELD_FORMAT) == 0) {
+            type = value;
+            return true;
+        }
+
+        std::string *path = image_path(paths, key);
+        if (!path) {
             return false;
         }
-    } else {
-        ret = mb_bi_reader_enable_format_all(bir.get());
-        if (ret != MB_BI_OK) {
-            fprintf(stderr, "Failed to enable all formats: %s\n",
-                    mb_bi_reader_error_string(bir.get()));
+
+        valid = is_digest(value);
+        if (valid) {
+            *path = store_object_path(store_dir, value);
+        }
+        return true;
+    };
+    auto ignore_manifest_key = [](const char *, const char *, bool &) {
+        return true;
+    };
+
+    if (!read_header(manifest_file, scratch.get(), handle_manifest_key)) {
+        return false;
+    }
+
+    if (type.empty()) {
+        fprintf(stderr, "%s: Missing '%s' key\n",
+                manifest_file.c_str(), FIELD_FORMAT);
+        return false;
+    }
+
+    // Missing images are optional when packing from a directory, but a
+    // missing object means that the store is incomplete
+    for (const std::string *path : {
+            &paths.kernel, &paths.ramdisk, &paths.second, &paths.dt,
+            &paths.aboot, &paths.kernel_mtkhdr, &paths.ramdisk_mtkhdr,
+            &paths.ipl, &paths.rpm, &paths.appsbl }) {
+        if (!path->empty() && !ScopedFILE(fopen(path->c_str(), "rb"), fclose)) {
+            fprintf(stderr, "%s: Failed to open for reading: %s\n",
+                    path->c_str(), strerror(errno));
             return false;
         }
     }
 
-    ret = mb_bi_reader_open_filename(bir.get(), input_file.c_str());
+    ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+
+    if (!biw) {
+        fprintf(stderr, "Failed to allocate writer: %s\n", strerror(errno));
+        return false;
+    }
+
+    ret = mb_bi_writer_set_format_by_name(biw.get(), type.c_str());
     if (ret != MB_BI_OK) {
-        fprintf(stderr, "%s: Failed to open for reading: %s\n",
-                input_file.c_str(), mb_bi_reader_error_string(bir.get()));
+        fprintf(stderr, "Invalid boot image type: %s\n", type.c_str());
         return false;
     }
 
-    ret = mb_bi_reader_read_header(bir.get(), &header);
+    ret = mb_bi_writer_open_filename(biw.get(), output_file.c_str());
     if (ret != MB_BI_OK) {
-        fprintf(stderr, "%s: Failed to read header: %s\n",
-                input_file.c_str(), mb_bi_reader_error_string(bir.get()));
+        fprintf(stderr, "%s: Failed to open for writing: %s\n",
+                output_file.c_str(), mb_bi_writer_error_string(biw.get()));
         return false;
     }
 
-    if (!write_header(paths.header, header)) {
+    ret = mb_bi_writer_get_header(biw.get(), &header);
+    if (ret != MB_BI_OK) {
+        fprintf(stderr, "Failed to get header instance: %s\n",
+                mb_bi_writer_error_string(biw.get()));
+        return false;
+    }
+
+    if (!read_header(manifest_file, header, ignore_manifest_key)) {
+        return false;
+    }
+
+    ret = mb_bi_writer_write_header(biw.get(), header);
+    if (ret != MB_BI_OK) {
+        fprintf(stderr, "%s: Failed to write header: %s\n",
+                output_file.c_str(), mb_bi_writer_error_string(biw.get()));
         return false;
     }
 
-    while ((ret = mb_bi_reader_read_entry(bir.get(), &entry)) == MB_BI_OK) {
-        if (!write_entry_to_file(paths, bir.get(), entry)) {
+    while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
+        if (!write_file_to_entry(paths, biw.get(), entry)) {
             return false;
         }
     }
 
     if (ret != MB_BI_EOF) {
-        fprintf(stderr, "Failed to read entry: %s\n",
-                mb_bi_reader_error_string(bir.get()));
+        fprintf(stderr, "Failed to get next entry: %s\n",
+                mb_bi_writer_error_string(biw.get()));
+        return false;
+    }
+
+    ret = mb_bi_writer_close(biw.get());
+    if (ret != MB_BI_OK) {
+        fprintf(stderr, "Failed to close boot image: %s\n",
+                mb_bi_writer_error_string(biw.get()));
         return false;
     }
 
@@ -1052,6 +2797,7 @@ bool pack_main(int argc, char *argv[])
     std::string input_dir;
     std::string prefix;
     const char *type = MB_BI_FORMAT_NAME_ANDROID;
+    RamdiskCompression compression = RamdiskCompression::Original;
     Paths paths;
 
     // Arguments with no short options
@@ -1071,7 +2817,7 @@ bool pack_main(int argc, char *argv[])
         OPT_INPUT_APPSBL         = 10000 + 11,
     };
 
-    static const char short_options[] = "i:p:nt:" "h";
+    static const char short_options[] = "i:p:nt:c:" "h";
 
     static struct option long_options[] = {
         // Arguments with short versions
@@ -1079,6 +2825,7 @@ bool pack_main(int argc, char *argv[])
         {"prefix",               required_argument, 0, 'p'},
         {"noprefix",             required_argument, 0, 'n'},
         {"type",                 required_argument, 0, 't'},
+        {"ramdisk-compression",  required_argument, 0, 'c'},
         // Arguments without short versions
         {"input-header",         required_argument, 0, OPT_INPUT_HEADER},
         {"input-kernel",         required_argument, 0, OPT_INPUT_KERNEL},
@@ -1117,6 +2864,17 @@ bool pack_main(int argc, char *argv[])
         case OPT_INPUT_RPM:            paths.rpm = optarg;            break;
         case OPT_INPUT_APPSBL:         paths.appsbl = optarg;         break;
 
+        case 'c':
+            if (strcmp(optarg, "lz4-legacy") == 0) {
+                compression = RamdiskCompression::Lz4Legacy;
+            } else if (strcmp(optarg, "none") == 0) {
+                compression = RamdiskCompression::None;
+            } else {
+                fprintf(stderr, "Invalid ramdisk compression: %s\n", optarg);
+                return false;
+            }
+            break;
+
         case 'h':
             fputs(HELP_PACK_USAGE, stdout);
             return true;
@@ -1191,7 +2949,7 @@ bool pack_main(int argc, char *argv[])
     }
 
     while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
-        if (!write_file_to_entry(paths, biw.get(), entry)) {
+        if (!write_file_to_entry(paths, biw.get(), entry, compression)) {
             return false;
         }
     }
@@ -1224,8 +2982,16 @@ int main(int argc, char *argv[])
 
     if (command == "unpack") {
         ret = unpack_main(--argc, ++argv);
+    } else if (command == "unpack-batch") {
+        ret = unpack_batch_main(--argc, ++argv);
     } else if (command == "pack") {
         ret = pack_main(--argc, ++argv);
+    } else if (command == "info") {
+        ret = info_main(--argc, ++argv);
+    } else if (command == "store") {
+        ret = store_main(--argc, ++argv);
+    } else if (command == "restore") {
+        ret = restore_main(--argc, ++argv);
     } else {
         fputs(HELP_MAIN_USAGE, stderr);
         return EXIT_FAILURE;
@@ -0,0 +1,4 @@
+if(MBP_ENABLE_BENCHMARKS)
+    # Google Benchmark is not bundled, so use the system's copy
+    find_package(benchmark REQUIRED)
+endif()
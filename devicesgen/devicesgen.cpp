@@ -26,6 +26,7 @@
 #include <jansson.h>
 #include <yaml-cpp/yaml.h>
 
+#include "mbdevice/database.h"
 #include "mbdevice/json.h"
 #include "mbdevice/validate.h"
 
@@ -201,6 +202,43 @@ static bool validate(const char *path, const char *json, bool is_array)
     return true;
 }
 
+static bool write_database(FILE *fp, json_t *json_root)
+{
+    MbDeviceJsonError error;
+
+    // The devices were already validated
+    char *json = json_dumps(json_root, JSON_COMPACT);
+    Device **devices = mb_device_new_list_from_json(json, &error);
+    free(json);
+    if (!devices) {
+        print_json_error("<merged>", &error);
+        return false;
+    }
+
+    size_t size;
+    void *data = mb_device_db_serialize(devices, &size);
+
+    for (Device **iter = devices; *iter; ++iter) {
+        mb_device_free(*iter);
+    }
+    free(devices);
+
+    if (!data) {
+        fprintf(stderr, "Failed to create device database: %s\n",
+                strerror(errno));
+        return false;
+    }
+
+    bool ret = fwrite(data, 1, size, fp) == size;
+    if (!ret) {
+        fprintf(stderr, "Failed to write device database: %s\n",
+                strerror(errno));
+    }
+
+    free(data);
+    return ret;
+}
+
 static void usage(FILE *stream)
 {
     fprintf(stream,
@@ -210,7 +248,8 @@ static void usage(FILE *stream)
             "  -o, --output <file>\n"
             "                   Output file (outputs to stdout if omitted)\n"
             "  -h, --help       Display this help message\n"
-            "  --styled         Output in human-readable format\n");
+            "  --styled         Output in human-readable format\n"
+            "  --binary         Output compiled device database instead of JSON\n");
 }
 
 int main(int argc, char *argv[])
@@ -219,12 +258,14 @@ int main(int argc, char *argv[])
 
     enum Options {
         OPT_STYLED             = 1000,
+        OPT_BINARY             = 1001,
     };
 
     static const char short_options[] = "o:h";
 
     static struct option long_options[] = {
         {"styled", no_argument, 0, OPT_STYLED},
+        {"binary", no_argument, 0, OPT_BINARY},
         {"output", required_argument, 0, 'o'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
@@ -234,6 +275,7 @@ int main(int argc, char *argv[])
 
     const char *output_file = nullptr;
     bool styled = false;
+    bool binary = false;
 
     while ((opt = getopt_long(argc, argv, short_options,
                               long_options, &long_index)) != -1) {
@@ -242,6 +284,10 @@ int main(int argc, char *argv[])
             styled = true;
             break;
 
+        case OPT_BINARY:
+            binary = true;
+            break;
+
         case 'o':
             output_file = optarg;
             break;
@@ -294,7 +340,7 @@ int main(int argc, char *argv[])
     FILE *fp = stdout;
 
     if (output_file) {
-        fp = fopen(output_file, "w");
+        fp = fopen(output_file, binary ? "wb" : "w");
         if (!fp) {
             fprintf(stderr, "%s: Failed to open file: %s\n",
                     output_file, strerror(errno));
@@ -302,18 +348,25 @@ int main(int argc, char *argv[])
         }
     }
 
-    char *output;
-    if (styled) {
-        output = json_dumps(json_root, JSON_INDENT(4) | JSON_SORT_KEYS);
+    if (binary) {
+        if (!write_database(fp, json_root)) {
+            return EXIT_FAILURE;
+        }
     } else {
-        output = json_dumps(json_root, JSON_COMPACT);
-    }
+        char *output;
+        if (styled) {
+            output = json_dumps(json_root, JSON_INDENT(4) | JSON_SORT_KEYS);
+        } else {
+            output = json_dumps(json_root, JSON_COMPACT);
+        }
+
+        if (fputs(output, fp) == EOF) {
+            fprintf(stderr, "Failed to write JSON: %s\n", strerror(errno));
+        }
 
-    if (fputs(output, fp) == EOF) {
-        fprintf(stderr, "Failed to write JSON: %s\n", strerror(errno));
+        free(output);
     }
 
-    free(output);
     json_decref(json_root);
 
     if (output_file) {
@@ -24,6 +24,7 @@
 #include <mbdevice/json.h>
 #include <mbdevice/validate.h>
 #include <mblog/logging.h>
+#include <mbpatcher/batchpatcher.h>
 #include <mbpatcher/patcherconfig.h>
 #include <mbpatcher/patcherinterface.h>
 
@@ -91,24 +92,37 @@ static Device * get_device(const char *path)
     return device;
 }
 
-static void mbp_progress_cb(uint64_t bytes, uint64_t maxBytes, void *userdata)
+static void mbp_progress_cb(size_t job, uint64_t bytes, uint64_t maxBytes,
+                            void *userdata)
 {
     (void) userdata;
-    printf("Current bytes percentage: %.1f\n", 100.0 * bytes / maxBytes);
+    printf("[Job %zu] Current bytes percentage: %.1f\n",
+           job, 100.0 * bytes / maxBytes);
+}
+
+static void mbp_finished_cb(size_t job,
+                            mb::patcher::BatchPatcher::JobState state,
+                            mb::patcher::ErrorCode error, void *userdata)
+{
+    (void) userdata;
+    if (state == mb::patcher::BatchPatcher::JobState::Succeeded) {
+        printf("[Job %zu] Succeeded\n", job);
+    } else {
+        fprintf(stderr, "[Job %zu] Error: %d\n", job, static_cast<int>(error));
+    }
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 6) {
+    if (argc < 6 || (argc - 4) % 2 != 0) {
         fprintf(stderr, "Usage: %s <patcher id> <device file> <rom id> "
-                "<input path> <output path>\n", argv[0]);
+                "<input path> <output path> [<input path> <output path> ...]\n",
+                argv[0]);
         return EXIT_FAILURE;
     }
 
     const char *patcher_id = argv[1];
     const char *device_file = argv[2];
     const char *rom_id = argv[3];
-    const char *input_path = argv[4];
-    const char *output_path = argv[5];
 
     mb::log::log_set_logger(std::make_shared<BasicLogger>());
 
@@ -120,24 +134,26 @@ int main(int argc, char *argv[]) {
     mb::patcher::PatcherConfig pc;
     pc.set_data_directory("data");
 
-    mb::patcher::FileInfo fi;
-    fi.set_device(device.get());
-    fi.set_input_path(input_path);
-    fi.set_output_path(output_path);
-    fi.set_rom_id(rom_id);
+    mb::patcher::BatchPatcher batch(&pc);
 
-    auto *patcher = pc.create_patcher(patcher_id);
-    if (!patcher) {
-        fprintf(stderr, "Invalid patcher ID: %s\n", patcher_id);
-        return EXIT_FAILURE;
+    for (int i = 4; i < argc; i += 2) {
+        mb::patcher::FileInfo fi;
+        fi.set_device(device.get());
+        fi.set_input_path(argv[i]);
+        fi.set_output_path(argv[i + 1]);
+        fi.set_rom_id(rom_id);
+
+        batch.add_job(patcher_id, fi);
     }
 
-    patcher->set_file_info(&fi);
-    bool ret = patcher->patch_file(&mbp_progress_cb, nullptr, nullptr, nullptr);
+    bool ret = batch.run(0, &mbp_progress_cb, nullptr, nullptr,
+                         &mbp_finished_cb, nullptr);
 
-    if (!ret) {
-        fprintf(stderr, "Error: %d\n", static_cast<int>(patcher->error()));
-    }
+    auto stats = batch.stats();
+    double seconds = stats.elapsed_ms / 1000.0;
+    printf("Patched %zu/%zu files in %.1fs (%.1f MiB/s)\n",
+           stats.succeeded, batch.job_count(), seconds,
+           seconds > 0 ? stats.bytes / 1048576.0 / seconds : 0.0);
 
     return ret ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,843 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Benchmark driver for the ZipPatcher and OdinPatcher
+//
+// ROM-shaped zips (many small files plus one huge system.new.dat) and Odin
+// tarballs are synthesized in the work directory. Each patcher is then run on
+// its input and the wall time, CPU time, peak RSS, I/O counters, and the
+// patcher's own phase timings are written as JSON.
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <archive.h>
+#include <archive_entry.h>
+
+#include <mbdevice/json.h>
+#include <mbdevice/validate.h>
+#include <mblog/logging.h>
+#include <mbpatcher/patcherconfig.h>
+#include <mbpatcher/patcherinterface.h>
+
+#define MIB                     (1024 * 1024)
+
+// Size of the pool of random data that the synthesized files are built from
+#define DATA_POOL_SIZE          (1 * MIB)
+
+typedef std::unique_ptr<Device, void (*)(Device *)> ScopedDevice;
+typedef std::unique_ptr<archive, int (*)(archive *)> ScopedArchive;
+typedef std::unique_ptr<archive_entry, void (*)(archive_entry *)>
+        ScopedArchiveEntry;
+
+// Only report warnings and errors, since the JSON may be written to stdout
+class QuietLogger : public mb::log::BaseLogger
+{
+public:
+    virtual void log(mb::log::LogLevel prio, const char *fmt, va_list ap) override
+    {
+        if (prio == mb::log::LogLevel::Error
+                || prio == mb::log::LogLevel::Warning) {
+            vfprintf(stderr, fmt, ap);
+            fprintf(stderr, "\n");
+        }
+    }
+};
+
+struct SynthOptions
+{
+    // Number of small files in the zip
+    unsigned int small_files;
+    // Maximum size of each small file
+    uint64_t small_file_max_size;
+    // Size of system.new.dat in the zip and system.img.ext4 in the tarball
+    uint64_t system_size;
+};
+
+struct IoStats
+{
+    // Bytes passed to read()/write() and friends
+    uint64_t rchar;
+    uint64_t wchar;
+    // Bytes that actually hit the storage layer
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+};
+
+struct RunResult
+{
+    std::string patcher_id;
+    unsigned int iteration;
+    bool success;
+    int error;
+    double wall_ms;
+    double user_ms;
+    double sys_ms;
+    uint64_t peak_rss_kib;
+    IoStats io;
+    uint64_t input_size;
+    uint64_t output_size;
+    std::vector<mb::patcher::Patcher::PhaseTime> phases;
+};
+
+template<typename UIntType>
+static inline bool str_to_unum(const char *str, int base, UIntType *out)
+{
+    static_assert(!std::is_signed<UIntType>::value,
+                  "Integer type is not unsigned");
+    static_assert(std::numeric_limits<UIntType>::max() <= ULLONG_MAX,
+                  "Integer type to too large to handle");
+
+    char *end;
+    errno = 0;
+    auto num = strtoull(str, &end, base);
+    if (errno == ERANGE
+            || num > std::numeric_limits<UIntType>::max()) {
+        errno = ERANGE;
+        return false;
+    } else if (*str == '\0' || *end != '\0') {
+        errno = EINVAL;
+        return false;
+    }
+    *out = static_cast<UIntType>(num);
+    return true;
+}
+
+static bool file_read_all(const std::string &path,
+                          std::vector<unsigned char> *data_out)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    auto size = ftell(fp);
+    rewind(fp);
+
+    std::vector<unsigned char> data(size);
+    if (fread(data.data(), size, 1, fp) != 1) {
+        fclose(fp);
+        return false;
+    }
+
+    data_out->swap(data);
+
+    fclose(fp);
+    return true;
+}
+
+static Device * get_device(const char *path)
+{
+    std::vector<unsigned char> contents;
+    if (!file_read_all(path, &contents)) {
+        fprintf(stderr, "%s: Failed to read file: %s\n", path, strerror(errno));
+        return nullptr;
+    }
+    contents.push_back('\0');
+
+    MbDeviceJsonError error;
+    Device *device = mb_device_new_from_json(
+            (const char *) contents.data(), &error);
+    if (!device) {
+        fprintf(stderr, "%s: Failed to load devices\n", path);
+        return nullptr;
+    }
+
+    if (mb_device_validate(device) != 0) {
+        fprintf(stderr, "%s: Validation failed\n", path);
+        mb_device_free(device);
+        return nullptr;
+    }
+
+    return device;
+}
+
+static uint64_t file_size(const std::string &path)
+{
+    struct stat sb;
+    return stat(path.c_str(), &sb) == 0 ? static_cast<uint64_t>(sb.st_size) : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Synthesis
+////////////////////////////////////////////////////////////////////////////////
+
+// Source of file contents. The data is moderately compressible (random bytes
+// from a 25 character alphabet) and every block starts at a different offset
+// in the pool, so the deflate window never sees repeated blocks.
+class DataSource
+{
+public:
+    DataSource() : _pool(DATA_POOL_SIZE)
+    {
+        std::mt19937 gen(12345);
+        std::uniform_int_distribution<int> dist('a', 'y');
+
+        for (auto &c : _pool) {
+            c = static_cast<unsigned char>(dist(gen));
+        }
+    }
+
+    // Returns a pointer to at least block_size() bytes
+    const unsigned char * block(uint64_t index) const
+    {
+        return _pool.data()
+                + static_cast<size_t>((index * 4099) % (_pool.size() / 2));
+    }
+
+    // Maximum size that can be requested from block()
+    size_t block_size() const
+    {
+        return _pool.size() / 2;
+    }
+
+private:
+    std::vector<unsigned char> _pool;
+};
+
+static bool write_entry(archive *a, const DataSource &source,
+                        const std::string &name, const void *data,
+                        uint64_t size)
+{
+    ScopedArchiveEntry entry(archive_entry_new(), &archive_entry_free);
+    if (!entry) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+
+    archive_entry_set_pathname(entry.get(), name.c_str());
+    archive_entry_set_filetype(entry.get(), AE_IFREG);
+    archive_entry_set_perm(entry.get(), 0644);
+    archive_entry_set_size(entry.get(), static_cast<int64_t>(size));
+
+    if (archive_write_header(a, entry.get()) != ARCHIVE_OK) {
+        fprintf(stderr, "%s: Failed to write header: %s\n",
+                name.c_str(), archive_error_string(a));
+        return false;
+    }
+
+    uint64_t index = 0;
+
+    for (uint64_t offset = 0; offset < size; ++index) {
+        size_t to_write = static_cast<size_t>(std::min<uint64_t>(
+                source.block_size(), size - offset));
+        const void *buf = data ? static_cast<const unsigned char *>(data)
+                + offset : source.block(index);
+
+        ssize_t n = archive_write_data(a, buf, to_write);
+        if (n < 0) {
+            fprintf(stderr, "%s: Failed to write data: %s\n",
+                    name.c_str(), archive_error_string(a));
+            return false;
+        }
+
+        offset += static_cast<uint64_t>(n);
+    }
+
+    return true;
+}
+
+static bool write_text_entry(archive *a, const DataSource &source,
+                             const std::string &name, const std::string &text)
+{
+    return write_entry(a, source, name, text.data(), text.size());
+}
+
+static const char updater_script[] =
+    "ui_print(\"Installing synthetic ROM\");\n"
+    "ifelse(is_mounted(\"/system\"), unmount(\"/system\"));\n"
+    "format(\"ext4\", \"EMMC\", \"/dev/block/bootdevice/by-name/system\", "
+        "\"0\", \"/system\");\n"
+    "block_image_update(\"/dev/block/bootdevice/by-name/system\", "
+        "package_extract_file(\"system.transfer.list\"), \"system.new.dat\", "
+        "\"system.patch.dat\");\n"
+    "mount(\"ext4\", \"EMMC\", \"/dev/block/bootdevice/by-name/system\", "
+        "\"/system\", \"\");\n"
+    "package_extract_dir(\"system\", \"/system\");\n"
+    "set_metadata_recursive(\"/system\", \"uid\", 0, \"gid\", 0, "
+        "\"dmode\", 0755, \"fmode\", 0644);\n"
+    "unmount(\"/system\");\n"
+    "package_extract_file(\"boot.img\", "
+        "\"/dev/block/bootdevice/by-name/boot\");\n";
+
+static bool synthesize_zip(const std::string &path, const SynthOptions &opts,
+                           const DataSource &source)
+{
+    ScopedArchive a(archive_write_new(), &archive_write_free);
+    if (!a) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+
+    if (archive_write_set_format_zip(a.get()) != ARCHIVE_OK
+            || archive_write_open_filename(a.get(), path.c_str())
+                    != ARCHIVE_OK) {
+        fprintf(stderr, "%s: Failed to open zip for writing: %s\n",
+                path.c_str(), archive_error_string(a.get()));
+        return false;
+    }
+
+    std::mt19937 gen(54321);
+    std::uniform_int_distribution<uint64_t> size_dist(
+            1, std::max<uint64_t>(opts.small_file_max_size, 1));
+
+    bool ret = write_entry(a.get(), source,
+                           "META-INF/com/google/android/update-binary",
+                           nullptr, 1 * MIB)
+            && write_text_entry(a.get(), source,
+                                "META-INF/com/google/android/updater-script",
+                                updater_script)
+            && write_entry(a.get(), source, "boot.img", nullptr, 16 * MIB)
+            && write_text_entry(a.get(), source, "system.transfer.list",
+                                "4\n0\n0\n0\n")
+            && write_entry(a.get(), source, "system.patch.dat", nullptr, 0)
+            && write_entry(a.get(), source, "system.new.dat", nullptr,
+                           opts.system_size);
+
+    for (unsigned int i = 0; ret && i < opts.small_files; ++i) {
+        char name[64];
+        snprintf(name, sizeof(name), "system/app/App%05u/App%05u.apk", i, i);
+        ret = write_entry(a.get(), source, name, nullptr, size_dist(gen));
+    }
+
+    if (archive_write_close(a.get()) != ARCHIVE_OK) {
+        fprintf(stderr, "%s: Failed to close zip: %s\n",
+                path.c_str(), archive_error_string(a.get()));
+        return false;
+    }
+
+    return ret;
+}
+
+static bool synthesize_tar(const std::string &path, const SynthOptions &opts,
+                           const DataSource &source)
+{
+    ScopedArchive a(archive_write_new(), &archive_write_free);
+    if (!a) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+
+    if (archive_write_set_format_ustar(a.get()) != ARCHIVE_OK
+            || archive_write_open_filename(a.get(), path.c_str())
+                    != ARCHIVE_OK) {
+        fprintf(stderr, "%s: Failed to open tar for writing: %s\n",
+                path.c_str(), archive_error_string(a.get()));
+        return false;
+    }
+
+    // Same layout as an AP tarball. recovery.img and modem.bin are skipped by
+    // the patcher, but still have to be read through.
+    bool ret = write_entry(a.get(), source, "boot.img", nullptr, 16 * MIB)
+            && write_entry(a.get(), source, "recovery.img", nullptr, 16 * MIB)
+            && write_entry(a.get(), source, "system.img.ext4", nullptr,
+                           opts.system_size)
+            && write_entry(a.get(), source, "modem.bin", nullptr, 32 * MIB)
+            && write_entry(a.get(), source, "cache.img.ext4", nullptr,
+                           16 * MIB);
+
+    if (archive_write_close(a.get()) != ARCHIVE_OK) {
+        fprintf(stderr, "%s: Failed to close tar: %s\n",
+                path.c_str(), archive_error_string(a.get()));
+        return false;
+    }
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Measurement
+////////////////////////////////////////////////////////////////////////////////
+
+static IoStats read_io_stats()
+{
+    IoStats stats = {};
+
+#ifdef __linux__
+    FILE *fp = fopen("/proc/self/io", "r");
+    if (!fp) {
+        return stats;
+    }
+
+    char key[32];
+    uint64_t value;
+
+    while (fscanf(fp, "%31[^:]: %" SCNu64 "\n", key, &value) == 2) {
+        if (strcmp(key, "rchar") == 0) {
+            stats.rchar = value;
+        } else if (strcmp(key, "wchar") == 0) {
+            stats.wchar = value;
+        } else if (strcmp(key, "read_bytes") == 0) {
+            stats.read_bytes = value;
+        } else if (strcmp(key, "write_bytes") == 0) {
+            stats.write_bytes = value;
+        }
+    }
+
+    fclose(fp);
+#endif
+
+    return stats;
+}
+
+// Reset the peak RSS so that each run is measured on its own. On kernels
+// without support for this, the peak RSS is the maximum of all runs so far.
+static void reset_peak_rss()
+{
+#ifdef __linux__
+    FILE *fp = fopen("/proc/self/clear_refs", "w");
+    if (fp) {
+        fputs("5", fp);
+        fclose(fp);
+    }
+#endif
+}
+
+static uint64_t peak_rss_kib()
+{
+#ifdef __linux__
+    FILE *fp = fopen("/proc/self/status", "r");
+    if (fp) {
+        char line[256];
+        uint64_t value;
+
+        while (fgets(line, sizeof(line), fp)) {
+            if (sscanf(line, "VmHWM: %" SCNu64, &value) == 1) {
+                fclose(fp);
+                return value;
+            }
+        }
+
+        fclose(fp);
+    }
+#endif
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) < 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return static_cast<uint64_t>(usage.ru_maxrss) / 1024;
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss);
+#endif
+}
+
+static double timeval_ms(const struct timeval &tv)
+{
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static RunResult run_patcher(mb::patcher::PatcherConfig &pc,
+                             const std::string &patcher_id,
+                             Device *device, const std::string &rom_id,
+                             const std::string &input_path,
+                             const std::string &output_path,
+                             unsigned int iteration)
+{
+    RunResult result = {};
+    result.patcher_id = patcher_id;
+    result.iteration = iteration;
+    result.input_size = file_size(input_path);
+
+    unlink(output_path.c_str());
+
+    mb::patcher::Patcher *patcher = pc.create_patcher(patcher_id);
+    if (!patcher) {
+        fprintf(stderr, "Invalid patcher ID: %s\n", patcher_id.c_str());
+        result.error = static_cast<int>(pc.error());
+        return result;
+    }
+
+    mb::patcher::FileInfo fi;
+    fi.set_device(device);
+    fi.set_input_path(input_path);
+    fi.set_output_path(output_path);
+    fi.set_rom_id(rom_id);
+
+    patcher->set_file_info(&fi);
+
+    reset_peak_rss();
+
+    struct rusage usage_before;
+    struct rusage usage_after;
+    getrusage(RUSAGE_SELF, &usage_before);
+    IoStats io_before = read_io_stats();
+    auto start = std::chrono::steady_clock::now();
+
+    result.success = patcher->patch_file(nullptr, nullptr, nullptr, nullptr);
+
+    auto end = std::chrono::steady_clock::now();
+    IoStats io_after = read_io_stats();
+    getrusage(RUSAGE_SELF, &usage_after);
+
+    result.error = static_cast<int>(patcher->error());
+    result.wall_ms = std::chrono::duration<double, std::milli>(
+            end - start).count();
+    result.user_ms = timeval_ms(usage_after.ru_utime)
+            - timeval_ms(usage_before.ru_utime);
+    result.sys_ms = timeval_ms(usage_after.ru_stime)
+            - timeval_ms(usage_before.ru_stime);
+    result.peak_rss_kib = peak_rss_kib();
+    result.io.rchar = io_after.rchar - io_before.rchar;
+    result.io.wchar = io_after.wchar - io_before.wchar;
+    result.io.read_bytes = io_after.read_bytes - io_before.read_bytes;
+    result.io.write_bytes = io_after.write_bytes - io_before.write_bytes;
+    result.output_size = file_size(output_path);
+    result.phases = patcher->phase_times();
+
+    pc.destroy_patcher(patcher);
+
+    if (!result.success) {
+        fprintf(stderr, "%s: Failed to patch %s: error %d\n",
+                patcher_id.c_str(), input_path.c_str(), result.error);
+    }
+
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Output
+////////////////////////////////////////////////////////////////////////////////
+
+static void write_json_string(FILE *fp, const std::string &str)
+{
+    fputc('"', fp);
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            fprintf(fp, "\\%c", c);
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+static void write_json(FILE *fp, const SynthOptions &opts,
+                       const std::vector<RunResult> &results)
+{
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"context\": {\n");
+    fprintf(fp, "    \"small_files\": %u,\n", opts.small_files);
+    fprintf(fp, "    \"small_file_max_size\": %" PRIu64 ",\n",
+            opts.small_file_max_size);
+    fprintf(fp, "    \"system_size\": %" PRIu64 "\n", opts.system_size);
+    fprintf(fp, "  },\n");
+    fprintf(fp, "  \"runs\": [");
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        const RunResult &r = results[i];
+
+        fprintf(fp, "%s\n    {\n", i == 0 ? "" : ",");
+        fprintf(fp, "      \"patcher\": ");
+        write_json_string(fp, r.patcher_id);
+        fprintf(fp, ",\n");
+        fprintf(fp, "      \"iteration\": %u,\n", r.iteration);
+        fprintf(fp, "      \"success\": %s,\n", r.success ? "true" : "false");
+        fprintf(fp, "      \"error\": %d,\n", r.error);
+        fprintf(fp, "      \"wall_ms\": %.3f,\n", r.wall_ms);
+        fprintf(fp, "      \"user_ms\": %.3f,\n", r.user_ms);
+        fprintf(fp, "      \"sys_ms\": %.3f,\n", r.sys_ms);
+        fprintf(fp, "      \"peak_rss_kib\": %" PRIu64 ",\n", r.peak_rss_kib);
+        fprintf(fp, "      \"bytes_read\": %" PRIu64 ",\n", r.io.rchar);
+        fprintf(fp, "      \"bytes_written\": %" PRIu64 ",\n", r.io.wchar);
+        fprintf(fp, "      \"storage_bytes_read\": %" PRIu64 ",\n",
+                r.io.read_bytes);
+        fprintf(fp, "      \"storage_bytes_written\": %" PRIu64 ",\n",
+                r.io.write_bytes);
+        fprintf(fp, "      \"input_size\": %" PRIu64 ",\n", r.input_size);
+        fprintf(fp, "      \"output_size\": %" PRIu64 ",\n", r.output_size);
+        fprintf(fp, "      \"phases\": [");
+
+        for (size_t j = 0; j < r.phases.size(); ++j) {
+            fprintf(fp, "%s\n        { \"name\": ", j == 0 ? "" : ",");
+            write_json_string(fp, r.phases[j].name);
+            fprintf(fp, ", \"elapsed_ms\": %.3f }",
+                    r.phases[j].elapsed_us / 1000.0);
+        }
+
+        fprintf(fp, "%s]\n    }", r.phases.empty() ? "" : "\n      ");
+    }
+
+    fprintf(fp, "\n  ]\n}\n");
+}
+
+static void usage(FILE *stream, const char *prog_name)
+{
+    fprintf(stream, "Usage: %s [option...] <device file> <work directory>\n"
+                    "\n"
+                    "Options:\n"
+                    "  -p, --patcher <id>\n"
+                    "                  Patcher to run (ZipPatcher or OdinPatcher)\n"
+                    "                  (can be specified multiple times; default: both)\n"
+                    "  -n, --repetitions <count>\n"
+                    "                  Number of times to run each patcher (default: 3)\n"
+                    "  -o, --output <file>\n"
+                    "                  Write JSON results to file instead of stdout\n"
+                    "  --data-dir <dir>\n"
+                    "                  Patcher data directory (default: data)\n"
+                    "  --rom-id <id>   ROM ID to patch for (default: dual)\n"
+                    "  --small-files <count>\n"
+                    "                  Number of small files in the zip (default: 2000)\n"
+                    "  --small-file-size <bytes>\n"
+                    "                  Maximum size of the small files (default: 65536)\n"
+                    "  --system-size <MiB>\n"
+                    "                  Size of the system image (default: 1024)\n"
+                    "  --keep          Keep the synthesized inputs and patched outputs\n",
+                    prog_name);
+}
+
+int main(int argc, char *argv[])
+{
+    SynthOptions opts;
+    opts.small_files = 2000;
+    opts.small_file_max_size = 64 * 1024;
+    opts.system_size = 1024 * MIB;
+
+    std::vector<std::string> patcher_ids;
+    unsigned int repetitions = 3;
+    const char *output_file = nullptr;
+    std::string data_dir("data");
+    std::string rom_id("dual");
+    bool keep = false;
+    uint64_t system_size_mib;
+
+    int opt;
+
+    // Arguments with no short options
+    enum : int
+    {
+        OPT_DATA_DIR             = CHAR_MAX + 1,
+        OPT_ROM_ID               = CHAR_MAX + 2,
+        OPT_SMALL_FILES          = CHAR_MAX + 3,
+        OPT_SMALL_FILE_SIZE      = CHAR_MAX + 4,
+        OPT_SYSTEM_SIZE          = CHAR_MAX + 5,
+        OPT_KEEP                 = CHAR_MAX + 6,
+    };
+
+    static const char short_options[] = "hn:o:p:";
+
+    static struct option long_options[] = {
+        // Arguments with short versions
+        {"help",            no_argument,       0, 'h'},
+        {"repetitions",     required_argument, 0, 'n'},
+        {"output",          required_argument, 0, 'o'},
+        {"patcher",         required_argument, 0, 'p'},
+        // Arguments without short versions
+        {"data-dir",        required_argument, 0, OPT_DATA_DIR},
+        {"rom-id",          required_argument, 0, OPT_ROM_ID},
+        {"small-files",     required_argument, 0, OPT_SMALL_FILES},
+        {"small-file-size", required_argument, 0, OPT_SMALL_FILE_SIZE},
+        {"system-size",     required_argument, 0, OPT_SYSTEM_SIZE},
+        {"keep",            no_argument,       0, OPT_KEEP},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'n':
+            if (!str_to_unum(optarg, 10, &repetitions) || repetitions == 0) {
+                fprintf(stderr, "Invalid value for -n/--repetitions: %s\n",
+                        optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'o':
+            output_file = optarg;
+            break;
+
+        case 'p':
+            patcher_ids.push_back(optarg);
+            break;
+
+        case OPT_DATA_DIR:
+            data_dir = optarg;
+            break;
+
+        case OPT_ROM_ID:
+            rom_id = optarg;
+            break;
+
+        case OPT_SMALL_FILES:
+            if (!str_to_unum(optarg, 10, &opts.small_files)) {
+                fprintf(stderr, "Invalid value for --small-files: %s\n",
+                        optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case OPT_SMALL_FILE_SIZE:
+            if (!str_to_unum(optarg, 10, &opts.small_file_max_size)) {
+                fprintf(stderr, "Invalid value for --small-file-size: %s\n",
+                        optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case OPT_SYSTEM_SIZE:
+            if (!str_to_unum(optarg, 10, &system_size_mib)
+                    || system_size_mib > UINT64_MAX / MIB) {
+                fprintf(stderr, "Invalid value for --system-size: %s\n",
+                        optarg);
+                return EXIT_FAILURE;
+            }
+            opts.system_size = system_size_mib * MIB;
+            break;
+
+        case OPT_KEEP:
+            keep = true;
+            break;
+
+        case 'h':
+            usage(stdout, argv[0]);
+            return EXIT_SUCCESS;
+
+        default:
+            usage(stderr, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage(stderr, argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *device_file = argv[optind];
+    std::string work_dir(argv[optind + 1]);
+
+    if (patcher_ids.empty()) {
+        patcher_ids.push_back("ZipPatcher");
+        patcher_ids.push_back("OdinPatcher");
+    }
+
+    mb::log::log_set_logger(std::make_shared<QuietLogger>());
+
+    ScopedDevice device(get_device(device_file), mb_device_free);
+    if (!device) {
+        return EXIT_FAILURE;
+    }
+
+    if (mkdir(work_dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "%s: Failed to create directory: %s\n",
+                work_dir.c_str(), strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    std::string zip_path(work_dir + "/rom.zip");
+    std::string tar_path(work_dir + "/firmware.tar.md5");
+    std::string output_path(work_dir + "/patched.zip");
+
+    // Synthesis is not part of the measurements
+    DataSource source;
+
+    for (auto const &id : patcher_ids) {
+        bool ok;
+
+        if (id == "ZipPatcher" && file_size(zip_path) == 0) {
+            fprintf(stderr, "Synthesizing %s\n", zip_path.c_str());
+            ok = synthesize_zip(zip_path, opts, source);
+        } else if (id == "OdinPatcher" && file_size(tar_path) == 0) {
+            fprintf(stderr, "Synthesizing %s\n", tar_path.c_str());
+            ok = synthesize_tar(tar_path, opts, source);
+        } else {
+            ok = true;
+        }
+
+        if (!ok) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    // The patch cache is left disabled so that every run does the full work
+    mb::patcher::PatcherConfig pc;
+    pc.set_data_directory(data_dir);
+    pc.set_temp_directory(work_dir);
+
+    std::vector<RunResult> results;
+    bool ret = true;
+
+    for (auto const &id : patcher_ids) {
+        const std::string &input_path =
+                id == "OdinPatcher" ? tar_path : zip_path;
+
+        for (unsigned int i = 0; i < repetitions; ++i) {
+            fprintf(stderr, "Running %s [%u/%u]\n",
+                    id.c_str(), i + 1, repetitions);
+
+            results.push_back(run_patcher(pc, id, device.get(), rom_id,
+                                          input_path, output_path, i));
+            if (!results.back().success) {
+                ret = false;
+                break;
+            }
+        }
+    }
+
+    if (!keep) {
+        unlink(zip_path.c_str());
+        unlink(tar_path.c_str());
+        unlink(output_path.c_str());
+    }
+
+    FILE *fp = stdout;
+    if (output_file) {
+        fp = fopen(output_file, "w");
+        if (!fp) {
+            fprintf(stderr, "%s: Failed to open for writing: %s\n",
+                    output_file, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    write_json(fp, opts, results);
+
+    if (fp != stdout && fclose(fp) != 0) {
+        fprintf(stderr, "%s: Failed to close file: %s\n",
+                output_file, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -34,9 +34,16 @@
 #include <QtWidgets/QGroupBox>
 
 
-const int patcherPtrTypeId = qRegisterMetaType<PatcherPtr>("PatcherPtr");
-const int fileInfoPtrTypeId = qRegisterMetaType<FileInfoPtr>("FileInfoPtr");
+const int batchPatcherPtrTypeId =
+        qRegisterMetaType<BatchPatcherPtr>("BatchPatcherPtr");
 const int uint64TypeId = qRegisterMetaType<uint64_t>("uint64_t");
+const int fileInspectionResultsTypeId =
+        qRegisterMetaType<FileInspectionResults>("FileInspectionResults");
+
+// Maximum number of files whose inspection results are kept
+static const int maxCachedInspections = 64;
+
+static QString errorToString(const mb::patcher::ErrorCode &error);
 
 MainWindowPrivate::MainWindowPrivate()
     : settings(qApp->applicationDirPath() % QStringLiteral("/settings.ini"),
@@ -55,10 +62,10 @@ MainWindow::MainWindow(mb::patcher::PatcherConfig *pc, QWidget *parent)
     // If we're passed an argument, switch to automatic mode
     if (qApp->arguments().size() > 2) {
         d->autoMode = true;
-        d->fileName = qApp->arguments().at(1);
+        d->fileNames << qApp->arguments().at(1);
     } else {
         d->autoMode = false;
-        d->fileName.clear();
+        d->fileNames.clear();
     }
 
     d->pc = pc;
@@ -88,6 +95,8 @@ MainWindow::MainWindow(mb::patcher::PatcherConfig *pc, QWidget *parent)
             d->task, &QObject::deleteLater);
     connect(this, &MainWindow::runThread,
             d->task, &PatcherTask::patch);
+    connect(d->task, &PatcherTask::jobFinished,
+            this, &MainWindow::onJobFinished);
     connect(d->task, &PatcherTask::finished,
             this, &MainWindow::onPatchingFinished);
     connect(d->task, &PatcherTask::progressUpdated,
@@ -98,22 +107,46 @@ MainWindow::MainWindow(mb::patcher::PatcherConfig *pc, QWidget *parent)
             this, &MainWindow::onDetailsUpdated);
 
     d->thread->start();
+
+    // Create file inspection thread so that large archives don't block the
+    // UI when they are chosen
+    d->inspectThread = new QThread(this);
+    d->inspector = new FileInspectorTask();
+    d->inspector->moveToThread(d->inspectThread);
+
+    connect(d->inspectThread, &QThread::finished,
+            d->inspector, &QObject::deleteLater);
+    connect(this, &MainWindow::runInspection,
+            d->inspector, &FileInspectorTask::inspect);
+    connect(d->inspector, &FileInspectorTask::inspected,
+            this, &MainWindow::onFilesInspected);
+
+    d->inspectThread->start();
 }
 
 MainWindow::~MainWindow()
 {
     Q_D(MainWindow);
 
-    if (d->patcher) {
-        d->patcher->cancel_patching();
-        d->pc->destroy_patcher(d->patcher);
-        d->patcher = nullptr;
+    if (d->batch) {
+        d->batch->cancel_all();
+    }
+
+    if (d->inspectThread != nullptr) {
+        // Stop any running inspection
+        d->inspector->setGeneration(++d->inspectGeneration);
+        d->inspectThread->quit();
+        d->inspectThread->wait();
     }
 
     if (d->thread != nullptr) {
         d->thread->quit();
         d->thread->wait();
     }
+
+    // The batch can only be freed once the worker thread is done with it
+    delete d->batch;
+    d->batch = nullptr;
 }
 
 void MainWindow::onDeviceSelected(int index)
@@ -206,14 +239,15 @@ void MainWindow::onChooseFileItemClicked(QAction *action)
 
     if (action == d->chooseFlashableZip) {
         d->patcherId = QStringLiteral("ZipPatcher");
-        chooseFile(tr("Flashable zips (*.zip)"));
+        chooseFiles(tr("Flashable zips (*.zip)"));
     } else if (action == d->chooseOdinImage) {
         d->patcherId = QStringLiteral("OdinPatcher");
-        chooseFile(tr("Odin images (*.zip *.tar.md5 *.tar.md5.gz *.tar.md5.xz)"));
+        chooseFiles(tr("Odin images (*.zip *.tar.md5 *.tar.md5.gz *.tar.md5.xz)"));
     }
 }
 
-void MainWindow::onProgressUpdated(uint64_t bytes, uint64_t maxBytes)
+void MainWindow::onProgressUpdated(uint64_t bytes, uint64_t maxBytes,
+                                   uint64_t elapsedMs)
 {
     Q_D(MainWindow);
 
@@ -234,6 +268,7 @@ void MainWindow::onProgressUpdated(uint64_t bytes, uint64_t maxBytes)
     d->progressBar->setValue(value);
     d->bytes = bytes;
     d->maxBytes = maxBytes;
+    d->elapsedMs = elapsedMs;
 
     updateProgressText();
 }
@@ -255,22 +290,42 @@ void MainWindow::onDetailsUpdated(const QString &text)
     d->detailsLbl->setText(text);
 }
 
-void MainWindow::onPatchingFinished(const QString &newFile, bool failed,
-                                    const QString &errorMessage)
+void MainWindow::onJobFinished(int job, bool failed,
+                               const QString &errorMessage)
 {
     Q_D(MainWindow);
 
-    d->pc->destroy_patcher(d->patcher);
-    d->patcher = nullptr;
+    d->patcherFailed[job] = failed;
+    d->patcherErrors[job] = errorMessage;
+}
 
-    d->patcherNewFile = newFile;
-    d->patcherFailed = failed;
-    d->patcherError = errorMessage;
+void MainWindow::onPatchingFinished()
+{
+    Q_D(MainWindow);
+
+    delete d->batch;
+    d->batch = nullptr;
 
     d->state = MainWindowPrivate::FinishedPatching;
     updateWidgetsVisibility();
 }
 
+void MainWindow::onFilesInspected(quint64 generation,
+                                  const FileInspectionResults &results)
+{
+    Q_D(MainWindow);
+
+    // Ignore results for files that are no longer selected
+    if (generation != d->inspectGeneration) {
+        return;
+    }
+
+    d->inspecting = false;
+    d->inspections = results;
+
+    updateWidgetsVisibility();
+}
+
 void MainWindow::updateProgressText()
 {
     Q_D(MainWindow);
@@ -280,8 +335,14 @@ void MainWindow::updateProgressText()
         percentage = 100.0 * d->bytes / d->maxBytes;
     }
 
-    d->progressBar->setFormat(tr("%1% - %2 / %3 files")
-            .arg(percentage, 0, 'f', 2).arg(d->files).arg(d->maxFiles));
+    double mibPerSec = 0.0;
+    if (d->elapsedMs != 0) {
+        mibPerSec = d->bytes / 1048576.0 / (d->elapsedMs / 1000.0);
+    }
+
+    d->progressBar->setFormat(tr("%1% - %2 / %3 files - %4 MiB/s")
+            .arg(percentage, 0, 'f', 2).arg(d->files).arg(d->maxFiles)
+            .arg(mibPerSec, 0, 'f', 1));
 }
 
 void MainWindow::addWidgets()
@@ -499,27 +560,82 @@ void MainWindow::populateInstallationLocations()
     d->instLocSel->addItem(tr("Extsd-slot"));
 }
 
-void MainWindow::chooseFile(const QString &patterns)
+void MainWindow::chooseFiles(const QString &patterns)
 {
     Q_D(MainWindow);
 
-    QString fileName = QFileDialog::getOpenFileName(this, QString(),
+    QStringList fileNames = QFileDialog::getOpenFileNames(this, QString(),
             d->settings.value(QStringLiteral("last_dir")).toString(),
             patterns);
-    if (fileName.isNull()) {
+    if (fileNames.isEmpty()) {
         return;
     }
 
     d->settings.setValue(QStringLiteral("last_dir"),
-                         QFileInfo(fileName).dir().absolutePath());
+                         QFileInfo(fileNames.first()).dir().absolutePath());
 
     d->state = MainWindowPrivate::ChoseFile;
 
-    d->fileName = fileName;
+    d->fileNames = fileNames;
 
+    inspectFiles();
     updateWidgetsVisibility();
 }
 
+void MainWindow::inspectFiles()
+{
+    Q_D(MainWindow);
+
+    // Cancels the inspection of the previously selected files
+    d->inspector->setGeneration(++d->inspectGeneration);
+
+    d->inspecting = true;
+    d->inspections.clear();
+
+    emit runInspection(d->inspectGeneration, d->fileNames);
+}
+
+QStringList MainWindow::inspectionWarnings()
+{
+    Q_D(MainWindow);
+
+    QStringList warnings;
+
+    for (const FileInspectionResult &result : d->inspections) {
+        QString name = QFileInfo(result.fileName).fileName();
+        const mb::patcher::FileInspection &info = result.inspection;
+
+        if (result.error != mb::patcher::ErrorCode::NoError) {
+            warnings << tr("%1: Failed to inspect file: %2")
+                    .arg(name).arg(errorToString(result.error));
+            continue;
+        }
+
+        if (d->patcherId == QStringLiteral("ZipPatcher")) {
+            if (info.format != mb::patcher::FileFormat::Zip) {
+                warnings << tr("%1: Not a zip file").arg(name);
+            } else if (!info.has_updater_script) {
+                warnings << tr("%1: Not a flashable zip (no updater-script)")
+                        .arg(name);
+            }
+        } else if (info.format == mb::patcher::FileFormat::Unknown) {
+            warnings << tr("%1: Not an Odin image").arg(name);
+        }
+
+        if (!mb::patcher::inspection_matches_device(info, d->device)) {
+            QStringList codenames;
+            for (const std::string &codename : info.devices) {
+                codenames << QString::fromStdString(codename);
+            }
+
+            warnings << tr("%1: File is for %2, not the selected device")
+                    .arg(name).arg(codenames.join(QStringLiteral(", ")));
+        }
+    }
+
+    return warnings;
+}
+
 void MainWindow::updateWidgetsVisibility()
 {
     Q_D(MainWindow);
@@ -542,16 +658,44 @@ void MainWindow::updateWidgetsVisibility()
     }
 
     if (d->state == MainWindowPrivate::ChoseFile) {
-        d->messageLbl->setText(tr("File: %1").arg(d->fileName));
-    } else if (d->state == MainWindowPrivate::FinishedPatching) {
         QString message;
 
-        if (d->patcherFailed) {
-            message.append(tr("Failed to patch file: %1\n\n").arg(d->fileName));
-            message.append(d->patcherError);
+        if (d->fileNames.size() == 1) {
+            message = tr("File: %1").arg(d->fileNames.first());
         } else {
-            message.append(tr("New file: %1\n\n").arg(d->patcherNewFile));
-            message.append(tr("Successfully patched file"));
+            message = tr("Files:\n%1").arg(
+                    d->fileNames.join(QStringLiteral("\n")));
+        }
+
+        if (d->inspecting) {
+            message.append(QStringLiteral("\n\n"));
+            message.append(tr("Inspecting files..."));
+        } else {
+            QStringList warnings = inspectionWarnings();
+            if (!warnings.isEmpty()) {
+                message.append(QStringLiteral("\n\n"));
+                message.append(warnings.join(QStringLiteral("\n")));
+            }
+        }
+
+        d->messageLbl->setText(message);
+    } else if (d->state == MainWindowPrivate::FinishedPatching) {
+        QString message;
+
+        for (int i = 0; i < d->fileNames.size(); ++i) {
+            if (i > 0) {
+                message.append(QStringLiteral("\n\n"));
+            }
+
+            if (d->patcherFailed[i]) {
+                message.append(tr("Failed to patch file: %1\n")
+                        .arg(d->fileNames[i]));
+                message.append(d->patcherErrors[i]);
+            } else {
+                message.append(tr("New file: %1\n")
+                        .arg(d->patcherNewFiles[i]));
+                message.append(tr("Successfully patched file"));
+            }
         }
 
         d->messageLbl->setText(message);
@@ -564,6 +708,7 @@ void MainWindow::startPatching()
 
     d->bytes = 0;
     d->maxBytes = 0;
+    d->elapsedMs = 0;
     d->files = 0;
     d->maxFiles = 0;
 
@@ -590,42 +735,52 @@ void MainWindow::startPatching()
     suffixes << QStringLiteral(".tar.md5.xz");
     suffixes << QStringLiteral(".zip");
 
-    QFileInfo qFileInfo(d->fileName);
-    QString suffix;
-    QString outputName;
-
-    for (const QString &suffix : suffixes) {
-        if (d->fileName.endsWith(suffix)) {
-            // Input name: <parent path>/<base name>.<suffix>
-            // Output name: <parent path>/<base name>_<rom id>.zip
-            outputName = d->fileName.left(d->fileName.size() - suffix.size())
+    d->batch = new mb::patcher::BatchPatcher(d->pc);
+    d->patcherNewFiles.clear();
+    d->patcherFailed.clear();
+    d->patcherErrors.clear();
+
+    for (const QString &fileName : d->fileNames) {
+        QFileInfo qFileInfo(fileName);
+        QString outputName;
+
+        for (const QString &suffix : suffixes) {
+            if (fileName.endsWith(suffix)) {
+                // Input name: <parent path>/<base name>.<suffix>
+                // Output name: <parent path>/<base name>_<rom id>.zip
+                outputName = fileName.left(fileName.size() - suffix.size())
+                        % QStringLiteral("_")
+                        % romId
+                        % QStringLiteral(".zip");
+                break;
+            }
+        }
+        if (outputName.isEmpty()) {
+            outputName = qFileInfo.completeBaseName()
                     % QStringLiteral("_")
                     % romId
-                    % QStringLiteral(".zip");
-            break;
+                    % QStringLiteral(".")
+                    % qFileInfo.suffix();
         }
-    }
-    if (outputName.isEmpty()) {
-        outputName = qFileInfo.completeBaseName()
-                % QStringLiteral("_")
-                % romId
-                % QStringLiteral(".")
-                % qFileInfo.suffix();
-    }
 
-    QString inputPath(QDir::toNativeSeparators(qFileInfo.filePath()));
-    QString outputPath(QDir::toNativeSeparators(
-            qFileInfo.dir().filePath(outputName)));
+        QString inputPath(QDir::toNativeSeparators(qFileInfo.filePath()));
+        QString outputPath(QDir::toNativeSeparators(
+                qFileInfo.dir().filePath(outputName)));
+
+        mb::patcher::FileInfo fileInfo;
+        fileInfo.set_input_path(inputPath.toUtf8().constData());
+        fileInfo.set_output_path(outputPath.toUtf8().constData());
+        fileInfo.set_device(d->device);
+        fileInfo.set_rom_id(romId.toUtf8().constData());
 
-    FileInfoPtr fileInfo = new mb::patcher::FileInfo();
-    fileInfo->set_input_path(inputPath.toUtf8().constData());
-    fileInfo->set_output_path(outputPath.toUtf8().constData());
-    fileInfo->set_device(d->device);
-    fileInfo->set_rom_id(romId.toUtf8().constData());
+        d->batch->add_job(d->patcherId.toStdString(), fileInfo);
 
-    d->patcher = d->pc->create_patcher(d->patcherId.toStdString());
+        d->patcherNewFiles << outputPath;
+        d->patcherFailed << true;
+        d->patcherErrors << QString();
+    }
 
-    emit runThread(d->patcher, fileInfo);
+    emit runThread(d->batch);
 }
 
 QWidget * MainWindow::newHorizLine(QWidget *parent)
@@ -676,6 +831,8 @@ static QString errorToString(const mb::patcher::ErrorCode &error) {
         return QObject::tr("Failed to close archive");
     case mb::patcher::ErrorCode::ArchiveFreeError:
         return QObject::tr("Failed to free archive header memory");
+    case mb::patcher::ErrorCode::ArchiveChecksumMismatch:
+        return QObject::tr("Archive checksum does not match");
     case mb::patcher::ErrorCode::PatchingCancelled:
         return QObject::tr("Patching was cancelled");
     default:
@@ -691,58 +848,169 @@ PatcherTask::PatcherTask(QWidget *parent)
 {
 }
 
-static void progressUpdatedCbWrapper(uint64_t bytes, uint64_t maxBytes,
-                                     void *userData)
+static void progressUpdatedCbWrapper(size_t job, uint64_t bytes,
+                                     uint64_t maxBytes, void *userData)
 {
     PatcherTask *task = static_cast<PatcherTask *>(userData);
-    task->progressUpdatedCb(bytes, maxBytes);
+    task->progressUpdatedCb(job, bytes, maxBytes);
 }
 
-static void filesUpdatedCbWrapper(uint64_t files, uint64_t maxFiles,
-                                  void *userData)
+static void filesUpdatedCbWrapper(size_t job, uint64_t files,
+                                  uint64_t maxFiles, void *userData)
 {
     PatcherTask *task = static_cast<PatcherTask *>(userData);
-    task->filesUpdatedCb(files, maxFiles);
+    task->filesUpdatedCb(job, files, maxFiles);
 }
 
-static void detailsUpdatedCbWrapper(const std::string &text, void *userData)
+static void detailsUpdatedCbWrapper(size_t job, const std::string &text,
+                                    void *userData)
 {
     PatcherTask *task = static_cast<PatcherTask *>(userData);
-    task->detailsUpdatedCb(text);
+    task->detailsUpdatedCb(job, text);
 }
 
-void PatcherTask::patch(PatcherPtr patcher, FileInfoPtr info)
+static void jobFinishedCbWrapper(size_t job,
+                                 mb::patcher::BatchPatcher::JobState state,
+                                 mb::patcher::ErrorCode error,
+                                 void *userData)
 {
-    patcher->set_file_info(info);
+    PatcherTask *task = static_cast<PatcherTask *>(userData);
+    task->jobFinishedCb(job, state, error);
+}
+
+void PatcherTask::patch(BatchPatcherPtr batch)
+{
+    m_batch = batch;
+    m_files.assign(batch->job_count(), 0);
+    m_maxFiles.assign(batch->job_count(), 0);
+
+    // Use one patcher per CPU core
+    batch->run(0, &progressUpdatedCbWrapper, &filesUpdatedCbWrapper,
+               &detailsUpdatedCbWrapper, &jobFinishedCbWrapper, this);
+
+    m_batch = nullptr;
 
-    bool ret = patcher->patch_file(&progressUpdatedCbWrapper,
-                                   &filesUpdatedCbWrapper,
-                                   &detailsUpdatedCbWrapper,
-                                   this);
+    emit finished();
+}
 
-    QString newFile(QString::fromStdString(info->output_path()));
+void PatcherTask::progressUpdatedCb(size_t job, uint64_t bytes,
+                                    uint64_t maxBytes)
+{
+    (void) job;
+    (void) bytes;
+    (void) maxBytes;
 
-    patcher->set_file_info(nullptr);
-    delete info;
+    // Report the progress of the whole batch
+    auto stats = m_batch->stats();
+    emit progressUpdated(stats.bytes, stats.max_bytes, stats.elapsed_ms);
+}
 
-    if (!ret) {
-        emit finished(QString(), true, errorToString(patcher->error()));
+void PatcherTask::filesUpdatedCb(size_t job, uint64_t files,
+                                 uint64_t maxFiles)
+{
+    m_files[job] = files;
+    m_maxFiles[job] = maxFiles;
+
+    uint64_t totalFiles = 0;
+    uint64_t totalMaxFiles = 0;
+    for (size_t i = 0; i < m_files.size(); ++i) {
+        totalFiles += m_files[i];
+        totalMaxFiles += m_maxFiles[i];
+    }
+
+    emit filesUpdated(totalFiles, totalMaxFiles);
+}
+
+void PatcherTask::detailsUpdatedCb(size_t job, const std::string &text)
+{
+    emit detailsUpdated(QStringLiteral("[%1/%2] %3")
+            .arg(job + 1).arg(m_files.size())
+            .arg(QString::fromStdString(text)));
+}
+
+void PatcherTask::jobFinishedCb(size_t job,
+                                mb::patcher::BatchPatcher::JobState state,
+                                mb::patcher::ErrorCode error)
+{
+    if (state == mb::patcher::BatchPatcher::JobState::Succeeded) {
+        emit jobFinished(static_cast<int>(job), false, QString());
     } else {
-        emit finished(newFile, false, QString());
+        emit jobFinished(static_cast<int>(job), true, errorToString(error));
     }
 }
 
-void PatcherTask::progressUpdatedCb(uint64_t bytes, uint64_t maxBytes)
+
+struct InspectCancelCtx
+{
+    const FileInspectorTask *task;
+    quint64 generation;
+};
+
+static bool inspectCancelledCbWrapper(void *userData)
+{
+    InspectCancelCtx *ctx = static_cast<InspectCancelCtx *>(userData);
+    return ctx->task->isCancelled(ctx->generation);
+}
+
+FileInspectorTask::FileInspectorTask(QObject *parent)
+    : QObject(parent), m_generation(0)
+{
+}
+
+void FileInspectorTask::setGeneration(quint64 generation)
 {
-    emit progressUpdated(bytes, maxBytes);
+    m_generation = generation;
 }
 
-void PatcherTask::filesUpdatedCb(uint64_t files, uint64_t maxFiles)
+bool FileInspectorTask::isCancelled(quint64 generation) const
 {
-    emit filesUpdated(files, maxFiles);
+    return m_generation != generation;
 }
 
-void PatcherTask::detailsUpdatedCb(const std::string &text)
+void FileInspectorTask::inspect(quint64 generation,
+                                const QStringList &fileNames)
 {
-    emit detailsUpdated(QString::fromStdString(text));
+    FileInspectionResults results;
+
+    for (const QString &fileName : fileNames) {
+        // Don't bother reporting anything if other files were chosen
+        if (isCancelled(generation)) {
+            return;
+        }
+
+        QFileInfo qFileInfo(fileName);
+        QString key = qFileInfo.absoluteFilePath();
+        QDateTime mtime = qFileInfo.lastModified();
+        qint64 size = qFileInfo.size();
+
+        // Reuse the results if the file hasn't changed
+        auto it = m_cache.constFind(key);
+        if (it != m_cache.constEnd() && it->mtime == mtime
+                && it->size == size) {
+            results << it->result;
+            continue;
+        }
+
+        FileInspectionResult result;
+        result.fileName = fileName;
+
+        InspectCancelCtx ctx{this, generation};
+        QString path(QDir::toNativeSeparators(qFileInfo.filePath()));
+
+        result.error = mb::patcher::inspect_file(
+                path.toUtf8().constData(), result.inspection,
+                &inspectCancelledCbWrapper, &ctx);
+        if (result.error == mb::patcher::ErrorCode::PatchingCancelled) {
+            return;
+        }
+
+        if (m_cache.size() >= maxCachedInspections) {
+            m_cache.clear();
+        }
+        m_cache.insert(key, CacheEntry{mtime, size, result});
+
+        results << result;
+    }
+
+    emit inspected(generation, results);
 }
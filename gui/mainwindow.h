@@ -20,19 +20,35 @@
 #ifndef MAINWINDOW_H
 #define MAINWINDOW_H
 
+#include <mbpatcher/batchpatcher.h>
 #include <mbpatcher/fileinfo.h>
+#include <mbpatcher/fileinspector.h>
 #include <mbpatcher/patcherconfig.h>
 #include <mbpatcher/patcherinterface.h>
 
+#include <atomic>
+#include <vector>
+
+#include <QtCore/QDateTime>
+#include <QtCore/QHash>
 #include <QtCore/QMetaType>
+#include <QtCore/QStringList>
 #include <QtWidgets/QAbstractButton>
 #include <QtWidgets/QWidget>
 
 
-typedef mb::patcher::Patcher * PatcherPtr;
-Q_DECLARE_METATYPE(PatcherPtr)
-typedef mb::patcher::FileInfo * FileInfoPtr;
-Q_DECLARE_METATYPE(FileInfoPtr)
+typedef mb::patcher::BatchPatcher * BatchPatcherPtr;
+Q_DECLARE_METATYPE(BatchPatcherPtr)
+
+struct FileInspectionResult
+{
+    QString fileName;
+    mb::patcher::ErrorCode error = mb::patcher::ErrorCode::NoError;
+    mb::patcher::FileInspection inspection;
+};
+
+typedef QList<FileInspectionResult> FileInspectionResults;
+Q_DECLARE_METATYPE(FileInspectionResults)
 
 class MainWindowPrivate;
 
@@ -45,7 +61,8 @@ public:
     ~MainWindow();
 
 signals:
-    void runThread(PatcherPtr patcher, FileInfoPtr info);
+    void runThread(BatchPatcherPtr batch);
+    void runInspection(quint64 generation, const QStringList &fileNames);
 
 private slots:
     void onDeviceSelected(int index);
@@ -55,12 +72,16 @@ private slots:
     void onChooseFileItemClicked(QAction *action);
 
     // Progress
-    void onProgressUpdated(uint64_t bytes, uint64_t maxBytes);
+    void onProgressUpdated(uint64_t bytes, uint64_t maxBytes,
+                           uint64_t elapsedMs);
     void onFilesUpdated(uint64_t files, uint64_t maxFiles);
     void onDetailsUpdated(const QString &text);
 
-    void onPatchingFinished(const QString &newFile, bool failed,
-                            const QString &errorMessage);
+    void onJobFinished(int job, bool failed, const QString &errorMessage);
+    void onPatchingFinished();
+
+    void onFilesInspected(quint64 generation,
+                          const FileInspectionResults &results);
 
 private:
     virtual void closeEvent(QCloseEvent *event) override;
@@ -73,7 +94,9 @@ private:
     void populateDevices();
     void populateInstallationLocations();
 
-    void chooseFile(const QString &patterns);
+    void chooseFiles(const QString &patterns);
+    void inspectFiles();
+    QStringList inspectionWarnings();
     void startPatching();
 
     void updateWidgetsVisibility();
@@ -93,18 +116,57 @@ class PatcherTask : public QObject
 public:
     PatcherTask(QWidget *parent = 0);
 
-    void patch(PatcherPtr patcher, FileInfoPtr info);
+    void patch(BatchPatcherPtr batch);
 
-    void progressUpdatedCb(uint64_t bytes, uint64_t maxBytes);
-    void filesUpdatedCb(uint64_t files, uint64_t maxFiles);
-    void detailsUpdatedCb(const std::string &text);
+    void progressUpdatedCb(size_t job, uint64_t bytes, uint64_t maxBytes);
+    void filesUpdatedCb(size_t job, uint64_t files, uint64_t maxFiles);
+    void detailsUpdatedCb(size_t job, const std::string &text);
+    void jobFinishedCb(size_t job, mb::patcher::BatchPatcher::JobState state,
+                       mb::patcher::ErrorCode error);
 
 signals:
-    void finished(const QString &newFile, bool failed,
-                  const QString &errorMessage);
-    void progressUpdated(uint64_t bytes, uint64_t maxBytes);
+    void jobFinished(int job, bool failed, const QString &errorMessage);
+    void finished();
+    void progressUpdated(uint64_t bytes, uint64_t maxBytes,
+                         uint64_t elapsedMs);
     void filesUpdated(uint64_t files, uint64_t maxFiles);
     void detailsUpdated(const QString &text);
+
+private:
+    BatchPatcherPtr m_batch = nullptr;
+    // Per-job file counts (the batch callbacks are never run concurrently)
+    std::vector<uint64_t> m_files;
+    std::vector<uint64_t> m_maxFiles;
+};
+
+class FileInspectorTask : public QObject
+{
+    Q_OBJECT
+
+public:
+    FileInspectorTask(QObject *parent = 0);
+
+    void inspect(quint64 generation, const QStringList &fileNames);
+
+    // May be called from any thread. Requests with an older generation are
+    // cancelled.
+    void setGeneration(quint64 generation);
+    bool isCancelled(quint64 generation) const;
+
+signals:
+    void inspected(quint64 generation, const FileInspectionResults &results);
+
+private:
+    struct CacheEntry
+    {
+        QDateTime mtime;
+        qint64 size;
+        FileInspectionResult result;
+    };
+
+    std::atomic<quint64> m_generation;
+    // Results keyed by absolute path (only accessed from the task's thread)
+    QHash<QString, CacheEntry> m_cache;
 };
 
 #endif // MAINWINDOW_H
@@ -65,6 +65,7 @@ public:
 
     uint64_t bytes;
     uint64_t maxBytes;
+    uint64_t elapsedMs;
     uint64_t files;
     uint64_t maxFiles;
 
@@ -73,25 +74,32 @@ public:
     // Current state of the patcher
     State state = FirstRun;
 
-    // Selected file
+    // Selected files
     QString patcherId;
-    QString fileName;
+    QStringList fileNames;
     bool autoMode;
 
     mb::patcher::PatcherConfig *pc = nullptr;
     std::vector<ScopedDevice> devices;
 
-    // Selected patcher
-    mb::patcher::Patcher *patcher = nullptr;
+    // Running batch
+    mb::patcher::BatchPatcher *batch = nullptr;
 
-    // Patcher finish status and error message
-    QString patcherNewFile;
-    bool patcherFailed;
-    QString patcherError;
+    // Per-file output path, finish status, and error message
+    QStringList patcherNewFiles;
+    QList<bool> patcherFailed;
+    QStringList patcherErrors;
 
     // Threads
     QThread *thread;
     PatcherTask *task;
+    QThread *inspectThread;
+    FileInspectorTask *inspector;
+
+    // Inspection results for the selected files
+    quint64 inspectGeneration = 0;
+    bool inspecting = false;
+    FileInspectionResults inspections;
 
     // Selected device
     Device *device = nullptr;
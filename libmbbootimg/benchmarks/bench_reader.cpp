@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "mbcommon/file/memory.h"
+
+#include "mbbootimg/reader.h"
+
+#include "images.h"
+
+typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+
+static std::unique_ptr<mb::File> open_image(const BenchImage &image, bool fd,
+                                            std::string &error)
+{
+    auto const &data = bench_image_data(image);
+    if (data.empty()) {
+        error = "Failed to generate image";
+        return nullptr;
+    }
+
+#ifndef _WIN32
+    if (fd) {
+        return bench_open_temp_file(data, error);
+    }
+#else
+    (void) fd;
+#endif
+
+    return std::unique_ptr<mb::File>(
+            new mb::MemoryFile(data.data(), data.size()));
+}
+
+// Open the image and read the header with a new reader. With autodetection
+// enabled, this includes the bids of all formats.
+static bool read_header(benchmark::State &state, const BenchImage &image,
+                        mb::File &file, bool autodetect, ScopedReader &bir)
+{
+    MbBiHeader *header;
+
+    bir.reset(mb_bi_reader_new());
+    if (!bir) {
+        state.SkipWithError("Failed to allocate reader");
+        return false;
+    }
+
+    int ret = autodetect
+            ? mb_bi_reader_enable_format_all(bir.get())
+            : mb_bi_reader_set_format_by_name(bir.get(), image.format);
+    if (ret != MB_BI_OK
+            || !file.seek(0, SEEK_SET, nullptr)
+            || mb_bi_reader_open(bir.get(), &file, false) != MB_BI_OK
+            || mb_bi_reader_read_header(bir.get(), &header) != MB_BI_OK) {
+        state.SkipWithError(mb_bi_reader_error_string(bir.get()));
+        return false;
+    }
+
+    if (strcmp(mb_bi_reader_format_name(bir.get()), image.format) != 0) {
+        state.SkipWithError("Detected wrong format");
+        return false;
+    }
+
+    return true;
+}
+
+static void BM_ReadHeader(benchmark::State &state, const BenchImage *image,
+                          bool fd, bool autodetect)
+{
+    std::string error;
+    auto file = open_image(*image, fd, error);
+    if (!file) {
+        state.SkipWithError(error.c_str());
+        return;
+    }
+
+    for (auto _ : state) {
+        ScopedReader bir(nullptr, &mb_bi_reader_free);
+        if (!read_header(state, *image, *file, autodetect, bir)) {
+            break;
+        }
+    }
+}
+
+// Args: read buffer size
+static void BM_ReadEntries(benchmark::State &state, const BenchImage *image,
+                           bool fd)
+{
+    std::string error;
+    auto file = open_image(*image, fd, error);
+    if (!file) {
+        state.SkipWithError(error.c_str());
+        return;
+    }
+
+    std::vector<unsigned char> buf(static_cast<size_t>(state.range(0)));
+    uint64_t total = 0;
+
+    for (auto _ : state) {
+        ScopedReader bir(nullptr, &mb_bi_reader_free);
+        if (!read_header(state, *image, *file, false, bir)) {
+            break;
+        }
+
+        MbBiEntry *entry;
+        size_t n;
+        int ret;
+
+        while ((ret = mb_bi_reader_read_entry(bir.get(), &entry))
+                == MB_BI_OK) {
+            while ((ret = mb_bi_reader_read_data(bir.get(), buf.data(),
+                                                 buf.size(), &n))
+                    == MB_BI_OK) {
+                total += n;
+            }
+            if (ret != MB_BI_EOF) {
+                break;
+            }
+        }
+
+        if (ret != MB_BI_EOF) {
+            state.SkipWithError(mb_bi_reader_error_string(bir.get()));
+            break;
+        }
+    }
+
+    state.SetBytesProcessed(static_cast<int64_t>(total));
+}
+
+static void BM_ReadEntriesView(benchmark::State &state,
+                               const BenchImage *image, bool fd)
+{
+    std::string error;
+    auto file = open_image(*image, fd, error);
+    if (!file) {
+        state.SkipWithError(error.c_str());
+        return;
+    }
+
+    uint64_t total = 0;
+
+    for (auto _ : state) {
+        ScopedReader bir(nullptr, &mb_bi_reader_free);
+        if (!read_header(state, *image, *file, false, bir)) {
+            break;
+        }
+
+        MbBiEntry *entry;
+        const void *data;
+        size_t n;
+        int ret;
+
+        while ((ret = mb_bi_reader_read_entry(bir.get(), &entry))
+                == MB_BI_OK) {
+            while ((ret = mb_bi_reader_read_data_view(bir.get(), &data,
+                                                      SIZE_MAX, &n))
+                    == MB_BI_OK) {
+                benchmark::DoNotOptimize(data);
+                total += n;
+            }
+            if (ret != MB_BI_EOF) {
+                break;
+            }
+        }
+
+        if (ret != MB_BI_EOF) {
+            state.SkipWithError(mb_bi_reader_error_string(bir.get()));
+            break;
+        }
+    }
+
+    state.SetBytesProcessed(static_cast<int64_t>(total));
+}
+
+static int register_benchmarks()
+{
+    const char *backends[] = { "memory", "fd" };
+
+    for (size_t i = 0; i < bench_images_count; ++i) {
+        const BenchImage *image = &bench_images[i];
+
+        for (size_t j = 0; j < sizeof(backends) / sizeof(backends[0]); ++j) {
+#ifdef _WIN32
+            if (j == 1) {
+                continue;
+            }
+#endif
+            std::string suffix = std::string("/") + image->name + "/"
+                    + backends[j];
+            bool fd = j == 1;
+
+            benchmark::RegisterBenchmark(
+                    ("BM_ReadHeaderAutodetect" + suffix).c_str(),
+                    &BM_ReadHeader, image, fd, true);
+            benchmark::RegisterBenchmark(
+                    ("BM_ReadHeader" + suffix).c_str(),
+                    &BM_ReadHeader, image, fd, false);
+            benchmark::RegisterBenchmark(
+                    ("BM_ReadEntries" + suffix).c_str(),
+                    &BM_ReadEntries, image, fd)
+                ->ArgName("bsize")
+                ->Arg(10240)
+                ->Arg(1024 * 1024);
+            benchmark::RegisterBenchmark(
+                    ("BM_ReadEntriesView" + suffix).c_str(),
+                    &BM_ReadEntriesView, image, fd);
+        }
+    }
+
+    return 0;
+}
+
+BENCHMARK_UNUSED static int registered = register_benchmarks();
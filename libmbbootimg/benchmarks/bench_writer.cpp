@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cstdio>
+
+#include "mbcommon/file/memory.h"
+
+#include "images.h"
+
+// Args: write buffer size (0 to write each entry in a single call)
+static void BM_Write(benchmark::State &state, const BenchImage *image, bool fd)
+{
+    std::vector<unsigned char> buf;
+    std::unique_ptr<mb::File> file;
+    std::string error;
+
+    auto const &expected = bench_image_data(*image);
+    if (expected.empty()) {
+        state.SkipWithError("Failed to generate image");
+        return;
+    }
+
+#ifndef _WIN32
+    if (fd) {
+        file = bench_open_temp_file({}, error);
+        if (!file) {
+            state.SkipWithError(error.c_str());
+            return;
+        }
+    } else
+#endif
+    {
+        // Avoid measuring reallocations of the buffer
+        buf.reserve(expected.size());
+        file.reset(new mb::MemoryFile(&buf));
+    }
+
+    for (auto _ : state) {
+        if (!file->seek(0, SEEK_SET, nullptr) || !file->truncate(0)) {
+            state.SkipWithError(file->error_string().c_str());
+            break;
+        }
+
+        if (!bench_write_image(*image, *file,
+                               static_cast<size_t>(state.range(0)), error)) {
+            state.SkipWithError(error.c_str());
+            break;
+        }
+    }
+
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations())
+            * static_cast<int64_t>(expected.size()));
+}
+
+static int register_benchmarks()
+{
+    const char *backends[] = { "memory", "fd" };
+
+    for (size_t i = 0; i < bench_images_count; ++i) {
+        const BenchImage *image = &bench_images[i];
+
+        // Loki images can only be written with the device's aboot image
+        if (!image->writable) {
+            continue;
+        }
+
+        for (size_t j = 0; j < sizeof(backends) / sizeof(backends[0]); ++j) {
+#ifdef _WIN32
+            if (j == 1) {
+                continue;
+            }
+#endif
+            std::string name = std::string("BM_Write/") + image->name + "/"
+                    + backends[j];
+
+            benchmark::RegisterBenchmark(name.c_str(), &BM_Write, image, j == 1)
+                ->ArgName("bsize")
+                ->Arg(10240)
+                ->Arg(0);
+        }
+    }
+
+    return 0;
+}
+
+BENCHMARK_UNUSED static int registered = register_benchmarks();
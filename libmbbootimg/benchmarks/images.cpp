@@ -0,0 +1,384 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "images.h"
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <string>
+
+#include <cstdlib>
+#include <cstring>
+
+#ifndef _WIN32
+#  include <unistd.h>
+#endif
+
+#include "mbcommon/endian.h"
+#include "mbcommon/file/memory.h"
+#include "mbcommon/file_util.h"
+
+#ifndef _WIN32
+#  include "mbcommon/file/fd.h"
+#endif
+
+#include "mbbootimg/entry.h"
+#include "mbbootimg/format/align_p.h"
+#include "mbbootimg/format/android_p.h"
+#include "mbbootimg/format/loki_p.h"
+#include "mbbootimg/format/mtk_p.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/writer.h"
+
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+
+// Entry sizes roughly matching those of a modern device
+#define BENCH_PAGE_SIZE         2048
+#define BENCH_KERNEL_SIZE       (8 * 1024 * 1024)
+#define BENCH_RAMDISK_SIZE      (6 * 1024 * 1024)
+#define BENCH_DT_SIZE           (1 * 1024 * 1024)
+#define BENCH_SONY_IPL_SIZE     (256 * 1024)
+#define BENCH_SONY_RPM_SIZE     (256 * 1024)
+
+#define BENCH_KERNEL_ADDR       0x80208000
+#define BENCH_RAMDISK_ADDR      0x82200000
+#define BENCH_SECOND_ADDR       0x81100000
+#define BENCH_TAGS_ADDR         0x80200100
+
+// Size of the aboot copy at the end of old-style Loki images and of the fake
+// block before the device tree in new-style Loki images (non-LG devices)
+#define BENCH_LOKI_ABOOT_SIZE   0x200
+
+const BenchImage bench_images[] = {
+    { "android",  MB_BI_FORMAT_NAME_ANDROID,  true  },
+    { "bump",     MB_BI_FORMAT_NAME_BUMP,     true  },
+    { "loki_old", MB_BI_FORMAT_NAME_LOKI,     false },
+    { "loki_new", MB_BI_FORMAT_NAME_LOKI,     false },
+    { "mtk",      MB_BI_FORMAT_NAME_MTK,      true  },
+    { "sony_elf", MB_BI_FORMAT_NAME_SONY_ELF, true  },
+};
+const size_t bench_images_count = sizeof(bench_images) / sizeof(bench_images[0]);
+
+// Random data that never contains any of the magic strings or the gzip header
+// searched for by the readers
+static std::vector<unsigned char> make_data(size_t size, unsigned int seed)
+{
+    std::vector<unsigned char> data(size);
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> dist('a', 'y');
+
+    for (auto &c : data) {
+        c = static_cast<unsigned char>(dist(gen));
+    }
+
+    return data;
+}
+
+static std::vector<unsigned char> make_mtk_header(const char *type)
+{
+    std::vector<unsigned char> data(sizeof(MtkHeader), 0xff);
+
+    // The size is filled in by the writer
+    memcpy(data.data(), MTK_MAGIC, MTK_MAGIC_SIZE);
+    memset(data.data() + MTK_MAGIC_SIZE, 0, sizeof(uint32_t));
+    memset(data.data() + offsetof(MtkHeader, type), 0, MTK_TYPE_SIZE);
+    memcpy(data.data() + offsetof(MtkHeader, type), type, strlen(type));
+
+    return data;
+}
+
+static BenchEntries make_entries(const BenchImage &image)
+{
+    BenchEntries entries;
+    std::string name(image.name);
+
+    entries[MB_BI_ENTRY_KERNEL] = make_data(BENCH_KERNEL_SIZE, 1);
+    entries[MB_BI_ENTRY_RAMDISK] = make_data(BENCH_RAMDISK_SIZE, 2);
+
+    if (name == "mtk") {
+        entries[MB_BI_ENTRY_MTK_KERNEL_HEADER] = make_mtk_header("KERNEL");
+        entries[MB_BI_ENTRY_MTK_RAMDISK_HEADER] = make_mtk_header("ROOTFS");
+    } else if (name == "sony_elf") {
+        entries[MB_BI_ENTRY_SONY_IPL] = make_data(BENCH_SONY_IPL_SIZE, 4);
+        entries[MB_BI_ENTRY_SONY_RPM] = make_data(BENCH_SONY_RPM_SIZE, 5);
+    } else if (name == "loki_old") {
+        // Old-style Loki images have no device tree. The kernel size is found
+        // via the zImage header and the ramdisk via its gzip header.
+        auto &kernel = entries[MB_BI_ENTRY_KERNEL];
+        uint32_t kernel_size = mb_htole32(BENCH_KERNEL_SIZE);
+        memcpy(kernel.data() + 0x2c, &kernel_size, sizeof(kernel_size));
+
+        static const unsigned char gzip_header[] = { 0x1f, 0x8b, 0x08, 0x08 };
+        auto &ramdisk = entries[MB_BI_ENTRY_RAMDISK];
+        memcpy(ramdisk.data(), gzip_header, sizeof(gzip_header));
+    }
+
+    if (name != "loki_old" && name != "sony_elf") {
+        entries[MB_BI_ENTRY_DEVICE_TREE] = make_data(BENCH_DT_SIZE, 3);
+    }
+
+    return entries;
+}
+
+const BenchEntries & bench_image_entries(const BenchImage &image)
+{
+    static std::map<std::string, BenchEntries> cache;
+
+    auto it = cache.find(image.name);
+    if (it == cache.end()) {
+        it = cache.emplace(image.name, make_entries(image)).first;
+    }
+    return it->second;
+}
+
+static void append(std::vector<unsigned char> &data, const void *buf,
+                   size_t size)
+{
+    auto ptr = static_cast<const unsigned char *>(buf);
+    data.insert(data.end(), ptr, ptr + size);
+}
+
+static void append_padding(std::vector<unsigned char> &data)
+{
+    data.resize(data.size() + align_page_size<size_t>(data.size(),
+                                                      BENCH_PAGE_SIZE));
+}
+
+// The Loki writer needs the device's aboot image, so Loki images are assembled
+// by hand, mimicking the layout produced by the loki_tool versions that created
+// them
+static std::vector<unsigned char> make_loki_image(const BenchImage &image)
+{
+    auto const &entries = bench_image_entries(image);
+    auto const &kernel = entries.at(MB_BI_ENTRY_KERNEL);
+    auto const &ramdisk = entries.at(MB_BI_ENTRY_RAMDISK);
+    auto dt = entries.find(MB_BI_ENTRY_DEVICE_TREE);
+    bool new_style = dt != entries.end();
+
+    AndroidHeader ahdr = {};
+    memcpy(ahdr.magic, ANDROID_BOOT_MAGIC, ANDROID_BOOT_MAGIC_SIZE);
+    ahdr.kernel_size = mb_htole32(static_cast<uint32_t>(kernel.size()));
+    ahdr.kernel_addr = mb_htole32(BENCH_KERNEL_ADDR);
+    ahdr.ramdisk_size = mb_htole32(static_cast<uint32_t>(ramdisk.size()));
+    ahdr.ramdisk_addr = mb_htole32(BENCH_RAMDISK_ADDR);
+    ahdr.second_addr = mb_htole32(BENCH_SECOND_ADDR);
+    ahdr.tags_addr = mb_htole32(BENCH_TAGS_ADDR);
+    ahdr.page_size = mb_htole32(BENCH_PAGE_SIZE);
+    if (new_style) {
+        ahdr.dt_size = mb_htole32(static_cast<uint32_t>(dt->second.size()));
+    }
+    strcpy(reinterpret_cast<char *>(ahdr.cmdline), "console=null");
+
+    LokiHeader lhdr = {};
+    memcpy(lhdr.magic, LOKI_MAGIC, LOKI_MAGIC_SIZE);
+    if (new_style) {
+        lhdr.orig_kernel_size = mb_htole32(
+                static_cast<uint32_t>(kernel.size()));
+        lhdr.orig_ramdisk_size = mb_htole32(
+                static_cast<uint32_t>(ramdisk.size()));
+        lhdr.ramdisk_addr = mb_htole32(BENCH_RAMDISK_ADDR);
+    }
+
+    std::vector<unsigned char> data;
+    append(data, &ahdr, sizeof(ahdr));
+    data.resize(LOKI_MAGIC_OFFSET);
+    append(data, &lhdr, sizeof(lhdr));
+    append_padding(data);
+
+    append(data, kernel.data(), kernel.size());
+    append_padding(data);
+
+    append(data, ramdisk.data(), ramdisk.size());
+    append_padding(data);
+
+    if (new_style) {
+        // Shellcode with the original ramdisk address patched in
+        size_t offset = data.size();
+        uint32_t ramdisk_addr = mb_htole32(BENCH_RAMDISK_ADDR);
+
+        data.resize(offset + BENCH_LOKI_ABOOT_SIZE);
+        memcpy(data.data() + offset, LOKI_SHELLCODE, LOKI_SHELLCODE_SIZE);
+        memcpy(data.data() + offset + LOKI_SHELLCODE_SIZE - 5, &ramdisk_addr,
+               sizeof(ramdisk_addr));
+
+        append(data, dt->second.data(), dt->second.size());
+        append_padding(data);
+    } else {
+        // Copy of aboot
+        data.resize(data.size() + BENCH_LOKI_ABOOT_SIZE);
+    }
+
+    return data;
+}
+
+const std::vector<unsigned char> & bench_image_data(const BenchImage &image)
+{
+    static std::map<std::string, std::vector<unsigned char>> cache;
+
+    auto it = cache.find(image.name);
+    if (it == cache.end()) {
+        std::vector<unsigned char> data;
+
+        if (image.writable) {
+            // An empty image makes the benchmarks report an error
+            mb::MemoryFile file(&data);
+            std::string error;
+            if (!bench_write_image(image, file, 0, error)) {
+                data.clear();
+            }
+        } else {
+            data = make_loki_image(image);
+        }
+
+        it = cache.emplace(image.name, std::move(data)).first;
+    }
+    return it->second;
+}
+
+static int set_header_fields(MbBiHeader *header)
+{
+    int (*setters[])(MbBiHeader *, uint32_t) = {
+        &mb_bi_header_set_kernel_address,
+        &mb_bi_header_set_ramdisk_address,
+        &mb_bi_header_set_secondboot_address,
+        &mb_bi_header_set_kernel_tags_address,
+    };
+    uint32_t values[] = {
+        BENCH_KERNEL_ADDR,
+        BENCH_RAMDISK_ADDR,
+        BENCH_SECOND_ADDR,
+        BENCH_TAGS_ADDR,
+    };
+    int ret;
+
+    ret = mb_bi_header_set_page_size(header, BENCH_PAGE_SIZE);
+    if (ret != MB_BI_OK && ret != MB_BI_UNSUPPORTED) return ret;
+
+    ret = mb_bi_header_set_kernel_cmdline(header, "console=null");
+    if (ret != MB_BI_OK && ret != MB_BI_UNSUPPORTED) return ret;
+
+    for (size_t i = 0; i < sizeof(setters) / sizeof(setters[0]); ++i) {
+        ret = setters[i](header, values[i]);
+        if (ret != MB_BI_OK && ret != MB_BI_UNSUPPORTED) return ret;
+    }
+
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Write synthetic image with the libmbbootimg writer
+ *
+ * \param[in] image Image to write (must be writable)
+ * \param[in] file Opened file to write to
+ * \param[in] chunk_size Maximum size of each mb_bi_writer_write_data() call
+ *                       (0 to write each entry in a single call)
+ * \param[out] error Error message on failure
+ *
+ * \return Whether the image was successfully written
+ */
+bool bench_write_image(const BenchImage &image, mb::File &file,
+                       size_t chunk_size, std::string &error)
+{
+    auto const &entries = bench_image_entries(image);
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    size_t n;
+    int ret;
+
+    ScopedWriter biw(mb_bi_writer_new(), &mb_bi_writer_free);
+    if (!biw) {
+        error = "Failed to allocate writer";
+        return false;
+    }
+
+    if (mb_bi_writer_set_format_by_name(biw.get(), image.format) != MB_BI_OK
+            || mb_bi_writer_open(biw.get(), &file, false) != MB_BI_OK
+            || mb_bi_writer_get_header(biw.get(), &header) != MB_BI_OK
+            || set_header_fields(header) != MB_BI_OK
+            || mb_bi_writer_write_header(biw.get(), header) != MB_BI_OK) {
+        error = mb_bi_writer_error_string(biw.get());
+        return false;
+    }
+
+    while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
+        if (mb_bi_writer_write_entry(biw.get(), entry) != MB_BI_OK) {
+            error = mb_bi_writer_error_string(biw.get());
+            return false;
+        }
+
+        auto it = entries.find(mb_bi_entry_type(entry));
+        if (it == entries.end()) {
+            continue;
+        }
+
+        auto const &data = it->second;
+        size_t size = chunk_size ? chunk_size : data.size();
+
+        for (size_t offset = 0; offset < data.size(); offset += size) {
+            size_t to_write = std::min(size, data.size() - offset);
+
+            if (mb_bi_writer_write_data(biw.get(), data.data() + offset,
+                                        to_write, &n) != MB_BI_OK) {
+                error = mb_bi_writer_error_string(biw.get());
+                return false;
+            }
+        }
+    }
+
+    if (ret != MB_BI_EOF || mb_bi_writer_close(biw.get()) != MB_BI_OK) {
+        error = mb_bi_writer_error_string(biw.get());
+        return false;
+    }
+
+    return true;
+}
+
+#ifndef _WIN32
+/*!
+ * \brief Create anonymous temporary file backed by FdFile
+ *
+ * \param[in] contents Initial contents of the file
+ * \param[out] error Error message on failure
+ *
+ * \return File positioned at offset 0 or nullptr on failure
+ */
+std::unique_ptr<mb::File> bench_open_temp_file(
+        const std::vector<unsigned char> &contents, std::string &error)
+{
+    char path[] = "/tmp/mbbootimg_benchmark.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        error = "Failed to create temporary file";
+        return nullptr;
+    }
+    unlink(path);
+
+    std::unique_ptr<mb::File> file(new mb::FdFile(fd, true));
+    size_t n;
+
+    if (!mb::file_write_fully(*file, contents.data(), contents.size(), n)
+            || !file->seek(0, SEEK_SET, nullptr)) {
+        error = file->error_string();
+        return nullptr;
+    }
+
+    return file;
+}
+#endif
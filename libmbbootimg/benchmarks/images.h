@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cstddef>
+
+#include "mbcommon/file.h"
+
+// Synthetic boot image used by the benchmarks
+struct BenchImage
+{
+    // Benchmark label
+    const char *name;
+    // libmbbootimg format name
+    const char *format;
+    // Whether the writer for the format can produce the image
+    bool writable;
+};
+
+typedef std::map<int, std::vector<unsigned char>> BenchEntries;
+
+extern const BenchImage bench_images[];
+extern const size_t bench_images_count;
+
+const BenchEntries & bench_image_entries(const BenchImage &image);
+const std::vector<unsigned char> & bench_image_data(const BenchImage &image);
+
+bool bench_write_image(const BenchImage &image, mb::File &file,
+                       size_t chunk_size, std::string &error);
+
+#ifndef _WIN32
+std::unique_ptr<mb::File> bench_open_temp_file(
+        const std::vector<unsigned char> &contents, std::string &error);
+#endif
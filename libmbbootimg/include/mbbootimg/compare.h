@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/common.h"
+
+MB_BEGIN_C_DECLS
+
+struct MbBiHeader;
+struct MbBiReader;
+
+MB_EXPORT int mb_bi_header_equal(struct MbBiHeader *header1,
+                                 struct MbBiHeader *header2);
+MB_EXPORT int mb_bi_reader_compare(struct MbBiReader *bir1,
+                                   struct MbBiReader *bir2,
+                                   int *equal_out);
+
+MB_END_C_DECLS
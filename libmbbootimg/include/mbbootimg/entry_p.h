@@ -21,6 +21,7 @@
 
 #include "mbbootimg/guard_p.h"
 
+#include <cstddef>
 #include <cstdint>
 
 #define MB_BI_ENTRY_FIELD_TYPE      (1U << 0)
@@ -40,4 +41,11 @@ struct MbBiEntry
         // Entry size
         uint64_t size;
     } field;
+
+    // String storage that is kept when the entry is cleared so that it can be
+    // reused without allocating
+    struct {
+        char *name;
+        size_t name_size;
+    } pool;
 };
@@ -26,6 +26,7 @@
 #include "mbbootimg/entry.h"
 #include "mbbootimg/format/android_p.h"
 #include "mbbootimg/format/segment_writer_p.h"
+#include "mbbootimg/format/sha1_pipeline_p.h"
 #include "mbbootimg/header.h"
 #include "mbbootimg/writer.h"
 
@@ -42,7 +43,7 @@ struct AndroidWriterCtx
 
     bool is_bump;
 
-    SHA_CTX sha_ctx;
+    struct Sha1Pipeline *sha_pipeline;
 
     struct SegmentWriterCtx segctx;
 };
@@ -27,8 +27,21 @@
 #include "mbbootimg/reader.h"
 
 
+// Size of the windows used when scanning for gzip headers in files that cannot
+// be peeked into
+#define LOKI_GZIP_SCAN_WINDOW   (64 * 1024)
+
 MB_BEGIN_C_DECLS
 
+// Results of the scans needed to locate the images in old-style Loki images
+struct LokiOldLayout
+{
+    bool valid;
+    uint32_t kernel_size;
+    uint64_t gzip_offset;
+    uint32_t ramdisk_size;
+};
+
 struct LokiReaderCtx
 {
     // Header values
@@ -41,6 +54,9 @@ struct LokiReaderCtx
     bool have_loki_offset;
     uint64_t loki_offset;
 
+    // Cached old-style image layout
+    struct LokiOldLayout old_layout;
+
     struct SegmentReaderCtx segctx;
 };
 
@@ -64,7 +80,8 @@ int loki_read_old_header(struct MbBiReader *bir, mb::File *file,
                          uint64_t *kernel_offset_out,
                          uint32_t *kernel_size_out,
                          uint64_t *ramdisk_offset_out,
-                         uint32_t *ramdisk_size_out);
+                         uint32_t *ramdisk_size_out,
+                         struct LokiOldLayout *layout);
 int loki_read_new_header(struct MbBiReader *bir, mb::File *file,
                          struct AndroidHeader *hdr, struct LokiHeader *loki_hdr,
                          struct MbBiHeader *header,
@@ -84,6 +101,9 @@ int loki_reader_go_to_entry(struct MbBiReader *bir, void *userdata,
 int loki_reader_read_data(struct MbBiReader *bir, void *userdata,
                           void *buf, size_t buf_size,
                           size_t &bytes_read);
+int loki_reader_read_data_view(struct MbBiReader *bir, void *userdata,
+                               const void *&data, size_t max_size,
+                               size_t &bytes_avail);
 int loki_reader_free(struct MbBiReader *bir, void *userdata);
 
 MB_END_C_DECLS
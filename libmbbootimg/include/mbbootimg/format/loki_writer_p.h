@@ -26,6 +26,7 @@
 #include "mbbootimg/entry.h"
 #include "mbbootimg/format/android_p.h"
 #include "mbbootimg/format/segment_writer_p.h"
+#include "mbbootimg/format/sha1_pipeline_p.h"
 #include "mbbootimg/header.h"
 #include "mbbootimg/writer.h"
 
@@ -43,7 +44,7 @@ struct LokiWriterCtx
     unsigned char *aboot;
     size_t aboot_size;
 
-    SHA_CTX sha_ctx;
+    struct Sha1Pipeline *sha_pipeline;
 
     struct SegmentWriterCtx segctx;
 };
@@ -58,6 +58,9 @@ int mtk_reader_go_to_entry(struct MbBiReader *bir, void *userdata,
 int mtk_reader_read_data(struct MbBiReader *bir, void *userdata,
                          void *buf, size_t buf_size,
                          size_t &bytes_read);
+int mtk_reader_read_data_view(struct MbBiReader *bir, void *userdata,
+                              const void *&data, size_t max_size,
+                              size_t &bytes_avail);
 int mtk_reader_free(struct MbBiReader *bir, void *userdata);
 
 MB_END_C_DECLS
@@ -41,6 +41,11 @@ struct MtkWriterCtx
     bool have_file_size;
     uint64_t file_size;
 
+    // In single-pass mode, the current MTK header entry is buffered so that
+    // its size field can be filled in before it is written
+    unsigned char mtkhdr_buf[sizeof(struct MtkHeader)];
+    size_t mtkhdr_len;
+
     struct SegmentWriterCtx segctx;
 };
 
@@ -90,3 +90,7 @@ int _segment_reader_go_to_entry(struct SegmentReaderCtx *ctx, mb::File *file,
 int _segment_reader_read_data(struct SegmentReaderCtx *ctx, mb::File *file,
                               void *buf, size_t buf_size, size_t &bytes_read,
                               struct MbBiReader *bir);
+int _segment_reader_read_data_view(struct SegmentReaderCtx *ctx,
+                                   mb::File *file, const void *&data,
+                                   size_t max_size, size_t &bytes_avail,
+                                   struct MbBiReader *bir);
@@ -63,6 +63,10 @@ struct SegmentWriterCtx
 
     bool have_pos;
     uint64_t pos;
+
+    // Whether all entry sizes are known up front and the output is written
+    // strictly sequentially (padding is written instead of seeked over)
+    bool streaming;
 };
 
 int _segment_writer_init(struct SegmentWriterCtx *ctx);
@@ -82,6 +86,13 @@ struct SegmentWriterEntry * _segment_writer_next_entry(struct SegmentWriterCtx *
 void _segment_writer_update_size_if_unset(struct SegmentWriterCtx *ctx,
                                           uint32_t size);
 
+uint64_t _segment_writer_layout(struct SegmentWriterCtx *ctx, uint64_t start);
+int _segment_writer_begin_stream(struct SegmentWriterCtx *ctx, mb::File *file,
+                                 uint64_t header_size, uint64_t start,
+                                 struct MbBiWriter *biw);
+int _segment_writer_write_zeros(mb::File *file, uint64_t size,
+                                struct MbBiWriter *biw);
+
 int _segment_writer_get_entry(struct SegmentWriterCtx *ctx, mb::File *file,
                               struct MbBiEntry *entry, struct MbBiWriter *biw);
 int _segment_writer_write_entry(struct SegmentWriterCtx *ctx, mb::File *file,
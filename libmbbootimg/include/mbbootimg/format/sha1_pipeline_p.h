@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbbootimg/guard_p.h"
+
+#ifdef __cplusplus
+#  include <cstddef>
+#else
+#  include <stddef.h>
+#endif
+
+#include <openssl/sha.h>
+
+#include "mbcommon/common.h"
+
+// Size of each of the two buffers used for handing data to the hashing thread
+#define SHA1_PIPELINE_BUF_SIZE      (256 * 1024)
+
+MB_BEGIN_C_DECLS
+
+struct Sha1Pipeline;
+
+struct Sha1Pipeline * _sha1_pipeline_new(void);
+void _sha1_pipeline_free(struct Sha1Pipeline *sp);
+
+bool _sha1_pipeline_update(struct Sha1Pipeline *sp,
+                           const void *data, size_t size);
+bool _sha1_pipeline_final(struct Sha1Pipeline *sp,
+                          unsigned char digest[SHA_DIGEST_LENGTH]);
+
+MB_END_C_DECLS
@@ -21,6 +21,7 @@
 
 #include "mbbootimg/guard_p.h"
 
+#include <cstddef>
 #include <cstdint>
 
 struct MbBiHeader
@@ -55,4 +56,13 @@ struct MbBiHeader
         uint32_t hdr_entrypoint;    // |         |      |      |     | X    |
         // TODO TODO TODO
     } field;
+
+    // String storage that is kept when the header is cleared so that it can
+    // be reused without allocating
+    struct {
+        char *board_name;
+        size_t board_name_size;
+        char *cmdline;
+        size_t cmdline_size;
+    } pool;
 };
@@ -21,6 +21,9 @@
 
 #include "mbbootimg/guard_p.h"
 
+#include <cstdlib>
+#include <cstring>
+
 #define IS_SUPPORTED(STRUCT, FLAG) \
     ((STRUCT)->fields_supported & (FLAG))
 
@@ -48,14 +51,80 @@
 
 #define SET_STRING_FIELD(STRUCT, FLAG, FIELD, VALUE) \
     do { \
-        free((STRUCT)->field.FIELD); \
+        if (!_mb_bi_set_pooled_string(&(STRUCT)->field.FIELD, \
+                                      &(STRUCT)->pool.FIELD, \
+                                      &(STRUCT)->pool.FIELD ## _size, \
+                                      (VALUE))) { \
+            return MB_BI_FAILED; \
+        } \
         if (VALUE) { \
-            char *dup = strdup(VALUE); \
-            if (!dup) { \
-                return MB_BI_FAILED; \
-            } \
-            SET_FIELD(STRUCT, FLAG, FIELD, dup); \
+            (STRUCT)->fields_set |= (FLAG); \
         } else { \
-            UNSET_FIELD(STRUCT, FLAG, FIELD, nullptr); \
+            (STRUCT)->fields_set &= ~(FLAG); \
         } \
     } while (0)
+
+/*!
+ * \brief Release a string field, keeping its pooled storage for reuse
+ *
+ * \p field either points to the pooled buffer or, if it was assigned directly,
+ * to a separately allocated string that is freed.
+ */
+static inline void _mb_bi_release_pooled_string(char **field, char *pool)
+{
+    if (*field != pool) {
+        free(*field);
+    }
+    *field = nullptr;
+}
+
+/*!
+ * \brief Free a string field and its pooled storage
+ */
+static inline void _mb_bi_free_pooled_string(char **field, char **pool,
+                                             size_t *pool_size)
+{
+    _mb_bi_release_pooled_string(field, *pool);
+    free(*pool);
+    *pool = nullptr;
+    *pool_size = 0;
+}
+
+/*!
+ * \brief Set a string field, reusing its pooled storage when possible
+ *
+ * Memory is only allocated if \p value does not fit in the pooled buffer.
+ *
+ * \return Whether the field was set. If false, the field is left unchanged.
+ */
+static inline bool _mb_bi_set_pooled_string(char **field, char **pool,
+                                            size_t *pool_size,
+                                            const char *value)
+{
+    if (!value) {
+        _mb_bi_release_pooled_string(field, *pool);
+        return true;
+    } else if (value == *field) {
+        return true;
+    }
+
+    size_t size = strlen(value) + 1;
+
+    if (size > *pool_size) {
+        // value might point into the pooled buffer, so it cannot be realloc'd
+        char *buf = static_cast<char *>(malloc(size));
+        if (!buf) {
+            return false;
+        }
+        _mb_bi_release_pooled_string(field, *pool);
+        free(*pool);
+        *pool = buf;
+        *pool_size = size;
+    } else {
+        _mb_bi_release_pooled_string(field, *pool);
+    }
+
+    memmove(*pool, value, size);
+    *field = *pool;
+    return true;
+}
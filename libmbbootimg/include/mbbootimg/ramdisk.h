@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+#  include <cstdarg>
+#  include <cstddef>
+#  include <cstdint>
+#else
+#  include <stdarg.h>
+#  include <stddef.h>
+#  include <stdint.h>
+#endif
+
+#include "mbcommon/common.h"
+
+#include "mbbootimg/defs.h"
+
+// Ramdisk compression formats
+
+#define MB_BI_RAMDISK_COMPRESSION_NONE          0
+#define MB_BI_RAMDISK_COMPRESSION_GZIP          1
+#define MB_BI_RAMDISK_COMPRESSION_LZ4_LEGACY    2
+#define MB_BI_RAMDISK_COMPRESSION_XZ            3
+#define MB_BI_RAMDISK_COMPRESSION_LZMA          4
+
+MB_BEGIN_C_DECLS
+
+struct MbBiReader;
+struct MbBiRamdiskReader;
+struct MbBiRamdiskMember;
+
+// Construction/destruction
+MB_EXPORT struct MbBiRamdiskReader * mb_bi_ramdisk_reader_new(void);
+MB_EXPORT int mb_bi_ramdisk_reader_free(struct MbBiRamdiskReader *brr);
+
+// Options
+MB_EXPORT int mb_bi_ramdisk_reader_set_threads(struct MbBiRamdiskReader *brr,
+                                               unsigned int threads);
+
+// Open/close
+MB_EXPORT int mb_bi_ramdisk_reader_open(struct MbBiRamdiskReader *brr,
+                                        struct MbBiReader *bir);
+MB_EXPORT int mb_bi_ramdisk_reader_close(struct MbBiRamdiskReader *brr);
+
+// Operations
+MB_EXPORT int mb_bi_ramdisk_reader_compression(struct MbBiRamdiskReader *brr);
+MB_EXPORT int mb_bi_ramdisk_reader_read_member(
+        struct MbBiRamdiskReader *brr, struct MbBiRamdiskMember **member);
+MB_EXPORT int mb_bi_ramdisk_reader_go_to_member(
+        struct MbBiRamdiskReader *brr, struct MbBiRamdiskMember **member,
+        const char *name);
+MB_EXPORT int mb_bi_ramdisk_reader_read_data(struct MbBiRamdiskReader *brr,
+                                             void *buf, size_t size,
+                                             size_t *bytes_read);
+MB_EXPORT int mb_bi_ramdisk_reader_read_data_view(
+        struct MbBiRamdiskReader *brr, const void **data, size_t max_size,
+        size_t *bytes_avail);
+
+// Member fields
+MB_EXPORT const char *
+mb_bi_ramdisk_member_name(struct MbBiRamdiskMember *member);
+MB_EXPORT uint32_t mb_bi_ramdisk_member_mode(struct MbBiRamdiskMember *member);
+MB_EXPORT uint32_t mb_bi_ramdisk_member_uid(struct MbBiRamdiskMember *member);
+MB_EXPORT uint32_t mb_bi_ramdisk_member_gid(struct MbBiRamdiskMember *member);
+MB_EXPORT uint32_t mb_bi_ramdisk_member_mtime(struct MbBiRamdiskMember *member);
+MB_EXPORT uint64_t mb_bi_ramdisk_member_size(struct MbBiRamdiskMember *member);
+
+// Error handling functions
+MB_EXPORT int mb_bi_ramdisk_reader_error(struct MbBiRamdiskReader *brr);
+MB_EXPORT const char *
+mb_bi_ramdisk_reader_error_string(struct MbBiRamdiskReader *brr);
+MB_PRINTF(3, 4)
+MB_EXPORT int mb_bi_ramdisk_reader_set_error(struct MbBiRamdiskReader *brr,
+                                             int error_code,
+                                             const char *fmt, ...);
+MB_EXPORT int mb_bi_ramdisk_reader_set_error_v(struct MbBiRamdiskReader *brr,
+                                               int error_code,
+                                               const char *fmt, va_list ap);
+
+MB_END_C_DECLS
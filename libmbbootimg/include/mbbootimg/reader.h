@@ -56,6 +56,7 @@ MB_EXPORT int mb_bi_reader_open_filename_w(struct MbBiReader *bir,
 MB_EXPORT int mb_bi_reader_open(struct MbBiReader *bir,
                                 mb::File *file, bool owned);
 MB_EXPORT int mb_bi_reader_close(struct MbBiReader *bir);
+MB_EXPORT int mb_bi_reader_reset(struct MbBiReader *bir);
 
 // Operations
 MB_EXPORT int mb_bi_reader_read_header(struct MbBiReader *bir,
@@ -74,6 +75,9 @@ MB_EXPORT int mb_bi_reader_go_to_entry2(struct MbBiReader *bir,
                                         int entry_type);
 MB_EXPORT int mb_bi_reader_read_data(struct MbBiReader *bir, void *buf,
                                      size_t size, size_t *bytes_read);
+MB_EXPORT int mb_bi_reader_read_data_view(struct MbBiReader *bir,
+                                          const void **data, size_t max_size,
+                                          size_t *bytes_avail);
 
 // Format operations
 MB_EXPORT int mb_bi_reader_format_code(struct MbBiReader *bir);
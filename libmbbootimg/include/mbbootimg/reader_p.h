@@ -23,6 +23,7 @@
 
 #ifdef __cplusplus
 #  include <string>
+#  include <vector>
 
 #  include <cstddef>
 #else
@@ -61,6 +62,15 @@
 
 #define MAX_FORMATS     10
 
+// Number of bytes at the beginning of the file that are cached when the boot
+// image is opened. The bidders and header readers of every format are served
+// from this cache, so it must cover the headers that they look for.
+#define READER_PROBE_SIZE   (64 * 1024)
+
+// Maximum number of bytes returned by mb_bi_reader_read_data_view() when the
+// data has to be copied into the reader's own buffer
+#define READER_VIEW_BUF_SIZE    (256 * 1024)
+
 MB_BEGIN_C_DECLS
 
 struct MbBiReader;
@@ -80,6 +90,9 @@ typedef int (*FormatReaderGoToEntry)(struct MbBiReader *bir, void *userdata,
 typedef int (*FormatReaderReadData)(struct MbBiReader *bir, void *userdata,
                                     void *buf, size_t buf_size,
                                     size_t &bytes_read);
+typedef int (*FormatReaderReadDataView)(struct MbBiReader *bir, void *userdata,
+                                        const void *&data, size_t max_size,
+                                        size_t &bytes_avail);
 typedef int (*FormatReaderFree)(struct MbBiReader *bir, void *userdata);
 
 struct FormatReader
@@ -94,6 +107,7 @@ struct FormatReader
     FormatReaderReadEntry read_entry_cb;
     FormatReaderGoToEntry go_to_entry_cb;
     FormatReaderReadData read_data_cb;
+    FormatReaderReadDataView read_data_view_cb;
     FormatReaderFree free_cb;
     void *userdata;
 };
@@ -130,6 +144,16 @@ struct MbBiReader
 
     struct MbBiHeader *header;
     struct MbBiEntry *entry;
+
+    // Cached beginning of the file
+    std::vector<unsigned char> probe_buf;
+    bool probe_valid;
+    // Whether probe_buf contains the entire file
+    bool probe_eof;
+
+    // Fallback storage for mb_bi_reader_read_data_view() when the format or
+    // file does not support direct access
+    std::vector<unsigned char> view_buf;
 };
 
 int _mb_bi_reader_register_format(struct MbBiReader *bir,
@@ -142,9 +166,14 @@ int _mb_bi_reader_register_format(struct MbBiReader *bir,
                                   FormatReaderReadEntry read_entry_cb,
                                   FormatReaderGoToEntry go_to_entry_cb,
                                   FormatReaderReadData read_data_cb,
+                                  FormatReaderReadDataView read_data_view_cb,
                                   FormatReaderFree free_cb);
 
 int _mb_bi_reader_free_format(struct MbBiReader *bir,
                               struct FormatReader *format);
 
+bool _mb_bi_reader_read_at(struct MbBiReader *bir, mb::File *file,
+                           uint64_t offset, void *buf, size_t size,
+                           size_t &bytes_read);
+
 MB_END_C_DECLS
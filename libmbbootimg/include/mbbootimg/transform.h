@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+#  include <vector>
+#endif
+
+#include "mbcommon/common.h"
+
+#include "mbbootimg/defs.h"
+
+#define MB_BI_TRANSFORM_COPY            0
+#define MB_BI_TRANSFORM_REWRITE         1
+#define MB_BI_TRANSFORM_REPLACE         2
+
+MB_BEGIN_C_DECLS
+
+struct MbBiReader;
+struct MbBiWriter;
+
+typedef int (*MbBiTransformSelectCb)(int type, void *userdata);
+
+MB_EXPORT int mb_bi_copy_data(struct MbBiReader *bir, struct MbBiWriter *biw);
+
+MB_END_C_DECLS
+
+#ifdef __cplusplus
+
+// Entry data is passed as a std::vector, so this part is C++ only
+
+typedef int (*MbBiTransformRewriteCb)(int type, bool exists,
+                                      std::vector<unsigned char> &data,
+                                      void *userdata);
+
+MB_EXPORT int mb_bi_transform(struct MbBiReader *bir, struct MbBiWriter *biw,
+                              MbBiTransformSelectCb select_cb,
+                              MbBiTransformRewriteCb rewrite_cb,
+                              void *userdata);
+
+#endif
@@ -22,10 +22,12 @@
 #ifdef __cplusplus
 #  include <cstdarg>
 #  include <cstddef>
+#  include <cstdint>
 #  include <cwchar>
 #else
 #  include <stdarg.h>
 #  include <stddef.h>
+#  include <stdint.h>
 #  include <wchar.h>
 #endif
 
@@ -72,6 +74,8 @@ MB_EXPORT int mb_bi_writer_write_entry(struct MbBiWriter *biw,
                                        struct MbBiEntry *entry);
 MB_EXPORT int mb_bi_writer_write_data(struct MbBiWriter *biw, const void *buf,
                                       size_t size, size_t *bytes_written);
+MB_EXPORT int mb_bi_writer_set_entry_size(struct MbBiWriter *biw,
+                                          int entry_type, uint64_t size);
 
 // Format operations
 MB_EXPORT int mb_bi_writer_format_code(struct MbBiWriter *biw);
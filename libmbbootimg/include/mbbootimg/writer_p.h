@@ -25,8 +25,10 @@
 #  include <string>
 
 #  include <cstddef>
+#  include <cstdint>
 #else
 #  include <stddef.h>
+#  include <stdint.h>
 #endif
 
 #include "mbcommon/common.h"
@@ -60,6 +62,10 @@
 
 #define MAX_FORMATS     10
 
+// Entry types are bit flags, so this is the number of distinct types that can
+// be represented
+#define MAX_ENTRY_SIZES 32
+
 MB_BEGIN_C_DECLS
 
 struct MbBiWriter;
@@ -132,6 +138,10 @@ struct MbBiWriter
 
     struct MbBiEntry *entry;
     struct MbBiHeader *header;
+
+    // Entry sizes declared with mb_bi_writer_set_entry_size()
+    uint64_t entry_sizes[MAX_ENTRY_SIZES];
+    uint32_t entry_sizes_set;
 };
 
 int _mb_bi_writer_register_format(struct MbBiWriter *biw,
@@ -151,4 +161,7 @@ int _mb_bi_writer_register_format(struct MbBiWriter *biw,
 int _mb_bi_writer_free_format(struct MbBiWriter *biw,
                               struct FormatWriter *format);
 
+bool _mb_bi_writer_entry_size(struct MbBiWriter *biw, int entry_type,
+                              uint64_t *size_out);
+
 MB_END_C_DECLS
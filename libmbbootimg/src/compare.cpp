@@ -0,0 +1,289 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbbootimg/compare.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <cstdint>
+#include <cstring>
+
+#include "mbbootimg/defs.h"
+#include "mbbootimg/entry.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/reader.h"
+
+struct CompareEntry
+{
+    int type;
+    bool size_set;
+    uint64_t size;
+
+    bool operator<(const CompareEntry &other) const
+    {
+        return type < other.type;
+    }
+};
+
+/*!
+ * \brief Copy the error from one reader to another
+ *
+ * \return Error code from \p src
+ */
+static int copy_error(MbBiReader *dest, MbBiReader *src, int ret)
+{
+    mb_bi_reader_set_error(dest, mb_bi_reader_error(src), "%s",
+                           mb_bi_reader_error_string(src));
+    return ret;
+}
+
+/*!
+ * \brief Read the type and size of every entry
+ *
+ * The sizes come from the boot image header, so no entry data is read.
+ */
+static int read_entries(MbBiReader *bir, std::vector<CompareEntry> &entries)
+{
+    MbBiEntry *entry;
+    int ret;
+
+    while ((ret = mb_bi_reader_read_entry(bir, &entry)) == MB_BI_OK) {
+        CompareEntry ce;
+        ce.type = mb_bi_entry_type(entry);
+        ce.size_set = mb_bi_entry_size_is_set(entry);
+        ce.size = ce.size_set ? mb_bi_entry_size(entry) : 0;
+        entries.push_back(ce);
+    }
+
+    if (ret != MB_BI_EOF) {
+        return ret;
+    }
+
+    std::sort(entries.begin(), entries.end());
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Compare the data of an entry in both boot images
+ */
+static int compare_entry_data(MbBiReader *bir1, MbBiReader *bir2, int type,
+                              int *equal_out)
+{
+    MbBiEntry *entry;
+    int ret;
+
+    ret = mb_bi_reader_go_to_entry(bir1, &entry, type);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+    ret = mb_bi_reader_go_to_entry(bir2, &entry, type);
+    if (ret != MB_BI_OK) {
+        return copy_error(bir1, bir2, ret);
+    }
+
+    // Compare the views directly. Each view remains valid until the next
+    // operation on its own reader, so the chunks do not need to line up.
+    const unsigned char *data1 = nullptr;
+    const unsigned char *data2 = nullptr;
+    size_t n1 = 0;
+    size_t n2 = 0;
+    int ret1 = MB_BI_OK;
+    int ret2 = MB_BI_OK;
+
+    while (true) {
+        if (n1 == 0 && ret1 != MB_BI_EOF) {
+            const void *view = nullptr;
+            ret1 = mb_bi_reader_read_data_view(bir1, &view, SIZE_MAX, &n1);
+            if (ret1 < 0) {
+                return ret1;
+            } else if (ret1 == MB_BI_EOF) {
+                n1 = 0;
+            }
+            data1 = static_cast<const unsigned char *>(view);
+        }
+        if (n2 == 0 && ret2 != MB_BI_EOF) {
+            const void *view = nullptr;
+            ret2 = mb_bi_reader_read_data_view(bir2, &view, SIZE_MAX, &n2);
+            if (ret2 < 0) {
+                return copy_error(bir1, bir2, ret2);
+            } else if (ret2 == MB_BI_EOF) {
+                n2 = 0;
+            }
+            data2 = static_cast<const unsigned char *>(view);
+        }
+
+        if (n1 == 0 || n2 == 0) {
+            // Equal only if both entries ended at the same time
+            *equal_out = n1 == 0 && n2 == 0;
+            return MB_BI_OK;
+        }
+
+        size_t n = std::min(n1, n2);
+
+        if (memcmp(data1, data2, n) != 0) {
+            *equal_out = 0;
+            return MB_BI_OK;
+        }
+
+        data1 += n;
+        data2 += n;
+        n1 -= n;
+        n2 -= n;
+    }
+}
+
+MB_BEGIN_C_DECLS
+
+/*!
+ * \brief Check if two boot image headers have the same values
+ *
+ * Only the fields that can be set by the user are compared. Fields that are
+ * unset in both headers are considered equal.
+ *
+ * \param header1 First MbBiHeader
+ * \param header2 Second MbBiHeader
+ *
+ * \return Non-zero if the headers are equal. Zero if they are not.
+ */
+int mb_bi_header_equal(MbBiHeader *header1, MbBiHeader *header2)
+{
+#define CHECK_COMPARABLE_VALUES(FIELD) \
+    do { \
+        bool isset1 = mb_bi_header_ ## FIELD ## _is_set(header1); \
+        bool isset2 = mb_bi_header_ ## FIELD ## _is_set(header2); \
+        if (isset1 != isset2 || (isset1 && mb_bi_header_ ## FIELD(header1) \
+                != mb_bi_header_ ## FIELD(header2))) { \
+            return 0; \
+        } \
+    } while (0)
+
+#define CHECK_STRING_VALUES(FIELD) \
+    do { \
+        const char *str1 = mb_bi_header_ ## FIELD(header1); \
+        const char *str2 = mb_bi_header_ ## FIELD(header2); \
+        if (!!str1 != !!str2 || (str1 && strcmp(str1, str2) != 0)) { \
+            return 0; \
+        } \
+    } while (0)
+
+    CHECK_STRING_VALUES(board_name);
+    CHECK_STRING_VALUES(kernel_cmdline);
+    CHECK_COMPARABLE_VALUES(page_size);
+    CHECK_COMPARABLE_VALUES(kernel_address);
+    CHECK_COMPARABLE_VALUES(ramdisk_address);
+    CHECK_COMPARABLE_VALUES(secondboot_address);
+    CHECK_COMPARABLE_VALUES(kernel_tags_address);
+    CHECK_COMPARABLE_VALUES(sony_ipl_address);
+    CHECK_COMPARABLE_VALUES(sony_rpm_address);
+    CHECK_COMPARABLE_VALUES(sony_appsbl_address);
+    CHECK_COMPARABLE_VALUES(entrypoint_address);
+
+    return 1;
+
+#undef CHECK_COMPARABLE_VALUES
+#undef CHECK_STRING_VALUES
+}
+
+/*!
+ * \brief Check if two boot images have the same header values and entries
+ *
+ * The comparison is done in order of increasing cost and stops at the first
+ * difference:
+ *
+ * 1. The header values are compared with mb_bi_header_equal()
+ * 2. The entry types and sizes (from the headers) are compared without
+ *    reading any entry data
+ * 3. The data of each entry is compared
+ *
+ * Entries may be in a different order in the two boot images.
+ *
+ * \note Both readers must have been opened, but no header or entries may have
+ *       been read yet.
+ *
+ * \param[in] bir1 First MbBiReader
+ * \param[in] bir2 Second MbBiReader
+ * \param[out] equal_out Pointer to store whether the boot images are equal
+ *
+ * \return
+ *   * #MB_BI_OK if the boot images are successfully compared
+ *   * \<= #MB_BI_WARN if an error occurs. The error is always reported through
+ *     \p bir1, even if it occurred while reading from \p bir2.
+ */
+int mb_bi_reader_compare(MbBiReader *bir1, MbBiReader *bir2, int *equal_out)
+{
+    MbBiHeader *header1;
+    MbBiHeader *header2;
+    int ret;
+
+    ret = mb_bi_reader_read_header(bir1, &header1);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+    ret = mb_bi_reader_read_header(bir2, &header2);
+    if (ret != MB_BI_OK) {
+        return copy_error(bir1, bir2, ret);
+    }
+
+    if (!mb_bi_header_equal(header1, header2)) {
+        *equal_out = 0;
+        return MB_BI_OK;
+    }
+
+    std::vector<CompareEntry> entries1;
+    std::vector<CompareEntry> entries2;
+
+    ret = read_entries(bir1, entries1);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+    ret = read_entries(bir2, entries2);
+    if (ret != MB_BI_OK) {
+        return copy_error(bir1, bir2, ret);
+    }
+
+    if (entries1.size() != entries2.size()) {
+        *equal_out = 0;
+        return MB_BI_OK;
+    }
+
+    for (size_t i = 0; i < entries1.size(); ++i) {
+        const CompareEntry &e1 = entries1[i];
+        const CompareEntry &e2 = entries2[i];
+
+        // Sizes are only trusted if both formats report them
+        if (e1.type != e2.type
+                || (e1.size_set && e2.size_set && e1.size != e2.size)) {
+            *equal_out = 0;
+            return MB_BI_OK;
+        }
+    }
+
+    for (auto const &entry : entries1) {
+        ret = compare_entry_data(bir1, bir2, entry.type, equal_out);
+        if (ret != MB_BI_OK || !*equal_out) {
+            return ret;
+        }
+    }
+
+    *equal_out = 1;
+    return MB_BI_OK;
+}
+
+MB_END_C_DECLS
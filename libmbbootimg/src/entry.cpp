@@ -38,16 +38,20 @@ MbBiEntry * mb_bi_entry_new()
 
 void mb_bi_entry_free(MbBiEntry *entry)
 {
-    mb_bi_entry_clear(entry);
-    free(entry);
+    if (entry) {
+        _mb_bi_free_pooled_string(&entry->field.name, &entry->pool.name,
+                                  &entry->pool.name_size);
+        free(entry);
+    }
 }
 
 
 void mb_bi_entry_clear(MbBiEntry *entry)
 {
     if (entry) {
-        free(entry->field.name);
-        memset(entry, 0, sizeof(*entry));
+        _mb_bi_release_pooled_string(&entry->field.name, entry->pool.name);
+        memset(&entry->field, 0, sizeof(entry->field));
+        entry->fields_set = 0;
     }
 }
 
@@ -69,8 +73,8 @@ MbBiEntry * mb_bi_entry_clone(MbBiEntry *entry)
 
     // Deep copy strings
     bool deep_copy_error =
-            (entry->field.name
-                    && !(dup->field.name = strdup(entry->field.name)));
+            !_mb_bi_set_pooled_string(&dup->field.name, &dup->pool.name,
+                                      &dup->pool.name_size, entry->field.name);
 
     if (deep_copy_error) {
         mb_bi_entry_free(dup);
@@ -84,15 +84,8 @@ int find_android_header(MbBiReader *bir, mb::File *file,
         return MB_BI_WARN;
     }
 
-    if (!file->seek(0, SEEK_SET, nullptr)) {
-        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
-                               "Failed to seek to beginning: %s",
-                               file->error_string().c_str());
-        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
-    }
-
-    if (!mb::file_read_fully(*file, buf,
-                             max_header_offset + sizeof(AndroidHeader), n)) {
+    if (!_mb_bi_reader_read_at(bir, file, 0, buf,
+                               max_header_offset + sizeof(AndroidHeader), n)) {
         mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
                                "Failed to read header: %s",
                                file->error_string().c_str());
@@ -169,14 +162,7 @@ int find_samsung_seandroid_magic(MbBiReader *bir, mb::File *file,
     pos += hdr->dt_size;
     pos += align_page_size<uint64_t>(pos, hdr->page_size);
 
-    if (!file->seek(pos, SEEK_SET, nullptr)) {
-        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
-                               "SEAndroid magic not found: %s",
-                               file->error_string().c_str());
-        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
-    }
-
-    if (!mb::file_read_fully(*file, buf, sizeof(buf), n)) {
+    if (!_mb_bi_reader_read_at(bir, file, pos, buf, sizeof(buf), n)) {
         mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
                                "Failed to read SEAndroid magic: %s",
                                file->error_string().c_str());
@@ -240,14 +226,7 @@ int find_bump_magic(MbBiReader *bir, mb::File *file,
     pos += hdr->dt_size;
     pos += align_page_size<uint64_t>(pos, hdr->page_size);
 
-    if (!file->seek(pos, SEEK_SET, nullptr)) {
-        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
-                               "SEAndroid magic not found: %s",
-                               file->error_string().c_str());
-        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
-    }
-
-    if (!mb::file_read_fully(*file, buf, sizeof(buf), n)) {
+    if (!_mb_bi_reader_read_at(bir, file, pos, buf, sizeof(buf), n)) {
         mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
                                "Failed to read SEAndroid magic: %s",
                                file->error_string().c_str());
@@ -545,6 +524,16 @@ int android_reader_read_data(MbBiReader *bir, void *userdata,
                                      bytes_read, bir);
 }
 
+int android_reader_read_data_view(MbBiReader *bir, void *userdata,
+                                  const void *&data, size_t max_size,
+                                  size_t &bytes_avail)
+{
+    AndroidReaderCtx *const ctx = static_cast<AndroidReaderCtx *>(userdata);
+
+    return _segment_reader_read_data_view(&ctx->segctx, bir->file, data,
+                                          max_size, bytes_avail, bir);
+}
+
 int android_reader_free(MbBiReader *bir, void *userdata)
 {
     (void) bir;
@@ -590,6 +579,7 @@ int mb_bi_reader_enable_format_android(MbBiReader *bir)
                                          &android_reader_read_entry,
                                          &android_reader_go_to_entry,
                                          &android_reader_read_data,
+                                         &android_reader_read_data_view,
                                          &android_reader_free);
 }
 
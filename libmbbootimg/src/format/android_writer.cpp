@@ -191,7 +191,7 @@ int android_writer_write_data(MbBiWriter *biw, void *userdata,
 
     // We always include the image in the hash. The size is sometimes included
     // and is handled in android_writer_finish_entry().
-    if (!SHA1_Update(&ctx->sha_ctx, buf, buf_size)) {
+    if (!_sha1_pipeline_update(ctx->sha_pipeline, buf, buf_size)) {
         mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
                                "Failed to update SHA1 hash");
         // This must be fatal as the write already happened and cannot be
@@ -220,7 +220,8 @@ int android_writer_finish_entry(MbBiWriter *biw, void *userdata)
 
     // Include size for everything except empty DT images
     if ((swentry->type != MB_BI_ENTRY_DEVICE_TREE || swentry->size > 0)
-            && !SHA1_Update(&ctx->sha_ctx, &le32_size, sizeof(le32_size))) {
+            && !_sha1_pipeline_update(ctx->sha_pipeline,
+                                      &le32_size, sizeof(le32_size))) {
         mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
                                "Failed to update SHA1 hash");
         return MB_BI_FATAL;
@@ -296,7 +297,7 @@ int android_writer_close(MbBiWriter *biw, void *userdata)
 
         // Set ID
         unsigned char digest[SHA_DIGEST_LENGTH];
-        if (!SHA1_Final(digest, &ctx->sha_ctx)) {
+        if (!_sha1_pipeline_final(ctx->sha_pipeline, digest)) {
             mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
                                    "Failed to update SHA1 hash");
             return MB_BI_FATAL;
@@ -333,6 +334,7 @@ int android_writer_free(MbBiWriter *bir, void *userdata)
     (void) bir;
     AndroidWriterCtx *const ctx = static_cast<AndroidWriterCtx *>(userdata);
     _segment_writer_deinit(&ctx->segctx);
+    _sha1_pipeline_free(ctx->sha_pipeline);
     free(ctx);
     return MB_BI_OK;
 }
@@ -358,11 +360,12 @@ int mb_bi_writer_set_format_android(MbBiWriter *biw)
         return MB_BI_FAILED;
     }
 
-    if (!SHA1_Init(&ctx->sha_ctx)) {
+    ctx->sha_pipeline = _sha1_pipeline_new();
+    if (!ctx->sha_pipeline) {
         mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
-                               "Failed to initialize SHA_CTX");
+                               "Failed to initialize SHA1 pipeline");
         free(ctx);
-        return false;
+        return MB_BI_FAILED;
     }
 
     _segment_writer_init(&ctx->segctx);
@@ -62,6 +62,7 @@ int mb_bi_reader_enable_format_bump(MbBiReader *bir)
                                          &android_reader_read_entry,
                                          &android_reader_go_to_entry,
                                          &android_reader_read_data,
+                                         &android_reader_read_data_view,
                                          &android_reader_free);
 }
 
@@ -48,11 +48,12 @@ int mb_bi_writer_set_format_bump(MbBiWriter *biw)
         return MB_BI_FAILED;
     }
 
-    if (!SHA1_Init(&ctx->sha_ctx)) {
+    ctx->sha_pipeline = _sha1_pipeline_new();
+    if (!ctx->sha_pipeline) {
         mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
-                               "Failed to initialize SHA_CTX");
+                               "Failed to initialize SHA1 pipeline");
         free(ctx);
-        return false;
+        return MB_BI_FAILED;
     }
 
     _segment_writer_init(&ctx->segctx);
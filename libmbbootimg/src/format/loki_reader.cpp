@@ -20,6 +20,7 @@
 #include "mbbootimg/format/loki_reader_p.h"
 
 #include <algorithm>
+#include <vector>
 
 #include <cerrno>
 #include <cinttypes>
@@ -29,6 +30,7 @@
 #include "mbcommon/endian.h"
 #include "mbcommon/file.h"
 #include "mbcommon/file_util.h"
+#include "mbcommon/libc/string.h"
 #include "mbcommon/string.h"
 
 #include "mbbootimg/entry.h"
@@ -69,14 +71,8 @@ int find_loki_header(MbBiReader *bir, mb::File *file,
     LokiHeader header;
     size_t n;
 
-    if (!file->seek(LOKI_MAGIC_OFFSET, SEEK_SET, nullptr)) {
-        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
-                               "Loki magic not found: %s",
-                               file->error_string().c_str());
-        return file->is_fatal() ? MB_BI_FATAL : MB_BI_WARN;
-    }
-
-    if (!mb::file_read_fully(*file, &header, sizeof(header), n)) {
+    if (!_mb_bi_reader_read_at(bir, file, LOKI_MAGIC_OFFSET,
+                               &header, sizeof(header), n)) {
         mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
                                "Failed to read header: %s",
                                file->error_string().c_str());
@@ -203,6 +199,10 @@ int loki_find_ramdisk_address(MbBiReader *bir, mb::File *file,
  * as it indiciates that the original filename field is set. This is usually the
  * case for ramdisks packed via the `gzip` command line tool.
  *
+ * If the file supports mb::File::peek(), the contents are scanned in place.
+ * Otherwise, they are read in windows of #LOKI_GZIP_SCAN_WINDOW bytes. In both
+ * cases, the flags byte is inspected directly from the scanned buffer.
+ *
  * \pre The file position can be at any offset prior to calling this function.
  *
  * \post The file pointer position is undefined after this function returns.
@@ -222,14 +222,6 @@ int loki_find_ramdisk_address(MbBiReader *bir, mb::File *file,
 int loki_old_find_gzip_offset(MbBiReader *bir, mb::File *file,
                               uint32_t start_offset, uint64_t *gzip_offset_out)
 {
-    struct SearchResult
-    {
-        bool have_flag0 = false;
-        bool have_flag8 = false;
-        uint64_t flag0_offset;
-        uint64_t flag8_offset;
-    };
-
     // gzip header:
     // byte 0-1 : magic bytes 0x1f, 0x8b
     // byte 2   : compression (0x08 = deflate)
@@ -239,58 +231,86 @@ int loki_old_find_gzip_offset(MbBiReader *bir, mb::File *file,
     // byte 9   : operating system
 
     static const unsigned char gzip_deflate_magic[] = { 0x1f, 0x8b, 0x08 };
+    static constexpr size_t header_size = sizeof(gzip_deflate_magic) + 1;
+
+    bool have_flag0 = false;
+    bool have_flag8 = false;
+    uint64_t flag0_offset = 0;
+    uint64_t flag8_offset = 0;
+
+    // Find first result with flags == 0x00 and flags == 0x08 among the headers
+    // that fit completely in the buffer. The flags byte is inspected directly
+    // from the buffer. Returns true if the search can stop early.
+    auto scan = [&](const unsigned char *data, size_t size,
+                    uint64_t base_offset) {
+        const unsigned char *ptr = data;
+        const unsigned char *end = data + size;
+
+        while (static_cast<size_t>(end - ptr) >= header_size) {
+            auto match = static_cast<const unsigned char *>(mb_memmem(
+                    ptr, static_cast<size_t>(end - ptr) - 1,
+                    gzip_deflate_magic, sizeof(gzip_deflate_magic)));
+            if (!match) {
+                break;
+            }
 
-    SearchResult result = {};
-
-    // Find first result with flags == 0x00 and flags == 0x08
-    auto result_cb = [](mb::File &file, void *userdata, uint64_t offset)
-            -> mb::FileSearchAction {
-        SearchResult *result = static_cast<SearchResult *>(userdata);
-        uint64_t orig_offset;
-        unsigned char flags;
-        size_t n;
+            uint64_t offset = base_offset + static_cast<size_t>(match - data);
+            unsigned char flags = match[sizeof(gzip_deflate_magic)];
 
-        // Stop early if possible
-        if (result->have_flag0 && result->have_flag8) {
-            return mb::FileSearchAction::Stop;
-        }
+            if (!have_flag0 && flags == 0x00) {
+                have_flag0 = true;
+                flag0_offset = offset;
+            } else if (!have_flag8 && flags == 0x08) {
+                have_flag8 = true;
+                flag8_offset = offset;
+            }
 
-        // Save original position
-        if (!file.seek(0, SEEK_CUR, &orig_offset)) {
-            return mb::FileSearchAction::Fail;
-        }
+            if (have_flag0 && have_flag8) {
+                return true;
+            }
 
-        // Seek to flags byte
-        if (!file.seek(offset + 3, SEEK_SET, nullptr)) {
-            return mb::FileSearchAction::Fail;
+            ptr = match + 1;
         }
 
-        // Read next bytes for flags
-        if (!mb::file_read_fully(file, &flags, sizeof(flags), n)) {
-            return mb::FileSearchAction::Fail;
-        } else if (n != sizeof(flags)) {
-            // EOF
-            return mb::FileSearchAction::Stop;
-        }
+        return false;
+    };
 
-        if (!result->have_flag0 && flags == 0x00) {
-            result->have_flag0 = true;
-            result->flag0_offset = offset;
-        } else if (!result->have_flag8 && flags == 0x08) {
-            result->have_flag8 = true;
-            result->flag8_offset = offset;
-        }
+    const void *view;
+    size_t view_size;
+
+    if (file->peek(start_offset, SIZE_MAX, view, view_size)) {
+        // Scan the file contents in place
+        scan(static_cast<const unsigned char *>(view), view_size,
+             start_offset);
+    } else if (file->error() == mb::FileError::Unsupported) {
+        // Scan in windows, carrying over the bytes of a header that may have
+        // been split across the window boundary
+        std::vector<unsigned char> buf(LOKI_GZIP_SCAN_WINDOW);
+        uint64_t offset = start_offset;
+        size_t carry = 0;
+
+        while (true) {
+            size_t n;
+
+            if (!_mb_bi_reader_read_at(bir, file, offset, buf.data() + carry,
+                                       buf.size() - carry, n)) {
+                mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
+                                       "Failed to search for gzip magic: %s",
+                                       file->error_string().c_str());
+                return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+            }
 
-        // Restore original position as per contract
-        if (!file.seek(orig_offset, SEEK_SET, nullptr)) {
-            return mb::FileSearchAction::Fail;
-        }
+            size_t total = carry + n;
 
-        return mb::FileSearchAction::Continue;
-    };
+            if (n == 0 || scan(buf.data(), total, offset - carry)) {
+                break;
+            }
 
-    if (!mb::file_search(*file, start_offset, -1, 0, gzip_deflate_magic,
-                         sizeof(gzip_deflate_magic), -1, result_cb, &result)) {
+            carry = std::min(total, header_size - 1);
+            memmove(buf.data(), buf.data() + total - carry, carry);
+            offset += n;
+        }
+    } else {
         mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
                                "Failed to search for gzip magic: %s",
                                file->error_string().c_str());
@@ -299,10 +319,10 @@ int loki_old_find_gzip_offset(MbBiReader *bir, mb::File *file,
 
     // Prefer gzip header with original filename flag since most loki'd boot
     // images will have been compressed manually with the gzip tool
-    if (result.have_flag8) {
-        *gzip_offset_out = result.flag8_offset;
-    } else if (result.have_flag0) {
-        *gzip_offset_out = result.flag0_offset;
+    if (have_flag8) {
+        *gzip_offset_out = flag8_offset;
+    } else if (have_flag0) {
+        *gzip_offset_out = flag0_offset;
     } else {
         mb_bi_reader_set_error(bir, MB_BI_ERROR_FILE_FORMAT,
                                "No gzip headers found");
@@ -445,14 +465,8 @@ int find_linux_kernel_size(MbBiReader *bir, mb::File *file,
     // shellcode). The size is stored in the kernel image's header though, so
     // we'll use that.
     // http://www.simtec.co.uk/products/SWLINUX/files/booting_article.html#d0e309
-    if (!file->seek(kernel_offset + 0x2c, SEEK_SET, nullptr)) {
-        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
-                               "Failed to seek to kernel header: %s",
-                               file->error_string().c_str());
-        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
-    }
-
-    if (!mb::file_read_fully(*file, &kernel_size, sizeof(kernel_size), n)) {
+    if (!_mb_bi_reader_read_at(bir, file, kernel_offset + 0x2c,
+                               &kernel_size, sizeof(kernel_size), n)) {
         mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
                                "Failed to read size from kernel header: %s",
                                file->error_string().c_str());
@@ -479,6 +493,10 @@ int find_linux_kernel_size(MbBiReader *bir, mb::File *file,
  * \param[out] kernel_size_out Pointer to store kernel size
  * \param[out] ramdisk_offset_out Pointer to store ramdisk offset
  * \param[out] ramdisk_size_out Pointer to store ramdisk size
+ * \param[in,out] layout Optional cache for the results of the kernel size,
+ *                       gzip offset, and ramdisk size scans. If it is valid,
+ *                       the scans are skipped. Otherwise, it is filled in on
+ *                       success.
  *
  * \return
  *   * #MB_BI_OK if the header is successfully read
@@ -492,7 +510,8 @@ int loki_read_old_header(MbBiReader *bir, mb::File *file,
                          uint64_t *kernel_offset_out,
                          uint32_t *kernel_size_out,
                          uint64_t *ramdisk_offset_out,
-                         uint32_t *ramdisk_size_out)
+                         uint32_t *ramdisk_size_out,
+                         LokiOldLayout *layout)
 {
     uint32_t tags_addr;
     uint32_t kernel_size;
@@ -512,26 +531,39 @@ int loki_read_old_header(MbBiReader *bir, mb::File *file,
     tags_addr = hdr->kernel_addr - ANDROID_DEFAULT_KERNEL_OFFSET
             + ANDROID_DEFAULT_TAGS_OFFSET;
 
-    // Try to guess kernel size
-    ret = find_linux_kernel_size(bir, file, hdr->page_size, &kernel_size);
-    if (ret != MB_BI_OK) {
-        return ret;
-    }
+    if (layout && layout->valid) {
+        kernel_size = layout->kernel_size;
+        gzip_offset = layout->gzip_offset;
+        ramdisk_size = layout->ramdisk_size;
+    } else {
+        // Try to guess kernel size
+        ret = find_linux_kernel_size(bir, file, hdr->page_size, &kernel_size);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
 
-    // Look for gzip offset for the ramdisk
-    ret = loki_old_find_gzip_offset(
-            bir, file, hdr->page_size + kernel_size
-            + align_page_size<uint64_t>(kernel_size, hdr->page_size),
-            &gzip_offset);
-    if (ret != MB_BI_OK) {
-        return ret;
-    }
+        // Look for gzip offset for the ramdisk
+        ret = loki_old_find_gzip_offset(
+                bir, file, hdr->page_size + kernel_size
+                + align_page_size<uint64_t>(kernel_size, hdr->page_size),
+                &gzip_offset);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
 
-    // Try to guess ramdisk size
-    ret = loki_old_find_ramdisk_size(bir, file, hdr, gzip_offset,
-                                     &ramdisk_size);
-    if (ret != MB_BI_OK) {
-        return ret;
+        // Try to guess ramdisk size
+        ret = loki_old_find_ramdisk_size(bir, file, hdr, gzip_offset,
+                                         &ramdisk_size);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        if (layout) {
+            layout->valid = true;
+            layout->kernel_size = kernel_size;
+            layout->gzip_offset = gzip_offset;
+            layout->ramdisk_size = ramdisk_size;
+        }
     }
 
     // Guess original ramdisk address
@@ -810,7 +842,8 @@ int loki_reader_read_header(MbBiReader *bir, void *userdata,
         ret =  loki_read_old_header(bir, bir->file,
                                     &ctx->hdr, &ctx->loki_hdr, header,
                                     &kernel_offset, &kernel_size,
-                                    &ramdisk_offset, &ramdisk_size);
+                                    &ramdisk_offset, &ramdisk_size,
+                                    &ctx->old_layout);
     }
     if (ret < 0) {
         return ret;
@@ -863,6 +896,16 @@ int loki_reader_read_data(MbBiReader *bir, void *userdata,
                                      bytes_read, bir);
 }
 
+int loki_reader_read_data_view(MbBiReader *bir, void *userdata,
+                               const void *&data, size_t max_size,
+                               size_t &bytes_avail)
+{
+    LokiReaderCtx *const ctx = static_cast<LokiReaderCtx *>(userdata);
+
+    return _segment_reader_read_data_view(&ctx->segctx, bir->file, data,
+                                          max_size, bytes_avail, bir);
+}
+
 int loki_reader_free(MbBiReader *bir, void *userdata)
 {
     (void) bir;
@@ -905,6 +948,7 @@ int mb_bi_reader_enable_format_loki(MbBiReader *bir)
                                          &loki_reader_read_entry,
                                          &loki_reader_go_to_entry,
                                          &loki_reader_read_data,
+                                         &loki_reader_read_data_view,
                                          &loki_reader_free);
 }
 
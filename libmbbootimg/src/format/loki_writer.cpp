@@ -222,7 +222,7 @@ int loki_writer_write_data(MbBiWriter *biw, void *userdata,
 
         // We always include the image in the hash. The size is sometimes
         // included and is handled in loki_writer_finish_entry().
-        if (!SHA1_Update(&ctx->sha_ctx, buf, buf_size)) {
+        if (!_sha1_pipeline_update(ctx->sha_pipeline, buf, buf_size)) {
             mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
                                    "Failed to update SHA1 hash");
             // This must be fatal as the write already happened and cannot be
@@ -252,7 +252,8 @@ int loki_writer_finish_entry(MbBiWriter *biw, void *userdata)
 
     // Include fake 0 size for unsupported secondboot image
     if (swentry->type == MB_BI_ENTRY_DEVICE_TREE
-            && !SHA1_Update(&ctx->sha_ctx, "\x00\x00\x00\x00", 4)) {
+            && !_sha1_pipeline_update(ctx->sha_pipeline,
+                                      "\x00\x00\x00\x00", 4)) {
         mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
                                "Failed to update SHA1 hash");
         return MB_BI_FATAL;
@@ -261,7 +262,8 @@ int loki_writer_finish_entry(MbBiWriter *biw, void *userdata)
     // Include size for everything except empty DT images
     if (swentry->type != MB_BI_ENTRY_ABOOT
             && (swentry->type != MB_BI_ENTRY_DEVICE_TREE || swentry->size > 0)
-            && !SHA1_Update(&ctx->sha_ctx, &le32_size, sizeof(le32_size))) {
+            && !_sha1_pipeline_update(ctx->sha_pipeline,
+                                      &le32_size, sizeof(le32_size))) {
         mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
                                "Failed to update SHA1 hash");
         return MB_BI_FATAL;
@@ -321,7 +323,7 @@ int loki_writer_close(MbBiWriter *biw, void *userdata)
 
         // Set ID
         unsigned char digest[SHA_DIGEST_LENGTH];
-        if (!SHA1_Final(digest, &ctx->sha_ctx)) {
+        if (!_sha1_pipeline_final(ctx->sha_pipeline, digest)) {
             mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
                                    "Failed to update SHA1 hash");
             return MB_BI_FATAL;
@@ -365,6 +367,7 @@ int loki_writer_free(MbBiWriter *bir, void *userdata)
     LokiWriterCtx *const ctx = static_cast<LokiWriterCtx *>(userdata);
     _segment_writer_deinit(&ctx->segctx);
     free(ctx->aboot);
+    _sha1_pipeline_free(ctx->sha_pipeline);
     free(ctx);
     return MB_BI_OK;
 }
@@ -390,11 +393,12 @@ int mb_bi_writer_set_format_loki(MbBiWriter *biw)
         return MB_BI_FAILED;
     }
 
-    if (!SHA1_Init(&ctx->sha_ctx)) {
+    ctx->sha_pipeline = _sha1_pipeline_new();
+    if (!ctx->sha_pipeline) {
         mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
-                               "Failed to initialize SHA_CTX");
+                               "Failed to initialize SHA1 pipeline");
         free(ctx);
-        return false;
+        return MB_BI_FAILED;
     }
 
     _segment_writer_init(&ctx->segctx);
@@ -67,20 +67,13 @@ int read_mtk_header(MbBiReader *bir, mb::File *file,
     MtkHeader mtkhdr;
     size_t n;
 
-    if (!file->seek(offset, SEEK_SET, nullptr)) {
+    if (!_mb_bi_reader_read_at(bir, file, offset, &mtkhdr, sizeof(mtkhdr), n)) {
         mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
-                               "Failed to seek to MTK header at %" PRIu64 ": %s",
+                               "Failed to read MTK header at %" PRIu64 ": %s",
                                offset, file->error_string().c_str());
         return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
     }
 
-    if (!mb::file_read_fully(*file, &mtkhdr, sizeof(mtkhdr), n)) {
-        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
-                               "Failed to read MTK header: %s",
-                               file->error_string().c_str());
-        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
-    }
-
     if (n != sizeof(MtkHeader)
             || memcmp(mtkhdr.magic, MTK_MAGIC, MTK_MAGIC_SIZE) != 0) {
         mb_bi_reader_set_error(bir, MB_BI_ERROR_FILE_FORMAT,
@@ -364,6 +357,16 @@ int mtk_reader_read_data(MbBiReader *bir, void *userdata,
                                      bytes_read, bir);
 }
 
+int mtk_reader_read_data_view(MbBiReader *bir, void *userdata,
+                              const void *&data, size_t max_size,
+                              size_t &bytes_avail)
+{
+    MtkReaderCtx *const ctx = static_cast<MtkReaderCtx *>(userdata);
+
+    return _segment_reader_read_data_view(&ctx->segctx, bir->file, data,
+                                          max_size, bytes_avail, bir);
+}
+
 int mtk_reader_free(MbBiReader *bir, void *userdata)
 {
     (void) bir;
@@ -406,6 +409,7 @@ int mb_bi_reader_enable_format_mtk(MbBiReader *bir)
                                          &mtk_reader_read_entry,
                                          &mtk_reader_go_to_entry,
                                          &mtk_reader_read_data,
+                                         &mtk_reader_read_data_view,
                                          &mtk_reader_free);
 }
 
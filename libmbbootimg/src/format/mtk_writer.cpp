@@ -172,6 +172,31 @@ static int _mtk_compute_sha1(MbBiWriter *biw, SegmentWriterCtx *segctx,
     return MB_BI_OK;
 }
 
+static void _mtk_update_header_size(MtkWriterCtx *ctx,
+                                    SegmentWriterEntry *swentry)
+{
+    switch (swentry->type) {
+    case MB_BI_ENTRY_KERNEL:
+        ctx->hdr.kernel_size = swentry->size + sizeof(MtkHeader);
+        break;
+    case MB_BI_ENTRY_RAMDISK:
+        ctx->hdr.ramdisk_size = swentry->size + sizeof(MtkHeader);
+        break;
+    case MB_BI_ENTRY_SECONDBOOT:
+        ctx->hdr.second_size = swentry->size;
+        break;
+    case MB_BI_ENTRY_DEVICE_TREE:
+        ctx->hdr.dt_size = swentry->size;
+        break;
+    }
+}
+
+static bool _mtk_is_mtk_header_entry(SegmentWriterEntry *swentry)
+{
+    return swentry->type == MB_BI_ENTRY_MTK_KERNEL_HEADER
+            || swentry->type == MB_BI_ENTRY_MTK_RAMDISK_HEADER;
+}
+
 int mtk_writer_get_header(MbBiWriter *biw, void *userdata,
                           MbBiHeader *header)
 {
@@ -258,35 +283,80 @@ int mtk_writer_write_header(MbBiWriter *biw, void *userdata,
     // TODO: UNUSED
     // TODO: ID
 
+    // If the caller declared the sizes of all entries, the header can be
+    // written now and the rest of the image can be written sequentially
+    const struct {
+        int type;
+        uint64_t align;
+    } entry_types[] = {
+        { MB_BI_ENTRY_MTK_KERNEL_HEADER,  0 },
+        { MB_BI_ENTRY_KERNEL,             ctx->hdr.page_size },
+        { MB_BI_ENTRY_MTK_RAMDISK_HEADER, 0 },
+        { MB_BI_ENTRY_RAMDISK,            ctx->hdr.page_size },
+        { MB_BI_ENTRY_SECONDBOOT,         ctx->hdr.page_size },
+        { MB_BI_ENTRY_DEVICE_TREE,        ctx->hdr.page_size },
+    };
+    uint64_t entry_sizes[sizeof(entry_types) / sizeof(entry_types[0])];
+    bool streaming = true;
+
+    for (size_t i = 0; i < sizeof(entry_types) / sizeof(entry_types[0]); ++i) {
+        if (!_mb_bi_writer_entry_size(biw, entry_types[i].type,
+                                      &entry_sizes[i])) {
+            streaming = false;
+        } else if (entry_sizes[i] > UINT32_MAX - sizeof(MtkHeader)) {
+            mb_bi_writer_set_error(biw, MB_BI_ERROR_INVALID_ARGUMENT,
+                                   "Invalid entry size: %" PRIu64,
+                                   entry_sizes[i]);
+            return MB_BI_FAILED;
+        } else if ((entry_types[i].type == MB_BI_ENTRY_MTK_KERNEL_HEADER
+                || entry_types[i].type == MB_BI_ENTRY_MTK_RAMDISK_HEADER)
+                && entry_sizes[i] != sizeof(MtkHeader)) {
+            mb_bi_writer_set_error(biw, MB_BI_ERROR_INVALID_ARGUMENT,
+                                   "Invalid size for MTK header entry");
+            return MB_BI_FAILED;
+        }
+    }
+
     // Clear existing entries (none should exist unless this function fails and
     // the user reattempts to call it)
     _segment_writer_entries_clear(&ctx->segctx);
 
-    ret = _segment_writer_entries_add(&ctx->segctx,
-                                      MB_BI_ENTRY_MTK_KERNEL_HEADER,
-                                      0, false, 0, biw);
-    if (ret != MB_BI_OK) return ret;
+    for (size_t i = 0; i < sizeof(entry_types) / sizeof(entry_types[0]); ++i) {
+        ret = _segment_writer_entries_add(
+                &ctx->segctx, entry_types[i].type,
+                streaming ? static_cast<uint32_t>(entry_sizes[i]) : 0,
+                streaming, entry_types[i].align, biw);
+        if (ret != MB_BI_OK) return ret;
+    }
 
-    ret = _segment_writer_entries_add(&ctx->segctx, MB_BI_ENTRY_KERNEL,
-                                      0, false, ctx->hdr.page_size, biw);
-    if (ret != MB_BI_OK) return ret;
+    if (streaming) {
+        size_t n;
 
-    ret = _segment_writer_entries_add(&ctx->segctx,
-                                      MB_BI_ENTRY_MTK_RAMDISK_HEADER,
-                                      0, false, 0, biw);
-    if (ret != MB_BI_OK) return ret;
+        _segment_writer_layout(&ctx->segctx, ctx->hdr.page_size);
 
-    ret = _segment_writer_entries_add(&ctx->segctx, MB_BI_ENTRY_RAMDISK,
-                                      0, false, ctx->hdr.page_size, biw);
-    if (ret != MB_BI_OK) return ret;
+        for (size_t i = 0; i < _segment_writer_entries_size(&ctx->segctx);
+                ++i) {
+            _mtk_update_header_size(
+                    ctx, _segment_writer_entries_get(&ctx->segctx, i));
+        }
 
-    ret = _segment_writer_entries_add(&ctx->segctx, MB_BI_ENTRY_SECONDBOOT,
-                                      0, false, ctx->hdr.page_size, biw);
-    if (ret != MB_BI_OK) return ret;
+        // The id field covers the entry data, which has not been written yet,
+        // so it is left zeroed
+        AndroidHeader hdr = ctx->hdr;
+        android_fix_header_byte_order(&hdr);
 
-    ret = _segment_writer_entries_add(&ctx->segctx, MB_BI_ENTRY_DEVICE_TREE,
-                                      0, false, ctx->hdr.page_size, biw);
-    if (ret != MB_BI_OK) return ret;
+        if (!mb::file_write_fully(*biw->file, &hdr, sizeof(hdr), n)
+                || n != sizeof(hdr)) {
+            mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
+                                   "Failed to write header: %s",
+                                   biw->file->error_string().c_str());
+            return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+        }
+
+        return _segment_writer_begin_stream(&ctx->segctx, biw->file,
+                                            sizeof(hdr), ctx->hdr.page_size,
+                                            biw);
+    }
 
     // Start writing after first page
     if (!biw->file->seek(ctx->hdr.page_size, SEEK_SET, nullptr)) {
@@ -304,6 +374,8 @@ int mtk_writer_get_entry(MbBiWriter *biw, void *userdata,
 {
     MtkWriterCtx *const ctx = static_cast<MtkWriterCtx *>(userdata);
 
+    ctx->mtkhdr_len = 0;
+
     return _segment_writer_get_entry(&ctx->segctx, biw->file, entry, biw);
 }
 
@@ -320,6 +392,22 @@ int mtk_writer_write_data(MbBiWriter *biw, void *userdata,
                           size_t &bytes_written)
 {
     MtkWriterCtx *const ctx = static_cast<MtkWriterCtx *>(userdata);
+    SegmentWriterEntry *swentry = _segment_writer_entry(&ctx->segctx);
+
+    // Hold back MTK headers until their size fields can be filled in
+    if (ctx->segctx.streaming && _mtk_is_mtk_header_entry(swentry)) {
+        if (buf_size > sizeof(ctx->mtkhdr_buf) - ctx->mtkhdr_len) {
+            mb_bi_writer_set_error(biw, MB_BI_ERROR_FILE_FORMAT,
+                                   "Invalid size for MTK header entry");
+            return MB_BI_FAILED;
+        }
+
+        memcpy(ctx->mtkhdr_buf + ctx->mtkhdr_len, buf, buf_size);
+        ctx->mtkhdr_len += buf_size;
+        bytes_written = buf_size;
+
+        return MB_BI_OK;
+    }
 
     return _segment_writer_write_data(&ctx->segctx, biw->file, buf, buf_size,
                                       bytes_written, biw);
@@ -331,13 +419,37 @@ int mtk_writer_finish_entry(MbBiWriter *biw, void *userdata)
     SegmentWriterEntry *swentry;
     int ret;
 
+    swentry = _segment_writer_entry(&ctx->segctx);
+
+    if (ctx->segctx.streaming && _mtk_is_mtk_header_entry(swentry)) {
+        if (ctx->mtkhdr_len != sizeof(MtkHeader)) {
+            mb_bi_writer_set_error(biw, MB_BI_ERROR_FILE_FORMAT,
+                                   "Invalid size for MTK header entry");
+            return MB_BI_FATAL;
+        }
+
+        uint32_t le32_size = mb_htole32(
+                swentry->type == MB_BI_ENTRY_MTK_KERNEL_HEADER
+                ? ctx->hdr.kernel_size - sizeof(MtkHeader)
+                : ctx->hdr.ramdisk_size - sizeof(MtkHeader));
+        size_t n;
+
+        memcpy(ctx->mtkhdr_buf + offsetof(MtkHeader, size), &le32_size,
+               sizeof(le32_size));
+
+        ret = _segment_writer_write_data(&ctx->segctx, biw->file,
+                                         ctx->mtkhdr_buf, ctx->mtkhdr_len,
+                                         n, biw);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+    }
+
     ret = _segment_writer_finish_entry(&ctx->segctx, biw->file, biw);
     if (ret != MB_BI_OK) {
         return ret;
     }
 
-    swentry = _segment_writer_entry(&ctx->segctx);
-
     if ((swentry->type == MB_BI_ENTRY_KERNEL
             || swentry->type == MB_BI_ENTRY_RAMDISK)
             && swentry->size == UINT32_MAX - sizeof(MtkHeader)) {
@@ -352,20 +464,7 @@ int mtk_writer_finish_entry(MbBiWriter *biw, void *userdata)
         return MB_BI_FATAL;
     }
 
-    switch (swentry->type) {
-    case MB_BI_ENTRY_KERNEL:
-        ctx->hdr.kernel_size = swentry->size + sizeof(MtkHeader);
-        break;
-    case MB_BI_ENTRY_RAMDISK:
-        ctx->hdr.ramdisk_size = swentry->size + sizeof(MtkHeader);
-        break;
-    case MB_BI_ENTRY_SECONDBOOT:
-        ctx->hdr.second_size = swentry->size;
-        break;
-    case MB_BI_ENTRY_DEVICE_TREE:
-        ctx->hdr.dt_size = swentry->size;
-        break;
-    }
+    _mtk_update_header_size(ctx, swentry);
 
     return MB_BI_OK;
 }
@@ -377,6 +476,11 @@ int mtk_writer_close(MbBiWriter *biw, void *userdata)
     int ret;
     size_t n;
 
+    // Everything, including the MTK header sizes, was written in order
+    if (ctx->segctx.streaming) {
+        return MB_BI_OK;
+    }
+
     if (!ctx->have_file_size) {
         if (!biw->file->seek(0, SEEK_CUR, &ctx->file_size)) {
             mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
@@ -237,3 +237,53 @@ int _segment_reader_read_data(SegmentReaderCtx *ctx, mb::File *file,
 
     return bytes_read == 0 ? MB_BI_EOF : MB_BI_OK;
 }
+
+int _segment_reader_read_data_view(SegmentReaderCtx *ctx, mb::File *file,
+                                   const void *&data, size_t max_size,
+                                   size_t &bytes_avail, MbBiReader *bir)
+{
+    size_t to_peek = std::min<uint64_t>(
+            max_size, ctx->read_end_offset - ctx->read_cur_offset);
+    const void *view;
+    size_t n;
+
+    if (!file->peek(ctx->read_cur_offset, to_peek, view, n)) {
+        if (file->error() == mb::FileError::Unsupported) {
+            // Caller will fall back to _segment_reader_read_data()
+            return MB_BI_UNSUPPORTED;
+        }
+
+        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
+                               "Failed to read data: %s",
+                               file->error_string().c_str());
+        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+    }
+
+    n = std::min(n, to_peek);
+
+    // Fail if we reach EOF early
+    if (n == 0 && ctx->read_cur_offset != ctx->read_end_offset
+            && !ctx->entry->can_truncate) {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_FILE_FORMAT,
+                               "Entry is truncated "
+                               "(expected %" PRIu64 " more bytes)",
+                               ctx->read_end_offset - ctx->read_cur_offset);
+        return MB_BI_FATAL;
+    }
+
+    // Keep the file position in sync so that _segment_reader_read_data() and
+    // _segment_reader_move_to_entry() continue from the right place
+    if (n > 0 && !file->seek(ctx->read_cur_offset + n, SEEK_SET, nullptr)) {
+        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
+                               "Failed to seek: %s",
+                               file->error_string().c_str());
+        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+    }
+
+    ctx->read_cur_offset += n;
+
+    data = view;
+    bytes_avail = n;
+
+    return n == 0 ? MB_BI_EOF : MB_BI_OK;
+}
@@ -136,6 +136,90 @@ void _segment_writer_update_size_if_unset(SegmentWriterCtx *ctx,
     }
 }
 
+/*!
+ * \brief Compute the offsets of all entries
+ *
+ * All entries must have their sizes set.
+ *
+ * \param ctx Segment writer context
+ * \param start Offset of the first entry
+ *
+ * \return Offset after the last entry (including its alignment padding)
+ */
+uint64_t _segment_writer_layout(SegmentWriterCtx *ctx, uint64_t start)
+{
+    uint64_t pos = start;
+
+    for (size_t i = 0; i < ctx->entries_len; ++i) {
+        SegmentWriterEntry *entry = &ctx->entries[i];
+
+        entry->offset = pos;
+        pos += entry->size;
+
+        if (entry->align > 0) {
+            pos += align_page_size<uint64_t>(pos, entry->align);
+        }
+    }
+
+    return pos;
+}
+
+/*!
+ * \brief Switch to single-pass mode after the header has been written
+ *
+ * Pads the output from \p header_size (the number of bytes already written) to
+ * \p start, where the first entry begins. Afterwards, the writer never seeks
+ * and writes alignment padding explicitly.
+ */
+int _segment_writer_begin_stream(SegmentWriterCtx *ctx, mb::File *file,
+                                 uint64_t header_size, uint64_t start,
+                                 MbBiWriter *biw)
+{
+    if (header_size > start) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
+                               "Header does not fit before first entry");
+        return MB_BI_FATAL;
+    }
+
+    int ret = _segment_writer_write_zeros(file, start - header_size, biw);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+    ctx->streaming = true;
+    ctx->have_pos = true;
+    ctx->pos = start;
+
+    return MB_BI_OK;
+}
+
+int _segment_writer_write_zeros(mb::File *file, uint64_t size,
+                                MbBiWriter *biw)
+{
+    static const char zeros[4096] = {};
+    size_t n;
+
+    while (size > 0) {
+        size_t to_write = std::min<uint64_t>(size, sizeof(zeros));
+
+        if (!mb::file_write_fully(*file, zeros, to_write, n)) {
+            mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
+                                   "Failed to write padding: %s",
+                                   file->error_string().c_str());
+            return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+        } else if (n != to_write) {
+            mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
+                                   "Padding write was truncated: %s",
+                                   file->error_string().c_str());
+            return MB_BI_FATAL;
+        }
+
+        size -= to_write;
+    }
+
+    return MB_BI_OK;
+}
+
 int _segment_writer_get_entry(SegmentWriterCtx *ctx, mb::File *file,
                               MbBiEntry *entry, MbBiWriter *biw)
 {
@@ -189,6 +273,12 @@ int _segment_writer_write_entry(SegmentWriterCtx *ctx, mb::File *file,
             mb_bi_writer_set_error(biw, MB_BI_ERROR_INVALID_ARGUMENT,
                                    "Invalid entry size: %" PRIu64, size);
             return MB_BI_FAILED;
+        } else if (ctx->streaming && size != ctx->entry->size) {
+            mb_bi_writer_set_error(biw, MB_BI_ERROR_INVALID_ARGUMENT,
+                                   "Entry size %" PRIu64 " does not match "
+                                   "declared size %" PRIu32,
+                                   size, ctx->entry->size);
+            return MB_BI_FAILED;
         }
 
         _segment_writer_update_size_if_unset(ctx, size);
@@ -209,6 +299,14 @@ int _segment_writer_write_data(SegmentWriterCtx *ctx, mb::File *file,
         return MB_BI_FAILED;
     }
 
+    // The headers have already been written with the declared size
+    if (ctx->streaming && ctx->entry_size + buf_size > ctx->entry->size) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_INVALID_ARGUMENT,
+                               "Entry data exceeds declared size of %" PRIu32,
+                               ctx->entry->size);
+        return MB_BI_FAILED;
+    }
+
     if (!mb::file_write_fully(*file, buf, buf_size, bytes_written)) {
         mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
                                "Failed to write data: %s",
@@ -232,6 +330,30 @@ int _segment_writer_write_data(SegmentWriterCtx *ctx, mb::File *file,
 int _segment_writer_finish_entry(SegmentWriterCtx *ctx, mb::File *file,
                                  MbBiWriter *biw)
 {
+    if (ctx->streaming) {
+        if (ctx->entry_size != ctx->entry->size) {
+            mb_bi_writer_set_error(biw, MB_BI_ERROR_FILE_FORMAT,
+                                   "Expected %" PRIu32 " bytes of entry data, "
+                                   "but only %" PRIu32 " were written",
+                                   ctx->entry->size, ctx->entry_size);
+            return MB_BI_FATAL;
+        }
+
+        if (ctx->entry->align > 0) {
+            uint64_t skip = align_page_size<uint64_t>(
+                    ctx->pos, ctx->entry->align);
+
+            int ret = _segment_writer_write_zeros(file, skip, biw);
+            if (ret != MB_BI_OK) {
+                return ret;
+            }
+
+            ctx->pos += skip;
+        }
+
+        return MB_BI_OK;
+    }
+
     // Update size with number of bytes written
     _segment_writer_update_size_if_unset(ctx, ctx->entry_size);
 
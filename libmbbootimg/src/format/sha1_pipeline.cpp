@@ -0,0 +1,291 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbbootimg/format/sha1_pipeline_p.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <system_error>
+#include <thread>
+
+#include <cstring>
+
+/*
+ * SHA1 hashing pipeline.
+ *
+ * Data passed to _sha1_pipeline_update() is copied into one of two buffers.
+ * Once a buffer is full, it is handed to a worker thread for hashing while the
+ * caller continues to fill the other buffer. This allows the hash computation
+ * to overlap with the writer's I/O without changing the order in which bytes
+ * are fed to SHA1_Update(), so the resulting digest is identical to hashing
+ * the data inline.
+ *
+ * The worker thread is only started once a buffer fills up. Small inputs are
+ * hashed inline when the digest is computed. If the thread cannot be started,
+ * all data is hashed inline.
+ */
+struct Sha1Pipeline
+{
+    SHA_CTX sha_ctx;
+
+    std::unique_ptr<unsigned char[]> bufs[2];
+    // Buffer currently being filled by the caller
+    size_t fill_index;
+    size_t fill_size;
+
+    std::thread thread;
+    bool thread_started;
+    bool thread_failed;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    // Buffer handed off to the worker thread
+    bool pending;
+    size_t pending_index;
+    size_t pending_size;
+    // Set when SHA1_Update() fails on the worker thread
+    bool failed;
+    bool stop;
+
+    Sha1Pipeline()
+        : fill_index(0)
+        , fill_size(0)
+        , thread_started(false)
+        , thread_failed(false)
+        , pending(false)
+        , pending_index(0)
+        , pending_size(0)
+        , failed(false)
+        , stop(false)
+    {
+    }
+};
+
+static void _sha1_pipeline_worker(Sha1Pipeline *sp)
+{
+    std::unique_lock<std::mutex> lock(sp->mutex);
+
+    while (true) {
+        sp->cv.wait(lock, [sp]{
+            return sp->pending || sp->stop;
+        });
+
+        if (!sp->pending) {
+            break;
+        }
+
+        const unsigned char *data = sp->bufs[sp->pending_index].get();
+        size_t size = sp->pending_size;
+
+        lock.unlock();
+        bool ret = SHA1_Update(&sp->sha_ctx, data, size);
+        lock.lock();
+
+        if (!ret) {
+            sp->failed = true;
+        }
+        sp->pending = false;
+        sp->cv.notify_all();
+    }
+}
+
+/*!
+ * \brief Wait for the worker thread to finish hashing the pending buffer
+ *
+ * \return Whether all data handed to the worker thread was hashed successfully
+ */
+static bool _sha1_pipeline_wait(Sha1Pipeline *sp)
+{
+    if (!sp->thread_started) {
+        return true;
+    }
+
+    std::unique_lock<std::mutex> lock(sp->mutex);
+    sp->cv.wait(lock, [sp]{
+        return !sp->pending;
+    });
+
+    return !sp->failed;
+}
+
+/*!
+ * \brief Hash the contents of the fill buffer
+ *
+ * \param sp Sha1Pipeline
+ * \param async Whether the buffer may be handed off to the worker thread
+ *
+ * \return Whether the data was successfully hashed or queued for hashing
+ */
+static bool _sha1_pipeline_flush(Sha1Pipeline *sp, bool async)
+{
+    if (sp->fill_size == 0) {
+        return true;
+    }
+
+    if (async && !sp->thread_started && !sp->thread_failed) {
+        try {
+            sp->thread = std::thread(&_sha1_pipeline_worker, sp);
+            sp->thread_started = true;
+        } catch (const std::system_error &) {
+            sp->thread_failed = true;
+        }
+    }
+
+    if (!async || !sp->thread_started) {
+        // Hash inline after anything that was already handed off
+        if (!_sha1_pipeline_wait(sp)) {
+            return false;
+        }
+
+        bool ret = SHA1_Update(&sp->sha_ctx, sp->bufs[sp->fill_index].get(),
+                               sp->fill_size);
+        sp->fill_size = 0;
+        return ret;
+    }
+
+    std::unique_lock<std::mutex> lock(sp->mutex);
+    sp->cv.wait(lock, [sp]{
+        return !sp->pending;
+    });
+
+    if (sp->failed) {
+        return false;
+    }
+
+    sp->pending = true;
+    sp->pending_index = sp->fill_index;
+    sp->pending_size = sp->fill_size;
+    sp->cv.notify_all();
+
+    // The other buffer is no longer in use since we waited for the previous
+    // hand off to complete
+    sp->fill_index ^= 1;
+    sp->fill_size = 0;
+
+    return true;
+}
+
+/*!
+ * \brief Allocate new SHA1 pipeline
+ *
+ * \return New Sha1Pipeline or NULL if memory could not be allocated or the
+ *         SHA1 context could not be initialized
+ */
+Sha1Pipeline * _sha1_pipeline_new(void)
+{
+    std::unique_ptr<Sha1Pipeline> sp(new(std::nothrow) Sha1Pipeline());
+    if (!sp) {
+        return nullptr;
+    }
+
+    for (auto &buf : sp->bufs) {
+        buf.reset(new(std::nothrow) unsigned char[SHA1_PIPELINE_BUF_SIZE]);
+        if (!buf) {
+            return nullptr;
+        }
+    }
+
+    if (!SHA1_Init(&sp->sha_ctx)) {
+        return nullptr;
+    }
+
+    return sp.release();
+}
+
+/*!
+ * \brief Stop the worker thread and free the SHA1 pipeline
+ *
+ * \param sp Sha1Pipeline (may be NULL)
+ */
+void _sha1_pipeline_free(Sha1Pipeline *sp)
+{
+    if (!sp) {
+        return;
+    }
+
+    if (sp->thread_started) {
+        {
+            std::lock_guard<std::mutex> lock(sp->mutex);
+            sp->stop = true;
+            sp->cv.notify_all();
+        }
+
+        sp->thread.join();
+    }
+
+    delete sp;
+}
+
+/*!
+ * \brief Add data to the hash
+ *
+ * The data is copied, so \p data can be reused as soon as the function
+ * returns.
+ *
+ * \param sp Sha1Pipeline
+ * \param data Data to hash
+ * \param size Size of \p data
+ *
+ * \return Whether the data was successfully added. If false is returned, the
+ *         pipeline can no longer be used.
+ */
+bool _sha1_pipeline_update(Sha1Pipeline *sp, const void *data, size_t size)
+{
+    auto ptr = static_cast<const unsigned char *>(data);
+
+    while (size > 0) {
+        size_t n = std::min(size, SHA1_PIPELINE_BUF_SIZE - sp->fill_size);
+
+        memcpy(sp->bufs[sp->fill_index].get() + sp->fill_size, ptr, n);
+        sp->fill_size += n;
+        ptr += n;
+        size -= n;
+
+        if (sp->fill_size == SHA1_PIPELINE_BUF_SIZE
+                && !_sha1_pipeline_flush(sp, true)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Compute the final digest
+ *
+ * Waits for all pending data to be hashed. The pipeline can no longer be
+ * updated after this function is called.
+ *
+ * \param[in] sp Sha1Pipeline
+ * \param[out] digest Buffer for storing the digest
+ *
+ * \return Whether the digest was successfully computed
+ */
+bool _sha1_pipeline_final(Sha1Pipeline *sp,
+                          unsigned char digest[SHA_DIGEST_LENGTH])
+{
+    // Hashing the remaining data inline is faster than handing it off since
+    // we must wait for it to complete anyway
+    return _sha1_pipeline_flush(sp, false)
+            && _sha1_pipeline_wait(sp)
+            && SHA1_Final(digest, &sp->sha_ctx);
+}
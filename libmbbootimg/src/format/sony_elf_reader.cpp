@@ -68,14 +68,7 @@ int find_sony_elf_header(MbBiReader *bir, mb::File *file,
     Sony_Elf32_Ehdr header;
     size_t n;
 
-    if (!file->seek(0, SEEK_SET, nullptr)) {
-        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
-                               "Failed to seek to beginning: %s",
-                               file->error_string().c_str());
-        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
-    }
-
-    if (!mb::file_read_fully(*file, &header, sizeof(header), n)) {
+    if (!_mb_bi_reader_read_at(bir, file, 0, &header, sizeof(header), n)) {
         mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
                                "Failed to read header: %s",
                                file->error_string().c_str());
@@ -174,19 +167,13 @@ int sony_elf_reader_read_header(MbBiReader *bir, void *userdata,
         Sony_Elf32_Phdr phdr;
         size_t n;
 
-        if (!bir->file->seek(pos, SEEK_SET, nullptr)) {
+        if (!_mb_bi_reader_read_at(bir, bir->file, pos,
+                                   &phdr, sizeof(phdr), n)) {
             mb_bi_reader_set_error(bir, bir->file->error().value() /* TODO */,
-                                   "Failed to seek to segment %" PRIu16
+                                   "Failed to read segment %" PRIu16
                                    " at %" PRIu64 ": %s", i, pos,
                                    bir->file->error_string().c_str());
             return bir->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
-        }
-
-        if (!mb::file_read_fully(*bir->file, &phdr, sizeof(phdr), n)) {
-            mb_bi_reader_set_error(bir, bir->file->error().value() /* TODO */,
-                                   "Failed to read segment %" PRIu16 ": %s",
-                                   i, bir->file->error_string().c_str());
-            return bir->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
         } else if (n != sizeof(phdr)) {
             mb_bi_reader_set_error(bir, MB_BI_ERROR_FILE_FORMAT,
                                    "Unexpected EOF when reading segment"
@@ -210,14 +197,8 @@ int sony_elf_reader_read_header(MbBiReader *bir, void *userdata,
                 return MB_BI_WARN;
             }
 
-            if (!bir->file->seek(phdr.p_offset, SEEK_SET, nullptr)) {
-                mb_bi_reader_set_error(bir, bir->file->error().value() /* TODO */,
-                                       "Failed to seek to cmdline: %s",
-                                       bir->file->error_string().c_str());
-                return bir->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
-            }
-
-            if (!mb::file_read_fully(*bir->file, cmdline, phdr.p_memsz, n)) {
+            if (!_mb_bi_reader_read_at(bir, bir->file, phdr.p_offset,
+                                       cmdline, phdr.p_memsz, n)) {
                 mb_bi_reader_set_error(bir, bir->file->error().value() /* TODO */,
                                        "Failed to read cmdline: %s",
                                        bir->file->error_string().c_str());
@@ -324,6 +305,16 @@ int sony_elf_reader_read_data(MbBiReader *bir, void *userdata,
                                      bytes_read, bir);
 }
 
+int sony_elf_reader_read_data_view(MbBiReader *bir, void *userdata,
+                                   const void *&data, size_t max_size,
+                                   size_t &bytes_avail)
+{
+    SonyElfReaderCtx *const ctx = static_cast<SonyElfReaderCtx *>(userdata);
+
+    return _segment_reader_read_data_view(&ctx->segctx, bir->file, data,
+                                          max_size, bytes_avail, bir);
+}
+
 int sony_elf_reader_free(MbBiReader *bir, void *userdata)
 {
     (void) bir;
@@ -366,6 +357,7 @@ int mb_bi_reader_enable_format_sony_elf(MbBiReader *bir)
                                          &sony_elf_reader_read_entry,
                                          &sony_elf_reader_go_to_entry,
                                          &sony_elf_reader_read_data,
+                                         &sony_elf_reader_read_data_view,
                                          &sony_elf_reader_free);
 }
 
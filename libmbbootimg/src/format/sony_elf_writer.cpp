@@ -41,9 +41,109 @@
 
 #define SONY_ELF_ENTRY_CMDLINE              (-1)
 
+// Offset of the first entry
+#define SONY_ELF_DATA_OFFSET                4096
+
 
 MB_BEGIN_C_DECLS
 
+static void _sony_elf_update_phdr(SonyElfWriterCtx *ctx,
+                                  SegmentWriterEntry *swentry)
+{
+    Sony_Elf32_Phdr *phdr;
+
+    switch (swentry->type) {
+    case MB_BI_ENTRY_KERNEL:
+        phdr = &ctx->hdr_kernel;
+        break;
+    case MB_BI_ENTRY_RAMDISK:
+        phdr = &ctx->hdr_ramdisk;
+        break;
+    case MB_BI_ENTRY_SONY_IPL:
+        phdr = &ctx->hdr_ipl;
+        break;
+    case MB_BI_ENTRY_SONY_RPM:
+        phdr = &ctx->hdr_rpm;
+        break;
+    case MB_BI_ENTRY_SONY_APPSBL:
+        phdr = &ctx->hdr_appsbl;
+        break;
+    case SONY_ELF_ENTRY_CMDLINE:
+        phdr = &ctx->hdr_cmdline;
+        break;
+    default:
+        return;
+    }
+
+    phdr->p_offset = swentry->offset;
+    phdr->p_filesz = swentry->size;
+    phdr->p_memsz = swentry->size;
+}
+
+/*!
+ * \brief Write ELF header and program headers at the current file position
+ *
+ * \param[out] size_out Number of bytes written
+ */
+static int _sony_elf_write_headers(MbBiWriter *biw, SonyElfWriterCtx *ctx,
+                                   size_t &size_out)
+{
+    Sony_Elf32_Ehdr hdr = ctx->hdr;
+    Sony_Elf32_Phdr hdr_kernel = ctx->hdr_kernel;
+    Sony_Elf32_Phdr hdr_ramdisk = ctx->hdr_ramdisk;
+    Sony_Elf32_Phdr hdr_cmdline = ctx->hdr_cmdline;
+    Sony_Elf32_Phdr hdr_ipl = ctx->hdr_ipl;
+    Sony_Elf32_Phdr hdr_rpm = ctx->hdr_rpm;
+    Sony_Elf32_Phdr hdr_appsbl = ctx->hdr_appsbl;
+    size_t n;
+
+    struct {
+        const void *ptr;
+        size_t size;
+        bool can_write;
+    } headers[] = {
+        { &hdr, sizeof(hdr), true },
+        { &hdr_kernel, sizeof(hdr_kernel), hdr_kernel.p_filesz > 0 },
+        { &hdr_ramdisk, sizeof(hdr_ramdisk), hdr_ramdisk.p_filesz > 0 },
+        { &hdr_cmdline, sizeof(hdr_cmdline), hdr_cmdline.p_filesz > 0 },
+        { &hdr_ipl, sizeof(hdr_ipl), hdr_ipl.p_filesz > 0 },
+        { &hdr_rpm, sizeof(hdr_rpm), hdr_rpm.p_filesz > 0 },
+        { &hdr_appsbl, sizeof(hdr_appsbl), hdr_appsbl.p_filesz > 0 },
+        { nullptr, 0, false },
+    };
+
+    sony_elf_fix_ehdr_byte_order(&hdr);
+    sony_elf_fix_phdr_byte_order(&hdr_kernel);
+    sony_elf_fix_phdr_byte_order(&hdr_ramdisk);
+    sony_elf_fix_phdr_byte_order(&hdr_cmdline);
+    sony_elf_fix_phdr_byte_order(&hdr_ipl);
+    sony_elf_fix_phdr_byte_order(&hdr_rpm);
+    sony_elf_fix_phdr_byte_order(&hdr_appsbl);
+
+    // Write all headers at once
+    mb::FileConstIoVec iov[sizeof(headers) / sizeof(headers[0])];
+    size_t iov_count = 0;
+    size_t total_size = 0;
+
+    for (auto it = headers; it->ptr && it->can_write; ++it) {
+        iov[iov_count].data = it->ptr;
+        iov[iov_count].size = it->size;
+        ++iov_count;
+        total_size += it->size;
+    }
+
+    if (!mb::file_writev_fully(*biw->file, iov, iov_count, n)
+            || n != total_size) {
+        mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
+                               "Failed to write header: %s",
+                               biw->file->error_string().c_str());
+        return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+    }
+
+    size_out = total_size;
+    return MB_BI_OK;
+}
+
 int sony_elf_writer_get_header(MbBiWriter *biw, void *userdata,
                                MbBiHeader *header)
 {
@@ -164,36 +264,72 @@ int sony_elf_writer_write_header(MbBiWriter *biw, void *userdata,
         ctx->hdr_appsbl.p_paddr = mb_bi_header_sony_appsbl_address(header);
     }
 
+    // If the caller declared the sizes of all entries, the headers can be
+    // written now and the rest of the image can be written sequentially
+    static const int entry_types[] = {
+        MB_BI_ENTRY_KERNEL,
+        MB_BI_ENTRY_RAMDISK,
+        SONY_ELF_ENTRY_CMDLINE,
+        MB_BI_ENTRY_SONY_IPL,
+        MB_BI_ENTRY_SONY_RPM,
+        MB_BI_ENTRY_SONY_APPSBL,
+    };
+    uint64_t entry_sizes[sizeof(entry_types) / sizeof(entry_types[0])];
+    bool streaming = true;
+
+    for (size_t i = 0; i < sizeof(entry_types) / sizeof(entry_types[0]); ++i) {
+        if (entry_types[i] == SONY_ELF_ENTRY_CMDLINE) {
+            entry_sizes[i] = ctx->cmdline_size;
+        } else if (!_mb_bi_writer_entry_size(biw, entry_types[i],
+                                             &entry_sizes[i])) {
+            streaming = false;
+        } else if (entry_sizes[i] > UINT32_MAX) {
+            mb_bi_writer_set_error(biw, MB_BI_ERROR_INVALID_ARGUMENT,
+                                   "Invalid entry size: %" PRIu64,
+                                   entry_sizes[i]);
+            return MB_BI_FAILED;
+        }
+    }
+
     // Clear existing entries (none should exist unless this function fails and
     // the user reattempts to call it)
     _segment_writer_entries_clear(&ctx->segctx);
 
-    ret = _segment_writer_entries_add(&ctx->segctx, MB_BI_ENTRY_KERNEL,
-                                      0, false, 0, biw);
-    if (ret != MB_BI_OK) return ret;
+    for (size_t i = 0; i < sizeof(entry_types) / sizeof(entry_types[0]); ++i) {
+        ret = _segment_writer_entries_add(
+                &ctx->segctx, entry_types[i],
+                streaming ? static_cast<uint32_t>(entry_sizes[i]) : 0,
+                streaming, 0, biw);
+        if (ret != MB_BI_OK) return ret;
+    }
+
+    if (streaming) {
+        size_t header_size;
+
+        _segment_writer_layout(&ctx->segctx, SONY_ELF_DATA_OFFSET);
 
-    ret = _segment_writer_entries_add(&ctx->segctx, MB_BI_ENTRY_RAMDISK,
-                                      0, false, 0, biw);
-    if (ret != MB_BI_OK) return ret;
+        for (size_t i = 0; i < _segment_writer_entries_size(&ctx->segctx);
+                ++i) {
+            SegmentWriterEntry *swentry =
+                    _segment_writer_entries_get(&ctx->segctx, i);
 
-    ret = _segment_writer_entries_add(&ctx->segctx, SONY_ELF_ENTRY_CMDLINE,
-                                      0, false, 0, biw);
-    if (ret != MB_BI_OK) return ret;
+            _sony_elf_update_phdr(ctx, swentry);
 
-    ret = _segment_writer_entries_add(&ctx->segctx, MB_BI_ENTRY_SONY_IPL,
-                                      0, false, 0, biw);
-    if (ret != MB_BI_OK) return ret;
+            if (swentry->size > 0) {
+                ++ctx->hdr.e_phnum;
+            }
+        }
 
-    ret = _segment_writer_entries_add(&ctx->segctx, MB_BI_ENTRY_SONY_RPM,
-                                      0, false, 0, biw);
-    if (ret != MB_BI_OK) return ret;
+        ret = _sony_elf_write_headers(biw, ctx, header_size);
+        if (ret != MB_BI_OK) return ret;
 
-    ret = _segment_writer_entries_add(&ctx->segctx, MB_BI_ENTRY_SONY_APPSBL,
-                                      0, false, 0, biw);
-    if (ret != MB_BI_OK) return ret;
+        return _segment_writer_begin_stream(&ctx->segctx, biw->file,
+                                            header_size, SONY_ELF_DATA_OFFSET,
+                                            biw);
+    }
 
     // Start writing at offset 4096
-    if (!biw->file->seek(4096, SEEK_SET, nullptr)) {
+    if (!biw->file->seek(SONY_ELF_DATA_OFFSET, SEEK_SET, nullptr)) {
         mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
                                "Failed to seek to first page: %s",
                                biw->file->error_string().c_str());
@@ -274,40 +410,10 @@ int sony_elf_writer_finish_entry(MbBiWriter *biw, void *userdata)
 
     swentry = _segment_writer_entry(&ctx->segctx);
 
-    switch (swentry->type) {
-    case MB_BI_ENTRY_KERNEL:
-        ctx->hdr_kernel.p_offset = swentry->offset;
-        ctx->hdr_kernel.p_filesz = swentry->size;
-        ctx->hdr_kernel.p_memsz = swentry->size;
-        break;
-    case MB_BI_ENTRY_RAMDISK:
-        ctx->hdr_ramdisk.p_offset = swentry->offset;
-        ctx->hdr_ramdisk.p_filesz = swentry->size;
-        ctx->hdr_ramdisk.p_memsz = swentry->size;
-        break;
-    case MB_BI_ENTRY_SONY_IPL:
-        ctx->hdr_ipl.p_offset = swentry->offset;
-        ctx->hdr_ipl.p_filesz = swentry->size;
-        ctx->hdr_ipl.p_memsz = swentry->size;
-        break;
-    case MB_BI_ENTRY_SONY_RPM:
-        ctx->hdr_rpm.p_offset = swentry->offset;
-        ctx->hdr_rpm.p_filesz = swentry->size;
-        ctx->hdr_rpm.p_memsz = swentry->size;
-        break;
-    case MB_BI_ENTRY_SONY_APPSBL:
-        ctx->hdr_appsbl.p_offset = swentry->offset;
-        ctx->hdr_appsbl.p_filesz = swentry->size;
-        ctx->hdr_appsbl.p_memsz = swentry->size;
-        break;
-    case SONY_ELF_ENTRY_CMDLINE:
-        ctx->hdr_cmdline.p_offset = swentry->offset;
-        ctx->hdr_cmdline.p_filesz = swentry->size;
-        ctx->hdr_cmdline.p_memsz = swentry->size;
-        break;
-    }
+    _sony_elf_update_phdr(ctx, swentry);
 
-    if (swentry->size > 0) {
+    // Already counted when the headers were written up front
+    if (!ctx->segctx.streaming && swentry->size > 0) {
         ++ctx->hdr.e_phnum;
     }
 
@@ -320,6 +426,11 @@ int sony_elf_writer_close(MbBiWriter *biw, void *userdata)
     SegmentWriterEntry *swentry;
     size_t n;
 
+    // Headers were already written
+    if (ctx->segctx.streaming) {
+        return MB_BI_OK;
+    }
+
     if (!ctx->have_file_size) {
         if (!biw->file->seek(0, SEEK_CUR, &ctx->file_size)) {
             mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
@@ -335,38 +446,6 @@ int sony_elf_writer_close(MbBiWriter *biw, void *userdata)
 
     // If successful, finish up the boot image
     if (!swentry) {
-        // Write headers
-        Sony_Elf32_Ehdr hdr = ctx->hdr;
-        Sony_Elf32_Phdr hdr_kernel = ctx->hdr_kernel;
-        Sony_Elf32_Phdr hdr_ramdisk = ctx->hdr_ramdisk;
-        Sony_Elf32_Phdr hdr_cmdline = ctx->hdr_cmdline;
-        Sony_Elf32_Phdr hdr_ipl = ctx->hdr_ipl;
-        Sony_Elf32_Phdr hdr_rpm = ctx->hdr_rpm;
-        Sony_Elf32_Phdr hdr_appsbl = ctx->hdr_appsbl;
-
-        struct {
-            const void *ptr;
-            size_t size;
-            bool can_write;
-        } headers[] = {
-            { &hdr, sizeof(hdr), true },
-            { &hdr_kernel, sizeof(hdr_kernel), hdr_kernel.p_filesz > 0 },
-            { &hdr_ramdisk, sizeof(hdr_ramdisk), hdr_ramdisk.p_filesz > 0 },
-            { &hdr_cmdline, sizeof(hdr_cmdline), hdr_cmdline.p_filesz > 0 },
-            { &hdr_ipl, sizeof(hdr_ipl), hdr_ipl.p_filesz > 0 },
-            { &hdr_rpm, sizeof(hdr_rpm), hdr_rpm.p_filesz > 0 },
-            { &hdr_appsbl, sizeof(hdr_appsbl), hdr_appsbl.p_filesz > 0 },
-            { nullptr, 0, false },
-        };
-
-        sony_elf_fix_ehdr_byte_order(&hdr);
-        sony_elf_fix_phdr_byte_order(&hdr_kernel);
-        sony_elf_fix_phdr_byte_order(&hdr_ramdisk);
-        sony_elf_fix_phdr_byte_order(&hdr_cmdline);
-        sony_elf_fix_phdr_byte_order(&hdr_ipl);
-        sony_elf_fix_phdr_byte_order(&hdr_rpm);
-        sony_elf_fix_phdr_byte_order(&hdr_appsbl);
-
         // Seek back to beginning to write headers
         if (!biw->file->seek(0, SEEK_SET, nullptr)) {
             mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
@@ -375,16 +454,7 @@ int sony_elf_writer_close(MbBiWriter *biw, void *userdata)
             return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
         }
 
-        // Write headers
-        for (auto it = headers; it->ptr && it->can_write; ++it) {
-            if (!mb::file_write_fully(*biw->file, it->ptr, it->size, n)
-                    || n != it->size) {
-                mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
-                                       "Failed to write header: %s",
-                                       biw->file->error_string().c_str());
-                return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
-            }
-        }
+        return _sony_elf_write_headers(biw, ctx, n);
     }
 
     return MB_BI_OK;
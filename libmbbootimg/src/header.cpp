@@ -41,17 +41,27 @@ MbBiHeader * mb_bi_header_new()
 
 void mb_bi_header_free(MbBiHeader *header)
 {
-    mb_bi_header_clear(header);
-    free(header);
+    if (header) {
+        _mb_bi_free_pooled_string(&header->field.board_name,
+                                  &header->pool.board_name,
+                                  &header->pool.board_name_size);
+        _mb_bi_free_pooled_string(&header->field.cmdline,
+                                  &header->pool.cmdline,
+                                  &header->pool.cmdline_size);
+        free(header);
+    }
 }
 
 void mb_bi_header_clear(MbBiHeader *header)
 {
     if (header) {
         uint64_t supported = header->fields_supported;
-        free(header->field.board_name);
-        free(header->field.cmdline);
-        memset(header, 0, sizeof(*header));
+        _mb_bi_release_pooled_string(&header->field.board_name,
+                                     header->pool.board_name);
+        _mb_bi_release_pooled_string(&header->field.cmdline,
+                                     header->pool.cmdline);
+        memset(&header->field, 0, sizeof(header->field));
+        header->fields_set = 0;
         header->fields_supported = supported;
     }
 }
@@ -89,10 +99,14 @@ MbBiHeader * mb_bi_header_clone(MbBiHeader *header)
 
     // Deep copy strings
     bool deep_copy_error =
-            (header->field.board_name
-                    && !(dup->field.board_name = strdup(header->field.board_name)))
-            || (header->field.cmdline
-                    && !(dup->field.cmdline = strdup(header->field.cmdline)));
+            !_mb_bi_set_pooled_string(&dup->field.board_name,
+                                      &dup->pool.board_name,
+                                      &dup->pool.board_name_size,
+                                      header->field.board_name)
+            || !_mb_bi_set_pooled_string(&dup->field.cmdline,
+                                         &dup->pool.cmdline,
+                                         &dup->pool.cmdline_size,
+                                         header->field.cmdline);
 
     if (deep_copy_error) {
         mb_bi_header_free(dup);
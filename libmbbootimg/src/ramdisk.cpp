@@ -0,0 +1,1503 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbbootimg/ramdisk.h"
+
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+#include <lz4.h>
+#include <lzma.h>
+#include <zlib.h>
+
+#include "mbcommon/string.h"
+#include "mbcommon/thread_pool.h"
+
+#include "mbbootimg/entry.h"
+#include "mbbootimg/reader.h"
+
+/*!
+ * \file mbbootimg/ramdisk.h
+ * \brief Streaming access to the cpio members of a boot image's ramdisk
+ *
+ * MbBiRamdiskReader decompresses the ramdisk entry of an MbBiReader on the fly
+ * and iterates over the members of the cpio archive inside it. No temporary
+ * files are created and, if the boot image's file supports it, the compressed
+ * data is read directly from the underlying storage (see
+ * mb_bi_reader_read_data_view()).
+ *
+ * The supported compression formats are gzip, LZ4 legacy (`lz4 -l`), xz, and
+ * lzma. LZ4 legacy blocks are decompressed in parallel and xz streams
+ * containing multiple blocks are decompressed with liblzma's multithreaded
+ * decoder. Only the "newc" cpio format, which is used by every Android
+ * ramdisk, is supported.
+ */
+
+// Size of the output buffer of the gzip and xz/lzma decoders
+#define RAMDISK_BUF_SIZE                (256 * 1024)
+
+// Magic and uncompressed block size of the LZ4 legacy format
+#define LZ4_LEGACY_MAGIC                0x184C2102u
+#define LZ4_LEGACY_BLOCK_SIZE           (8 * 1024 * 1024)
+// Maximum number of LZ4 blocks that are decompressed at the same time. Each
+// one needs LZ4_LEGACY_BLOCK_SIZE bytes of output buffer.
+#define LZ4_LEGACY_MAX_BATCH            4
+
+#define CPIO_NEWC_HEADER_SIZE           110
+// Guard against allocating huge buffers for corrupt headers
+#define CPIO_MAX_NAME_SIZE              4096
+#define CPIO_TRAILER                    "TRAILER!!!"
+
+enum class RamdiskReaderState
+{
+    NEW,
+    MEMBERS,
+    END,
+    FATAL,
+};
+
+struct MbBiRamdiskMember
+{
+    std::string name;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t mtime;
+    uint64_t size;
+};
+
+namespace
+{
+
+/*!
+ * \brief Source of consecutive chunks of data
+ */
+class ChunkSource
+{
+public:
+    virtual ~ChunkSource() = default;
+
+    /*!
+     * \brief Get the next chunk of data
+     *
+     * The chunk remains valid until the next call.
+     *
+     * \return
+     *   * #MB_BI_OK and a non-empty chunk if data is available
+     *   * #MB_BI_EOF if there is no more data
+     *   * \<= #MB_BI_WARN if an error occurs. The error is set on the
+     *     MbBiRamdiskReader.
+     */
+    virtual int next_chunk(const unsigned char *&data, size_t &size) = 0;
+};
+
+/*!
+ * \brief Byte stream on top of a ChunkSource
+ *
+ * Data is handed out directly from the source's chunks. Bytes are only copied
+ * when a caller needs a contiguous range that crosses a chunk boundary.
+ */
+class BufferedStream
+{
+public:
+    explicit BufferedStream(ChunkSource *source)
+        : _source(source)
+        , _chunk(nullptr)
+        , _chunk_size(0)
+        , _staging_pos(0)
+        , _eof(false)
+    {
+    }
+
+    /*!
+     * \brief Make up to \p n contiguous bytes available without consuming them
+     *
+     * \p avail is less than \p n only if the end of the stream is reached.
+     */
+    int peek(size_t n, const unsigned char *&data, size_t &avail)
+    {
+        size_t staged = _staging.size() - _staging_pos;
+
+        if (staged == 0 && _chunk_size >= n) {
+            data = _chunk;
+            avail = _chunk_size;
+            return MB_BI_OK;
+        } else if (staged >= n) {
+            data = _staging.data() + _staging_pos;
+            avail = staged;
+            return MB_BI_OK;
+        }
+
+        _staging.erase(_staging.begin(), _staging.begin() + _staging_pos);
+        _staging_pos = 0;
+
+        while (_staging.size() < n) {
+            if (_chunk_size == 0) {
+                int ret = pull();
+                if (ret == MB_BI_EOF) {
+                    break;
+                } else if (ret != MB_BI_OK) {
+                    return ret;
+                }
+            }
+
+            size_t take = std::min(_chunk_size, n - _staging.size());
+            _staging.insert(_staging.end(), _chunk, _chunk + take);
+            _chunk += take;
+            _chunk_size -= take;
+        }
+
+        data = _staging.data();
+        avail = _staging.size();
+        return MB_BI_OK;
+    }
+
+    /*!
+     * \brief Consume bytes previously made available by peek()
+     */
+    void consume(size_t n)
+    {
+        size_t staged = std::min(_staging.size() - _staging_pos, n);
+        _staging_pos += staged;
+        n -= staged;
+
+        _chunk += n;
+        _chunk_size -= n;
+    }
+
+    /*!
+     * \brief Read and consume up to \p max bytes without copying
+     *
+     * The data remains valid until the next operation on the stream.
+     */
+    int read(size_t max, const unsigned char *&data, size_t &n)
+    {
+        size_t staged = _staging.size() - _staging_pos;
+
+        if (staged > 0) {
+            n = std::min(staged, max);
+            data = _staging.data() + _staging_pos;
+            _staging_pos += n;
+            return MB_BI_OK;
+        }
+
+        if (_chunk_size == 0) {
+            int ret = pull();
+            if (ret != MB_BI_OK) {
+                return ret;
+            }
+        }
+
+        n = std::min(_chunk_size, max);
+        data = _chunk;
+        _chunk += n;
+        _chunk_size -= n;
+        return MB_BI_OK;
+    }
+
+    /*!
+     * \brief Skip \p n bytes
+     *
+     * \return #MB_BI_EOF if the end of the stream is reached before \p n bytes
+     *         are skipped
+     */
+    int skip(uint64_t n)
+    {
+        while (n > 0) {
+            const unsigned char *data;
+            size_t n_read;
+
+            int ret = read(static_cast<size_t>(
+                    std::min<uint64_t>(n, SIZE_MAX)), data, n_read);
+            if (ret != MB_BI_OK) {
+                return ret;
+            }
+
+            n -= n_read;
+        }
+
+        return MB_BI_OK;
+    }
+
+private:
+    int pull()
+    {
+        if (_eof) {
+            return MB_BI_EOF;
+        }
+
+        int ret = _source->next_chunk(_chunk, _chunk_size);
+        if (ret == MB_BI_EOF) {
+            _eof = true;
+            _chunk_size = 0;
+        }
+        return ret;
+    }
+
+    ChunkSource *_source;
+    const unsigned char *_chunk;
+    size_t _chunk_size;
+    std::vector<unsigned char> _staging;
+    size_t _staging_pos;
+    bool _eof;
+};
+
+/*!
+ * \brief Compressed ramdisk data from the boot image reader
+ */
+class EntrySource : public ChunkSource
+{
+public:
+    EntrySource(MbBiRamdiskReader *brr, MbBiReader *bir)
+        : _brr(brr), _bir(bir)
+    {
+    }
+
+    virtual int next_chunk(const unsigned char *&data, size_t &size) override
+    {
+        const void *view;
+
+        int ret = mb_bi_reader_read_data_view(_bir, &view, SIZE_MAX, &size);
+        if (ret == MB_BI_OK) {
+            data = static_cast<const unsigned char *>(view);
+        } else if (ret != MB_BI_EOF) {
+            mb_bi_ramdisk_reader_set_error(_brr, mb_bi_reader_error(_bir),
+                                           "Failed to read ramdisk: %s",
+                                           mb_bi_reader_error_string(_bir));
+        }
+        return ret;
+    }
+
+private:
+    MbBiRamdiskReader *_brr;
+    MbBiReader *_bir;
+};
+
+/*!
+ * \brief Uncompressed ramdisk
+ */
+class PassthroughDecoder : public ChunkSource
+{
+public:
+    explicit PassthroughDecoder(BufferedStream *input)
+        : _input(input)
+    {
+    }
+
+    virtual int next_chunk(const unsigned char *&data, size_t &size) override
+    {
+        return _input->read(SIZE_MAX, data, size);
+    }
+
+private:
+    BufferedStream *_input;
+};
+
+/*!
+ * \brief gzip-compressed ramdisk
+ */
+class GzipDecoder : public ChunkSource
+{
+public:
+    GzipDecoder(MbBiRamdiskReader *brr, BufferedStream *input)
+        : _brr(brr), _input(input), _initialized(false), _done(false)
+    {
+        memset(&_strm, 0, sizeof(_strm));
+    }
+
+    virtual ~GzipDecoder()
+    {
+        if (_initialized) {
+            inflateEnd(&_strm);
+        }
+    }
+
+    int init()
+    {
+        // Only accept the gzip wrapper
+        int ret = inflateInit2(&_strm, 15 + 16);
+        if (ret != Z_OK) {
+            mb_bi_ramdisk_reader_set_error(_brr, MB_BI_ERROR_INTERNAL_ERROR,
+                                           "Failed to initialize zlib: %d",
+                                           ret);
+            return MB_BI_FAILED;
+        }
+
+        _initialized = true;
+        _buf.resize(RAMDISK_BUF_SIZE);
+
+        return MB_BI_OK;
+    }
+
+    virtual int next_chunk(const unsigned char *&data, size_t &size) override
+    {
+        if (_done) {
+            return MB_BI_EOF;
+        }
+
+        _strm.next_out = _buf.data();
+        _strm.avail_out = static_cast<uInt>(_buf.size());
+
+        while (_strm.avail_out == _buf.size()) {
+            if (_strm.avail_in == 0) {
+                const unsigned char *in;
+                size_t n;
+
+                int ret = _input->read(UINT_MAX, in, n);
+                if (ret == MB_BI_EOF) {
+                    mb_bi_ramdisk_reader_set_error(
+                            _brr, MB_BI_ERROR_FILE_FORMAT,
+                            "gzip stream is truncated");
+                    return MB_BI_FATAL;
+                } else if (ret != MB_BI_OK) {
+                    return ret;
+                }
+
+                _strm.next_in = const_cast<Bytef *>(in);
+                _strm.avail_in = static_cast<uInt>(n);
+            }
+
+            int ret = inflate(&_strm, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                // Anything after the stream (eg. padding) is ignored
+                _done = true;
+                break;
+            } else if (ret != Z_OK) {
+                mb_bi_ramdisk_reader_set_error(
+                        _brr, MB_BI_ERROR_FILE_FORMAT,
+                        "Failed to decompress gzip stream: %s",
+                        _strm.msg ? _strm.msg : "Unknown error");
+                return MB_BI_FATAL;
+            }
+        }
+
+        size = _buf.size() - _strm.avail_out;
+        if (size == 0) {
+            return MB_BI_EOF;
+        }
+
+        data = _buf.data();
+        return MB_BI_OK;
+    }
+
+private:
+    MbBiRamdiskReader *_brr;
+    BufferedStream *_input;
+    z_stream _strm;
+    bool _initialized;
+    bool _done;
+    std::vector<unsigned char> _buf;
+};
+
+/*!
+ * \brief xz- or lzma-compressed ramdisk
+ */
+class LzmaDecoder : public ChunkSource
+{
+public:
+    LzmaDecoder(MbBiRamdiskReader *brr, BufferedStream *input)
+        : _brr(brr), _input(input), _strm(LZMA_STREAM_INIT), _done(false)
+        , _input_eof(false)
+    {
+    }
+
+    virtual ~LzmaDecoder()
+    {
+        lzma_end(&_strm);
+    }
+
+    int init(bool xz, unsigned int threads)
+    {
+        lzma_ret ret;
+
+        if (!xz) {
+            ret = lzma_alone_decoder(&_strm, UINT64_MAX);
+        } else if (threads > 1) {
+#if LZMA_VERSION >= UINT32_C(50040002)
+            // Streams with a single block (eg. those created by xz without
+            // -T) are still decompressed on one thread
+            lzma_mt mt = {};
+            mt.threads = threads;
+            mt.memlimit_threading = lzma_physmem() / 4;
+            mt.memlimit_stop = UINT64_MAX;
+
+            ret = lzma_stream_decoder_mt(&_strm, &mt);
+#else
+            ret = lzma_stream_decoder(&_strm, UINT64_MAX, 0);
+#endif
+        } else {
+            ret = lzma_stream_decoder(&_strm, UINT64_MAX, 0);
+        }
+
+        if (ret != LZMA_OK) {
+            mb_bi_ramdisk_reader_set_error(_brr, MB_BI_ERROR_INTERNAL_ERROR,
+                                           "Failed to initialize liblzma: %d",
+                                           ret);
+            return MB_BI_FAILED;
+        }
+
+        _buf.resize(RAMDISK_BUF_SIZE);
+
+        return MB_BI_OK;
+    }
+
+    virtual int next_chunk(const unsigned char *&data, size_t &size) override
+    {
+        if (_done) {
+            return MB_BI_EOF;
+        }
+
+        _strm.next_out = _buf.data();
+        _strm.avail_out = _buf.size();
+
+        while (_strm.avail_out == _buf.size()) {
+            if (_strm.avail_in == 0 && !_input_eof) {
+                const unsigned char *in;
+                size_t n;
+
+                int ret = _input->read(SIZE_MAX, in, n);
+                if (ret == MB_BI_EOF) {
+                    // Let liblzma decide whether the stream is complete
+                    _input_eof = true;
+                    n = 0;
+                } else if (ret != MB_BI_OK) {
+                    return ret;
+                }
+
+                _strm.next_in = in;
+                _strm.avail_in = n;
+            }
+
+            lzma_ret ret = lzma_code(
+                    &_strm, _input_eof ? LZMA_FINISH : LZMA_RUN);
+            if (ret == LZMA_STREAM_END) {
+                _done = true;
+                break;
+            } else if (ret != LZMA_OK) {
+                mb_bi_ramdisk_reader_set_error(
+                        _brr, MB_BI_ERROR_FILE_FORMAT,
+                        "Failed to decompress xz/lzma stream: %s",
+                        error_string(ret));
+                return MB_BI_FATAL;
+            }
+        }
+
+        size = _buf.size() - _strm.avail_out;
+        if (size == 0) {
+            return MB_BI_EOF;
+        }
+
+        data = _buf.data();
+        return MB_BI_OK;
+    }
+
+private:
+    static const char * error_string(lzma_ret ret)
+    {
+        switch (ret) {
+        case LZMA_MEM_ERROR:
+            return "Out of memory";
+        case LZMA_MEMLIMIT_ERROR:
+            return "Memory usage limit reached";
+        case LZMA_FORMAT_ERROR:
+            return "Unrecognized file format";
+        case LZMA_OPTIONS_ERROR:
+            return "Unsupported options";
+        case LZMA_DATA_ERROR:
+            return "Data is corrupt";
+        case LZMA_BUF_ERROR:
+            return "Data is truncated";
+        default:
+            return "Unknown error";
+        }
+    }
+
+    MbBiRamdiskReader *_brr;
+    BufferedStream *_input;
+    lzma_stream _strm;
+    bool _done;
+    bool _input_eof;
+    std::vector<unsigned char> _buf;
+};
+
+/*!
+ * \brief LZ4 legacy-compressed ramdisk
+ *
+ * The format is a magic number followed by independently compressed blocks,
+ * each prefixed with its compressed size. Every block except the last one
+ * decompresses to exactly LZ4_LEGACY_BLOCK_SIZE bytes, so a batch of blocks is
+ * read at a time and decompressed in parallel.
+ */
+class Lz4LegacyDecoder : public ChunkSource
+{
+public:
+    Lz4LegacyDecoder(MbBiRamdiskReader *brr, BufferedStream *input,
+                     unsigned int threads)
+        : _brr(brr), _input(input), _threads(threads)
+        , _blocks(std::max(1u, std::min<unsigned int>(
+                threads, LZ4_LEGACY_MAX_BATCH)))
+        , _blocks_used(0), _next_block(0), _done(false)
+    {
+    }
+
+    virtual int next_chunk(const unsigned char *&data, size_t &size) override
+    {
+        while (_next_block == _blocks_used) {
+            if (_done) {
+                return MB_BI_EOF;
+            }
+
+            int ret = decode_batch();
+            if (ret != MB_BI_OK) {
+                return ret;
+            }
+        }
+
+        const Block &block = _blocks[_next_block++];
+        data = block.out.data();
+        size = block.out_size;
+        return MB_BI_OK;
+    }
+
+private:
+    struct Block
+    {
+        std::vector<unsigned char> in;
+        std::vector<unsigned char> out;
+        size_t out_size;
+    };
+
+    // Read the compressed size of the next block, skipping over the magic of
+    // concatenated streams. Sets size to 0 at the end of the data.
+    int read_block_size(uint32_t &size)
+    {
+        while (true) {
+            const unsigned char *data;
+            size_t avail;
+
+            int ret = _input->peek(4, data, avail);
+            if (ret != MB_BI_OK) {
+                return ret;
+            } else if (avail == 0) {
+                size = 0;
+                return MB_BI_OK;
+            } else if (avail < 4) {
+                mb_bi_ramdisk_reader_set_error(
+                        _brr, MB_BI_ERROR_FILE_FORMAT,
+                        "LZ4 block header is truncated");
+                return MB_BI_FATAL;
+            }
+
+            size = static_cast<uint32_t>(data[0])
+                    | static_cast<uint32_t>(data[1]) << 8
+                    | static_cast<uint32_t>(data[2]) << 16
+                    | static_cast<uint32_t>(data[3]) << 24;
+            _input->consume(4);
+
+            if (size != LZ4_LEGACY_MAGIC) {
+                return MB_BI_OK;
+            }
+        }
+    }
+
+    int decode_batch()
+    {
+        _blocks_used = 0;
+        _next_block = 0;
+
+        // Gather the compressed blocks
+        while (_blocks_used < _blocks.size()) {
+            uint32_t size;
+
+            int ret = read_block_size(size);
+            if (ret != MB_BI_OK) {
+                return ret;
+            } else if (size == 0) {
+                // End of data or zero padding
+                _done = true;
+                break;
+            } else if (size > static_cast<uint32_t>(
+                    LZ4_compressBound(LZ4_LEGACY_BLOCK_SIZE))) {
+                mb_bi_ramdisk_reader_set_error(
+                        _brr, MB_BI_ERROR_FILE_FORMAT,
+                        "Invalid LZ4 block size: %u", size);
+                return MB_BI_FATAL;
+            }
+
+            Block &block = _blocks[_blocks_used];
+            block.in.clear();
+
+            while (block.in.size() < size) {
+                const unsigned char *data;
+                size_t n;
+
+                ret = _input->read(size - block.in.size(), data, n);
+                if (ret == MB_BI_EOF) {
+                    mb_bi_ramdisk_reader_set_error(
+                            _brr, MB_BI_ERROR_FILE_FORMAT,
+                            "LZ4 block is truncated");
+                    return MB_BI_FATAL;
+                } else if (ret != MB_BI_OK) {
+                    return ret;
+                }
+
+                block.in.insert(block.in.end(), data, data + n);
+            }
+
+            ++_blocks_used;
+        }
+
+        // Decompress them
+        bool ok = mb::parallel_for(_blocks_used, [&](size_t i) {
+            Block &block = _blocks[i];
+
+            try {
+                block.out.resize(LZ4_LEGACY_BLOCK_SIZE);
+            } catch (const std::bad_alloc &) {
+                return false;
+            }
+
+            int n = LZ4_decompress_safe(
+                    reinterpret_cast<const char *>(block.in.data()),
+                    reinterpret_cast<char *>(block.out.data()),
+                    static_cast<int>(block.in.size()),
+                    static_cast<int>(block.out.size()));
+            if (n < 0) {
+                return false;
+            }
+
+            block.out_size = static_cast<size_t>(n);
+            return true;
+        }, _threads, mb::CoreHint::Performance);
+
+        if (!ok) {
+            mb_bi_ramdisk_reader_set_error(_brr, MB_BI_ERROR_FILE_FORMAT,
+                                           "Failed to decompress LZ4 block");
+            return MB_BI_FATAL;
+        }
+
+        // Empty blocks would look like EOF to the caller
+        _blocks_used = static_cast<size_t>(std::remove_if(
+                _blocks.begin(), _blocks.begin() + _blocks_used,
+                [](const Block &b) { return b.out_size == 0; })
+                - _blocks.begin());
+
+        return MB_BI_OK;
+    }
+
+    MbBiRamdiskReader *_brr;
+    BufferedStream *_input;
+    unsigned int _threads;
+    std::vector<Block> _blocks;
+    size_t _blocks_used;
+    size_t _next_block;
+    bool _done;
+};
+
+}
+
+struct MbBiRamdiskReader
+{
+    RamdiskReaderState state;
+
+    // Options
+    unsigned int threads;
+
+    MbBiReader *bir;
+    int compression;
+
+    // Decompression pipeline
+    std::unique_ptr<ChunkSource> entry_source;
+    std::unique_ptr<BufferedStream> entry_stream;
+    std::unique_ptr<ChunkSource> decoder;
+    std::unique_ptr<BufferedStream> cpio_stream;
+
+    MbBiRamdiskMember member;
+    // Number of members read since the ramdisk was opened
+    size_t members_read;
+    // Unread data and padding of the current member
+    uint64_t data_remain;
+    uint64_t data_padding;
+
+    // Error
+    int error_code;
+    std::string error_string;
+};
+
+#define ENSURE_OPENED(BRR) \
+    do { \
+        if ((BRR)->state == RamdiskReaderState::NEW) { \
+            mb_bi_ramdisk_reader_set_error((BRR), \
+                                           MB_BI_ERROR_PROGRAMMER_ERROR, \
+                                           "%s: Ramdisk is not opened", \
+                                           __func__); \
+            return MB_BI_FAILED; \
+        } else if ((BRR)->state == RamdiskReaderState::FATAL) { \
+            mb_bi_ramdisk_reader_set_error((BRR), \
+                                           MB_BI_ERROR_PROGRAMMER_ERROR, \
+                                           "%s: Invalid state: fatal", \
+                                           __func__); \
+            return MB_BI_FATAL; \
+        } \
+    } while (0)
+
+/*!
+ * \brief Parse a hex field of a newc header
+ */
+static bool parse_hex(const unsigned char *data, uint32_t &value)
+{
+    uint32_t result = 0;
+
+    for (size_t i = 0; i < 8; ++i) {
+        unsigned char c = data[i];
+        uint32_t digit;
+
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            digit = c - 'A' + 10;
+        } else {
+            return false;
+        }
+
+        result = (result << 4) | digit;
+    }
+
+    value = result;
+    return true;
+}
+
+/*!
+ * \brief Detect the compression format from the first bytes of the ramdisk
+ */
+static int detect_compression(MbBiRamdiskReader *brr, BufferedStream &stream)
+{
+    static const unsigned char gzip_magic[] = { 0x1f, 0x8b };
+    static const unsigned char lz4_magic[] = { 0x02, 0x21, 0x4c, 0x18 };
+    static const unsigned char xz_magic[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+    // lc=3, lp=0, pb=2 (the defaults), followed by the little-endian
+    // dictionary size, which is always less than 4 GiB
+    static const unsigned char lzma_magic[] = { 0x5d, 0x00 };
+    static const unsigned char cpio_magic[] = { '0', '7', '0', '7', '0' };
+
+    const unsigned char *data;
+    size_t avail;
+
+    int ret = stream.peek(sizeof(xz_magic), data, avail);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+#define MATCHES(MAGIC) \
+    (avail >= sizeof(MAGIC) && memcmp(data, MAGIC, sizeof(MAGIC)) == 0)
+
+    if (avail == 0 || MATCHES(cpio_magic)) {
+        brr->compression = MB_BI_RAMDISK_COMPRESSION_NONE;
+    } else if (MATCHES(gzip_magic)) {
+        brr->compression = MB_BI_RAMDISK_COMPRESSION_GZIP;
+    } else if (MATCHES(lz4_magic)) {
+        brr->compression = MB_BI_RAMDISK_COMPRESSION_LZ4_LEGACY;
+    } else if (MATCHES(xz_magic)) {
+        brr->compression = MB_BI_RAMDISK_COMPRESSION_XZ;
+    } else if (MATCHES(lzma_magic)) {
+        brr->compression = MB_BI_RAMDISK_COMPRESSION_LZMA;
+    } else {
+        mb_bi_ramdisk_reader_set_error(brr, MB_BI_ERROR_FILE_FORMAT,
+                                       "Unknown ramdisk compression format");
+        return MB_BI_FAILED;
+    }
+
+#undef MATCHES
+
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Set up the decompression pipeline for the ramdisk entry
+ */
+static int open_pipeline(MbBiRamdiskReader *brr)
+{
+    MbBiEntry *entry;
+    unsigned int threads = brr->threads;
+    int ret;
+
+    if (threads == 0) {
+        threads = mb::ThreadPool::global().max_workers();
+    }
+
+    ret = mb_bi_reader_go_to_entry(brr->bir, &entry, MB_BI_ENTRY_RAMDISK);
+    if (ret == MB_BI_EOF) {
+        mb_bi_ramdisk_reader_set_error(brr, MB_BI_ERROR_FILE_FORMAT,
+                                       "Boot image has no ramdisk");
+        return MB_BI_FAILED;
+    } else if (ret != MB_BI_OK) {
+        mb_bi_ramdisk_reader_set_error(
+                brr, mb_bi_reader_error(brr->bir),
+                "Failed to go to ramdisk entry: %s",
+                mb_bi_reader_error_string(brr->bir));
+        return ret;
+    }
+
+    try {
+        brr->entry_source.reset(new EntrySource(brr, brr->bir));
+        brr->entry_stream.reset(new BufferedStream(brr->entry_source.get()));
+
+        ret = detect_compression(brr, *brr->entry_stream);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        switch (brr->compression) {
+        case MB_BI_RAMDISK_COMPRESSION_NONE:
+            brr->decoder.reset(new PassthroughDecoder(
+                    brr->entry_stream.get()));
+            break;
+        case MB_BI_RAMDISK_COMPRESSION_GZIP: {
+            GzipDecoder *decoder = new GzipDecoder(
+                    brr, brr->entry_stream.get());
+            brr->decoder.reset(decoder);
+            ret = decoder->init();
+            break;
+        }
+        case MB_BI_RAMDISK_COMPRESSION_LZ4_LEGACY:
+            // Skip magic
+            brr->entry_stream->consume(4);
+            brr->decoder.reset(new Lz4LegacyDecoder(
+                    brr, brr->entry_stream.get(), threads));
+            break;
+        case MB_BI_RAMDISK_COMPRESSION_XZ:
+        case MB_BI_RAMDISK_COMPRESSION_LZMA: {
+            LzmaDecoder *decoder = new LzmaDecoder(
+                    brr, brr->entry_stream.get());
+            brr->decoder.reset(decoder);
+            ret = decoder->init(
+                    brr->compression == MB_BI_RAMDISK_COMPRESSION_XZ, threads);
+            break;
+        }
+        }
+
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        brr->cpio_stream.reset(new BufferedStream(brr->decoder.get()));
+    } catch (const std::bad_alloc &) {
+        mb_bi_ramdisk_reader_set_error(brr, -ENOMEM,
+                                       "Failed to allocate ramdisk decoder");
+        return MB_BI_FAILED;
+    }
+
+    brr->members_read = 0;
+    brr->data_remain = 0;
+    brr->data_padding = 0;
+
+    return MB_BI_OK;
+}
+
+static void close_pipeline(MbBiRamdiskReader *brr)
+{
+    // Tear down in reverse order since each stage refers to the previous one
+    brr->cpio_stream.reset();
+    brr->decoder.reset();
+    brr->entry_stream.reset();
+    brr->entry_source.reset();
+}
+
+/*!
+ * \brief Convert stream EOF in the middle of the cpio archive to an error
+ */
+static int truncated_error(MbBiRamdiskReader *brr, int ret)
+{
+    if (ret == MB_BI_EOF) {
+        mb_bi_ramdisk_reader_set_error(brr, MB_BI_ERROR_FILE_FORMAT,
+                                       "cpio archive is truncated");
+        ret = MB_BI_FATAL;
+    }
+    return ret;
+}
+
+static int read_member_impl(MbBiRamdiskReader *brr)
+{
+    BufferedStream &stream = *brr->cpio_stream;
+    const unsigned char *data;
+    size_t avail;
+    uint32_t fields[13];
+    int ret;
+
+    // Skip whatever is left of the previous member
+    ret = stream.skip(brr->data_remain + brr->data_padding);
+    if (ret != MB_BI_OK) {
+        return truncated_error(brr, ret);
+    }
+    brr->data_remain = 0;
+    brr->data_padding = 0;
+
+    ret = stream.peek(CPIO_NEWC_HEADER_SIZE, data, avail);
+    if (ret != MB_BI_OK) {
+        return ret;
+    } else if (avail == 0) {
+        // Tolerate archives without a trailer
+        return MB_BI_EOF;
+    } else if (avail < CPIO_NEWC_HEADER_SIZE) {
+        return truncated_error(brr, MB_BI_EOF);
+    }
+
+    if (memcmp(data, "070701", 6) != 0 && memcmp(data, "070702", 6) != 0) {
+        mb_bi_ramdisk_reader_set_error(brr, MB_BI_ERROR_FILE_FORMAT,
+                                       "Unsupported cpio format or invalid "
+                                       "header magic");
+        return MB_BI_FATAL;
+    }
+
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+        if (!parse_hex(data + 6 + i * 8, fields[i])) {
+            mb_bi_ramdisk_reader_set_error(brr, MB_BI_ERROR_FILE_FORMAT,
+                                           "Invalid cpio header field");
+            return MB_BI_FATAL;
+        }
+    }
+
+    // Field order: ino, mode, uid, gid, nlink, mtime, filesize, devmajor,
+    // devminor, rdevmajor, rdevminor, namesize, check
+    uint32_t name_size = fields[11];
+    if (name_size == 0 || name_size > CPIO_MAX_NAME_SIZE) {
+        mb_bi_ramdisk_reader_set_error(brr, MB_BI_ERROR_FILE_FORMAT,
+                                       "Invalid cpio name size: %u",
+                                       name_size);
+        return MB_BI_FATAL;
+    }
+
+    brr->member.mode = fields[1];
+    brr->member.uid = fields[2];
+    brr->member.gid = fields[3];
+    brr->member.mtime = fields[5];
+    brr->member.size = fields[6];
+
+    stream.consume(CPIO_NEWC_HEADER_SIZE);
+
+    ret = stream.peek(name_size, data, avail);
+    if (ret != MB_BI_OK) {
+        return ret;
+    } else if (avail < name_size) {
+        return truncated_error(brr, MB_BI_EOF);
+    }
+
+    // The name is NULL-terminated and the size includes the terminator
+    brr->member.name.assign(reinterpret_cast<const char *>(data),
+                            strnlen(reinterpret_cast<const char *>(data),
+                                    name_size));
+    stream.consume(name_size);
+
+    // The header and name are padded to a multiple of 4 bytes
+    ret = stream.skip((4 - (CPIO_NEWC_HEADER_SIZE + name_size) % 4) % 4);
+    if (ret != MB_BI_OK) {
+        return truncated_error(brr, ret);
+    }
+
+    if (brr->member.name == CPIO_TRAILER) {
+        return MB_BI_EOF;
+    }
+
+    brr->data_remain = brr->member.size;
+    brr->data_padding = (4 - brr->member.size % 4) % 4;
+    ++brr->members_read;
+
+    return MB_BI_OK;
+}
+
+static int out_of_memory_error(MbBiRamdiskReader *brr)
+{
+    mb_bi_ramdisk_reader_set_error(brr, -ENOMEM,
+                                   "Failed to allocate ramdisk buffer");
+    return MB_BI_FATAL;
+}
+
+static int read_member(MbBiRamdiskReader *brr)
+{
+    try {
+        return read_member_impl(brr);
+    } catch (const std::bad_alloc &) {
+        return out_of_memory_error(brr);
+    }
+}
+
+/*!
+ * \brief Update the state based on the result of an operation
+ */
+static int update_state(MbBiRamdiskReader *brr, int ret)
+{
+    if (ret == MB_BI_EOF) {
+        brr->state = RamdiskReaderState::END;
+    } else if (ret <= MB_BI_FATAL) {
+        brr->state = RamdiskReaderState::FATAL;
+    }
+    return ret;
+}
+
+MB_BEGIN_C_DECLS
+
+/*!
+ * \brief Create a new ramdisk reader
+ *
+ * \note The returned MbBiRamdiskReader is *not* thread-safe.
+ *
+ * \return New MbBiRamdiskReader or NULL if memory could not be allocated. If
+ *         the function fails, `errno` will be set accordingly.
+ */
+MbBiRamdiskReader * mb_bi_ramdisk_reader_new()
+{
+    MbBiRamdiskReader *brr = new(std::nothrow) MbBiRamdiskReader();
+    if (brr) {
+        brr->state = RamdiskReaderState::NEW;
+        brr->threads = 0;
+        brr->bir = nullptr;
+        brr->compression = MB_BI_RAMDISK_COMPRESSION_NONE;
+        brr->error_code = MB_BI_ERROR_NONE;
+    } else {
+        errno = ENOMEM;
+    }
+    return brr;
+}
+
+/*!
+ * \brief Free a ramdisk reader
+ *
+ * The MbBiReader that the ramdisk reader was opened with is not freed.
+ *
+ * \param brr MbBiRamdiskReader
+ *
+ * \return #MB_BI_OK
+ */
+int mb_bi_ramdisk_reader_free(MbBiRamdiskReader *brr)
+{
+    if (brr) {
+        close_pipeline(brr);
+        delete brr;
+    }
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Set the number of threads used for decompression
+ *
+ * This only affects LZ4 legacy ramdisks and xz ramdisks that contain multiple
+ * blocks. The option takes effect the next time the ramdisk reader is opened.
+ *
+ * \param brr MbBiRamdiskReader
+ * \param threads Maximum number of threads. If 0, the number of workers in
+ *                the global mb::ThreadPool is used.
+ *
+ * \return #MB_BI_OK
+ */
+int mb_bi_ramdisk_reader_set_threads(MbBiRamdiskReader *brr,
+                                     unsigned int threads)
+{
+    brr->threads = threads;
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Open the ramdisk of a boot image
+ *
+ * The reader is moved to the boot image's ramdisk entry with
+ * mb_bi_reader_go_to_entry(). \p bir must remain valid and must not be used
+ * until mb_bi_ramdisk_reader_close() is called.
+ *
+ * \pre The header of \p bir must have been read.
+ *
+ * \param brr MbBiRamdiskReader
+ * \param bir MbBiReader
+ *
+ * \return
+ *   * #MB_BI_OK if the ramdisk is successfully opened
+ *   * \<= #MB_BI_WARN if an error occurs (eg. the boot image has no ramdisk
+ *     or the compression format is unknown)
+ */
+int mb_bi_ramdisk_reader_open(MbBiRamdiskReader *brr, MbBiReader *bir)
+{
+    if (brr->state != RamdiskReaderState::NEW) {
+        mb_bi_ramdisk_reader_set_error(brr, MB_BI_ERROR_PROGRAMMER_ERROR,
+                                       "Ramdisk is already opened");
+        return MB_BI_FAILED;
+    }
+
+    brr->bir = bir;
+
+    int ret = open_pipeline(brr);
+    if (ret != MB_BI_OK) {
+        close_pipeline(brr);
+        brr->bir = nullptr;
+        return ret;
+    }
+
+    brr->state = RamdiskReaderState::MEMBERS;
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Close the ramdisk
+ *
+ * After this function returns, the ramdisk reader can be opened again.
+ *
+ * \param brr MbBiRamdiskReader
+ *
+ * \return #MB_BI_OK
+ */
+int mb_bi_ramdisk_reader_close(MbBiRamdiskReader *brr)
+{
+    close_pipeline(brr);
+    brr->bir = nullptr;
+    brr->state = RamdiskReaderState::NEW;
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Get the compression format of the ramdisk
+ *
+ * \param brr MbBiRamdiskReader
+ *
+ * \return One of the `MB_BI_RAMDISK_COMPRESSION_*` constants if the ramdisk
+ *         is opened. Otherwise, #MB_BI_FAILED.
+ */
+int mb_bi_ramdisk_reader_compression(MbBiRamdiskReader *brr)
+{
+    if (brr->state == RamdiskReaderState::NEW) {
+        mb_bi_ramdisk_reader_set_error(brr, MB_BI_ERROR_PROGRAMMER_ERROR,
+                                       "%s: Ramdisk is not opened", __func__);
+        return MB_BI_FAILED;
+    }
+
+    return brr->compression;
+}
+
+/*!
+ * \brief Read the next member of the cpio archive
+ *
+ * Any unread data of the current member is skipped.
+ *
+ * \param[in] brr MbBiRamdiskReader
+ * \param[out] member Pointer to store the member. It is owned by \p brr and
+ *                    remains valid until the next member is read.
+ *
+ * \return
+ *   * #MB_BI_OK if a member is successfully read
+ *   * #MB_BI_EOF if there are no more members
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int mb_bi_ramdisk_reader_read_member(MbBiRamdiskReader *brr,
+                                     MbBiRamdiskMember **member)
+{
+    ENSURE_OPENED(brr);
+
+    if (brr->state == RamdiskReaderState::END) {
+        return MB_BI_EOF;
+    }
+
+    int ret = update_state(brr, read_member(brr));
+    if (ret == MB_BI_OK) {
+        *member = &brr->member;
+    }
+    return ret;
+}
+
+/*!
+ * \brief Find a member of the cpio archive by name
+ *
+ * The search starts from the current position. If the member is not found
+ * before the end of the archive, the ramdisk is decompressed again from the
+ * beginning, so members that were already passed can also be found.
+ *
+ * \param[in] brr MbBiRamdiskReader
+ * \param[out] member Pointer to store the member. It is owned by \p brr and
+ *                    remains valid until the next member is read.
+ * \param[in] name Path of the member (eg. `init.rc`)
+ *
+ * \return
+ *   * #MB_BI_OK if the member is found
+ *   * #MB_BI_EOF if the archive does not contain the member
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int mb_bi_ramdisk_reader_go_to_member(MbBiRamdiskReader *brr,
+                                      MbBiRamdiskMember **member,
+                                      const char *name)
+{
+    ENSURE_OPENED(brr);
+
+    bool from_start = brr->members_read == 0;
+    int ret;
+
+    while (true) {
+        if (brr->state == RamdiskReaderState::END) {
+            ret = MB_BI_EOF;
+        } else {
+            ret = update_state(brr, read_member(brr));
+        }
+
+        if (ret == MB_BI_OK) {
+            if (brr->member.name == name) {
+                *member = &brr->member;
+                return MB_BI_OK;
+            }
+        } else if (ret == MB_BI_EOF && !from_start) {
+            // Start over
+            close_pipeline(brr);
+
+            ret = open_pipeline(brr);
+            if (ret != MB_BI_OK) {
+                brr->state = RamdiskReaderState::FATAL;
+                return MB_BI_FATAL;
+            }
+
+            brr->state = RamdiskReaderState::MEMBERS;
+            from_start = true;
+        } else {
+            return ret;
+        }
+    }
+}
+
+/*!
+ * \brief Read data of the current member
+ *
+ * Unlike mb_bi_reader_read_data(), this function only returns less than
+ * \p size bytes if the end of the member is reached.
+ *
+ * \param[in] brr MbBiRamdiskReader
+ * \param[out] buf Output buffer
+ * \param[in] size Size of output buffer
+ * \param[out] bytes_read Pointer to store number of bytes read
+ *
+ * \return
+ *   * #MB_BI_OK if data is successfully read
+ *   * #MB_BI_EOF if the end of the member has already been reached
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int mb_bi_ramdisk_reader_read_data(MbBiRamdiskReader *brr, void *buf,
+                                   size_t size, size_t *bytes_read)
+{
+    size_t total = 0;
+    int ret = MB_BI_OK;
+
+    while (total < size) {
+        const void *data;
+        size_t n;
+
+        ret = mb_bi_ramdisk_reader_read_data_view(brr, &data, size - total,
+                                                  &n);
+        if (ret == MB_BI_EOF) {
+            break;
+        } else if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        memcpy(static_cast<char *>(buf) + total, data, n);
+        total += n;
+    }
+
+    *bytes_read = total;
+    return total == 0 && ret == MB_BI_EOF ? MB_BI_EOF : MB_BI_OK;
+}
+
+/*!
+ * \brief Read data of the current member without copying
+ *
+ * \note The returned pointer remains valid only until the next operation on
+ *       \p brr.
+ *
+ * \param[in] brr MbBiRamdiskReader
+ * \param[out] data Pointer to store address of the data
+ * \param[in] max_size Maximum number of bytes to return
+ * \param[out] bytes_avail Pointer to store number of bytes available at
+ *                         \p data
+ *
+ * \return
+ *   * #MB_BI_OK if data is successfully read
+ *   * #MB_BI_EOF if the end of the member has been reached
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int mb_bi_ramdisk_reader_read_data_view(MbBiRamdiskReader *brr,
+                                        const void **data, size_t max_size,
+                                        size_t *bytes_avail)
+{
+    ENSURE_OPENED(brr);
+
+    if (brr->state == RamdiskReaderState::END || brr->data_remain == 0) {
+        return MB_BI_EOF;
+    }
+
+    const unsigned char *ptr;
+    size_t n;
+    int ret;
+
+    try {
+        ret = brr->cpio_stream->read(static_cast<size_t>(std::min<uint64_t>(
+                max_size, brr->data_remain)), ptr, n);
+    } catch (const std::bad_alloc &) {
+        ret = out_of_memory_error(brr);
+    }
+    if (ret != MB_BI_OK) {
+        return update_state(brr, truncated_error(brr, ret));
+    }
+
+    brr->data_remain -= n;
+
+    *data = ptr;
+    *bytes_avail = n;
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Get the path of a ramdisk member
+ */
+const char * mb_bi_ramdisk_member_name(MbBiRamdiskMember *member)
+{
+    return member->name.c_str();
+}
+
+/*!
+ * \brief Get the mode (file type and permissions) of a ramdisk member
+ */
+uint32_t mb_bi_ramdisk_member_mode(MbBiRamdiskMember *member)
+{
+    return member->mode;
+}
+
+/*!
+ * \brief Get the owner user ID of a ramdisk member
+ */
+uint32_t mb_bi_ramdisk_member_uid(MbBiRamdiskMember *member)
+{
+    return member->uid;
+}
+
+/*!
+ * \brief Get the owner group ID of a ramdisk member
+ */
+uint32_t mb_bi_ramdisk_member_gid(MbBiRamdiskMember *member)
+{
+    return member->gid;
+}
+
+/*!
+ * \brief Get the modification time of a ramdisk member
+ */
+uint32_t mb_bi_ramdisk_member_mtime(MbBiRamdiskMember *member)
+{
+    return member->mtime;
+}
+
+/*!
+ * \brief Get the data size of a ramdisk member
+ *
+ * For symlinks, the data is the link target.
+ */
+uint64_t mb_bi_ramdisk_member_size(MbBiRamdiskMember *member)
+{
+    return member->size;
+}
+
+/*!
+ * \brief Get error code for a failed operation.
+ *
+ * \note The return value is undefined if an operation did not fail.
+ *
+ * \param brr MbBiRamdiskReader
+ *
+ * \return Error code for failed operation. If \>= 0, then the value is one of
+ *         the MB_BI_* entries. If \< 0, then the error code is
+ *         implementation-defined (usually `-errno` or `-GetLastError()`).
+ */
+int mb_bi_ramdisk_reader_error(MbBiRamdiskReader *brr)
+{
+    return brr->error_code;
+}
+
+/*!
+ * \brief Get error string for a failed operation.
+ *
+ * \note The return value is undefined if an operation did not fail.
+ *
+ * \param brr MbBiRamdiskReader
+ *
+ * \return Error string for failed operation. The string contents may be
+ *         undefined, but will never be NULL or an invalid string.
+ */
+const char * mb_bi_ramdisk_reader_error_string(MbBiRamdiskReader *brr)
+{
+    return brr->error_string.c_str();
+}
+
+/*!
+ * \brief Set error string for a failed operation.
+ *
+ * \sa mb_bi_ramdisk_reader_set_error_v()
+ *
+ * \param brr MbBiRamdiskReader
+ * \param error_code Error code
+ * \param fmt `printf()`-style format string
+ * \param ... `printf()`-style format arguments
+ *
+ * \return MB_BI_OK if the error is successfully set or MB_BI_FAILED if an
+ *         error occurs
+ */
+int mb_bi_ramdisk_reader_set_error(MbBiRamdiskReader *brr, int error_code,
+                                   const char *fmt, ...)
+{
+    int ret;
+    va_list ap;
+
+    va_start(ap, fmt);
+    ret = mb_bi_ramdisk_reader_set_error_v(brr, error_code, fmt, ap);
+    va_end(ap);
+
+    return ret;
+}
+
+/*!
+ * \brief Set error string for a failed operation.
+ *
+ * \sa mb_bi_ramdisk_reader_set_error()
+ *
+ * \param brr MbBiRamdiskReader
+ * \param error_code Error code
+ * \param fmt `printf()`-style format string
+ * \param ap `printf()`-style format arguments as a va_list
+ *
+ * \return MB_BI_OK if the error is successfully set or MB_BI_FAILED if an
+ *         error occurs
+ */
+int mb_bi_ramdisk_reader_set_error_v(MbBiRamdiskReader *brr, int error_code,
+                                     const char *fmt, va_list ap)
+{
+    brr->error_code = error_code;
+    return mb::format_v(brr->error_string, fmt, ap)
+            ? MB_BI_OK : MB_BI_FAILED;
+}
+
+MB_END_C_DECLS
@@ -19,13 +19,20 @@
 
 #include "mbbootimg/reader.h"
 
+#include <algorithm>
+#include <new>
+
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
 #include "mbcommon/file.h"
+#ifndef _WIN32
+#include "mbcommon/file/mmap.h"
+#endif
 #include "mbcommon/file/standard.h"
+#include "mbcommon/file_util.h"
 #include "mbcommon/string.h"
 
 #include "mbbootimg/entry.h"
@@ -156,6 +163,30 @@
  *   * Return \<= #MB_BI_WARN if an error occurs
  */
 
+/*!
+ * \typedef FormatReaderReadDataView
+ * \ingroup MB_BI_READER_FORMAT_CALLBACKS
+ *
+ * \brief Format reader callback to borrow entry data without copying
+ *
+ * \note This function *may* return less than \p max_size bytes, but *must*
+ *       return more than 0 bytes unless EOF is reached. If direct access is
+ *       not possible, it must return #MB_BI_UNSUPPORTED without consuming any
+ *       data so that the data can be read with the read data callback instead.
+ *
+ * \param[in] bir MbBiReader
+ * \param[in] userdata User callback data
+ * \param[out] data Output pointer to the entry data
+ * \param[in] max_size Maximum number of bytes to return
+ * \param[out] bytes_avail Output number of bytes available at \p data
+ *
+ * \return
+ *   * Return #MB_BI_OK if the entry data is successfully read
+ *   * Return #MB_BI_EOF if the end of the curent entry has been reached
+ *   * Return #MB_BI_UNSUPPORTED if direct access is not supported
+ *   * Return \<= #MB_BI_WARN if an error occurs
+ */
+
 /*!
  * \typedef FormatReaderFree
  * \ingroup MB_BI_READER_FORMAT_CALLBACKS
@@ -231,6 +262,7 @@ static struct
  * \param read_entry_cb Read entry callback (required)
  * \param go_to_entry_cb Go to entry callback (optional)
  * \param read_data_cb Read data callback (required)
+ * \param read_data_view_cb Read data view callback (optional)
  * \param free_cb Free callback (optional)
  *
  * \return
@@ -248,6 +280,7 @@ int _mb_bi_reader_register_format(MbBiReader *bir,
                                   FormatReaderReadEntry read_entry_cb,
                                   FormatReaderGoToEntry go_to_entry_cb,
                                   FormatReaderReadData read_data_cb,
+                                  FormatReaderReadDataView read_data_view_cb,
                                   FormatReaderFree free_cb)
 {
     int ret;
@@ -265,6 +298,7 @@ int _mb_bi_reader_register_format(MbBiReader *bir,
     format.read_entry_cb = read_entry_cb;
     format.go_to_entry_cb = go_to_entry_cb;
     format.read_data_cb = read_data_cb;
+    format.read_data_view_cb = read_data_view_cb;
     format.free_cb = free_cb;
     format.userdata = userdata;
 
@@ -342,6 +376,91 @@ int _mb_bi_reader_free_format(MbBiReader *bir, FormatReader *format)
     return ret;
 }
 
+/*!
+ * \brief Cache the beginning of the reader's file
+ *
+ * \return Whether the cache is successfully filled. If false, the error is set
+ *         on the reader's File handle.
+ */
+static bool _mb_bi_reader_probe_fill(MbBiReader *bir)
+{
+    size_t n;
+
+    bir->probe_valid = false;
+    bir->probe_eof = false;
+    bir->probe_buf.resize(READER_PROBE_SIZE);
+
+    if (!bir->file->seek(0, SEEK_SET, nullptr)
+            || !mb::file_read_fully(*bir->file, bir->probe_buf.data(),
+                                    bir->probe_buf.size(), n)) {
+        bir->probe_buf.clear();
+        return false;
+    }
+
+    bir->probe_buf.resize(n);
+    bir->probe_valid = true;
+    bir->probe_eof = n < READER_PROBE_SIZE;
+
+    return true;
+}
+
+/*!
+ * \brief Discard the cached beginning of the reader's file
+ */
+static void _mb_bi_reader_probe_clear(MbBiReader *bir)
+{
+    // Keep the capacity so that the buffer can be reused when the next boot
+    // image is opened
+    bir->probe_buf.clear();
+    bir->probe_valid = false;
+    bir->probe_eof = false;
+}
+
+/*!
+ * \brief Read data at a file offset
+ *
+ * If \p file is the reader's File handle and the requested range was cached
+ * when the boot image was opened, the data is copied from the cache and no
+ * file operations are performed. Otherwise, the data is read from \p file
+ * with File::seek() and mb::file_read_fully().
+ *
+ * \note The file position is undefined after this function returns.
+ *
+ * \param[in] bir MbBiReader
+ * \param[in] file File handle
+ * \param[in] offset File offset to read from
+ * \param[out] buf Buffer to read into
+ * \param[in] size Buffer size
+ * \param[out] bytes_read Output number of bytes that were read. A short read
+ *                        indicates end of file.
+ *
+ * \return Whether the read is successful. If false, the error is set on
+ *         \p file.
+ */
+bool _mb_bi_reader_read_at(MbBiReader *bir, mb::File *file,
+                           uint64_t offset, void *buf, size_t size,
+                           size_t &bytes_read)
+{
+    if (file == bir->file && bir->probe_valid) {
+        size_t cached = bir->probe_buf.size();
+
+        if (bir->probe_eof
+                || (offset <= cached && size <= cached - offset)) {
+            size_t avail = 0;
+            if (offset < cached) {
+                avail = std::min<size_t>(cached - offset, size);
+                memcpy(buf, bir->probe_buf.data() + offset, avail);
+            }
+
+            bytes_read = avail;
+            return true;
+        }
+    }
+
+    return file->seek(offset, SEEK_SET, nullptr)
+            && mb::file_read_fully(*file, buf, size, bytes_read);
+}
+
 /*!
  * \brief Allocate new MbBiReader.
  *
@@ -408,6 +527,8 @@ int mb_bi_reader_free(MbBiReader *bir)
 /*!
  * \brief Open boot image from filename (MBS).
  *
+ * On Unix-like systems, regular files are opened with mb::MmapFile.
+ *
  * \param bir MbBiReader
  * \param filename MBS filename
  *
@@ -419,6 +540,19 @@ int mb_bi_reader_open_filename(MbBiReader *bir, const char *filename)
 {
     READER_ENSURE_STATE(bir, ReaderState::NEW);
 
+#ifndef _WIN32
+    // Prefer memory mapping the file so that the format readers can search the
+    // image in place. Fall back to regular I/O for files that can't be mapped,
+    // such as block devices.
+    {
+        mb::File *mmap_file = new(std::nothrow) mb::MmapFile(filename);
+        if (mmap_file && mmap_file->is_open()) {
+            return mb_bi_reader_open(bir, mmap_file, true);
+        }
+        delete mmap_file;
+    }
+#endif
+
     mb::File *file = new(std::nothrow) mb::StandardFile(
             filename, mb::FileOpenMode::READ_ONLY);
     if (!file) {
@@ -441,6 +575,8 @@ int mb_bi_reader_open_filename(MbBiReader *bir, const char *filename)
 /*!
  * \brief Open boot image from filename (WCS).
  *
+ * On Unix-like systems, regular files are opened with mb::MmapFile.
+ *
  * \param bir MbBiReader
  * \param filename WCS filename
  *
@@ -452,6 +588,19 @@ int mb_bi_reader_open_filename_w(MbBiReader *bir, const wchar_t *filename)
 {
     READER_ENSURE_STATE(bir, ReaderState::NEW);
 
+#ifndef _WIN32
+    // Prefer memory mapping the file so that the format readers can search the
+    // image in place. Fall back to regular I/O for files that can't be mapped,
+    // such as block devices.
+    {
+        mb::File *mmap_file = new(std::nothrow) mb::MmapFile(filename);
+        if (mmap_file && mmap_file->is_open()) {
+            return mb_bi_reader_open(bir, mmap_file, true);
+        }
+        delete mmap_file;
+    }
+#endif
+
     mb::File *file = new(std::nothrow) mb::StandardFile(
             filename, mb::FileOpenMode::READ_ONLY);
     if (!file) {
@@ -506,6 +655,16 @@ int mb_bi_reader_open(MbBiReader *bir, mb::File *file, bool owned)
         goto done;
     }
 
+    // Read the beginning of the file once so that the bidders and header
+    // readers don't each need to seek and read it again
+    if (!_mb_bi_reader_probe_fill(bir)) {
+        mb_bi_reader_set_error(bir, bir->file->error().value() /* TODO */,
+                               "Failed to read file: %s",
+                               bir->file->error_string().c_str());
+        ret = bir->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+        goto done;
+    }
+
     // Perform bid if a format wasn't explicitly chosen
     if (!bir->format) {
         FormatReader *format = nullptr, *cur;
@@ -559,6 +718,8 @@ done:
         bir->file = nullptr;
         bir->file_owned = false;
 
+        _mb_bi_reader_probe_clear(bir);
+
         if (!forced_format) {
             bir->format = nullptr;
         }
@@ -599,6 +760,8 @@ int mb_bi_reader_close(MbBiReader *bir)
         bir->file = nullptr;
         bir->file_owned = false;
 
+        _mb_bi_reader_probe_clear(bir);
+
         // Don't change state to ReaderState::FATAL if MB_BI_FATAL is returned.
         // Otherwise, we risk double-closing the boot image. CLOSED and FATAL
         // are the same anyway, aside from the fact that boot images can be
@@ -610,13 +773,76 @@ int mb_bi_reader_close(MbBiReader *bir)
     return ret;
 }
 
+/*!
+ * \brief Reset an MbBiReader so that it can be used to open another boot image.
+ *
+ * The reader is closed if it is open and is returned to the initial state. The
+ * same set of formats that was enabled before the reset is enabled again, but
+ * their per-image state is discarded. A format that was explicitly selected
+ * with mb_bi_reader_set_format_by_code() or mb_bi_reader_set_format_by_name()
+ * is not remembered and must be selected again.
+ *
+ * This allows a single MbBiReader to be reused for multiple boot images
+ * without reallocating the reader or repeating the format setup.
+ *
+ * \param bir MbBiReader
+ *
+ * \return
+ *   * #MB_BI_OK if the reader is successfully reset
+ *   * \<= #MB_BI_WARN if an error occurs while closing the reader or while
+ *     re-enabling a format. If \<= #MB_BI_FATAL is returned, the reader can no
+ *     longer be used and should be freed.
+ */
+int mb_bi_reader_reset(MbBiReader *bir)
+{
+    int ret, ret2;
+    int types[MAX_FORMATS];
+    size_t types_len = bir->formats_len;
+
+    ret = mb_bi_reader_close(bir);
+
+    for (size_t i = 0; i < bir->formats_len; ++i) {
+        types[i] = bir->formats[i].type;
+
+        ret2 = _mb_bi_reader_free_format(bir, &bir->formats[i]);
+        if (ret2 < ret) {
+            ret = ret2;
+        }
+    }
+
+    bir->formats_len = 0;
+    bir->format = nullptr;
+
+    mb_bi_header_clear(bir->header);
+    mb_bi_entry_clear(bir->entry);
+
+    bir->state = ReaderState::NEW;
+
+    for (size_t i = 0; i < types_len; ++i) {
+        ret2 = mb_bi_reader_enable_format_by_code(bir, types[i]);
+        if (ret2 != MB_BI_OK && ret2 != MB_BI_WARN) {
+            if (ret2 < ret) {
+                ret = ret2;
+            }
+            if (ret2 <= MB_BI_FATAL) {
+                bir->state = ReaderState::FATAL;
+                break;
+            }
+        }
+    }
+
+    return ret;
+}
+
 /*!
  * \brief Read boot image header.
  *
  * Read the header from the boot image and store a reference to the MbBiHeader
  * in \p header. The value of \p header after a successful call to this function
  * should *never* be deallocated with mb_bi_header_free(). It is tracked
- * internally and will be freed when the MbBiReader is freed.
+ * internally and will be freed when the MbBiReader is freed. Its storage is
+ * reused across calls and across opens, so reading the header of similar boot
+ * images does not allocate.
  *
  * \param[in] bir MbBiReader
  * \param[out] header Pointer to store MbBiHeader reference
@@ -690,7 +916,8 @@ int mb_bi_reader_read_header2(MbBiReader *bir, MbBiHeader *header)
  * Read the next entry from the boot image and store a reference to the
  * MbBiEntry in \p entry. The value of \p entry after a successful call to this
  * function should *never* be deallocated with mb_bi_entry_free(). It is tracked
- * internally and will be freed when the MbBiReader is freed.
+ * internally and will be freed when the MbBiReader is freed. Its storage is
+ * reused across calls and across opens.
  *
  * \param[in] bir MbBiReader
  * \param[out] entry Pointer to store MbBiEntry reference
@@ -863,6 +1090,76 @@ int mb_bi_reader_read_data(MbBiReader *bir, void *buf, size_t size,
     return ret;
 }
 
+/*!
+ * \brief Read current boot image entry data without copying.
+ *
+ * Instead of copying into a caller-provided buffer, this function returns a
+ * pointer to the next chunk of the current entry's data. If the format and the
+ * underlying file support direct access (eg. mb::MemoryFile), the pointer
+ * refers to the file's storage and no copy is made. Otherwise, the data is
+ * read into a buffer owned by the reader and at most #READER_VIEW_BUF_SIZE
+ * bytes are returned per call.
+ *
+ * The data is consumed as if mb_bi_reader_read_data() was called, so both
+ * functions can be used interchangeably on the same entry.
+ *
+ * \note The returned pointer remains valid only until the next operation on
+ *       \p bir or on its underlying file.
+ *
+ * \param[in] bir MbBiReader
+ * \param[out] data Pointer to store address of the data
+ * \param[in] max_size Maximum number of bytes to return
+ * \param[out] bytes_avail Pointer to store number of bytes available at
+ *                         \p data
+ *
+ * \return
+ *   * #MB_BI_OK if data is successfully read
+ *   * #MB_BI_EOF if EOF is reached for the current entry
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int mb_bi_reader_read_data_view(MbBiReader *bir, const void **data,
+                                size_t max_size, size_t *bytes_avail)
+{
+    READER_ENSURE_STATE(bir, ReaderState::DATA);
+    int ret = MB_BI_UNSUPPORTED;
+
+    if (bir->format->read_data_view_cb) {
+        ret = bir->format->read_data_view_cb(bir, bir->format->userdata,
+                                             *data, max_size, *bytes_avail);
+    }
+
+    if (ret == MB_BI_UNSUPPORTED) {
+        if (!bir->format->read_data_cb) {
+            mb_bi_reader_set_error(bir, MB_BI_ERROR_INTERNAL_ERROR,
+                                   "Missing format read_data_cb");
+            bir->state = ReaderState::FATAL;
+            return MB_BI_FATAL;
+        }
+
+        try {
+            bir->view_buf.resize(std::min<size_t>(
+                    max_size, READER_VIEW_BUF_SIZE));
+        } catch (const std::bad_alloc &) {
+            mb_bi_reader_set_error(bir, -ENOMEM,
+                                   "Failed to allocate view buffer");
+            return MB_BI_FAILED;
+        }
+
+        ret = bir->format->read_data_cb(bir, bir->format->userdata,
+                                        bir->view_buf.data(),
+                                        bir->view_buf.size(), *bytes_avail);
+        *data = bir->view_buf.data();
+    }
+
+    if (ret == MB_BI_OK) {
+        // Do not alter state. Stay in ReaderState::DATA
+    } else if (ret <= MB_BI_FATAL) {
+        bir->state = ReaderState::FATAL;
+    }
+
+    return ret;
+}
+
 /*!
  * \brief Get detected or forced boot image format code.
  *
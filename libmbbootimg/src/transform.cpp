@@ -0,0 +1,330 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbbootimg/transform.h"
+
+#include <new>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include "mbbootimg/entry.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/reader.h"
+#include "mbbootimg/writer.h"
+
+#define TRANSFORM_BUF_SIZE      (256 * 1024)
+
+/*!
+ * \file mbbootimg/transform.h
+ * \brief Boot image transform API
+ *
+ * The transform API streams a boot image from an MbBiReader into an
+ * MbBiWriter without writing the entries to temporary files. Individual
+ * entries can be rewritten in memory along the way.
+ */
+
+/*!
+ * \defgroup MB_BI_TRANSFORM_ACTIONS Entry transform actions
+ *
+ * \brief Actions that can be returned by a #MbBiTransformSelectCb callback
+ */
+
+/*!
+ * \def MB_BI_TRANSFORM_COPY
+ * \ingroup MB_BI_TRANSFORM_ACTIONS
+ *
+ * \brief Stream the entry data from the reader to the writer unchanged
+ */
+
+/*!
+ * \def MB_BI_TRANSFORM_REWRITE
+ * \ingroup MB_BI_TRANSFORM_ACTIONS
+ *
+ * \brief Load the entry data into memory and pass it to the rewrite callback
+ */
+
+/*!
+ * \def MB_BI_TRANSFORM_REPLACE
+ * \ingroup MB_BI_TRANSFORM_ACTIONS
+ *
+ * \brief Pass empty data to the rewrite callback without reading the entry
+ *
+ * This is useful when the callback replaces the entry data entirely.
+ */
+
+/*!
+ * \typedef MbBiTransformSelectCb
+ *
+ * \brief Callback for choosing how an entry is transformed
+ *
+ * \param type Entry type (\ref MB_BI_ENTRY_TYPES)
+ * \param userdata User callback data
+ *
+ * \return One of the \ref MB_BI_TRANSFORM_ACTIONS or \<= #MB_BI_WARN to abort
+ *         the transform
+ */
+
+/*!
+ * \typedef MbBiTransformRewriteCb
+ *
+ * \brief Callback for rewriting an entry in memory
+ *
+ * \param type Entry type (\ref MB_BI_ENTRY_TYPES)
+ * \param exists Whether the entry exists in the input boot image. If false,
+ *               \p data is empty and the callback may provide new data.
+ * \param data Entry data, which should be replaced with the new data. This is
+ *             always empty for #MB_BI_TRANSFORM_REPLACE.
+ * \param userdata User callback data
+ *
+ * \return #MB_BI_OK if the entry is successfully rewritten or \<= #MB_BI_WARN
+ *         to abort the transform. The callback should set an error on the
+ *         writer with mb_bi_writer_set_error() before returning an error.
+ */
+
+static int _copy_reader_error(MbBiReader *bir, MbBiWriter *biw,
+                              const char *context, int ret)
+{
+    mb_bi_writer_set_error(biw, mb_bi_reader_error(bir), "%s: %s",
+                           context, mb_bi_reader_error_string(bir));
+    return ret;
+}
+
+static int _read_data_to_memory(MbBiReader *bir, MbBiWriter *biw,
+                                MbBiEntry *entry,
+                                std::vector<unsigned char> &data)
+{
+    int ret;
+    size_t offset = 0;
+    size_t n;
+
+    data.clear();
+
+    try {
+        if (mb_bi_entry_size_is_set(entry)) {
+            data.reserve(mb_bi_entry_size(entry));
+        }
+
+        while (true) {
+            if (data.size() - offset < TRANSFORM_BUF_SIZE) {
+                data.resize(offset + TRANSFORM_BUF_SIZE);
+            }
+
+            ret = mb_bi_reader_read_data(bir, data.data() + offset,
+                                         data.size() - offset, &n);
+            if (ret == MB_BI_EOF) {
+                break;
+            } else if (ret != MB_BI_OK) {
+                return _copy_reader_error(
+                        bir, biw, "Failed to read entry data", ret);
+            }
+
+            offset += n;
+        }
+    } catch (const std::bad_alloc &) {
+        mb_bi_writer_set_error(biw, -ENOMEM,
+                               "Failed to allocate entry buffer");
+        return MB_BI_FAILED;
+    }
+
+    data.resize(offset);
+
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Copy data of the current entry from a reader to a writer
+ *
+ * The data of the reader's current entry is streamed to the writer's current
+ * entry without any intermediate files.
+ *
+ * \param bir MbBiReader
+ * \param biw MbBiWriter
+ *
+ * \return
+ *   * #MB_BI_OK if the data is successfully copied
+ *   * \<= #MB_BI_WARN if an error occurs. The error is always set on \p biw,
+ *     even if the failure occurred while reading.
+ */
+int mb_bi_copy_data(MbBiReader *bir, MbBiWriter *biw)
+{
+    int ret;
+    const void *data;
+    size_t n_read;
+    size_t n_written;
+
+    while ((ret = mb_bi_reader_read_data_view(bir, &data, SIZE_MAX, &n_read))
+            == MB_BI_OK) {
+        ret = mb_bi_writer_write_data(biw, data, n_read, &n_written);
+        if (ret != MB_BI_OK) {
+            return ret;
+        } else if (n_read != n_written) {
+            mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
+                                   "Wrote %zu of %zu bytes",
+                                   n_written, n_read);
+            return MB_BI_FAILED;
+        }
+    }
+
+    if (ret != MB_BI_EOF) {
+        return _copy_reader_error(bir, biw, "Failed to read entry data", ret);
+    }
+
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Stream a boot image from a reader into a writer
+ *
+ * The header is copied from \p bir to \p biw. Then, for every entry that the
+ * writer's format supports, \p select_cb is called to choose what to do with
+ * the entry:
+ *
+ *   * #MB_BI_TRANSFORM_COPY: The entry data is streamed from the reader to the
+ *     writer. If the input boot image does not contain the entry, the entry is
+ *     written with no data.
+ *   * #MB_BI_TRANSFORM_REWRITE: The entry data is loaded into memory and passed
+ *     to \p rewrite_cb, which may modify it in place. The resulting data is
+ *     written to the writer.
+ *   * #MB_BI_TRANSFORM_REPLACE: Like #MB_BI_TRANSFORM_REWRITE, but the input
+ *     entry data is not read and \p rewrite_cb is always passed empty data.
+ *
+ * If \p select_cb is NULL, every entry is copied.
+ *
+ * \pre \p bir must be opened and its header must not have been read yet.
+ * \pre \p biw must be opened and its header must not have been written yet.
+ *
+ * \note The writer is not closed. mb_bi_writer_close() must be called to
+ *       finish writing the boot image.
+ *
+ * \param bir MbBiReader
+ * \param biw MbBiWriter
+ * \param select_cb Callback for choosing the action for each entry (optional)
+ * \param rewrite_cb Callback for rewriting an entry (required if \p select_cb
+ *                   may return #MB_BI_TRANSFORM_REWRITE or
+ *                   #MB_BI_TRANSFORM_REPLACE)
+ * \param userdata User callback data
+ *
+ * \return
+ *   * #MB_BI_OK if the boot image is successfully transformed
+ *   * \<= #MB_BI_WARN if an error occurs. The error is always set on \p biw,
+ *     even if the failure occurred while reading.
+ */
+int mb_bi_transform(MbBiReader *bir, MbBiWriter *biw,
+                    MbBiTransformSelectCb select_cb,
+                    MbBiTransformRewriteCb rewrite_cb,
+                    void *userdata)
+{
+    MbBiHeader *header;
+    MbBiEntry *in_entry;
+    MbBiEntry *out_entry;
+    std::vector<unsigned char> data;
+    int ret;
+
+    ret = mb_bi_reader_read_header(bir, &header);
+    if (ret != MB_BI_OK) {
+        return _copy_reader_error(bir, biw, "Failed to read header", ret);
+    }
+
+    ret = mb_bi_writer_write_header(biw, header);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+    while ((ret = mb_bi_writer_get_entry(biw, &out_entry)) == MB_BI_OK) {
+        int type = mb_bi_entry_type(out_entry);
+        bool exists;
+        int action;
+
+        ret = mb_bi_writer_write_entry(biw, out_entry);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        action = select_cb ? select_cb(type, userdata) : MB_BI_TRANSFORM_COPY;
+        if (action < 0) {
+            return action;
+        } else if (action != MB_BI_TRANSFORM_COPY
+                && action != MB_BI_TRANSFORM_REWRITE
+                && action != MB_BI_TRANSFORM_REPLACE) {
+            mb_bi_writer_set_error(biw, MB_BI_ERROR_PROGRAMMER_ERROR,
+                                   "Invalid transform action: %d", action);
+            return MB_BI_FAILED;
+        } else if (action != MB_BI_TRANSFORM_COPY && !rewrite_cb) {
+            mb_bi_writer_set_error(biw, MB_BI_ERROR_PROGRAMMER_ERROR,
+                                   "No rewrite callback provided");
+            return MB_BI_FAILED;
+        }
+
+        ret = mb_bi_reader_go_to_entry(bir, &in_entry, type);
+        if (ret == MB_BI_OK) {
+            exists = true;
+        } else if (ret == MB_BI_EOF) {
+            exists = false;
+        } else {
+            return _copy_reader_error(bir, biw, "Failed to go to entry", ret);
+        }
+
+        if (action == MB_BI_TRANSFORM_COPY) {
+            if (exists) {
+                ret = mb_bi_copy_data(bir, biw);
+                if (ret != MB_BI_OK) {
+                    return ret;
+                }
+            }
+            continue;
+        }
+
+        // The callback discards the existing data when replacing the entry
+        if (exists && action == MB_BI_TRANSFORM_REWRITE) {
+            ret = _read_data_to_memory(bir, biw, in_entry, data);
+            if (ret != MB_BI_OK) {
+                return ret;
+            }
+        } else {
+            data.clear();
+        }
+
+        ret = rewrite_cb(type, exists, data, userdata);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        if (!data.empty()) {
+            size_t n;
+
+            ret = mb_bi_writer_write_data(biw, data.data(), data.size(), &n);
+            if (ret != MB_BI_OK) {
+                return ret;
+            } else if (n != data.size()) {
+                mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
+                                       "Wrote %zu of %zu bytes",
+                                       n, data.size());
+                return MB_BI_FAILED;
+            }
+        }
+    }
+
+    if (ret != MB_BI_EOF) {
+        return ret;
+    }
+
+    return MB_BI_OK;
+}
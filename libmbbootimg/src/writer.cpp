@@ -345,6 +345,45 @@ int _mb_bi_writer_free_format(MbBiWriter *biw, FormatWriter *format)
     return ret;
 }
 
+static int _entry_size_index(int entry_type)
+{
+    unsigned int type = static_cast<unsigned int>(entry_type);
+
+    // Must be exactly one bit
+    if (type == 0 || (type & (type - 1)) != 0) {
+        return -1;
+    }
+
+    int index = 0;
+    while (type >>= 1) {
+        ++index;
+    }
+
+    return index < MAX_ENTRY_SIZES ? index : -1;
+}
+
+/*!
+ * \brief Get the size declared for an entry type
+ *
+ * \param[in] biw MbBiWriter
+ * \param[in] entry_type Entry type
+ * \param[out] size_out Pointer to store entry size
+ *
+ * \return Whether a size was declared with mb_bi_writer_set_entry_size()
+ */
+bool _mb_bi_writer_entry_size(MbBiWriter *biw, int entry_type,
+                              uint64_t *size_out)
+{
+    int index = _entry_size_index(entry_type);
+
+    if (index < 0 || !(biw->entry_sizes_set & (1U << index))) {
+        return false;
+    }
+
+    *size_out = biw->entry_sizes[index];
+    return true;
+}
+
 /*!
  * \brief Allocate new MbBiWriter.
  *
@@ -832,6 +871,51 @@ int mb_bi_writer_write_data(MbBiWriter *biw, const void *buf, size_t size,
     return ret;
 }
 
+/*!
+ * \brief Declare the size of an entry before writing the boot image
+ *
+ * Declaring the sizes up front allows formats whose headers depend on the
+ * entry sizes (currently, MTK and Sony ELF) to compute the complete layout
+ * when the header is written. If the sizes of all of a format's entries are
+ * declared, the boot image is written in a single forward pass without
+ * seeking, which allows writing to pipes or other non-seekable outputs.
+ * Entries that will not be written must be declared with a size of 0. Formats
+ * that do not support single-pass writing ignore the declared sizes.
+ *
+ * The amount of data written for each entry must match the declared size.
+ * Otherwise, the writer will fail when the entry is finished.
+ *
+ * \note In single-pass mode, the MTK writer cannot compute the SHA1 digest in
+ *       the header's `id` field because the digest covers the entry data that
+ *       follows the header. The field is left zeroed.
+ *
+ * This function must be called before mb_bi_writer_write_header().
+ *
+ * \param biw MbBiWriter
+ * \param entry_type Entry type (one of the `MB_BI_ENTRY_*` constants)
+ * \param size Size of the entry data
+ *
+ * \return
+ *   * #MB_BI_OK if the size is successfully recorded
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int mb_bi_writer_set_entry_size(MbBiWriter *biw, int entry_type, uint64_t size)
+{
+    WRITER_ENSURE_STATE(biw, WriterState::NEW | WriterState::HEADER);
+
+    int index = _entry_size_index(entry_type);
+    if (index < 0) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_INVALID_ARGUMENT,
+                               "Invalid entry type: %d", entry_type);
+        return MB_BI_FAILED;
+    }
+
+    biw->entry_sizes[index] = size;
+    biw->entry_sizes_set |= 1U << index;
+
+    return MB_BI_OK;
+}
+
 /*!
  * \brief Get selected boot image format code.
  *
@@ -20,6 +20,10 @@
 #include <gtest/gtest.h>
 
 #include <memory>
+#include <vector>
+
+#include <cstdint>
+#include <cstring>
 
 #include "mbcommon/file.h"
 #include "mbcommon/file/memory.h"
@@ -412,3 +416,108 @@ TEST_F(AndroidReaderGoToEntryTest, GoToMissingEntryShouldFail)
     // In EOF state now, so next read should return MB_BI_EOF
     ASSERT_EQ(mb_bi_reader_read_entry(_bir.get(), &entry), MB_BI_EOF);
 }
+
+TEST_F(AndroidReaderGoToEntryTest, ReadDataViewShouldNotCopy)
+{
+    MbBiEntry *entry;
+    const void *data;
+    size_t n;
+
+    ASSERT_EQ(mb_bi_reader_go_to_entry(_bir.get(), &entry, MB_BI_ENTRY_RAMDISK),
+              MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_read_data_view(_bir.get(), &data, SIZE_MAX, &n),
+              MB_BI_OK);
+    ASSERT_EQ(n, 7u);
+    // Points directly into the MemoryFile's buffer
+    ASSERT_EQ(data, _data.data() + 2 * 2048);
+    ASSERT_EQ(mb_bi_reader_read_data_view(_bir.get(), &data, SIZE_MAX, &n),
+              MB_BI_EOF);
+}
+
+TEST_F(AndroidReaderGoToEntryTest, ReadDataViewAndReadDataShouldInterleave)
+{
+    MbBiEntry *entry;
+    const void *data;
+    char buf[50];
+    size_t n;
+
+    ASSERT_EQ(mb_bi_reader_go_to_entry(_bir.get(), &entry,
+                                       MB_BI_ENTRY_SECONDBOOT),
+              MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_read_data_view(_bir.get(), &data, 6, &n),
+              MB_BI_OK);
+    ASSERT_EQ(n, 6u);
+    ASSERT_EQ(memcmp(data, "second", n), 0);
+    ASSERT_EQ(mb_bi_reader_read_data(_bir.get(), buf, sizeof(buf), &n),
+              MB_BI_OK);
+    ASSERT_EQ(n, 4u);
+    ASSERT_EQ(memcmp(buf, "boot", n), 0);
+    ASSERT_EQ(mb_bi_reader_read_data_view(_bir.get(), &data, SIZE_MAX, &n),
+              MB_BI_EOF);
+
+    // Moving to another entry should still work after partially viewing one
+    ASSERT_EQ(mb_bi_reader_go_to_entry(_bir.get(), &entry, MB_BI_ENTRY_KERNEL),
+              MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_read_data_view(_bir.get(), &data, 3, &n),
+              MB_BI_OK);
+    ASSERT_EQ(n, 3u);
+    ASSERT_EQ(memcmp(data, "ker", n), 0);
+    ASSERT_EQ(mb_bi_reader_read_entry(_bir.get(), &entry), MB_BI_OK);
+    ASSERT_EQ(mb_bi_entry_type(entry), MB_BI_ENTRY_RAMDISK);
+    ASSERT_EQ(mb_bi_reader_read_data(_bir.get(), buf, sizeof(buf), &n),
+              MB_BI_OK);
+    ASSERT_EQ(n, 7u);
+    ASSERT_EQ(memcmp(buf, "ramdisk", n), 0);
+}
+
+// MemoryFile that does not allow direct access to its contents
+class UnpeekableMemoryFile : public mb::MemoryFile
+{
+public:
+    using mb::MemoryFile::MemoryFile;
+
+protected:
+    virtual bool on_peek(uint64_t offset, size_t size, const void *&data,
+                         size_t &bytes_avail) override
+    {
+        return File::on_peek(offset, size, data, bytes_avail);
+    }
+};
+
+TEST(AndroidReaderViewTest, ReadDataViewShouldFallBackToCopy)
+{
+    ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+
+    AndroidHeader ahdr = {};
+    memcpy(ahdr.magic, ANDROID_BOOT_MAGIC, ANDROID_BOOT_MAGIC_SIZE);
+    ahdr.kernel_size = 6;
+    ahdr.page_size = 2048;
+
+    std::vector<unsigned char> data(2 * ahdr.page_size);
+    memcpy(data.data(), &ahdr, sizeof(ahdr));
+    memcpy(data.data() + ahdr.page_size, "kernel", 6);
+
+    UnpeekableMemoryFile file(data.data(), data.size());
+    ASSERT_TRUE(file.is_open());
+
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    const void *view;
+    size_t n;
+
+    ASSERT_EQ(mb_bi_reader_enable_format_android(bir.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_open(bir.get(), &file, false), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_read_header(bir.get(), &header), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_read_entry(bir.get(), &entry), MB_BI_OK);
+    ASSERT_EQ(mb_bi_entry_type(entry), MB_BI_ENTRY_KERNEL);
+
+    ASSERT_EQ(mb_bi_reader_read_data_view(bir.get(), &view, SIZE_MAX, &n),
+              MB_BI_OK);
+    ASSERT_EQ(n, 6u);
+    ASSERT_EQ(memcmp(view, "kernel", n), 0);
+    // Copied into the reader's own buffer
+    ASSERT_NE(view, data.data() + ahdr.page_size);
+    ASSERT_EQ(mb_bi_reader_read_data_view(bir.get(), &view, SIZE_MAX, &n),
+              MB_BI_EOF);
+}
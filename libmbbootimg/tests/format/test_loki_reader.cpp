@@ -30,6 +30,20 @@
 typedef std::unique_ptr<MbBiHeader, decltype(mb_bi_header_free) *> ScopedHeader;
 typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
 
+// MemoryFile that does not expose its contents via peek()
+class NoPeekMemoryFile : public mb::MemoryFile
+{
+public:
+    using mb::MemoryFile::MemoryFile;
+
+protected:
+    bool on_peek(uint64_t offset, size_t size, const void *&data,
+                 size_t &bytes_avail) override
+    {
+        return mb::File::on_peek(offset, size, data, bytes_avail);
+    }
+};
+
 // Tests for find_loki_header()
 
 TEST(FindLokiHeaderTest, ValidMagicShouldSucceed)
@@ -338,6 +352,67 @@ TEST(LokiOldFindGzipOffsetTest, MissingFlagsShouldWarn)
                        "No gzip headers found"));
 }
 
+TEST(LokiOldFindGzipOffsetTest, HeaderAcrossWindowBoundaryShouldBeFound)
+{
+    ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+
+    std::vector<unsigned char> data(LOKI_GZIP_SCAN_WINDOW + 16);
+
+    // Header with flags == 0x00 in the first window
+    data[10] = 0x1f;
+    data[11] = 0x8b;
+    data[12] = 0x08;
+    data[13] = 0x00;
+
+    // Header with flags == 0x08 split across the first and second windows
+    size_t split = LOKI_GZIP_SCAN_WINDOW - 2;
+    data[split + 0] = 0x1f;
+    data[split + 1] = 0x8b;
+    data[split + 2] = 0x08;
+    data[split + 3] = 0x08;
+
+    uint64_t gzip_offset;
+
+    {
+        NoPeekMemoryFile file(data.data(), data.size());
+        ASSERT_TRUE(file.is_open());
+
+        ASSERT_EQ(loki_old_find_gzip_offset(bir.get(), &file, 0, &gzip_offset),
+                  MB_BI_OK);
+        ASSERT_EQ(gzip_offset, split);
+    }
+
+    {
+        mb::MemoryFile file(data.data(), data.size());
+        ASSERT_TRUE(file.is_open());
+
+        ASSERT_EQ(loki_old_find_gzip_offset(bir.get(), &file, 0, &gzip_offset),
+                  MB_BI_OK);
+        ASSERT_EQ(gzip_offset, split);
+    }
+}
+
+TEST(LokiOldFindGzipOffsetTest, MissingFlagsWithoutPeekShouldWarn)
+{
+    ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+
+    unsigned char data[] = {
+        0x00, 0x1f, 0x8b, 0x08,
+    };
+
+    uint64_t gzip_offset;
+
+    NoPeekMemoryFile file(data, sizeof(data));
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_EQ(loki_old_find_gzip_offset(bir.get(), &file, 0, &gzip_offset),
+              MB_BI_WARN);
+    ASSERT_TRUE(strstr(mb_bi_reader_error_string(bir.get()),
+                       "No gzip headers found"));
+}
+
 // Tests for loki_old_find_ramdisk_size()
 
 TEST(LokiOldFindRamdiskSizeTest, ValidSamsungImageShouldSucceed)
@@ -512,7 +587,7 @@ TEST(LokiReadOldHeaderTest, ValidImageShouldSucceed)
 
     ASSERT_EQ(loki_read_old_header(bir.get(), &file, &ahdr, &lhdr,
                                    header.get(), &kernel_offset, &kernel_size,
-                                   &ramdisk_offset, &ramdisk_size),
+                                   &ramdisk_offset, &ramdisk_size, nullptr),
               MB_BI_OK);
 
     // Board name
@@ -653,3 +728,55 @@ TEST(LokiReadNewHeaderTest, ValidImageShouldSucceed)
     ASSERT_EQ(ramdisk_offset, 2 * ahdr.page_size);
     ASSERT_EQ(ramdisk_size, ahdr.page_size);
 }
+
+TEST(LokiReadOldHeaderTest, CachedLayoutShouldBeUsed)
+{
+    ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+    ScopedHeader header(mb_bi_header_new(), &mb_bi_header_free);
+    ASSERT_TRUE(!!header);
+
+    AndroidHeader ahdr = {};
+    memcpy(ahdr.magic, ANDROID_BOOT_MAGIC, ANDROID_BOOT_MAGIC_SIZE);
+    ahdr.kernel_addr = 0x11223344;
+    ahdr.ramdisk_addr = 0x88e0ff90; // jflteatt
+    ahdr.page_size = 2048;
+
+    LokiHeader lhdr = {};
+    memcpy(lhdr.magic, LOKI_MAGIC, LOKI_MAGIC_SIZE);
+
+    uint64_t kernel_offset;
+    uint32_t kernel_size;
+    uint64_t ramdisk_offset;
+    uint32_t ramdisk_size;
+
+    // Image contains no kernel header or gzip headers, so the scans would fail
+    std::vector<unsigned char> data(3 * ahdr.page_size + 0x200);
+
+    LokiOldLayout layout = {};
+    layout.valid = true;
+    layout.kernel_size = 1234;
+    layout.gzip_offset = 4096;
+    layout.ramdisk_size = 100;
+
+    mb::MemoryFile file(data.data(), data.size());
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_EQ(loki_read_old_header(bir.get(), &file, &ahdr, &lhdr,
+                                   header.get(), &kernel_offset, &kernel_size,
+                                   &ramdisk_offset, &ramdisk_size, &layout),
+              MB_BI_OK);
+
+    ASSERT_EQ(kernel_offset, ahdr.page_size);
+    ASSERT_EQ(kernel_size, 1234u);
+    ASSERT_EQ(ramdisk_offset, 4096u);
+    ASSERT_EQ(ramdisk_size, 100u);
+
+    // Without the cache, the scans are performed and fail
+    layout.valid = false;
+    ASSERT_EQ(loki_read_old_header(bir.get(), &file, &ahdr, &lhdr,
+                                   header.get(), &kernel_offset, &kernel_size,
+                                   &ramdisk_offset, &ramdisk_size, &layout),
+              MB_BI_WARN);
+    ASSERT_FALSE(layout.valid);
+}
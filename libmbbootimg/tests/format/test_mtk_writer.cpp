@@ -18,3 +18,191 @@
  */
 
 #include <gtest/gtest.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cstddef>
+#include <cstring>
+
+#include "mbcommon/file/memory.h"
+
+#include "mbbootimg/entry.h"
+#include "mbbootimg/format/android_p.h"
+#include "mbbootimg/format/mtk_p.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/writer.h"
+
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+
+// MemoryFile that behaves like a pipe
+class NoSeekMemoryFile : public mb::MemoryFile
+{
+public:
+    using mb::MemoryFile::MemoryFile;
+
+protected:
+    bool on_seek(int64_t offset, int whence, uint64_t &new_offset) override
+    {
+        (void) offset;
+        (void) whence;
+        (void) new_offset;
+        return false;
+    }
+
+    bool on_truncate(uint64_t size) override
+    {
+        (void) size;
+        return false;
+    }
+};
+
+struct MtkWriterTest : testing::Test
+{
+    std::map<int, std::string> _entries;
+
+    MtkWriterTest()
+    {
+        std::string mtkhdr(sizeof(MtkHeader), '\xff');
+        memcpy(&mtkhdr[0], MTK_MAGIC, MTK_MAGIC_SIZE);
+
+        _entries[MB_BI_ENTRY_MTK_KERNEL_HEADER] = mtkhdr;
+        _entries[MB_BI_ENTRY_KERNEL] = std::string(5000, 'k');
+        _entries[MB_BI_ENTRY_MTK_RAMDISK_HEADER] = mtkhdr;
+        _entries[MB_BI_ENTRY_RAMDISK] = std::string(3000, 'r');
+        _entries[MB_BI_ENTRY_SECONDBOOT] = std::string();
+        _entries[MB_BI_ENTRY_DEVICE_TREE] = std::string(100, 'd');
+    }
+
+    void declare_sizes(MbBiWriter *biw)
+    {
+        for (auto const &item : _entries) {
+            ASSERT_EQ(mb_bi_writer_set_entry_size(biw, item.first,
+                                                  item.second.size()),
+                      MB_BI_OK);
+        }
+    }
+
+    void write_image(MbBiWriter *biw, mb::File *file)
+    {
+        MbBiHeader *header;
+        MbBiEntry *entry;
+        size_t n;
+        int ret;
+
+        ASSERT_EQ(mb_bi_writer_set_format_mtk(biw), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_open(biw, file, false), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_get_header(biw, &header), MB_BI_OK);
+        ASSERT_EQ(mb_bi_header_set_page_size(header, 2048), MB_BI_OK);
+        ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header, "cmdline"),
+                  MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_write_header(biw, header), MB_BI_OK);
+
+        while ((ret = mb_bi_writer_get_entry(biw, &entry)) == MB_BI_OK) {
+            const std::string &data = _entries[mb_bi_entry_type(entry)];
+
+            ASSERT_EQ(mb_bi_writer_write_entry(biw, entry), MB_BI_OK);
+            ASSERT_EQ(mb_bi_writer_write_data(biw, data.data(), data.size(),
+                                              &n), MB_BI_OK);
+            ASSERT_EQ(n, data.size());
+        }
+        ASSERT_EQ(ret, MB_BI_EOF);
+
+        ASSERT_EQ(mb_bi_writer_close(biw), MB_BI_OK);
+    }
+};
+
+TEST_F(MtkWriterTest, DeclaredSizesShouldWriteWithoutSeeking)
+{
+    std::vector<unsigned char> seek_buf;
+    std::vector<unsigned char> stream_buf;
+
+    {
+        ScopedWriter biw(mb_bi_writer_new(), &mb_bi_writer_free);
+        ASSERT_TRUE(!!biw);
+        mb::MemoryFile file(&seek_buf);
+        ASSERT_TRUE(file.is_open());
+
+        write_image(biw.get(), &file);
+    }
+
+    {
+        ScopedWriter biw(mb_bi_writer_new(), &mb_bi_writer_free);
+        ASSERT_TRUE(!!biw);
+        NoSeekMemoryFile file(&stream_buf);
+        ASSERT_TRUE(file.is_open());
+
+        declare_sizes(biw.get());
+        write_image(biw.get(), &file);
+    }
+
+    // The id field is not computed in single-pass mode
+    ASSERT_GE(seek_buf.size(), sizeof(AndroidHeader));
+    memset(seek_buf.data() + offsetof(AndroidHeader, id), 0,
+           sizeof(AndroidHeader::id));
+
+    ASSERT_EQ(seek_buf, stream_buf);
+}
+
+TEST_F(MtkWriterTest, MismatchedDeclaredSizeShouldFail)
+{
+    std::vector<unsigned char> buf;
+    ScopedWriter biw(mb_bi_writer_new(), &mb_bi_writer_free);
+    ASSERT_TRUE(!!biw);
+    NoSeekMemoryFile file(&buf);
+    ASSERT_TRUE(file.is_open());
+
+    declare_sizes(biw.get());
+    ASSERT_EQ(mb_bi_writer_set_entry_size(biw.get(), MB_BI_ENTRY_KERNEL, 6000),
+              MB_BI_OK);
+
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    size_t n;
+
+    ASSERT_EQ(mb_bi_writer_set_format_mtk(biw.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_open(biw.get(), &file, false), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_get_header(biw.get(), &header), MB_BI_OK);
+    ASSERT_EQ(mb_bi_header_set_page_size(header, 2048), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_write_header(biw.get(), header), MB_BI_OK);
+
+    // MTK kernel header
+    const std::string &mtkhdr = _entries[MB_BI_ENTRY_MTK_KERNEL_HEADER];
+    ASSERT_EQ(mb_bi_writer_get_entry(biw.get(), &entry), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_write_entry(biw.get(), entry), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_write_data(biw.get(), mtkhdr.data(), mtkhdr.size(),
+                                      &n), MB_BI_OK);
+
+    // Kernel is shorter than declared
+    const std::string &kernel = _entries[MB_BI_ENTRY_KERNEL];
+    ASSERT_EQ(mb_bi_writer_get_entry(biw.get(), &entry), MB_BI_OK);
+    ASSERT_EQ(mb_bi_entry_type(entry), MB_BI_ENTRY_KERNEL);
+    ASSERT_EQ(mb_bi_writer_write_entry(biw.get(), entry), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_write_data(biw.get(), kernel.data(), kernel.size(),
+                                      &n), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_get_entry(biw.get(), &entry), MB_BI_FATAL);
+}
+
+TEST_F(MtkWriterTest, InvalidDeclaredMtkHeaderSizeShouldFail)
+{
+    std::vector<unsigned char> buf;
+    ScopedWriter biw(mb_bi_writer_new(), &mb_bi_writer_free);
+    ASSERT_TRUE(!!biw);
+    NoSeekMemoryFile file(&buf);
+    ASSERT_TRUE(file.is_open());
+
+    declare_sizes(biw.get());
+    ASSERT_EQ(mb_bi_writer_set_entry_size(biw.get(),
+                                          MB_BI_ENTRY_MTK_RAMDISK_HEADER, 100),
+              MB_BI_OK);
+
+    MbBiHeader *header;
+
+    ASSERT_EQ(mb_bi_writer_set_format_mtk(biw.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_open(biw.get(), &file, false), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_get_header(biw.get(), &header), MB_BI_OK);
+    ASSERT_EQ(mb_bi_header_set_page_size(header, 2048), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_write_header(biw.get(), header), MB_BI_FAILED);
+}
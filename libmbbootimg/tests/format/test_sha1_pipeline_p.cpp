@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <cstring>
+
+#include <openssl/sha.h>
+
+#include "mbbootimg/format/sha1_pipeline_p.h"
+
+struct Sha1PipelineDeleter
+{
+    void operator()(Sha1Pipeline *sp)
+    {
+        _sha1_pipeline_free(sp);
+    }
+};
+
+typedef std::unique_ptr<Sha1Pipeline, Sha1PipelineDeleter> ScopedSha1Pipeline;
+
+static std::vector<unsigned char> make_data(size_t size)
+{
+    std::vector<unsigned char> data(size);
+    for (size_t i = 0; i < size; ++i) {
+        data[i] = static_cast<unsigned char>(i * 31 + i / 257);
+    }
+    return data;
+}
+
+static void check_digest(const std::vector<unsigned char> &data,
+                         size_t chunk_size)
+{
+    unsigned char expected[SHA_DIGEST_LENGTH];
+    unsigned char actual[SHA_DIGEST_LENGTH];
+
+    SHA1(data.data(), data.size(), expected);
+
+    ScopedSha1Pipeline sp(_sha1_pipeline_new());
+    ASSERT_TRUE(!!sp);
+
+    for (size_t i = 0; i < data.size(); i += chunk_size) {
+        size_t n = std::min(chunk_size, data.size() - i);
+        ASSERT_TRUE(_sha1_pipeline_update(sp.get(), data.data() + i, n));
+    }
+
+    ASSERT_TRUE(_sha1_pipeline_final(sp.get(), actual));
+    ASSERT_EQ(memcmp(actual, expected, SHA_DIGEST_LENGTH), 0);
+}
+
+TEST(Sha1PipelineTest, HashEmpty)
+{
+    check_digest({}, 1);
+}
+
+TEST(Sha1PipelineTest, HashSmallInline)
+{
+    // Never fills a buffer, so the worker thread should not be needed
+    check_digest(make_data(1000), 7);
+}
+
+TEST(Sha1PipelineTest, HashLargeSmallChunks)
+{
+    check_digest(make_data(SHA1_PIPELINE_BUF_SIZE * 3 + 123), 10240);
+}
+
+TEST(Sha1PipelineTest, HashLargeSingleChunk)
+{
+    check_digest(make_data(SHA1_PIPELINE_BUF_SIZE * 5 - 1),
+                 SHA1_PIPELINE_BUF_SIZE * 5);
+}
+
+TEST(Sha1PipelineTest, HashExactBufferMultiple)
+{
+    check_digest(make_data(SHA1_PIPELINE_BUF_SIZE * 2),
+                 SHA1_PIPELINE_BUF_SIZE);
+}
+
+TEST(Sha1PipelineTest, FreeWithoutFinal)
+{
+    auto data = make_data(SHA1_PIPELINE_BUF_SIZE * 2 + 1);
+
+    Sha1Pipeline *sp = _sha1_pipeline_new();
+    ASSERT_NE(sp, nullptr);
+    ASSERT_TRUE(_sha1_pipeline_update(sp, data.data(), data.size()));
+    _sha1_pipeline_free(sp);
+}
@@ -18,3 +18,172 @@
  */
 
 #include <gtest/gtest.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mbcommon/file/memory.h"
+
+#include "mbbootimg/entry.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/writer.h"
+
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+
+// MemoryFile that behaves like a pipe
+class NoSeekMemoryFile : public mb::MemoryFile
+{
+public:
+    using mb::MemoryFile::MemoryFile;
+
+protected:
+    bool on_seek(int64_t offset, int whence, uint64_t &new_offset) override
+    {
+        (void) offset;
+        (void) whence;
+        (void) new_offset;
+        return false;
+    }
+};
+
+struct SonyElfWriterTest : testing::Test
+{
+    std::map<int, std::string> _entries;
+
+    SonyElfWriterTest()
+    {
+        _entries[MB_BI_ENTRY_KERNEL] = std::string(5000, 'k');
+        _entries[MB_BI_ENTRY_RAMDISK] = std::string(3000, 'r');
+        _entries[MB_BI_ENTRY_SONY_IPL] = std::string(1000, 'i');
+        _entries[MB_BI_ENTRY_SONY_RPM] = std::string(2000, 'p');
+        _entries[MB_BI_ENTRY_SONY_APPSBL] = std::string();
+    }
+
+    void declare_sizes(MbBiWriter *biw)
+    {
+        for (auto const &item : _entries) {
+            ASSERT_EQ(mb_bi_writer_set_entry_size(biw, item.first,
+                                                  item.second.size()),
+                      MB_BI_OK);
+        }
+    }
+
+    void write_image(MbBiWriter *biw, mb::File *file)
+    {
+        MbBiHeader *header;
+        MbBiEntry *entry;
+        size_t n;
+        int ret;
+
+        ASSERT_EQ(mb_bi_writer_set_format_sony_elf(biw), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_open(biw, file, false), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_get_header(biw, &header), MB_BI_OK);
+        ASSERT_EQ(mb_bi_header_set_kernel_address(header, 0x80208000),
+                  MB_BI_OK);
+        ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header, "cmdline"),
+                  MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_write_header(biw, header), MB_BI_OK);
+
+        while ((ret = mb_bi_writer_get_entry(biw, &entry)) == MB_BI_OK) {
+            const std::string &data = _entries[mb_bi_entry_type(entry)];
+
+            ASSERT_EQ(mb_bi_writer_write_entry(biw, entry), MB_BI_OK);
+            ASSERT_EQ(mb_bi_writer_write_data(biw, data.data(), data.size(),
+                                              &n), MB_BI_OK);
+            ASSERT_EQ(n, data.size());
+        }
+        ASSERT_EQ(ret, MB_BI_EOF);
+
+        ASSERT_EQ(mb_bi_writer_close(biw), MB_BI_OK);
+    }
+};
+
+TEST_F(SonyElfWriterTest, DeclaredSizesShouldWriteWithoutSeeking)
+{
+    std::vector<unsigned char> seek_buf;
+    std::vector<unsigned char> stream_buf;
+
+    {
+        ScopedWriter biw(mb_bi_writer_new(), &mb_bi_writer_free);
+        ASSERT_TRUE(!!biw);
+        mb::MemoryFile file(&seek_buf);
+        ASSERT_TRUE(file.is_open());
+
+        write_image(biw.get(), &file);
+    }
+
+    {
+        ScopedWriter biw(mb_bi_writer_new(), &mb_bi_writer_free);
+        ASSERT_TRUE(!!biw);
+        NoSeekMemoryFile file(&stream_buf);
+        ASSERT_TRUE(file.is_open());
+
+        declare_sizes(biw.get());
+        write_image(biw.get(), &file);
+    }
+
+    ASSERT_EQ(seek_buf, stream_buf);
+}
+
+TEST_F(SonyElfWriterTest, PartiallyDeclaredSizesShouldSeek)
+{
+    std::vector<unsigned char> buf;
+    ScopedWriter biw(mb_bi_writer_new(), &mb_bi_writer_free);
+    ASSERT_TRUE(!!biw);
+    NoSeekMemoryFile file(&buf);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_EQ(mb_bi_writer_set_entry_size(biw.get(), MB_BI_ENTRY_KERNEL, 5000),
+              MB_BI_OK);
+
+    MbBiHeader *header;
+
+    ASSERT_EQ(mb_bi_writer_set_format_sony_elf(biw.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_open(biw.get(), &file, false), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_get_header(biw.get(), &header), MB_BI_OK);
+
+    // Not all sizes are known, so the writer tries to skip to the first entry
+    ASSERT_EQ(mb_bi_writer_write_header(biw.get(), header), MB_BI_FAILED);
+}
+
+TEST_F(SonyElfWriterTest, ExcessDataShouldFail)
+{
+    std::vector<unsigned char> buf;
+    ScopedWriter biw(mb_bi_writer_new(), &mb_bi_writer_free);
+    ASSERT_TRUE(!!biw);
+    NoSeekMemoryFile file(&buf);
+    ASSERT_TRUE(file.is_open());
+
+    declare_sizes(biw.get());
+    ASSERT_EQ(mb_bi_writer_set_entry_size(biw.get(), MB_BI_ENTRY_KERNEL, 10),
+              MB_BI_OK);
+
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    size_t n;
+
+    ASSERT_EQ(mb_bi_writer_set_format_sony_elf(biw.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_open(biw.get(), &file, false), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_get_header(biw.get(), &header), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_write_header(biw.get(), header), MB_BI_OK);
+
+    const std::string &kernel = _entries[MB_BI_ENTRY_KERNEL];
+    ASSERT_EQ(mb_bi_writer_get_entry(biw.get(), &entry), MB_BI_OK);
+    ASSERT_EQ(mb_bi_entry_type(entry), MB_BI_ENTRY_KERNEL);
+    ASSERT_EQ(mb_bi_writer_write_entry(biw.get(), entry), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_write_data(biw.get(), kernel.data(), kernel.size(),
+                                      &n), MB_BI_FAILED);
+}
+
+TEST(SonyElfWriterSetEntrySizeTest, InvalidTypeShouldFail)
+{
+    ScopedWriter biw(mb_bi_writer_new(), &mb_bi_writer_free);
+    ASSERT_TRUE(!!biw);
+
+    ASSERT_EQ(mb_bi_writer_set_entry_size(biw.get(), 0, 0), MB_BI_FAILED);
+    ASSERT_EQ(mb_bi_writer_set_entry_size(
+            biw.get(), MB_BI_ENTRY_KERNEL | MB_BI_ENTRY_RAMDISK, 0),
+              MB_BI_FAILED);
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cstring>
+
+#include "mbcommon/file/memory.h"
+
+#include "mbbootimg/compare.h"
+#include "mbbootimg/format/android_p.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/reader.h"
+
+typedef std::unique_ptr<MbBiHeader, decltype(mb_bi_header_free) *> ScopedHeader;
+typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+
+static std::vector<unsigned char> make_image(const std::string &kernel,
+                                             const std::string &ramdisk,
+                                             uint32_t kernel_addr = 0x8000)
+{
+    AndroidHeader ahdr = {};
+    memcpy(ahdr.magic, ANDROID_BOOT_MAGIC, ANDROID_BOOT_MAGIC_SIZE);
+    ahdr.kernel_size = static_cast<uint32_t>(kernel.size());
+    ahdr.kernel_addr = kernel_addr;
+    ahdr.ramdisk_size = static_cast<uint32_t>(ramdisk.size());
+    ahdr.page_size = 2048;
+
+    std::vector<unsigned char> data(3 * ahdr.page_size);
+    memcpy(data.data(), &ahdr, sizeof(ahdr));
+    memcpy(data.data() + ahdr.page_size, kernel.data(), kernel.size());
+    memcpy(data.data() + 2 * ahdr.page_size, ramdisk.data(), ramdisk.size());
+
+    return data;
+}
+
+struct BootImgCompareTest : testing::Test
+{
+    mb::MemoryFile _file1;
+    mb::MemoryFile _file2;
+    ScopedReader _bir1;
+    ScopedReader _bir2;
+    std::vector<unsigned char> _data1;
+    std::vector<unsigned char> _data2;
+
+    BootImgCompareTest()
+        : _bir1(mb_bi_reader_new(), &mb_bi_reader_free)
+        , _bir2(mb_bi_reader_new(), &mb_bi_reader_free)
+    {
+    }
+
+    void open(std::vector<unsigned char> data1,
+              std::vector<unsigned char> data2)
+    {
+        ASSERT_TRUE(!!_bir1);
+        ASSERT_TRUE(!!_bir2);
+
+        _data1.swap(data1);
+        _data2.swap(data2);
+
+        _file1.open(_data1.data(), _data1.size());
+        ASSERT_TRUE(_file1.is_open());
+        _file2.open(_data2.data(), _data2.size());
+        ASSERT_TRUE(_file2.is_open());
+
+        ASSERT_EQ(mb_bi_reader_enable_format_android(_bir1.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_reader_enable_format_android(_bir2.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_reader_open(_bir1.get(), &_file1, false), MB_BI_OK);
+        ASSERT_EQ(mb_bi_reader_open(_bir2.get(), &_file2, false), MB_BI_OK);
+    }
+};
+
+TEST_F(BootImgCompareTest, IdenticalImagesShouldBeEqual)
+{
+    open(make_image("kernel", "ramdisk"), make_image("kernel", "ramdisk"));
+
+    int equal = 0;
+    ASSERT_EQ(mb_bi_reader_compare(_bir1.get(), _bir2.get(), &equal),
+              MB_BI_OK);
+    ASSERT_TRUE(equal);
+}
+
+TEST_F(BootImgCompareTest, DifferentHeaderShouldNotBeEqual)
+{
+    open(make_image("kernel", "ramdisk", 0x8000),
+         make_image("kernel", "ramdisk", 0x10000));
+
+    int equal = 1;
+    ASSERT_EQ(mb_bi_reader_compare(_bir1.get(), _bir2.get(), &equal),
+              MB_BI_OK);
+    ASSERT_FALSE(equal);
+}
+
+TEST_F(BootImgCompareTest, DifferentSizeShouldNotBeEqual)
+{
+    open(make_image("kernel", "ramdisk"), make_image("kernel", "ramdisk2"));
+
+    int equal = 1;
+    ASSERT_EQ(mb_bi_reader_compare(_bir1.get(), _bir2.get(), &equal),
+              MB_BI_OK);
+    ASSERT_FALSE(equal);
+}
+
+TEST_F(BootImgCompareTest, DifferentDataShouldNotBeEqual)
+{
+    open(make_image("kernel", "ramdisk"), make_image("kernel", "ramdizk"));
+
+    int equal = 1;
+    ASSERT_EQ(mb_bi_reader_compare(_bir1.get(), _bir2.get(), &equal),
+              MB_BI_OK);
+    ASSERT_FALSE(equal);
+}
+
+TEST_F(BootImgCompareTest, ErrorInSecondImageShouldBeReportedOnFirst)
+{
+    std::vector<unsigned char> truncated = make_image("kernel", "ramdisk");
+    truncated.resize(2048 + 3);
+
+    open(make_image("kernel", "ramdisk"), std::move(truncated));
+
+    int equal;
+    ASSERT_LE(mb_bi_reader_compare(_bir1.get(), _bir2.get(), &equal),
+              MB_BI_WARN);
+    ASSERT_NE(mb_bi_reader_error(_bir1.get()), 0);
+    ASSERT_STRNE(mb_bi_reader_error_string(_bir1.get()), "");
+}
+
+TEST(BootImgHeaderEqualTest, UnsetFieldsShouldDiffer)
+{
+    ScopedHeader header1(mb_bi_header_new(), &mb_bi_header_free);
+    ScopedHeader header2(mb_bi_header_new(), &mb_bi_header_free);
+    ASSERT_TRUE(!!header1);
+    ASSERT_TRUE(!!header2);
+
+    ASSERT_TRUE(mb_bi_header_equal(header1.get(), header2.get()));
+
+    ASSERT_EQ(mb_bi_header_set_board_name(header1.get(), "board"), MB_BI_OK);
+    ASSERT_FALSE(mb_bi_header_equal(header1.get(), header2.get()));
+
+    ASSERT_EQ(mb_bi_header_set_board_name(header2.get(), "board"), MB_BI_OK);
+    ASSERT_TRUE(mb_bi_header_equal(header1.get(), header2.get()));
+
+    ASSERT_EQ(mb_bi_header_set_page_size(header2.get(), 2048), MB_BI_OK);
+    ASSERT_FALSE(mb_bi_header_equal(header1.get(), header2.get()));
+}
@@ -21,6 +21,7 @@
 
 #include <memory>
 
+#include "mbbootimg/defs.h"
 #include "mbbootimg/entry.h"
 #include "mbbootimg/entry_p.h"
 
@@ -77,6 +78,24 @@ TEST(BootImgEntryTest, CheckGettersSetters)
     ASSERT_EQ(entry->field.name, nullptr);
     ASSERT_EQ(mb_bi_entry_name(entry.get()), nullptr);
 
+    // Storage should be reused for strings that fit
+
+    ASSERT_EQ(mb_bi_entry_set_name(entry.get(), "Hello, world!"), MB_BI_OK);
+    const char *name = mb_bi_entry_name(entry.get());
+    mb_bi_entry_clear(entry.get());
+    ASSERT_EQ(entry->field.name, nullptr);
+    ASSERT_EQ(mb_bi_entry_set_name(entry.get(), "Hello"), MB_BI_OK);
+    ASSERT_EQ(mb_bi_entry_name(entry.get()), name);
+    ASSERT_STREQ(mb_bi_entry_name(entry.get()), "Hello");
+
+    // Setting a field to itself should be a no-op
+
+    ASSERT_EQ(mb_bi_entry_set_name(entry.get(), mb_bi_entry_name(entry.get())),
+              MB_BI_OK);
+    ASSERT_STREQ(mb_bi_entry_name(entry.get()), "Hello");
+
+    mb_bi_entry_set_name(entry.get(), nullptr);
+
     // Size field
 
     mb_bi_entry_set_size(entry.get(), 1234);
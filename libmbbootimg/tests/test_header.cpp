@@ -113,6 +113,21 @@ TEST(BootImgHeaderTest, CheckGettersSetters)
     ASSERT_EQ(header->field.cmdline, nullptr);
     ASSERT_EQ(mb_bi_header_kernel_cmdline(header.get()), nullptr);
 
+    // Storage should be reused for strings that fit and reallocated otherwise
+
+    ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header.get(), "test"), MB_BI_OK);
+    const char *cmdline = mb_bi_header_kernel_cmdline(header.get());
+    mb_bi_header_clear(header.get());
+    ASSERT_EQ(header->field.cmdline, nullptr);
+    ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header.get(), "abc"), MB_BI_OK);
+    ASSERT_EQ(mb_bi_header_kernel_cmdline(header.get()), cmdline);
+    ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header.get(), "abcdefgh"),
+              MB_BI_OK);
+    ASSERT_STREQ(mb_bi_header_kernel_cmdline(header.get()), "abcdefgh");
+    ASSERT_EQ(header->pool.cmdline_size, 9u);
+
+    ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header.get(), nullptr), MB_BI_OK);
+
     // Page size field
 
     ASSERT_EQ(mb_bi_header_set_page_size(header.get(), 1234), MB_BI_OK);
@@ -0,0 +1,480 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cstdio>
+#include <cstring>
+
+#include <lz4.h>
+#include <lzma.h>
+#include <zlib.h>
+
+#include "mbcommon/file/memory.h"
+
+#include "mbbootimg/format/android_p.h"
+#include "mbbootimg/ramdisk.h"
+#include "mbbootimg/reader.h"
+
+typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+typedef std::unique_ptr<MbBiRamdiskReader,
+                        decltype(mb_bi_ramdisk_reader_free) *>
+        ScopedRamdiskReader;
+
+typedef std::vector<unsigned char> Buffer;
+typedef std::vector<std::pair<std::string, std::string>> Members;
+
+static void append(Buffer &buf, const void *data, size_t size)
+{
+    auto ptr = static_cast<const unsigned char *>(data);
+    buf.insert(buf.end(), ptr, ptr + size);
+}
+
+static void pad4(Buffer &buf)
+{
+    buf.resize((buf.size() + 3) & ~static_cast<size_t>(3));
+}
+
+static void append_newc_member(Buffer &buf, const std::string &name,
+                               uint32_t mode, const std::string &data)
+{
+    char header[111];
+    snprintf(header, sizeof(header),
+             "070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+             0u, mode, 0u, 0u, 1u, 0u, static_cast<uint32_t>(data.size()),
+             0u, 0u, 0u, 0u, static_cast<uint32_t>(name.size() + 1), 0u);
+
+    append(buf, header, 110);
+    append(buf, name.c_str(), name.size() + 1);
+    pad4(buf);
+    append(buf, data.data(), data.size());
+    pad4(buf);
+}
+
+static Buffer make_cpio(const Members &members)
+{
+    Buffer buf;
+
+    for (auto const &m : members) {
+        append_newc_member(buf, m.first, 0100644, m.second);
+    }
+    append_newc_member(buf, "TRAILER!!!", 0, "");
+
+    return buf;
+}
+
+static Buffer compress_gzip(const Buffer &in)
+{
+    z_stream strm = {};
+    EXPECT_EQ(deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16,
+                           8, Z_DEFAULT_STRATEGY), Z_OK);
+
+    Buffer out(deflateBound(&strm, static_cast<uLong>(in.size())));
+    strm.next_in = const_cast<Bytef *>(in.data());
+    strm.avail_in = static_cast<uInt>(in.size());
+    strm.next_out = out.data();
+    strm.avail_out = static_cast<uInt>(out.size());
+
+    EXPECT_EQ(deflate(&strm, Z_FINISH), Z_STREAM_END);
+    out.resize(strm.total_out);
+    deflateEnd(&strm);
+
+    return out;
+}
+
+static Buffer compress_lz4_legacy(const Buffer &in)
+{
+    const size_t block_size = 8 * 1024 * 1024;
+    Buffer out;
+
+    static const unsigned char magic[] = { 0x02, 0x21, 0x4c, 0x18 };
+    append(out, magic, sizeof(magic));
+
+    for (size_t offset = 0; offset < in.size(); offset += block_size) {
+        int in_size = static_cast<int>(std::min(block_size,
+                                                in.size() - offset));
+        std::vector<char> block(static_cast<size_t>(
+                LZ4_compressBound(in_size)));
+
+        int n = LZ4_compress_default(
+                reinterpret_cast<const char *>(in.data() + offset),
+                block.data(), in_size, static_cast<int>(block.size()));
+        EXPECT_GT(n, 0);
+
+        unsigned char size[4] = {
+            static_cast<unsigned char>(n & 0xff),
+            static_cast<unsigned char>((n >> 8) & 0xff),
+            static_cast<unsigned char>((n >> 16) & 0xff),
+            static_cast<unsigned char>((n >> 24) & 0xff),
+        };
+        append(out, size, sizeof(size));
+        append(out, block.data(), static_cast<size_t>(n));
+    }
+
+    return out;
+}
+
+static Buffer run_lzma_encoder(lzma_stream &strm, const Buffer &in)
+{
+    Buffer out(lzma_stream_buffer_bound(in.size()) + 1024);
+    strm.next_in = in.data();
+    strm.avail_in = in.size();
+    strm.next_out = out.data();
+    strm.avail_out = out.size();
+
+    EXPECT_EQ(lzma_code(&strm, LZMA_FINISH), LZMA_STREAM_END);
+    out.resize(strm.total_out);
+    lzma_end(&strm);
+
+    return out;
+}
+
+static Buffer compress_xz(const Buffer &in)
+{
+    lzma_stream strm = LZMA_STREAM_INIT;
+    EXPECT_EQ(lzma_easy_encoder(&strm, 1, LZMA_CHECK_CRC32), LZMA_OK);
+    return run_lzma_encoder(strm, in);
+}
+
+static Buffer compress_xz_multiblock(const Buffer &in)
+{
+    lzma_mt mt = {};
+    mt.threads = 2;
+    mt.block_size = 1024 * 1024;
+    mt.preset = 1;
+    mt.check = LZMA_CHECK_CRC32;
+
+    lzma_stream strm = LZMA_STREAM_INIT;
+    EXPECT_EQ(lzma_stream_encoder_mt(&strm, &mt), LZMA_OK);
+    return run_lzma_encoder(strm, in);
+}
+
+static Buffer compress_lzma(const Buffer &in)
+{
+    lzma_options_lzma options;
+    EXPECT_FALSE(lzma_lzma_preset(&options, 1));
+
+    lzma_stream strm = LZMA_STREAM_INIT;
+    EXPECT_EQ(lzma_alone_encoder(&strm, &options), LZMA_OK);
+    return run_lzma_encoder(strm, in);
+}
+
+static Buffer make_image(const Buffer &ramdisk)
+{
+    AndroidHeader ahdr = {};
+    memcpy(ahdr.magic, ANDROID_BOOT_MAGIC, ANDROID_BOOT_MAGIC_SIZE);
+    ahdr.kernel_size = 6;
+    ahdr.ramdisk_size = static_cast<uint32_t>(ramdisk.size());
+    ahdr.page_size = 2048;
+
+    Buffer data(2 * ahdr.page_size + ramdisk.size());
+    memcpy(data.data(), &ahdr, sizeof(ahdr));
+    memcpy(data.data() + ahdr.page_size, "kernel", 6);
+    memcpy(data.data() + 2 * ahdr.page_size, ramdisk.data(), ramdisk.size());
+
+    return data;
+}
+
+static std::string read_member_data(MbBiRamdiskReader *brr)
+{
+    std::string data;
+    const void *view;
+    size_t n;
+    int ret;
+
+    while ((ret = mb_bi_ramdisk_reader_read_data_view(brr, &view, 3, &n))
+            == MB_BI_OK) {
+        data.append(static_cast<const char *>(view), n);
+    }
+    EXPECT_EQ(ret, MB_BI_EOF) << mb_bi_ramdisk_reader_error_string(brr);
+
+    return data;
+}
+
+struct BootImgRamdiskTest : testing::Test
+{
+    Buffer _data;
+    mb::MemoryFile _file;
+    ScopedReader _bir;
+    ScopedRamdiskReader _brr;
+
+    BootImgRamdiskTest()
+        : _bir(mb_bi_reader_new(), &mb_bi_reader_free)
+        , _brr(mb_bi_ramdisk_reader_new(), &mb_bi_ramdisk_reader_free)
+    {
+    }
+
+    void open(Buffer ramdisk, unsigned int threads = 0)
+    {
+        ASSERT_TRUE(!!_bir);
+        ASSERT_TRUE(!!_brr);
+
+        _data = make_image(ramdisk);
+
+        ASSERT_TRUE(_file.open(_data.data(), _data.size()));
+        ASSERT_EQ(mb_bi_reader_enable_format_android(_bir.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_reader_open(_bir.get(), &_file, false), MB_BI_OK);
+
+        MbBiHeader *header;
+        ASSERT_EQ(mb_bi_reader_read_header(_bir.get(), &header), MB_BI_OK);
+
+        ASSERT_EQ(mb_bi_ramdisk_reader_set_threads(_brr.get(), threads),
+                  MB_BI_OK);
+    }
+};
+
+static const Members test_members = {
+    { "init.rc", "on boot\n" },
+    { "default.prop", "ro.secure=1\n" },
+    { "empty", "" },
+    { "sbin/adbd", std::string(5000, 'x') },
+};
+
+struct CompressionParam
+{
+    Buffer (*compress)(const Buffer &);
+    int compression;
+};
+
+static Buffer no_compression(const Buffer &in)
+{
+    return in;
+}
+
+struct BootImgRamdiskCompressionTest
+    : BootImgRamdiskTest
+    , testing::WithParamInterface<CompressionParam>
+{
+};
+
+TEST_P(BootImgRamdiskCompressionTest, ReadAllMembers)
+{
+    open(GetParam().compress(make_cpio(test_members)));
+    ASSERT_EQ(mb_bi_ramdisk_reader_open(_brr.get(), _bir.get()), MB_BI_OK)
+            << mb_bi_ramdisk_reader_error_string(_brr.get());
+    ASSERT_EQ(mb_bi_ramdisk_reader_compression(_brr.get()),
+              GetParam().compression);
+
+    MbBiRamdiskMember *member;
+
+    for (auto const &m : test_members) {
+        ASSERT_EQ(mb_bi_ramdisk_reader_read_member(_brr.get(), &member),
+                  MB_BI_OK) << mb_bi_ramdisk_reader_error_string(_brr.get());
+        ASSERT_STREQ(mb_bi_ramdisk_member_name(member), m.first.c_str());
+        ASSERT_EQ(mb_bi_ramdisk_member_mode(member), 0100644u);
+        ASSERT_EQ(mb_bi_ramdisk_member_size(member), m.second.size());
+        ASSERT_EQ(read_member_data(_brr.get()), m.second);
+    }
+
+    ASSERT_EQ(mb_bi_ramdisk_reader_read_member(_brr.get(), &member),
+              MB_BI_EOF);
+    ASSERT_EQ(mb_bi_ramdisk_reader_read_member(_brr.get(), &member),
+              MB_BI_EOF);
+}
+
+TEST_P(BootImgRamdiskCompressionTest, UnreadDataShouldBeSkipped)
+{
+    open(GetParam().compress(make_cpio(test_members)));
+    ASSERT_EQ(mb_bi_ramdisk_reader_open(_brr.get(), _bir.get()), MB_BI_OK);
+
+    MbBiRamdiskMember *member;
+    char buf[4];
+    size_t n;
+
+    ASSERT_EQ(mb_bi_ramdisk_reader_read_member(_brr.get(), &member),
+              MB_BI_OK);
+    ASSERT_EQ(mb_bi_ramdisk_reader_read_data(_brr.get(), buf, sizeof(buf),
+                                             &n), MB_BI_OK);
+    ASSERT_EQ(n, 4u);
+    ASSERT_EQ(memcmp(buf, "on b", 4), 0);
+
+    ASSERT_EQ(mb_bi_ramdisk_reader_read_member(_brr.get(), &member),
+              MB_BI_OK);
+    ASSERT_STREQ(mb_bi_ramdisk_member_name(member), "default.prop");
+    ASSERT_EQ(read_member_data(_brr.get()), "ro.secure=1\n");
+}
+
+INSTANTIATE_TEST_CASE_P(
+    Compressions, BootImgRamdiskCompressionTest,
+    testing::Values(
+        CompressionParam{ &no_compression,
+                          MB_BI_RAMDISK_COMPRESSION_NONE },
+        CompressionParam{ &compress_gzip,
+                          MB_BI_RAMDISK_COMPRESSION_GZIP },
+        CompressionParam{ &compress_lz4_legacy,
+                          MB_BI_RAMDISK_COMPRESSION_LZ4_LEGACY },
+        CompressionParam{ &compress_xz,
+                          MB_BI_RAMDISK_COMPRESSION_XZ },
+        CompressionParam{ &compress_lzma,
+                          MB_BI_RAMDISK_COMPRESSION_LZMA }
+    )
+);
+
+TEST_F(BootImgRamdiskTest, GoToMemberShouldStartOverIfPassed)
+{
+    open(compress_gzip(make_cpio(test_members)));
+    ASSERT_EQ(mb_bi_ramdisk_reader_open(_brr.get(), _bir.get()), MB_BI_OK);
+
+    MbBiRamdiskMember *member;
+
+    ASSERT_EQ(mb_bi_ramdisk_reader_go_to_member(_brr.get(), &member,
+                                                "default.prop"), MB_BI_OK);
+    ASSERT_STREQ(mb_bi_ramdisk_member_name(member), "default.prop");
+
+    ASSERT_EQ(mb_bi_ramdisk_reader_go_to_member(_brr.get(), &member,
+                                                "init.rc"), MB_BI_OK);
+    ASSERT_STREQ(mb_bi_ramdisk_member_name(member), "init.rc");
+    ASSERT_EQ(read_member_data(_brr.get()), "on boot\n");
+
+    // Iteration continues after the member that was found
+    ASSERT_EQ(mb_bi_ramdisk_reader_read_member(_brr.get(), &member),
+              MB_BI_OK);
+    ASSERT_STREQ(mb_bi_ramdisk_member_name(member), "default.prop");
+}
+
+TEST_F(BootImgRamdiskTest, GoToMissingMemberShouldReturnEOF)
+{
+    open(compress_gzip(make_cpio(test_members)));
+    ASSERT_EQ(mb_bi_ramdisk_reader_open(_brr.get(), _bir.get()), MB_BI_OK);
+
+    MbBiRamdiskMember *member;
+
+    ASSERT_EQ(mb_bi_ramdisk_reader_read_member(_brr.get(), &member),
+              MB_BI_OK);
+    ASSERT_EQ(mb_bi_ramdisk_reader_go_to_member(_brr.get(), &member,
+                                                "romid"), MB_BI_EOF);
+}
+
+TEST_F(BootImgRamdiskTest, MultithreadedLz4ShouldMatch)
+{
+    // Spans multiple 8 MiB LZ4 blocks
+    std::string big(20 * 1024 * 1024, '\0');
+    for (size_t i = 0; i < big.size(); ++i) {
+        big[i] = static_cast<char>((i * 7) ^ (i >> 13));
+    }
+    Members members = { { "big", big }, { "after", "end" } };
+
+    open(compress_lz4_legacy(make_cpio(members)), 4);
+    ASSERT_EQ(mb_bi_ramdisk_reader_open(_brr.get(), _bir.get()), MB_BI_OK);
+
+    MbBiRamdiskMember *member;
+    std::string data;
+    const void *view;
+    size_t n;
+    int ret;
+
+    ASSERT_EQ(mb_bi_ramdisk_reader_read_member(_brr.get(), &member),
+              MB_BI_OK);
+    while ((ret = mb_bi_ramdisk_reader_read_data_view(
+            _brr.get(), &view, SIZE_MAX, &n)) == MB_BI_OK) {
+        data.append(static_cast<const char *>(view), n);
+    }
+    ASSERT_EQ(ret, MB_BI_EOF);
+    ASSERT_TRUE(data == big);
+
+    ASSERT_EQ(mb_bi_ramdisk_reader_read_member(_brr.get(), &member),
+              MB_BI_OK);
+    ASSERT_STREQ(mb_bi_ramdisk_member_name(member), "after");
+    ASSERT_EQ(read_member_data(_brr.get()), "end");
+}
+
+TEST_F(BootImgRamdiskTest, MultithreadedXzShouldMatch)
+{
+    std::string big(4 * 1024 * 1024, '\0');
+    for (size_t i = 0; i < big.size(); ++i) {
+        big[i] = static_cast<char>((i * 13) ^ (i >> 11));
+    }
+    Members members = { { "big", big }, { "after", "end" } };
+
+    open(compress_xz_multiblock(make_cpio(members)), 4);
+    ASSERT_EQ(mb_bi_ramdisk_reader_open(_brr.get(), _bir.get()), MB_BI_OK);
+
+    MbBiRamdiskMember *member;
+    std::string data(big.size(), '\0');
+    size_t n;
+
+    ASSERT_EQ(mb_bi_ramdisk_reader_go_to_member(_brr.get(), &member, "big"),
+              MB_BI_OK);
+    ASSERT_EQ(mb_bi_ramdisk_reader_read_data(_brr.get(), &data[0],
+                                             data.size(), &n), MB_BI_OK);
+    ASSERT_EQ(n, big.size());
+    ASSERT_TRUE(data == big);
+
+    ASSERT_EQ(mb_bi_ramdisk_reader_go_to_member(_brr.get(), &member,
+                                                "after"), MB_BI_OK);
+    ASSERT_EQ(read_member_data(_brr.get()), "end");
+}
+
+TEST_F(BootImgRamdiskTest, HeadersSplitAcrossChunksShouldBeParsed)
+{
+    // Enough members that headers cross the decoder's output chunks
+    Members members;
+    for (int i = 0; i < 20000; ++i) {
+        members.emplace_back("file" + std::to_string(i), std::to_string(i));
+    }
+
+    open(compress_gzip(make_cpio(members)));
+    ASSERT_EQ(mb_bi_ramdisk_reader_open(_brr.get(), _bir.get()), MB_BI_OK);
+
+    MbBiRamdiskMember *member;
+
+    for (auto const &m : members) {
+        ASSERT_EQ(mb_bi_ramdisk_reader_read_member(_brr.get(), &member),
+                  MB_BI_OK) << mb_bi_ramdisk_reader_error_string(_brr.get());
+        ASSERT_STREQ(mb_bi_ramdisk_member_name(member), m.first.c_str());
+        ASSERT_EQ(read_member_data(_brr.get()), m.second);
+    }
+
+    ASSERT_EQ(mb_bi_ramdisk_reader_read_member(_brr.get(), &member),
+              MB_BI_EOF);
+}
+
+TEST_F(BootImgRamdiskTest, UnknownCompressionShouldFail)
+{
+    Buffer ramdisk(64, 'z');
+
+    open(ramdisk);
+    ASSERT_LE(mb_bi_ramdisk_reader_open(_brr.get(), _bir.get()),
+              MB_BI_WARN);
+    ASSERT_TRUE(strstr(mb_bi_ramdisk_reader_error_string(_brr.get()),
+                       "Unknown ramdisk compression"));
+}
+
+TEST_F(BootImgRamdiskTest, TruncatedRamdiskShouldFail)
+{
+    Buffer ramdisk = compress_gzip(make_cpio(test_members));
+    ramdisk.resize(ramdisk.size() / 2);
+
+    open(ramdisk);
+    ASSERT_EQ(mb_bi_ramdisk_reader_open(_brr.get(), _bir.get()), MB_BI_OK);
+
+    MbBiRamdiskMember *member;
+    int ret;
+
+    while ((ret = mb_bi_ramdisk_reader_read_member(_brr.get(), &member))
+            == MB_BI_OK);
+    ASSERT_LE(ret, MB_BI_FATAL);
+    ASSERT_TRUE(strstr(mb_bi_ramdisk_reader_error_string(_brr.get()),
+                       "truncated"));
+}
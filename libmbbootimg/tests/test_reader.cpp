@@ -20,7 +20,13 @@
 #include <gtest/gtest.h>
 
 #include <memory>
+#include <vector>
 
+#include <cstring>
+
+#include "mbcommon/file/memory.h"
+
+#include "mbbootimg/format/android_defs.h"
 #include "mbbootimg/reader.h"
 #include "mbbootimg/reader_p.h"
 
@@ -50,4 +56,83 @@ TEST(BootImgReaderTest, CheckInitialValues)
     // Header and entry allocated
     ASSERT_NE(bir->header, nullptr);
     ASSERT_NE(bir->entry, nullptr);
+
+    // Nothing cached
+    ASSERT_FALSE(bir->probe_valid);
+    ASSERT_TRUE(bir->probe_buf.empty());
+}
+
+TEST(BootImgReaderTest, OpenCachesFileHead)
+{
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+
+    std::vector<unsigned char> data(READER_PROBE_SIZE * 2);
+    memcpy(data.data(), ANDROID_BOOT_MAGIC, ANDROID_BOOT_MAGIC_SIZE);
+    data.back() = 'x';
+
+    mb::MemoryFile file(data.data(), data.size());
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_EQ(mb_bi_reader_enable_format_all(bir.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_open(bir.get(), &file, false), MB_BI_OK);
+
+    ASSERT_TRUE(bir->probe_valid);
+    ASSERT_FALSE(bir->probe_eof);
+    ASSERT_EQ(bir->probe_buf.size(), static_cast<size_t>(READER_PROBE_SIZE));
+
+    unsigned char buf[ANDROID_BOOT_MAGIC_SIZE];
+    size_t n;
+
+    // Served from the cache without changing the file position
+    ASSERT_TRUE(file.seek(100, SEEK_SET, nullptr));
+    ASSERT_TRUE(_mb_bi_reader_read_at(bir.get(), &file, 0, buf, sizeof(buf),
+                                      n));
+    ASSERT_EQ(n, sizeof(buf));
+    ASSERT_EQ(memcmp(buf, ANDROID_BOOT_MAGIC, ANDROID_BOOT_MAGIC_SIZE), 0);
+    uint64_t pos;
+    ASSERT_TRUE(file.seek(0, SEEK_CUR, &pos));
+    ASSERT_EQ(pos, 100u);
+
+    // Uncached ranges are read from the file
+    ASSERT_TRUE(_mb_bi_reader_read_at(bir.get(), &file, data.size() - 1, buf,
+                                      sizeof(buf), n));
+    ASSERT_EQ(n, 1u);
+    ASSERT_EQ(buf[0], 'x');
+
+    ASSERT_EQ(mb_bi_reader_close(bir.get()), MB_BI_OK);
+    ASSERT_FALSE(bir->probe_valid);
+}
+
+TEST(BootImgReaderTest, ResetReenablesFormats)
+{
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+
+    std::vector<unsigned char> data(READER_PROBE_SIZE);
+    memcpy(data.data(), ANDROID_BOOT_MAGIC, ANDROID_BOOT_MAGIC_SIZE);
+
+    ASSERT_EQ(mb_bi_reader_enable_format_android(bir.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_enable_format_loki(bir.get()), MB_BI_OK);
+    ASSERT_EQ(bir->formats_len, 2u);
+
+    for (int i = 0; i < 2; ++i) {
+        mb::MemoryFile file(data.data(), data.size());
+        ASSERT_TRUE(file.is_open());
+
+        ASSERT_EQ(mb_bi_reader_open(bir.get(), &file, false), MB_BI_OK);
+        ASSERT_NE(bir->format, nullptr);
+        ASSERT_EQ(mb_bi_reader_format_code(bir.get()), MB_BI_FORMAT_ANDROID);
+
+        ASSERT_EQ(mb_bi_reader_reset(bir.get()), MB_BI_OK);
+
+        // Back to the initial state with the same formats enabled
+        ASSERT_EQ(bir->state, ReaderState::NEW);
+        ASSERT_EQ(bir->file, nullptr);
+        ASSERT_EQ(bir->format, nullptr);
+        ASSERT_FALSE(bir->probe_valid);
+        ASSERT_EQ(bir->formats_len, 2u);
+        ASSERT_EQ(bir->formats[0].type, MB_BI_FORMAT_ANDROID);
+        ASSERT_EQ(bir->formats[1].type, MB_BI_FORMAT_LOKI);
+    }
 }
@@ -0,0 +1,275 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <cstring>
+
+#include "mbcommon/file/memory.h"
+
+#include "mbbootimg/entry.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/reader.h"
+#include "mbbootimg/transform.h"
+#include "mbbootimg/writer.h"
+
+typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+
+typedef std::unordered_map<int, std::string> EntryMap;
+
+struct BootImgTransformTest : public ::testing::Test
+{
+protected:
+    void *_in_buf = nullptr;
+    size_t _in_size = 0;
+    void *_out_buf = nullptr;
+    size_t _out_size = 0;
+
+    virtual ~BootImgTransformTest()
+    {
+        free(_in_buf);
+        free(_out_buf);
+    }
+
+    void WriteImage(const EntryMap &entries)
+    {
+        ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+        ASSERT_TRUE(!!biw);
+
+        mb::MemoryFile file(&_in_buf, &_in_size);
+        ASSERT_TRUE(file.is_open());
+
+        ASSERT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_open(biw.get(), &file, false), MB_BI_OK);
+
+        MbBiHeader *header;
+        MbBiEntry *entry;
+        int ret;
+        size_t n;
+
+        ASSERT_EQ(mb_bi_writer_get_header(biw.get(), &header), MB_BI_OK);
+        ASSERT_EQ(mb_bi_header_set_page_size(header, 2048), MB_BI_OK);
+        ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header, "foo=bar"),
+                  MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_write_header(biw.get(), header), MB_BI_OK);
+
+        while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
+            ASSERT_EQ(mb_bi_writer_write_entry(biw.get(), entry), MB_BI_OK);
+
+            auto it = entries.find(mb_bi_entry_type(entry));
+            if (it != entries.end()) {
+                ASSERT_EQ(mb_bi_writer_write_data(biw.get(), it->second.data(),
+                                                  it->second.size(), &n),
+                          MB_BI_OK);
+                ASSERT_EQ(n, it->second.size());
+            }
+        }
+        ASSERT_EQ(ret, MB_BI_EOF);
+
+        ASSERT_EQ(mb_bi_writer_close(biw.get()), MB_BI_OK);
+    }
+
+    void ReadImage(void *buf, size_t size, EntryMap &entries,
+                   std::string &cmdline)
+    {
+        ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+        ASSERT_TRUE(!!bir);
+
+        mb::MemoryFile file(buf, size);
+        ASSERT_TRUE(file.is_open());
+
+        ASSERT_EQ(mb_bi_reader_enable_format_android(bir.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_reader_open(bir.get(), &file, false), MB_BI_OK);
+
+        MbBiHeader *header;
+        MbBiEntry *entry;
+        int ret;
+
+        ASSERT_EQ(mb_bi_reader_read_header(bir.get(), &header), MB_BI_OK);
+        cmdline = mb_bi_header_kernel_cmdline(header);
+
+        entries.clear();
+
+        while ((ret = mb_bi_reader_read_entry(bir.get(), &entry)) == MB_BI_OK) {
+            std::string &data = entries[mb_bi_entry_type(entry)];
+            char chunk[1024];
+            size_t n;
+
+            while ((ret = mb_bi_reader_read_data(bir.get(), chunk,
+                                                 sizeof(chunk), &n))
+                    == MB_BI_OK) {
+                data.append(chunk, n);
+            }
+            ASSERT_EQ(ret, MB_BI_EOF);
+        }
+        ASSERT_EQ(ret, MB_BI_EOF);
+    }
+
+    void Transform(MbBiTransformSelectCb select_cb,
+                   MbBiTransformRewriteCb rewrite_cb)
+    {
+        ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+        ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+        ASSERT_TRUE(!!bir);
+        ASSERT_TRUE(!!biw);
+
+        mb::MemoryFile in_file(_in_buf, _in_size);
+        mb::MemoryFile out_file(&_out_buf, &_out_size);
+        ASSERT_TRUE(in_file.is_open());
+        ASSERT_TRUE(out_file.is_open());
+
+        ASSERT_EQ(mb_bi_reader_enable_format_android(bir.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_reader_open(bir.get(), &in_file, false), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_open(biw.get(), &out_file, false), MB_BI_OK);
+
+        ASSERT_EQ(mb_bi_transform(bir.get(), biw.get(), select_cb, rewrite_cb,
+                                  nullptr), MB_BI_OK)
+                << mb_bi_writer_error_string(biw.get());
+
+        ASSERT_EQ(mb_bi_writer_close(biw.get()), MB_BI_OK);
+    }
+};
+
+TEST_F(BootImgTransformTest, CopyAllEntries)
+{
+    EntryMap input{
+        { MB_BI_ENTRY_KERNEL, "kernel" },
+        { MB_BI_ENTRY_RAMDISK, "ramdisk" },
+    };
+    ASSERT_NO_FATAL_FAILURE(WriteImage(input));
+    ASSERT_NO_FATAL_FAILURE(Transform(nullptr, nullptr));
+
+    // Output should be byte for byte identical
+    ASSERT_EQ(_out_size, _in_size);
+    ASSERT_EQ(memcmp(_out_buf, _in_buf, _in_size), 0);
+}
+
+TEST_F(BootImgTransformTest, RewriteEntries)
+{
+    EntryMap input{
+        { MB_BI_ENTRY_KERNEL, "kernel" },
+        { MB_BI_ENTRY_RAMDISK, "ramdisk" },
+    };
+    ASSERT_NO_FATAL_FAILURE(WriteImage(input));
+
+    auto select_cb = [](int type, void *userdata) -> int {
+        (void) userdata;
+        return type == MB_BI_ENTRY_KERNEL
+                ? MB_BI_TRANSFORM_COPY : MB_BI_TRANSFORM_REWRITE;
+    };
+    auto rewrite_cb = [](int type, bool exists,
+                         std::vector<unsigned char> &data,
+                         void *userdata) -> int {
+        (void) userdata;
+        if (type == MB_BI_ENTRY_RAMDISK) {
+            EXPECT_TRUE(exists);
+            std::reverse(data.begin(), data.end());
+            data.push_back('!');
+        } else if (type == MB_BI_ENTRY_SECONDBOOT) {
+            // Not in the input, so add it
+            EXPECT_FALSE(exists);
+            EXPECT_TRUE(data.empty());
+            data.assign({ 's', 'e', 'c', 'o', 'n', 'd' });
+        }
+        return MB_BI_OK;
+    };
+
+    ASSERT_NO_FATAL_FAILURE(Transform(select_cb, rewrite_cb));
+
+    EntryMap output;
+    std::string cmdline;
+    ASSERT_NO_FATAL_FAILURE(ReadImage(_out_buf, _out_size, output, cmdline));
+
+    ASSERT_EQ(cmdline, "foo=bar");
+    ASSERT_EQ(output[MB_BI_ENTRY_KERNEL], "kernel");
+    ASSERT_EQ(output[MB_BI_ENTRY_RAMDISK], "ksidmar!");
+    ASSERT_EQ(output[MB_BI_ENTRY_SECONDBOOT], "second");
+    ASSERT_EQ(output[MB_BI_ENTRY_DEVICE_TREE], "");
+}
+
+TEST_F(BootImgTransformTest, ReplaceEntries)
+{
+    EntryMap input{
+        { MB_BI_ENTRY_KERNEL, "kernel" },
+        { MB_BI_ENTRY_RAMDISK, "ramdisk" },
+    };
+    ASSERT_NO_FATAL_FAILURE(WriteImage(input));
+
+    auto select_cb = [](int type, void *userdata) -> int {
+        (void) userdata;
+        return type == MB_BI_ENTRY_KERNEL
+                ? MB_BI_TRANSFORM_REPLACE : MB_BI_TRANSFORM_COPY;
+    };
+    auto rewrite_cb = [](int type, bool exists,
+                         std::vector<unsigned char> &data,
+                         void *userdata) -> int {
+        (void) userdata;
+        EXPECT_EQ(type, MB_BI_ENTRY_KERNEL);
+        // The existing data is not read
+        EXPECT_TRUE(exists);
+        EXPECT_TRUE(data.empty());
+        data.assign({ 'n', 'e', 'w' });
+        return MB_BI_OK;
+    };
+
+    ASSERT_NO_FATAL_FAILURE(Transform(select_cb, rewrite_cb));
+
+    EntryMap output;
+    std::string cmdline;
+    ASSERT_NO_FATAL_FAILURE(ReadImage(_out_buf, _out_size, output, cmdline));
+
+    ASSERT_EQ(output[MB_BI_ENTRY_KERNEL], "new");
+    ASSERT_EQ(output[MB_BI_ENTRY_RAMDISK], "ramdisk");
+}
+
+TEST_F(BootImgTransformTest, RewriteFailureAborts)
+{
+    ASSERT_NO_FATAL_FAILURE(WriteImage({ { MB_BI_ENTRY_KERNEL, "kernel" } }));
+
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+    ASSERT_TRUE(!!bir);
+    ASSERT_TRUE(!!biw);
+
+    mb::MemoryFile in_file(_in_buf, _in_size);
+    mb::MemoryFile out_file(&_out_buf, &_out_size);
+
+    ASSERT_EQ(mb_bi_reader_enable_format_android(bir.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_open(bir.get(), &in_file, false), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_open(biw.get(), &out_file, false), MB_BI_OK);
+
+    auto select_cb = [](int type, void *userdata) -> int {
+        (void) type;
+        (void) userdata;
+        return MB_BI_TRANSFORM_REWRITE;
+    };
+
+    // Missing rewrite callback
+    ASSERT_EQ(mb_bi_transform(bir.get(), biw.get(), select_cb, nullptr,
+                              nullptr), MB_BI_FAILED);
+    ASSERT_EQ(mb_bi_writer_error(biw.get()), MB_BI_ERROR_PROGRAMMER_ERROR);
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <benchmark/benchmark.h>
+
+#include <random>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+
+#ifndef _WIN32
+#  include <unistd.h>
+#endif
+
+#include "mbcommon/file/memory.h"
+#include "mbcommon/file_util.h"
+
+#ifndef _WIN32
+#  include "mbcommon/file/fd.h"
+#endif
+
+// Random data that never contains the search patterns below, except where they
+// are explicitly inserted
+static std::vector<unsigned char> make_haystack(size_t size)
+{
+    std::vector<unsigned char> data(size);
+    std::mt19937 gen(12345);
+    std::uniform_int_distribution<int> dist('a', 'y');
+
+    for (auto &c : data) {
+        c = static_cast<unsigned char>(dist(gen));
+    }
+
+    return data;
+}
+
+static mb::FileSearchAction count_match(mb::File &file, void *userdata,
+                                        uint64_t offset)
+{
+    (void) file;
+    (void) offset;
+
+    ++*static_cast<size_t *>(userdata);
+    return mb::FileSearchAction::Continue;
+}
+
+// Args: pattern size, buffer size (0 for default)
+static void BM_FileSearch(benchmark::State &state)
+{
+    constexpr size_t haystack_size = 16 * 1024 * 1024;
+    auto pattern_size = static_cast<size_t>(state.range(0));
+    auto bsize = static_cast<size_t>(state.range(1));
+
+    std::vector<unsigned char> data = make_haystack(haystack_size);
+    std::vector<unsigned char> pattern(pattern_size, 'z');
+
+    // Sprinkle some matches throughout the data
+    for (size_t offset = haystack_size / 8; offset + pattern_size
+            < haystack_size; offset += haystack_size / 8) {
+        std::copy(pattern.begin(), pattern.end(), data.begin() + offset);
+    }
+
+    mb::MemoryFile file(data.data(), data.size());
+
+    for (auto _ : state) {
+        size_t matches = 0;
+        if (!mb::file_search(file, -1, -1, bsize, pattern.data(),
+                             pattern.size(), -1, &count_match, &matches)) {
+            state.SkipWithError(file.error_string().c_str());
+            break;
+        }
+        benchmark::DoNotOptimize(matches);
+    }
+
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations())
+            * static_cast<int64_t>(haystack_size));
+}
+BENCHMARK(BM_FileSearch)
+    ->ArgNames({"pattern", "bsize"})
+    ->ArgsProduct({{4, 16, 64, 256}, {0, 64 * 1024, 1024 * 1024}});
+
+static void BM_FileReadFully(benchmark::State &state)
+{
+    auto size = static_cast<size_t>(state.range(0));
+    std::vector<unsigned char> data = make_haystack(size);
+    std::vector<unsigned char> buf(size);
+
+    mb::MemoryFile file(data.data(), data.size());
+
+    for (auto _ : state) {
+        size_t n;
+        if (!file.seek(0, SEEK_SET, nullptr)
+                || !mb::file_read_fully(file, buf.data(), buf.size(), n)) {
+            state.SkipWithError(file.error_string().c_str());
+            break;
+        }
+        benchmark::DoNotOptimize(buf.data());
+    }
+
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations())
+            * static_cast<int64_t>(size));
+}
+BENCHMARK(BM_FileReadFully)->RangeMultiplier(16)->Range(4 * 1024, 16 << 20);
+
+// MemoryFile that uses the generic read_at()/write_at() based file_move()
+class GenericMoveFile : public mb::MemoryFile
+{
+public:
+    using mb::MemoryFile::MemoryFile;
+
+protected:
+    virtual bool on_move(uint64_t src, uint64_t dest, uint64_t size,
+                         uint64_t &size_moved) override
+    {
+        return File::on_move(src, dest, size, size_moved);
+    }
+};
+
+static void run_file_move(benchmark::State &state, mb::File &file,
+                          uint64_t size)
+{
+    for (auto _ : state) {
+        uint64_t n;
+        // Alternate directions so that both code paths are measured
+        if (!mb::file_move(file, size / 2, 0, size / 2, n)
+                || !mb::file_move(file, 0, size / 2, size / 2, n)) {
+            state.SkipWithError(file.error_string().c_str());
+            break;
+        }
+    }
+
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations())
+            * static_cast<int64_t>(size));
+}
+
+static void BM_FileMoveMemory(benchmark::State &state)
+{
+    auto size = static_cast<size_t>(state.range(0));
+    std::vector<unsigned char> data = make_haystack(size);
+    mb::MemoryFile file(data.data(), data.size());
+
+    run_file_move(state, file, size);
+}
+BENCHMARK(BM_FileMoveMemory)->RangeMultiplier(16)->Range(64 * 1024, 64 << 20);
+
+static void BM_FileMoveGeneric(benchmark::State &state)
+{
+    auto size = static_cast<size_t>(state.range(0));
+    std::vector<unsigned char> data = make_haystack(size);
+    GenericMoveFile file(data.data(), data.size());
+
+    run_file_move(state, file, size);
+}
+BENCHMARK(BM_FileMoveGeneric)->RangeMultiplier(16)->Range(64 * 1024, 64 << 20);
+
+#ifndef _WIN32
+static void BM_FileMoveFd(benchmark::State &state)
+{
+    auto size = static_cast<size_t>(state.range(0));
+    std::vector<unsigned char> data = make_haystack(size);
+
+    char path[] = "/tmp/mbcommon_benchmark.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        state.SkipWithError("Failed to create temporary file");
+        return;
+    }
+    unlink(path);
+
+    mb::FdFile file(fd, true);
+    size_t n;
+    if (!mb::file_write_fully(file, data.data(), data.size(), n)) {
+        state.SkipWithError(file.error_string().c_str());
+        return;
+    }
+
+    run_file_move(state, file, size);
+}
+BENCHMARK(BM_FileMoveFd)->RangeMultiplier(16)->Range(64 * 1024, 64 << 20);
+#endif
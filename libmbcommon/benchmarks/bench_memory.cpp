@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <benchmark/benchmark.h>
+
+#include <vector>
+
+#include <cstdlib>
+
+#include "mbcommon/file/memory.h"
+#include "mbcommon/file_util.h"
+
+static constexpr size_t total_size = 16 * 1024 * 1024;
+
+// Arg: size of each write
+static void BM_MemoryFileGrowth(benchmark::State &state)
+{
+    auto chunk_size = static_cast<size_t>(state.range(0));
+    std::vector<unsigned char> chunk(chunk_size, 'x');
+
+    for (auto _ : state) {
+        void *buf = nullptr;
+        size_t size = 0;
+
+        {
+            mb::MemoryFile file(&buf, &size);
+
+            for (size_t written = 0; written < total_size;
+                    written += chunk_size) {
+                size_t n;
+                if (!mb::file_write_fully(file, chunk.data(), chunk.size(),
+                                          n)) {
+                    state.SkipWithError(file.error_string().c_str());
+                    break;
+                }
+            }
+        }
+
+        benchmark::DoNotOptimize(buf);
+        free(buf);
+    }
+
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations())
+            * static_cast<int64_t>(total_size));
+}
+BENCHMARK(BM_MemoryFileGrowth)->RangeMultiplier(8)->Range(16, 64 * 1024);
+
+static void BM_MemoryFileGrowthVector(benchmark::State &state)
+{
+    auto chunk_size = static_cast<size_t>(state.range(0));
+    std::vector<unsigned char> chunk(chunk_size, 'x');
+
+    for (auto _ : state) {
+        std::vector<unsigned char> buf;
+
+        {
+            mb::MemoryFile file(&buf);
+
+            for (size_t written = 0; written < total_size;
+                    written += chunk_size) {
+                size_t n;
+                if (!mb::file_write_fully(file, chunk.data(), chunk.size(),
+                                          n)) {
+                    state.SkipWithError(file.error_string().c_str());
+                    break;
+                }
+            }
+        }
+
+        benchmark::DoNotOptimize(buf.data());
+    }
+
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations())
+            * static_cast<int64_t>(total_size));
+}
+BENCHMARK(BM_MemoryFileGrowthVector)->RangeMultiplier(8)->Range(16, 64 * 1024);
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <vector>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "mbcommon/string.h"
+
+// Args: buffer size, replacement size
+static void BM_MemReplace(benchmark::State &state)
+{
+    auto size = static_cast<size_t>(state.range(0));
+    auto to_size = static_cast<size_t>(state.range(1));
+
+    // One match every 64 bytes
+    std::string source;
+    while (source.size() < size) {
+        source += "abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRSTUVW"
+                  "<xy>";
+    }
+    source.resize(size);
+    std::string to(to_size, '-');
+
+    for (auto _ : state) {
+        void *mem = malloc(source.size());
+        size_t mem_size = source.size();
+        size_t n_replaced;
+
+        memcpy(mem, source.data(), source.size());
+
+        if (mb::mem_replace(&mem, &mem_size, "<xy>", 4, to.data(), to.size(),
+                            0, &n_replaced) < 0) {
+            free(mem);
+            state.SkipWithError("mem_replace() failed");
+            break;
+        }
+
+        benchmark::DoNotOptimize(mem);
+        free(mem);
+    }
+
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations())
+            * static_cast<int64_t>(size));
+}
+BENCHMARK(BM_MemReplace)
+    ->ArgNames({"size", "to"})
+    ->ArgsProduct({{1024, 64 * 1024, 1024 * 1024}, {0, 4, 16}});
+
+static void BM_StrReplace(benchmark::State &state)
+{
+    auto size = static_cast<size_t>(state.range(0));
+
+    std::string source;
+    while (source.size() < size) {
+        source += "The quick brown fox jumps over the lazy dog. ";
+    }
+    source.resize(size);
+
+    for (auto _ : state) {
+        char *str = strdup(source.c_str());
+        size_t n_replaced;
+
+        if (mb::str_replace(&str, "fox", "wolverine", 0, &n_replaced) < 0) {
+            free(str);
+            state.SkipWithError("str_replace() failed");
+            break;
+        }
+
+        benchmark::DoNotOptimize(str);
+        free(str);
+    }
+
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations())
+            * static_cast<int64_t>(size));
+}
+BENCHMARK(BM_StrReplace)->RangeMultiplier(16)->Range(256, 1024 * 1024);
+
+// Args: number of patterns
+static void BM_MemReplaceMulti(benchmark::State &state)
+{
+    auto count = static_cast<size_t>(state.range(0));
+    const size_t size = 1024 * 1024;
+
+    std::vector<std::string> patterns;
+    std::vector<mb::MemReplacement> replacements;
+    for (size_t i = 0; i < count; ++i) {
+        patterns.push_back(mb::format("@VAR%zu@", i));
+    }
+    for (auto const &p : patterns) {
+        replacements.push_back({ p.data(), p.size(), "value", 5 });
+    }
+
+    // One placeholder every 64 bytes
+    std::string source;
+    for (size_t i = 0; source.size() < size; ++i) {
+        source += "abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRS";
+        source += patterns[i % count];
+    }
+    source.resize(size);
+
+    for (auto _ : state) {
+        void *mem = malloc(source.size());
+        size_t mem_size = source.size();
+        size_t n_replaced;
+
+        memcpy(mem, source.data(), source.size());
+
+        if (mb::mem_replace_multi(&mem, &mem_size, replacements.data(),
+                                  replacements.size(), &n_replaced) < 0) {
+            free(mem);
+            state.SkipWithError("mem_replace_multi() failed");
+            break;
+        }
+
+        benchmark::DoNotOptimize(mem);
+        free(mem);
+    }
+
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations())
+            * static_cast<int64_t>(size));
+}
+BENCHMARK(BM_MemReplaceMulti)->ArgNames({"patterns"})->Arg(1)->Arg(4)->Arg(10);
+
+static void BM_FormatShort(benchmark::State &state)
+{
+    for (auto _ : state) {
+        std::string result = mb::format("%s: %d", "value", 42);
+        benchmark::DoNotOptimize(result.data());
+    }
+}
+BENCHMARK(BM_FormatShort);
+
+static void BM_FormatLong(benchmark::State &state)
+{
+    std::string arg(static_cast<size_t>(state.range(0)), 'x');
+
+    for (auto _ : state) {
+        std::string result = mb::format("[%s] %s (%zu bytes)", "tag",
+                                        arg.c_str(), arg.size());
+        benchmark::DoNotOptimize(result.data());
+    }
+}
+BENCHMARK(BM_FormatLong)->RangeMultiplier(8)->Range(64, 32 * 1024);
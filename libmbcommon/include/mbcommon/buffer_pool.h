@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/common.h"
+
+#include <cstddef>
+
+namespace mb
+{
+
+// Alignment of every IoBuffer. This satisfies O_DIRECT on all filesystems
+// Android devices use.
+constexpr size_t IO_BUFFER_ALIGNMENT = 4096;
+// Buffer size for sequential reads and writes when the caller has no better
+// idea
+constexpr size_t IO_BUFFER_DEFAULT_SIZE = 1024 * 1024;
+
+class MB_EXPORT IoBuffer
+{
+public:
+    IoBuffer();
+    explicit IoBuffer(size_t size);
+    ~IoBuffer();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(IoBuffer)
+
+    IoBuffer(IoBuffer &&other);
+    IoBuffer & operator=(IoBuffer &&rhs);
+
+    bool allocate(size_t size = IO_BUFFER_DEFAULT_SIZE);
+    void release();
+
+    template<typename T = unsigned char>
+    T * data() const
+    {
+        return static_cast<T *>(_data);
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    explicit operator bool() const
+    {
+        return _data != nullptr;
+    }
+
+private:
+    void *_data;
+    size_t _size;
+};
+
+}
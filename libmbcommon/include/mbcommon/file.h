@@ -33,6 +33,18 @@
 namespace mb
 {
 
+struct FileIoVec
+{
+    void *data;
+    size_t size;
+};
+
+struct FileConstIoVec
+{
+    const void *data;
+    size_t size;
+};
+
 class FilePrivate;
 class MB_EXPORT File
 {
@@ -55,6 +67,18 @@ public:
     bool write(const void *buf, size_t size, size_t &bytes_written);
     bool seek(int64_t offset, int whence, uint64_t *new_offset);
     bool truncate(uint64_t size);
+    bool peek(uint64_t offset, size_t size, const void *&data,
+              size_t &bytes_avail);
+    bool readv(const FileIoVec *iov, size_t count, size_t &bytes_read);
+    bool writev(const FileConstIoVec *iov, size_t count,
+                size_t &bytes_written);
+
+    // Positional operations
+    bool read_at(uint64_t offset, void *buf, size_t size, size_t &bytes_read);
+    bool write_at(uint64_t offset, const void *buf, size_t size,
+                  size_t &bytes_written);
+    bool move(uint64_t src, uint64_t dest, uint64_t size,
+              uint64_t &size_moved);
 
     // File state
     bool is_open();
@@ -82,6 +106,18 @@ protected:
     virtual bool on_write(const void *buf, size_t size, size_t &bytes_written);
     virtual bool on_seek(int64_t offset, int whence, uint64_t &new_offset);
     virtual bool on_truncate(uint64_t size);
+    virtual bool on_peek(uint64_t offset, size_t size, const void *&data,
+                         size_t &bytes_avail);
+    virtual bool on_readv(const FileIoVec *iov, size_t count,
+                          size_t &bytes_read);
+    virtual bool on_writev(const FileConstIoVec *iov, size_t count,
+                           size_t &bytes_written);
+    virtual bool on_read_at(uint64_t offset, void *buf, size_t size,
+                            size_t &bytes_read);
+    virtual bool on_write_at(uint64_t offset, const void *buf, size_t size,
+                             size_t &bytes_written);
+    virtual bool on_move(uint64_t src, uint64_t dest, uint64_t size,
+                         uint64_t &size_moved);
 
     std::unique_ptr<FilePrivate> _priv_ptr;
 };
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "mbcommon/guard_p.h"
+
+#include <vector>
+
+#include "mbcommon/file/buffered.h"
+#include "mbcommon/file_p.h"
+
+/*! \cond INTERNAL */
+namespace mb
+{
+
+class BufferedFilePrivate : public FilePrivate
+{
+public:
+    BufferedFilePrivate();
+    virtual ~BufferedFilePrivate();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(BufferedFilePrivate)
+
+    void clear();
+
+    // Underlying file (not owned)
+    File *file;
+    bool seekable;
+
+    // Requested buffer size (0 for default)
+    size_t buf_size;
+
+    // Buffer holding either read-ahead data or pending writes
+    std::vector<char> buf;
+    uint64_t buf_offset;
+    size_t buf_len;
+    bool dirty;
+
+    // Logical position of this handle
+    uint64_t pos;
+    // Actual position of the underlying file
+    uint64_t file_pos;
+};
+
+}
+/*! \endcond */
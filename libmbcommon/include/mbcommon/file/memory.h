@@ -19,6 +19,8 @@
 
 #pragma once
 
+#include <vector>
+
 #include "mbcommon/file.h"
 
 namespace mb
@@ -33,6 +35,7 @@ public:
     MemoryFile();
     MemoryFile(const void *buf, size_t size);
     MemoryFile(void **buf_ptr, size_t *size_ptr);
+    MemoryFile(std::vector<unsigned char> *buf);
     virtual ~MemoryFile();
 
     MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(MemoryFile)
@@ -40,6 +43,9 @@ public:
 
     bool open(const void *buf, size_t size);
     bool open(void **buf_ptr, size_t *size_ptr);
+    bool open(std::vector<unsigned char> *buf);
+
+    bool reserve(size_t capacity);
 
 protected:
     /*! \cond INTERNAL */
@@ -48,6 +54,8 @@ protected:
                const void *buf, size_t size);
     MemoryFile(MemoryFilePrivate *priv,
                void **buf_ptr, size_t *size_ptr);
+    MemoryFile(MemoryFilePrivate *priv,
+               std::vector<unsigned char> *buf);
     /*! \endcond */
 
     virtual bool on_close() override;
@@ -58,6 +66,14 @@ protected:
     virtual bool on_seek(int64_t offset, int whence,
                          uint64_t &new_offset) override;
     virtual bool on_truncate(uint64_t size) override;
+    virtual bool on_read_at(uint64_t offset, void *buf, size_t size,
+                            size_t &bytes_read) override;
+    virtual bool on_write_at(uint64_t offset, const void *buf, size_t size,
+                             size_t &bytes_written) override;
+    virtual bool on_move(uint64_t src, uint64_t dest, uint64_t size,
+                         uint64_t &size_moved) override;
+    virtual bool on_peek(uint64_t offset, size_t size, const void *&data,
+                         size_t &bytes_avail) override;
 };
 
 }
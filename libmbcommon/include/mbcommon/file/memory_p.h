@@ -21,6 +21,8 @@
 
 #include "mbcommon/guard_p.h"
 
+#include <vector>
+
 #include "mbcommon/file/memory.h"
 #include "mbcommon/file_p.h"
 
@@ -40,10 +42,15 @@ public:
 
     void *data;
     size_t size;
+    // Allocated size of data (only for dynamically sized buffers)
+    size_t capacity;
 
     void **data_ptr;
     size_t *size_ptr;
 
+    // Caller's vector if opened with open(std::vector<unsigned char> *)
+    std::vector<unsigned char> *vector;
+
     size_t pos;
 
     bool fixed_size;
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <system_error>
+#include <vector>
+
+#include "mbcommon/file/fd.h"
+
+namespace mb
+{
+
+struct UringCompletion
+{
+    // Tag passed to the submit function
+    void *tag;
+    // Number of bytes transferred if successful
+    size_t bytes;
+    // Error if the operation failed
+    std::error_code error;
+};
+
+class UringFilePrivate;
+class MB_EXPORT UringFile : public FdFile
+{
+    MB_DECLARE_PRIVATE(UringFile)
+
+public:
+    UringFile();
+    UringFile(int fd, bool owned);
+    UringFile(const std::string &filename, FileOpenMode mode);
+    UringFile(const std::wstring &filename, FileOpenMode mode);
+    virtual ~UringFile();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(UringFile)
+    MB_DEFAULT_MOVE_CONSTRUCT_AND_ASSIGN(UringFile)
+
+    using FdFile::open;
+
+    bool has_ring();
+
+    // Registered buffer pool
+    bool register_buffers(size_t count, size_t size);
+    void * buffer(size_t index);
+    size_t buffer_count();
+    size_t buffer_size();
+
+    // Asynchronous operations
+    bool submit_read_at(uint64_t offset, void *buf, size_t size, void *tag);
+    bool submit_write_at(uint64_t offset, const void *buf, size_t size,
+                         void *tag);
+    bool submit_read_fixed(uint64_t offset, size_t index, size_t size,
+                           void *tag);
+    bool submit_write_fixed(uint64_t offset, size_t index, size_t size,
+                            void *tag);
+    bool submit();
+    bool reap(size_t min_complete, std::vector<UringCompletion> &completions);
+    size_t in_flight();
+
+protected:
+    /*! \cond INTERNAL */
+    UringFile(UringFilePrivate *priv);
+    UringFile(UringFilePrivate *priv,
+              int fd, bool owned);
+    UringFile(UringFilePrivate *priv,
+              const std::string &filename, FileOpenMode mode);
+    UringFile(UringFilePrivate *priv,
+              const std::wstring &filename, FileOpenMode mode);
+    /*! \endcond */
+
+    virtual bool on_open() override;
+    virtual bool on_close() override;
+    virtual bool on_read(void *buf, size_t size,
+                         size_t &bytes_read) override;
+    virtual bool on_write(const void *buf, size_t size,
+                          size_t &bytes_written) override;
+    virtual bool on_read_at(uint64_t offset, void *buf, size_t size,
+                            size_t &bytes_read) override;
+    virtual bool on_write_at(uint64_t offset, const void *buf, size_t size,
+                             size_t &bytes_written) override;
+};
+
+}
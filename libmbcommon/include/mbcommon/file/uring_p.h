@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "mbcommon/guard_p.h"
+
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+#include <linux/io_uring.h>
+
+#include "mbcommon/file/uring.h"
+#include "mbcommon/file/fd_p.h"
+
+/*! \cond INTERNAL */
+namespace mb
+{
+
+struct UringRing
+{
+    int fd = -1;
+
+    // Submission queue
+    void *sq_ptr = nullptr;
+    size_t sq_ptr_size = 0;
+    unsigned *sq_head = nullptr;
+    unsigned *sq_tail = nullptr;
+    unsigned *sq_mask = nullptr;
+    unsigned *sq_array = nullptr;
+    unsigned sq_entries = 0;
+    struct io_uring_sqe *sqes = nullptr;
+    size_t sqes_size = 0;
+
+    // Completion queue
+    void *cq_ptr = nullptr;
+    size_t cq_ptr_size = 0;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned *cq_mask = nullptr;
+    unsigned cq_entries = 0;
+    struct io_uring_cqe *cqes = nullptr;
+};
+
+class UringFilePrivate : public FdFilePrivate
+{
+public:
+    UringFilePrivate();
+    virtual ~UringFilePrivate();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(UringFilePrivate)
+
+    bool setup_ring(unsigned entries);
+    void destroy_ring();
+    void free_buffers();
+
+    // The ring is shared by all threads using the handle
+    std::mutex lock;
+
+    bool have_ring;
+    UringRing ring;
+
+    // SQEs that have been queued, but not yet submitted
+    unsigned unsubmitted;
+    // Operations submitted to the kernel, but not yet reaped
+    size_t submitted;
+
+    // Tags of asynchronous operations, keyed by user_data
+    std::unordered_map<uint64_t, void *> tags;
+    uint64_t next_id;
+
+    // Completions that have been reaped, but not yet returned to the caller
+    std::deque<UringCompletion> completed;
+
+    // Result of the synchronous operation in progress
+    bool sync_done;
+    int32_t sync_result;
+
+    // Registered buffer pool
+    void *buffers;
+    size_t buffers_count;
+    size_t buffers_size;
+    bool buffers_registered;
+};
+
+}
+/*! \endcond */
@@ -20,6 +20,7 @@
 #pragma once
 
 #include "mbcommon/file.h"
+#include "mbcommon/flags.h"
 
 #include "mbcommon/file/open_mode.h"
 
@@ -28,6 +29,16 @@
 namespace mb
 {
 
+enum class Win32FileHint : uint8_t
+{
+    // Open with FILE_FLAG_SEQUENTIAL_SCAN
+    SequentialScan  = 1 << 0,
+    // Read read-only files through overlapped double-buffered read-ahead
+    ReadAhead       = 1 << 1,
+};
+MB_DECLARE_FLAGS(Win32FileHints, Win32FileHint)
+MB_DECLARE_OPERATORS_FOR_FLAGS(Win32FileHints)
+
 class Win32FilePrivate;
 class MB_EXPORT Win32File : public File
 {
@@ -47,6 +58,13 @@ public:
     bool open(const std::string &filename, FileOpenMode mode);
     bool open(const std::wstring &filename, FileOpenMode mode);
 
+    Win32FileHints hints();
+    bool set_hints(Win32FileHints hints);
+
+    bool read_ahead_active();
+
+    bool preallocate(uint64_t size, bool set_valid_data = false);
+
 protected:
     /*! \cond INTERNAL */
     Win32File(Win32FilePrivate *priv);
@@ -67,6 +85,10 @@ protected:
     virtual bool on_seek(int64_t offset, int whence,
                          uint64_t &new_offset) override;
     virtual bool on_truncate(uint64_t size) override;
+    virtual bool on_read_at(uint64_t offset, void *buf, size_t size,
+                            size_t &bytes_read) override;
+    virtual bool on_write_at(uint64_t offset, const void *buf, size_t size,
+                             size_t &bytes_written) override;
 };
 
 }
@@ -21,6 +21,8 @@
 
 #include "mbcommon/guard_p.h"
 
+#include <vector>
+
 #include <windows.h>
 
 #include "mbcommon/file/win32.h"
@@ -34,6 +36,10 @@ struct Win32FileFuncs
 {
     // windows.h
     virtual BOOL fn_CloseHandle(HANDLE hObject) = 0;
+    virtual HANDLE fn_CreateEventW(LPSECURITY_ATTRIBUTES lpEventAttributes,
+                                   BOOL bManualReset,
+                                   BOOL bInitialState,
+                                   LPCWSTR lpName) = 0;
     virtual HANDLE fn_CreateFileW(LPCWSTR lpFileName,
                                   DWORD dwDesiredAccess,
                                   DWORD dwShareMode,
@@ -41,6 +47,12 @@ struct Win32FileFuncs
                                   DWORD dwCreationDisposition,
                                   DWORD dwFlagsAndAttributes,
                                   HANDLE hTemplateFile) = 0;
+    virtual BOOL fn_GetFileSizeEx(HANDLE hFile,
+                                  PLARGE_INTEGER lpFileSize) = 0;
+    virtual BOOL fn_GetOverlappedResult(HANDLE hFile,
+                                        LPOVERLAPPED lpOverlapped,
+                                        LPDWORD lpNumberOfBytesTransferred,
+                                        BOOL bWait) = 0;
     virtual BOOL fn_ReadFile(HANDLE hFile,
                              LPVOID lpBuffer,
                              DWORD nNumberOfBytesToRead,
@@ -51,6 +63,8 @@ struct Win32FileFuncs
                                      LARGE_INTEGER liDistanceToMove,
                                      PLARGE_INTEGER lpNewFilePointer,
                                      DWORD dwMoveMethod) = 0;
+    virtual BOOL fn_SetFileValidData(HANDLE hFile,
+                                     LONGLONG ValidDataLength) = 0;
     virtual BOOL fn_WriteFile(HANDLE hFile,
                               LPCVOID lpBuffer,
                               DWORD nNumberOfBytesToWrite,
@@ -58,6 +72,26 @@ struct Win32FileFuncs
                               LPOVERLAPPED lpOverlapped) = 0;
 };
 
+struct Win32ReadAheadBuffer
+{
+    enum class State
+    {
+        // Not holding any data
+        Idle,
+        // Read has been issued, but not yet collected
+        Pending,
+        // Read has completed and [offset, offset + size) is valid
+        Ready,
+    };
+
+    std::vector<unsigned char> data;
+    OVERLAPPED overlapped;
+    HANDLE event;
+    State state;
+    uint64_t offset;
+    size_t size;
+};
+
 class Win32FilePrivate : public FilePrivate
 {
 public:
@@ -90,6 +124,17 @@ public:
 
     bool append;
 
+    // Not reset by clear() so that hints apply to every subsequent open
+    Win32FileHints hints;
+
+    // Read-ahead state. Only used if the handle was opened with
+    // FILE_FLAG_OVERLAPPED, in which case the OS does not maintain the file
+    // pointer on our behalf.
+    bool read_ahead;
+    uint64_t position;
+    Win32ReadAheadBuffer ra[2];
+    unsigned int ra_index;
+
     LPWSTR error;
 
 protected:
@@ -21,6 +21,8 @@
 
 #include "mbcommon/guard_p.h"
 
+#include <mutex>
+
 #include "mbcommon/file.h"
 #include "mbcommon/flags.h"
 
@@ -50,6 +52,9 @@ public:
     // Error
     std::error_code error_code;
     std::string error_string;
+
+    // Serializes the seek-based fallback for positional operations
+    std::mutex positional_lock;
 };
 
 }
@@ -34,12 +34,26 @@ enum class FileSearchAction
 typedef FileSearchAction (*FileSearchResultCallback)(File &file, void *userdata,
                                                      uint64_t offset);
 
+struct FileSearchPattern
+{
+    const void *data;
+    size_t size;
+};
+
+typedef FileSearchAction (*FileSearchMultiResultCallback)(File &file,
+                                                          void *userdata,
+                                                          size_t index,
+                                                          uint64_t offset);
+
 MB_EXPORT bool file_read_fully(File &file,
                                void *buf, size_t size,
                                size_t &bytes_read);
 MB_EXPORT bool file_write_fully(File &file,
                                 const void *buf, size_t size,
                                 size_t &bytes_written);
+MB_EXPORT bool file_writev_fully(File &file,
+                                 const FileConstIoVec *iov, size_t count,
+                                 size_t &bytes_written);
 
 MB_EXPORT bool file_read_discard(File &file, uint64_t size,
                                  uint64_t &bytes_discarded);
@@ -50,6 +64,13 @@ MB_EXPORT bool file_search(File &file, int64_t start, int64_t end,
                            FileSearchResultCallback result_cb,
                            void *userdata);
 
+MB_EXPORT bool file_search_multi(File &file, int64_t start, int64_t end,
+                                 size_t bsize,
+                                 const FileSearchPattern *patterns,
+                                 size_t patterns_count, int64_t max_matches,
+                                 FileSearchMultiResultCallback result_cb,
+                                 void *userdata);
+
 MB_EXPORT bool file_move(File &file, uint64_t src, uint64_t dest,
                          uint64_t size, uint64_t &size_moved);
 
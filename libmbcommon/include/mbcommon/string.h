@@ -54,6 +54,9 @@ MB_PRINTF(1, 2)
 MB_EXPORT std::string format(const char *fmt, ...);
 MB_EXPORT bool format_v(std::string &out, const char *fmt, va_list ap);
 MB_EXPORT std::string format_v(const char *fmt, va_list ap);
+MB_PRINTF(2, 3)
+MB_EXPORT bool append_format(std::string &out, const char *fmt, ...);
+MB_EXPORT bool append_format_v(std::string &out, const char *fmt, va_list ap);
 
 // String starts with
 MB_EXPORT bool starts_with_n(const char *string, size_t len_string,
@@ -96,4 +99,29 @@ MB_EXPORT int mem_replace(void **mem, size_t *mem_size,
 MB_EXPORT int str_replace(char **str, const char *from, const char *to,
                           size_t n, size_t *n_replaced);
 
+// Multi-pattern replace
+struct MemReplacement
+{
+    const void *from;
+    size_t from_size;
+    const void *to;
+    size_t to_size;
+};
+
+struct StrReplacement
+{
+    const char *from;
+    const char *to;
+};
+
+MB_EXPORT int mem_replace_multi(void **mem, size_t *mem_size,
+                                const MemReplacement *replacements,
+                                size_t count, size_t *n_replaced);
+MB_EXPORT int str_replace_multi(char **str,
+                                const StrReplacement *replacements,
+                                size_t count, size_t *n_replaced);
+MB_EXPORT bool str_replace_multi(std::string &str,
+                                 const StrReplacement *replacements,
+                                 size_t count, size_t *n_replaced);
+
 }
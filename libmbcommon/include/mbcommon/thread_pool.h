@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/common.h"
+
+#include <functional>
+#include <memory>
+
+#include <cstddef>
+
+namespace mb
+{
+
+enum class CoreHint
+{
+    // Run on any CPU the process is allowed to use
+    Any,
+    // Prefer the fastest cores (eg. compression, hashing)
+    Performance,
+    // Prefer the slowest cores (eg. I/O bound or background work)
+    Efficiency,
+};
+
+class ThreadPoolPrivate;
+class MB_EXPORT ThreadPool
+{
+    MB_DECLARE_PRIVATE(ThreadPool)
+
+public:
+    explicit ThreadPool(unsigned int max_workers = 0);
+    ~ThreadPool();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(ThreadPool)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(ThreadPool)
+
+    static ThreadPool & global();
+    static bool set_global_max_workers(unsigned int max_workers);
+
+    unsigned int max_workers() const;
+
+    void submit(std::function<void()> task, CoreHint hint = CoreHint::Any);
+    bool run_pending_task();
+
+private:
+    std::unique_ptr<ThreadPoolPrivate> _priv_ptr;
+};
+
+class TaskGroupPrivate;
+class MB_EXPORT TaskGroup
+{
+    MB_DECLARE_PRIVATE(TaskGroup)
+
+public:
+    explicit TaskGroup(ThreadPool &pool = ThreadPool::global());
+    ~TaskGroup();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(TaskGroup)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(TaskGroup)
+
+    void run(std::function<void()> task, CoreHint hint = CoreHint::Any);
+    void wait();
+
+    void cancel();
+    bool is_cancelled() const;
+
+private:
+    std::unique_ptr<TaskGroupPrivate> _priv_ptr;
+};
+
+MB_EXPORT void run_concurrently(unsigned int n,
+                                const std::function<void()> &fn,
+                                CoreHint hint = CoreHint::Any,
+                                ThreadPool &pool = ThreadPool::global());
+
+MB_EXPORT bool parallel_for(size_t count,
+                            const std::function<bool(size_t)> &fn,
+                            unsigned int max_parallelism = 0,
+                            CoreHint hint = CoreHint::Any,
+                            ThreadPool &pool = ThreadPool::global());
+
+}
@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbcommon/buffer_pool.h"
+
+#include <utility>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+// Smallest buffer handed out (2^12 = 4 KiB)
+#define MIN_SIZE_SHIFT          12
+// Largest buffer kept in the per-thread cache (2^23 = 8 MiB). Larger buffers
+// are returned to the allocator immediately.
+#define MAX_CACHED_SIZE_SHIFT   23
+#define SIZE_CLASSES            (MAX_CACHED_SIZE_SHIFT - MIN_SIZE_SHIFT + 1)
+// Number of free buffers kept per thread for each size class
+#define CACHED_PER_CLASS        2
+// Maximum total size of the free buffers kept per thread
+#define MAX_CACHED_BYTES        (8 * 1024 * 1024)
+
+/*!
+ * \file mbcommon/buffer_pool.h
+ * \brief Page-aligned I/O buffers with per-thread caching
+ */
+
+namespace mb
+{
+
+/*! \cond INTERNAL */
+
+static void * aligned_alloc_buf(size_t size)
+{
+#ifdef _WIN32
+    void *ptr = _aligned_malloc(size, IO_BUFFER_ALIGNMENT);
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+#else
+    void *ptr;
+    int ret = posix_memalign(&ptr, IO_BUFFER_ALIGNMENT, size);
+    if (ret != 0) {
+        errno = ret;
+        return nullptr;
+    }
+    return ptr;
+#endif
+}
+
+static void aligned_free_buf(void *ptr)
+{
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+/*!
+ * \brief Free buffers owned by the current thread
+ *
+ * Buffers that were released by the thread are handed back out to the same
+ * thread, which avoids both the allocator's locks and the page faults from
+ * touching fresh memory for every copy or hash.
+ */
+struct BufferCache
+{
+    void *bufs[SIZE_CLASSES][CACHED_PER_CLASS];
+    size_t count[SIZE_CLASSES];
+    size_t total;
+
+    BufferCache() : bufs(), count(), total(0)
+    {
+    }
+
+    ~BufferCache()
+    {
+        for (size_t i = 0; i < SIZE_CLASSES; ++i) {
+            for (size_t j = 0; j < count[i]; ++j) {
+                aligned_free_buf(bufs[i][j]);
+            }
+        }
+    }
+};
+
+static thread_local BufferCache t_cache;
+
+static bool size_class(size_t size, unsigned int &shift)
+{
+    shift = MIN_SIZE_SHIFT;
+    while ((static_cast<size_t>(1) << shift) < size) {
+        if (++shift >= sizeof(size_t) * 8) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*! \endcond */
+
+/*!
+ * \class IoBuffer
+ *
+ * \brief Owned, page-aligned buffer for file I/O
+ *
+ * Sizes are rounded up to a power of two (minimum 4 KiB) and the buffer is
+ * aligned to #IO_BUFFER_ALIGNMENT, so it can be used with `O_DIRECT`. Buffers
+ * up to 8 MiB are cached per thread when released, so code that allocates a
+ * buffer per call (eg. for each file copied or hashed) does not hit the
+ * allocator every time.
+ */
+
+/*!
+ * \brief Construct an empty buffer
+ */
+IoBuffer::IoBuffer() : _data(nullptr), _size(0)
+{
+}
+
+/*!
+ * \brief Construct and allocate a buffer
+ *
+ * Check whether the allocation succeeded with `operator bool()`.
+ *
+ * \param size Minimum size of the buffer
+ */
+IoBuffer::IoBuffer(size_t size) : IoBuffer()
+{
+    allocate(size);
+}
+
+IoBuffer::~IoBuffer()
+{
+    release();
+}
+
+IoBuffer::IoBuffer(IoBuffer &&other) : IoBuffer()
+{
+    std::swap(_data, other._data);
+    std::swap(_size, other._size);
+}
+
+IoBuffer & IoBuffer::operator=(IoBuffer &&rhs)
+{
+    if (this != &rhs) {
+        release();
+        std::swap(_data, rhs._data);
+        std::swap(_size, rhs._size);
+    }
+    return *this;
+}
+
+/*!
+ * \brief Allocate the buffer
+ *
+ * Any existing buffer is released first.
+ *
+ * \param size Minimum size of the buffer
+ *
+ * \return Whether the buffer was allocated. If false, errno is set
+ *         appropriately.
+ */
+bool IoBuffer::allocate(size_t size)
+{
+    release();
+
+    unsigned int shift;
+    if (!size_class(size, shift)) {
+        errno = ENOMEM;
+        return false;
+    }
+
+    size_t actual = static_cast<size_t>(1) << shift;
+
+    if (shift <= MAX_CACHED_SIZE_SHIFT) {
+        BufferCache &cache = t_cache;
+        size_t i = shift - MIN_SIZE_SHIFT;
+
+        if (cache.count[i] > 0) {
+            _data = cache.bufs[i][--cache.count[i]];
+            _size = actual;
+            cache.total -= actual;
+            return true;
+        }
+    }
+
+    _data = aligned_alloc_buf(actual);
+    if (!_data) {
+        return false;
+    }
+
+    _size = actual;
+    return true;
+}
+
+/*!
+ * \brief Release the buffer
+ *
+ * The buffer is returned to the current thread's cache if there is room.
+ * Otherwise, it is freed.
+ */
+void IoBuffer::release()
+{
+    if (!_data) {
+        return;
+    }
+
+    unsigned int shift;
+    size_class(_size, shift);
+
+    BufferCache &cache = t_cache;
+    size_t i = shift - MIN_SIZE_SHIFT;
+
+    if (shift <= MAX_CACHED_SIZE_SHIFT
+            && cache.count[i] < CACHED_PER_CLASS
+            && cache.total + _size <= MAX_CACHED_BYTES) {
+        cache.bufs[i][cache.count[i]++] = _data;
+        cache.total += _size;
+    } else {
+        aligned_free_buf(_data);
+    }
+
+    _data = nullptr;
+    _size = 0;
+}
+
+}
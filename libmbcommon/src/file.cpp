@@ -19,11 +19,15 @@
 
 #include "mbcommon/file.h"
 
+#include <algorithm>
+
 #include <cassert>
 #include <cerrno>
+#include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
 
+#include "mbcommon/buffer_pool.h"
 #include "mbcommon/file_p.h"
 #include "mbcommon/string.h"
 
@@ -320,6 +324,186 @@ bool File::truncate(uint64_t size)
     return on_truncate(size);
 }
 
+/*!
+ * \brief Borrow a read-only view of the file contents.
+ *
+ * Instead of copying data into a caller-provided buffer, this function returns
+ * a pointer to the file's underlying storage (eg. a memory mapping). The file
+ * position is *not* changed.
+ *
+ * The returned pointer remains valid until the next write, truncate, or close
+ * operation on the handle.
+ *
+ * \note Not all File implementations support this operation. If the error is
+ *       FileError::UnsupportedPeek, fall back to File::seek() and File::read().
+ *
+ * \param[in] offset File offset of the view
+ * \param[in] size Maximum size of the view
+ * \param[out] data Output pointer to data at \p offset
+ * \param[out] bytes_avail Output number of bytes available at \p data. This
+ *                         may be less than \p size if the end of file is
+ *                         reached. 0 indicates that \p offset is at or beyond
+ *                         the end of file.
+ *
+ * \return Whether the view was successfully obtained
+ */
+bool File::peek(uint64_t offset, size_t size, const void *&data,
+                size_t &bytes_avail)
+{
+    GET_PIMPL_OR_RETURN(false);
+    ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
+
+    return on_peek(offset, size, data, bytes_avail);
+}
+
+/*!
+ * \brief Read from a File handle into multiple buffers.
+ *
+ * The buffers in \p iov are filled in order as if File::read() were called for
+ * each one, but backends that support scatter-gather I/O (eg. FdFile) do so
+ * with a single system call. As with File::read(), fewer bytes than the total
+ * size of the buffers may be read.
+ *
+ * \param[in] iov Array of buffers
+ * \param[in] count Number of elements in \p iov
+ * \param[out] bytes_read Output number of bytes that were read. 0 indicates end
+ *                        of file if the buffers are not empty.
+ *
+ * \return Whether some bytes were read or EOF was reached
+ */
+bool File::readv(const FileIoVec *iov, size_t count, size_t &bytes_read)
+{
+    GET_PIMPL_OR_RETURN(false);
+    ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
+
+    return on_readv(iov, count, bytes_read);
+}
+
+/*!
+ * \brief Write to a File handle from multiple buffers.
+ *
+ * The buffers in \p iov are written in order as if File::write() were called
+ * for each one, but backends that support scatter-gather I/O (eg. FdFile) do
+ * so with a single system call. As with File::write(), fewer bytes than the
+ * total size of the buffers may be written. Use file_writev_fully() to write
+ * everything.
+ *
+ * \param[in] iov Array of buffers
+ * \param[in] count Number of elements in \p iov
+ * \param[out] bytes_written Output number of bytes that were written.
+ *
+ * \return Whether some bytes were successfully written
+ */
+bool File::writev(const FileConstIoVec *iov, size_t count,
+                  size_t &bytes_written)
+{
+    GET_PIMPL_OR_RETURN(false);
+    ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
+
+    return on_writev(iov, count, bytes_written);
+}
+
+/*!
+ * \brief Read from a File handle at the given offset.
+ *
+ * Unlike File::read(), this function does not use the file position, so
+ * multiple threads can read different parts of the same File handle at the
+ * same time. Backends that support positional I/O natively (eg. FdFile,
+ * MemoryFile, MmapFile, and Win32File) perform the read without any locking.
+ * Other backends fall back to seeking to \p offset, reading, and seeking back
+ * while holding a lock that is shared with File::write_at().
+ *
+ * \note The file position after this function returns is unspecified for some
+ *       backends. Do not mix positional and stream operations without seeking
+ *       to a known location first. The error state of the handle is shared, so
+ *       if concurrent operations fail, only one error is retained.
+ *
+ * \param[in] offset File offset to read from
+ * \param[out] buf Buffer to read into
+ * \param[in] size Buffer size
+ * \param[out] bytes_read Output number of bytes that were read. 0 indicates end
+ *                        of file.
+ *
+ * \return Whether some bytes were read or EOF was reached
+ */
+bool File::read_at(uint64_t offset, void *buf, size_t size,
+                   size_t &bytes_read)
+{
+    GET_PIMPL_OR_RETURN(false);
+    ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
+
+    return on_read_at(offset, buf, size, bytes_read);
+}
+
+/*!
+ * \brief Write to a File handle at the given offset.
+ *
+ * This is the writing counterpart of File::read_at(). The same notes regarding
+ * the file position and concurrency apply.
+ *
+ * \param[in] offset File offset to write to
+ * \param[in] buf Buffer to write from
+ * \param[in] size Buffer size
+ * \param[out] bytes_written Output number of bytes that were written.
+ *
+ * \return Whether some bytes were successfully written
+ */
+bool File::write_at(uint64_t offset, const void *buf, size_t size,
+                    size_t &bytes_written)
+{
+    GET_PIMPL_OR_RETURN(false);
+    ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
+
+    return on_write_at(offset, buf, size, bytes_written);
+}
+
+/*!
+ * \brief Move data within a File handle.
+ *
+ * This function is equivalent to `memmove()`, except it operates on a File
+ * handle. The source and destination regions can overlap. In the degenerate
+ * case where \p src == \p dest or \p size == 0, no operation will be performed,
+ * but the function will return true and set \p size_moved accordingly.
+ *
+ * Backends move the data as efficiently as they can (eg. `memmove()` for
+ * MemoryFile and `copy_file_range()` for FdFile). Otherwise, the data is copied
+ * in large chunks with File::read_at() and File::write_at(). The same notes
+ * regarding the file position apply.
+ *
+ * \note If \p size_moved is less than \p size, then the *first* \p size_moved
+ *       bytes have been copied from offset \p src to offset \p dest. This is
+ *       true even if \p src \< \p dest, resulting in a backwards copy.
+ *
+ * \param[in] src Source offset
+ * \param[in] dest Destination offset
+ * \param[in] size Size of data to move
+ * \param[out] size_moved Output size of data that was moved
+ *
+ * \return Whether data was successfully moved
+ */
+bool File::move(uint64_t src, uint64_t dest, uint64_t size,
+                uint64_t &size_moved)
+{
+    GET_PIMPL_OR_RETURN(false);
+    ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
+
+    // Check if we need to do anything
+    if (src == dest || size == 0) {
+        size_moved = size;
+        return true;
+    }
+
+    if (src > UINT64_MAX - size || dest > UINT64_MAX - size) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Offset + size overflows integer");
+        return false;
+    }
+
+    size_moved = 0;
+
+    return on_move(src, dest, size, size_moved);
+}
+
 /*!
  * \brief Check whether file is opened
  *
@@ -637,4 +821,383 @@ bool File::on_truncate(uint64_t size)
     return false;
 }
 
+/*!
+ * \brief File peek callback
+ *
+ * Subclasses should override this method if the file contents can be accessed
+ * directly from memory without copying.
+ *
+ * \note This callback must *not* change the file position.
+ *
+ * This method should return:
+ *
+ *   * True if a view of the file contents was successfully obtained
+ *   * False and set error to FileError::UnsupportedPeek if the file does not
+ *     support direct access
+ *   * False and set specific error for all other cases
+ *
+ * If this method is not overridden, it will simply return false and set the
+ * error to FileError::UnsupportedPeek.
+ *
+ * \param[in] offset File offset of the view
+ * \param[in] size Maximum size of the view
+ * \param[out] data Output pointer to data at \p offset
+ * \param[out] bytes_avail Output number of bytes available at \p data
+ *
+ * \return Always returns false and sets the error to
+ *         #FileError::UnsupportedPeek
+ */
+bool File::on_peek(uint64_t offset, size_t size, const void *&data,
+                   size_t &bytes_avail)
+{
+    (void) offset;
+    (void) size;
+    (void) data;
+    (void) bytes_avail;
+
+    set_error(make_error_code(FileError::UnsupportedPeek),
+              "%s: Peek callback not supported", __func__);
+    return false;
+}
+
+/*!
+ * \brief File vectored read callback
+ *
+ * Subclasses should override this method if the file supports reading into
+ * multiple buffers at once (eg. with `readv()`).
+ *
+ * This method should return the same values as on_read().
+ *
+ * If this method is not overridden, it will call on_read() for each buffer
+ * until a short read occurs. If an error occurs after some data has already
+ * been read, the error is discarded and the number of bytes read so far is
+ * returned. The next operation will then report the error.
+ *
+ * \param[in] iov Array of buffers
+ * \param[in] count Number of elements in \p iov
+ * \param[out] bytes_read Output number of bytes that were read. This parameter
+ *                        is guaranteed to be non-NULL.
+ *
+ * \return Whether some bytes were read or EOF was reached
+ */
+bool File::on_readv(const FileIoVec *iov, size_t count, size_t &bytes_read)
+{
+    size_t total = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        size_t n;
+
+        if (iov[i].size == 0) {
+            continue;
+        } else if (!on_read(iov[i].data, iov[i].size, n)) {
+            if (total > 0) {
+                break;
+            }
+            return false;
+        }
+
+        total += n;
+
+        if (n < iov[i].size) {
+            break;
+        }
+    }
+
+    bytes_read = total;
+    return true;
+}
+
+/*!
+ * \brief File vectored write callback
+ *
+ * Subclasses should override this method if the file supports writing from
+ * multiple buffers at once (eg. with `writev()`).
+ *
+ * This method should return the same values as on_write().
+ *
+ * If this method is not overridden, it will call on_write() for each buffer
+ * until a short write occurs. If an error occurs after some data has already
+ * been written, the error is discarded and the number of bytes written so far
+ * is returned. The next operation will then report the error.
+ *
+ * \param[in] iov Array of buffers
+ * \param[in] count Number of elements in \p iov
+ * \param[out] bytes_written Output number of bytes that were written. This
+ *                           parameter is guaranteed to be non-NULL.
+ *
+ * \return Whether some bytes were written
+ */
+bool File::on_writev(const FileConstIoVec *iov, size_t count,
+                     size_t &bytes_written)
+{
+    size_t total = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        size_t n;
+
+        if (iov[i].size == 0) {
+            continue;
+        } else if (!on_write(iov[i].data, iov[i].size, n)) {
+            if (total > 0) {
+                break;
+            }
+            return false;
+        }
+
+        total += n;
+
+        if (n < iov[i].size) {
+            break;
+        }
+    }
+
+    bytes_written = total;
+    return true;
+}
+
+/*! \cond INTERNAL */
+
+// Run a stream operation at offset and restore the previous file position
+// afterwards. If the position cannot be restored, the file is marked fatal.
+template<typename Op>
+static bool with_position(File &file, FilePrivate *priv, uint64_t offset,
+                          Op &&op,
+                          bool (File::*seek_fn)(int64_t, int, uint64_t &))
+{
+    std::lock_guard<std::mutex> lock(priv->positional_lock);
+
+    uint64_t orig_offset;
+    uint64_t new_offset;
+
+    if (offset > INT64_MAX) {
+        file.set_error(make_error_code(FileError::ArgumentOutOfRange),
+                       "Offset %" PRIu64 " is too large", offset);
+        return false;
+    }
+
+    if (!(file.*seek_fn)(0, SEEK_CUR, orig_offset)
+            || !(file.*seek_fn)(static_cast<int64_t>(offset), SEEK_SET,
+                                new_offset)) {
+        return false;
+    }
+
+    bool ret = op();
+
+    // Preserve the error from the operation if it failed
+    if (!(file.*seek_fn)(static_cast<int64_t>(orig_offset), SEEK_SET,
+                         new_offset)) {
+        file.set_fatal(true);
+        return false;
+    }
+
+    return ret;
+}
+
+/*! \endcond */
+
+/*!
+ * \brief File positional read callback
+ *
+ * Subclasses should override this method if the file can be read at an
+ * arbitrary offset without using the file position (eg. with `pread()`).
+ * Overrides must be safe to call from multiple threads at the same time.
+ *
+ * This method should return the same values as on_read().
+ *
+ * If this method is not overridden, it will seek to \p offset with on_seek(),
+ * call on_read(), and restore the original file position while holding a
+ * lock. If the original position could not be restored, the file is set to
+ * the fatal state.
+ *
+ * \param[in] offset File offset to read from
+ * \param[out] buf Buffer to read into
+ * \param[in] size Buffer size
+ * \param[out] bytes_read Output number of bytes that were read. 0 indicates end
+ *                        of file. This parameter is guaranteed to be non-NULL.
+ *
+ * \return Whether some bytes were read or EOF was reached
+ */
+bool File::on_read_at(uint64_t offset, void *buf, size_t size,
+                      size_t &bytes_read)
+{
+    MB_PRIVATE(File);
+
+    return with_position(*this, priv, offset, [&]() {
+        return on_read(buf, size, bytes_read);
+    }, &File::on_seek);
+}
+
+/*!
+ * \brief File positional write callback
+ *
+ * Subclasses should override this method if the file can be written at an
+ * arbitrary offset without using the file position (eg. with `pwrite()`).
+ * Overrides must be safe to call from multiple threads at the same time as
+ * long as the written regions do not overlap.
+ *
+ * This method should return the same values as on_write().
+ *
+ * If this method is not overridden, it will seek to \p offset with on_seek(),
+ * call on_write(), and restore the original file position while holding a
+ * lock. If the original position could not be restored, the file is set to
+ * the fatal state.
+ *
+ * \param[in] offset File offset to write to
+ * \param[in] buf Buffer to write from
+ * \param[in] size Buffer size
+ * \param[out] bytes_written Output number of bytes that were written. This
+ *                           parameter is guaranteed to be non-NULL.
+ *
+ * \return Whether some bytes were written
+ */
+bool File::on_write_at(uint64_t offset, const void *buf, size_t size,
+                       size_t &bytes_written)
+{
+    MB_PRIVATE(File);
+
+    return with_position(*this, priv, offset, [&]() {
+        return on_write(buf, size, bytes_written);
+    }, &File::on_seek);
+}
+
+/*! \cond INTERNAL */
+
+static bool read_at_fully(File &file, uint64_t offset, char *buf, size_t size,
+                          size_t &bytes_read)
+{
+    bytes_read = 0;
+
+    while (bytes_read < size) {
+        size_t n;
+
+        if (!file.read_at(offset + bytes_read, buf + bytes_read,
+                          size - bytes_read, n)) {
+            return false;
+        } else if (n == 0) {
+            break;
+        }
+
+        bytes_read += n;
+    }
+
+    return true;
+}
+
+static bool write_at_fully(File &file, uint64_t offset, const char *buf,
+                           size_t size, size_t &bytes_written)
+{
+    bytes_written = 0;
+
+    while (bytes_written < size) {
+        size_t n;
+
+        if (!file.write_at(offset + bytes_written, buf + bytes_written,
+                           size - bytes_written, n)) {
+            return false;
+        } else if (n == 0) {
+            break;
+        }
+
+        bytes_written += n;
+    }
+
+    return true;
+}
+
+/*! \endcond */
+
+/*!
+ * \brief File move callback
+ *
+ * Subclasses should override this method if data can be moved within the file
+ * more efficiently than by reading it into memory and writing it back out (eg.
+ * with `memmove()` or `copy_file_range()`).
+ *
+ * File::move() has already handled the degenerate cases and checked that
+ * neither \p src + \p size nor \p dest + \p size overflows. \p size_moved is
+ * initialized to 0.
+ *
+ * If this method is not overridden, the regions are copied in chunks of up to
+ * 1 MiB with File::read_at() and File::write_at(), starting from the end that
+ * avoids overwriting unread source data.
+ *
+ * \param[in] src Source offset
+ * \param[in] dest Destination offset
+ * \param[in] size Size of data to move
+ * \param[out] size_moved Output size of data that was moved. The *first*
+ *                        \p size_moved bytes must have been moved.
+ *
+ * \return Whether data was successfully moved
+ */
+bool File::on_move(uint64_t src, uint64_t dest, uint64_t size,
+                   uint64_t &size_moved)
+{
+    size_t buf_size = static_cast<size_t>(
+            std::min<uint64_t>(IO_BUFFER_DEFAULT_SIZE, size));
+    IoBuffer buf(buf_size);
+    size_t n_read;
+    size_t n_written;
+
+    if (!buf) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to allocate buffer");
+        return false;
+    }
+
+    char *data = buf.data<char>();
+
+    if (dest < src) {
+        // Copy forwards
+        while (size_moved < size) {
+            size_t to_read = static_cast<size_t>(std::min<uint64_t>(
+                    buf_size, size - size_moved));
+
+            if (!read_at_fully(*this, src + size_moved, data, to_read,
+                               n_read)) {
+                return false;
+            } else if (n_read == 0) {
+                break;
+            }
+
+            if (!write_at_fully(*this, dest + size_moved, data, n_read,
+                                n_written)) {
+                return false;
+            }
+
+            size_moved += n_written;
+
+            if (n_written < n_read) {
+                break;
+            }
+        }
+    } else {
+        // Copy backwards
+        while (size_moved < size) {
+            size_t to_read = static_cast<size_t>(std::min<uint64_t>(
+                    buf_size, size - size_moved));
+
+            if (!read_at_fully(*this, src + size - size_moved - to_read,
+                               data, to_read, n_read)) {
+                return false;
+            } else if (n_read == 0) {
+                break;
+            }
+
+            if (!write_at_fully(*this, dest + size - size_moved - n_read,
+                                data, n_read, n_written)) {
+                return false;
+            }
+
+            size_moved += n_written;
+
+            if (n_written < n_read) {
+                // Hit EOF. Subtract bytes beyond EOF that we can't copy
+                size -= n_read - n_written;
+            }
+        }
+    }
+
+    return true;
+}
+
 }
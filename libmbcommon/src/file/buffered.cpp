@@ -0,0 +1,463 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "mbcommon/file/buffered.h"
+
+#include <algorithm>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include "mbcommon/file_util.h"
+#include "mbcommon/string.h"
+
+#include "mbcommon/file/buffered_p.h"
+
+/*!
+ * \file mbcommon/file/buffered.h
+ * \brief Buffer reads and writes of another File handle
+ */
+
+namespace mb
+{
+
+/*! \cond INTERNAL */
+
+static constexpr size_t DEFAULT_BUFFER_SIZE = 64 * 1024;
+
+BufferedFilePrivate::BufferedFilePrivate()
+{
+    clear();
+}
+
+BufferedFilePrivate::~BufferedFilePrivate()
+{
+}
+
+void BufferedFilePrivate::clear()
+{
+    file = nullptr;
+    seekable = false;
+    buf_size = 0;
+    buf.clear();
+    buf.shrink_to_fit();
+    buf_offset = 0;
+    buf_len = 0;
+    dirty = false;
+    pos = 0;
+    file_pos = 0;
+}
+
+// Seek the underlying file to offset if it is not already there
+static bool sync_position(BufferedFile *bfile, BufferedFilePrivate *priv,
+                          uint64_t offset)
+{
+    if (priv->file_pos == offset) {
+        return true;
+    }
+
+    if (offset > INT64_MAX
+            || !priv->file->seek(static_cast<int64_t>(offset), SEEK_SET,
+                                 nullptr)) {
+        bfile->set_error(priv->file->error(), "Failed to seek file: %s",
+                         priv->file->error_string().c_str());
+        return false;
+    }
+
+    priv->file_pos = offset;
+    return true;
+}
+
+// Write out pending data. The buffer contents remain valid as read-ahead data.
+static bool flush_buffer(BufferedFile *bfile, BufferedFilePrivate *priv)
+{
+    if (!priv->dirty) {
+        return true;
+    }
+
+    size_t n;
+
+    if (!sync_position(bfile, priv, priv->buf_offset)) {
+        return false;
+    }
+
+    bool ret = file_write_fully(*priv->file, priv->buf.data(),
+                                priv->buf_len, n);
+    priv->file_pos += n;
+
+    if (!ret) {
+        bfile->set_error(priv->file->error(), "Failed to write file: %s",
+                         priv->file->error_string().c_str());
+        return false;
+    } else if (n != priv->buf_len) {
+        bfile->set_error(std::make_error_code(std::errc::io_error),
+                         "Wrote %" MB_PRIzu " of %" MB_PRIzu " bytes",
+                         n, priv->buf_len);
+        return false;
+    }
+
+    priv->dirty = false;
+    return true;
+}
+
+/*! \endcond */
+
+/*!
+ * \class BufferedFile
+ *
+ * \brief Buffer reads and writes of another File handle.
+ *
+ * Small reads are served from a read-ahead window and consecutive small writes
+ * are coalesced in memory before being passed on to the underlying File
+ * handle. Seeks only update the position of the BufferedFile handle; the
+ * underlying file is repositioned lazily when data actually needs to be read
+ * or written. Requests that are at least as large as the buffer bypass it.
+ *
+ * The underlying File handle is not owned by the BufferedFile handle and is
+ * not closed when the BufferedFile handle is closed. It must not be used
+ * directly while the BufferedFile handle is open since its position and
+ * contents may not reflect pending buffered operations. Call flush() to write
+ * out any pending data.
+ *
+ * This handle does not support File::peek() because the buffer only exposes a
+ * window of the file. file_search() and file_read_fully() work as expected.
+ */
+
+/*!
+ * \brief Construct unbound BufferedFile.
+ *
+ * The File handle will not be bound to any file. One of the open functions will
+ * need to be called to open a file.
+ */
+BufferedFile::BufferedFile()
+    : BufferedFile(new BufferedFilePrivate())
+{
+}
+
+/*!
+ * \brief Open File handle on top of another File handle.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(File *, size_t)
+ *
+ * \param file Underlying File handle
+ * \param buf_size Buffer size or 0 to use the default size (64 KiB)
+ */
+BufferedFile::BufferedFile(File *file, size_t buf_size)
+    : BufferedFile(new BufferedFilePrivate(), file, buf_size)
+{
+}
+
+/*! \cond INTERNAL */
+
+BufferedFile::BufferedFile(BufferedFilePrivate *priv)
+    : File(priv)
+{
+}
+
+BufferedFile::BufferedFile(BufferedFilePrivate *priv,
+                           File *file, size_t buf_size)
+    : File(priv)
+{
+    open(file, buf_size);
+}
+
+/*! \endcond */
+
+BufferedFile::~BufferedFile()
+{
+    close();
+}
+
+/*!
+ * \brief Open on top of another File handle.
+ *
+ * \p file must already be open. Buffering starts at its current position.
+ *
+ * \param file Underlying File handle
+ * \param buf_size Buffer size or 0 to use the default size (64 KiB)
+ *
+ * \return Whether the file is successfully opened
+ */
+bool BufferedFile::open(File *file, size_t buf_size)
+{
+    MB_PRIVATE(BufferedFile);
+    if (priv) {
+        priv->file = file;
+        priv->buf_size = buf_size;
+    }
+    return File::open();
+}
+
+/*!
+ * \brief Write pending data to the underlying File handle.
+ *
+ * \return
+ *   * True if all pending data was written
+ *   * False with error set to FileError::InvalidState if the file is not open
+ *   * False with the underlying file's error if writing fails
+ */
+bool BufferedFile::flush()
+{
+    MB_PRIVATE(BufferedFile);
+
+    if (!priv || !is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "File is not open");
+        return false;
+    }
+
+    return flush_buffer(this, priv);
+}
+
+bool BufferedFile::on_open()
+{
+    MB_PRIVATE(BufferedFile);
+
+    if (!priv->file || !priv->file->is_open()) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Underlying file is not open");
+        return false;
+    }
+
+    priv->buf.resize(priv->buf_size != 0
+            ? priv->buf_size : DEFAULT_BUFFER_SIZE);
+
+    // Files that cannot report their position are treated as non-seekable
+    // and seeks are passed through
+    uint64_t offset;
+    priv->seekable = priv->file->seek(0, SEEK_CUR, &offset);
+    priv->pos = priv->file_pos = priv->seekable ? offset : 0;
+
+    return true;
+}
+
+bool BufferedFile::on_close()
+{
+    MB_PRIVATE(BufferedFile);
+
+    bool ret = flush_buffer(this, priv);
+
+    // Reset to allow opening another file
+    priv->clear();
+
+    return ret;
+}
+
+bool BufferedFile::on_read(void *buf, size_t size, size_t &bytes_read)
+{
+    MB_PRIVATE(BufferedFile);
+
+    // Serve from the buffer if possible. This includes pending writes.
+    if (priv->pos >= priv->buf_offset
+            && priv->pos - priv->buf_offset < priv->buf_len) {
+        size_t skip = static_cast<size_t>(priv->pos - priv->buf_offset);
+        size_t n = std::min(priv->buf_len - skip, size);
+
+        memcpy(buf, priv->buf.data() + skip, n);
+        priv->pos += n;
+
+        bytes_read = n;
+        return true;
+    }
+
+    if (!flush_buffer(this, priv) || !sync_position(this, priv, priv->pos)) {
+        return false;
+    }
+
+    size_t n;
+
+    if (size >= priv->buf.size()) {
+        // Large reads go directly into the caller's buffer
+        if (!priv->file->read(buf, size, n)) {
+            set_error(priv->file->error(), "Failed to read file: %s",
+                      priv->file->error_string().c_str());
+            return false;
+        }
+
+        priv->file_pos += n;
+        priv->pos += n;
+
+        bytes_read = n;
+        return true;
+    }
+
+    // Refill buffer
+    priv->buf_len = 0;
+
+    if (!priv->file->read(priv->buf.data(), priv->buf.size(), n)) {
+        set_error(priv->file->error(), "Failed to read file: %s",
+                  priv->file->error_string().c_str());
+        return false;
+    }
+
+    priv->buf_offset = priv->pos;
+    priv->buf_len = n;
+    priv->file_pos += n;
+
+    n = std::min(n, size);
+    memcpy(buf, priv->buf.data(), n);
+    priv->pos += n;
+
+    bytes_read = n;
+    return true;
+}
+
+bool BufferedFile::on_write(const void *buf, size_t size,
+                            size_t &bytes_written)
+{
+    MB_PRIVATE(BufferedFile);
+
+    // Extend or overwrite pending data if the write touches it and fits
+    if (priv->dirty && priv->pos >= priv->buf_offset
+            && priv->pos - priv->buf_offset <= priv->buf_len
+            && size <= priv->buf.size()
+                    - static_cast<size_t>(priv->pos - priv->buf_offset)) {
+        size_t skip = static_cast<size_t>(priv->pos - priv->buf_offset);
+
+        memcpy(priv->buf.data() + skip, buf, size);
+        priv->buf_len = std::max(priv->buf_len, skip + size);
+        priv->pos += size;
+
+        bytes_written = size;
+        return true;
+    }
+
+    if (!flush_buffer(this, priv)) {
+        return false;
+    }
+
+    // Read-ahead data may be stale after the write
+    priv->buf_len = 0;
+
+    if (size >= priv->buf.size()) {
+        size_t n;
+
+        if (!sync_position(this, priv, priv->pos)) {
+            return false;
+        }
+
+        bool ret = file_write_fully(*priv->file, buf, size, n);
+        priv->file_pos += n;
+        priv->pos += n;
+
+        if (!ret) {
+            set_error(priv->file->error(), "Failed to write file: %s",
+                      priv->file->error_string().c_str());
+            return false;
+        }
+
+        bytes_written = n;
+        return true;
+    }
+
+    memcpy(priv->buf.data(), buf, size);
+    priv->buf_offset = priv->pos;
+    priv->buf_len = size;
+    priv->dirty = true;
+    priv->pos += size;
+
+    bytes_written = size;
+    return true;
+}
+
+bool BufferedFile::on_seek(int64_t offset, int whence, uint64_t &new_offset)
+{
+    MB_PRIVATE(BufferedFile);
+
+    if (!priv->seekable || whence == SEEK_END) {
+        // The underlying file is needed to compute the new position
+        if (!flush_buffer(this, priv)) {
+            return false;
+        }
+
+        uint64_t file_offset;
+
+        if (!priv->file->seek(offset, whence, &file_offset)) {
+            set_error(priv->file->error(), "Failed to seek file: %s",
+                      priv->file->error_string().c_str());
+            return false;
+        }
+
+        if (!priv->seekable) {
+            priv->buf_len = 0;
+        }
+
+        new_offset = priv->pos = priv->file_pos = file_offset;
+        return true;
+    }
+
+    switch (whence) {
+    case SEEK_SET:
+        if (offset < 0) {
+            set_error(make_error_code(FileError::InvalidArgument),
+                      "Invalid SEEK_SET offset %" PRId64, offset);
+            return false;
+        }
+        new_offset = priv->pos = offset;
+        break;
+    case SEEK_CUR:
+        if ((offset < 0 && static_cast<uint64_t>(-offset) > priv->pos)
+                || (offset > 0 && static_cast<uint64_t>(offset)
+                        > INT64_MAX - priv->pos)) {
+            set_error(make_error_code(FileError::InvalidArgument),
+                      "Invalid SEEK_CUR offset %" PRId64
+                      " for position %" PRIu64, offset, priv->pos);
+            return false;
+        }
+        new_offset = priv->pos += offset;
+        break;
+    default:
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Invalid whence argument: %d", whence);
+        return false;
+    }
+
+    return true;
+}
+
+bool BufferedFile::on_truncate(uint64_t size)
+{
+    MB_PRIVATE(BufferedFile);
+
+    if (!flush_buffer(this, priv)) {
+        return false;
+    }
+
+    if (!priv->file->truncate(size)) {
+        set_error(priv->file->error(), "Failed to truncate file: %s",
+                  priv->file->error_string().c_str());
+        return false;
+    }
+
+    // Drop read-ahead data past the new end of the file
+    if (priv->buf_offset >= size) {
+        priv->buf_len = 0;
+    } else if (priv->buf_len > size - priv->buf_offset) {
+        priv->buf_len = static_cast<size_t>(size - priv->buf_offset);
+    }
+
+    return true;
+}
+
+}
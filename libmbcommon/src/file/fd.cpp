@@ -19,15 +19,23 @@
 
 #include "mbcommon/file/fd.h"
 
+#include <algorithm>
+
 #include <cerrno>
 #include <climits>
 #include <cstdlib>
 #include <cstring>
 
+#include <vector>
+
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#  include <sys/syscall.h>
+#endif
+
 #include "mbcommon/locale.h"
 
 #include "mbcommon/file/fd_p.h"
@@ -87,11 +95,87 @@ struct RealFdFileFuncs : public FdFileFuncs
     {
         return write(fd, buf, count);
     }
+
+#ifndef _WIN32
+    virtual ssize_t fn_pread64(int fd, void *buf, size_t count,
+                               off64_t offset) override
+    {
+        return pread64(fd, buf, count, offset);
+    }
+
+    virtual ssize_t fn_pwrite64(int fd, const void *buf, size_t count,
+                                off64_t offset) override
+    {
+        return pwrite64(fd, buf, count, offset);
+    }
+
+    virtual ssize_t fn_readv(int fd, const struct iovec *iov,
+                             int iovcnt) override
+    {
+        return readv(fd, iov, iovcnt);
+    }
+
+    virtual ssize_t fn_writev(int fd, const struct iovec *iov,
+                              int iovcnt) override
+    {
+        return writev(fd, iov, iovcnt);
+    }
+
+    virtual ssize_t fn_copy_file_range(int fd_in, off64_t *off_in, int fd_out,
+                                       off64_t *off_out, size_t len,
+                                       unsigned int flags) override
+    {
+#ifdef __NR_copy_file_range
+        // Call directly since older versions of glibc and bionic do not have a
+        // wrapper
+        return syscall(__NR_copy_file_range, fd_in, off_in, fd_out, off_out,
+                       len, flags);
+#else
+        (void) fd_in;
+        (void) off_in;
+        (void) fd_out;
+        (void) off_out;
+        (void) len;
+        (void) flags;
+        errno = ENOSYS;
+        return -1;
+#endif
+    }
+#endif
 };
 /*! \endcond */
 
 static RealFdFileFuncs g_default_funcs;
 
+#ifndef _WIN32
+/*! \cond INTERNAL */
+
+// Convert buffers to iovecs, limiting the number of buffers to IOV_MAX and the
+// total size to SSIZE_MAX
+template<typename IoVec>
+static std::vector<struct iovec> to_iovecs(const IoVec *iov, size_t count)
+{
+    std::vector<struct iovec> result;
+    size_t remain = SSIZE_MAX;
+
+    result.reserve(std::min<size_t>(count, IOV_MAX));
+
+    for (size_t i = 0; i < count && result.size() < IOV_MAX && remain > 0;
+            ++i) {
+        struct iovec v;
+        v.iov_base = const_cast<void *>(static_cast<const void *>(
+                iov[i].data));
+        v.iov_len = std::min(iov[i].size, remain);
+        remain -= v.iov_len;
+        result.push_back(v);
+    }
+
+    return result;
+}
+
+/*! \endcond */
+#endif
+
 /*! \cond INTERNAL */
 
 FdFilePrivate::FdFilePrivate()
@@ -475,6 +559,170 @@ bool FdFile::on_seek(int64_t offset, int whence, uint64_t &new_offset)
     return true;
 }
 
+bool FdFile::on_readv(const FileIoVec *iov, size_t count, size_t &bytes_read)
+{
+#ifdef _WIN32
+    // The CRT does not provide readv()
+    return File::on_readv(iov, count, bytes_read);
+#else
+    MB_PRIVATE(FdFile);
+
+    auto iovecs = to_iovecs(iov, count);
+
+    ssize_t n = priv->funcs->fn_readv(priv->fd, iovecs.data(),
+                                      static_cast<int>(iovecs.size()));
+    if (n < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to read file");
+        return false;
+    }
+
+    bytes_read = n;
+    return true;
+#endif
+}
+
+bool FdFile::on_writev(const FileConstIoVec *iov, size_t count,
+                       size_t &bytes_written)
+{
+#ifdef _WIN32
+    // The CRT does not provide writev()
+    return File::on_writev(iov, count, bytes_written);
+#else
+    MB_PRIVATE(FdFile);
+
+    auto iovecs = to_iovecs(iov, count);
+
+    ssize_t n = priv->funcs->fn_writev(priv->fd, iovecs.data(),
+                                       static_cast<int>(iovecs.size()));
+    if (n < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to write file");
+        return false;
+    }
+
+    bytes_written = n;
+    return true;
+#endif
+}
+
+bool FdFile::on_read_at(uint64_t offset, void *buf, size_t size,
+                        size_t &bytes_read)
+{
+#ifdef _WIN32
+    // The CRT does not provide pread()
+    return File::on_read_at(offset, buf, size, bytes_read);
+#else
+    MB_PRIVATE(FdFile);
+
+    if (offset > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset is too large");
+        return false;
+    }
+
+    if (size > SSIZE_MAX) {
+        size = SSIZE_MAX;
+    }
+
+    ssize_t n = priv->funcs->fn_pread64(priv->fd, buf, size,
+                                        static_cast<off64_t>(offset));
+    if (n < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to read file");
+        return false;
+    }
+
+    bytes_read = n;
+    return true;
+#endif
+}
+
+bool FdFile::on_write_at(uint64_t offset, const void *buf, size_t size,
+                         size_t &bytes_written)
+{
+#ifdef _WIN32
+    // The CRT does not provide pwrite()
+    return File::on_write_at(offset, buf, size, bytes_written);
+#else
+    MB_PRIVATE(FdFile);
+
+    if (offset > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset is too large");
+        return false;
+    }
+
+    if (size > SSIZE_MAX) {
+        size = SSIZE_MAX;
+    }
+
+    ssize_t n = priv->funcs->fn_pwrite64(priv->fd, buf, size,
+                                         static_cast<off64_t>(offset));
+    if (n < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to write file");
+        return false;
+    }
+
+    bytes_written = n;
+    return true;
+#endif
+}
+
+bool FdFile::on_move(uint64_t src, uint64_t dest, uint64_t size,
+                     uint64_t &size_moved)
+{
+#ifdef _WIN32
+    return File::on_move(src, dest, size, size_moved);
+#else
+    MB_PRIVATE(FdFile);
+
+    // copy_file_range() does not allow the regions to overlap
+    if ((src < dest + size && dest < src + size)
+            || src + size > INT64_MAX || dest + size > INT64_MAX) {
+        return File::on_move(src, dest, size, size_moved);
+    }
+
+    // Let the kernel copy the data without bouncing it through userspace. This
+    // may reflink or copy server-side on filesystems that support it.
+    while (size_moved < size) {
+        off64_t off_in = static_cast<off64_t>(src + size_moved);
+        off64_t off_out = static_cast<off64_t>(dest + size_moved);
+        size_t to_copy = static_cast<size_t>(std::min<uint64_t>(
+                size - size_moved, SSIZE_MAX));
+
+        ssize_t n = priv->funcs->fn_copy_file_range(
+                priv->fd, &off_in, priv->fd, &off_out, to_copy, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == ENOSYS || errno == EXDEV || errno == EINVAL
+                    || errno == EOPNOTSUPP || errno == EBADF) {
+                // Not supported by the kernel or filesystem, so copy the rest
+                // manually
+                uint64_t n_rest = 0;
+                bool ret = File::on_move(src + size_moved, dest + size_moved,
+                                         size - size_moved, n_rest);
+                size_moved += n_rest;
+                return ret;
+            }
+
+            set_error(std::error_code(errno, std::generic_category()),
+                      "Failed to copy file range");
+            return false;
+        } else if (n == 0) {
+            // Reached EOF
+            break;
+        }
+
+        size_moved += static_cast<uint64_t>(n);
+    }
+
+    return true;
+#endif
+}
+
 bool FdFile::on_truncate(uint64_t size)
 {
     MB_PRIVATE(FdFile);
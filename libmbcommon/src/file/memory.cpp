@@ -27,6 +27,8 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <exception>
+
 #include "mbcommon/file/memory_p.h"
 #include "mbcommon/string.h"
 
@@ -53,18 +55,162 @@ void MemoryFilePrivate::clear()
 {
     data = nullptr;
     size = 0;
+    capacity = 0;
     data_ptr = nullptr;
     size_ptr = nullptr;
+    vector = nullptr;
     pos = 0;
     fixed_size = false;
 }
 
+// Smallest allocation made when a dynamic buffer needs to grow
+static constexpr size_t MIN_CAPACITY = 64;
+
+// Make sure that the buffer can hold at least min_capacity bytes. If exact is
+// false, the capacity is at least doubled so that a series of small writes
+// only triggers a logarithmic number of reallocations.
+static bool ensure_capacity(MemoryFile *file, MemoryFilePrivate *priv,
+                            size_t min_capacity, bool exact)
+{
+    if (min_capacity <= priv->capacity) {
+        return true;
+    }
+
+    size_t new_capacity = min_capacity;
+    if (!exact) {
+        size_t doubled = priv->capacity > SIZE_MAX / 2
+                ? SIZE_MAX : priv->capacity * 2;
+        new_capacity = std::max(new_capacity, std::max(doubled, MIN_CAPACITY));
+    }
+
+    if (priv->vector) {
+        try {
+            priv->vector->reserve(new_capacity);
+        } catch (const std::exception &) {
+            file->set_error(std::error_code(ENOMEM, std::generic_category()),
+                            "Failed to enlarge buffer");
+            return false;
+        }
+
+        priv->data = priv->vector->data();
+        priv->capacity = priv->vector->capacity();
+    } else {
+        void *new_data = realloc(priv->data, new_capacity);
+        if (!new_data) {
+            file->set_error(std::error_code(errno, std::generic_category()),
+                            "Failed to enlarge buffer");
+            return false;
+        }
+
+        priv->data = new_data;
+        priv->capacity = new_capacity;
+        if (priv->data_ptr) {
+            *priv->data_ptr = priv->data;
+        }
+    }
+
+    return true;
+}
+
+// Set the size of the file. The capacity must already be large enough. Any
+// new space is zero-initialized, but the allocation is never shrunk.
+static void set_size(MemoryFilePrivate *priv, size_t new_size)
+{
+    if (priv->vector) {
+        // Cannot throw since the capacity is large enough
+        priv->vector->resize(new_size);
+        priv->data = priv->vector->data();
+    } else if (new_size > priv->size) {
+        memset(static_cast<char *>(priv->data) + priv->size, 0,
+               new_size - priv->size);
+    }
+
+    priv->size = new_size;
+    if (priv->size_ptr) {
+        *priv->size_ptr = priv->size;
+    }
+}
+
+static void read_data(MemoryFilePrivate *priv, size_t offset,
+                      void *buf, size_t size, size_t &bytes_read)
+{
+    size_t to_read = 0;
+    if (offset < priv->size) {
+        to_read = std::min(priv->size - offset, size);
+    }
+
+    memcpy(buf, static_cast<char *>(priv->data) + offset, to_read);
+
+    bytes_read = to_read;
+}
+
+static bool write_data(MemoryFile *file, MemoryFilePrivate *priv,
+                       size_t offset, const void *buf, size_t size,
+                       size_t &bytes_written)
+{
+    if (offset > SIZE_MAX - size) {
+        file->set_error(make_error_code(FileError::InvalidArgument),
+                        "Write would overflow size_t");
+        return false;
+    }
+
+    size_t desired_size = offset + size;
+    size_t to_write = size;
+
+    if (desired_size > priv->size) {
+        if (priv->fixed_size) {
+            to_write = offset <= priv->size ? priv->size - offset : 0;
+        } else {
+            // Enlarge buffer
+            if (!ensure_capacity(file, priv, desired_size, false)) {
+                return false;
+            }
+
+            // Only the gap between the old end and the write position needs
+            // to be zero-initialized since the rest is overwritten below
+            if (offset > priv->size) {
+                set_size(priv, offset);
+            }
+
+            if (priv->vector) {
+                size_t overlap = priv->size - offset;
+                memcpy(static_cast<char *>(priv->data) + offset,
+                       buf, overlap);
+                // Cannot throw since the capacity is large enough
+                priv->vector->insert(
+                        priv->vector->end(),
+                        static_cast<const unsigned char *>(buf) + overlap,
+                        static_cast<const unsigned char *>(buf) + size);
+                priv->data = priv->vector->data();
+                priv->size = desired_size;
+
+                bytes_written = size;
+                return true;
+            }
+
+            priv->size = desired_size;
+            if (priv->size_ptr) {
+                *priv->size_ptr = priv->size;
+            }
+        }
+    }
+
+    memcpy(static_cast<char *>(priv->data) + offset, buf, to_write);
+
+    bytes_written = to_write;
+    return true;
+}
+
 /*! \endcond */
 
 /*!
  * \class MemoryFile
  *
  * \brief Open file from statically or dynamically sized memory buffers.
+ *
+ * File::read_at() and File::write_at() copy directly to and from the buffer.
+ * Concurrent positional writes that enlarge a dynamically sized buffer must be
+ * serialized by the caller since the buffer may be reallocated.
  */
 
 /*!
@@ -110,6 +256,21 @@ MemoryFile::MemoryFile(void **buf_ptr, size_t *size_ptr)
 {
 }
 
+/*!
+ * \brief Open File handle from a vector.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(std::vector<unsigned char> *)
+ *
+ * \param[in,out] buf Pointer to vector
+ */
+MemoryFile::MemoryFile(std::vector<unsigned char> *buf)
+    : MemoryFile(new MemoryFilePrivate(), buf)
+{
+}
+
 /*! \cond INTERNAL */
 
 MemoryFile::MemoryFile(MemoryFilePrivate *priv)
@@ -131,6 +292,13 @@ MemoryFile::MemoryFile(MemoryFilePrivate *priv,
     open(buf_ptr, size_ptr);
 }
 
+MemoryFile::MemoryFile(MemoryFilePrivate *priv,
+                       std::vector<unsigned char> *buf)
+    : File(priv)
+{
+    open(buf);
+}
+
 /*! \endcond */
 
 MemoryFile::~MemoryFile()
@@ -152,8 +320,10 @@ bool MemoryFile::open(const void *buf, size_t size)
     if (priv) {
         priv->data = const_cast<void *>(buf);
         priv->size = size;
+        priv->capacity = size;
         priv->data_ptr = nullptr;
         priv->size_ptr = nullptr;
+        priv->vector = nullptr;
         priv->pos = 0;
         priv->fixed_size = true;
     }
@@ -163,6 +333,11 @@ bool MemoryFile::open(const void *buf, size_t size)
 /*!
  * \brief Open from dynamically sized memory buffer.
  *
+ * The buffer must have been allocated with `malloc()` and will be enlarged
+ * with `realloc()` as needed. To keep writes cheap, the allocation grows
+ * geometrically and is not shrunk when the file is truncated, so it may be
+ * larger than `*size_ptr`.
+ *
  * \param[in,out] buf_ptr Pointer to data buffer
  * \param[in,out] size_ptr Pointer to size of data buffer
  *
@@ -174,14 +349,78 @@ bool MemoryFile::open(void **buf_ptr, size_t *size_ptr)
     if (priv) {
         priv->data = *buf_ptr;
         priv->size = *size_ptr;
+        priv->capacity = *size_ptr;
         priv->data_ptr = buf_ptr;
         priv->size_ptr = size_ptr;
+        priv->vector = nullptr;
+        priv->pos = 0;
+        priv->fixed_size = false;
+    }
+    return File::open();
+}
+
+/*!
+ * \brief Open from a vector.
+ *
+ * Writes and truncations resize the vector in place, so the data is never
+ * copied out of it when the file is closed. The vector must outlive the file
+ * and must not be modified while the file is open.
+ *
+ * \param[in,out] buf Pointer to vector
+ *
+ * \return Whether the file is successfully opened
+ */
+bool MemoryFile::open(std::vector<unsigned char> *buf)
+{
+    MB_PRIVATE(MemoryFile);
+    if (priv) {
+        priv->data = buf->data();
+        priv->size = buf->size();
+        priv->capacity = buf->capacity();
+        priv->data_ptr = nullptr;
+        priv->size_ptr = nullptr;
+        priv->vector = buf;
         priv->pos = 0;
         priv->fixed_size = false;
     }
     return File::open();
 }
 
+/*!
+ * \brief Preallocate space in a dynamically sized buffer.
+ *
+ * Make sure that the file can grow to \p capacity bytes without reallocating
+ * the buffer. The size of the file is not changed. This is useful when the
+ * final size of the data is known or can be estimated before writing.
+ *
+ * \param capacity Number of bytes to allocate
+ *
+ * \return
+ *   * True if the space was allocated
+ *   * False with error set to FileError::InvalidState if the file is not open
+ *   * False with error set to FileError::UnsupportedWrite if the file is
+ *     backed by a fixed size buffer
+ *   * False with an error set if the allocation fails
+ */
+bool MemoryFile::reserve(size_t capacity)
+{
+    MB_PRIVATE(MemoryFile);
+
+    if (!priv || !is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "File is not open");
+        return false;
+    }
+
+    if (priv->fixed_size) {
+        set_error(make_error_code(FileError::UnsupportedWrite),
+                  "Cannot enlarge fixed buffer");
+        return false;
+    }
+
+    return ensure_capacity(this, priv, capacity, true);
+}
+
 bool MemoryFile::on_close()
 {
     MB_PRIVATE(MemoryFile);
@@ -196,62 +435,90 @@ bool MemoryFile::on_read(void *buf, size_t size, size_t &bytes_read)
 {
     MB_PRIVATE(MemoryFile);
 
-    size_t to_read = 0;
-    if (priv->pos < priv->size) {
-        to_read = std::min(priv->size - priv->pos, size);
+    read_data(priv, priv->pos, buf, size, bytes_read);
+    priv->pos += bytes_read;
+
+    return true;
+}
+
+bool MemoryFile::on_write(const void *buf, size_t size, size_t &bytes_written)
+{
+    MB_PRIVATE(MemoryFile);
+
+    if (!write_data(this, priv, priv->pos, buf, size, bytes_written)) {
+        return false;
     }
 
-    memcpy(buf, static_cast<char *>(priv->data) + priv->pos, to_read);
-    priv->pos += to_read;
+    priv->pos += bytes_written;
+    return true;
+}
 
-    bytes_read = to_read;
+bool MemoryFile::on_read_at(uint64_t offset, void *buf, size_t size,
+                            size_t &bytes_read)
+{
+    MB_PRIVATE(MemoryFile);
+
+    if (offset >= priv->size) {
+        bytes_read = 0;
+        return true;
+    }
+
+    read_data(priv, static_cast<size_t>(offset), buf, size, bytes_read);
     return true;
 }
 
-bool MemoryFile::on_write(const void *buf, size_t size, size_t &bytes_written)
+bool MemoryFile::on_write_at(uint64_t offset, const void *buf, size_t size,
+                             size_t &bytes_written)
 {
     MB_PRIVATE(MemoryFile);
 
-    if (priv->pos > SIZE_MAX - size) {
+    if (offset > SIZE_MAX) {
         set_error(make_error_code(FileError::InvalidArgument),
                   "Write would overflow size_t");
         return false;
     }
 
-    size_t desired_size = priv->pos + size;
-    size_t to_write = size;
+    return write_data(this, priv, static_cast<size_t>(offset), buf, size,
+                      bytes_written);
+}
+
+bool MemoryFile::on_move(uint64_t src, uint64_t dest, uint64_t size,
+                         uint64_t &size_moved)
+{
+    MB_PRIVATE(MemoryFile);
+
+    if (src >= priv->size) {
+        return true;
+    }
+
+    size_t to_move = static_cast<size_t>(std::min<uint64_t>(
+            size, priv->size - src));
+
+    if (dest > SIZE_MAX - to_move) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Move would overflow size_t");
+        return false;
+    }
+
+    size_t desired_size = static_cast<size_t>(dest) + to_move;
 
     if (desired_size > priv->size) {
         if (priv->fixed_size) {
-            to_write = priv->pos <= priv->size ? priv->size - priv->pos : 0;
+            to_move = dest < priv->size
+                    ? static_cast<size_t>(priv->size - dest) : 0;
         } else {
-            // Enlarge buffer
-            void *new_data = realloc(priv->data, desired_size);
-            if (!new_data) {
-                set_error(std::error_code(errno, std::generic_category()),
-                          "Failed to enlarge buffer");
+            if (!ensure_capacity(this, priv, desired_size, false)) {
                 return false;
             }
 
-            // Zero-initialize new space
-            memset(static_cast<char *>(new_data) + priv->size, 0,
-                   desired_size - priv->size);
-
-            priv->data = new_data;
-            priv->size = desired_size;
-            if (priv->data_ptr) {
-                *priv->data_ptr = priv->data;
-            }
-            if (priv->size_ptr) {
-                *priv->size_ptr = priv->size;
-            }
+            set_size(priv, desired_size);
         }
     }
 
-    memcpy(static_cast<char *>(priv->data) + priv->pos, buf, to_write);
-    priv->pos += to_write;
+    memmove(static_cast<char *>(priv->data) + dest,
+            static_cast<char *>(priv->data) + src, to_move);
 
-    bytes_written = to_write;
+    size_moved = to_move;
     return true;
 }
 
@@ -307,30 +574,34 @@ bool MemoryFile::on_truncate(uint64_t size)
         set_error(make_error_code(FileError::UnsupportedTruncate),
                   "Cannot truncate fixed buffer");
         return false;
+    } else if (size > SIZE_MAX) {
+        set_error(make_error_code(FileError::IntegerOverflow),
+                  "Size %" PRIu64 " is too large for buffer", size);
+        return false;
     } else {
-        void *new_data = realloc(priv->data, size);
-        if (!new_data) {
-            set_error(std::error_code(errno, std::generic_category()),
-                      "Failed to resize buffer");
+        // Shrinking keeps the allocation so that growing again is cheap
+        if (!ensure_capacity(this, priv, static_cast<size_t>(size), true)) {
             return false;
         }
 
-        // Zero-initialize new space
-        if (size > priv->size) {
-            memset(static_cast<char *>(new_data) + priv->size, 0,
-                   size - priv->size);
-        }
+        set_size(priv, static_cast<size_t>(size));
+    }
 
-        priv->data = new_data;
-        priv->size = size;
-        if (priv->data_ptr) {
-            *priv->data_ptr = priv->data;
-        }
-        if (priv->size_ptr) {
-            *priv->size_ptr = priv->size;
-        }
+    return true;
+}
+
+bool MemoryFile::on_peek(uint64_t offset, size_t size, const void *&data,
+                         size_t &bytes_avail)
+{
+    MB_PRIVATE(MemoryFile);
+
+    size_t avail = 0;
+    if (offset < priv->size) {
+        avail = std::min<size_t>(priv->size - offset, size);
     }
 
+    data = static_cast<char *>(priv->data) + (avail > 0 ? offset : 0);
+    bytes_avail = avail;
     return true;
 }
 
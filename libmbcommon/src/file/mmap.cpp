@@ -0,0 +1,461 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbcommon/file/mmap.h"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mbcommon/locale.h"
+#include "mbcommon/string.h"
+
+#include "mbcommon/file/mmap_p.h"
+
+/*!
+ * \file mbcommon/file/mmap.h
+ * \brief Open file as a read-only memory mapping
+ */
+
+namespace mb
+{
+
+/*! \cond INTERNAL */
+struct RealMmapFileFuncs : public MmapFileFuncs
+{
+    virtual int fn_open(const char *path, int flags, mode_t mode) override
+    {
+        return open(path, flags, mode);
+    }
+
+    virtual void * fn_mmap(void *addr, size_t length, int prot, int flags,
+                           int fd, off_t offset) override
+    {
+        return mmap(addr, length, prot, flags, fd, offset);
+    }
+
+    virtual int fn_munmap(void *addr, size_t length) override
+    {
+        return munmap(addr, length);
+    }
+
+    virtual int fn_fstat(int fildes, struct stat *buf) override
+    {
+        return fstat(fildes, buf);
+    }
+
+    virtual int fn_close(int fd) override
+    {
+        return close(fd);
+    }
+};
+/*! \endcond */
+
+static RealMmapFileFuncs g_default_funcs;
+
+/*! \cond INTERNAL */
+
+MmapFilePrivate::MmapFilePrivate()
+    : MmapFilePrivate(&g_default_funcs)
+{
+}
+
+MmapFilePrivate::MmapFilePrivate(MmapFileFuncs *funcs)
+    : funcs(funcs)
+{
+    clear();
+}
+
+MmapFilePrivate::~MmapFilePrivate()
+{
+}
+
+void MmapFilePrivate::clear()
+{
+    fd = -1;
+    owned = false;
+    filename.clear();
+    map = nullptr;
+    size = 0;
+    pos = 0;
+}
+
+/*! \endcond */
+
+/*!
+ * \class MmapFile
+ *
+ * \brief Open file as a read-only memory mapping.
+ *
+ * The entire file is mapped into memory when the handle is opened. Reads are
+ * served from the mapping and File::peek() returns pointers directly into the
+ * mapped pages, which allows callers to scan the file without copying it into
+ * intermediate buffers.
+ *
+ * Only regular files can be opened. Writing and truncation are not supported.
+ */
+
+/*!
+ * \brief Construct unbound MmapFile.
+ *
+ * The File handle will not be bound to any file. One of the open functions will
+ * need to be called to open a file.
+ */
+MmapFile::MmapFile()
+    : MmapFile(new MmapFilePrivate())
+{
+}
+
+/*!
+ * \brief Open File handle from file descriptor.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(int, bool)
+ *
+ * \param fd File descriptor
+ * \param owned Whether the file descriptor should be owned by the File handle
+ */
+MmapFile::MmapFile(int fd, bool owned)
+    : MmapFile(new MmapFilePrivate(), fd, owned)
+{
+}
+
+/*!
+ * \brief Open File handle from a multi-byte filename.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(const std::string &)
+ *
+ * \param filename MBS filename
+ */
+MmapFile::MmapFile(const std::string &filename)
+    : MmapFile(new MmapFilePrivate(), filename)
+{
+}
+
+/*!
+ * \brief Open File handle from a wide-character filename.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(const std::wstring &)
+ *
+ * \param filename WCS filename
+ */
+MmapFile::MmapFile(const std::wstring &filename)
+    : MmapFile(new MmapFilePrivate(), filename)
+{
+}
+
+/*! \cond INTERNAL */
+
+MmapFile::MmapFile(MmapFilePrivate *priv)
+    : File(priv)
+{
+}
+
+MmapFile::MmapFile(MmapFilePrivate *priv,
+                   int fd, bool owned)
+    : File(priv)
+{
+    open(fd, owned);
+}
+
+MmapFile::MmapFile(MmapFilePrivate *priv,
+                   const std::string &filename)
+    : File(priv)
+{
+    open(filename);
+}
+
+MmapFile::MmapFile(MmapFilePrivate *priv,
+                   const std::wstring &filename)
+    : File(priv)
+{
+    open(filename);
+}
+
+/*! \endcond */
+
+MmapFile::~MmapFile()
+{
+    close();
+}
+
+/*!
+ * \brief Open from file descriptor.
+ *
+ * If \p owned is true, then the File handle will take ownership of the file
+ * descriptor. In other words, the file descriptor will be closed when the
+ * File handle is closed. The file descriptor must be readable.
+ *
+ * \param fd File descriptor
+ * \param owned Whether the file descriptor should be owned by the File handle
+ *
+ * \return Whether the file is successfully opened
+ */
+bool MmapFile::open(int fd, bool owned)
+{
+    MB_PRIVATE(MmapFile);
+    if (priv) {
+        priv->fd = fd;
+        priv->owned = owned;
+    }
+    return File::open();
+}
+
+/*!
+ * \brief Open from a multi-byte filename.
+ *
+ * \p filename is directly passed to `open()`.
+ *
+ * \param filename MBS filename
+ *
+ * \return Whether the file is successfully opened
+ */
+bool MmapFile::open(const std::string &filename)
+{
+    MB_PRIVATE(MmapFile);
+    if (priv) {
+        priv->fd = -1;
+        priv->owned = true;
+        priv->filename = filename;
+    }
+    return File::open();
+}
+
+/*!
+ * \brief Open from a wide-character filename.
+ *
+ * \p filename is converted to MBS using wcs_to_mbs() before being passed to
+ * `open()`.
+ *
+ * \param filename WCS filename
+ *
+ * \return Whether the file is successfully opened
+ */
+bool MmapFile::open(const std::wstring &filename)
+{
+    MB_PRIVATE(MmapFile);
+    if (priv) {
+        std::string native_filename;
+        if (!wcs_to_mbs(native_filename, filename)) {
+            set_error(make_error_code(FileError::CannotConvertEncoding),
+                      "Failed to convert WCS filename to MBS");
+            return false;
+        }
+
+        priv->fd = -1;
+        priv->owned = true;
+        priv->filename = std::move(native_filename);
+    }
+    return File::open();
+}
+
+bool MmapFile::on_open()
+{
+    MB_PRIVATE(MmapFile);
+
+    if (!priv->filename.empty()) {
+        priv->fd = priv->funcs->fn_open(
+                priv->filename.c_str(), O_RDONLY | O_CLOEXEC, 0);
+        if (priv->fd < 0) {
+            set_error(std::error_code(errno, std::generic_category()),
+                      "Failed to open file");
+            return false;
+        }
+    }
+
+    struct stat sb;
+
+    if (priv->funcs->fn_fstat(priv->fd, &sb) < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to stat file");
+        return false;
+    }
+
+    if (S_ISDIR(sb.st_mode)) {
+        set_error(std::make_error_code(std::errc::is_a_directory),
+                  "Failed to open file");
+        return false;
+    } else if (!S_ISREG(sb.st_mode)) {
+        set_error(std::make_error_code(std::errc::invalid_argument),
+                  "Only regular files can be mapped");
+        return false;
+    }
+
+    if (static_cast<uint64_t>(sb.st_size) > SIZE_MAX) {
+        set_error(make_error_code(FileError::IntegerOverflow),
+                  "File size %" PRIu64 " exceeds address space",
+                  static_cast<uint64_t>(sb.st_size));
+        return false;
+    }
+
+    priv->size = static_cast<size_t>(sb.st_size);
+    priv->pos = 0;
+
+    // Zero-length mappings are not allowed
+    if (priv->size > 0) {
+        void *map = priv->funcs->fn_mmap(nullptr, priv->size, PROT_READ,
+                                         MAP_PRIVATE, priv->fd, 0);
+        if (map == MAP_FAILED) {
+            set_error(std::error_code(errno, std::generic_category()),
+                      "Failed to map file");
+            return false;
+        }
+
+        priv->map = map;
+    }
+
+    return true;
+}
+
+bool MmapFile::on_close()
+{
+    MB_PRIVATE(MmapFile);
+
+    bool ret = true;
+
+    if (priv->map && priv->funcs->fn_munmap(priv->map, priv->size) < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to unmap file");
+        ret = false;
+    }
+
+    if (priv->owned && priv->fd >= 0 && priv->funcs->fn_close(priv->fd) < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to close file");
+        ret = false;
+    }
+
+    // Reset to allow opening another file
+    priv->clear();
+
+    return ret;
+}
+
+bool MmapFile::on_read(void *buf, size_t size, size_t &bytes_read)
+{
+    MB_PRIVATE(MmapFile);
+
+    size_t to_read = 0;
+    if (priv->pos < priv->size) {
+        to_read = std::min(priv->size - priv->pos, size);
+    }
+
+    if (to_read > 0) {
+        memcpy(buf, static_cast<char *>(priv->map) + priv->pos, to_read);
+    }
+    priv->pos += to_read;
+
+    bytes_read = to_read;
+    return true;
+}
+
+bool MmapFile::on_read_at(uint64_t offset, void *buf, size_t size,
+                          size_t &bytes_read)
+{
+    MB_PRIVATE(MmapFile);
+
+    size_t to_read = 0;
+    if (offset < priv->size) {
+        to_read = std::min(priv->size - static_cast<size_t>(offset), size);
+    }
+
+    if (to_read > 0) {
+        memcpy(buf, static_cast<char *>(priv->map) + offset, to_read);
+    }
+
+    bytes_read = to_read;
+    return true;
+}
+
+bool MmapFile::on_seek(int64_t offset, int whence, uint64_t &new_offset)
+{
+    MB_PRIVATE(MmapFile);
+
+    switch (whence) {
+    case SEEK_SET:
+        if (offset < 0 || static_cast<uint64_t>(offset) > SIZE_MAX) {
+            set_error(make_error_code(FileError::InvalidArgument),
+                      "Invalid SEEK_SET offset %" PRId64, offset);
+            return false;
+        }
+        new_offset = priv->pos = offset;
+        break;
+    case SEEK_CUR:
+        if ((offset < 0 && static_cast<uint64_t>(-offset) > priv->pos)
+                || (offset > 0 && static_cast<uint64_t>(offset)
+                        > SIZE_MAX - priv->pos)) {
+            set_error(make_error_code(FileError::InvalidArgument),
+                      "Invalid SEEK_CUR offset %" PRId64
+                      " for position %" MB_PRIzu, offset, priv->pos);
+            return false;
+        }
+        new_offset = priv->pos += offset;
+        break;
+    case SEEK_END:
+        if ((offset < 0 && static_cast<size_t>(-offset) > priv->size)
+                || (offset > 0 && static_cast<uint64_t>(offset)
+                        > SIZE_MAX - priv->size)) {
+            set_error(make_error_code(FileError::InvalidArgument),
+                      "Invalid SEEK_END offset %" PRId64
+                      " for file of size %" MB_PRIzu, offset, priv->size);
+            return false;
+        }
+        new_offset = priv->pos = priv->size + offset;
+        break;
+    default:
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Invalid whence argument: %d", whence);
+        return false;
+    }
+
+    return true;
+}
+
+bool MmapFile::on_peek(uint64_t offset, size_t size, const void *&data,
+                       size_t &bytes_avail)
+{
+    MB_PRIVATE(MmapFile);
+
+    size_t avail = 0;
+    if (offset < priv->size) {
+        avail = std::min<size_t>(priv->size - offset, size);
+    }
+
+    data = static_cast<char *>(priv->map) + (avail > 0 ? offset : 0);
+    bytes_avail = avail;
+    return true;
+}
+
+}
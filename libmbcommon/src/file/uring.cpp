@@ -0,0 +1,951 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "mbcommon/file/uring.h"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "mbcommon/file/uring_p.h"
+
+/*!
+ * \file mbcommon/file/uring.h
+ * \brief Open file with POSIX file descriptors and perform I/O with io_uring
+ */
+
+// The io_uring syscall numbers are the same on all architectures that use the
+// unified syscall table
+#ifndef __NR_io_uring_setup
+#  define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#  define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#  define __NR_io_uring_register 427
+#endif
+
+// Largest transfer the kernel will perform in a single read or write
+#define MAX_RW_COUNT (INT_MAX & ~4095u)
+
+namespace mb
+{
+
+/*! \cond INTERNAL */
+
+static constexpr unsigned DEFAULT_QUEUE_DEPTH = 64;
+
+// user_data of synchronous operations. Asynchronous operations start at 1.
+static constexpr uint64_t SYNC_USER_DATA = 0;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+                              unsigned min_complete, unsigned flags)
+{
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit,
+                                    min_complete, flags, nullptr, 0));
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg,
+                                 unsigned nr_args)
+{
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg,
+                                    nr_args));
+}
+
+UringFilePrivate::UringFilePrivate()
+    : have_ring(false)
+    , unsubmitted(0)
+    , submitted(0)
+    , next_id(SYNC_USER_DATA + 1)
+    , sync_done(false)
+    , sync_result(0)
+    , buffers(nullptr)
+    , buffers_count(0)
+    , buffers_size(0)
+    , buffers_registered(false)
+{
+}
+
+UringFilePrivate::~UringFilePrivate()
+{
+    destroy_ring();
+    free_buffers();
+}
+
+bool UringFilePrivate::setup_ring(unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    int ring_fd = sys_io_uring_setup(entries, &p);
+    if (ring_fd < 0) {
+        return false;
+    }
+
+    ring.fd = ring_fd;
+
+    // IORING_OP_READ/IORING_OP_WRITE and reading at the current file position
+    // require Linux 5.6
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        destroy_ring();
+        return false;
+    }
+
+    ring.sq_ptr_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_ptr_size = p.cq_off.cqes
+            + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        ring.sq_ptr_size = std::max(ring.sq_ptr_size, ring.cq_ptr_size);
+    }
+
+    void *sq_ptr = mmap(nullptr, ring.sq_ptr_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        destroy_ring();
+        return false;
+    }
+    ring.sq_ptr = sq_ptr;
+
+    if (single_mmap) {
+        ring.cq_ptr = ring.sq_ptr;
+        ring.cq_ptr_size = 0;
+    } else {
+        void *cq_ptr = mmap(nullptr, ring.cq_ptr_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring.fd,
+                            IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            destroy_ring();
+            return false;
+        }
+        ring.cq_ptr = cq_ptr;
+    }
+
+    ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(nullptr, ring.sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        destroy_ring();
+        return false;
+    }
+    ring.sqes = static_cast<struct io_uring_sqe *>(sqes);
+
+    auto sq_base = static_cast<char *>(ring.sq_ptr);
+    ring.sq_head = reinterpret_cast<unsigned *>(sq_base + p.sq_off.head);
+    ring.sq_tail = reinterpret_cast<unsigned *>(sq_base + p.sq_off.tail);
+    ring.sq_mask = reinterpret_cast<unsigned *>(sq_base + p.sq_off.ring_mask);
+    ring.sq_array = reinterpret_cast<unsigned *>(sq_base + p.sq_off.array);
+    ring.sq_entries = p.sq_entries;
+
+    auto cq_base = static_cast<char *>(ring.cq_ptr);
+    ring.cq_head = reinterpret_cast<unsigned *>(cq_base + p.cq_off.head);
+    ring.cq_tail = reinterpret_cast<unsigned *>(cq_base + p.cq_off.tail);
+    ring.cq_mask = reinterpret_cast<unsigned *>(cq_base + p.cq_off.ring_mask);
+    ring.cqes = reinterpret_cast<struct io_uring_cqe *>(
+            cq_base + p.cq_off.cqes);
+    ring.cq_entries = p.cq_entries;
+
+    have_ring = true;
+    return true;
+}
+
+void UringFilePrivate::destroy_ring()
+{
+    if (ring.sqes) {
+        munmap(ring.sqes, ring.sqes_size);
+    }
+    if (ring.cq_ptr && ring.cq_ptr != ring.sq_ptr) {
+        munmap(ring.cq_ptr, ring.cq_ptr_size);
+    }
+    if (ring.sq_ptr) {
+        munmap(ring.sq_ptr, ring.sq_ptr_size);
+    }
+    if (ring.fd >= 0) {
+        // Closing the ring also unregisters the buffers
+        close(ring.fd);
+    }
+
+    ring = UringRing();
+    have_ring = false;
+    buffers_registered = false;
+    unsubmitted = 0;
+    submitted = 0;
+}
+
+void UringFilePrivate::free_buffers()
+{
+    if (buffers_registered) {
+        sys_io_uring_register(ring.fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+        buffers_registered = false;
+    }
+
+    free(buffers);
+    buffers = nullptr;
+    buffers_count = 0;
+    buffers_size = 0;
+}
+
+// Submit queued SQEs and wait for at least min_complete completions
+static bool ring_enter(UringFile *file, UringFilePrivate *priv,
+                       unsigned min_complete)
+{
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+    while (true) {
+        int ret = sys_io_uring_enter(priv->ring.fd, priv->unsubmitted,
+                                     min_complete, flags);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            file->set_error(std::error_code(errno, std::generic_category()),
+                            "Failed to submit I/O requests");
+            return false;
+        }
+
+        priv->unsubmitted -= static_cast<unsigned>(ret);
+        priv->submitted += static_cast<unsigned>(ret);
+        return true;
+    }
+}
+
+// Move all available CQEs into the completed list or the sync result
+static void ring_drain(UringFilePrivate *priv)
+{
+    UringRing &r = priv->ring;
+    unsigned head = *r.cq_head;
+    unsigned tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        const struct io_uring_cqe &cqe = r.cqes[head & *r.cq_mask];
+
+        if (cqe.user_data == SYNC_USER_DATA) {
+            priv->sync_done = true;
+            priv->sync_result = cqe.res;
+        } else {
+            UringCompletion completion;
+            completion.tag = nullptr;
+            completion.bytes = cqe.res >= 0 ? static_cast<size_t>(cqe.res) : 0;
+            if (cqe.res < 0) {
+                completion.error = std::error_code(
+                        -cqe.res, std::generic_category());
+            }
+
+            auto it = priv->tags.find(cqe.user_data);
+            if (it != priv->tags.end()) {
+                completion.tag = it->second;
+                priv->tags.erase(it);
+            }
+
+            priv->completed.push_back(std::move(completion));
+        }
+
+        ++head;
+        --priv->submitted;
+    }
+
+    __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Get the next free SQE. The completion queue is never allowed to overflow.
+static struct io_uring_sqe * ring_get_sqe(UringFile *file,
+                                          UringFilePrivate *priv)
+{
+    UringRing &r = priv->ring;
+
+    while (priv->submitted + priv->unsubmitted >= r.cq_entries) {
+        if (!ring_enter(file, priv, 1)) {
+            return nullptr;
+        }
+        ring_drain(priv);
+    }
+
+    unsigned tail = *r.sq_tail;
+    if (tail - __atomic_load_n(r.sq_head, __ATOMIC_ACQUIRE) >= r.sq_entries) {
+        // Submission queue is full. Hand the queued entries to the kernel.
+        if (!ring_enter(file, priv, 0)) {
+            return nullptr;
+        }
+    }
+
+    unsigned index = tail & *r.sq_mask;
+    struct io_uring_sqe *sqe = &r.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r.sq_array[index] = index;
+
+    return sqe;
+}
+
+static void ring_commit_sqe(UringFilePrivate *priv)
+{
+    UringRing &r = priv->ring;
+
+    __atomic_store_n(r.sq_tail, *r.sq_tail + 1, __ATOMIC_RELEASE);
+    ++priv->unsubmitted;
+}
+
+static void ring_prep_rw(struct io_uring_sqe *sqe, uint8_t opcode, int fd,
+                         uint64_t offset, const void *buf, size_t size)
+{
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = reinterpret_cast<uintptr_t>(buf);
+    sqe->len = static_cast<uint32_t>(std::min<size_t>(size, MAX_RW_COUNT));
+}
+
+// Perform an operation synchronously through the ring. Completions of
+// asynchronous operations that arrive in the meantime are kept for reap().
+static bool ring_run_sync(UringFile *file, UringFilePrivate *priv,
+                          uint8_t opcode, uint64_t offset,
+                          const void *buf, size_t size, size_t &result)
+{
+    std::lock_guard<std::mutex> lock(priv->lock);
+
+    struct io_uring_sqe *sqe = ring_get_sqe(file, priv);
+    if (!sqe) {
+        return false;
+    }
+
+    ring_prep_rw(sqe, opcode, priv->fd, offset, buf, size);
+    sqe->user_data = SYNC_USER_DATA;
+    ring_commit_sqe(priv);
+
+    priv->sync_done = false;
+
+    while (!priv->sync_done) {
+        if (!ring_enter(file, priv, 1)) {
+            return false;
+        }
+        ring_drain(priv);
+    }
+
+    if (priv->sync_result < 0) {
+        file->set_error(std::error_code(-priv->sync_result,
+                                        std::generic_category()),
+                        opcode == IORING_OP_READ
+                                ? "Failed to read file"
+                                : "Failed to write file");
+        return false;
+    }
+
+    result = static_cast<size_t>(priv->sync_result);
+    return true;
+}
+
+// Queue an asynchronous operation. Without a ring, the operation is performed
+// immediately and its completion is queued instead.
+static bool submit_rw(UringFile *file, UringFilePrivate *priv, bool write,
+                      uint64_t offset, const void *buf, size_t size,
+                      int buf_index, void *tag)
+{
+    if (!file->is_open()) {
+        file->set_error(make_error_code(FileError::InvalidState),
+                        "File is not open");
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(priv->lock);
+
+    if (!priv->have_ring) {
+        UringCompletion completion;
+        completion.tag = tag;
+        completion.bytes = 0;
+
+        bool ret = write
+                ? file->write_at(offset, buf, size, completion.bytes)
+                : file->read_at(offset, const_cast<void *>(buf), size,
+                                completion.bytes);
+        if (!ret) {
+            completion.error = file->error();
+        }
+
+        priv->completed.push_back(std::move(completion));
+        return true;
+    }
+
+    struct io_uring_sqe *sqe = ring_get_sqe(file, priv);
+    if (!sqe) {
+        return false;
+    }
+
+    uint8_t opcode;
+    if (buf_index >= 0) {
+        opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    } else {
+        opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+
+    uint64_t id = priv->next_id++;
+
+    ring_prep_rw(sqe, opcode, priv->fd, offset, buf, size);
+    if (buf_index >= 0) {
+        sqe->buf_index = static_cast<uint16_t>(buf_index);
+    }
+    sqe->user_data = id;
+    ring_commit_sqe(priv);
+
+    priv->tags[id] = tag;
+    return true;
+}
+
+// Validate a fixed buffer reference and return its index for the SQE
+static bool check_fixed(UringFile *file, UringFilePrivate *priv,
+                        size_t index, size_t size, int &buf_index)
+{
+    if (index >= priv->buffers_count || size > priv->buffers_size) {
+        file->set_error(make_error_code(FileError::ArgumentOutOfRange),
+                        "Invalid registered buffer range");
+        return false;
+    }
+
+    buf_index = priv->buffers_registered ? static_cast<int>(index) : -1;
+    return true;
+}
+
+/*! \endcond */
+
+/*!
+ * \class UringFile
+ *
+ * \brief Open file with POSIX file descriptors and perform I/O with io_uring.
+ *
+ * This behaves like FdFile, except that reads and writes go through an
+ * io_uring instance created when the file is opened. In addition to the
+ * regular synchronous File API, operations can be queued with the submit_*()
+ * functions, handed to the kernel in a single batch with submit(), and
+ * collected with reap(). This allows many operations on the same file to be in
+ * flight at the same time.
+ *
+ * A pool of buffers can be registered with the kernel with register_buffers()
+ * and used with submit_read_fixed() and submit_write_fixed(), which avoids
+ * mapping the pages for every operation.
+ *
+ * io_uring requires Linux 5.6 or newer. If the ring cannot be created (eg.
+ * the kernel is too old or the syscalls are blocked), the file silently falls
+ * back to the FdFile implementation. Asynchronous operations are then
+ * performed immediately by the submit functions. Use has_ring() to check which
+ * mode is in use.
+ *
+ * The ring is protected by a lock, so the handle can be shared between
+ * threads in the same way as FdFile.
+ */
+
+/*!
+ * \brief Construct unbound UringFile.
+ *
+ * The File handle will not be bound to any file. One of the open functions will
+ * need to be called to open a file.
+ */
+UringFile::UringFile()
+    : UringFile(new UringFilePrivate())
+{
+}
+
+/*!
+ * \brief Open File handle from file descriptor.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa FdFile::open(int, bool)
+ *
+ * \param fd File descriptor
+ * \param owned Whether the file descriptor should be owned by the File handle
+ */
+UringFile::UringFile(int fd, bool owned)
+    : UringFile(new UringFilePrivate(), fd, owned)
+{
+}
+
+/*!
+ * \brief Open File handle from a multi-byte filename.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa FdFile::open(const std::string &, FileOpenMode)
+ *
+ * \param filename MBS filename
+ * \param mode Open mode (\ref FileOpenMode)
+ */
+UringFile::UringFile(const std::string &filename, FileOpenMode mode)
+    : UringFile(new UringFilePrivate(), filename, mode)
+{
+}
+
+/*!
+ * \brief Open File handle from a wide-character filename.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa FdFile::open(const std::wstring &, FileOpenMode)
+ *
+ * \param filename WCS filename
+ * \param mode Open mode (\ref FileOpenMode)
+ */
+UringFile::UringFile(const std::wstring &filename, FileOpenMode mode)
+    : UringFile(new UringFilePrivate(), filename, mode)
+{
+}
+
+/*! \cond INTERNAL */
+
+UringFile::UringFile(UringFilePrivate *priv)
+    : FdFile(priv)
+{
+}
+
+// The FdFile constructors that open the file cannot be used because on_open()
+// would not be dispatched to UringFile during base class construction
+
+UringFile::UringFile(UringFilePrivate *priv,
+                     int fd, bool owned)
+    : FdFile(priv)
+{
+    open(fd, owned);
+}
+
+UringFile::UringFile(UringFilePrivate *priv,
+                     const std::string &filename, FileOpenMode mode)
+    : FdFile(priv)
+{
+    open(filename, mode);
+}
+
+UringFile::UringFile(UringFilePrivate *priv,
+                     const std::wstring &filename, FileOpenMode mode)
+    : FdFile(priv)
+{
+    open(filename, mode);
+}
+
+/*! \endcond */
+
+UringFile::~UringFile()
+{
+    close();
+}
+
+/*!
+ * \brief Check whether I/O is performed with io_uring.
+ *
+ * \return Whether the file is open and has a working io_uring instance
+ */
+bool UringFile::has_ring()
+{
+    MB_PRIVATE(UringFile);
+    return priv && is_open() && priv->have_ring;
+}
+
+/*!
+ * \brief Allocate and register a pool of buffers.
+ *
+ * Any previously registered buffers are freed. The buffers are page aligned.
+ * If the kernel refuses to register them (eg. because of `RLIMIT_MEMLOCK`),
+ * they are still allocated and the fixed operations transparently use regular
+ * reads and writes.
+ *
+ * \param count Number of buffers
+ * \param size Size of each buffer
+ *
+ * \return
+ *   * True if the buffers were allocated
+ *   * False with error set to FileError::InvalidState if the file is not open
+ *     or operations are still in flight
+ *   * False with a specific error if allocation fails
+ */
+bool UringFile::register_buffers(size_t count, size_t size)
+{
+    MB_PRIVATE(UringFile);
+
+    if (!priv || !is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "File is not open");
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(priv->lock);
+
+    if (priv->submitted + priv->unsubmitted > 0) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "Cannot replace buffers while operations are in flight");
+        return false;
+    }
+
+    priv->free_buffers();
+
+    if (count == 0 || size == 0) {
+        return true;
+    } else if (count > UINT16_MAX || size > SIZE_MAX / count) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Buffer pool is too large");
+        return false;
+    }
+
+    void *buffers;
+    int ret = posix_memalign(&buffers, static_cast<size_t>(getpagesize()),
+                             count * size);
+    if (ret != 0) {
+        set_error(std::error_code(ret, std::generic_category()),
+                  "Failed to allocate buffers");
+        return false;
+    }
+
+    priv->buffers = buffers;
+    priv->buffers_count = count;
+    priv->buffers_size = size;
+
+    if (priv->have_ring) {
+        std::vector<struct iovec> iovs(count);
+        for (size_t i = 0; i < count; ++i) {
+            iovs[i].iov_base = static_cast<char *>(buffers) + i * size;
+            iovs[i].iov_len = size;
+        }
+
+        priv->buffers_registered = sys_io_uring_register(
+                priv->ring.fd, IORING_REGISTER_BUFFERS, iovs.data(),
+                static_cast<unsigned>(count)) == 0;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Get pointer to a registered buffer.
+ *
+ * \param index Buffer index
+ *
+ * \return Pointer to buffer or nullptr if \p index is out of range
+ */
+void * UringFile::buffer(size_t index)
+{
+    MB_PRIVATE(UringFile);
+
+    if (!priv || index >= priv->buffers_count) {
+        return nullptr;
+    }
+
+    return static_cast<char *>(priv->buffers) + index * priv->buffers_size;
+}
+
+/*!
+ * \brief Get number of registered buffers.
+ */
+size_t UringFile::buffer_count()
+{
+    MB_PRIVATE(UringFile);
+    return priv ? priv->buffers_count : 0;
+}
+
+/*!
+ * \brief Get size of each registered buffer.
+ */
+size_t UringFile::buffer_size()
+{
+    MB_PRIVATE(UringFile);
+    return priv ? priv->buffers_size : 0;
+}
+
+/*!
+ * \brief Queue an asynchronous read.
+ *
+ * The operation is not guaranteed to start until submit() or reap() is
+ * called. \p buf must remain valid until the completion has been reaped.
+ *
+ * \param offset File offset to read from
+ * \param buf Buffer to read into
+ * \param size Buffer size
+ * \param tag Opaque value returned in the UringCompletion
+ *
+ * \return Whether the operation was queued
+ */
+bool UringFile::submit_read_at(uint64_t offset, void *buf, size_t size,
+                               void *tag)
+{
+    MB_PRIVATE(UringFile);
+    return priv && submit_rw(this, priv, false, offset, buf, size, -1, tag);
+}
+
+/*!
+ * \brief Queue an asynchronous write.
+ *
+ * \sa submit_read_at()
+ *
+ * \param offset File offset to write to
+ * \param buf Buffer to write from
+ * \param size Buffer size
+ * \param tag Opaque value returned in the UringCompletion
+ *
+ * \return Whether the operation was queued
+ */
+bool UringFile::submit_write_at(uint64_t offset, const void *buf, size_t size,
+                                void *tag)
+{
+    MB_PRIVATE(UringFile);
+    return priv && submit_rw(this, priv, true, offset, buf, size, -1, tag);
+}
+
+/*!
+ * \brief Queue an asynchronous read into a registered buffer.
+ *
+ * \sa submit_read_at(), register_buffers()
+ *
+ * \param offset File offset to read from
+ * \param index Index of registered buffer
+ * \param size Number of bytes to read (at most buffer_size())
+ * \param tag Opaque value returned in the UringCompletion
+ *
+ * \return Whether the operation was queued
+ */
+bool UringFile::submit_read_fixed(uint64_t offset, size_t index, size_t size,
+                                  void *tag)
+{
+    MB_PRIVATE(UringFile);
+
+    int buf_index;
+    return priv && check_fixed(this, priv, index, size, buf_index)
+            && submit_rw(this, priv, false, offset, buffer(index), size,
+                         buf_index, tag);
+}
+
+/*!
+ * \brief Queue an asynchronous write from a registered buffer.
+ *
+ * \sa submit_read_at(), register_buffers()
+ *
+ * \param offset File offset to write to
+ * \param index Index of registered buffer
+ * \param size Number of bytes to write (at most buffer_size())
+ * \param tag Opaque value returned in the UringCompletion
+ *
+ * \return Whether the operation was queued
+ */
+bool UringFile::submit_write_fixed(uint64_t offset, size_t index, size_t size,
+                                   void *tag)
+{
+    MB_PRIVATE(UringFile);
+
+    int buf_index;
+    return priv && check_fixed(this, priv, index, size, buf_index)
+            && submit_rw(this, priv, true, offset, buffer(index), size,
+                         buf_index, tag);
+}
+
+/*!
+ * \brief Hand all queued operations to the kernel.
+ *
+ * \return Whether the operations were submitted
+ */
+bool UringFile::submit()
+{
+    MB_PRIVATE(UringFile);
+
+    if (!priv || !is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "File is not open");
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(priv->lock);
+
+    return !priv->have_ring || priv->unsubmitted == 0
+            || ring_enter(this, priv, 0);
+}
+
+/*!
+ * \brief Collect completed asynchronous operations.
+ *
+ * Queued operations are submitted first. Then, this function waits until at
+ * least \p min_complete operations have completed or no more operations are
+ * in flight, and appends all available completions to \p completions.
+ *
+ * \param min_complete Minimum number of completions to wait for
+ * \param[out] completions Vector to append completions to
+ *
+ * \return Whether the completions were collected
+ */
+bool UringFile::reap(size_t min_complete,
+                     std::vector<UringCompletion> &completions)
+{
+    MB_PRIVATE(UringFile);
+
+    if (!priv || !is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "File is not open");
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(priv->lock);
+
+    if (priv->have_ring) {
+        if (priv->unsubmitted > 0 && !ring_enter(this, priv, 0)) {
+            return false;
+        }
+        ring_drain(priv);
+
+        while (priv->completed.size() < min_complete && priv->submitted > 0) {
+            if (!ring_enter(this, priv, 1)) {
+                return false;
+            }
+            ring_drain(priv);
+        }
+    }
+
+    for (auto &completion : priv->completed) {
+        completions.push_back(std::move(completion));
+    }
+    priv->completed.clear();
+
+    return true;
+}
+
+/*!
+ * \brief Get number of asynchronous operations that have not been reaped.
+ */
+size_t UringFile::in_flight()
+{
+    MB_PRIVATE(UringFile);
+
+    if (!priv) {
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(priv->lock);
+
+    return priv->tags.size() + priv->completed.size();
+}
+
+bool UringFile::on_open()
+{
+    MB_PRIVATE(UringFile);
+
+    if (!FdFile::on_open()) {
+        return false;
+    }
+
+    // Fall back to FdFile if io_uring is not available
+    priv->setup_ring(DEFAULT_QUEUE_DEPTH);
+
+    return true;
+}
+
+bool UringFile::on_close()
+{
+    MB_PRIVATE(UringFile);
+
+    {
+        std::lock_guard<std::mutex> lock(priv->lock);
+
+        // Wait for in-flight operations since they reference caller buffers
+        if (priv->have_ring) {
+            if (priv->unsubmitted == 0 || ring_enter(this, priv, 0)) {
+                while (priv->submitted > 0 && ring_enter(this, priv, 1)) {
+                    ring_drain(priv);
+                }
+            }
+        }
+
+        priv->free_buffers();
+        priv->destroy_ring();
+        priv->tags.clear();
+        priv->completed.clear();
+        priv->next_id = SYNC_USER_DATA + 1;
+    }
+
+    return FdFile::on_close();
+}
+
+bool UringFile::on_read(void *buf, size_t size, size_t &bytes_read)
+{
+    MB_PRIVATE(UringFile);
+
+    if (!priv->have_ring) {
+        return FdFile::on_read(buf, size, bytes_read);
+    }
+
+    // An offset of -1 uses and updates the file position
+    return ring_run_sync(this, priv, IORING_OP_READ, UINT64_MAX, buf, size,
+                         bytes_read);
+}
+
+bool UringFile::on_write(const void *buf, size_t size, size_t &bytes_written)
+{
+    MB_PRIVATE(UringFile);
+
+    if (!priv->have_ring) {
+        return FdFile::on_write(buf, size, bytes_written);
+    }
+
+    return ring_run_sync(this, priv, IORING_OP_WRITE, UINT64_MAX, buf, size,
+                         bytes_written);
+}
+
+bool UringFile::on_read_at(uint64_t offset, void *buf, size_t size,
+                           size_t &bytes_read)
+{
+    MB_PRIVATE(UringFile);
+
+    if (!priv->have_ring) {
+        return FdFile::on_read_at(offset, buf, size, bytes_read);
+    } else if (offset > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset is too large");
+        return false;
+    }
+
+    return ring_run_sync(this, priv, IORING_OP_READ, offset, buf, size,
+                         bytes_read);
+}
+
+bool UringFile::on_write_at(uint64_t offset, const void *buf, size_t size,
+                            size_t &bytes_written)
+{
+    MB_PRIVATE(UringFile);
+
+    if (!priv->have_ring) {
+        return FdFile::on_write_at(offset, buf, size, bytes_written);
+    } else if (offset > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset is too large");
+        return false;
+    }
+
+    return ring_run_sync(this, priv, IORING_OP_WRITE, offset, buf, size,
+                         bytes_written);
+}
+
+}
@@ -19,7 +19,10 @@
 
 #include "mbcommon/file/win32.h"
 
+#include <algorithm>
+
 #include <cerrno>
+#include <cinttypes>
 #include <climits>
 #include <cstdlib>
 #include <cstring>
@@ -30,6 +33,9 @@
 
 static_assert(sizeof(DWORD) == 4, "DWORD is not 32 bits");
 
+// Size of each of the two read-ahead buffers
+static constexpr size_t READ_AHEAD_BUFFER_SIZE = 1024 * 1024;
+
 /*!
  * \file mbcommon/file/win32.h
  * \brief Open file with Win32 `HANDLE` API
@@ -47,6 +53,15 @@ struct RealWin32FileFuncs : public Win32FileFuncs
         return CloseHandle(hObject);
     }
 
+    virtual HANDLE fn_CreateEventW(LPSECURITY_ATTRIBUTES lpEventAttributes,
+                                   BOOL bManualReset,
+                                   BOOL bInitialState,
+                                   LPCWSTR lpName) override
+    {
+        return CreateEventW(lpEventAttributes, bManualReset, bInitialState,
+                            lpName);
+    }
+
     virtual HANDLE fn_CreateFileW(LPCWSTR lpFileName,
                                   DWORD dwDesiredAccess,
                                   DWORD dwShareMode,
@@ -60,6 +75,21 @@ struct RealWin32FileFuncs : public Win32FileFuncs
                            dwFlagsAndAttributes, hTemplateFile);
     }
 
+    virtual BOOL fn_GetFileSizeEx(HANDLE hFile,
+                                  PLARGE_INTEGER lpFileSize) override
+    {
+        return GetFileSizeEx(hFile, lpFileSize);
+    }
+
+    virtual BOOL fn_GetOverlappedResult(HANDLE hFile,
+                                        LPOVERLAPPED lpOverlapped,
+                                        LPDWORD lpNumberOfBytesTransferred,
+                                        BOOL bWait) override
+    {
+        return GetOverlappedResult(hFile, lpOverlapped,
+                                   lpNumberOfBytesTransferred, bWait);
+    }
+
     virtual BOOL fn_ReadFile(HANDLE hFile,
                              LPVOID lpBuffer,
                              DWORD nNumberOfBytesToRead,
@@ -84,6 +114,12 @@ struct RealWin32FileFuncs : public Win32FileFuncs
                                 dwMoveMethod);
     }
 
+    virtual BOOL fn_SetFileValidData(HANDLE hFile,
+                                     LONGLONG ValidDataLength) override
+    {
+        return SetFileValidData(hFile, ValidDataLength);
+    }
+
     virtual BOOL fn_WriteFile(HANDLE hFile,
                               LPCVOID lpBuffer,
                               DWORD nNumberOfBytesToWrite,
@@ -106,8 +142,12 @@ Win32FilePrivate::Win32FilePrivate()
 }
 
 Win32FilePrivate::Win32FilePrivate(Win32FileFuncs *funcs)
-    : funcs(funcs), error(nullptr)
+    : funcs(funcs), hints(), error(nullptr)
 {
+    for (auto &buf : ra) {
+        buf.event = nullptr;
+    }
+
     clear();
 }
 
@@ -127,6 +167,14 @@ void Win32FilePrivate::clear()
     creation = 0;
     attrib = 0;
     append = false;
+    read_ahead = false;
+    position = 0;
+    for (auto &buf : ra) {
+        buf.state = Win32ReadAheadBuffer::State::Idle;
+        buf.offset = 0;
+        buf.size = 0;
+    }
+    ra_index = 0;
 }
 
 bool Win32FilePrivate::convert_mode(FileOpenMode mode,
@@ -191,6 +239,306 @@ bool Win32FilePrivate::convert_mode(FileOpenMode mode,
     return true;
 }
 
+/*!
+ * \brief Queue an overlapped read of the next chunk into a read-ahead buffer
+ */
+static bool ra_submit(Win32File *file, Win32FilePrivate *priv,
+                      Win32ReadAheadBuffer &buf, uint64_t offset)
+{
+    buf.overlapped = {};
+    buf.overlapped.Offset = static_cast<DWORD>(offset);
+    buf.overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    buf.overlapped.hEvent = buf.event;
+    buf.offset = offset;
+    buf.size = 0;
+
+    bool ret = priv->funcs->fn_ReadFile(
+        priv->handle,                           // hFile
+        buf.data.data(),                        // lpBuffer
+        static_cast<DWORD>(buf.data.size()),    // nNumberOfBytesToRead
+        nullptr,                                // lpNumberOfBytesRead
+        &buf.overlapped                         // lpOverlapped
+    );
+
+    if (!ret) {
+        DWORD error = GetLastError();
+
+        // Reading at or past the end of the file is not an error
+        if (error == ERROR_HANDLE_EOF) {
+            buf.state = Win32ReadAheadBuffer::State::Ready;
+            return true;
+        } else if (error != ERROR_IO_PENDING) {
+            buf.state = Win32ReadAheadBuffer::State::Idle;
+            file->set_error(std::error_code(error, std::system_category()),
+                            "Failed to queue read-ahead");
+            return false;
+        }
+    }
+
+    // The result is collected with GetOverlappedResult() even if the read
+    // completed synchronously
+    buf.state = Win32ReadAheadBuffer::State::Pending;
+    return true;
+}
+
+/*!
+ * \brief Wait for a queued read-ahead to complete
+ */
+static bool ra_wait(Win32File *file, Win32FilePrivate *priv,
+                    Win32ReadAheadBuffer &buf)
+{
+    if (buf.state != Win32ReadAheadBuffer::State::Pending) {
+        return true;
+    }
+
+    DWORD n = 0;
+
+    if (!priv->funcs->fn_GetOverlappedResult(
+            priv->handle, &buf.overlapped, &n, TRUE)) {
+        DWORD error = GetLastError();
+
+        if (error != ERROR_HANDLE_EOF) {
+            buf.state = Win32ReadAheadBuffer::State::Idle;
+            file->set_error(std::error_code(error, std::system_category()),
+                            "Failed to read file");
+            return false;
+        }
+
+        n = 0;
+    }
+
+    buf.state = Win32ReadAheadBuffer::State::Ready;
+    buf.size = n;
+    return true;
+}
+
+/*!
+ * \brief Wait for all in-flight read-aheads and mark the buffers as unused
+ *
+ * The kernel owns the buffers until the reads complete, so this must be
+ * called before the buffers are reused for another offset or freed.
+ */
+static void ra_drain(Win32FilePrivate *priv)
+{
+    for (auto &buf : priv->ra) {
+        if (buf.state == Win32ReadAheadBuffer::State::Pending) {
+            DWORD n;
+            priv->funcs->fn_GetOverlappedResult(
+                    priv->handle, &buf.overlapped, &n, TRUE);
+        }
+        buf.state = Win32ReadAheadBuffer::State::Idle;
+    }
+}
+
+static bool ra_init(Win32File *file, Win32FilePrivate *priv)
+{
+    for (auto &buf : priv->ra) {
+        buf.event = priv->funcs->fn_CreateEventW(nullptr, TRUE, FALSE,
+                                                 nullptr);
+        if (!buf.event) {
+            file->set_error(std::error_code(GetLastError(),
+                                            std::system_category()),
+                            "Failed to create event");
+            return false;
+        }
+
+        buf.data.resize(READ_AHEAD_BUFFER_SIZE);
+    }
+
+    return true;
+}
+
+static void ra_release(Win32FilePrivate *priv)
+{
+    ra_drain(priv);
+
+    for (auto &buf : priv->ra) {
+        if (buf.event) {
+            priv->funcs->fn_CloseHandle(buf.event);
+            buf.event = nullptr;
+        }
+
+        std::vector<unsigned char>().swap(buf.data);
+    }
+}
+
+/*!
+ * \brief Read from the double-buffered read-ahead window
+ *
+ * While the caller consumes one buffer, the kernel fills the other with the
+ * following chunk. When a buffer has been fully consumed, it is immediately
+ * requeued for the chunk after the one in the other buffer. Seeking outside of
+ * the current buffer restarts the stream at the new position.
+ */
+static bool ra_read(Win32File *file, Win32FilePrivate *priv,
+                    void *buf, size_t size, size_t &bytes_read)
+{
+    auto *cur = &priv->ra[priv->ra_index];
+    const uint64_t capacity = cur->data.size();
+
+    if (cur->state == Win32ReadAheadBuffer::State::Idle
+            || priv->position < cur->offset
+            || priv->position - cur->offset >= capacity) {
+        ra_drain(priv);
+
+        priv->ra_index = 0;
+        cur = &priv->ra[0];
+
+        if (!ra_submit(file, priv, priv->ra[0], priv->position)
+                || !ra_submit(file, priv, priv->ra[1],
+                              priv->position + capacity)) {
+            return false;
+        }
+    }
+
+    if (!ra_wait(file, priv, *cur)) {
+        return false;
+    }
+
+    // A short read means that the end of the file was reached
+    uint64_t consumed = priv->position - cur->offset;
+    if (consumed >= cur->size) {
+        bytes_read = 0;
+        return true;
+    }
+
+    size_t n = static_cast<size_t>(
+            std::min<uint64_t>(size, cur->size - consumed));
+    memcpy(buf, cur->data.data() + consumed, n);
+    priv->position += n;
+    bytes_read = n;
+
+    if (consumed + n == capacity) {
+        auto &next = priv->ra[priv->ra_index ^ 1];
+
+        cur->state = Win32ReadAheadBuffer::State::Idle;
+        priv->ra_index ^= 1;
+
+        // Failing to queue the next chunk is not fatal for this read. The
+        // stream is restarted (and the error reported) when the reader gets
+        // to the idle buffer.
+        if (next.state != Win32ReadAheadBuffer::State::Idle) {
+            (void) ra_submit(file, priv, *cur, next.offset + capacity);
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Seek by updating the emulated file pointer
+ *
+ * The buffers are left alone. ra_read() restarts the stream if the new
+ * position is outside of the current buffer.
+ */
+static bool ra_seek(Win32File *file, Win32FilePrivate *priv,
+                    int64_t offset, int whence, uint64_t &new_offset)
+{
+    uint64_t base;
+
+    switch (whence) {
+    case SEEK_CUR:
+        base = priv->position;
+        break;
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_END: {
+        LARGE_INTEGER size;
+        if (!priv->funcs->fn_GetFileSizeEx(priv->handle, &size)) {
+            file->set_error(std::error_code(GetLastError(),
+                                            std::system_category()),
+                            "Failed to get file size");
+            return false;
+        }
+        base = static_cast<uint64_t>(size.QuadPart);
+        break;
+    }
+    default:
+        file->set_error(make_error_code(FileError::InvalidArgument),
+                        "Invalid whence argument: %d", whence);
+        return false;
+    }
+
+    if (offset < 0 && static_cast<uint64_t>(-(offset + 1)) >= base) {
+        file->set_error(make_error_code(FileError::ArgumentOutOfRange),
+                        "Seeking to negative offset");
+        return false;
+    } else if (offset > 0 && base + static_cast<uint64_t>(offset)
+            > static_cast<uint64_t>(INT64_MAX)) {
+        file->set_error(make_error_code(FileError::IntegerOverflow),
+                        "Seeking too far");
+        return false;
+    }
+
+    priv->position = base + static_cast<uint64_t>(offset);
+    new_offset = priv->position;
+    return true;
+}
+
+/*!
+ * \brief Positional read on a handle opened with FILE_FLAG_OVERLAPPED
+ */
+static bool ra_read_at(Win32File *file, Win32FilePrivate *priv,
+                       uint64_t offset, void *buf, size_t size,
+                       size_t &bytes_read)
+{
+    // Each call gets its own event so that completions of the read-ahead
+    // buffers cannot be mistaken for this one
+    HANDLE event = priv->funcs->fn_CreateEventW(nullptr, TRUE, FALSE,
+                                                nullptr);
+    if (!event) {
+        file->set_error(std::error_code(GetLastError(),
+                                        std::system_category()),
+                        "Failed to create event");
+        return false;
+    }
+
+    OVERLAPPED overlapped{};
+    overlapped.Offset = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    overlapped.hEvent = event;
+
+    DWORD n = 0;
+    DWORD error = ERROR_SUCCESS;
+
+    bool ret = priv->funcs->fn_ReadFile(
+        priv->handle,   // hFile
+        buf,            // lpBuffer
+        size,           // nNumberOfBytesToRead
+        nullptr,        // lpNumberOfBytesRead
+        &overlapped     // lpOverlapped
+    );
+
+    if (!ret) {
+        error = GetLastError();
+    }
+
+    if (ret || error == ERROR_IO_PENDING) {
+        error = ERROR_SUCCESS;
+
+        if (!priv->funcs->fn_GetOverlappedResult(
+                priv->handle, &overlapped, &n, TRUE)) {
+            error = GetLastError();
+        }
+    }
+
+    priv->funcs->fn_CloseHandle(event);
+
+    // Reading at or past the end of the file is not an error
+    if (error == ERROR_HANDLE_EOF) {
+        bytes_read = 0;
+        return true;
+    } else if (error != ERROR_SUCCESS) {
+        file->set_error(std::error_code(error, std::system_category()),
+                        "Failed to read file");
+        return false;
+    }
+
+    bytes_read = n;
+    return true;
+}
+
 /*! \endcond */
 
 /*!
@@ -199,6 +547,19 @@ bool Win32FilePrivate::convert_mode(FileOpenMode mode,
  * \brief Open file using Win32 API.
  *
  * This class supports opening large files (64-bit offsets) on Windows.
+ *
+ * Access pattern hints can be set with set_hints() before opening a file by
+ * name. With Win32FileHint::SequentialScan, the file is opened with
+ * `FILE_FLAG_SEQUENTIAL_SCAN` so that the cache manager reads ahead more
+ * aggressively and drops pages behind the reader. With
+ * Win32FileHint::ReadAhead, files opened with FileOpenMode::READ_ONLY are
+ * opened with `FILE_FLAG_OVERLAPPED` and read() is served from two buffers:
+ * while one is being consumed, the next chunk of the file is read into the
+ * other. Writing and truncating are not supported in read-ahead mode. Use
+ * read_ahead_active() to check whether the mode is in use.
+ *
+ * For outputs of a known size, preallocate() can be used to reserve the space
+ * before writing.
  */
 
 /*!
@@ -413,19 +774,164 @@ bool Win32File::open(const std::wstring &filename, FileOpenMode mode)
     return File::open();
 }
 
+/*!
+ * \brief Get access pattern hints.
+ *
+ * \return Hints that are applied when a file is opened by name
+ */
+Win32FileHints Win32File::hints()
+{
+    MB_PRIVATE(Win32File);
+    return priv ? priv->hints : Win32FileHints();
+}
+
+/*!
+ * \brief Set access pattern hints.
+ *
+ * The hints are applied when a file is opened by name and persist across
+ * close() and subsequent opens. They are ignored when opening from a Win32
+ * `HANDLE`. Win32FileHint::ReadAhead only applies to files opened with
+ * FileOpenMode::READ_ONLY.
+ *
+ * \param hints Access pattern hints
+ *
+ * \return
+ *   * True if the hints were set
+ *   * False with error set to FileError::InvalidState if the file is open
+ */
+bool Win32File::set_hints(Win32FileHints hints)
+{
+    MB_PRIVATE(Win32File);
+
+    if (!priv || is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "Hints cannot be changed while the file is open");
+        return false;
+    }
+
+    priv->hints = hints;
+    return true;
+}
+
+/*!
+ * \brief Check whether reads are served by the read-ahead buffers.
+ *
+ * \return Whether the file is open in read-ahead mode
+ */
+bool Win32File::read_ahead_active()
+{
+    MB_PRIVATE(Win32File);
+    return priv && is_open() && priv->read_ahead;
+}
+
+/*!
+ * \brief Reserve space for an output file of a known size.
+ *
+ * If \p size is larger than the current file size, the file is extended to
+ * \p size so that the filesystem can allocate the space in one go instead of
+ * growing the file on every write. The file position is not changed. If fewer
+ * than \p size bytes end up being written, the file should be truncated to
+ * the actual size.
+ *
+ * If \p set_valid_data is true, `SetFileValidData()` is also called so that
+ * Windows does not zero-fill the new space when it is written out of order.
+ * This exposes whatever was previously stored on disk in that range until it
+ * is overwritten, so it should only be used when the entire range will be
+ * written. It requires the `SE_MANAGE_VOLUME_NAME` privilege to be enabled. If
+ * the privilege is not held, the file is still extended as if
+ * \p set_valid_data were false.
+ *
+ * \param size Expected final size of the file
+ * \param set_valid_data Whether to skip zero-filling the reserved space
+ *
+ * \return
+ *   * True if the space was reserved
+ *   * False with error set to FileError::InvalidState if the file is not open
+ *   * False with error set to FileError::UnsupportedWrite if the file is in
+ *     read-ahead mode
+ *   * False with a specific error if the file cannot be extended
+ */
+bool Win32File::preallocate(uint64_t size, bool set_valid_data)
+{
+    MB_PRIVATE(Win32File);
+
+    if (!priv || !is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "File is not open");
+        return false;
+    } else if (priv->read_ahead) {
+        set_error(make_error_code(FileError::UnsupportedWrite),
+                  "Cannot preallocate file in read-ahead mode");
+        return false;
+    } else if (size > static_cast<uint64_t>(INT64_MAX)) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Size too large: %" PRIu64, size);
+        return false;
+    }
+
+    LARGE_INTEGER current_size;
+
+    if (!priv->funcs->fn_GetFileSizeEx(priv->handle, &current_size)) {
+        set_error(std::error_code(GetLastError(), std::system_category()),
+                  "Failed to get file size");
+        return false;
+    }
+
+    if (size <= static_cast<uint64_t>(current_size.QuadPart)) {
+        return true;
+    }
+
+    if (!on_truncate(size)) {
+        return false;
+    }
+
+    if (set_valid_data && !priv->funcs->fn_SetFileValidData(
+            priv->handle, static_cast<LONGLONG>(size))) {
+        DWORD error = GetLastError();
+
+        // The file is still extended. Windows just zero-fills it lazily.
+        if (error != ERROR_PRIVILEGE_NOT_HELD) {
+            set_error(std::error_code(error, std::system_category()),
+                      "Failed to set valid data length");
+            return false;
+        }
+    }
+
+    return true;
+}
+
 bool Win32File::on_open()
 {
     MB_PRIVATE(Win32File);
 
     if (!priv->filename.empty()) {
+        DWORD attrib = priv->attrib;
+
+        if (priv->hints & Win32FileHint::SequentialScan) {
+            attrib |= FILE_FLAG_SEQUENTIAL_SCAN;
+        }
+
+        // Read-ahead needs an overlapped handle, which does not maintain the
+        // file pointer. Limit it to read-only files so that writes and
+        // truncation do not need to be emulated.
+        if ((priv->hints & Win32FileHint::ReadAhead)
+                && priv->access == GENERIC_READ && !priv->append) {
+            attrib |= FILE_FLAG_OVERLAPPED;
+            priv->read_ahead = true;
+        }
+
         priv->handle = priv->funcs->fn_CreateFileW(
                 priv->filename.c_str(), priv->access, priv->sharing, &priv->sa,
-                priv->creation, priv->attrib, nullptr);
+                priv->creation, attrib, nullptr);
         if (priv->handle == INVALID_HANDLE_VALUE) {
             set_error(std::error_code(GetLastError(), std::system_category()),
                       "Failed to open file");
             return false;
         }
+
+        if (priv->read_ahead && !ra_init(this, priv)) {
+            return false;
+        }
     }
 
     return true;
@@ -437,6 +943,9 @@ bool Win32File::on_close()
 
     bool ret = true;
 
+    // The read-ahead buffers must not be freed while reads are in flight
+    ra_release(priv);
+
     if (priv->owned && priv->handle != INVALID_HANDLE_VALUE
             && !priv->funcs->fn_CloseHandle(priv->handle)) {
         set_error(std::error_code(GetLastError(), std::system_category()),
@@ -454,6 +963,10 @@ bool Win32File::on_read(void *buf, size_t size, size_t &bytes_read)
 {
     MB_PRIVATE(Win32File);
 
+    if (priv->read_ahead) {
+        return ra_read(this, priv, buf, size, bytes_read);
+    }
+
     DWORD n = 0;
 
     if (size > UINT_MAX) {
@@ -482,6 +995,12 @@ bool Win32File::on_write(const void *buf, size_t size, size_t &bytes_written)
 {
     MB_PRIVATE(Win32File);
 
+    if (priv->read_ahead) {
+        set_error(make_error_code(FileError::UnsupportedWrite),
+                  "Cannot write file in read-ahead mode");
+        return false;
+    }
+
     DWORD n = 0;
 
     // We have to seek manually in append mode because the Win32 API has no
@@ -515,10 +1034,100 @@ bool Win32File::on_write(const void *buf, size_t size, size_t &bytes_written)
     return true;
 }
 
+bool Win32File::on_read_at(uint64_t offset, void *buf, size_t size,
+                           size_t &bytes_read)
+{
+    MB_PRIVATE(Win32File);
+
+    DWORD n = 0;
+
+    if (size > UINT_MAX) {
+        size = UINT_MAX;
+    }
+
+    if (priv->read_ahead) {
+        return ra_read_at(this, priv, offset, buf, size, bytes_read);
+    }
+
+    // The file pointer is still updated because the handle is synchronous
+    OVERLAPPED overlapped{};
+    overlapped.Offset = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+    bool ret = priv->funcs->fn_ReadFile(
+        priv->handle,   // hFile
+        buf,            // lpBuffer
+        size,           // nNumberOfBytesToRead
+        &n,             // lpNumberOfBytesRead
+        &overlapped     // lpOverlapped
+    );
+
+    if (!ret) {
+        DWORD error = GetLastError();
+
+        // Reading at or past the end of the file is not an error
+        if (error == ERROR_HANDLE_EOF) {
+            bytes_read = 0;
+            return true;
+        }
+
+        set_error(std::error_code(error, std::system_category()),
+                  "Failed to read file");
+        return false;
+    }
+
+    bytes_read = n;
+    return true;
+}
+
+bool Win32File::on_write_at(uint64_t offset, const void *buf, size_t size,
+                            size_t &bytes_written)
+{
+    MB_PRIVATE(Win32File);
+
+    if (priv->read_ahead) {
+        set_error(make_error_code(FileError::UnsupportedWrite),
+                  "Cannot write file in read-ahead mode");
+        return false;
+    }
+
+    DWORD n = 0;
+
+    if (size > UINT_MAX) {
+        size = UINT_MAX;
+    }
+
+    // The file pointer is still updated because the handle is synchronous
+    OVERLAPPED overlapped{};
+    overlapped.Offset = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+    bool ret = priv->funcs->fn_WriteFile(
+        priv->handle,   // hFile
+        buf,            // lpBuffer
+        size,           // nNumberOfBytesToWrite
+        &n,             // lpNumberOfBytesWritten
+        &overlapped     // lpOverlapped
+    );
+
+    if (!ret) {
+        set_error(std::error_code(GetLastError(), std::system_category()),
+                  "Failed to write file");
+        return false;
+    }
+
+    bytes_written = n;
+    return true;
+}
+
 bool Win32File::on_seek(int64_t offset, int whence, uint64_t &new_offset)
 {
     MB_PRIVATE(Win32File);
 
+    if (priv->read_ahead) {
+        return ra_seek(this, priv, offset, whence, new_offset);
+    }
+
     DWORD move_method;
     LARGE_INTEGER pos;
     LARGE_INTEGER new_pos;
@@ -562,6 +1171,12 @@ bool Win32File::on_truncate(uint64_t size)
 {
     MB_PRIVATE(Win32File);
 
+    if (priv->read_ahead) {
+        set_error(make_error_code(FileError::UnsupportedTruncate),
+                  "Cannot truncate file in read-ahead mode");
+        return false;
+    }
+
     bool ret = true;
     uint64_t current_pos;
     uint64_t temp;
@@ -77,6 +77,8 @@ std::string FileErrorCategory::message(int condition) const
         return "seek not supported";
     case FileError::UnsupportedTruncate:
         return "truncate not supported";
+    case FileError::UnsupportedPeek:
+        return "peek not supported";
     case FileError::IntegerOverflow:
         return "integer overflowed";
     case FileError::BadFileFormat:
@@ -102,6 +104,7 @@ FileErrorCategory::default_error_condition(int code) const noexcept
     case FileError::UnsupportedWrite:
     case FileError::UnsupportedSeek:
     case FileError::UnsupportedTruncate:
+    case FileError::UnsupportedPeek:
         return FileError::Unsupported;
     default:
         return std::error_condition(code, *this);
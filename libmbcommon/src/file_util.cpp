@@ -20,15 +20,29 @@
 #include "mbcommon/file_util.h"
 
 #include <algorithm>
+#include <vector>
 
 #include <cerrno>
 #include <cstdio>
 #include <cstring>
 
+#if defined(__SSE2__) && defined(__GNUC__)
+#  include <emmintrin.h>
+#  define HAVE_SSE2_SEARCH 1
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && defined(__GNUC__)
+#  include <arm_neon.h>
+#  define HAVE_NEON_SEARCH 1
+#endif
+
+#include "mbcommon/buffer_pool.h"
 #include "mbcommon/libc/string.h"
 
 #define DEFAULT_BUFFER_SIZE             (8 * 1024 * 1024)
 
+// Maximum number of distinct leading pattern bytes that the vectorized
+// candidate filter compares against in parallel
+#define MAX_VECTOR_NEEDLES              8
+
 /*!
  * \file mbcommon/file_util.h
  * \brief Useful utility functions for File API
@@ -125,6 +139,72 @@ bool file_write_fully(File &file, const void *buf, size_t size,
     return true;
 }
 
+/*!
+ * \brief Write to a File handle from multiple buffers.
+ *
+ * This function differs from File::writev() in that it will call
+ * File::writev() repeatedly until all of the buffers are written or EOF is
+ * reached. If File::writev() fails and the error is std::errc::interrupted,
+ * the write operation will be automatically reattempted.
+ *
+ * \note \p bytes_written is updated with the number of bytes successfully
+ *       written even when this function fails. Take this into account if
+ *       reattempting the write operation.
+ *
+ * \param[in] file File handle
+ * \param[in] iov Array of buffers
+ * \param[in] count Number of elements in \p iov
+ * \param[out] bytes_written Output number of bytes that were written.
+ *
+ * \return Whether some bytes are written
+ */
+bool file_writev_fully(File &file, const FileConstIoVec *iov, size_t count,
+                       size_t &bytes_written)
+{
+    std::vector<FileConstIoVec> remain(iov, iov + count);
+    size_t index = 0;
+    size_t n;
+
+    bytes_written = 0;
+
+    while (true) {
+        // Skip buffers that have been fully written
+        while (index < remain.size() && remain[index].size == 0) {
+            ++index;
+        }
+        if (index == remain.size()) {
+            break;
+        }
+
+        if (!file.writev(remain.data() + index, remain.size() - index, n)) {
+            if (file.error() == std::errc::interrupted) {
+                continue;
+            } else {
+                return false;
+            }
+        } else if (n == 0) {
+            break;
+        }
+
+        bytes_written += n;
+
+        // Advance past the written data
+        while (n > 0) {
+            size_t consumed = std::min(n, remain[index].size);
+            remain[index].data = static_cast<const char *>(
+                    remain[index].data) + consumed;
+            remain[index].size -= consumed;
+            n -= consumed;
+
+            if (remain[index].size == 0) {
+                ++index;
+            }
+        }
+    }
+
+    return true;
+}
+
 /*!
  * \brief Read from a File handle and discard the data.
  *
@@ -190,6 +270,74 @@ bool file_read_discard(File &file, uint64_t size, uint64_t &bytes_discarded)
  *   * #FileSearchAction::Fail if an error occurs
  */
 
+/*! \cond INTERNAL */
+
+/*!
+ * \brief Search file contents exposed via File::peek()
+ *
+ * The view is reacquired after every callback invocation since the callback
+ * is allowed to perform operations that invalidate it.
+ */
+static bool search_in_place(File &file, uint64_t offset, int64_t end,
+                            const void *pattern, size_t pattern_size,
+                            int64_t max_matches,
+                            FileSearchResultCallback result_cb,
+                            void *userdata)
+{
+    const void *data;
+    size_t avail;
+
+    while (true) {
+        if (end >= 0 && offset >= static_cast<uint64_t>(end)) {
+            // Artificial EOF
+            return true;
+        }
+
+        if (!file.peek(offset, SIZE_MAX, data, avail)) {
+            return false;
+        } else if (avail < pattern_size) {
+            // Reached EOF
+            return true;
+        }
+
+        auto base = static_cast<const char *>(data);
+        auto match = static_cast<const char *>(
+                mb_memmem(base, avail, pattern, pattern_size));
+        if (!match) {
+            return true;
+        }
+
+        uint64_t match_offset = offset + static_cast<size_t>(match - base);
+
+        // Stop if match falls outside of ending boundary
+        if (end >= 0 && match_offset + pattern_size
+                > static_cast<uint64_t>(end)) {
+            return true;
+        }
+
+        // Invoke callback
+        auto ret = result_cb(file, userdata, match_offset);
+        if (ret == FileSearchAction::Stop) {
+            // Stop searching early
+            return true;
+        } else if (ret != FileSearchAction::Continue) {
+            return false;
+        }
+
+        if (max_matches > 0) {
+            --max_matches;
+            if (max_matches == 0) {
+                return true;
+            }
+        }
+
+        // We don't do overlapping searches
+        offset = match_offset + pattern_size;
+    }
+}
+
+/*! \endcond */
+
 /*!
  * \brief Search file for binary sequence
  *
@@ -200,6 +348,9 @@ bool file_read_discard(File &file, uint64_t size, uint64_t &bytes_discarded)
  * 2 * \p pattern_size would exceed the maximum value of a `size_t`, `SIZE_MAX`
  * will be used.
  *
+ * If \p file supports File::peek() (eg. MmapFile or MemoryFile), the file
+ * contents are scanned in place and no buffer is allocated.
+ *
  * If \p file does not support seeking, then the file position must be set to
  * the beginning of the file before calling this function. Instead of seeking,
  * the function will read and discard any data before \p start.
@@ -231,7 +382,7 @@ bool file_search(File &file, int64_t start, int64_t end,
                  FileSearchResultCallback result_cb,
                  void *userdata)
 {
-    std::unique_ptr<char, decltype(free) *> buf(nullptr, &free);
+    IoBuffer buf;
     size_t buf_size;
     char *ptr;
     size_t ptr_remain;
@@ -272,19 +423,33 @@ bool file_search(File &file, int64_t start, int64_t end,
         return false;
     }
 
-    buf.reset(static_cast<char *>(malloc(buf_size)));
-    if (!buf) {
-        file.set_error(std::error_code(errno, std::generic_category()),
-                       "Failed to allocate buffer");
-        return false;
-    }
-
     if (start >= 0) {
         offset = start;
     } else {
         offset = 0;
     }
 
+    // Scan the file contents in place if the handle can expose them directly
+    {
+        const void *data;
+        size_t avail;
+
+        if (file.peek(offset, SIZE_MAX, data, avail)) {
+            return search_in_place(file, offset, end, pattern, pattern_size,
+                                   max_matches, result_cb, userdata);
+        } else if (file.error() != FileError::Unsupported) {
+            return false;
+        }
+    }
+
+    if (!buf.allocate(buf_size)) {
+        file.set_error(std::error_code(errno, std::generic_category()),
+                       "Failed to allocate buffer");
+        return false;
+    }
+
+    char *base = buf.data<char>();
+
     // Seek to starting point
     if (!file.seek(offset, SEEK_SET, nullptr)) {
         if (file.error() == FileError::Unsupported) {
@@ -303,7 +468,7 @@ bool file_search(File &file, int64_t start, int64_t end,
     }
 
     // Initially read to beginning of buffer
-    ptr = buf.get();
+    ptr = base;
     ptr_remain = buf_size;
 
     while (true) {
@@ -312,7 +477,7 @@ bool file_search(File &file, int64_t start, int64_t end,
         }
 
         // Number of available bytes in buf
-        n += ptr - buf.get();
+        n += ptr - base;
 
         if (n < pattern_size) {
             // Reached EOF
@@ -331,19 +496,19 @@ bool file_search(File &file, int64_t start, int64_t end,
         }
 
         // Search from beginning of buffer
-        match = buf.get();
+        match = base;
         match_remain = n;
 
         while ((match = static_cast<char *>(
                 mb_memmem(match, match_remain, pattern, pattern_size)))) {
             // Stop if match falls outside of ending boundary
-            if (end >= 0 && offset + match - buf.get() + pattern_size
+            if (end >= 0 && offset + match - base + pattern_size
                     > static_cast<uint64_t>(end)) {
                 return true;
             }
 
             // Invoke callback
-            auto ret = result_cb(file, userdata, offset + match - buf.get());
+            auto ret = result_cb(file, userdata, offset + match - base);
             if (ret == FileSearchAction::Stop) {
                 // Stop searching early
                 return true;
@@ -361,7 +526,7 @@ bool file_search(File &file, int64_t start, int64_t end,
             // We don't do overlapping searches
             if (match_remain >= pattern_size) {
                 match += pattern_size;
-                match_remain = n - (match - buf.get());
+                match_remain = n - (match - base);
             } else {
                 break;
             }
@@ -371,8 +536,8 @@ bool file_search(File &file, int64_t start, int64_t end,
         // beginning. We will move fewer than pattern_size - 1 bytes if there
         // was a match close to the end.
         size_t to_move = std::min(match_remain, pattern_size - 1);
-        memmove(buf.get(), buf.get() + n - to_move, to_move);
-        ptr = buf.get() + to_move;
+        memmove(base, base + n - to_move, to_move);
+        ptr = base + to_move;
         ptr_remain = buf_size - to_move;
         offset += n - to_move;
     }
@@ -380,125 +545,452 @@ bool file_search(File &file, int64_t start, int64_t end,
     return true;
 }
 
+/*! \cond INTERNAL */
+
+struct MultiSearchState
+{
+    const FileSearchPattern *patterns;
+    size_t patterns_count;
+    // Size of the largest pattern
+    size_t max_size;
+    // Whether a byte value is the first byte of any pattern
+    bool is_first[256];
+    // Distinct first bytes of all patterns
+    unsigned char needles[256];
+    size_t needles_count;
+    // Offset at which each pattern may match next (no overlapping matches)
+    std::vector<uint64_t> next_offset;
+};
+
+static bool multi_search_init(MultiSearchState &ms,
+                              const FileSearchPattern *patterns,
+                              size_t patterns_count)
+{
+    ms.patterns = patterns;
+    ms.patterns_count = patterns_count;
+    ms.max_size = 0;
+    ms.needles_count = 0;
+    ms.next_offset.assign(patterns_count, 0);
+    memset(ms.is_first, 0, sizeof(ms.is_first));
+
+    for (size_t i = 0; i < patterns_count; ++i) {
+        if (patterns[i].size == 0) {
+            continue;
+        }
+
+        auto c = *static_cast<const unsigned char *>(patterns[i].data);
+        if (!ms.is_first[c]) {
+            ms.is_first[c] = true;
+            ms.needles[ms.needles_count++] = c;
+        }
+
+        ms.max_size = std::max(ms.max_size, patterns[i].size);
+    }
+
+    return ms.max_size > 0;
+}
+
 /*!
- * \brief Move data in file
+ * \brief Find the next position in [\p pos, \p limit) whose byte is the first
+ *        byte of some pattern
  *
- * This function is equivalent to `memmove()`, except it operates on a File
- * handle. The source and destination regions can overlap. In the degenerate
- * case where \p src == \p dest or \p size == 0, no operation will be performed,
- * but the function will return true and set \p size_moved accordingly.
+ * \return Candidate position or \p limit if there are no candidates
+ */
+static size_t multi_search_find_candidate(const MultiSearchState &ms,
+                                          const unsigned char *buf,
+                                          size_t pos, size_t limit)
+{
+    if (ms.needles_count == 1) {
+        auto ptr = static_cast<const unsigned char *>(
+                memchr(buf + pos, ms.needles[0], limit - pos));
+        return ptr ? static_cast<size_t>(ptr - buf) : limit;
+    }
+
+#if defined(HAVE_SSE2_SEARCH)
+    if (ms.needles_count <= MAX_VECTOR_NEEDLES) {
+        __m128i needles[MAX_VECTOR_NEEDLES];
+        for (size_t i = 0; i < ms.needles_count; ++i) {
+            needles[i] = _mm_set1_epi8(static_cast<char>(ms.needles[i]));
+        }
+
+        for (; limit - pos >= 16; pos += 16) {
+            __m128i chunk = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(buf + pos));
+            __m128i eq = _mm_cmpeq_epi8(chunk, needles[0]);
+            for (size_t i = 1; i < ms.needles_count; ++i) {
+                eq = _mm_or_si128(eq, _mm_cmpeq_epi8(chunk, needles[i]));
+            }
+
+            int mask = _mm_movemask_epi8(eq);
+            if (mask != 0) {
+                return pos + static_cast<size_t>(__builtin_ctz(mask));
+            }
+        }
+    }
+#elif defined(HAVE_NEON_SEARCH)
+    if (ms.needles_count <= MAX_VECTOR_NEEDLES) {
+        uint8x16_t needles[MAX_VECTOR_NEEDLES];
+        for (size_t i = 0; i < ms.needles_count; ++i) {
+            needles[i] = vdupq_n_u8(ms.needles[i]);
+        }
+
+        for (; limit - pos >= 16; pos += 16) {
+            uint8x16_t chunk = vld1q_u8(buf + pos);
+            uint8x16_t eq = vceqq_u8(chunk, needles[0]);
+            for (size_t i = 1; i < ms.needles_count; ++i) {
+                eq = vorrq_u8(eq, vceqq_u8(chunk, needles[i]));
+            }
+
+            uint64x2_t eq64 = vreinterpretq_u64_u8(eq);
+            if ((vgetq_lane_u64(eq64, 0) | vgetq_lane_u64(eq64, 1)) != 0) {
+                // Locate the exact position with the scalar loop below
+                break;
+            }
+        }
+    }
+#endif
+
+    for (; pos < limit; ++pos) {
+        if (ms.is_first[buf[pos]]) {
+            return pos;
+        }
+    }
+
+    return limit;
+}
+
+/*!
+ * \brief Find the next match that starts in [\p pos, \p limit)
+ *
+ * Only patterns that fit entirely within the first \p n bytes of \p buf are
+ * verified. \p base_offset is the file offset of \p buf.
+ */
+static bool multi_search_find_match(const MultiSearchState &ms,
+                                    const unsigned char *buf, size_t n,
+                                    uint64_t base_offset,
+                                    size_t pos, size_t limit,
+                                    size_t &match_pos, size_t &match_index)
+{
+    while ((pos = multi_search_find_candidate(ms, buf, pos, limit)) < limit) {
+        for (size_t i = 0; i < ms.patterns_count; ++i) {
+            auto const &pattern = ms.patterns[i];
+            auto data = static_cast<const unsigned char *>(pattern.data);
+
+            if (pattern.size == 0 || pattern.size > n - pos
+                    || data[0] != buf[pos]
+                    || base_offset + pos < ms.next_offset[i]) {
+                continue;
+            }
+
+            if (memcmp(buf + pos, data, pattern.size) == 0) {
+                match_pos = pos;
+                match_index = i;
+                return true;
+            }
+        }
+
+        ++pos;
+    }
+
+    return false;
+}
+
+/*! \endcond */
+
+/*!
+ * \typedef FileSearchMultiResultCallback
  *
- * \note This function is very seek-heavy and may be slow if the handle cannot
- *       seek efficiently. It will perform two seeks per loop interation. Each
- *       iteration moves up to 10240 bytes.
+ * \brief Search result callback for file_search_multi()
  *
- * \note If \p *size_moved is less than \p size, then the *first* \p *size_moved
- *       bytes have been copied from offset \p src to offset \p dest. This is
- *       true even if \p src \< \p dest, resulting in a backwards copy.
+ * The same restrictions as FileSearchResultCallback apply.
  *
- * \param[in] file File handle
- * \param[in] src Source offset
- * \param[in] dest Destination offset
- * \param[in] size Size of data to move
- * \param[out] size_moved Pointer to store size of data that is moved
+ * \sa file_search_multi()
  *
- * \return Whether data is successfully moved
+ * \param file File handle
+ * \param userdata User callback data
+ * \param index Index of the matched pattern in the pattern array
+ * \param offset File offset of search result
+ *
+ * \return
+ *   * #FileSearchAction::Continue to continue search
+ *   * #FileSearchAction::Stop to stop search, but have file_search_multi()
+ *     report a successful result
+ *   * #FileSearchAction::Fail if an error occurs
  */
-bool file_move(File &file, uint64_t src, uint64_t dest, uint64_t size,
-               uint64_t &size_moved)
+
+/*!
+ * \brief Search file for multiple binary sequences in a single pass
+ *
+ * This function behaves like file_search(), except that every pattern in
+ * \p patterns is searched for at the same time and each byte of the file is
+ * read only once. Candidate positions are located by comparing against the
+ * first byte of every pattern (vectorized on SSE2 and NEON capable targets)
+ * and are then verified against the full patterns.
+ *
+ * Matches are reported in order of increasing file offset. If multiple
+ * patterns match at the same offset, they are reported in the order that they
+ * appear in \p patterns. As with file_search(), matches of the same pattern do
+ * not overlap, but matches of different patterns may. Empty patterns are
+ * ignored.
+ *
+ * If \p bsize is zero, then the larger of 8 MiB and 2 * the size of the
+ * largest pattern will be used. Otherwise, \p bsize must not be smaller than
+ * the largest pattern.
+ *
+ * \param file File handle
+ * \param start Start offset or negative number for beginning of file
+ * \param end End offset or negative number for end of file
+ * \param bsize Buffer size or 0 to automatically choose a size
+ * \param patterns Array of patterns to search
+ * \param patterns_count Number of elements in \p patterns
+ * \param max_matches Maximum number of matches (of all patterns) or -1 to find
+ *                    all matches
+ * \param result_cb Callback to invoke upon finding a match
+ * \param userdata User callback data
+ *
+ * \return Whether the search completes successfully
+ */
+bool file_search_multi(File &file, int64_t start, int64_t end,
+                       size_t bsize, const FileSearchPattern *patterns,
+                       size_t patterns_count, int64_t max_matches,
+                       FileSearchMultiResultCallback result_cb,
+                       void *userdata)
 {
-    char buf[10240];
-    size_t n_read;
-    size_t n_written;
+    IoBuffer buf;
+    MultiSearchState ms;
+    size_t buf_size;
+    unsigned char *ptr;
+    size_t ptr_remain;
+    size_t match_pos;
+    size_t match_index;
+    uint64_t offset;
+    size_t n;
+
+    // Check boundaries
+    if (start >= 0 && end >= 0 && end < start) {
+        file.set_error(make_error_code(FileError::InvalidArgument),
+                       "End offset < start offset");
+        return false;
+    }
 
-    // Check if we need to do anything
-    if (src == dest || size == 0) {
-        size_moved = size;
+    // Trivial case
+    if (max_matches == 0
+            || !multi_search_init(ms, patterns, patterns_count)) {
         return true;
     }
 
-    if (src > UINT64_MAX - size || dest > UINT64_MAX - size) {
+    // Compute buffer size
+    if (bsize != 0) {
+        buf_size = bsize;
+    } else {
+        buf_size = DEFAULT_BUFFER_SIZE;
+
+        if (ms.max_size > SIZE_MAX / 2) {
+            buf_size = SIZE_MAX;
+        } else {
+            buf_size = std::max(buf_size, ms.max_size * 2);
+        }
+    }
+
+    // Ensure buffer is large enough
+    if (buf_size < ms.max_size) {
         file.set_error(make_error_code(FileError::InvalidArgument),
-                       "Offset + size overflows integer");
+                       "Buffer size cannot be less than pattern size");
         return false;
     }
 
-    size_moved = 0;
+    if (start >= 0) {
+        offset = start;
+    } else {
+        offset = 0;
+    }
 
-    if (dest < src) {
-        // Copy forwards
-        while (size_moved < size) {
-            size_t to_read = std::min<uint64_t>(
-                    sizeof(buf), size - size_moved);
+    // Scan the file contents in place if the handle can expose them directly
+    {
+        const void *data;
+        size_t avail;
+
+        if (file.peek(offset, SIZE_MAX, data, avail)) {
+            while (true) {
+                if (end >= 0) {
+                    if (offset >= static_cast<uint64_t>(end)) {
+                        return true;
+                    }
+                    avail = std::min<uint64_t>(
+                            avail, static_cast<uint64_t>(end) - offset);
+                }
 
-            // Seek to source offset
-            if (!file.seek(src + size_moved, SEEK_SET, nullptr)) {
-                return false;
-            }
+                if (!multi_search_find_match(
+                        ms, static_cast<const unsigned char *>(data), avail,
+                        offset, 0, avail, match_pos, match_index)) {
+                    return true;
+                }
 
-            // Read data from source
-            if (!file_read_fully(file, buf, to_read, n_read)) {
-                return false;
-            } else if (n_read == 0) {
-                break;
-            }
+                offset += match_pos;
 
-            // Seek to destination offset
-            if (!file.seek(dest + size_moved, SEEK_SET, nullptr)) {
-                return false;
-            }
+                auto ret = result_cb(file, userdata, match_index, offset);
+                if (ret == FileSearchAction::Stop) {
+                    return true;
+                } else if (ret != FileSearchAction::Continue) {
+                    return false;
+                }
 
-            // Write data to destination
-            if (!file_write_fully(file, buf, n_read, n_written)) {
-                return false;
-            }
+                if (max_matches > 0) {
+                    --max_matches;
+                    if (max_matches == 0) {
+                        return true;
+                    }
+                }
 
-            size_moved += n_written;
+                ms.next_offset[match_index] =
+                        offset + patterns[match_index].size;
 
-            if (n_written < n_read) {
-                break;
+                // Reacquire the view since the callback may have invalidated it
+                if (!file.peek(offset, SIZE_MAX, data, avail)) {
+                    return false;
+                }
             }
+        } else if (file.error() != FileError::Unsupported) {
+            return false;
         }
-    } else {
-        // Copy backwards
-        while (size_moved < size) {
-            size_t to_read = std::min<uint64_t>(
-                    sizeof(buf), size - size_moved);
-
-            // Seek to source offset
-            if (!file.seek(src + size - size_moved - to_read, SEEK_SET,
-                           nullptr)) {
+    }
+
+    if (!buf.allocate(buf_size)) {
+        file.set_error(std::error_code(errno, std::generic_category()),
+                       "Failed to allocate buffer");
+        return false;
+    }
+
+    unsigned char *base = buf.data();
+
+    // Seek to starting point
+    if (!file.seek(offset, SEEK_SET, nullptr)) {
+        if (file.error() == FileError::Unsupported) {
+            uint64_t discarded;
+            if (!file_read_discard(file, offset, discarded)) {
+                return false;
+            } else if (discarded != offset) {
+                file.set_error(make_error_code(FileError::InvalidArgument),
+                               "Reached EOF before starting offset");
+                file.set_fatal(true);
                 return false;
             }
+        } else {
+            return false;
+        }
+    }
 
-            // Read data form source
-            if (!file_read_fully(file, buf, to_read, n_read)) {
-                return false;
-            } else if (n_read == 0) {
-                break;
+    // Initially read to beginning of buffer
+    ptr = base;
+    ptr_remain = buf_size;
+
+    while (true) {
+        if (!file_read_fully(file, ptr, ptr_remain, n)) {
+            return false;
+        }
+
+        // A short read indicates EOF
+        bool eof = n < ptr_remain;
+
+        // Number of available bytes in buf
+        n += ptr - base;
+
+        if (end >= 0) {
+            if (offset >= static_cast<uint64_t>(end)) {
+                // Artificial EOF
+                return true;
+            } else if (n > static_cast<uint64_t>(end) - offset) {
+                n = static_cast<uint64_t>(end) - offset;
+                eof = true;
             }
+        }
+
+        // Ensure that offset + n cannot overflow
+        if (n > UINT64_MAX - offset) {
+            file.set_error(make_error_code(FileError::IntegerOverflow),
+                           "Read overflows offset value");
+            return false;
+        }
+
+        // Unless we've reached EOF, only scan positions where every pattern
+        // can be fully verified. The rest are scanned after the next read.
+        size_t limit;
+        if (eof) {
+            limit = n;
+        } else {
+            limit = n - ms.max_size + 1;
+        }
+
+        size_t pos = 0;
 
-            // Seek to destination offset
-            if (!file.seek(dest + size - size_moved - n_read, SEEK_SET,
-                           nullptr)) {
+        while (multi_search_find_match(ms, base, n, offset, pos, limit,
+                                       match_pos, match_index)) {
+            auto ret = result_cb(file, userdata, match_index,
+                                 offset + match_pos);
+            if (ret == FileSearchAction::Stop) {
+                return true;
+            } else if (ret != FileSearchAction::Continue) {
                 return false;
             }
 
-            // Write data to destination
-            if (!file_write_fully(file, buf, n_read, n_written)) {
-                return false;
+            if (max_matches > 0) {
+                --max_matches;
+                if (max_matches == 0) {
+                    return true;
+                }
             }
 
-            size_moved += n_written;
+            ms.next_offset[match_index] =
+                    offset + match_pos + patterns[match_index].size;
+            pos = match_pos;
+        }
 
-            if (n_written < n_read) {
-                // Hit EOF. Subtract bytes beyond EOF that we can't copy
-                size -= n_read - n_written;
-            }
+        if (eof) {
+            return true;
         }
+
+        // Move the unscanned bytes to the beginning of the buffer
+        size_t to_move = n - limit;
+        memmove(base, base + limit, to_move);
+        ptr = base + to_move;
+        ptr_remain = buf_size - to_move;
+        offset += limit;
     }
 
     return true;
 }
 
+/*!
+ * \brief Move data in file
+ *
+ * This function is equivalent to `memmove()`, except it operates on a File
+ * handle. The source and destination regions can overlap. In the degenerate
+ * case where \p src == \p dest or \p size == 0, no operation will be performed,
+ * but the function will return true and set \p size_moved accordingly.
+ *
+ * \note This is a wrapper around File::move(), which uses the most efficient
+ *       method supported by the backend. MemoryFile moves the data in memory
+ *       and FdFile lets the kernel copy non-overlapping regions. Other backends
+ *       copy up to 1 MiB per iteration with File::read_at() and
+ *       File::write_at(), which may be slow if the handle cannot seek
+ *       efficiently.
+ *
+ * \note If \p *size_moved is less than \p size, then the *first* \p *size_moved
+ *       bytes have been copied from offset \p src to offset \p dest. This is
+ *       true even if \p src \< \p dest, resulting in a backwards copy.
+ *
+ * \param[in] file File handle
+ * \param[in] src Source offset
+ * \param[in] dest Destination offset
+ * \param[in] size Size of data to move
+ * \param[out] size_moved Pointer to store size of data that is moved
+ *
+ * \return Whether data is successfully moved
+ */
+bool file_move(File &file, uint64_t src, uint64_t dest, uint64_t size,
+               uint64_t &size_moved)
+{
+    return file.move(src, dest, size, size_moved);
+}
+
 }
@@ -19,6 +19,8 @@
 
 #include "mbcommon/string.h"
 
+#include <vector>
+
 #include <cerrno>
 #include <climits>
 #include <cstdint>
@@ -96,6 +98,10 @@ MB_END_C_DECLS
 namespace mb
 {
 
+// Size of the stack buffer that append_format_v() tries first. This fits
+// almost every log message and error string.
+#define FORMAT_STACK_BUF_SIZE   256
+
 // No wide-character version of the format functions is provided because it's
 // impossible to portably create an appropriately sized buffer with swprintf().
 // Passing 0 as the length does not work and not every
@@ -175,6 +181,86 @@ std::string format(const char *fmt, ...)
  * \return Whether the format string was successfully processed.
  */
 bool format_v(std::string &out, const char *fmt, va_list ap)
+{
+    out.clear();
+    return append_format_v(out, fmt, ap);
+}
+
+/*!
+ * \brief Format a string using a `va_list`
+ *
+ * \note This uses the `*printf()` family of functions in the system's C
+ *       library. The format string may not be understood the same way by every
+ *       platform.
+ *
+ * \note The value of `errno` and `GetLastError()` (on Win32) are preserved if
+ *       this function does not fail.
+ *
+ * \param fmt Format string
+ * \param ap Format arguments as `va_list`
+ *
+ * \return Resulting formatted string.
+ * \throws std::exception If an error occurs while formatting the string.
+ */
+std::string format_v(const char *fmt, va_list ap)
+{
+    std::string result;
+    // TODO: This should use exceptions to report errors, but we currently don't
+    // support them due to the substantial size increase of the compiled
+    // binaries.
+    format_v(result, fmt, ap);
+    return result;
+}
+
+/*!
+ * \brief Append a formatted string to a string
+ *
+ * \note This uses the `*printf()` family of functions in the system's C
+ *       library. The format string may not be understood the same way by every
+ *       platform.
+ *
+ * \note The value of `errno` and `GetLastError()` (on Win32) are preserved if
+ *       this function does not fail.
+ *
+ * \param[in,out] out Reference to string to append to. If this function fails,
+ *                    the string is left unchanged.
+ * \param[in] fmt Format string
+ * \param[in] ... Format arguments
+ *
+ * \return Whether the format string was successfully processed.
+ */
+bool append_format(std::string &out, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    bool result = append_format_v(out, fmt, ap);
+    va_end(ap);
+
+    return result;
+}
+
+/*!
+ * \brief Append a formatted string to a string using a `va_list`
+ *
+ * The output is formatted into a stack buffer first. `vsnprintf()` is only
+ * called a second time, directly into \p out, if the output does not fit.
+ *
+ * \note This uses the `*printf()` family of functions in the system's C
+ *       library. The format string may not be understood the same way by every
+ *       platform.
+ *
+ * \note The value of `errno` and `GetLastError()` (on Win32) are preserved if
+ *       this function does not fail.
+ *
+ * \param[in,out] out Reference to string to append to. If this function fails,
+ *                    the string is left unchanged.
+ * \param[in] fmt Format string
+ * \param[in] ap Format arguments as `va_list`
+ *
+ * \return Whether the format string was successfully processed.
+ */
+bool append_format_v(std::string &out, const char *fmt, va_list ap)
 {
     static_assert(INT_MAX <= SIZE_MAX, "INT_MAX > SIZE_MAX");
 
@@ -184,6 +270,7 @@ bool format_v(std::string &out, const char *fmt, va_list ap)
 #endif
     int ret;
     va_list copy;
+    char buf[FORMAT_STACK_BUF_SIZE];
 
     saved_errno = errno;
 #ifdef _WIN32
@@ -191,28 +278,35 @@ bool format_v(std::string &out, const char *fmt, va_list ap)
 #endif
 
     va_copy(copy, ap);
-    ret = vsnprintf(nullptr, 0, fmt, copy);
+    ret = vsnprintf(buf, sizeof(buf), fmt, copy);
     va_end(copy);
 
     if (ret < 0 || ret == INT_MAX) {
         return false;
     }
 
-    // C++11 guarantees that the memory is contiguous, but does not guarantee
-    // that the internal buffer is NULL-terminated, so we'll make room for '\0'
-    // and then get rid of it.
-    out.resize(ret + 1);
+    if (static_cast<size_t>(ret) < sizeof(buf)) {
+        out.append(buf, static_cast<size_t>(ret));
+    } else {
+        size_t old_size = out.size();
 
-    va_copy(copy, ap);
-    // NOTE: Change `&out[0]` to `out.data()` once we target C++17.
-    ret = vsnprintf(&out[0], out.size(), fmt, copy);
-    va_end(copy);
+        // C++11 guarantees that the memory is contiguous, but does not
+        // guarantee that the internal buffer is NULL-terminated, so we'll make
+        // room for '\0' and then get rid of it.
+        out.resize(old_size + static_cast<size_t>(ret) + 1);
 
-    if (ret < 0) {
-        return false;
-    }
+        va_copy(copy, ap);
+        // NOTE: Change `&out[0]` to `out.data()` once we target C++17.
+        ret = vsnprintf(&out[old_size], out.size() - old_size, fmt, copy);
+        va_end(copy);
 
-    out.resize(ret);
+        if (ret < 0) {
+            out.resize(old_size);
+            return false;
+        }
+
+        out.resize(old_size + static_cast<size_t>(ret));
+    }
 
     // Restore errno and Win32 error on success
     errno = saved_errno;
@@ -223,32 +317,6 @@ bool format_v(std::string &out, const char *fmt, va_list ap)
     return true;
 }
 
-/*!
- * \brief Format a string using a `va_list`
- *
- * \note This uses the `*printf()` family of functions in the system's C
- *       library. The format string may not be understood the same way by every
- *       platform.
- *
- * \note The value of `errno` and `GetLastError()` (on Win32) are preserved if
- *       this function does not fail.
- *
- * \param fmt Format string
- * \param ap Format arguments as `va_list`
- *
- * \return Resulting formatted string.
- * \throws std::exception If an error occurs while formatting the string.
- */
-std::string format_v(const char *fmt, va_list ap)
-{
-    std::string result;
-    // TODO: This should use exceptions to report errors, but we currently don't
-    // support them due to the substantial size increase of the compiled
-    // binaries.
-    format_v(result, fmt, ap);
-    return result;
-}
-
 /*!
  * \brief Check if string has prefix (allows non-NULL-terminated strings)
  *        (case sensitive)
@@ -835,4 +903,283 @@ int str_replace(char **str, const char *from, const char *to,
                        from, strlen(from), to, strlen(to), n, n_replaced);
 }
 
+struct ReplaceMatch
+{
+    size_t pos;
+    size_t index;
+};
+
+/*!
+ * \brief Find all non-overlapping matches of several byte sequences
+ *
+ * The buffer is scanned once from left to right. At each position, the first
+ * entry in \p replacements that matches wins. Candidate positions are found
+ * by the first byte of each pattern, with `memchr()` if all patterns start with
+ * the same byte (eg. `@VARIABLE@` placeholders).
+ *
+ * \return Whether the size of the output fits in a `size_t`. If not, `errno`
+ *         is set to `EOVERFLOW`.
+ */
+static bool find_replace_matches(const char *data, size_t size,
+                                 const MemReplacement *replacements,
+                                 size_t count,
+                                 std::vector<ReplaceMatch> &matches,
+                                 size_t &new_size)
+{
+    bool first_bytes[UCHAR_MAX + 1] = {};
+    size_t distinct = 0;
+    unsigned char only_byte = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (replacements[i].from_size == 0) {
+            continue;
+        }
+
+        auto c = *static_cast<const unsigned char *>(replacements[i].from);
+        if (!first_bytes[c]) {
+            first_bytes[c] = true;
+            only_byte = c;
+            ++distinct;
+        }
+    }
+
+    matches.clear();
+    new_size = size;
+
+    if (distinct == 0) {
+        return true;
+    }
+
+    size_t pos = 0;
+
+    while (pos < size) {
+        if (distinct == 1) {
+            auto ptr = static_cast<const char *>(
+                    memchr(data + pos, only_byte, size - pos));
+            if (!ptr) {
+                break;
+            }
+            pos = static_cast<size_t>(ptr - data);
+        } else {
+            while (pos < size
+                    && !first_bytes[static_cast<unsigned char>(data[pos])]) {
+                ++pos;
+            }
+            if (pos == size) {
+                break;
+            }
+        }
+
+        size_t remain = size - pos;
+        size_t i = 0;
+
+        for (; i < count; ++i) {
+            auto const &r = replacements[i];
+            if (r.from_size > 0 && r.from_size <= remain
+                    && memcmp(data + pos, r.from, r.from_size) == 0) {
+                break;
+            }
+        }
+
+        if (i == count) {
+            ++pos;
+            continue;
+        }
+
+        auto const &r = replacements[i];
+
+        // The match lies within the part of the input that hasn't been
+        // consumed yet, so this can't underflow
+        new_size -= r.from_size;
+        if (new_size > SIZE_MAX - r.to_size) {
+            errno = EOVERFLOW;
+            return false;
+        }
+        new_size += r.to_size;
+
+        matches.push_back({ pos, i });
+        pos += r.from_size;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Build output of a multi-pattern replacement
+ *
+ * \p out must have room for the size computed by find_replace_matches().
+ */
+static void build_replace_output(char *out, const char *data, size_t size,
+                                 const MemReplacement *replacements,
+                                 const std::vector<ReplaceMatch> &matches)
+{
+    void *target_ptr = out;
+    size_t pos = 0;
+
+    for (auto const &m : matches) {
+        auto const &r = replacements[m.index];
+
+        // Copy data left of the match
+        target_ptr = _mb_mempcpy(target_ptr, data + pos, m.pos - pos);
+
+        // Copy replacement
+        target_ptr = _mb_mempcpy(target_ptr, r.to, r.to_size);
+
+        pos = m.pos + r.from_size;
+    }
+
+    // Copy remainder
+    _mb_mempcpy(target_ptr, data + pos, size - pos);
+}
+
+static std::vector<MemReplacement>
+to_mem_replacements(const StrReplacement *replacements, size_t count)
+{
+    std::vector<MemReplacement> result;
+    result.reserve(count);
+
+    for (size_t i = 0; i < count; ++i) {
+        result.push_back({
+            replacements[i].from, strlen(replacements[i].from),
+            replacements[i].to, strlen(replacements[i].to),
+        });
+    }
+
+    return result;
+}
+
+/*!
+ * \brief Replace several byte sequences in a byte sequence in a single pass
+ *
+ * Replace every occurrence of each (`from`, `from_size`) in \p replacements
+ * with the corresponding (`to`, `to_size`) in (\p *mem, \p *mem_size). The
+ * input is scanned once and the output is allocated once, so this is faster
+ * than calling mem_replace() for each pair. Unlike a chain of mem_replace()
+ * calls, replacement data is never rescanned for matches. If several patterns
+ * match at the same position, the one that appears first in \p replacements
+ * is used. Entries with an empty `from` never match.
+ *
+ * If the function succeeds, \p *mem will be passed to `free()` and \p *mem and
+ * \p *mem_size will be updated to point to the newly allocated block of memory
+ * and its size. If \p n_replaced is not NULL, the total number of replacements
+ * done will be stored at the value pointed by \p n_replaced. If the function
+ * fails, \p *mem will be left unchanged.
+ *
+ * \param[in,out] mem Pointer to byte sequence to modify
+ * \param[in,out] mem_size Pointer to size of bytes sequence to modify
+ * \param[in] replacements Array of patterns and their replacements
+ * \param[in] count Number of elements in \p replacements
+ * \param[out] n_replaced Pointer to store number of replacements made
+ *
+ * \return
+ *   * 0 if successful
+ *   * -1 if an error occurred, with `errno` set accordingly
+ */
+int mem_replace_multi(void **mem, size_t *mem_size,
+                      const MemReplacement *replacements,
+                      size_t count, size_t *n_replaced)
+{
+    auto data = static_cast<const char *>(*mem);
+    std::vector<ReplaceMatch> matches;
+    size_t new_size;
+
+    if (!find_replace_matches(data, *mem_size, replacements, count,
+                              matches, new_size)) {
+        return -1;
+    }
+
+    char *buf = nullptr;
+
+    if (new_size > 0) {
+        buf = static_cast<char *>(malloc(new_size));
+        if (!buf) {
+            return -1;
+        }
+
+        build_replace_output(buf, data, *mem_size, replacements, matches);
+    }
+
+    free(*mem);
+    *mem = buf;
+    *mem_size = new_size;
+
+    if (n_replaced) {
+        *n_replaced = matches.size();
+    }
+
+    return 0;
+}
+
+/*!
+ * \brief Replace several strings in a string in a single pass
+ *
+ * Replace every occurrence of each `from` in \p replacements with the
+ * corresponding `to` in \p *str. See mem_replace_multi() for how overlapping
+ * matches are handled. If the function succeeds, \p *str will be passed to
+ * `free()` and \p *str will be updated to point to the newly allocated string.
+ * If \p n_replaced is not NULL, the total number of replacements done will be
+ * stored at the value pointed by \p n_replaced. If the function fails, \p *str
+ * will be left unchanged.
+ *
+ * \param[in,out] str Pointer to string to modify
+ * \param[in] replacements Array of strings and their replacements
+ * \param[in] count Number of elements in \p replacements
+ * \param[out] n_replaced Pointer to store number of replacements made
+ *
+ * \return
+ *   * 0 if successful
+ *   * -1 if an error occurred, with `errno` set accordingly
+ */
+int str_replace_multi(char **str, const StrReplacement *replacements,
+                      size_t count, size_t *n_replaced)
+{
+    size_t str_size = strlen(*str) + 1;
+    auto mem_replacements = to_mem_replacements(replacements, count);
+
+    return mem_replace_multi(reinterpret_cast<void **>(str), &str_size,
+                             mem_replacements.data(), mem_replacements.size(),
+                             n_replaced);
+}
+
+/*!
+ * \brief Replace several strings in a string in a single pass
+ *
+ * Same as str_replace_multi(char **, const StrReplacement *, size_t, size_t *),
+ * but for a `std::string`. The result is built in a single allocation and is
+ * then swapped into \p str.
+ *
+ * \param[in,out] str String to modify
+ * \param[in] replacements Array of strings and their replacements
+ * \param[in] count Number of elements in \p replacements
+ * \param[out] n_replaced Pointer to store number of replacements made
+ *
+ * \return Whether the replacements were successful. If false, `errno` is set
+ *         accordingly and \p str is left unchanged.
+ */
+bool str_replace_multi(std::string &str, const StrReplacement *replacements,
+                       size_t count, size_t *n_replaced)
+{
+    auto mem_replacements = to_mem_replacements(replacements, count);
+    std::vector<ReplaceMatch> matches;
+    size_t new_size;
+
+    if (!find_replace_matches(str.data(), str.size(), mem_replacements.data(),
+                              mem_replacements.size(), matches, new_size)) {
+        return false;
+    }
+
+    if (!matches.empty()) {
+        std::string result(new_size, '\0');
+        build_replace_output(&result[0], str.data(), str.size(),
+                             mem_replacements.data(), matches);
+        str.swap(result);
+    }
+
+    if (n_replaced) {
+        *n_replaced = matches.size();
+    }
+
+    return true;
+}
+
 }
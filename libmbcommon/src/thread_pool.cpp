@@ -0,0 +1,745 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbcommon/thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <cstdint>
+#include <cstdio>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/*!
+ * \file mbcommon/thread_pool.h
+ * \brief Process-wide work-stealing thread pool
+ */
+
+namespace mb
+{
+
+/*! \cond INTERNAL */
+
+#ifdef __linux__
+
+struct CpuTopology
+{
+    // Whether the CPUs have different maximum frequencies (eg. big.LITTLE)
+    bool heterogeneous;
+    cpu_set_t any;
+    cpu_set_t performance;
+    cpu_set_t efficiency;
+};
+
+static bool read_max_freq(int cpu, unsigned long &freq)
+{
+    char path[64];
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%d/cpufreq/cpuinfo_max_freq", cpu);
+
+    FILE *fp = fopen(path, "re");
+    if (!fp) {
+        return false;
+    }
+
+    bool ret = fscanf(fp, "%lu", &freq) == 1;
+    fclose(fp);
+    return ret;
+}
+
+static CpuTopology load_cpu_topology()
+{
+    CpuTopology topology;
+    topology.heterogeneous = false;
+    CPU_ZERO(&topology.any);
+    CPU_ZERO(&topology.performance);
+    CPU_ZERO(&topology.efficiency);
+
+    if (sched_getaffinity(0, sizeof(topology.any), &topology.any) < 0) {
+        return topology;
+    }
+
+    std::vector<std::pair<int, unsigned long>> freqs;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &topology.any)) {
+            continue;
+        }
+
+        unsigned long freq;
+        if (!read_max_freq(cpu, freq)) {
+            // Without complete information, don't restrict anything
+            return topology;
+        }
+
+        freqs.emplace_back(cpu, freq);
+    }
+
+    if (freqs.empty()) {
+        return topology;
+    }
+
+    auto minmax = std::minmax_element(
+            freqs.begin(), freqs.end(),
+            [](const std::pair<int, unsigned long> &a,
+               const std::pair<int, unsigned long> &b) {
+        return a.second < b.second;
+    });
+    unsigned long min_freq = minmax.first->second;
+
+    if (min_freq == minmax.second->second) {
+        return topology;
+    }
+
+    // Every cluster faster than the slowest one counts as a performance
+    // cluster, so tri-cluster SoCs use both their big and prime cores
+    for (auto const &p : freqs) {
+        CPU_SET(p.first, p.second == min_freq
+                ? &topology.efficiency : &topology.performance);
+    }
+
+    topology.heterogeneous = true;
+    return topology;
+}
+
+static const CpuTopology & cpu_topology()
+{
+    static CpuTopology topology = load_cpu_topology();
+    return topology;
+}
+
+static void apply_core_hint(CoreHint hint)
+{
+    const CpuTopology &topology = cpu_topology();
+    if (!topology.heterogeneous) {
+        return;
+    }
+
+    const cpu_set_t *set;
+    switch (hint) {
+    case CoreHint::Performance:
+        set = &topology.performance;
+        break;
+    case CoreHint::Efficiency:
+        set = &topology.efficiency;
+        break;
+    default:
+        set = &topology.any;
+        break;
+    }
+
+    // This is only a hint, so failure is not fatal
+    sched_setaffinity(0, sizeof(*set), set);
+}
+
+#else
+
+static void apply_core_hint(CoreHint hint)
+{
+    (void) hint;
+}
+
+#endif
+
+static unsigned int default_max_workers()
+{
+    // Threads waiting on a task group run tasks too, so leave one CPU for the
+    // caller
+    unsigned int n = std::thread::hardware_concurrency();
+    return n > 1 ? n - 1 : 1;
+}
+
+struct PoolTask
+{
+    std::function<void()> fn;
+    CoreHint hint;
+};
+
+struct PoolWorker
+{
+    // Tasks submitted by this worker. The owner pops from the back and other
+    // threads steal from the front.
+    std::mutex lock;
+    std::deque<PoolTask> tasks;
+    std::thread thread;
+    CoreHint hint;
+};
+
+class ThreadPoolPrivate
+{
+public:
+    explicit ThreadPoolPrivate(unsigned int max_workers);
+
+    bool take_task(PoolWorker *self, PoolTask &task);
+    void push_task(PoolTask task);
+    void worker_loop(PoolWorker *self);
+
+#ifndef _WIN32
+    static void reset_global_after_fork();
+#endif
+
+    // Slots are allocated up front so stealing threads can iterate over them
+    // without locking the whole pool
+    std::vector<std::unique_ptr<PoolWorker>> workers;
+    std::atomic<unsigned int> started;
+
+    // Protects injected, idle, and stopping
+    std::mutex lock;
+    std::condition_variable cv;
+    // Tasks submitted from threads outside the pool
+    std::deque<PoolTask> injected;
+    // Number of queued tasks. This can briefly go negative when a task is
+    // taken before its submitter has counted it.
+    std::atomic<int64_t> pending;
+    unsigned int idle;
+    bool stopping;
+
+#ifndef _WIN32
+    // Worker threads do not survive fork()
+    pid_t pid;
+#endif
+};
+
+static thread_local ThreadPoolPrivate *t_pool = nullptr;
+static thread_local PoolWorker *t_worker = nullptr;
+
+static std::atomic<unsigned int> g_global_max_workers{0};
+static std::atomic_bool g_global_created{false};
+static ThreadPool *g_global_pool = nullptr;
+
+ThreadPoolPrivate::ThreadPoolPrivate(unsigned int max_workers)
+    : started(0)
+    , pending(0)
+    , idle(0)
+    , stopping(false)
+#ifndef _WIN32
+    , pid(getpid())
+#endif
+{
+    if (max_workers == 0) {
+        max_workers = default_max_workers();
+    }
+
+    workers.reserve(max_workers);
+    for (unsigned int i = 0; i < max_workers; ++i) {
+        workers.emplace_back(new PoolWorker());
+        workers.back()->hint = CoreHint::Any;
+    }
+}
+
+bool ThreadPoolPrivate::take_task(PoolWorker *self, PoolTask &task)
+{
+    // Newest task from our own deque first since its data is likely cached
+    if (self) {
+        std::lock_guard<std::mutex> guard(self->lock);
+        if (!self->tasks.empty()) {
+            task = std::move(self->tasks.back());
+            self->tasks.pop_back();
+            --pending;
+            return true;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!injected.empty()) {
+            task = std::move(injected.front());
+            injected.pop_front();
+            --pending;
+            return true;
+        }
+    }
+
+    // Steal the oldest task from another worker
+    unsigned int n = started;
+    for (unsigned int i = 0; i < n; ++i) {
+        PoolWorker *victim = workers[i].get();
+        if (victim == self) {
+            continue;
+        }
+
+        std::lock_guard<std::mutex> guard(victim->lock);
+        if (!victim->tasks.empty()) {
+            task = std::move(victim->tasks.front());
+            victim->tasks.pop_front();
+            --pending;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void ThreadPoolPrivate::push_task(PoolTask task)
+{
+    bool from_worker = t_pool == this;
+
+    if (from_worker) {
+        std::lock_guard<std::mutex> guard(t_worker->lock);
+        t_worker->tasks.push_back(std::move(task));
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (!from_worker) {
+        injected.push_back(std::move(task));
+    }
+    ++pending;
+
+    if (idle > 0) {
+        cv.notify_one();
+        return;
+    }
+
+    // Workers are started lazily so short-lived processes and small pools do
+    // not create threads they never use
+    unsigned int n = started;
+    if (n < workers.size()) {
+        PoolWorker *worker = workers[n].get();
+        try {
+            worker->thread = std::thread(&ThreadPoolPrivate::worker_loop,
+                                         this, worker);
+            started = n + 1;
+        } catch (const std::system_error &) {
+            // The existing workers and waiting threads will run the task
+        }
+    }
+}
+
+void ThreadPoolPrivate::worker_loop(PoolWorker *self)
+{
+    t_pool = this;
+    t_worker = self;
+
+    while (true) {
+        PoolTask task;
+
+        if (take_task(self, task)) {
+            if (task.hint != self->hint) {
+                apply_core_hint(task.hint);
+                self->hint = task.hint;
+            }
+            task.fn();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(lock);
+        if (pending > 0) {
+            // Something was queued while we were looking
+            continue;
+        } else if (stopping) {
+            break;
+        }
+
+        ++idle;
+        cv.wait(guard);
+        --idle;
+    }
+}
+
+#ifndef _WIN32
+
+void ThreadPoolPrivate::reset_global_after_fork()
+{
+    // Only the forking thread exists in the child, so the old workers' state
+    // (including any locked mutexes) is abandoned rather than destroyed
+    ThreadPoolPrivate *old = g_global_pool->_priv_ptr.release();
+    g_global_pool->_priv_ptr.reset(new ThreadPoolPrivate(
+            static_cast<unsigned int>(old->workers.size())));
+}
+
+#endif
+
+/*! \endcond */
+
+/*!
+ * \class ThreadPool
+ *
+ * \brief Pool of worker threads shared by the whole process
+ *
+ * Each worker has its own deque of tasks. Tasks submitted from a worker are
+ * pushed onto that worker's deque and run newest first, while idle workers
+ * steal the oldest tasks from busy ones. Tasks submitted from other threads go
+ * into a shared queue.
+ *
+ * Workers are started on demand, up to the limit given to the constructor.
+ * Most code should use ThreadPool::global() instead of creating its own pool
+ * so that independent subsystems running at the same time do not use more
+ * threads than there are CPUs.
+ *
+ * Tasks must not throw exceptions.
+ */
+
+/*!
+ * \brief Construct a thread pool
+ *
+ * \param max_workers Maximum number of worker threads. If 0, one less than the
+ *                    number of CPUs is used (minimum 1), since threads waiting
+ *                    on a TaskGroup run tasks as well.
+ */
+ThreadPool::ThreadPool(unsigned int max_workers)
+    : _priv_ptr(new ThreadPoolPrivate(max_workers))
+{
+}
+
+/*!
+ * \brief Destroy the thread pool
+ *
+ * All queued tasks are run before the workers exit.
+ */
+ThreadPool::~ThreadPool()
+{
+    MB_PRIVATE(ThreadPool);
+
+    {
+        std::lock_guard<std::mutex> guard(priv->lock);
+        priv->stopping = true;
+        priv->cv.notify_all();
+    }
+
+    unsigned int n = priv->started;
+    for (unsigned int i = 0; i < n; ++i) {
+        priv->workers[i]->thread.join();
+    }
+}
+
+/*!
+ * \brief Get the process-wide thread pool
+ *
+ * The pool is created on first use and is never destroyed, so tasks may be
+ * submitted from static destructors and atexit() handlers. A child process
+ * created by `fork()` gets a new set of workers.
+ */
+ThreadPool & ThreadPool::global()
+{
+    static ThreadPool *pool = [] {
+        g_global_created = true;
+        g_global_pool = new ThreadPool(g_global_max_workers);
+#ifndef _WIN32
+        pthread_atfork(nullptr, nullptr,
+                       &ThreadPoolPrivate::reset_global_after_fork);
+#endif
+        return g_global_pool;
+    }();
+    return *pool;
+}
+
+/*!
+ * \brief Set the maximum number of workers of the process-wide pool
+ *
+ * \param max_workers Maximum number of worker threads (0 for the default)
+ *
+ * \return Whether the limit was set. This fails if ThreadPool::global() has
+ *         already been called.
+ */
+bool ThreadPool::set_global_max_workers(unsigned int max_workers)
+{
+    if (g_global_created) {
+        return false;
+    }
+
+    g_global_max_workers = max_workers;
+    return true;
+}
+
+/*!
+ * \brief Maximum number of worker threads
+ */
+unsigned int ThreadPool::max_workers() const
+{
+    MB_PRIVATE(const ThreadPool);
+    return static_cast<unsigned int>(priv->workers.size());
+}
+
+/*!
+ * \brief Queue a task
+ *
+ * In a child process created by `fork()`, the pool's workers no longer exist,
+ * so the task is run on the calling thread before this function returns. This
+ * does not apply to ThreadPool::global(), which is recreated in the child.
+ *
+ * \param task Task to run
+ * \param hint Which CPUs the task should preferably run on. This is ignored
+ *             when all CPUs are the same or on non-Linux systems.
+ */
+void ThreadPool::submit(std::function<void()> task, CoreHint hint)
+{
+    MB_PRIVATE(ThreadPool);
+
+#ifndef _WIN32
+    if (getpid() != priv->pid) {
+        task();
+        return;
+    }
+#endif
+
+    priv->push_task({ std::move(task), hint });
+}
+
+/*!
+ * \brief Run one queued task on the calling thread
+ *
+ * This lets a thread that is waiting for tasks to complete help out instead of
+ * blocking.
+ *
+ * \return Whether a task was run
+ */
+bool ThreadPool::run_pending_task()
+{
+    MB_PRIVATE(ThreadPool);
+
+#ifndef _WIN32
+    if (getpid() != priv->pid) {
+        // Tasks are run synchronously after fork(), so nothing is queued
+        return false;
+    }
+#endif
+
+    PoolTask task;
+    if (!priv->take_task(t_pool == priv ? t_worker : nullptr, task)) {
+        return false;
+    }
+
+    task.fn();
+    return true;
+}
+
+/*! \cond INTERNAL */
+
+struct TaskGroupState
+{
+    std::mutex lock;
+    std::condition_variable cv;
+    size_t pending = 0;
+    std::atomic_bool cancelled{false};
+};
+
+class TaskGroupPrivate
+{
+public:
+    ThreadPool *pool;
+    // Shared with the queued tasks so that the last task can still signal
+    // completion while the waiting thread destroys the group
+    std::shared_ptr<TaskGroupState> state;
+};
+
+/*! \endcond */
+
+/*!
+ * \class TaskGroup
+ *
+ * \brief Set of tasks that can be waited on and cancelled together
+ *
+ * The destructor waits for all tasks in the group to complete.
+ */
+
+/*!
+ * \brief Construct a task group
+ *
+ * \param pool Pool to run the tasks in
+ */
+TaskGroup::TaskGroup(ThreadPool &pool)
+    : _priv_ptr(new TaskGroupPrivate())
+{
+    MB_PRIVATE(TaskGroup);
+    priv->pool = &pool;
+    priv->state = std::make_shared<TaskGroupState>();
+}
+
+TaskGroup::~TaskGroup()
+{
+    wait();
+}
+
+/*!
+ * \brief Queue a task in the group
+ *
+ * If the group is cancelled before the task starts, the task is skipped.
+ *
+ * \param task Task to run
+ * \param hint Which CPUs the task should preferably run on
+ */
+void TaskGroup::run(std::function<void()> task, CoreHint hint)
+{
+    MB_PRIVATE(TaskGroup);
+
+    std::shared_ptr<TaskGroupState> state = priv->state;
+
+    {
+        std::lock_guard<std::mutex> guard(state->lock);
+        ++state->pending;
+    }
+
+    priv->pool->submit([state, task] {
+        if (!state->cancelled) {
+            task();
+        }
+
+        std::lock_guard<std::mutex> guard(state->lock);
+        if (--state->pending == 0) {
+            state->cv.notify_all();
+        }
+    }, hint);
+}
+
+/*!
+ * \brief Wait for all tasks in the group to complete
+ *
+ * While waiting, the calling thread runs queued tasks from the pool, so this
+ * may be called from within a task without deadlocking.
+ */
+void TaskGroup::wait()
+{
+    MB_PRIVATE(TaskGroup);
+
+    TaskGroupState *state = priv->state.get();
+
+    while (true) {
+        {
+            std::lock_guard<std::mutex> guard(state->lock);
+            if (state->pending == 0) {
+                return;
+            }
+        }
+
+        if (priv->pool->run_pending_task()) {
+            continue;
+        }
+
+        // Everything is running. Check back periodically in case the running
+        // tasks queue more work that this thread can help with.
+        std::unique_lock<std::mutex> guard(state->lock);
+        state->cv.wait_for(guard, std::chrono::milliseconds(10), [&] {
+            return state->pending == 0;
+        });
+    }
+}
+
+/*!
+ * \brief Cancel the group
+ *
+ * Tasks that have not started yet are skipped. Running tasks should check
+ * is_cancelled() periodically and return early.
+ */
+void TaskGroup::cancel()
+{
+    MB_PRIVATE(TaskGroup);
+    priv->state->cancelled = true;
+}
+
+/*!
+ * \brief Whether the group has been cancelled
+ */
+bool TaskGroup::is_cancelled() const
+{
+    MB_PRIVATE(const TaskGroup);
+    return priv->state->cancelled;
+}
+
+/*!
+ * \brief Run a function on several threads at once
+ *
+ * \p fn is run by the calling thread and by up to `n - 1` tasks in \p pool.
+ * This is meant for workers that pull items from a shared queue and keep
+ * per-thread state, such as an open file. If the pool is busy, some copies may
+ * only start after the others have drained the queue, so \p fn must handle
+ * finding no work.
+ *
+ * \param n Maximum number of concurrent calls to \p fn. If 0, the number of
+ *          CPUs is used.
+ * \param fn Function to run
+ * \param hint Which CPUs the pool's copies of \p fn should preferably run on
+ * \param pool Pool to run the extra copies in
+ */
+void run_concurrently(unsigned int n, const std::function<void()> &fn,
+                      CoreHint hint, ThreadPool &pool)
+{
+    if (n == 0) {
+        n = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    TaskGroup group(pool);
+
+    for (unsigned int i = 1; i < n; ++i) {
+        group.run(fn, hint);
+    }
+
+    fn();
+
+    group.wait();
+}
+
+/*!
+ * \brief Call a function for each index in `[0, count)` in parallel
+ *
+ * The indexes are handed out in ascending order to the calling thread and to
+ * tasks in \p pool. Once any call returns false, no new indexes are handed out.
+ *
+ * \param count Number of indexes
+ * \param fn Function to call with each index
+ * \param max_parallelism Maximum number of concurrent calls to \p fn. If 0,
+ *                        the number of CPUs is used.
+ * \param hint Which CPUs the pool's calls to \p fn should preferably run on
+ * \param pool Pool to run in
+ *
+ * \return Whether every call to \p fn returned true
+ */
+bool parallel_for(size_t count, const std::function<bool(size_t)> &fn,
+                  unsigned int max_parallelism, CoreHint hint,
+                  ThreadPool &pool)
+{
+    if (count == 0) {
+        return true;
+    } else if (max_parallelism == 0) {
+        max_parallelism = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    std::atomic<size_t> next{0};
+    std::atomic_bool failed{false};
+
+    auto worker = [&] {
+        size_t i;
+        while (!failed && (i = next++) < count) {
+            if (!fn(i)) {
+                failed = true;
+            }
+        }
+    };
+
+    run_concurrently(static_cast<unsigned int>(
+            std::min<size_t>(max_parallelism, count)), worker, hint, pool);
+
+    return !failed;
+}
+
+}
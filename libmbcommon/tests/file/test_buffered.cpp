@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <gtest/gtest.h>
+
+#include <cstring>
+
+#include "mbcommon/file/buffered.h"
+#include "mbcommon/file/memory.h"
+#include "mbcommon/file_util.h"
+
+#include "mock_test_file.h"
+
+TEST(FileBufferedTest, OpenRequiresOpenFile)
+{
+    TestFile inner;
+
+    mb::BufferedFile file(&inner);
+    ASSERT_FALSE(file.is_open());
+    ASSERT_EQ(file.error(), mb::FileError::InvalidArgument);
+}
+
+TEST(FileBufferedTest, SmallReadsUseReadAhead)
+{
+    TestFileCounters counters;
+    TestFile inner(&counters);
+    ASSERT_TRUE(inner.open());
+
+    mb::BufferedFile file(&inner, 256);
+    ASSERT_TRUE(file.is_open());
+
+    char c;
+    size_t n;
+
+    for (size_t i = 0; i < 256; ++i) {
+        ASSERT_TRUE(file.read(&c, 1, n));
+        ASSERT_EQ(n, 1u);
+        ASSERT_EQ(c, static_cast<char>('a' + (i % 26)));
+    }
+    ASSERT_EQ(counters.n_read, 1u);
+
+    ASSERT_TRUE(file.read(&c, 1, n));
+    ASSERT_EQ(c, static_cast<char>('a' + (256 % 26)));
+    ASSERT_EQ(counters.n_read, 2u);
+}
+
+TEST(FileBufferedTest, SeekWithinBufferIsFree)
+{
+    TestFileCounters counters;
+    TestFile inner(&counters);
+    ASSERT_TRUE(inner.open());
+
+    mb::BufferedFile file(&inner, 256);
+    ASSERT_TRUE(file.is_open());
+    unsigned int initial_seeks = counters.n_seek;
+
+    char buf[4];
+    size_t n;
+
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_TRUE(file.seek(100, SEEK_SET, nullptr));
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(memcmp(buf, "wxyz", 4), 0);
+    ASSERT_TRUE(file.seek(-104, SEEK_CUR, nullptr));
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(memcmp(buf, "abcd", 4), 0);
+
+    ASSERT_EQ(counters.n_read, 1u);
+    ASSERT_EQ(counters.n_seek, initial_seeks);
+}
+
+TEST(FileBufferedTest, LargeReadBypassesBuffer)
+{
+    TestFile inner;
+    ASSERT_TRUE(inner.open());
+
+    mb::BufferedFile file(&inner, 16);
+    ASSERT_TRUE(file.is_open());
+
+    char buf[INITIAL_BUF_SIZE];
+    size_t n;
+
+    ASSERT_TRUE(mb::file_read_fully(file, buf, sizeof(buf), n));
+    ASSERT_EQ(n, INITIAL_BUF_SIZE);
+    for (size_t i = 0; i < INITIAL_BUF_SIZE; ++i) {
+        ASSERT_EQ(buf[i], static_cast<char>('a' + (i % 26)));
+    }
+
+    ASSERT_TRUE(file.read(buf, 1, n));
+    ASSERT_EQ(n, 0u);
+}
+
+TEST(FileBufferedTest, SmallWritesAreCoalesced)
+{
+    TestFileCounters counters;
+    TestFile inner(&counters);
+    ASSERT_TRUE(inner.open());
+
+    {
+        mb::BufferedFile file(&inner, 64);
+        ASSERT_TRUE(file.is_open());
+
+        size_t n;
+        for (int i = 0; i < 32; ++i) {
+            ASSERT_TRUE(file.write("xy", 2, n));
+            ASSERT_EQ(n, 2u);
+        }
+        ASSERT_EQ(counters.n_write, 0u);
+
+        // Reads see pending data
+        char buf[2];
+        ASSERT_TRUE(file.seek(10, SEEK_SET, nullptr));
+        ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+        ASSERT_EQ(n, 2u);
+        ASSERT_EQ(memcmp(buf, "xy", 2), 0);
+
+        ASSERT_TRUE(file.flush());
+        ASSERT_EQ(counters.n_write, 1u);
+    }
+
+    ASSERT_EQ(inner._buf.size(), INITIAL_BUF_SIZE);
+    for (size_t i = 0; i < 64; ++i) {
+        ASSERT_EQ(inner._buf[i], (i % 2) ? 'y' : 'x');
+    }
+    ASSERT_EQ(inner._buf[64], 'a' + (64 % 26));
+}
+
+TEST(FileBufferedTest, CloseFlushesPendingWrites)
+{
+    void *data = nullptr;
+    size_t size = 0;
+    mb::MemoryFile inner(&data, &size);
+    ASSERT_TRUE(inner.is_open());
+
+    mb::BufferedFile file(&inner);
+    ASSERT_TRUE(file.is_open());
+
+    size_t n;
+    ASSERT_TRUE(file.write("foo", 3, n));
+    ASSERT_TRUE(file.seek(5, SEEK_SET, nullptr));
+    ASSERT_TRUE(file.write("bar", 3, n));
+    ASSERT_EQ(size, 3u);
+
+    ASSERT_TRUE(file.close());
+    ASSERT_EQ(size, 8u);
+    ASSERT_EQ(memcmp(data, "foo\0\0bar", 8), 0);
+
+    free(data);
+}
+
+TEST(FileBufferedTest, SeekEndIncludesPendingWrites)
+{
+    void *data = nullptr;
+    size_t size = 0;
+    mb::MemoryFile inner(&data, &size);
+    ASSERT_TRUE(inner.is_open());
+
+    mb::BufferedFile file(&inner);
+    ASSERT_TRUE(file.is_open());
+
+    size_t n;
+    uint64_t offset;
+    ASSERT_TRUE(file.write("foobar", 6, n));
+    ASSERT_TRUE(file.seek(0, SEEK_END, &offset));
+    ASSERT_EQ(offset, 6u);
+
+    ASSERT_TRUE(file.close());
+    free(data);
+}
+
+TEST(FileBufferedTest, TruncateDropsBufferedData)
+{
+    TestFile inner;
+    ASSERT_TRUE(inner.open());
+
+    mb::BufferedFile file(&inner, 64);
+    ASSERT_TRUE(file.is_open());
+
+    char buf[8];
+    size_t n;
+
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_TRUE(file.truncate(4));
+    ASSERT_TRUE(file.seek(2, SEEK_SET, nullptr));
+
+    ASSERT_TRUE(mb::file_read_fully(file, buf, sizeof(buf), n));
+    ASSERT_EQ(n, 2u);
+    ASSERT_EQ(memcmp(buf, "cd", 2), 0);
+}
+
+static mb::FileSearchAction search_cb(mb::File &file, void *userdata,
+                                      uint64_t offset)
+{
+    (void) file;
+    static_cast<std::vector<uint64_t> *>(userdata)->push_back(offset);
+    return mb::FileSearchAction::Continue;
+}
+
+TEST(FileBufferedTest, SearchFile)
+{
+    TestFile inner;
+    ASSERT_TRUE(inner.open());
+
+    mb::BufferedFile file(&inner, 32);
+    ASSERT_TRUE(file.is_open());
+
+    std::vector<uint64_t> offsets;
+    ASSERT_TRUE(mb::file_search(file, -1, -1, 0, "xyz", 3, -1,
+                                &search_cb, &offsets));
+
+    std::vector<uint64_t> expected;
+    for (uint64_t i = 23; i + 3 <= INITIAL_BUF_SIZE; i += 26) {
+        expected.push_back(i);
+    }
+    ASSERT_EQ(offsets, expected);
+}
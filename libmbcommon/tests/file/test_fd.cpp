@@ -45,6 +45,19 @@ struct MockFdFileFuncs : public mb::FdFileFuncs
     MOCK_METHOD3(fn_lseek64, off64_t(int fd, off64_t offset, int whence));
     MOCK_METHOD3(fn_read, ssize_t(int fd, void *buf, size_t count));
     MOCK_METHOD3(fn_write, ssize_t(int fd, const void *buf, size_t count));
+#ifndef _WIN32
+    MOCK_METHOD4(fn_pread64, ssize_t(int fd, void *buf, size_t count,
+                                     off64_t offset));
+    MOCK_METHOD4(fn_pwrite64, ssize_t(int fd, const void *buf, size_t count,
+                                      off64_t offset));
+    MOCK_METHOD3(fn_readv, ssize_t(int fd, const struct iovec *iov,
+                                   int iovcnt));
+    MOCK_METHOD3(fn_writev, ssize_t(int fd, const struct iovec *iov,
+                                    int iovcnt));
+    MOCK_METHOD6(fn_copy_file_range, ssize_t(int fd_in, off64_t *off_in,
+                                             int fd_out, off64_t *off_out,
+                                             size_t len, unsigned int flags));
+#endif
 
     struct stat _sb_regfile{};
 
@@ -72,6 +85,21 @@ struct MockFdFileFuncs : public mb::FdFileFuncs
                 .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
         ON_CALL(*this, fn_write(testing::_, testing::_, testing::_))
                 .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+#ifndef _WIN32
+        ON_CALL(*this, fn_pread64(testing::_, testing::_, testing::_,
+                                  testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_pwrite64(testing::_, testing::_, testing::_,
+                                   testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_readv(testing::_, testing::_, testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_writev(testing::_, testing::_, testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_copy_file_range(testing::_, testing::_, testing::_,
+                                          testing::_, testing::_, testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+#endif
     }
 
     void report_as_regular_file()
@@ -388,6 +416,175 @@ TEST_F(FileFdTest, ReadFailureEINTR)
     ASSERT_EQ(file.error(), std::errc::interrupted);
 }
 
+#ifndef _WIN32
+TEST_F(FileFdTest, ReadAtSuccess)
+{
+    _funcs.report_as_regular_file();
+
+    // Ensure that pread is used instead of seeking
+    EXPECT_CALL(_funcs, fn_pread64(testing::_, testing::_, testing::_, 100))
+            .Times(1)
+            .WillOnce(testing::ReturnArg<2>());
+    EXPECT_CALL(_funcs, fn_lseek64(testing::_, testing::_, testing::_))
+            .Times(0);
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    char c;
+    size_t n;
+    ASSERT_TRUE(file.read_at(100, &c, 1, n));
+    ASSERT_EQ(n, 1u);
+}
+
+TEST_F(FileFdTest, ReadAtFailure)
+{
+    _funcs.report_as_regular_file();
+
+    EXPECT_CALL(_funcs, fn_pread64(testing::_, testing::_, testing::_,
+                                   testing::_))
+            .Times(1);
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    char c;
+    size_t n;
+    ASSERT_FALSE(file.read_at(0, &c, 1, n));
+    ASSERT_EQ(file.error(), std::errc::io_error);
+}
+
+TEST_F(FileFdTest, WriteAtSuccess)
+{
+    _funcs.report_as_regular_file();
+
+    EXPECT_CALL(_funcs, fn_pwrite64(testing::_, testing::_, testing::_, 42))
+            .Times(1)
+            .WillOnce(testing::ReturnArg<2>());
+    EXPECT_CALL(_funcs, fn_lseek64(testing::_, testing::_, testing::_))
+            .Times(0);
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    size_t n;
+    ASSERT_TRUE(file.write_at(42, "x", 1, n));
+    ASSERT_EQ(n, 1u);
+}
+
+TEST_F(FileFdTest, WritevSuccess)
+{
+    _funcs.report_as_regular_file();
+
+    // Ensure that all buffers are passed in a single call
+    EXPECT_CALL(_funcs, fn_writev(testing::_, testing::_, 2))
+            .Times(1)
+            .WillOnce(testing::Return(4));
+    EXPECT_CALL(_funcs, fn_write(testing::_, testing::_, testing::_))
+            .Times(0);
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    mb::FileConstIoVec iov[] = {
+        { "ab", 2 },
+        { "cd", 2 },
+    };
+    size_t n;
+    ASSERT_TRUE(file.writev(iov, 2, n));
+    ASSERT_EQ(n, 4u);
+}
+
+TEST_F(FileFdTest, WritevFailure)
+{
+    _funcs.report_as_regular_file();
+
+    EXPECT_CALL(_funcs, fn_writev(testing::_, testing::_, testing::_))
+            .Times(1);
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    mb::FileConstIoVec iov[] = {
+        { "ab", 2 },
+    };
+    size_t n;
+    ASSERT_FALSE(file.writev(iov, 1, n));
+    ASSERT_EQ(file.error(), std::errc::io_error);
+}
+#endif
+
+#ifndef _WIN32
+TEST_F(FileFdTest, MoveUsesCopyFileRange)
+{
+    _funcs.report_as_regular_file();
+
+    // Ensure that the data is not bounced through userspace
+    EXPECT_CALL(_funcs, fn_copy_file_range(testing::_, testing::_, testing::_,
+                                           testing::_, testing::_, 0))
+            .Times(2)
+            .WillRepeatedly(testing::Return(50));
+    EXPECT_CALL(_funcs, fn_pread64(testing::_, testing::_, testing::_,
+                                   testing::_))
+            .Times(0);
+    EXPECT_CALL(_funcs, fn_pwrite64(testing::_, testing::_, testing::_,
+                                    testing::_))
+            .Times(0);
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    uint64_t n;
+    ASSERT_TRUE(file.move(0, 200, 100, n));
+    ASSERT_EQ(n, 100u);
+}
+
+TEST_F(FileFdTest, MoveFallbackWhenCopyFileRangeUnsupported)
+{
+    _funcs.report_as_regular_file();
+
+    EXPECT_CALL(_funcs, fn_copy_file_range(testing::_, testing::_, testing::_,
+                                           testing::_, testing::_, testing::_))
+            .Times(1)
+            .WillOnce(testing::SetErrnoAndReturn(ENOSYS, -1));
+    EXPECT_CALL(_funcs, fn_pread64(testing::_, testing::_, 100, 0))
+            .Times(1)
+            .WillOnce(testing::ReturnArg<2>());
+    EXPECT_CALL(_funcs, fn_pwrite64(testing::_, testing::_, 100, 200))
+            .Times(1)
+            .WillOnce(testing::ReturnArg<2>());
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    uint64_t n;
+    ASSERT_TRUE(file.move(0, 200, 100, n));
+    ASSERT_EQ(n, 100u);
+}
+
+TEST_F(FileFdTest, MoveOverlappingDoesNotUseCopyFileRange)
+{
+    _funcs.report_as_regular_file();
+
+    EXPECT_CALL(_funcs, fn_copy_file_range(testing::_, testing::_, testing::_,
+                                           testing::_, testing::_, testing::_))
+            .Times(0);
+    EXPECT_CALL(_funcs, fn_pread64(testing::_, testing::_, 100, 0))
+            .Times(1)
+            .WillOnce(testing::ReturnArg<2>());
+    EXPECT_CALL(_funcs, fn_pwrite64(testing::_, testing::_, 100, 50))
+            .Times(1)
+            .WillOnce(testing::ReturnArg<2>());
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    uint64_t n;
+    ASSERT_TRUE(file.move(0, 50, 100, n));
+    ASSERT_EQ(n, 100u);
+}
+#endif
+
 TEST_F(FileFdTest, WriteSuccess)
 {
     _funcs.report_as_regular_file();
@@ -20,6 +20,7 @@
 #include <gtest/gtest.h>
 
 #include <memory>
+#include <vector>
 
 #include "mbcommon/file.h"
 #include "mbcommon/file/memory.h"
@@ -104,6 +105,24 @@ TEST(FileStaticMemoryTest, ReadTooLarge)
     ASSERT_EQ(out[0], 'x');
 }
 
+TEST(FileStaticMemoryTest, PeekInBounds)
+{
+    constexpr char in[] = "abc";
+    constexpr size_t in_size = 3;
+    const void *data;
+    size_t n;
+
+    mb::MemoryFile file(in, in_size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.peek(1, 10, data, n));
+    ASSERT_EQ(n, 2u);
+    ASSERT_EQ(data, in + 1);
+
+    ASSERT_TRUE(file.peek(3, 10, data, n));
+    ASSERT_EQ(n, 0u);
+}
+
 TEST(FileStaticMemoryTest, WriteInBounds)
 {
     constexpr char in[] = "x";
@@ -235,6 +254,18 @@ TEST(FileStaticMemoryTest, CheckTruncateUnsupported)
     ASSERT_NE(file.error_string().find("truncate"), std::string::npos);
 }
 
+TEST(FileStaticMemoryTest, CheckReserveUnsupported)
+{
+    constexpr char in[] = "x";
+    constexpr size_t in_size = 1;
+
+    mb::MemoryFile file(in, in_size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_FALSE(file.reserve(10));
+    ASSERT_EQ(file.error(), mb::FileError::UnsupportedWrite);
+}
+
 TEST(FileDynamicMemoryTest, OpenFile)
 {
     void *in = nullptr;
@@ -515,3 +546,205 @@ TEST(FileDynamicMemoryTest, TruncateFile)
 
     free(in);
 }
+
+TEST(FileDynamicMemoryTest, TruncateShrinkThenGrow)
+{
+    void *in = strdup("abc");
+    size_t in_size = 3;
+
+    mb::MemoryFile file(&in, &in_size);
+    ASSERT_TRUE(file.is_open());
+
+    // The old data must not reappear when the file grows again
+    ASSERT_TRUE(file.truncate(0));
+    ASSERT_EQ(in_size, 0u);
+    ASSERT_TRUE(file.truncate(3));
+    ASSERT_EQ(in_size, 3u);
+    for (int i = 0; i < 3; ++i) {
+        ASSERT_EQ(static_cast<char *>(in)[i], '\0');
+    }
+
+    free(in);
+}
+
+TEST(FileDynamicMemoryTest, ManySmallWrites)
+{
+    void *in = nullptr;
+    size_t in_size = 0;
+    size_t n;
+
+    mb::MemoryFile file(&in, &in_size);
+    ASSERT_TRUE(file.is_open());
+
+    for (int i = 0; i < 10000; ++i) {
+        unsigned char c = i % 256;
+        ASSERT_TRUE(file.write(&c, 1, n));
+        ASSERT_EQ(n, 1u);
+    }
+
+    ASSERT_EQ(in_size, 10000u);
+    for (int i = 0; i < 10000; ++i) {
+        ASSERT_EQ(static_cast<unsigned char *>(in)[i], i % 256);
+    }
+
+    free(in);
+}
+
+TEST(FileDynamicMemoryTest, WriteAfterGapZeroFills)
+{
+    void *in = nullptr;
+    size_t in_size = 0;
+    size_t n;
+
+    mb::MemoryFile file(&in, &in_size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.write("abcdef", 6, n));
+    ASSERT_TRUE(file.truncate(1));
+    ASSERT_TRUE(file.seek(4, SEEK_SET, nullptr));
+    ASSERT_TRUE(file.write("y", 1, n));
+    ASSERT_EQ(in_size, 5u);
+    ASSERT_EQ(memcmp(in, "a\0\0\0y", 5), 0);
+
+    free(in);
+}
+
+TEST(FileDynamicMemoryTest, ReserveSpace)
+{
+    void *in = strdup("x");
+    size_t in_size = 1;
+    size_t n;
+
+    mb::MemoryFile file(&in, &in_size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.reserve(1024));
+    ASSERT_EQ(in_size, 1u);
+    void *reserved = in;
+
+    ASSERT_TRUE(file.seek(0, SEEK_END, nullptr));
+    for (int i = 1; i < 1024; ++i) {
+        ASSERT_TRUE(file.write("y", 1, n));
+    }
+    ASSERT_EQ(in_size, 1024u);
+    ASSERT_EQ(in, reserved);
+    ASSERT_EQ(static_cast<char *>(in)[0], 'x');
+    ASSERT_EQ(static_cast<char *>(in)[1023], 'y');
+
+    free(in);
+}
+
+TEST(FileDynamicMemoryTest, ReserveClosed)
+{
+    mb::MemoryFile file;
+    ASSERT_FALSE(file.reserve(10));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidState);
+}
+
+TEST(FileVectorMemoryTest, ReadInBounds)
+{
+    std::vector<unsigned char> in{'x'};
+    char out[1];
+    size_t out_size;
+
+    mb::MemoryFile file(&in);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.read(out, sizeof(out), out_size));
+    ASSERT_EQ(out_size, 1u);
+    ASSERT_EQ(out[0], 'x');
+}
+
+TEST(FileVectorMemoryTest, WriteOverlappingEnd)
+{
+    std::vector<unsigned char> in{'a', 'b', 'c'};
+    size_t n;
+
+    mb::MemoryFile file(&in);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.seek(1, SEEK_SET, nullptr));
+    ASSERT_TRUE(file.write("xyz", 3, n));
+    ASSERT_EQ(n, 3u);
+    ASSERT_EQ(in, (std::vector<unsigned char>{'a', 'x', 'y', 'z'}));
+}
+
+TEST(FileVectorMemoryTest, WriteOutOfBounds)
+{
+    std::vector<unsigned char> in;
+    size_t n;
+
+    mb::MemoryFile file(&in);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.seek(3, SEEK_SET, nullptr));
+    ASSERT_TRUE(file.write("y", 1, n));
+    ASSERT_EQ(n, 1u);
+    ASSERT_EQ(in, (std::vector<unsigned char>{0, 0, 0, 'y'}));
+}
+
+TEST(FileVectorMemoryTest, TruncateFile)
+{
+    std::vector<unsigned char> in{'x'};
+
+    mb::MemoryFile file(&in);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.truncate(10));
+    ASSERT_EQ(in.size(), 10u);
+    for (int i = 1; i < 10; ++i) {
+        ASSERT_EQ(in[i], 0);
+    }
+
+    ASSERT_TRUE(file.truncate(5));
+    ASSERT_EQ(in.size(), 5u);
+    ASSERT_GE(in.capacity(), 10u);
+}
+
+TEST(FileStaticMemoryTest, ReadWriteAt)
+{
+    char in[] = "abcdef";
+    constexpr size_t in_size = 6;
+    char out[3];
+    size_t n;
+    uint64_t offset;
+
+    mb::MemoryFile file(in, in_size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.read_at(2, out, sizeof(out), n));
+    ASSERT_EQ(n, 3u);
+    ASSERT_EQ(memcmp(out, "cde", 3), 0);
+
+    ASSERT_TRUE(file.read_at(10, out, sizeof(out), n));
+    ASSERT_EQ(n, 0u);
+
+    ASSERT_TRUE(file.write_at(4, "xyz", 3, n));
+    ASSERT_EQ(n, 2u);
+    ASSERT_EQ(memcmp(in, "abcdxy", 6), 0);
+
+    // Position is unchanged
+    ASSERT_TRUE(file.seek(0, SEEK_CUR, &offset));
+    ASSERT_EQ(offset, 0u);
+}
+
+TEST(FileDynamicMemoryTest, WriteAtGrowsBuffer)
+{
+    void *in = nullptr;
+    size_t in_size = 0;
+    size_t n;
+    uint64_t offset;
+
+    mb::MemoryFile file(&in, &in_size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.write_at(2, "x", 1, n));
+    ASSERT_EQ(n, 1u);
+    ASSERT_EQ(in_size, 3u);
+    ASSERT_EQ(memcmp(in, "\0\0x", 3), 0);
+
+    ASSERT_TRUE(file.seek(0, SEEK_CUR, &offset));
+    ASSERT_EQ(offset, 0u);
+
+    free(in);
+}
@@ -0,0 +1,393 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gmock/gmock.h>
+
+#include <cstring>
+
+#include <sys/mman.h>
+
+#include "mbcommon/file.h"
+#include "mbcommon/file/mmap.h"
+#include "mbcommon/file/mmap_p.h"
+
+struct MockMmapFileFuncs : public mb::MmapFileFuncs
+{
+    // fcntl.h
+    MOCK_METHOD3(fn_open, int(const char *path, int flags, mode_t mode));
+
+    // sys/mman.h
+    MOCK_METHOD6(fn_mmap, void *(void *addr, size_t length, int prot,
+                                 int flags, int fd, off_t offset));
+    MOCK_METHOD2(fn_munmap, int(void *addr, size_t length));
+
+    // sys/stat.h
+    MOCK_METHOD2(fn_fstat, int(int fildes, struct stat *buf));
+
+    // unistd.h
+    MOCK_METHOD1(fn_close, int(int fd));
+
+    struct stat _sb_regfile{};
+    char _data[6] = "abcde";
+
+    MockMmapFileFuncs()
+    {
+        _sb_regfile.st_mode = S_IFREG | S_IRWXU | S_IRWXG | S_IRWXO;
+        _sb_regfile.st_size = sizeof(_data) - 1;
+
+        // Fail everything by default
+        ON_CALL(*this, fn_open(testing::_, testing::_, testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_mmap(testing::_, testing::_, testing::_,
+                               testing::_, testing::_, testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, MAP_FAILED));
+        ON_CALL(*this, fn_munmap(testing::_, testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_fstat(testing::_, testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_close(testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+    }
+
+    void report_as_regular_file()
+    {
+        ON_CALL(*this, fn_fstat(testing::_, testing::_))
+                .WillByDefault(testing::DoAll(
+                        testing::SetArgPointee<1>(_sb_regfile),
+                        testing::Return(0)));
+    }
+
+    void open_with_success()
+    {
+        ON_CALL(*this, fn_open(testing::_, testing::_, testing::_))
+                .WillByDefault(testing::Return(0));
+    }
+
+    void map_with_success()
+    {
+        ON_CALL(*this, fn_mmap(testing::_, testing::_, testing::_,
+                               testing::_, testing::_, testing::_))
+                .WillByDefault(testing::Return(_data));
+        ON_CALL(*this, fn_munmap(testing::_, testing::_))
+                .WillByDefault(testing::Return(0));
+    }
+};
+
+class TestableMmapFilePrivate : public mb::MmapFilePrivate
+{
+public:
+    TestableMmapFilePrivate(mb::MmapFileFuncs *funcs)
+        : mb::MmapFilePrivate(funcs)
+    {
+    }
+};
+
+class TestableMmapFile : public mb::MmapFile
+{
+public:
+    MB_DECLARE_PRIVATE(TestableMmapFile)
+
+    TestableMmapFile(mb::MmapFileFuncs *funcs)
+        : mb::MmapFile(new TestableMmapFilePrivate(funcs))
+    {
+    }
+
+    TestableMmapFile(mb::MmapFileFuncs *funcs, int fd, bool owned)
+        : mb::MmapFile(new TestableMmapFilePrivate(funcs), fd, owned)
+    {
+    }
+
+    TestableMmapFile(mb::MmapFileFuncs *funcs, const std::string &filename)
+        : mb::MmapFile(new TestableMmapFilePrivate(funcs), filename)
+    {
+    }
+
+    ~TestableMmapFile()
+    {
+    }
+};
+
+struct FileMmapTest : testing::Test
+{
+    testing::NiceMock<MockMmapFileFuncs> _funcs;
+};
+
+TEST_F(FileMmapTest, OpenFilenameMbsSuccess)
+{
+    _funcs.report_as_regular_file();
+    _funcs.open_with_success();
+    _funcs.map_with_success();
+
+    EXPECT_CALL(_funcs, fn_open(testing::_, testing::_, testing::_))
+            .Times(1);
+    EXPECT_CALL(_funcs, fn_mmap(testing::_, _funcs._sb_regfile.st_size,
+                                PROT_READ, testing::_, testing::_, 0))
+            .Times(1);
+
+    TestableMmapFile file(&_funcs);
+    ASSERT_TRUE(file.open("x"));
+}
+
+TEST_F(FileMmapTest, OpenFilenameMbsFailure)
+{
+    _funcs.report_as_regular_file();
+
+    EXPECT_CALL(_funcs, fn_open(testing::_, testing::_, testing::_))
+            .Times(1);
+
+    TestableMmapFile file(&_funcs);
+    ASSERT_FALSE(file.open("x"));
+    ASSERT_EQ(file.error(), std::errc::io_error);
+}
+
+TEST_F(FileMmapTest, OpenFilenameWcsSuccess)
+{
+    _funcs.report_as_regular_file();
+    _funcs.open_with_success();
+    _funcs.map_with_success();
+
+    EXPECT_CALL(_funcs, fn_open(testing::_, testing::_, testing::_))
+            .Times(1);
+
+    TestableMmapFile file(&_funcs);
+    ASSERT_TRUE(file.open(L"x"));
+}
+
+TEST_F(FileMmapTest, OpenFstatFailed)
+{
+    EXPECT_CALL(_funcs, fn_fstat(testing::_, testing::_))
+            .Times(1);
+
+    TestableMmapFile file(&_funcs);
+    ASSERT_FALSE(file.open(0, false));
+    ASSERT_EQ(file.error(), std::errc::io_error);
+}
+
+TEST_F(FileMmapTest, OpenDirectory)
+{
+    struct stat sb{};
+    sb.st_mode = S_IFDIR | S_IRWXU | S_IRWXG | S_IRWXO;
+
+    EXPECT_CALL(_funcs, fn_fstat(testing::_, testing::_))
+            .Times(1)
+            .WillOnce(testing::DoAll(testing::SetArgPointee<1>(sb),
+                                     testing::Return(0)));
+
+    TestableMmapFile file(&_funcs);
+    ASSERT_FALSE(file.open(0, false));
+    ASSERT_EQ(file.error(), std::errc::is_a_directory);
+}
+
+TEST_F(FileMmapTest, OpenNonRegularFile)
+{
+    struct stat sb{};
+    sb.st_mode = S_IFCHR | S_IRWXU | S_IRWXG | S_IRWXO;
+
+    EXPECT_CALL(_funcs, fn_fstat(testing::_, testing::_))
+            .Times(1)
+            .WillOnce(testing::DoAll(testing::SetArgPointee<1>(sb),
+                                     testing::Return(0)));
+
+    TestableMmapFile file(&_funcs);
+    ASSERT_FALSE(file.open(0, false));
+    ASSERT_EQ(file.error(), std::errc::invalid_argument);
+}
+
+TEST_F(FileMmapTest, OpenMmapFailed)
+{
+    _funcs.report_as_regular_file();
+
+    EXPECT_CALL(_funcs, fn_mmap(testing::_, testing::_, testing::_,
+                                testing::_, testing::_, testing::_))
+            .Times(1);
+
+    TestableMmapFile file(&_funcs);
+    ASSERT_FALSE(file.open(0, false));
+    ASSERT_EQ(file.error(), std::errc::io_error);
+}
+
+TEST_F(FileMmapTest, OpenEmptyFileSkipsMapping)
+{
+    struct stat sb = _funcs._sb_regfile;
+    sb.st_size = 0;
+
+    EXPECT_CALL(_funcs, fn_fstat(testing::_, testing::_))
+            .Times(1)
+            .WillOnce(testing::DoAll(testing::SetArgPointee<1>(sb),
+                                     testing::Return(0)));
+    EXPECT_CALL(_funcs, fn_mmap(testing::_, testing::_, testing::_,
+                                testing::_, testing::_, testing::_))
+            .Times(0);
+    EXPECT_CALL(_funcs, fn_munmap(testing::_, testing::_))
+            .Times(0);
+
+    TestableMmapFile file(&_funcs, 0, false);
+    ASSERT_TRUE(file.is_open());
+
+    char c;
+    size_t n;
+    ASSERT_TRUE(file.read(&c, 1, n));
+    ASSERT_EQ(n, 0u);
+}
+
+TEST_F(FileMmapTest, CloseUnownedFile)
+{
+    _funcs.report_as_regular_file();
+    _funcs.map_with_success();
+
+    EXPECT_CALL(_funcs, fn_munmap(testing::_, testing::_))
+            .Times(1);
+    EXPECT_CALL(_funcs, fn_close(testing::_))
+            .Times(0);
+
+    TestableMmapFile file(&_funcs, 0, false);
+    ASSERT_TRUE(file.is_open());
+    ASSERT_TRUE(file.close());
+}
+
+TEST_F(FileMmapTest, CloseOwnedFile)
+{
+    _funcs.report_as_regular_file();
+    _funcs.map_with_success();
+
+    EXPECT_CALL(_funcs, fn_munmap(testing::_, testing::_))
+            .Times(1);
+    EXPECT_CALL(_funcs, fn_close(testing::_))
+            .Times(1)
+            .WillOnce(testing::Return(0));
+
+    TestableMmapFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+    ASSERT_TRUE(file.close());
+}
+
+TEST_F(FileMmapTest, CloseFailure)
+{
+    _funcs.report_as_regular_file();
+    _funcs.map_with_success();
+
+    EXPECT_CALL(_funcs, fn_close(testing::_))
+            .Times(1);
+
+    TestableMmapFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+    ASSERT_FALSE(file.close());
+    ASSERT_EQ(file.error(), std::errc::io_error);
+}
+
+TEST_F(FileMmapTest, ReadSuccess)
+{
+    _funcs.report_as_regular_file();
+    _funcs.map_with_success();
+
+    TestableMmapFile file(&_funcs, 0, false);
+    ASSERT_TRUE(file.is_open());
+
+    char buf[10];
+    size_t n;
+    ASSERT_TRUE(file.read(buf, 3, n));
+    ASSERT_EQ(n, 3u);
+    ASSERT_EQ(memcmp(buf, "abc", 3), 0);
+
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, 2u);
+    ASSERT_EQ(memcmp(buf, "de", 2), 0);
+
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, 0u);
+}
+
+TEST_F(FileMmapTest, WriteUnsupported)
+{
+    _funcs.report_as_regular_file();
+    _funcs.map_with_success();
+
+    TestableMmapFile file(&_funcs, 0, false);
+    ASSERT_TRUE(file.is_open());
+
+    size_t n;
+    ASSERT_FALSE(file.write("x", 1, n));
+    ASSERT_EQ(file.error(), mb::FileError::UnsupportedWrite);
+}
+
+TEST_F(FileMmapTest, SeekSuccess)
+{
+    _funcs.report_as_regular_file();
+    _funcs.map_with_success();
+
+    TestableMmapFile file(&_funcs, 0, false);
+    ASSERT_TRUE(file.is_open());
+
+    uint64_t offset;
+    ASSERT_TRUE(file.seek(2, SEEK_SET, &offset));
+    ASSERT_EQ(offset, 2u);
+    ASSERT_TRUE(file.seek(1, SEEK_CUR, &offset));
+    ASSERT_EQ(offset, 3u);
+    ASSERT_TRUE(file.seek(-1, SEEK_END, &offset));
+    ASSERT_EQ(offset, 4u);
+
+    char c;
+    size_t n;
+    ASSERT_TRUE(file.read(&c, 1, n));
+    ASSERT_EQ(n, 1u);
+    ASSERT_EQ(c, 'e');
+}
+
+TEST_F(FileMmapTest, SeekFailure)
+{
+    _funcs.report_as_regular_file();
+    _funcs.map_with_success();
+
+    TestableMmapFile file(&_funcs, 0, false);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_FALSE(file.seek(-1, SEEK_SET, nullptr));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidArgument);
+    ASSERT_FALSE(file.seek(-10, SEEK_END, nullptr));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidArgument);
+}
+
+TEST_F(FileMmapTest, PeekReturnsMappedData)
+{
+    _funcs.report_as_regular_file();
+    _funcs.map_with_success();
+
+    TestableMmapFile file(&_funcs, 0, false);
+    ASSERT_TRUE(file.is_open());
+
+    const void *data;
+    size_t n;
+    ASSERT_TRUE(file.peek(1, 3, data, n));
+    ASSERT_EQ(n, 3u);
+    ASSERT_EQ(data, _funcs._data + 1);
+
+    // Truncated at EOF
+    ASSERT_TRUE(file.peek(3, 10, data, n));
+    ASSERT_EQ(n, 2u);
+    ASSERT_EQ(data, _funcs._data + 3);
+
+    // Beyond EOF
+    ASSERT_TRUE(file.peek(10, 10, data, n));
+    ASSERT_EQ(n, 0u);
+
+    // File position is unchanged
+    uint64_t offset;
+    ASSERT_TRUE(file.seek(0, SEEK_CUR, &offset));
+    ASSERT_EQ(offset, 0u);
+}
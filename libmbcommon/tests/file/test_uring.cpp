@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "mbcommon/file/uring.h"
+#include "mbcommon/file_util.h"
+
+struct FileUringTest : testing::Test
+{
+    std::string _path;
+
+    virtual void SetUp() override
+    {
+        const char *tmpdir = getenv("TMPDIR");
+        std::string tmpl(tmpdir ? tmpdir : "/tmp");
+        tmpl += "/mbcommon-uring-XXXXXX";
+
+        std::vector<char> buf(tmpl.begin(), tmpl.end());
+        buf.push_back('\0');
+
+        int fd = mkstemp(buf.data());
+        ASSERT_GE(fd, 0);
+        close(fd);
+
+        _path = buf.data();
+    }
+
+    virtual void TearDown() override
+    {
+        unlink(_path.c_str());
+    }
+};
+
+TEST_F(FileUringTest, ReadWriteSync)
+{
+    mb::UringFile file(_path, mb::FileOpenMode::READ_WRITE_TRUNC);
+    ASSERT_TRUE(file.is_open());
+
+    size_t n;
+    ASSERT_TRUE(mb::file_write_fully(file, "foobar", 6, n));
+    ASSERT_EQ(n, 6u);
+
+    uint64_t offset;
+    ASSERT_TRUE(file.seek(0, SEEK_CUR, &offset));
+    ASSERT_EQ(offset, 6u);
+
+    char buf[6];
+    ASSERT_TRUE(file.seek(0, SEEK_SET, nullptr));
+    ASSERT_TRUE(mb::file_read_fully(file, buf, sizeof(buf), n));
+    ASSERT_EQ(n, 6u);
+    ASSERT_EQ(memcmp(buf, "foobar", 6), 0);
+
+    ASSERT_TRUE(file.read_at(3, buf, 3, n));
+    ASSERT_EQ(n, 3u);
+    ASSERT_EQ(memcmp(buf, "bar", 3), 0);
+
+    ASSERT_TRUE(file.close());
+}
+
+TEST_F(FileUringTest, AsyncWriteThenRead)
+{
+    constexpr size_t count = 200;
+    constexpr size_t block = 512;
+
+    mb::UringFile file(_path, mb::FileOpenMode::READ_WRITE_TRUNC);
+    ASSERT_TRUE(file.is_open());
+
+    std::vector<std::vector<char>> blocks(count);
+    for (size_t i = 0; i < count; ++i) {
+        blocks[i].assign(block, static_cast<char>('a' + (i % 26)));
+        ASSERT_TRUE(file.submit_write_at(i * block, blocks[i].data(), block,
+                                         &blocks[i]));
+    }
+
+    std::vector<mb::UringCompletion> completions;
+    ASSERT_TRUE(file.reap(count, completions));
+    ASSERT_EQ(completions.size(), count);
+    for (auto const &c : completions) {
+        ASSERT_FALSE(c.error);
+        ASSERT_EQ(c.bytes, block);
+    }
+    ASSERT_EQ(file.in_flight(), 0u);
+
+    std::vector<char> out(count * block);
+    for (size_t i = 0; i < count; ++i) {
+        ASSERT_TRUE(file.submit_read_at(i * block, out.data() + i * block,
+                                        block, reinterpret_cast<void *>(i)));
+    }
+    ASSERT_TRUE(file.submit());
+
+    completions.clear();
+    ASSERT_TRUE(file.reap(count, completions));
+    ASSERT_EQ(completions.size(), count);
+
+    for (size_t i = 0; i < count; ++i) {
+        ASSERT_EQ(out[i * block], static_cast<char>('a' + (i % 26)));
+        ASSERT_EQ(out[i * block + block - 1],
+                  static_cast<char>('a' + (i % 26)));
+    }
+}
+
+TEST_F(FileUringTest, RegisteredBuffers)
+{
+    mb::UringFile file(_path, mb::FileOpenMode::READ_WRITE_TRUNC);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.register_buffers(2, 4096));
+    ASSERT_EQ(file.buffer_count(), 2u);
+    ASSERT_EQ(file.buffer_size(), 4096u);
+    ASSERT_NE(file.buffer(1), nullptr);
+    ASSERT_EQ(file.buffer(2), nullptr);
+
+    memset(file.buffer(0), 'x', 4096);
+    ASSERT_TRUE(file.submit_write_fixed(0, 0, 4096, nullptr));
+
+    std::vector<mb::UringCompletion> completions;
+    ASSERT_TRUE(file.reap(1, completions));
+    ASSERT_EQ(completions.size(), 1u);
+    ASSERT_EQ(completions[0].bytes, 4096u);
+
+    ASSERT_TRUE(file.submit_read_fixed(0, 1, 4096, nullptr));
+    completions.clear();
+    ASSERT_TRUE(file.reap(1, completions));
+    ASSERT_EQ(completions.size(), 1u);
+    ASSERT_EQ(completions[0].bytes, 4096u);
+    ASSERT_EQ(memcmp(file.buffer(0), file.buffer(1), 4096), 0);
+
+    // Buffer range is checked
+    ASSERT_FALSE(file.submit_read_fixed(0, 2, 1, nullptr));
+    ASSERT_EQ(file.error(), mb::FileError::ArgumentOutOfRange);
+    ASSERT_FALSE(file.submit_read_fixed(0, 0, 4097, nullptr));
+}
+
+TEST_F(FileUringTest, AsyncReadError)
+{
+    mb::UringFile file(_path, mb::FileOpenMode::READ_ONLY);
+    ASSERT_TRUE(file.is_open());
+
+    char c = 'x';
+    ASSERT_TRUE(file.submit_write_at(0, &c, 1, &c));
+
+    std::vector<mb::UringCompletion> completions;
+    ASSERT_TRUE(file.reap(1, completions));
+    ASSERT_EQ(completions.size(), 1u);
+    ASSERT_EQ(completions[0].tag, &c);
+    ASSERT_TRUE(completions[0].error);
+}
+
+TEST_F(FileUringTest, SubmitClosed)
+{
+    mb::UringFile file;
+    char c;
+
+    ASSERT_FALSE(file.submit_read_at(0, &c, 1, nullptr));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidState);
+}
@@ -62,6 +62,11 @@ struct MockWin32FileFuncs : public mb::Win32FileFuncs
 {
     // windows.h
     MOCK_METHOD1(fn_CloseHandle, BOOL(HANDLE hObject));
+    MOCK_METHOD4(fn_CreateEventW,
+                 HANDLE(LPSECURITY_ATTRIBUTES lpEventAttributes,
+                        BOOL bManualReset,
+                        BOOL bInitialState,
+                        LPCWSTR lpName));
     MOCK_METHOD7(fn_CreateFileW, HANDLE(LPCWSTR lpFileName,
                                         DWORD dwDesiredAccess,
                                         DWORD dwShareMode,
@@ -69,6 +74,13 @@ struct MockWin32FileFuncs : public mb::Win32FileFuncs
                                         DWORD dwCreationDisposition,
                                         DWORD dwFlagsAndAttributes,
                                         HANDLE hTemplateFile));
+    MOCK_METHOD2(fn_GetFileSizeEx, BOOL(HANDLE hFile,
+                                        PLARGE_INTEGER lpFileSize));
+    MOCK_METHOD4(fn_GetOverlappedResult,
+                 BOOL(HANDLE hFile,
+                      LPOVERLAPPED lpOverlapped,
+                      LPDWORD lpNumberOfBytesTransferred,
+                      BOOL bWait));
     MOCK_METHOD5(fn_ReadFile, BOOL(HANDLE hFile,
                                    LPVOID lpBuffer,
                                    DWORD nNumberOfBytesToRead,
@@ -79,6 +91,8 @@ struct MockWin32FileFuncs : public mb::Win32FileFuncs
                                            LARGE_INTEGER liDistanceToMove,
                                            PLARGE_INTEGER lpNewFilePointer,
                                            DWORD dwMoveMethod));
+    MOCK_METHOD2(fn_SetFileValidData, BOOL(HANDLE hFile,
+                                           LONGLONG ValidDataLength));
     MOCK_METHOD5(fn_WriteFile, BOOL(HANDLE hFile,
                                     LPCVOID lpBuffer,
                                     DWORD nNumberOfBytesToWrite,
@@ -91,11 +105,22 @@ struct MockWin32FileFuncs : public mb::Win32FileFuncs
         ON_CALL(*this, fn_CloseHandle(testing::_))
                 .WillByDefault(SetWin32ErrorAndReturn(ERROR_INVALID_HANDLE,
                                                       FALSE));
+        ON_CALL(*this, fn_CreateEventW(testing::_, testing::_, testing::_,
+                                       testing::_))
+                .WillByDefault(SetWin32ErrorAndReturn(ERROR_INVALID_HANDLE,
+                                                      nullptr));
         ON_CALL(*this, fn_CreateFileW(testing::_, testing::_, testing::_,
                                       testing::_, testing::_, testing::_,
                                       testing::_))
                 .WillByDefault(SetWin32ErrorAndReturn(ERROR_INVALID_HANDLE,
                                                       INVALID_HANDLE_VALUE));
+        ON_CALL(*this, fn_GetFileSizeEx(testing::_, testing::_))
+                .WillByDefault(SetWin32ErrorAndReturn(ERROR_INVALID_HANDLE,
+                                                      FALSE));
+        ON_CALL(*this, fn_GetOverlappedResult(testing::_, testing::_,
+                                              testing::_, testing::_))
+                .WillByDefault(SetWin32ErrorAndReturn(ERROR_INVALID_HANDLE,
+                                                      FALSE));
         ON_CALL(*this, fn_ReadFile(testing::_, testing::_, testing::_,
                                    testing::_, testing::_))
                 .WillByDefault(SetWin32ErrorAndReturn(ERROR_INVALID_HANDLE,
@@ -107,6 +132,9 @@ struct MockWin32FileFuncs : public mb::Win32FileFuncs
                                            testing::_))
                 .WillByDefault(SetWin32ErrorAndReturn(ERROR_INVALID_HANDLE,
                                                       FALSE));
+        ON_CALL(*this, fn_SetFileValidData(testing::_, testing::_))
+                .WillByDefault(SetWin32ErrorAndReturn(ERROR_INVALID_HANDLE,
+                                                      FALSE));
         ON_CALL(*this, fn_WriteFile(testing::_, testing::_, testing::_,
                                     testing::_, testing::_))
                 .WillByDefault(SetWin32ErrorAndReturn(ERROR_INVALID_HANDLE,
@@ -616,3 +644,94 @@ TEST_F(FileWin32Test, TruncateThirdSeekFailed)
     ASSERT_TRUE(file.is_fatal());
     ASSERT_EQ(file.error().value(), ERROR_INVALID_HANDLE);
 }
+
+TEST_F(FileWin32Test, OpenSequentialScanHint)
+{
+    EXPECT_CALL(_funcs, fn_CreateFileW(testing::_, testing::_, testing::_,
+                                       testing::_, testing::_,
+                                       FILE_FLAG_SEQUENTIAL_SCAN, testing::_))
+            .Times(1)
+            .WillOnce(testing::Return(reinterpret_cast<HANDLE>(1)));
+
+    TestableWin32File file(&_funcs);
+    ASSERT_TRUE(file.set_hints(mb::Win32FileHint::SequentialScan));
+    ASSERT_TRUE(file.open(L"x", mb::FileOpenMode::WRITE_ONLY));
+    ASSERT_FALSE(file.read_ahead_active());
+}
+
+TEST_F(FileWin32Test, OpenReadAheadHint)
+{
+    EXPECT_CALL(_funcs, fn_CreateFileW(testing::_, testing::_, testing::_,
+                                       testing::_, testing::_,
+                                       FILE_FLAG_OVERLAPPED, testing::_))
+            .Times(1)
+            .WillOnce(testing::Return(reinterpret_cast<HANDLE>(1)));
+    EXPECT_CALL(_funcs, fn_CreateEventW(testing::_, testing::_, testing::_,
+                                        testing::_))
+            .Times(2)
+            .WillRepeatedly(testing::Return(reinterpret_cast<HANDLE>(2)));
+
+    TestableWin32File file(&_funcs);
+    ASSERT_TRUE(file.set_hints(mb::Win32FileHint::ReadAhead));
+    ASSERT_TRUE(file.open(L"x", mb::FileOpenMode::READ_ONLY));
+    ASSERT_TRUE(file.read_ahead_active());
+
+    // Hints cannot be changed while the file is open
+    ASSERT_FALSE(file.set_hints(mb::Win32FileHints()));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidState);
+
+    size_t n;
+    ASSERT_FALSE(file.write("x", 1, n));
+    ASSERT_EQ(file.error(), mb::FileError::UnsupportedWrite);
+}
+
+TEST_F(FileWin32Test, OpenReadAheadHintIgnoredForWriting)
+{
+    EXPECT_CALL(_funcs, fn_CreateFileW(testing::_, testing::_, testing::_,
+                                       testing::_, testing::_, 0, testing::_))
+            .Times(1)
+            .WillOnce(testing::Return(reinterpret_cast<HANDLE>(1)));
+    EXPECT_CALL(_funcs, fn_CreateEventW(testing::_, testing::_, testing::_,
+                                        testing::_))
+            .Times(0);
+
+    TestableWin32File file(&_funcs);
+    ASSERT_TRUE(file.set_hints(mb::Win32FileHint::ReadAhead));
+    ASSERT_TRUE(file.open(L"x", mb::FileOpenMode::READ_WRITE));
+    ASSERT_FALSE(file.read_ahead_active());
+}
+
+TEST_F(FileWin32Test, PreallocateNotOpen)
+{
+    TestableWin32File file(&_funcs);
+    ASSERT_FALSE(file.preallocate(1024));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidState);
+}
+
+TEST_F(FileWin32Test, PreallocateExtendsFile)
+{
+    LARGE_INTEGER size;
+    size.QuadPart = 0;
+
+    EXPECT_CALL(_funcs, fn_GetFileSizeEx(testing::_, testing::_))
+            .Times(1)
+            .WillOnce(testing::DoAll(testing::SetArgPointee<1>(size),
+                                     testing::Return(TRUE)));
+    EXPECT_CALL(_funcs, fn_SetFilePointerEx(testing::_, testing::_, testing::_,
+                                            testing::_))
+            .Times(3)
+            .WillRepeatedly(testing::DoAll(testing::SetArgPointee<2>(size),
+                                           testing::Return(TRUE)));
+    EXPECT_CALL(_funcs, fn_SetEndOfFile(testing::_))
+            .Times(1)
+            .WillOnce(testing::Return(TRUE));
+    EXPECT_CALL(_funcs, fn_SetFileValidData(testing::_, 1024))
+            .Times(1)
+            .WillOnce(SetWin32ErrorAndReturn(ERROR_PRIVILEGE_NOT_HELD, FALSE));
+
+    TestableWin32File file(&_funcs, nullptr, true, false);
+    ASSERT_TRUE(file.is_open());
+
+    // Missing privilege is not an error
+    ASSERT_TRUE(file.preallocate(1024, true));
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <utility>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include "mbcommon/buffer_pool.h"
+
+TEST(BufferPoolTest, SizeIsRoundedUpToPowerOfTwo)
+{
+    mb::IoBuffer buf;
+    ASSERT_FALSE(buf);
+
+    ASSERT_TRUE(buf.allocate(1));
+    ASSERT_EQ(buf.size(), 4096u);
+
+    ASSERT_TRUE(buf.allocate(10240));
+    ASSERT_EQ(buf.size(), 16384u);
+
+    ASSERT_TRUE(buf.allocate(65536));
+    ASSERT_EQ(buf.size(), 65536u);
+
+    ASSERT_TRUE(buf.allocate());
+    ASSERT_EQ(buf.size(), mb::IO_BUFFER_DEFAULT_SIZE);
+}
+
+TEST(BufferPoolTest, BufferIsAligned)
+{
+    for (size_t size : { 1u, 5000u, 1u << 20, 1u << 24 }) {
+        mb::IoBuffer buf(size);
+        ASSERT_TRUE(buf);
+        ASSERT_EQ(reinterpret_cast<uintptr_t>(buf.data())
+                  % mb::IO_BUFFER_ALIGNMENT, 0u);
+
+        // Make sure the whole buffer is usable
+        memset(buf.data(), 0xff, buf.size());
+    }
+}
+
+TEST(BufferPoolTest, ReleasedBufferIsReused)
+{
+    // Use a new thread so that the cache isn't already full from other tests
+    std::thread([] {
+        void *ptr;
+
+        {
+            mb::IoBuffer buf(100000);
+            ASSERT_TRUE(buf);
+            ptr = buf.data();
+        }
+
+        mb::IoBuffer buf(100000);
+        ASSERT_TRUE(buf);
+        ASSERT_EQ(buf.data(), ptr);
+    }).join();
+}
+
+TEST(BufferPoolTest, LiveBuffersAreDistinct)
+{
+    mb::IoBuffer a(8192);
+    mb::IoBuffer b(8192);
+    ASSERT_TRUE(a);
+    ASSERT_TRUE(b);
+    ASSERT_NE(a.data(), b.data());
+}
+
+TEST(BufferPoolTest, CacheIsFreedOnThreadExit)
+{
+    // Run under ASan/valgrind to check for leaks
+    std::thread([] {
+        for (int i = 0; i < 100; ++i) {
+            mb::IoBuffer buf(8192);
+            ASSERT_TRUE(buf);
+        }
+    }).join();
+}
+
+TEST(BufferPoolTest, MoveTransfersOwnership)
+{
+    mb::IoBuffer a(4096);
+    ASSERT_TRUE(a);
+    void *ptr = a.data();
+
+    mb::IoBuffer b(std::move(a));
+    ASSERT_FALSE(a);
+    ASSERT_EQ(b.data(), ptr);
+    ASSERT_EQ(b.size(), 4096u);
+
+    a = std::move(b);
+    ASSERT_FALSE(b);
+    ASSERT_EQ(a.data(), ptr);
+    ASSERT_EQ(b.size(), 0u);
+}
+
+TEST(BufferPoolTest, HugeSizeFails)
+{
+    mb::IoBuffer buf;
+    ASSERT_FALSE(buf.allocate(SIZE_MAX));
+    ASSERT_EQ(errno, ENOMEM);
+    ASSERT_FALSE(buf);
+}
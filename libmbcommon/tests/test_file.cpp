@@ -516,3 +516,74 @@ TEST(FileTest, SetError)
     ASSERT_EQ(file.error(), file._priv_func()->error_code);
     ASSERT_EQ(file.error_string(), file._priv_func()->error_string);
 }
+
+TEST(FileTest, PeekUnsupportedByDefault)
+{
+    testing::NiceMock<MockTestFile> file;
+
+    // Open file
+    ASSERT_TRUE(file.open());
+
+    // Peek file
+    const void *data;
+    size_t n;
+    ASSERT_FALSE(file.peek(0, 1, data, n));
+    ASSERT_EQ(file.error(), mb::FileError::UnsupportedPeek);
+    ASSERT_EQ(file._priv_func()->state, mb::FileState::OPENED);
+}
+
+TEST(FileTest, PeekInWrongState)
+{
+    testing::NiceMock<MockTestFile> file;
+
+    // Peek file
+    const void *data;
+    size_t n;
+    ASSERT_FALSE(file.peek(0, 1, data, n));
+    ASSERT_EQ(file._priv_func()->state, mb::FileState::NEW);
+    ASSERT_EQ(file._priv_func()->error_code, mb::FileError::InvalidState);
+}
+
+TEST(FileTest, ReadAtFallbackRestoresPosition)
+{
+    TestFile file;
+    ASSERT_TRUE(file.open());
+
+    uint64_t offset;
+    ASSERT_TRUE(file.seek(5, SEEK_SET, nullptr));
+
+    char buf[3];
+    size_t n;
+    ASSERT_TRUE(file.read_at(26, buf, sizeof(buf), n));
+    ASSERT_EQ(n, 3u);
+    ASSERT_EQ(memcmp(buf, "abc", 3), 0);
+
+    ASSERT_TRUE(file.write_at(0, "XY", 2, n));
+    ASSERT_EQ(n, 2u);
+    ASSERT_EQ(file._buf[0], 'X');
+    ASSERT_EQ(file._buf[1], 'Y');
+
+    ASSERT_TRUE(file.seek(0, SEEK_CUR, &offset));
+    ASSERT_EQ(offset, 5u);
+}
+
+TEST(FileTest, ReadAtFallbackSeekFailure)
+{
+    testing::NiceMock<MockTestFile> file;
+    ASSERT_TRUE(file.open());
+
+    EXPECT_CALL(file, on_seek(testing::_, testing::_, testing::_))
+            .WillOnce(testing::Invoke([&](int64_t, int, uint64_t &) {
+                file.set_error(mb::make_error_code(
+                        mb::FileError::UnsupportedSeek), "No seeking");
+                return false;
+            }));
+    EXPECT_CALL(file, on_read(testing::_, testing::_, testing::_))
+            .Times(0);
+
+    char c;
+    size_t n;
+    ASSERT_FALSE(file.read_at(0, &c, 1, n));
+    ASSERT_EQ(file.error(), mb::FileError::UnsupportedSeek);
+    ASSERT_TRUE(file.is_open());
+}
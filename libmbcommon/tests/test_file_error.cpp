@@ -45,4 +45,7 @@ TEST(FileErrorTest, CheckErrorCodesComparableToErrorConditions)
     ec = mb::make_error_code(mb::FileError::UnsupportedTruncate);
     ASSERT_EQ(ec, mb::FileError::Unsupported);
     ASSERT_EQ(mb::FileError::Unsupported, ec);
+    ec = mb::make_error_code(mb::FileError::UnsupportedPeek);
+    ASSERT_EQ(ec, mb::FileError::Unsupported);
+    ASSERT_EQ(mb::FileError::Unsupported, ec);
 }
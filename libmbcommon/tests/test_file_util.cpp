@@ -19,7 +19,9 @@
 
 #include <gmock/gmock.h>
 
+#include <algorithm>
 #include <memory>
+#include <vector>
 
 #include <cinttypes>
 
@@ -161,6 +163,54 @@ TEST_F(FileUtilTest, WriteFullyPartialFail)
     ASSERT_EQ(n, 8u);
 }
 
+TEST_F(FileUtilTest, WritevFullyNormal)
+{
+    // Write at most 3 bytes at a time to force buffers to be split
+    EXPECT_CALL(_file, on_write(testing::_, testing::_, testing::_))
+            .Times(4)
+            .WillRepeatedly(testing::Invoke([&](const void *buf, size_t size,
+                                                size_t &bytes_written) {
+                return _file.orig_on_write(buf, std::min<size_t>(size, 3),
+                                           bytes_written);
+            }));
+
+    // Open file
+    ASSERT_TRUE(_file.open());
+
+    mb::FileConstIoVec iov[] = {
+        { "abcd", 4 },
+        { nullptr, 0 },
+        { "efgh", 4 },
+    };
+
+    size_t n;
+    ASSERT_TRUE(mb::file_writev_fully(_file, iov, 3, n));
+    ASSERT_EQ(n, 8u);
+    ASSERT_EQ(memcmp(_file._buf.data(), "abcdefgh", 8), 0);
+}
+
+TEST_F(FileUtilTest, WritevFullyPartialFail)
+{
+    EXPECT_CALL(_file, on_write(testing::_, testing::_, testing::_))
+            .Times(3)
+            .WillOnce(testing::DoAll(testing::SetArgReferee<2>(4),
+                                     testing::Return(true)))
+            .WillRepeatedly(testing::DoAll(testing::SetArgReferee<2>(0),
+                                           testing::Return(false)));
+
+    // Open file
+    ASSERT_TRUE(_file.open());
+
+    mb::FileConstIoVec iov[] = {
+        { "abcd", 4 },
+        { "efgh", 4 },
+    };
+
+    size_t n;
+    ASSERT_FALSE(mb::file_writev_fully(_file, iov, 2, n));
+    ASSERT_EQ(n, 4u);
+}
+
 TEST_F(FileUtilTest, ReadDiscardNormal)
 {
     EXPECT_CALL(_file, on_read(testing::_, testing::_, testing::_))
@@ -297,6 +347,146 @@ TEST_F(FileSearchTest, FindNormal)
                                 this));
 }
 
+static mb::FileSearchAction collect_offsets_cb(mb::File &file, void *userdata,
+                                              uint64_t offset)
+{
+    (void) file;
+
+    auto offsets = static_cast<std::vector<uint64_t> *>(userdata);
+    offsets->push_back(offset);
+
+    return mb::FileSearchAction::Continue;
+}
+
+TEST_F(FileSearchTest, FindInPlaceMatchesBufferedSearch)
+{
+    // TestFile does not support peeking, so the buffered path is used
+    TestFile buffered_file;
+    ASSERT_TRUE(buffered_file.open());
+
+    std::vector<unsigned char> data(buffered_file._buf);
+
+    mb::MemoryFile mem_file(data.data(), data.size());
+    ASSERT_TRUE(mem_file.is_open());
+
+    std::vector<uint64_t> buffered_offsets;
+    std::vector<uint64_t> in_place_offsets;
+
+    // Small buffer to exercise matches spanning buffer refills
+    ASSERT_TRUE(mb::file_search(buffered_file, 10, 1000, 8, "xyz", 3, -1,
+                                &collect_offsets_cb, &buffered_offsets));
+    ASSERT_TRUE(mb::file_search(mem_file, 10, 1000, 8, "xyz", 3, -1,
+                                &collect_offsets_cb, &in_place_offsets));
+
+    ASSERT_FALSE(in_place_offsets.empty());
+    ASSERT_EQ(in_place_offsets.front(), 23u);
+    ASSERT_EQ(in_place_offsets, buffered_offsets);
+
+    // Max matches is respected
+    in_place_offsets.clear();
+    ASSERT_TRUE(mb::file_search(mem_file, -1, -1, 0, "xyz", 3, 2,
+                                &collect_offsets_cb, &in_place_offsets));
+    ASSERT_EQ(in_place_offsets, (std::vector<uint64_t>{23, 49}));
+
+    ASSERT_TRUE(buffered_file.close());
+}
+
+static mb::FileSearchAction collect_multi_cb(mb::File &file, void *userdata,
+                                            size_t index, uint64_t offset)
+{
+    (void) file;
+
+    auto results = static_cast<std::vector<std::pair<size_t, uint64_t>> *>(
+            userdata);
+    results->emplace_back(index, offset);
+
+    return mb::FileSearchAction::Continue;
+}
+
+TEST_F(FileSearchTest, FindMultiNormal)
+{
+    // Patterns share a prefix, overlap each other, and cross the 16-byte
+    // boundaries of the vectorized filter
+    static constexpr char data[] =
+            "ANDROID!....LOKI....ANDROID!ANDROIDxx........\x7f" "ELF"
+            "..........................LOKILOKI";
+    const mb::FileSearchPattern patterns[] = {
+        { "ANDROID!", 8 },
+        { "ANDROID", 7 },
+        { "LOKI", 4 },
+        { "\x7f" "ELF", 4 },
+        { "", 0 },
+    };
+    const std::vector<std::pair<size_t, uint64_t>> expected{
+        { 0, 0 }, { 1, 0 }, { 2, 12 }, { 0, 20 }, { 1, 20 }, { 1, 28 },
+        { 3, 45 }, { 2, 75 }, { 2, 79 },
+    };
+
+    TestFile buffered_file;
+    ASSERT_TRUE(buffered_file.open());
+    buffered_file._buf.assign(data, data + sizeof(data) - 1);
+
+    mb::MemoryFile mem_file(data, sizeof(data) - 1);
+    ASSERT_TRUE(mem_file.is_open());
+
+    for (size_t bsize : { 0, 8, 9, 17 }) {
+        std::vector<std::pair<size_t, uint64_t>> results;
+
+        ASSERT_TRUE(buffered_file.seek(0, SEEK_SET, nullptr));
+        ASSERT_TRUE(mb::file_search_multi(buffered_file, -1, -1, bsize,
+                                          patterns, 5, -1, &collect_multi_cb,
+                                          &results));
+        ASSERT_EQ(results, expected) << "bsize: " << bsize;
+    }
+
+    std::vector<std::pair<size_t, uint64_t>> results;
+    ASSERT_TRUE(mb::file_search_multi(mem_file, -1, -1, 0, patterns, 5, -1,
+                                      &collect_multi_cb, &results));
+    ASSERT_EQ(results, expected);
+
+    ASSERT_TRUE(buffered_file.close());
+}
+
+TEST_F(FileSearchTest, FindMultiBoundaries)
+{
+    static constexpr char data[] = "abcabcabcxyz";
+    const mb::FileSearchPattern patterns[] = {
+        { "abc", 3 },
+        { "xyz", 3 },
+    };
+
+    TestFile buffered_file;
+    ASSERT_TRUE(buffered_file.open());
+    buffered_file._buf.assign(data, data + sizeof(data) - 1);
+
+    mb::MemoryFile mem_file(data, sizeof(data) - 1);
+    ASSERT_TRUE(mem_file.is_open());
+
+    for (mb::File *file : { static_cast<mb::File *>(&buffered_file),
+                            static_cast<mb::File *>(&mem_file) }) {
+        std::vector<std::pair<size_t, uint64_t>> results;
+
+        // Start and end offsets are respected
+        ASSERT_TRUE(mb::file_search_multi(*file, 1, 11, 4, patterns, 2, -1,
+                                          &collect_multi_cb, &results));
+        ASSERT_EQ(results, (std::vector<std::pair<size_t, uint64_t>>{
+                { 0, 3 }, { 0, 6 }}));
+
+        // Max matches is respected
+        results.clear();
+        ASSERT_TRUE(mb::file_search_multi(*file, -1, -1, 0, patterns, 2, 2,
+                                          &collect_multi_cb, &results));
+        ASSERT_EQ(results.size(), 2u);
+
+        // Buffer must fit the largest pattern
+        ASSERT_FALSE(mb::file_search_multi(*file, -1, -1, 2, patterns, 2, -1,
+                                           &collect_multi_cb, &results));
+        ASSERT_EQ(file->error(), mb::FileError::InvalidArgument);
+    }
+
+    ASSERT_TRUE(buffered_file.close());
+}
+
 TEST(FileMoveTest, DegenerateCasesShouldSucceed)
 {
     constexpr char buf[] = "abcdef";
@@ -414,4 +604,47 @@ TEST(FileMoveTest, LargeBackwardsCopyShouldSucceed)
     free(buf);
 }
 
+TEST(FileMoveTest, DynamicBufferShouldGrow)
+{
+    std::vector<unsigned char> buf{'a', 'b', 'c', 'd'};
+    uint64_t n;
+
+    mb::MemoryFile file(&buf);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(mb::file_move(file, 0, 6, 4, n));
+    ASSERT_EQ(n, 4u);
+    ASSERT_EQ(buf, (std::vector<unsigned char>{
+            'a', 'b', 'c', 'd', 0, 0, 'a', 'b', 'c', 'd'}));
+}
+
+TEST(FileMoveTest, GenericBackwardsCopyShouldSucceed)
+{
+    // TestFile does not override on_move(), so the buffered path is used
+    TestFile file;
+    ASSERT_TRUE(file.open());
+
+    std::vector<unsigned char> orig = file._buf;
+
+    uint64_t n;
+    ASSERT_TRUE(mb::file_move(file, 0, 100, 800, n));
+    ASSERT_EQ(n, 800u);
+    ASSERT_TRUE(std::equal(orig.begin(), orig.begin() + 800,
+                           file._buf.begin() + 100));
+}
+
+TEST(FileMoveTest, GenericForwardsCopyPastEofShouldCopyPartially)
+{
+    TestFile file;
+    ASSERT_TRUE(file.open());
+
+    std::vector<unsigned char> orig = file._buf;
+
+    uint64_t n;
+    ASSERT_TRUE(mb::file_move(file, 900, 0, 300, n));
+    ASSERT_EQ(n, 124u);
+    ASSERT_TRUE(std::equal(orig.begin() + 900, orig.end(),
+                           file._buf.begin()));
+}
+
 // TODO: Add more tests after integrating gmock
@@ -31,6 +31,37 @@ TEST(StringTest, FormatEmptyString)
     ASSERT_EQ(mb::format(""), "");
 }
 
+TEST(StringTest, FormatLongString)
+{
+    // Larger than the stack buffer
+    std::string arg(1000, 'x');
+
+    ASSERT_EQ(mb::format("[%s]", arg.c_str()), "[" + arg + "]");
+}
+
+TEST(StringTest, AppendFormat)
+{
+    std::string out("prefix:");
+
+    ASSERT_TRUE(mb::append_format(out, " %d", 42));
+    ASSERT_EQ(out, "prefix: 42");
+
+    ASSERT_TRUE(mb::append_format(out, "%s", ""));
+    ASSERT_EQ(out, "prefix: 42");
+
+    std::string arg(1000, 'y');
+    ASSERT_TRUE(mb::append_format(out, " %s.", arg.c_str()));
+    ASSERT_EQ(out, "prefix: 42 " + arg + ".");
+}
+
+TEST(StringTest, FormatReusesOutput)
+{
+    std::string out(1000, 'z');
+
+    ASSERT_TRUE(mb::format(out, "%s", "short"));
+    ASSERT_EQ(out, "short");
+}
+
 TEST(StringTest, FormatSizeT)
 {
     ptrdiff_t signed_val = 0x7FFFFFFF;
@@ -348,3 +379,86 @@ TEST(StringTest, ReplaceString)
         free(buf);
     }
 }
+
+TEST(StringTest, ReplaceMultiMemory)
+{
+    const mb::MemReplacement replacements[] = {
+        { "abc", 3, "x", 1 },
+        { "ab", 2, "yy", 2 },
+        { "\0z", 2, "", 0 },
+        { "", 0, "never", 5 },
+    };
+    const size_t count = sizeof(replacements) / sizeof(replacements[0]);
+
+    struct {
+        const char *source;
+        size_t source_size;
+        const char *target;
+        size_t target_size;
+        size_t n_expected;
+    } test_cases[] = {
+        // Earlier entries win at the same position
+        { "abcab", 5, "xyy", 3, 2 },
+        // Patterns with different first bytes
+        { "1\0z2abc3", 8, "12x3", 4, 2 },
+        // Replacements are not rescanned
+        { "aabcc", 5, "axc", 3, 1 },
+        // No matches
+        { "defg", 4, "defg", 4, 0 },
+        // Empty data
+        { "", 0, "", 0, 0 },
+        // End
+        { nullptr, 0, nullptr, 0, 0 },
+    };
+
+    for (auto it = test_cases; it->source; ++it) {
+        size_t buf_size = it->source_size;
+        void *buf = malloc(buf_size);
+        ASSERT_TRUE(buf || buf_size == 0);
+        memcpy(buf, it->source, buf_size);
+
+        size_t matches;
+        ASSERT_EQ(mb::mem_replace_multi(&buf, &buf_size, replacements, count,
+                                        &matches), 0);
+
+        // Ensure target matches
+        ASSERT_EQ(buf_size, it->target_size);
+        ASSERT_EQ(memcmp(it->target, buf, buf_size), 0);
+
+        // Ensure number of replacements matches
+        ASSERT_EQ(matches, it->n_expected);
+
+        free(buf);
+    }
+}
+
+TEST(StringTest, ReplaceMultiString)
+{
+    const mb::StrReplacement replacements[] = {
+        { "\t", "\\t" },
+        { "@NAME@", "@VERSION@" },
+        { "@VERSION@", "1.0" },
+    };
+    const size_t count = sizeof(replacements) / sizeof(replacements[0]);
+
+    char *buf = strdup("\t@NAME@ v@VERSION@@\t");
+    ASSERT_NE(buf, nullptr);
+
+    size_t matches;
+    ASSERT_EQ(mb::str_replace_multi(&buf, replacements, count, &matches), 0);
+    ASSERT_STREQ(buf, "\\t@VERSION@ v1.0@\\t");
+    ASSERT_EQ(matches, 4u);
+
+    free(buf);
+
+    std::string str("\t@NAME@ v@VERSION@@\t");
+    ASSERT_TRUE(mb::str_replace_multi(str, replacements, count, &matches));
+    ASSERT_EQ(str, "\\t@VERSION@ v1.0@\\t");
+    ASSERT_EQ(matches, 4u);
+
+    // No matches leaves the string alone
+    str = "nothing";
+    ASSERT_TRUE(mb::str_replace_multi(str, replacements, count, &matches));
+    ASSERT_EQ(str, "nothing");
+    ASSERT_EQ(matches, 0u);
+}
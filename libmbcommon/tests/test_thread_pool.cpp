@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "mbcommon/thread_pool.h"
+
+TEST(ThreadPoolTest, RunTasksInGroup)
+{
+    mb::ThreadPool pool(4);
+    std::atomic<int> counter{0};
+
+    {
+        mb::TaskGroup group(pool);
+        for (int i = 0; i < 1000; ++i) {
+            group.run([&] { ++counter; });
+        }
+        group.wait();
+
+        ASSERT_EQ(counter, 1000);
+    }
+}
+
+TEST(ThreadPoolTest, DestructorWaitsForGroup)
+{
+    mb::ThreadPool pool(2);
+    std::atomic<int> counter{0};
+
+    {
+        mb::TaskGroup group(pool);
+        for (int i = 0; i < 100; ++i) {
+            group.run([&] {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                ++counter;
+            });
+        }
+    }
+
+    ASSERT_EQ(counter, 100);
+}
+
+TEST(ThreadPoolTest, NestedGroupsDoNotDeadlock)
+{
+    // A single worker must still make progress when tasks wait on subtasks
+    mb::ThreadPool pool(1);
+    std::atomic<int> counter{0};
+
+    mb::TaskGroup outer(pool);
+    for (int i = 0; i < 8; ++i) {
+        outer.run([&] {
+            mb::TaskGroup inner(pool);
+            for (int j = 0; j < 8; ++j) {
+                inner.run([&] { ++counter; });
+            }
+            inner.wait();
+        });
+    }
+    outer.wait();
+
+    ASSERT_EQ(counter, 64);
+}
+
+TEST(ThreadPoolTest, CancelSkipsQueuedTasks)
+{
+    mb::ThreadPool pool(1);
+    std::atomic_bool release{false};
+    std::atomic<int> counter{0};
+
+    mb::TaskGroup group(pool);
+    group.run([&] {
+        while (!release) {
+            std::this_thread::yield();
+        }
+    });
+    // The only worker is busy, so these stay queued until wait() is called
+    for (int i = 0; i < 10; ++i) {
+        group.run([&] { ++counter; });
+    }
+
+    group.cancel();
+    ASSERT_TRUE(group.is_cancelled());
+    release = true;
+    group.wait();
+
+    ASSERT_EQ(counter, 0);
+}
+
+TEST(ThreadPoolTest, WorkerCap)
+{
+    mb::ThreadPool pool(2);
+    ASSERT_EQ(pool.max_workers(), 2u);
+
+    std::atomic<int> running{0};
+    std::atomic<int> max_running{0};
+
+    mb::TaskGroup group(pool);
+    for (int i = 0; i < 50; ++i) {
+        group.run([&] {
+            int n = ++running;
+            int prev = max_running;
+            while (n > prev && !max_running.compare_exchange_weak(prev, n)) {
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+            --running;
+        });
+    }
+    group.wait();
+
+    // Two workers plus the thread calling wait()
+    ASSERT_LE(max_running, 3);
+}
+
+TEST(ThreadPoolTest, ParallelForVisitsEveryIndex)
+{
+    mb::ThreadPool pool(3);
+    std::vector<std::atomic<int>> visited(500);
+    for (auto &v : visited) {
+        v = 0;
+    }
+
+    ASSERT_TRUE(mb::parallel_for(visited.size(), [&](size_t i) {
+        ++visited[i];
+        return true;
+    }, 0, mb::CoreHint::Any, pool));
+
+    for (auto &v : visited) {
+        ASSERT_EQ(v, 1);
+    }
+
+    ASSERT_TRUE(mb::parallel_for(0, [](size_t) {
+        return false;
+    }, 0, mb::CoreHint::Any, pool));
+}
+
+TEST(ThreadPoolTest, ParallelForStopsOnFailure)
+{
+    mb::ThreadPool pool(3);
+    std::atomic<size_t> calls{0};
+
+    ASSERT_FALSE(mb::parallel_for(100000, [&](size_t i) {
+        ++calls;
+        return i != 10;
+    }, 4, mb::CoreHint::Performance, pool));
+
+    ASSERT_LT(calls, 100000u);
+}
+
+TEST(ThreadPoolTest, RunConcurrentlyLimitsCopies)
+{
+    mb::ThreadPool pool(8);
+    std::atomic<int> calls{0};
+
+    mb::run_concurrently(3, [&] { ++calls; }, mb::CoreHint::Efficiency, pool);
+
+    ASSERT_EQ(calls, 3);
+}
+
+#ifndef _WIN32
+TEST(ThreadPoolTest, RunsInlineAfterFork)
+{
+    mb::ThreadPool pool(2);
+
+    // Start the workers in the parent
+    {
+        mb::TaskGroup group(pool);
+        group.run([] {});
+    }
+
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+
+    if (pid == 0) {
+        std::atomic<int> counter{0};
+        mb::TaskGroup group(pool);
+        for (int i = 0; i < 10; ++i) {
+            group.run([&] { ++counter; });
+        }
+        group.wait();
+        _exit(counter == 10 ? 0 : 1);
+    }
+
+    int status;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+}
+
+TEST(ThreadPoolTest, GlobalPoolWorksAfterFork)
+{
+    ASSERT_TRUE(mb::parallel_for(100, [](size_t) { return true; }));
+
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+
+    if (pid == 0) {
+        std::atomic<int> counter{0};
+        std::atomic_bool release{false};
+        mb::TaskGroup group;
+
+        // If the task ran inline, run() would never return
+        group.run([&] {
+            while (!release) {
+                std::this_thread::yield();
+            }
+            ++counter;
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        release = true;
+        group.wait();
+
+        _exit(counter == 1 ? 0 : 1);
+    }
+
+    int status;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+}
+#endif
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <stddef.h>
+
+#include "mbdevice/device.h"
+
+/*
+ * Compiled device database
+ *
+ * The database is a single little-endian blob (generated by devicesgen) that
+ * can be mapped into memory and queried directly. It contains:
+ *
+ * - A header (struct MbDeviceDbHeader)
+ * - Fixed-size device records (struct MbDeviceDbRecord)
+ * - An index of (codename, record) pairs sorted by codename
+ * - A data area containing NULL-terminated strings and string lists
+ *
+ * Looking up a device by codename is a binary search over the index and does
+ * not allocate memory. A full Device can be created from a record when needed.
+ */
+
+struct MbDeviceDb;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+MB_EXPORT struct MbDeviceDb * mb_device_db_open(const char *path);
+MB_EXPORT struct MbDeviceDb * mb_device_db_open_memory(const void *data,
+                                                       size_t size);
+MB_EXPORT void mb_device_db_close(struct MbDeviceDb *db);
+
+MB_EXPORT bool mb_device_db_is_db(const void *data, size_t size);
+
+MB_EXPORT size_t mb_device_db_count(const struct MbDeviceDb *db);
+MB_EXPORT int mb_device_db_find_by_codename(const struct MbDeviceDb *db,
+                                            const char *codename);
+MB_EXPORT const char * mb_device_db_id(const struct MbDeviceDb *db,
+                                       size_t index);
+MB_EXPORT const char * mb_device_db_name(const struct MbDeviceDb *db,
+                                         size_t index);
+MB_EXPORT struct Device * mb_device_db_get(const struct MbDeviceDb *db,
+                                           size_t index);
+
+MB_EXPORT void * mb_device_db_serialize(struct Device * const *devices,
+                                        size_t *size_out);
+
+#ifdef __cplusplus
+}
+#endif
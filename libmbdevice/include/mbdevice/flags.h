@@ -32,6 +32,10 @@ enum DeviceFlags
 {
     FLAG_HAS_COMBINED_BOOT_AND_RECOVERY     = 1 << 0,
     FLAG_FSTAB_SKIP_SDCARD0                 = 1 << 1,
+    // Kernel can unpack LZ4 legacy compressed ramdisks (CONFIG_RD_LZ4)
+    FLAG_RAMDISK_LZ4_LEGACY                 = 1 << 2,
+    // Boot partition is large enough for an uncompressed ramdisk
+    FLAG_RAMDISK_UNCOMPRESSED               = 1 << 3,
 };
 
 enum TwFlags
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+
+/* All integers are little-endian. Offsets are relative to the start of the
+ * database and an offset of 0 means NULL. */
+
+#define MB_DEVICE_DB_MAGIC              "MBDEVDB\0"
+#define MB_DEVICE_DB_MAGIC_SIZE         8
+#define MB_DEVICE_DB_VERSION            1
+
+struct MbDeviceDbHeader
+{
+    char magic[MB_DEVICE_DB_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t record_count;
+    uint32_t records_offset;
+    uint32_t index_count;
+    uint32_t index_offset;
+    uint32_t data_offset;
+    uint32_t data_size;
+};
+
+/* String fields are offsets to NULL-terminated strings. List fields are
+ * offsets to a 4-byte aligned uint32_t count followed by that many string
+ * offsets. */
+struct MbDeviceDbRecord
+{
+    uint64_t flags;
+    uint64_t tw_flags;
+
+    uint32_t id;
+    uint32_t codenames;
+    uint32_t name;
+    uint32_t architecture;
+
+    uint32_t base_dirs;
+    uint32_t system_devs;
+    uint32_t cache_devs;
+    uint32_t data_devs;
+    uint32_t boot_devs;
+    uint32_t recovery_devs;
+    uint32_t extra_devs;
+
+    uint32_t tw_supported;
+    uint32_t tw_pixel_format;
+    uint32_t tw_force_pixel_format;
+    int32_t tw_overscan_percent;
+    int32_t tw_default_x_offset;
+    int32_t tw_default_y_offset;
+    uint32_t tw_brightness_path;
+    uint32_t tw_secondary_brightness_path;
+    int32_t tw_max_brightness;
+    int32_t tw_default_brightness;
+    uint32_t tw_battery_path;
+    uint32_t tw_cpu_temp_path;
+    uint32_t tw_input_blacklist;
+    uint32_t tw_input_whitelist;
+    uint32_t tw_graphics_backends;
+    uint32_t tw_theme;
+
+    uint32_t reserved;
+};
+
+struct MbDeviceDbIndexEntry
+{
+    uint32_t codename;
+    uint32_t record;
+};
@@ -0,0 +1,812 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "mbdevice/database.h"
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+#include "mbcommon/endian.h"
+
+#include "mbdevice/internal/database_format.h"
+
+
+struct MbDeviceDb
+{
+    const unsigned char *data;
+    size_t size;
+
+    // Owned mapping or buffer (if any)
+    void *map;
+    size_t map_size;
+    bool map_is_mmap;
+};
+
+#define RECORD_FIELD(DB, INDEX, FIELD) \
+    load_le32((DB)->data + record_offset((DB), (INDEX)) \
+            + offsetof(struct MbDeviceDbRecord, FIELD))
+#define RECORD_FIELD64(DB, INDEX, FIELD) \
+    load_le64((DB)->data + record_offset((DB), (INDEX)) \
+            + offsetof(struct MbDeviceDbRecord, FIELD))
+
+static const size_t record_string_fields[] = {
+    offsetof(struct MbDeviceDbRecord, id),
+    offsetof(struct MbDeviceDbRecord, name),
+    offsetof(struct MbDeviceDbRecord, architecture),
+    offsetof(struct MbDeviceDbRecord, tw_brightness_path),
+    offsetof(struct MbDeviceDbRecord, tw_secondary_brightness_path),
+    offsetof(struct MbDeviceDbRecord, tw_battery_path),
+    offsetof(struct MbDeviceDbRecord, tw_cpu_temp_path),
+    offsetof(struct MbDeviceDbRecord, tw_input_blacklist),
+    offsetof(struct MbDeviceDbRecord, tw_input_whitelist),
+    offsetof(struct MbDeviceDbRecord, tw_theme),
+};
+
+static const size_t record_list_fields[] = {
+    offsetof(struct MbDeviceDbRecord, codenames),
+    offsetof(struct MbDeviceDbRecord, base_dirs),
+    offsetof(struct MbDeviceDbRecord, system_devs),
+    offsetof(struct MbDeviceDbRecord, cache_devs),
+    offsetof(struct MbDeviceDbRecord, data_devs),
+    offsetof(struct MbDeviceDbRecord, boot_devs),
+    offsetof(struct MbDeviceDbRecord, recovery_devs),
+    offsetof(struct MbDeviceDbRecord, extra_devs),
+    offsetof(struct MbDeviceDbRecord, tw_graphics_backends),
+};
+
+static_assert(sizeof(struct MbDeviceDbHeader) == 40,
+              "Unexpected header size");
+static_assert(sizeof(struct MbDeviceDbRecord) == 128,
+              "Unexpected record size");
+static_assert(sizeof(struct MbDeviceDbIndexEntry) == 8,
+              "Unexpected index entry size");
+
+// The data may not be aligned (eg. with mb_device_db_open_memory()), so use
+// memcpy() for all loads
+
+static inline uint32_t load_le32(const unsigned char *ptr)
+{
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return mb_le32toh(value);
+}
+
+static inline uint64_t load_le64(const unsigned char *ptr)
+{
+    uint64_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return mb_le64toh(value);
+}
+
+static inline uint32_t header_field(const struct MbDeviceDb *db, size_t offset)
+{
+    return load_le32(db->data + offset);
+}
+
+#define HEADER_FIELD(DB, FIELD) \
+    header_field((DB), offsetof(struct MbDeviceDbHeader, FIELD))
+
+static inline size_t record_offset(const struct MbDeviceDb *db, size_t index)
+{
+    return HEADER_FIELD(db, records_offset)
+            + index * sizeof(struct MbDeviceDbRecord);
+}
+
+static inline const char * get_string(const struct MbDeviceDb *db,
+                                      uint32_t offset)
+{
+    if (offset == 0) {
+        return NULL;
+    }
+    return reinterpret_cast<const char *>(db->data + offset);
+}
+
+static bool section_in_bounds(size_t size, uint64_t offset, uint64_t count,
+                              uint64_t elem_size)
+{
+    return offset <= size && count * elem_size <= size - offset;
+}
+
+static bool validate_string(const struct MbDeviceDb *db, uint32_t offset)
+{
+    uint32_t data_offset = HEADER_FIELD(db, data_offset);
+    uint32_t data_size = HEADER_FIELD(db, data_size);
+
+    // The data area ends with a NULL byte, so any offset inside of it refers
+    // to a terminated string
+    return offset == 0 || (offset >= data_offset
+            && offset - data_offset < data_size);
+}
+
+static bool validate_list(const struct MbDeviceDb *db, uint32_t offset)
+{
+    if (offset == 0) {
+        return true;
+    }
+
+    uint64_t data_offset = HEADER_FIELD(db, data_offset);
+    uint64_t data_end = data_offset + HEADER_FIELD(db, data_size);
+
+    if (offset < data_offset || offset % 4 != 0
+            || offset + sizeof(uint32_t) > data_end) {
+        return false;
+    }
+
+    uint64_t count = load_le32(db->data + offset);
+    if (offset + sizeof(uint32_t) + count * sizeof(uint32_t) > data_end) {
+        return false;
+    }
+
+    for (uint64_t i = 0; i < count; ++i) {
+        uint32_t item = load_le32(db->data + offset + sizeof(uint32_t)
+                + i * sizeof(uint32_t));
+        if (item == 0 || !validate_string(db, item)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool validate_db(const struct MbDeviceDb *db)
+{
+    if (!mb_device_db_is_db(db->data, db->size)) {
+        return false;
+    }
+
+    uint32_t record_count = HEADER_FIELD(db, record_count);
+    uint32_t index_count = HEADER_FIELD(db, index_count);
+
+    if (HEADER_FIELD(db, version) != MB_DEVICE_DB_VERSION
+            || HEADER_FIELD(db, record_size) != sizeof(struct MbDeviceDbRecord)
+            || !section_in_bounds(db->size, HEADER_FIELD(db, records_offset),
+                                  record_count, sizeof(struct MbDeviceDbRecord))
+            || !section_in_bounds(db->size, HEADER_FIELD(db, index_offset),
+                                  index_count,
+                                  sizeof(struct MbDeviceDbIndexEntry))
+            || !section_in_bounds(db->size, HEADER_FIELD(db, data_offset),
+                                  HEADER_FIELD(db, data_size), 1)
+            || HEADER_FIELD(db, data_offset) == 0
+            || HEADER_FIELD(db, data_size) == 0
+            || db->data[HEADER_FIELD(db, data_offset)
+                    + HEADER_FIELD(db, data_size) - 1] != '\0') {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < record_count; ++i) {
+        const unsigned char *record = db->data + record_offset(db, i);
+
+        for (size_t offset : record_string_fields) {
+            if (!validate_string(db, load_le32(record + offset))) {
+                return false;
+            }
+        }
+        for (size_t offset : record_list_fields) {
+            if (!validate_list(db, load_le32(record + offset))) {
+                return false;
+            }
+        }
+    }
+
+    // The index must be sorted for the binary search in
+    // mb_device_db_find_by_codename()
+    const unsigned char *index = db->data + HEADER_FIELD(db, index_offset);
+    const char *prev = NULL;
+
+    for (uint32_t i = 0; i < index_count; ++i) {
+        uint32_t codename = load_le32(index + i * 8);
+        uint32_t record = load_le32(index + i * 8 + 4);
+
+        if (codename == 0 || !validate_string(db, codename)
+                || record >= record_count) {
+            return false;
+        }
+
+        const char *str = get_string(db, codename);
+        if (prev && strcmp(prev, str) > 0) {
+            return false;
+        }
+        prev = str;
+    }
+
+    return true;
+}
+
+static struct MbDeviceDb * wrap_db(const void *data, size_t size, void *map,
+                                   size_t map_size, bool map_is_mmap)
+{
+    struct MbDeviceDb *db = static_cast<struct MbDeviceDb *>(
+            malloc(sizeof(struct MbDeviceDb)));
+    if (!db) {
+        return NULL;
+    }
+
+    db->data = static_cast<const unsigned char *>(data);
+    db->size = size;
+    db->map = map;
+    db->map_size = map_size;
+    db->map_is_mmap = map_is_mmap;
+
+    if (!validate_db(db)) {
+        // Don't release the caller's mapping
+        db->map = NULL;
+        mb_device_db_close(db);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return db;
+}
+
+/*!
+ * \brief Open a compiled device database file
+ *
+ * The file is mapped into memory (if supported) and validated.
+ *
+ * \return Database handle or NULL with errno set on failure. errno is set to
+ *         EINVAL if the file is not a valid database.
+ */
+struct MbDeviceDb * mb_device_db_open(const char *path)
+{
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    size_t size = static_cast<size_t>(sb.st_size);
+    if (size == 0) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int saved_errno = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        errno = saved_errno;
+        return NULL;
+    }
+
+    struct MbDeviceDb *db = wrap_db(map, size, map, size, true);
+    if (!db) {
+        saved_errno = errno;
+        munmap(map, size);
+        errno = saved_errno;
+    }
+    return db;
+#else
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return NULL;
+    }
+
+    std::vector<unsigned char> buf;
+    unsigned char chunk[8192];
+    size_t n;
+
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        buf.insert(buf.end(), chunk, chunk + n);
+    }
+
+    bool failed = ferror(fp);
+    fclose(fp);
+    if (failed || buf.empty()) {
+        errno = failed ? EIO : EINVAL;
+        return NULL;
+    }
+
+    void *copy = malloc(buf.size());
+    if (!copy) {
+        return NULL;
+    }
+    memcpy(copy, buf.data(), buf.size());
+
+    struct MbDeviceDb *db = wrap_db(copy, buf.size(), copy, buf.size(), false);
+    if (!db) {
+        int saved_errno = errno;
+        free(copy);
+        errno = saved_errno;
+    }
+    return db;
+#endif
+}
+
+/*!
+ * \brief Open a compiled device database from memory
+ *
+ * The data is not copied and must remain valid until the database is closed.
+ *
+ * \return Database handle or NULL with errno set on failure
+ */
+struct MbDeviceDb * mb_device_db_open_memory(const void *data, size_t size)
+{
+    return wrap_db(data, size, NULL, 0, false);
+}
+
+void mb_device_db_close(struct MbDeviceDb *db)
+{
+    if (!db) {
+        return;
+    }
+
+    if (db->map) {
+#ifndef _WIN32
+        if (db->map_is_mmap) {
+            munmap(db->map, db->map_size);
+        } else
+#endif
+        {
+            free(db->map);
+        }
+    }
+
+    free(db);
+}
+
+/*!
+ * \brief Check if data starts with the device database magic
+ */
+bool mb_device_db_is_db(const void *data, size_t size)
+{
+    return size >= sizeof(struct MbDeviceDbHeader)
+            && memcmp(data, MB_DEVICE_DB_MAGIC, MB_DEVICE_DB_MAGIC_SIZE) == 0;
+}
+
+size_t mb_device_db_count(const struct MbDeviceDb *db)
+{
+    return HEADER_FIELD(db, record_count);
+}
+
+/*!
+ * \brief Find a device by codename
+ *
+ * This does not allocate memory.
+ *
+ * \return Index of the first device with the codename or -1 if not found
+ */
+int mb_device_db_find_by_codename(const struct MbDeviceDb *db,
+                                  const char *codename)
+{
+    const unsigned char *index = db->data + HEADER_FIELD(db, index_offset);
+    size_t lo = 0;
+    size_t hi = HEADER_FIELD(db, index_count);
+
+    // Lower bound
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const char *str = get_string(db, load_le32(index + mid * 8));
+
+        if (strcmp(str, codename) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo < HEADER_FIELD(db, index_count)
+            && strcmp(get_string(db, load_le32(index + lo * 8)),
+                      codename) == 0) {
+        return static_cast<int>(load_le32(index + lo * 8 + 4));
+    }
+
+    return -1;
+}
+
+const char * mb_device_db_id(const struct MbDeviceDb *db, size_t index)
+{
+    if (index >= mb_device_db_count(db)) {
+        return NULL;
+    }
+    return get_string(db, RECORD_FIELD(db, index, id));
+}
+
+const char * mb_device_db_name(const struct MbDeviceDb *db, size_t index)
+{
+    if (index >= mb_device_db_count(db)) {
+        return NULL;
+    }
+    return get_string(db, RECORD_FIELD(db, index, name));
+}
+
+static bool get_list(const struct MbDeviceDb *db, uint32_t offset,
+                     std::vector<const char *> &list)
+{
+    list.clear();
+
+    if (offset == 0) {
+        return false;
+    }
+
+    uint32_t count = load_le32(db->data + offset);
+    for (uint32_t i = 0; i < count; ++i) {
+        list.push_back(get_string(db, load_le32(
+                db->data + offset + (i + 1) * sizeof(uint32_t))));
+    }
+    list.push_back(NULL);
+
+    return true;
+}
+
+/*!
+ * \brief Create a Device from a database record
+ *
+ * \return New Device (free with mb_device_free()) or NULL with errno set on
+ *         failure
+ */
+struct Device * mb_device_db_get(const struct MbDeviceDb *db, size_t index)
+{
+    if (index >= mb_device_db_count(db)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct Device *device = mb_device_new();
+    if (!device) {
+        return NULL;
+    }
+
+    std::vector<const char *> list;
+    bool ok = true;
+
+#define SET_STRING(NAME, FIELD) \
+    ok = ok && mb_device_set_ ## NAME(device, get_string( \
+            db, RECORD_FIELD(db, index, FIELD))) == MB_DEVICE_OK
+#define SET_LIST(NAME, FIELD) \
+    ok = ok && mb_device_set_ ## NAME(device, \
+            get_list(db, RECORD_FIELD(db, index, FIELD), list) \
+            ? list.data() : NULL) == MB_DEVICE_OK
+#define SET_INT(NAME, FIELD) \
+    ok = ok && mb_device_set_ ## NAME(device, static_cast<int32_t>( \
+            RECORD_FIELD(db, index, FIELD))) == MB_DEVICE_OK
+
+    SET_STRING(id, id);
+    SET_LIST(codenames, codenames);
+    SET_STRING(name, name);
+    SET_STRING(architecture, architecture);
+    ok = ok && mb_device_set_flags(
+            device, RECORD_FIELD64(db, index, flags)) == MB_DEVICE_OK;
+
+    SET_LIST(block_dev_base_dirs, base_dirs);
+    SET_LIST(system_block_devs, system_devs);
+    SET_LIST(cache_block_devs, cache_devs);
+    SET_LIST(data_block_devs, data_devs);
+    SET_LIST(boot_block_devs, boot_devs);
+    SET_LIST(recovery_block_devs, recovery_devs);
+    SET_LIST(extra_block_devs, extra_devs);
+
+    ok = ok && mb_device_set_tw_supported(
+            device, RECORD_FIELD(db, index, tw_supported) != 0) == MB_DEVICE_OK;
+    ok = ok && mb_device_set_tw_flags(
+            device, RECORD_FIELD64(db, index, tw_flags)) == MB_DEVICE_OK;
+    ok = ok && mb_device_set_tw_pixel_format(
+            device, static_cast<enum TwPixelFormat>(
+                    RECORD_FIELD(db, index, tw_pixel_format))) == MB_DEVICE_OK;
+    ok = ok && mb_device_set_tw_force_pixel_format(
+            device, static_cast<enum TwForcePixelFormat>(
+                    RECORD_FIELD(db, index, tw_force_pixel_format)))
+                    == MB_DEVICE_OK;
+    SET_INT(tw_overscan_percent, tw_overscan_percent);
+    SET_INT(tw_default_x_offset, tw_default_x_offset);
+    SET_INT(tw_default_y_offset, tw_default_y_offset);
+    SET_STRING(tw_brightness_path, tw_brightness_path);
+    SET_STRING(tw_secondary_brightness_path, tw_secondary_brightness_path);
+    SET_INT(tw_max_brightness, tw_max_brightness);
+    SET_INT(tw_default_brightness, tw_default_brightness);
+    SET_STRING(tw_battery_path, tw_battery_path);
+    SET_STRING(tw_cpu_temp_path, tw_cpu_temp_path);
+    SET_STRING(tw_input_blacklist, tw_input_blacklist);
+    SET_STRING(tw_input_whitelist, tw_input_whitelist);
+    SET_LIST(tw_graphics_backends, tw_graphics_backends);
+    SET_STRING(tw_theme, tw_theme);
+
+#undef SET_STRING
+#undef SET_LIST
+#undef SET_INT
+
+    if (!ok) {
+        int saved_errno = errno;
+        mb_device_free(device);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    return device;
+}
+
+class DbWriter
+{
+public:
+    // Returns offset relative to the start of the data area (+1, so that 0
+    // can still mean NULL before rebasing)
+    uint32_t add_string(const char *str)
+    {
+        if (!str) {
+            return 0;
+        }
+
+        auto it = _strings.find(str);
+        if (it != _strings.end()) {
+            return it->second;
+        }
+
+        uint32_t offset = static_cast<uint32_t>(_data.size()) + 1;
+        _data.insert(_data.end(), str, str + strlen(str) + 1);
+        _strings[str] = offset;
+        return offset;
+    }
+
+    uint32_t add_list(char const * const *list)
+    {
+        if (!list) {
+            return 0;
+        }
+
+        std::vector<uint32_t> items;
+        for (auto it = list; *it; ++it) {
+            items.push_back(add_string(*it));
+        }
+
+        while (_data.size() % 4 != 0) {
+            _data.push_back('\0');
+        }
+
+        uint32_t offset = static_cast<uint32_t>(_data.size()) + 1;
+        _lists.push_back(offset);
+        append_le32(static_cast<uint32_t>(items.size()));
+        for (uint32_t item : items) {
+            // Fixed up in finish()
+            append_le32(item);
+        }
+        return offset;
+    }
+
+    std::vector<unsigned char> & data()
+    {
+        return _data;
+    }
+
+    const std::vector<uint32_t> & lists() const
+    {
+        return _lists;
+    }
+
+private:
+    void append_le32(uint32_t value)
+    {
+        value = mb_htole32(value);
+        auto ptr = reinterpret_cast<const unsigned char *>(&value);
+        _data.insert(_data.end(), ptr, ptr + sizeof(value));
+    }
+
+    std::vector<unsigned char> _data;
+    std::unordered_map<std::string, uint32_t> _strings;
+    std::vector<uint32_t> _lists;
+};
+
+static inline void store_le32(unsigned char *ptr, uint32_t value)
+{
+    value = mb_htole32(value);
+    memcpy(ptr, &value, sizeof(value));
+}
+
+static inline void store_le64(unsigned char *ptr, uint64_t value)
+{
+    value = mb_htole64(value);
+    memcpy(ptr, &value, sizeof(value));
+}
+
+/*!
+ * \brief Serialize a NULL-terminated list of devices into a database
+ *
+ * \param[in] devices NULL-terminated list of devices
+ * \param[out] size_out Size of the returned buffer
+ *
+ * \return Buffer (free with free()) or NULL with errno set on failure
+ */
+void * mb_device_db_serialize(struct Device * const *devices, size_t *size_out)
+{
+    struct PendingRecord
+    {
+        uint32_t fields[sizeof(struct MbDeviceDbRecord) / sizeof(uint32_t)];
+    };
+
+    DbWriter writer;
+    std::vector<PendingRecord> records;
+    std::vector<std::pair<const char *, uint32_t>> index;
+
+    for (auto it = devices; *it; ++it) {
+        const struct Device *d = *it;
+        PendingRecord r;
+        memset(&r, 0, sizeof(r));
+
+#define FIELD(NAME) \
+    r.fields[offsetof(struct MbDeviceDbRecord, NAME) / sizeof(uint32_t)]
+
+        FIELD(id) = writer.add_string(mb_device_id(d));
+        FIELD(codenames) = writer.add_list(mb_device_codenames(d));
+        FIELD(name) = writer.add_string(mb_device_name(d));
+        FIELD(architecture) = writer.add_string(mb_device_architecture(d));
+        FIELD(base_dirs) = writer.add_list(mb_device_block_dev_base_dirs(d));
+        FIELD(system_devs) = writer.add_list(mb_device_system_block_devs(d));
+        FIELD(cache_devs) = writer.add_list(mb_device_cache_block_devs(d));
+        FIELD(data_devs) = writer.add_list(mb_device_data_block_devs(d));
+        FIELD(boot_devs) = writer.add_list(mb_device_boot_block_devs(d));
+        FIELD(recovery_devs) = writer.add_list(
+                mb_device_recovery_block_devs(d));
+        FIELD(extra_devs) = writer.add_list(mb_device_extra_block_devs(d));
+        FIELD(tw_brightness_path) = writer.add_string(
+                mb_device_tw_brightness_path(d));
+        FIELD(tw_secondary_brightness_path) = writer.add_string(
+                mb_device_tw_secondary_brightness_path(d));
+        FIELD(tw_battery_path) = writer.add_string(
+                mb_device_tw_battery_path(d));
+        FIELD(tw_cpu_temp_path) = writer.add_string(
+                mb_device_tw_cpu_temp_path(d));
+        FIELD(tw_input_blacklist) = writer.add_string(
+                mb_device_tw_input_blacklist(d));
+        FIELD(tw_input_whitelist) = writer.add_string(
+                mb_device_tw_input_whitelist(d));
+        FIELD(tw_graphics_backends) = writer.add_list(
+                mb_device_tw_graphics_backends(d));
+        FIELD(tw_theme) = writer.add_string(mb_device_tw_theme(d));
+
+#undef FIELD
+
+        auto codenames = mb_device_codenames(d);
+        if (codenames) {
+            for (auto it2 = codenames; *it2; ++it2) {
+                index.emplace_back(*it2, static_cast<uint32_t>(
+                        records.size()));
+            }
+        }
+
+        records.push_back(r);
+    }
+
+    std::stable_sort(index.begin(), index.end(),
+                     [](const std::pair<const char *, uint32_t> &a,
+                        const std::pair<const char *, uint32_t> &b) {
+        return strcmp(a.first, b.first) < 0;
+    });
+
+    std::vector<unsigned char> &data = writer.data();
+    // Terminate the data area (see validate_string())
+    data.push_back('\0');
+
+    size_t records_offset = sizeof(struct MbDeviceDbHeader);
+    size_t index_offset = records_offset
+            + records.size() * sizeof(struct MbDeviceDbRecord);
+    size_t data_offset = index_offset
+            + index.size() * sizeof(struct MbDeviceDbIndexEntry);
+    size_t size = data_offset + data.size();
+
+    if (size > UINT32_MAX) {
+        errno = EOVERFLOW;
+        return NULL;
+    }
+
+    unsigned char *buf = static_cast<unsigned char *>(calloc(1, size));
+    if (!buf) {
+        return NULL;
+    }
+
+    // Rebase an offset relative to the data area to the start of the buffer
+    auto rebase = [&](uint32_t offset) -> uint32_t {
+        return offset == 0 ? 0 : static_cast<uint32_t>(
+                data_offset + offset - 1);
+    };
+
+    // Fix up string offsets in lists
+    for (uint32_t list : writer.lists()) {
+        unsigned char *ptr = data.data() + list - 1;
+        uint32_t count = load_le32(ptr);
+        for (uint32_t i = 1; i <= count; ++i) {
+            store_le32(ptr + i * sizeof(uint32_t),
+                       rebase(load_le32(ptr + i * sizeof(uint32_t))));
+        }
+    }
+
+    // Header
+    memcpy(buf, MB_DEVICE_DB_MAGIC, MB_DEVICE_DB_MAGIC_SIZE);
+#define SET_HEADER(FIELD, VALUE) \
+    store_le32(buf + offsetof(struct MbDeviceDbHeader, FIELD), \
+               static_cast<uint32_t>(VALUE))
+    SET_HEADER(version, MB_DEVICE_DB_VERSION);
+    SET_HEADER(record_size, sizeof(struct MbDeviceDbRecord));
+    SET_HEADER(record_count, records.size());
+    SET_HEADER(records_offset, records_offset);
+    SET_HEADER(index_count, index.size());
+    SET_HEADER(index_offset, index_offset);
+    SET_HEADER(data_offset, data_offset);
+    SET_HEADER(data_size, data.size());
+#undef SET_HEADER
+
+    // Records
+    size_t i = 0;
+    for (auto it = devices; *it; ++it, ++i) {
+        const struct Device *d = *it;
+        unsigned char *ptr = buf + records_offset
+                + i * sizeof(struct MbDeviceDbRecord);
+
+        for (size_t offset : record_string_fields) {
+            store_le32(ptr + offset,
+                       rebase(records[i].fields[offset / sizeof(uint32_t)]));
+        }
+        for (size_t offset : record_list_fields) {
+            store_le32(ptr + offset,
+                       rebase(records[i].fields[offset / sizeof(uint32_t)]));
+        }
+
+#define SET_RECORD(FIELD, VALUE) \
+    store_le32(ptr + offsetof(struct MbDeviceDbRecord, FIELD), \
+               static_cast<uint32_t>(VALUE))
+        store_le64(ptr + offsetof(struct MbDeviceDbRecord, flags),
+                   mb_device_flags(d));
+        store_le64(ptr + offsetof(struct MbDeviceDbRecord, tw_flags),
+                   mb_device_tw_flags(d));
+        SET_RECORD(tw_supported, mb_device_tw_supported(d) ? 1 : 0);
+        SET_RECORD(tw_pixel_format, mb_device_tw_pixel_format(d));
+        SET_RECORD(tw_force_pixel_format, mb_device_tw_force_pixel_format(d));
+        SET_RECORD(tw_overscan_percent, mb_device_tw_overscan_percent(d));
+        SET_RECORD(tw_default_x_offset, mb_device_tw_default_x_offset(d));
+        SET_RECORD(tw_default_y_offset, mb_device_tw_default_y_offset(d));
+        SET_RECORD(tw_max_brightness, mb_device_tw_max_brightness(d));
+        SET_RECORD(tw_default_brightness, mb_device_tw_default_brightness(d));
+#undef SET_RECORD
+    }
+
+    // Codename index
+    unsigned char *index_ptr = buf + index_offset;
+    for (auto const &entry : index) {
+        store_le32(index_ptr, rebase(writer.add_string(entry.first)));
+        store_le32(index_ptr + 4, entry.second);
+        index_ptr += sizeof(struct MbDeviceDbIndexEntry);
+    }
+
+    memcpy(buf + data_offset, data.data(), data.size());
+
+    *size_out = size;
+    return buf;
+}
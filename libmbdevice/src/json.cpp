@@ -31,74 +31,131 @@
 
 #define JSON_BOOLEAN JSON_TRUE
 
+// All of the lookup tables below must be sorted by key. They are searched with
+// find_by_key() and the order is checked at compile time.
+
+/*!
+ * \brief Compile-time equivalent of strcmp()
+ */
+static constexpr int const_strcmp(const char *a, const char *b)
+{
+    return *a != *b || !*a
+            ? static_cast<unsigned char>(*a) - static_cast<unsigned char>(*b)
+            : const_strcmp(a + 1, b + 1);
+}
+
+template<typename T, size_t N>
+static constexpr bool is_sorted_by_key(const T (&table)[N], size_t i = 1)
+{
+    return i >= N || (const_strcmp(table[i - 1].key, table[i].key) < 0
+            && is_sorted_by_key(table, i + 1));
+}
+
+/*!
+ * \brief Binary search a table sorted by key
+ *
+ * \return Pointer to matching entry or NULL if \p key was not found
+ */
+template<typename T, size_t N>
+static const T * find_by_key(const T (&table)[N], const char *key)
+{
+    size_t lo = 0;
+    size_t hi = N;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(key, table[mid].key);
+
+        if (cmp == 0) {
+            return &table[mid];
+        } else if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    return NULL;
+}
+
 struct flag_mapping
 {
     const char *key;
     uint64_t flag;
 };
 
-struct flag_mapping device_flag_mappings[] = {
+static constexpr flag_mapping device_flag_mappings[] = {
 #define FLAG(F) { #F, FLAG_ ## F }
-    FLAG(HAS_COMBINED_BOOT_AND_RECOVERY),
     FLAG(FSTAB_SKIP_SDCARD0),
+    FLAG(HAS_COMBINED_BOOT_AND_RECOVERY),
+    FLAG(RAMDISK_LZ4_LEGACY),
+    FLAG(RAMDISK_UNCOMPRESSED),
 #undef FLAG
-    { NULL, 0 }
 };
 
-struct flag_mapping tw_flag_mappings[] = {
+static_assert(is_sorted_by_key(device_flag_mappings),
+              "device_flag_mappings is not sorted");
+
+static constexpr flag_mapping tw_flag_mappings[] = {
 #define FLAG(F) { #F, FLAG_ ## F }
-    FLAG(TW_TOUCHSCREEN_SWAP_XY),
-    FLAG(TW_TOUCHSCREEN_FLIP_X),
-    FLAG(TW_TOUCHSCREEN_FLIP_Y),
-    FLAG(TW_GRAPHICS_FORCE_USE_LINELENGTH),
-    FLAG(TW_SCREEN_BLANK_ON_BOOT),
     FLAG(TW_BOARD_HAS_FLIPPED_SCREEN),
+    FLAG(TW_GRAPHICS_FORCE_USE_LINELENGTH),
+    FLAG(TW_HAS_DOWNLOAD_MODE),
+    FLAG(TW_IGNORE_ABS_MT_TRACKING_ID),
     FLAG(TW_IGNORE_MAJOR_AXIS_0),
     FLAG(TW_IGNORE_MT_POSITION_0),
-    FLAG(TW_IGNORE_ABS_MT_TRACKING_ID),
     FLAG(TW_NEW_ION_HEAP),
+    FLAG(TW_NO_CPU_TEMP),
     FLAG(TW_NO_SCREEN_BLANK),
     FLAG(TW_NO_SCREEN_TIMEOUT),
-    FLAG(TW_ROUND_SCREEN),
-    FLAG(TW_NO_CPU_TEMP),
-    FLAG(TW_QCOM_RTC_FIX),
-    FLAG(TW_HAS_DOWNLOAD_MODE),
     FLAG(TW_PREFER_LCD_BACKLIGHT),
+    FLAG(TW_QCOM_RTC_FIX),
+    FLAG(TW_ROUND_SCREEN),
+    FLAG(TW_SCREEN_BLANK_ON_BOOT),
+    FLAG(TW_TOUCHSCREEN_FLIP_X),
+    FLAG(TW_TOUCHSCREEN_FLIP_Y),
+    FLAG(TW_TOUCHSCREEN_SWAP_XY),
 #undef FLAG
-    { NULL, 0 }
 };
 
+static_assert(is_sorted_by_key(tw_flag_mappings),
+              "tw_flag_mappings is not sorted");
+
 struct tw_pxfmt_mapping
 {
     const char *key;
     enum TwPixelFormat value;
 };
 
-struct tw_pxfmt_mapping tw_pxfmt_mappings[] = {
+static constexpr tw_pxfmt_mapping tw_pxfmt_mappings[] = {
 #define FLAG(F) { #F, TW_PIXEL_FORMAT_ ## F }
-    FLAG(DEFAULT),
     FLAG(ABGR_8888),
-    FLAG(RGBX_8888),
     FLAG(BGRA_8888),
+    FLAG(DEFAULT),
     FLAG(RGBA_8888),
+    FLAG(RGBX_8888),
 #undef FLAG
-    { NULL, TW_PIXEL_FORMAT_DEFAULT }
 };
 
+static_assert(is_sorted_by_key(tw_pxfmt_mappings),
+              "tw_pxfmt_mappings is not sorted");
+
 struct tw_force_pxfmt_mapping
 {
     const char *key;
     enum TwForcePixelFormat value;
 };
 
-struct tw_force_pxfmt_mapping tw_force_pxfmt_mappings[] = {
+static constexpr tw_force_pxfmt_mapping tw_force_pxfmt_mappings[] = {
 #define FLAG(F) { #F, TW_FORCE_PIXEL_FORMAT_ ## F }
     FLAG(NONE),
     FLAG(RGB_565),
 #undef FLAG
-    { NULL, TW_FORCE_PIXEL_FORMAT_NONE }
 };
 
+static_assert(is_sorted_by_key(tw_force_pxfmt_mappings),
+              "tw_force_pxfmt_mappings is not sorted");
+
 static const char * json_type_to_string(json_type type)
 {
     switch (type) {
@@ -306,6 +363,86 @@ done:
     return ret;
 }
 
+typedef int (*key_handler)(struct Device *, json_t *, const char *,
+                           struct MbDeviceJsonError *);
+
+struct key_mapping
+{
+    const char *key;
+    key_handler handler;
+};
+
+template<setter_boolean Fn>
+static int handle_boolean(struct Device *device, json_t *value,
+                          const char *context,
+                          struct MbDeviceJsonError *error)
+{
+    return device_set_boolean(Fn, device, value, context, error);
+}
+
+template<setter_int Fn>
+static int handle_int(struct Device *device, json_t *value,
+                      const char *context,
+                      struct MbDeviceJsonError *error)
+{
+    return device_set_int(Fn, device, value, context, error);
+}
+
+template<setter_string Fn>
+static int handle_string(struct Device *device, json_t *value,
+                         const char *context,
+                         struct MbDeviceJsonError *error)
+{
+    return device_set_string(Fn, device, value, context, error);
+}
+
+template<setter_string_array Fn>
+static int handle_string_array(struct Device *device, json_t *value,
+                               const char *context,
+                               struct MbDeviceJsonError *error)
+{
+    return device_set_string_array(Fn, device, value, context, error);
+}
+
+/*!
+ * \brief Dispatch each key in a JSON object to its handler in \p keys
+ */
+template<size_t N>
+static int process_keys(struct Device *device, json_t *node,
+                        const char *context,
+                        const key_mapping (&keys)[N],
+                        struct MbDeviceJsonError *error)
+{
+    int ret = 0;
+    char subcontext[100];
+    const char *key;
+    json_t *value;
+
+    if (!json_is_object(node)) {
+        json_error_set_mismatched_type(
+                error, context, node->type, JSON_OBJECT);
+        return -1;
+    }
+
+    json_object_foreach(node, key, value) {
+        snprintf(subcontext, sizeof(subcontext), "%s.%s", context, key);
+
+        auto m = find_by_key(keys, key);
+        if (m) {
+            ret = m->handler(device, value, subcontext, error);
+        } else {
+            json_error_set_unknown_key(error, subcontext);
+            ret = -1;
+        }
+
+        if (ret != 0) {
+            break;
+        }
+    }
+
+    return ret;
+}
+
 static int process_device_flags(struct Device *device, json_t *node,
                                 const char *context,
                                 struct MbDeviceJsonError *error)
@@ -330,20 +467,13 @@ static int process_device_flags(struct Device *device, json_t *node,
             return -1;
         }
 
-        const char *str = json_string_value(value);
-        uint64_t old_flags = flags;
-
-        for (struct flag_mapping *m = device_flag_mappings; m->key; ++m) {
-            if (strcmp(m->key, str) == 0) {
-                flags |= m->flag;
-                break;
-            }
-        }
-
-        if (flags == old_flags) {
+        auto m = find_by_key(device_flag_mappings, json_string_value(value));
+        if (!m) {
             json_error_set_unknown_value(error, subcontext);
             return -1;
         }
+
+        flags |= m->flag;
     }
 
     int fn_ret = mb_device_set_flags(device, flags);
@@ -379,20 +509,13 @@ static int process_boot_ui_flags(struct Device *device, json_t *node,
             return -1;
         }
 
-        const char *str = json_string_value(value);
-        uint64_t old_flags = flags;
-
-        for (struct flag_mapping *m = tw_flag_mappings; m->key; ++m) {
-            if (strcmp(m->key, str) == 0) {
-                flags |= m->flag;
-                break;
-            }
-        }
-
-        if (flags == old_flags) {
+        auto m = find_by_key(tw_flag_mappings, json_string_value(value));
+        if (!m) {
             json_error_set_unknown_value(error, subcontext);
             return -1;
         }
+
+        flags |= m->flag;
     }
 
     int fn_ret = mb_device_set_tw_flags(device, flags);
@@ -408,240 +531,140 @@ static int process_boot_ui_pixel_format(struct Device *device, json_t *node,
                                         const char *context,
                                         struct MbDeviceJsonError *error)
 {
-    const char *str;
-
     if (!json_is_string(node)) {
         json_error_set_mismatched_type(error, context, node->type, JSON_STRING);
         return -1;
     }
 
-    str = json_string_value(node);
+    auto m = find_by_key(tw_pxfmt_mappings, json_string_value(node));
+    if (!m) {
+        json_error_set_unknown_value(error, context);
+        return -1;
+    }
 
-    for (struct tw_pxfmt_mapping *m = tw_pxfmt_mappings; m->key; ++m) {
-        if (strcmp(m->key, str) == 0) {
-            int fn_ret = mb_device_set_tw_pixel_format(device, m->value);
-            if (fn_ret < 0) {
-                json_error_set_standard_error(error, fn_ret);
-                return -1;
-            }
-            return 0;
-        }
+    int fn_ret = mb_device_set_tw_pixel_format(device, m->value);
+    if (fn_ret < 0) {
+        json_error_set_standard_error(error, fn_ret);
+        return -1;
     }
 
-    json_error_set_unknown_value(error, context);
-    return -1;
+    return 0;
 }
 
 static int process_boot_ui_force_pixel_format(struct Device *device, json_t *node,
                                               const char *context,
                                               struct MbDeviceJsonError *error)
 {
-    const char *str;
-
     if (!json_is_string(node)) {
         json_error_set_mismatched_type(error, context, node->type, JSON_STRING);
         return -1;
     }
 
-    str = json_string_value(node);
+    auto m = find_by_key(tw_force_pxfmt_mappings, json_string_value(node));
+    if (!m) {
+        json_error_set_unknown_value(error, context);
+        return -1;
+    }
 
-    for (struct tw_force_pxfmt_mapping *m = tw_force_pxfmt_mappings;
-            m->key; ++m) {
-        if (strcmp(m->key, str) == 0) {
-            int fn_ret = mb_device_set_tw_force_pixel_format(device, m->value);
-            if (fn_ret < 0) {
-                json_error_set_standard_error(error, fn_ret);
-                return -1;
-            }
-            return 0;
-        }
+    int fn_ret = mb_device_set_tw_force_pixel_format(device, m->value);
+    if (fn_ret < 0) {
+        json_error_set_standard_error(error, fn_ret);
+        return -1;
     }
 
-    json_error_set_unknown_value(error, context);
-    return -1;
+    return 0;
 }
 
+static constexpr key_mapping boot_ui_keys[] = {
+    { "battery_path",
+      &handle_string<&mb_device_set_tw_battery_path> },
+    { "brightness_path",
+      &handle_string<&mb_device_set_tw_brightness_path> },
+    { "cpu_temp_path",
+      &handle_string<&mb_device_set_tw_cpu_temp_path> },
+    { "default_brightness",
+      &handle_int<&mb_device_set_tw_default_brightness> },
+    { "default_x_offset",
+      &handle_int<&mb_device_set_tw_default_x_offset> },
+    { "default_y_offset",
+      &handle_int<&mb_device_set_tw_default_y_offset> },
+    { "flags",
+      &process_boot_ui_flags },
+    { "force_pixel_format",
+      &process_boot_ui_force_pixel_format },
+    { "graphics_backends",
+      &handle_string_array<&mb_device_set_tw_graphics_backends> },
+    { "input_blacklist",
+      &handle_string<&mb_device_set_tw_input_blacklist> },
+    { "input_whitelist",
+      &handle_string<&mb_device_set_tw_input_whitelist> },
+    { "max_brightness",
+      &handle_int<&mb_device_set_tw_max_brightness> },
+    { "overscan_percent",
+      &handle_int<&mb_device_set_tw_overscan_percent> },
+    { "pixel_format",
+      &process_boot_ui_pixel_format },
+    { "secondary_brightness_path",
+      &handle_string<&mb_device_set_tw_secondary_brightness_path> },
+    { "supported",
+      &handle_boolean<&mb_device_set_tw_supported> },
+    { "theme",
+      &handle_string<&mb_device_set_tw_theme> },
+};
+
+static_assert(is_sorted_by_key(boot_ui_keys), "boot_ui_keys is not sorted");
+
+static constexpr key_mapping block_devs_keys[] = {
+    { "base_dirs",
+      &handle_string_array<&mb_device_set_block_dev_base_dirs> },
+    { "boot",
+      &handle_string_array<&mb_device_set_boot_block_devs> },
+    { "cache",
+      &handle_string_array<&mb_device_set_cache_block_devs> },
+    { "data",
+      &handle_string_array<&mb_device_set_data_block_devs> },
+    { "extra",
+      &handle_string_array<&mb_device_set_extra_block_devs> },
+    { "recovery",
+      &handle_string_array<&mb_device_set_recovery_block_devs> },
+    { "system",
+      &handle_string_array<&mb_device_set_system_block_devs> },
+};
+
+static_assert(is_sorted_by_key(block_devs_keys),
+              "block_devs_keys is not sorted");
+
 static int process_boot_ui(struct Device *device, json_t *node,
                            const char *context,
                            struct MbDeviceJsonError *error)
 {
-    int ret = 0;
-    char subcontext[100];
-    const char *key;
-    json_t *value;
-
-    if (!json_is_object(node)) {
-        json_error_set_mismatched_type(
-                error, context, node->type, JSON_OBJECT);
-        return -1;
-    }
-
-    json_object_foreach(node, key, value) {
-        snprintf(subcontext, sizeof(subcontext), "%s.%s", context, key);
-
-        if (strcmp(key, "supported") == 0) {
-            ret = device_set_boolean(&mb_device_set_tw_supported,
-                                     device, value, subcontext, error);
-        } else if (strcmp(key, "flags") == 0) {
-            ret = process_boot_ui_flags(
-                    device, value, subcontext, error);
-        } else if (strcmp(key, "pixel_format") == 0) {
-            ret = process_boot_ui_pixel_format(
-                    device, value, subcontext, error);
-        } else if (strcmp(key, "force_pixel_format") == 0) {
-            ret = process_boot_ui_force_pixel_format(
-                    device, value, subcontext, error);
-        } else if (strcmp(key, "overscan_percent") == 0) {
-            ret = device_set_int(&mb_device_set_tw_overscan_percent,
-                                 device, value, subcontext, error);
-        } else if (strcmp(key, "default_x_offset") == 0) {
-            ret = device_set_int(&mb_device_set_tw_default_x_offset,
-                                 device, value, subcontext, error);
-        } else if (strcmp(key, "default_y_offset") == 0) {
-            ret = device_set_int(&mb_device_set_tw_default_y_offset,
-                                 device, value, subcontext, error);
-        } else if (strcmp(key, "brightness_path") == 0) {
-            ret = device_set_string(&mb_device_set_tw_brightness_path,
-                                    device, value, subcontext, error);
-        } else if (strcmp(key, "secondary_brightness_path") == 0) {
-            ret = device_set_string(&mb_device_set_tw_secondary_brightness_path,
-                                    device, value, subcontext, error);
-        } else if (strcmp(key, "max_brightness") == 0) {
-            ret = device_set_int(&mb_device_set_tw_max_brightness,
-                                 device, value, subcontext, error);
-        } else if (strcmp(key, "default_brightness") == 0) {
-            ret = device_set_int(&mb_device_set_tw_default_brightness,
-                                 device, value, subcontext, error);
-        } else if (strcmp(key, "battery_path") == 0) {
-            ret = device_set_string(&mb_device_set_tw_battery_path,
-                                    device, value, subcontext, error);
-        } else if (strcmp(key, "cpu_temp_path") == 0) {
-            ret = device_set_string(&mb_device_set_tw_cpu_temp_path,
-                                    device, value, subcontext, error);
-        } else if (strcmp(key, "input_blacklist") == 0) {
-            ret = device_set_string(&mb_device_set_tw_input_blacklist,
-                                    device, value, subcontext, error);
-        } else if (strcmp(key, "input_whitelist") == 0) {
-            ret = device_set_string(&mb_device_set_tw_input_whitelist,
-                                    device, value, subcontext, error);
-        } else if (strcmp(key, "graphics_backends") == 0) {
-            ret = device_set_string_array(&mb_device_set_tw_graphics_backends,
-                                          device, value, subcontext, error);
-        } else if (strcmp(key, "theme") == 0) {
-            ret = device_set_string(&mb_device_set_tw_theme,
-                                    device, value, subcontext, error);
-        } else {
-            json_error_set_unknown_key(error, subcontext);
-            ret = -1;
-        }
-
-        if (ret != 0) {
-            break;
-        }
-    }
-
-    return ret;
+    return process_keys(device, node, context, boot_ui_keys, error);
 }
 
 static int process_block_devs(struct Device *device, json_t *node,
                               const char *context,
                               struct MbDeviceJsonError *error)
 {
-    int ret = 0;
-    char subcontext[100];
-    const char *key;
-    json_t *value;
-
-    if (!json_is_object(node)) {
-        json_error_set_mismatched_type(
-                error, context, node->type, JSON_OBJECT);
-        return -1;
-    }
-
-    json_object_foreach(node, key, value) {
-        snprintf(subcontext, sizeof(subcontext), "%s.%s", context, key);
-
-        if (strcmp(key, "base_dirs") == 0) {
-            ret = device_set_string_array(&mb_device_set_block_dev_base_dirs,
-                                          device, value, subcontext, error);
-        } else if (strcmp(key, "system") == 0) {
-            ret = device_set_string_array(&mb_device_set_system_block_devs,
-                                          device, value, subcontext, error);
-        } else if (strcmp(key, "cache") == 0) {
-            ret = device_set_string_array(&mb_device_set_cache_block_devs,
-                                          device, value, subcontext, error);
-        } else if (strcmp(key, "data") == 0) {
-            ret = device_set_string_array(&mb_device_set_data_block_devs,
-                                          device, value, subcontext, error);
-        } else if (strcmp(key, "boot") == 0) {
-            ret = device_set_string_array(&mb_device_set_boot_block_devs,
-                                          device, value, subcontext, error);
-        } else if (strcmp(key, "recovery") == 0) {
-            ret = device_set_string_array(&mb_device_set_recovery_block_devs,
-                                          device, value, subcontext, error);
-        } else if (strcmp(key, "extra") == 0) {
-            ret = device_set_string_array(&mb_device_set_extra_block_devs,
-                                          device, value, subcontext, error);
-        } else {
-            json_error_set_unknown_key(error, subcontext);
-            ret = -1;
-        }
+    return process_keys(device, node, context, block_devs_keys, error);
+}
 
-        if (ret != 0) {
-            break;
-        }
-    }
+static constexpr key_mapping device_keys[] = {
+    { "architecture",   &handle_string<&mb_device_set_architecture> },
+    { "block_devs",     &process_block_devs },
+    { "boot_ui",        &process_boot_ui },
+    { "codenames",      &handle_string_array<&mb_device_set_codenames> },
+    { "flags",          &process_device_flags },
+    { "id",             &handle_string<&mb_device_set_id> },
+    { "name",           &handle_string<&mb_device_set_name> },
+};
 
-    return ret;
-}
+static_assert(is_sorted_by_key(device_keys), "device_keys is not sorted");
 
 static int process_device(struct Device *device, json_t *node,
                           const char *context,
                           struct MbDeviceJsonError *error)
 {
-    int ret = 0;
-    char subcontext[100];
-    const char *key;
-    json_t *value;
-
-    if (!json_is_object(node)) {
-        json_error_set_mismatched_type(
-                error, context, node->type, JSON_OBJECT);
-        return -1;
-    }
-
-    json_object_foreach(node, key, value) {
-        snprintf(subcontext, sizeof(subcontext), "%s.%s", context, key);
-
-        if (strcmp(key, "name") == 0) {
-            ret = device_set_string(&mb_device_set_name,
-                                    device, value, subcontext, error);
-        } else if (strcmp(key, "id") == 0) {
-            ret = device_set_string(&mb_device_set_id,
-                                    device, value, subcontext, error);
-        } else if (strcmp(key, "codenames") == 0) {
-            ret = device_set_string_array(&mb_device_set_codenames,
-                                          device, value, subcontext, error);
-        } else if (strcmp(key, "architecture") == 0) {
-            ret = device_set_string(&mb_device_set_architecture,
-                                    device, value, subcontext, error);
-        } else if (strcmp(key, "flags") == 0) {
-            ret = process_device_flags(device, value, subcontext, error);
-        } else if (strcmp(key, "block_devs") == 0) {
-            ret = process_block_devs(device, value, subcontext, error);
-        } else if (strcmp(key, "boot_ui") == 0) {
-            ret = process_boot_ui(device, value, subcontext, error);
-        } else {
-            json_error_set_unknown_key(error, subcontext);
-            ret = -1;
-        }
-
-        if (ret != 0) {
-            break;
-        }
-    }
-
-    return ret;
+    return process_keys(device, node, context, device_keys, error);
 }
 
 struct Device * mb_device_new_from_json(const char *json,
@@ -681,60 +704,169 @@ done:
     return ok ? device : NULL;
 }
 
-struct Device ** mb_device_new_list_from_json(const char *json,
-                                              struct MbDeviceJsonError *error)
+static const char * json_skip_whitespace(const char *p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+        ++p;
+    }
+    return p;
+}
+
+/*!
+ * \brief Report the error for a device list that failed to stream
+ *
+ * The whole document is parsed again so that the error (and its line and
+ * column) matches what jansson reports for the complete input. This only
+ * happens on the error path.
+ *
+ * \param error Error to set
+ * \param json Complete JSON input
+ * \param offset Byte offset at which the streaming parser failed
+ */
+static void json_error_set_list_error(struct MbDeviceJsonError *error,
+                                      const char *json, size_t offset)
 {
-    struct Device **devices = NULL;
-    size_t devices_size;
-    json_t *root = NULL;
-    json_t *elem;
-    size_t index;
     json_error_t json_error;
-    bool ok = true;
-    char context[100];
+    json_t *root;
 
     root = json_loads(json, 0, &json_error);
     if (!root) {
         json_error_set_parse_error(error, json_error.line, json_error.column);
-        ok = false;
-        goto done;
+        return;
     }
 
     if (!json_is_array(root)) {
         json_error_set_mismatched_type(error, "", root->type, JSON_ARRAY);
-        ok = false;
-        goto done;
+    } else {
+        // Should not happen, but fall back to the streaming parser's position
+        int line = 1;
+        int column = 0;
+
+        for (size_t i = 0; i < offset; ++i) {
+            if (json[i] == '\n') {
+                ++line;
+                column = 0;
+            } else if ((json[i] & 0xc0) != 0x80) {
+                ++column;
+            }
+        }
+
+        json_error_set_parse_error(error, line, column + 1);
     }
 
-    devices_size = (json_array_size(root) + 1) * sizeof(struct Device *);
-    devices = (struct Device **) malloc(devices_size);
+    json_decref(root);
+}
+
+/*!
+ * \brief Load a list of devices from a JSON array
+ *
+ * Instead of building the DOM for the whole array, the array is walked
+ * manually and each element is decoded with `JSON_DISABLE_EOF_CHECK`,
+ * processed, and freed before moving on to the next. Only a single device's
+ * DOM is alive at a time.
+ */
+struct Device ** mb_device_new_list_from_json(const char *json,
+                                              struct MbDeviceJsonError *error)
+{
+    struct Device **devices = NULL;
+    size_t devices_count = 0;
+    size_t devices_capacity = 16;
+    size_t json_size = strlen(json);
+    const char *p;
+    json_t *elem;
+    json_error_t json_error;
+    bool ok = true;
+    char context[100];
+
+    devices = (struct Device **) malloc(
+            devices_capacity * sizeof(struct Device *));
     if (!devices) {
         json_error_set_standard_error(error, MB_DEVICE_ERROR_ERRNO);
         ok = false;
         goto done;
     }
-    memset(devices, 0, devices_size);
+    devices[0] = NULL;
 
-    json_array_foreach(root, index, elem) {
-        snprintf(context, sizeof(context), "[%" MB_PRIzu "]", index);
+    p = json_skip_whitespace(json);
+    if (*p != '[') {
+        json_error_set_list_error(error, json, p - json);
+        ok = false;
+        goto done;
+    }
 
-        devices[index] = mb_device_new();
-        if (!devices[index]) {
-            json_error_set_standard_error(error, MB_DEVICE_ERROR_ERRNO);
-            ok = false;
-            goto done;
-        }
+    p = json_skip_whitespace(p + 1);
 
-        if (process_device(devices[index], elem, context, error) < 0) {
-            ok = false;
-            goto done;
+    if (*p == ']') {
+        p = json_skip_whitespace(p + 1);
+    } else {
+        while (true) {
+            elem = json_loadb(p, json_size - (p - json),
+                              JSON_DECODE_ANY | JSON_DISABLE_EOF_CHECK,
+                              &json_error);
+            if (!elem) {
+                json_error_set_list_error(error, json, p - json);
+                ok = false;
+                goto done;
+            }
+
+            if (devices_count + 1 == devices_capacity) {
+                size_t new_capacity = devices_capacity * 2;
+                struct Device **new_devices = (struct Device **) realloc(
+                        devices, new_capacity * sizeof(struct Device *));
+                if (!new_devices) {
+                    json_error_set_standard_error(error, MB_DEVICE_ERROR_ERRNO);
+                    json_decref(elem);
+                    ok = false;
+                    goto done;
+                }
+
+                devices = new_devices;
+                devices_capacity = new_capacity;
+            }
+
+            snprintf(context, sizeof(context), "[%" MB_PRIzu "]",
+                     devices_count);
+
+            devices[devices_count] = mb_device_new();
+            if (!devices[devices_count]) {
+                json_error_set_standard_error(error, MB_DEVICE_ERROR_ERRNO);
+                json_decref(elem);
+                ok = false;
+                goto done;
+            }
+            devices[++devices_count] = NULL;
+
+            int ret = process_device(devices[devices_count - 1], elem,
+                                     context, error);
+            json_decref(elem);
+            if (ret < 0) {
+                ok = false;
+                goto done;
+            }
+
+            p = json_skip_whitespace(p + json_error.position);
+
+            if (*p == ',') {
+                p = json_skip_whitespace(p + 1);
+            } else if (*p == ']') {
+                p = json_skip_whitespace(p + 1);
+                break;
+            } else {
+                json_error_set_list_error(error, json, p - json);
+                ok = false;
+                goto done;
+            }
         }
     }
 
-done:
-    if (root) {
-        json_decref(root);
+    // Match json_loads() and reject trailing data
+    if (*p != '\0') {
+        json_error_set_list_error(error, json, p - json);
+        ok = false;
+        goto done;
     }
+
+done:
     if (!ok && devices) {
         for (struct Device **iter = devices; *iter; ++iter) {
             mb_device_free(*iter);
@@ -807,9 +939,9 @@ char * mb_device_to_json(struct Device *device)
             goto done;
         }
 
-        for (struct flag_mapping *it = device_flag_mappings; it->key; ++it) {
-            if ((device->flags & it->flag)
-                    && json_array_append_new(array, json_string(it->key)) < 0) {
+        for (auto const &it : device_flag_mappings) {
+            if ((device->flags & it.flag)
+                    && json_array_append_new(array, json_string(it.key)) < 0) {
                 goto done;
             }
         }
@@ -884,19 +1016,19 @@ char * mb_device_to_json(struct Device *device)
             goto done;
         }
 
-        for (struct flag_mapping *it = tw_flag_mappings; it->key; ++it) {
-            if ((device->tw_options.flags & it->flag)
-                    && json_array_append_new(array, json_string(it->key)) < 0) {
+        for (auto const &it : tw_flag_mappings) {
+            if ((device->tw_options.flags & it.flag)
+                    && json_array_append_new(array, json_string(it.key)) < 0) {
                 goto done;
             }
         }
     }
 
     if (device->tw_options.pixel_format != TW_PIXEL_FORMAT_DEFAULT) {
-        for (struct tw_pxfmt_mapping *it = tw_pxfmt_mappings; it->key; ++it) {
-            if (device->tw_options.pixel_format == it->value) {
+        for (auto const &it : tw_pxfmt_mappings) {
+            if (device->tw_options.pixel_format == it.value) {
                 if (json_object_set_new(boot_ui, "pixel_format",
-                                        json_string(it->key)) < 0) {
+                                        json_string(it.key)) < 0) {
                     goto done;
                 }
                 break;
@@ -905,11 +1037,10 @@ char * mb_device_to_json(struct Device *device)
     }
 
     if (device->tw_options.force_pixel_format != TW_FORCE_PIXEL_FORMAT_NONE) {
-        for (struct tw_force_pxfmt_mapping *it = tw_force_pxfmt_mappings;
-                it->key; ++it) {
-            if (device->tw_options.force_pixel_format == it->value) {
+        for (auto const &it : tw_force_pxfmt_mappings) {
+            if (device->tw_options.force_pixel_format == it.value) {
                 if (json_object_set_new(boot_ui, "force_pixel_format",
-                                        json_string(it->key)) < 0) {
+                                        json_string(it.key)) < 0) {
                     goto done;
                 }
                 break;
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "mbdevice/database.h"
+#include "mbdevice/device.h"
+
+struct DeviceDbTest : testing::Test
+{
+    Device *_devices[3];
+    void *_data;
+    size_t _size;
+
+    DeviceDbTest() : _data(nullptr), _size(0)
+    {
+        static const char *codenames_a[] = { "bravo", "alpha", nullptr };
+        static const char *codenames_b[] = { "charlie", nullptr };
+        static const char *system_devs[] = { "/dev/block/sda1", nullptr };
+        static const char *empty[] = { nullptr };
+
+        _devices[0] = mb_device_new();
+        mb_device_set_id(_devices[0], "device_a");
+        mb_device_set_codenames(_devices[0], codenames_a);
+        mb_device_set_name(_devices[0], "Device A");
+        mb_device_set_architecture(_devices[0], "arm64-v8a");
+        mb_device_set_flags(_devices[0], 3);
+        mb_device_set_system_block_devs(_devices[0], system_devs);
+        mb_device_set_extra_block_devs(_devices[0], empty);
+        mb_device_set_tw_supported(_devices[0], true);
+        mb_device_set_tw_flags(_devices[0], 0x12345678abcdULL);
+        mb_device_set_tw_pixel_format(_devices[0], TW_PIXEL_FORMAT_RGBA_8888);
+        mb_device_set_tw_default_x_offset(_devices[0], -10);
+        mb_device_set_tw_theme(_devices[0], "portrait_hdpi");
+
+        _devices[1] = mb_device_new();
+        mb_device_set_id(_devices[1], "device_b");
+        mb_device_set_codenames(_devices[1], codenames_b);
+        mb_device_set_name(_devices[1], "Device B");
+        mb_device_set_system_block_devs(_devices[1], system_devs);
+
+        _devices[2] = nullptr;
+    }
+
+    virtual ~DeviceDbTest()
+    {
+        for (Device **it = _devices; *it; ++it) {
+            mb_device_free(*it);
+        }
+        free(_data);
+    }
+
+    void serialize()
+    {
+        _data = mb_device_db_serialize(_devices, &_size);
+        ASSERT_NE(_data, nullptr);
+    }
+};
+
+TEST_F(DeviceDbTest, CheckRoundTrip)
+{
+    serialize();
+
+    MbDeviceDb *db = mb_device_db_open_memory(_data, _size);
+    ASSERT_NE(db, nullptr);
+
+    ASSERT_EQ(mb_device_db_count(db), 2u);
+
+    for (size_t i = 0; i < 2; ++i) {
+        Device *device = mb_device_db_get(db, i);
+        ASSERT_NE(device, nullptr);
+        ASSERT_TRUE(mb_device_equals(device, _devices[i]));
+        mb_device_free(device);
+    }
+
+    mb_device_db_close(db);
+}
+
+TEST_F(DeviceDbTest, CheckFindByCodename)
+{
+    serialize();
+
+    MbDeviceDb *db = mb_device_db_open_memory(_data, _size);
+    ASSERT_NE(db, nullptr);
+
+    ASSERT_EQ(mb_device_db_find_by_codename(db, "alpha"), 0);
+    ASSERT_EQ(mb_device_db_find_by_codename(db, "bravo"), 0);
+    ASSERT_EQ(mb_device_db_find_by_codename(db, "charlie"), 1);
+    ASSERT_EQ(mb_device_db_find_by_codename(db, "delta"), -1);
+    ASSERT_EQ(mb_device_db_find_by_codename(db, ""), -1);
+
+    ASSERT_STREQ(mb_device_db_id(db, 1), "device_b");
+    ASSERT_STREQ(mb_device_db_name(db, 0), "Device A");
+    ASSERT_EQ(mb_device_db_id(db, 2), nullptr);
+
+    mb_device_db_close(db);
+}
+
+TEST_F(DeviceDbTest, CheckInvalidData)
+{
+    serialize();
+
+    // Bad magic
+    ASSERT_EQ(mb_device_db_open_memory("garbage", 7), nullptr);
+    ASSERT_EQ(errno, EINVAL);
+
+    // Truncated
+    ASSERT_EQ(mb_device_db_open_memory(_data, _size - 1), nullptr);
+    ASSERT_EQ(errno, EINVAL);
+
+    // Out of bounds offset in the first record's ID field
+    std::vector<unsigned char> buf(static_cast<unsigned char *>(_data),
+                                   static_cast<unsigned char *>(_data) + _size);
+    uint32_t bad = 0xffffff00;
+    memcpy(buf.data() + 40 + 16, &bad, sizeof(bad));
+    ASSERT_EQ(mb_device_db_open_memory(buf.data(), buf.size()), nullptr);
+    ASSERT_EQ(errno, EINVAL);
+}
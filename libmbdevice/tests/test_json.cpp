@@ -19,6 +19,8 @@
 
 #include <gtest/gtest.h>
 
+#include <string>
+
 #include "mbdevice/device.h"
 #include "mbdevice/json.h"
 
@@ -34,7 +36,8 @@ static const char sample_complete[] =
         "],"
         "\"architecture\": \"arm64-v8a\","
         "\"flags\": ["
-            "\"HAS_COMBINED_BOOT_AND_RECOVERY\""
+            "\"HAS_COMBINED_BOOT_AND_RECOVERY\","
+            "\"RAMDISK_LZ4_LEGACY\""
         "],"
         "\"block_devs\": {"
             "\"base_dirs\": ["
@@ -230,7 +233,8 @@ TEST(JsonTest, LoadCompleteDefinition)
     ASSERT_STREQ(mb_device_name(sd.device), "Test Device");
     ASSERT_STREQ(mb_device_architecture(sd.device), "arm64-v8a");
 
-    uint64_t device_flags = FLAG_HAS_COMBINED_BOOT_AND_RECOVERY;
+    uint64_t device_flags = FLAG_HAS_COMBINED_BOOT_AND_RECOVERY
+            | FLAG_RAMDISK_LZ4_LEGACY;
     ASSERT_EQ(mb_device_flags(sd.device), device_flags);
 
     const char *base_dirs[] = { "/dev/block/bootdevice/by-name", nullptr };
@@ -397,6 +401,48 @@ TEST(JsonTest, LoadMultiple)
     ASSERT_STREQ(sd2.error.expected_type, "array");
 }
 
+TEST(JsonTest, LoadMultipleMany)
+{
+    std::string json = "[";
+    for (int i = 0; i < 100; ++i) {
+        if (i > 0) {
+            json += ",\n";
+        }
+        json += "{\"id\": \"test";
+        json += std::to_string(i);
+        json += "\"}";
+    }
+    json += "]";
+
+    ScopedDevices sd(json.c_str());
+    ASSERT_NE(sd.devices, nullptr);
+
+    size_t count = 0;
+    for (struct Device **iter = sd.devices; *iter; ++iter, ++count) {
+        ASSERT_EQ(mb_device_id(*iter), "test" + std::to_string(count));
+    }
+    ASSERT_EQ(count, 100u);
+}
+
+TEST(JsonTest, LoadMultipleMalformed)
+{
+    ScopedDevices sd1("[{\"id\": \"test1\"} {\"id\": \"test2\"}]");
+    ASSERT_EQ(sd1.devices, nullptr);
+    ASSERT_EQ(sd1.error.type, MB_DEVICE_JSON_PARSE_ERROR);
+    ASSERT_EQ(sd1.error.line, 1);
+    ASSERT_EQ(sd1.error.column, 18);
+
+    ScopedDevices sd2("[{\"id\": \"test1\"}]\n]");
+    ASSERT_EQ(sd2.devices, nullptr);
+    ASSERT_EQ(sd2.error.type, MB_DEVICE_JSON_PARSE_ERROR);
+    ASSERT_EQ(sd2.error.line, 2);
+
+    ScopedDevices sd3("[{\"id\": \"test1\"}, {\"foo\": \"bar\"}]");
+    ASSERT_EQ(sd3.devices, nullptr);
+    ASSERT_EQ(sd3.error.type, MB_DEVICE_JSON_UNKNOWN_KEY);
+    ASSERT_STREQ(sd3.error.context, "[1].foo");
+}
+
 TEST(JsonTest, CreateJson)
 {
     ScopedDevice sd1(sample_complete);
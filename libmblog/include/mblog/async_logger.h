@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "mblog/base_logger.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <cstddef>
+#include <cstdint>
+
+#define ASYNC_LOG_MSG_SIZE 512
+
+namespace mb
+{
+namespace log
+{
+
+/*!
+ * \brief Logger that writes messages to another logger asynchronously
+ *
+ * Messages are formatted by the calling thread into a fixed size ring buffer
+ * without taking any locks. A background thread drains the buffer and passes
+ * the messages to the wrapped logger. If the buffer is full, the message is
+ * dropped and counted. The number of dropped messages is reported through the
+ * wrapped logger once there is space again.
+ *
+ * If a process forks, the child does not have the background thread, so
+ * messages logged by the child are passed to the wrapped logger synchronously.
+ */
+class MB_EXPORT AsyncLogger : public BaseLogger
+{
+public:
+    AsyncLogger(std::shared_ptr<BaseLogger> sink, size_t capacity,
+                bool flush_on_crash);
+
+    virtual ~AsyncLogger();
+
+    virtual void log(LogLevel prio, const char *fmt, va_list ap) override;
+    virtual void flush() override;
+
+    uint64_t dropped() const;
+
+private:
+    struct Slot
+    {
+        std::atomic<size_t> seq;
+        LogLevel prio;
+        char msg[ASYNC_LOG_MSG_SIZE];
+    };
+
+    bool enqueue(LogLevel prio, const char *fmt, va_list ap);
+    bool drain();
+    void consumer();
+    void crash_flush();
+
+    static void crash_handler(int sig);
+
+    std::shared_ptr<BaseLogger> _sink;
+
+    std::unique_ptr<Slot[]> _slots;
+    size_t _mask;
+    std::atomic<size_t> _enqueue_pos;
+    std::atomic<size_t> _dequeue_pos;
+    // Held by whichever thread is draining the buffer
+    std::atomic_flag _draining;
+
+    std::atomic<uint64_t> _dropped;
+    uint64_t _dropped_reported;
+
+    std::mutex _mutex;
+    std::condition_variable _wake_cv;
+    std::condition_variable _drained_cv;
+    std::atomic<bool> _sleeping;
+    bool _stop;
+
+    unsigned int _fork_generation;
+    bool _flush_on_crash;
+    std::unique_ptr<std::thread> _thread;
+};
+
+}
+}
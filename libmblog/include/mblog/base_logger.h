@@ -33,6 +33,9 @@ class MB_EXPORT BaseLogger
 {
 public:
     virtual void log(LogLevel prio, const char *fmt, va_list ap) = 0;
+
+    // Write out any buffered messages
+    virtual void flush() {}
 };
 
 }
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "mblog/base_logger.h"
+
+#include <cstdint>
+
+/*
+ * Binary log format
+ *
+ * All integers are little endian. The file starts with a header:
+ *
+ *   char     magic[8]      MBLOG_BINARY_MAGIC
+ *   uint32_t version       MBLOG_BINARY_VERSION
+ *   uint32_t reserved      0
+ *
+ * followed by records:
+ *
+ *   uint32_t size          Size of the rest of the record
+ *   uint8_t  level         LogLevel
+ *   uint8_t  kind          MBLOG_BINARY_RECORD_*
+ *   uint16_t reserved      0
+ *   uint64_t timestamp     CLOCK_REALTIME in nanoseconds
+ *
+ * For MBLOG_BINARY_RECORD_TEXT, the rest of the record is the formatted
+ * message (not NULL-terminated). For MBLOG_BINARY_RECORD_FORMAT, it contains:
+ *
+ *   uint64_t fmt_offset    Offset of the format string from the start of the
+ *                          executable's first loadable segment
+ *   uint8_t  argc          Number of arguments
+ *
+ * followed by argc arguments, each consisting of a MBLOG_BINARY_ARG_* type
+ * byte and its value. Integers, doubles, and pointers are stored in 8 bytes.
+ * Strings are stored as a uint32_t length followed by the (not NULL-terminated)
+ * data. Field widths and precisions given as '*' are stored as integer
+ * arguments in the order they are consumed.
+ *
+ * The format strings are not stored in the log. They are read from the exact
+ * executable that produced the log by mblogdecode.
+ */
+
+#define MBLOG_BINARY_MAGIC          "MBBINLOG"
+#define MBLOG_BINARY_MAGIC_SIZE     8
+#define MBLOG_BINARY_VERSION        1
+
+#define MBLOG_BINARY_RECORD_TEXT    0
+#define MBLOG_BINARY_RECORD_FORMAT  1
+
+#define MBLOG_BINARY_ARG_INT        1
+#define MBLOG_BINARY_ARG_UINT       2
+#define MBLOG_BINARY_ARG_DOUBLE     3
+#define MBLOG_BINARY_ARG_STRING     4
+#define MBLOG_BINARY_ARG_POINTER    5
+
+namespace mb
+{
+namespace log
+{
+
+/*!
+ * \brief Logger that writes compact binary records instead of text
+ *
+ * Messages whose format string is part of the executable are stored as the
+ * format string's offset plus the raw arguments, so no formatting is done on
+ * the device. Other messages (eg. formats built at runtime or from shared
+ * libraries, or formats using unsupported conversions like `%m`) are formatted
+ * and stored as text.
+ *
+ * Each record is written with a single `write()` call, so the logger can be
+ * used from multiple threads.
+ */
+class MB_EXPORT BinaryLogger : public BaseLogger
+{
+public:
+    BinaryLogger(int fd, bool owns_fd);
+
+    virtual ~BinaryLogger();
+
+    virtual void log(LogLevel prio, const char *fmt, va_list ap) override;
+
+private:
+    int _fd;
+    bool _owns_fd;
+};
+
+}
+}
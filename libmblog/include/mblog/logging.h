@@ -19,6 +19,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <memory>
 
 #include <cstdarg>
@@ -27,17 +28,46 @@
 #include "mblog/base_logger.h"
 #include "mblog/log_level.h"
 
-#define LOGE(...) mb::log::log(mb::log::LogLevel::Error, __VA_ARGS__)
-#define LOGW(...) mb::log::log(mb::log::LogLevel::Warning, __VA_ARGS__)
-#define LOGI(...) mb::log::log(mb::log::LogLevel::Info, __VA_ARGS__)
-#define LOGD(...) mb::log::log(mb::log::LogLevel::Debug, __VA_ARGS__)
-#define LOGV(...) mb::log::log(mb::log::LogLevel::Verbose, __VA_ARGS__)
+// Least severe level that is compiled in. Messages with a less severe level
+// are removed at compile time and their arguments are never evaluated. The
+// value is the numeric value of the corresponding LogLevel.
+#ifndef MBLOG_MIN_LEVEL
+#  define MBLOG_MIN_LEVEL 4 /* LogLevel::Verbose */
+#endif
 
-#define VLOGE(...) mb::log::logv(mb::log::LogLevel::Error, __VA_ARGS__)
-#define VLOGW(...) mb::log::logv(mb::log::LogLevel::Warning, __VA_ARGS__)
-#define VLOGI(...) mb::log::logv(mb::log::LogLevel::Info, __VA_ARGS__)
-#define VLOGD(...) mb::log::logv(mb::log::LogLevel::Debug, __VA_ARGS__)
-#define VLOGV(...) mb::log::logv(mb::log::LogLevel::Verbose, __VA_ARGS__)
+#define MBLOG_LEVEL_COMPILED(level) \
+    (static_cast<int>(level) <= MBLOG_MIN_LEVEL)
+
+// The arguments are only evaluated if the level is enabled
+#define MBLOG_LOG_IF(fn, level, ...) \
+    do { \
+        if (MBLOG_LEVEL_COMPILED(level) \
+                && mb::log::log_level_enabled(level)) { \
+            fn(level, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOGE(...) \
+    MBLOG_LOG_IF(mb::log::log, mb::log::LogLevel::Error, __VA_ARGS__)
+#define LOGW(...) \
+    MBLOG_LOG_IF(mb::log::log, mb::log::LogLevel::Warning, __VA_ARGS__)
+#define LOGI(...) \
+    MBLOG_LOG_IF(mb::log::log, mb::log::LogLevel::Info, __VA_ARGS__)
+#define LOGD(...) \
+    MBLOG_LOG_IF(mb::log::log, mb::log::LogLevel::Debug, __VA_ARGS__)
+#define LOGV(...) \
+    MBLOG_LOG_IF(mb::log::log, mb::log::LogLevel::Verbose, __VA_ARGS__)
+
+#define VLOGE(...) \
+    MBLOG_LOG_IF(mb::log::logv, mb::log::LogLevel::Error, __VA_ARGS__)
+#define VLOGW(...) \
+    MBLOG_LOG_IF(mb::log::logv, mb::log::LogLevel::Warning, __VA_ARGS__)
+#define VLOGI(...) \
+    MBLOG_LOG_IF(mb::log::logv, mb::log::LogLevel::Info, __VA_ARGS__)
+#define VLOGD(...) \
+    MBLOG_LOG_IF(mb::log::logv, mb::log::LogLevel::Debug, __VA_ARGS__)
+#define VLOGV(...) \
+    MBLOG_LOG_IF(mb::log::logv, mb::log::LogLevel::Verbose, __VA_ARGS__)
 
 namespace mb
 {
@@ -50,6 +80,21 @@ MB_EXPORT void log_set_logger(std::shared_ptr<BaseLogger> logger);
 MB_PRINTF(2, 3)
 MB_EXPORT void log(LogLevel prio, const char *fmt, ...);
 MB_EXPORT void logv(LogLevel prio, const char *fmt, va_list ap);
+MB_EXPORT void log_flush();
+
+MB_EXPORT LogLevel log_level();
+MB_EXPORT void log_set_level(LogLevel level);
+
+namespace detail
+{
+MB_EXPORT extern std::atomic<LogLevel> g_log_level;
+}
+
+// Inlined at the call site by the LOG*() macros
+inline bool log_level_enabled(LogLevel prio)
+{
+    return prio <= detail::g_log_level.load(std::memory_order_relaxed);
+}
 
 }
 }
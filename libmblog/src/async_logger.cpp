@@ -0,0 +1,373 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "mblog/async_logger.h"
+
+#include <cinttypes>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+
+#ifndef _WIN32
+#  include <pthread.h>
+#endif
+
+namespace mb
+{
+namespace log
+{
+
+// Incremented in the child process after every fork(). A logger created in a
+// different generation does not have a background thread in this process.
+static std::atomic<unsigned int> g_fork_generation(0);
+static std::once_flag g_atfork_once;
+
+static std::atomic<AsyncLogger *> g_crash_logger(nullptr);
+
+#ifndef _WIN32
+static const int g_crash_signals[] = {
+    SIGABRT, SIGBUS, SIGFPE, SIGILL, SIGSEGV,
+};
+static struct sigaction g_old_actions[sizeof(g_crash_signals)
+        / sizeof(g_crash_signals[0])];
+#endif
+
+static void atfork_child()
+{
+    g_fork_generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void sink_log(BaseLogger &sink, LogLevel prio, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    sink.log(prio, fmt, ap);
+    va_end(ap);
+}
+
+static size_t round_up_pow2(size_t n)
+{
+    size_t result = 2;
+    while (result < n && result <= SIZE_MAX / 2) {
+        result <<= 1;
+    }
+    return result;
+}
+
+/*!
+ * \brief Construct logger that writes to \p sink from a background thread
+ *
+ * \param sink Logger to pass formatted messages to
+ * \param capacity Maximum number of queued messages (rounded up to a power of
+ *                 2). Messages are dropped when the buffer is full.
+ * \param flush_on_crash Whether to drain the buffer synchronously when the
+ *                       process receives a fatal signal. Only one logger can
+ *                       do so at a time.
+ */
+AsyncLogger::AsyncLogger(std::shared_ptr<BaseLogger> sink, size_t capacity,
+                         bool flush_on_crash)
+    : _sink(std::move(sink))
+    , _mask(round_up_pow2(capacity) - 1)
+    , _enqueue_pos(0)
+    , _dequeue_pos(0)
+    , _dropped(0)
+    , _dropped_reported(0)
+    , _sleeping(false)
+    , _stop(false)
+    , _flush_on_crash(false)
+{
+    _draining.clear();
+
+    _slots.reset(new Slot[_mask + 1]);
+    for (size_t i = 0; i <= _mask; ++i) {
+        _slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+#ifndef _WIN32
+    std::call_once(g_atfork_once, []{
+        pthread_atfork(nullptr, nullptr, &atfork_child);
+    });
+#endif
+    _fork_generation = g_fork_generation.load(std::memory_order_relaxed);
+
+    try {
+        _thread.reset(new std::thread(&AsyncLogger::consumer, this));
+    } catch (const std::exception &) {
+        // Log synchronously if the thread cannot be started
+        _thread.reset();
+    }
+
+#ifndef _WIN32
+    AsyncLogger *expected = nullptr;
+    if (flush_on_crash && _thread && g_crash_logger.compare_exchange_strong(
+            expected, this)) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &AsyncLogger::crash_handler;
+        sigemptyset(&sa.sa_mask);
+
+        for (size_t i = 0; i < sizeof(g_crash_signals)
+                / sizeof(g_crash_signals[0]); ++i) {
+            sigaction(g_crash_signals[i], &sa, &g_old_actions[i]);
+        }
+
+        _flush_on_crash = true;
+    }
+#else
+    (void) flush_on_crash;
+#endif
+}
+
+AsyncLogger::~AsyncLogger()
+{
+#ifndef _WIN32
+    if (_flush_on_crash) {
+        for (size_t i = 0; i < sizeof(g_crash_signals)
+                / sizeof(g_crash_signals[0]); ++i) {
+            sigaction(g_crash_signals[i], &g_old_actions[i], nullptr);
+        }
+        g_crash_logger.store(nullptr);
+    }
+#endif
+
+    if (!_thread) {
+        return;
+    }
+
+    if (_fork_generation != g_fork_generation.load(
+            std::memory_order_relaxed)) {
+        // The thread only exists in the parent process, so it can neither be
+        // joined nor detached here
+        _thread.release();
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+        _wake_cv.notify_one();
+    }
+
+    _thread->join();
+}
+
+void AsyncLogger::log(LogLevel prio, const char *fmt, va_list ap)
+{
+    if (!_thread || _fork_generation != g_fork_generation.load(
+            std::memory_order_relaxed)) {
+        _sink->log(prio, fmt, ap);
+        return;
+    }
+
+    if (!enqueue(prio, fmt, ap)) {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    // Pairs with the fence in consumer() so that either the consumer sees the
+    // new message or we see that it is sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_sleeping.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _wake_cv.notify_one();
+    }
+}
+
+/*!
+ * \brief Wait until all queued messages have been written
+ *
+ * Messages that are logged while this function is running may or may not be
+ * written before it returns.
+ */
+void AsyncLogger::flush()
+{
+    if (_thread && _fork_generation == g_fork_generation.load(
+            std::memory_order_relaxed)) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        size_t target = _enqueue_pos.load(std::memory_order_relaxed);
+
+        _wake_cv.notify_one();
+        _drained_cv.wait(lock, [&]{
+            return static_cast<ptrdiff_t>(
+                    _dequeue_pos.load(std::memory_order_acquire) - target) >= 0;
+        });
+    }
+
+    _sink->flush();
+}
+
+/*!
+ * \brief Get the number of messages that were dropped because the buffer was
+ *        full
+ */
+uint64_t AsyncLogger::dropped() const
+{
+    return _dropped.load(std::memory_order_relaxed);
+}
+
+bool AsyncLogger::enqueue(LogLevel prio, const char *fmt, va_list ap)
+{
+    Slot *slot;
+    size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+
+    while (true) {
+        slot = &_slots[pos & _mask];
+        size_t seq = slot->seq.load(std::memory_order_acquire);
+        ptrdiff_t diff = static_cast<ptrdiff_t>(seq - pos);
+
+        if (diff == 0) {
+            if (_enqueue_pos.compare_exchange_weak(
+                    pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Full
+            return false;
+        } else {
+            pos = _enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->prio = prio;
+
+    int len = vsnprintf(slot->msg, sizeof(slot->msg), fmt, ap);
+    if (len < 0) {
+        slot->msg[0] = '\0';
+    } else if (static_cast<size_t>(len) >= sizeof(slot->msg)) {
+        // Make user aware of any truncation
+        static const char trunc[] = " [trunc...]";
+        memcpy(slot->msg + sizeof(slot->msg) - sizeof(trunc), trunc,
+               sizeof(trunc));
+    }
+
+    slot->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+// Write all published messages to the sink. Returns false if another thread is
+// already draining the buffer.
+bool AsyncLogger::drain()
+{
+    if (_draining.test_and_set(std::memory_order_acquire)) {
+        return false;
+    }
+
+    size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+
+    while (true) {
+        Slot *slot = &_slots[pos & _mask];
+        size_t seq = slot->seq.load(std::memory_order_acquire);
+
+        if (seq != pos + 1) {
+            // Empty or the next message is still being formatted
+            break;
+        }
+
+        sink_log(*_sink, slot->prio, "%s", slot->msg);
+
+        slot->seq.store(pos + _mask + 1, std::memory_order_release);
+        ++pos;
+        _dequeue_pos.store(pos, std::memory_order_release);
+    }
+
+    uint64_t dropped = _dropped.load(std::memory_order_relaxed);
+    if (dropped != _dropped_reported) {
+        sink_log(*_sink, LogLevel::Warning,
+                 "[%" PRIu64 " log messages dropped]",
+                 dropped - _dropped_reported);
+        _dropped_reported = dropped;
+    }
+
+    _draining.clear(std::memory_order_release);
+    return true;
+}
+
+void AsyncLogger::consumer()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (true) {
+        lock.unlock();
+        drain();
+        lock.lock();
+
+        _drained_cv.notify_all();
+
+        if (_stop) {
+            break;
+        }
+
+        _sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+        if (_slots[pos & _mask].seq.load(std::memory_order_acquire)
+                != pos + 1) {
+            _wake_cv.wait(lock);
+        }
+
+        _sleeping.store(false, std::memory_order_relaxed);
+    }
+
+    lock.unlock();
+
+    // Messages logged after the stop request
+    drain();
+}
+
+void AsyncLogger::crash_flush()
+{
+    // Messages in the buffer of a forked child belong to the parent
+    if (_fork_generation != g_fork_generation.load(
+            std::memory_order_relaxed)) {
+        return;
+    }
+
+    // If the background thread crashed while draining, there is nothing more
+    // that can be done
+    drain();
+}
+
+void AsyncLogger::crash_handler(int sig)
+{
+#ifndef _WIN32
+    AsyncLogger *logger = g_crash_logger.exchange(nullptr);
+    if (logger) {
+        logger->crash_flush();
+    }
+
+    // Restore the previous handler and let it (or the default action) handle
+    // the signal
+    for (size_t i = 0; i < sizeof(g_crash_signals)
+            / sizeof(g_crash_signals[0]); ++i) {
+        if (g_crash_signals[i] == sig) {
+            sigaction(sig, &g_old_actions[i], nullptr);
+            break;
+        }
+    }
+
+    raise(sig);
+#else
+    (void) sig;
+#endif
+}
+
+}
+}
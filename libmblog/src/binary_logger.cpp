@@ -0,0 +1,384 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "mblog/binary_logger.h"
+
+#include <algorithm>
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mbcommon/endian.h"
+
+// Largest record that is written. Messages that do not fit are truncated.
+#define BINARY_LOG_BUF_SIZE     1024
+// Maximum number of arguments in a MBLOG_BINARY_RECORD_FORMAT record
+#define BINARY_LOG_MAX_ARGS     32
+
+// Provided by the linker for executables
+#ifdef __linux__
+extern "C" char __executable_start[] __attribute__((weak));
+extern "C" char _end[] __attribute__((weak));
+#endif
+
+namespace mb
+{
+namespace log
+{
+
+namespace
+{
+
+struct RecordBuf
+{
+    unsigned char data[BINARY_LOG_BUF_SIZE];
+    size_t size = 0;
+
+    bool put(const void *buf, size_t n)
+    {
+        if (n > sizeof(data) - size) {
+            return false;
+        }
+        memcpy(data + size, buf, n);
+        size += n;
+        return true;
+    }
+
+    bool put_u8(uint8_t value)
+    {
+        return put(&value, sizeof(value));
+    }
+
+    bool put_u32(uint32_t value)
+    {
+        value = mb_htole32(value);
+        return put(&value, sizeof(value));
+    }
+
+    bool put_u64(uint64_t value)
+    {
+        value = mb_htole64(value);
+        return put(&value, sizeof(value));
+    }
+};
+
+}
+
+// Get the offset of ptr from the start of the executable if it points to data
+// that is part of the executable file
+static bool image_offset(const char *ptr, uint64_t &offset)
+{
+#ifdef __linux__
+    auto addr = reinterpret_cast<uintptr_t>(ptr);
+    auto start = reinterpret_cast<uintptr_t>(__executable_start);
+    auto end = reinterpret_cast<uintptr_t>(_end);
+
+    if (start && end && addr >= start && addr < end) {
+        offset = addr - start;
+        return true;
+    }
+#else
+    (void) ptr;
+    (void) offset;
+#endif
+    return false;
+}
+
+static bool put_int_arg(RecordBuf &buf, int64_t value)
+{
+    return buf.put_u8(MBLOG_BINARY_ARG_INT)
+            && buf.put_u64(static_cast<uint64_t>(value));
+}
+
+static bool put_uint_arg(RecordBuf &buf, uint64_t value)
+{
+    return buf.put_u8(MBLOG_BINARY_ARG_UINT) && buf.put_u64(value);
+}
+
+// Append the arguments of fmt to buf. Returns false if the format contains
+// conversions that cannot be decoded without the device state (eg. %m or %n)
+// or if the arguments do not fit.
+static bool encode_args(RecordBuf &buf, size_t argc_offset, const char *fmt,
+                        va_list ap)
+{
+    size_t argc = 0;
+
+    for (const char *p = fmt; *p; ++p) {
+        if (*p != '%') {
+            continue;
+        }
+        ++p;
+
+        if (*p == '%') {
+            continue;
+        }
+
+        // Flags
+        while (*p && strchr("-+ #0'", *p)) {
+            ++p;
+        }
+
+        // Width and precision
+        for (int i = 0; i < 2; ++i) {
+            if (i == 1) {
+                if (*p != '.') {
+                    break;
+                }
+                ++p;
+            }
+
+            if (*p == '*') {
+                if (++argc > BINARY_LOG_MAX_ARGS
+                        || !put_int_arg(buf, va_arg(ap, int))) {
+                    return false;
+                }
+                ++p;
+            } else {
+                while (*p >= '0' && *p <= '9') {
+                    ++p;
+                }
+            }
+        }
+
+        // Length modifier
+        char length[3] = {};
+        for (size_t i = 0; i < 2 && *p && strchr("hljztLq", *p); ++i) {
+            length[i] = *p++;
+        }
+
+        if (++argc > BINARY_LOG_MAX_ARGS) {
+            return false;
+        }
+
+        bool ok;
+
+        switch (*p) {
+        case 'd':
+        case 'i': {
+            int64_t value;
+            if (strcmp(length, "hh") == 0) {
+                value = static_cast<signed char>(va_arg(ap, int));
+            } else if (strcmp(length, "h") == 0) {
+                value = static_cast<short>(va_arg(ap, int));
+            } else if (strcmp(length, "l") == 0) {
+                value = va_arg(ap, long);
+            } else if (strcmp(length, "ll") == 0 || strcmp(length, "q") == 0) {
+                value = va_arg(ap, long long);
+            } else if (strcmp(length, "j") == 0) {
+                value = va_arg(ap, intmax_t);
+            } else if (strcmp(length, "z") == 0) {
+                value = va_arg(ap, ssize_t);
+            } else if (strcmp(length, "t") == 0) {
+                value = va_arg(ap, ptrdiff_t);
+            } else if (!*length) {
+                value = va_arg(ap, int);
+            } else {
+                return false;
+            }
+            ok = put_int_arg(buf, value);
+            break;
+        }
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X': {
+            uint64_t value;
+            if (strcmp(length, "hh") == 0) {
+                value = static_cast<unsigned char>(va_arg(ap, unsigned int));
+            } else if (strcmp(length, "h") == 0) {
+                value = static_cast<unsigned short>(va_arg(ap, unsigned int));
+            } else if (strcmp(length, "l") == 0) {
+                value = va_arg(ap, unsigned long);
+            } else if (strcmp(length, "ll") == 0 || strcmp(length, "q") == 0) {
+                value = va_arg(ap, unsigned long long);
+            } else if (strcmp(length, "j") == 0) {
+                value = va_arg(ap, uintmax_t);
+            } else if (strcmp(length, "z") == 0) {
+                value = va_arg(ap, size_t);
+            } else if (strcmp(length, "t") == 0) {
+                value = static_cast<uint64_t>(va_arg(ap, ptrdiff_t));
+            } else if (!*length) {
+                value = va_arg(ap, unsigned int);
+            } else {
+                return false;
+            }
+            ok = put_uint_arg(buf, value);
+            break;
+        }
+        case 'c':
+            if (*length) {
+                return false;
+            }
+            ok = put_int_arg(buf, va_arg(ap, int));
+            break;
+        case 'a':
+        case 'A':
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G': {
+            double value;
+            if (strcmp(length, "L") == 0) {
+                value = static_cast<double>(va_arg(ap, long double));
+            } else if (!*length || strcmp(length, "l") == 0) {
+                value = va_arg(ap, double);
+            } else {
+                return false;
+            }
+            uint64_t bits;
+            static_assert(sizeof(bits) == sizeof(value),
+                          "double is not 64 bits");
+            memcpy(&bits, &value, sizeof(bits));
+            ok = buf.put_u8(MBLOG_BINARY_ARG_DOUBLE) && buf.put_u64(bits);
+            break;
+        }
+        case 's': {
+            if (*length) {
+                return false;
+            }
+            const char *str = va_arg(ap, const char *);
+            if (!str) {
+                str = "(null)";
+            }
+            size_t len = strlen(str);
+            ok = buf.put_u8(MBLOG_BINARY_ARG_STRING)
+                    && len <= UINT32_MAX
+                    && buf.put_u32(static_cast<uint32_t>(len))
+                    && buf.put(str, len);
+            break;
+        }
+        case 'p':
+            ok = buf.put_u8(MBLOG_BINARY_ARG_POINTER) && buf.put_u64(
+                    reinterpret_cast<uintptr_t>(va_arg(ap, void *)));
+            break;
+        default:
+            // %m, %n, wide characters, or invalid conversions
+            return false;
+        }
+
+        if (!ok) {
+            return false;
+        }
+    }
+
+    buf.data[argc_offset] = static_cast<uint8_t>(argc);
+    return true;
+}
+
+static void start_record(RecordBuf &buf, LogLevel prio, uint8_t kind)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    buf.size = 0;
+    buf.put_u32(0);
+    buf.put_u8(static_cast<uint8_t>(prio));
+    buf.put_u8(kind);
+    buf.put_u8(0);
+    buf.put_u8(0);
+    buf.put_u64(static_cast<uint64_t>(ts.tv_sec) * 1000000000u
+            + static_cast<uint64_t>(ts.tv_nsec));
+}
+
+/*!
+ * \brief Construct logger that writes to a file descriptor
+ *
+ * If the file is empty, the binary log header is written first. Otherwise, the
+ * records are appended to the existing log.
+ *
+ * \param fd File descriptor opened for writing (preferably with `O_APPEND`)
+ * \param owns_fd Whether to close \p fd when the logger is destroyed
+ */
+BinaryLogger::BinaryLogger(int fd, bool owns_fd)
+    : _fd(fd), _owns_fd(owns_fd)
+{
+    struct stat sb;
+
+    if (_fd >= 0 && fstat(_fd, &sb) == 0 && sb.st_size == 0) {
+        RecordBuf buf;
+        buf.put(MBLOG_BINARY_MAGIC, MBLOG_BINARY_MAGIC_SIZE);
+        buf.put_u32(MBLOG_BINARY_VERSION);
+        buf.put_u32(0);
+
+        write(_fd, buf.data, buf.size);
+    }
+}
+
+BinaryLogger::~BinaryLogger()
+{
+    if (_owns_fd && _fd >= 0) {
+        close(_fd);
+    }
+}
+
+void BinaryLogger::log(LogLevel prio, const char *fmt, va_list ap)
+{
+    if (_fd < 0) {
+        return;
+    }
+
+    RecordBuf buf;
+    bool encoded = false;
+    uint64_t fmt_offset;
+
+    if (image_offset(fmt, fmt_offset)) {
+        va_list copy;
+        va_copy(copy, ap);
+
+        start_record(buf, prio, MBLOG_BINARY_RECORD_FORMAT);
+        buf.put_u64(fmt_offset);
+        size_t argc_offset = buf.size;
+        buf.put_u8(0);
+
+        encoded = encode_args(buf, argc_offset, fmt, copy);
+
+        va_end(copy);
+    }
+
+    if (!encoded) {
+        start_record(buf, prio, MBLOG_BINARY_RECORD_TEXT);
+
+        size_t avail = sizeof(buf.data) - buf.size;
+        int len = vsnprintf(reinterpret_cast<char *>(buf.data) + buf.size,
+                            avail, fmt, ap);
+        if (len < 0) {
+            return;
+        }
+
+        // Drop the NULL terminator (and anything that was truncated)
+        buf.size += std::min<size_t>(static_cast<size_t>(len), avail - 1);
+    }
+
+    uint32_t record_size = mb_htole32(
+            static_cast<uint32_t>(buf.size - sizeof(uint32_t)));
+    memcpy(buf.data, &record_size, sizeof(record_size));
+
+    write(_fd, buf.data, buf.size);
+}
+
+}
+}
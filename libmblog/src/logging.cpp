@@ -33,6 +33,11 @@ namespace log
 static std::string log_tag("mblog");
 static std::shared_ptr<BaseLogger> logger;
 
+namespace detail
+{
+std::atomic<LogLevel> g_log_level(LogLevel::Verbose);
+}
+
 const char * get_log_tag()
 {
     return log_tag.c_str();
@@ -48,6 +53,17 @@ void log_set_logger(std::shared_ptr<BaseLogger> logger_local)
     logger = std::move(logger_local);
 }
 
+LogLevel log_level()
+{
+    return detail::g_log_level.load(std::memory_order_relaxed);
+}
+
+// Messages less severe than level are discarded without being formatted
+void log_set_level(LogLevel level)
+{
+    detail::g_log_level.store(level, std::memory_order_relaxed);
+}
+
 void log(LogLevel prio, const char *fmt, ...)
 {
     va_list ap;
@@ -60,6 +76,11 @@ void log(LogLevel prio, const char *fmt, ...)
 
 void logv(LogLevel prio, const char *fmt, va_list ap)
 {
+    // Direct callers bypass the check in the LOG*() macros
+    if (!MBLOG_LEVEL_COMPILED(prio) || !log_level_enabled(prio)) {
+        return;
+    }
+
     int saved_errno = errno;
 
     if (!logger) {
@@ -71,5 +92,16 @@ void logv(LogLevel prio, const char *fmt, va_list ap)
     errno = saved_errno;
 }
 
+void log_flush()
+{
+    int saved_errno = errno;
+
+    if (logger) {
+        logger->flush();
+    }
+
+    errno = saved_errno;
+}
+
 }
 }
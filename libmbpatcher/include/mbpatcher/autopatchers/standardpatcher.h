@@ -54,9 +54,15 @@ public:
     virtual std::vector<std::string> existing_files() const override;
 
     virtual bool patch_files(const std::string &directory) override;
-
-    bool patch_updater(const std::string &directory);
-    bool patch_transfer_list(const std::string &directory);
+    virtual bool patch_file(const std::string &name,
+                            std::string *contents) override;
+    virtual bool patches_tokens(const std::string &name) const override;
+    virtual bool patch_tokens(const std::string &name,
+                              std::vector<EdifyToken *> *tokens) override;
+
+    bool patch_updater(std::string *contents);
+    bool patch_updater_tokens(std::vector<EdifyToken *> *tokens);
+    bool patch_transfer_list(std::string *contents);
 
 private:
     std::unique_ptr<StandardPatcherPrivate> _priv_ptr;
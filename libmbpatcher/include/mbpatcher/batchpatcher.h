@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "mbcommon/common.h"
+
+#include "mbpatcher/errors.h"
+#include "mbpatcher/fileinfo.h"
+
+
+namespace mb
+{
+namespace patcher
+{
+
+class PatcherConfig;
+
+class BatchPatcherPrivate;
+class MB_EXPORT BatchPatcher
+{
+    MB_DECLARE_PRIVATE(BatchPatcher)
+
+public:
+    enum class JobState
+    {
+        Pending,
+        Running,
+        Succeeded,
+        Failed,
+        Cancelled,
+    };
+
+    struct Stats
+    {
+        // Number of jobs in each final state
+        size_t succeeded;
+        size_t failed;
+        size_t cancelled;
+        // Sum of the progress values of all jobs
+        uint64_t bytes;
+        uint64_t max_bytes;
+        // Time since run() was called
+        uint64_t elapsed_ms;
+    };
+
+    typedef void (*JobProgressCallback) (size_t, uint64_t, uint64_t, void *);
+    typedef void (*JobFilesCallback) (size_t, uint64_t, uint64_t, void *);
+    typedef void (*JobDetailsCallback) (size_t, const std::string &, void *);
+    typedef void (*JobFinishedCallback) (size_t, JobState, ErrorCode, void *);
+
+    explicit BatchPatcher(PatcherConfig *pc);
+    ~BatchPatcher();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(BatchPatcher)
+
+    size_t add_job(const std::string &patcher_id, const FileInfo &info);
+
+    size_t job_count() const;
+    JobState job_state(size_t job) const;
+    ErrorCode job_error(size_t job) const;
+
+    Stats stats() const;
+
+    bool run(unsigned int max_concurrent,
+             JobProgressCallback progress_cb,
+             JobFilesCallback files_cb,
+             JobDetailsCallback details_cb,
+             JobFinishedCallback finished_cb,
+             void *userdata);
+
+    void cancel_job(size_t job);
+    void cancel_all();
+
+private:
+    std::unique_ptr<BatchPatcherPrivate> _priv_ptr;
+};
+
+}
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mbcommon/common.h"
+#include "mbpatcher/cwrapper/ctypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum BatchJobState
+{
+    BATCH_JOB_PENDING,
+    BATCH_JOB_RUNNING,
+    BATCH_JOB_SUCCEEDED,
+    BATCH_JOB_FAILED,
+    BATCH_JOB_CANCELLED,
+};
+
+struct CBatchStats
+{
+    size_t succeeded;
+    size_t failed;
+    size_t cancelled;
+    uint64_t bytes;
+    uint64_t max_bytes;
+    uint64_t elapsed_ms;
+};
+
+typedef void (*BatchProgressCallback) (size_t, uint64_t, uint64_t, void *);
+typedef void (*BatchFilesCallback) (size_t, uint64_t, uint64_t, void *);
+typedef void (*BatchDetailsCallback) (size_t, const char *, void *);
+typedef void (*BatchFinishedCallback) (size_t, /* enum BatchJobState */ int,
+                                       /* enum ErrorCode */ int, void *);
+
+MB_EXPORT CBatchPatcher * mbpatcher_batch_create(CPatcherConfig *pc);
+MB_EXPORT void mbpatcher_batch_destroy(CBatchPatcher *batch);
+
+MB_EXPORT size_t mbpatcher_batch_add_job(CBatchPatcher *batch,
+                                         const char *patcher_id,
+                                         const CFileInfo *info);
+
+MB_EXPORT size_t mbpatcher_batch_job_count(const CBatchPatcher *batch);
+MB_EXPORT /* enum BatchJobState */ int mbpatcher_batch_job_state(const CBatchPatcher *batch,
+                                                                 size_t job);
+MB_EXPORT /* enum ErrorCode */ int mbpatcher_batch_job_error(const CBatchPatcher *batch,
+                                                             size_t job);
+
+MB_EXPORT void mbpatcher_batch_stats(const CBatchPatcher *batch,
+                                     struct CBatchStats *stats);
+
+MB_EXPORT bool mbpatcher_batch_run(CBatchPatcher *batch,
+                                   unsigned int maxConcurrent,
+                                   BatchProgressCallback progressCb,
+                                   BatchFilesCallback filesCb,
+                                   BatchDetailsCallback detailsCb,
+                                   BatchFinishedCallback finishedCb,
+                                   void *userData);
+
+MB_EXPORT void mbpatcher_batch_cancel_job(CBatchPatcher *batch, size_t job);
+MB_EXPORT void mbpatcher_batch_cancel_all(CBatchPatcher *batch);
+
+#ifdef __cplusplus
+}
+#endif
@@ -34,6 +34,9 @@ typedef struct CPatcher CPatcher;
 struct CAutoPatcher;
 typedef struct CAutoPatcher CAutoPatcher;
 
+struct CBatchPatcher;
+typedef struct CBatchPatcher CBatchPatcher;
+
 #ifdef __cplusplus
 }
 #endif
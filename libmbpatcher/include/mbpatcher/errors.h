@@ -58,6 +58,7 @@ enum ErrorCode
     ArchiveWriteHeaderError = 212,
     ArchiveCloseError = 220,
     ArchiveFreeError = 221,
+    ArchiveChecksumMismatch = 230,
 
     // Cancelled
     PatchingCancelled = 300,
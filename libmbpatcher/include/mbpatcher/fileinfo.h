@@ -20,6 +20,7 @@
 #pragma once
 
 #include <memory>
+#include <string>
 
 #include "mbcommon/common.h"
 #include "mbdevice/device.h"
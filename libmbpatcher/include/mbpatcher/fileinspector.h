@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+#include "mbcommon/common.h"
+#include "mbdevice/device.h"
+
+#include "mbpatcher/errors.h"
+
+
+namespace mb
+{
+namespace patcher
+{
+
+enum class FileFormat
+{
+    Unknown,
+    Zip,
+    Tar,
+    Gzip,
+    Xz,
+};
+
+struct FileInspection
+{
+    FileFormat format = FileFormat::Unknown;
+    // Zip files only
+    uint64_t entries = 0;
+    uint64_t uncompressed_size = 0;
+    bool has_updater_script = false;
+    // Codenames that the updater-script asserts the device to be
+    std::vector<std::string> devices;
+};
+
+typedef bool (*InspectCancelledCallback)(void *userdata);
+
+MB_EXPORT ErrorCode inspect_file(const std::string &path,
+                                 FileInspection &inspection,
+                                 InspectCancelledCallback cancelled_cb
+                                         = nullptr,
+                                 void *userdata = nullptr);
+
+MB_EXPORT bool inspection_matches_device(const FileInspection &inspection,
+                                         Device *device);
+
+}
+}
@@ -49,9 +49,17 @@ public:
 
     std::string data_directory() const;
     std::string temp_directory() const;
+    std::string cache_directory() const;
 
     void set_data_directory(std::string path);
     void set_temp_directory(std::string path);
+    void set_cache_directory(std::string path);
+
+    unsigned int progress_update_rate() const;
+    void set_progress_update_rate(unsigned int rate_hz);
+
+    bool in_memory_output() const;
+    void set_in_memory_output(bool enabled);
 
     std::vector<std::string> patchers() const;
     std::vector<std::string> auto_patchers() const;
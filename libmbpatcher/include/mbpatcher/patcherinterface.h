@@ -19,6 +19,11 @@
 
 #pragma once
 
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
 #include "mbcommon/common.h"
 
 #include "mbpatcher/errors.h"
@@ -30,6 +35,8 @@ namespace mb
 namespace patcher
 {
 
+class EdifyToken;
+
 /*!
  * \class Patcher
  * \brief Handles the patching of zip files and boot images
@@ -45,6 +52,13 @@ public:
     typedef void (*FilesUpdatedCallback) (uint64_t, uint64_t, void *);
     typedef void (*DetailsUpdatedCallback) (const std::string &, void *);
 
+    /*! \brief Time spent in one phase of a patching operation */
+    struct PhaseTime
+    {
+        std::string name;
+        uint64_t elapsed_us;
+    };
+
     virtual ~Patcher() {}
 
     /*!
@@ -89,6 +103,19 @@ public:
      * useful if the patching operation is being done on a thread.
      */
     virtual void cancel_patching() = 0;
+
+    /*!
+     * \brief Time spent in each phase of the last patching operation
+     *
+     * The phases are listed in the order in which they first completed. A
+     * phase that is entered multiple times (eg. once per file) is reported
+     * once with the total time. Patchers that do not record timings return an
+     * empty list.
+     */
+    virtual std::vector<PhaseTime> phase_times() const
+    {
+        return {};
+    }
 };
 
 
@@ -140,6 +167,46 @@ public:
      * \param directory Directory containing the files to be patched
      */
     virtual bool patch_files(const std::string &directory) = 0;
+
+    /*!
+     * \brief Patch a file in memory
+     *
+     * \param name Path of the file in the zip file (one of existing_files())
+     * \param contents Contents of the file, which will be modified in place
+     */
+    virtual bool patch_file(const std::string &name,
+                            std::string *contents) = 0;
+
+    /*!
+     * \brief Whether a file can be patched as edify tokens
+     *
+     * AutoPatchers that edit edify scripts can return true here and implement
+     * patch_tokens() so that consecutive AutoPatchers share a single tokenized
+     * copy of the script instead of each tokenizing and untokenizing it.
+     *
+     * \param name Path of the file in the zip file (one of existing_files())
+     */
+    virtual bool patches_tokens(const std::string &name) const
+    {
+        (void) name;
+        return false;
+    }
+
+    /*!
+     * \brief Patch a tokenized edify script in memory
+     *
+     * Only called if patches_tokens() returns true for \p name.
+     *
+     * \param name Path of the file in the zip file (one of existing_files())
+     * \param tokens Tokens of the script, which will be modified in place
+     */
+    virtual bool patch_tokens(const std::string &name,
+                              std::vector<EdifyToken *> *tokens)
+    {
+        (void) name;
+        (void) tokens;
+        return false;
+    }
 };
 
 }
@@ -56,6 +56,8 @@ public:
 
     virtual void cancel_patching() override;
 
+    virtual std::vector<PhaseTime> phase_times() const override;
+
 private:
     std::unique_ptr<OdinPatcherPrivate> _priv_ptr;
 };
@@ -56,6 +56,8 @@ public:
 
     virtual void cancel_patching() override;
 
+    virtual std::vector<PhaseTime> phase_times() const override;
+
     static std::string create_info_prop(const PatcherConfig * const pc,
                                         const std::string &rom_id,
                                         bool always_patch_ramdisk);
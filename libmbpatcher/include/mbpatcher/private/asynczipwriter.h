@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "minizip/zip.h"
+
+#include "mbcommon/common.h"
+
+
+namespace mb
+{
+namespace patcher
+{
+
+/*!
+ * \brief Write data for the current zip entry on a background thread
+ *
+ * The producer fills blocks obtained from get_buffer() and hands them off with
+ * commit(). A writer thread passes them to zipWriteInFileInZip() in order, so
+ * deflating and writing the output overlaps with producing the next block.
+ * If the thread cannot be started, data is written synchronously by commit().
+ *
+ * The zip file must not be accessed by anything else between start() and
+ * finish().
+ */
+class AsyncZipWriter
+{
+public:
+    AsyncZipWriter(zipFile zf, size_t block_size, size_t block_count);
+    ~AsyncZipWriter();
+
+    void start();
+    bool finish();
+
+    bool get_buffer(void **buffer, size_t *size);
+    bool commit(size_t size);
+
+    int error() const;
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(AsyncZipWriter)
+
+private:
+    struct Block
+    {
+        std::unique_ptr<unsigned char[]> data;
+        size_t size;
+    };
+
+    zipFile _zf;
+    size_t _block_size;
+    std::vector<Block> _blocks;
+
+    std::thread _thread;
+    bool _threaded;
+
+    mutable std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<size_t> _free;
+    std::deque<size_t> _filled;
+    // Block currently handed out to the producer
+    size_t _current;
+    bool _finishing;
+    int _error;
+
+    void writer();
+};
+
+}
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "mbcommon/common.h"
+
+#include "mbpatcher/errors.h"
+#include "mbpatcher/patcherinterface.h"
+
+
+namespace mb
+{
+namespace patcher
+{
+
+/*!
+ * \brief Run a sequence of AutoPatchers over a file held in memory
+ *
+ * The AutoPatchers listing the file in AutoPatcher::existing_files() are run in
+ * order on the same contents. Consecutive AutoPatchers that support patching
+ * the file as edify tokens (see AutoPatcher::patches_tokens()) share a single
+ * token stream, so an edify script is tokenized and untokenized once instead of
+ * once per AutoPatcher. The contents are only converted back to a string when
+ * a string-based AutoPatcher needs them or when all AutoPatchers have run.
+ */
+class AutoPatcherPipeline
+{
+public:
+    explicit AutoPatcherPipeline(const std::vector<AutoPatcher *> &patchers);
+
+    bool run(const std::string &name, std::string *contents);
+
+    ErrorCode error() const;
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(AutoPatcherPipeline)
+
+private:
+    const std::vector<AutoPatcher *> &_patchers;
+    ErrorCode _error;
+};
+
+}
+}
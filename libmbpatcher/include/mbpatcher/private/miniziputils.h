@@ -30,6 +30,8 @@
 
 namespace mb
 {
+class File;
+
 namespace patcher
 {
 
@@ -54,7 +56,9 @@ public:
 
     static UnzCtx * open_input_file(std::string path);
 
-    static ZipCtx * open_output_file(std::string path);
+    static ZipCtx * open_output_file(std::string path, bool append = false);
+
+    static ZipCtx * open_output_file(File &file);
 
     static int close_input_file(UnzCtx *ctx);
 
@@ -74,10 +78,15 @@ public:
                               void (*cb)(uint64_t bytes, void *),
                               void *userData);
 
-    static bool read_to_memory(unzFile uf,
-                               std::vector<unsigned char> *output,
-                               void (*cb)(uint64_t bytes, void *),
-                               void *userData);
+    typedef bool (*ReadWindowCb)(const void *data, size_t size,
+                                 void *userdata);
+
+    static bool read_to_string(unzFile uf,
+                               uint64_t budget,
+                               std::string *output,
+                               bool *streamed,
+                               ReadWindowCb window_cb,
+                               void *userdata);
 
     static bool extract_file(unzFile uf,
                              const std::string &directory);
@@ -89,6 +98,8 @@ public:
     static ErrorCode add_file(zipFile zf,
                               const std::string &name,
                               const std::string &path);
+
+    static bool get_file_time(const std::string &filename, uint32_t *dostime);
 };
 
 }
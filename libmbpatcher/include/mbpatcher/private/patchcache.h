@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <string>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "mbpatcher/errors.h"
+
+
+namespace mb
+{
+namespace patcher
+{
+
+/*!
+ * \brief Incrementally computed patch cache key
+ *
+ * The key is a 128-bit FNV-1a digest of everything added to it. Strings are
+ * length-prefixed so that adjacent fields cannot run into each other.
+ */
+class PatchCacheKey
+{
+public:
+    PatchCacheKey();
+
+    void add(const void *data, size_t size);
+    void add(const std::string &str);
+    void add(uint64_t value);
+    ErrorCode add_file(const std::string &path);
+
+    std::string hex() const;
+
+private:
+    uint64_t _hi;
+    uint64_t _lo;
+};
+
+/*!
+ * \brief Content-addressed store for patched files
+ *
+ * Complete patched outputs and individual patched zip entries are stored in
+ * separate subdirectories of the cache directory. Files are written to a
+ * temporary name first and renamed into place, so concurrent patchers sharing
+ * a cache never see partially written entries.
+ */
+class PatchCache
+{
+public:
+    explicit PatchCache(std::string directory);
+
+    bool enabled() const;
+
+    bool get_output(const std::string &key, const std::string &path) const;
+    bool put_output(const std::string &key, const std::string &path) const;
+
+    bool get_entry(const std::string &key, std::string *contents) const;
+    bool put_entry(const std::string &key, const std::string &contents) const;
+
+private:
+    std::string _directory;
+
+    std::string path_for(const char *type, const std::string &key) const;
+    bool store(const std::string &target, const std::string &source_path,
+               const std::string *contents) const;
+
+    static bool exists(const std::string &path);
+    static bool copy_file(const std::string &source, const std::string &target);
+};
+
+}
+}
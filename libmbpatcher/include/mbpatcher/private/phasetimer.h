@@ -17,46 +17,45 @@
  * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "archive_util.h"
+#pragma once
 
-#include <cerrno>
-#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
 
-#include "mblog/logging.h"
+#include "mbcommon/common.h"
+
+#include "mbpatcher/patcherinterface.h"
 
-#define BUF_SIZE    10240
 
 namespace mb
 {
+namespace patcher
+{
 
-bool la_copy_data_to_fd(archive *a, int fd)
+/*!
+ * \brief Measure the time spent in a patching phase
+ *
+ * The elapsed time is added to the phase named \p name in \p times when the
+ * timer is stopped or destroyed. If the phase is not in the list yet, it is
+ * appended.
+ */
+class PhaseTimer
 {
-    char buf[BUF_SIZE];
-    la_ssize_t n_read;
-    ssize_t n_written;
-    la_ssize_t remain;
-
-    while ((n_read = archive_read_data(a, buf, sizeof(buf))) > 0) {
-        remain = n_read;
-
-        while (remain > 0) {
-            n_written = write(fd, buf + (n_read - remain), remain);
-            if (n_written <= 0) {
-                LOGE("Failed to write data: %s", strerror(errno));
-                return false;
-            }
-
-            remain -= n_written;
-        }
-    }
-
-    if (n_read < 0) {
-        LOGE("Failed to read archive entry data: %s",
-             archive_error_string(a));
-        return false;
-    }
-
-    return true;
-}
+public:
+    PhaseTimer(std::vector<Patcher::PhaseTime> &times, std::string name);
+    ~PhaseTimer();
 
+    void stop();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(PhaseTimer)
+
+private:
+    std::vector<Patcher::PhaseTime> &_times;
+    std::string _name;
+    std::chrono::steady_clock::time_point _start;
+    bool _running;
+};
+
+}
 }
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <atomic>
+
+#include <cstdint>
+
+#include "mbcommon/common.h"
+
+#include "mbpatcher/patcherinterface.h"
+
+
+namespace mb
+{
+namespace patcher
+{
+
+/*!
+ * \brief Rate-limited progress reporting for patchers
+ *
+ * Patchers update the byte and file counters as often as they like (eg. for
+ * every buffer that is read or written). The counters are atomic and can be
+ * updated from any thread. The user callbacks are invoked at most once per
+ * sampling interval and only if a counter changed since it was last
+ * reported, so the cost of progress reporting no longer scales with the
+ * number of buffers processed.
+ */
+class ProgressReporter
+{
+public:
+    ProgressReporter();
+
+    void start(Patcher::ProgressUpdatedCallback progress_cb,
+               Patcher::FilesUpdatedCallback files_cb,
+               void *userdata, unsigned int rate_hz);
+    void finish();
+
+    void set_bytes(uint64_t bytes, uint64_t max_bytes);
+    void set_files(uint64_t files, uint64_t max_files);
+
+    void flush();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(ProgressReporter)
+
+private:
+    Patcher::ProgressUpdatedCallback _progress_cb;
+    Patcher::FilesUpdatedCallback _files_cb;
+    void *_userdata;
+    int64_t _interval_ns;
+
+    std::atomic<uint64_t> _bytes;
+    std::atomic<uint64_t> _max_bytes;
+    std::atomic<uint64_t> _files;
+    std::atomic<uint64_t> _max_files;
+
+    // Earliest time (steady clock) at which the next sample may be reported
+    std::atomic<int64_t> _next_sample_ns;
+    // Held by the thread currently invoking the callbacks
+    std::atomic_flag _reporting;
+
+    // Last reported values. Only accessed while _reporting is held.
+    uint64_t _reported_bytes;
+    uint64_t _reported_max_bytes;
+    uint64_t _reported_files;
+    uint64_t _reported_max_files;
+
+    void sample(bool force);
+};
+
+}
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mbcommon/common.h"
+#include "mbcommon/file.h"
+
+#include "mbpatcher/errors.h"
+
+
+namespace mb
+{
+namespace patcher
+{
+
+/*!
+ * \brief Read a file sequentially on a background thread
+ *
+ * A reader thread fills a ring of fixed-size blocks ahead of the consumer so
+ * that file I/O overlaps with whatever the consumer does with the data (eg.
+ * parsing with libarchive). If the thread cannot be started, reads are done
+ * synchronously on the calling thread.
+ *
+ * The file must not be accessed by anything else between start() and stop().
+ */
+class ReadaheadFile
+{
+public:
+    ReadaheadFile(File &file, size_t block_size, size_t block_count);
+    ~ReadaheadFile();
+
+    void start();
+    void stop();
+
+    bool read(const void **buffer, size_t *size);
+    bool skip(uint64_t size);
+
+    ErrorCode error() const;
+    std::string error_string() const;
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(ReadaheadFile)
+
+private:
+    struct Block
+    {
+        std::unique_ptr<unsigned char[]> data;
+        size_t offset;
+        size_t size;
+    };
+
+    File &_file;
+    size_t _block_size;
+    std::vector<Block> _blocks;
+
+    std::thread _thread;
+    bool _threaded;
+
+    mutable std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<size_t> _free;
+    std::deque<size_t> _filled;
+    // Block currently handed out to the consumer
+    size_t _current;
+    // Bytes to skip before the next block read by the reader thread
+    uint64_t _skip_pending;
+    bool _eof;
+    bool _stop;
+    ErrorCode _error;
+    std::string _error_string;
+
+    void reader();
+    void release_current();
+};
+
+}
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <cstddef>
+
+#include <openssl/md5.h>
+
+#include "mbcommon/common.h"
+
+
+namespace mb
+{
+namespace patcher
+{
+
+/*!
+ * \brief Verify the MD5 trailer of a Samsung `.tar.md5` file while it is read
+ *
+ * A `.tar.md5` file is a tarball followed by a line of the form
+ * `<md5sum>  <filename>\n`, where the checksum covers everything before that
+ * line. Data is fed to update() as it is read and hashed immediately, except
+ * for the last TRAILER_MAX_SIZE bytes, which are held back until finish()
+ * knows where the trailer starts.
+ */
+class TarMd5Verifier
+{
+public:
+    enum class Result
+    {
+        Match,
+        Mismatch,
+        NoTrailer,
+    };
+
+    TarMd5Verifier();
+
+    void update(const void *data, size_t size);
+    Result finish();
+
+    const std::string & expected() const;
+    const std::string & actual() const;
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(TarMd5Verifier)
+
+private:
+    MD5_CTX _ctx;
+    std::vector<unsigned char> _tail;
+    std::string _expected;
+    std::string _actual;
+};
+
+}
+}
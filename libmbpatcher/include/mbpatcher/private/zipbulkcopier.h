@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "mbcommon/file/standard.h"
+
+#include "mbpatcher/errors.h"
+
+
+namespace mb
+{
+namespace patcher
+{
+
+/*!
+ * \brief Copy zip entries without going through minizip
+ *
+ * The input central directory is parsed once and runs of consecutive entries
+ * selected by the filter callback are copied as single blocks (local headers,
+ * data, and data descriptors included). A new central directory with adjusted
+ * local header offsets is then written, so the output is a complete zip that
+ * minizip can open in append mode to add the remaining entries.
+ *
+ * The parsed central directory is also exposed through entries() so callers
+ * can compute totals without scanning the archive a second time.
+ */
+class ZipBulkCopier
+{
+public:
+    typedef bool (*FilterCb)(const std::string &name, void *userdata);
+    typedef bool (*CopiedCb)(const std::string &name,
+                             uint64_t uncompressed_size, void *userdata);
+
+    struct Entry
+    {
+        std::string name;
+        uint64_t local_offset;
+        uint64_t uncompressed_size;
+        // Location of the raw record in the central directory buffer
+        size_t record_offset;
+        size_t record_size;
+        // Location of the local header offset within the record (4 or 8 bytes)
+        size_t offset_field;
+        size_t offset_field_size;
+        // End of the entry's local data (start of the next entry)
+        uint64_t end_offset;
+        bool copy;
+    };
+
+    ErrorCode open(const std::string &input_path, bool *unsupported);
+
+    const std::vector<Entry> & entries() const;
+    const std::vector<unsigned char> & central_directory() const;
+
+    ErrorCode copy(const std::string &output_path, FilterCb filter_cb,
+                   CopiedCb copied_cb, void *userdata);
+
+private:
+    std::string _input_path;
+    StandardFile _input;
+    std::vector<unsigned char> _cd;
+    std::vector<unsigned char> _comment;
+    uint64_t _cd_offset;
+    std::vector<Entry> _entries;
+    // Entries in file order
+    std::vector<Entry *> _sorted;
+};
+
+}
+}
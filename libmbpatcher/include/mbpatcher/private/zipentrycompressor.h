@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "minizip/zip.h"
+
+#include "mbcommon/common.h"
+#include "mbcommon/thread_pool.h"
+
+#include "mbpatcher/errors.h"
+
+
+namespace mb
+{
+namespace patcher
+{
+
+/*!
+ * \brief Deflate zip entries concurrently
+ *
+ * Entries are queued with add_file() and compressed into memory buffers by a
+ * pool of worker threads. write() appends the finished entries to the output
+ * zip in the order they were queued. Each entry is compressed in one piece
+ * with fixed zlib parameters, so the output is identical regardless of the
+ * number of threads.
+ *
+ * Files queued with add_cached_file() are compressed once per process. Later
+ * uses of the same unchanged file copy the compressed data from the cache.
+ */
+class ZipEntryCompressor
+{
+public:
+    typedef bool (*WrittenCb)(const std::string &name, void *userdata);
+
+    explicit ZipEntryCompressor(unsigned int threads = 0);
+    ~ZipEntryCompressor();
+
+    void add_file(const std::string &name, std::vector<unsigned char> contents);
+    void add_file(const std::string &name, const std::string &path);
+    void add_cached_file(const std::string &name, const std::string &path);
+
+    static void clear_cache();
+
+    ErrorCode write(zipFile zf, WrittenCb cb, void *userdata);
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(ZipEntryCompressor)
+
+private:
+    struct CachedFile
+    {
+        std::vector<unsigned char> compressed;
+        uint64_t uncompressed_size;
+        uint32_t crc;
+        uint32_t dos_date;
+    };
+
+    struct Entry
+    {
+        std::string name;
+        // Input file, if the contents should be read from disk
+        std::string path;
+        std::vector<unsigned char> contents;
+        uint32_t dos_date;
+        // Whether the compressed file should be shared through the cache
+        bool cache;
+
+        std::vector<unsigned char> compressed;
+        // Used instead of compressed if the entry came from the cache
+        std::shared_ptr<const CachedFile> cached;
+        uint64_t uncompressed_size;
+        uint32_t crc;
+        ErrorCode error;
+        bool done;
+    };
+
+    unsigned int _threads;
+    std::vector<std::unique_ptr<Entry>> _entries;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    // Index of the next entry to compress
+    size_t _next;
+    bool _stop;
+
+    void worker();
+    bool compress_next(std::unique_lock<std::mutex> &lock);
+    void stop_workers(TaskGroup &workers);
+
+    static ErrorCode compress(Entry &entry);
+    static ErrorCode write_entry(zipFile zf, const Entry &entry);
+
+    static std::mutex & cache_mutex();
+    static std::unordered_map<std::string, std::shared_ptr<const CachedFile>> &
+    cache();
+};
+
+}
+}
@@ -88,16 +88,9 @@ static bool space_or_end(const char *ptr)
     return !*ptr || isspace(*ptr);
 }
 
-static bool patch_file(const std::string &path)
+static void patch_mount_cmds(std::string *contents)
 {
-    std::string contents;
-
-    ErrorCode ret = FileUtils::read_to_string(path, &contents);
-    if (ret != ErrorCode::NoError) {
-        return false;
-    }
-
-    std::vector<std::string> lines = StringUtils::split(contents, '\n');
+    std::vector<std::string> lines = StringUtils::split(*contents, '\n');
 
     for (std::string &line : lines) {
         const char *ptr = line.data();
@@ -111,20 +104,37 @@ static bool patch_file(const std::string &path)
         }
     }
 
-    contents = StringUtils::join(lines, "\n");
-    FileUtils::write_from_string(path, contents);
-
-    return true;
+    *contents = StringUtils::join(lines, "\n");
 }
 
 bool MountCmdPatcher::patch_files(const std::string &directory)
 {
-    patch_file(directory + "/" + FlashScript);
-    patch_file(directory + "/" + InstallerScript);
+    for (auto const &name : existing_files()) {
+        std::string path(directory);
+        path += "/";
+        path += name;
+
+        std::string contents;
+
+        if (FileUtils::read_to_string(path, &contents) == ErrorCode::NoError) {
+            patch_mount_cmds(&contents);
+            FileUtils::write_from_string(path, contents);
+        }
+    }
 
     // Don't fail if an error occurs
     return true;
 }
 
+bool MountCmdPatcher::patch_file(const std::string &name,
+                                 std::string *contents)
+{
+    (void) name;
+
+    patch_mount_cmds(contents);
+
+    return true;
+}
+
 }
 }
@@ -19,14 +19,16 @@
 
 #include "mbpatcher/autopatchers/standardpatcher.h"
 
+#include <cerrno>
+#include <cstdio>
 #include <cstring>
 
+#include "mbcommon/file_util.h"
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
 
 #include "mbpatcher/edify/tokenizer.h"
 #include "mbpatcher/private/fileutils.h"
-#include "mbpatcher/private/stringutils.h"
 
 #define DUMP_DEBUG 0
 
@@ -62,6 +64,12 @@ static constexpr char UNMOUNT_FMT[] =
 static constexpr char FORMAT_FMT[] =
         "(run_program(\"/update-binary-tool\", \"format\", \"%s\") == 0)";
 
+static constexpr char TRANSFER_LIST_ERASE[] = "erase ";
+static constexpr size_t TRANSFER_LIST_ERASE_LEN =
+        sizeof(TRANSFER_LIST_ERASE) - 1;
+
+static constexpr size_t TRANSFER_LIST_BUF_SIZE = 64 * 1024;
+
 
 StandardPatcher::StandardPatcher(const PatcherConfig * const pc,
                                  const FileInfo * const info)
@@ -182,21 +190,51 @@ static bool find_function(const std::vector<EdifyToken *>::iterator begin,
     return false;
 }
 
+/*!
+ * \brief Token list being rewritten
+ *
+ * Instead of splicing replacements into the original list, which shifts every
+ * following token, the tokens are moved to a new list as the script is
+ * scanned. This keeps each patching pass linear in the number of tokens.
+ */
+struct EdifyEditor
+{
+    // Original tokens. Tokens in [begin, copied) have been moved to output or
+    // deallocated.
+    std::vector<EdifyToken *> *tokens;
+    std::vector<EdifyToken *>::iterator copied;
+    std::vector<EdifyToken *> output;
+
+    explicit EdifyEditor(std::vector<EdifyToken *> *tokens_)
+        : tokens(tokens_), copied(tokens_->begin())
+    {
+        output.reserve(tokens->size());
+    }
+
+    // Move the remaining tokens to the output and replace the original list
+    void finish()
+    {
+        output.insert(output.end(), copied, tokens->end());
+        tokens->swap(output);
+        output.clear();
+    }
+};
+
 /*!
  * \brief Replace edify function
  *
- * \param tokens List of edify tokens
+ * \param editor Token list being rewritten
  * \param func_name Function name token of the replaced function
  * \param left_paren Left parenthesis token of the replaced function
  * \param right_paren Right parenthesis token of the replaced function
  * \param replacement Replacement edify function (in string form)
  *
- * \return New iterator pointing to position *after* the right parenthesis of
- *         the replaced function. Returns tokens->end() if the replacement
- *         string could not be tokenized.
+ * \return Iterator pointing to position *after* the right parenthesis of
+ *         the replaced function. Returns editor->tokens->end() if the
+ *         replacement string could not be tokenized.
  */
 static std::vector<EdifyToken *>::iterator
-replace_function(std::vector<EdifyToken *> *tokens,
+replace_function(EdifyEditor *editor,
                  std::vector<EdifyToken *>::iterator func_name,
                  std::vector<EdifyToken *>::iterator left_paren,
                  std::vector<EdifyToken *>::iterator right_paren,
@@ -211,33 +249,31 @@ replace_function(std::vector<EdifyToken *> *tokens,
     if (!result) {
         LOGE("Failed to tokenize replacement function string: %s",
              replacement.c_str());
-        return tokens->end();
+        return editor->tokens->end();
     }
 
+    // Move unchanged tokens preceding the function
+    editor->output.insert(editor->output.end(), editor->copied, func_name);
+
     // Deallocate replaced tokens
     for (auto it = func_name; it != right_paren; ++it) {
         delete *it;
     }
     delete *right_paren;
 
-    // Remove replaced tokens
-    auto it = tokens->erase(func_name, right_paren);
-    it = tokens->erase(it);
-
     // Add replacement tokens
-    it = tokens->insert(it, replacement_tokens.begin(),
-                        replacement_tokens.end());
+    editor->output.insert(editor->output.end(), replacement_tokens.begin(),
+                          replacement_tokens.end());
 
-    // Move iterator to the end of the replaced tokens
-    it += replacement_tokens.size();
+    editor->copied = right_paren + 1;
 
-    return it;
+    return editor->copied;
 }
 
 /*!
  * \brief Replace edify mount() command
  *
- * \param tokens List of edify tokens
+ * \param editor Token list being rewritten
  * \param func_name Function name token
  * \param left_paren Left parenthesis token
  * \param right_paren Right parenthesis token
@@ -248,7 +284,7 @@ replace_function(std::vector<EdifyToken *> *tokens,
  * \return Iterator pointing to position immediately after the right parenthesis
  */
 static std::vector<EdifyToken *>::iterator
-replace_edify_mount(std::vector<EdifyToken *> *tokens,
+replace_edify_mount(EdifyEditor *editor,
                     const std::vector<EdifyToken *>::iterator func_name,
                     const std::vector<EdifyToken *>::iterator left_paren,
                     const std::vector<EdifyToken *>::iterator right_paren,
@@ -275,13 +311,13 @@ replace_edify_mount(std::vector<EdifyToken *> *tokens,
                 || find_items_in_string(str.c_str(), data_devs);
 
         if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(editor, func_name, left_paren, right_paren,
                                     format(MOUNT_FMT, "/system"));
         } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(editor, func_name, left_paren, right_paren,
                                     format(MOUNT_FMT, "/cache"));
         } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(editor, func_name, left_paren, right_paren,
                                     format(MOUNT_FMT, "/data"));
         }
     }
@@ -291,7 +327,7 @@ replace_edify_mount(std::vector<EdifyToken *> *tokens,
 /*!
  * \brief Replace edify unmount() command
  *
- * \param tokens List of edify tokens
+ * \param editor Token list being rewritten
  * \param func_name Function name token
  * \param left_paren Left parenthesis token
  * \param right_paren Right parenthesis token
@@ -302,7 +338,7 @@ replace_edify_mount(std::vector<EdifyToken *> *tokens,
  * \return Iterator pointing to position immediately after the right parenthesis
  */
 static std::vector<EdifyToken *>::iterator
-replace_edify_unmount(std::vector<EdifyToken *> *tokens,
+replace_edify_unmount(EdifyEditor *editor,
                       const std::vector<EdifyToken *>::iterator func_name,
                       const std::vector<EdifyToken *>::iterator left_paren,
                       const std::vector<EdifyToken *>::iterator right_paren,
@@ -329,13 +365,13 @@ replace_edify_unmount(std::vector<EdifyToken *> *tokens,
                 || find_items_in_string(str.c_str(), data_devs);
 
         if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(editor, func_name, left_paren, right_paren,
                                     format(UNMOUNT_FMT, "/system"));
         } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(editor, func_name, left_paren, right_paren,
                                     format(UNMOUNT_FMT, "/cache"));
         } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(editor, func_name, left_paren, right_paren,
                                     format(UNMOUNT_FMT, "/data"));
         }
     }
@@ -345,7 +381,7 @@ replace_edify_unmount(std::vector<EdifyToken *> *tokens,
 /*!
  * \brief Replace edify run_program() command
  *
- * \param tokens List of edify tokens
+ * \param editor Token list being rewritten
  * \param func_name Function name token
  * \param left_paren Left parenthesis token
  * \param right_paren Right parenthesis token
@@ -356,7 +392,7 @@ replace_edify_unmount(std::vector<EdifyToken *> *tokens,
  * \return Iterator pointing to position immediately after the right parenthesis
  */
 static std::vector<EdifyToken *>::iterator
-replace_edify_run_program(std::vector<EdifyToken *> *tokens,
+replace_edify_run_program(EdifyEditor *editor,
                           const std::vector<EdifyToken *>::iterator func_name,
                           const std::vector<EdifyToken *>::iterator left_paren,
                           const std::vector<EdifyToken *>::iterator right_paren,
@@ -413,42 +449,42 @@ replace_edify_run_program(std::vector<EdifyToken *> *tokens,
     }
 
     if (found_reboot) {
-        return replace_function(tokens, func_name, left_paren, right_paren,
+        return replace_function(editor, func_name, left_paren, right_paren,
                                 "(ui_print(\"Removed reboot command\") == 0)");
     } else if (found_umount) {
         if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(editor, func_name, left_paren, right_paren,
                                     format(UNMOUNT_FMT, "/system"));
         } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(editor, func_name, left_paren, right_paren,
                                     format(UNMOUNT_FMT, "/cache"));
         } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(editor, func_name, left_paren, right_paren,
                                     format(UNMOUNT_FMT, "/data"));
         }
     } else if (found_mount) {
         if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(editor, func_name, left_paren, right_paren,
                                     format(MOUNT_FMT, "/system"));
         } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(editor, func_name, left_paren, right_paren,
                                     format(MOUNT_FMT, "/cache"));
         } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(editor, func_name, left_paren, right_paren,
                                     format(MOUNT_FMT, "/data"));
         }
     } else if (found_format_sh) {
-        return replace_function(tokens, func_name, left_paren, right_paren,
+        return replace_function(editor, func_name, left_paren, right_paren,
                                 format(FORMAT_FMT, "/system"));
     } else if (found_mke2fs) {
         if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(editor, func_name, left_paren, right_paren,
                                     format(FORMAT_FMT, "/system"));
         } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(editor, func_name, left_paren, right_paren,
                                     format(FORMAT_FMT, "/cache"));
         } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(editor, func_name, left_paren, right_paren,
                                     format(FORMAT_FMT, "/data"));
         }
     }
@@ -459,7 +495,7 @@ replace_edify_run_program(std::vector<EdifyToken *> *tokens,
 /*!
  * \brief Replace edify delete_recursive() command
  *
- * \param tokens List of edify tokens
+ * \param editor Token list being rewritten
  * \param func_name Function name token
  * \param left_paren Left parenthesis token
  * \param right_paren Right parenthesis token
@@ -467,7 +503,7 @@ replace_edify_run_program(std::vector<EdifyToken *> *tokens,
  * \return Iterator pointing to position immediately after the right parenthesis
  */
 static std::vector<EdifyToken *>::iterator
-replace_edify_delete_recursive(std::vector<EdifyToken *> *tokens,
+replace_edify_delete_recursive(EdifyEditor *editor,
                                const std::vector<EdifyToken *>::iterator func_name,
                                const std::vector<EdifyToken *>::iterator left_paren,
                                const std::vector<EdifyToken *>::iterator right_paren)
@@ -481,10 +517,10 @@ replace_edify_delete_recursive(std::vector<EdifyToken *> *tokens,
         const std::string unescaped = token->unescaped_string();
 
         if (unescaped == "/system" || unescaped == "/system/") {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(editor, func_name, left_paren, right_paren,
                                     format(FORMAT_FMT, "/system"));
         } else if (unescaped == "/cache" || unescaped == "/cache/") {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(editor, func_name, left_paren, right_paren,
                                     format(FORMAT_FMT, "/cache"));
         }
     }
@@ -494,7 +530,7 @@ replace_edify_delete_recursive(std::vector<EdifyToken *> *tokens,
 /*!
  * \brief Replace edify format() command
  *
- * \param tokens List of edify tokens
+ * \param editor Token list being rewritten
  * \param func_name Function name token
  * \param left_paren Left parenthesis token
  * \param right_paren Right parenthesis token
@@ -505,7 +541,7 @@ replace_edify_delete_recursive(std::vector<EdifyToken *> *tokens,
  * \return Iterator pointing to position immediately after the right parenthesis
  */
 static std::vector<EdifyToken *>::iterator
-replace_edify_format(std::vector<EdifyToken *> *tokens,
+replace_edify_format(EdifyEditor *editor,
                      const std::vector<EdifyToken *>::iterator func_name,
                      const std::vector<EdifyToken *>::iterator left_paren,
                      const std::vector<EdifyToken *>::iterator right_paren,
@@ -532,60 +568,300 @@ replace_edify_format(std::vector<EdifyToken *> *tokens,
                 || find_items_in_string(str.c_str(), data_devs);
 
         if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(editor, func_name, left_paren, right_paren,
                                     format(FORMAT_FMT, "/system"));
         } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(editor, func_name, left_paren, right_paren,
                                     format(FORMAT_FMT, "/cache"));
         } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(editor, func_name, left_paren, right_paren,
                                     format(FORMAT_FMT, "/data"));
         }
     }
     return right_paren + 1;
 }
 
-bool StandardPatcher::patch_files(const std::string &directory)
+/*!
+ * \brief Line-oriented transfer list filter
+ *
+ * Removes all `erase` commands from a block-based OTA transfer list. Only the
+ * first few bytes of each line are buffered, so the input can be fed in
+ * arbitrarily sized chunks without ever holding a complete line or file in
+ * memory. The output is identical to splitting the input on newlines,
+ * dropping the `erase` lines, and joining the remaining lines back together.
+ */
+class TransferListFilter
+{
+public:
+    TransferListFilter()
+        : _state(State::Undecided)
+        , _prefix_size(0)
+        , _kept_line(false)
+    {
+    }
+
+    void feed(const char *data, size_t size, std::string *out)
+    {
+        const char *end = data + size;
+
+        while (data != end) {
+            if (_state == State::Undecided) {
+                if (*data == '\n') {
+                    // Line shorter than the command prefix
+                    keep_line(out);
+                    ++data;
+                    end_line();
+                    continue;
+                }
+
+                _prefix[_prefix_size++] = *data++;
+
+                if (_prefix_size == TRANSFER_LIST_ERASE_LEN) {
+                    if (std::memcmp(_prefix, TRANSFER_LIST_ERASE,
+                                    TRANSFER_LIST_ERASE_LEN) == 0) {
+                        _state = State::Drop;
+                    } else {
+                        keep_line(out);
+                        _state = State::Keep;
+                    }
+                }
+                continue;
+            }
+
+            auto newline = static_cast<const char *>(
+                    std::memchr(data, '\n', end - data));
+            const char *line_end = newline ? newline : end;
+
+            if (_state == State::Keep) {
+                out->append(data, line_end);
+            }
+
+            data = line_end;
+
+            if (newline) {
+                ++data;
+                end_line();
+            }
+        }
+    }
+
+    void finish(std::string *out)
+    {
+        // The final (possibly empty) line has no trailing newline
+        if (_state == State::Undecided) {
+            keep_line(out);
+        }
+        end_line();
+    }
+
+private:
+    enum class State
+    {
+        Undecided,
+        Keep,
+        Drop,
+    };
+
+    void keep_line(std::string *out)
+    {
+        if (_kept_line) {
+            out->push_back('\n');
+        }
+        out->append(_prefix, _prefix_size);
+        _kept_line = true;
+    }
+
+    void end_line()
+    {
+        _state = State::Undecided;
+        _prefix_size = 0;
+    }
+
+    State _state;
+    char _prefix[TRANSFER_LIST_ERASE_LEN];
+    size_t _prefix_size;
+    bool _kept_line;
+};
+
+/*!
+ * \brief Stream a transfer list from one file to another
+ *
+ * The target is written to a temporary file and atomically renamed over
+ * \p path once the transfer list has been completely rewritten.
+ */
+static bool patch_transfer_list_file(const std::string &path, bool *missing)
 {
-    if (!patch_updater(directory)) {
+    StandardFile in;
+    StandardFile out;
+
+    *missing = false;
+
+    auto ret = FileUtils::open_file(in, path, FileOpenMode::READ_ONLY);
+    if (ret == ErrorCode::FileOpenError) {
+        *missing = true;
+        return true;
+    } else if (ret != ErrorCode::NoError) {
         return false;
     }
 
-    if (!patch_transfer_list(directory)) {
+    std::string temp_path(path);
+    temp_path += ".tmp";
+
+    if (FileUtils::open_file(out, temp_path, FileOpenMode::WRITE_ONLY)
+            != ErrorCode::NoError) {
+        LOGE("%s: Failed to open for writing: %s",
+             temp_path.c_str(), out.error_string().c_str());
         return false;
     }
 
+    TransferListFilter filter;
+    std::vector<char> buf(TRANSFER_LIST_BUF_SIZE);
+    std::string output;
+    output.reserve(buf.size());
+    bool eof = false;
+
+    while (!eof) {
+        size_t n;
+        if (!file_read_fully(in, buf.data(), buf.size(), n)) {
+            LOGE("%s: Failed to read: %s",
+                 path.c_str(), in.error_string().c_str());
+            goto error;
+        }
+
+        output.clear();
+        if (n == 0) {
+            filter.finish(&output);
+            eof = true;
+        } else {
+            filter.feed(buf.data(), n, &output);
+        }
+
+        size_t n_written;
+        if (!file_write_fully(out, output.data(), output.size(), n_written)
+                || n_written != output.size()) {
+            LOGE("%s: Failed to write: %s",
+                 temp_path.c_str(), out.error_string().c_str());
+            goto error;
+        }
+    }
+
+    if (!out.close()) {
+        LOGE("%s: Failed to close: %s",
+             temp_path.c_str(), out.error_string().c_str());
+        goto error;
+    }
+
+    in.close();
+
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        LOGE("%s: Failed to rename to %s: %s", temp_path.c_str(),
+             path.c_str(), strerror(errno));
+        goto error;
+    }
+
     return true;
+
+error:
+    out.close();
+    std::remove(temp_path.c_str());
+    return false;
 }
 
-bool StandardPatcher::patch_updater(const std::string &directory)
+bool StandardPatcher::patch_files(const std::string &directory)
 {
-    MB_PRIVATE(StandardPatcher);
+    for (auto const &name : existing_files()) {
+        std::string path(directory);
+        path += "/";
+        path += name;
+
+        if (name == SystemTransferList) {
+            // Transfer lists can be huge, so avoid loading them into memory
+            bool missing;
+            if (!patch_transfer_list_file(path, &missing)) {
+                return false;
+            }
+            continue;
+        }
+
+        std::string contents;
+
+        auto ret = FileUtils::read_to_string(path, &contents);
+        if (ret == ErrorCode::FileOpenError) {
+            continue;
+        } else if (ret != ErrorCode::NoError) {
+            return false;
+        }
+
+        if (!patch_file(name, &contents)) {
+            return false;
+        }
 
-    std::string contents;
-    std::string path;
+        FileUtils::write_from_string(path, contents);
+    }
 
-    path += directory;
-    path += "/";
-    path += UpdaterScript;
+    return true;
+}
 
-    FileUtils::read_to_string(path, &contents);
+bool StandardPatcher::patch_file(const std::string &name,
+                                 std::string *contents)
+{
+    if (name == UpdaterScript) {
+        return patch_updater(contents);
+    } else if (name == SystemTransferList) {
+        return patch_transfer_list(contents);
+    }
 
-    if (contents.size() >= 2 && std::memcmp(contents.data(), "#!", 2) == 0) {
+    return true;
+}
+
+bool StandardPatcher::patches_tokens(const std::string &name) const
+{
+    return name == UpdaterScript;
+}
+
+bool StandardPatcher::patch_tokens(const std::string &name,
+                                   std::vector<EdifyToken *> *tokens)
+{
+    if (name == UpdaterScript) {
+        return patch_updater_tokens(tokens);
+    }
+
+    return true;
+}
+
+bool StandardPatcher::patch_updater(std::string *contents)
+{
+    if (contents->size() >= 2 && std::memcmp(contents->data(), "#!", 2) == 0) {
         // Ignore any script with a shebang line
         return true;
     }
 
     std::vector<EdifyToken *> tokens;
     bool result = EdifyTokenizer::tokenize(
-            contents.data(), contents.size(), &tokens);
+            contents->data(), contents->size(), &tokens);
     if (!result) {
         LOGE("Failed to tokenize updater-script");
         return false;
     }
 
+    result = patch_updater_tokens(&tokens);
+    if (result) {
+        *contents = EdifyTokenizer::untokenize(tokens);
+    }
+
+    for (EdifyToken *t : tokens) {
+        delete t;
+    }
+
+    return result;
+}
+
+bool StandardPatcher::patch_updater_tokens(std::vector<EdifyToken *> *tokens)
+{
+    MB_PRIVATE(StandardPatcher);
+
 #if DUMP_DEBUG
-    EdifyTokenizer::dump(tokens);
+    EdifyTokenizer::dump(*tokens);
 #endif
 
     Device *device = priv->info->device();
@@ -593,12 +869,12 @@ bool StandardPatcher::patch_updater(const std::string &directory)
     auto cacheDevs = mb_device_cache_block_devs(device);
     auto dataDevs = mb_device_data_block_devs(device);
 
-    std::vector<EdifyToken *>::iterator begin = tokens.begin();
-    std::vector<EdifyToken *>::iterator end;
+    EdifyEditor editor(tokens);
+    std::vector<EdifyToken *>::iterator begin = tokens->begin();
+    std::vector<EdifyToken *>::iterator end = tokens->end();
 
     // TODO: Catch errors
     while (true) {
-        end = tokens.end();
 
         // Need to find:
         // 1. String containing function name
@@ -616,64 +892,43 @@ bool StandardPatcher::patch_updater(const std::string &directory)
         EdifyTokenString *t_func_name = (EdifyTokenString *)(*func_name);
 
         if (t_func_name->unescaped_string() == "mount") {
-            begin = replace_edify_mount(&tokens, func_name, left_paren, right_paren,
+            begin = replace_edify_mount(&editor, func_name, left_paren, right_paren,
                                         systemDevs, cacheDevs, dataDevs);
         } else if (t_func_name->unescaped_string() == "unmount") {
-            begin = replace_edify_unmount(&tokens, func_name, left_paren, right_paren,
+            begin = replace_edify_unmount(&editor, func_name, left_paren, right_paren,
                                           systemDevs, cacheDevs, dataDevs);
         } else if (t_func_name->unescaped_string() == "run_program") {
-            begin = replace_edify_run_program(&tokens, func_name, left_paren, right_paren,
+            begin = replace_edify_run_program(&editor, func_name, left_paren, right_paren,
                                               systemDevs, cacheDevs, dataDevs);
         } else if (t_func_name->unescaped_string() == "delete_recursive") {
-            begin = replace_edify_delete_recursive(&tokens, func_name, left_paren, right_paren);
+            begin = replace_edify_delete_recursive(&editor, func_name, left_paren, right_paren);
         } else if (t_func_name->unescaped_string() == "format") {
-            begin = replace_edify_format(&tokens, func_name, left_paren, right_paren,
+            begin = replace_edify_format(&editor, func_name, left_paren, right_paren,
                                          systemDevs, cacheDevs, dataDevs);
         } else {
             begin = func_name + 1;
         }
     }
 
+    editor.finish();
+
 #if DUMP_DEBUG
-    EdifyTokenizer::dump(tokens);
+    EdifyTokenizer::dump(*tokens);
 #endif
 
-    FileUtils::write_from_string(path, EdifyTokenizer::untokenize(tokens));
-
-    for (EdifyToken *t : tokens) {
-        delete t;
-    }
-
     return true;
 }
 
-bool StandardPatcher::patch_transfer_list(const std::string &directory)
+bool StandardPatcher::patch_transfer_list(std::string *contents)
 {
-    std::string contents;
-    std::string path;
-    std::vector<std::string> lines;
+    TransferListFilter filter;
+    std::string output;
+    output.reserve(contents->size());
 
-    path += directory;
-    path += "/";
-    path += SystemTransferList;
-
-    auto ret = FileUtils::read_to_string(path, &contents);
-    if (ret != ErrorCode::NoError) {
-        return ret == ErrorCode::FileOpenError;
-    }
-
-    lines = StringUtils::split(contents, '\n');
-
-    for (auto it = lines.begin(); it != lines.end();) {
-        if (starts_with(*it, "erase ")) {
-            it = lines.erase(it);
-        } else {
-            ++it;
-        }
-    }
+    filter.feed(contents->data(), contents->size(), &output);
+    filter.finish(&output);
 
-    contents = StringUtils::join(lines, "\n");
-    FileUtils::write_from_string(path, contents);
+    contents->swap(output);
 
     return true;
 }
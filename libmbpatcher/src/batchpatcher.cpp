@@ -0,0 +1,513 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "mbpatcher/batchpatcher.h"
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <cassert>
+
+#include "mbcommon/thread_pool.h"
+#include "mblog/logging.h"
+
+#include "mbpatcher/patcherconfig.h"
+#include "mbpatcher/patcherinterface.h"
+
+
+namespace mb
+{
+namespace patcher
+{
+
+/*! \cond INTERNAL */
+struct BatchJob
+{
+    BatchPatcherPrivate *priv;
+    size_t index;
+
+    std::string patcher_id;
+    FileInfo info;
+
+    BatchPatcher::JobState state;
+    ErrorCode error;
+
+    // Only valid while the job is running
+    Patcher *patcher;
+    bool cancel_requested;
+
+    uint64_t bytes;
+    uint64_t max_bytes;
+};
+
+class BatchPatcherPrivate
+{
+public:
+    PatcherConfig *pc;
+
+    // Protects the job list, the job states, and the statistics
+    mutable std::mutex mutex;
+    // Serializes calls to the user-supplied callbacks
+    std::mutex cb_mutex;
+
+    std::vector<std::unique_ptr<BatchJob>> jobs;
+    size_t next_job;
+    bool running;
+
+    std::chrono::steady_clock::time_point start_time;
+    std::chrono::steady_clock::time_point end_time;
+
+    BatchPatcher::JobProgressCallback progress_cb;
+    BatchPatcher::JobFilesCallback files_cb;
+    BatchPatcher::JobDetailsCallback details_cb;
+    BatchPatcher::JobFinishedCallback finished_cb;
+    void *userdata;
+
+    BatchJob * claim_job();
+    void finish_job(BatchJob *job, BatchPatcher::JobState state,
+                    ErrorCode error);
+    void run_job(BatchJob *job);
+    void worker();
+};
+/*! \endcond */
+
+static void job_progress_cb(uint64_t bytes, uint64_t max_bytes,
+                            void *userdata)
+{
+    auto *job = static_cast<BatchJob *>(userdata);
+    auto *priv = job->priv;
+
+    {
+        std::lock_guard<std::mutex> lock(priv->mutex);
+        job->bytes = bytes;
+        job->max_bytes = max_bytes;
+
+        // Patchers reset their cancellation flag when patching begins, so
+        // reapply any cancellation request that raced with the start
+        if (job->cancel_requested) {
+            job->patcher->cancel_patching();
+        }
+    }
+
+    if (priv->progress_cb) {
+        std::lock_guard<std::mutex> lock(priv->cb_mutex);
+        priv->progress_cb(job->index, bytes, max_bytes, priv->userdata);
+    }
+}
+
+static void job_files_cb(uint64_t files, uint64_t max_files, void *userdata)
+{
+    auto *job = static_cast<BatchJob *>(userdata);
+    auto *priv = job->priv;
+
+    if (priv->files_cb) {
+        std::lock_guard<std::mutex> lock(priv->cb_mutex);
+        priv->files_cb(job->index, files, max_files, priv->userdata);
+    }
+}
+
+static void job_details_cb(const std::string &text, void *userdata)
+{
+    auto *job = static_cast<BatchJob *>(userdata);
+    auto *priv = job->priv;
+
+    if (priv->details_cb) {
+        std::lock_guard<std::mutex> lock(priv->cb_mutex);
+        priv->details_cb(job->index, text, priv->userdata);
+    }
+}
+
+/*!
+ * \brief Get the next pending job
+ *
+ * Jobs that were cancelled before they were started are finished here.
+ *
+ * \return Next job to run or nullptr if there are no more pending jobs
+ */
+BatchJob * BatchPatcherPrivate::claim_job()
+{
+    while (true) {
+        BatchJob *job = nullptr;
+        bool cancelled = false;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            while (next_job < jobs.size()
+                    && jobs[next_job]->state != BatchPatcher::JobState::Pending) {
+                ++next_job;
+            }
+
+            if (next_job == jobs.size()) {
+                return nullptr;
+            }
+
+            job = jobs[next_job++].get();
+            cancelled = job->cancel_requested;
+            job->state = BatchPatcher::JobState::Running;
+        }
+
+        if (!cancelled) {
+            return job;
+        }
+
+        finish_job(job, BatchPatcher::JobState::Cancelled,
+                   ErrorCode::PatchingCancelled);
+    }
+}
+
+void BatchPatcherPrivate::finish_job(BatchJob *job,
+                                     BatchPatcher::JobState state,
+                                     ErrorCode error)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job->state = state;
+        job->error = error;
+        job->patcher = nullptr;
+    }
+
+    if (finished_cb) {
+        std::lock_guard<std::mutex> lock(cb_mutex);
+        finished_cb(job->index, state, error, userdata);
+    }
+}
+
+void BatchPatcherPrivate::run_job(BatchJob *job)
+{
+    // PatcherConfig is shared by all of the jobs and serializes the creation
+    // and destruction of patchers
+    Patcher *patcher = pc->create_patcher(job->patcher_id);
+    if (!patcher) {
+        LOGE("%s: Invalid patcher ID: %s", job->info.input_path().c_str(),
+             job->patcher_id.c_str());
+        finish_job(job, BatchPatcher::JobState::Failed,
+                   ErrorCode::PatcherCreateError);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job->patcher = patcher;
+    }
+
+    patcher->set_file_info(&job->info);
+
+    bool ret = patcher->patch_file(&job_progress_cb, &job_files_cb,
+                                   &job_details_cb, job);
+    ErrorCode error = ret ? ErrorCode::NoError : patcher->error();
+
+    bool cancelled;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job->patcher = nullptr;
+        cancelled = job->cancel_requested;
+    }
+
+    patcher->set_file_info(nullptr);
+    pc->destroy_patcher(patcher);
+
+    BatchPatcher::JobState state;
+    if (ret) {
+        state = BatchPatcher::JobState::Succeeded;
+    } else if (cancelled || error == ErrorCode::PatchingCancelled) {
+        state = BatchPatcher::JobState::Cancelled;
+        error = ErrorCode::PatchingCancelled;
+    } else {
+        state = BatchPatcher::JobState::Failed;
+    }
+
+    finish_job(job, state, error);
+}
+
+void BatchPatcherPrivate::worker()
+{
+    while (BatchJob *job = claim_job()) {
+        run_job(job);
+    }
+}
+
+/*!
+ * \class BatchPatcher
+ * \brief Patches multiple files concurrently
+ *
+ * Each job is patched by its own Patcher instance created from the shared
+ * PatcherConfig. Up to the requested number of jobs run at the same time.
+ */
+
+/*!
+ * \brief Construct a new batch
+ *
+ * \param pc PatcherConfig used to create the patchers. It must outlive the
+ *           BatchPatcher.
+ */
+BatchPatcher::BatchPatcher(PatcherConfig *pc)
+    : _priv_ptr(new BatchPatcherPrivate())
+{
+    MB_PRIVATE(BatchPatcher);
+    priv->pc = pc;
+    priv->next_job = 0;
+    priv->running = false;
+    priv->progress_cb = nullptr;
+    priv->files_cb = nullptr;
+    priv->details_cb = nullptr;
+    priv->finished_cb = nullptr;
+    priv->userdata = nullptr;
+}
+
+BatchPatcher::~BatchPatcher()
+{
+}
+
+/*!
+ * \brief Add a file to the batch
+ *
+ * \param patcher_id ID of the patcher to use for this file
+ * \param info File information. A copy is made, so \p info does not need to
+ *             outlive the batch.
+ *
+ * \return Index of the new job
+ */
+size_t BatchPatcher::add_job(const std::string &patcher_id,
+                             const FileInfo &info)
+{
+    MB_PRIVATE(BatchPatcher);
+
+    std::unique_ptr<BatchJob> job(new BatchJob());
+    job->priv = priv;
+    job->patcher_id = patcher_id;
+    job->info.set_input_path(info.input_path());
+    job->info.set_output_path(info.output_path());
+    job->info.set_device(info.device());
+    job->info.set_rom_id(info.rom_id());
+    job->state = JobState::Pending;
+    job->error = ErrorCode::NoError;
+    job->patcher = nullptr;
+    job->cancel_requested = false;
+    job->bytes = 0;
+    job->max_bytes = 0;
+
+    std::lock_guard<std::mutex> lock(priv->mutex);
+    job->index = priv->jobs.size();
+    priv->jobs.push_back(std::move(job));
+
+    return priv->jobs.size() - 1;
+}
+
+/*!
+ * \brief Number of jobs in the batch
+ */
+size_t BatchPatcher::job_count() const
+{
+    MB_PRIVATE(const BatchPatcher);
+    std::lock_guard<std::mutex> lock(priv->mutex);
+    return priv->jobs.size();
+}
+
+/*!
+ * \brief Current state of a job
+ */
+BatchPatcher::JobState BatchPatcher::job_state(size_t job) const
+{
+    MB_PRIVATE(const BatchPatcher);
+    std::lock_guard<std::mutex> lock(priv->mutex);
+    assert(job < priv->jobs.size());
+    return priv->jobs[job]->state;
+}
+
+/*!
+ * \brief Error of a failed or cancelled job
+ *
+ * \return ErrorCode or ErrorCode::NoError if the job has not failed
+ */
+ErrorCode BatchPatcher::job_error(size_t job) const
+{
+    MB_PRIVATE(const BatchPatcher);
+    std::lock_guard<std::mutex> lock(priv->mutex);
+    assert(job < priv->jobs.size());
+    return priv->jobs[job]->error;
+}
+
+/*!
+ * \brief Get aggregate statistics for the batch
+ *
+ * This can be called from any thread, including from within the callbacks
+ * passed to run(). The throughput of the batch is `bytes / elapsed_ms`.
+ */
+BatchPatcher::Stats BatchPatcher::stats() const
+{
+    MB_PRIVATE(const BatchPatcher);
+    std::lock_guard<std::mutex> lock(priv->mutex);
+
+    Stats stats{};
+
+    for (auto const &job : priv->jobs) {
+        switch (job->state) {
+        case JobState::Succeeded:
+            ++stats.succeeded;
+            break;
+        case JobState::Failed:
+            ++stats.failed;
+            break;
+        case JobState::Cancelled:
+            ++stats.cancelled;
+            break;
+        default:
+            break;
+        }
+
+        stats.bytes += job->bytes;
+        stats.max_bytes += job->max_bytes;
+    }
+
+    if (priv->start_time != std::chrono::steady_clock::time_point()) {
+        auto end = priv->running
+                ? std::chrono::steady_clock::now() : priv->end_time;
+        stats.elapsed_ms = static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                        end - priv->start_time).count());
+    }
+
+    return stats;
+}
+
+/*!
+ * \brief Patch all pending jobs
+ *
+ * This function blocks until every pending job has finished. The callbacks
+ * are invoked from the worker threads, but never concurrently, so they do not
+ * need to be synchronized with each other. Any of the callback parameters can
+ * be nullptr if they are not needed.
+ *
+ * \param max_concurrent Maximum number of jobs to patch at the same time or 0
+ *                       to use the number of CPU cores
+ * \param progress_cb Callback for receiving the progress of a job
+ * \param files_cb Callback for receiving the files count of a job
+ * \param details_cb Callback for receiving the detailed progress text of a job
+ * \param finished_cb Callback invoked once when a job finishes
+ * \param userdata Pointer to pass to callback functions
+ *
+ * \return Whether all of the jobs succeeded
+ */
+bool BatchPatcher::run(unsigned int max_concurrent,
+                       JobProgressCallback progress_cb,
+                       JobFilesCallback files_cb,
+                       JobDetailsCallback details_cb,
+                       JobFinishedCallback finished_cb,
+                       void *userdata)
+{
+    MB_PRIVATE(BatchPatcher);
+
+    size_t pending = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(priv->mutex);
+
+        if (priv->running) {
+            LOGE("Batch is already running");
+            return false;
+        }
+
+        for (auto const &job : priv->jobs) {
+            if (job->state == JobState::Pending) {
+                ++pending;
+            }
+        }
+
+        priv->running = true;
+        priv->next_job = 0;
+        priv->start_time = std::chrono::steady_clock::now();
+        priv->progress_cb = progress_cb;
+        priv->files_cb = files_cb;
+        priv->details_cb = details_cb;
+        priv->finished_cb = finished_cb;
+        priv->userdata = userdata;
+    }
+
+    if (max_concurrent == 0) {
+        max_concurrent = std::max(1u, std::thread::hardware_concurrency());
+    }
+    size_t n_threads = std::min<size_t>(max_concurrent, pending);
+
+    // The calling thread acts as one of the workers
+    run_concurrently(static_cast<unsigned int>(n_threads),
+                     [priv] { priv->worker(); });
+
+    std::lock_guard<std::mutex> lock(priv->mutex);
+
+    priv->running = false;
+    priv->end_time = std::chrono::steady_clock::now();
+    priv->progress_cb = nullptr;
+    priv->files_cb = nullptr;
+    priv->details_cb = nullptr;
+    priv->finished_cb = nullptr;
+    priv->userdata = nullptr;
+
+    return std::all_of(priv->jobs.begin(), priv->jobs.end(),
+                       [](const std::unique_ptr<BatchJob> &job) {
+        return job->state == JobState::Succeeded;
+    });
+}
+
+/*!
+ * \brief Cancel a job
+ *
+ * If the job is running, its patcher is asked to stop. If the job has not
+ * started yet, it will be skipped. This can be called from any thread.
+ */
+void BatchPatcher::cancel_job(size_t job)
+{
+    MB_PRIVATE(BatchPatcher);
+    std::lock_guard<std::mutex> lock(priv->mutex);
+
+    assert(job < priv->jobs.size());
+    auto &j = priv->jobs[job];
+
+    if (j->state == JobState::Pending || j->state == JobState::Running) {
+        j->cancel_requested = true;
+        if (j->patcher) {
+            j->patcher->cancel_patching();
+        }
+    }
+}
+
+/*!
+ * \brief Cancel all unfinished jobs
+ */
+void BatchPatcher::cancel_all()
+{
+    MB_PRIVATE(BatchPatcher);
+    std::lock_guard<std::mutex> lock(priv->mutex);
+
+    for (auto &j : priv->jobs) {
+        if (j->state == JobState::Pending || j->state == JobState::Running) {
+            j->cancel_requested = true;
+            if (j->patcher) {
+                j->patcher->cancel_patching();
+            }
+        }
+    }
+}
+
+}
+}
@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "mbpatcher/cwrapper/cbatchpatcher.h"
+
+#include <cassert>
+
+#include "mbpatcher/batchpatcher.h"
+#include "mbpatcher/patcherconfig.h"
+
+
+#define CAST(x) \
+    assert(x != nullptr); \
+    auto *bp = reinterpret_cast<mb::patcher::BatchPatcher *>(x);
+#define CCAST(x) \
+    assert(x != nullptr); \
+    auto const *bp = reinterpret_cast<const mb::patcher::BatchPatcher *>(x);
+
+
+/*!
+ * \file cbatchpatcher.h
+ * \brief C Wrapper for BatchPatcher
+ *
+ * Please see the documentation for BatchPatcher from the C++ API for more
+ * details. The C functions directly correspond to the BatchPatcher member
+ * functions.
+ *
+ * \sa BatchPatcher
+ */
+
+extern "C" {
+
+struct BatchCallbackWrapper
+{
+    BatchProgressCallback progress_cb;
+    BatchFilesCallback files_cb;
+    BatchDetailsCallback details_cb;
+    BatchFinishedCallback finished_cb;
+    void *userdata;
+};
+
+static void batch_progress_cb_wrapper(size_t job, uint64_t bytes,
+                                      uint64_t max_bytes, void *userdata)
+{
+    auto *wrapper = reinterpret_cast<BatchCallbackWrapper *>(userdata);
+    if (wrapper->progress_cb) {
+        wrapper->progress_cb(job, bytes, max_bytes, wrapper->userdata);
+    }
+}
+
+static void batch_files_cb_wrapper(size_t job, uint64_t files,
+                                   uint64_t max_files, void *userdata)
+{
+    auto *wrapper = reinterpret_cast<BatchCallbackWrapper *>(userdata);
+    if (wrapper->files_cb) {
+        wrapper->files_cb(job, files, max_files, wrapper->userdata);
+    }
+}
+
+static void batch_details_cb_wrapper(size_t job, const std::string &text,
+                                     void *userdata)
+{
+    auto *wrapper = reinterpret_cast<BatchCallbackWrapper *>(userdata);
+    if (wrapper->details_cb) {
+        wrapper->details_cb(job, text.c_str(), wrapper->userdata);
+    }
+}
+
+static void batch_finished_cb_wrapper(size_t job,
+                                      mb::patcher::BatchPatcher::JobState state,
+                                      mb::patcher::ErrorCode error,
+                                      void *userdata)
+{
+    auto *wrapper = reinterpret_cast<BatchCallbackWrapper *>(userdata);
+    if (wrapper->finished_cb) {
+        wrapper->finished_cb(job, static_cast<int>(state),
+                             static_cast<int>(error), wrapper->userdata);
+    }
+}
+
+/*!
+ * \brief Create a new CBatchPatcher object.
+ *
+ * \note The returned object must be freed with mbpatcher_batch_destroy().
+ *
+ * \param pc CPatcherConfig used to create the patchers
+ * \return New CBatchPatcher
+ */
+CBatchPatcher * mbpatcher_batch_create(CPatcherConfig *pc)
+{
+    assert(pc != nullptr);
+    auto *config = reinterpret_cast<mb::patcher::PatcherConfig *>(pc);
+    return reinterpret_cast<CBatchPatcher *>(
+            new mb::patcher::BatchPatcher(config));
+}
+
+/*!
+ * \brief Destroys a CBatchPatcher object.
+ *
+ * \param batch CBatchPatcher to destroy
+ */
+void mbpatcher_batch_destroy(CBatchPatcher *batch)
+{
+    CAST(batch);
+    delete bp;
+}
+
+/*!
+ * \brief Add a file to the batch
+ *
+ * \param batch CBatchPatcher object
+ * \param patcher_id Patcher ID
+ * \param info CFileInfo describing the file to be patched (copied)
+ * \return Index of the new job
+ *
+ * \sa BatchPatcher::add_job()
+ */
+size_t mbpatcher_batch_add_job(CBatchPatcher *batch, const char *patcher_id,
+                               const CFileInfo *info)
+{
+    CAST(batch);
+    assert(info != nullptr);
+    auto const *fi = reinterpret_cast<const mb::patcher::FileInfo *>(info);
+    return bp->add_job(patcher_id, *fi);
+}
+
+/*!
+ * \brief Number of jobs in the batch
+ *
+ * \sa BatchPatcher::job_count()
+ */
+size_t mbpatcher_batch_job_count(const CBatchPatcher *batch)
+{
+    CCAST(batch);
+    return bp->job_count();
+}
+
+/*!
+ * \brief Current state of a job
+ *
+ * \return BatchJobState
+ *
+ * \sa BatchPatcher::job_state()
+ */
+/* enum BatchJobState */ int mbpatcher_batch_job_state(const CBatchPatcher *batch,
+                                                       size_t job)
+{
+    CCAST(batch);
+    return static_cast<int>(bp->job_state(job));
+}
+
+/*!
+ * \brief Error of a failed or cancelled job
+ *
+ * \return ErrorCode
+ *
+ * \sa BatchPatcher::job_error()
+ */
+/* enum ErrorCode */ int mbpatcher_batch_job_error(const CBatchPatcher *batch,
+                                                   size_t job)
+{
+    CCAST(batch);
+    return static_cast<int>(bp->job_error(job));
+}
+
+/*!
+ * \brief Get aggregate statistics for the batch
+ *
+ * \param batch CBatchPatcher object
+ * \param stats Output statistics
+ *
+ * \sa BatchPatcher::stats()
+ */
+void mbpatcher_batch_stats(const CBatchPatcher *batch, CBatchStats *stats)
+{
+    CCAST(batch);
+    assert(stats != nullptr);
+
+    auto s = bp->stats();
+    stats->succeeded = s.succeeded;
+    stats->failed = s.failed;
+    stats->cancelled = s.cancelled;
+    stats->bytes = s.bytes;
+    stats->max_bytes = s.max_bytes;
+    stats->elapsed_ms = s.elapsed_ms;
+}
+
+/*!
+ * \brief Patch all pending jobs
+ *
+ * \param batch CBatchPatcher object
+ * \param maxConcurrent Maximum number of concurrent jobs (0 for CPU count)
+ * \param progressCb Callback for receiving the progress of a job
+ * \param filesCb Callback for receiving the files count of a job
+ * \param detailsCb Callback for receiving detailed progress text of a job
+ * \param finishedCb Callback invoked when a job finishes
+ * \param userData Pointer to pass to callback functions
+ * \return true if all jobs succeeded, otherwise false
+ *
+ * \sa BatchPatcher::run()
+ */
+bool mbpatcher_batch_run(CBatchPatcher *batch,
+                         unsigned int maxConcurrent,
+                         BatchProgressCallback progressCb,
+                         BatchFilesCallback filesCb,
+                         BatchDetailsCallback detailsCb,
+                         BatchFinishedCallback finishedCb,
+                         void *userData)
+{
+    CAST(batch);
+
+    BatchCallbackWrapper wrapper;
+    wrapper.progress_cb = progressCb;
+    wrapper.files_cb = filesCb;
+    wrapper.details_cb = detailsCb;
+    wrapper.finished_cb = finishedCb;
+    wrapper.userdata = userData;
+
+    return bp->run(maxConcurrent, &batch_progress_cb_wrapper,
+                   &batch_files_cb_wrapper, &batch_details_cb_wrapper,
+                   &batch_finished_cb_wrapper,
+                   reinterpret_cast<void *>(&wrapper));
+}
+
+/*!
+ * \brief Cancel a job
+ *
+ * \sa BatchPatcher::cancel_job()
+ */
+void mbpatcher_batch_cancel_job(CBatchPatcher *batch, size_t job)
+{
+    CAST(batch);
+    bp->cancel_job(job);
+}
+
+/*!
+ * \brief Cancel all unfinished jobs
+ *
+ * \sa BatchPatcher::cancel_all()
+ */
+void mbpatcher_batch_cancel_all(CBatchPatcher *batch)
+{
+    CAST(batch);
+    bp->cancel_all();
+}
+
+}
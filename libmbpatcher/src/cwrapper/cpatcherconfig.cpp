@@ -126,6 +126,23 @@ char * mbpatcher_config_temp_directory(const CPatcherConfig *pc)
     return string_to_cstring(config->temp_directory());
 }
 
+/*!
+ * \brief Get the patch cache directory
+ *
+ * \note The returned string is dynamically allocated. It should be free()'d
+ *       when it is no longer needed.
+ *
+ * \param pc CPatcherConfig object
+ * \return Patch cache directory
+ *
+ * \sa PatcherConfig::cache_directory()
+ */
+char * mbpatcher_config_cache_directory(const CPatcherConfig *pc)
+{
+    CCAST(pc);
+    return string_to_cstring(config->cache_directory());
+}
+
 /*!
  * \brief Set top-level data directory
  *
@@ -154,6 +171,77 @@ void mbpatcher_config_set_temp_directory(CPatcherConfig *pc, char *path)
     config->set_temp_directory(path);
 }
 
+/*!
+ * \brief Set the patch cache directory
+ *
+ * \param pc CPatcherConfig object
+ * \param path Path to cache directory
+ *
+ * \sa PatcherConfig::set_cache_directory()
+ */
+void mbpatcher_config_set_cache_directory(CPatcherConfig *pc, char *path)
+{
+    CAST(pc);
+    config->set_cache_directory(path);
+}
+
+/*!
+ * \brief Get the maximum rate at which progress callbacks are invoked
+ *
+ * \param pc CPatcherConfig object
+ * \return Maximum number of progress updates per second or 0 if unlimited
+ *
+ * \sa PatcherConfig::progress_update_rate()
+ */
+unsigned int mbpatcher_config_progress_update_rate(const CPatcherConfig *pc)
+{
+    CCAST(pc);
+    return config->progress_update_rate();
+}
+
+/*!
+ * \brief Set the maximum rate at which progress callbacks are invoked
+ *
+ * \param pc CPatcherConfig object
+ * \param rate Maximum number of progress updates per second or 0 for unlimited
+ *
+ * \sa PatcherConfig::set_progress_update_rate()
+ */
+void mbpatcher_config_set_progress_update_rate(CPatcherConfig *pc,
+                                               unsigned int rate)
+{
+    CAST(pc);
+    config->set_progress_update_rate(rate);
+}
+
+/*!
+ * \brief Get whether generated zips are assembled in memory
+ *
+ * \param pc CPatcherConfig object
+ * \return Whether in-memory output is enabled
+ *
+ * \sa PatcherConfig::in_memory_output()
+ */
+bool mbpatcher_config_in_memory_output(const CPatcherConfig *pc)
+{
+    CCAST(pc);
+    return config->in_memory_output();
+}
+
+/*!
+ * \brief Set whether generated zips are assembled in memory
+ *
+ * \param pc CPatcherConfig object
+ * \param enabled Whether to enable in-memory output
+ *
+ * \sa PatcherConfig::set_in_memory_output()
+ */
+void mbpatcher_config_set_in_memory_output(CPatcherConfig *pc, bool enabled)
+{
+    CAST(pc);
+    config->set_in_memory_output(enabled);
+}
+
 /*!
  * \brief Get list of Patcher IDs
  *
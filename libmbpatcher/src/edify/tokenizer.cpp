@@ -429,36 +429,30 @@ bool EdifyTokenizer::next_token(const char *data, std::size_t size,
         *token = new EdifyTokenNewline();
         p += 1;
     } else if (data[p] != '\n' && std::isspace(data[p])) {
-        std::string buf;
-        buf += data[p];
+        std::size_t start = p;
         p += 1;
         while (size - p >= 1 && data[p] != '\n' && std::isspace(data[p])) {
-            buf += data[p];
             p += 1;
         }
-        *token = new EdifyTokenWhitespace(std::move(buf));
+        *token = new EdifyTokenWhitespace(std::string(data + start, p - start));
     } else if (data[p] == '#') {
-        std::string buf;
         // Omit '#' character
         p += 1;
+        std::size_t start = p;
         while (size - p >= 1 && data[p] != '\n') {
-            buf += data[p];
             p += 1;
         }
-        *token = new EdifyTokenComment(std::move(buf));
+        *token = new EdifyTokenComment(std::string(data + start, p - start));
     } else if (is_valid_unquoted(data[p])) {
-        std::string buf;
-        buf += data[p];
+        std::size_t start = p;
         p += 1;
         while (size - p >= 1 && is_valid_unquoted(data[p])) {
-            buf += data[p];
             p += 1;
         }
-        *token = new EdifyTokenString(std::move(buf), EdifyTokenString::NotQuoted);
+        *token = new EdifyTokenString(std::string(data + start, p - start),
+                                      EdifyTokenString::NotQuoted);
     } else if (data[p] == '"') {
         std::size_t curPos = p;
-        std::string buf;
-        buf += data[p];
         p += 1;
         bool escaped = false;
         bool terminated = false;
@@ -466,19 +460,18 @@ bool EdifyTokenizer::next_token(const char *data, std::size_t size,
             if (data[p] == '\\' || escaped) {
                 escaped = !escaped;
             } else if (!escaped && data[p] == '"') {
-                buf += data[p];
                 p += 1;
                 terminated = true;
                 break;
             }
-            buf += data[p];
             p += 1;
         }
         if (!terminated) {
             LOGE("Unterminated quote at position %" MB_PRIzu, curPos);
             return false;
         }
-        *token = new EdifyTokenString(std::move(buf), EdifyTokenString::AlreadyQuoted);
+        *token = new EdifyTokenString(std::string(data + curPos, p - curPos),
+                                      EdifyTokenString::AlreadyQuoted);
     } else {
         *token = new EdifyTokenUnknown(data[p]);
         p += 1;
@@ -493,6 +486,8 @@ bool EdifyTokenizer::tokenize(const char *data, std::size_t size,
                               std::vector<EdifyToken *> *tokens)
 {
     std::vector<EdifyToken *> temp;
+    // Rough estimate to avoid repeated reallocation for large scripts
+    temp.reserve(size / 4);
     EdifyToken *token;
     std::size_t pos = 0;
     bool fail = false;
@@ -526,6 +521,8 @@ bool EdifyTokenizer::tokenize(const char *data, std::size_t size,
 std::string EdifyTokenizer::untokenize(const std::vector<EdifyToken *> &tokens)
 {
     std::string output;
+    // Most tokens are a few characters long
+    output.reserve(tokens.size() * 4);
     for (EdifyToken *token : tokens) {
         output += token->generate();
     }
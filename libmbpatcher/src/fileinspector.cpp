@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbpatcher/fileinspector.h"
+
+#include <algorithm>
+
+#include <cstring>
+
+#include "mbcommon/file/standard.h"
+#include "mbcommon/file_util.h"
+
+#include "mblog/logging.h"
+
+#include "mbpatcher/private/fileutils.h"
+#include "mbpatcher/private/miniziputils.h"
+
+// Largest updater-script that will be scanned for device asserts
+#define UPDATER_SCRIPT_MAX_SIZE         (1024 * 1024)
+
+
+namespace mb
+{
+namespace patcher
+{
+
+/*! \cond INTERNAL */
+
+static const char *UPDATER_SCRIPT =
+        "META-INF/com/google/android/updater-script";
+
+static const char *DEVICE_PROPS[] = {
+    "ro.product.device",
+    "ro.build.product",
+};
+
+static FileFormat detect_format(const unsigned char *header, size_t size)
+{
+    static const unsigned char zip_magic[] = { 'P', 'K', 0x03, 0x04 };
+    static const unsigned char zip_empty_magic[] = { 'P', 'K', 0x05, 0x06 };
+    static const unsigned char gzip_magic[] = { 0x1f, 0x8b };
+    static const unsigned char xz_magic[] =
+            { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+    static const unsigned char tar_magic[] = { 'u', 's', 't', 'a', 'r' };
+    static const size_t tar_magic_offset = 257;
+
+    if (size >= sizeof(zip_magic)
+            && (memcmp(header, zip_magic, sizeof(zip_magic)) == 0
+            || memcmp(header, zip_empty_magic, sizeof(zip_empty_magic)) == 0)) {
+        return FileFormat::Zip;
+    } else if (size >= sizeof(gzip_magic)
+            && memcmp(header, gzip_magic, sizeof(gzip_magic)) == 0) {
+        return FileFormat::Gzip;
+    } else if (size >= sizeof(xz_magic)
+            && memcmp(header, xz_magic, sizeof(xz_magic)) == 0) {
+        return FileFormat::Xz;
+    } else if (size >= tar_magic_offset + sizeof(tar_magic)
+            && memcmp(header + tar_magic_offset, tar_magic,
+                      sizeof(tar_magic)) == 0) {
+        return FileFormat::Tar;
+    }
+
+    return FileFormat::Unknown;
+}
+
+/*!
+ * \brief Find `getprop("<prop>") == "<codename>"` asserts in an edify script
+ */
+static void find_device_asserts(const std::string &script,
+                                std::vector<std::string> &devices)
+{
+    for (const char *prop : DEVICE_PROPS) {
+        std::string needle("getprop(\"");
+        needle += prop;
+        needle += "\")";
+
+        for (size_t pos = script.find(needle); pos != std::string::npos;
+                pos = script.find(needle, pos)) {
+            pos += needle.size();
+
+            pos = script.find_first_not_of(" \t\r\n", pos);
+            if (pos == std::string::npos
+                    || script.compare(pos, 2, "==") != 0) {
+                continue;
+            }
+
+            pos = script.find_first_not_of(" \t\r\n", pos + 2);
+            if (pos == std::string::npos || script[pos] != '"') {
+                continue;
+            }
+
+            size_t end = script.find('"', pos + 1);
+            if (end == std::string::npos) {
+                break;
+            }
+
+            std::string codename = script.substr(pos + 1, end - pos - 1);
+            if (!codename.empty() && std::find(devices.begin(), devices.end(),
+                                               codename) == devices.end()) {
+                devices.push_back(std::move(codename));
+            }
+
+            pos = end + 1;
+        }
+    }
+}
+
+static ErrorCode inspect_zip(const std::string &path,
+                             FileInspection &inspection,
+                             InspectCancelledCallback cancelled_cb,
+                             void *userdata)
+{
+    MinizipUtils::UnzCtx *ctx = MinizipUtils::open_input_file(path);
+    if (!ctx) {
+        LOGE("miniunz: Failed to open for reading: %s", path.c_str());
+        return ErrorCode::ArchiveReadOpenError;
+    }
+
+    unzFile uf = MinizipUtils::ctx_get_unz_file(ctx);
+    ErrorCode error = ErrorCode::NoError;
+    std::string name;
+    unz_file_info64 fi;
+    memset(&fi, 0, sizeof(fi));
+
+    int ret = unzGoToFirstFile(uf);
+    if (ret == UNZ_END_OF_LIST_OF_FILE) {
+        MinizipUtils::close_input_file(ctx);
+        return ErrorCode::NoError;
+    } else if (ret != UNZ_OK) {
+        LOGE("miniunz: Failed to move to first file: %s",
+             MinizipUtils::unz_error_string(ret).c_str());
+        MinizipUtils::close_input_file(ctx);
+        return ErrorCode::ArchiveReadHeaderError;
+    }
+
+    do {
+        if (cancelled_cb && cancelled_cb(userdata)) {
+            error = ErrorCode::PatchingCancelled;
+            break;
+        }
+
+        if (!MinizipUtils::get_info(uf, &fi, &name)) {
+            error = ErrorCode::ArchiveReadHeaderError;
+            break;
+        }
+
+        ++inspection.entries;
+        inspection.uncompressed_size += fi.uncompressed_size;
+
+        if (name == UPDATER_SCRIPT) {
+            inspection.has_updater_script = true;
+
+            std::string script;
+            bool streamed;
+
+            // Too large scripts are not treated as an error since they can
+            // still be patched
+            if (fi.uncompressed_size <= UPDATER_SCRIPT_MAX_SIZE
+                    && MinizipUtils::read_to_string(
+                            uf, UPDATER_SCRIPT_MAX_SIZE, &script, &streamed,
+                            nullptr, nullptr)) {
+                find_device_asserts(script, inspection.devices);
+            }
+        }
+    } while ((ret = unzGoToNextFile(uf)) == UNZ_OK);
+
+    if (error == ErrorCode::NoError && ret != UNZ_END_OF_LIST_OF_FILE) {
+        LOGE("miniunz: Finished before EOF: %s",
+             MinizipUtils::unz_error_string(ret).c_str());
+        error = ErrorCode::ArchiveReadHeaderError;
+    }
+
+    MinizipUtils::close_input_file(ctx);
+
+    return error;
+}
+
+/*! \endcond */
+
+/*!
+ * \brief Inspect a file before patching it
+ *
+ * The format is detected from the file's magic bytes. For zip files, the
+ * central directory is scanned to count the entries and the updater-script
+ * (if any) is searched for the device codenames that it asserts. The contents
+ * of compressed tarballs are not inspected.
+ *
+ * This may take a while for large zip files, so it should not be called from
+ * a UI thread.
+ *
+ * \param[in] path Path to file
+ * \param[out] inspection Inspection results (reset before inspecting)
+ * \param[in] cancelled_cb Optional callback that returns true if the
+ *                         inspection should stop early. It is called once per
+ *                         zip entry.
+ * \param[in] userdata Data to pass to \p cancelled_cb
+ *
+ * \return ErrorCode::NoError if the file was successfully inspected,
+ *         ErrorCode::PatchingCancelled if \p cancelled_cb returned true, or
+ *         another error code if the file could not be read
+ */
+ErrorCode inspect_file(const std::string &path,
+                       FileInspection &inspection,
+                       InspectCancelledCallback cancelled_cb,
+                       void *userdata)
+{
+    inspection = FileInspection();
+
+    unsigned char header[512];
+    size_t n;
+
+    {
+        StandardFile file;
+
+        if (FileUtils::open_file(file, path, FileOpenMode::READ_ONLY)
+                != ErrorCode::NoError) {
+            LOGE("%s: Failed to open for reading: %s",
+                 path.c_str(), file.error_string().c_str());
+            return ErrorCode::FileOpenError;
+        }
+
+        if (!file_read_fully(file, header, sizeof(header), n)) {
+            LOGE("%s: Failed to read header: %s",
+                 path.c_str(), file.error_string().c_str());
+            return ErrorCode::FileReadError;
+        }
+    }
+
+    inspection.format = detect_format(header, n);
+
+    if (inspection.format == FileFormat::Zip) {
+        return inspect_zip(path, inspection, cancelled_cb, userdata);
+    }
+
+    return ErrorCode::NoError;
+}
+
+/*!
+ * \brief Check if an inspected file can be installed on a device
+ *
+ * \return False only if the file asserts the device codename and none of the
+ *         asserted codenames belong to \p device. Files without asserts are
+ *         assumed to work on any device.
+ */
+bool inspection_matches_device(const FileInspection &inspection,
+                               Device *device)
+{
+    if (inspection.devices.empty() || !device) {
+        return true;
+    }
+
+    auto codenames = mb_device_codenames(device);
+    if (!codenames) {
+        return true;
+    }
+
+    for (auto it = codenames; *it; ++it) {
+        if (std::find(inspection.devices.begin(), inspection.devices.end(),
+                      *it) != inspection.devices.end()) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+}
+}
@@ -20,6 +20,7 @@
 #include "mbpatcher/patcherconfig.h"
 
 #include <algorithm>
+#include <mutex>
 
 #include <cassert>
 
@@ -46,11 +47,21 @@ public:
     // Directories
     std::string data_dir;
     std::string temp_dir;
+    std::string cache_dir;
+
+    // Maximum progress callback invocations per second
+    unsigned int progress_rate = 30;
+
+    // Whether generated zips are assembled in memory
+    bool in_memory_output = false;
 
     // Errors
     ErrorCode error;
 
-    // Created patchers
+    // Created patchers. Patchers can be created and destroyed from multiple
+    // threads (eg. by BatchPatcher) and patchers create their autopatchers
+    // from their own threads.
+    std::mutex alloc_mutex;
     std::vector<Patcher *> alloc_patchers;
     std::vector<AutoPatcher *> alloc_auto_patchers;
 };
@@ -71,15 +82,13 @@ PatcherConfig::~PatcherConfig()
 {
     MB_PRIVATE(PatcherConfig);
 
-    for (Patcher *patcher : priv->alloc_patchers) {
-        destroy_patcher(patcher);
+    while (!priv->alloc_patchers.empty()) {
+        destroy_patcher(priv->alloc_patchers.back());
     }
-    priv->alloc_patchers.clear();
 
-    for (AutoPatcher *patcher : priv->alloc_auto_patchers) {
-        destroy_auto_patcher(patcher);
+    while (!priv->alloc_auto_patchers.empty()) {
+        destroy_auto_patcher(priv->alloc_auto_patchers.back());
     }
-    priv->alloc_auto_patchers.clear();
 }
 
 /*!
@@ -125,6 +134,19 @@ std::string PatcherConfig::temp_directory() const
     }
 }
 
+/*!
+ * \brief Get the patch cache directory
+ *
+ * The patch cache is disabled by default.
+ *
+ * \return Patch cache directory or an empty string if the cache is disabled
+ */
+std::string PatcherConfig::cache_directory() const
+{
+    MB_PRIVATE(const PatcherConfig);
+    return priv->cache_dir;
+}
+
 /*!
  * \brief Set top-level data directory
  *
@@ -150,6 +172,80 @@ void PatcherConfig::set_temp_directory(std::string path)
     priv->temp_dir = std::move(path);
 }
 
+/*!
+ * \brief Set the patch cache directory
+ *
+ * If set, patched files are stored in this directory, keyed by the contents
+ * of the input file and the patching parameters. Patching the same input with
+ * the same parameters again reuses the cached result.
+ *
+ * \param path Path to cache directory or an empty string to disable the cache
+ */
+void PatcherConfig::set_cache_directory(std::string path)
+{
+    MB_PRIVATE(PatcherConfig);
+    priv->cache_dir = std::move(path);
+}
+
+/*!
+ * \brief Get the maximum rate at which progress callbacks are invoked
+ *
+ * The default is 30 updates per second.
+ *
+ * \return Maximum number of progress updates per second or 0 if unlimited
+ */
+unsigned int PatcherConfig::progress_update_rate() const
+{
+    MB_PRIVATE(const PatcherConfig);
+    return priv->progress_rate;
+}
+
+/*!
+ * \brief Set the maximum rate at which progress callbacks are invoked
+ *
+ * Patchers sample their progress at this rate and only invoke the progress
+ * and files callbacks if the values changed. This keeps the overhead low when
+ * the callbacks are expensive (eg. when they are marshalled to a UI thread).
+ *
+ * \param rate_hz Maximum number of progress updates per second or 0 to report
+ *                every change
+ */
+void PatcherConfig::set_progress_update_rate(unsigned int rate_hz)
+{
+    MB_PRIVATE(PatcherConfig);
+    priv->progress_rate = rate_hz;
+}
+
+/*!
+ * \brief Get whether generated zips are assembled in memory
+ *
+ * This is disabled by default.
+ *
+ * \return Whether in-memory output is enabled
+ */
+bool PatcherConfig::in_memory_output() const
+{
+    MB_PRIVATE(const PatcherConfig);
+    return priv->in_memory_output;
+}
+
+/*!
+ * \brief Set whether generated zips are assembled in memory
+ *
+ * If enabled, patchers that generate zips from scratch (currently
+ * RamdiskUpdater) build the whole zip in memory and write it out at once. The
+ * static files from the data directory are compressed once per process and
+ * reused for later zips, so generating many variants of the same zip (eg. one
+ * per device) mostly consists of copying already compressed data.
+ *
+ * \param enabled Whether to enable in-memory output
+ */
+void PatcherConfig::set_in_memory_output(bool enabled)
+{
+    MB_PRIVATE(PatcherConfig);
+    priv->in_memory_output = enabled;
+}
+
 /*!
  * \brief Get list of Patcher IDs
  *
@@ -199,6 +295,7 @@ Patcher * PatcherConfig::create_patcher(const std::string &id)
     }
 
     if (p != nullptr) {
+        std::lock_guard<std::mutex> lock(priv->alloc_mutex);
         priv->alloc_patchers.push_back(p);
     }
 
@@ -227,6 +324,7 @@ AutoPatcher * PatcherConfig::create_auto_patcher(const std::string &id,
     }
 
     if (ap != nullptr) {
+        std::lock_guard<std::mutex> lock(priv->alloc_mutex);
         priv->alloc_auto_patchers.push_back(ap);
     }
 
@@ -242,13 +340,18 @@ void PatcherConfig::destroy_patcher(Patcher *patcher)
 {
     MB_PRIVATE(PatcherConfig);
 
-    auto it = std::find(priv->alloc_patchers.begin(),
-                        priv->alloc_patchers.end(),
-                        patcher);
+    {
+        std::lock_guard<std::mutex> lock(priv->alloc_mutex);
+
+        auto it = std::find(priv->alloc_patchers.begin(),
+                            priv->alloc_patchers.end(),
+                            patcher);
 
-    assert(it != priv->alloc_patchers.end());
+        assert(it != priv->alloc_patchers.end());
+
+        priv->alloc_patchers.erase(it);
+    }
 
-    priv->alloc_patchers.erase(it);
     delete patcher;
 }
 
@@ -261,13 +364,18 @@ void PatcherConfig::destroy_auto_patcher(AutoPatcher *patcher)
 {
     MB_PRIVATE(PatcherConfig);
 
-    auto it = std::find(priv->alloc_auto_patchers.begin(),
-                        priv->alloc_auto_patchers.end(),
-                        patcher);
+    {
+        std::lock_guard<std::mutex> lock(priv->alloc_mutex);
 
-    assert(it != priv->alloc_auto_patchers.end());
+        auto it = std::find(priv->alloc_auto_patchers.begin(),
+                            priv->alloc_auto_patchers.end(),
+                            patcher);
+
+        assert(it != priv->alloc_auto_patchers.end());
+
+        priv->alloc_auto_patchers.erase(it);
+    }
 
-    priv->alloc_auto_patchers.erase(it);
     delete patcher;
 }
 
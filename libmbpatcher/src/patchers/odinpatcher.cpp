@@ -20,6 +20,7 @@
 #include "mbpatcher/patchers/odinpatcher.h"
 
 #include <algorithm>
+#include <memory>
 #include <thread>
 #include <unordered_set>
 
@@ -44,9 +45,14 @@
 
 #include "mbpatcher/patcherconfig.h"
 #include "mbpatcher/patchers/zippatcher.h"
+#include "mbpatcher/private/asynczipwriter.h"
 #include "mbpatcher/private/fileutils.h"
 #include "mbpatcher/private/miniziputils.h"
+#include "mbpatcher/private/phasetimer.h"
+#include "mbpatcher/private/progressreporter.h"
+#include "mbpatcher/private/readaheadfile.h"
 #include "mbpatcher/private/stringutils.h"
+#include "mbpatcher/private/tarmd5verifier.h"
 
 #if defined(__ANDROID__)
 #  include "mbcommon/file/fd.h"
@@ -57,6 +63,14 @@
 // minizip
 #include "minizip/zip.h"
 
+// Input blocks read ahead of libarchive
+#define READAHEAD_BLOCK_SIZE        (1024 * 1024)
+#define READAHEAD_BLOCK_COUNT       4
+
+// Blocks queued for deflating into the output zip
+#define WRITE_BLOCK_SIZE            (1024 * 1024)
+#define WRITE_BLOCK_COUNT           4
+
 class ar;
 
 namespace mb
@@ -71,7 +85,6 @@ public:
     PatcherConfig *pc;
     const FileInfo *info;
 
-    uint64_t old_bytes;
     uint64_t bytes;
     uint64_t max_bytes;
 
@@ -79,18 +92,20 @@ public:
 
     ErrorCode error;
 
-    unsigned char la_buf[10240];
 #ifdef __ANDROID__
     FdFile la_file;
     int fd = -1;
 #else
     StandardFile la_file;
 #endif
+    std::unique_ptr<ReadaheadFile> la_readahead;
+    // Checksum of the input as it is read, if it is a .tar.md5 file
+    std::unique_ptr<TarMd5Verifier> md5_verifier;
 
     std::unordered_set<std::string> added_files;
 
     // Callbacks
-    OdinPatcher::ProgressUpdatedCallback progress_cb;
+    ProgressReporter progress;
     OdinPatcher::DetailsUpdatedCallback details_cb;
     void *userdata;
 
@@ -98,10 +113,13 @@ public:
     archive *a_input = nullptr;
     MinizipUtils::ZipCtx *z_output = nullptr;
 
+    std::vector<Patcher::PhaseTime> phase_times;
+
     bool patch_tar();
 
     bool process_file(archive *a, archive_entry *entry, bool sparse);
     bool process_contents(archive *a, int depth);
+    bool verify_input_md5();
     bool open_input_archive();
     bool close_input_archive();
     bool open_output_archive();
@@ -173,17 +191,18 @@ bool OdinPatcher::patch_file(ProgressUpdatedCallback progress_cb,
 
     assert(priv->info != nullptr);
 
-    priv->progress_cb = progress_cb;
+    priv->progress.start(progress_cb, nullptr, userdata,
+                         priv->pc->progress_update_rate());
     priv->details_cb = details_cb;
     priv->userdata = userdata;
 
-    priv->old_bytes = 0;
     priv->bytes = 0;
     priv->max_bytes = 0;
+    priv->phase_times.clear();
 
     bool ret = priv->patch_tar();
 
-    priv->progress_cb = nullptr;
+    priv->progress.finish();
     priv->details_cb = nullptr;
     priv->userdata = nullptr;
 
@@ -202,6 +221,12 @@ bool OdinPatcher::patch_file(ProgressUpdatedCallback progress_cb,
     return ret;
 }
 
+std::vector<Patcher::PhaseTime> OdinPatcher::phase_times() const
+{
+    MB_PRIVATE(const OdinPatcher);
+    return priv->phase_times;
+}
+
 #ifdef __ANDROID__
 static bool convert_to_int(const char *str, int *out)
 {
@@ -251,23 +276,19 @@ bool OdinPatcherPrivate::patch_tar()
 
     if (cancelled) return false;
 
-    // Get file size and seek back to original location
-    uint64_t current_pos;
-    if (!la_file.seek(0, SEEK_CUR, &current_pos)
-            || !la_file.seek(0, SEEK_END, &max_bytes)
-            || !la_file.seek(current_pos, SEEK_SET, nullptr)) {
-        LOGE("%s: Failed to seek: %s", info->input_path().c_str(),
-             la_file.error_string().c_str());
-        error = ErrorCode::FileSeekError;
-        return false;
+    {
+        PhaseTimer timer(phase_times, "process_contents");
+        if (!process_contents(a_input, 0)) {
+            return false;
+        }
     }
 
-    if (cancelled) return false;
-
-    if (!process_contents(a_input, 0)) {
+    if (md5_verifier && !verify_input_md5()) {
         return false;
     }
 
+    PhaseTimer timer(phase_times, "add_files");
+
     std::string arch_dir(pc->data_directory());
     arch_dir += "/binaries/android/";
     arch_dir += mb_device_architecture(info->device());
@@ -414,22 +435,33 @@ bool OdinPatcherPrivate::process_file(archive *a, archive_entry *entry,
         return false;
     }
 
-    la_ssize_t n_read;
-    char buf[10240];
-    while ((n_read = archive_read_data(a, buf, sizeof(buf))) > 0) {
-        if (cancelled) return false;
+    // Deflate and write on a separate thread while libarchive reads the next
+    // block
+    AsyncZipWriter writer(zf, WRITE_BLOCK_SIZE, WRITE_BLOCK_COUNT);
+    writer.start();
 
-        mz_ret = zipWriteInFileInZip(zf, buf, n_read);
-        if (mz_ret != ZIP_OK) {
-            LOGE("minizip: Failed to write %s in output zip: %s",
-                 zip_name.c_str(),
-                 MinizipUtils::zip_error_string(mz_ret).c_str());
-            error = ErrorCode::ArchiveWriteDataError;
-            zipCloseFileInZip(zf);
-            return false;
+    la_ssize_t n_read = 0;
+    void *buf;
+    size_t buf_size;
+
+    while (!cancelled && writer.get_buffer(&buf, &buf_size)) {
+        n_read = archive_read_data(a, buf, buf_size);
+        if (n_read <= 0 || !writer.commit(static_cast<size_t>(n_read))) {
+            break;
         }
     }
 
+    if (!writer.finish()) {
+        LOGE("minizip: Failed to write %s in output zip: %s",
+             zip_name.c_str(),
+             MinizipUtils::zip_error_string(writer.error()).c_str());
+        error = ErrorCode::ArchiveWriteDataError;
+        zipCloseFileInZip(zf);
+        return false;
+    }
+
+    if (cancelled) return false;
+
     if (n_read != 0) {
         LOGE("libarchive: Failed to read %s: %s",
              name, archive_error_string(a));
@@ -571,10 +603,72 @@ bool OdinPatcherPrivate::process_contents(archive *a, int depth)
     return true;
 }
 
+/*!
+ * \brief Check the input against its `.tar.md5` trailer
+ *
+ * Everything libarchive read has already been hashed by la_read_cb(), so only
+ * the remainder of the file after the end of the tarball (the padding and the
+ * trailer itself) needs to be read here.
+ */
+bool OdinPatcherPrivate::verify_input_md5()
+{
+    PhaseTimer timer(phase_times, "verify_md5");
+
+    while (true) {
+        if (cancelled) return false;
+
+        const void *buf;
+        size_t n;
+
+        if (!la_readahead->read(&buf, &n)) {
+            LOGE("%s: Failed to read: %s", info->input_path().c_str(),
+                 la_readahead->error_string().c_str());
+            error = la_readahead->error();
+            return false;
+        } else if (n == 0) {
+            break;
+        }
+
+        md5_verifier->update(buf, n);
+        bytes += n;
+        update_progress(bytes, max_bytes);
+    }
+
+    switch (md5_verifier->finish()) {
+    case TarMd5Verifier::Result::Match:
+        LOGD("%s: MD5 checksum matches: %s", info->input_path().c_str(),
+             md5_verifier->actual().c_str());
+        return true;
+    case TarMd5Verifier::Result::NoTrailer:
+        LOGW("%s: No MD5 trailer found; not verifying",
+             info->input_path().c_str());
+        return true;
+    case TarMd5Verifier::Result::Mismatch:
+    default:
+        LOGE("%s: MD5 checksum mismatch: expected %s, but got %s",
+             info->input_path().c_str(), md5_verifier->expected().c_str(),
+             md5_verifier->actual().c_str());
+        error = ErrorCode::ArchiveChecksumMismatch;
+        return false;
+    }
+}
+
 bool OdinPatcherPrivate::open_input_archive()
 {
     assert(a_input == nullptr);
 
+    // Samsung firmware files carry the MD5 checksum of the tarball at the end.
+    // On Android, the input may be a file descriptor with an unknown name, in
+    // which case the trailer is checked if one is present.
+    md5_verifier.reset();
+    if (ends_with(info->input_path(), ".tar.md5")
+#ifdef __ANDROID__
+            || fd >= 0
+#endif
+            ) {
+        md5_verifier.reset(new TarMd5Verifier());
+    }
+
     a_input = archive_read_new();
 
     archive_read_support_format_zip(a_input);
@@ -652,21 +746,7 @@ bool OdinPatcherPrivate::close_output_archive()
 
 void OdinPatcherPrivate::update_progress(uint64_t bytes, uint64_t max_bytes)
 {
-    if (progress_cb) {
-        bool should_call = true;
-        if (max_bytes > 0) {
-            // Rate limit... call back only if percentage exceeds 0.01%
-            double old_ratio = (double) old_bytes / max_bytes;
-            double new_ratio = (double) bytes / max_bytes;
-            if (new_ratio - old_ratio < 0.0001) {
-                should_call = false;
-            }
-        }
-        if (should_call) {
-            progress_cb(bytes, max_bytes, userdata);
-            old_bytes = bytes;
-        }
-    }
+    progress.set_bytes(bytes, max_bytes);
 }
 
 void OdinPatcherPrivate::update_details(const std::string &msg)
@@ -693,16 +773,21 @@ la_ssize_t OdinPatcherPrivate::la_read_cb(archive *a, void *userdata,
 {
     (void) a;
     auto *priv = static_cast<OdinPatcherPrivate *>(userdata);
-    *buffer = priv->la_buf;
     size_t bytes_read;
 
-    if (!priv->la_file.read(priv->la_buf, sizeof(priv->la_buf), bytes_read)) {
+    if (!priv->la_readahead->read(buffer, &bytes_read)) {
         LOGE("%s: Failed to read: %s", priv->info->input_path().c_str(),
-             priv->la_file.error_string().c_str());
-        priv->error = ErrorCode::FileReadError;
+             priv->la_readahead->error_string().c_str());
+        priv->error = priv->la_readahead->error();
         return -1;
     }
 
+    // Hashing here overlaps with the readahead thread's I/O and the output
+    // thread's deflating, so verification needs no separate pass
+    if (priv->md5_verifier) {
+        priv->md5_verifier->update(*buffer, bytes_read);
+    }
+
     priv->bytes += bytes_read;
     priv->update_progress(priv->bytes, priv->max_bytes);
     return static_cast<la_ssize_t>(bytes_read);
@@ -714,10 +799,16 @@ la_int64_t OdinPatcherPrivate::la_skip_cb(archive *a, void *userdata,
     (void) a;
     auto *priv = static_cast<OdinPatcherPrivate *>(userdata);
 
-    if (!priv->la_file.seek(request, SEEK_CUR, nullptr)) {
+    if (priv->md5_verifier) {
+        // Every byte must be hashed, so make libarchive read through the data
+        // instead of seeking past it
+        return 0;
+    }
+
+    if (!priv->la_readahead->skip(static_cast<uint64_t>(request))) {
         LOGE("%s: Failed to seek: %s", priv->info->input_path().c_str(),
-             priv->la_file.error_string().c_str());
-        priv->error = ErrorCode::FileSeekError;
+             priv->la_readahead->error_string().c_str());
+        priv->error = priv->la_readahead->error();
         return -1;
     }
 
@@ -758,6 +849,23 @@ int OdinPatcherPrivate::la_open_cb(archive *a, void *userdata)
         return -1;
     }
 
+    // Get file size and seek back to original location
+    uint64_t current_pos;
+    if (!priv->la_file.seek(0, SEEK_CUR, &current_pos)
+            || !priv->la_file.seek(0, SEEK_END, &priv->max_bytes)
+            || !priv->la_file.seek(static_cast<int64_t>(current_pos), SEEK_SET,
+                                   nullptr)) {
+        LOGE("%s: Failed to seek: %s", priv->info->input_path().c_str(),
+             priv->la_file.error_string().c_str());
+        priv->error = ErrorCode::FileSeekError;
+        return -1;
+    }
+
+    // The file is only accessed by the readahead thread from now on
+    priv->la_readahead.reset(new ReadaheadFile(
+            priv->la_file, READAHEAD_BLOCK_SIZE, READAHEAD_BLOCK_COUNT));
+    priv->la_readahead->start();
+
     return 0;
 }
 
@@ -766,6 +874,8 @@ int OdinPatcherPrivate::la_close_cb(archive *a, void *userdata)
     (void) a;
     auto *priv = static_cast<OdinPatcherPrivate *>(userdata);
 
+    priv->la_readahead.reset();
+
     if (!priv->la_file.close()) {
         LOGE("%s: Failed to close: %s", priv->info->input_path().c_str(),
              priv->la_file.error_string().c_str());
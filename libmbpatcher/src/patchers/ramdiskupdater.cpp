@@ -19,9 +19,14 @@
 
 #include "mbpatcher/patchers/ramdiskupdater.h"
 
+#include <utility>
+#include <vector>
+
 #include <cassert>
 #include <cstring>
 
+#include "mbcommon/file/memory.h"
+
 #include "mbdevice/device.h"
 #include "mbdevice/json.h"
 
@@ -29,7 +34,9 @@
 
 #include "mbpatcher/patcherconfig.h"
 #include "mbpatcher/patchers/zippatcher.h"
+#include "mbpatcher/private/fileutils.h"
 #include "mbpatcher/private/miniziputils.h"
+#include "mbpatcher/private/zipentrycompressor.h"
 
 
 namespace mb
@@ -38,6 +45,18 @@ namespace patcher
 {
 
 /*! \cond INTERNAL */
+struct CopySpec
+{
+    std::string source;
+    std::string target;
+};
+
+struct GeneratedFile
+{
+    std::string name;
+    std::vector<unsigned char> contents;
+};
+
 class RamdiskUpdaterPrivate
 {
 public:
@@ -50,7 +69,11 @@ public:
 
     MinizipUtils::ZipCtx *z_output = nullptr;
 
+    std::vector<CopySpec> files_to_copy();
+    bool generate_files(std::vector<GeneratedFile> &files);
+
     bool create_zip();
+    bool create_zip_in_memory();
 
     bool open_output_archive();
     void close_output_archive();
@@ -125,25 +148,8 @@ bool RamdiskUpdater::patch_file(ProgressUpdatedCallback progress_cb,
     return ret;
 }
 
-struct CopySpec
+std::vector<CopySpec> RamdiskUpdaterPrivate::files_to_copy()
 {
-    std::string source;
-    std::string target;
-};
-
-bool RamdiskUpdaterPrivate::create_zip()
-{
-    ErrorCode result;
-
-    // Unlike the old patcher, we'll write directly to the new file
-    if (!open_output_archive()) {
-        return false;
-    }
-
-    zipFile zf = MinizipUtils::ctx_get_zip_file(z_output);
-
-    if (cancelled) return false;
-
     std::string arch_dir(pc->data_directory());
     arch_dir += "/binaries/android/";
     arch_dir += mb_device_architecture(info->device());
@@ -180,7 +186,59 @@ bool RamdiskUpdaterPrivate::create_zip()
                           "multiboot/binaries/" + binary});
     }
 
-    for (const CopySpec &spec : toCopy) {
+    return toCopy;
+}
+
+bool RamdiskUpdaterPrivate::generate_files(std::vector<GeneratedFile> &files)
+{
+    const std::string info_prop =
+            ZipPatcher::create_info_prop(pc, info->rom_id(), true);
+    files.push_back({
+        "multiboot/info.prop",
+        std::vector<unsigned char>(info_prop.begin(), info_prop.end())
+    });
+
+    char *json = mb_device_to_json(info->device());
+    if (!json) {
+        error = ErrorCode::MemoryAllocationError;
+        return false;
+    }
+
+    files.push_back({
+        "multiboot/device.json",
+        std::vector<unsigned char>(json, json + strlen(json))
+    });
+    free(json);
+
+    // Create dummy "installer"
+    std::string installer("#!/sbin/sh");
+
+    files.push_back({
+        "META-INF/com/google/android/update-binary.orig",
+        std::vector<unsigned char>(installer.begin(), installer.end())
+    });
+
+    return true;
+}
+
+bool RamdiskUpdaterPrivate::create_zip()
+{
+    if (pc->in_memory_output()) {
+        return create_zip_in_memory();
+    }
+
+    ErrorCode result;
+
+    // Unlike the old patcher, we'll write directly to the new file
+    if (!open_output_archive()) {
+        return false;
+    }
+
+    zipFile zf = MinizipUtils::ctx_get_zip_file(z_output);
+
+    if (cancelled) return false;
+
+    for (const CopySpec &spec : files_to_copy()) {
         if (cancelled) return false;
 
         result = MinizipUtils::add_file(zf, spec.target, spec.source);
@@ -192,50 +250,88 @@ bool RamdiskUpdaterPrivate::create_zip()
 
     if (cancelled) return false;
 
-    const std::string info_prop =
-            ZipPatcher::create_info_prop(pc, info->rom_id(), true);
-    result = MinizipUtils::add_file(
-            zf, "multiboot/info.prop",
-            std::vector<unsigned char>(info_prop.begin(), info_prop.end()));
-    if (result != ErrorCode::NoError) {
-        error = result;
+    std::vector<GeneratedFile> generated;
+    if (!generate_files(generated)) {
         return false;
     }
 
-    if (cancelled) return false;
+    for (const GeneratedFile &file : generated) {
+        if (cancelled) return false;
 
-    char *json = mb_device_to_json(info->device());
-    if (!json) {
-        error = ErrorCode::MemoryAllocationError;
-        return false;
+        result = MinizipUtils::add_file(zf, file.name, file.contents);
+        if (result != ErrorCode::NoError) {
+            error = result;
+            return false;
+        }
     }
 
-    result = MinizipUtils::add_file(
-            zf, "multiboot/device.json",
-            std::vector<unsigned char>(json, json + strlen(json)));
-    free(json);
+    if (cancelled) return false;
 
-    if (result != ErrorCode::NoError) {
-        error = result;
+    return true;
+}
+
+/*!
+ * \brief Build the zip in memory and write it to the output path at once
+ *
+ * The files copied from the data directory are the same for every zip, so
+ * they go through the ZipEntryCompressor cache and are only compressed the
+ * first time.
+ */
+bool RamdiskUpdaterPrivate::create_zip_in_memory()
+{
+    ZipEntryCompressor compressor;
+
+    for (const CopySpec &spec : files_to_copy()) {
+        compressor.add_cached_file(spec.target, spec.source);
+    }
+
+    std::vector<GeneratedFile> generated;
+    if (!generate_files(generated)) {
         return false;
     }
 
+    for (GeneratedFile &file : generated) {
+        compressor.add_file(file.name, std::move(file.contents));
+    }
+
     if (cancelled) return false;
 
-    // Create dummy "installer"
-    std::string installer("#!/sbin/sh");
+    std::vector<unsigned char> buf;
+    MemoryFile file(&buf);
+
+    MinizipUtils::ZipCtx *ctx = MinizipUtils::open_output_file(file);
+    if (!ctx) {
+        LOGE("minizip: Failed to open memory buffer for writing");
+        error = ErrorCode::ArchiveWriteOpenError;
+        return false;
+    }
+
+    ErrorCode result = compressor.write(
+            MinizipUtils::ctx_get_zip_file(ctx),
+            [](const std::string &name, void *userdata) {
+        (void) name;
+        return !static_cast<RamdiskUpdaterPrivate *>(userdata)->cancelled;
+    }, this);
 
-    result = MinizipUtils::add_file(
-            zf, "META-INF/com/google/android/update-binary.orig",
-            std::vector<unsigned char>(installer.begin(), installer.end()));
+    int ret = MinizipUtils::close_output_file(ctx);
 
     if (result != ErrorCode::NoError) {
         error = result;
         return false;
+    } else if (ret != ZIP_OK) {
+        LOGE("minizip: Failed to close archive (error code: %d)", ret);
+        error = ErrorCode::ArchiveCloseError;
+        return false;
     }
 
     if (cancelled) return false;
 
+    result = FileUtils::write_from_memory(info->output_path(), buf);
+    if (result != ErrorCode::NoError) {
+        error = result;
+        return false;
+    }
+
     return true;
 }
 
@@ -20,6 +20,7 @@
 #include "mbpatcher/patchers/zippatcher.h"
 
 #include <algorithm>
+#include <unordered_map>
 #include <unordered_set>
 
 #include <cassert>
@@ -27,14 +28,22 @@
 
 #include "mbcommon/string.h"
 #include "mbcommon/version.h"
+#include "mbcommon/file_util.h"
 #include "mbdevice/json.h"
 #include "mblog/logging.h"
 #include "mbpio/delete.h"
+#include "mbpio/directory.h"
 
 #include "mbpatcher/patcherconfig.h"
+#include "mbpatcher/private/autopatcherpipeline.h"
 #include "mbpatcher/private/fileutils.h"
 #include "mbpatcher/private/miniziputils.h"
+#include "mbpatcher/private/patchcache.h"
+#include "mbpatcher/private/phasetimer.h"
+#include "mbpatcher/private/progressreporter.h"
 #include "mbpatcher/private/stringutils.h"
+#include "mbpatcher/private/zipbulkcopier.h"
+#include "mbpatcher/private/zipentrycompressor.h"
 
 // minizip
 #include "minizip/unzip.h"
@@ -46,6 +55,10 @@ namespace mb
 namespace patcher
 {
 
+// Entries read for the AutoPatchers that are larger than this are spilled to
+// disk instead of being held in memory
+static constexpr uint64_t PATCH_MEMORY_BUDGET = 16 * 1024 * 1024;
+
 /*! \cond INTERNAL */
 class ZipPatcherPrivate
 {
@@ -63,8 +76,7 @@ public:
     ErrorCode error;
 
     // Callbacks
-    ZipPatcher::ProgressUpdatedCallback progress_cb;
-    ZipPatcher::FilesUpdatedCallback files_cb;
+    ProgressReporter progress;
     ZipPatcher::DetailsUpdatedCallback details_cb;
     void *userdata;
 
@@ -73,22 +85,45 @@ public:
     MinizipUtils::ZipCtx *z_output = nullptr;
     std::vector<AutoPatcher *> auto_patchers;
 
+    std::vector<Patcher::PhaseTime> phase_times;
+
     bool patch_zip();
 
-    bool pass1(const std::string &temporary_dir,
-               const std::unordered_set<std::string> &exclude);
-    bool pass2(const std::string &temporary_dir,
+    // Whether unmodified entries were already copied by ZipBulkCopier
+    bool bulk_copied = false;
+
+    // Contents of the files needed by the AutoPatchers
+    std::unordered_map<std::string, std::string> patch_contents;
+    // Files needed by the AutoPatchers that exceeded the memory budget. They
+    // are extracted to spill_dir.
+    std::unordered_set<std::string> spilled_files;
+    std::string spill_dir;
+
+    std::string device_json;
+    // Patch cache key of the complete output, if it should be stored
+    std::string cache_key;
+
+    void add_cache_params(PatchCacheKey &key) const;
+
+    bool archive_stats(ZipBulkCopier &copier, bool *can_bulk_copy);
+    bool bulk_copy(ZipBulkCopier &copier,
+                   const std::unordered_set<std::string> &exclude);
+    bool read_patch_input(unzFile uf, const std::string &name);
+    bool pass1(const std::unordered_set<std::string> &exclude);
+    bool pass2(ZipEntryCompressor &compressor,
                const std::unordered_set<std::string> &files);
     bool open_input_archive();
     void close_input_archive();
-    bool open_output_archive();
-    void close_output_archive();
+    bool open_output_archive(bool append);
+    bool close_output_archive();
 
     void update_progress(uint64_t bytes, uint64_t maxBytes);
     void update_files(uint64_t files, uint64_t maxFiles);
     void update_details(const std::string &msg);
 
     static void la_progress_cb(uint64_t bytes, void *userData);
+    static bool is_bulk_copyable(const std::string &name,
+                                 const std::unordered_set<std::string> &exclude);
 };
 /*! \endcond */
 
@@ -140,8 +175,8 @@ bool ZipPatcher::patch_file(ProgressUpdatedCallback progress_cb,
 
     assert(priv->info != nullptr);
 
-    priv->progress_cb = progress_cb;
-    priv->files_cb = files_cb;
+    priv->progress.start(progress_cb, files_cb, userdata,
+                         priv->pc->progress_update_rate());
     priv->details_cb = details_cb;
     priv->userdata = userdata;
 
@@ -150,10 +185,12 @@ bool ZipPatcher::patch_file(ProgressUpdatedCallback progress_cb,
     priv->files = 0;
     priv->max_files = 0;
 
+    priv->cache_key.clear();
+    priv->phase_times.clear();
+
     bool ret = priv->patch_zip();
 
-    priv->progress_cb = nullptr;
-    priv->files_cb = nullptr;
+    priv->progress.finish();
     priv->details_cb = nullptr;
     priv->userdata = nullptr;
 
@@ -162,11 +199,21 @@ bool ZipPatcher::patch_file(ProgressUpdatedCallback progress_cb,
     }
     priv->auto_patchers.clear();
 
+    if (!priv->spill_dir.empty()) {
+        if (!io::deleteRecursively(priv->spill_dir)) {
+            LOGW("%s: Failed to delete temporary directory",
+                 priv->spill_dir.c_str());
+        }
+        priv->spill_dir.clear();
+    }
+    priv->spilled_files.clear();
+
     if (priv->z_input != nullptr) {
         priv->close_input_archive();
     }
+    bool closed = true;
     if (priv->z_output != nullptr) {
-        priv->close_output_archive();
+        closed = priv->close_output_archive();
     }
 
     if (priv->cancelled) {
@@ -174,9 +221,22 @@ bool ZipPatcher::patch_file(ProgressUpdatedCallback progress_cb,
         return false;
     }
 
+    if (ret && closed && !priv->cache_key.empty()) {
+        PatchCache cache(priv->pc->cache_directory());
+        if (!cache.put_output(priv->cache_key, priv->info->output_path())) {
+            LOGW("Failed to store patched file in cache");
+        }
+    }
+
     return ret;
 }
 
+std::vector<Patcher::PhaseTime> ZipPatcher::phase_times() const
+{
+    MB_PRIVATE(const ZipPatcher);
+    return priv->phase_times;
+}
+
 struct CopySpec
 {
     std::string source;
@@ -209,24 +269,17 @@ bool ZipPatcherPrivate::patch_zip()
         }
     }
 
-    // Unlike the old patcher, we'll write directly to the new file
-    if (!open_output_archive()) {
-        return false;
-    }
-
-    zipFile zf = MinizipUtils::ctx_get_zip_file(z_output);
-
     if (cancelled) return false;
 
-    MinizipUtils::ArchiveStats stats;
-    auto result = MinizipUtils::archive_stats(info->input_path(), &stats,
-                                              std::vector<std::string>());
-    if (result != ErrorCode::NoError) {
-        error = result;
-        return false;
-    }
+    ZipBulkCopier copier;
+    bool can_bulk_copy;
 
-    max_bytes = stats.total_size;
+    {
+        PhaseTimer timer(phase_times, "archive_stats");
+        if (!archive_stats(copier, &can_bulk_copy)) {
+            return false;
+        }
+    }
 
     if (cancelled) return false;
 
@@ -268,83 +321,353 @@ bool ZipPatcherPrivate::patch_zip()
 
     // +1 for info.prop
     // +1 for device.json
-    max_files = stats.files + to_copy.size() + 2;
+    max_files += to_copy.size() + 2;
     update_files(files, max_files);
 
-    if (!open_input_archive()) {
+    char *json = mb_device_to_json(info->device());
+    if (!json) {
+        error = ErrorCode::MemoryAllocationError;
         return false;
     }
+    device_json = json;
+    free(json);
 
-    // Create temporary dir for extracted files for autopatchers
-    std::string temp_dir =
-            FileUtils::create_temporary_dir(pc->temp_directory());
+    PatchCache cache(pc->cache_directory());
+
+    // The cached output is keyed by the input's central directory, which
+    // includes the CRC32 of every entry, and by everything that is added
+    if (cache.enabled() && can_bulk_copy) {
+        PatchCacheKey key;
+        key.add(std::string("output"));
+        add_cache_params(key);
+        key.add(copier.central_directory().data(),
+                copier.central_directory().size());
+
+        bool have_key = true;
+        for (const CopySpec &spec : to_copy) {
+            key.add(spec.target);
+            if (key.add_file(spec.source) != ErrorCode::NoError) {
+                have_key = false;
+                break;
+            }
+        }
 
-    if (!pass1(temp_dir, exclude_from_pass1)) {
-        io::deleteRecursively(temp_dir);
-        return false;
+        if (have_key) {
+            cache_key = key.hex();
+
+            if (cache.get_output(cache_key, info->output_path())) {
+                LOGD("Using cached patched file: %s", cache_key.c_str());
+                cache_key.clear();
+
+                files = max_files;
+                bytes = max_bytes;
+                update_files(files, max_files);
+                update_progress(bytes, max_bytes);
+                return true;
+            }
+        }
     }
 
     if (cancelled) return false;
 
-    // On the second pass, run the autopatchers on the rest of the files
+    bulk_copied = false;
 
-    if (!pass2(temp_dir, exclude_from_pass1)) {
-        io::deleteRecursively(temp_dir);
+    if (can_bulk_copy) {
+        PhaseTimer timer(phase_times, "bulk_copy");
+        if (!bulk_copy(copier, exclude_from_pass1)) {
+            return false;
+        }
+    }
+
+    // Unlike the old patcher, we'll write directly to the new file
+    if (!open_output_archive(bulk_copied)) {
         return false;
     }
 
-    io::deleteRecursively(temp_dir);
+    zipFile zf = MinizipUtils::ctx_get_zip_file(z_output);
 
-    for (const CopySpec &spec : to_copy) {
-        if (cancelled) return false;
+    if (cancelled) return false;
 
-        update_files(++files, max_files);
-        update_details(spec.target);
+    if (!open_input_archive()) {
+        return false;
+    }
+
+    patch_contents.clear();
 
-        result = MinizipUtils::add_file(zf, spec.target, spec.source);
-        if (result != ErrorCode::NoError) {
-            error = result;
+    {
+        PhaseTimer timer(phase_times, "pass1");
+        if (!pass1(exclude_from_pass1)) {
             return false;
         }
     }
 
     if (cancelled) return false;
 
-    update_files(++files, max_files);
-    update_details("multiboot/info.prop");
+    // On the second pass, run the autopatchers on the rest of the files
+
+    // Files that need to be recompressed are deflated concurrently and
+    // written in a fixed order
+    ZipEntryCompressor compressor;
+
+    {
+        PhaseTimer timer(phase_times, "pass2");
+        if (!pass2(compressor, exclude_from_pass1)) {
+            return false;
+        }
+    }
+
+    patch_contents.clear();
+
+    PhaseTimer timer(phase_times, "add_files");
+
+    for (const CopySpec &spec : to_copy) {
+        compressor.add_file(spec.target, spec.source);
+    }
 
     const std::string info_prop =
             ZipPatcher::create_info_prop(pc, info->rom_id(), false);
-    result = MinizipUtils::add_file(
-            zf, "multiboot/info.prop",
+    compressor.add_file(
+            "multiboot/info.prop",
             std::vector<unsigned char>(info_prop.begin(), info_prop.end()));
+
+    compressor.add_file(
+            "multiboot/device.json",
+            std::vector<unsigned char>(device_json.begin(), device_json.end()));
+
+    if (cancelled) return false;
+
+    auto result = compressor.write(
+            zf, [](const std::string &name, void *userdata) {
+        auto *priv = static_cast<ZipPatcherPrivate *>(userdata);
+
+        priv->update_files(++priv->files, priv->max_files);
+        priv->update_details(name);
+
+        return !priv->cancelled;
+    }, this);
     if (result != ErrorCode::NoError) {
         error = result;
         return false;
     }
 
-    if (cancelled) return false;
+    return true;
+}
 
-    update_files(++files, max_files);
-    update_details("multiboot/device.json");
+/*!
+ * \brief Add the parameters that affect the patched files to a cache key
+ */
+void ZipPatcherPrivate::add_cache_params(PatchCacheKey &key) const
+{
+    key.add(std::string(version()));
+    key.add(std::string(git_version()));
+    key.add(ZipPatcher::Id);
+    key.add(info->rom_id());
+    key.add(device_json);
+}
 
-    char *json = mb_device_to_json(info->device());
-    if (!json) {
-        error = ErrorCode::MemoryAllocationError;
+bool ZipPatcherPrivate::is_bulk_copyable(
+        const std::string &name,
+        const std::unordered_set<std::string> &exclude)
+{
+    // Files needed by the AutoPatchers and the renamed installer go through
+    // minizip in pass 1
+    return exclude.find(name) == exclude.end()
+            && name != "META-INF/com/google/android/update-binary";
+}
+
+/*!
+ * \brief Compute the number of files and total uncompressed size
+ *
+ * The totals come from the central directory parsed by \p copier, which is
+ * reused for bulk copying. If the input zip's layout is not supported by
+ * ZipBulkCopier, the totals are computed through minizip instead and
+ * \p can_bulk_copy is set to false.
+ */
+bool ZipPatcherPrivate::archive_stats(ZipBulkCopier &copier,
+                                      bool *can_bulk_copy)
+{
+    bool unsupported;
+
+    *can_bulk_copy = false;
+    max_bytes = 0;
+    max_files = 0;
+
+    auto result = copier.open(info->input_path(), &unsupported);
+    if (result == ErrorCode::NoError) {
+        for (auto const &entry : copier.entries()) {
+            max_bytes += entry.uncompressed_size;
+        }
+        max_files = copier.entries().size();
+        *can_bulk_copy = true;
+        return true;
+    } else if (!unsupported) {
+        error = result;
         return false;
     }
 
-    result = MinizipUtils::add_file(
-            zf, "multiboot/device.json",
-            std::vector<unsigned char>(json, json + strlen(json)));
-    free(json);
+    LOGW("Falling back to copying files individually");
 
+    MinizipUtils::ArchiveStats stats;
+    result = MinizipUtils::archive_stats(info->input_path(), &stats,
+                                         std::vector<std::string>());
     if (result != ErrorCode::NoError) {
         error = result;
         return false;
     }
 
-    if (cancelled) return false;
+    max_bytes = stats.total_size;
+    max_files = stats.files;
+
+    return true;
+}
+
+/*!
+ * \brief Copy unmodified files to the output zip in bulk
+ *
+ * Runs of consecutive entries that will be copied unchanged are copied as
+ * single blocks without going through minizip. The output zip is then opened
+ * in append mode for the remaining files.
+ */
+bool ZipPatcherPrivate::bulk_copy(ZipBulkCopier &copier,
+                                  const std::unordered_set<std::string> &exclude)
+{
+    struct Ctx
+    {
+        ZipPatcherPrivate *priv;
+        const std::unordered_set<std::string> *exclude;
+    };
+
+    Ctx ctx{this, &exclude};
+
+    auto result = copier.copy(
+            info->output_path(),
+            [](const std::string &name, void *userdata) {
+        auto *ctx = static_cast<Ctx *>(userdata);
+        return is_bulk_copyable(name, *ctx->exclude);
+    }, [](const std::string &name, uint64_t size, void *userdata) {
+        auto *priv = static_cast<Ctx *>(userdata)->priv;
+
+        priv->update_files(++priv->files, priv->max_files);
+        priv->update_details(name);
+        priv->bytes += size;
+        priv->update_progress(priv->bytes, priv->max_bytes);
+
+        return !priv->cancelled;
+    }, &ctx);
+
+    if (result != ErrorCode::NoError) {
+        error = result;
+        return false;
+    }
+
+    bulk_copied = true;
+    return true;
+}
+
+struct SpillCtx
+{
+    ZipPatcherPrivate *priv;
+    const std::string *name;
+    StandardFile file;
+    std::string path;
+};
+
+static bool spill_window_cb(const void *data, size_t size, void *userdata)
+{
+    auto *ctx = static_cast<SpillCtx *>(userdata);
+    auto *priv = ctx->priv;
+    size_t n;
+
+    if (priv->cancelled) {
+        return false;
+    }
+
+    // Only create the spill file once we know that it is needed
+    if (!ctx->file.is_open()) {
+        if (priv->spill_dir.empty()) {
+            priv->spill_dir = FileUtils::create_temporary_dir(
+                    priv->pc->temp_directory());
+            if (priv->spill_dir.empty()) {
+                LOGE("Failed to create temporary directory");
+                priv->error = ErrorCode::FileOpenError;
+                return false;
+            }
+        }
+
+        ctx->path = priv->spill_dir;
+        ctx->path += "/";
+        ctx->path += *ctx->name;
+
+        auto slash = ctx->path.find_last_of('/');
+        if (!io::createDirectories(ctx->path.substr(0, slash))) {
+            LOGE("%s: Failed to create parent directory", ctx->path.c_str());
+            priv->error = ErrorCode::FileOpenError;
+            return false;
+        }
+
+        if (FileUtils::open_file(ctx->file, ctx->path, FileOpenMode::WRITE_ONLY)
+                != ErrorCode::NoError) {
+            LOGE("%s: Failed to open for writing: %s",
+                 ctx->path.c_str(), ctx->file.error_string().c_str());
+            priv->error = ErrorCode::FileOpenError;
+            return false;
+        }
+    }
+
+    if (!file_write_fully(ctx->file, data, size, n) || n != size) {
+        LOGE("%s: Failed to write: %s",
+             ctx->path.c_str(), ctx->file.error_string().c_str());
+        priv->error = ErrorCode::FileWriteError;
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Read a file needed by the AutoPatchers
+ *
+ * Files within PATCH_MEMORY_BUDGET are read into patch_contents. Larger files
+ * are streamed to the same relative path in spill_dir so that they can be
+ * patched on disk with AutoPatcher::patch_files().
+ */
+bool ZipPatcherPrivate::read_patch_input(unzFile uf, const std::string &name)
+{
+    SpillCtx ctx;
+    ctx.priv = this;
+    ctx.name = &name;
+
+    std::string contents;
+    bool streamed;
+
+    if (!MinizipUtils::read_to_string(uf, PATCH_MEMORY_BUDGET, &contents,
+                                      &streamed, &spill_window_cb, &ctx)) {
+        if (error == ErrorCode::NoError) {
+            error = ErrorCode::ArchiveReadDataError;
+        }
+        return false;
+    }
+
+    if (!streamed) {
+        patch_contents[name] = std::move(contents);
+        return true;
+    }
+
+    if (!ctx.file.is_open()) {
+        // Nothing was written because the entry was empty after all
+        patch_contents[name];
+        return true;
+    }
+
+    if (!ctx.file.close()) {
+        LOGE("%s: Failed to close: %s",
+             ctx.path.c_str(), ctx.file.error_string().c_str());
+        error = ErrorCode::FileCloseError;
+        return false;
+    }
+
+    LOGD("%s: Spilled to disk to limit memory usage", name.c_str());
+    spilled_files.insert(name);
 
     return true;
 }
@@ -354,11 +677,12 @@ bool ZipPatcherPrivate::patch_zip()
  *
  * This performs the following operations:
  *
- * - Files needed by an AutoPatcher are extracted to the temporary directory.
- * - Otherwise, the file is copied directly to the output zip.
+ * - Files needed by an AutoPatcher are read into memory (or spilled to disk if
+ *   they exceed the memory budget).
+ * - Otherwise, the file is copied directly to the output zip (unless it was
+ *   already copied by bulk_copy()).
  */
-bool ZipPatcherPrivate::pass1(const std::string &temporary_dir,
-                              const std::unordered_set<std::string> &exclude)
+bool ZipPatcherPrivate::pass1(const std::unordered_set<std::string> &exclude)
 {
     unzFile uf = MinizipUtils::ctx_get_unz_file(z_input);
     zipFile zf = MinizipUtils::ctx_get_zip_file(z_output);
@@ -380,13 +704,16 @@ bool ZipPatcherPrivate::pass1(const std::string &temporary_dir,
             return false;
         }
 
+        if (bulk_copied && is_bulk_copyable(cur_file, exclude)) {
+            continue;
+        }
+
         update_files(++files, max_files);
         update_details(cur_file);
 
         // Skip files that should be patched and added in pass 2
         if (exclude.find(cur_file) != exclude.end()) {
-            if (!MinizipUtils::extract_file(uf, temporary_dir)) {
-                error = ErrorCode::ArchiveReadDataError;
+            if (!read_patch_input(uf, cur_file)) {
                 return false;
             }
             continue;
@@ -421,51 +748,129 @@ bool ZipPatcherPrivate::pass1(const std::string &temporary_dir,
  *
  * This performs the following operations:
  *
- * - Patch files in the temporary directory using the AutoPatchers and add the
- *   resulting files to the output zip
+ * - Patch the files read in the first pass using the AutoPatchers and add the
+ *   resulting files to the output zip through \p compressor. Each file is run
+ *   through an AutoPatcherPipeline, so an edify script is tokenized once no
+ *   matter how many AutoPatchers edit it.
  */
-bool ZipPatcherPrivate::pass2(const std::string &temporary_dir,
+bool ZipPatcherPrivate::pass2(ZipEntryCompressor &compressor,
                               const std::unordered_set<std::string> &files)
 {
     zipFile zf = MinizipUtils::ctx_get_zip_file(z_output);
+    PatchCache cache(pc->cache_directory());
+    AutoPatcherPipeline pipeline(auto_patchers);
 
-    for (auto *ap : auto_patchers) {
+    for (auto &item : patch_contents) {
         if (cancelled) return false;
-        if (!ap->patch_files(temporary_dir)) {
-            error = ap->error();
-            return false;
+
+        const std::string &file = item.first;
+        std::string &contents = item.second;
+        std::string key;
+
+        // Patched entries are keyed by their original contents
+        if (cache.enabled()) {
+            PatchCacheKey entry_key;
+            entry_key.add(std::string("entry"));
+            add_cache_params(entry_key);
+            for (auto *ap : auto_patchers) {
+                entry_key.add(ap->id());
+            }
+            entry_key.add(file);
+            entry_key.add(contents);
+            key = entry_key.hex();
+
+            if (cache.get_entry(key, &contents)) {
+                LOGD("Using cached patched entry: %s", file.c_str());
+                continue;
+            }
+        }
+
+        {
+            PhaseTimer timer(phase_times, "autopatchers");
+            if (!pipeline.run(file, &contents)) {
+                error = pipeline.error();
+                return false;
+            }
+        }
+
+        if (!key.empty() && !cache.put_entry(key, contents)) {
+            LOGW("Failed to store patched entry in cache: %s", file.c_str());
+        }
+    }
+
+    // Oversized files are patched in place in the spill directory. Only the
+    // spilled files exist there, so the AutoPatchers skip everything else.
+    if (!spilled_files.empty()) {
+        for (auto *ap : auto_patchers) {
+            if (cancelled) return false;
+
+            PhaseTimer timer(phase_times, "autopatchers");
+            if (!ap->patch_files(spill_dir)) {
+                error = ap->error();
+                return false;
+            }
         }
     }
 
     // TODO Headers are being discarded
 
+    std::vector<std::string> spilled;
+
     for (auto const &file : files) {
         if (cancelled) return false;
 
-        ErrorCode ret;
+        if (spilled_files.find(file) != spilled_files.end()) {
+            spilled.push_back(file);
+            continue;
+        }
+
+        auto it = patch_contents.find(file);
+        if (it == patch_contents.end()) {
+            LOGW("File does not exist in input zip: %s", file.c_str());
+            continue;
+        }
+
+        const std::string &contents = it->second;
+        std::vector<unsigned char> data(contents.begin(), contents.end());
 
         if (file == "META-INF/com/google/android/update-binary") {
-            ret = MinizipUtils::add_file(
-                    zf,
+            compressor.add_file(
                     "META-INF/com/google/android/update-binary.orig",
-                      temporary_dir + "/" + file);
+                    std::move(data));
         } else {
-            ret = MinizipUtils::add_file(
-                    zf,
-                    file,
-                      temporary_dir + "/" + file);
+            compressor.add_file(file, std::move(data));
+        }
+    }
+
+    if (cancelled) return false;
+
+    auto ret = compressor.write(zf, nullptr, nullptr);
+    if (ret != ErrorCode::NoError) {
+        error = ret;
+        return false;
+    }
+
+    // The compressor buffers whole entries, so stream the spilled files
+    // directly into the zip instead
+    for (auto const &file : spilled) {
+        if (cancelled) return false;
+
+        std::string path(spill_dir);
+        path += "/";
+        path += file;
+
+        std::string name(file);
+        if (name == "META-INF/com/google/android/update-binary") {
+            name = "META-INF/com/google/android/update-binary.orig";
         }
 
-        if (ret == ErrorCode::FileOpenError) {
-            LOGW("File does not exist in temporary directory: %s", file.c_str());
-        } else if (ret != ErrorCode::NoError) {
+        ret = MinizipUtils::add_file(zf, name, path);
+        if (ret != ErrorCode::NoError) {
             error = ret;
             return false;
         }
     }
 
-    if (cancelled) return false;
-
     return true;
 }
 
@@ -497,11 +902,11 @@ void ZipPatcherPrivate::close_input_archive()
     z_input = nullptr;
 }
 
-bool ZipPatcherPrivate::open_output_archive()
+bool ZipPatcherPrivate::open_output_archive(bool append)
 {
     assert(z_output == nullptr);
 
-    z_output = MinizipUtils::open_output_file(info->output_path());
+    z_output = MinizipUtils::open_output_file(info->output_path(), append);
 
     if (!z_output) {
         LOGE("minizip: Failed to open for writing: %s",
@@ -513,7 +918,7 @@ bool ZipPatcherPrivate::open_output_archive()
     return true;
 }
 
-void ZipPatcherPrivate::close_output_archive()
+bool ZipPatcherPrivate::close_output_archive()
 {
     assert(z_output != nullptr);
 
@@ -523,20 +928,18 @@ void ZipPatcherPrivate::close_output_archive()
     }
 
     z_output = nullptr;
+
+    return ret == ZIP_OK;
 }
 
 void ZipPatcherPrivate::update_progress(uint64_t bytes, uint64_t max_bytes)
 {
-    if (progress_cb) {
-        progress_cb(bytes, max_bytes, userdata);
-    }
+    progress.set_bytes(bytes, max_bytes);
 }
 
 void ZipPatcherPrivate::update_files(uint64_t files, uint64_t max_files)
 {
-    if (files_cb) {
-        files_cb(files, max_files, userdata);
-    }
+    progress.set_files(files, max_files);
 }
 
 void ZipPatcherPrivate::update_details(const std::string &msg)
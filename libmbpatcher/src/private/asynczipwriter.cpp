@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "mbpatcher/private/asynczipwriter.h"
+
+#include <algorithm>
+#include <system_error>
+
+#include <cstdint>
+
+#include "mblog/logging.h"
+
+#define NO_BLOCK                    SIZE_MAX
+
+
+namespace mb
+{
+namespace patcher
+{
+
+/*!
+ * \brief Construct an asynchronous writer
+ *
+ * \param zf Zip file with an entry opened for writing
+ * \param block_size Size of each buffer returned by get_buffer()
+ * \param block_count Number of buffers (must be at least 1)
+ */
+AsyncZipWriter::AsyncZipWriter(zipFile zf, size_t block_size,
+                               size_t block_count)
+    : _zf(zf)
+    , _block_size(block_size)
+    , _blocks(std::max<size_t>(1, block_count))
+    , _threaded(false)
+    , _current(NO_BLOCK)
+    , _finishing(false)
+    , _error(ZIP_OK)
+{
+    for (auto &block : _blocks) {
+        block.data.reset(new unsigned char[block_size]);
+        block.size = 0;
+    }
+}
+
+AsyncZipWriter::~AsyncZipWriter()
+{
+    finish();
+}
+
+/*!
+ * \brief Start the writer thread
+ */
+void AsyncZipWriter::start()
+{
+    finish();
+
+    _free.clear();
+    _filled.clear();
+    for (size_t i = 0; i < _blocks.size(); ++i) {
+        _free.push_back(i);
+    }
+    _current = NO_BLOCK;
+    _finishing = false;
+    _error = ZIP_OK;
+
+    try {
+        _thread = std::thread(&AsyncZipWriter::writer, this);
+        _threaded = true;
+    } catch (const std::system_error &e) {
+        LOGW("Failed to start zip writer thread: %s", e.what());
+    }
+}
+
+/*!
+ * \brief Wait for all committed data to be written and stop the thread
+ *
+ * \return Whether all data was written successfully
+ */
+bool AsyncZipWriter::finish()
+{
+    if (_threaded) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _finishing = true;
+            _cv.notify_all();
+        }
+
+        _thread.join();
+        _threaded = false;
+    }
+
+    return _error == ZIP_OK;
+}
+
+/*!
+ * \brief Get a buffer to fill with the next block of data
+ *
+ * \param[out] buffer Pointer to the buffer
+ * \param[out] size Size of the buffer
+ *
+ * \return False if a previous write failed
+ */
+bool AsyncZipWriter::get_buffer(void **buffer, size_t *size)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    if (_current == NO_BLOCK) {
+        if (!_threaded) {
+            _current = 0;
+        } else {
+            _cv.wait(lock, [this]{
+                return !_free.empty() || _error != ZIP_OK;
+            });
+
+            if (_error != ZIP_OK) {
+                return false;
+            }
+
+            _current = _free.front();
+            _free.pop_front();
+        }
+    }
+
+    *buffer = _blocks[_current].data.get();
+    *size = _block_size;
+    return _error == ZIP_OK;
+}
+
+/*!
+ * \brief Hand off the buffer returned by get_buffer() for writing
+ *
+ * \param size Number of bytes that were filled
+ *
+ * \return False if a write has failed
+ */
+bool AsyncZipWriter::commit(size_t size)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    if (_current == NO_BLOCK) {
+        return _error == ZIP_OK;
+    }
+
+    size_t index = _current;
+    _current = NO_BLOCK;
+
+    if (!_threaded) {
+        _error = zipWriteInFileInZip(_zf, _blocks[index].data.get(),
+                                     static_cast<unsigned int>(size));
+        return _error == ZIP_OK;
+    }
+
+    _blocks[index].size = size;
+    _filled.push_back(index);
+    _cv.notify_all();
+
+    return _error == ZIP_OK;
+}
+
+/*!
+ * \brief Error code returned by minizip for the first failed write
+ */
+int AsyncZipWriter::error() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _error;
+}
+
+void AsyncZipWriter::writer()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (true) {
+        _cv.wait(lock, [this]{
+            return !_filled.empty() || _finishing;
+        });
+
+        if (_filled.empty()) {
+            break;
+        }
+
+        size_t index = _filled.front();
+        _filled.pop_front();
+
+        int ret = ZIP_OK;
+        if (_error == ZIP_OK) {
+            lock.unlock();
+            ret = zipWriteInFileInZip(
+                    _zf, _blocks[index].data.get(),
+                    static_cast<unsigned int>(_blocks[index].size));
+            lock.lock();
+        }
+
+        if (ret != ZIP_OK && _error == ZIP_OK) {
+            _error = ret;
+        }
+
+        _free.push_back(index);
+        _cv.notify_all();
+    }
+}
+
+}
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbpatcher/private/autopatcherpipeline.h"
+
+#include <algorithm>
+
+#include <cstring>
+
+#include "mblog/logging.h"
+
+#include "mbpatcher/edify/tokenizer.h"
+
+
+namespace mb
+{
+namespace patcher
+{
+
+static void free_tokens(std::vector<EdifyToken *> *tokens)
+{
+    for (EdifyToken *t : *tokens) {
+        delete t;
+    }
+    tokens->clear();
+}
+
+AutoPatcherPipeline::AutoPatcherPipeline(
+        const std::vector<AutoPatcher *> &patchers)
+    : _patchers(patchers)
+    , _error(ErrorCode::NoError)
+{
+}
+
+/*!
+ * \brief Run the AutoPatchers on a file
+ *
+ * \param name Path of the file in the zip file
+ * \param contents Contents of the file, which will be modified in place
+ *
+ * \return Whether all AutoPatchers succeeded. If false, error() returns the
+ *         error of the AutoPatcher that failed.
+ */
+bool AutoPatcherPipeline::run(const std::string &name, std::string *contents)
+{
+    std::vector<EdifyToken *> tokens;
+    // Whether tokens holds the current contents instead of *contents
+    bool have_tokens = false;
+    // Scripts with a shebang line are not edify and are left to patch_file(),
+    // which knows to skip them
+    bool is_edify = !(contents->size() >= 2
+            && std::memcmp(contents->data(), "#!", 2) == 0);
+
+    for (auto *ap : _patchers) {
+        auto const &ap_files = ap->existing_files();
+        if (std::find(ap_files.begin(), ap_files.end(), name)
+                == ap_files.end()) {
+            continue;
+        }
+
+        bool ret;
+
+        if (is_edify && ap->patches_tokens(name)) {
+            if (!have_tokens) {
+                if (!EdifyTokenizer::tokenize(
+                        contents->data(), contents->size(), &tokens)) {
+                    LOGE("%s: Failed to tokenize edify script", name.c_str());
+                    free_tokens(&tokens);
+                    _error = ap->error();
+                    return false;
+                }
+                have_tokens = true;
+            }
+
+            ret = ap->patch_tokens(name, &tokens);
+        } else {
+            if (have_tokens) {
+                *contents = EdifyTokenizer::untokenize(tokens);
+                free_tokens(&tokens);
+                have_tokens = false;
+            }
+
+            ret = ap->patch_file(name, contents);
+        }
+
+        if (!ret) {
+            free_tokens(&tokens);
+            _error = ap->error();
+            return false;
+        }
+    }
+
+    if (have_tokens) {
+        *contents = EdifyTokenizer::untokenize(tokens);
+        free_tokens(&tokens);
+    }
+
+    return true;
+}
+
+ErrorCode AutoPatcherPipeline::error() const
+{
+    return _error;
+}
+
+}
+}
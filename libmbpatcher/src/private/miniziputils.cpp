@@ -23,6 +23,7 @@
 
 #include <cassert>
 #include <cerrno>
+#include <cinttypes>
 #include <cstdint>
 #include <cstring>
 
@@ -30,7 +31,9 @@
 #include <time.h>
 #endif
 
+#include "mbcommon/buffer_pool.h"
 #include "mbcommon/file/standard.h"
+#include "mbcommon/file_util.h"
 #include "mbcommon/locale.h"
 
 #include "mblog/logging.h"
@@ -58,6 +61,9 @@
 
 #include "mbpatcher/private/fileutils.h"
 
+// minizip no longer supports reads larger than UINT16_MAX
+#define MINIZIP_READ_SIZE       UINT16_MAX
+#define MINIZIP_BUF_SIZE        (MINIZIP_READ_SIZE + 1)
 
 namespace mb
 {
@@ -150,6 +156,87 @@ struct MinizipUtils::ZipCtx
 #endif
 };
 
+// minizip I/O callbacks for writing to an already open File. The stream is the
+// File itself and closing the zip does not close it.
+
+static voidpf ZCALLBACK file_open_cb(voidpf opaque, const void *filename,
+                                     int mode)
+{
+    (void) filename;
+    (void) mode;
+    return opaque;
+}
+
+static uLong ZCALLBACK file_read_cb(voidpf opaque, voidpf stream,
+                                    void *buf, uLong size)
+{
+    (void) opaque;
+    size_t n;
+    if (!file_read_fully(*static_cast<File *>(stream), buf, size, n)) {
+        return 0;
+    }
+    return static_cast<uLong>(n);
+}
+
+static uLong ZCALLBACK file_write_cb(voidpf opaque, voidpf stream,
+                                     const void *buf, uLong size)
+{
+    (void) opaque;
+    size_t n;
+    if (!file_write_fully(*static_cast<File *>(stream), buf, size, n)) {
+        return 0;
+    }
+    return static_cast<uLong>(n);
+}
+
+static ZPOS64_T ZCALLBACK file_tell_cb(voidpf opaque, voidpf stream)
+{
+    (void) opaque;
+    uint64_t offset;
+    if (!static_cast<File *>(stream)->seek(0, SEEK_CUR, &offset)) {
+        return static_cast<ZPOS64_T>(-1);
+    }
+    return offset;
+}
+
+static long ZCALLBACK file_seek_cb(voidpf opaque, voidpf stream,
+                                   ZPOS64_T offset, int origin)
+{
+    (void) opaque;
+    int whence;
+
+    switch (origin) {
+    case ZLIB_FILEFUNC_SEEK_CUR:
+        whence = SEEK_CUR;
+        break;
+    case ZLIB_FILEFUNC_SEEK_END:
+        whence = SEEK_END;
+        break;
+    case ZLIB_FILEFUNC_SEEK_SET:
+        whence = SEEK_SET;
+        break;
+    default:
+        return -1;
+    }
+
+    return static_cast<File *>(stream)->seek(
+            static_cast<int64_t>(offset), whence, nullptr) ? 0 : -1;
+}
+
+static int ZCALLBACK file_close_cb(voidpf opaque, voidpf stream)
+{
+    (void) opaque;
+    (void) stream;
+    return 0;
+}
+
+static int ZCALLBACK file_error_cb(voidpf opaque, voidpf stream)
+{
+    (void) opaque;
+    (void) stream;
+    return 0;
+}
+
 unzFile MinizipUtils::ctx_get_unz_file(UnzCtx *ctx)
 {
     return ctx->uf;
@@ -192,7 +279,8 @@ MinizipUtils::UnzCtx * MinizipUtils::open_input_file(std::string path)
     return ctx;
 }
 
-MinizipUtils::ZipCtx * MinizipUtils::open_output_file(std::string path)
+MinizipUtils::ZipCtx * MinizipUtils::open_output_file(std::string path,
+                                                     bool append)
 {
     ZipCtx *ctx = new(std::nothrow) ZipCtx();
     if (!ctx) {
@@ -215,7 +303,10 @@ MinizipUtils::ZipCtx * MinizipUtils::open_output_file(std::string path)
 #endif
 
     fill_buffer_filefunc64(&ctx->z_func, &ctx->buf);
-    ctx->zf = zipOpen2_64(ctx->path.c_str(), 0, nullptr, &ctx->z_func);
+    ctx->zf = zipOpen2_64(ctx->path.c_str(),
+                          append ? APPEND_STATUS_ADDINZIP
+                                 : APPEND_STATUS_CREATE,
+                          nullptr, &ctx->z_func);
     if (!ctx->zf) {
         free(ctx);
         return nullptr;
@@ -224,6 +315,38 @@ MinizipUtils::ZipCtx * MinizipUtils::open_output_file(std::string path)
     return ctx;
 }
 
+/*!
+ * \brief Write a zip file to an open File
+ *
+ * This is mainly useful for building zip files in a MemoryFile. \p file must
+ * be readable, writable, and seekable and must outlive the returned context.
+ * It is not closed by close_output_file().
+ */
+MinizipUtils::ZipCtx * MinizipUtils::open_output_file(File &file)
+{
+    ZipCtx *ctx = new(std::nothrow) ZipCtx();
+    if (!ctx) {
+        return nullptr;
+    }
+
+    ctx->z_func.zopen64_file = &file_open_cb;
+    ctx->z_func.zread_file = &file_read_cb;
+    ctx->z_func.zwrite_file = &file_write_cb;
+    ctx->z_func.ztell64_file = &file_tell_cb;
+    ctx->z_func.zseek64_file = &file_seek_cb;
+    ctx->z_func.zclose_file = &file_close_cb;
+    ctx->z_func.zerror_file = &file_error_cb;
+    ctx->z_func.opaque = &file;
+
+    ctx->zf = zipOpen2_64("", APPEND_STATUS_CREATE, nullptr, &ctx->z_func);
+    if (!ctx->zf) {
+        delete ctx;
+        return nullptr;
+    }
+
+    return ctx;
+}
+
 int MinizipUtils::close_input_file(UnzCtx *ctx)
 {
     int ret = unzClose(ctx->uf);
@@ -368,6 +491,12 @@ bool MinizipUtils::copy_file_raw(unzFile uf,
     zfi.internal_fa = ufi.internal_fa;
     zfi.external_fa = ufi.external_fa;
 
+    IoBuffer buf;
+    if (!buf.allocate(MINIZIP_BUF_SIZE)) {
+        LOGE("Failed to allocate buffer: %s", strerror(errno));
+        return false;
+    }
+
     int method;
     int level;
 
@@ -408,12 +537,11 @@ bool MinizipUtils::copy_file_raw(unzFile uf,
 
     uint64_t bytes = 0;
 
-    // minizip no longer supports buffers larger than UINT16_MAX
-    char buf[UINT16_MAX];
     int bytes_read;
     double ratio;
 
-    while ((bytes_read = unzReadCurrentFile(uf, buf, sizeof(buf))) > 0) {
+    while ((bytes_read = unzReadCurrentFile(
+            uf, buf.data(), MINIZIP_READ_SIZE)) > 0) {
         bytes += bytes_read;
         if (cb) {
             // Scale this to the uncompressed size for the purposes of a
@@ -422,7 +550,7 @@ bool MinizipUtils::copy_file_raw(unzFile uf,
             cb(ratio * ufi.uncompressed_size, userData);
         }
 
-        ret = zipWriteInFileInZip(zf, buf, bytes_read);
+        ret = zipWriteInFileInZip(zf, buf.data(), bytes_read);
         if (ret != ZIP_OK) {
             LOGE("minizip: Failed to write data to inner file: %s",
                  zip_error_string(ret).c_str());
@@ -454,19 +582,54 @@ bool MinizipUtils::copy_file_raw(unzFile uf,
     return bytes_read == 0 && close_success;
 }
 
-bool MinizipUtils::read_to_memory(unzFile uf,
-                                  std::vector<unsigned char> *output,
-                                  void (*cb)(uint64_t bytes, void *),
-                                  void *userData)
+/*!
+ * \brief Read the current entry into memory if it fits within a budget
+ *
+ * If the entry's uncompressed size is at most \p budget bytes, exactly that
+ * much memory is reserved and the entry is inflated directly into \p output.
+ * Otherwise, the entry is inflated through a fixed-size window and each window
+ * is passed to \p window_cb, so that the memory usage does not depend on the
+ * size of the entry.
+ *
+ * \param uf Input zip file positioned at the entry to read
+ * \param budget Maximum number of bytes to read into memory
+ * \param[out] output Contents of the entry if it was not streamed
+ * \param[out] streamed Whether the entry was passed to \p window_cb instead
+ * \param window_cb Callback receiving the data of oversized entries. If
+ *                  nullptr, reading an oversized entry fails. Returning false
+ *                  aborts the read.
+ * \param userdata User data for \p window_cb
+ *
+ * \return Whether the entry was successfully read
+ */
+bool MinizipUtils::read_to_string(unzFile uf,
+                                  uint64_t budget,
+                                  std::string *output,
+                                  bool *streamed,
+                                  ReadWindowCb window_cb,
+                                  void *userdata)
 {
     unz_file_info64 fi;
+    std::string filename;
+
+    if (!get_info(uf, &fi, &filename)) {
+        return false;
+    }
 
-    if (!get_info(uf, &fi, nullptr)) {
+    *streamed = fi.uncompressed_size > budget;
+    output->clear();
+
+    if (*streamed && !window_cb) {
+        LOGE("%s: Entry size (%" PRIu64 ") exceeds memory budget "
+             "(%" PRIu64 ")", filename.c_str(), fi.uncompressed_size, budget);
         return false;
     }
 
-    std::vector<unsigned char> data;
-    data.reserve(fi.uncompressed_size);
+    IoBuffer buf;
+    if (!buf.allocate(MINIZIP_BUF_SIZE)) {
+        LOGE("Failed to allocate buffer: %s", strerror(errno));
+        return false;
+    }
 
     int ret = unzOpenCurrentFile(uf);
     if (ret != UNZ_OK) {
@@ -475,34 +638,67 @@ bool MinizipUtils::read_to_memory(unzFile uf,
         return false;
     }
 
-    int n;
-    char buf[32768];
+    bool success = true;
+    int n = 0;
 
-    while ((n = unzReadCurrentFile(uf, buf, sizeof(buf))) > 0) {
-        if (cb) {
-            cb(data.size() + n, userData);
+    if (*streamed) {
+        while ((n = unzReadCurrentFile(
+                uf, buf.data(), MINIZIP_READ_SIZE)) > 0) {
+            if (!window_cb(buf.data<char>(), static_cast<size_t>(n),
+                           userdata)) {
+                success = false;
+                break;
+            }
+        }
+    } else {
+        size_t size = static_cast<size_t>(fi.uncompressed_size);
+        size_t offset = 0;
+
+        output->resize(size);
+
+        while (offset < size) {
+            unsigned int to_read = static_cast<unsigned int>(
+                    std::min<size_t>(size - offset, 1u << 30));
+            n = unzReadCurrentFile(uf, &(*output)[offset], to_read);
+            if (n <= 0) {
+                break;
+            }
+            offset += static_cast<size_t>(n);
         }
 
-        data.insert(data.end(), buf, buf + n);
+        if (n >= 0 && offset == size) {
+            // The entry must not contain more data than its header claims
+            n = unzReadCurrentFile(uf, buf.data(), MINIZIP_READ_SIZE);
+            if (n > 0) {
+                LOGE("%s: Entry is larger than its declared size",
+                     filename.c_str());
+                success = false;
+            }
+        } else if (n == 0) {
+            LOGE("%s: Entry is smaller than its declared size",
+                 filename.c_str());
+            success = false;
+        }
     }
-    if (n != 0) {
+
+    if (n < 0) {
         LOGE("miniunz: Finished before reaching inner file's EOF: %s",
              unz_error_string(n).c_str());
+        success = false;
     }
 
     ret = unzCloseCurrentFile(uf);
     if (ret != UNZ_OK) {
         LOGE("miniunz: Failed to close inner file: %s",
              unz_error_string(ret).c_str());
-        return false;
+        success = false;
     }
 
-    if (n != 0) {
-        return false;
+    if (!success) {
+        output->clear();
     }
 
-    data.swap(*output);
-    return true;
+    return success;
 }
 
 bool MinizipUtils::extract_file(unzFile uf, const std::string &directory)
@@ -528,6 +724,12 @@ bool MinizipUtils::extract_file(unzFile uf, const std::string &directory)
              parent_path.c_str(), io::lastErrorString().c_str());
     }
 
+    IoBuffer buf;
+    if (!buf.allocate(MINIZIP_BUF_SIZE)) {
+        LOGE("Failed to allocate buffer: %s", strerror(errno));
+        return false;
+    }
+
     StandardFile file;
     int ret;
 
@@ -547,11 +749,10 @@ bool MinizipUtils::extract_file(unzFile uf, const std::string &directory)
     }
 
     int n;
-    char buf[32768];
     size_t bytes_written;
 
-    while ((n = unzReadCurrentFile(uf, buf, sizeof(buf))) > 0) {
-        if (!file.write(buf, n, bytes_written)) {
+    while ((n = unzReadCurrentFile(uf, buf.data(), MINIZIP_READ_SIZE)) > 0) {
+        if (!file.write(buf.data(), n, bytes_written)) {
             LOGE("%s: Failed to write file: %s",
                  full_path.c_str(), file.error_string().c_str());
             unzCloseCurrentFile(uf);
@@ -579,7 +780,7 @@ bool MinizipUtils::extract_file(unzFile uf, const std::string &directory)
     return n == 0;
 }
 
-static bool get_file_time(const std::string &filename, uint32_t *dostime)
+bool MinizipUtils::get_file_time(const std::string &filename, uint32_t *dostime)
 {
     // Don't fail when building with -Werror
     (void) filename;
@@ -687,6 +888,12 @@ ErrorCode MinizipUtils::add_file(zipFile zf,
                                  const std::string &name,
                                  const std::string &path)
 {
+    IoBuffer buf;
+    if (!buf.allocate(MINIZIP_BUF_SIZE)) {
+        LOGE("Failed to allocate buffer: %s", strerror(errno));
+        return ErrorCode::MemoryAllocationError;
+    }
+
     // Copy file into archive
     StandardFile file;
     bool file_ret;
@@ -740,12 +947,11 @@ ErrorCode MinizipUtils::add_file(zipFile zf,
     }
 
     // Write data to file
-    char buf[32768];
     size_t bytes_read;
 
-    while ((file_ret = file.read(buf, sizeof(buf), bytes_read))
+    while ((file_ret = file.read(buf.data(), MINIZIP_READ_SIZE, bytes_read))
             && bytes_read > 0) {
-        ret = zipWriteInFileInZip(zf, buf, bytes_read);
+        ret = zipWriteInFileInZip(zf, buf.data(), bytes_read);
         if (ret != ZIP_OK) {
             LOGE("minizip: Failed to write inner file data: %s",
                  zip_error_string(ret).c_str());
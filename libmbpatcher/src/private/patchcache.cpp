@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "mbpatcher/private/patchcache.h"
+
+#include <random>
+#include <vector>
+
+#include <cinttypes>
+#include <cstdio>
+
+#include "mbcommon/file/standard.h"
+#include "mbcommon/file_util.h"
+
+#include "mblog/logging.h"
+
+#include "mbpio/directory.h"
+
+#include "mbpatcher/private/fileutils.h"
+
+// FNV-1a 128-bit parameters
+#define FNV128_OFFSET_HI            0x6c62272e07bb0142ull
+#define FNV128_OFFSET_LO            0x62b821756295c58dull
+// The prime is 2^88 + FNV128_PRIME_LOW
+#define FNV128_PRIME_LOW            0x13bull
+
+#define COPY_BUF_SIZE               (1024 * 1024)
+
+
+namespace mb
+{
+namespace patcher
+{
+
+PatchCacheKey::PatchCacheKey()
+    : _hi(FNV128_OFFSET_HI)
+    , _lo(FNV128_OFFSET_LO)
+{
+}
+
+void PatchCacheKey::add(const void *data, size_t size)
+{
+    auto ptr = static_cast<const unsigned char *>(data);
+
+    for (size_t i = 0; i < size; ++i) {
+        _lo ^= ptr[i];
+
+        // Multiply (_hi, _lo) by 2^88 + FNV128_PRIME_LOW modulo 2^128
+        uint64_t a = (_lo & 0xffffffffull) * FNV128_PRIME_LOW;
+        uint64_t b = (_lo >> 32) * FNV128_PRIME_LOW;
+        uint64_t lo = a + (b << 32);
+        uint64_t carry = (b >> 32) + (lo < a ? 1 : 0);
+
+        _hi = _hi * FNV128_PRIME_LOW + carry + (_lo << 24);
+        _lo = lo;
+    }
+}
+
+void PatchCacheKey::add(const std::string &str)
+{
+    add(static_cast<uint64_t>(str.size()));
+    add(str.data(), str.size());
+}
+
+void PatchCacheKey::add(uint64_t value)
+{
+    unsigned char buf[8];
+
+    for (size_t i = 0; i < sizeof(buf); ++i) {
+        buf[i] = static_cast<unsigned char>(value >> (i * 8));
+    }
+
+    add(buf, sizeof(buf));
+}
+
+/*!
+ * \brief Add the contents of a file to the key
+ */
+ErrorCode PatchCacheKey::add_file(const std::string &path)
+{
+    std::vector<unsigned char> contents;
+
+    auto ret = FileUtils::read_to_memory(path, &contents);
+    if (ret != ErrorCode::NoError) {
+        return ret;
+    }
+
+    add(static_cast<uint64_t>(contents.size()));
+    add(contents.data(), contents.size());
+
+    return ErrorCode::NoError;
+}
+
+std::string PatchCacheKey::hex() const
+{
+    char buf[33];
+    snprintf(buf, sizeof(buf), "%016llx%016llx",
+             static_cast<unsigned long long>(_hi),
+             static_cast<unsigned long long>(_lo));
+    return buf;
+}
+
+/*!
+ * \brief Construct a patch cache
+ *
+ * \param directory Cache directory. The cache is disabled if empty.
+ */
+PatchCache::PatchCache(std::string directory)
+    : _directory(std::move(directory))
+{
+}
+
+bool PatchCache::enabled() const
+{
+    return !_directory.empty();
+}
+
+/*!
+ * \brief Copy a cached output to \p path
+ *
+ * \return Whether the output was in the cache and was copied successfully
+ */
+bool PatchCache::get_output(const std::string &key,
+                            const std::string &path) const
+{
+    if (!enabled()) {
+        return false;
+    }
+
+    std::string cached = path_for("outputs", key);
+    if (!exists(cached)) {
+        return false;
+    }
+
+    return copy_file(cached, path);
+}
+
+/*!
+ * \brief Store a copy of \p path as the cached output for \p key
+ */
+bool PatchCache::put_output(const std::string &key,
+                            const std::string &path) const
+{
+    return enabled() && store(path_for("outputs", key), path, nullptr);
+}
+
+/*!
+ * \brief Read a cached patched entry
+ *
+ * \return Whether the entry was in the cache
+ */
+bool PatchCache::get_entry(const std::string &key, std::string *contents) const
+{
+    if (!enabled()) {
+        return false;
+    }
+
+    std::string cached = path_for("entries", key);
+    if (!exists(cached)) {
+        return false;
+    }
+
+    return FileUtils::read_to_string(cached, contents) == ErrorCode::NoError;
+}
+
+/*!
+ * \brief Store a patched entry
+ */
+bool PatchCache::put_entry(const std::string &key,
+                           const std::string &contents) const
+{
+    return enabled() && store(path_for("entries", key), std::string(),
+                              &contents);
+}
+
+std::string PatchCache::path_for(const char *type,
+                                 const std::string &key) const
+{
+    std::string path(_directory);
+    path += '/';
+    path += type;
+    path += '/';
+    path += key;
+    return path;
+}
+
+/*!
+ * \brief Atomically store a file in the cache
+ *
+ * The data is copied from \p source_path or, if \p contents is not null,
+ * written from \p contents.
+ */
+bool PatchCache::store(const std::string &target,
+                       const std::string &source_path,
+                       const std::string *contents) const
+{
+    std::string dir = target.substr(0, target.find_last_of('/'));
+    if (!io::createDirectories(dir)) {
+        LOGW("%s: Failed to create cache directory", dir.c_str());
+        return false;
+    }
+
+    std::random_device rd;
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".tmp.%08x", rd());
+
+    std::string temp_path(target);
+    temp_path += suffix;
+
+    bool ret;
+    if (contents) {
+        ret = FileUtils::write_from_string(temp_path, *contents)
+                == ErrorCode::NoError;
+    } else {
+        ret = copy_file(source_path, temp_path);
+    }
+
+    if (ret && std::rename(temp_path.c_str(), target.c_str()) != 0) {
+        // Another patcher may have stored the same key in the meantime
+        LOGW("%s: Failed to rename to %s", temp_path.c_str(), target.c_str());
+        ret = false;
+    }
+
+    if (!ret) {
+        std::remove(temp_path.c_str());
+    }
+
+    return ret;
+}
+
+/*!
+ * \brief Check for a cache miss without logging an error
+ */
+bool PatchCache::exists(const std::string &path)
+{
+    StandardFile file;
+    return FileUtils::open_file(file, path, FileOpenMode::READ_ONLY)
+            == ErrorCode::NoError;
+}
+
+bool PatchCache::copy_file(const std::string &source,
+                           const std::string &target)
+{
+    StandardFile in;
+    StandardFile out;
+
+#ifdef _WIN32
+    // Both files are streamed front to back
+    in.set_hints(Win32FileHint::SequentialScan | Win32FileHint::ReadAhead);
+    out.set_hints(Win32FileHint::SequentialScan);
+#endif
+
+    if (FileUtils::open_file(in, source, FileOpenMode::READ_ONLY)
+            != ErrorCode::NoError) {
+        LOGE("%s: Failed to open for reading: %s",
+             source.c_str(), in.error_string().c_str());
+        return false;
+    }
+
+    if (FileUtils::open_file(out, target, FileOpenMode::WRITE_ONLY)
+            != ErrorCode::NoError) {
+        LOGE("%s: Failed to open for writing: %s",
+             target.c_str(), out.error_string().c_str());
+        return false;
+    }
+
+#ifdef _WIN32
+    uint64_t size;
+    if (in.seek(0, SEEK_END, &size) && in.seek(0, SEEK_SET, nullptr)) {
+        if (!out.preallocate(size)) {
+            LOGW("%s: Failed to preallocate %" PRIu64 " bytes: %s",
+                 target.c_str(), size, out.error_string().c_str());
+        }
+    } else {
+        LOGE("%s: Failed to seek: %s",
+             source.c_str(), in.error_string().c_str());
+        return false;
+    }
+#endif
+
+    std::vector<unsigned char> buf(COPY_BUF_SIZE);
+    size_t n;
+
+    while (true) {
+        if (!file_read_fully(in, buf.data(), buf.size(), n)) {
+            LOGE("%s: Failed to read: %s",
+                 source.c_str(), in.error_string().c_str());
+            return false;
+        } else if (n == 0) {
+            break;
+        }
+
+        size_t n_written;
+        if (!file_write_fully(out, buf.data(), n, n_written)
+                || n_written != n) {
+            LOGE("%s: Failed to write: %s",
+                 target.c_str(), out.error_string().c_str());
+            return false;
+        }
+    }
+
+    if (!out.close()) {
+        LOGE("%s: Failed to close: %s",
+             target.c_str(), out.error_string().c_str());
+        return false;
+    }
+
+    return true;
+}
+
+}
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbpatcher/private/phasetimer.h"
+
+#include <algorithm>
+#include <utility>
+
+
+namespace mb
+{
+namespace patcher
+{
+
+PhaseTimer::PhaseTimer(std::vector<Patcher::PhaseTime> &times,
+                       std::string name)
+    : _times(times)
+    , _name(std::move(name))
+    , _start(std::chrono::steady_clock::now())
+    , _running(true)
+{
+}
+
+PhaseTimer::~PhaseTimer()
+{
+    stop();
+}
+
+/*!
+ * \brief Stop the timer and record the elapsed time
+ *
+ * Calling this function more than once has no effect.
+ */
+void PhaseTimer::stop()
+{
+    if (!_running) {
+        return;
+    }
+    _running = false;
+
+    auto elapsed = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - _start).count());
+
+    auto it = std::find_if(_times.begin(), _times.end(),
+                           [&](const Patcher::PhaseTime &t) {
+        return t.name == _name;
+    });
+    if (it != _times.end()) {
+        it->elapsed_us += elapsed;
+    } else {
+        _times.push_back({_name, elapsed});
+    }
+}
+
+}
+}
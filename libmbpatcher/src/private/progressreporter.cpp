@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "mbpatcher/private/progressreporter.h"
+
+#include <chrono>
+#include <thread>
+
+
+namespace mb
+{
+namespace patcher
+{
+
+static int64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ProgressReporter::ProgressReporter()
+    : _progress_cb(nullptr)
+    , _files_cb(nullptr)
+    , _userdata(nullptr)
+    , _interval_ns(0)
+    , _bytes(0)
+    , _max_bytes(0)
+    , _files(0)
+    , _max_files(0)
+    , _next_sample_ns(0)
+    , _reported_bytes(0)
+    , _reported_max_bytes(0)
+    , _reported_files(0)
+    , _reported_max_files(0)
+{
+    _reporting.clear();
+}
+
+/*!
+ * \brief Reset the counters and set the callbacks for a patching operation
+ *
+ * \param progress_cb Callback for byte progress (may be nullptr)
+ * \param files_cb Callback for file progress (may be nullptr)
+ * \param userdata Pointer to pass to the callbacks
+ * \param rate_hz Maximum number of samples reported per second. If 0, changes
+ *                are reported immediately (concurrent updates from multiple
+ *                threads may still be coalesced).
+ */
+void ProgressReporter::start(Patcher::ProgressUpdatedCallback progress_cb,
+                             Patcher::FilesUpdatedCallback files_cb,
+                             void *userdata, unsigned int rate_hz)
+{
+    _progress_cb = progress_cb;
+    _files_cb = files_cb;
+    _userdata = userdata;
+    _interval_ns = rate_hz == 0 ? 0 : 1000000000 / rate_hz;
+
+    _bytes = 0;
+    _max_bytes = 0;
+    _files = 0;
+    _max_files = 0;
+    _next_sample_ns = 0;
+
+    _reported_bytes = 0;
+    _reported_max_bytes = 0;
+    _reported_files = 0;
+    _reported_max_files = 0;
+}
+
+/*!
+ * \brief Report the final values and clear the callbacks
+ *
+ * All threads that update the counters must have stopped before this is
+ * called.
+ */
+void ProgressReporter::finish()
+{
+    flush();
+
+    _progress_cb = nullptr;
+    _files_cb = nullptr;
+    _userdata = nullptr;
+}
+
+void ProgressReporter::set_bytes(uint64_t bytes, uint64_t max_bytes)
+{
+    _bytes.store(bytes, std::memory_order_relaxed);
+    _max_bytes.store(max_bytes, std::memory_order_relaxed);
+    sample(false);
+}
+
+void ProgressReporter::set_files(uint64_t files, uint64_t max_files)
+{
+    _files.store(files, std::memory_order_relaxed);
+    _max_files.store(max_files, std::memory_order_relaxed);
+    sample(false);
+}
+
+/*!
+ * \brief Report any unreported changes regardless of the sampling rate
+ */
+void ProgressReporter::flush()
+{
+    sample(true);
+}
+
+void ProgressReporter::sample(bool force)
+{
+    if (!_progress_cb && !_files_cb) {
+        return;
+    }
+
+    int64_t now = 0;
+
+    if (!force && _interval_ns > 0) {
+        now = now_ns();
+        if (now < _next_sample_ns.load(std::memory_order_relaxed)) {
+            return;
+        }
+    }
+
+    // Only one thread reports at a time. Others simply skip this sample
+    // since their values will be picked up by the next one.
+    while (_reporting.test_and_set(std::memory_order_acquire)) {
+        if (!force) {
+            return;
+        }
+        std::this_thread::yield();
+    }
+
+    if (_interval_ns > 0) {
+        if (now == 0) {
+            now = now_ns();
+        }
+        _next_sample_ns.store(now + _interval_ns, std::memory_order_relaxed);
+    }
+
+    uint64_t bytes = _bytes.load(std::memory_order_relaxed);
+    uint64_t max_bytes = _max_bytes.load(std::memory_order_relaxed);
+    uint64_t files = _files.load(std::memory_order_relaxed);
+    uint64_t max_files = _max_files.load(std::memory_order_relaxed);
+
+    if (_progress_cb && (bytes != _reported_bytes
+            || max_bytes != _reported_max_bytes)) {
+        _progress_cb(bytes, max_bytes, _userdata);
+        _reported_bytes = bytes;
+        _reported_max_bytes = max_bytes;
+    }
+
+    if (_files_cb && (files != _reported_files
+            || max_files != _reported_max_files)) {
+        _files_cb(files, max_files, _userdata);
+        _reported_files = files;
+        _reported_max_files = max_files;
+    }
+
+    _reporting.clear(std::memory_order_release);
+}
+
+}
+}
@@ -0,0 +1,319 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "mbpatcher/private/readaheadfile.h"
+
+#include <algorithm>
+#include <system_error>
+
+#include <cstdint>
+#include <cstdio>
+
+#include "mbcommon/file_util.h"
+
+#include "mblog/logging.h"
+
+#define NO_BLOCK                    SIZE_MAX
+
+
+namespace mb
+{
+namespace patcher
+{
+
+/*!
+ * \brief Construct a readahead reader
+ *
+ * \param file Opened file to read from, starting at its current position
+ * \param block_size Size of each block returned by read()
+ * \param block_count Number of blocks in the ring (must be at least 1)
+ */
+ReadaheadFile::ReadaheadFile(File &file, size_t block_size,
+                             size_t block_count)
+    : _file(file)
+    , _block_size(block_size)
+    , _blocks(std::max<size_t>(1, block_count))
+    , _threaded(false)
+    , _current(NO_BLOCK)
+    , _skip_pending(0)
+    , _eof(false)
+    , _stop(false)
+    , _error(ErrorCode::NoError)
+{
+    for (auto &block : _blocks) {
+        block.data.reset(new unsigned char[block_size]);
+        block.offset = 0;
+        block.size = 0;
+    }
+}
+
+ReadaheadFile::~ReadaheadFile()
+{
+    stop();
+}
+
+/*!
+ * \brief Start the reader thread
+ *
+ * If the thread cannot be started, read() and skip() will access the file
+ * directly.
+ */
+void ReadaheadFile::start()
+{
+    stop();
+
+    _free.clear();
+    _filled.clear();
+    for (size_t i = 0; i < _blocks.size(); ++i) {
+        _free.push_back(i);
+    }
+    _current = NO_BLOCK;
+    _skip_pending = 0;
+    _eof = false;
+    _stop = false;
+    _error = ErrorCode::NoError;
+    _error_string.clear();
+
+    try {
+        _thread = std::thread(&ReadaheadFile::reader, this);
+        _threaded = true;
+    } catch (const std::system_error &e) {
+        LOGW("Failed to start readahead thread: %s", e.what());
+    }
+}
+
+/*!
+ * \brief Stop the reader thread
+ *
+ * The file position is unspecified afterwards.
+ */
+void ReadaheadFile::stop()
+{
+    if (!_threaded) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+        _cv.notify_all();
+    }
+
+    _thread.join();
+    _threaded = false;
+}
+
+/*!
+ * \brief Get the next block of data
+ *
+ * \param[out] buffer Pointer to the data, which remains valid until the next
+ *                    call to read() or skip()
+ * \param[out] size Size of the data. 0 indicates EOF.
+ *
+ * \return Whether the data was successfully read. If false, error() and
+ *         error_string() return the cause.
+ */
+bool ReadaheadFile::read(const void **buffer, size_t *size)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    release_current();
+
+    if (!_threaded) {
+        Block &block = _blocks[0];
+        size_t n;
+
+        if (!file_read_fully(_file, block.data.get(), _block_size, n)) {
+            _error = ErrorCode::FileReadError;
+            _error_string = _file.error_string();
+            return false;
+        }
+
+        *buffer = block.data.get();
+        *size = n;
+        return true;
+    }
+
+    _cv.wait(lock, [this]{
+        return !_filled.empty() || _eof || _error != ErrorCode::NoError;
+    });
+
+    if (!_filled.empty()) {
+        _current = _filled.front();
+        _filled.pop_front();
+
+        Block &block = _blocks[_current];
+        *buffer = block.data.get() + block.offset;
+        *size = block.size - block.offset;
+        return true;
+    } else if (_error != ErrorCode::NoError) {
+        return false;
+    }
+
+    *buffer = _blocks[0].data.get();
+    *size = 0;
+    return true;
+}
+
+/*!
+ * \brief Skip data
+ *
+ * Buffered data is discarded first. The remainder is skipped by seeking the
+ * file on the reader thread, so seek errors may only be reported by a later
+ * call to read().
+ *
+ * \param size Number of bytes to skip
+ *
+ * \return Whether no error has occurred so far
+ */
+bool ReadaheadFile::skip(uint64_t size)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    release_current();
+
+    if (!_threaded) {
+        if (!_file.seek(static_cast<int64_t>(size), SEEK_CUR, nullptr)) {
+            _error = ErrorCode::FileSeekError;
+            _error_string = _file.error_string();
+            return false;
+        }
+        return true;
+    }
+
+    while (size > 0 && !_filled.empty()) {
+        Block &block = _blocks[_filled.front()];
+        size_t avail = block.size - block.offset;
+
+        if (avail <= size) {
+            size -= avail;
+            _free.push_back(_filled.front());
+            _filled.pop_front();
+        } else {
+            block.offset += static_cast<size_t>(size);
+            size = 0;
+        }
+    }
+
+    if (size > 0 && !_eof) {
+        _skip_pending += size;
+    }
+
+    _cv.notify_all();
+
+    return _error == ErrorCode::NoError;
+}
+
+ErrorCode ReadaheadFile::error() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _error;
+}
+
+std::string ReadaheadFile::error_string() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _error_string;
+}
+
+void ReadaheadFile::reader()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (true) {
+        _cv.wait(lock, [this]{
+            return _stop || (!_eof && _error == ErrorCode::NoError
+                    && (_skip_pending > 0 || !_free.empty()));
+        });
+
+        if (_stop) {
+            break;
+        }
+
+        if (_skip_pending > 0) {
+            uint64_t n = _skip_pending;
+            _skip_pending = 0;
+
+            lock.unlock();
+            bool ret = _file.seek(static_cast<int64_t>(n), SEEK_CUR, nullptr);
+            std::string msg = ret ? std::string() : _file.error_string();
+            lock.lock();
+
+            if (!ret) {
+                _error = ErrorCode::FileSeekError;
+                _error_string = msg;
+                _cv.notify_all();
+            }
+            continue;
+        }
+
+        size_t index = _free.front();
+        _free.pop_front();
+        Block &block = _blocks[index];
+
+        lock.unlock();
+        size_t n;
+        bool ret = file_read_fully(_file, block.data.get(), _block_size, n);
+        std::string msg = ret ? std::string() : _file.error_string();
+        lock.lock();
+
+        if (!ret) {
+            _error = ErrorCode::FileReadError;
+            _error_string = msg;
+            _free.push_back(index);
+            _cv.notify_all();
+            continue;
+        }
+
+        block.offset = 0;
+        block.size = n;
+
+        // Apply skips that were requested while the block was being read
+        if (_skip_pending > 0) {
+            size_t m = static_cast<size_t>(std::min<uint64_t>(_skip_pending, n));
+            block.offset = m;
+            _skip_pending -= m;
+        }
+
+        if (n < _block_size) {
+            _eof = true;
+        }
+
+        if (block.offset == block.size) {
+            _free.push_back(index);
+        } else {
+            _filled.push_back(index);
+        }
+
+        _cv.notify_all();
+    }
+}
+
+void ReadaheadFile::release_current()
+{
+    if (_current != NO_BLOCK) {
+        _free.push_back(_current);
+        _current = NO_BLOCK;
+        _cv.notify_all();
+    }
+}
+
+}
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbpatcher/private/tarmd5verifier.h"
+
+#include <algorithm>
+
+#include <cctype>
+#include <cstdio>
+
+
+// Largest trailer that will be recognized (checksum, separator, file name and
+// newline)
+#define TRAILER_MAX_SIZE            4096
+#define MD5_HEX_LENGTH              (2 * MD5_DIGEST_LENGTH)
+
+
+namespace mb
+{
+namespace patcher
+{
+
+TarMd5Verifier::TarMd5Verifier()
+{
+    MD5_Init(&_ctx);
+    _tail.reserve(TRAILER_MAX_SIZE);
+}
+
+/*!
+ * \brief Feed the next chunk of the file
+ */
+void TarMd5Verifier::update(const void *data, size_t size)
+{
+    auto ptr = static_cast<const unsigned char *>(data);
+
+    if (size >= TRAILER_MAX_SIZE) {
+        // Everything held back so far is definitely not part of the trailer
+        if (!_tail.empty()) {
+            MD5_Update(&_ctx, _tail.data(), _tail.size());
+        }
+        MD5_Update(&_ctx, ptr, size - TRAILER_MAX_SIZE);
+        _tail.assign(ptr + size - TRAILER_MAX_SIZE, ptr + size);
+        return;
+    }
+
+    _tail.insert(_tail.end(), ptr, ptr + size);
+
+    if (_tail.size() > TRAILER_MAX_SIZE) {
+        size_t excess = _tail.size() - TRAILER_MAX_SIZE;
+        MD5_Update(&_ctx, _tail.data(), excess);
+        _tail.erase(_tail.begin(), _tail.begin() + excess);
+    }
+}
+
+/*!
+ * \brief Locate the trailer and compare it against the computed checksum
+ *
+ * Must be called after all of the file has been passed to update(). The tar
+ * data before the trailer ends with zero-filled blocks, so the trailer is the
+ * text after the last NUL byte.
+ *
+ * \return Result::NoTrailer if the file does not end with a valid trailer
+ */
+TarMd5Verifier::Result TarMd5Verifier::finish()
+{
+    auto nul = std::find(_tail.rbegin(), _tail.rend(), '\0');
+    size_t start = static_cast<size_t>(_tail.rend() - nul);
+    size_t size = _tail.size() - start;
+    const unsigned char *trailer = _tail.data() + start;
+
+    if (size < MD5_HEX_LENGTH + 3 || trailer[size - 1] != '\n'
+            || trailer[MD5_HEX_LENGTH] != ' '
+            || trailer[MD5_HEX_LENGTH + 1] != ' '
+            || !std::all_of(trailer, trailer + MD5_HEX_LENGTH,
+                            [](unsigned char c) { return isxdigit(c); })) {
+        MD5_Update(&_ctx, _tail.data(), _tail.size());
+        _tail.clear();
+        return Result::NoTrailer;
+    }
+
+    MD5_Update(&_ctx, _tail.data(), start);
+
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5_Final(digest, &_ctx);
+
+    _expected.clear();
+    for (size_t i = 0; i < MD5_HEX_LENGTH; ++i) {
+        _expected += static_cast<char>(tolower(trailer[i]));
+    }
+
+    _actual.clear();
+    for (unsigned char c : digest) {
+        char hex[3];
+        snprintf(hex, sizeof(hex), "%02x", c);
+        _actual += hex;
+    }
+
+    _tail.clear();
+
+    return _expected == _actual ? Result::Match : Result::Mismatch;
+}
+
+/*!
+ * \brief Checksum from the trailer (valid after finish())
+ */
+const std::string & TarMd5Verifier::expected() const
+{
+    return _expected;
+}
+
+/*!
+ * \brief Computed checksum (valid after finish() found a trailer)
+ */
+const std::string & TarMd5Verifier::actual() const
+{
+    return _actual;
+}
+
+}
+}
@@ -0,0 +1,580 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbpatcher/private/zipbulkcopier.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <cstdio>
+#include <cstring>
+
+#include "mbcommon/endian.h"
+#include "mbcommon/file/standard.h"
+#include "mbcommon/file_util.h"
+
+#include "mblog/logging.h"
+
+#include "mbpatcher/private/fileutils.h"
+
+#define CD_SIGNATURE                0x02014b50u
+#define EOCD_SIGNATURE              0x06054b50u
+#define ZIP64_EOCD_SIGNATURE        0x06064b50u
+#define ZIP64_LOCATOR_SIGNATURE     0x07064b50u
+
+#define CD_HEADER_SIZE              46
+#define EOCD_SIZE                   22
+#define ZIP64_EOCD_SIZE             56
+#define ZIP64_LOCATOR_SIZE          20
+#define LOCAL_HEADER_SIZE           30
+
+#define ZIP64_EXTRA_ID              0x0001
+
+// Largest central directory that will be loaded into memory
+#define MAX_CD_SIZE                 (256 * 1024 * 1024)
+
+#define COPY_BUF_SIZE               (1024 * 1024)
+
+namespace mb
+{
+namespace patcher
+{
+
+typedef ZipBulkCopier::Entry CdEntry;
+
+static inline uint16_t load_le16(const unsigned char *ptr)
+{
+    uint16_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return mb_le16toh(value);
+}
+
+static inline uint32_t load_le32(const unsigned char *ptr)
+{
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return mb_le32toh(value);
+}
+
+static inline uint64_t load_le64(const unsigned char *ptr)
+{
+    uint64_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return mb_le64toh(value);
+}
+
+static inline void append_le16(std::vector<unsigned char> &buf, uint16_t value)
+{
+    value = mb_htole16(value);
+    auto ptr = reinterpret_cast<const unsigned char *>(&value);
+    buf.insert(buf.end(), ptr, ptr + sizeof(value));
+}
+
+static inline void append_le32(std::vector<unsigned char> &buf, uint32_t value)
+{
+    value = mb_htole32(value);
+    auto ptr = reinterpret_cast<const unsigned char *>(&value);
+    buf.insert(buf.end(), ptr, ptr + sizeof(value));
+}
+
+static inline void append_le64(std::vector<unsigned char> &buf, uint64_t value)
+{
+    value = mb_htole64(value);
+    auto ptr = reinterpret_cast<const unsigned char *>(&value);
+    buf.insert(buf.end(), ptr, ptr + sizeof(value));
+}
+
+static bool read_at(File &file, uint64_t offset, void *buf, size_t size)
+{
+    size_t n;
+
+    return file.seek(static_cast<int64_t>(offset), SEEK_SET, nullptr)
+            && file_read_fully(file, buf, size, n) && n == size;
+}
+
+static bool write_all(File &file, const void *buf, size_t size)
+{
+    size_t n;
+
+    return file_write_fully(file, buf, size, n) && n == size;
+}
+
+/*!
+ * \brief Locate and load the central directory
+ *
+ * \return Whether the archive has a supported layout. \p cd_offset is the
+ *         offset of the central directory and \p cd_end is the offset where
+ *         the end of central directory records begin
+ */
+static bool load_central_directory(File &file,
+                                   std::vector<unsigned char> &cd,
+                                   uint64_t &cd_offset, uint64_t &cd_entries,
+                                   uint64_t &cd_end,
+                                   std::vector<unsigned char> &comment)
+{
+    uint64_t file_size;
+    if (!file.seek(0, SEEK_END, &file_size) || file_size < EOCD_SIZE) {
+        return false;
+    }
+
+    // The EOCD record is followed by a comment of up to 65535 bytes
+    size_t tail_size = static_cast<size_t>(
+            std::min<uint64_t>(file_size, EOCD_SIZE + UINT16_MAX));
+    uint64_t tail_offset = file_size - tail_size;
+    std::vector<unsigned char> tail(tail_size);
+
+    if (!read_at(file, tail_offset, tail.data(), tail.size())) {
+        return false;
+    }
+
+    size_t eocd = SIZE_MAX;
+    for (size_t i = tail_size - EOCD_SIZE + 1; i-- > 0;) {
+        if (load_le32(tail.data() + i) == EOCD_SIGNATURE
+                && i + EOCD_SIZE + load_le16(tail.data() + i + 20)
+                        == tail_size) {
+            eocd = i;
+            break;
+        }
+    }
+    if (eocd == SIZE_MAX) {
+        return false;
+    }
+
+    const unsigned char *p = tail.data() + eocd;
+    uint16_t disk = load_le16(p + 4);
+    uint16_t cd_disk = load_le16(p + 6);
+    uint64_t entries = load_le16(p + 10);
+    uint64_t cd_size = load_le32(p + 12);
+    cd_offset = load_le32(p + 16);
+    cd_end = tail_offset + eocd;
+
+    comment.assign(p + EOCD_SIZE, p + EOCD_SIZE + load_le16(p + 20));
+
+    if (disk != 0 || cd_disk != 0) {
+        // Multi-disk archives are not supported
+        return false;
+    }
+
+    if (entries == UINT16_MAX || cd_size == UINT32_MAX
+            || cd_offset == UINT32_MAX) {
+        unsigned char locator[ZIP64_LOCATOR_SIZE];
+        unsigned char eocd64[ZIP64_EOCD_SIZE];
+
+        if (cd_end < ZIP64_LOCATOR_SIZE
+                || !read_at(file, cd_end - ZIP64_LOCATOR_SIZE, locator,
+                            sizeof(locator))
+                || load_le32(locator) != ZIP64_LOCATOR_SIGNATURE) {
+            return false;
+        }
+
+        uint64_t eocd64_offset = load_le64(locator + 8);
+        if (eocd64_offset + ZIP64_EOCD_SIZE > cd_end - ZIP64_LOCATOR_SIZE
+                || !read_at(file, eocd64_offset, eocd64, sizeof(eocd64))
+                || load_le32(eocd64) != ZIP64_EOCD_SIGNATURE
+                || load_le32(eocd64 + 16) != 0
+                || load_le32(eocd64 + 20) != 0) {
+            return false;
+        }
+
+        entries = load_le64(eocd64 + 32);
+        cd_size = load_le64(eocd64 + 40);
+        cd_offset = load_le64(eocd64 + 48);
+        cd_end = eocd64_offset;
+    }
+
+    if (cd_size > MAX_CD_SIZE || cd_offset > cd_end
+            || cd_size > cd_end - cd_offset) {
+        return false;
+    }
+
+    cd.resize(static_cast<size_t>(cd_size));
+    if (!read_at(file, cd_offset, cd.data(), cd.size())) {
+        return false;
+    }
+
+    cd_entries = entries;
+    return true;
+}
+
+static bool parse_central_directory(const std::vector<unsigned char> &cd,
+                                    uint64_t cd_entries,
+                                    std::vector<CdEntry> &entries)
+{
+    size_t pos = 0;
+
+    for (uint64_t i = 0; i < cd_entries; ++i) {
+        if (cd.size() - pos < CD_HEADER_SIZE) {
+            return false;
+        }
+
+        const unsigned char *p = cd.data() + pos;
+        if (load_le32(p) != CD_SIGNATURE) {
+            return false;
+        }
+
+        uint32_t uncompressed_size = load_le32(p + 24);
+        uint32_t compressed_size = load_le32(p + 20);
+        uint16_t name_size = load_le16(p + 28);
+        uint16_t extra_size = load_le16(p + 30);
+        uint16_t comment_size = load_le16(p + 32);
+        uint16_t disk = load_le16(p + 34);
+        uint32_t local_offset = load_le32(p + 42);
+
+        size_t record_size = CD_HEADER_SIZE + name_size + extra_size
+                + comment_size;
+        if (cd.size() - pos < record_size || (disk != 0 && disk != UINT16_MAX)) {
+            return false;
+        }
+
+        CdEntry entry;
+        entry.name.assign(reinterpret_cast<const char *>(p + CD_HEADER_SIZE),
+                          name_size);
+        entry.local_offset = local_offset;
+        entry.uncompressed_size = uncompressed_size;
+        entry.record_offset = pos;
+        entry.record_size = record_size;
+        entry.offset_field = 42;
+        entry.offset_field_size = 4;
+        entry.end_offset = 0;
+        entry.copy = false;
+
+        if (uncompressed_size == UINT32_MAX || compressed_size == UINT32_MAX
+                || local_offset == UINT32_MAX || disk == UINT16_MAX) {
+            // Find zip64 extended information extra field
+            size_t extra = CD_HEADER_SIZE + name_size;
+            size_t extra_end = extra + extra_size;
+            bool found = false;
+
+            while (extra + 4 <= extra_end) {
+                uint16_t id = load_le16(p + extra);
+                uint16_t size = load_le16(p + extra + 2);
+                size_t data = extra + 4;
+
+                if (data + size > extra_end) {
+                    return false;
+                }
+
+                if (id == ZIP64_EXTRA_ID) {
+                    size_t field = data;
+
+                    if (uncompressed_size == UINT32_MAX) {
+                        if (field + 8 > data + size) {
+                            return false;
+                        }
+                        entry.uncompressed_size = load_le64(p + field);
+                        field += 8;
+                    }
+                    if (compressed_size == UINT32_MAX) {
+                        field += 8;
+                    }
+                    if (local_offset == UINT32_MAX) {
+                        if (field + 8 > data + size) {
+                            return false;
+                        }
+                        entry.local_offset = load_le64(p + field);
+                        entry.offset_field = field;
+                        entry.offset_field_size = 8;
+                        field += 8;
+                    }
+                    if (disk == UINT16_MAX) {
+                        if (field + 4 > data + size
+                                || load_le32(p + field) != 0) {
+                            return false;
+                        }
+                    }
+
+                    found = true;
+                    break;
+                }
+
+                extra = data + size;
+            }
+
+            if (!found) {
+                return false;
+            }
+        }
+
+        entries.push_back(std::move(entry));
+        pos += record_size;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Open a zip file and parse its central directory
+ *
+ * \param input_path Input zip file
+ * \param[out] unsupported Set to whether the failure was caused by a zip
+ *                         layout that cannot be bulk copied (eg. multi-disk
+ *                         archives). The caller should fall back to reading
+ *                         the archive through minizip in that case.
+ *
+ * \return ErrorCode::NoError if successful or an error code if the file
+ *         cannot be opened or has an unsupported layout
+ */
+ErrorCode ZipBulkCopier::open(const std::string &input_path, bool *unsupported)
+{
+    *unsupported = false;
+
+    _input_path = input_path;
+    _cd.clear();
+    _comment.clear();
+    _entries.clear();
+    _sorted.clear();
+
+    ErrorCode ret = FileUtils::open_file(_input, input_path,
+                                         FileOpenMode::READ_ONLY);
+    if (ret != ErrorCode::NoError) {
+        LOGE("%s: Failed to open for reading: %s",
+             input_path.c_str(), _input.error_string().c_str());
+        return ret;
+    }
+
+    uint64_t cd_entries;
+    uint64_t cd_end;
+
+    if (!load_central_directory(_input, _cd, _cd_offset, cd_entries, cd_end,
+                                _comment)
+            || !parse_central_directory(_cd, cd_entries, _entries)) {
+        LOGW("%s: Unsupported zip layout for bulk copying",
+             input_path.c_str());
+        *unsupported = true;
+        return ErrorCode::ArchiveReadHeaderError;
+    }
+
+    // Entries in file order. Each entry's data extends to the start of the
+    // next entry (or the central directory), which covers data descriptors.
+    _sorted.reserve(_entries.size());
+    for (auto &entry : _entries) {
+        _sorted.push_back(&entry);
+    }
+    std::sort(_sorted.begin(), _sorted.end(),
+              [](const CdEntry *a, const CdEntry *b) {
+        return a->local_offset < b->local_offset;
+    });
+
+    for (size_t i = 0; i < _sorted.size(); ++i) {
+        uint64_t end = i + 1 < _sorted.size()
+                ? _sorted[i + 1]->local_offset : _cd_offset;
+        if (end < _sorted[i]->local_offset + LOCAL_HEADER_SIZE) {
+            // Overlapping or truncated entries
+            LOGW("%s: Unsupported zip layout for bulk copying",
+                 input_path.c_str());
+            *unsupported = true;
+            return ErrorCode::ArchiveReadHeaderError;
+        }
+        _sorted[i]->end_offset = end;
+    }
+
+    return ErrorCode::NoError;
+}
+
+/*!
+ * \brief Entries in the central directory of the opened zip file
+ */
+const std::vector<ZipBulkCopier::Entry> & ZipBulkCopier::entries() const
+{
+    return _entries;
+}
+
+/*!
+ * \brief Raw central directory of the opened zip file
+ */
+const std::vector<unsigned char> & ZipBulkCopier::central_directory() const
+{
+    return _cd;
+}
+
+/*!
+ * \brief Copy entries from the opened zip file in bulk
+ *
+ * \param output_path Output zip file (will be overwritten)
+ * \param filter_cb Callback that returns whether an entry should be copied
+ * \param copied_cb Callback invoked after each entry is copied. Returning
+ *                  false cancels the copy.
+ * \param userdata User data for the callbacks
+ *
+ * \return ErrorCode::NoError if successful, ErrorCode::PatchingCancelled if
+ *         cancelled, or an I/O error code
+ */
+ErrorCode ZipBulkCopier::copy(const std::string &output_path,
+                              FilterCb filter_cb, CopiedCb copied_cb,
+                              void *userdata)
+{
+    StandardFile output;
+    ErrorCode ret;
+
+    for (auto &entry : _entries) {
+        entry.copy = filter_cb(entry.name, userdata);
+    }
+
+    ret = FileUtils::open_file(output, output_path, FileOpenMode::WRITE_ONLY);
+    if (ret != ErrorCode::NoError) {
+        LOGE("%s: Failed to open for writing: %s",
+             output_path.c_str(), output.error_string().c_str());
+        return ret;
+    }
+
+    std::vector<unsigned char> buf(COPY_BUF_SIZE);
+    // Maps local header offsets from the input to the output
+    std::vector<uint64_t> new_offsets(_entries.size());
+    uint64_t out_offset = 0;
+
+    for (size_t i = 0; i < _sorted.size();) {
+        if (!_sorted[i]->copy) {
+            ++i;
+            continue;
+        }
+
+        // Find run of consecutive entries to copy
+        size_t run_end = i;
+        while (run_end < _sorted.size() && _sorted[run_end]->copy) {
+            ++run_end;
+        }
+
+        uint64_t run_offset = _sorted[i]->local_offset;
+        uint64_t remaining = _sorted[run_end - 1]->end_offset - run_offset;
+        uint64_t in_offset = run_offset;
+
+        if (!_input.seek(static_cast<int64_t>(run_offset), SEEK_SET, nullptr)) {
+            LOGE("%s: Failed to seek: %s",
+                 _input_path.c_str(), _input.error_string().c_str());
+            return ErrorCode::FileSeekError;
+        }
+
+        while (remaining > 0) {
+            size_t to_read = static_cast<size_t>(
+                    std::min<uint64_t>(remaining, buf.size()));
+            size_t n;
+
+            if (!file_read_fully(_input, buf.data(), to_read, n)
+                    || n != to_read) {
+                LOGE("%s: Failed to read: %s",
+                     _input_path.c_str(), _input.error_string().c_str());
+                return ErrorCode::FileReadError;
+            }
+
+            if (!write_all(output, buf.data(), n)) {
+                LOGE("%s: Failed to write: %s",
+                     output_path.c_str(), output.error_string().c_str());
+                return ErrorCode::FileWriteError;
+            }
+
+            remaining -= n;
+            in_offset += n;
+
+            // Report entries that were fully copied
+            for (; i < run_end && _sorted[i]->end_offset <= in_offset; ++i) {
+                new_offsets[_sorted[i] - _entries.data()] =
+                        out_offset + (_sorted[i]->local_offset - run_offset);
+
+                if (!copied_cb(_sorted[i]->name, _sorted[i]->uncompressed_size,
+                               userdata)) {
+                    return ErrorCode::PatchingCancelled;
+                }
+            }
+        }
+
+        out_offset += in_offset - run_offset;
+    }
+
+    // Write central directory in the original order
+    std::vector<unsigned char> new_cd;
+    uint64_t new_entries = 0;
+
+    for (size_t i = 0; i < _entries.size(); ++i) {
+        const CdEntry &entry = _entries[i];
+        if (!entry.copy) {
+            continue;
+        }
+
+        size_t record = new_cd.size();
+        new_cd.insert(new_cd.end(),
+                      _cd.begin() + entry.record_offset,
+                      _cd.begin() + entry.record_offset + entry.record_size);
+
+        // Entries only move towards the beginning of the file, so the new
+        // offset always fits in the existing field
+        unsigned char *field = new_cd.data() + record + entry.offset_field;
+        if (entry.offset_field_size == 8) {
+            uint64_t value = mb_htole64(new_offsets[i]);
+            memcpy(field, &value, sizeof(value));
+        } else {
+            uint32_t value = mb_htole32(static_cast<uint32_t>(new_offsets[i]));
+            memcpy(field, &value, sizeof(value));
+        }
+
+        ++new_entries;
+    }
+
+    uint64_t new_cd_offset = out_offset;
+    uint64_t new_cd_size = new_cd.size();
+    bool zip64 = new_entries >= UINT16_MAX || new_cd_offset >= UINT32_MAX
+            || new_cd_size >= UINT32_MAX;
+
+    if (zip64) {
+        uint64_t eocd64_offset = new_cd_offset + new_cd_size;
+
+        append_le32(new_cd, ZIP64_EOCD_SIGNATURE);
+        append_le64(new_cd, ZIP64_EOCD_SIZE - 12);
+        append_le16(new_cd, 45);
+        append_le16(new_cd, 45);
+        append_le32(new_cd, 0);
+        append_le32(new_cd, 0);
+        append_le64(new_cd, new_entries);
+        append_le64(new_cd, new_entries);
+        append_le64(new_cd, new_cd_size);
+        append_le64(new_cd, new_cd_offset);
+
+        append_le32(new_cd, ZIP64_LOCATOR_SIGNATURE);
+        append_le32(new_cd, 0);
+        append_le64(new_cd, eocd64_offset);
+        append_le32(new_cd, 1);
+    }
+
+    append_le32(new_cd, EOCD_SIGNATURE);
+    append_le16(new_cd, 0);
+    append_le16(new_cd, 0);
+    append_le16(new_cd, zip64 ? UINT16_MAX : static_cast<uint16_t>(new_entries));
+    append_le16(new_cd, zip64 ? UINT16_MAX : static_cast<uint16_t>(new_entries));
+    append_le32(new_cd, zip64 ? UINT32_MAX : static_cast<uint32_t>(new_cd_size));
+    append_le32(new_cd, zip64 ? UINT32_MAX
+                              : static_cast<uint32_t>(new_cd_offset));
+    append_le16(new_cd, static_cast<uint16_t>(_comment.size()));
+    new_cd.insert(new_cd.end(), _comment.begin(), _comment.end());
+
+    if (!write_all(output, new_cd.data(), new_cd.size())) {
+        LOGE("%s: Failed to write: %s",
+             output_path.c_str(), output.error_string().c_str());
+        return ErrorCode::FileWriteError;
+    }
+
+    if (!output.close()) {
+        LOGE("%s: Failed to close: %s",
+             output_path.c_str(), output.error_string().c_str());
+        return ErrorCode::FileCloseError;
+    }
+
+    return ErrorCode::NoError;
+}
+
+}
+}
@@ -0,0 +1,439 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "mbpatcher/private/zipentrycompressor.h"
+
+#include <algorithm>
+#include <thread>
+
+#include <cstring>
+
+#include <zlib.h>
+
+#include "mblog/logging.h"
+
+#include "mbpatcher/private/fileutils.h"
+#include "mbpatcher/private/miniziputils.h"
+
+// Same value minizip uses for deflateInit2()
+#define DEFLATE_MEM_LEVEL           8
+
+#define DEFLATE_CHUNK_SIZE          (256 * 1024)
+#define WRITE_CHUNK_SIZE            (1024 * 1024)
+
+
+namespace mb
+{
+namespace patcher
+{
+
+/*!
+ * \brief Construct a compressor
+ *
+ * \param threads Number of threads to compress with (including the thread
+ *                calling write()). If 0, the number of CPUs is used.
+ */
+ZipEntryCompressor::ZipEntryCompressor(unsigned int threads)
+    : _threads(threads)
+    , _next(0)
+    , _stop(false)
+{
+    if (_threads == 0) {
+        _threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+}
+
+ZipEntryCompressor::~ZipEntryCompressor()
+{
+}
+
+/*!
+ * \brief Queue an in-memory file
+ *
+ * \param name Path of the file in the zip file
+ * \param contents Uncompressed contents of the file
+ */
+void ZipEntryCompressor::add_file(const std::string &name,
+                                  std::vector<unsigned char> contents)
+{
+    std::unique_ptr<Entry> entry(new Entry());
+    entry->name = name;
+    entry->contents = std::move(contents);
+    entry->dos_date = 0;
+    entry->cache = false;
+    entry->error = ErrorCode::NoError;
+    entry->done = false;
+    _entries.push_back(std::move(entry));
+}
+
+/*!
+ * \brief Queue a file on disk
+ *
+ * The file is read by the thread that compresses it.
+ *
+ * \param name Path of the file in the zip file
+ * \param path Path of the input file
+ */
+void ZipEntryCompressor::add_file(const std::string &name,
+                                  const std::string &path)
+{
+    std::unique_ptr<Entry> entry(new Entry());
+    entry->name = name;
+    entry->path = path;
+    entry->dos_date = 0;
+    entry->cache = false;
+    entry->error = ErrorCode::NoError;
+    entry->done = false;
+    _entries.push_back(std::move(entry));
+}
+
+/*!
+ * \brief Queue a file on disk whose compressed data is shared with later uses
+ *
+ * This is meant for static files that are added to many zip files, such as the
+ * mbtool binaries. The cache is keyed by \p path and an entry is only reused
+ * if the file's size, CRC32, and modification time are unchanged, so the file
+ * is still read each time, but only compressed once.
+ *
+ * \param name Path of the file in the zip file
+ * \param path Path of the input file
+ */
+void ZipEntryCompressor::add_cached_file(const std::string &name,
+                                         const std::string &path)
+{
+    add_file(name, path);
+    _entries.back()->cache = true;
+}
+
+/*!
+ * \brief Drop all compressed files shared by add_cached_file()
+ */
+void ZipEntryCompressor::clear_cache()
+{
+    std::lock_guard<std::mutex> lock(cache_mutex());
+    cache().clear();
+}
+
+std::mutex & ZipEntryCompressor::cache_mutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
+std::unordered_map<std::string,
+                   std::shared_ptr<const ZipEntryCompressor::CachedFile>> &
+ZipEntryCompressor::cache()
+{
+    static std::unordered_map<std::string, std::shared_ptr<const CachedFile>>
+            files;
+    return files;
+}
+
+/*!
+ * \brief Compress the queued files and add them to a zip file
+ *
+ * The entries are written in the order they were queued. The queue is empty
+ * after this function returns, regardless of whether it succeeds.
+ *
+ * \param zf Output zip file
+ * \param cb Callback invoked after each entry is written. Returning false
+ *           cancels the operation. May be nullptr.
+ * \param userdata User data for the callback
+ *
+ * \return ErrorCode::NoError if successful, ErrorCode::PatchingCancelled if
+ *         cancelled, or the first error that occurred
+ */
+ErrorCode ZipEntryCompressor::write(zipFile zf, WrittenCb cb, void *userdata)
+{
+    TaskGroup workers;
+    ErrorCode ret = ErrorCode::NoError;
+
+    _next = 0;
+    _stop = false;
+
+    // The calling thread also compresses entries while waiting
+    size_t n_workers = std::min<size_t>(_threads, _entries.size());
+    if (n_workers > 0) {
+        --n_workers;
+    }
+
+    for (size_t i = 0; i < n_workers; ++i) {
+        workers.run([this] { worker(); }, CoreHint::Performance);
+    }
+
+    for (size_t i = 0; i < _entries.size(); ++i) {
+        Entry &entry = *_entries[i];
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+
+            while (!entry.done) {
+                // Entries are claimed in order, so if this entry has not been
+                // picked up by a worker, it is the next one
+                if (_next == i) {
+                    compress_next(lock);
+                } else {
+                    _cv.wait(lock);
+                }
+            }
+        }
+
+        if (entry.error != ErrorCode::NoError) {
+            ret = entry.error;
+            break;
+        }
+
+        ret = write_entry(zf, entry);
+        if (ret != ErrorCode::NoError) {
+            break;
+        }
+
+        // Release the buffers as soon as the entry has been written
+        std::vector<unsigned char>().swap(entry.contents);
+        std::vector<unsigned char>().swap(entry.compressed);
+        entry.cached.reset();
+
+        if (cb && !cb(entry.name, userdata)) {
+            ret = ErrorCode::PatchingCancelled;
+            break;
+        }
+    }
+
+    stop_workers(workers);
+    _entries.clear();
+
+    return ret;
+}
+
+void ZipEntryCompressor::worker()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (compress_next(lock));
+}
+
+/*!
+ * \brief Claim and compress the next entry
+ *
+ * \pre \p lock is locked
+ *
+ * \return Whether an entry was compressed
+ */
+bool ZipEntryCompressor::compress_next(std::unique_lock<std::mutex> &lock)
+{
+    if (_stop || _next == _entries.size()) {
+        return false;
+    }
+
+    Entry &entry = *_entries[_next++];
+
+    lock.unlock();
+    ErrorCode ret = compress(entry);
+    lock.lock();
+
+    entry.error = ret;
+    entry.done = true;
+    _cv.notify_all();
+
+    return true;
+}
+
+void ZipEntryCompressor::stop_workers(TaskGroup &workers)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+
+    workers.wait();
+}
+
+ErrorCode ZipEntryCompressor::compress(Entry &entry)
+{
+    if (!entry.path.empty()) {
+        auto ret = FileUtils::read_to_memory(entry.path, &entry.contents);
+        if (ret != ErrorCode::NoError) {
+            return ret;
+        }
+
+        if (!MinizipUtils::get_file_time(entry.path, &entry.dos_date)) {
+            LOGE("%s: Failed to get modification time", entry.path.c_str());
+            return ErrorCode::FileOpenError;
+        }
+    }
+
+    if (entry.cache) {
+        uint32_t crc = crc32(0, nullptr, 0);
+        for (size_t offset = 0; offset < entry.contents.size();
+                offset += DEFLATE_CHUNK_SIZE) {
+            crc = crc32(crc, entry.contents.data() + offset,
+                        static_cast<uInt>(std::min<size_t>(
+                                DEFLATE_CHUNK_SIZE,
+                                entry.contents.size() - offset)));
+        }
+
+        std::shared_ptr<const CachedFile> cached;
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex());
+            auto it = cache().find(entry.path);
+            if (it != cache().end()) {
+                cached = it->second;
+            }
+        }
+
+        if (cached && cached->uncompressed_size == entry.contents.size()
+                && cached->crc == crc && cached->dos_date == entry.dos_date) {
+            entry.cached = std::move(cached);
+            entry.uncompressed_size = entry.cached->uncompressed_size;
+            entry.crc = entry.cached->crc;
+            std::vector<unsigned char>().swap(entry.contents);
+            return ErrorCode::NoError;
+        }
+    }
+
+    const unsigned char *in = entry.contents.data();
+    size_t remaining = entry.contents.size();
+
+    entry.uncompressed_size = remaining;
+    entry.crc = crc32(0, nullptr, 0);
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+
+    // Raw deflate stream with minizip's default parameters
+    int ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                           -MAX_WBITS, DEFLATE_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        LOGE("zlib: Failed to initialize deflate: %d", ret);
+        return ErrorCode::ArchiveWriteDataError;
+    }
+
+    std::vector<unsigned char> buf(DEFLATE_CHUNK_SIZE);
+    int flush;
+
+    do {
+        uInt n = static_cast<uInt>(
+                std::min<size_t>(remaining, DEFLATE_CHUNK_SIZE));
+
+        entry.crc = crc32(entry.crc, in, n);
+
+        strm.next_in = const_cast<unsigned char *>(in);
+        strm.avail_in = n;
+        in += n;
+        remaining -= n;
+        flush = remaining == 0 ? Z_FINISH : Z_NO_FLUSH;
+
+        do {
+            strm.next_out = buf.data();
+            strm.avail_out = static_cast<uInt>(buf.size());
+
+            ret = deflate(&strm, flush);
+            if (ret == Z_STREAM_ERROR) {
+                LOGE("%s: zlib: Failed to deflate data", entry.name.c_str());
+                deflateEnd(&strm);
+                return ErrorCode::ArchiveWriteDataError;
+            }
+
+            entry.compressed.insert(entry.compressed.end(), buf.data(),
+                                    buf.data() + buf.size() - strm.avail_out);
+        } while (strm.avail_out == 0);
+    } while (flush != Z_FINISH);
+
+    deflateEnd(&strm);
+
+    // The uncompressed data is no longer needed
+    std::vector<unsigned char>().swap(entry.contents);
+
+    if (entry.cache) {
+        std::shared_ptr<CachedFile> cached(new CachedFile());
+        cached->compressed = std::move(entry.compressed);
+        cached->uncompressed_size = entry.uncompressed_size;
+        cached->crc = entry.crc;
+        cached->dos_date = entry.dos_date;
+        entry.cached = cached;
+
+        std::lock_guard<std::mutex> lock(cache_mutex());
+        cache()[entry.path] = std::move(cached);
+    }
+
+    return ErrorCode::NoError;
+}
+
+ErrorCode ZipEntryCompressor::write_entry(zipFile zf, const Entry &entry)
+{
+    bool zip64 = entry.uncompressed_size >= ((1ull << 32) - 1);
+
+    zip_fileinfo zi;
+    memset(&zi, 0, sizeof(zi));
+    zi.dos_date = entry.dos_date;
+
+    int ret = zipOpenNewFileInZip2_64(
+        zf,                     // file
+        entry.name.c_str(),     // filename
+        &zi,                    // zip_fileinfo
+        nullptr,                // extrafield_local
+        0,                      // size_extrafield_local
+        nullptr,                // extrafield_global
+        0,                      // size_extrafield_global
+        nullptr,                // comment
+        Z_DEFLATED,             // method
+        Z_DEFAULT_COMPRESSION,  // level
+        1,                      // raw
+        zip64                   // zip64
+    );
+    if (ret != ZIP_OK) {
+        LOGE("minizip: Failed to open inner file: %s",
+             MinizipUtils::zip_error_string(ret).c_str());
+        return ErrorCode::ArchiveWriteDataError;
+    }
+
+    const std::vector<unsigned char> &compressed =
+            entry.cached ? entry.cached->compressed : entry.compressed;
+    const unsigned char *ptr = compressed.data();
+    size_t remaining = compressed.size();
+
+    while (remaining > 0) {
+        unsigned int n = static_cast<unsigned int>(
+                std::min<size_t>(remaining, WRITE_CHUNK_SIZE));
+
+        ret = zipWriteInFileInZip(zf, ptr, n);
+        if (ret != ZIP_OK) {
+            LOGE("minizip: Failed to write inner file data: %s",
+                 MinizipUtils::zip_error_string(ret).c_str());
+            zipCloseFileInZipRaw64(zf, entry.uncompressed_size, entry.crc);
+            return ErrorCode::ArchiveWriteDataError;
+        }
+
+        ptr += n;
+        remaining -= n;
+    }
+
+    ret = zipCloseFileInZipRaw64(zf, entry.uncompressed_size, entry.crc);
+    if (ret != ZIP_OK) {
+        LOGE("minizip: Failed to close inner file: %s",
+             MinizipUtils::zip_error_string(ret).c_str());
+        return ErrorCode::ArchiveWriteDataError;
+    }
+
+    return ErrorCode::NoError;
+}
+
+}
+}
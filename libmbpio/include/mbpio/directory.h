@@ -20,10 +20,30 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 namespace io
 {
 
+enum class FileType
+{
+    // Type could not be determined
+    Unknown,
+    Regular,
+    Directory,
+    // Symlinks on POSIX and reparse points (including junctions) on Windows
+    Symlink,
+    Other,
+};
+
+struct DirectoryEntry
+{
+    std::string name;
+    FileType type;
+};
+
 bool createDirectories(const std::string &path);
+bool listDirectory(const std::string &path,
+                   std::vector<DirectoryEntry> &entries);
 
 }
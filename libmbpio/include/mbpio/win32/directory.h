@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <windows.h>
+
+#include "mbpio/directory.h"
+
+namespace io
+{
+namespace win32
+{
+
+struct FindEntry
+{
+    std::wstring name;
+    DWORD attributes;
+};
+
+bool findEntries(const std::wstring &path, std::vector<FindEntry> &entries);
+bool listDirectory(const std::string &path,
+                   std::vector<DirectoryEntry> &entries);
+
+}
+}
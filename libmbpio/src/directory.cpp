@@ -30,10 +30,12 @@
 #include "mbpio/private/string.h"
 
 #if IO_PLATFORM_WINDOWS
+#include "mbpio/win32/directory.h"
 #include "mbpio/win32/error.h"
 #else
 #include <cerrno>
 #include <sys/stat.h>
+#include "mbpio/posix/directory.h"
 #endif
 
 namespace io
@@ -104,4 +106,28 @@ bool createDirectories(const std::string &path)
     return true;
 }
 
+/*!
+ * \brief List the entries in a directory
+ *
+ * Entries are fetched in large batches (`getdents64()` on Linux and
+ * `FindFirstFileExW()` with `FIND_FIRST_EX_LARGE_FETCH` on Windows) and their
+ * types are taken from the enumeration results instead of stat'ing every
+ * entry. "." and ".." are not included. The order of the entries is
+ * unspecified.
+ *
+ * \param path Directory path
+ * \param entries Output list of entries
+ *
+ * \return Whether the directory was successfully listed
+ */
+bool listDirectory(const std::string &path,
+                   std::vector<DirectoryEntry> &entries)
+{
+#if IO_PLATFORM_WINDOWS
+    return win32::listDirectory(path, entries);
+#else
+    return posix::listDirectory(path, entries);
+#endif
+}
+
 }
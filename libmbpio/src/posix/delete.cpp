@@ -19,12 +19,16 @@
 
 #include "mbpio/posix/delete.h"
 
+#include <vector>
+
 #include <cerrno>
 #include <cstring>
 
-#include <ftw.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "mbpio/error.h"
+#include "mbpio/posix/directory.h"
 #include "mbpio/private/string.h"
 
 namespace io
@@ -32,24 +36,88 @@ namespace io
 namespace posix
 {
 
-static int deleteCbNftw(const char *fpath, const struct stat *sb,
-                        int typeflag, struct FTW *ftwbuf)
+/*!
+ * \brief Delete the contents of the directory referred to by \p dirfd
+ *
+ * Entries are removed relative to \p dirfd using the types reported by
+ * listDirectoryAt(), so nothing is stat'ed again and symlinks are never
+ * followed. \p path is only used for error messages.
+ */
+static bool deleteContentsAt(int dirfd, const std::string &path)
 {
-    (void) sb;
-    (void) typeflag;
-    (void) ftwbuf;
+    std::vector<DirectoryEntry> entries;
 
-    int ret = remove(fpath);
-    if (ret < 0) {
-        setLastError(Error::PlatformError, priv::format(
-                "%s: Failed to remove: %s", fpath, strerror(errno)));
+    if (!listDirectoryAt(dirfd, path, entries)) {
+        return false;
     }
-    return ret;
+
+    for (auto const &entry : entries) {
+        bool isDirectory = entry.type == FileType::Directory;
+
+        if (isDirectory) {
+            int fd = openat(dirfd, entry.name.c_str(),
+                            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0) {
+                setLastError(Error::PlatformError, priv::format(
+                        "%s/%s: Failed to open directory: %s",
+                        path.c_str(), entry.name.c_str(), strerror(errno)));
+                return false;
+            }
+
+            bool ret = deleteContentsAt(fd, path + "/" + entry.name);
+
+            close(fd);
+
+            if (!ret) {
+                return false;
+            }
+        }
+
+        if (unlinkat(dirfd, entry.name.c_str(),
+                     isDirectory ? AT_REMOVEDIR : 0) < 0) {
+            setLastError(Error::PlatformError, priv::format(
+                    "%s/%s: Failed to remove: %s",
+                    path.c_str(), entry.name.c_str(), strerror(errno)));
+            return false;
+        }
+    }
+
+    return true;
 }
 
 bool deleteRecursively(const std::string &path)
 {
-    return nftw(path.c_str(), deleteCbNftw, 64, FTW_DEPTH | FTW_PHYS);
+    int dirfd = open(path.c_str(),
+                     O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dirfd < 0) {
+        // Not a directory or a symlink, so just remove the path itself
+        if (errno == ENOTDIR || errno == ELOOP) {
+            if (unlink(path.c_str()) < 0) {
+                setLastError(Error::PlatformError, priv::format(
+                        "%s: Failed to remove: %s",
+                        path.c_str(), strerror(errno)));
+                return false;
+            }
+            return true;
+        }
+
+        setLastError(Error::PlatformError, priv::format(
+                "%s: Failed to open directory: %s",
+                path.c_str(), strerror(errno)));
+        return false;
+    }
+
+    bool ret = deleteContentsAt(dirfd, path);
+
+    close(dirfd);
+
+    if (ret && rmdir(path.c_str()) < 0) {
+        setLastError(Error::PlatformError, priv::format(
+                "%s: Failed to remove: %s", path.c_str(), strerror(errno)));
+        ret = false;
+    }
+
+    return ret;
 }
 
 }
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbpio/posix/directory.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include "mbpio/error.h"
+#include "mbpio/private/string.h"
+
+// Large enough to fetch a few hundred entries per syscall
+#define GETDENTS_BUF_SIZE       (64 * 1024)
+
+namespace io
+{
+namespace posix
+{
+
+static FileType typeFromMode(mode_t mode)
+{
+    if (S_ISREG(mode)) {
+        return FileType::Regular;
+    } else if (S_ISDIR(mode)) {
+        return FileType::Directory;
+    } else if (S_ISLNK(mode)) {
+        return FileType::Symlink;
+    } else {
+        return FileType::Other;
+    }
+}
+
+static FileType typeFromDType(int dirfd, const char *name, unsigned char type)
+{
+    switch (type) {
+    case DT_REG:
+        return FileType::Regular;
+    case DT_DIR:
+        return FileType::Directory;
+    case DT_LNK:
+        return FileType::Symlink;
+    case DT_UNKNOWN: {
+        // Some filesystems do not report the type, so fall back to stat'ing
+        // the entry
+        struct stat sb;
+        if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+            return FileType::Unknown;
+        }
+        return typeFromMode(sb.st_mode);
+    }
+    default:
+        return FileType::Other;
+    }
+}
+
+static void addEntry(int dirfd, const char *name, unsigned char type,
+                     std::vector<DirectoryEntry> &entries)
+{
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return;
+    }
+
+    entries.emplace_back();
+    entries.back().name = name;
+    entries.back().type = typeFromDType(dirfd, name, type);
+}
+
+/*!
+ * \brief List entries in the directory referred to by \p dirfd
+ *
+ * On Linux, the entries are fetched with `getdents64()` in batches of
+ * \ref GETDENTS_BUF_SIZE bytes. The entry type comes from `d_type`, so entries
+ * are only stat'ed if the filesystem does not report the type. "." and ".."
+ * are skipped. \p path is only used for error messages.
+ *
+ * The file offset of \p dirfd is advanced to the end of the directory.
+ */
+bool listDirectoryAt(int dirfd, const std::string &path,
+                     std::vector<DirectoryEntry> &entries)
+{
+    entries.clear();
+
+#if defined(__linux__)
+    std::vector<char> buf(GETDENTS_BUF_SIZE);
+
+    while (true) {
+        long n = syscall(SYS_getdents64, dirfd, buf.data(), buf.size());
+        if (n < 0) {
+            setLastError(Error::PlatformError, priv::format(
+                    "%s: Failed to read directory: %s",
+                    path.c_str(), strerror(errno)));
+            return false;
+        } else if (n == 0) {
+            break;
+        }
+
+        // struct linux_dirent64 is not exposed by all libcs, so parse the
+        // fixed-layout records manually:
+        //   u64 d_ino, s64 d_off, u16 d_reclen, u8 d_type, char d_name[]
+        for (long pos = 0; pos < n;) {
+            const char *record = buf.data() + pos;
+            uint16_t reclen;
+            unsigned char type;
+
+            memcpy(&reclen, record + 16, sizeof(reclen));
+            type = static_cast<unsigned char>(record[18]);
+
+            addEntry(dirfd, record + 19, type, entries);
+
+            pos += reclen;
+        }
+    }
+#else
+    // fdopendir() takes ownership of the file descriptor
+    int fd = dup(dirfd);
+    if (fd < 0) {
+        setLastError(Error::PlatformError, priv::format(
+                "%s: Failed to duplicate file descriptor: %s",
+                path.c_str(), strerror(errno)));
+        return false;
+    }
+
+    DIR *dp = fdopendir(fd);
+    if (!dp) {
+        setLastError(Error::PlatformError, priv::format(
+                "%s: Failed to open directory: %s",
+                path.c_str(), strerror(errno)));
+        close(fd);
+        return false;
+    }
+
+    struct dirent *ent;
+    errno = 0;
+    while ((ent = readdir(dp))) {
+        addEntry(dirfd, ent->d_name, ent->d_type, entries);
+        errno = 0;
+    }
+
+    int saved_errno = errno;
+    closedir(dp);
+
+    if (saved_errno != 0) {
+        setLastError(Error::PlatformError, priv::format(
+                "%s: Failed to read directory: %s",
+                path.c_str(), strerror(saved_errno)));
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+bool listDirectory(const std::string &path,
+                   std::vector<DirectoryEntry> &entries)
+{
+    int dirfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) {
+        setLastError(Error::PlatformError, priv::format(
+                "%s: Failed to open directory: %s",
+                path.c_str(), strerror(errno)));
+        return false;
+    }
+
+    bool ret = listDirectoryAt(dirfd, path, entries);
+
+    close(dirfd);
+
+    return ret;
+}
+
+}
+}
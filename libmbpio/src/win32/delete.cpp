@@ -21,13 +21,13 @@
 
 #include <windows.h>
 
-#include <memory>
-#include <type_traits>
+#include <vector>
 
 #include "mbcommon/locale.h"
 
 #include "mbpio/error.h"
 #include "mbpio/private/string.h"
+#include "mbpio/win32/directory.h"
 #include "mbpio/win32/error.h"
 
 namespace io
@@ -35,69 +35,57 @@ namespace io
 namespace win32
 {
 
-typedef std::unique_ptr<std::remove_pointer<HANDLE>::type, decltype(FindClose) *> ScopedFindHandle;
-
 static bool win32RecursiveDelete(const std::wstring &path)
 {
-    std::wstring mask(path);
-    mask += L"\\*";
-
-    WIN32_FIND_DATAW findData;
-
-    // First, delete the contents of the directory, recursively for subdirectories
-    HANDLE _searchHandle = FindFirstFileExW(
-        mask.c_str(),           // lpFileName
-        FindExInfoBasic,        // fInfoLevelId
-        &findData,              // lpFindFileData
-        FindExSearchNameMatch,  // fSearchOp
-        nullptr,                // lpSearchFilter
-        0                       // dwAdditionalFlags
-    );
-    if (_searchHandle == INVALID_HANDLE_VALUE) {
-        DWORD error = GetLastError();
-        if (error != ERROR_FILE_NOT_FOUND) {
+    std::vector<FindEntry> entries;
+
+    // First, delete the contents of the directory, recursively for
+    // subdirectories. The attributes from the enumeration are used directly
+    // instead of querying each entry again.
+    if (!findEntries(path, entries)) {
+        return false;
+    }
+
+    for (auto const &entry : entries) {
+        std::wstring childPath(path);
+        childPath += L'\\';
+        childPath += entry.name;
+
+        // DeleteFileW() refuses to delete read-only files
+        if ((entry.attributes & FILE_ATTRIBUTE_READONLY)
+                && !SetFileAttributesW(childPath.c_str(),
+                        entry.attributes & ~FILE_ATTRIBUTE_READONLY)) {
+            DWORD error = GetLastError();
             setLastError(Error::PlatformError, priv::format(
-                    "FindFirstFileExW() failed: %s",
+                    "SetFileAttributesW() failed: %s",
                     errorToString(error).c_str()));
             return false;
         }
-    } else {
-        ScopedFindHandle searchHandle(_searchHandle, &FindClose);
-
-        while (true) {
-            if (wcscmp(findData.cFileName, L".") != 0
-                    && wcscmp(findData.cFileName, L"..") != 0) {
-                bool isDirectory = (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-                        || (findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT);
-                std::wstring childPath(path);
-                childPath += L'\\';
-                childPath += findData.cFileName;
-
-                if (isDirectory) {
-                    if (!win32RecursiveDelete(childPath)) {
-                        return false;
-                    }
-                } else {
-                    if (!DeleteFileW(childPath.c_str())) {
-                        DWORD error = GetLastError();
-                        setLastError(Error::PlatformError, priv::format(
-                                "DeleteFileW() failed: %s",
-                                errorToString(error).c_str()));
-                        return false;
-                    }
-                }
-            }
 
-            // Advance to the next file in the directory
-            if (!FindNextFileW(searchHandle.get(), &findData)) {
+        if (entry.attributes & FILE_ATTRIBUTE_REPARSE_POINT) {
+            // Remove junctions and symlinks themselves without deleting
+            // anything they point to
+            bool ret = (entry.attributes & FILE_ATTRIBUTE_DIRECTORY)
+                    ? RemoveDirectoryW(childPath.c_str())
+                    : DeleteFileW(childPath.c_str());
+            if (!ret) {
+                DWORD error = GetLastError();
+                setLastError(Error::PlatformError, priv::format(
+                        "Failed to remove reparse point: %s",
+                        errorToString(error).c_str()));
+                return false;
+            }
+        } else if (entry.attributes & FILE_ATTRIBUTE_DIRECTORY) {
+            if (!win32RecursiveDelete(childPath)) {
+                return false;
+            }
+        } else {
+            if (!DeleteFileW(childPath.c_str())) {
                 DWORD error = GetLastError();
-                if (error != ERROR_NO_MORE_FILES) {
-                    setLastError(Error::PlatformError, priv::format(
-                            "FindNextFileW() failed: %s",
-                            errorToString(error).c_str()));
-                    return false;
-                }
-                break;
+                setLastError(Error::PlatformError, priv::format(
+                        "DeleteFileW() failed: %s",
+                        errorToString(error).c_str()));
+                return false;
             }
         }
     }
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbpio/win32/directory.h"
+
+#include <memory>
+#include <type_traits>
+
+#include "mbcommon/locale.h"
+
+#include "mbpio/error.h"
+#include "mbpio/private/string.h"
+#include "mbpio/win32/error.h"
+
+namespace io
+{
+namespace win32
+{
+
+typedef std::unique_ptr<std::remove_pointer<HANDLE>::type, decltype(FindClose) *> ScopedFindHandle;
+
+/*!
+ * \brief List entries in a directory along with their attributes
+ *
+ * The search is done with `FIND_FIRST_EX_LARGE_FETCH` so that entries are
+ * fetched from the filesystem in large batches and with `FindExInfoBasic` so
+ * that short (8.3) names are not queried. "." and ".." are skipped.
+ */
+bool findEntries(const std::wstring &path, std::vector<FindEntry> &entries)
+{
+    std::wstring mask(path);
+    mask += L"\\*";
+
+    WIN32_FIND_DATAW findData;
+
+    entries.clear();
+
+    HANDLE _searchHandle = FindFirstFileExW(
+        mask.c_str(),               // lpFileName
+        FindExInfoBasic,            // fInfoLevelId
+        &findData,                  // lpFindFileData
+        FindExSearchNameMatch,      // fSearchOp
+        nullptr,                    // lpSearchFilter
+        FIND_FIRST_EX_LARGE_FETCH   // dwAdditionalFlags
+    );
+    if (_searchHandle == INVALID_HANDLE_VALUE) {
+        DWORD error = GetLastError();
+        if (error == ERROR_FILE_NOT_FOUND) {
+            return true;
+        }
+        setLastError(Error::PlatformError, priv::format(
+                "FindFirstFileExW() failed: %s",
+                errorToString(error).c_str()));
+        return false;
+    }
+
+    ScopedFindHandle searchHandle(_searchHandle, &FindClose);
+
+    while (true) {
+        if (wcscmp(findData.cFileName, L".") != 0
+                && wcscmp(findData.cFileName, L"..") != 0) {
+            entries.emplace_back();
+            entries.back().name = findData.cFileName;
+            entries.back().attributes = findData.dwFileAttributes;
+        }
+
+        // Advance to the next file in the directory
+        if (!FindNextFileW(searchHandle.get(), &findData)) {
+            DWORD error = GetLastError();
+            if (error != ERROR_NO_MORE_FILES) {
+                setLastError(Error::PlatformError, priv::format(
+                        "FindNextFileW() failed: %s",
+                        errorToString(error).c_str()));
+                return false;
+            }
+            break;
+        }
+    }
+
+    return true;
+}
+
+bool listDirectory(const std::string &path,
+                   std::vector<DirectoryEntry> &entries)
+{
+    std::wstring wPath;
+
+    if (!mb::utf8_to_wcs(wPath, path)) {
+        setLastError(Error::PlatformError, priv::format(
+                "%s: Failed to convert UTF-8 to UTF-16", path.c_str()));
+        return false;
+    }
+
+    std::vector<FindEntry> findResults;
+    if (!findEntries(wPath, findResults)) {
+        return false;
+    }
+
+    entries.clear();
+    entries.reserve(findResults.size());
+
+    for (auto const &result : findResults) {
+        DirectoryEntry entry;
+
+        if (!mb::wcs_to_utf8(entry.name, result.name)) {
+            setLastError(Error::PlatformError, priv::format(
+                    "%s: Failed to convert UTF-16 to UTF-8", path.c_str()));
+            return false;
+        }
+
+        if (result.attributes & FILE_ATTRIBUTE_REPARSE_POINT) {
+            entry.type = FileType::Symlink;
+        } else if (result.attributes & FILE_ATTRIBUTE_DIRECTORY) {
+            entry.type = FileType::Directory;
+        } else {
+            entry.type = FileType::Regular;
+        }
+
+        entries.push_back(std::move(entry));
+    }
+
+    return true;
+}
+
+}
+}
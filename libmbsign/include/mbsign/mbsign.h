@@ -43,8 +43,20 @@ MB_EXPORT EVP_PKEY * load_public_key_from_file(const char *file, int format,
                                                const char *pass);
 MB_EXPORT bool sign_data(BIO *bio_data_in, BIO *bio_sig_out,
                          EVP_PKEY *pkey);
+MB_EXPORT bool sign_data_fd(int fd, BIO *bio_sig_out, EVP_PKEY *pkey);
+MB_EXPORT bool sign_data_buf(const void *data, size_t size, BIO *bio_sig_out,
+                             EVP_PKEY *pkey);
 MB_EXPORT bool verify_data(BIO *bio_data_in, BIO *bio_sig_in,
                            EVP_PKEY *pkey, bool *result_out);
+MB_EXPORT bool verify_data_multi(BIO *bio_data_in, BIO *bio_sig_in,
+                                 EVP_PKEY * const *pkeys, size_t pkeys_count,
+                                 bool *result_out, size_t *key_index_out);
+MB_EXPORT bool verify_data_fd(int fd, BIO *bio_sig_in,
+                              EVP_PKEY * const *pkeys, size_t pkeys_count,
+                              bool *result_out, size_t *key_index_out);
+MB_EXPORT bool verify_data_buf(const void *data, size_t size, BIO *bio_sig_in,
+                               EVP_PKEY * const *pkeys, size_t pkeys_count,
+                               bool *result_out, size_t *key_index_out);
 
 }
 }
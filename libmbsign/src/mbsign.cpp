@@ -19,9 +19,20 @@
 
 #include "mbsign/mbsign.h"
 
+#include <algorithm>
+
 #include <cassert>
+#include <cerrno>
 #include <cstring>
 
+#ifdef _WIN32
+#  include <io.h>
+#else
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
 #include <openssl/err.h>
 #ifdef OPENSSL_IS_BORINGSSL
 #include <openssl/mem.h>
@@ -31,7 +42,8 @@
 
 #include "mblog/logging.h"
 
-#define BUFSIZE                 1024 * 8
+#define BUFSIZE                 (1024 * 1024)
+#define MMAP_WINDOW             (64 * 1024 * 1024)
 
 #define MAGIC                   "!MBSIGN!"
 #define MAGIC_SIZE              8
@@ -330,104 +342,232 @@ EVP_PKEY * load_public_key_from_file(const char *file, int format,
     return pkey;
 }
 
+static const EVP_MD * version_to_md(unsigned int version)
+{
+    switch (version) {
+    case VERSION_1_SHA512_DGST:
+        return EVP_sha512();
+    default:
+        return nullptr;
+    }
+}
+
+static bool digest_update(EVP_MD_CTX *mctx, const void *data, size_t size)
+{
+    if (!EVP_DigestUpdate(mctx, data, size)) {
+        LOGE("Failed to update digest");
+        openssl_log_errors();
+        return false;
+    }
+    return true;
+}
+
+static bool digest_bio(EVP_MD_CTX *mctx, BIO *bio_data_in)
+{
+    unsigned char *buf = (unsigned char *) OPENSSL_malloc(BUFSIZE);
+    if (!buf) {
+        LOGE("Failed to allocate I/O buffer");
+        openssl_log_errors();
+        return false;
+    }
+
+    bool ret = true;
+
+    while (true) {
+        int n = BIO_read(bio_data_in, buf, BUFSIZE);
+        if (n < 0) {
+            LOGE("Failed to read from input data BIO stream");
+            openssl_log_errors();
+            ret = false;
+            break;
+        } else if (n == 0) {
+            break;
+        } else if (!digest_update(mctx, buf, n)) {
+            ret = false;
+            break;
+        }
+    }
+
+    OPENSSL_free(buf);
+    return ret;
+}
+
+static bool digest_fd_read(EVP_MD_CTX *mctx, int fd)
+{
+    unsigned char *buf = (unsigned char *) OPENSSL_malloc(BUFSIZE);
+    if (!buf) {
+        LOGE("Failed to allocate I/O buffer");
+        openssl_log_errors();
+        return false;
+    }
+
+    bool ret = true;
+
+    while (true) {
+        auto n = read(fd, buf, BUFSIZE);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("Failed to read input file: %s", strerror(errno));
+            ret = false;
+            break;
+        } else if (n == 0) {
+            break;
+        } else if (!digest_update(mctx, buf, n)) {
+            ret = false;
+            break;
+        }
+    }
+
+    OPENSSL_free(buf);
+    return ret;
+}
+
 /*!
- * \brief Sign data from stream
+ * \brief Digest data from the current offset of a file descriptor until EOF
  *
- * \param bio_data_in Input stream for data
- * \param bio_sig_out Output stream for signature
- * \param pkey Private key
- *
- * \return Whether the signing operation was successful
+ * Regular files are mapped into memory in windows of MMAP_WINDOW bytes and
+ * hashed directly from the page cache. Anything that cannot be mapped is read
+ * in BUFSIZE chunks instead. On return, the file offset is at EOF.
  */
-bool sign_data(BIO *bio_data_in, BIO *bio_sig_out, EVP_PKEY *pkey)
+static bool digest_fd(EVP_MD_CTX *mctx, int fd)
 {
-    assert(bio_data_in && bio_sig_out && pkey);
+#ifndef _WIN32
+    struct stat sb;
+    off_t offset;
+
+    if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode)
+            || (offset = lseek(fd, 0, SEEK_CUR)) < 0) {
+        return digest_fd_read(mctx, fd);
+    }
+
+    const off_t page_size = sysconf(_SC_PAGESIZE);
+
+    while (offset < sb.st_size) {
+        // mmap() offsets must be page aligned
+        off_t map_offset = offset - offset % page_size;
+        size_t skip = offset - map_offset;
+        size_t map_size = std::min<uint64_t>(
+                MMAP_WINDOW, sb.st_size - map_offset);
+
+        void *map = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd,
+                         map_offset);
+        if (map == MAP_FAILED) {
+            // Continue with read() from the current position
+            if (lseek(fd, offset, SEEK_SET) < 0) {
+                LOGE("Failed to seek input file: %s", strerror(errno));
+                return false;
+            }
+            return digest_fd_read(mctx, fd);
+        }
 
-    unsigned int version = VERSION_LATEST;
-    const EVP_MD *md_type = nullptr;
-    EVP_MD_CTX *mctx = nullptr;
-    EVP_PKEY_CTX *pctx = nullptr;
-#ifdef OPENSSL_IS_BORINGSSL
-    EVP_MD_CTX ctx;
-#else
-    BIO *bio_md = nullptr;
-#endif
-    BIO *bio_input = nullptr;
-    unsigned char *buf = nullptr;
-    size_t len;
-    int n;
+        madvise(map, map_size, MADV_SEQUENTIAL);
 
-    if (version == VERSION_1_SHA512_DGST) {
-        md_type = EVP_sha512();
-    } else {
-        LOGE("Invalid signature file version");
+        bool ret = digest_update(
+                mctx, static_cast<unsigned char *>(map) + skip,
+                map_size - skip);
+
+        munmap(map, map_size);
+
+        if (!ret) {
+            return false;
+        }
+
+        offset = map_offset + map_size;
+    }
+
+    // Match the stream semantics of the read() path
+    if (lseek(fd, offset, SEEK_SET) < 0) {
+        LOGE("Failed to seek input file: %s", strerror(errno));
         return false;
     }
 
-#ifdef OPENSSL_IS_BORINGSSL
-    EVP_MD_CTX_init(&ctx);
-    mctx = &ctx;
+    // Pick up anything appended after fstat()
+    return digest_fd_read(mctx, fd);
 #else
-    bio_md = BIO_new(BIO_f_md());
-    if (!bio_md) {
+    return digest_fd_read(mctx, fd);
+#endif
+}
+
+static EVP_MD_CTX * digest_new(const EVP_MD *md_type)
+{
+    EVP_MD_CTX *mctx = EVP_MD_CTX_create();
+    if (!mctx) {
+        LOGE("Failed to allocate message digest context");
         openssl_log_errors();
-        goto error;
+        return nullptr;
     }
 
-    if (!BIO_get_md_ctx(bio_md, &mctx)) {
-        LOGE("Failed to get message digest context");
+    if (!EVP_DigestInit_ex(mctx, md_type, nullptr)) {
+        LOGE("Failed to set message digest context");
         openssl_log_errors();
-        goto error;
+        EVP_MD_CTX_destroy(mctx);
+        return nullptr;
     }
-#endif
 
-    if (!EVP_DigestSignInit(mctx, &pctx, md_type, nullptr, pkey)) {
-        LOGE("Failed to set message digest context");
+    return mctx;
+}
+
+static bool digest_final(EVP_MD_CTX *mctx, unsigned char *digest,
+                         unsigned int *digest_len)
+{
+    bool ret = EVP_DigestFinal_ex(mctx, digest, digest_len);
+    if (!ret) {
+        LOGE("Failed to finalize digest");
+        openssl_log_errors();
+    }
+    EVP_MD_CTX_destroy(mctx);
+    return ret;
+}
+
+/*!
+ * \brief Sign a digest and write the header and signature to a stream
+ */
+static bool write_signature(BIO *bio_sig_out, unsigned int version,
+                            const EVP_MD *md_type, EVP_PKEY *pkey,
+                            const unsigned char *digest,
+                            unsigned int digest_len)
+{
+    EVP_PKEY_CTX *pctx = nullptr;
+    unsigned char *sigbuf = nullptr;
+    size_t siglen;
+    SigHeader hdr;
+
+    pctx = EVP_PKEY_CTX_new(pkey, nullptr);
+    if (!pctx) {
+        LOGE("Failed to create private key context");
         openssl_log_errors();
         goto error;
     }
 
-    buf = (unsigned char *) OPENSSL_malloc(BUFSIZE);
-    if (!buf) {
-        LOGE("Failed to allocate I/O buffer");
+    if (EVP_PKEY_sign_init(pctx) <= 0
+            || EVP_PKEY_CTX_set_signature_md(pctx, md_type) <= 0) {
+        LOGE("Failed to initialize signing operation");
         openssl_log_errors();
         goto error;
     }
 
-#ifdef OPENSSL_IS_BORINGSSL
-    bio_input = bio_data_in;
-#else
-    bio_input = BIO_push(bio_md, bio_data_in);
-#endif
+    if (EVP_PKEY_sign(pctx, nullptr, &siglen, digest, digest_len) <= 0) {
+        LOGE("Failed to determine signature size");
+        openssl_log_errors();
+        goto error;
+    }
 
-    while (true) {
-        n = BIO_read(bio_input, buf, BUFSIZE);
-        if (n < 0) {
-            LOGE("Failed to read from input data BIO stream");
-            openssl_log_errors();
-            goto error;
-        }
-        if (n == 0) {
-            break;
-        }
-#ifdef OPENSSL_IS_BORINGSSL
-        if (!EVP_DigestUpdate(mctx, buf, n)) {
-            LOGE("Failed to update digest");
-            openssl_log_errors();
-            goto error;
-        }
-#endif
+    sigbuf = (unsigned char *) OPENSSL_malloc(siglen);
+    if (!sigbuf) {
+        LOGE("Failed to allocate signature buffer");
+        openssl_log_errors();
+        goto error;
     }
 
-    len = BUFSIZE;
-    if (!EVP_DigestSignFinal(mctx, buf, &len)) {
+    if (EVP_PKEY_sign(pctx, sigbuf, &siglen, digest, digest_len) <= 0) {
         LOGE("Failed to sign data");
         openssl_log_errors();
         goto error;
     }
 
     // Write header
-    SigHeader hdr;
     memset(&hdr, 0, sizeof(hdr));
     memcpy(hdr.magic, MAGIC, MAGIC_SIZE);
     hdr.version = version;
@@ -438,182 +578,362 @@ bool sign_data(BIO *bio_data_in, BIO *bio_sig_out, EVP_PKEY *pkey)
         goto error;
     }
 
-    if (BIO_write(bio_sig_out, buf, len) != (int) len) {
+    if (BIO_write(bio_sig_out, sigbuf, siglen) != (int) siglen) {
         LOGE("Failed to write signature to signature BIO stream");
         openssl_log_errors();
         goto error;
     }
 
-#ifdef OPENSSL_IS_BORINGSSL
-    EVP_MD_CTX_cleanup(&ctx);
-#else
-    BIO_free(bio_md);
-#endif
-    OPENSSL_free(buf);
+    EVP_PKEY_CTX_free(pctx);
+    OPENSSL_free(sigbuf);
     return true;
 
 error:
-#ifdef OPENSSL_IS_BORINGSSL
-    EVP_MD_CTX_cleanup(&ctx);
-#else
-    BIO_free(bio_md);
-#endif
-    OPENSSL_free(buf);
+    EVP_PKEY_CTX_free(pctx);
+    OPENSSL_free(sigbuf);
     return false;
 }
 
 /*!
- * \brief Verify signature of data from stream
- *
- * \param bio_data_in Input stream for data
- * \param bio_sig_in Input stream for signature
- * \param pkey Public key
- * \param result_out Output pointer for result of verification operation
+ * \brief Read the header and signature from a stream
  *
- * \return Whether the verification operation completed successfully (does not
- *         indicate whether the signature is valid)
+ * On success, \p sig_out must be freed with OPENSSL_free().
  */
-bool verify_data(BIO *bio_data_in, BIO *bio_sig_in,
-                 EVP_PKEY *pkey, bool *result_out)
+static bool read_signature(BIO *bio_sig_in, EVP_PKEY * const *pkeys,
+                           size_t pkeys_count, const EVP_MD **md_out,
+                           unsigned char **sig_out, size_t *sig_len_out)
 {
-    assert(bio_data_in && bio_sig_in && pkey && result_out);
-
     SigHeader hdr;
-    const EVP_MD *md_type = nullptr;
-    EVP_MD_CTX *mctx = nullptr;
-    EVP_PKEY_CTX *pctx = nullptr;
-#ifdef OPENSSL_IS_BORINGSSL
-    EVP_MD_CTX ctx;
-#else
-    BIO *bio_md = nullptr;
-#endif
-    BIO *bio_input = nullptr;
-    unsigned char *buf = nullptr;
-    unsigned char *sigbuf = nullptr;
-    int siglen;
-    int n;
-
-#ifdef OPENSSL_IS_BORINGSSL
-    EVP_MD_CTX_init(&ctx);
-    mctx = &ctx;
-#else
-    bio_md = BIO_new(BIO_f_md());
-    if (!bio_md) {
-        openssl_log_errors();
-        goto error;
-    }
-
-    if (!BIO_get_md_ctx(bio_md, &mctx)) {
-        LOGE("Failed to get message digest context");
-        openssl_log_errors();
-        goto error;
-    }
-#endif
+    const EVP_MD *md_type;
+    unsigned char *sigbuf;
+    int siglen = 0;
 
     // Read header from signature file
     if (BIO_read(bio_sig_in, &hdr, sizeof(hdr)) != sizeof(hdr)) {
         LOGE("Failed to read header from signature BIO stream");
         openssl_log_errors();
-        goto error;
+        return false;
     }
 
     // Verify header
     if (memcmp(hdr.magic, MAGIC, MAGIC_SIZE) != 0) {
         LOGE("Invalid magic in signature file");
         openssl_log_errors();
-        goto error;
+        return false;
     }
 
     // Verify version
-    if (hdr.version == VERSION_1_SHA512_DGST) {
-        md_type = EVP_sha512();
-    } else {
+    md_type = version_to_md(hdr.version);
+    if (!md_type) {
         LOGE("Invalid version in signature file: %u", hdr.version);
         openssl_log_errors();
-        goto error;
-    }
-
-    if (!EVP_DigestVerifyInit(mctx, &pctx, md_type, nullptr, pkey)) {
-        LOGE("Failed to set message digest context");
-        openssl_log_errors();
-        goto error;
+        return false;
     }
 
-    buf = (unsigned char *) OPENSSL_malloc(BUFSIZE);
-    if (!buf) {
-        LOGE("Failed to allocate I/O buffer");
-        openssl_log_errors();
-        goto error;
+    // The signature is as large as the key that created it
+    for (size_t i = 0; i < pkeys_count; ++i) {
+        siglen = std::max(siglen, EVP_PKEY_size(pkeys[i]));
     }
 
-    siglen = EVP_PKEY_size(pkey);
-    sigbuf = (unsigned char *) OPENSSL_malloc(siglen);
+    sigbuf = (unsigned char *) OPENSSL_malloc(siglen > 0 ? siglen : 1);
     if (!sigbuf) {
         LOGE("Failed to allocate signature buffer");
         openssl_log_errors();
-        goto error;
+        return false;
     }
+
     siglen = BIO_read(bio_sig_in, sigbuf, siglen);
     if (siglen <= 0) {
         LOGE("Failed to read signature BIO stream");
         openssl_log_errors();
-        goto error;
+        OPENSSL_free(sigbuf);
+        return false;
     }
 
-#ifdef OPENSSL_IS_BORINGSSL
-    bio_input = bio_data_in;
-#else
-    bio_input = BIO_push(bio_md, bio_data_in);
-#endif
+    *md_out = md_type;
+    *sig_out = sigbuf;
+    *sig_len_out = siglen;
+    return true;
+}
 
-    while (true) {
-        n = BIO_read(bio_input, buf, BUFSIZE);
-        if (n < 0) {
-            LOGE("Failed to read input data BIO stream");
+/*!
+ * \brief Check a digest against a signature for each key until one matches
+ */
+static bool check_signature(const EVP_MD *md_type,
+                            const unsigned char *sig, size_t sig_len,
+                            const unsigned char *digest,
+                            unsigned int digest_len,
+                            EVP_PKEY * const *pkeys, size_t pkeys_count,
+                            bool *result_out, size_t *key_index_out)
+{
+    *result_out = false;
+
+    for (size_t i = 0; i < pkeys_count; ++i) {
+        EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new(pkeys[i], nullptr);
+        if (!pctx) {
+            LOGE("Failed to create public key context");
             openssl_log_errors();
-            goto error;
+            return false;
         }
-        if (n == 0) {
-            break;
+
+        if (EVP_PKEY_verify_init(pctx) <= 0
+                || EVP_PKEY_CTX_set_signature_md(pctx, md_type) <= 0) {
+            LOGE("Failed to initialize signature verification");
+            openssl_log_errors();
+            EVP_PKEY_CTX_free(pctx);
+            return false;
         }
-#ifdef OPENSSL_IS_BORINGSSL
-        if (!EVP_DigestUpdate(mctx, buf, n)) {
-            LOGE("Failed to update digest");
+
+        int n = EVP_PKEY_verify(pctx, sig, sig_len, digest, digest_len);
+
+        EVP_PKEY_CTX_free(pctx);
+
+        if (n == 1) {
+            *result_out = true;
+            if (key_index_out) {
+                *key_index_out = i;
+            }
+            break;
+        } else if (n == 0) {
+            // Signed by a different key. Discard the errors from this attempt.
+            ERR_clear_error();
+        } else {
+            LOGE("Failed to verify data");
             openssl_log_errors();
-            goto error;
+            return false;
         }
-#endif
     }
 
-    n = EVP_DigestVerifyFinal(mctx, sigbuf, siglen);
-    if (n == 1) {
-        *result_out = true;
-    } else if (n == 0) {
-        *result_out = false;
+    return true;
+}
+
+/*!
+ * \brief Input source for data to be signed or verified
+ */
+struct DataSource
+{
+    BIO *bio;
+    int fd;
+    const void *buf;
+    size_t size;
+};
+
+static bool digest_source(EVP_MD_CTX *mctx, const DataSource &src)
+{
+    if (src.bio) {
+        return digest_bio(mctx, src.bio);
+    } else if (src.fd >= 0) {
+        return digest_fd(mctx, src.fd);
     } else {
-        LOGE("Failed to verify data");
-        openssl_log_errors();
-        goto error;
+        return digest_update(mctx, src.buf, src.size);
     }
+}
 
-#ifdef OPENSSL_IS_BORINGSSL
-    EVP_MD_CTX_cleanup(&ctx);
-#else
-    BIO_free(bio_md);
-#endif
-    OPENSSL_free(sigbuf);
-    OPENSSL_free(buf);
-    return true;
+static bool sign_source(const DataSource &src, BIO *bio_sig_out,
+                        EVP_PKEY *pkey)
+{
+    unsigned int version = VERSION_LATEST;
+    const EVP_MD *md_type;
+    EVP_MD_CTX *mctx;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len;
 
-error:
-#ifdef OPENSSL_IS_BORINGSSL
-    EVP_MD_CTX_cleanup(&ctx);
-#else
-    BIO_free(bio_md);
-#endif
-    OPENSSL_free(sigbuf);
-    OPENSSL_free(buf);
-    return false;
+    md_type = version_to_md(version);
+    if (!md_type) {
+        LOGE("Invalid signature file version");
+        return false;
+    }
+
+    mctx = digest_new(md_type);
+    if (!mctx) {
+        return false;
+    }
+
+    if (!digest_source(mctx, src)) {
+        EVP_MD_CTX_destroy(mctx);
+        return false;
+    }
+
+    return digest_final(mctx, digest, &digest_len)
+            && write_signature(bio_sig_out, version, md_type, pkey,
+                               digest, digest_len);
+}
+
+static bool verify_source(const DataSource &src, BIO *bio_sig_in,
+                          EVP_PKEY * const *pkeys, size_t pkeys_count,
+                          bool *result_out, size_t *key_index_out)
+{
+    const EVP_MD *md_type;
+    EVP_MD_CTX *mctx;
+    unsigned char *sig;
+    size_t sig_len;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len;
+    bool ret;
+
+    if (!read_signature(bio_sig_in, pkeys, pkeys_count,
+                        &md_type, &sig, &sig_len)) {
+        return false;
+    }
+
+    mctx = digest_new(md_type);
+    if (!mctx) {
+        OPENSSL_free(sig);
+        return false;
+    }
+
+    if (!digest_source(mctx, src)) {
+        EVP_MD_CTX_destroy(mctx);
+        OPENSSL_free(sig);
+        return false;
+    }
+
+    ret = digest_final(mctx, digest, &digest_len)
+            && check_signature(md_type, sig, sig_len, digest, digest_len,
+                               pkeys, pkeys_count, result_out, key_index_out);
+
+    OPENSSL_free(sig);
+    return ret;
+}
+
+/*!
+ * \brief Sign data from stream
+ *
+ * \param bio_data_in Input stream for data
+ * \param bio_sig_out Output stream for signature
+ * \param pkey Private key
+ *
+ * \return Whether the signing operation was successful
+ */
+bool sign_data(BIO *bio_data_in, BIO *bio_sig_out, EVP_PKEY *pkey)
+{
+    assert(bio_data_in && bio_sig_out && pkey);
+
+    return sign_source({ bio_data_in, -1, nullptr, 0 }, bio_sig_out, pkey);
+}
+
+/*!
+ * \brief Sign data read from a file descriptor
+ *
+ * Data is read from the current file offset until EOF. Regular files are
+ * memory mapped, so this is considerably faster than sign_data() for large
+ * files.
+ *
+ * \param fd Input file descriptor for data
+ * \param bio_sig_out Output stream for signature
+ * \param pkey Private key
+ *
+ * \return Whether the signing operation was successful
+ */
+bool sign_data_fd(int fd, BIO *bio_sig_out, EVP_PKEY *pkey)
+{
+    assert(fd >= 0 && bio_sig_out && pkey);
+
+    return sign_source({ nullptr, fd, nullptr, 0 }, bio_sig_out, pkey);
+}
+
+/*!
+ * \brief Sign data in memory
+ *
+ * \param data Data buffer
+ * \param size Size of data buffer
+ * \param bio_sig_out Output stream for signature
+ * \param pkey Private key
+ *
+ * \return Whether the signing operation was successful
+ */
+bool sign_data_buf(const void *data, size_t size, BIO *bio_sig_out,
+                   EVP_PKEY *pkey)
+{
+    assert((data || size == 0) && bio_sig_out && pkey);
+
+    return sign_source({ nullptr, -1, data, size }, bio_sig_out, pkey);
+}
+
+/*!
+ * \brief Verify signature of data from stream
+ *
+ * \param bio_data_in Input stream for data
+ * \param bio_sig_in Input stream for signature
+ * \param pkey Public key
+ * \param result_out Output pointer for result of verification operation
+ *
+ * \return Whether the verification operation completed successfully (does not
+ *         indicate whether the signature is valid)
+ */
+bool verify_data(BIO *bio_data_in, BIO *bio_sig_in,
+                 EVP_PKEY *pkey, bool *result_out)
+{
+    assert(bio_data_in && bio_sig_in && pkey && result_out);
+
+    return verify_data_multi(bio_data_in, bio_sig_in, &pkey, 1, result_out,
+                             nullptr);
+}
+
+/*!
+ * \brief Verify signature of data from stream against several public keys
+ *
+ * The data is read and hashed only once, regardless of the number of keys. The
+ * digest is then checked against each key in order until one of them matches.
+ *
+ * \param bio_data_in Input stream for data
+ * \param bio_sig_in Input stream for signature
+ * \param pkeys Array of public keys
+ * \param pkeys_count Number of public keys in \p pkeys
+ * \param result_out Output pointer for whether the signature is valid for any
+ *                   of the keys
+ * \param key_index_out Optional output pointer for the index of the key that
+ *                      the signature is valid for
+ *
+ * \return Whether the verification operation completed successfully (does not
+ *         indicate whether the signature is valid)
+ */
+bool verify_data_multi(BIO *bio_data_in, BIO *bio_sig_in,
+                       EVP_PKEY * const *pkeys, size_t pkeys_count,
+                       bool *result_out, size_t *key_index_out)
+{
+    assert(bio_data_in && bio_sig_in && pkeys && result_out);
+
+    return verify_source({ bio_data_in, -1, nullptr, 0 }, bio_sig_in,
+                         pkeys, pkeys_count, result_out, key_index_out);
+}
+
+/*!
+ * \brief Verify signature of data read from a file descriptor
+ *
+ * This behaves like verify_data_multi(), except that data is read from the
+ * current offset of \p fd until EOF. Regular files are memory mapped.
+ *
+ * \return Whether the verification operation completed successfully (does not
+ *         indicate whether the signature is valid)
+ */
+bool verify_data_fd(int fd, BIO *bio_sig_in,
+                    EVP_PKEY * const *pkeys, size_t pkeys_count,
+                    bool *result_out, size_t *key_index_out)
+{
+    assert(fd >= 0 && bio_sig_in && pkeys && result_out);
+
+    return verify_source({ nullptr, fd, nullptr, 0 }, bio_sig_in,
+                         pkeys, pkeys_count, result_out, key_index_out);
+}
+
+/*!
+ * \brief Verify signature of data in memory
+ *
+ * This behaves like verify_data_multi(), except that data is read from
+ * \p data.
+ *
+ * \return Whether the verification operation completed successfully (does not
+ *         indicate whether the signature is valid)
+ */
+bool verify_data_buf(const void *data, size_t size, BIO *bio_sig_in,
+                     EVP_PKEY * const *pkeys, size_t pkeys_count,
+                     bool *result_out, size_t *key_index_out)
+{
+    assert((data || size == 0) && bio_sig_in && pkeys && result_out);
+
+    return verify_source({ nullptr, -1, data, size }, bio_sig_in,
+                         pkeys, pkeys_count, result_out, key_index_out);
 }
 
 }
@@ -19,6 +19,8 @@
 
 #include <gtest/gtest.h>
 
+#include <unistd.h>
+
 #include <openssl/err.h>
 #include <openssl/pem.h>
 #include <openssl/rsa.h>
@@ -235,3 +237,218 @@ TEST(SignTest, TestLoadValidPemKeysWithInvalidPassphrase)
     EVP_PKEY_free(private_key_read);
     BIO_free(bio);
 }
+
+static BIO * new_data_bio()
+{
+    BIO *bio = BIO_new(BIO_s_mem());
+    if (bio) {
+        // Report EOF instead of retry once the buffer is drained
+        BIO_set_mem_eof_return(bio, 0);
+        for (int i = 0; i < 1024; ++i) {
+            BIO_write(bio, "The quick brown fox jumps over the lazy dog\n", 44);
+        }
+    }
+    return bio;
+}
+
+static bool sign_test_data(EVP_PKEY *private_key, BIO *bio_sig_out)
+{
+    BIO *bio_data = new_data_bio();
+    if (!bio_data) {
+        return false;
+    }
+
+    bool ret = mb::sign::sign_data(bio_data, bio_sig_out, private_key);
+    BIO_free(bio_data);
+    return ret;
+}
+
+static bool verify_test_data(const std::string &sig, EVP_PKEY * const *keys,
+                             size_t count, bool *valid, size_t *index)
+{
+    BIO *bio_data = new_data_bio();
+    BIO *bio_sig = BIO_new_mem_buf((void *) sig.data(), sig.size());
+    bool ret = false;
+
+    if (bio_data && bio_sig) {
+        ret = mb::sign::verify_data_multi(bio_data, bio_sig, keys, count,
+                                          valid, index);
+    }
+
+    BIO_free(bio_data);
+    BIO_free(bio_sig);
+    return ret;
+}
+
+TEST(SignTest, TestSignAndVerify)
+{
+    EVP_PKEY *private_key;
+    EVP_PKEY *public_key;
+    BIO *bio_data;
+    BIO *bio_sig;
+    bool valid = false;
+
+    // Generate keys
+    ASSERT_TRUE(generate_keys(&private_key, &public_key));
+
+    bio_sig = BIO_new(BIO_s_mem());
+    ASSERT_NE(bio_sig, nullptr);
+    ASSERT_TRUE(sign_test_data(private_key, bio_sig));
+
+    bio_data = new_data_bio();
+    ASSERT_NE(bio_data, nullptr);
+    ASSERT_TRUE(mb::sign::verify_data(bio_data, bio_sig, public_key, &valid));
+    ASSERT_TRUE(valid);
+
+    EVP_PKEY_free(private_key);
+    EVP_PKEY_free(public_key);
+    BIO_free(bio_data);
+    BIO_free(bio_sig);
+}
+
+TEST(SignTest, TestVerifyMultipleKeys)
+{
+    EVP_PKEY *private_keys[3];
+    EVP_PKEY *public_keys[3];
+    BIO *bio_sig;
+    char *sig_data;
+    long sig_size;
+    bool valid;
+    size_t index;
+
+    // Generate keys
+    for (int i = 0; i < 3; ++i) {
+        ASSERT_TRUE(generate_keys(&private_keys[i], &public_keys[i]));
+    }
+
+    // Sign with the last key
+    bio_sig = BIO_new(BIO_s_mem());
+    ASSERT_NE(bio_sig, nullptr);
+    ASSERT_TRUE(sign_test_data(private_keys[2], bio_sig));
+    sig_size = BIO_get_mem_data(bio_sig, &sig_data);
+    ASSERT_GT(sig_size, 0);
+    std::string sig(sig_data, sig_size);
+
+    // Matching key is last
+    valid = false;
+    index = 0;
+    ASSERT_TRUE(verify_test_data(sig, public_keys, 3, &valid, &index));
+    ASSERT_TRUE(valid);
+    ASSERT_EQ(index, 2u);
+
+    // Matching key is first
+    EVP_PKEY *reordered[3] = { public_keys[2], public_keys[0], public_keys[1] };
+    valid = false;
+    index = 1;
+    ASSERT_TRUE(verify_test_data(sig, reordered, 3, &valid, &index));
+    ASSERT_TRUE(valid);
+    ASSERT_EQ(index, 0u);
+
+    // No matching key
+    valid = true;
+    ASSERT_TRUE(verify_test_data(sig, public_keys, 2, &valid, nullptr));
+    ASSERT_FALSE(valid);
+
+    // Corrupted signature
+    std::string bad_sig(sig);
+    bad_sig.back() ^= 0xff;
+    valid = true;
+    ASSERT_TRUE(verify_test_data(bad_sig, public_keys, 3, &valid, nullptr));
+    ASSERT_FALSE(valid);
+
+    for (int i = 0; i < 3; ++i) {
+        EVP_PKEY_free(private_keys[i]);
+        EVP_PKEY_free(public_keys[i]);
+    }
+    BIO_free(bio_sig);
+}
+
+TEST(SignTest, TestSignAndVerifyFdAndBuffer)
+{
+    EVP_PKEY *private_key;
+    EVP_PKEY *public_key;
+    BIO *bio_data;
+    BIO *bio_sig;
+    char *data;
+    long data_size;
+    char *sig_data;
+    long sig_size;
+    char path[] = "/tmp/mbsign_tests.XXXXXX";
+    int fd;
+    bool valid;
+
+    // Generate keys
+    ASSERT_TRUE(generate_keys(&private_key, &public_key));
+
+    bio_data = new_data_bio();
+    ASSERT_NE(bio_data, nullptr);
+    data_size = BIO_get_mem_data(bio_data, &data);
+    ASSERT_GT(data_size, 0);
+
+    fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    unlink(path);
+    ASSERT_EQ(write(fd, data, data_size), data_size);
+
+    // Sign from file descriptor
+    ASSERT_EQ(lseek(fd, 0, SEEK_SET), 0);
+    bio_sig = BIO_new(BIO_s_mem());
+    ASSERT_NE(bio_sig, nullptr);
+    ASSERT_TRUE(mb::sign::sign_data_fd(fd, bio_sig, private_key));
+    ASSERT_EQ(lseek(fd, 0, SEEK_CUR), data_size);
+    sig_size = BIO_get_mem_data(bio_sig, &sig_data);
+    ASSERT_GT(sig_size, 0);
+    std::string sig(sig_data, sig_size);
+    BIO_free(bio_sig);
+
+    // Verify from stream
+    valid = false;
+    ASSERT_TRUE(verify_test_data(sig, &public_key, 1, &valid, nullptr));
+    ASSERT_TRUE(valid);
+
+    // Verify from memory
+    bio_sig = BIO_new_mem_buf((void *) sig.data(), sig.size());
+    ASSERT_NE(bio_sig, nullptr);
+    valid = false;
+    ASSERT_TRUE(mb::sign::verify_data_buf(data, data_size, bio_sig,
+                                          &public_key, 1, &valid, nullptr));
+    ASSERT_TRUE(valid);
+    BIO_free(bio_sig);
+
+    // Verify from file descriptor
+    ASSERT_EQ(lseek(fd, 0, SEEK_SET), 0);
+    bio_sig = BIO_new_mem_buf((void *) sig.data(), sig.size());
+    ASSERT_NE(bio_sig, nullptr);
+    valid = false;
+    ASSERT_TRUE(mb::sign::verify_data_fd(fd, bio_sig, &public_key, 1,
+                                         &valid, nullptr));
+    ASSERT_TRUE(valid);
+    BIO_free(bio_sig);
+
+    // Verify from an unaligned offset, which only covers part of the data
+    ASSERT_EQ(lseek(fd, 1, SEEK_SET), 1);
+    bio_sig = BIO_new_mem_buf((void *) sig.data(), sig.size());
+    ASSERT_NE(bio_sig, nullptr);
+    valid = true;
+    ASSERT_TRUE(mb::sign::verify_data_fd(fd, bio_sig, &public_key, 1,
+                                         &valid, nullptr));
+    ASSERT_FALSE(valid);
+    BIO_free(bio_sig);
+
+    // Sign from memory and verify the (partial) data from the offset
+    bio_sig = BIO_new(BIO_s_mem());
+    ASSERT_NE(bio_sig, nullptr);
+    ASSERT_TRUE(mb::sign::sign_data_buf(data + 1, data_size - 1, bio_sig,
+                                        private_key));
+    ASSERT_EQ(lseek(fd, 1, SEEK_SET), 1);
+    valid = false;
+    ASSERT_TRUE(mb::sign::verify_data_fd(fd, bio_sig, &public_key, 1,
+                                         &valid, nullptr));
+    ASSERT_TRUE(valid);
+    BIO_free(bio_sig);
+
+    close(fd);
+    EVP_PKEY_free(private_key);
+    EVP_PKEY_free(public_key);
+    BIO_free(bio_data);
+}
@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <cstdio>
+
+#include "mbcommon/file/memory.h"
+#include "mbcommon/file_util.h"
+
+#include "mbsparse/sparse.h"
+#include "mbsparse/writer.h"
+
+#include "corpus.h"
+
+// Size of the expanded images
+#define CORPUS_EXPANDED_SIZE    (32 * 1024 * 1024)
+// Buffer size for sequential reads and writes
+#define IO_BUFFER_SIZE          (1024 * 1024)
+
+// Chunk type mixes modeled after the images found in factory images
+struct Profile
+{
+    const char *name;
+    unsigned int raw_weight;
+    unsigned int fill_weight;
+    unsigned int dont_care_weight;
+    uint32_t crc32_interval;
+};
+
+static const Profile profiles[] = {
+    // Raw data only
+    { "raw",     100,  0,  0,  0 },
+    // system/vendor images: long runs of raw data separated by holes
+    { "system",   60, 10, 30,  0 },
+    // userdata/cache images: mostly zero filled or unused blocks
+    { "userdata",  5, 65, 30,  0 },
+    // Same as system, but with CRC32 chunks (eg. from some Samsung firmware)
+    { "crc32",    60, 10, 30, 16 },
+};
+
+// Generating a corpus is slow and the function of a benchmark is called
+// multiple times while the iteration count is being determined, so keep the
+// most recently used corpus around
+static const Corpus & get_corpus(const Profile &profile,
+                                 benchmark::State &state)
+{
+    static const Profile *cached_profile = nullptr;
+    static CorpusConfig cached_config;
+    static Corpus corpus;
+
+    CorpusConfig config = {};
+    config.expanded_size = CORPUS_EXPANDED_SIZE;
+    config.block_size = static_cast<uint32_t>(state.range(0));
+    config.chunk_count = static_cast<uint32_t>(state.range(1));
+    config.raw_weight = profile.raw_weight;
+    config.fill_weight = profile.fill_weight;
+    config.dont_care_weight = profile.dont_care_weight;
+    config.crc32_interval = profile.crc32_interval;
+
+    if (cached_profile != &profile
+            || cached_config.block_size != config.block_size
+            || cached_config.chunk_count != config.chunk_count) {
+        // Release the old corpus first to limit memory usage
+        corpus = Corpus();
+        corpus = generate_corpus(config, 12345);
+        cached_profile = &profile;
+        cached_config = config;
+    }
+
+    return corpus;
+}
+
+// Args: block size, chunk count
+static void BM_SparseRead(benchmark::State &state, const Profile *profile,
+                          bool verify)
+{
+    auto const &corpus = get_corpus(*profile, state);
+    std::vector<unsigned char> buf(IO_BUFFER_SIZE);
+
+    for (auto _ : state) {
+        mb::MemoryFile source(corpus.sparse.data(), corpus.sparse.size());
+        mb::sparse::SparseFile file;
+        size_t n;
+
+        file.set_verify_crc32(verify);
+
+        if (!file.open(&source)) {
+            state.SkipWithError(file.error_string().c_str());
+            break;
+        }
+
+        bool ret;
+        do {
+            ret = mb::file_read_fully(file, buf.data(), buf.size(), n);
+        } while (ret && n == buf.size());
+
+        if (!ret || !file.close()) {
+            state.SkipWithError(file.error_string().c_str());
+            break;
+        }
+    }
+
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations())
+            * static_cast<int64_t>(corpus.expanded.size()));
+}
+
+// Args: block size, chunk count
+static void BM_SparseSeek(benchmark::State &state, const Profile *profile)
+{
+    auto const &corpus = get_corpus(*profile, state);
+    mb::MemoryFile source(corpus.sparse.data(), corpus.sparse.size());
+    mb::sparse::SparseFile file;
+
+    if (!file.open(&source)) {
+        state.SkipWithError(file.error_string().c_str());
+        return;
+    }
+
+    // Each seek is followed by a small read to make sure that the chunk at the
+    // new offset is actually processed
+    std::vector<unsigned char> buf(4096);
+    std::vector<uint64_t> offsets(1024);
+    std::mt19937 gen(12345);
+    std::uniform_int_distribution<uint64_t> dist(
+            0, corpus.expanded.size() - buf.size());
+
+    for (auto &offset : offsets) {
+        offset = dist(gen);
+    }
+
+    size_t i = 0;
+
+    for (auto _ : state) {
+        size_t n;
+
+        if (!file.seek(static_cast<int64_t>(offsets[i]), SEEK_SET, nullptr)
+                || !mb::file_read_fully(file, buf.data(), buf.size(), n)) {
+            state.SkipWithError(file.error_string().c_str());
+            break;
+        }
+
+        i = (i + 1) % offsets.size();
+    }
+
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+
+// Args: block size, chunk count
+static void BM_SparseEncodeRanges(benchmark::State &state,
+                                  const Profile *profile)
+{
+    auto const &corpus = get_corpus(*profile, state);
+    std::vector<unsigned char> output;
+    output.reserve(corpus.sparse.size());
+
+    for (auto _ : state) {
+        mb::MemoryFile input(corpus.expanded.data(), corpus.expanded.size());
+        output.clear();
+        mb::MemoryFile file(&output);
+
+        if (!mb::sparse::write_sparse_file(
+                input, file, static_cast<uint32_t>(state.range(0)),
+                corpus.block_count, corpus.ranges)) {
+            state.SkipWithError(file.error_string().c_str());
+            break;
+        }
+    }
+
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations())
+            * static_cast<int64_t>(corpus.expanded.size()));
+}
+
+// Args: block size, chunk count
+static void BM_SparseEncodeStream(benchmark::State &state,
+                                  const Profile *profile)
+{
+    auto const &corpus = get_corpus(*profile, state);
+    std::vector<unsigned char> output;
+    output.reserve(corpus.sparse.size());
+
+    for (auto _ : state) {
+        output.clear();
+        mb::MemoryFile file(&output);
+        mb::sparse::SparseWriter writer(
+                &file, static_cast<uint32_t>(state.range(0)), false);
+        bool ret = writer.is_open();
+
+        for (size_t offset = 0; ret && offset < corpus.expanded.size();
+                offset += IO_BUFFER_SIZE) {
+            size_t n;
+            ret = mb::file_write_fully(
+                    writer, corpus.expanded.data() + offset,
+                    std::min<size_t>(IO_BUFFER_SIZE,
+                                     corpus.expanded.size() - offset), n);
+        }
+
+        if (!ret || !writer.close()) {
+            state.SkipWithError(writer.error_string().c_str());
+            break;
+        }
+    }
+
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations())
+            * static_cast<int64_t>(corpus.expanded.size()));
+}
+
+static void apply_args(benchmark::internal::Benchmark *b)
+{
+    b->ArgNames({"blksz", "chunks"})
+        ->ArgsProduct({{1024, 4096}, {16, 1024, 8192}});
+}
+
+static int register_benchmarks()
+{
+    for (auto const &profile : profiles) {
+        std::string suffix = std::string("/") + profile.name;
+
+        benchmark::RegisterBenchmark(("BM_SparseRead" + suffix).c_str(),
+                                     &BM_SparseRead, &profile, false)
+            ->Apply(&apply_args);
+        if (profile.crc32_interval != 0) {
+            benchmark::RegisterBenchmark(
+                    ("BM_SparseReadVerify" + suffix).c_str(),
+                    &BM_SparseRead, &profile, true)
+                ->Apply(&apply_args);
+        }
+        benchmark::RegisterBenchmark(("BM_SparseSeek" + suffix).c_str(),
+                                     &BM_SparseSeek, &profile)
+            ->Apply(&apply_args);
+        benchmark::RegisterBenchmark(
+                ("BM_SparseEncodeRanges" + suffix).c_str(),
+                &BM_SparseEncodeRanges, &profile)
+            ->Apply(&apply_args);
+        benchmark::RegisterBenchmark(
+                ("BM_SparseEncodeStream" + suffix).c_str(),
+                &BM_SparseEncodeStream, &profile)
+            ->Apply(&apply_args);
+    }
+
+    return 0;
+}
+
+BENCHMARK_UNUSED static int registered = register_benchmarks();
@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "corpus.h"
+
+#include <algorithm>
+#include <random>
+
+#include <cstring>
+
+#include <zlib.h>
+
+#include "mbcommon/endian.h"
+
+#include "mbsparse/sparse.h"
+#include "mbsparse/sparse_p.h"
+
+using namespace mb::sparse;
+
+static void fix_sparse_header_byte_order(SparseHeader &header)
+{
+    header.magic = mb_htole32(header.magic);
+    header.major_version = mb_htole16(header.major_version);
+    header.minor_version = mb_htole16(header.minor_version);
+    header.file_hdr_sz = mb_htole16(header.file_hdr_sz);
+    header.chunk_hdr_sz = mb_htole16(header.chunk_hdr_sz);
+    header.blk_sz = mb_htole32(header.blk_sz);
+    header.total_blks = mb_htole32(header.total_blks);
+    header.total_chunks = mb_htole32(header.total_chunks);
+    header.image_checksum = mb_htole32(header.image_checksum);
+}
+
+static void fix_chunk_header_byte_order(ChunkHeader &header)
+{
+    header.chunk_type = mb_htole16(header.chunk_type);
+    header.reserved1 = mb_htole16(header.reserved1);
+    header.chunk_sz = mb_htole32(header.chunk_sz);
+    header.total_sz = mb_htole32(header.total_sz);
+}
+
+static void append(std::vector<unsigned char> &data, const void *buf,
+                   size_t size)
+{
+    auto ptr = static_cast<const unsigned char *>(buf);
+    data.insert(data.end(), ptr, ptr + size);
+}
+
+static void append_chunk_header(std::vector<unsigned char> &data,
+                                uint16_t type, uint32_t chunk_sz,
+                                uint32_t data_size)
+{
+    ChunkHeader chdr = {};
+    chdr.chunk_type = type;
+    chdr.chunk_sz = chunk_sz;
+    chdr.total_sz = static_cast<uint32_t>(sizeof(ChunkHeader) + data_size);
+    fix_chunk_header_byte_order(chdr);
+
+    append(data, &chdr, sizeof(chdr));
+}
+
+/*!
+ * \brief Generate sparse image and its expanded equivalent
+ *
+ * The blocks of the expanded image are divided among the chunks, with each
+ * chunk's size varying randomly between half and one and a half times the
+ * average. Raw chunks contain random printable characters, so they are never
+ * mistaken for fill data. Fill chunks use zero three quarters of the time, as
+ * is typical for ext4 images.
+ *
+ * \param config Shape of the image
+ * \param seed Seed for the random number generator
+ *
+ * \return Generated corpus
+ */
+Corpus generate_corpus(const CorpusConfig &config, unsigned int seed)
+{
+    Corpus corpus;
+    std::mt19937 gen(seed);
+    std::discrete_distribution<int> type_dist({
+        static_cast<double>(config.raw_weight),
+        static_cast<double>(config.fill_weight),
+        static_cast<double>(config.dont_care_weight),
+    });
+    std::uniform_int_distribution<int> byte_dist('a', 'y');
+    std::uniform_int_distribution<uint32_t> fill_dist;
+
+    uint64_t total_blocks = config.expanded_size / config.block_size;
+    uint32_t chunk_count = static_cast<uint32_t>(
+            std::min<uint64_t>(config.chunk_count, total_blocks));
+    uint64_t avg_blocks = total_blocks / chunk_count;
+    std::uniform_int_distribution<uint64_t> size_dist(
+            std::max<uint64_t>(avg_blocks / 2, 1), avg_blocks * 3 / 2);
+
+    // Sparse header is written once the chunk count is known
+    corpus.sparse.resize(sizeof(SparseHeader));
+    corpus.expanded.reserve(total_blocks * config.block_size);
+    corpus.block_count = total_blocks;
+
+    uint32_t total_chunks = 0;
+    uint64_t block = 0;
+    uint32_t crc = 0;
+    size_t crc_offset = 0;
+
+    for (uint32_t i = 0; i < chunk_count; ++i) {
+        uint64_t remaining = total_blocks - block;
+        uint64_t blocks = i == chunk_count - 1 ? remaining
+                : std::min(size_dist(gen), remaining - (chunk_count - i - 1));
+        uint64_t size = blocks * config.block_size;
+        auto chunk_sz = static_cast<uint32_t>(blocks);
+
+        int type = type_dist(gen);
+
+        switch (type) {
+        case 0: {
+            append_chunk_header(corpus.sparse, CHUNK_TYPE_RAW, chunk_sz,
+                                static_cast<uint32_t>(size));
+
+            size_t offset = corpus.expanded.size();
+            corpus.expanded.resize(offset + size);
+            for (size_t j = offset; j < corpus.expanded.size(); ++j) {
+                corpus.expanded[j] = static_cast<unsigned char>(byte_dist(gen));
+            }
+            append(corpus.sparse, corpus.expanded.data() + offset, size);
+            break;
+        }
+        case 1: {
+            uint32_t fill_val = fill_dist(gen) % 4 == 0 ? fill_dist(gen) : 0;
+            uint32_t fill_val_le = mb_htole32(fill_val);
+
+            append_chunk_header(corpus.sparse, CHUNK_TYPE_FILL, chunk_sz,
+                                sizeof(fill_val_le));
+            append(corpus.sparse, &fill_val_le, sizeof(fill_val_le));
+
+            for (uint64_t j = 0; j < size; j += sizeof(fill_val_le)) {
+                append(corpus.expanded, &fill_val_le, sizeof(fill_val_le));
+            }
+            break;
+        }
+        default:
+            append_chunk_header(corpus.sparse, CHUNK_TYPE_DONT_CARE, chunk_sz,
+                                0);
+            corpus.expanded.resize(corpus.expanded.size() + size);
+            break;
+        }
+
+        // Blocks with data, for the encoder
+        if (type != 2) {
+            if (!corpus.ranges.empty() && corpus.ranges.back().end == block) {
+                corpus.ranges.back().end += blocks;
+            } else {
+                corpus.ranges.push_back({ block, block + blocks });
+            }
+        }
+
+        ++total_chunks;
+        block += blocks;
+
+        if (config.crc32_interval != 0
+                && (i + 1) % config.crc32_interval == 0) {
+            // Checksum of all expanded data up to this point
+            crc = static_cast<uint32_t>(::crc32(
+                    crc, corpus.expanded.data() + crc_offset,
+                    static_cast<uInt>(corpus.expanded.size() - crc_offset)));
+            crc_offset = corpus.expanded.size();
+
+            uint32_t crc_le = mb_htole32(crc);
+
+            append_chunk_header(corpus.sparse, CHUNK_TYPE_CRC32, 0,
+                                sizeof(crc_le));
+            append(corpus.sparse, &crc_le, sizeof(crc_le));
+            ++total_chunks;
+        }
+    }
+
+    SparseHeader shdr = {};
+    shdr.magic = SPARSE_HEADER_MAGIC;
+    shdr.major_version = SPARSE_HEADER_MAJOR_VER;
+    shdr.minor_version = 0;
+    shdr.file_hdr_sz = sizeof(SparseHeader);
+    shdr.chunk_hdr_sz = sizeof(ChunkHeader);
+    shdr.blk_sz = config.block_size;
+    shdr.total_blks = static_cast<uint32_t>(total_blocks);
+    shdr.total_chunks = total_chunks;
+    shdr.image_checksum = 0;
+    fix_sparse_header_byte_order(shdr);
+
+    memcpy(corpus.sparse.data(), &shdr, sizeof(shdr));
+
+    return corpus;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <vector>
+
+#include <cstdint>
+
+#include "mbsparse/writer.h"
+
+// Shape of a synthetic sparse image
+struct CorpusConfig
+{
+    // Size of the expanded image in bytes (rounded down to whole blocks)
+    uint64_t expanded_size;
+    uint32_t block_size;
+    // Number of RAW, FILL, and DONT_CARE chunks
+    uint32_t chunk_count;
+    // Relative frequencies of the chunk types
+    unsigned int raw_weight;
+    unsigned int fill_weight;
+    unsigned int dont_care_weight;
+    // Add a CRC32 chunk after every this many chunks (0 to disable)
+    uint32_t crc32_interval;
+};
+
+struct Corpus
+{
+    // Sparse image
+    std::vector<unsigned char> sparse;
+    // Expanded image with "don't care" regions zeroed
+    std::vector<unsigned char> expanded;
+    // Block ranges that are not "don't care" regions
+    std::vector<mb::sparse::BlockRange> ranges;
+    uint64_t block_count;
+};
+
+Corpus generate_corpus(const CorpusConfig &config, unsigned int seed);
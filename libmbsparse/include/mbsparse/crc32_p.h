@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbsparse/guard_p.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace mb
+{
+namespace sparse
+{
+
+/*! \cond INTERNAL */
+
+uint32_t crc32_repeat(uint32_t crc, const unsigned char *data, size_t size,
+                      uint64_t count);
+
+/*! \endcond */
+
+}
+}
@@ -46,6 +46,12 @@ public:
     // File size
     uint64_t size();
 
+    // Sparse regions
+    bool region(uint64_t &size, bool &dont_care);
+
+    // Integrity checking
+    void set_verify_crc32(bool verify);
+
 protected:
     /*! \cond INTERNAL */
     SparseFile(SparseFilePrivate *priv);
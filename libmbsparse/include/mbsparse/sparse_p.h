@@ -92,6 +92,9 @@ struct ChunkInfo
 
     /*! \brief [CHUNK_TYPE_FILL only] Filler value for the chunk */
     uint32_t fill_val;
+
+    /*! \brief [CHUNK_TYPE_CRC32 only] Expected checksum of preceding data */
+    uint32_t crc32;
 };
 
 enum class Seekability
@@ -132,12 +135,23 @@ public:
 
     bool move_to_chunk(uint64_t offset);
 
+    bool update_crc32(uint64_t offset, const void *data, size_t size);
+    bool skip_crc32(uint64_t offset);
+    bool check_crc32_chunks();
+
     File *file;
     Seekability seekability;
 
-    // Expected CRC32 checksum. We currently do *not* validate this. It would
-    // only work if the entire file was read sequentially anyway.
-    uint32_t expected_crc32;
+    // Whether to verify CRC32 chunks (not reset by clear())
+    bool verify_crc32;
+    // Whether crc32 still covers all data from the beginning of the file.
+    // Verification stops if data is skipped without being read.
+    bool crc32_valid;
+    // CRC32 of the expanded data in [0, crc32_offset)
+    uint32_t crc32;
+    uint64_t crc32_offset;
+    // Index of the first chunk that has not been fully checksummed
+    size_t crc32_chunk;
     // Relative offset in input file
     uint64_t cur_src_offset;
     // Absolute offset in output file
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <functional>
+#include <vector>
+
+#include <cstdint>
+
+#include "mbcommon/file.h"
+
+namespace mb
+{
+namespace sparse
+{
+
+class SparseFileSetPrivate;
+class MB_EXPORT SparseFileSet : public File
+{
+    MB_DECLARE_PRIVATE(SparseFileSet)
+
+public:
+    typedef std::function<bool(uint64_t offset, const void *data,
+                               size_t size)> PositionalWriter;
+
+    SparseFileSet();
+    SparseFileSet(const std::vector<File *> &files);
+    virtual ~SparseFileSet();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(SparseFileSet)
+    MB_DEFAULT_MOVE_CONSTRUCT_AND_ASSIGN(SparseFileSet)
+
+    // File open
+    bool open(const std::vector<File *> &files);
+
+    // File size
+    uint64_t size();
+
+    // Sparse regions
+    bool region(uint64_t &size, bool &dont_care);
+
+    // Extraction
+    bool extract(const PositionalWriter &writer,
+                 unsigned int max_parallelism = 0);
+
+protected:
+    /*! \cond INTERNAL */
+    SparseFileSet(SparseFileSetPrivate *priv);
+    SparseFileSet(SparseFileSetPrivate *priv,
+                  const std::vector<File *> &files);
+    /*! \endcond */
+
+    virtual bool on_open() override;
+    virtual bool on_close() override;
+    virtual bool on_read(void *buf, size_t size,
+                         size_t &bytes_read) override;
+    virtual bool on_seek(int64_t offset, int whence,
+                         uint64_t &new_offset) override;
+
+private:
+    std::unique_ptr<SparseFileSetPrivate> _priv_ptr;
+};
+
+}
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbsparse/guard_p.h"
+
+#include <memory>
+#include <vector>
+
+#include <cstdint>
+
+#include "mbsparse/sparse.h"
+
+namespace mb
+{
+namespace sparse
+{
+
+/*! \cond INTERNAL */
+
+/*! \brief Range of the expanded image that is provided by one part */
+struct SetExtent
+{
+    // Half-open byte range: [begin, end)
+    uint64_t begin;
+    uint64_t end;
+    // Index of the part that supplies the data
+    size_t part;
+};
+
+class SparseFileSetPrivate
+{
+    MB_DECLARE_PUBLIC(SparseFileSet)
+
+public:
+    SparseFileSetPrivate(SparseFileSet *sfs);
+    ~SparseFileSetPrivate() = default;
+
+    void clear();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(SparseFileSetPrivate)
+
+    bool index_part(size_t part, std::vector<SetExtent> &extents);
+    std::vector<SetExtent>::const_iterator find_extent(uint64_t offset) const;
+    bool read_part(size_t part, uint64_t offset, void *buf, size_t size);
+
+    std::vector<File *> files;
+    std::vector<std::unique_ptr<SparseFile>> parts;
+
+    // Sorted, non-overlapping extents. Offsets not covered by any extent are
+    // "don't care" regions.
+    std::vector<SetExtent> extents;
+
+    // Size of the expanded image (the largest size of all parts)
+    uint64_t file_size;
+    // Current offset in the expanded image
+    uint64_t cur_offset;
+
+private:
+    SparseFileSet *_pub_ptr;
+};
+
+/*! \endcond */
+
+}
+}
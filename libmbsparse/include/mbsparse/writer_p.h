@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbsparse/guard_p.h"
+
+#include <vector>
+
+#include <cstdint>
+
+namespace mb
+{
+namespace sparse
+{
+
+/*! \cond INTERNAL */
+
+class SparseWriterPrivate
+{
+    MB_DECLARE_PUBLIC(SparseWriter)
+
+public:
+    SparseWriterPrivate(SparseWriter *sw);
+    ~SparseWriterPrivate() = default;
+
+    void clear();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(SparseWriterPrivate)
+
+    bool wwrite(const void *buf, size_t size);
+
+    bool add_blocks(const unsigned char *data, uint64_t count);
+    bool add_hole(uint64_t count);
+    bool skip_to(uint64_t offset);
+    bool flush_chunk();
+    bool finish();
+
+    File *file;
+    uint32_t block_size;
+    bool checksum;
+
+    // Offset of the sparse header in the output file
+    uint64_t header_offset;
+    // Number of chunks written to the output file
+    uint32_t total_chunks;
+    // CRC32 of the expanded data that has been written so far
+    uint32_t image_crc32;
+
+    // Current offset in the expanded file
+    uint64_t cur_offset;
+    // Size of the expanded file
+    uint64_t file_size;
+
+    // Number of blocks that have been added to chunks
+    uint64_t blocks_done;
+    // Partial block following the last block in blocks_done
+    std::vector<unsigned char> block_buf;
+    size_t block_used;
+
+    // Chunk that is still being extended. A zero chunk_type means that there
+    // is no pending chunk.
+    uint16_t chunk_type;
+    uint64_t chunk_blocks;
+    unsigned char chunk_fill[4];
+    std::vector<unsigned char> chunk_raw;
+
+    // Scratch block used for computing checksums of fill chunks
+    std::vector<unsigned char> fill_buf;
+
+private:
+    SparseWriter *_pub_ptr;
+};
+
+/*! \endcond */
+
+}
+}
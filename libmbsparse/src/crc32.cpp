@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbsparse/crc32_p.h"
+
+#include <zlib.h>
+
+// Largest length passed to crc32_combine(). This keeps the length within the
+// range of z_off_t on 32-bit systems.
+#define MAX_CRC32_COMBINE_SIZE  (1u << 30)
+
+namespace mb
+{
+namespace sparse
+{
+
+/*! \cond INTERNAL */
+
+/*!
+ * \brief Update a CRC32 checksum with repeated data
+ *
+ * The checksum of \p data is only computed once. Longer runs are built up by
+ * combining checksums, so large fill and "don't care" regions never need to be
+ * expanded.
+ *
+ * \param crc Checksum to update
+ * \param data Data to repeat
+ * \param size Size of \p data
+ * \param count Number of times \p data is repeated
+ *
+ * \return Updated checksum
+ */
+uint32_t crc32_repeat(uint32_t crc, const unsigned char *data, size_t size,
+                      uint64_t count)
+{
+    if (size == 0 || count == 0) {
+        return crc;
+    }
+
+    uLong data_crc = ::crc32(0, data, static_cast<uInt>(size));
+
+    while (count > 0) {
+        uLong run_crc = data_crc;
+        uint64_t run_count = 1;
+
+        while (run_count * 2 <= count
+                && run_count * 2 * size <= MAX_CRC32_COMBINE_SIZE) {
+            run_crc = crc32_combine(run_crc, run_crc,
+                                    static_cast<z_off_t>(run_count * size));
+            run_count *= 2;
+        }
+
+        crc = static_cast<uint32_t>(crc32_combine(
+                crc, run_crc, static_cast<z_off_t>(run_count * size)));
+        count -= run_count;
+    }
+
+    return crc;
+}
+
+/*! \endcond */
+
+}
+}
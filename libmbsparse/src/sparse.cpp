@@ -30,11 +30,14 @@
 #include <cstdint>
 #include <cstring>
 
+#include <zlib.h>
+
 #include "mbcommon/algorithm.h"
 #include "mbcommon/endian.h"
 #include "mbcommon/file_util.h"
 #include "mbcommon/string.h"
 
+#include "mbsparse/crc32_p.h"
 #include "mbsparse/sparse_p.h"
 
 // Enable debug logging of headers, offsets, etc.?
@@ -142,7 +145,8 @@ struct OffsetComp
 };
 
 SparseFilePrivate::SparseFilePrivate(SparseFile *sf)
-    : _pub_ptr(sf)
+    : verify_crc32(false)
+    , _pub_ptr(sf)
 {
     clear();
 }
@@ -150,7 +154,10 @@ SparseFilePrivate::SparseFilePrivate(SparseFile *sf)
 void SparseFilePrivate::clear()
 {
     file = nullptr;
-    expected_crc32 = 0;
+    crc32_valid = true;
+    crc32 = 0;
+    crc32_offset = 0;
+    crc32_chunk = 0;
     cur_src_offset = 0;
     cur_tgt_offset = 0;
     file_size = 0;
@@ -226,6 +233,7 @@ bool SparseFilePrivate::skip_bytes(uint64_t bytes)
             pub->set_fatal(true);
             return false;
         }
+        cur_src_offset += discarded;
         return true;
     }
 
@@ -480,17 +488,20 @@ bool SparseFilePrivate::process_crc32_chunk(const ChunkHeader &chdr,
         return false;
     }
 
+    uint64_t src_begin = cur_src_offset - shdr.chunk_hdr_sz;
+
     if (!wread(&crc32, sizeof(crc32))) {
         return false;
     }
 
-    expected_crc32 = mb_le32toh(crc32);
+    uint64_t src_end = cur_src_offset;
 
     chunk_out.type = chdr.chunk_type;
     chunk_out.begin = tgt_offset;
     chunk_out.end = tgt_offset;
-    chunk_out.src_begin = tgt_offset - shdr.chunk_hdr_sz;
-    chunk_out.src_end = tgt_offset + data_size;
+    chunk_out.src_begin = src_begin;
+    chunk_out.src_end = src_end;
+    chunk_out.crc32 = mb_le32toh(crc32);
 
     return true;
 }
@@ -548,6 +559,11 @@ bool SparseFilePrivate::process_chunk(const ChunkHeader &chdr,
 /*!
  * \brief Move to chunk that is responsible for the specified offset
  *
+ * Chunks that have already been read are kept in \a chunks, which is sorted by
+ * offset, so moving to one of them only requires a binary search. Chunk headers
+ * are only read when the offset is past the last indexed chunk and only until
+ * the chunk containing the offset is found.
+ *
  * \note This function only returns a failure code if a file operation fails. To
  *       check if a matching chunk is found, use `chunk != chunks.end()`.
  *
@@ -572,8 +588,16 @@ bool SparseFilePrivate::move_to_chunk(uint64_t offset)
         }
     }
 
-    // We don't have the chunk, so read until we find it
     chunk = chunks.end();
+
+    // No chunk covers data past the end of the file, so don't bother reading
+    // the remaining chunk headers (eg. when seeking to the end of the file).
+    // They're still needed for verifying a trailing CRC32 chunk.
+    if (offset >= file_size && !(verify_crc32 && crc32_valid)) {
+        return true;
+    }
+
+    // We don't have the chunk, so read until we find it
     while (chunks.size() < shdr.total_chunks) {
         size_t chunk_num = chunks.size();
 
@@ -686,6 +710,131 @@ bool SparseFilePrivate::move_to_chunk(uint64_t offset)
     return true;
 }
 
+/*!
+ * \brief Update checksum with data read from the sparse file
+ *
+ * Only data past \a crc32_offset is checksummed. If there is a gap between
+ * \a crc32_offset and \p offset, verification is stopped.
+ *
+ * \return False if a CRC32 chunk does not match the data
+ */
+bool SparseFilePrivate::update_crc32(uint64_t offset, const void *data,
+                                     size_t size)
+{
+    if (!verify_crc32 || !crc32_valid) {
+        return true;
+    }
+
+    if (offset > crc32_offset) {
+        DEBUG("Data was skipped; no longer verifying CRC32 chunks");
+        crc32_valid = false;
+        return true;
+    }
+
+    uint64_t end = offset + size;
+    if (end <= crc32_offset) {
+        return true;
+    }
+
+    size_t skip = static_cast<size_t>(crc32_offset - offset);
+    crc32 = static_cast<uint32_t>(::crc32(
+            crc32, static_cast<const unsigned char *>(data) + skip,
+            static_cast<uInt>(size - skip)));
+    crc32_offset = end;
+
+    return check_crc32_chunks();
+}
+
+/*!
+ * \brief Update checksum with data that was seeked over
+ *
+ * Fill and "don't care" chunks can be checksummed without reading anything.
+ * If a raw chunk is skipped, verification is stopped.
+ *
+ * \return False if a CRC32 chunk does not match the data
+ */
+bool SparseFilePrivate::skip_crc32(uint64_t offset)
+{
+    if (!verify_crc32 || !crc32_valid) {
+        return true;
+    }
+
+    while (crc32_offset < offset) {
+        if (!check_crc32_chunks()) {
+            return false;
+        } else if (crc32_chunk == chunks.size()) {
+            break;
+        }
+
+        const ChunkInfo &info = chunks[crc32_chunk];
+        uint64_t end = std::min(info.end, offset);
+        unsigned char pattern[4] = {};
+
+        switch (info.type) {
+        case CHUNK_TYPE_FILL: {
+            auto shift = (crc32_offset - info.begin) % sizeof(uint32_t);
+            uint32_t fill_val = mb_htole32(info.fill_val);
+            for (size_t i = 0; i < sizeof(uint32_t); ++i) {
+                pattern[i] = reinterpret_cast<unsigned char *>(&fill_val)
+                        [(i + shift) % sizeof(uint32_t)];
+            }
+            break;
+        }
+        case CHUNK_TYPE_DONT_CARE:
+            break;
+        default:
+            DEBUG("Raw data was skipped; no longer verifying CRC32 chunks");
+            crc32_valid = false;
+            return true;
+        }
+
+        unsigned char block[4096];
+        for (size_t i = 0; i < sizeof(block); ++i) {
+            block[i] = pattern[i % sizeof(pattern)];
+        }
+
+        uint64_t size = end - crc32_offset;
+        crc32 = crc32_repeat(crc32, block, sizeof(block),
+                             size / sizeof(block));
+        crc32 = static_cast<uint32_t>(::crc32(
+                crc32, block, static_cast<uInt>(size % sizeof(block))));
+        crc32_offset = end;
+    }
+
+    return check_crc32_chunks();
+}
+
+/*!
+ * \brief Verify CRC32 chunks covered by the data checksummed so far
+ *
+ * \return False if a CRC32 chunk does not match the data
+ */
+bool SparseFilePrivate::check_crc32_chunks()
+{
+    MB_PUBLIC(SparseFile);
+
+    if (!verify_crc32 || !crc32_valid) {
+        return true;
+    }
+
+    for (; crc32_chunk < chunks.size()
+            && chunks[crc32_chunk].end <= crc32_offset; ++crc32_chunk) {
+        const ChunkInfo &info = chunks[crc32_chunk];
+
+        if (info.type == CHUNK_TYPE_CRC32 && info.begin == crc32_offset
+                && info.crc32 != crc32) {
+            pub->set_error(make_error_code(FileError::BadFileFormat),
+                           "CRC32 chunk #%" MB_PRIzu " expected checksum "
+                           "0x%08" PRIx32 ", but data has checksum 0x%08"
+                           PRIx32, crc32_chunk, info.crc32, crc32);
+            pub->set_fatal(true);
+            return false;
+        }
+    }
+
+    return true;
+}
+
 /*! \endcond */
 
 /*!
@@ -770,6 +919,64 @@ uint64_t SparseFile::size()
     return priv->file_size;
 }
 
+/*!
+ * \brief Set whether to verify CRC32 chunks
+ *
+ * If enabled, the data is checksummed as it is read and compared against every
+ * CRC32 chunk in the sparse file. A mismatch causes read() to fail with
+ * FileError::BadFileFormat. Fill and "don't care" regions that are seeked over
+ * are still checksummed, but verification silently stops if raw data is
+ * skipped or if the file is read out of order.
+ *
+ * This option is not reset when the file is closed.
+ *
+ * \param verify Whether to verify CRC32 chunks
+ */
+void SparseFile::set_verify_crc32(bool verify)
+{
+    MB_PRIVATE(SparseFile);
+    priv->verify_crc32 = verify;
+}
+
+/*!
+ * \brief Get the region of the sparse file at the current offset
+ *
+ * A region extends from the current offset to the end of the sparse chunk that
+ * contains it. This allows callers to avoid writing out "don't care" regions,
+ * which read back as zeros.
+ *
+ * \param[out] size Number of bytes until the end of the region. This is 0 if
+ *                  the current offset is at or past EOF.
+ * \param[out] dont_care Whether the region is a "don't care" region
+ *
+ * \return Whether the current region was successfully found
+ */
+bool SparseFile::region(uint64_t &size, bool &dont_care)
+{
+    MB_PRIVATE(SparseFile);
+
+    if (!is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "File is not open");
+        return false;
+    }
+
+    if (!priv->move_to_chunk(priv->cur_tgt_offset)
+            || !priv->check_crc32_chunks()) {
+        return false;
+    }
+
+    if (priv->chunk == priv->chunks.end()) {
+        size = 0;
+        dont_care = false;
+    } else {
+        size = priv->chunk->end - priv->cur_tgt_offset;
+        dont_care = priv->chunk->type == CHUNK_TYPE_DONT_CARE;
+    }
+
+    return true;
+}
+
 /*!
  * \brief Open sparse file for reading
  *
@@ -909,7 +1116,8 @@ bool SparseFile::on_read(void *buf, size_t size, size_t &bytes_read)
     uint64_t total_read = 0;
 
     while (size > 0) {
-        if (!priv->move_to_chunk(priv->cur_tgt_offset)) {
+        if (!priv->move_to_chunk(priv->cur_tgt_offset)
+                || !priv->check_crc32_chunks()) {
             return false;
         } else if (priv->chunk == priv->chunks.end()) {
             OPER("Reached EOF");
@@ -934,7 +1142,14 @@ bool SparseFile::on_read(void *buf, size_t size, size_t &bytes_read)
             OPER("Raw data is %" PRIu64 " bytes into the raw chunk", diff);
 
             uint64_t raw_src_offset = priv->chunk->raw_begin + diff;
-            if (raw_src_offset != priv->cur_src_offset) {
+            if (raw_src_offset > priv->cur_src_offset
+                    && priv->seekability != Seekability::CAN_SEEK) {
+                // Forward seek into the raw chunk
+                if (!priv->skip_bytes(
+                        raw_src_offset - priv->cur_src_offset)) {
+                    return false;
+                }
+            } else if (raw_src_offset != priv->cur_src_offset) {
                 assert(priv->seekability == Seekability::CAN_SEEK);
 
                 int64_t seek_offset;
@@ -986,6 +1201,10 @@ bool SparseFile::on_read(void *buf, size_t size, size_t &bytes_read)
             assert(false);
         }
 
+        if (!priv->update_crc32(priv->cur_tgt_offset, buf, n_read)) {
+            return false;
+        }
+
         OPER("Read %" PRIu64 " bytes", n_read);
         total_read += n_read;
         priv->cur_tgt_offset += n_read;
@@ -1003,7 +1222,9 @@ bool SparseFile::on_read(void *buf, size_t size, size_t &bytes_read)
  * \p whence takes the same \a SEEK_SET, \a SEEK_CUR, and \a SEEK_END values as
  * \a lseek() in `\<stdio.h\>`.
  *
- * \note Seeking will only work if the underlying file handle supports seeking.
+ * \note Seeking backwards will only work if the underlying file handle supports
+ *       seeking. Seeking forwards is always supported, though the skipped data
+ *       may need to be read and discarded.
  *
  * \param[in] offset Offset to seek
  * \param[in] whence \a SEEK_SET, \a SEEK_CUR, or \a SEEK_END
@@ -1017,12 +1238,6 @@ bool SparseFile::on_seek(int64_t offset, int whence, uint64_t &new_offset_out)
 
     OPER("seek(%" PRId64 ", %d)", offset, whence);
 
-    if (priv->seekability != Seekability::CAN_SEEK) {
-        set_error(make_error_code(FileError::UnsupportedSeek),
-                  "Underlying file does not support seeking");
-        return false;
-    }
-
     uint64_t new_offset;
     switch (whence) {
     case SEEK_SET:
@@ -1057,7 +1272,16 @@ bool SparseFile::on_seek(int64_t offset, int whence, uint64_t &new_offset_out)
         return false;
     }
 
-    if (!priv->move_to_chunk(new_offset)) {
+    if (priv->seekability != Seekability::CAN_SEEK
+            && new_offset < priv->cur_tgt_offset) {
+        set_error(make_error_code(FileError::UnsupportedSeek),
+                  "Underlying file does not support seeking backwards");
+        return false;
+    }
+
+    if (!priv->move_to_chunk(new_offset)
+            || (new_offset > priv->cur_tgt_offset
+                    && !priv->skip_crc32(new_offset))) {
         return false;
     }
 
@@ -0,0 +1,590 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbsparse/sparse_set.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+
+#include "mbcommon/buffer_pool.h"
+#include "mbcommon/file_util.h"
+#include "mbcommon/string.h"
+#include "mbcommon/thread_pool.h"
+
+#include "mbsparse/sparse_set_p.h"
+
+namespace mb
+{
+namespace sparse
+{
+
+/*! \cond INTERNAL */
+
+SparseFileSetPrivate::SparseFileSetPrivate(SparseFileSet *sfs)
+    : _pub_ptr(sfs)
+{
+    clear();
+}
+
+void SparseFileSetPrivate::clear()
+{
+    std::vector<File *>().swap(files);
+    std::vector<std::unique_ptr<SparseFile>>().swap(parts);
+    std::vector<SetExtent>().swap(extents);
+    file_size = 0;
+    cur_offset = 0;
+}
+
+/*!
+ * \brief Find the byte ranges of a part that are not "don't care" regions
+ */
+bool SparseFileSetPrivate::index_part(size_t part,
+                                      std::vector<SetExtent> &part_extents)
+{
+    MB_PUBLIC(SparseFileSet);
+
+    SparseFile &file = *parts[part];
+    uint64_t offset = 0;
+
+    while (true) {
+        uint64_t size;
+        bool dont_care;
+
+        if (!file.region(size, dont_care)) {
+            pub->set_error(file.error(), "Part %" MB_PRIzu ": %s",
+                           part, file.error_string().c_str());
+            return false;
+        } else if (size == 0) {
+            break;
+        }
+
+        if (!dont_care) {
+            if (!part_extents.empty() && part_extents.back().end == offset) {
+                part_extents.back().end += size;
+            } else {
+                part_extents.push_back({offset, offset + size, part});
+            }
+        }
+
+        offset += size;
+
+        if (!file.seek(static_cast<int64_t>(offset), SEEK_SET, nullptr)) {
+            pub->set_error(file.error(), "Part %" MB_PRIzu ": %s",
+                           part, file.error_string().c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Find the first extent that ends after \p offset
+ */
+std::vector<SetExtent>::const_iterator
+SparseFileSetPrivate::find_extent(uint64_t offset) const
+{
+    return std::upper_bound(extents.begin(), extents.end(), offset,
+                            [](uint64_t o, const SetExtent &e) {
+        return o < e.end;
+    });
+}
+
+/*!
+ * \brief Read expanded data from a part
+ *
+ * This does not touch any state shared between parts, so different parts can
+ * be read from different threads. On failure, the error is set on the part.
+ */
+bool SparseFileSetPrivate::read_part(size_t part, uint64_t offset,
+                                     void *buf, size_t size)
+{
+    SparseFile &file = *parts[part];
+    size_t n;
+
+    if (!file.seek(static_cast<int64_t>(offset), SEEK_SET, nullptr)
+            || !file_read_fully(file, buf, size, n)) {
+        return false;
+    } else if (n != size) {
+        file.set_error(std::make_error_code(std::errc::io_error),
+                       "Unexpected EOF at offset %" PRIu64, offset + n);
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Combine the extents of every part into a single index
+ *
+ * Where parts overlap, the later part wins. This matches flashing the parts
+ * one after another.
+ */
+static std::vector<SetExtent>
+merge_extents(const std::vector<SetExtent> &all_extents)
+{
+    struct Event
+    {
+        uint64_t offset;
+        size_t part;
+        bool start;
+    };
+
+    std::vector<Event> events;
+    events.reserve(all_extents.size() * 2);
+
+    for (auto const &e : all_extents) {
+        events.push_back({e.begin, e.part, true});
+        events.push_back({e.end, e.part, false});
+    }
+
+    std::sort(events.begin(), events.end(),
+              [](const Event &a, const Event &b) {
+        return a.offset < b.offset;
+    });
+
+    std::vector<SetExtent> result;
+    // Number of extents of each part that cover the current offset
+    std::map<size_t, size_t> active;
+    uint64_t prev = 0;
+
+    for (auto it = events.begin(); it != events.end();) {
+        uint64_t offset = it->offset;
+
+        if (!active.empty() && offset > prev) {
+            size_t owner = active.rbegin()->first;
+
+            if (!result.empty() && result.back().end == prev
+                    && result.back().part == owner) {
+                result.back().end = offset;
+            } else {
+                result.push_back({prev, offset, owner});
+            }
+        }
+
+        for (; it != events.end() && it->offset == offset; ++it) {
+            if (it->start) {
+                ++active[it->part];
+            } else if (--active[it->part] == 0) {
+                active.erase(it->part);
+            }
+        }
+
+        prev = offset;
+    }
+
+    return result;
+}
+
+/*! \endcond */
+
+/*!
+ * \class SparseFileSet
+ *
+ * \brief Read a set of sparse files as a single image.
+ *
+ * Some firmware splits images into several sparse files (eg. Motorola's
+ * `system.img_sparsechunk.N`). Each part describes the whole image, but stores
+ * data for only a portion of it and marks everything else as "don't care".
+ * The expanded image is the result of writing every part in order.
+ *
+ * When the set is opened, the chunks of every part are indexed to find which
+ * part supplies each byte range. Reads are then served from the right part and
+ * regions not covered by any part read back as zeros.
+ *
+ * The underlying files must support random seeking. Each part must use its own
+ * File instance, which allows extract() to decode the parts in parallel.
+ */
+
+/*!
+ * \brief Construct unbound SparseFileSet.
+ *
+ * The File handle will not be bound to any file. One of the open functions will
+ * need to be called to open a file.
+ */
+SparseFileSet::SparseFileSet()
+    : SparseFileSet(new SparseFileSetPrivate(this))
+{
+}
+
+/*!
+ * \brief Open set of sparse files from File handles.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(const std::vector<File *> &)
+ *
+ * \param files Parts in the order in which they would be flashed
+ */
+SparseFileSet::SparseFileSet(const std::vector<File *> &files)
+    : SparseFileSet(new SparseFileSetPrivate(this), files)
+{
+}
+
+/*! \cond INTERNAL */
+SparseFileSet::SparseFileSet(SparseFileSetPrivate *priv)
+    : _priv_ptr(priv)
+{
+}
+
+SparseFileSet::SparseFileSet(SparseFileSetPrivate *priv,
+                             const std::vector<File *> &files)
+    : _priv_ptr(priv)
+{
+    open(files);
+}
+/*! \endcond */
+
+SparseFileSet::~SparseFileSet()
+{
+    close();
+}
+
+/*!
+ * \brief Open set of sparse files from File handles.
+ *
+ * \note The SparseFileSet will *not* take ownership of the files in \p files.
+ *       The caller must ensure that they are properly closed and destroyed
+ *       when they are no longer needed.
+ *
+ * \param files Parts in the order in which they would be flashed
+ *
+ * \return Whether the set is successfully opened
+ */
+bool SparseFileSet::open(const std::vector<File *> &files)
+{
+    MB_PRIVATE(SparseFileSet);
+    if (priv) {
+        priv->files = files;
+    }
+    return File::open();
+}
+
+/*!
+ * \brief Get the size of the expanded image
+ *
+ * \return Largest size of all parts. The return value is undefined if the set
+ *         is not opened.
+ */
+uint64_t SparseFileSet::size()
+{
+    MB_PRIVATE(SparseFileSet);
+    return priv->file_size;
+}
+
+/*!
+ * \brief Get the region of the expanded image at the current offset
+ *
+ * This is the same as SparseFile::region(), except that a region ends wherever
+ * the part that supplies the data changes.
+ *
+ * \param[out] size Number of bytes until the end of the region. This is 0 if
+ *                  the current offset is at or past EOF.
+ * \param[out] dont_care Whether no part stores data for the region
+ *
+ * \return Whether the current region was successfully found
+ */
+bool SparseFileSet::region(uint64_t &size, bool &dont_care)
+{
+    MB_PRIVATE(SparseFileSet);
+
+    if (!is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "File is not open");
+        return false;
+    }
+
+    if (priv->cur_offset >= priv->file_size) {
+        size = 0;
+        dont_care = false;
+        return true;
+    }
+
+    auto it = priv->find_extent(priv->cur_offset);
+
+    if (it != priv->extents.end() && it->begin <= priv->cur_offset) {
+        size = it->end - priv->cur_offset;
+        dont_care = false;
+    } else {
+        uint64_t end = it != priv->extents.end() ? it->begin : priv->file_size;
+        size = end - priv->cur_offset;
+        dont_care = true;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Write the data of every part to its offset in the expanded image
+ *
+ * The parts are decoded in parallel on the shared thread pool. Each part only
+ * writes the ranges that it supplies according to the index, so the order in
+ * which the parts finish does not matter. "Don't care" regions are not
+ * written.
+ *
+ * \p writer is called concurrently from multiple threads with non-overlapping
+ * ranges. For a block device, it would typically call `pwrite64()` on a shared
+ * file descriptor. It should set `errno` if it returns false.
+ *
+ * \param writer Function to write data at an offset of the output
+ * \param max_parallelism Maximum number of parts to decode at once (0 for no
+ *                        limit other than the thread pool size)
+ *
+ * \return Whether all of the data was written. If false is returned, the error
+ *         is set on the SparseFileSet.
+ */
+bool SparseFileSet::extract(const PositionalWriter &writer,
+                            unsigned int max_parallelism)
+{
+    MB_PRIVATE(SparseFileSet);
+
+    if (!is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "File is not open");
+        return false;
+    }
+
+    std::vector<std::vector<SetExtent>> by_part(priv->parts.size());
+    for (auto const &e : priv->extents) {
+        by_part[e.part].push_back(e);
+    }
+
+    // Errors are recorded per part since set_error() is not thread safe
+    std::vector<std::error_code> errors(priv->parts.size());
+    std::vector<std::string> messages(priv->parts.size());
+
+    bool ret = parallel_for(priv->parts.size(), [&](size_t part) {
+        IoBuffer buf;
+        if (!buf.allocate()) {
+            errors[part] = std::error_code(errno, std::generic_category());
+            messages[part] = "Failed to allocate buffer";
+            return false;
+        }
+
+        for (auto const &e : by_part[part]) {
+            for (uint64_t offset = e.begin; offset < e.end;) {
+                size_t n = static_cast<size_t>(
+                        std::min<uint64_t>(e.end - offset, buf.size()));
+
+                if (!priv->read_part(part, offset, buf.data(), n)) {
+                    errors[part] = priv->parts[part]->error();
+                    messages[part] = priv->parts[part]->error_string();
+                    return false;
+                }
+
+                if (!writer(offset, buf.data(), n)) {
+                    errors[part] = std::error_code(
+                            errno, std::generic_category());
+                    messages[part] = format(
+                            "Failed to write at offset %" PRIu64 ": %s",
+                            offset, strerror(errno));
+                    return false;
+                }
+
+                offset += n;
+            }
+        }
+
+        return true;
+    }, max_parallelism);
+
+    if (!ret) {
+        for (size_t i = 0; i < errors.size(); ++i) {
+            if (errors[i]) {
+                set_error(errors[i], "Part %" MB_PRIzu ": %s",
+                          i, messages[i].c_str());
+                break;
+            }
+        }
+    }
+
+    return ret;
+}
+
+/*!
+ * \brief Open set of sparse files
+ *
+ * Every part is opened as a SparseFile and its chunks are indexed.
+ *
+ * \note This function will fail if any of the underlying files is not open.
+ *
+ * \return Whether the parts were successfully opened and indexed
+ */
+bool SparseFileSet::on_open()
+{
+    MB_PRIVATE(SparseFileSet);
+
+    if (priv->files.empty()) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "No sparse files provided");
+        return false;
+    }
+
+    if (std::find(priv->files.begin(), priv->files.end(), nullptr)
+            != priv->files.end()) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Sparse file list contains null file");
+        return false;
+    }
+
+    std::vector<SetExtent> all_extents;
+
+    for (size_t i = 0; i < priv->files.size(); ++i) {
+        std::unique_ptr<SparseFile> part(new SparseFile());
+
+        if (!part->open(priv->files[i])) {
+            set_error(part->error(), "Part %" MB_PRIzu ": %s",
+                      i, part->error_string().c_str());
+            return false;
+        }
+
+        priv->file_size = std::max(priv->file_size, part->size());
+        priv->parts.push_back(std::move(part));
+
+        if (!priv->index_part(i, all_extents)) {
+            return false;
+        }
+    }
+
+    priv->extents = merge_extents(all_extents);
+
+    return true;
+}
+
+/*!
+ * \brief Close opened set of sparse files
+ *
+ * The underlying files are not closed.
+ *
+ * \return True
+ */
+bool SparseFileSet::on_close()
+{
+    MB_PRIVATE(SparseFileSet);
+
+    // Reset to allow opening another set
+    priv->clear();
+
+    return true;
+}
+
+/*!
+ * \brief Read from the expanded image
+ *
+ * Data is read from whichever part supplies each byte range. "Don't care"
+ * regions read back as zeros.
+ *
+ * \param buf Buffer to read into
+ * \param size Buffer size
+ * \param bytes_read Output number of bytes that were read. 0 indicates end of
+ *                   file.
+ *
+ * \return Whether the read was successful
+ */
+bool SparseFileSet::on_read(void *buf, size_t size, size_t &bytes_read)
+{
+    MB_PRIVATE(SparseFileSet);
+
+    auto ptr = static_cast<unsigned char *>(buf);
+    size_t total = 0;
+
+    while (size > 0 && priv->cur_offset < priv->file_size) {
+        auto it = priv->find_extent(priv->cur_offset);
+        size_t n;
+
+        if (it != priv->extents.end() && it->begin <= priv->cur_offset) {
+            n = static_cast<size_t>(
+                    std::min<uint64_t>(size, it->end - priv->cur_offset));
+
+            if (!priv->read_part(it->part, priv->cur_offset, ptr, n)) {
+                auto &part = priv->parts[it->part];
+                set_error(part->error(), "Part %" MB_PRIzu ": %s",
+                          it->part, part->error_string().c_str());
+                return false;
+            }
+        } else {
+            uint64_t end = it != priv->extents.end()
+                    ? it->begin : priv->file_size;
+            n = static_cast<size_t>(
+                    std::min<uint64_t>(size, end - priv->cur_offset));
+
+            memset(ptr, 0, n);
+        }
+
+        ptr += n;
+        size -= n;
+        total += n;
+        priv->cur_offset += n;
+    }
+
+    bytes_read = total;
+    return true;
+}
+
+/*!
+ * \brief Seek the expanded image
+ *
+ * \param[in] offset Offset to seek
+ * \param[in] whence \a SEEK_SET, \a SEEK_CUR, or \a SEEK_END
+ * \param[out] new_offset Pointer to store new offset of the expanded image
+ *
+ * \return Whether the seeking was successful
+ */
+bool SparseFileSet::on_seek(int64_t offset, int whence, uint64_t &new_offset)
+{
+    MB_PRIVATE(SparseFileSet);
+
+    uint64_t base;
+    switch (whence) {
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_CUR:
+        base = priv->cur_offset;
+        break;
+    case SEEK_END:
+        base = priv->file_size;
+        break;
+    default:
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Invalid seek whence: %d", whence);
+        return false;
+    }
+
+    if ((offset < 0 && static_cast<uint64_t>(-offset) > base)
+            || (offset > 0 && base >= UINT64_MAX - offset)) {
+        set_error(make_error_code(FileError::IntegerOverflow),
+                  "Offset overflows uint64_t");
+        return false;
+    }
+
+    priv->cur_offset = base + offset;
+    new_offset = priv->cur_offset;
+
+    return true;
+}
+
+}
+}
@@ -0,0 +1,907 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbsparse/writer.h"
+
+#include <algorithm>
+
+#include <cinttypes>
+#include <cstring>
+
+#include <zlib.h>
+
+#include "mbcommon/endian.h"
+#include "mbcommon/file_util.h"
+#include "mbcommon/string.h"
+
+#include "mbsparse/crc32_p.h"
+#include "mbsparse/sparse.h"
+#include "mbsparse/sparse_p.h"
+#include "mbsparse/writer_p.h"
+
+// Largest supported block size
+#define MAX_BLOCK_SIZE          (64 * 1024 * 1024)
+
+// Largest number of bytes buffered for a raw chunk before it is written out.
+// Raw chunks are buffered because the chunk header must contain the size.
+#define MAX_RAW_BUF_SIZE        (4 * 1024 * 1024)
+
+// Size of the buffer used for copying raw chunk data
+#define COPY_BUF_SIZE           (1024 * 1024)
+
+namespace mb
+{
+namespace sparse
+{
+
+static void fix_sparse_header_byte_order(SparseHeader &header)
+{
+    header.magic = mb_htole32(header.magic);
+    header.major_version = mb_htole16(header.major_version);
+    header.minor_version = mb_htole16(header.minor_version);
+    header.file_hdr_sz = mb_htole16(header.file_hdr_sz);
+    header.chunk_hdr_sz = mb_htole16(header.chunk_hdr_sz);
+    header.blk_sz = mb_htole32(header.blk_sz);
+    header.total_blks = mb_htole32(header.total_blks);
+    header.total_chunks = mb_htole32(header.total_chunks);
+    header.image_checksum = mb_htole32(header.image_checksum);
+}
+
+static void fix_chunk_header_byte_order(ChunkHeader &header)
+{
+    header.chunk_type = mb_htole16(header.chunk_type);
+    header.reserved1 = mb_htole16(header.reserved1);
+    header.chunk_sz = mb_htole32(header.chunk_sz);
+    header.total_sz = mb_htole32(header.total_sz);
+}
+
+/*!
+ * \brief Check if a block consists of a single repeating 32-bit value
+ *
+ * Comparing the block against itself shifted by 4 bytes lets memcmp() use the
+ * platform's vectorized implementation instead of looping over every word.
+ */
+static bool is_fill_block(const unsigned char *block, uint32_t block_size)
+{
+    return memcmp(block, block + sizeof(uint32_t),
+                  block_size - sizeof(uint32_t)) == 0;
+}
+
+/*! \cond INTERNAL */
+
+SparseWriterPrivate::SparseWriterPrivate(SparseWriter *sw)
+    : _pub_ptr(sw)
+{
+    clear();
+}
+
+void SparseWriterPrivate::clear()
+{
+    file = nullptr;
+    block_size = 0;
+    checksum = false;
+    header_offset = 0;
+    total_chunks = 0;
+    image_crc32 = 0;
+    cur_offset = 0;
+    file_size = 0;
+    blocks_done = 0;
+    std::vector<unsigned char>().swap(block_buf);
+    block_used = 0;
+    chunk_type = 0;
+    chunk_blocks = 0;
+    memset(chunk_fill, 0, sizeof(chunk_fill));
+    std::vector<unsigned char>().swap(chunk_raw);
+    std::vector<unsigned char>().swap(fill_buf);
+}
+
+bool SparseWriterPrivate::wwrite(const void *buf, size_t size)
+{
+    MB_PUBLIC(SparseWriter);
+    size_t bytes_written;
+
+    if (!file_write_fully(*file, buf, size, bytes_written)) {
+        pub->set_error(file->error(), "Failed to write file: %s",
+                       file->error_string().c_str());
+        pub->set_fatal(true);
+        return false;
+    }
+
+    if (bytes_written != size) {
+        pub->set_error(std::make_error_code(std::errc::io_error),
+                       "Requested %" MB_PRIzu " bytes, but only wrote %"
+                       MB_PRIzu " bytes", size, bytes_written);
+        pub->set_fatal(true);
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Add whole blocks of data to the pending chunk
+ *
+ * Blocks made up of a single repeating 32-bit value are stored in fill chunks.
+ * Everything else is buffered for a raw chunk.
+ */
+bool SparseWriterPrivate::add_blocks(const unsigned char *data,
+                                     uint64_t count)
+{
+    MB_PUBLIC(SparseWriter);
+
+    if (count > UINT32_MAX - blocks_done) {
+        pub->set_error(make_error_code(FileError::ArgumentOutOfRange),
+                       "Sparse file cannot have more than %" PRIu32
+                       " blocks", UINT32_MAX);
+        pub->set_fatal(true);
+        return false;
+    }
+
+    for (uint64_t i = 0; i < count; ++i, data += block_size) {
+        if (is_fill_block(data, block_size)) {
+            if (chunk_type != CHUNK_TYPE_FILL
+                    || memcmp(chunk_fill, data, sizeof(chunk_fill)) != 0) {
+                if (!flush_chunk()) {
+                    return false;
+                }
+                chunk_type = CHUNK_TYPE_FILL;
+                memcpy(chunk_fill, data, sizeof(chunk_fill));
+            }
+        } else {
+            if (chunk_type != CHUNK_TYPE_RAW
+                    || chunk_raw.size() + block_size > MAX_RAW_BUF_SIZE) {
+                if (!flush_chunk()) {
+                    return false;
+                }
+                chunk_type = CHUNK_TYPE_RAW;
+            }
+            chunk_raw.insert(chunk_raw.end(), data, data + block_size);
+        }
+
+        ++chunk_blocks;
+        ++blocks_done;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Add blocks that were never written to the pending chunk
+ *
+ * The blocks are stored in a "don't care" chunk.
+ */
+bool SparseWriterPrivate::add_hole(uint64_t count)
+{
+    MB_PUBLIC(SparseWriter);
+
+    if (count > UINT32_MAX - blocks_done) {
+        pub->set_error(make_error_code(FileError::ArgumentOutOfRange),
+                       "Sparse file cannot have more than %" PRIu32
+                       " blocks", UINT32_MAX);
+        pub->set_fatal(true);
+        return false;
+    }
+
+    if (chunk_type != CHUNK_TYPE_DONT_CARE) {
+        if (!flush_chunk()) {
+            return false;
+        }
+        chunk_type = CHUNK_TYPE_DONT_CARE;
+    }
+
+    chunk_blocks += count;
+    blocks_done += count;
+
+    return true;
+}
+
+/*!
+ * \brief Fill the gap between the end of the written data and \p offset
+ *
+ * Whole blocks in the gap become a hole. Partial blocks are zero-filled.
+ */
+bool SparseWriterPrivate::skip_to(uint64_t offset)
+{
+    uint64_t pos = blocks_done * block_size + block_used;
+
+    if (offset <= pos) {
+        return true;
+    }
+
+    if (block_used > 0) {
+        uint64_t block_begin = pos - block_used;
+        size_t end = offset - block_begin < block_size
+                ? static_cast<size_t>(offset - block_begin) : block_size;
+
+        memset(block_buf.data() + block_used, 0, end - block_used);
+        block_used = end;
+
+        if (block_used < block_size) {
+            return true;
+        }
+
+        if (!add_blocks(block_buf.data(), 1)) {
+            return false;
+        }
+        block_used = 0;
+    }
+
+    uint64_t target_block = offset / block_size;
+    if (target_block > blocks_done
+            && !add_hole(target_block - blocks_done)) {
+        return false;
+    }
+
+    block_used = offset % block_size;
+    memset(block_buf.data(), 0, block_used);
+
+    return true;
+}
+
+/*!
+ * \brief Write the pending chunk to the output file
+ */
+bool SparseWriterPrivate::flush_chunk()
+{
+    if (chunk_type == 0) {
+        return true;
+    }
+
+    const void *data = nullptr;
+    uint32_t data_size = 0;
+
+    switch (chunk_type) {
+    case CHUNK_TYPE_RAW:
+        data = chunk_raw.data();
+        data_size = static_cast<uint32_t>(chunk_raw.size());
+        break;
+    case CHUNK_TYPE_FILL:
+        data = chunk_fill;
+        data_size = sizeof(chunk_fill);
+        break;
+    }
+
+    ChunkHeader chdr = {};
+    chdr.chunk_type = chunk_type;
+    chdr.chunk_sz = static_cast<uint32_t>(chunk_blocks);
+    chdr.total_sz = sizeof(ChunkHeader) + data_size;
+    fix_chunk_header_byte_order(chdr);
+
+    if (!wwrite(&chdr, sizeof(chdr)) || !wwrite(data, data_size)) {
+        return false;
+    }
+
+    if (checksum) {
+        switch (chunk_type) {
+        case CHUNK_TYPE_RAW:
+            image_crc32 = static_cast<uint32_t>(::crc32(
+                    image_crc32, chunk_raw.data(), data_size));
+            break;
+        case CHUNK_TYPE_FILL:
+            for (size_t i = 0; i < block_size; i += sizeof(chunk_fill)) {
+                memcpy(fill_buf.data() + i, chunk_fill, sizeof(chunk_fill));
+            }
+            image_crc32 = crc32_repeat(image_crc32, fill_buf.data(),
+                                       block_size, chunk_blocks);
+            break;
+        case CHUNK_TYPE_DONT_CARE:
+            // "Don't care" chunks are counted as zeros
+            memset(fill_buf.data(), 0, block_size);
+            image_crc32 = crc32_repeat(image_crc32, fill_buf.data(),
+                                       block_size, chunk_blocks);
+            break;
+        }
+    }
+
+    ++total_chunks;
+    chunk_type = 0;
+    chunk_blocks = 0;
+    chunk_raw.clear();
+
+    return true;
+}
+
+/*!
+ * \brief Write the remaining chunks and the final sparse header
+ */
+bool SparseWriterPrivate::finish()
+{
+    MB_PUBLIC(SparseWriter);
+
+    // The expanded file must be a whole number of blocks, so pad the last one
+    // with zeros
+    if (!skip_to(file_size)) {
+        return false;
+    }
+
+    if (block_used > 0) {
+        memset(block_buf.data() + block_used, 0, block_size - block_used);
+        if (!add_blocks(block_buf.data(), 1)) {
+            return false;
+        }
+        block_used = 0;
+    }
+
+    if (!flush_chunk()) {
+        return false;
+    }
+
+    if (checksum) {
+        ChunkHeader chdr = {};
+        chdr.chunk_type = CHUNK_TYPE_CRC32;
+        chdr.chunk_sz = 0;
+        chdr.total_sz = sizeof(ChunkHeader) + sizeof(image_crc32);
+        fix_chunk_header_byte_order(chdr);
+
+        uint32_t crc32_le = mb_htole32(image_crc32);
+
+        if (!wwrite(&chdr, sizeof(chdr))
+                || !wwrite(&crc32_le, sizeof(crc32_le))) {
+            return false;
+        }
+
+        ++total_chunks;
+    }
+
+    uint64_t end_offset;
+
+    if (!file->seek(0, SEEK_CUR, &end_offset)
+            || !file->seek(static_cast<int64_t>(header_offset), SEEK_SET,
+                           nullptr)) {
+        pub->set_error(file->error(), "Failed to seek file: %s",
+                       file->error_string().c_str());
+        pub->set_fatal(true);
+        return false;
+    }
+
+    SparseHeader shdr = {};
+    shdr.magic = SPARSE_HEADER_MAGIC;
+    shdr.major_version = SPARSE_HEADER_MAJOR_VER;
+    shdr.minor_version = 0;
+    shdr.file_hdr_sz = sizeof(SparseHeader);
+    shdr.chunk_hdr_sz = sizeof(ChunkHeader);
+    shdr.blk_sz = block_size;
+    shdr.total_blks = static_cast<uint32_t>(blocks_done);
+    shdr.total_chunks = total_chunks;
+    shdr.image_checksum = checksum ? image_crc32 : 0;
+    fix_sparse_header_byte_order(shdr);
+
+    if (!wwrite(&shdr, sizeof(shdr))) {
+        return false;
+    }
+
+    // Leave the file positioned after the sparse data
+    if (!file->seek(static_cast<int64_t>(end_offset), SEEK_SET, nullptr)) {
+        pub->set_error(file->error(), "Failed to seek file: %s",
+                       file->error_string().c_str());
+        pub->set_fatal(true);
+        return false;
+    }
+
+    return true;
+}
+
+/*! \endcond */
+
+/*!
+ * \class SparseWriter
+ *
+ * \brief Write Android sparse file image.
+ *
+ * Data written to the SparseWriter is encoded on the fly. Blocks consisting of
+ * a single repeating 32-bit value (including all zeros) are stored as fill
+ * chunks and everything else is stored as raw chunks. Regions that are skipped
+ * over by seeking forward or by extending the file with truncate() are stored
+ * as "don't care" chunks.
+ *
+ * Only a small amount of raw data is buffered, so the expanded file never needs
+ * to exist in memory or on disk. Writes must be sequential. Seeking backwards
+ * into data that has already been written is not supported.
+ */
+
+/*!
+ * \brief Construct unbound SparseWriter.
+ *
+ * The File handle will not be bound to any file. One of the open functions will
+ * need to be called to open a file.
+ */
+SparseWriter::SparseWriter()
+    : SparseWriter(new SparseWriterPrivate(this))
+{
+}
+
+/*!
+ * \brief Open sparse file for writing to File handle.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(File *, uint32_t, bool)
+ *
+ * \param file File to write to
+ * \param block_size Block size
+ * \param checksum Whether to store a CRC32 checksum of the expanded data
+ */
+SparseWriter::SparseWriter(File *file, uint32_t block_size, bool checksum)
+    : SparseWriter(new SparseWriterPrivate(this), file, block_size, checksum)
+{
+}
+
+/*! \cond INTERNAL */
+SparseWriter::SparseWriter(SparseWriterPrivate *priv)
+    : _priv_ptr(priv)
+{
+}
+
+SparseWriter::SparseWriter(SparseWriterPrivate *priv, File *file,
+                           uint32_t block_size, bool checksum)
+    : _priv_ptr(priv)
+{
+    open(file, block_size, checksum);
+}
+/*! \endcond */
+
+SparseWriter::~SparseWriter()
+{
+    close();
+}
+
+/*!
+ * \brief Open sparse file for writing to File handle.
+ *
+ * \note The SparseWriter will *not* take ownership of \p file. The caller must
+ *       ensure that it is properly closed and destroyed when it is no longer
+ *       needed.
+ *
+ * \param file File to write to
+ * \param block_size Block size (must be a non-zero multiple of 4)
+ * \param checksum Whether to store a CRC32 checksum of the expanded data in the
+ *                 sparse header and in a trailing CRC32 chunk
+ *
+ * \return Whether the file is successfully opened
+ */
+bool SparseWriter::open(File *file, uint32_t block_size, bool checksum)
+{
+    MB_PRIVATE(SparseWriter);
+    if (priv) {
+        priv->file = file;
+        priv->block_size = block_size;
+        priv->checksum = checksum;
+    }
+    return File::open();
+}
+
+/*!
+ * \brief Open sparse file for writing
+ *
+ * A placeholder sparse header is written immediately. The real header is
+ * written when the file is closed, so the file must support seeking.
+ *
+ * \note This function will fail if the file handle is not open.
+ *
+ * \pre The caller should position the file where the sparse file data should
+ *      begin. This allows for writing sparse files in the middle of another
+ *      file.
+ *
+ * \return Whether the sparse file is successfully opened
+ */
+bool SparseWriter::on_open()
+{
+    MB_PRIVATE(SparseWriter);
+
+    if (!priv->file->is_open()) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Underlying file is not open");
+        return false;
+    }
+
+    if (priv->block_size == 0 || priv->block_size % 4 != 0
+            || priv->block_size > MAX_BLOCK_SIZE) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Invalid block size: %" PRIu32, priv->block_size);
+        return false;
+    }
+
+    if (!priv->file->seek(0, SEEK_CUR, &priv->header_offset)) {
+        set_error(priv->file->error(), "Failed to get file offset: %s",
+                  priv->file->error_string().c_str());
+        return false;
+    }
+
+    priv->block_buf.resize(priv->block_size);
+    if (priv->checksum) {
+        priv->fill_buf.resize(priv->block_size);
+    }
+
+    SparseHeader shdr = {};
+
+    if (!priv->wwrite(&shdr, sizeof(shdr))) {
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Close opened sparse file
+ *
+ * The remaining chunks and the sparse header are written to the underlying
+ * file. If a fatal error occurred earlier, the sparse file is left incomplete.
+ *
+ * \note If the sparse file is open, then no matter what value is returned, the
+ *       sparse file will be closed.
+ *
+ * \return
+ *   * True if the sparse file was successfully finalized
+ *   * False if an error occurs while writing the remaining data
+ */
+bool SparseWriter::on_close()
+{
+    MB_PRIVATE(SparseWriter);
+
+    bool ret = true;
+
+    if (!is_fatal()) {
+        ret = priv->finish();
+    }
+
+    // Reset to allow opening another file
+    priv->clear();
+
+    return ret;
+}
+
+/*!
+ * \brief Write to sparse file
+ *
+ * If the current offset is past the end of the written data, the gap is stored
+ * as a "don't care" region.
+ *
+ * \param buf Buffer to write from
+ * \param size Number of bytes to write
+ * \param bytes_written Number of bytes that were written
+ *
+ * \return Whether the data was successfully written
+ */
+bool SparseWriter::on_write(const void *buf, size_t size,
+                            size_t &bytes_written)
+{
+    MB_PRIVATE(SparseWriter);
+
+    if (!priv->skip_to(priv->cur_offset)) {
+        return false;
+    }
+
+    auto data = reinterpret_cast<const unsigned char *>(buf);
+    size_t remain = size;
+
+    // Complete the partial block first
+    if (priv->block_used > 0) {
+        size_t n = std::min<size_t>(remain,
+                                    priv->block_size - priv->block_used);
+        memcpy(priv->block_buf.data() + priv->block_used, data, n);
+        priv->block_used += n;
+        data += n;
+        remain -= n;
+
+        if (priv->block_used == priv->block_size) {
+            if (!priv->add_blocks(priv->block_buf.data(), 1)) {
+                return false;
+            }
+            priv->block_used = 0;
+        }
+    }
+
+    // Whole blocks can be encoded directly from the caller's buffer
+    if (remain >= priv->block_size) {
+        size_t count = remain / priv->block_size;
+        if (!priv->add_blocks(data, count)) {
+            return false;
+        }
+        data += count * priv->block_size;
+        remain -= count * priv->block_size;
+    }
+
+    if (remain > 0) {
+        memcpy(priv->block_buf.data(), data, remain);
+        priv->block_used = remain;
+    }
+
+    priv->cur_offset += size;
+    priv->file_size = std::max(priv->file_size, priv->cur_offset);
+
+    bytes_written = size;
+    return true;
+}
+
+/*!
+ * \brief Seek sparse file
+ *
+ * \p whence takes the same \a SEEK_SET, \a SEEK_CUR, and \a SEEK_END values as
+ * \a lseek() in `\<stdio.h\>`. Seeking before the end of the data that has
+ * already been written is not supported.
+ *
+ * \param[in] offset Offset to seek
+ * \param[in] whence \a SEEK_SET, \a SEEK_CUR, or \a SEEK_END
+ * \param[out] new_offset_out Pointer to store new offset of sparse file
+ *
+ * \return Whether the seeking was successful
+ */
+bool SparseWriter::on_seek(int64_t offset, int whence,
+                           uint64_t &new_offset_out)
+{
+    MB_PRIVATE(SparseWriter);
+
+    uint64_t new_offset;
+    switch (whence) {
+    case SEEK_SET:
+        if (offset < 0) {
+            set_error(make_error_code(FileError::InvalidArgument),
+                      "Cannot seek to negative offset");
+            return false;
+        }
+        new_offset = offset;
+        break;
+    case SEEK_CUR:
+        if ((offset < 0 && static_cast<uint64_t>(-offset) > priv->cur_offset)
+                || (offset > 0 && priv->cur_offset >= UINT64_MAX - offset)) {
+            set_error(make_error_code(FileError::IntegerOverflow),
+                      "Offset overflows uint64_t");
+            return false;
+        }
+        new_offset = priv->cur_offset + offset;
+        break;
+    case SEEK_END:
+        if ((offset < 0 && static_cast<uint64_t>(-offset) > priv->file_size)
+                || (offset > 0 && priv->file_size >= UINT64_MAX - offset)) {
+            set_error(make_error_code(FileError::IntegerOverflow),
+                      "Offset overflows uint64_t");
+            return false;
+        }
+        new_offset = priv->file_size + offset;
+        break;
+    default:
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Invalid seek whence: %d", whence);
+        return false;
+    }
+
+    if (new_offset < priv->blocks_done * priv->block_size + priv->block_used) {
+        set_error(make_error_code(FileError::UnsupportedSeek),
+                  "Cannot seek to %" PRIu64 " before end of written data",
+                  new_offset);
+        return false;
+    }
+
+    priv->cur_offset = new_offset;
+
+    new_offset_out = new_offset;
+
+    return true;
+}
+
+/*!
+ * \brief Set the size of the sparse file
+ *
+ * The file can only be extended. The new region is stored as a "don't care"
+ * region.
+ *
+ * \param size New size of the expanded file
+ *
+ * \return Whether the size was successfully set
+ */
+bool SparseWriter::on_truncate(uint64_t size)
+{
+    MB_PRIVATE(SparseWriter);
+
+    if (size < priv->file_size) {
+        set_error(make_error_code(FileError::UnsupportedTruncate),
+                  "Cannot shrink sparse file from %" PRIu64 " to %" PRIu64
+                  " bytes", priv->file_size, size);
+        return false;
+    }
+
+    priv->file_size = size;
+
+    return true;
+}
+
+/*!
+ * \brief Check if a block consists entirely of zeros
+ */
+static bool is_zero_block(const unsigned char *block, uint32_t block_size)
+{
+    static const unsigned char zeros[sizeof(uint32_t)] = {};
+    return memcmp(block, zeros, sizeof(zeros)) == 0
+            && is_fill_block(block, block_size);
+}
+
+/*!
+ * \brief Write whole blocks to \p output, seeking over the zero-filled ones
+ *
+ * Seeking forward in a SparseWriter leaves a "don't care" region, so runs of
+ * zero blocks cost a single chunk header instead of a fill chunk.
+ */
+static bool write_skipping_zeros(File &output, const unsigned char *data,
+                                 size_t size, uint32_t block_size)
+{
+    while (size > 0) {
+        size_t run = 0;
+
+        while (run < size && is_zero_block(data + run, block_size)) {
+            run += block_size;
+        }
+
+        if (run > 0) {
+            if (!output.seek(static_cast<int64_t>(run), SEEK_CUR, nullptr)) {
+                return false;
+            }
+        } else {
+            while (run < size && !is_zero_block(data + run, block_size)) {
+                run += block_size;
+            }
+
+            size_t n;
+            if (!file_write_fully(output, data, run, n) || n != run) {
+                return false;
+            }
+        }
+
+        data += run;
+        size -= run;
+    }
+
+    return true;
+}
+
+static bool copy_range(File &input, File &output, uint64_t offset,
+                       uint64_t size, std::vector<unsigned char> &buf,
+                       uint32_t block_size, bool zeros_as_holes)
+{
+    if (!input.seek(static_cast<int64_t>(offset), SEEK_SET, nullptr)) {
+        output.set_error(input.error(),
+                         "Failed to seek input to %" PRIu64 ": %s",
+                         offset, input.error_string().c_str());
+        return false;
+    }
+
+    while (size > 0) {
+        size_t to_copy = static_cast<size_t>(
+                std::min<uint64_t>(size, buf.size()));
+        size_t n;
+
+        if (!file_read_fully(input, buf.data(), to_copy, n)) {
+            output.set_error(input.error(), "Failed to read input: %s",
+                             input.error_string().c_str());
+            return false;
+        } else if (n != to_copy) {
+            output.set_error(std::make_error_code(std::errc::io_error),
+                             "Input ended before offset %" PRIu64,
+                             offset + to_copy);
+            return false;
+        }
+
+        if (zeros_as_holes) {
+            if (!write_skipping_zeros(output, buf.data(), n, block_size)) {
+                return false;
+            }
+        } else if (!file_write_fully(output, buf.data(), n, n)
+                || n != to_copy) {
+            return false;
+        }
+
+        offset += to_copy;
+        size -= to_copy;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Write Android sparse image containing only the specified blocks
+ *
+ * Every block in \p ranges is stored as raw data (or as fill data if the block
+ * consists of a single repeating 32-bit value) and every other block is stored
+ * as a "don't care" chunk. When the image is expanded, blocks outside of the
+ * ranges are left untouched (or zero).
+ *
+ * If \p zeros_as_holes is true, zero-filled blocks inside the ranges are also
+ * stored as "don't care" chunks. This is only safe if the image will be
+ * expanded into a file or partition that is already zeroed, but it avoids a
+ * fill chunk for every run of zeros. The check compares whole blocks with
+ * memcmp(), so it runs at memory bandwidth.
+ *
+ * \param input File to read the blocks from
+ * \param output File to write the sparse image to
+ * \param block_size Block size (must be a non-zero multiple of 4)
+ * \param block_count Total number of blocks in the expanded image
+ * \param ranges Block ranges to store. The ranges must be sorted and must not
+ *               overlap.
+ * \param zeros_as_holes Whether to store zero-filled blocks as "don't care"
+ *                       chunks
+ *
+ * \return Whether the sparse image was successfully written. If false is
+ *         returned, the error is set on \p output.
+ */
+bool write_sparse_file(File &input, File &output,
+                       uint32_t block_size, uint64_t block_count,
+                       const std::vector<BlockRange> &ranges,
+                       bool zeros_as_holes)
+{
+    if (block_count > UINT32_MAX) {
+        output.set_error(make_error_code(FileError::ArgumentOutOfRange),
+                         "Too many blocks: %" PRIu64, block_count);
+        return false;
+    }
+
+    uint64_t prev_end = 0;
+
+    for (auto const &range : ranges) {
+        if (range.begin < prev_end || range.begin >= range.end
+                || range.end > block_count) {
+            output.set_error(make_error_code(FileError::ArgumentOutOfRange),
+                             "Invalid block range: [%" PRIu64 ", %" PRIu64 ")",
+                             range.begin, range.end);
+            return false;
+        }
+        prev_end = range.end;
+    }
+
+    SparseWriter writer;
+
+    if (!writer.open(&output, block_size, false)) {
+        output.set_error(writer.error(), "%s", writer.error_string().c_str());
+        return false;
+    }
+
+    // Zero blocks can only be detected if every read ends on a block boundary
+    std::vector<unsigned char> buf(
+            std::max<size_t>(1, COPY_BUF_SIZE / block_size) * block_size);
+    bool ret = true;
+
+    for (auto const &range : ranges) {
+        if (!writer.seek(static_cast<int64_t>(range.begin * block_size),
+                         SEEK_SET, nullptr)
+                || !copy_range(input, writer, range.begin * block_size,
+                               (range.end - range.begin) * block_size, buf,
+                               block_size, zeros_as_holes)) {
+            ret = false;
+            break;
+        }
+    }
+
+    ret = ret && writer.truncate(block_count * block_size);
+
+    if (!ret) {
+        output.set_error(writer.error(), "%s", writer.error_string().c_str());
+        // Don't write the sparse header for an incomplete image
+        writer.set_fatal(true);
+        return false;
+    }
+
+    if (!writer.close()) {
+        output.set_error(writer.error(), "%s", writer.error_string().c_str());
+        return false;
+    }
+
+    return true;
+}
+
+}
+}
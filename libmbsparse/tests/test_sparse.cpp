@@ -34,7 +34,18 @@ public:
         _seekability = seekability;
     }
 
+    size_t read_count() const
+    {
+        return _read_count;
+    }
+
 protected:
+    virtual bool on_read(void *buf, size_t size, size_t &bytes_read) override
+    {
+        ++_read_count;
+        return mb::MemoryFile::on_read(buf, size, bytes_read);
+    }
+
     virtual bool on_seek(int64_t offset, int whence,
                          uint64_t &new_offset) override
     {
@@ -59,6 +70,7 @@ protected:
 
 private:
     mb::sparse::Seekability _seekability = mb::sparse::Seekability::CAN_SEEK;
+    size_t _read_count = 0;
 };
 
 struct SparseTest : testing::Test
@@ -655,6 +667,68 @@ TEST_F(SparseTest, ReadValidDataWithSeekableFile)
     ASSERT_TRUE(_file.close());
 }
 
+TEST_F(SparseTest, RandomSeeksUseChunkIndex)
+{
+    constexpr uint32_t chunk_count = 1000;
+    size_t n;
+
+    mb::sparse::SparseHeader shdr = {};
+    shdr.magic = mb::sparse::SPARSE_HEADER_MAGIC;
+    shdr.major_version = mb::sparse::SPARSE_HEADER_MAJOR_VER;
+    shdr.file_hdr_sz = sizeof(mb::sparse::SparseHeader);
+    shdr.chunk_hdr_sz = sizeof(mb::sparse::ChunkHeader);
+    shdr.blk_sz = 4;
+    shdr.total_blks = chunk_count;
+    shdr.total_chunks = chunk_count;
+    fix_sparse_header_byte_order(shdr);
+
+    ASSERT_TRUE(_source_file.write(&shdr, sizeof(shdr), n));
+
+    // One single-block fill chunk per index
+    for (uint32_t i = 0; i < chunk_count; ++i) {
+        mb::sparse::ChunkHeader chdr = {};
+        chdr.chunk_type = mb::sparse::CHUNK_TYPE_FILL;
+        chdr.chunk_sz = 1;
+        chdr.total_sz = sizeof(chdr) + sizeof(uint32_t);
+        fix_chunk_header_byte_order(chdr);
+
+        uint32_t fill_val = mb_htole32(i);
+
+        ASSERT_TRUE(_source_file.write(&chdr, sizeof(chdr), n));
+        ASSERT_TRUE(_source_file.write(&fill_val, sizeof(fill_val), n));
+    }
+
+    ASSERT_TRUE(_source_file.seek(0, SEEK_SET, nullptr));
+    ASSERT_TRUE(_file.open(&_source_file));
+
+    // Seeking to the end should not read any chunk headers
+    size_t reads = _source_file.read_count();
+    uint64_t pos;
+    ASSERT_TRUE(_file.seek(0, SEEK_END, &pos));
+    ASSERT_EQ(pos, chunk_count * 4u);
+    ASSERT_EQ(_source_file.read_count(), reads);
+
+    auto read_chunk = [&](uint32_t i) {
+        uint32_t value;
+        ASSERT_TRUE(_file.seek(i * 4, SEEK_SET, nullptr));
+        ASSERT_TRUE(_file.read(&value, sizeof(value), n));
+        ASSERT_EQ(n, sizeof(value));
+        ASSERT_EQ(mb_le32toh(value), i);
+    };
+
+    // Index every chunk
+    read_chunk(chunk_count - 1);
+
+    // Random seeks within the indexed range should not touch the source file
+    reads = _source_file.read_count();
+    for (uint32_t i = 0; i < chunk_count; ++i) {
+        read_chunk((i * 7919) % chunk_count);
+    }
+    ASSERT_EQ(_source_file.read_count(), reads);
+
+    ASSERT_TRUE(_file.close());
+}
+
 TEST_F(SparseTest, ReadValidDataWithSkippableFile)
 {
     char buf[1024];
@@ -728,3 +802,52 @@ TEST_F(SparseTest, ReadValidDataWithUnseekableFile)
 
     ASSERT_TRUE(_file.close());
 }
+
+TEST_F(SparseTest, SeekForwardWithUnseekableFile)
+{
+    char buf[16];
+    size_t n;
+    uint64_t size;
+    bool dont_care;
+    build_valid_data();
+
+    _source_file.set_seekability(mb::sparse::Seekability::CAN_READ);
+    ASSERT_TRUE(_file.open(&_source_file));
+
+    // Raw chunk
+    ASSERT_TRUE(_file.region(size, dont_care));
+    ASSERT_EQ(size, 16u);
+    ASSERT_FALSE(dont_care);
+
+    // Check that seeking forward into a raw chunk works
+    ASSERT_TRUE(_file.seek(5, SEEK_SET, nullptr));
+    ASSERT_TRUE(_file.read(buf, 3, n));
+    ASSERT_EQ(n, 3u);
+    ASSERT_EQ(memcmp(buf, expected_valid_data + 5, 3), 0);
+
+    // Check that seeking forward into a fill chunk works
+    ASSERT_TRUE(_file.seek(20, SEEK_SET, nullptr));
+    ASSERT_TRUE(_file.read(buf, 4, n));
+    ASSERT_EQ(n, 4u);
+    ASSERT_EQ(memcmp(buf, expected_valid_data + 20, 4), 0);
+    ASSERT_TRUE(_file.region(size, dont_care));
+    ASSERT_EQ(size, 8u);
+    ASSERT_FALSE(dont_care);
+
+    // Skip chunk
+    ASSERT_TRUE(_file.seek(8, SEEK_CUR, nullptr));
+    ASSERT_TRUE(_file.region(size, dont_care));
+    ASSERT_EQ(size, 16u);
+    ASSERT_TRUE(dont_care);
+
+    // Check that seeking backwards fails
+    ASSERT_FALSE(_file.seek(-1, SEEK_CUR, nullptr));
+    ASSERT_EQ(_file.error(), mb::FileError::UnsupportedSeek);
+
+    // Check that there is no region at EOF
+    ASSERT_TRUE(_file.seek(0, SEEK_END, nullptr));
+    ASSERT_TRUE(_file.region(size, dont_care));
+    ASSERT_EQ(size, 0u);
+
+    ASSERT_TRUE(_file.close());
+}
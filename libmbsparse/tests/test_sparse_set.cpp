@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <mutex>
+#include <vector>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include "mbcommon/file/memory.h"
+#include "mbcommon/file_util.h"
+
+#include "mbsparse/sparse_set.h"
+#include "mbsparse/writer.h"
+
+using namespace mb;
+using namespace mb::sparse;
+
+// 16 blocks of 8 bytes
+#define BLOCK_SIZE      8
+#define BLOCK_COUNT     16
+
+struct SparseFileSetTest : testing::Test
+{
+    // Every part is a slice of a different source image, so the test can tell
+    // which part supplied each block
+    std::vector<std::vector<unsigned char>> _sources;
+    std::vector<void *> _part_data;
+    std::vector<size_t> _part_sizes;
+    std::vector<std::unique_ptr<MemoryFile>> _part_files;
+    std::vector<std::vector<BlockRange>> _part_ranges;
+
+    virtual ~SparseFileSetTest()
+    {
+        for (void *data : _part_data) {
+            free(data);
+        }
+    }
+
+    void add_part(std::vector<BlockRange> ranges)
+    {
+        unsigned char id = static_cast<unsigned char>(_sources.size());
+        std::vector<unsigned char> source;
+
+        for (size_t i = 0; i < BLOCK_SIZE * BLOCK_COUNT; ++i) {
+            source.push_back(static_cast<unsigned char>(id * 0x40 + i % 0x40));
+        }
+
+        MemoryFile input(source.data(), source.size());
+        void *data = nullptr;
+        size_t size = 0;
+        MemoryFile output(&data, &size);
+
+        ASSERT_TRUE(input.is_open());
+        ASSERT_TRUE(output.is_open());
+        ASSERT_TRUE(write_sparse_file(input, output, BLOCK_SIZE, BLOCK_COUNT,
+                                      ranges));
+        ASSERT_TRUE(output.close());
+
+        _sources.push_back(std::move(source));
+        _part_data.push_back(data);
+        _part_sizes.push_back(size);
+        _part_ranges.push_back(std::move(ranges));
+    }
+
+    std::vector<File *> open_parts()
+    {
+        std::vector<File *> files;
+
+        _part_files.clear();
+
+        for (size_t i = 0; i < _part_data.size(); ++i) {
+            _part_files.emplace_back(
+                    new MemoryFile(_part_data[i], _part_sizes[i]));
+            EXPECT_TRUE(_part_files.back()->is_open());
+            files.push_back(_part_files.back().get());
+        }
+
+        return files;
+    }
+
+    // Result of flashing the parts in order onto a zeroed device
+    std::vector<unsigned char> expected()
+    {
+        std::vector<unsigned char> data(BLOCK_SIZE * BLOCK_COUNT);
+
+        for (size_t i = 0; i < _sources.size(); ++i) {
+            for (auto const &r : _part_ranges[i]) {
+                std::copy(_sources[i].begin() + r.begin * BLOCK_SIZE,
+                          _sources[i].begin() + r.end * BLOCK_SIZE,
+                          data.begin() + r.begin * BLOCK_SIZE);
+            }
+        }
+
+        return data;
+    }
+
+    void SetUp() override
+    {
+        // Part 1 overlaps the end of part 0 and blocks 10-11 and 14-15 are not
+        // in any part
+        add_part({{0, 6}});
+        add_part({{4, 10}});
+        add_part({{12, 14}});
+    }
+};
+
+TEST_F(SparseFileSetTest, ReadWholeImage)
+{
+    SparseFileSet set(open_parts());
+    ASSERT_TRUE(set.is_open());
+    ASSERT_EQ(set.size(), BLOCK_SIZE * BLOCK_COUNT);
+
+    std::vector<unsigned char> data(1024);
+    size_t n;
+    ASSERT_TRUE(file_read_fully(set, data.data(), data.size(), n));
+    data.resize(n);
+
+    ASSERT_EQ(data, expected());
+}
+
+TEST_F(SparseFileSetTest, RegionsFollowIndex)
+{
+    SparseFileSet set(open_parts());
+    ASSERT_TRUE(set.is_open());
+
+    std::vector<std::pair<uint64_t, bool>> regions;
+    uint64_t offset = 0;
+
+    while (true) {
+        uint64_t size;
+        bool dont_care;
+
+        ASSERT_TRUE(set.region(size, dont_care));
+        if (size == 0) {
+            break;
+        }
+
+        regions.emplace_back(size, dont_care);
+        offset += size;
+
+        ASSERT_TRUE(set.seek(static_cast<int64_t>(offset), SEEK_SET,
+                             nullptr));
+    }
+
+    ASSERT_EQ(regions, (std::vector<std::pair<uint64_t, bool>>{
+        {4 * BLOCK_SIZE, false},
+        {6 * BLOCK_SIZE, false},
+        {2 * BLOCK_SIZE, true},
+        {2 * BLOCK_SIZE, false},
+        {2 * BLOCK_SIZE, true},
+    }));
+}
+
+TEST_F(SparseFileSetTest, RandomReads)
+{
+    SparseFileSet set(open_parts());
+    ASSERT_TRUE(set.is_open());
+
+    auto data = expected();
+    unsigned char buf[20];
+    size_t n;
+
+    // Crosses from part 0 into part 1
+    ASSERT_TRUE(set.seek(3 * BLOCK_SIZE + 2, SEEK_SET, nullptr));
+    ASSERT_TRUE(set.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, sizeof(buf));
+    ASSERT_EQ(memcmp(buf, data.data() + 3 * BLOCK_SIZE + 2, sizeof(buf)), 0);
+
+    // Crosses from a "don't care" region into part 2
+    ASSERT_TRUE(set.seek(11 * BLOCK_SIZE, SEEK_SET, nullptr));
+    ASSERT_TRUE(set.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, sizeof(buf));
+    ASSERT_EQ(memcmp(buf, data.data() + 11 * BLOCK_SIZE, sizeof(buf)), 0);
+
+    // Short read at EOF
+    ASSERT_TRUE(set.seek(-4, SEEK_END, nullptr));
+    ASSERT_TRUE(set.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, 4u);
+}
+
+TEST_F(SparseFileSetTest, ExtractWritesEveryPart)
+{
+    SparseFileSet set(open_parts());
+    ASSERT_TRUE(set.is_open());
+
+    std::mutex mutex;
+    std::vector<unsigned char> output(BLOCK_SIZE * BLOCK_COUNT);
+    uint64_t written = 0;
+
+    ASSERT_TRUE(set.extract([&](uint64_t offset, const void *data,
+                                size_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        memcpy(output.data() + offset, data, size);
+        written += size;
+        return true;
+    }));
+
+    ASSERT_EQ(output, expected());
+    // "Don't care" regions and overwritten ranges are not written
+    ASSERT_EQ(written, 12u * BLOCK_SIZE);
+}
+
+TEST_F(SparseFileSetTest, ExtractReportsWriteFailure)
+{
+    SparseFileSet set(open_parts());
+    ASSERT_TRUE(set.is_open());
+
+    ASSERT_FALSE(set.extract([](uint64_t, const void *, size_t) {
+        errno = ENOSPC;
+        return false;
+    }, 1));
+    ASSERT_EQ(set.error(), std::errc::no_space_on_device);
+}
+
+TEST_F(SparseFileSetTest, InvalidParts)
+{
+    SparseFileSet set;
+    ASSERT_FALSE(set.open({}));
+    ASSERT_EQ(set.error(), FileError::InvalidArgument);
+
+    ASSERT_FALSE(set.open({nullptr}));
+    ASSERT_EQ(set.error(), FileError::InvalidArgument);
+
+    unsigned char garbage[64] = {};
+    MemoryFile file(garbage, sizeof(garbage));
+    ASSERT_FALSE(set.open({&file}));
+}
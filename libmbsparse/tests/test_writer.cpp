@@ -0,0 +1,402 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <cstdlib>
+#include <cstring>
+
+#include <zlib.h>
+
+#include "mbcommon/endian.h"
+#include "mbcommon/file/memory.h"
+#include "mbcommon/file_util.h"
+
+#include "mbsparse/sparse.h"
+#include "mbsparse/writer.h"
+
+#define CHUNK_TYPE_RAW          0xCAC1
+#define CHUNK_TYPE_FILL         0xCAC2
+#define CHUNK_TYPE_DONT_CARE    0xCAC3
+#define CHUNK_TYPE_CRC32        0xCAC4
+
+using namespace mb;
+using namespace mb::sparse;
+
+struct SparseWriterTest : testing::Test
+{
+    std::vector<unsigned char> _input_data;
+    MemoryFile _input;
+    MemoryFile _output;
+    void *_output_data = nullptr;
+    size_t _output_size = 0;
+
+    virtual ~SparseWriterTest()
+    {
+        free(_output_data);
+    }
+
+    void SetUp() override
+    {
+        // 16 blocks of 4 bytes, each filled with its index + 1
+        for (unsigned char i = 0; i < 16; ++i) {
+            _input_data.insert(_input_data.end(), 4, i + 1);
+        }
+
+        ASSERT_TRUE(_input.open(_input_data.data(), _input_data.size()));
+        ASSERT_TRUE(_output.open(&_output_data, &_output_size));
+    }
+
+    std::vector<unsigned char> expand()
+    {
+        MemoryFile source;
+        SparseFile file;
+        std::vector<unsigned char> data(1024);
+        size_t n;
+
+        EXPECT_TRUE(source.open(_output_data, _output_size));
+        EXPECT_TRUE(file.open(&source));
+        EXPECT_TRUE(file_read_fully(file, data.data(), data.size(), n));
+        data.resize(n);
+
+        return data;
+    }
+
+    // Get the type of every chunk in the output sparse file
+    std::vector<uint16_t> chunk_types()
+    {
+        std::vector<uint16_t> types;
+        auto data = static_cast<unsigned char *>(_output_data);
+        uint16_t file_hdr_sz;
+        uint32_t total_chunks;
+
+        memcpy(&file_hdr_sz, data + 8, sizeof(file_hdr_sz));
+        memcpy(&total_chunks, data + 20, sizeof(total_chunks));
+
+        size_t offset = mb_le16toh(file_hdr_sz);
+
+        for (uint32_t i = 0; i < mb_le32toh(total_chunks); ++i) {
+            uint16_t type;
+            uint32_t total_sz;
+
+            memcpy(&type, data + offset, sizeof(type));
+            memcpy(&total_sz, data + offset + 8, sizeof(total_sz));
+
+            types.push_back(mb_le16toh(type));
+            offset += mb_le32toh(total_sz);
+        }
+
+        EXPECT_EQ(offset, _output_size);
+
+        return types;
+    }
+
+    uint32_t image_checksum()
+    {
+        uint32_t checksum;
+        memcpy(&checksum, static_cast<unsigned char *>(_output_data) + 24,
+               sizeof(checksum));
+        return mb_le32toh(checksum);
+    }
+};
+
+TEST_F(SparseWriterTest, WriteRangesRoundTrip)
+{
+    std::vector<BlockRange> ranges{{0, 2}, {5, 6}, {10, 13}};
+
+    ASSERT_TRUE(write_sparse_file(_input, _output, 4, 16, ranges));
+
+    std::vector<unsigned char> expected(_input_data.size());
+    for (auto const &r : ranges) {
+        std::copy(_input_data.begin() + r.begin * 4,
+                  _input_data.begin() + r.end * 4,
+                  expected.begin() + r.begin * 4);
+    }
+
+    ASSERT_EQ(expand(), expected);
+}
+
+TEST_F(SparseWriterTest, WriteAllBlocks)
+{
+    ASSERT_TRUE(write_sparse_file(_input, _output, 4, 16, {{0, 16}}));
+    ASSERT_EQ(expand(), _input_data);
+}
+
+TEST_F(SparseWriterTest, WriteNoBlocks)
+{
+    ASSERT_TRUE(write_sparse_file(_input, _output, 4, 16, {}));
+    ASSERT_EQ(expand(), std::vector<unsigned char>(_input_data.size()));
+}
+
+TEST_F(SparseWriterTest, RejectInvalidRanges)
+{
+    ASSERT_FALSE(write_sparse_file(_input, _output, 4, 16, {{2, 2}}));
+    ASSERT_FALSE(write_sparse_file(_input, _output, 4, 16, {{4, 6}, {5, 8}}));
+    ASSERT_FALSE(write_sparse_file(_input, _output, 4, 16, {{10, 17}}));
+    ASSERT_FALSE(write_sparse_file(_input, _output, 3, 16, {{0, 1}}));
+}
+
+TEST_F(SparseWriterTest, WriteZerosAsHoles)
+{
+    // With 8-byte blocks, every block holds two different words, so only the
+    // zeroed blocks (2, 3, and 6) are not raw
+    std::fill(_input_data.begin() + 2 * 8, _input_data.begin() + 4 * 8, 0);
+    std::fill(_input_data.begin() + 6 * 8, _input_data.begin() + 7 * 8, 0);
+
+    ASSERT_TRUE(write_sparse_file(_input, _output, 8, 8, {{0, 8}}, true));
+
+    ASSERT_EQ(chunk_types(), (std::vector<uint16_t>{
+        CHUNK_TYPE_RAW, CHUNK_TYPE_DONT_CARE, CHUNK_TYPE_RAW,
+        CHUNK_TYPE_DONT_CARE, CHUNK_TYPE_RAW
+    }));
+    ASSERT_EQ(expand(), _input_data);
+}
+
+TEST_F(SparseWriterTest, WriteZerosAsFillByDefault)
+{
+    std::fill(_input_data.begin() + 2 * 8, _input_data.begin() + 4 * 8, 0);
+
+    ASSERT_TRUE(write_sparse_file(_input, _output, 8, 8, {{0, 8}}));
+
+    ASSERT_EQ(chunk_types(), (std::vector<uint16_t>{
+        CHUNK_TYPE_RAW, CHUNK_TYPE_FILL, CHUNK_TYPE_RAW
+    }));
+    ASSERT_EQ(expand(), _input_data);
+}
+
+TEST_F(SparseWriterTest, FailOnTruncatedInput)
+{
+    ASSERT_TRUE(_input.close());
+    ASSERT_TRUE(_input.open(_input_data.data(), 8 * 4));
+
+    ASSERT_FALSE(write_sparse_file(_input, _output, 4, 16, {{4, 12}}));
+}
+
+TEST_F(SparseWriterTest, StreamDetectsFillBlocks)
+{
+    std::vector<unsigned char> data;
+    // Two raw blocks
+    for (unsigned char i = 0; i < 32; ++i) {
+        data.push_back(i);
+    }
+    // Three zero blocks
+    data.insert(data.end(), 48, 0);
+    // Two blocks filled with a 32-bit pattern
+    for (int i = 0; i < 8; ++i) {
+        data.insert(data.end(), {0xde, 0xad, 0xbe, 0xef});
+    }
+    // Partial raw block
+    data.insert(data.end(), {1, 2, 3, 4, 5});
+
+    SparseWriter writer;
+    ASSERT_TRUE(writer.open(&_output, 16, false));
+
+    // Write in odd-sized pieces to exercise the partial block handling
+    for (size_t offset = 0; offset < data.size(); offset += 7) {
+        size_t n;
+        size_t to_write = std::min<size_t>(7, data.size() - offset);
+        ASSERT_TRUE(writer.write(data.data() + offset, to_write, n));
+        ASSERT_EQ(n, to_write);
+    }
+
+    ASSERT_TRUE(writer.close());
+
+    ASSERT_EQ(chunk_types(), (std::vector<uint16_t>{
+        CHUNK_TYPE_RAW, CHUNK_TYPE_FILL, CHUNK_TYPE_FILL, CHUNK_TYPE_RAW
+    }));
+
+    // The last block is padded with zeros
+    data.resize(128);
+    ASSERT_EQ(expand(), data);
+}
+
+TEST_F(SparseWriterTest, StreamSkippedRegionsAreHoles)
+{
+    std::vector<unsigned char> block(16);
+    for (size_t i = 0; i < block.size(); ++i) {
+        block[i] = static_cast<unsigned char>(i);
+    }
+
+    SparseWriter writer;
+    size_t n;
+    ASSERT_TRUE(writer.open(&_output, 16, false));
+    ASSERT_TRUE(writer.write(block.data(), block.size(), n));
+    ASSERT_TRUE(writer.seek(48, SEEK_CUR, nullptr));
+    ASSERT_TRUE(writer.write(block.data(), block.size(), n));
+    ASSERT_TRUE(writer.truncate(160));
+    ASSERT_TRUE(writer.close());
+
+    ASSERT_EQ(chunk_types(), (std::vector<uint16_t>{
+        CHUNK_TYPE_RAW, CHUNK_TYPE_DONT_CARE, CHUNK_TYPE_RAW,
+        CHUNK_TYPE_DONT_CARE
+    }));
+
+    std::vector<unsigned char> expected(160);
+    std::copy(block.begin(), block.end(), expected.begin());
+    std::copy(block.begin(), block.end(), expected.begin() + 64);
+    ASSERT_EQ(expand(), expected);
+}
+
+TEST_F(SparseWriterTest, StreamWithChecksum)
+{
+    std::vector<unsigned char> data(_input_data);
+    data.insert(data.end(), 64, 0);
+    data.insert(data.end(), {9, 8, 7, 6});
+
+    SparseWriter writer;
+    size_t n;
+    ASSERT_TRUE(writer.open(&_output, 8, true));
+    ASSERT_TRUE(writer.write(data.data(), data.size(), n));
+    ASSERT_TRUE(writer.seek(24, SEEK_END, nullptr));
+    ASSERT_TRUE(writer.truncate(data.size() + 24));
+    ASSERT_TRUE(writer.close());
+
+    auto types = chunk_types();
+    ASSERT_FALSE(types.empty());
+    ASSERT_EQ(types.back(), CHUNK_TYPE_CRC32);
+
+    // The last partial block is zero-padded and the hole counts as zeros
+    data.resize(data.size() + 28);
+    ASSERT_EQ(expand(), data);
+    ASSERT_EQ(image_checksum(), crc32(0, data.data(), data.size()));
+}
+
+TEST_F(SparseWriterTest, StreamRejectsRewinding)
+{
+    unsigned char buf[8] = {};
+    size_t n;
+
+    SparseWriter writer;
+    ASSERT_TRUE(writer.open(&_output, 4, false));
+    ASSERT_TRUE(writer.write(buf, sizeof(buf), n));
+    ASSERT_TRUE(writer.seek(0, SEEK_CUR, nullptr));
+    ASSERT_FALSE(writer.seek(4, SEEK_SET, nullptr));
+    ASSERT_FALSE(writer.truncate(4));
+    ASSERT_TRUE(writer.close());
+}
+
+TEST_F(SparseWriterTest, StreamRejectsInvalidBlockSize)
+{
+    SparseWriter writer;
+    ASSERT_FALSE(writer.open(&_output, 0, false));
+    ASSERT_FALSE(writer.open(&_output, 6, false));
+}
+
+struct SparseVerifyTest : SparseWriterTest
+{
+    // Raw data, zeros, a hole, and more raw data, followed by a CRC32 chunk
+    void build_checksummed_file()
+    {
+        SparseWriter writer;
+        std::vector<unsigned char> zeros(32);
+        size_t n;
+
+        ASSERT_TRUE(writer.open(&_output, 8, true));
+        ASSERT_TRUE(writer.write(_input_data.data(), 32, n));
+        ASSERT_TRUE(writer.write(zeros.data(), zeros.size(), n));
+        ASSERT_TRUE(writer.seek(16, SEEK_CUR, nullptr));
+        ASSERT_TRUE(writer.write(_input_data.data() + 32, 32, n));
+        ASSERT_TRUE(writer.close());
+
+        _expected.assign(_input_data.begin(), _input_data.begin() + 32);
+        _expected.insert(_expected.end(), 48, 0);
+        _expected.insert(_expected.end(), _input_data.begin() + 32,
+                         _input_data.begin() + 64);
+    }
+
+    // Corrupt the last byte of the final raw chunk
+    void corrupt()
+    {
+        static_cast<unsigned char *>(_output_data)[_output_size - 17] ^= 0xff;
+    }
+
+    std::vector<unsigned char> _expected;
+};
+
+TEST_F(SparseVerifyTest, VerifySequentialRead)
+{
+    build_checksummed_file();
+
+    MemoryFile source;
+    SparseFile file;
+    std::vector<unsigned char> data(1024);
+    size_t n;
+
+    file.set_verify_crc32(true);
+    ASSERT_TRUE(source.open(_output_data, _output_size));
+    ASSERT_TRUE(file.open(&source));
+    ASSERT_TRUE(file_read_fully(file, data.data(), data.size(), n));
+    data.resize(n);
+    ASSERT_EQ(data, _expected);
+}
+
+TEST_F(SparseVerifyTest, VerifyDetectsCorruption)
+{
+    build_checksummed_file();
+    corrupt();
+
+    MemoryFile source;
+    SparseFile file;
+    std::vector<unsigned char> data(1024);
+    size_t n;
+
+    // Not verifying by default
+    ASSERT_TRUE(source.open(_output_data, _output_size));
+    ASSERT_TRUE(file.open(&source));
+    ASSERT_TRUE(file_read_fully(file, data.data(), data.size(), n));
+    ASSERT_TRUE(file.close());
+    ASSERT_TRUE(source.close());
+
+    file.set_verify_crc32(true);
+    ASSERT_TRUE(source.open(_output_data, _output_size));
+    ASSERT_TRUE(file.open(&source));
+    ASSERT_FALSE(file_read_fully(file, data.data(), data.size(), n));
+    ASSERT_EQ(file.error(), FileError::BadFileFormat);
+}
+
+TEST_F(SparseVerifyTest, VerifyAfterSeekingOverHoles)
+{
+    build_checksummed_file();
+    corrupt();
+
+    MemoryFile source;
+    SparseFile file;
+    std::vector<unsigned char> data(1024);
+    uint64_t size;
+    bool dont_care;
+    size_t n;
+
+    file.set_verify_crc32(true);
+    ASSERT_TRUE(source.open(_output_data, _output_size));
+    ASSERT_TRUE(file.open(&source));
+
+    // Read everything except the "don't care" region
+    while (file.region(size, dont_care) && size > 0) {
+        if (dont_care) {
+            ASSERT_TRUE(file.seek(size, SEEK_CUR, nullptr));
+        } else if (!file_read_fully(file, data.data(), size, n)) {
+            break;
+        }
+    }
+
+    ASSERT_EQ(file.error(), FileError::BadFileFormat);
+}
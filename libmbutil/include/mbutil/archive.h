@@ -22,14 +22,21 @@
 #include <string>
 #include <vector>
 
+#include <cstdint>
+
 #include <archive.h>
 #include <archive_entry.h>
 
+#include "mbutil/hash.h"
+
 namespace mb
 {
 namespace util
 {
 
+class ProgressTracker;
+class ZipIndex;
+
 struct extract_info {
     std::string from;
     std::string to;
@@ -40,6 +47,14 @@ struct exists_info {
     bool exists;
 };
 
+struct ArchiveDigest
+{
+    // Size of the archive file in bytes
+    uint64_t size;
+    // SHA512 hash of the archive file
+    Sha512Digest sha512;
+};
+
 enum class compression_type
 {
     NONE,
@@ -48,7 +63,18 @@ enum class compression_type
     XZ
 };
 
+// Block size passed to archive_read_open_*() for large archives
+#define LIBARCHIVE_READ_BLOCK_SIZE      (256 * 1024)
+
+enum CopyDataFlags : int
+{
+    // Discard holes on block devices instead of zeroing them
+    COPY_DATA_DISCARD_HOLES     = 0x1,
+};
+
 int libarchive_copy_data(archive *in, archive *out, archive_entry *entry);
+bool libarchive_copy_data_to_fd(archive *in, archive_entry *entry, int fd,
+                                int flags);
 bool libarchive_copy_data_disk_to_archive(archive *in, archive *out,
                                           archive_entry *entry);
 int libarchive_copy_header_and_data(archive *in, archive *out,
@@ -56,19 +82,44 @@ int libarchive_copy_header_and_data(archive *in, archive *out,
 bool libarchive_tar_extract(const std::string &filename,
                             const std::string &target,
                             const std::vector<std::string> &patterns,
-                            compression_type compression);
+                            compression_type compression,
+                            ProgressTracker *progress = nullptr);
+bool libarchive_tar_extract_parallel(const std::string &filename,
+                                     const std::string &target,
+                                     const std::vector<std::string> &patterns,
+                                     compression_type compression,
+                                     unsigned int threads,
+                                     ProgressTracker *progress = nullptr,
+                                     const ArchiveDigest *expected = nullptr);
 bool libarchive_tar_create(const std::string &filename,
                            const std::string &base_dir,
                            const std::vector<std::string> &paths,
-                           compression_type compression);
+                           compression_type compression,
+                           unsigned int threads,
+                           bool recursive,
+                           bool file_data,
+                           ProgressTracker *progress = nullptr,
+                           ArchiveDigest *digest = nullptr);
+bool libarchive_tar_create_fd(int fd,
+                              const std::string &base_dir,
+                              const std::vector<std::string> &paths,
+                              compression_type compression,
+                              unsigned int threads,
+                              bool recursive,
+                              bool file_data,
+                              ProgressTracker *progress = nullptr,
+                              ArchiveDigest *digest = nullptr);
 
 bool extract_archive(const std::string &filename, const std::string &target);
 bool extract_files(const std::string &filename, const std::string &target,
                    const std::vector<std::string> &files);
 bool extract_files2(const std::string &filename,
                     const std::vector<extract_info> &files);
+bool extract_files2(const ZipIndex &zip,
+                    const std::vector<extract_info> &files);
 bool archive_exists(const std::string &filename,
                     std::vector<exists_info> &files);
+bool archive_exists(const ZipIndex &zip, std::vector<exists_info> &files);
 
 }
 }
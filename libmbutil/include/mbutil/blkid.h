@@ -19,12 +19,15 @@
 
 #pragma once
 
+#include <vector>
+
 namespace mb
 {
 namespace util
 {
 
 bool blkid_get_fs_type(const char *path, const char **type);
+bool blkid_probe_fs_types(const char *path, std::vector<const char *> *types);
 
 }
 }
@@ -21,6 +21,8 @@
 
 #include <cstddef>
 
+#define COMMAND_PASSED_FD       3
+
 namespace mb
 {
 namespace util
@@ -74,6 +76,8 @@ struct CommandCtx
     const char *chroot_dir = nullptr;
     /*! Whether to redirect stdio fds */
     bool redirect_stdio = false;
+    /*! Descriptor to pass as COMMAND_PASSED_FD (-1 for none) */
+    int pass_fd = -1;
 
     // Logging
 
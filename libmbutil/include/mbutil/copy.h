@@ -21,25 +21,37 @@
 
 #include <string>
 
+#include <cstdint>
+
 namespace mb
 {
 namespace util
 {
 
+class ProgressTracker;
+
 enum CopyFlags : int
 {
     COPY_ATTRIBUTES          = 0x1,
     COPY_XATTRS              = 0x2,
     COPY_EXCLUDE_TOP_LEVEL   = 0x4,
-    COPY_FOLLOW_SYMLINKS     = 0x8
+    COPY_FOLLOW_SYMLINKS     = 0x8,
+    // Copy regular files with a pool of threads (copy_dir() only)
+    COPY_PARALLEL            = 0x10
 };
 
 bool copy_data_fd(int fd_source, int fd_target);
+bool copy_data_fd_range(int fd_source, uint64_t src_offset,
+                        int fd_target, uint64_t tgt_offset,
+                        uint64_t size, uint64_t &copied);
 bool copy_xattrs(const std::string &source, const std::string &target);
+bool copy_xattrs_fd(int fd_source, int fd_target);
 bool copy_stat(const std::string &source, const std::string &target);
+bool copy_stat_fd(int fd_source, int fd_target);
 bool copy_contents(const std::string &source, const std::string &target);
 bool copy_file(const std::string &source, const std::string &target, int flags);
-bool copy_dir(const std::string &source, const std::string &target, int flags);
+bool copy_dir(const std::string &source, const std::string &target, int flags,
+              ProgressTracker *progress = nullptr);
 
 }
 }
@@ -20,13 +20,52 @@
 #pragma once
 
 #include <string>
+#include <thread>
+#include <vector>
 
 namespace mb
 {
 namespace util
 {
 
+enum DeleteFlags : int
+{
+    // Delete subtrees with a pool of threads
+    DELETE_PARALLEL          = 0x1,
+    // Move the path out of the way and delete it in a detached thread. Only
+    // use this in long-lived processes or the renamed path will be left behind
+    DELETE_BACKGROUND        = 0x2
+};
+
 bool delete_recursive(const std::string &path);
+bool delete_recursive(const std::string &path, int flags);
+bool delete_dir_contents(const std::string &path,
+                         const std::vector<std::string> &exclusions,
+                         int flags);
+void wait_for_background_deletes();
+
+class TrashDeleter
+{
+public:
+    TrashDeleter();
+    ~TrashDeleter();
+
+    TrashDeleter(const TrashDeleter &) = delete;
+    TrashDeleter & operator=(const TrashDeleter &) = delete;
+
+    bool start(const std::string &path,
+               const std::vector<std::string> &exclusions,
+               int flags);
+    bool wait();
+
+    const std::string & trash_name() const;
+
+private:
+    std::thread _thread;
+    std::string _trash;
+    std::string _trash_name;
+    bool _ret;
+};
 
 }
 }
\ No newline at end of file
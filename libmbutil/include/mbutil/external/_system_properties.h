@@ -123,6 +123,14 @@ int mb__system_property_update(prop_info *pi, const char *value, unsigned int le
 */
 uint32_t mb__system_property_serial(const prop_info* pi);
 
+/* Return the name of a system property returned by
+** mb__system_property_find or mb__system_property_foreach. The name is
+** stored in the property area and remains valid until the area is unmapped.
+**
+** Returns nullptr if the property area uses the old (compat) layout.
+*/
+const char* mb__system_property_name(const prop_info* pi);
+
 /* Initialize the system properties area in read only mode.
  * Should be done by all processes that need to read system
  * properties.
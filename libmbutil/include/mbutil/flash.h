@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+
+#include <cstddef>
+#include <cstdint>
+
+#include <openssl/sha.h>
+
+namespace mb
+{
+namespace util
+{
+
+struct FlashStats
+{
+    // Bytes that differed from the target and were written
+    uint64_t bytes_written;
+    // Bytes that already matched the target and were skipped
+    uint64_t bytes_unchanged;
+};
+
+bool flash_data(const std::string &path, const void *data, size_t size,
+                unsigned char digest[SHA512_DIGEST_LENGTH],
+                FlashStats *stats);
+
+}
+}
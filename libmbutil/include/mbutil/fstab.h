@@ -19,7 +19,9 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #define MF_WAIT             0x1
@@ -77,8 +79,39 @@ struct twrp_fstab_rec
     std::string orig_line;
 };
 
+/*!
+ * \brief Parsed fstab file with mount point lookup
+ *
+ * Mount points are indexed by their normalized path, so find() matches the
+ * same records as comparing each record's mount point with path_compare().
+ */
+template<typename Rec>
+class FstabTable
+{
+public:
+    explicit FstabTable(std::vector<Rec> recs);
+
+    const std::vector<Rec> & recs() const
+    {
+        return _recs;
+    }
+
+    const Rec * find(const std::string &mount_point) const;
+
+private:
+    std::vector<Rec> _recs;
+    // Normalized mount point -> index of first record in _recs
+    std::unordered_map<std::string, size_t> _index;
+};
+
+typedef FstabTable<fstab_rec> Fstab;
+typedef FstabTable<twrp_fstab_rec> TwrpFstab;
+
 std::vector<fstab_rec> read_fstab(const std::string &path);
 std::vector<twrp_fstab_rec> read_twrp_fstab(const std::string &path);
 
+std::shared_ptr<const Fstab> load_fstab(const std::string &path);
+std::shared_ptr<const TwrpFstab> load_twrp_fstab(const std::string &path);
+
 }
 }
@@ -19,10 +19,14 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
 #include <vector>
 
+#include <cstdlib>
+
 #include <fts.h>
+#include <sys/stat.h>
 
 namespace mb
 {
@@ -37,7 +41,15 @@ public:
         // If tree contains a mountpoint, traverse its contents
         FTS_CrossMountPointBoundaries   = 0x2,
         // Call on_reached_special_file() instead of separate functions
-        FTS_GroupSpecialFiles           = 0x4
+        FTS_GroupSpecialFiles           = 0x4,
+        // Read directories ahead of the traversal on worker threads. The hooks
+        // are still called in order from the calling thread, but directories
+        // may be read before on_reached_directory_pre() is called for them, so
+        // this must not be used if the hooks change the source tree.
+        FTS_Parallel                    = 0x8,
+        // Only stat directories and entries whose type the filesystem doesn't
+        // report. For other entries, only st_mode of fts_statp is valid.
+        FTS_NoStat                      = 0x10
     };
 
     enum Action : int {
@@ -80,8 +92,6 @@ protected:
     std::string _path;
     // Input flags
     int _flags = 0;
-    // fts pointer
-    FTS *_ftsp = nullptr;
     // Current fts entry
     FTSENT *_curr = nullptr;
     // Root (level 0) fts entry
@@ -90,7 +100,37 @@ protected:
     std::string _error_msg;
 
 private:
+    struct Child;
+    struct Dir;
+    struct Prefetcher;
+
+    typedef std::unique_ptr<FTSENT, void (*)(void *)> EntryPtr;
+
     bool _ran = false;
+    // Storage for _root and for the _curr of every non-root entry
+    EntryPtr _root_ent{nullptr, free};
+    EntryPtr _ent{nullptr, free};
+    // Storage for the fts_path of every non-root entry
+    std::string _ent_path;
+    // Stat buffer of the root entry
+    struct stat _root_sb;
+    // Directories currently being traversed (for detecting symlink loops)
+    std::vector<const struct stat *> _ancestors;
+    // Only set if FTS_Parallel was specified
+    std::unique_ptr<Prefetcher> _prefetcher;
+
+    static std::shared_ptr<Dir> load_dir(int dfd, const char *name,
+                                         int flags);
+    std::shared_ptr<Dir> get_dir(const std::shared_ptr<Dir> &parent,
+                                 size_t index);
+    void release_dir(Dir &dir);
+    void prefetch_dir(const std::shared_ptr<Dir> &dir);
+
+    static void set_entry(FTSENT *ent, char *path, size_t path_len,
+                          const char *name, short level, unsigned short info,
+                          struct stat *sb, int error);
+    bool visit(bool &ret, bool &skip);
+    bool walk(const std::shared_ptr<Dir> &dir, short level, bool &ret);
 };
 
 }
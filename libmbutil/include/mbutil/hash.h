@@ -19,7 +19,11 @@
 
 #pragma once
 
+#include <array>
 #include <string>
+#include <vector>
+
+#include <cstdint>
 
 #include <openssl/sha.h>
 
@@ -28,8 +32,23 @@ namespace mb
 namespace util
 {
 
+typedef std::array<unsigned char, SHA512_DIGEST_LENGTH> Sha512Digest;
+
+enum class HashAlgorithm
+{
+    Sha256,
+    Sha512,
+};
+
 bool sha512_hash(const std::string &path,
                  unsigned char digest[SHA512_DIGEST_LENGTH]);
+bool sha512_hash(int fd, unsigned char digest[SHA512_DIGEST_LENGTH]);
+bool sha512_hash_files(const std::vector<std::string> &paths,
+                       std::vector<Sha512Digest> &digests,
+                       unsigned int max_threads);
+bool hash_fd_range(int fd, HashAlgorithm algorithm,
+                   uint64_t offset, uint64_t size,
+                   std::vector<unsigned char> &digest, uint64_t &hashed);
 
 }
 }
@@ -21,15 +21,34 @@
 
 #include <string>
 
+#include <cstdint>
+
 namespace mb
 {
 namespace util
 {
 
+enum LoopDevFlags : int
+{
+    // Bypass the page cache for the backing file if the kernel supports it
+    LOOPDEV_DIRECT_IO        = 0x1
+};
+
+struct LoopDevInfo
+{
+    std::string backing_file;
+    bool direct_io;
+    uint32_t block_size;
+};
+
 std::string loopdev_find_unused(void);
 bool loopdev_set_up_device(const std::string &loopdev, const std::string &file,
                            uint64_t offset, bool ro);
+bool loopdev_set_up_device(const std::string &loopdev, const std::string &file,
+                           uint64_t offset, bool ro, int flags,
+                           uint32_t block_size = 0);
 bool loopdev_remove_device(const std::string &loopdev);
+bool loopdev_get_info(const std::string &loopdev, LoopDevInfo &info);
 
 }
 }
\ No newline at end of file
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2014  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <regex>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Parsed textual file_contexts file
+ *
+ * Lookups follow libselinux's precedence rules: specs without regex
+ * metacharacters take priority over regex specs and, otherwise, the last
+ * matching spec in the file wins.
+ */
+class FileContexts
+{
+public:
+    bool load(const std::string &path);
+
+    bool lookup(const std::string &path, mode_t mode,
+                std::string *context) const;
+
+private:
+    struct Spec
+    {
+        std::string pattern;
+        std::regex regex;
+        bool has_meta_chars;
+        // File type bits (S_IFMT) or 0 to match all types
+        mode_t type;
+        std::string context;
+    };
+
+    std::vector<Spec> _specs;
+};
+
+enum MetadataFlags : int
+{
+    // Set owner to MetadataRules::uid and MetadataRules::gid
+    METADATA_SET_OWNER      = 0x1,
+    // Set permissions to MetadataRules::dir_mode or MetadataRules::file_mode.
+    // Symlinks are never chmod'ed
+    METADATA_SET_MODE       = 0x2,
+    // Set the SELinux label to MetadataRules::context or, if
+    // MetadataRules::file_contexts is set, the label it specifies
+    METADATA_SET_CONTEXT    = 0x4,
+};
+
+struct MetadataRules
+{
+    int flags = 0;
+
+    uid_t uid = 0;
+    gid_t gid = 0;
+
+    mode_t dir_mode = 0;
+    mode_t file_mode = 0;
+
+    std::string context;
+    const FileContexts *file_contexts = nullptr;
+    // Path that the root of the tree is matched as in file_contexts (eg.
+    // "/system" when labeling a mounted system image elsewhere). Defaults to
+    // the path of the tree if empty
+    std::string label_path;
+};
+
+bool apply_metadata_recursive(const std::string &path,
+                              const MetadataRules &rules);
+
+}
+}
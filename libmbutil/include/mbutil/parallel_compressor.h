@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "mbutil/archive.h"
+
+namespace mb
+{
+namespace util
+{
+
+class ParallelCompressor
+{
+public:
+    typedef std::function<void(const void *, size_t)> OutputObserver;
+
+    ParallelCompressor(compression_type type, unsigned int threads);
+    ~ParallelCompressor();
+
+    ParallelCompressor(const ParallelCompressor &) = delete;
+    ParallelCompressor & operator=(const ParallelCompressor &) = delete;
+
+    static bool is_supported(compression_type type);
+
+    void set_output_observer(OutputObserver observer);
+
+    bool open(int fd);
+    bool write(const void *data, size_t size);
+    bool close();
+
+    int error() const;
+
+private:
+    struct Job;
+
+    bool write_fully(const void *data, size_t size);
+    bool submit(bool last);
+    bool drain_one();
+    void stop_workers();
+    void worker_loop();
+
+    static bool compress_gzip(Job &job);
+    static bool compress_lz4(Job &job);
+
+    compression_type _type;
+    unsigned int _threads;
+    size_t _block_size;
+    int _fd;
+    OutputObserver _observer;
+    int _error;
+    bool _open;
+
+    std::vector<std::thread> _workers;
+    std::mutex _mutex;
+    std::condition_variable _work_cv;
+    std::condition_variable _done_cv;
+    bool _stop;
+
+    // Jobs waiting for a worker
+    std::deque<std::shared_ptr<Job>> _pending;
+    // Jobs not yet written to the output, in stream order
+    std::deque<std::shared_ptr<Job>> _in_flight;
+    // Job currently being filled by write()
+    std::shared_ptr<Job> _cur;
+
+    // gzip trailer state
+    uint32_t _crc;
+    uint64_t _total_in;
+};
+
+}
+}
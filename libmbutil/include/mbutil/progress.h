@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+
+#include <cstdint>
+
+namespace mb
+{
+namespace util
+{
+
+struct ProgressStats
+{
+    // Number of regular files processed
+    uint64_t files;
+    // Number of input bytes processed
+    uint64_t bytes;
+    // Total number of input bytes or 0 if unknown
+    uint64_t total_bytes;
+    // Time since the tracker was created
+    double elapsed_s;
+    // Rate since the previous report
+    double bytes_per_sec;
+    // Estimated time remaining or -1 if unknown
+    double eta_s;
+    // Whether this is the final report
+    bool finished;
+};
+
+typedef std::function<void(const ProgressStats &)> ProgressCallback;
+
+class ProgressTracker
+{
+public:
+    ProgressTracker(ProgressCallback cb, unsigned int interval_ms = 1000);
+
+    ProgressTracker(const ProgressTracker &) = delete;
+    ProgressTracker & operator=(const ProgressTracker &) = delete;
+
+    void set_total_bytes(uint64_t total);
+
+    void add_file();
+    void add_bytes(uint64_t n);
+    void set_bytes(uint64_t n);
+
+    ProgressStats stats() const;
+
+    void finish();
+
+private:
+    void maybe_report();
+    void report(uint64_t now_ms, bool finished);
+
+    ProgressCallback _cb;
+    unsigned int _interval_ms;
+    uint64_t _start_ms;
+
+    std::atomic<uint64_t> _files;
+    std::atomic<uint64_t> _bytes;
+    std::atomic<uint64_t> _total_bytes;
+    // Time of the next report. Threads only call the callback if this has
+    // passed, so the common path is two relaxed loads.
+    std::atomic<uint64_t> _next_report_ms;
+
+    // Serializes the callback. Threads that find it locked skip reporting.
+    std::mutex _report_lock;
+    uint64_t _last_report_ms;
+    uint64_t _last_report_bytes;
+};
+
+}
+}
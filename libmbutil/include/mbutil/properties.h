@@ -19,8 +19,12 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
 #include <unordered_map>
+#include <vector>
+
+#include <sys/types.h>
 
 #include "mbutil/integer.h"
 #include "mbutil/external/system_properties.h"
@@ -95,8 +99,97 @@ bool property_list(PropertyListCb prop_fn, void *cookie);
 
 bool property_get_all(std::unordered_map<std::string, std::string> &map);
 
+/*!
+ * \brief Snapshot of the system properties that can be cheaply refreshed
+ *
+ * update() does nothing if the property area's global serial number has not
+ * changed since the last call. Otherwise, it walks the prop_info records and
+ * only rereads the values of properties whose serial number changed. Names
+ * point directly into the (read-only) property area.
+ */
+class PropertySnapshot
+{
+public:
+    struct Property
+    {
+        const prop_info *pi;
+        // Points into the property area or into the snapshot's own storage.
+        // Valid for the lifetime of the snapshot.
+        const char *name;
+        std::string value;
+        uint32_t serial;
+    };
+
+    PropertySnapshot();
+
+    PropertySnapshot(const PropertySnapshot &) = delete;
+    PropertySnapshot & operator=(const PropertySnapshot &) = delete;
+
+    bool update(std::vector<size_t> *changed = nullptr);
+
+    const std::vector<Property> & properties() const;
+
+private:
+    static void update_cb(const prop_info *pi, void *cookie);
+
+    bool _valid;
+    uint32_t _area_serial;
+    std::vector<Property> _props;
+    std::unordered_map<const prop_info *, size_t> _index;
+    // Names for old property areas, where names are copied out
+    std::vector<std::unique_ptr<std::string>> _names;
+    std::vector<size_t> *_changed;
+};
+
 // Properties file functions
 
+/*!
+ * \brief Parsed properties file
+ *
+ * The file is read into a single buffer and the keys are indexed with an
+ * open-addressing hash table, so lookups do not need to rescan the file. If a
+ * key appears more than once, the first occurrence wins (like
+ * property_file_get()).
+ */
+class PropertyFile
+{
+public:
+    PropertyFile();
+
+    bool load(const std::string &path);
+    bool is_stale(const std::string &path) const;
+
+    bool get(const std::string &key, std::string &value_out) const;
+
+    bool list(PropertyListCb prop_fn, void *cookie) const;
+
+private:
+    struct Entry
+    {
+        size_t key_offset;
+        size_t key_size;
+        size_t value_offset;
+        size_t value_size;
+    };
+
+    void parse();
+    void build_index();
+    const Entry * find(const char *key, size_t key_size) const;
+
+    std::string _buf;
+    // Entries in file order
+    std::vector<Entry> _entries;
+    // Hash table of (index into _entries + 1), 0 = empty slot
+    std::vector<size_t> _index;
+
+    // File identity for revalidation
+    dev_t _dev;
+    ino_t _ino;
+    off_t _size;
+    time_t _mtime_sec;
+    long _mtime_nsec;
+};
+
 bool property_file_get(const std::string &path, const std::string &key,
                        std::string &value_out);
 std::string property_file_get_string(const std::string &path,
@@ -146,5 +239,7 @@ bool property_file_get_all(const std::string &path,
 bool property_file_write_all(const std::string &path,
                              const std::unordered_map<std::string, std::string> &map);
 
+void property_file_cache_clear();
+
 }
 }
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace mb
+{
+namespace util
+{
+
+enum class IoPriorityClass
+{
+    // Let the kernel derive the I/O priority from the nice level
+    None = 0,
+    RealTime = 1,
+    BestEffort = 2,
+    // Only do I/O when no other process needs the disk
+    Idle = 3,
+};
+
+struct CgroupPlacement
+{
+    // Mountpoint of the cgroup v1 hierarchy (eg. /dev/cpuset)
+    std::string mount_point;
+    // Controller as listed in /proc/<pid>/cgroup (eg. cpuset)
+    std::string controller;
+    // Group relative to mount_point (eg. background)
+    std::string group;
+};
+
+struct SchedPolicy
+{
+    IoPriorityClass io_class = IoPriorityClass::None;
+    // 0 (highest) to 7 (lowest). Ignored for IoPriorityClass::None and Idle
+    int io_level = 4;
+    int nice = 0;
+    // Groups that don't exist on the device are skipped
+    std::vector<CgroupPlacement> cgroups;
+    // Maximum write rate in bytes per second (0 for unlimited)
+    uint64_t write_limit = 0;
+};
+
+enum class SchedPreset
+{
+    // Finish as quickly as possible
+    Foreground,
+    // Stay out of the way of the apps the user is interacting with
+    Background,
+};
+
+SchedPolicy sched_policy_preset(SchedPreset preset);
+bool parse_sched_preset(const char *str, SchedPreset &preset);
+
+bool apply_thread_sched_policy(const SchedPolicy &policy);
+bool apply_process_sched_policy(const SchedPolicy &policy);
+
+class ScopedThreadSchedPolicy
+{
+public:
+    explicit ScopedThreadSchedPolicy(const SchedPolicy &policy);
+    ~ScopedThreadSchedPolicy();
+
+    ScopedThreadSchedPolicy(const ScopedThreadSchedPolicy &) = delete;
+    ScopedThreadSchedPolicy & operator=(const ScopedThreadSchedPolicy &)
+            = delete;
+
+private:
+    int _nice;
+    int _ioprio;
+    // Original group of the thread in each hierarchy that it was moved out of
+    std::vector<CgroupPlacement> _cgroups;
+    uint64_t _write_limit;
+};
+
+void set_write_limit(uint64_t bytes_per_sec);
+uint64_t write_limit();
+void throttle_write(size_t size);
+
+}
+}
@@ -23,6 +23,7 @@
 #include <vector>
 
 #include <inttypes.h>
+#include <sys/uio.h>
 
 namespace mb
 {
@@ -31,6 +32,7 @@ namespace util
 
 ssize_t socket_read(int fd, void *buf, size_t size);
 ssize_t socket_write(int fd, const void *buf, size_t size);
+ssize_t socket_writev(int fd, struct iovec *iov, int iovcnt);
 bool socket_read_bytes(int fd, std::vector<uint8_t> *result);
 bool socket_write_bytes(int fd, const uint8_t *data, size_t len);
 bool socket_read_uint16(int fd, uint16_t *result);
@@ -52,5 +54,36 @@ bool socket_write_string_array(int fd, const std::vector<std::string> &list);
 bool socket_receive_fds(int fd, std::vector<int> *fds);
 bool socket_send_fds(int fd, const std::vector<int> &fds);
 
+/*!
+ * \brief Reader for messages written by socket_write_bytes()
+ *
+ * Messages are read into a buffer that is kept across messages, so reading a
+ * message does not allocate memory (once the buffer is large enough) and
+ * several small messages can be read with a single read() call. The payload of
+ * every message is 8-byte aligned.
+ *
+ * Since this reads ahead, it must not be mixed with other socket_read_*()
+ * calls or with socket_receive_fds() on the same socket.
+ */
+class SocketFramedReader
+{
+public:
+    SocketFramedReader(int fd);
+
+    SocketFramedReader(const SocketFramedReader &) = delete;
+    SocketFramedReader & operator=(const SocketFramedReader &) = delete;
+
+    bool read(const uint8_t **data, size_t *size);
+
+private:
+    bool fill(size_t size);
+
+    int _fd;
+    std::vector<uint8_t> _buf;
+    // Range of _buf containing data that has been read, but not yet consumed
+    size_t _begin;
+    size_t _end;
+};
+
 }
 }
\ No newline at end of file
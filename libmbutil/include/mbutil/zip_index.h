@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <string>
+#include <unordered_map>
+
+#include <cstdint>
+
+namespace mb
+{
+namespace util
+{
+
+struct ZipEntryInfo
+{
+    std::string name;
+    uint16_t version_made_by;
+    uint16_t flags;
+    uint16_t method;
+    uint32_t crc32;
+    uint64_t compressed_size;
+    uint64_t uncompressed_size;
+    uint64_t local_header_offset;
+    uint32_t external_attrs;
+};
+
+class ZipIndex
+{
+public:
+    ZipIndex();
+    ~ZipIndex();
+
+    ZipIndex(const ZipIndex &) = delete;
+    ZipIndex & operator=(const ZipIndex &) = delete;
+
+    bool open(const std::string &path);
+    void close();
+
+    bool is_open() const;
+    const std::string & path() const;
+    size_t size() const;
+
+    const ZipEntryInfo * find(const std::string &name) const;
+
+    static bool can_extract(const ZipEntryInfo &entry);
+    bool extract(const ZipEntryInfo &entry, const std::string &target) const;
+
+private:
+    bool read_at(void *buf, size_t size, uint64_t offset) const;
+    bool read_central_directory();
+    bool entry_data_offset(const ZipEntryInfo &entry, uint64_t *offset) const;
+    bool read_entry_data(const ZipEntryInfo &entry, int fd_out,
+                         std::string *data_out) const;
+
+    int _fd;
+    uint64_t _file_size;
+    // Read-only mapping of the whole file or nullptr if it couldn't be mapped
+    const unsigned char *_map;
+    std::string _path;
+    std::unordered_map<std::string, ZipEntryInfo> _entries;
+};
+
+}
+}
@@ -22,13 +22,25 @@
 #include <algorithm>
 #include <memory>
 #include <cerrno>
+#include <cinttypes>
 #include <cstring>
 
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mbcommon/string.h"
 #include "mblog/logging.h"
 #include "mbutil/autoclose/archive.h"
 #include "mbutil/directory.h"
 #include "mbutil/finally.h"
+#include "mbutil/parallel_compressor.h"
 #include "mbutil/path.h"
+#include "mbutil/progress.h"
+#include "mbutil/sched_policy.h"
+#include "mbutil/zip_index.h"
 
 #define LIBARCHIVE_DISK_WRITER_FLAGS \
     ARCHIVE_EXTRACT_TIME \
@@ -75,6 +87,179 @@ int libarchive_copy_data(archive *in, archive *out, archive_entry *entry)
     return ARCHIVE_OK;
 }
 
+// Source of zeros for holes that can't be skipped
+static const char null_buf[64 * 1024] = {};
+
+static bool write_fully_fd(int fd, const void *buf, size_t size)
+{
+    auto ptr = static_cast<const char *>(buf);
+
+    while (size > 0) {
+        ssize_t n = write(fd, ptr, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return false;
+        } else if (n == 0) {
+            errno = EIO;
+            return false;
+        }
+
+        ptr += n;
+        size -= static_cast<size_t>(n);
+
+        throttle_write(static_cast<size_t>(n));
+    }
+
+    return true;
+}
+
+struct CopyDataTarget
+{
+    int fd;
+    int flags;
+    bool seekable;
+    bool block_dev;
+    // Offset of the fd when the copy started
+    int64_t base;
+};
+
+static bool write_zeros(const CopyDataTarget &target, int64_t size)
+{
+    while (size > 0) {
+        size_t n = static_cast<size_t>(std::min<int64_t>(
+                size, static_cast<int64_t>(sizeof(null_buf))));
+        if (!write_fully_fd(target.fd, null_buf, n)) {
+            return false;
+        }
+        size -= static_cast<int64_t>(n);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Move past a hole at \p pos (relative to the start of the copy)
+ *
+ * Holes in regular files are left unallocated. On block devices, the range is
+ * discarded if requested or zeroed by the device otherwise. Zeros are written
+ * if neither is possible (eg. unaligned ranges or pipes).
+ */
+static bool skip_hole(const CopyDataTarget &target, int64_t pos, int64_t size)
+{
+    if (!target.seekable) {
+        return write_zeros(target, size);
+    }
+
+    if (target.block_dev) {
+        uint64_t range[2] = {
+            static_cast<uint64_t>(target.base + pos),
+            static_cast<uint64_t>(size)
+        };
+
+        if (!(target.flags & COPY_DATA_DISCARD_HOLES)
+                || ioctl(target.fd, BLKDISCARD, &range) < 0) {
+            if (ioctl(target.fd, BLKZEROOUT, &range) < 0) {
+                return write_zeros(target, size);
+            }
+        }
+    }
+
+    return lseek64(target.fd, size, SEEK_CUR) >= 0;
+}
+
+/*!
+ * \brief Copy the data of the current entry to a file descriptor
+ *
+ * Blocks are written straight from libarchive's buffers. Holes reported by
+ * archive_read_data_block() (or a trailing gap up to the entry size) are
+ * skipped with lseek() instead of being written out. See skip_hole() for how
+ * holes are handled on block devices and non-seekable file descriptors.
+ *
+ * Data is written starting at the current offset of \p fd.
+ *
+ * \param in Input archive positioned at an entry
+ * \param entry Current entry (may be NULL)
+ * \param fd Output file descriptor
+ * \param flags Bitwise-OR of CopyDataFlags
+ *
+ * \return Whether all data was copied
+ */
+bool libarchive_copy_data_to_fd(archive *in, archive_entry *entry, int fd,
+                                int flags)
+{
+    const char *name = entry && archive_entry_pathname(entry)
+            ? archive_entry_pathname(entry) : "(archive entry)";
+
+    CopyDataTarget target;
+    target.fd = fd;
+    target.flags = flags;
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        LOGE("%s: Failed to stat output: %s", name, strerror(errno));
+        return false;
+    }
+
+    target.base = lseek64(fd, 0, SEEK_CUR);
+    target.seekable = target.base >= 0
+            && (S_ISREG(sb.st_mode) || S_ISBLK(sb.st_mode));
+    target.block_dev = S_ISBLK(sb.st_mode);
+
+    const void *buf;
+    size_t size;
+    int64_t offset;
+    int64_t pos = 0;
+    int ret;
+
+    while ((ret = archive_read_data_block(in, &buf, &size, &offset))
+            == ARCHIVE_OK) {
+        if (offset < pos) {
+            LOGE("%s: Data block at %" PRId64 " is before current offset %"
+                 PRId64, name, offset, pos);
+            return false;
+        } else if (offset > pos) {
+            if (!skip_hole(target, pos, offset - pos)) {
+                LOGE("%s: Failed to skip hole: %s", name, strerror(errno));
+                return false;
+            }
+            pos = offset;
+        }
+
+        if (!write_fully_fd(fd, buf, size)) {
+            LOGE("%s: Failed to write data: %s", name, strerror(errno));
+            return false;
+        }
+        pos += static_cast<int64_t>(size);
+    }
+
+    if (ret != ARCHIVE_EOF) {
+        LOGE("%s: Data copy ended without reaching EOF: %s",
+             name, archive_error_string(in));
+        return false;
+    }
+
+    // Trailing hole
+    if (entry && archive_entry_size_is_set(entry)
+            && archive_entry_size(entry) > pos) {
+        int64_t hole = archive_entry_size(entry) - pos;
+        if (!skip_hole(target, pos, hole)) {
+            LOGE("%s: Failed to skip hole: %s", name, strerror(errno));
+            return false;
+        }
+        pos += hole;
+
+        // Seeking past the end doesn't extend regular files
+        if (target.seekable && S_ISREG(sb.st_mode)
+                && ftruncate64(fd, target.base + pos) < 0) {
+            LOGE("%s: Failed to truncate: %s", name, strerror(errno));
+            return false;
+        }
+    }
+
+    return true;
+}
+
 /*!
  * \brief Copy sparse file on disk to an archive
  *
@@ -87,12 +272,9 @@ bool libarchive_copy_data_disk_to_archive(archive *in, archive *out,
     ssize_t bytes_written;
     int64_t offset;
     int64_t progress = 0;
-    char null_buf[64 * 1024];
     const void *buf;
     int ret;
 
-    memset(null_buf, 0, sizeof(null_buf));
-
     while ((ret = archive_read_data_block(
             in, &buf, &bytes_read, &offset)) == ARCHIVE_OK) {
         if (offset > progress) {
@@ -170,10 +352,18 @@ int libarchive_copy_header_and_data(archive *in, archive *out,
  * warning because an incomplete archive is useless for backup and restoring.
  */
 
+/*!
+ * \brief Extract a tar archive to a directory
+ *
+ * If \a progress is not null, its byte counter tracks the number of bytes
+ * consumed from \a filename (before decompression) and its total is set to the
+ * size of \a filename so that the ETA is meaningful for compressed archives.
+ */
 bool libarchive_tar_extract(const std::string &filename,
                             const std::string &target,
                             const std::vector<std::string> &patterns,
-                            compression_type compression)
+                            compression_type compression,
+                            ProgressTracker *progress)
 {
     if (target.empty()) {
         LOGE("%s: Invalid target path for extraction", target.c_str());
@@ -230,13 +420,20 @@ bool libarchive_tar_extract(const std::string &filename,
     archive_write_disk_set_standard_lookup(out.get());
     archive_write_disk_set_options(out.get(), LIBARCHIVE_DISK_WRITER_FLAGS);
 
-    if (archive_read_open_filename(
-            in.get(), filename.c_str(), 10240) != ARCHIVE_OK) {
+    if (archive_read_open_filename(in.get(), filename.c_str(),
+                                   LIBARCHIVE_READ_BLOCK_SIZE) != ARCHIVE_OK) {
         LOGE("%s: Failed to open file: %s",
              filename.c_str(), archive_error_string(in.get()));
         return false;
     }
 
+    if (progress) {
+        struct stat sb;
+        if (stat(filename.c_str(), &sb) == 0) {
+            progress->set_total_bytes(static_cast<uint64_t>(sb.st_size));
+        }
+    }
+
     archive_entry *entry;
     int ret;
     std::string target_path;
@@ -283,6 +480,14 @@ bool libarchive_tar_extract(const std::string &filename,
                  archive_error_string(in.get()));
             return false;
         }
+
+        if (progress) {
+            if (archive_entry_filetype(entry) == AE_IFREG) {
+                progress->add_file();
+            }
+            progress->set_bytes(static_cast<uint64_t>(
+                    archive_filter_bytes(in.get(), -1)));
+        }
     }
 
     if (archive_read_close(in.get()) != ARCHIVE_OK) {
@@ -304,18 +509,32 @@ bool libarchive_tar_extract(const std::string &filename,
     return archive_match_path_unmatched_inclusions(matcher.get()) == 0;
 }
 
-static bool write_file(archive *in, archive *out, archive_entry *entry)
+static bool write_file(archive *in, archive *out, archive_entry *entry,
+                       bool file_data, ProgressTracker *progress)
 {
     int ret;
 
+    if (!file_data && archive_entry_filetype(entry) == AE_IFREG) {
+        archive_entry_set_size(entry, 0);
+        archive_entry_sparse_clear(entry);
+    }
+
     ret = archive_write_header(out, entry);
     if (ret != ARCHIVE_OK) {
         LOGE("%s: %s", archive_entry_pathname(entry), archive_error_string(out));
         return false;
     }
 
-    if (archive_entry_size(entry) > 0) {
-        return util::libarchive_copy_data_disk_to_archive(in, out, entry);
+    int64_t size = archive_entry_size(entry);
+
+    if (size > 0 && !util::libarchive_copy_data_disk_to_archive(
+            in, out, entry)) {
+        return false;
+    }
+
+    if (progress && archive_entry_filetype(entry) == AE_IFREG) {
+        progress->add_bytes(static_cast<uint64_t>(std::max<int64_t>(size, 0)));
+        progress->add_file();
     }
 
     return true;
@@ -323,34 +542,178 @@ static bool write_file(archive *in, archive *out, archive_entry *entry)
 
 static int metadata_filter(archive *a, void *data, archive_entry *entry)
 {
-    (void) data;
     (void) entry;
 
-    if (archive_read_disk_can_descend(a)) {
+    bool recursive = *static_cast<bool *>(data);
+
+    if (recursive && archive_read_disk_can_descend(a)) {
         archive_read_disk_descend(a);
     }
     return 1;
 }
 
 /*!
- * \brief Create pax archive with all metadata
+ * \brief Output of libarchive_tar_create() when it is not a plain file write
  *
- * \param filename Target archive path
- * \param base_dir Base directory for \a paths
- * \param paths List of paths to add to the archive
+ * Data is either compressed by \a compressor or written to the output as is.
+ * If \a digest is not null, the bytes that end up in the output are hashed and
+ * counted as they are written.
  *
- * \return Whether the archive creation was successful
+ * If \a out_fd is -1, \a filename is created. Otherwise, the data is written
+ * to \a out_fd, which is not closed.
  */
-bool libarchive_tar_create(const std::string &filename,
-                           const std::string &base_dir,
-                           const std::vector<std::string> &paths,
-                           compression_type compression)
+struct ArchiveWriteCtx
+{
+    ParallelCompressor compressor;
+    bool parallel;
+    std::string filename;
+    int out_fd;
+    int fd;
+    ArchiveDigest *digest;
+    SHA512_CTX sha_ctx;
+
+    ArchiveWriteCtx(compression_type type, unsigned int threads,
+                    bool parallel, const std::string &filename, int out_fd,
+                    ArchiveDigest *digest)
+        : compressor(type, threads), parallel(parallel), filename(filename)
+        , out_fd(out_fd), fd(-1), digest(digest)
+    {
+        if (digest) {
+            compressor.set_output_observer([this](const void *buf,
+                                                  size_t size) {
+                observe(buf, size);
+            });
+        }
+    }
+
+    void observe(const void *buf, size_t size)
+    {
+        SHA512_Update(&sha_ctx, buf, size);
+        digest->size += size;
+    }
+};
+
+static int archive_open_cb(archive *a, void *userdata)
+{
+    auto *ctx = static_cast<ArchiveWriteCtx *>(userdata);
+
+    if (ctx->out_fd >= 0) {
+        ctx->fd = ctx->out_fd;
+    } else {
+        ctx->fd = open(ctx->filename.c_str(),
+                       O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    }
+    if (ctx->fd < 0) {
+        archive_set_error(a, errno, "Failed to open file: %s",
+                          strerror(errno));
+        return ARCHIVE_FATAL;
+    }
+
+    if (ctx->digest) {
+        if (!SHA512_Init(&ctx->sha_ctx)) {
+            archive_set_error(a, EINVAL, "openssl: SHA512_Init() failed");
+            return ARCHIVE_FATAL;
+        }
+        ctx->digest->size = 0;
+    }
+
+    if (ctx->parallel && !ctx->compressor.open(ctx->fd)) {
+        archive_set_error(a, ctx->compressor.error(),
+                          "Failed to start compressor: %s",
+                          strerror(ctx->compressor.error()));
+        return ARCHIVE_FATAL;
+    }
+
+    return ARCHIVE_OK;
+}
+
+static la_ssize_t archive_write_cb(archive *a, void *userdata,
+                                   const void *buf, size_t size)
+{
+    auto *ctx = static_cast<ArchiveWriteCtx *>(userdata);
+
+    if (ctx->parallel) {
+        if (!ctx->compressor.write(buf, size)) {
+            archive_set_error(a, ctx->compressor.error(),
+                              "Failed to write compressed data: %s",
+                              strerror(ctx->compressor.error()));
+            return -1;
+        }
+    } else {
+        if (!write_fully_fd(ctx->fd, buf, size)) {
+            archive_set_error(a, errno, "Failed to write data: %s",
+                              strerror(errno));
+            return -1;
+        }
+        if (ctx->digest) {
+            ctx->observe(buf, size);
+        }
+    }
+
+    return size;
+}
+
+static int archive_close_cb(archive *a, void *userdata)
+{
+    auto *ctx = static_cast<ArchiveWriteCtx *>(userdata);
+
+    if (ctx->fd < 0) {
+        return ARCHIVE_OK;
+    }
+
+    bool ret = true;
+    int error = 0;
+
+    if (ctx->parallel) {
+        ret = ctx->compressor.close();
+        error = ctx->compressor.error();
+    }
+
+    if (ctx->fd != ctx->out_fd && close(ctx->fd) < 0 && ret) {
+        ret = false;
+        error = errno;
+    }
+    ctx->fd = -1;
+
+    if (!ret) {
+        archive_set_error(a, error, "Failed to finish compressed stream: %s",
+                          strerror(error));
+        return ARCHIVE_FATAL;
+    }
+
+    if (ctx->digest && !SHA512_Final(ctx->digest->sha512.data(),
+                                     &ctx->sha_ctx)) {
+        archive_set_error(a, EINVAL, "openssl: SHA512_Final() failed");
+        return ARCHIVE_FATAL;
+    }
+
+    return ARCHIVE_OK;
+}
+
+static bool tar_create(const std::string &filename,
+                       int out_fd,
+                       const std::string &base_dir,
+                       const std::vector<std::string> &paths,
+                       compression_type compression,
+                       unsigned int threads,
+                       bool recursive,
+                       bool file_data,
+                       ProgressTracker *progress,
+                       ArchiveDigest *digest)
 {
     if (base_dir.empty() && paths.empty()) {
         LOGE("%s: No base directory or paths specified", filename.c_str());
         return false;
     }
 
+    bool parallel = threads > 1 && ParallelCompressor::is_supported(compression);
+    int ret;
+
+    // Must outlive the archive writer since the writer's close callback
+    // references it
+    ArchiveWriteCtx write_ctx(compression, threads, parallel, filename, out_fd,
+                              digest);
+
     autoclose::archive in(archive_read_disk_new(), archive_read_free);
     if (!in) {
         LOGE("%s: Out of memory when creating disk reader", __FUNCTION__);
@@ -371,7 +734,7 @@ bool libarchive_tar_create(const std::string &filename,
     // Set up disk reader parameters
     archive_read_disk_set_symlink_physical(in.get());
     archive_read_disk_set_metadata_filter_callback(
-            in.get(), metadata_filter, nullptr);
+            in.get(), metadata_filter, &recursive);
     archive_read_disk_set_behavior(in.get(), LIBARCHIVE_DISK_READER_FLAGS);
     // We don't want to look up usernames and group names on Android
     //archive_read_disk_set_standard_lookup(in.get());
@@ -393,13 +756,25 @@ bool libarchive_tar_create(const std::string &filename,
     case compression_type::NONE:
         break;
     case compression_type::LZ4:
-        archive_write_add_filter_lz4(out.get());
+        if (!parallel) {
+            archive_write_add_filter_lz4(out.get());
+        }
         break;
     case compression_type::GZIP:
-        archive_write_add_filter_gzip(out.get());
+        if (!parallel) {
+            archive_write_add_filter_gzip(out.get());
+        }
         break;
     case compression_type::XZ:
         archive_write_add_filter_xz(out.get());
+        if (threads > 1) {
+            std::string value = format("%u", threads);
+            if (archive_write_set_filter_option(
+                    out.get(), "xz", "threads", value.c_str()) != ARCHIVE_OK) {
+                LOGW("%s: Multithreaded xz compression not available: %s",
+                     filename.c_str(), archive_error_string(out.get()));
+            }
+        }
         break;
     default:
         LOGE("Invalid compression type");
@@ -411,7 +786,19 @@ bool libarchive_tar_create(const std::string &filename,
                                             archive_format(out.get()));
 
     // Open output file
-    if (archive_write_open_filename(out.get(), filename.c_str()) != ARCHIVE_OK) {
+    // The custom callbacks are also needed for throttle_write() to see the data
+    if (parallel || digest || out_fd >= 0 || write_limit() != 0) {
+        if (!parallel) {
+            // Don't pad the compressed stream, like
+            // archive_write_open_filename() does for regular files
+            archive_write_set_bytes_in_last_block(out.get(), 1);
+        }
+        ret = archive_write_open(out.get(), &write_ctx, &archive_open_cb,
+                                 &archive_write_cb, &archive_close_cb);
+    } else {
+        ret = archive_write_open_filename(out.get(), filename.c_str());
+    }
+    if (ret != ARCHIVE_OK) {
         LOGE("%s: Failed to open file: %s",
              filename.c_str(), archive_error_string(out.get()));
         return false;
@@ -419,7 +806,6 @@ bool libarchive_tar_create(const std::string &filename,
 
     archive_entry *entry = nullptr;
     archive_entry *sparse_entry = nullptr;
-    int ret;
     std::string full_path;
 
     // Add hierarchies
@@ -496,7 +882,8 @@ bool libarchive_tar_create(const std::string &filename,
             archive_entry_linkify(resolver.get(), &entry, &sparse_entry);
 
             if (entry) {
-                if (!write_file(in.get(), out.get(), entry)) {
+                if (!write_file(in.get(), out.get(), entry, file_data,
+                                progress)) {
                     archive_entry_free(entry);
                     return false;
                 }
@@ -504,7 +891,8 @@ bool libarchive_tar_create(const std::string &filename,
                 entry = nullptr;
             }
             if (sparse_entry) {
-                if (!write_file(in.get(), out.get(), sparse_entry)) {
+                if (!write_file(in.get(), out.get(), sparse_entry,
+                                file_data, progress)) {
                     archive_entry_free(sparse_entry);
                     return false;
                 }
@@ -548,7 +936,7 @@ bool libarchive_tar_create(const std::string &filename,
             return false;
         }
 
-        if (!write_file(in.get(), out.get(), entry)) {
+        if (!write_file(in.get(), out.get(), entry, file_data, progress)) {
             archive_entry_free(entry);
             return false;
         }
@@ -566,6 +954,73 @@ bool libarchive_tar_create(const std::string &filename,
     return true;
 }
 
+/*!
+ * \brief Create pax archive with all metadata
+ *
+ * If \a threads is greater than 1, gzip and lz4 archives are compressed in
+ * parallel with ParallelCompressor and xz archives use liblzma's threaded
+ * encoder. The output is readable by libarchive_tar_extract() either way.
+ *
+ * \param filename Target archive path
+ * \param base_dir Base directory for \a paths
+ * \param paths List of paths to add to the archive
+ * \param compression Compression type
+ * \param threads Number of compression threads
+ * \param recursive Whether to add the contents of directories in \a paths. If
+ *                  false, only the directory entries themselves are added.
+ * \param file_data Whether to store the contents of regular files. If false,
+ *                  regular files are stored with a size of 0 so that only
+ *                  their metadata ends up in the archive.
+ * \param progress Progress tracker that is updated after each regular file is
+ *                 added (may be NULL). The total is left to the caller.
+ * \param digest If not NULL, the size and SHA512 hash of the archive file are
+ *               computed while it is written and stored here. This avoids
+ *               reading the archive back to checksum it.
+ *
+ * \return Whether the archive creation was successful
+ */
+bool libarchive_tar_create(const std::string &filename,
+                           const std::string &base_dir,
+                           const std::vector<std::string> &paths,
+                           compression_type compression,
+                           unsigned int threads,
+                           bool recursive,
+                           bool file_data,
+                           ProgressTracker *progress,
+                           ArchiveDigest *digest)
+{
+    return tar_create(filename, -1, base_dir, paths, compression, threads,
+                      recursive, file_data, progress, digest);
+}
+
+/*!
+ * \brief Create pax archive with all metadata and write it to a file descriptor
+ *
+ * The output is the same as that of libarchive_tar_create(), so \a fd may be a
+ * pipe or socket. The last block is not padded. \a fd is not closed.
+ *
+ * \return Whether the archive creation was successful
+ */
+bool libarchive_tar_create_fd(int fd,
+                              const std::string &base_dir,
+                              const std::vector<std::string> &paths,
+                              compression_type compression,
+                              unsigned int threads,
+                              bool recursive,
+                              bool file_data,
+                              ProgressTracker *progress,
+                              ArchiveDigest *digest)
+{
+    if (fd < 0) {
+        LOGE("Invalid file descriptor: %d", fd);
+        return false;
+    }
+
+    return tar_create(format("<fd %d>", fd), fd, base_dir, paths,
+                      compression, threads, recursive, file_data, progress,
+                      digest);
+}
+
 static bool set_up_input(archive *in, const std::string &filename)
 {
     // Add more as needed
@@ -575,7 +1030,8 @@ static bool set_up_input(archive *in, const std::string &filename)
     archive_read_support_format_zip(in);
     //archive_read_support_filter_xz(in);
 
-    if (archive_read_open_filename(in, filename.c_str(), 10240) != ARCHIVE_OK) {
+    if (archive_read_open_filename(in, filename.c_str(),
+                                   LIBARCHIVE_READ_BLOCK_SIZE) != ARCHIVE_OK) {
         LOGE("%s: Failed to open archive: %s",
              filename.c_str(), archive_error_string(in));
         return false;
@@ -652,6 +1108,63 @@ bool extract_archive(const std::string &filename, const std::string &target)
     return true;
 }
 
+/*
+ * Extract entries by seeking directly to them using the zip's central
+ * directory. If the zip cannot be indexed or contains entries ZipIndex cannot
+ * handle, *fallback is set to true and nothing is extracted so the caller can
+ * stream the archive through libarchive instead.
+ */
+static bool extract_files_indexed(const ZipIndex &zip,
+                                  const std::vector<extract_info> &files,
+                                  bool *fallback)
+{
+    std::vector<const ZipEntryInfo *> entries;
+    bool missing = false;
+
+    *fallback = false;
+
+    for (const extract_info &info : files) {
+        const ZipEntryInfo *entry = zip.find(info.from);
+        if (entry && !ZipIndex::can_extract(*entry)) {
+            *fallback = true;
+            return false;
+        }
+        entries.push_back(entry);
+    }
+
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (!entries[i]) {
+            LOGE("%s: File not found in archive", files[i].from.c_str());
+            missing = true;
+        } else if (!zip.extract(*entries[i], files[i].to)) {
+            return false;
+        }
+    }
+
+    if (missing) {
+        LOGE("Not all specified files were extracted");
+        return false;
+    }
+
+    return true;
+}
+
+static bool extract_files_indexed(const std::string &filename,
+                                  const std::vector<extract_info> &files,
+                                  bool *fallback)
+{
+    ZipIndex zip;
+
+    if (!zip.open(filename)) {
+        LOGW("%s: Failed to index zip; reading sequentially",
+             filename.c_str());
+        *fallback = true;
+        return false;
+    }
+
+    return extract_files_indexed(zip, files, fallback);
+}
+
 bool extract_files(const std::string &filename, const std::string &target,
                    const std::vector<std::string> &files)
 {
@@ -659,6 +1172,20 @@ bool extract_files(const std::string &filename, const std::string &target,
         return false;
     }
 
+    {
+        std::vector<extract_info> infos;
+        bool fallback;
+
+        for (const std::string &file : files) {
+            infos.push_back({ file, target + "/" + file });
+        }
+
+        bool ret = extract_files_indexed(filename, infos, &fallback);
+        if (!fallback) {
+            return ret;
+        }
+    }
+
     autoclose::archive in(archive_read_new(), archive_read_free);
     autoclose::archive out(archive_write_disk_new(), archive_write_free);
 
@@ -723,13 +1250,9 @@ bool extract_files(const std::string &filename, const std::string &target,
     return true;
 }
 
-bool extract_files2(const std::string &filename,
-                    const std::vector<extract_info> &files)
+static bool extract_files2_sequential(const std::string &filename,
+                                      const std::vector<extract_info> &files)
 {
-    if (files.empty()) {
-        return false;
-    }
-
     autoclose::archive in(archive_read_new(), archive_read_free);
     autoclose::archive out(archive_write_disk_new(), archive_write_free);
 
@@ -778,6 +1301,61 @@ bool extract_files2(const std::string &filename,
     return true;
 }
 
+bool extract_files2(const std::string &filename,
+                    const std::vector<extract_info> &files)
+{
+    if (files.empty()) {
+        return false;
+    }
+
+    bool fallback;
+    bool indexed_ret = extract_files_indexed(filename, files, &fallback);
+    if (!fallback) {
+        return indexed_ret;
+    }
+
+    return extract_files2_sequential(filename, files);
+}
+
+/*!
+ * \brief Extract files using an already opened zip index
+ *
+ * This avoids parsing the central directory again when the same zip is
+ * accessed multiple times. Entries that \p zip cannot extract are read
+ * sequentially from the zip's path with libarchive.
+ */
+bool extract_files2(const ZipIndex &zip,
+                    const std::vector<extract_info> &files)
+{
+    if (files.empty()) {
+        return false;
+    }
+
+    bool fallback;
+    bool indexed_ret = extract_files_indexed(zip, files, &fallback);
+    if (!fallback) {
+        return indexed_ret;
+    }
+
+    return extract_files2_sequential(zip.path(), files);
+}
+
+/*!
+ * \brief Check whether files exist using an already opened zip index
+ */
+bool archive_exists(const ZipIndex &zip, std::vector<exists_info> &files)
+{
+    if (files.empty()) {
+        return false;
+    }
+
+    for (exists_info &info : files) {
+        info.exists = zip.find(info.path) != nullptr;
+    }
+
+    return true;
+}
+
 bool archive_exists(const std::string &filename,
                     std::vector<exists_info> &files)
 {
@@ -799,6 +1377,16 @@ bool archive_exists(const std::string &filename,
         info.exists = false;
     }
 
+    // Only the central directory needs to be read
+    {
+        ZipIndex zip;
+        if (zip.open(filename)) {
+            return archive_exists(zip, files);
+        }
+        LOGW("%s: Failed to index zip; reading sequentially",
+             filename.c_str());
+    }
+
     if (!set_up_input(in.get(), filename)) {
         return false;
     }
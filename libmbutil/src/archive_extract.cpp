@@ -0,0 +1,1190 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/archive.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+#include "mbutil/autoclose/archive.h"
+#include "mbutil/directory.h"
+#include "mbutil/progress.h"
+#include "mbutil/sched_policy.h"
+
+// Regular files up to this size are buffered and handed to the writer threads.
+// Larger files are streamed to disk by the reader thread.
+#define PARALLEL_EXTRACT_BUFFER_MAX     (4 * 1024 * 1024)
+// Maximum amount of buffered file data waiting to be written
+#define PARALLEL_EXTRACT_QUEUE_BYTES    (64 * 1024 * 1024)
+// Maximum number of cached directory fds
+#define PARALLEL_EXTRACT_DIR_FDS        256
+
+namespace mb
+{
+namespace util
+{
+
+namespace
+{
+
+struct DirFd
+{
+    int fd;
+
+    explicit DirFd(int fd_) : fd(fd_)
+    {
+    }
+
+    ~DirFd()
+    {
+        close(fd);
+    }
+
+    DirFd(const DirFd &) = delete;
+    DirFd & operator=(const DirFd &) = delete;
+};
+
+typedef std::shared_ptr<DirFd> DirFdPtr;
+
+struct Metadata
+{
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    struct timespec times[2];
+    std::vector<std::pair<std::string, std::string>> xattrs;
+};
+
+struct Extent
+{
+    int64_t offset;
+    size_t data_offset;
+    size_t size;
+};
+
+struct FileJob
+{
+    // Path relative to the target directory, split into parent and name
+    std::string parent;
+    std::string name;
+    int64_t size;
+    bool sparse;
+    Metadata meta;
+    std::vector<char> data;
+    std::vector<Extent> extents;
+};
+
+struct DeferredDir
+{
+    std::string path;
+    Metadata meta;
+};
+
+/*!
+ * \brief Split an archive path into its parent and name relative to the target
+ *
+ * Leading slashes and "./" components are removed. Paths containing ".." are
+ * rejected, like ARCHIVE_EXTRACT_SECURE_NODOTDOT.
+ */
+bool split_path(const char *path, std::string &parent, std::string &name)
+{
+    std::vector<std::string> components;
+    const char *p = path;
+
+    while (*p) {
+        const char *end = strchr(p, '/');
+        size_t len = end ? static_cast<size_t>(end - p) : strlen(p);
+
+        if (len == 2 && p[0] == '.' && p[1] == '.') {
+            return false;
+        } else if (len > 0 && !(len == 1 && p[0] == '.')) {
+            components.emplace_back(p, len);
+        }
+
+        p += len;
+        if (*p == '/') {
+            ++p;
+        }
+    }
+
+    parent.clear();
+    name.clear();
+
+    if (components.empty()) {
+        return true;
+    }
+
+    name = std::move(components.back());
+    components.pop_back();
+
+    for (auto const &c : components) {
+        if (!parent.empty()) {
+            parent += '/';
+        }
+        parent += c;
+    }
+
+    return true;
+}
+
+std::string join_path(const std::string &parent, const std::string &name)
+{
+    return parent.empty() ? name : parent + '/' + name;
+}
+
+void read_metadata(archive_entry *entry, Metadata &meta)
+{
+    meta.mode = archive_entry_perm(entry);
+    meta.uid = static_cast<uid_t>(archive_entry_uid(entry));
+    meta.gid = static_cast<gid_t>(archive_entry_gid(entry));
+
+    meta.times[1].tv_sec = archive_entry_mtime(entry);
+    meta.times[1].tv_nsec = archive_entry_mtime_nsec(entry);
+    if (archive_entry_atime_is_set(entry)) {
+        meta.times[0].tv_sec = archive_entry_atime(entry);
+        meta.times[0].tv_nsec = archive_entry_atime_nsec(entry);
+    } else {
+        meta.times[0] = meta.times[1];
+    }
+
+    // This includes the SELinux label (security.selinux)
+    const char *xattr_name;
+    const void *xattr_value;
+    size_t xattr_size;
+
+    archive_entry_xattr_reset(entry);
+    while (archive_entry_xattr_next(entry, &xattr_name, &xattr_value,
+                                    &xattr_size) == ARCHIVE_OK) {
+        meta.xattrs.emplace_back(xattr_name, std::string(
+                static_cast<const char *>(xattr_value), xattr_size));
+    }
+}
+
+/*!
+ * \brief Apply metadata to an open file or directory
+ *
+ * The owner is set before the mode so that setuid/setgid bits are not
+ * cleared.
+ */
+bool apply_metadata_fd(int fd, const std::string &path, const Metadata &meta)
+{
+    for (auto const &xattr : meta.xattrs) {
+        if (fsetxattr(fd, xattr.first.c_str(), xattr.second.data(),
+                      xattr.second.size(), 0) < 0) {
+            LOGE("%s: Failed to set xattr %s: %s", path.c_str(),
+                 xattr.first.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    if (fchown(fd, meta.uid, meta.gid) < 0) {
+        LOGE("%s: Failed to set owner: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (fchmod(fd, meta.mode) < 0) {
+        LOGE("%s: Failed to set mode: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (futimens(fd, meta.times) < 0) {
+        LOGE("%s: Failed to set times: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Apply metadata to a symlink or special file by name
+ */
+bool apply_metadata_at(int dirfd, const std::string &name,
+                       const std::string &path, const Metadata &meta,
+                       bool is_symlink)
+{
+    // There is no fd-based way to modify a symlink, so use the /proc path of
+    // the parent directory
+    std::string proc_path = "/proc/self/fd/" + std::to_string(dirfd) + '/'
+            + name;
+
+    for (auto const &xattr : meta.xattrs) {
+        if (lsetxattr(proc_path.c_str(), xattr.first.c_str(),
+                      xattr.second.data(), xattr.second.size(), 0) < 0) {
+            LOGE("%s: Failed to set xattr %s: %s", path.c_str(),
+                 xattr.first.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    if (fchownat(dirfd, name.c_str(), meta.uid, meta.gid,
+                 AT_SYMLINK_NOFOLLOW) < 0) {
+        LOGE("%s: Failed to set owner: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    // Symlink permissions are meaningless
+    if (!is_symlink && fchmodat(dirfd, name.c_str(), meta.mode, 0) < 0) {
+        LOGE("%s: Failed to set mode: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (utimensat(dirfd, name.c_str(), meta.times, AT_SYMLINK_NOFOLLOW) < 0) {
+        LOGE("%s: Failed to set times: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Remove whatever is at \p name so that it can be replaced
+ *
+ * Only empty directories are removed.
+ */
+bool remove_existing(int dirfd, const std::string &name,
+                     const std::string &path)
+{
+    if (unlinkat(dirfd, name.c_str(), 0) < 0
+            && (errno != EISDIR
+                || unlinkat(dirfd, name.c_str(), AT_REMOVEDIR) < 0)) {
+        LOGE("%s: Failed to remove existing file: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+class ParallelExtractor
+{
+public:
+    ParallelExtractor(int root_fd, unsigned int threads)
+        : _root(std::make_shared<DirFd>(root_fd))
+        , _failed(false)
+        , _stop(false)
+        , _active(0)
+        , _queued_bytes(0)
+    {
+        for (unsigned int i = 0; i < threads; ++i) {
+            _threads.emplace_back(&ParallelExtractor::worker, this);
+        }
+    }
+
+    ~ParallelExtractor()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_queue_lock);
+            // Anything still queued is from an extraction that failed
+            _queue.clear();
+            _stop = true;
+        }
+        _queue_cv.notify_all();
+
+        for (auto &t : _threads) {
+            t.join();
+        }
+    }
+
+    ParallelExtractor(const ParallelExtractor &) = delete;
+    ParallelExtractor & operator=(const ParallelExtractor &) = delete;
+
+    bool failed() const
+    {
+        return _failed.load(std::memory_order_relaxed);
+    }
+
+    int root_fd() const
+    {
+        return _root->fd;
+    }
+
+    DirFdPtr get_dir(const std::string &path);
+    bool extract_entry(archive *in, archive_entry *entry,
+                       const std::string &parent, const std::string &name);
+    bool finish();
+
+private:
+    DirFdPtr open_dir_locked(const std::string &path);
+
+    bool extract_directory(archive_entry *entry, const std::string &parent,
+                           const std::string &name);
+    bool extract_regular(archive *in, archive_entry *entry,
+                         const std::string &parent, const std::string &name);
+    bool extract_symlink(archive_entry *entry, const std::string &parent,
+                         const std::string &name);
+    bool extract_hardlink(archive_entry *entry, const std::string &parent,
+                          const std::string &name);
+    bool extract_special(archive_entry *entry, const std::string &parent,
+                         const std::string &name);
+
+    int create_file(const FileJob &job, const DirFd &dir);
+    bool finish_file(int fd, const FileJob &job);
+    bool write_job(const FileJob &job);
+
+    void enqueue(std::unique_ptr<FileJob> job);
+    void wait_idle();
+    void worker();
+
+    DirFdPtr _root;
+    std::mutex _dir_lock;
+    std::unordered_map<std::string, DirFdPtr> _dirs;
+
+    std::vector<DeferredDir> _deferred_dirs;
+
+    std::atomic<bool> _failed;
+
+    std::mutex _queue_lock;
+    std::condition_variable _queue_cv;
+    std::condition_variable _idle_cv;
+    std::deque<std::unique_ptr<FileJob>> _queue;
+    bool _stop;
+    unsigned int _active;
+    size_t _queued_bytes;
+    std::vector<std::thread> _threads;
+};
+
+/*!
+ * \brief Get an fd for a directory relative to the target, creating it if
+ *        needed
+ *
+ * Each component is opened with O_NOFOLLOW, so symlinks extracted from the
+ * archive can never redirect later entries outside of the target, like
+ * ARCHIVE_EXTRACT_SECURE_SYMLINKS.
+ */
+DirFdPtr ParallelExtractor::get_dir(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(_dir_lock);
+    return open_dir_locked(path);
+}
+
+DirFdPtr ParallelExtractor::open_dir_locked(const std::string &path)
+{
+    if (path.empty()) {
+        return _root;
+    }
+
+    auto it = _dirs.find(path);
+    if (it != _dirs.end()) {
+        return it->second;
+    }
+
+    std::string parent;
+    std::string name;
+    auto slash = path.rfind('/');
+    if (slash == std::string::npos) {
+        name = path;
+    } else {
+        parent = path.substr(0, slash);
+        name = path.substr(slash + 1);
+    }
+
+    DirFdPtr parent_fd = open_dir_locked(parent);
+    if (!parent_fd) {
+        return nullptr;
+    }
+
+    int fd = openat(parent_fd->fd, name.c_str(),
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT) {
+        // The archive does not have to list parent directories first
+        if (mkdirat(parent_fd->fd, name.c_str(), 0755) < 0
+                && errno != EEXIST) {
+            LOGE("%s: Failed to create directory: %s",
+                 path.c_str(), strerror(errno));
+            return nullptr;
+        }
+        fd = openat(parent_fd->fd, name.c_str(),
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        LOGE("%s: Failed to open directory: %s", path.c_str(), strerror(errno));
+        return nullptr;
+    }
+
+    // Entries are usually grouped by directory, so evicting everything is
+    // nearly as good as an LRU. Fds still in use stay open until released.
+    if (_dirs.size() >= PARALLEL_EXTRACT_DIR_FDS) {
+        _dirs.clear();
+    }
+
+    auto dir = std::make_shared<DirFd>(fd);
+    _dirs[path] = dir;
+    return dir;
+}
+
+bool ParallelExtractor::extract_entry(archive *in, archive_entry *entry,
+                                      const std::string &parent,
+                                      const std::string &name)
+{
+    // Hard links may not have a file type set
+    if (archive_entry_hardlink(entry)) {
+        return extract_hardlink(entry, parent, name);
+    }
+
+    switch (archive_entry_filetype(entry)) {
+    case AE_IFDIR:
+        return extract_directory(entry, parent, name);
+    case AE_IFREG:
+        return extract_regular(in, entry, parent, name);
+    case AE_IFLNK:
+        return extract_symlink(entry, parent, name);
+    case AE_IFCHR:
+    case AE_IFBLK:
+    case AE_IFIFO:
+    case AE_IFSOCK:
+        return extract_special(entry, parent, name);
+    default:
+        LOGE("%s: Unsupported file type: 0%o", archive_entry_pathname(entry),
+             archive_entry_filetype(entry));
+        return false;
+    }
+}
+
+bool ParallelExtractor::extract_directory(archive_entry *entry,
+                                          const std::string &parent,
+                                          const std::string &name)
+{
+    std::string path = join_path(parent, name);
+
+    if (!name.empty()) {
+        DirFdPtr dir = get_dir(parent);
+        if (!dir) {
+            return false;
+        }
+
+        struct stat sb;
+        if (fstatat(dir->fd, name.c_str(), &sb, AT_SYMLINK_NOFOLLOW) == 0
+                && !S_ISDIR(sb.st_mode)
+                && !remove_existing(dir->fd, name, path)) {
+            return false;
+        }
+
+        // The real mode is applied at the end so that read-only directories
+        // can still be populated
+        if (mkdirat(dir->fd, name.c_str(), 0700) < 0 && errno != EEXIST) {
+            LOGE("%s: Failed to create directory: %s",
+                 path.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    DeferredDir deferred;
+    deferred.path = std::move(path);
+    read_metadata(entry, deferred.meta);
+    _deferred_dirs.push_back(std::move(deferred));
+
+    return true;
+}
+
+bool ParallelExtractor::extract_regular(archive *in, archive_entry *entry,
+                                        const std::string &parent,
+                                        const std::string &name)
+{
+    std::unique_ptr<FileJob> job(new FileJob());
+    job->parent = parent;
+    job->name = name;
+    job->size = archive_entry_size_is_set(entry) ? archive_entry_size(entry) : 0;
+    job->sparse = archive_entry_sparse_count(entry) > 0;
+    read_metadata(entry, job->meta);
+
+    bool buffered = job->size <= PARALLEL_EXTRACT_BUFFER_MAX;
+    int fd = -1;
+    std::string path = join_path(parent, name);
+
+    if (buffered) {
+        job->data.reserve(static_cast<size_t>(job->size));
+    } else {
+        DirFdPtr dir = get_dir(parent);
+        if (!dir) {
+            return false;
+        }
+        fd = create_file(*job, *dir);
+        if (fd < 0) {
+            return false;
+        }
+    }
+
+    const void *buf;
+    size_t size;
+    int64_t offset;
+    int ret;
+
+    while ((ret = archive_read_data_block(in, &buf, &size, &offset))
+            == ARCHIVE_OK) {
+        if (buffered) {
+            Extent extent;
+            extent.offset = offset;
+            extent.data_offset = job->data.size();
+            extent.size = size;
+            job->extents.push_back(extent);
+
+            auto data = static_cast<const char *>(buf);
+            job->data.insert(job->data.end(), data, data + size);
+        } else {
+            auto data = static_cast<const char *>(buf);
+            while (size > 0) {
+                ssize_t n = pwrite64(fd, data, size, offset);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                } else if (n <= 0) {
+                    LOGE("%s: Failed to write: %s",
+                         path.c_str(), strerror(n < 0 ? errno : EIO));
+                    close(fd);
+                    return false;
+                }
+                data += n;
+                size -= static_cast<size_t>(n);
+                offset += n;
+
+                throttle_write(static_cast<size_t>(n));
+            }
+        }
+    }
+
+    if (ret != ARCHIVE_EOF) {
+        LOGE("%s: Data copy ended without reaching EOF: %s",
+             path.c_str(), archive_error_string(in));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    if (buffered) {
+        enqueue(std::move(job));
+        return true;
+    } else {
+        return finish_file(fd, *job);
+    }
+}
+
+bool ParallelExtractor::extract_symlink(archive_entry *entry,
+                                        const std::string &parent,
+                                        const std::string &name)
+{
+    std::string path = join_path(parent, name);
+    const char *target = archive_entry_symlink(entry);
+    if (!target) {
+        LOGE("%s: Symlink has no target", path.c_str());
+        return false;
+    }
+
+    DirFdPtr dir = get_dir(parent);
+    if (!dir) {
+        return false;
+    }
+
+    if (symlinkat(target, dir->fd, name.c_str()) < 0) {
+        if (errno != EEXIST || !remove_existing(dir->fd, name, path)
+                || symlinkat(target, dir->fd, name.c_str()) < 0) {
+            LOGE("%s: Failed to create symlink: %s",
+                 path.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    Metadata meta;
+    read_metadata(entry, meta);
+    return apply_metadata_at(dir->fd, name, path, meta, true);
+}
+
+bool ParallelExtractor::extract_hardlink(archive_entry *entry,
+                                         const std::string &parent,
+                                         const std::string &name)
+{
+    std::string path = join_path(parent, name);
+    std::string target_parent;
+    std::string target_name;
+
+    if (!split_path(archive_entry_hardlink(entry), target_parent, target_name)
+            || target_name.empty()) {
+        LOGE("%s: Invalid hard link target: %s",
+             path.c_str(), archive_entry_hardlink(entry));
+        return false;
+    }
+
+    // The link target may still be queued
+    wait_idle();
+    if (failed()) {
+        return false;
+    }
+
+    DirFdPtr target_dir = get_dir(target_parent);
+    DirFdPtr dir = get_dir(parent);
+    if (!target_dir || !dir) {
+        return false;
+    }
+
+    if (linkat(target_dir->fd, target_name.c_str(), dir->fd, name.c_str(),
+               0) < 0) {
+        if (errno != EEXIST || !remove_existing(dir->fd, name, path)
+                || linkat(target_dir->fd, target_name.c_str(), dir->fd,
+                          name.c_str(), 0) < 0) {
+            LOGE("%s: Failed to create hard link: %s",
+                 path.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool ParallelExtractor::extract_special(archive_entry *entry,
+                                        const std::string &parent,
+                                        const std::string &name)
+{
+    std::string path = join_path(parent, name);
+
+    DirFdPtr dir = get_dir(parent);
+    if (!dir) {
+        return false;
+    }
+
+    mode_t mode = archive_entry_filetype(entry) | 0600;
+    dev_t dev = archive_entry_rdev(entry);
+
+    if (mknodat(dir->fd, name.c_str(), mode, dev) < 0) {
+        if (errno != EEXIST || !remove_existing(dir->fd, name, path)
+                || mknodat(dir->fd, name.c_str(), mode, dev) < 0) {
+            LOGE("%s: Failed to create special file: %s",
+                 path.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    Metadata meta;
+    read_metadata(entry, meta);
+    return apply_metadata_at(dir->fd, name, path, meta, false);
+}
+
+int ParallelExtractor::create_file(const FileJob &job, const DirFd &dir)
+{
+    std::string path = join_path(job.parent, job.name);
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC;
+
+    int fd = openat(dir.fd, job.name.c_str(), flags, 0600);
+    if (fd < 0 && (errno == ELOOP || errno == EISDIR)) {
+        // Replace symlinks and (empty) directories with the file
+        if (!remove_existing(dir.fd, job.name, path)) {
+            return -1;
+        }
+        fd = openat(dir.fd, job.name.c_str(), flags, 0600);
+    }
+    if (fd < 0) {
+        LOGE("%s: Failed to create file: %s", path.c_str(), strerror(errno));
+        return -1;
+    }
+
+    // Preallocating avoids fragmentation and repeated block allocation.
+    // Sparse files would lose their holes.
+    if (!job.sparse && job.size > 0
+            && fallocate64(fd, 0, 0, job.size) < 0
+            && errno != EOPNOTSUPP && errno != ENOSYS) {
+        LOGW("%s: Failed to preallocate space: %s",
+             path.c_str(), strerror(errno));
+    }
+
+    return fd;
+}
+
+/*!
+ * \brief Truncate to the final size, apply metadata, and close the file
+ */
+bool ParallelExtractor::finish_file(int fd, const FileJob &job)
+{
+    std::string path = join_path(job.parent, job.name);
+    bool ret = true;
+
+    // Sparse files may end in a hole
+    if (job.sparse && ftruncate64(fd, job.size) < 0) {
+        LOGE("%s: Failed to set size: %s", path.c_str(), strerror(errno));
+        ret = false;
+    }
+
+    if (ret) {
+        ret = apply_metadata_fd(fd, path, job.meta);
+    }
+
+    if (close(fd) < 0 && ret) {
+        LOGE("%s: Failed to close: %s", path.c_str(), strerror(errno));
+        ret = false;
+    }
+
+    return ret;
+}
+
+bool ParallelExtractor::write_job(const FileJob &job)
+{
+    DirFdPtr dir = get_dir(job.parent);
+    if (!dir) {
+        return false;
+    }
+
+    int fd = create_file(job, *dir);
+    if (fd < 0) {
+        return false;
+    }
+
+    for (auto const &extent : job.extents) {
+        const char *data = job.data.data() + extent.data_offset;
+        size_t size = extent.size;
+        int64_t offset = extent.offset;
+
+        while (size > 0) {
+            ssize_t n = pwrite64(fd, data, size, offset);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n <= 0) {
+                LOGE("%s: Failed to write: %s",
+                     join_path(job.parent, job.name).c_str(),
+                     strerror(n < 0 ? errno : EIO));
+                close(fd);
+                return false;
+            }
+            data += n;
+            size -= static_cast<size_t>(n);
+            offset += n;
+
+            throttle_write(static_cast<size_t>(n));
+        }
+    }
+
+    return finish_file(fd, job);
+}
+
+void ParallelExtractor::enqueue(std::unique_ptr<FileJob> job)
+{
+    std::unique_lock<std::mutex> lock(_queue_lock);
+
+    // Block the reader while too much data is buffered. A single job is
+    // always accepted so that progress is guaranteed.
+    _idle_cv.wait(lock, [&] {
+        return _queued_bytes == 0
+                || _queued_bytes + job->data.size()
+                        <= PARALLEL_EXTRACT_QUEUE_BYTES;
+    });
+
+    _queued_bytes += job->data.size();
+    _queue.push_back(std::move(job));
+    lock.unlock();
+
+    _queue_cv.notify_one();
+}
+
+void ParallelExtractor::wait_idle()
+{
+    std::unique_lock<std::mutex> lock(_queue_lock);
+    _idle_cv.wait(lock, [&] {
+        return _queue.empty() && _active == 0;
+    });
+}
+
+void ParallelExtractor::worker()
+{
+    std::unique_lock<std::mutex> lock(_queue_lock);
+
+    while (true) {
+        _queue_cv.wait(lock, [&] {
+            return _stop || !_queue.empty();
+        });
+        if (_queue.empty()) {
+            break;
+        }
+
+        std::unique_ptr<FileJob> job = std::move(_queue.front());
+        _queue.pop_front();
+        ++_active;
+        lock.unlock();
+
+        // Skip remaining jobs once anything has failed
+        if (!failed() && !write_job(*job)) {
+            _failed.store(true, std::memory_order_relaxed);
+        }
+
+        lock.lock();
+        _queued_bytes -= job->data.size();
+        --_active;
+        _idle_cv.notify_all();
+    }
+}
+
+/*!
+ * \brief Wait for all writes, apply directory metadata, and sync
+ */
+bool ParallelExtractor::finish()
+{
+    wait_idle();
+    if (failed()) {
+        return false;
+    }
+
+    // Creating entries modifies the parent directory's mtime, so this must
+    // happen after everything has been written
+    for (auto const &deferred : _deferred_dirs) {
+        DirFdPtr dir = get_dir(deferred.path);
+        if (!dir || !apply_metadata_fd(dir->fd, deferred.path, deferred.meta)) {
+            return false;
+        }
+    }
+
+    // syncfs() is not exposed by older bionic versions
+    if (syscall(SYS_syncfs, _root->fd) < 0) {
+        LOGE("Failed to sync filesystem: %s", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Archive input that hashes the raw file contents as they are read
+ */
+struct VerifyReadCtx
+{
+    std::string filename;
+    int fd;
+    std::vector<unsigned char> buf;
+    SHA512_CTX sha_ctx;
+    uint64_t size;
+
+    explicit VerifyReadCtx(const std::string &filename_)
+        : filename(filename_), fd(-1), buf(LIBARCHIVE_READ_BLOCK_SIZE), size(0)
+    {
+    }
+
+    ~VerifyReadCtx()
+    {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    VerifyReadCtx(const VerifyReadCtx &) = delete;
+    VerifyReadCtx & operator=(const VerifyReadCtx &) = delete;
+
+    ssize_t read_block()
+    {
+        ssize_t n;
+        do {
+            n = read(fd, buf.data(), buf.size());
+        } while (n < 0 && errno == EINTR);
+
+        if (n > 0) {
+            SHA512_Update(&sha_ctx, buf.data(), static_cast<size_t>(n));
+            size += static_cast<uint64_t>(n);
+        }
+
+        return n;
+    }
+
+    /*!
+     * \brief Hash the data after the end of the tar stream and compare
+     *
+     * libarchive stops reading at the end-of-archive marker, so the padding
+     * after it has not been hashed yet.
+     */
+    bool finish(const ArchiveDigest &expected)
+    {
+        ssize_t n;
+        while ((n = read_block()) > 0);
+
+        if (n < 0) {
+            LOGE("%s: Failed to read: %s", filename.c_str(), strerror(errno));
+            return false;
+        }
+
+        Sha512Digest digest;
+        if (!SHA512_Final(digest.data(), &sha_ctx)) {
+            LOGE("openssl: SHA512_Final() failed");
+            return false;
+        }
+
+        if (size != expected.size || digest != expected.sha512) {
+            LOGE("%s: Archive does not match its checksum (%" PRIu64
+                 " of %" PRIu64 " bytes)", filename.c_str(), size,
+                 expected.size);
+            return false;
+        }
+
+        return true;
+    }
+};
+
+static int verify_open_cb(archive *a, void *userdata)
+{
+    auto *ctx = static_cast<VerifyReadCtx *>(userdata);
+
+    ctx->fd = open(ctx->filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (ctx->fd < 0) {
+        archive_set_error(a, errno, "%s", strerror(errno));
+        return ARCHIVE_FATAL;
+    }
+
+    posix_fadvise(ctx->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (!SHA512_Init(&ctx->sha_ctx)) {
+        archive_set_error(a, EINVAL, "openssl: SHA512_Init() failed");
+        return ARCHIVE_FATAL;
+    }
+
+    return ARCHIVE_OK;
+}
+
+static la_ssize_t verify_read_cb(archive *a, void *userdata,
+                                 const void **buf)
+{
+    auto *ctx = static_cast<VerifyReadCtx *>(userdata);
+
+    ssize_t n = ctx->read_block();
+    if (n < 0) {
+        archive_set_error(a, errno, "Failed to read: %s", strerror(errno));
+        return -1;
+    }
+
+    *buf = ctx->buf.data();
+    return n;
+}
+
+}
+
+/*!
+ * \brief Extract a tar archive to a directory using multiple writer threads
+ *
+ * This is a faster alternative to libarchive_tar_extract() for archives with
+ * many small files. The calling thread decompresses the archive. Regular
+ * files up to 4 MiB are buffered and written by a pool of \a threads writer
+ * threads. Larger files, directories, and links are handled by the calling
+ * thread.
+ *
+ * Files are created with `openat()` relative to cached directory fds and
+ * preallocated with `fallocate()`. Owner, mode, times, and xattrs (including
+ * SELinux labels) are applied through the open fd. The metadata of
+ * directories is applied in one batch at the end, followed by a single
+ * `syncfs()`.
+ *
+ * Only numeric owners are restored, and ACLs and file flags are not
+ * supported. Extraction stops at the first error.
+ *
+ * \param filename Archive path
+ * \param target Target directory (created if it does not exist)
+ * \param patterns Only extract entries matching these patterns (all entries if
+ *                 empty)
+ * \param compression Compression type of the archive
+ * \param threads Number of writer threads (0 for the number of CPUs)
+ * \param progress Progress tracker (may be NULL). See libarchive_tar_extract()
+ * \param expected If not NULL, the archive file is hashed as it is read and
+ *                 the extraction fails if it does not match. Since the file
+ *                 is hashed while it is extracted, corrupted data may already
+ *                 have been written to \a target when the mismatch is found.
+ *
+ * \return Whether the archive was successfully extracted
+ */
+bool libarchive_tar_extract_parallel(const std::string &filename,
+                                     const std::string &target,
+                                     const std::vector<std::string> &patterns,
+                                     compression_type compression,
+                                     unsigned int threads,
+                                     ProgressTracker *progress,
+                                     const ArchiveDigest *expected)
+{
+    if (target.empty()) {
+        LOGE("%s: Invalid target path for extraction", target.c_str());
+        return false;
+    }
+
+    if (threads == 0) {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    autoclose::archive matcher(archive_match_new(), archive_match_free);
+    if (!matcher) {
+        LOGE("%s: Out of memory when creating matcher", __FUNCTION__);
+        return false;
+    }
+    autoclose::archive in(archive_read_new(), archive_read_free);
+    if (!in) {
+        LOGE("%s: Out of memory when creating archive reader", __FUNCTION__);
+        return false;
+    }
+
+    for (const std::string &pattern : patterns) {
+        if (archive_match_include_pattern(
+                matcher.get(), pattern.c_str()) != ARCHIVE_OK) {
+            LOGE("Invalid pattern: %s", pattern.c_str());
+            return false;
+        }
+    }
+
+    archive_read_support_format_tar(in.get());
+
+    switch (compression) {
+    case compression_type::NONE:
+        break;
+    case compression_type::LZ4:
+        archive_read_support_filter_lz4(in.get());
+        break;
+    case compression_type::GZIP:
+        archive_read_support_filter_gzip(in.get());
+        break;
+    case compression_type::XZ:
+        archive_read_support_filter_xz(in.get());
+        break;
+    default:
+        LOGE("Invalid compression type");
+        return false;
+    }
+
+    if (!mkdir_recursive(target, 0755) && errno != EEXIST) {
+        LOGE("%s: Failed to create directory: %s",
+             target.c_str(), strerror(errno));
+        return false;
+    }
+
+    int root_fd = open(target.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        LOGE("%s: Failed to open directory: %s",
+             target.c_str(), strerror(errno));
+        return false;
+    }
+
+    // Must outlive the archive reader since the reader references it
+    VerifyReadCtx verify_ctx(filename);
+
+    // Owns root_fd from here on
+    ParallelExtractor extractor(root_fd, threads);
+
+    int ret;
+    if (expected) {
+        ret = archive_read_open(in.get(), &verify_ctx, &verify_open_cb,
+                                &verify_read_cb, nullptr);
+    } else {
+        ret = archive_read_open_filename(in.get(), filename.c_str(),
+                                         LIBARCHIVE_READ_BLOCK_SIZE);
+    }
+    if (ret != ARCHIVE_OK) {
+        LOGE("%s: Failed to open file: %s",
+             filename.c_str(), archive_error_string(in.get()));
+        return false;
+    }
+
+    if (progress) {
+        struct stat sb;
+        if (stat(filename.c_str(), &sb) == 0) {
+            progress->set_total_bytes(static_cast<uint64_t>(sb.st_size));
+        }
+    }
+
+    archive_entry *entry;
+    std::string parent;
+    std::string name;
+
+    while (!extractor.failed()) {
+        ret = archive_read_next_header(in.get(), &entry);
+        if (ret == ARCHIVE_EOF) {
+            break;
+        } else if (ret == ARCHIVE_RETRY) {
+            LOGW("%s: Retrying header read", filename.c_str());
+            continue;
+        } else if (ret != ARCHIVE_OK) {
+            LOGE("%s: Failed to read header: %s",
+                 filename.c_str(), archive_error_string(in.get()));
+            return false;
+        }
+
+        const char *path = archive_entry_pathname(entry);
+        if (!path || !*path) {
+            LOGE("%s: Header has null or empty filename", filename.c_str());
+            return false;
+        }
+
+        LOGV("%s", path);
+
+        if (archive_match_excluded(matcher.get(), entry)) {
+            continue;
+        }
+
+        if (!split_path(path, parent, name)) {
+            LOGE("%s: Path contains '..'", path);
+            return false;
+        }
+
+        if (name.empty() && archive_entry_filetype(entry) != AE_IFDIR) {
+            LOGE("%s: Path refers to the target directory", path);
+            return false;
+        }
+
+        if (!extractor.extract_entry(in.get(), entry, parent, name)) {
+            return false;
+        }
+
+        if (progress) {
+            if (archive_entry_filetype(entry) == AE_IFREG) {
+                progress->add_file();
+            }
+            progress->set_bytes(static_cast<uint64_t>(
+                    archive_filter_bytes(in.get(), -1)));
+        }
+    }
+
+    if (!extractor.finish()) {
+        return false;
+    }
+
+    if (expected && !verify_ctx.finish(*expected)) {
+        return false;
+    }
+
+    if (archive_read_close(in.get()) != ARCHIVE_OK) {
+        LOGE("%s: %s", filename.c_str(), archive_error_string(in.get()));
+        return false;
+    }
+
+    const char *pattern;
+    while ((ret = archive_match_path_unmatched_inclusions_next(
+            matcher.get(), &pattern)) == ARCHIVE_OK) {
+        LOGE("%s: Pattern not matched: %s", filename.c_str(), pattern);
+    }
+    if (ret != ARCHIVE_EOF) {
+        LOGE("%s: %s", filename.c_str(), archive_error_string(matcher.get()));
+        return false;
+    }
+
+    return archive_match_path_unmatched_inclusions(matcher.get()) == 0;
+}
+
+}
+}
@@ -19,6 +19,7 @@
 
 #include "mbutil/blkid.h"
 
+#include <algorithm>
 #include <vector>
 
 #include <cerrno>
@@ -29,6 +30,9 @@
 
 #include "mbutil/finally.h"
 
+// Large enough for every magic checked below (btrfs's is the furthest)
+#define PROBE_SIZE              (64 * 1024 + 4096)
+
 // NOTE: We don't use libblkid from util-linux because we don't need most of its
 // features and it increases mbtool's binary size more than 200KiB (armeabi-v7a)
 
@@ -54,6 +58,11 @@ static inline bool is_btrfs(const void *data, size_t size)
     return check_magic(data, size, "_BHRfS_M", 8, 64 * 1024 + 0x40);
 }
 
+static inline bool is_erofs(const void *data, size_t size)
+{
+    return check_magic(data, size, "\xe2\xe1\xf5\xe0", 4, 0x400);
+}
+
 static inline bool is_exfat(const void *data, size_t size)
 {
     return check_magic(data, size, "EXFAT   ", 8, 3);
@@ -88,8 +97,13 @@ static inline bool is_vfat(const void *data, size_t size)
             || check_magic(data, size, "MSDOS",    5, 0x36)
             || check_magic(data, size, "FAT16   ", 8, 0x36)
             || check_magic(data, size, "FAT12   ", 8, 0x36)
-            || check_magic(data, size, "FAT     ", 8, 0x36)
-            || check_magic(data, size, "\353",     1, 0)
+            || check_magic(data, size, "FAT     ", 8, 0x36);
+}
+
+// Any x86 boot sector matches this, including those of exfat and ntfs
+static inline bool is_vfat_weak(const void *data, size_t size)
+{
+    return     check_magic(data, size, "\353",     1, 0)
             || check_magic(data, size, "\351",     1, 0)
             || check_magic(data, size, "\125\252", 2, 0x1fe);
 }
@@ -100,23 +114,27 @@ struct probe_func
     bool (*func)(const void *, size_t);
 };
 
+// Ordered from most to least reliable
 static probe_func probe_funcs[] = {
     { "btrfs",    &is_btrfs },
+    { "erofs",    &is_erofs },
     { "exfat",    &is_exfat },
     { "ext",      &is_ext },
     { "f2fs",     &is_f2fs },
     { "ntfs",     &is_ntfs },
     { "squashfs", &is_squashfs },
     { "vfat",     &is_vfat },
+    { "vfat",     &is_vfat_weak },
     { nullptr,    nullptr },
 };
 
-static ssize_t read_all(int fd, void *buf, size_t size)
+static ssize_t pread_all(int fd, void *buf, size_t size, off_t offset)
 {
     size_t total = 0;
 
     while (total < size) {
-        ssize_t n = read(fd, static_cast<char *>(buf) + total, size - total);
+        ssize_t n = pread(fd, static_cast<char *>(buf) + total, size - total,
+                          offset + total);
         if (n == 0) {
             break;
         } else if (n < 0) {
@@ -133,9 +151,21 @@ static ssize_t read_all(int fd, void *buf, size_t size)
     return total;
 }
 
-bool blkid_get_fs_type(const char *path, const char **type)
+/*!
+ * \brief Detect all filesystem types that match the superblock region of a
+ *        file or block device
+ *
+ * The superblock region is read once and every magic check is run over it.
+ *
+ * \param path Path to file or block device
+ * \param types Output list of matching types, ordered from most to least
+ *              likely. The list is empty if the filesystem is unknown.
+ *
+ * \return Whether the superblock region could be read
+ */
+bool blkid_probe_fs_types(const char *path, std::vector<const char *> *types)
 {
-    std::vector<unsigned char> buf(1024 * 1024);
+    std::vector<unsigned char> buf(PROBE_SIZE);
 
     int fd = open(path, O_RDONLY | O_CLOEXEC);
     if (fd < 0) {
@@ -148,19 +178,35 @@ bool blkid_get_fs_type(const char *path, const char **type)
         errno = saved_errno;
     });
 
-    ssize_t n = read_all(fd, buf.data(), buf.size());
+    ssize_t n = pread_all(fd, buf.data(), buf.size(), 0);
     if (n < 0) {
         return false;
     }
 
+    types->clear();
+
     for (auto it = probe_funcs; it->name; ++it) {
-        if (it->func(buf.data(), n)) {
-            *type = it->name;
-            return true;
+        if (it->func(buf.data(), n)
+                && std::none_of(types->begin(), types->end(),
+                                [&](const char *type) {
+                    return strcmp(type, it->name) == 0;
+                })) {
+            types->push_back(it->name);
         }
     }
 
-    *type = nullptr;
+    return true;
+}
+
+bool blkid_get_fs_type(const char *path, const char **type)
+{
+    std::vector<const char *> types;
+
+    if (!blkid_probe_fs_types(path, &types)) {
+        return false;
+    }
+
+    *type = types.empty() ? nullptr : types.front();
     return true;
 }
 
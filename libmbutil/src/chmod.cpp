@@ -79,6 +79,11 @@ private:
 
     bool chmod_path()
     {
+        // Don't touch the inode (and its ctime) if nothing would change
+        if ((_curr->fts_statp->st_mode & 07777) == (_perms & 07777)) {
+            return true;
+        }
+
         if (::chmod(_curr->fts_accpath, _perms) < 0) {
             mb::format(_error_msg, "%s: Failed to chmod: %s",
                        _curr->fts_path, strerror(errno));
@@ -25,6 +25,7 @@
 
 #include <grp.h>
 #include <pwd.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -88,6 +89,13 @@ private:
 
     bool chown_path()
     {
+        // Don't touch the inode (and its ctime) if nothing would change
+        const struct stat *sb = _curr->fts_statp;
+        if ((!_follow_symlinks || !S_ISLNK(sb->st_mode))
+                && sb->st_uid == _uid && sb->st_gid == _gid) {
+            return true;
+        }
+
         if (!chown_internal(_curr->fts_accpath, _uid, _gid, _follow_symlinks)) {
             mb::format(_error_msg, "%s: Failed to chown: %s",
                        _curr->fts_path, strerror(errno));
@@ -20,12 +20,14 @@
 #include "mbutil/command.h"
 
 #include <cerrno>
+#include <csignal>
 #include <cstdarg>
 #include <cstdlib>
 #include <cstring>
 
 #include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -97,6 +99,109 @@ static void initialize_priv(struct CommandCtxPriv *priv)
     priv->stderr_pipe[1] = -1;
 }
 
+static bool create_pipe(int fds[2])
+{
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        fds[0] = -1;
+        fds[1] = -1;
+        return false;
+    }
+
+    // Make read end non-blocking
+    return fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0;
+}
+
+/*
+ * Make fd available to the command as COMMAND_PASSED_FD. Only plain syscalls
+ * are used so that this is safe to call from a vfork()'d child.
+ */
+static int install_passed_fd(int fd)
+{
+    // dup2() does nothing if the fd is already in place, so the close-on-exec
+    // flag has to be cleared explicitly
+    if (fd == COMMAND_PASSED_FD) {
+        return fcntl(fd, F_SETFD, 0);
+    }
+    return dup2(fd, COMMAND_PASSED_FD);
+}
+
+/*
+ * Spawn the command with vfork() so that the page tables of the (potentially
+ * large) parent process are not copied. Until it execs, the child borrows the
+ * parent's memory and stack, so it may only make plain syscalls: no logging
+ * and no allocation. Exec errors are passed back through exec_errno and logged
+ * by the parent, which resumes once the child has exec'd or exited.
+ */
+static pid_t spawn_vfork(struct CommandCtx *ctx)
+{
+    const char *path = ctx->path;
+    char * const *argv = const_cast<char * const *>(ctx->argv);
+    char * const *envp = const_cast<char * const *>(ctx->envp);
+    int stdout_fd = ctx->redirect_stdio ? ctx->_priv->stdout_pipe[1] : -1;
+    int stderr_fd = ctx->redirect_stdio ? ctx->_priv->stderr_pipe[1] : -1;
+    int pass_fd = ctx->pass_fd;
+    volatile int exec_errno = 0;
+
+    // Keep the parent's signal handlers from running in the child while it
+    // still shares the parent's memory
+    sigset_t all_signals;
+    sigset_t old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+
+    pid_t pid = vfork();
+    if (pid == 0) {
+        for (int sig = 1; sig < NSIG; ++sig) {
+            struct sigaction sa;
+            if (sigaction(sig, nullptr, &sa) == 0
+                    && sa.sa_handler != SIG_DFL
+                    && sa.sa_handler != SIG_IGN) {
+                memset(&sa, 0, sizeof(sa));
+                sa.sa_handler = SIG_DFL;
+                sigaction(sig, &sa, nullptr);
+            }
+        }
+        sigprocmask(SIG_SETMASK, &old_signals, nullptr);
+
+        if (stdout_fd >= 0 && (dup2(stdout_fd, STDOUT_FILENO) < 0
+                || dup2(stderr_fd, STDERR_FILENO) < 0)) {
+            exec_errno = errno;
+            _exit(127);
+        }
+
+        if (pass_fd >= 0 && install_passed_fd(pass_fd) < 0) {
+            exec_errno = errno;
+            _exit(127);
+        }
+
+        if (envp) {
+            execvpe(path, argv, envp);
+        } else {
+            execvp(path, argv);
+        }
+
+        exec_errno = errno;
+        _exit(127);
+    }
+
+    int saved_errno = errno;
+    pthread_sigmask(SIG_SETMASK, &old_signals, nullptr);
+
+    if (pid < 0) {
+        LOGE("Failed to vfork: %s", strerror(saved_errno));
+        errno = saved_errno;
+        return -1;
+    }
+
+    if (exec_errno != 0) {
+        // The child has already exited with status 127, which command_wait()
+        // will return
+        LOGE("%s: Failed to exec: %s", path, strerror(exec_errno));
+    }
+
+    return pid;
+}
+
 bool command_start(struct CommandCtx *ctx)
 {
     if (ctx->_priv                              // Process already started
@@ -115,24 +220,22 @@ bool command_start(struct CommandCtx *ctx)
     log_command(ctx->path, ctx->log_argv ? ctx->argv : nullptr,
                 ctx->log_envp ? ctx->envp : nullptr);
 
-    // Create stdout/stderr pipe if output callback is provided
+    // Create stdout/stderr pipe if output callback is provided. The pipes are
+    // close-on-exec so that they don't leak into commands spawned concurrently
+    // from other threads. dup2() clears the flag on the child's stdio fds.
     if (ctx->redirect_stdio) {
-        if (pipe(ctx->_priv->stdout_pipe) < 0) {
-            ctx->_priv->stdout_pipe[0] = -1;
-            ctx->_priv->stdout_pipe[1] = -1;
-            goto error;
-        }
-        if (pipe(ctx->_priv->stderr_pipe) < 0) {
-            ctx->_priv->stderr_pipe[0] = -1;
-            ctx->_priv->stderr_pipe[1] = -1;
+        if (!create_pipe(ctx->_priv->stdout_pipe)
+                || !create_pipe(ctx->_priv->stderr_pipe)) {
             goto error;
         }
+    }
 
-        // Make read ends non-blocking
-        if (fcntl(ctx->_priv->stdout_pipe[0], F_SETFL, O_NONBLOCK) < 0
-                || fcntl(ctx->_priv->stderr_pipe[0], F_SETFL, O_NONBLOCK) < 0) {
+    if (!ctx->chroot_dir) {
+        ctx->_priv->pid = spawn_vfork(ctx);
+        if (ctx->_priv->pid < 0) {
             goto error;
         }
+        goto parent;
     }
 
     ctx->_priv->pid = fork();
@@ -175,6 +278,11 @@ bool command_start(struct CommandCtx *ctx)
             safely_close(&ctx->_priv->stderr_pipe[1]);
         }
 
+        if (ctx->pass_fd >= 0 && install_passed_fd(ctx->pass_fd) < 0) {
+            LOGE("Failed to pass fd %d: %s", ctx->pass_fd, strerror(errno));
+            goto child_error;
+        }
+
         if (ctx->envp) {
             execvpe(ctx->path, const_cast<char * const *>(ctx->argv),
                     const_cast<char * const *>(ctx->envp));
@@ -193,12 +301,13 @@ child_error:
         }
 
         _exit(127);
-    } else {
-        // Close write ends of the pipes
-        if (ctx->redirect_stdio) {
-            safely_close(&ctx->_priv->stdout_pipe[1]);
-            safely_close(&ctx->_priv->stderr_pipe[1]);
-        }
+    }
+
+parent:
+    // Close write ends of the pipes
+    if (ctx->redirect_stdio) {
+        safely_close(&ctx->_priv->stdout_pipe[1]);
+        safely_close(&ctx->_priv->stderr_pipe[1]);
     }
 
     return true;
@@ -277,33 +386,40 @@ bool command_raw_reader(struct CommandCtx *ctx, CmdRawCb cb, void *userdata)
         for (int i = 0; i < fds_size; ++i) {
             bool is_stderr = fds[i].fd == ctx->_priv->stderr_pipe[0];
 
-            if (fds[i].revents & POLLHUP) {
-                // EOF/pipe closed. The fd will be closed later
-                fds[i].fd = -1;
-                fds[i].events = 0;
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
 
-                // Final call for EOF
-                cb(buf, 0, is_stderr, userdata);
-            } else if (fds[i].revents & POLLIN) {
+            // Drain everything that's available. Data may still be buffered in
+            // the pipe when POLLHUP is reported, so only read() returning 0
+            // means EOF.
+            while (true) {
                 ssize_t n = read(fds[i].fd, buf, sizeof(buf) - 1);
-                if (n < 0) {
-                    if (errno != EAGAIN
-                            && errno != EWOULDBLOCK
-                            && errno != EINTR) {
-                        // Read failed; disable FD
-                        fds[i].fd = -1;
-                        fds[i].events = 0;
-                        ret = false;
-                    }
-                } else {
-                    // NULL-terminate
-                    buf[n] = '\0';
-
-                    // Potential EOF (n == 0) here on some non-Linux systems,
-                    // which is fine since it's not possible to reach both the
-                    // POLLHUP block and this block
-                    cb(buf, n, is_stderr, userdata);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    break;
+                } else if (n < 0) {
+                    // Read failed; disable FD
+                    fds[i].fd = -1;
+                    fds[i].events = 0;
+                    ret = false;
+                    break;
+                } else if (n == 0) {
+                    // EOF/pipe closed. The fd will be closed later
+                    fds[i].fd = -1;
+                    fds[i].events = 0;
+
+                    // Final call for EOF
+                    buf[0] = '\0';
+                    cb(buf, 0, is_stderr, userdata);
+                    break;
                 }
+
+                // NULL-terminate
+                buf[n] = '\0';
+
+                cb(buf, n, is_stderr, userdata);
             }
         }
     }
@@ -19,22 +19,42 @@
 
 #include "mbutil/copy.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
 #include <cerrno>
 #include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
 #include <fts.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/xattr.h>
 #include <unistd.h>
 
+#include "mbcommon/buffer_pool.h"
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
 #include "mbutil/finally.h"
 #include "mbutil/fts.h"
 #include "mbutil/path.h"
+#include "mbutil/progress.h"
+#include "mbutil/sched_policy.h"
 #include "mbutil/string.h"
 
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
 // WARNING: Everything operates on paths, so it's subject to race conditions
 // Directory copy operations will not cross mountpoint boundaries
 
@@ -43,121 +63,434 @@ namespace mb
 namespace util
 {
 
-bool copy_data_fd(int fd_source, int fd_target)
+// Maximum number of bytes to pass to a single copy_file_range()/sendfile()
+#define COPY_MAX_CHUNK_SIZE     (1024 * 1024 * 1024)
+// Same as above, but when a write limit is set so that throttle_write() can
+// pace the kernel's copies
+#define COPY_THROTTLED_CHUNK_SIZE   (1024 * 1024)
+// Maximum number of worker threads used by copy_dir() with COPY_PARALLEL
+#define COPY_DIR_MAX_THREADS    8
+// Initial size of the per-thread xattr name list and value buffers
+#define XATTR_MIN_BUF_SIZE      256
+
+enum class CopyMethod
 {
-    char buf[10240];
-    ssize_t nread;
+    CopyFileRange,
+    Sendfile,
+    ReadWrite,
+};
 
-    while ((nread = read(fd_source, buf, sizeof buf)) > 0) {
-        char *out_ptr = buf;
-        ssize_t nwritten;
+static bool allocate_copy_buf(IoBuffer &buf)
+{
+    return buf || buf.allocate();
+}
 
-        do {
-            if ((nwritten = write(fd_target, out_ptr, nread)) < 0) {
+static bool write_fully(int fd, const char *buf, size_t size,
+                        off64_t *offset)
+{
+    while (size > 0) {
+        ssize_t n = offset ? pwrite64(fd, buf, size, *offset)
+                : write(fd, buf, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            errno = EIO;
+            return false;
+        }
+
+        buf += n;
+        size -= static_cast<size_t>(n);
+        if (offset) {
+            *offset += n;
+        }
+
+        throttle_write(static_cast<size_t>(n));
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Copy data between arbitrary file descriptors using read()/write()
+ *
+ * This is used for pipes, sockets, devices, and pseudo-files, where neither
+ * the offsets nor the size of the source are known.
+ */
+static bool copy_data_stream(int fd_source, int fd_target)
+{
+    IoBuffer buf;
+    if (!allocate_copy_buf(buf)) {
+        return false;
+    }
+
+    while (true) {
+        ssize_t n = read(fd_source, buf.data(), buf.size());
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            return true;
+        }
+
+        if (!write_fully(fd_target, buf.data<char>(), static_cast<size_t>(n),
+                         nullptr)) {
+            return false;
+        }
+    }
+}
+
+/*!
+ * \brief Copy a range of a regular file to a regular file
+ *
+ * The data is copied with copy_file_range() if possible, then sendfile(), and
+ * finally pread()/pwrite(). \p method is downgraded in place when the kernel
+ * or filesystem does not support a method so that later ranges skip it.
+ *
+ * \return False if an error occurs. Copying stops early without an error if
+ *         the source file shrinks during the copy. The number of bytes copied
+ *         is added to \p copied (if not NULL) in either case.
+ */
+static bool copy_data_range(int fd_source, off64_t src_offset,
+                            int fd_target, off64_t tgt_offset,
+                            uint64_t size, CopyMethod &method,
+                            IoBuffer &buf, uint64_t *copied = nullptr)
+{
+    uint64_t max_chunk = write_limit() != 0
+            ? COPY_THROTTLED_CHUNK_SIZE : COPY_MAX_CHUNK_SIZE;
+
+    while (size > 0) {
+        size_t to_copy = static_cast<size_t>(std::min(size, max_chunk));
+        ssize_t n;
+
+        switch (method) {
+        case CopyMethod::CopyFileRange: {
+#ifdef __NR_copy_file_range
+            loff_t in_off = src_offset;
+            loff_t out_off = tgt_offset;
+
+            n = syscall(__NR_copy_file_range, fd_source, &in_off,
+                        fd_target, &out_off, to_copy, 0u);
+            if (n < 0 && errno != EINTR) {
+                if (errno == ENOSYS || errno == EXDEV || errno == EINVAL
+                        || errno == EOPNOTSUPP || errno == EBADF) {
+                    method = CopyMethod::Sendfile;
+                    continue;
+                }
                 return false;
             }
+#else
+            method = CopyMethod::Sendfile;
+            continue;
+#endif
+            break;
+        }
+
+        case CopyMethod::Sendfile: {
+            off64_t in_off = src_offset;
+
+            if (lseek64(fd_target, tgt_offset, SEEK_SET) < 0) {
+                return false;
+            }
+
+            n = sendfile64(fd_target, fd_source, &in_off, to_copy);
+            if (n < 0 && errno != EINTR) {
+                if (errno == ENOSYS || errno == EINVAL) {
+                    method = CopyMethod::ReadWrite;
+                    continue;
+                }
+                return false;
+            }
+            break;
+        }
+
+        case CopyMethod::ReadWrite: {
+            if (!allocate_copy_buf(buf)) {
+                return false;
+            }
+
+            n = pread64(fd_source, buf.data(),
+                        std::min<size_t>(to_copy, buf.size()), src_offset);
+            if (n > 0) {
+                off64_t out_off = tgt_offset;
+                if (!write_fully(fd_target, buf.data<char>(),
+                                 static_cast<size_t>(n), &out_off)) {
+                    return false;
+                }
+            } else if (n < 0 && errno != EINTR) {
+                return false;
+            }
+            break;
+        }
+
+        default:
+            errno = EINVAL;
+            return false;
+        }
+
+        if (n < 0) {
+            // EINTR
+            continue;
+        } else if (n == 0) {
+            if (method != CopyMethod::ReadWrite) {
+                // Some kernels report 0 bytes copied for pseudo-files instead
+                // of failing, so make sure with a regular read
+                method = CopyMethod::ReadWrite;
+                continue;
+            }
+            // Source shrank
+            return true;
+        }
+
+        if (method != CopyMethod::ReadWrite) {
+            // write_fully() already accounted for the data otherwise
+            throttle_write(static_cast<size_t>(n));
+        }
 
-            nread -= nwritten;
-            out_ptr += nwritten;
-        } while (nread > 0);
+        src_offset += n;
+        tgt_offset += n;
+        size -= static_cast<uint64_t>(n);
+        if (copied) {
+            *copied += static_cast<uint64_t>(n);
+        }
     }
 
-    return nread == 0;
+    return true;
 }
 
-static bool copy_data(const std::string &source, const std::string &target)
+/*!
+ * \brief Copy data from one file descriptor to another
+ *
+ * Data is copied from the current offset of \p fd_source to the current
+ * offset of \p fd_target until the end of the source file. On success, both
+ * offsets are left at the end of the copied data.
+ *
+ * If both file descriptors refer to regular files, the fastest available
+ * method is used:
+ *
+ * 1. Whole files are reflinked with `FICLONE` if the filesystem supports it
+ * 2. Otherwise, `copy_file_range()`, `sendfile()`, and finally a large buffer
+ *    are tried in that order
+ *
+ * When copying past the end of the target file, holes in the source file are
+ * found with `SEEK_DATA`/`SEEK_HOLE` and are skipped so that the target stays
+ * sparse.
+ */
+bool copy_data_fd(int fd_source, int fd_target)
 {
-    int fd_source = -1;
-    int fd_target = -1;
+    struct stat sb_source;
+    struct stat sb_target;
+    off64_t src_start;
+    off64_t tgt_start;
+
+    if (fstat(fd_source, &sb_source) < 0 || !S_ISREG(sb_source.st_mode)
+            || fstat(fd_target, &sb_target) < 0 || !S_ISREG(sb_target.st_mode)
+            || (src_start = lseek64(fd_source, 0, SEEK_CUR)) < 0
+            || (tgt_start = lseek64(fd_target, 0, SEEK_CUR)) < 0) {
+        return copy_data_stream(fd_source, fd_target);
+    }
 
-    fd_source = open(source.c_str(), O_RDONLY);
-    if (fd_source < 0) {
-        return false;
+    off64_t src_size = sb_source.st_size;
+    if (src_start >= src_size) {
+        // Pseudo-files (eg. in procfs or sysfs) report a size of 0
+        return copy_data_stream(fd_source, fd_target);
     }
 
-    auto close_source_fd = finally([&] {
-        close(fd_source);
-    });
+    off64_t tgt_end = tgt_start + (src_size - src_start);
 
-    fd_target = open(target.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
-    if (fd_target < 0) {
-        return false;
+    // Share the extents if copying an entire file to an empty file
+    if (src_start == 0 && tgt_start == 0 && sb_target.st_size == 0
+            && ioctl(fd_target, FICLONE, fd_source) == 0) {
+        return lseek64(fd_source, src_size, SEEK_SET) >= 0
+                && lseek64(fd_target, tgt_end, SEEK_SET) >= 0;
     }
 
-    auto close_target_fd = finally([&] {
-        close(fd_target);
-    });
+    // Holes can only be skipped if there's no existing data to overwrite
+    bool skip_holes = sb_target.st_size <= tgt_start;
+    CopyMethod method = CopyMethod::CopyFileRange;
+    IoBuffer buf;
+
+    for (off64_t offset = src_start; offset < src_size;) {
+        off64_t data = offset;
+        off64_t hole = src_size;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+        if (skip_holes) {
+            data = lseek64(fd_source, offset, SEEK_DATA);
+            if (data < 0) {
+                if (errno == ENXIO) {
+                    // Remainder of the file is a hole
+                    break;
+                }
+                // Not supported, so copy everything
+                data = offset;
+                skip_holes = false;
+            } else {
+                hole = lseek64(fd_source, data, SEEK_HOLE);
+                if (hole < 0 || hole > src_size) {
+                    hole = src_size;
+                }
+            }
+        }
+#endif
 
-    if (!copy_data_fd(fd_source, fd_target)) {
+        if (data >= src_size) {
+            break;
+        }
+
+        uint64_t size = static_cast<uint64_t>(hole - data);
+        uint64_t copied = 0;
+
+        if (!copy_data_range(fd_source, data,
+                             fd_target, tgt_start + (data - src_start),
+                             size, method, buf, &copied)) {
+            return false;
+        }
+
+        if (copied < size) {
+            // The source is shorter than its reported size, so read whatever
+            // is left until EOF
+            off64_t src_end = data + static_cast<off64_t>(copied);
+
+            return lseek64(fd_source, src_end, SEEK_SET) >= 0
+                    && lseek64(fd_target, tgt_start + (src_end - src_start),
+                               SEEK_SET) >= 0
+                    && copy_data_stream(fd_source, fd_target);
+        }
+
+        offset = hole;
+    }
+
+    // Extend the target to cover trailing holes
+    if (skip_holes && ftruncate64(fd_target, tgt_end) < 0) {
         return false;
     }
 
-    return true;
+    return lseek64(fd_source, src_size, SEEK_SET) >= 0
+            && lseek64(fd_target, tgt_end, SEEK_SET) >= 0;
 }
 
-bool copy_xattrs(const std::string &source, const std::string &target)
+/*!
+ * \brief Copy a range of data from one regular file to another
+ *
+ * Unlike copy_data_fd(), the data is copied between explicit offsets and holes
+ * are not preserved. `copy_file_range()`, `sendfile()`, and finally a large
+ * buffer are tried in that order. The offset of \p fd_source is never changed,
+ * but the offset of \p fd_target is unspecified afterwards.
+ *
+ * \param[in] fd_source Source file descriptor
+ * \param[in] src_offset Offset in source file
+ * \param[in] fd_target Target file descriptor
+ * \param[in] tgt_offset Offset in target file
+ * \param[in] size Maximum number of bytes to copy
+ * \param[out] copied Number of bytes copied, which is less than \p size if
+ *                    the end of the source file was reached. This is set even
+ *                    if an error occurs.
+ *
+ * \return true on success, false on failure and errno set appropriately
+ */
+bool copy_data_fd_range(int fd_source, uint64_t src_offset,
+                        int fd_target, uint64_t tgt_offset,
+                        uint64_t size, uint64_t &copied)
+{
+    CopyMethod method = CopyMethod::CopyFileRange;
+    IoBuffer buf;
+
+    copied = 0;
+
+    return copy_data_range(fd_source, static_cast<off64_t>(src_offset),
+                           fd_target, static_cast<off64_t>(tgt_offset),
+                           size, method, buf, &copied);
+}
+
+struct XattrBuffers
 {
-    ssize_t size;
     std::vector<char> names;
-    char *end_names;
-    char *name;
     std::vector<char> value;
+};
+
+// Reused by every copy on the same thread so that copying a tree doesn't
+// allocate (and query the size of) each attribute
+static thread_local XattrBuffers t_xattr_bufs;
+
+/*!
+ * \brief Call an xattr list/get function with a reusable buffer
+ *
+ * \p fn is first called with the existing buffer. The buffer is only resized
+ * when the kernel reports `ERANGE`, so the size query is skipped for the
+ * common case of small attributes.
+ *
+ * \return Size of the data or -1 with errno set
+ */
+template<typename Fn>
+static ssize_t xattr_call(std::vector<char> &buf, Fn fn)
+{
+    if (buf.size() < XATTR_MIN_BUF_SIZE) {
+        buf.resize(XATTR_MIN_BUF_SIZE);
+    }
+
+    while (true) {
+        ssize_t size = fn(buf.data(), buf.size());
+        if (size >= 0 || errno != ERANGE) {
+            return size;
+        }
+
+        size = fn(nullptr, 0);
+        if (size < 0) {
+            return size;
+        }
+
+        // Try again in case the data grew between calls
+        buf.resize(static_cast<size_t>(size) + 1);
+    }
+}
+
+template<typename List, typename Get, typename Set>
+static bool copy_xattrs_impl(const char *source, const char *target,
+                             List list_fn, Get get_fn, Set set_fn)
+{
+    XattrBuffers &bufs = t_xattr_bufs;
+    ssize_t size;
 
     // xattr names are in a NULL-separated list
-    size = llistxattr(source.c_str(), nullptr, 0);
+    size = xattr_call(bufs.names, list_fn);
     if (size < 0) {
         if (errno == ENOTSUP) {
-            LOGV("%s: xattrs not supported on source filesystem",
-                 source.c_str());
+            LOGV("%s: xattrs not supported on source filesystem", source);
             return true;
         } else {
-            LOGE("%s: Failed to list xattrs: %s",
-                 source.c_str(), strerror(errno));
+            LOGE("%s: Failed to list xattrs: %s", source, strerror(errno));
             return false;
         }
     }
 
-    names.resize(size + 1);
-
-    size = llistxattr(source.c_str(), names.data(), size);
-    if (size < 0) {
-        LOGE("%s: Failed to list xattrs on second try: %s",
-             source.c_str(), strerror(errno));
-        return false;
-    } else {
-        names[size] = '\0';
-        end_names = names.data() + size;
-    }
+    const char *end_names = bufs.names.data() + size;
 
-    for (name = names.data(); name != end_names; name = strchr(name, '\0') + 1) {
+    const char *name = bufs.names.data();
+    for (; name < end_names; name = strchr(name, '\0') + 1) {
         if (!*name) {
             continue;
         }
 
-        size = lgetxattr(source.c_str(), name, nullptr, 0);
+        size = xattr_call(bufs.value, [&](char *buf, size_t buf_size) {
+            return get_fn(name, buf, buf_size);
+        });
         if (size < 0) {
             LOGW("%s: Failed to get attribute '%s': %s",
-                 source.c_str(), name, strerror(errno));
-            continue;
-        }
-
-        value.resize(size);
-
-        size = lgetxattr(source.c_str(), name, value.data(), size);
-        if (size < 0) {
-            LOGW("%s: Failed to get attribute '%s' on second try: %s",
-                 source.c_str(), name, strerror(errno));
+                 source, name, strerror(errno));
             continue;
         }
 
-        if (lsetxattr(target.c_str(), name, value.data(), size, 0) < 0) {
+        if (set_fn(name, bufs.value.data(), static_cast<size_t>(size)) < 0) {
             if (errno == ENOTSUP) {
-                LOGV("%s: xattrs not supported on target filesystem",
-                     target.c_str());
+                LOGV("%s: xattrs not supported on target filesystem", target);
                 break;
             } else {
-                LOGE("%s: Failed to set xattrs: %s",
-                     target.c_str(), strerror(errno));
+                LOGE("%s: Failed to set xattrs: %s", target, strerror(errno));
                 return false;
             }
         }
@@ -166,6 +499,53 @@ bool copy_xattrs(const std::string &source, const std::string &target)
     return true;
 }
 
+static bool copy_xattrs_fd(int fd_source, const char *source,
+                           int fd_target, const char *target)
+{
+    return copy_xattrs_impl(source, target, [&](char *buf, size_t size) {
+        return flistxattr(fd_source, buf, size);
+    }, [&](const char *name, char *buf, size_t size) {
+        return fgetxattr(fd_source, name, buf, size);
+    }, [&](const char *name, const char *buf, size_t size) {
+        return fsetxattr(fd_target, name, buf, size, 0);
+    });
+}
+
+/*!
+ * \brief Copy xattrs (including the SELinux label) between paths
+ *
+ * Symlinks are not followed. Prefer copy_xattrs_fd() if both files are already
+ * open since it avoids resolving the paths for every attribute.
+ */
+bool copy_xattrs(const std::string &source, const std::string &target)
+{
+    const char *s = source.c_str();
+    const char *t = target.c_str();
+
+    return copy_xattrs_impl(s, t, [&](char *buf, size_t size) {
+        return llistxattr(s, buf, size);
+    }, [&](const char *name, char *buf, size_t size) {
+        return lgetxattr(s, name, buf, size);
+    }, [&](const char *name, const char *buf, size_t size) {
+        return lsetxattr(t, name, buf, size, 0);
+    });
+}
+
+/*!
+ * \brief Copy xattrs (including the SELinux label) between open files
+ *
+ * \note `O_PATH` file descriptors cannot be used because the kernel rejects
+ *       them for xattr operations. Use copy_xattrs() for symlinks.
+ */
+bool copy_xattrs_fd(int fd_source, int fd_target)
+{
+    std::string source = mb::format("<fd %d>", fd_source);
+    std::string target = mb::format("<fd %d>", fd_target);
+
+    return copy_xattrs_fd(fd_source, source.c_str(),
+                          fd_target, target.c_str());
+}
+
 bool copy_stat(const std::string &source, const std::string &target)
 {
     struct stat sb;
@@ -191,6 +571,118 @@ bool copy_stat(const std::string &source, const std::string &target)
     return true;
 }
 
+static bool copy_stat_fd(const struct stat &sb, int fd_target,
+                         const char *target)
+{
+    if (fchown(fd_target, sb.st_uid, sb.st_gid) < 0) {
+        LOGE("%s: Failed to chown: %s", target, strerror(errno));
+        return false;
+    }
+
+    if (fchmod(fd_target, sb.st_mode & (S_ISUID | S_ISGID | S_ISVTX
+                                      | S_IRWXU | S_IRWXG | S_IRWXO)) < 0) {
+        LOGE("%s: Failed to chmod: %s", target, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Copy the owner and mode between open files
+ */
+bool copy_stat_fd(int fd_source, int fd_target)
+{
+    struct stat sb;
+
+    if (fstat(fd_source, &sb) < 0) {
+        LOGE("<fd %d>: Failed to stat: %s", fd_source, strerror(errno));
+        return false;
+    }
+
+    return copy_stat_fd(sb, fd_target,
+                        mb::format("<fd %d>", fd_target).c_str());
+}
+
+enum class CopyStep
+{
+    Data,
+    Attributes,
+    Xattrs,
+};
+
+static const char * copy_step_error(CopyStep step)
+{
+    switch (step) {
+    case CopyStep::Attributes:
+        return "Failed to copy attributes";
+    case CopyStep::Xattrs:
+        return "Failed to copy xattrs";
+    case CopyStep::Data:
+    default:
+        return "Failed to copy data";
+    }
+}
+
+/*!
+ * \brief Create \p target as a copy of the regular file \p source
+ *
+ * If requested by \p flags, the attributes and xattrs are copied through the
+ * file descriptors that were opened for copying the data, so the paths are
+ * only resolved once per file.
+ *
+ * \param sb Stat buffer for \p source
+ * \param[out] step Step that failed if false is returned
+ */
+static bool copy_regular_file(const std::string &source,
+                              const std::string &target,
+                              const struct stat &sb, int flags,
+                              CopyStep &step)
+{
+    int fd_source = -1;
+    int fd_target = -1;
+
+    step = CopyStep::Data;
+
+    fd_source = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_source < 0) {
+        return false;
+    }
+
+    auto close_source_fd = finally([&] {
+        close(fd_source);
+    });
+
+    fd_target = open(target.c_str(),
+                     O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd_target < 0) {
+        return false;
+    }
+
+    auto close_target_fd = finally([&] {
+        close(fd_target);
+    });
+
+    if (!copy_data_fd(fd_source, fd_target)) {
+        return false;
+    }
+
+    step = CopyStep::Attributes;
+    if ((flags & COPY_ATTRIBUTES)
+            && !copy_stat_fd(sb, fd_target, target.c_str())) {
+        return false;
+    }
+
+    step = CopyStep::Xattrs;
+    if ((flags & COPY_XATTRS)
+            && !copy_xattrs_fd(fd_source, source.c_str(),
+                               fd_target, target.c_str())) {
+        return false;
+    }
+
+    return true;
+}
+
 bool copy_contents(const std::string &source, const std::string &target)
 {
     int fd_source = -1;
@@ -286,13 +778,16 @@ bool copy_file(const std::string &source, const std::string &target, int flags)
 
         // Treat as file
 
-    case S_IFREG:
-        if (!copy_data(source, target)) {
-            LOGE("%s: Failed to copy data: %s",
-                 target.c_str(), strerror(errno));
+    case S_IFREG: {
+        // Metadata is copied through the open file descriptors
+        CopyStep step;
+        if (!copy_regular_file(source, target, sb, flags, step)) {
+            LOGE("%s: %s: %s", target.c_str(), copy_step_error(step),
+                 strerror(errno));
             return false;
         }
-        break;
+        return true;
+    }
 
     case S_IFSOCK:
         LOGE("%s: Cannot copy socket", target.c_str());
@@ -324,8 +819,16 @@ bool copy_file(const std::string &source, const std::string &target, int flags)
 
 class RecursiveCopier : public FTSWrapper {
 public:
-    RecursiveCopier(std::string path, std::string target, int copyflags)
-        : FTSWrapper(path, 0), _copyflags(copyflags), _target(target) {
+    RecursiveCopier(std::string path, std::string target, int copyflags,
+                    ProgressTracker *progress)
+        : FTSWrapper(path, (copyflags & COPY_PARALLEL) ? FTS_Parallel : 0)
+        , _copyflags(copyflags), _target(target)
+        , _progress(progress) {
+    }
+
+    virtual ~RecursiveCopier()
+    {
+        stop_workers();
     }
 
     virtual bool on_pre_execute() override
@@ -362,9 +865,43 @@ public:
             return false;
         }
 
+        if (_copyflags & COPY_PARALLEL) {
+            start_workers();
+        }
+
         return true;
     }
 
+    virtual bool on_post_execute(bool success) override
+    {
+        if (!(_copyflags & COPY_PARALLEL)) {
+            return true;
+        }
+
+        bool ret = stop_workers();
+
+        // Don't make partially copied directories look complete
+        if (!success || !ret) {
+            _deferred_dirs.clear();
+            return ret;
+        }
+
+        // Now that every file has been written, the directory attributes can
+        // be applied in the same (post-order) order as a serial copy
+        for (auto const &dir : _deferred_dirs) {
+            if (!cp_attrs(dir.first, dir.second, _error_msg)) {
+                ret = false;
+            }
+
+            if (!cp_xattrs(dir.first, dir.second, _error_msg)) {
+                ret = false;
+            }
+        }
+        _deferred_dirs.clear();
+
+        return ret;
+    }
+
     virtual int on_changed_path() override
     {
         // Make sure we aren't copying the target on top of itself
@@ -445,6 +982,13 @@ public:
 
     virtual int on_reached_directory_post() override
     {
+        // Files in this directory may still be queued. Setting the mode or
+        // SELinux label now could prevent the workers from creating them.
+        if (_copyflags & COPY_PARALLEL) {
+            _deferred_dirs.emplace_back(_curr->fts_accpath, _curtgtpath);
+            return Action::FTS_OK;
+        }
+
         if (!cp_attrs()) {
             return Action::FTS_Fail;
         }
@@ -462,23 +1006,14 @@ public:
             return Action::FTS_Fail;
         }
 
-        // Copy file contents
-        if (!copy_data(_curr->fts_accpath, _curtgtpath)) {
-            mb::format(_error_msg, "%s: Failed to copy data: %s",
-                       _curtgtpath.c_str(), strerror(errno));
-            LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
-        }
-
-        if (!cp_attrs()) {
-            return Action::FTS_Fail;
-        }
-
-        if (!cp_xattrs()) {
-            return Action::FTS_Fail;
+        if (_copyflags & COPY_PARALLEL) {
+            queue_file(_curr->fts_accpath, _curtgtpath, *_curr->fts_statp);
+            return Action::FTS_OK;
         }
 
-        return Action::FTS_OK;
+        return copy_file_data(_curr->fts_accpath, _curtgtpath,
+                              *_curr->fts_statp, _error_msg)
+                ? Action::FTS_OK : Action::FTS_Fail;
     }
 
     virtual int on_reached_symlink() override
@@ -600,6 +1135,124 @@ private:
     std::string _target;
     struct stat sb_target;
     std::string _curtgtpath;
+    ProgressTracker *_progress;
+
+    struct QueuedFile
+    {
+        std::string source;
+        std::string target;
+        struct stat sb;
+    };
+
+    // Regular files waiting to be copied by the workers
+    std::deque<QueuedFile> _queue;
+    bool _queue_done = false;
+    std::mutex _queue_mutex;
+    std::condition_variable _queue_cv;
+    std::vector<std::thread> _workers;
+    // First error reported by a worker
+    bool _worker_failed = false;
+    std::string _worker_error_msg;
+    // Directories whose attributes are set after the workers finish
+    std::vector<std::pair<std::string, std::string>> _deferred_dirs;
+
+    void start_workers()
+    {
+        unsigned int n_threads = std::thread::hardware_concurrency();
+        n_threads = std::min(std::max(n_threads, 2u),
+                             static_cast<unsigned int>(COPY_DIR_MAX_THREADS));
+
+        _queue_done = false;
+        _worker_failed = false;
+
+        for (unsigned int i = 0; i < n_threads; ++i) {
+            _workers.emplace_back(&RecursiveCopier::worker_thread, this);
+        }
+    }
+
+    bool stop_workers()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_queue_mutex);
+            _queue_done = true;
+        }
+        _queue_cv.notify_all();
+
+        for (auto &t : _workers) {
+            t.join();
+        }
+        _workers.clear();
+
+        if (_worker_failed) {
+            _error_msg = _worker_error_msg;
+            return false;
+        }
+        return true;
+    }
+
+    void queue_file(std::string source, std::string target,
+                    const struct stat &sb)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_queue_mutex);
+            _queue.push_back({ std::move(source), std::move(target), sb });
+        }
+        _queue_cv.notify_one();
+    }
+
+    void worker_thread()
+    {
+        std::unique_lock<std::mutex> lock(_queue_mutex);
+
+        while (true) {
+            _queue_cv.wait(lock, [&] {
+                return !_queue.empty() || _queue_done;
+            });
+            if (_queue.empty()) {
+                break;
+            }
+
+            auto item = std::move(_queue.front());
+            _queue.pop_front();
+
+            lock.unlock();
+
+            std::string error_msg;
+            bool ret = copy_file_data(item.source, item.target, item.sb,
+                                      error_msg);
+
+            lock.lock();
+
+            if (!ret && !_worker_failed) {
+                _worker_failed = true;
+                _worker_error_msg = std::move(error_msg);
+            }
+        }
+    }
+
+    bool copy_file_data(const std::string &source,
+                        const std::string &target,
+                        const struct stat &sb,
+                        std::string &error_msg)
+    {
+        // Copy file contents and metadata
+        CopyStep step;
+        if (!copy_regular_file(source, target, sb, _copyflags, step)) {
+            mb::format(error_msg, "%s: %s: %s", target.c_str(),
+                       copy_step_error(step), strerror(errno));
+            LOGW("%s", error_msg.c_str());
+            return false;
+        }
+
+        // Counted per file since copy_file_range() and FICLONE copy the data
+        // in very few (or just one) syscalls anyway
+        if (_progress) {
+            _progress->add_bytes(static_cast<uint64_t>(sb.st_size));
+            _progress->add_file();
+        }
+
+        return true;
+    }
 
     bool remove_existing_file()
     {
@@ -614,24 +1267,36 @@ private:
     }
 
     bool cp_attrs()
+    {
+        return cp_attrs(_curr->fts_accpath, _curtgtpath, _error_msg);
+    }
+
+    bool cp_attrs(const std::string &source, const std::string &target,
+                  std::string &error_msg)
     {
         if ((_copyflags & COPY_ATTRIBUTES)
-                && !copy_stat(_curr->fts_accpath, _curtgtpath)) {
-            mb::format(_error_msg, "%s: Failed to copy attributes: %s",
-                       _curtgtpath.c_str(), strerror(errno));
-            LOGW("%s", _error_msg.c_str());
+                && !copy_stat(source, target)) {
+            mb::format(error_msg, "%s: Failed to copy attributes: %s",
+                       target.c_str(), strerror(errno));
+            LOGW("%s", error_msg.c_str());
             return false;
         }
         return true;
     }
 
     bool cp_xattrs()
+    {
+        return cp_xattrs(_curr->fts_accpath, _curtgtpath, _error_msg);
+    }
+
+    bool cp_xattrs(const std::string &source, const std::string &target,
+                   std::string &error_msg)
     {
         if ((_copyflags & COPY_XATTRS)
-                && !copy_xattrs(_curr->fts_accpath, _curtgtpath)) {
-            mb::format(_error_msg, "%s: Failed to copy xattrs: %s",
-                       _curtgtpath.c_str(), strerror(errno));
-            LOGW("%s", _error_msg.c_str());
+                && !copy_xattrs(source, target)) {
+            mb::format(error_msg, "%s: Failed to copy xattrs: %s",
+                       target.c_str(), strerror(errno));
+            LOGW("%s", error_msg.c_str());
             return false;
         }
         return true;
@@ -640,11 +1305,19 @@ private:
 
 
 // Copy as much as possible
-bool copy_dir(const std::string &source, const std::string &target, int flags)
+//
+// With COPY_PARALLEL, the traversal thread creates directories, symlinks and
+// special files in order while regular files are copied by a pool of worker
+// threads. Directory attributes and xattrs are applied after all workers have
+// finished.
+//
+// If progress is not null, it is updated after each regular file is copied.
+bool copy_dir(const std::string &source, const std::string &target, int flags,
+              ProgressTracker *progress)
 {
     mode_t old_umask = umask(0);
 
-    RecursiveCopier copier(source, target, flags);
+    RecursiveCopier copier(source, target, flags, progress);
     bool ret = copier.run();
 
     umask(old_umask);
@@ -19,16 +19,32 @@
 
 #include "mbutil/delete.h"
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
 #include <cerrno>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
 #include "mbutil/fts.h"
+#include "mbutil/sched_policy.h"
 #include "mbutil/string.h"
 
+// Maximum number of worker threads used with DELETE_PARALLEL
+#define DELETE_MAX_THREADS      8
+
 namespace mb
 {
 namespace util
@@ -37,7 +53,8 @@ namespace util
 class RecursiveDeleter : public FTSWrapper {
 public:
     RecursiveDeleter(std::string path)
-        : FTSWrapper(path, FTS_GroupSpecialFiles)
+        // Entries are only removed by path, so they don't need to be stat'ed
+        : FTSWrapper(path, FTS_GroupSpecialFiles | FTS_NoStat)
     {
     }
 
@@ -93,5 +110,572 @@ bool delete_recursive(const std::string &path)
     return deleter.run();
 }
 
+struct DeleteDir
+{
+    // Open directory fd used for all *at() calls on the children
+    int fd;
+    // Directory containing this one (null for the top-level directory)
+    std::shared_ptr<DeleteDir> parent;
+    // Name in the parent directory
+    std::string name;
+    // Full path (for log messages only)
+    std::string path;
+    // 1 for the directory scan + 1 for each subdirectory still being deleted
+    std::atomic<unsigned int> refs;
+};
+
+/*!
+ * \brief Recursively delete the contents of a directory using directory fds
+ *
+ * Every entry is removed with unlinkat() relative to its parent's fd, so no
+ * path is resolved more than once. Subdirectories are handed to idle worker
+ * threads when there are any and are otherwise deleted depth-first by the
+ * current thread. A directory is removed by whichever thread finishes its last
+ * child. Mountpoints are never descended into.
+ */
+class ParallelDeleter
+{
+public:
+    ParallelDeleter(unsigned int n_threads, std::vector<std::string> exclusions)
+        : _n_threads(n_threads), _exclusions(std::move(exclusions))
+    {
+    }
+
+    // Takes ownership of dfd
+    bool run(int dfd, const std::string &path)
+    {
+        struct stat sb;
+        if (fstat(dfd, &sb) < 0) {
+            LOGE("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+            close(dfd);
+            return false;
+        }
+        _dev = sb.st_dev;
+
+        _root = std::make_shared<DeleteDir>();
+        _root->fd = dfd;
+        _root->path = path;
+        _root->refs = 1;
+
+        _queue.push_back(_root);
+
+        std::vector<std::thread> threads;
+        for (unsigned int i = 0; i < _n_threads; ++i) {
+            threads.emplace_back(&ParallelDeleter::worker_thread, this);
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+
+        _root.reset();
+
+        return !_failed;
+    }
+
+private:
+    unsigned int _n_threads;
+    std::vector<std::string> _exclusions;
+    dev_t _dev;
+    std::shared_ptr<DeleteDir> _root;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<std::shared_ptr<DeleteDir>> _queue;
+    unsigned int _idle = 0;
+    bool _done = false;
+    std::atomic_bool _failed{false};
+
+    void worker_thread()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        while (true) {
+            ++_idle;
+            _cv.wait(lock, [&] {
+                return !_queue.empty() || _done;
+            });
+            --_idle;
+
+            if (_queue.empty()) {
+                break;
+            }
+
+            auto dir = std::move(_queue.front());
+            _queue.pop_front();
+
+            lock.unlock();
+            delete_contents(dir);
+            lock.lock();
+        }
+    }
+
+    bool try_queue(const std::shared_ptr<DeleteDir> &dir)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_queue.size() >= _idle) {
+                return false;
+            }
+            _queue.push_back(dir);
+        }
+        _cv.notify_one();
+        return true;
+    }
+
+    void delete_contents(const std::shared_ptr<DeleteDir> &dir)
+    {
+        int fd = fcntl(dir->fd, F_DUPFD_CLOEXEC, 0);
+        DIR *dp = fd < 0 ? nullptr : fdopendir(fd);
+        if (!dp) {
+            LOGE("%s: Failed to open directory: %s",
+                 dir->path.c_str(), strerror(errno));
+            _failed = true;
+            if (fd >= 0) {
+                close(fd);
+            }
+            release(dir);
+            return;
+        }
+
+        struct dirent *ent;
+        while ((ent = readdir(dp))) {
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0
+                    || (dir == _root && std::find(_exclusions.begin(),
+                                                  _exclusions.end(),
+                                                  ent->d_name)
+                            != _exclusions.end())) {
+                continue;
+            }
+
+            bool is_dir;
+            if (ent->d_type != DT_UNKNOWN) {
+                is_dir = ent->d_type == DT_DIR;
+            } else {
+                struct stat sb;
+                if (fstatat(dir->fd, ent->d_name, &sb,
+                            AT_SYMLINK_NOFOLLOW) < 0) {
+                    if (errno != ENOENT) {
+                        LOGE("%s/%s: Failed to stat: %s", dir->path.c_str(),
+                             ent->d_name, strerror(errno));
+                        _failed = true;
+                    }
+                    continue;
+                }
+                is_dir = S_ISDIR(sb.st_mode);
+            }
+
+            if (!is_dir) {
+                if (unlinkat(dir->fd, ent->d_name, 0) < 0 && errno != ENOENT) {
+                    LOGE("%s/%s: Failed to remove: %s", dir->path.c_str(),
+                         ent->d_name, strerror(errno));
+                    _failed = true;
+                }
+                continue;
+            }
+
+            int child_fd = openat(dir->fd, ent->d_name, O_RDONLY | O_DIRECTORY
+                                  | O_NOFOLLOW | O_CLOEXEC);
+            if (child_fd < 0) {
+                if (errno != ENOENT) {
+                    LOGE("%s/%s: Failed to open directory: %s",
+                         dir->path.c_str(), ent->d_name, strerror(errno));
+                    _failed = true;
+                }
+                continue;
+            }
+
+            struct stat sb;
+            if (fstat(child_fd, &sb) < 0 || sb.st_dev != _dev) {
+                LOGE("%s/%s: Not deleting across filesystems",
+                     dir->path.c_str(), ent->d_name);
+                _failed = true;
+                close(child_fd);
+                continue;
+            }
+
+            auto child = std::make_shared<DeleteDir>();
+            child->fd = child_fd;
+            child->parent = dir;
+            child->name = ent->d_name;
+            child->path = dir->path;
+            child->path += '/';
+            child->path += ent->d_name;
+            child->refs = 1;
+
+            ++dir->refs;
+
+            if (!try_queue(child)) {
+                delete_contents(child);
+            }
+        }
+
+        closedir(dp);
+
+        release(dir);
+    }
+
+    void release(std::shared_ptr<DeleteDir> dir)
+    {
+        while (dir && --dir->refs == 0) {
+            close(dir->fd);
+
+            auto parent = std::move(dir->parent);
+            if (!parent) {
+                // Top-level directory is done, so wake up the idle workers
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _done = true;
+                }
+                _cv.notify_all();
+                return;
+            }
+
+            if (unlinkat(parent->fd, dir->name.c_str(), AT_REMOVEDIR) < 0
+                    && errno != ENOENT) {
+                LOGE("%s: Failed to remove: %s",
+                     dir->path.c_str(), strerror(errno));
+                _failed = true;
+            }
+
+            dir = std::move(parent);
+        }
+    }
+};
+
+static unsigned int delete_thread_count(int flags)
+{
+    if (!(flags & DELETE_PARALLEL)) {
+        return 1;
+    }
+
+    unsigned int n_threads = std::thread::hardware_concurrency();
+    return std::min(std::max(n_threads, 2u),
+                    static_cast<unsigned int>(DELETE_MAX_THREADS));
+}
+
+/*!
+ * \brief Move the top-level entries of a directory into a trash directory
+ *
+ * Entries that can't be moved (eg. mountpoints) are left in place.
+ */
+static void move_to_trash(int dfd, const std::string &trash,
+                          const std::string &trash_name,
+                          const std::vector<std::string> &exclusions)
+{
+    int trash_fd = open(trash.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int fd = trash_fd < 0 ? -1 : fcntl(dfd, F_DUPFD_CLOEXEC, 0);
+    DIR *dp = fd < 0 ? nullptr : fdopendir(fd);
+
+    if (dp) {
+        struct dirent *ent;
+        while ((ent = readdir(dp))) {
+            if (strcmp(ent->d_name, ".") == 0
+                    || strcmp(ent->d_name, "..") == 0
+                    || trash_name == ent->d_name
+                    || std::find(exclusions.begin(), exclusions.end(),
+                                 ent->d_name) != exclusions.end()) {
+                continue;
+            }
+
+            renameat(dfd, ent->d_name, trash_fd, ent->d_name);
+        }
+        closedir(dp);
+    } else if (fd >= 0) {
+        close(fd);
+    }
+
+    if (trash_fd >= 0) {
+        close(trash_fd);
+    }
+}
+
+// Number of running DELETE_BACKGROUND threads
+static std::mutex g_background_mutex;
+static std::condition_variable g_background_cv;
+static unsigned int g_background_count = 0;
+
+static void delete_in_background(std::string path, int flags)
+{
+    {
+        std::lock_guard<std::mutex> lock(g_background_mutex);
+        ++g_background_count;
+    }
+
+    std::thread([](std::string path, int flags) {
+        LOGV("%s: Deleting in the background", path.c_str());
+        if (!delete_recursive(path, flags & ~DELETE_BACKGROUND)) {
+            LOGE("%s: Failed to delete in the background", path.c_str());
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(g_background_mutex);
+            --g_background_count;
+        }
+        g_background_cv.notify_all();
+    }, std::move(path), flags).detach();
+}
+
+/*!
+ * \brief Wait for all DELETE_BACKGROUND deletions to finish
+ *
+ * This includes deletions that are started by other threads while waiting.
+ * It is useful for operations that need the space to actually be freed, such
+ * as trimming the filesystem.
+ */
+void wait_for_background_deletes()
+{
+    std::unique_lock<std::mutex> lock(g_background_mutex);
+    g_background_cv.wait(lock, [] {
+        return g_background_count == 0;
+    });
+}
+
+/*!
+ * \brief Recursively delete a path
+ *
+ * \param path Path to delete. Symlinks are not followed.
+ * \param flags Bitmask of DeleteFlags. If no flags are given, this behaves
+ *              the same as delete_recursive(const std::string &).
+ *
+ * \return True if the path was deleted (or handed to a background thread) or
+ *         did not exist. False if any entry could not be deleted.
+ */
+bool delete_recursive(const std::string &path, int flags)
+{
+    if (!(flags & (DELETE_PARALLEL | DELETE_BACKGROUND))) {
+        return delete_recursive(path);
+    }
+
+    struct stat sb;
+    if (lstat(path.c_str(), &sb) < 0) {
+        return errno == ENOENT;
+    }
+
+    if (!S_ISDIR(sb.st_mode)) {
+        if (unlink(path.c_str()) < 0 && errno != ENOENT) {
+            LOGE("%s: Failed to remove: %s", path.c_str(), strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    if (flags & DELETE_BACKGROUND) {
+        // Rename onto a fresh empty directory next to the original path. This
+        // fails for mountpoints, in which case we'll delete in the foreground.
+        std::string trash(path);
+        while (trash.size() > 1 && trash.back() == '/') {
+            trash.pop_back();
+        }
+        trash += ".deleting.XXXXXX";
+
+        if (mkdtemp(&trash[0])) {
+            if (rename(path.c_str(), trash.c_str()) == 0) {
+                delete_in_background(std::move(trash), flags);
+                return true;
+            }
+            rmdir(trash.c_str());
+        }
+    }
+
+    if (!delete_dir_contents(path, {}, flags & ~DELETE_BACKGROUND)) {
+        return false;
+    }
+
+    if (rmdir(path.c_str()) < 0 && errno != ENOENT) {
+        LOGE("%s: Failed to remove: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Recursively delete everything inside a directory
+ *
+ * The directory itself is kept. Mountpoints inside the directory are not
+ * descended into and cause the function to fail.
+ *
+ * \param path Directory to empty
+ * \param exclusions Names of top-level entries to keep
+ * \param flags Bitmask of DeleteFlags. With DELETE_BACKGROUND, the entries are
+ *              moved into a hidden directory inside \p path that is deleted
+ *              by a detached thread.
+ *
+ * \return True if all entries were deleted (or handed to a background thread)
+ *         or the directory did not exist. False, otherwise.
+ */
+bool delete_dir_contents(const std::string &path,
+                         const std::vector<std::string> &exclusions,
+                         int flags)
+{
+    int dfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) {
+        if (errno == ENOENT) {
+            // Don't fail if directory does not exist
+            return true;
+        }
+        LOGE("%s: Failed to open directory: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::vector<std::string> new_exclusions(exclusions);
+
+    if (flags & DELETE_BACKGROUND) {
+        std::string trash(path);
+        trash += "/.deleting.XXXXXX";
+
+        if (mkdtemp(&trash[0])) {
+            std::string trash_name = trash.substr(trash.rfind('/') + 1);
+
+            // Anything that can't be moved (eg. mountpoints) is handled by the
+            // foreground deletion below
+            move_to_trash(dfd, trash, trash_name, new_exclusions);
+
+            new_exclusions.push_back(std::move(trash_name));
+            delete_in_background(std::move(trash), flags);
+        }
+    }
+
+    ParallelDeleter deleter(delete_thread_count(flags),
+                            std::move(new_exclusions));
+    return deleter.run(dfd, path);
+}
+
+/*!
+ * \brief Lower the CPU and I/O priority of the calling thread
+ *
+ * Threads created afterwards by the calling thread inherit both priorities.
+ */
+static void lower_thread_priority()
+{
+    SchedPolicy policy;
+    policy.io_class = IoPriorityClass::Idle;
+    policy.nice = 19;
+
+    if (!apply_thread_sched_policy(policy)) {
+        LOGW("Failed to lower thread priority");
+    }
+}
+
+/*!
+ * \class TrashDeleter
+ * \brief Empties a directory right away and deletes its old contents later
+ *
+ * start() moves the top-level entries of a directory into a hidden trash
+ * directory inside it and returns as soon as the directory is otherwise empty.
+ * The trash is then deleted by a thread with the lowest CPU and I/O priority,
+ * so the directory can be refilled while the old contents are being deleted.
+ * Since the trash is on the same filesystem, the space used by the old
+ * contents is only freed gradually.
+ *
+ * Unlike DELETE_BACKGROUND, the deletion can be waited for, so this is safe to
+ * use in short-lived processes. The destructor waits as well.
+ */
+
+TrashDeleter::TrashDeleter() : _ret(true)
+{
+}
+
+TrashDeleter::~TrashDeleter()
+{
+    wait();
+}
+
+/*!
+ * \brief Empty a directory and start deleting its old contents
+ *
+ * \param path Directory to empty
+ * \param exclusions Names of top-level entries to keep
+ * \param flags Bitmask of DeleteFlags used for deleting the trash.
+ *              DELETE_BACKGROUND is ignored.
+ *
+ * \return True if the directory is empty (apart from \p exclusions and the
+ *         trash) or did not exist. False, otherwise.
+ */
+bool TrashDeleter::start(const std::string &path,
+                         const std::vector<std::string> &exclusions,
+                         int flags)
+{
+    if (!wait()) {
+        return false;
+    }
+
+    flags &= ~DELETE_BACKGROUND;
+
+    int dfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        LOGE("%s: Failed to open directory: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::string trash(path);
+    trash += "/.deleting.XXXXXX";
+
+    std::vector<std::string> new_exclusions(exclusions);
+
+    if (mkdtemp(&trash[0])) {
+        std::string trash_name = trash.substr(trash.rfind('/') + 1);
+
+        move_to_trash(dfd, trash, trash_name, exclusions);
+
+        new_exclusions.push_back(trash_name);
+
+        _trash = std::move(trash);
+        _trash_name = std::move(trash_name);
+        _thread = std::thread([this, flags] {
+            lower_thread_priority();
+
+            LOGV("%s: Deleting in the background", _trash.c_str());
+            _ret = delete_recursive(_trash, flags);
+        });
+    } else {
+        LOGW("%s: Failed to create trash directory: %s",
+             trash.c_str(), strerror(errno));
+    }
+
+    // Delete whatever couldn't be moved in the foreground
+    ParallelDeleter deleter(delete_thread_count(flags),
+                            std::move(new_exclusions));
+    return deleter.run(dfd, path);
+}
+
+/*!
+ * \brief Wait for the old contents to be deleted
+ *
+ * \return Whether the trash was completely deleted. True if there was nothing
+ *         to delete.
+ */
+bool TrashDeleter::wait()
+{
+    if (_thread.joinable()) {
+        _thread.join();
+
+        if (!_ret) {
+            LOGE("%s: Failed to delete", _trash.c_str());
+        }
+
+        _trash.clear();
+        _trash_name.clear();
+    }
+
+    bool ret = _ret;
+    _ret = true;
+    return ret;
+}
+
+/*!
+ * \brief Name of the trash directory inside the directory being emptied
+ *
+ * This is empty if no deletion is in progress. The trash should be excluded
+ * from anything else that walks the directory until wait() returns.
+ */
+const std::string & TrashDeleter::trash_name() const
+{
+    return _trash_name;
+}
+
 }
 }
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/discard.h"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+#include "mbutil/finally.h"
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Discard the unused blocks of a mounted filesystem
+ *
+ * This is the same as running `fstrim` on the filesystem containing \p path.
+ * For filesystems backed by a loop device, the kernel punches holes in the
+ * image file instead.
+ *
+ * \param[in] path Any directory on the filesystem
+ * \param[out] trimmed Number of bytes that were discarded. Some kernels report
+ *                     the total size of the free space instead.
+ *
+ * \return True if the filesystem was trimmed. False with errno set if the
+ *         filesystem or the underlying device does not support discard
+ *         (`EOPNOTSUPP` or `ENOTTY`) or another error occurs.
+ */
+bool fstrim(const std::string &path, uint64_t &trimmed)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto close_fd = finally([&] {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    });
+
+    struct fstrim_range range;
+    range.start = 0;
+    range.len = UINT64_MAX;
+    range.minlen = 0;
+
+    if (ioctl(fd, FITRIM, &range) < 0) {
+        return false;
+    }
+
+    trimmed = range.len;
+    return true;
+}
+
+/*!
+ * \brief Discard a range of a block device or regular file
+ *
+ * Block devices are discarded with `BLKDISCARD`. Regular files have the range
+ * deallocated with `FALLOC_FL_PUNCH_HOLE`, which keeps the file size.
+ *
+ * \return True if the range was discarded. False with errno set to
+ *         `EOPNOTSUPP` if \p fd refers to a different type of file or the
+ *         device/filesystem does not support discarding.
+ */
+bool discard_range(int fd, uint64_t offset, uint64_t size)
+{
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        return false;
+    }
+
+    if (S_ISBLK(sb.st_mode)) {
+        uint64_t range[2] = { offset, size };
+        return ioctl(fd, BLKDISCARD, &range) == 0;
+    } else if (S_ISREG(sb.st_mode)) {
+        return fallocate64(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                           static_cast<off64_t>(offset),
+                           static_cast<off64_t>(size)) == 0;
+    }
+
+    errno = EOPNOTSUPP;
+    return false;
+}
+
+/*!
+ * \brief Release all blocks of a regular file or block device
+ *
+ * This is meant to be called right before deleting an image. Unlike unlinking,
+ * the blocks are released even if the image is still held open (eg. by a loop
+ * device).
+ *
+ * \param[in] path Path to file. Symlinks are not followed.
+ * \param[out] discarded Number of bytes that were allocated to the file (or the
+ *                       size of the block device)
+ *
+ * \return True if the whole file was discarded. False with errno set
+ *         otherwise.
+ */
+bool discard_file(const std::string &path, uint64_t &discarded)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto close_fd = finally([&] {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    });
+
+    struct stat sb;
+    uint64_t size;
+
+    if (fstat(fd, &sb) < 0) {
+        return false;
+    }
+
+    if (S_ISBLK(sb.st_mode)) {
+        if (ioctl(fd, BLKGETSIZE64, &size) < 0) {
+            return false;
+        }
+        discarded = size;
+    } else {
+        discarded = static_cast<uint64_t>(sb.st_blocks) * 512;
+        // Also cover the partial block at the end and any blocks that were
+        // preallocated past the end of the file
+        size = std::max(static_cast<uint64_t>(sb.st_size), discarded);
+        size = (size + static_cast<uint64_t>(sb.st_blksize) - 1)
+                / static_cast<uint64_t>(sb.st_blksize)
+                * static_cast<uint64_t>(sb.st_blksize);
+    }
+
+    if (size == 0) {
+        return true;
+    }
+
+    if (!discard_range(fd, 0, size)) {
+        discarded = 0;
+        return false;
+    }
+
+    return true;
+}
+
+}
+}
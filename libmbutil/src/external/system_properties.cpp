@@ -1540,6 +1540,16 @@ uint32_t mb__system_property_serial(const prop_info* pi) {
   return serial;
 }
 
+const char* mb__system_property_name(const prop_info* pi) {
+#if MB_ENABLE_COMPAT_PROPERTIES
+  if (__predict_false(compat_mode)) {
+    return nullptr;
+  }
+#endif
+
+  return pi->name;
+}
+
 uint32_t mb__system_property_wait_any(uint32_t old_serial) {
   uint32_t new_serial;
   mb__system_property_wait(nullptr, old_serial, &new_serial, nullptr);
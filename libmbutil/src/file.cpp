@@ -19,8 +19,14 @@
 
 #include "mbutil/file.h"
 
+#include <map>
 #include <memory>
+#include <mutex>
+#include <queue>
+#include <tuple>
+
 #include <cerrno>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -35,6 +41,9 @@
 #include "mbutil/autoclose/file.h"
 #include "mbutil/finally.h"
 
+// Maximum number of file_find_one_of() results to cache
+#define FILE_FIND_CACHE_SIZE    64
+
 namespace mb
 {
 namespace util
@@ -141,13 +150,188 @@ bool file_write_data(const std::string &path,
     return ret;
 }
 
+/*!
+ * \brief Aho-Corasick automaton for matching several patterns in one pass
+ *
+ * The transitions are fully expanded (one row of 256 entries per state), so
+ * the scan loop does a single table lookup per byte without following failure
+ * links.
+ */
+class MultiPatternMatcher
+{
+public:
+    explicit MultiPatternMatcher(const std::vector<std::string> &patterns)
+        : _matches_empty(false)
+    {
+        add_state();
+
+        for (auto const &pattern : patterns) {
+            if (pattern.empty()) {
+                _matches_empty = true;
+                continue;
+            }
+
+            uint32_t state = 0;
+            for (unsigned char c : pattern) {
+                uint32_t next = _delta[state * 256 + c];
+                if (next == 0) {
+                    // add_state() may reallocate the table
+                    next = add_state();
+                    _delta[state * 256 + c] = next;
+                }
+                state = next;
+            }
+            _accept[state] = true;
+        }
+
+        // Breadth-first traversal to fill in the missing transitions from the
+        // failure links
+        std::vector<uint32_t> fail(_accept.size(), 0);
+        std::queue<uint32_t> queue;
+
+        for (unsigned int c = 0; c < 256; ++c) {
+            if (uint32_t next = _delta[c]) {
+                queue.push(next);
+            }
+        }
+
+        while (!queue.empty()) {
+            uint32_t state = queue.front();
+            queue.pop();
+
+            // A state also accepts if its longest proper suffix accepts
+            if (_accept[fail[state]]) {
+                _accept[state] = true;
+            }
+
+            for (unsigned int c = 0; c < 256; ++c) {
+                uint32_t &next = _delta[state * 256 + c];
+                uint32_t fallback = _delta[fail[state] * 256 + c];
+
+                if (next == 0) {
+                    next = fallback;
+                } else {
+                    fail[next] = fallback;
+                    queue.push(next);
+                }
+            }
+        }
+    }
+
+    bool search(const unsigned char *data, size_t size) const
+    {
+        if (_matches_empty) {
+            return true;
+        }
+
+        const uint32_t *delta = _delta.data();
+        uint32_t state = 0;
+
+        for (size_t i = 0; i < size; ++i) {
+            state = delta[state * 256 + data[i]];
+            if (_accept[state]) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+private:
+    uint32_t add_state()
+    {
+        _delta.resize(_delta.size() + 256, 0);
+        _accept.push_back(false);
+        return static_cast<uint32_t>(_accept.size() - 1);
+    }
+
+    std::vector<uint32_t> _delta;
+    std::vector<bool> _accept;
+    bool _matches_empty;
+};
+
+struct FindCacheKey
+{
+    std::string path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime_sec;
+    long mtime_nsec;
+    std::vector<std::string> items;
+
+    FindCacheKey(const std::string &path_, const struct stat &sb,
+                 const std::vector<std::string> &items_)
+        : path(path_), dev(sb.st_dev), ino(sb.st_ino), size(sb.st_size),
+          mtime_sec(sb.st_mtim.tv_sec), mtime_nsec(sb.st_mtim.tv_nsec),
+          items(items_)
+    {
+    }
+
+    bool operator<(const FindCacheKey &other) const
+    {
+        return std::tie(path, dev, ino, size, mtime_sec, mtime_nsec, items)
+                < std::tie(other.path, other.dev, other.ino, other.size,
+                           other.mtime_sec, other.mtime_nsec, other.items);
+    }
+};
+
+static std::mutex g_find_cache_lock;
+static std::map<FindCacheKey, bool> g_find_cache;
+
+static bool find_cache_lookup(const FindCacheKey &key, bool &result)
+{
+    std::lock_guard<std::mutex> lock(g_find_cache_lock);
+
+    auto it = g_find_cache.find(key);
+    if (it == g_find_cache.end()) {
+        return false;
+    }
+
+    result = it->second;
+    return true;
+}
+
+static void find_cache_insert(FindCacheKey key, bool result)
+{
+    std::lock_guard<std::mutex> lock(g_find_cache_lock);
+
+    // Entries for replaced files are never looked up again, so just start over
+    // instead of tracking the age of each entry
+    if (g_find_cache.size() >= FILE_FIND_CACHE_SIZE) {
+        g_find_cache.clear();
+    }
+
+    g_find_cache[std::move(key)] = result;
+}
+
+/*!
+ * \brief Check if a file contains any of the given byte strings
+ *
+ * The file is scanned once regardless of the number of \p items. Results are
+ * cached by path, device, inode, size, and modification time, so checking an
+ * unchanged file again only costs a `stat()`.
+ *
+ * \param path File to search
+ * \param items Byte strings to search for
+ *
+ * \return True if the file contains at least one of \p items. False if it
+ *         contains none of them or if the file cannot be read.
+ */
 bool file_find_one_of(const std::string &path, std::vector<std::string> items)
 {
     struct stat sb;
+    bool result;
+
+    if (stat(path.c_str(), &sb) == 0
+            && find_cache_lookup(FindCacheKey(path, sb, items), result)) {
+        return result;
+    }
+
     void *map = MAP_FAILED;
     int fd = -1;
 
-    if ((fd = open(path.c_str(), O_RDONLY)) < 0) {
+    if ((fd = open(path.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
         return false;
     }
 
@@ -159,22 +343,29 @@ bool file_find_one_of(const std::string &path, std::vector<std::string> items)
         return false;
     }
 
-    map = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (map == MAP_FAILED) {
-        return false;
-    }
+    MultiPatternMatcher matcher(items);
 
-    auto unmap_map = util::finally([&] {
-        munmap(map, sb.st_size);
-    });
-
-    for (auto const &item : items) {
-        if (memmem(map, sb.st_size, item.data(), item.size())) {
-            return true;
+    if (sb.st_size == 0) {
+        result = matcher.search(nullptr, 0);
+    } else {
+        map = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            return false;
         }
+
+        auto unmap_map = util::finally([&] {
+            munmap(map, sb.st_size);
+        });
+
+        madvise(map, sb.st_size, MADV_SEQUENTIAL);
+
+        result = matcher.search(static_cast<const unsigned char *>(map),
+                                static_cast<size_t>(sb.st_size));
     }
 
-    return false;
+    find_cache_insert(FindCacheKey(path, sb, items), result);
+
+    return result;
 }
 
 bool file_read_all(const std::string &path,
@@ -0,0 +1,315 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/flash.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mbcommon/buffer_pool.h"
+#include "mblog/logging.h"
+#include "mbutil/finally.h"
+
+// Amount of data compared, written, and verified at a time
+#define FLASH_CHUNK_SIZE        (1024 * 1024)
+// Buffer, offset, and size alignment required for O_DIRECT
+#define FLASH_DIRECT_ALIGNMENT  4096
+
+namespace mb
+{
+namespace util
+{
+
+struct FlashCtx
+{
+    const char *path;
+    // Buffered descriptor, used for unaligned I/O and as a fallback
+    int fd;
+    // O_DIRECT descriptor or -1 if unavailable
+    int direct_fd;
+};
+
+static int select_fd(const FlashCtx &ctx, size_t size)
+{
+    // Offsets are always multiples of FLASH_CHUNK_SIZE, so only the size of
+    // the final chunk can be unaligned
+    return ctx.direct_fd >= 0 && size % FLASH_DIRECT_ALIGNMENT == 0
+            ? ctx.direct_fd : ctx.fd;
+}
+
+static void disable_direct_io(FlashCtx &ctx)
+{
+    LOGW("%s: O_DIRECT not supported; using buffered I/O", ctx.path);
+    close(ctx.direct_fd);
+    ctx.direct_fd = -1;
+}
+
+static bool read_chunk(FlashCtx &ctx, unsigned char *buf, size_t size,
+                       uint64_t offset, size_t &bytes_read)
+{
+    bytes_read = 0;
+
+    while (bytes_read < size) {
+        int fd = select_fd(ctx, size);
+        ssize_t n = pread64(fd, buf + bytes_read, size - bytes_read,
+                            static_cast<off64_t>(offset + bytes_read));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EINVAL && fd == ctx.direct_fd) {
+                disable_direct_io(ctx);
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            break;
+        }
+
+        bytes_read += static_cast<size_t>(n);
+    }
+
+    return true;
+}
+
+static bool write_chunk(FlashCtx &ctx, const unsigned char *buf, size_t size,
+                        uint64_t offset)
+{
+    size_t bytes_written = 0;
+
+    while (bytes_written < size) {
+        int fd = select_fd(ctx, size);
+        ssize_t n = pwrite64(fd, buf + bytes_written, size - bytes_written,
+                             static_cast<off64_t>(offset + bytes_written));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EINVAL && fd == ctx.direct_fd) {
+                disable_direct_io(ctx);
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            errno = EIO;
+            return false;
+        }
+
+        bytes_written += static_cast<size_t>(n);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Write data to a block device, skipping unchanged regions
+ *
+ * The target is processed in 1 MiB chunks. Each chunk is first read from the
+ * target and compared against \p data. Only chunks that differ are written,
+ * so flashing an image that is already on the device causes no writes at all.
+ * Aligned chunks use `O_DIRECT` to bypass the page cache. Once all data has
+ * been written and synced, only the written ranges are read back and compared
+ * against \p data.
+ *
+ * The SHA512 hash of \p data is computed while the chunks are processed. On
+ * success, it is also the hash of the first \p size bytes of the target.
+ *
+ * If \p path is a regular file, it is truncated to \p size bytes.
+ *
+ * \param[in] path Path to block device (or regular file)
+ * \param[in] data Data to write
+ * \param[in] size Size of \p data
+ * \param[out] digest `unsigned char` array of size `SHA512_DIGEST_LENGTH` to
+ *                    store the hash of \p data (may be NULL)
+ * \param[out] stats Number of bytes written and skipped (may be NULL)
+ *
+ * \return true on success, false on failure and errno set appropriately
+ */
+bool flash_data(const std::string &path, const void *data, size_t size,
+                unsigned char digest[SHA512_DIGEST_LENGTH],
+                FlashStats *stats)
+{
+    FlashCtx ctx;
+    ctx.path = path.c_str();
+
+    ctx.fd = open(ctx.path, O_RDWR | O_CLOEXEC);
+    if (ctx.fd < 0) {
+        LOGE("%s: Failed to open: %s", ctx.path, strerror(errno));
+        return false;
+    }
+
+    // Not all filesystems support O_DIRECT, so this is allowed to fail
+    ctx.direct_fd = open(ctx.path, O_RDWR | O_CLOEXEC | O_DIRECT);
+
+    auto close_fds = finally([&] {
+        int saved_errno = errno;
+        close(ctx.fd);
+        if (ctx.direct_fd >= 0) {
+            close(ctx.direct_fd);
+        }
+        errno = saved_errno;
+    });
+
+    struct stat sb;
+    if (fstat(ctx.fd, &sb) < 0) {
+        LOGE("%s: Failed to stat: %s", ctx.path, strerror(errno));
+        return false;
+    }
+
+    if (S_ISBLK(sb.st_mode)) {
+        uint64_t dev_size;
+        if (ioctl(ctx.fd, BLKGETSIZE64, &dev_size) < 0) {
+            LOGE("%s: Failed to get block device size: %s",
+                 ctx.path, strerror(errno));
+            return false;
+        }
+
+        if (size > dev_size) {
+            LOGE("%s: Data (%zu bytes) is larger than block device"
+                 " (%" PRIu64 " bytes)", ctx.path, size, dev_size);
+            errno = ENOSPC;
+            return false;
+        }
+    }
+
+    // IoBuffer's alignment satisfies O_DIRECT
+    static_assert(IO_BUFFER_ALIGNMENT % FLASH_DIRECT_ALIGNMENT == 0,
+                  "I/O buffers are not aligned for O_DIRECT");
+    IoBuffer read_buf;
+    IoBuffer write_buf;
+    if (!read_buf.allocate(FLASH_CHUNK_SIZE)
+            || !write_buf.allocate(FLASH_CHUNK_SIZE)) {
+        return false;
+    }
+
+    SHA512_CTX sha_ctx;
+    if (!SHA512_Init(&sha_ctx)) {
+        LOGE("openssl: SHA512_Init() failed");
+        errno = EINVAL;
+        return false;
+    }
+
+    auto src = static_cast<const unsigned char *>(data);
+    // Written ranges as (offset, size) pairs with adjacent ranges merged
+    std::vector<std::pair<uint64_t, uint64_t>> written;
+    uint64_t bytes_written = 0;
+
+    for (uint64_t offset = 0; offset < size; offset += FLASH_CHUNK_SIZE) {
+        size_t n = static_cast<size_t>(
+                std::min<uint64_t>(FLASH_CHUNK_SIZE, size - offset));
+        size_t n_read;
+
+        if (!read_chunk(ctx, read_buf.data(), n, offset, n_read)) {
+            LOGE("%s: Failed to read: %s", ctx.path, strerror(errno));
+            return false;
+        }
+
+        if (!SHA512_Update(&sha_ctx, src + offset, n)) {
+            LOGE("openssl: SHA512_Update() failed");
+            errno = EINVAL;
+            return false;
+        }
+
+        if (n_read == n && memcmp(read_buf.data(), src + offset, n) == 0) {
+            continue;
+        }
+
+        // O_DIRECT needs an aligned source buffer
+        memcpy(write_buf.data(), src + offset, n);
+
+        if (!write_chunk(ctx, write_buf.data(), n, offset)) {
+            LOGE("%s: Failed to write: %s", ctx.path, strerror(errno));
+            return false;
+        }
+
+        if (!written.empty() && written.back().first + written.back().second
+                == offset) {
+            written.back().second += n;
+        } else {
+            written.emplace_back(offset, n);
+        }
+        bytes_written += n;
+    }
+
+    if (S_ISREG(sb.st_mode) && static_cast<uint64_t>(sb.st_size) != size
+            && ftruncate64(ctx.fd, static_cast<off64_t>(size)) < 0) {
+        LOGE("%s: Failed to truncate: %s", ctx.path, strerror(errno));
+        return false;
+    }
+
+    if (!written.empty()) {
+        if (fdatasync(ctx.fd) < 0) {
+            LOGE("%s: Failed to sync: %s", ctx.path, strerror(errno));
+            return false;
+        }
+
+        // Make sure buffered reads of the written ranges come from the device
+        posix_fadvise(ctx.fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+
+    for (auto const &range : written) {
+        uint64_t end = range.first + range.second;
+
+        for (uint64_t offset = range.first; offset < end;
+                offset += FLASH_CHUNK_SIZE) {
+            size_t n = static_cast<size_t>(
+                    std::min<uint64_t>(FLASH_CHUNK_SIZE, end - offset));
+            size_t n_read;
+
+            if (!read_chunk(ctx, read_buf.data(), n, offset, n_read)) {
+                LOGE("%s: Failed to read back: %s", ctx.path, strerror(errno));
+                return false;
+            }
+
+            if (n_read != n
+                    || memcmp(read_buf.data(), src + offset, n) != 0) {
+                LOGE("%s: Data read back at offset %" PRIu64
+                     " does not match written data", ctx.path, offset);
+                errno = EIO;
+                return false;
+            }
+        }
+    }
+
+    if (digest && !SHA512_Final(digest, &sha_ctx)) {
+        LOGE("openssl: SHA512_Final() failed");
+        errno = EINVAL;
+        return false;
+    }
+
+    if (stats) {
+        stats->bytes_written = bytes_written;
+        stats->bytes_unchanged = size - bytes_written;
+    }
+
+    return true;
+}
+
+}
+}
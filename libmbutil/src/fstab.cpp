@@ -20,6 +20,7 @@
 #include "mbutil/fstab.h"
 
 #include <memory>
+#include <mutex>
 
 #include <cctype>
 #include <cerrno>
@@ -29,10 +30,11 @@
 #include <cstring>
 
 #include <sys/mount.h>
+#include <sys/stat.h>
 
 #include "mblog/logging.h"
-#include "mbutil/autoclose/file.h"
-#include "mbutil/finally.h"
+#include "mbutil/file.h"
+#include "mbutil/path.h"
 #include "mbutil/string.h"
 
 
@@ -140,106 +142,95 @@ static int options_to_flags(struct mount_flag *flags_map, char *args,
     return flags;
 }
 
-// Much simplified version of fs_mgr's fstab parsing code
-std::vector<fstab_rec> read_fstab(const std::string &path)
+/*!
+ * \brief Read a file and split it into lines in a single pass
+ *
+ * Empty lines and comments are skipped. The returned lines point into \p buf
+ * and have their trailing newline removed.
+ */
+static bool read_lines(const std::string &path, std::vector<unsigned char> &buf,
+                       std::vector<char *> &lines)
 {
-    autoclose::file fp(autoclose::fopen(path.c_str(), "rb"));
-    if (!fp) {
-        LOGE("Failed to open file %s: %s", path.c_str(), strerror(errno));
-        return std::vector<fstab_rec>();
+    if (!file_read_all(path, &buf)) {
+        LOGE("Failed to read file %s: %s", path.c_str(), strerror(errno));
+        return false;
     }
-
-    int count, entries;
-    char *line = nullptr;
-    size_t len = 0; // allocated memory size
-    ssize_t bytes_read; // number of bytes read
-    char *temp;
-    char *save_ptr;
-    const char *delim = " \t";
-    std::vector<fstab_rec> fstab;
-    char temp_mount_args[1024];
-
-    auto free_line = finally([&] {
-        free(line);
-    });
-
-    entries = 0;
-    while ((bytes_read = getline(&line, &len, fp.get())) != -1) {
-        // Strip newlines
-        if (bytes_read > 0 && line[bytes_read - 1] == '\n') {
-            line[bytes_read - 1] = '\0';
+    buf.push_back('\0');
+
+    char *line = reinterpret_cast<char *>(buf.data());
+    char *data_end = line + buf.size() - 1;
+
+    while (line < data_end) {
+        char *line_end = static_cast<char *>(
+                memchr(line, '\n', static_cast<size_t>(data_end - line)));
+        if (line_end) {
+            *line_end = '\0';
+        } else {
+            line_end = data_end;
         }
 
-        // Strip leading
-        temp = line;
+        // Skip empty lines and comments
+        char *temp = line;
         while (isspace(*temp)) {
             ++temp;
         }
-
-        // Skip empty lines and comments
-        if (*temp == '\0' || *temp == '#') {
-            continue;
+        if (*temp != '\0' && *temp != '#') {
+            lines.push_back(line);
         }
 
-        ++entries;
-    }
-
-    if (entries == 0) {
-        LOGE("fstab contains no entries");
-        return std::vector<fstab_rec>();
+        line = line_end + 1;
     }
 
-    std::fseek(fp.get(), 0, SEEK_SET);
+    return true;
+}
 
-    count = 0;
-    while ((bytes_read = getline(&line, &len, fp.get())) != -1) {
-        // Strip newlines
-        if (bytes_read > 0 && line[bytes_read - 1] == '\n') {
-            line[bytes_read - 1] = '\0';
-        }
+// Much simplified version of fs_mgr's fstab parsing code
+static bool parse_fstab(const std::string &path, std::vector<fstab_rec> &fstab)
+{
+    std::vector<unsigned char> buf;
+    std::vector<char *> lines;
+    if (!read_lines(path, buf, lines)) {
+        return false;
+    }
 
-        // Strip leading
-        temp = line;
-        while (isspace(*temp)) {
-            ++temp;
-        }
+    if (lines.empty()) {
+        LOGE("fstab contains no entries");
+        return false;
+    }
 
-        // Skip empty lines and comments
-        if (*temp == '\0' || *temp == '#') {
-            continue;
-        }
+    char *temp;
+    char *save_ptr;
+    const char *delim = " \t";
+    char temp_mount_args[1024];
 
-        // Avoid possible overflow if the file was changed
-        if (count >= entries) {
-            LOGE("Found more fstab entries on second read than first read");
-            break;
-        }
+    fstab.reserve(lines.size());
 
+    for (char *line : lines) {
         fstab_rec rec;
 
         rec.orig_line = line;
 
         if ((temp = strtok_r(line, delim, &save_ptr)) == nullptr) {
             LOGE("No source path/device found in entry: %s", line);
-            return std::vector<fstab_rec>();
+            return false;
         }
         rec.blk_device = temp;
 
         if ((temp = strtok_r(nullptr, delim, &save_ptr)) == nullptr) {
             LOGE("No mount point found in entry: %s", line);
-            return std::vector<fstab_rec>();
+            return false;
         }
         rec.mount_point = temp;
 
         if ((temp = strtok_r(nullptr, delim, &save_ptr)) == nullptr) {
             LOGE("No filesystem type found in entry: %s", line);
-            return std::vector<fstab_rec>();
+            return false;
         }
         rec.fs_type = temp;
 
         if ((temp = strtok_r(nullptr, delim, &save_ptr)) == nullptr) {
             LOGE("No mount options found in entry: %s", line);
-            return std::vector<fstab_rec>();
+            return false;
         }
         rec.mount_args = temp;
         rec.flags = options_to_flags(mount_flags, temp, temp_mount_args, 1024);
@@ -250,17 +241,15 @@ std::vector<fstab_rec> read_fstab(const std::string &path)
 
         if ((temp = strtok_r(nullptr, delim, &save_ptr)) == nullptr) {
             LOGE("No fs_mgr/vold options found in entry: %s", line);
-            return std::vector<fstab_rec>();
+            return false;
         }
         rec.vold_args = temp;
         rec.fs_mgr_flags = options_to_flags(fs_mgr_flags, temp, nullptr, 0);
 
         fstab.push_back(std::move(rec));
-
-        ++count;
     }
 
-    return fstab;
+    return true;
 }
 
 static bool convert_to_int(const char *str, int *out)
@@ -276,62 +265,41 @@ static bool convert_to_int(const char *str, int *out)
     return true;
 }
 
-std::vector<twrp_fstab_rec> read_twrp_fstab(const std::string &path)
+static bool parse_twrp_fstab(const std::string &path,
+                             std::vector<twrp_fstab_rec> &fstab)
 {
-    autoclose::file fp(autoclose::fopen(path.c_str(), "rb"));
-    if (!fp) {
-        LOGE("Failed to open file %s: %s", path.c_str(), strerror(errno));
-        return {};
+    std::vector<unsigned char> buf;
+    std::vector<char *> lines;
+    if (!read_lines(path, buf, lines)) {
+        return false;
     }
 
-    char *line = nullptr;
-    size_t len = 0; // allocated memory size
-    ssize_t bytes_read; // number of bytes read
     char *temp;
     char *save_ptr;
     const char *delim = " \t";
-    std::vector<twrp_fstab_rec> fstab;
 
-    auto free_line = finally([&] {
-        free(line);
-    });
-
-    while ((bytes_read = getline(&line, &len, fp.get())) != -1) {
-        // Strip newlines
-        if (bytes_read > 0 && line[bytes_read - 1] == '\n') {
-            line[bytes_read - 1] = '\0';
-        }
-
-        // Strip leading whitespace
-        temp = line;
-        while (isspace(*temp)) {
-            ++temp;
-        }
-
-        // Skip empty lines and comments
-        if (*temp == '\0' || *temp == '#') {
-            continue;
-        }
+    fstab.reserve(lines.size());
 
+    for (char *line : lines) {
         twrp_fstab_rec rec;
 
         rec.orig_line = line;
 
         if ((temp = strtok_r(line, delim, &save_ptr)) == nullptr) {
             LOGE("No mount point found in entry: %s", line);
-            return {};
+            return false;
         }
         rec.mount_point = temp;
 
         if ((temp = strtok_r(nullptr, delim, &save_ptr)) == nullptr) {
             LOGE("No filesystem type found in entry: %s", line);
-            return {};
+            return false;
         }
         rec.fs_type = temp;
 
         if ((temp = strtok_r(nullptr, delim, &save_ptr)) == nullptr) {
             LOGE("No block device found in entry: %s", line);
-            return {};
+            return false;
         }
         rec.blk_devices.push_back(temp);
 
@@ -344,7 +312,7 @@ std::vector<twrp_fstab_rec> read_twrp_fstab(const std::string &path)
                 temp += 7;
                 if (!convert_to_int(temp, &rec.length)) {
                     LOGE("Invalid length: %s", temp);
-                    return {};
+                    return false;
                 }
             } else if (strncmp(temp, "flags=", 6) == 0) {
                 // TWRP flags
@@ -363,7 +331,138 @@ std::vector<twrp_fstab_rec> read_twrp_fstab(const std::string &path)
         fstab.push_back(std::move(rec));
     }
 
-    return fstab;
+    return true;
+}
+
+static std::string normalize_mount_point(const std::string &path)
+{
+    std::vector<std::string> pieces(path_split(path));
+    normalize_path(&pieces);
+    return path_join(pieces);
+}
+
+template<typename Rec>
+FstabTable<Rec>::FstabTable(std::vector<Rec> recs)
+    : _recs(std::move(recs))
+{
+    _index.reserve(_recs.size());
+    for (size_t i = 0; i < _recs.size(); ++i) {
+        // Keep the first record for duplicate mount points
+        _index.emplace(normalize_mount_point(_recs[i].mount_point), i);
+    }
+}
+
+template<typename Rec>
+const Rec * FstabTable<Rec>::find(const std::string &mount_point) const
+{
+    if (mount_point.empty()) {
+        return nullptr;
+    }
+
+    auto it = _index.find(normalize_mount_point(mount_point));
+    return it == _index.end() ? nullptr : &_recs[it->second];
+}
+
+template class FstabTable<fstab_rec>;
+template class FstabTable<twrp_fstab_rec>;
+
+template<typename Table>
+struct CachedFstab
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    std::shared_ptr<const Table> table;
+};
+
+static std::mutex fstab_cache_lock;
+static std::unordered_map<std::string, CachedFstab<Fstab>> fstab_cache;
+static std::unordered_map<std::string, CachedFstab<TwrpFstab>> twrp_fstab_cache;
+
+/*!
+ * \brief Get a parsed fstab from the cache or parse and cache it
+ *
+ * A cached entry is only used if the file's device, inode, size, and mtime are
+ * unchanged. Failures are not cached.
+ */
+template<typename Table, typename Rec>
+static std::shared_ptr<const Table> load_cached(
+        std::unordered_map<std::string, CachedFstab<Table>> &cache,
+        const std::string &path,
+        bool (*parse)(const std::string &, std::vector<Rec> &))
+{
+    struct stat sb;
+    if (stat(path.c_str(), &sb) < 0) {
+        LOGE("Failed to stat file %s: %s", path.c_str(), strerror(errno));
+        return {};
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(fstab_cache_lock);
+
+        auto it = cache.find(path);
+        if (it != cache.end()) {
+            const CachedFstab<Table> &entry = it->second;
+            if (entry.dev == sb.st_dev && entry.ino == sb.st_ino
+                    && entry.size == sb.st_size
+                    && entry.mtime.tv_sec == sb.st_mtim.tv_sec
+                    && entry.mtime.tv_nsec == sb.st_mtim.tv_nsec) {
+                return entry.table;
+            }
+            cache.erase(it);
+        }
+    }
+
+    std::vector<Rec> recs;
+    if (!parse(path, recs)) {
+        return {};
+    }
+
+    CachedFstab<Table> entry;
+    entry.dev = sb.st_dev;
+    entry.ino = sb.st_ino;
+    entry.size = sb.st_size;
+    entry.mtime = sb.st_mtim;
+    entry.table = std::make_shared<const Table>(std::move(recs));
+
+    std::lock_guard<std::mutex> lock(fstab_cache_lock);
+    cache[path] = entry;
+    return entry.table;
+}
+
+/*!
+ * \brief Get the parsed, shared representation of an fstab file
+ *
+ * The file is only reparsed if it changed since the last call.
+ *
+ * \return Parsed fstab or nullptr if the file could not be read or parsed
+ */
+std::shared_ptr<const Fstab> load_fstab(const std::string &path)
+{
+    return load_cached(fstab_cache, path, &parse_fstab);
+}
+
+/*!
+ * \brief Get the parsed, shared representation of a TWRP fstab file
+ *
+ * \sa load_fstab()
+ */
+std::shared_ptr<const TwrpFstab> load_twrp_fstab(const std::string &path)
+{
+    return load_cached(twrp_fstab_cache, path, &parse_twrp_fstab);
+}
+
+std::vector<fstab_rec> read_fstab(const std::string &path)
+{
+    auto fstab = load_fstab(path);
+    return fstab ? fstab->recs() : std::vector<fstab_rec>();
+}
+
+std::vector<twrp_fstab_rec> read_twrp_fstab(const std::string &path)
+{
+    auto fstab = load_twrp_fstab(path);
+    return fstab ? fstab->recs() : std::vector<twrp_fstab_rec>();
 }
 
 }
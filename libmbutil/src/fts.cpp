@@ -19,21 +19,238 @@
 
 #include "mbutil/fts.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
 #include <cerrno>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "mbcommon/string.h"
+#include "mbutil/finally.h"
 #include "mbutil/string.h"
 
+// Size of the buffer passed to getdents64()
+#define FTS_DENTS_BUF_SIZE      (32 * 1024)
+// Maximum number of worker threads used with FTS_Parallel
+#define FTS_MAX_THREADS         4
+// Maximum number of directories read ahead with FTS_Parallel. Each of them
+// holds an open fd until it is traversed or skipped.
+#define FTS_MAX_PREFETCH        64
+
+// NOTE: fts_open()/fts_read() are not used because they stat every entry by
+// its full path, which resolves every parent directory again. The traversal
+// below reads each directory with getdents64() and only uses *at() calls
+// relative to the directory fd, while filling in FTSENT structs the same way
+// fts_read() does with FTS_NOCHDIR.
 
 namespace mb
 {
 namespace util
 {
 
+// Layout of the records returned by getdents64(). Not every libc declares it.
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+enum ChildState
+{
+    // Not read ahead
+    CHILD_UNLOADED,
+    // Waiting for a worker thread to read it
+    CHILD_QUEUED,
+    // Being read by a worker thread
+    CHILD_LOADING,
+    // Read by a worker thread, but not traversed yet
+    CHILD_LOADED,
+    // Skipped while being read by a worker thread
+    CHILD_ABANDONED,
+};
+
+struct FTSWrapper::Child
+{
+    std::string name;
+    struct stat sb;
+    // FTS_D, FTS_F, FTS_SL, FTS_SLNONE, FTS_DEFAULT, or FTS_NS
+    unsigned short info;
+    // errno if info is FTS_NS
+    int error;
+
+    // Guarded by Prefetcher::mutex
+    int state = CHILD_UNLOADED;
+    std::shared_ptr<Dir> dir;
+};
+
+struct FTSWrapper::Dir
+{
+    // Open directory fd used for all *at() calls on the children
+    int fd = -1;
+    // errno if the directory could not be opened or read
+    int error = 0;
+    std::vector<Child> children;
+
+    ~Dir()
+    {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+
+/*!
+ * \brief Worker threads that read directories ahead of the traversal
+ *
+ * When the traversal enters a directory, its subdirectories are queued. A
+ * worker that reads one of them queues its subdirectories in turn, up to
+ * FTS_MAX_PREFETCH directories in total. If the traversal reaches a directory
+ * that is still queued, it takes it back and reads it itself instead of
+ * waiting.
+ */
+struct FTSWrapper::Prefetcher
+{
+    int flags;
+    dev_t root_dev;
+
+    std::mutex mutex;
+    // Signaled when the queue is not empty or the workers should exit
+    std::condition_variable work_cv;
+    // Signaled when a worker finishes reading a directory
+    std::condition_variable loaded_cv;
+    std::deque<std::pair<std::shared_ptr<Dir>, size_t>> queue;
+    // Number of children that are not CHILD_UNLOADED
+    size_t outstanding = 0;
+    bool stop = false;
+    std::vector<std::thread> threads;
+
+    Prefetcher(int flags_, dev_t root_dev_, unsigned int n_threads)
+        : flags(flags_), root_dev(root_dev_)
+    {
+        for (unsigned int i = 0; i < n_threads; ++i) {
+            threads.emplace_back(&Prefetcher::worker_thread, this);
+        }
+    }
+
+    ~Prefetcher()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        work_cv.notify_all();
+
+        for (auto &t : threads) {
+            t.join();
+        }
+    }
+
+    // Must be called with mutex held
+    void schedule(const std::shared_ptr<Dir> &dir)
+    {
+        bool queued = false;
+
+        for (size_t i = 0; i < dir->children.size()
+                && outstanding < FTS_MAX_PREFETCH; ++i) {
+            Child &child = dir->children[i];
+
+            if (child.info != FTS_D || child.state != CHILD_UNLOADED
+                    || (!(flags & FTS_CrossMountPointBoundaries)
+                            && child.sb.st_dev != root_dev)) {
+                continue;
+            }
+
+            child.state = CHILD_QUEUED;
+            queue.emplace_back(dir, i);
+            ++outstanding;
+            queued = true;
+        }
+
+        if (queued) {
+            work_cv.notify_all();
+        }
+    }
+
+    // Must be called with mutex held
+    void release(Dir &dir)
+    {
+        for (Child &child : dir.children) {
+            switch (child.state) {
+            case CHILD_QUEUED:
+                child.state = CHILD_UNLOADED;
+                --outstanding;
+                break;
+            case CHILD_LOADING:
+                child.state = CHILD_ABANDONED;
+                break;
+            case CHILD_LOADED: {
+                auto subdir = std::move(child.dir);
+                child.state = CHILD_UNLOADED;
+                --outstanding;
+                release(*subdir);
+                break;
+            }
+            }
+        }
+    }
+
+    void worker_thread()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true) {
+            work_cv.wait(lock, [&] {
+                return stop || !queue.empty();
+            });
+
+            if (stop) {
+                break;
+            }
+
+            auto item = std::move(queue.front());
+            queue.pop_front();
+
+            Child &child = item.first->children[item.second];
+            if (child.state != CHILD_QUEUED) {
+                // Taken back or released by the traversal
+                continue;
+            }
+            child.state = CHILD_LOADING;
+
+            lock.unlock();
+            auto dir = load_dir(item.first->fd, child.name.c_str(), flags);
+            lock.lock();
+
+            if (child.state == CHILD_ABANDONED) {
+                child.state = CHILD_UNLOADED;
+                --outstanding;
+                continue;
+            }
+
+            child.dir = dir;
+            child.state = CHILD_LOADED;
+            schedule(dir);
+
+            loaded_cv.notify_all();
+        }
+    }
+};
+
 FTSWrapper::FTSWrapper(std::string path, int flags)
 {
     _path = std::move(path);
@@ -44,124 +261,455 @@ FTSWrapper::FTSWrapper(std::string path, int flags)
 
 FTSWrapper::~FTSWrapper()
 {
-    if (_ftsp) {
-        fts_close(_ftsp);
-    }
 }
 
-bool FTSWrapper::run()
+static unsigned short info_for_mode(mode_t mode)
 {
-    if (_ran) {
-        _error_msg = "Already ran";
-        return false;
+    switch (mode & S_IFMT) {
+    case S_IFDIR: return FTS_D;
+    case S_IFREG: return FTS_F;
+    case S_IFLNK: return FTS_SL;
+    default:      return FTS_DEFAULT;
     }
-    _ran = true;
+}
 
-    bool ret = true;
-    int fts_flags = 0;
-    int result;
+/*!
+ * \brief Stat a path like fts_read() does
+ *
+ * \return fts_info value for the path
+ */
+static unsigned short stat_entry(int dfd, const char *name, int flags,
+                                 struct stat &sb, int &error)
+{
+    error = 0;
+
+    if (flags & FTSWrapper::FTS_FollowSymlinks) {
+        if (fstatat(dfd, name, &sb, 0) == 0) {
+            return info_for_mode(sb.st_mode);
+        }
 
-    // Don't change directories
-    fts_flags += FTS_NOCHDIR;
+        error = errno;
 
-    // Don't follow symlinks by default
-    if (_flags & FTS_FollowSymlinks) {
-        fts_flags |= FTS_LOGICAL;
+        // fts reports dangling symlinks instead of an error
+        if (fstatat(dfd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0
+                && S_ISLNK(sb.st_mode)) {
+            error = 0;
+            return FTS_SLNONE;
+        }
     } else {
-        fts_flags |= FTS_PHYSICAL;
+        if (fstatat(dfd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+            return info_for_mode(sb.st_mode);
+        }
+
+        error = errno;
     }
 
-    // Don't cross mountpoint boundaries by default
-    if ((_flags & FTS_CrossMountPointBoundaries) == 0) {
-        fts_flags |= FTS_XDEV;
+    memset(&sb, 0, sizeof(sb));
+    return FTS_NS;
+}
+
+/*!
+ * \brief Open and read a directory relative to a directory fd
+ *
+ * If the directory cannot be opened or read, then Dir::error is set to errno.
+ */
+std::shared_ptr<FTSWrapper::Dir> FTSWrapper::load_dir(int dfd,
+                                                      const char *name,
+                                                      int flags)
+{
+    auto dir = std::make_shared<Dir>();
+
+    int open_flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    if (!(flags & FTS_FollowSymlinks)) {
+        open_flags |= O_NOFOLLOW;
     }
 
-    // Pre-execute hook
-    if (!on_pre_execute()) {
-        return false;
+    dir->fd = openat(dfd, name, open_flags);
+    if (dir->fd < 0) {
+        dir->error = errno;
+        return dir;
     }
 
-    // We only support traversal of one tree
-    char *files[] = { (char *) _path.c_str(), nullptr };
+    std::vector<char> buf(FTS_DENTS_BUF_SIZE);
 
-    _ftsp = fts_open(files, fts_flags, nullptr);
-    if (!_ftsp) {
-        mb::format(_error_msg, "fts_open failed: %s", strerror(errno));
-        ret = false;
+    while (true) {
+        long n = syscall(SYS_getdents64, dir->fd, buf.data(), buf.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            dir->error = errno;
+            dir->children.clear();
+            return dir;
+        } else if (n == 0) {
+            break;
+        }
+
+        for (long pos = 0; pos < n;) {
+            auto ent = reinterpret_cast<linux_dirent64 *>(buf.data() + pos);
+            pos += ent->d_reclen;
+
+            if (strcmp(ent->d_name, ".") == 0
+                    || strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+
+            dir->children.emplace_back();
+            Child &child = dir->children.back();
+            child.name = ent->d_name;
+
+            // Directories are always stat'ed for their device and inode
+            bool need_stat = !(flags & FTS_NoStat)
+                    || ent->d_type == DT_UNKNOWN
+                    || ent->d_type == DT_DIR
+                    || (ent->d_type == DT_LNK && (flags & FTS_FollowSymlinks));
+
+            if (need_stat) {
+                child.info = stat_entry(dir->fd, ent->d_name, flags,
+                                        child.sb, child.error);
+            } else {
+                memset(&child.sb, 0, sizeof(child.sb));
+                // Same as DTTOIF()
+                child.sb.st_mode = static_cast<mode_t>(ent->d_type) << 12;
+                child.info = info_for_mode(child.sb.st_mode);
+                child.error = 0;
+            }
+        }
     }
 
-    while (_ftsp && (_curr = fts_read(_ftsp))) {
-        switch (_curr->fts_info) {
-        case FTS_NS:  // no stat()
-        case FTS_DNR: // directory not read
-        case FTS_ERR: { // other error
-            mb::format(_error_msg, "fts_read error: %s",
-                       strerror(_curr->fts_errno));
-            ret = false;
-            break;
+    return dir;
+}
+
+/*!
+ * \brief Get the contents of a subdirectory, using the read-ahead copy if the
+ *        prefetcher has one
+ */
+std::shared_ptr<FTSWrapper::Dir> FTSWrapper::get_dir(
+        const std::shared_ptr<Dir> &parent, size_t index)
+{
+    Child &child = parent->children[index];
+
+    if (_prefetcher) {
+        std::unique_lock<std::mutex> lock(_prefetcher->mutex);
+
+        if (child.state == CHILD_LOADING) {
+            _prefetcher->loaded_cv.wait(lock, [&] {
+                return child.state == CHILD_LOADED;
+            });
         }
 
-        case FTS_DC:   // Not reached unless FTS_LOGICAL specified
-                       // (FTS_PHYSICAL doesn't follow symlinks)
-        case FTS_DOT:  // Not reached unless FTS_SEEDOT specified
-        case FTS_NSOK: // Not reached unless FTS_NOSTAT specified
-            continue;
+        if (child.state == CHILD_LOADED) {
+            auto dir = std::move(child.dir);
+            child.state = CHILD_UNLOADED;
+            --_prefetcher->outstanding;
+
+            // The pre-order hook may have made the directory readable, so only
+            // successful reads are reused
+            if (dir->error == 0) {
+                return dir;
+            }
+        } else if (child.state == CHILD_QUEUED) {
+            child.state = CHILD_UNLOADED;
+            --_prefetcher->outstanding;
         }
+    }
 
-        if (_curr->fts_level == 0) {
-            _root = _curr;
+    return load_dir(parent->fd, child.name.c_str(), _flags);
+}
+
+void FTSWrapper::release_dir(Dir &dir)
+{
+    if (_prefetcher) {
+        std::lock_guard<std::mutex> lock(_prefetcher->mutex);
+        _prefetcher->release(dir);
+    }
+}
+
+void FTSWrapper::prefetch_dir(const std::shared_ptr<Dir> &dir)
+{
+    if (_prefetcher) {
+        std::lock_guard<std::mutex> lock(_prefetcher->mutex);
+        _prefetcher->schedule(dir);
+    }
+}
+
+void FTSWrapper::set_entry(FTSENT *ent, char *path, size_t path_len,
+                           const char *name, short level, unsigned short info,
+                           struct stat *sb, int error)
+{
+    size_t name_len = strlen(name);
+
+    ent->fts_accpath = path;
+    ent->fts_path = path;
+    ent->fts_pathlen = static_cast<unsigned short>(path_len);
+    ent->fts_namelen = static_cast<unsigned short>(name_len);
+    memcpy(ent->fts_name, name, name_len + 1);
+    ent->fts_level = level;
+    ent->fts_info = info;
+    ent->fts_errno = error;
+    ent->fts_statp = sb;
+    ent->fts_ino = sb->st_ino;
+    ent->fts_dev = sb->st_dev;
+    ent->fts_nlink = sb->st_nlink;
+}
+
+static FTSENT * alloc_entry(size_t name_len)
+{
+    size_t size = std::max(sizeof(FTSENT),
+                           offsetof(FTSENT, fts_name) + name_len + 1);
+    return static_cast<FTSENT *>(calloc(1, size));
+}
+
+/*!
+ * \brief Call the hooks for _curr
+ *
+ * \param[out] ret Set to false if a hook failed
+ * \param[out] skip Set to true if a hook asked for the tree to be skipped
+ *
+ * \return Whether the traversal should continue
+ */
+bool FTSWrapper::visit(bool &ret, bool &skip)
+{
+    int result;
+
+    skip = false;
+
+    switch (_curr->fts_info) {
+    case FTS_NS:  // no stat()
+    case FTS_DNR: // directory not read
+    case FTS_ERR: { // other error
+        mb::format(_error_msg, "fts_read error: %s",
+                   strerror(_curr->fts_errno));
+        ret = false;
+        break;
+    }
+    }
+
+    // Current path hook
+    _error_msg = "Handler returned failure";
+    result = on_changed_path();
+    if (result & FTS_Fail) {
+        ret = false;
+    }
+    if (result & FTS_Next) {
+        return true;
+    }
+    if (result & FTS_Skip) {
+        skip = true;
+        return true;
+    }
+    if (result & FTS_Stop) {
+        return false;
+    }
+
+    // Call other hooks
+    _error_msg = "Handler returned failure";
+
+    switch (_curr->fts_info) {
+    case FTS_D: result = on_reached_directory_pre(); break;
+    case FTS_DP: result = on_reached_directory_post(); break;
+    case FTS_F: result = on_reached_file(); break;
+    case FTS_SL:
+    case FTS_SLNONE: result = on_reached_symlink(); break;
+    case FTS_DEFAULT:
+        if (_flags & FTS_GroupSpecialFiles) {
+            result = on_reached_special_file();
+        } else {
+            switch (_curr->fts_statp->st_mode & S_IFMT) {
+            case S_IFBLK: result = on_reached_block_device(); break;
+            case S_IFCHR: result = on_reached_character_device(); break;
+            case S_IFIFO: result = on_reached_fifo(); break;
+            case S_IFSOCK: result = on_reached_socket(); break;
+            default: result = Action::FTS_Skip; break;
+            }
         }
+    }
 
-        // Current path hook
-        _error_msg = "Handler returned failure";
-        result = on_changed_path();
-        if (result & FTS_Fail) {
-            ret = false;
+    // Handle result
+    if (result & FTS_Fail) {
+        ret = false;
+    }
+    if (result & FTS_Skip) {
+        skip = true;
+        return true;
+    }
+    if (result & FTS_Stop) {
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Traverse the children of a directory
+ *
+ * _ent_path must be the path of \p dir when this is called and is restored
+ * before returning.
+ *
+ * \return Whether the traversal should continue
+ */
+bool FTSWrapper::walk(const std::shared_ptr<Dir> &dir, short level, bool &ret)
+{
+    size_t dir_path_len = _ent_path.size();
+
+    auto restore_path = finally([&] {
+        _ent_path.resize(dir_path_len);
+    });
+
+    for (size_t i = 0; i < dir->children.size(); ++i) {
+        Child &child = dir->children[i];
+
+        // Like fts, don't add a slash if the root path already ends with one
+        _ent_path.resize(dir_path_len);
+        if (_ent_path.empty() || _ent_path.back() != '/') {
+            _ent_path += '/';
         }
-        if (result & FTS_Next) {
+        _ent_path += child.name;
+
+        size_t path_len = _ent_path.size();
+
+        // Directory cycles can only happen when following symlinks. fts
+        // reports them as FTS_DC, which we've always ignored.
+        if (child.info == FTS_D && (_flags & FTS_FollowSymlinks)
+                && std::any_of(_ancestors.begin(), _ancestors.end(),
+                               [&](const struct stat *sb) {
+                    return sb->st_dev == child.sb.st_dev
+                            && sb->st_ino == child.sb.st_ino;
+                })) {
             continue;
         }
-        if (result & FTS_Skip) {
-            fts_set(_ftsp, _curr, FTS_SKIP);
-            continue;
+
+        set_entry(_ent.get(), &_ent_path[0], path_len, child.name.c_str(),
+                  level, child.info, &child.sb, child.error);
+        _curr = _ent.get();
+
+        bool skip;
+        if (!visit(ret, skip)) {
+            return false;
         }
-        if (result & FTS_Stop) {
-            break;
+
+        if (child.info != FTS_D) {
+            continue;
         }
 
-        // Call other hooks
-        _error_msg = "Handler returned failure";
+        // Skipped directories and mountpoints are still visited in post-order
+        if (!skip && ((_flags & FTS_CrossMountPointBoundaries)
+                || child.sb.st_dev == _root_sb.st_dev)) {
+            auto subdir = get_dir(dir, i);
 
-        switch (_curr->fts_info) {
-        case FTS_D: result = on_reached_directory_pre(); break;
-        case FTS_DP: result = on_reached_directory_post(); break;
-        case FTS_F: result = on_reached_file(); break;
-        case FTS_SL:
-        case FTS_SLNONE: result = on_reached_symlink(); break;
-        case FTS_DEFAULT:
-            if (_flags & FTS_GroupSpecialFiles) {
-                result = on_reached_special_file();
-            } else {
-                switch (_curr->fts_statp->st_mode & S_IFMT) {
-                case S_IFBLK: result = on_reached_block_device(); break;
-                case S_IFCHR: result = on_reached_character_device(); break;
-                case S_IFIFO: result = on_reached_fifo(); break;
-                case S_IFSOCK: result = on_reached_socket(); break;
-                default: result = Action::FTS_Skip; break;
+            if (subdir->error != 0) {
+                set_entry(_ent.get(), &_ent_path[0], path_len,
+                          child.name.c_str(), level, FTS_DNR, &child.sb,
+                          subdir->error);
+                _curr = _ent.get();
+
+                if (!visit(ret, skip)) {
+                    return false;
                 }
+                continue;
+            }
+
+            prefetch_dir(subdir);
+
+            _ancestors.push_back(&child.sb);
+            bool keep_going = walk(subdir, level + 1, ret);
+            _ancestors.pop_back();
+
+            release_dir(*subdir);
+
+            if (!keep_going) {
+                return false;
             }
         }
 
-        // Handle result
-        if (result & FTS_Fail) {
-            ret = false;
+        set_entry(_ent.get(), &_ent_path[0], path_len, child.name.c_str(),
+                  level, FTS_DP, &child.sb, 0);
+        _curr = _ent.get();
+
+        if (!visit(ret, skip)) {
+            return false;
         }
-        if (result & FTS_Skip) {
-            fts_set(_ftsp, _curr, FTS_SKIP);
-            continue;
+    }
+
+    return true;
+}
+
+bool FTSWrapper::run()
+{
+    if (_ran) {
+        _error_msg = "Already ran";
+        return false;
+    }
+    _ran = true;
+
+    bool ret = true;
+
+    // Pre-execute hook
+    if (!on_pre_execute()) {
+        return false;
+    }
+
+    // Like fts, the root's name is everything after the last slash
+    auto slash = _path.find_last_of('/');
+    const char *root_name = slash == std::string::npos
+            ? _path.c_str() : _path.c_str() + slash + 1;
+
+    _root_ent.reset(alloc_entry(strlen(root_name)));
+    _ent.reset(alloc_entry(NAME_MAX));
+    if (!_root_ent || !_ent) {
+        _error_msg = "Out of memory";
+        return false;
+    }
+
+    int error;
+    unsigned short info = stat_entry(AT_FDCWD, _path.c_str(), _flags,
+                                     _root_sb, error);
+
+    // fts doesn't follow a symlink at the root without FTS_COMFOLLOW either
+    set_entry(_root_ent.get(), &_path[0], _path.size(), root_name, 0, info,
+              &_root_sb, error);
+    _root = _curr = _root_ent.get();
+
+    bool skip;
+    bool keep_going = visit(ret, skip);
+
+    if (keep_going && info == FTS_D) {
+        std::shared_ptr<Dir> dir;
+        if (!skip) {
+            dir = load_dir(AT_FDCWD, _path.c_str(), _flags);
         }
-        if (result & FTS_Stop) {
-            break;
+
+        if (dir && dir->error != 0) {
+            set_entry(_root_ent.get(), &_path[0], _path.size(), root_name, 0,
+                      FTS_DNR, &_root_sb, dir->error);
+            _curr = _root_ent.get();
+            keep_going = false;
+            visit(ret, skip);
+        } else if (dir) {
+            if (_flags & FTS_Parallel) {
+                unsigned int n_threads = std::thread::hardware_concurrency();
+                n_threads = std::min(std::max(n_threads, 2u),
+                                     static_cast<unsigned int>(FTS_MAX_THREADS));
+
+                _prefetcher.reset(new Prefetcher(_flags, _root_sb.st_dev,
+                                                 n_threads));
+            }
+
+            prefetch_dir(dir);
+
+            _ent_path = _path;
+            _ancestors.push_back(&_root_sb);
+            keep_going = walk(dir, 1, ret);
+            _ancestors.clear();
+
+            release_dir(*dir);
+            _prefetcher.reset();
+        }
+
+        if (keep_going) {
+            set_entry(_root_ent.get(), &_path[0], _path.size(), root_name, 0,
+                      FTS_DP, &_root_sb, 0);
+            _curr = _root_ent.get();
+            visit(ret, skip);
         }
     }
 
@@ -176,7 +724,6 @@ std::string FTSWrapper::error()
 {
     return _error_msg;
 }
-
 bool FTSWrapper::on_pre_execute() {
     return true;
 }
@@ -19,13 +19,19 @@
 
 #include "mbutil/hash.h"
 
-#include <memory>
+#include <algorithm>
 
 #include <cerrno>
-#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mbcommon/buffer_pool.h"
+#include "mbcommon/thread_pool.h"
 #include "mblog/logging.h"
-#include "mbutil/autoclose/file.h"
+#include "mbutil/finally.h"
 
 namespace mb
 {
@@ -44,39 +50,206 @@ namespace util
 bool sha512_hash(const std::string &path,
                  unsigned char digest[SHA512_DIGEST_LENGTH])
 {
-    autoclose::file fp(autoclose::fopen(path.c_str(), "rb"));
-    if (!fp) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
         LOGE("%s: Failed to open: %s", path.c_str(), strerror(errno));
         return false;
     }
 
-    unsigned char buf[10240];
-    size_t n;
+    auto close_fd = finally([&] {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    });
+
+    if (!sha512_hash(fd, digest)) {
+        LOGE("%s: Failed to compute SHA512 hash: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Compute SHA512 hash of the remaining data in a file descriptor
+ *
+ * The data is read sequentially from the current offset in 1 MiB chunks. The
+ * kernel is told to expect sequential access so that it reads ahead
+ * aggressively.
+ *
+ * \param fd File descriptor (regular file, block device, or pipe)
+ * \param digest `unsigned char` array of size `SHA512_DIGEST_LENGTH` to store
+ *               computed hash value
+ *
+ * \return true on success, false on failure and errno set appropriately
+ */
+bool sha512_hash(int fd, unsigned char digest[SHA512_DIGEST_LENGTH])
+{
+    // Not supported for pipes, but that's harmless
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    IoBuffer buf;
+    if (!buf.allocate()) {
+        return false;
+    }
 
     SHA512_CTX ctx;
     if (!SHA512_Init(&ctx)) {
         LOGE("openssl: SHA512_Init() failed");
+        errno = EINVAL;
         return false;
     }
 
-    while ((n = fread(buf, 1, sizeof(buf), fp.get())) > 0) {
-        if (!SHA512_Update(&ctx, buf, n)) {
+    while (true) {
+        ssize_t n = read(fd, buf.data(), buf.size());
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            break;
+        }
+
+        if (!SHA512_Update(&ctx, buf.data(), static_cast<size_t>(n))) {
             LOGE("openssl: SHA512_Update() failed");
+            errno = EINVAL;
             return false;
         }
-        if (n < sizeof(buf)) {
+    }
+
+    if (!SHA512_Final(digest, &ctx)) {
+        LOGE("openssl: SHA512_Final() failed");
+        errno = EINVAL;
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Compute SHA512 hashes of several files concurrently
+ *
+ * The files are hashed in the shared thread pool by up to \p max_threads
+ * threads (capped at the number of CPUs and files). Hashing stops at the first
+ * failure.
+ *
+ * \param[in] paths Paths of files to hash
+ * \param[out] digests Hash of each file in \p paths (in the same order)
+ * \param[in] max_threads Maximum number of threads to use (0 for no limit)
+ *
+ * \return true if every file was hashed, false otherwise
+ */
+bool sha512_hash_files(const std::vector<std::string> &paths,
+                       std::vector<Sha512Digest> &digests,
+                       unsigned int max_threads)
+{
+    std::vector<Sha512Digest> result(paths.size());
+
+    bool ret = parallel_for(paths.size(), [&](size_t i) {
+        return sha512_hash(paths[i], result[i].data());
+    }, max_threads, CoreHint::Performance);
+
+    if (!ret) {
+        return false;
+    }
+
+    digests.swap(result);
+    return true;
+}
+
+/*!
+ * \brief Compute hash of a range of a file descriptor
+ *
+ * The data is read with `pread()`, so the file offset of \p fd is not
+ * changed.
+ *
+ * \param[in] fd File descriptor (regular file or block device)
+ * \param[in] algorithm Hash algorithm
+ * \param[in] offset Offset to start hashing from
+ * \param[in] size Maximum number of bytes to hash. Hashing stops early if the
+ *                 end of the file is reached.
+ * \param[out] digest Computed hash value
+ * \param[out] hashed Number of bytes hashed
+ *
+ * \return true on success, false on failure and errno set appropriately
+ */
+bool hash_fd_range(int fd, HashAlgorithm algorithm,
+                   uint64_t offset, uint64_t size,
+                   std::vector<unsigned char> &digest, uint64_t &hashed)
+{
+    SHA256_CTX sha256_ctx;
+    SHA512_CTX sha512_ctx;
+    int ret;
+
+    switch (algorithm) {
+    case HashAlgorithm::Sha256:
+        ret = SHA256_Init(&sha256_ctx);
+        break;
+    case HashAlgorithm::Sha512:
+        ret = SHA512_Init(&sha512_ctx);
+        break;
+    default:
+        errno = EINVAL;
+        return false;
+    }
+
+    if (!ret) {
+        LOGE("openssl: Failed to initialize hash context");
+        errno = EINVAL;
+        return false;
+    }
+
+    posix_fadvise(fd, static_cast<off_t>(offset), 0, POSIX_FADV_SEQUENTIAL);
+
+    IoBuffer buf;
+    if (!buf.allocate()) {
+        return false;
+    }
+
+    hashed = 0;
+
+    while (hashed < size) {
+        size_t to_read = static_cast<size_t>(
+                std::min<uint64_t>(size - hashed, buf.size()));
+
+        ssize_t n = pread64(fd, buf.data(), to_read,
+                            static_cast<off64_t>(offset + hashed));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
             break;
         }
+
+        ret = algorithm == HashAlgorithm::Sha256
+                ? SHA256_Update(&sha256_ctx, buf.data(),
+                                static_cast<size_t>(n))
+                : SHA512_Update(&sha512_ctx, buf.data(),
+                                static_cast<size_t>(n));
+        if (!ret) {
+            LOGE("openssl: Failed to update hash");
+            errno = EINVAL;
+            return false;
+        }
+
+        hashed += static_cast<uint64_t>(n);
     }
 
-    if (ferror(fp.get())) {
-        LOGE("%s: Failed to read file", path.c_str());
-        errno = EIO;
-        return false;
+    if (algorithm == HashAlgorithm::Sha256) {
+        digest.resize(SHA256_DIGEST_LENGTH);
+        ret = SHA256_Final(digest.data(), &sha256_ctx);
+    } else {
+        digest.resize(SHA512_DIGEST_LENGTH);
+        ret = SHA512_Final(digest.data(), &sha512_ctx);
     }
 
-    if (!SHA512_Final(digest, &ctx)) {
-        LOGE("openssl: SHA512_Final() failed");
+    if (!ret) {
+        LOGE("openssl: Failed to finalize hash");
+        errno = EINVAL;
         return false;
     }
 
@@ -19,12 +19,15 @@
 
 #include "mbutil/loopdev.h"
 
+#include <algorithm>
+#include <mutex>
 #include <vector>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <unistd.h>
@@ -32,6 +35,8 @@
 #include <linux/loop.h>
 
 #include "mbcommon/string.h"
+#include "mblog/logging.h"
+#include "mbutil/file.h"
 #include "mbutil/finally.h"
 #include "mbutil/string.h"
 
@@ -41,136 +46,210 @@
 
 #define LOOP_CONTROL    "/dev/loop-control"
 #define LOOP_FMT        "/dev/block/loop%d"
+#define LOOP_SYSFS_FMT  "/sys/dev/block/%u:%u/%s"
 
 #define MAX_LOOPDEVS    1024
 
+// Number of free loop devices to look for at a time
+#define LOOPDEV_POOL_SIZE 8
+
+// Added in Linux 5.8. Attaches the file and sets the status in one ioctl.
+#ifndef LOOP_CONFIGURE
+#define LOOP_CONFIGURE  0x4C0A
+
+struct loop_config
+{
+    __u32 fd;
+    __u32 block_size;
+    struct loop_info64 info;
+    __u64 __reserved[8];
+};
+#endif
+
+#ifndef LO_FLAGS_DIRECT_IO
+#define LO_FLAGS_DIRECT_IO 16
+#endif
+
+#ifndef LOOP_SET_BLOCK_SIZE
+#define LOOP_SET_BLOCK_SIZE 0x4C09
+#endif
+
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#endif
+
 
 namespace mb
 {
 namespace util
 {
 
+/*
+ * Loop devices that were free when they were last checked. Finding a free
+ * loop device can mean opening every /dev/block/loop* node on older kernels,
+ * so a batch is found at once and devices are recycled when they are cleared.
+ * Devices are removed from the pool when handed out, so concurrent callers in
+ * this process never get the same device.
+ */
+static std::mutex pool_mutex;
+static std::vector<int> pool;
+
 /*!
- * \brief Find empty loopdev by using the new ioctl for /dev/block/loop-control
- *
- * \return Loopdev number or -1 if loop-control does not exist or the ioctl
- *         failed
+ * \brief Check if a loop device is unused, creating its node if needed
  */
-static int find_loopdev_by_loop_control(void)
+static bool is_loopdev_free(int n)
 {
-    int fd = -1;
+    char loopdev[64];
+    struct loop_info64 loopinfo;
+    struct stat sb;
 
-    if ((fd = open(LOOP_CONTROL, O_RDWR)) < 0) {
-        return -1;
+    sprintf(loopdev, LOOP_FMT, n);
+
+    if (mknod(loopdev, S_IFBLK | 0644, makedev(7, n)) < 0 && errno != EEXIST) {
+        return false;
+    }
+
+    int fd = open(loopdev, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        // Loopdev does not exist. Great! The kernel will create it when it's
+        // set up.
+        return errno == ENOENT;
     }
 
     auto close_fd = finally([&] {
         close(fd);
     });
 
-    int n = ioctl(fd, LOOP_CTL_GET_FREE);
-    if (n < 0) {
-        return -1;
+    if (fstat(fd, &sb) < 0) {
+        // Uhhhhh...
+        return false;
     }
 
-    char loopdev[64];
-    sprintf(loopdev, LOOP_FMT, n);
-
-    if (mknod(loopdev, S_IFBLK | 0644, makedev(7, n)) < 0 && errno != EEXIST) {
-        return -1;
+    if (!S_ISBLK(sb.st_mode) || major(sb.st_rdev) != 7) {
+        // Device isn't a loop device
+        return false;
     }
 
-    return n;
+    return ioctl(fd, LOOP_GET_STATUS64, &loopinfo) < 0 && errno == ENXIO;
+}
+
+static void pool_add(int n)
+{
+    if (n > 0 && pool.size() < LOOPDEV_POOL_SIZE
+            && std::find(pool.begin(), pool.end(), n) == pool.end()) {
+        pool.push_back(n);
+    }
 }
 
 /*!
- * \brief Find empty loopdev by dumb scan through /dev/block/loop*
+ * \brief Find empty loopdevs by using the new ioctls for /dev/loop-control
  *
- * \return Loopdev number or -1 if:
- *         - /dev/block/loop# failed to stat where errno != ENOENT
- *         - /dev/block/loop# is not a loop device
- *         - /dev/block/loop# could not be opened
- *         - LOOP_GET_STATUS64 ioctl failed where errno != ENXIO
+ * LOOP_CTL_GET_FREE only returns the lowest free device, so the devices after
+ * it are created with LOOP_CTL_ADD or checked if they already exist.
  */
-static int find_loopdev_by_scanning(void)
+static void fill_pool_by_loop_control(void)
 {
-    int fd;
-    char loopdev[64];
+    int fd = -1;
+
+    if ((fd = open(LOOP_CONTROL, O_RDWR | O_CLOEXEC)) < 0) {
+        return;
+    }
+
+    auto close_fd = finally([&] {
+        close(fd);
+    });
+
+    int n = ioctl(fd, LOOP_CTL_GET_FREE);
+    if (n < 0) {
+        return;
+    }
 
     // Avoid /dev/block/loop0 since some installers (ahem, SuperSU) are
     // hardcoded to use it
-    for (int n = 1; n < MAX_LOOPDEVS; ++n) {
-        struct loop_info64 loopinfo;
-        struct stat sb;
-
-        sprintf(loopdev, LOOP_FMT, n);
+    if (n > 0 && is_loopdev_free(n)) {
+        pool_add(n);
+    }
 
-        if (mknod(loopdev, S_IFBLK | 0644, makedev(7, n)) < 0) {
-            if (errno != EEXIST) {
-                continue;
-            }
+    for (int m = n + 1; m < MAX_LOOPDEVS && m <= n + 4 * LOOPDEV_POOL_SIZE
+            && pool.size() < LOOPDEV_POOL_SIZE; ++m) {
+        if (ioctl(fd, LOOP_CTL_ADD, m) < 0 && errno != EEXIST) {
+            break;
+        }
+        if (is_loopdev_free(m)) {
+            pool_add(m);
         }
+    }
+}
 
-        if ((fd = open(loopdev, O_RDWR | O_CLOEXEC)) < 0) {
-            // Loopdev does not exist. Great! loopdev_find_unused() will
-            // create it
-            if (errno == ENOENT) {
-                return n;
-            } else {
-                continue;
-            }
+/*!
+ * \brief Find empty loopdevs by dumb scan through /dev/block/loop*
+ */
+static void fill_pool_by_scanning(void)
+{
+    for (int n = 1; n < MAX_LOOPDEVS && pool.size() < LOOPDEV_POOL_SIZE; ++n) {
+        if (is_loopdev_free(n)) {
+            pool_add(n);
         }
+    }
+}
 
-        auto close_fd = finally([&] {
-            close(fd);
-        });
+std::string loopdev_find_unused(void)
+{
+    std::lock_guard<std::mutex> lock(pool_mutex);
 
-        if (fstat(fd, &sb) < 0) {
-            // Uhhhhh...
-            continue;
-        }
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        while (!pool.empty()) {
+            int n = pool.front();
+            pool.erase(pool.begin());
 
-        if (!S_ISBLK(sb.st_mode) || major(sb.st_rdev) != 7) {
-            // Device isn't a loop device
-            continue;
+            // Someone else may have claimed it in the meantime
+            if (is_loopdev_free(n)) {
+                return mb::format(LOOP_FMT, n);
+            }
         }
 
-        if (ioctl(fd, LOOP_GET_STATUS64, &loopinfo) < 0) {
-            if (errno == ENXIO) {
-                return n;
-            } else {
-                continue;
-            }
+        fill_pool_by_loop_control();
+        if (pool.empty()) {
+            fill_pool_by_scanning();
         }
     }
 
-    return -1;
+    errno = ENOENT;
+    return {};
 }
 
-std::string loopdev_find_unused(void)
+bool loopdev_set_up_device(const std::string &loopdev, const std::string &file,
+                           uint64_t offset, bool ro)
 {
-    int n = find_loopdev_by_loop_control();
-    // Also search by scanning if n == 0, since some installers hardcode
-    // /dev/block/loop0
-    if (n <= 0) {
-        n = find_loopdev_by_scanning();
-    }
-    if (n < 0) {
-        return {};
-    }
-
-    return mb::format(LOOP_FMT, n);
+    return loopdev_set_up_device(loopdev, file, offset, ro, 0);
 }
 
+/*!
+ * \brief Attach a file to a loop device
+ *
+ * LOOP_CONFIGURE is used if the kernel supports it. Otherwise, this falls back
+ * to LOOP_SET_FD and LOOP_SET_STATUS64, in which case \a flags and
+ * \a block_size are applied on a best effort basis.
+ *
+ * \param loopdev Loop device path
+ * \param file Backing file
+ * \param offset Offset of the data in \a file
+ * \param ro Whether to attach the file read-only
+ * \param flags Bitmask of LoopDevFlags
+ * \param block_size Logical block size or 0 to use the kernel default
+ *
+ * \return Whether the file was attached
+ */
 bool loopdev_set_up_device(const std::string &loopdev, const std::string &file,
-                           uint64_t offset, bool ro)
+                           uint64_t offset, bool ro, int flags,
+                           uint32_t block_size)
 {
     int ffd = -1;
     int lfd = -1;
 
-    struct loop_info64 loopinfo;
+    struct loop_config config;
 
-    if ((ffd = open(file.c_str(), ro ? O_RDONLY : O_RDWR)) < 0) {
+    if ((ffd = open(file.c_str(), (ro ? O_RDONLY : O_RDWR) | O_CLOEXEC)) < 0) {
         return false;
     }
 
@@ -178,7 +257,7 @@ bool loopdev_set_up_device(const std::string &loopdev, const std::string &file,
         close(ffd);
     });
 
-    if ((lfd = open(loopdev.c_str(), ro ? O_RDONLY : O_RDWR)) < 0) {
+    if ((lfd = open(loopdev.c_str(), (ro ? O_RDONLY : O_RDWR) | O_CLOEXEC)) < 0) {
         return false;
     }
 
@@ -186,32 +265,116 @@ bool loopdev_set_up_device(const std::string &loopdev, const std::string &file,
         close(lfd);
     });
 
-    memset(&loopinfo, 0, sizeof(struct loop_info64));
-    strlcpy((char *) loopinfo.lo_file_name, file.c_str(), LO_NAME_SIZE);
-    loopinfo.lo_offset = offset;
+    memset(&config, 0, sizeof(config));
+    config.fd = ffd;
+    config.block_size = block_size;
+    strlcpy((char *) config.info.lo_file_name, file.c_str(), LO_NAME_SIZE);
+    config.info.lo_offset = offset;
+    if (ro) {
+        config.info.lo_flags |= LO_FLAGS_READ_ONLY;
+    }
+    if (flags & LOOPDEV_DIRECT_IO) {
+        config.info.lo_flags |= LO_FLAGS_DIRECT_IO;
+    }
+
+    if (ioctl(lfd, LOOP_CONFIGURE, &config) == 0) {
+        return true;
+    } else if (errno != EINVAL && errno != ENOTTY) {
+        return false;
+    }
+
+    // Fall back to the old ioctls. LO_FLAGS_READ_ONLY is implied by the file
+    // being opened read-only and can't be set with LOOP_SET_STATUS64.
+    config.info.lo_flags &= ~(LO_FLAGS_READ_ONLY | LO_FLAGS_DIRECT_IO);
 
     if (ioctl(lfd, LOOP_SET_FD, ffd) < 0) {
         return false;
     }
 
-    if (ioctl(lfd, LOOP_SET_STATUS64, &loopinfo) < 0) {
+    if (ioctl(lfd, LOOP_SET_STATUS64, &config.info) < 0) {
         ioctl(lfd, LOOP_CLR_FD, 0);
         return false;
     }
 
+    if (block_size != 0 && ioctl(lfd, LOOP_SET_BLOCK_SIZE, block_size) < 0) {
+        LOGW("%s: Failed to set block size to %u: %s",
+             loopdev.c_str(), block_size, strerror(errno));
+    }
+
+    if ((flags & LOOPDEV_DIRECT_IO) && ioctl(lfd, LOOP_SET_DIRECT_IO, 1) < 0) {
+        LOGV("%s: Direct I/O not available: %s",
+             loopdev.c_str(), strerror(errno));
+    }
+
     return true;
 }
 
 bool loopdev_remove_device(const std::string &loopdev)
 {
     int lfd;
-    if ((lfd = open(loopdev.c_str(), O_RDONLY)) < 0) {
+    if ((lfd = open(loopdev.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
         return false;
     }
+
+    struct stat sb;
+    bool have_stat = fstat(lfd, &sb) == 0;
+
     int ret = ioctl(lfd, LOOP_CLR_FD, 0);
     close(lfd);
+
+    // Recycle the device for the next caller
+    if (ret == 0 && have_stat && S_ISBLK(sb.st_mode)
+            && major(sb.st_rdev) == 7) {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        pool_add(minor(sb.st_rdev));
+    }
+
     return ret == 0;
 }
 
+
+/*!
+ * \brief Get the state of an attached loop device from sysfs
+ *
+ * \a info.direct_io reflects what the kernel actually uses, which may be false
+ * even if LOOPDEV_DIRECT_IO was requested (eg. if the backing filesystem does
+ * not support direct I/O).
+ *
+ * \return Whether the loop device is attached and its state could be read
+ */
+bool loopdev_get_info(const std::string &loopdev, LoopDevInfo &info)
+{
+    struct stat sb;
+    if (stat(loopdev.c_str(), &sb) < 0) {
+        return false;
+    } else if (!S_ISBLK(sb.st_mode) || major(sb.st_rdev) != 7) {
+        errno = EINVAL;
+        return false;
+    }
+
+    unsigned int maj = major(sb.st_rdev);
+    unsigned int min = minor(sb.st_rdev);
+    std::string value;
+
+    if (!file_first_line(mb::format(LOOP_SYSFS_FMT, maj, min,
+                                    "loop/backing_file"), &value)) {
+        // Not attached
+        return false;
+    }
+    info.backing_file = std::move(value);
+
+    // Kernels older than 4.4 don't support direct I/O at all
+    info.direct_io = file_first_line(mb::format(LOOP_SYSFS_FMT, maj, min,
+                                                "loop/dio"), &value)
+            && value == "1";
+
+    info.block_size = 512;
+    if (file_first_line(mb::format(LOOP_SYSFS_FMT, maj, min,
+                                   "queue/logical_block_size"), &value)) {
+        info.block_size = strtoul(value.c_str(), nullptr, 10);
+    }
+
+    return true;
+}
 }
 }
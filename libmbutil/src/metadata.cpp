@@ -0,0 +1,491 @@
+/*
+ * Copyright (C) 2014  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/metadata.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <cerrno>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "mbcommon/string.h"
+#include "mbcommon/thread_pool.h"
+#include "mblog/logging.h"
+#include "mbutil/file.h"
+#include "mbutil/string.h"
+
+#define SELINUX_XATTR           "security.selinux"
+// Contexts longer than this are compared by rewriting the label
+#define SELINUX_CONTEXT_MAX     256
+#define METADATA_MAX_THREADS    4
+
+namespace mb
+{
+namespace util
+{
+
+static bool parse_file_type(const std::string &str, mode_t *type)
+{
+    if (str.size() != 2 || str[0] != '-') {
+        return false;
+    }
+
+    switch (str[1]) {
+    case '-': *type = S_IFREG;  return true;
+    case 'd': *type = S_IFDIR;  return true;
+    case 'c': *type = S_IFCHR;  return true;
+    case 'b': *type = S_IFBLK;  return true;
+    case 's': *type = S_IFSOCK; return true;
+    case 'l': *type = S_IFLNK;  return true;
+    case 'p': *type = S_IFIFO;  return true;
+    default:                    return false;
+    }
+}
+
+/*!
+ * \brief Load a textual file_contexts file
+ *
+ * \param path Path to file_contexts
+ *
+ * \return True if the file was successfully parsed. False and errno set
+ *         appropriately if the file could not be read or contains an invalid
+ *         line.
+ */
+bool FileContexts::load(const std::string &path)
+{
+    std::vector<unsigned char> data;
+    if (!file_read_all(path, &data)) {
+        LOGE("%s: Failed to read file: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::vector<Spec> specs;
+    std::string contents(data.begin(), data.end());
+    size_t line_num = 0;
+
+    for (auto &line : split(contents, "\n")) {
+        ++line_num;
+
+        auto hash = line.find('#');
+        if (hash != std::string::npos) {
+            line.erase(hash);
+        }
+
+        auto fields = tokenize(line, " \t\r");
+
+        if (fields.empty()) {
+            continue;
+        } else if (fields.size() != 2 && fields.size() != 3) {
+            LOGE("%s:%zu: Invalid number of fields", path.c_str(), line_num);
+            errno = EINVAL;
+            return false;
+        }
+
+        Spec spec;
+        spec.pattern = fields[0];
+        spec.has_meta_chars = spec.pattern.find_first_of(".^$?*+|[({\\")
+                != std::string::npos;
+        spec.type = 0;
+        spec.context = fields.back();
+
+        if (fields.size() == 3 && !parse_file_type(fields[1], &spec.type)) {
+            LOGE("%s:%zu: Invalid file type: %s",
+                 path.c_str(), line_num, fields[1].c_str());
+            errno = EINVAL;
+            return false;
+        }
+
+        if (spec.has_meta_chars) {
+            try {
+                spec.regex.assign("^(?:" + spec.pattern + ")$",
+                                  std::regex::ECMAScript
+                                  | std::regex::optimize);
+            } catch (const std::regex_error &e) {
+                LOGE("%s:%zu: Invalid regex: %s: %s",
+                     path.c_str(), line_num, spec.pattern.c_str(), e.what());
+                errno = EINVAL;
+                return false;
+            }
+        }
+
+        specs.push_back(std::move(spec));
+    }
+
+    _specs.swap(specs);
+    return true;
+}
+
+/*!
+ * \brief Look up the label for a path
+ *
+ * \param path Absolute path to match against the specs
+ * \param mode File mode (only the type bits are used)
+ * \param[out] context Matched label
+ *
+ * \return True if a spec matched. False if no spec matched or the matched spec
+ *         has a context of `<<none>>`, which means the path must not be
+ *         relabeled.
+ */
+bool FileContexts::lookup(const std::string &path, mode_t mode,
+                          std::string *context) const
+{
+    const Spec *match = nullptr;
+
+    // Exact specs take priority over regexes
+    for (int pass = 0; pass < 2 && !match; ++pass) {
+        bool want_meta = pass == 1;
+
+        for (auto it = _specs.rbegin(); it != _specs.rend(); ++it) {
+            if (it->has_meta_chars != want_meta
+                    || (it->type != 0 && it->type != (mode & S_IFMT))) {
+                continue;
+            }
+
+            if (want_meta ? std::regex_match(path, it->regex)
+                    : path == it->pattern) {
+                match = &*it;
+                break;
+            }
+        }
+    }
+
+    if (!match || match->context == "<<none>>") {
+        return false;
+    }
+
+    *context = match->context;
+    return true;
+}
+
+/*!
+ * \brief Apply owner, mode, and label rules to a tree in a single pass
+ *
+ * Entries are enumerated and modified relative to directory fds. Labels are
+ * read and written via /proc/self/fd/<dirfd>/<name> when /proc is available.
+ * Subdirectories are handed to idle worker threads when there are any and are
+ * otherwise processed depth-first by the current thread. Symlinks are not
+ * traversed and mountpoints are updated, but not descended into.
+ */
+class MetadataApplier
+{
+public:
+    MetadataApplier(const MetadataRules &rules) : _rules(rules)
+    {
+    }
+
+    bool run(const std::string &path)
+    {
+        struct stat sb;
+        if (lstat(path.c_str(), &sb) < 0) {
+            LOGW("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+            return false;
+        }
+
+        std::string label_path = _rules.label_path.empty()
+                ? path : _rules.label_path;
+
+        int dfd = -1;
+        if (S_ISDIR(sb.st_mode)) {
+            // Open before applying the new mode in case it is more restrictive
+            dfd = open(path.c_str(),
+                       O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (dfd < 0) {
+                LOGW("%s: Failed to open directory: %s",
+                     path.c_str(), strerror(errno));
+                return false;
+            }
+        }
+
+        apply(AT_FDCWD, path.c_str(), path, path, label_path, sb);
+
+        if (dfd < 0) {
+            return finish();
+        }
+
+        _dev = sb.st_dev;
+        _use_proc_fd = access("/proc/self/fd", X_OK) == 0;
+
+        _queue.push_back({ dfd, path, std::move(label_path) });
+        _pending = 1;
+
+        unsigned int n_threads = std::min(std::max(
+                std::thread::hardware_concurrency(), 1u),
+                static_cast<unsigned int>(METADATA_MAX_THREADS));
+
+        run_concurrently(n_threads, [this] { worker_thread(); });
+
+        return finish();
+    }
+
+private:
+    struct Dir
+    {
+        int fd;
+        std::string path;
+        std::string label_path;
+    };
+
+    const MetadataRules &_rules;
+    dev_t _dev;
+    bool _use_proc_fd;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<Dir> _queue;
+    unsigned int _idle = 0;
+    // Number of queued directories that have not been fully processed
+    unsigned int _pending = 0;
+    // errno value of the first failure
+    std::atomic_int _error{0};
+
+    bool finish()
+    {
+        if (_error != 0) {
+            errno = _error;
+            return false;
+        }
+        return true;
+    }
+
+    void set_error(const char *action, const std::string &path)
+    {
+        int saved_errno = errno;
+        LOGW("%s: Failed to %s: %s", path.c_str(), action, strerror(errno));
+
+        int expected = 0;
+        _error.compare_exchange_strong(expected, saved_errno);
+    }
+
+    void worker_thread()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        while (true) {
+            ++_idle;
+            _cv.wait(lock, [&] {
+                return !_queue.empty() || _pending == 0;
+            });
+            --_idle;
+
+            if (_queue.empty()) {
+                break;
+            }
+
+            Dir dir = std::move(_queue.front());
+            _queue.pop_front();
+
+            lock.unlock();
+            apply_contents(dir);
+            lock.lock();
+
+            if (--_pending == 0) {
+                _cv.notify_all();
+            }
+        }
+    }
+
+    bool try_queue(Dir &dir)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_queue.size() >= _idle) {
+                return false;
+            }
+            _queue.push_back(std::move(dir));
+            ++_pending;
+        }
+        _cv.notify_one();
+        return true;
+    }
+
+    // Takes ownership of dir.fd
+    void apply_contents(Dir &dir)
+    {
+        DIR *dp = fdopendir(dir.fd);
+        if (!dp) {
+            set_error("open directory", dir.path);
+            close(dir.fd);
+            return;
+        }
+
+        std::string proc_prefix;
+        if (_use_proc_fd) {
+            proc_prefix = format("/proc/self/fd/%d/", dir.fd);
+        }
+
+        std::string entry_path;
+        std::string xattr_path;
+        std::string label_path;
+
+        struct dirent *ent;
+        while ((ent = readdir(dp))) {
+            if (strcmp(ent->d_name, ".") == 0
+                    || strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+
+            entry_path = dir.path;
+            entry_path += '/';
+            entry_path += ent->d_name;
+
+            label_path = dir.label_path;
+            label_path += '/';
+            label_path += ent->d_name;
+
+            if (_use_proc_fd) {
+                xattr_path = proc_prefix;
+                xattr_path += ent->d_name;
+            } else {
+                xattr_path = entry_path;
+            }
+
+            struct stat sb;
+            if (fstatat(dir.fd, ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+                set_error("stat", entry_path);
+                continue;
+            }
+
+            Dir child;
+            child.fd = -1;
+
+            // Don't descend into mountpoints
+            if (S_ISDIR(sb.st_mode) && sb.st_dev == _dev) {
+                child.fd = openat(dir.fd, ent->d_name, O_RDONLY | O_DIRECTORY
+                                  | O_NOFOLLOW | O_CLOEXEC);
+                if (child.fd < 0) {
+                    set_error("open directory", entry_path);
+                }
+            }
+
+            apply(dir.fd, ent->d_name, entry_path, xattr_path, label_path, sb);
+
+            if (child.fd < 0) {
+                continue;
+            }
+
+            child.path = std::move(entry_path);
+            child.label_path = std::move(label_path);
+
+            if (!try_queue(child)) {
+                apply_contents(child);
+            }
+        }
+
+        closedir(dp);
+    }
+
+    void apply(int dfd, const char *name, const std::string &path,
+               const std::string &xattr_path, const std::string &label_path,
+               const struct stat &sb)
+    {
+        bool chowned = false;
+
+        if ((_rules.flags & METADATA_SET_OWNER)
+                && (sb.st_uid != _rules.uid || sb.st_gid != _rules.gid)) {
+            if (fchownat(dfd, name, _rules.uid, _rules.gid,
+                         AT_SYMLINK_NOFOLLOW) < 0) {
+                set_error("chown", path);
+            } else {
+                chowned = true;
+            }
+        }
+
+        if ((_rules.flags & METADATA_SET_MODE) && !S_ISLNK(sb.st_mode)) {
+            mode_t mode = S_ISDIR(sb.st_mode)
+                    ? _rules.dir_mode : _rules.file_mode;
+
+            // chown() may have cleared the setuid and setgid bits
+            if ((chowned || (sb.st_mode & 07777) != (mode & 07777))
+                    && fchmodat(dfd, name, mode, 0) < 0) {
+                set_error("chmod", path);
+            }
+        }
+
+        if (_rules.flags & METADATA_SET_CONTEXT) {
+            if (_rules.file_contexts) {
+                std::string context;
+                if (_rules.file_contexts->lookup(
+                        label_path, sb.st_mode, &context)) {
+                    set_context(path, xattr_path, context);
+                }
+            } else {
+                set_context(path, xattr_path, _rules.context);
+            }
+        }
+    }
+
+    void set_context(const std::string &path, const std::string &xattr_path,
+                     const std::string &context)
+    {
+        // Don't touch the inode (and its ctime) if nothing would change
+        char current[SELINUX_CONTEXT_MAX];
+        ssize_t n = lgetxattr(xattr_path.c_str(), SELINUX_XATTR,
+                              current, sizeof(current));
+        if (n > 0) {
+            size_t len = static_cast<size_t>(n);
+            if (current[len - 1] == '\0') {
+                --len;
+            }
+            if (len == context.size()
+                    && memcmp(current, context.data(), len) == 0) {
+                return;
+            }
+        }
+
+        if (lsetxattr(xattr_path.c_str(), SELINUX_XATTR, context.c_str(),
+                      context.size() + 1, 0) < 0) {
+            set_error("set context", path);
+        }
+    }
+};
+
+/*!
+ * \brief Recursively apply owner, mode, and SELinux label rules to a tree
+ *
+ * This is equivalent to running util::chown(), util::chmod(), and
+ * util::selinux_lset_context_recursive() on the same tree, but walks it only
+ * once. Syscalls are skipped for entries that already have the target owner,
+ * mode, or label. All entries are processed even if some fail.
+ *
+ * \param path Root of the tree
+ * \param rules Metadata to apply
+ *
+ * \return True if all entries were successfully updated. False and errno set
+ *         to the error of the first failure if any operation failed.
+ */
+bool apply_metadata_recursive(const std::string &path,
+                              const MetadataRules &rules)
+{
+    MetadataApplier applier(rules);
+    return applier.run(path);
+}
+
+}
+}
@@ -20,6 +20,7 @@
 #include "mbutil/mount.h"
 
 #include <memory>
+#include <mutex>
 #include <vector>
 
 #include <cerrno>
@@ -44,6 +45,10 @@
 
 #define MAX_UNMOUNT_TRIES 5
 
+// Serializes finding and attaching unused loop devices, since threads mounting
+// images concurrently would otherwise be handed the same loop device
+static std::mutex loopdev_setup_mutex;
+
 #define DELETED_SUFFIX " (deleted)"
 
 namespace mb
@@ -225,6 +230,8 @@ bool mount(const char *source, const char *target, const char *fstype,
     }
 
     if (need_loopdev) {
+        std::unique_lock<std::mutex> lock(loopdev_setup_mutex);
+
         std::string loopdev = util::loopdev_find_unused();
         if (loopdev.empty()) {
             LOGE("Failed to find unused loop device: %s", strerror(errno));
@@ -240,6 +247,8 @@ bool mount(const char *source, const char *target, const char *fstype,
             return false;
         }
 
+        lock.unlock();
+
         if (::mount(loopdev.c_str(), target, fstype, mount_flags, data) < 0) {
             util::loopdev_remove_device(loopdev);
             return false;
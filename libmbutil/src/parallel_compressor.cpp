@@ -0,0 +1,467 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/parallel_compressor.h"
+
+#include <algorithm>
+#include <utility>
+
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+
+#include <lz4.h>
+#include <zlib.h>
+
+#include "mblog/logging.h"
+#include "mbutil/sched_policy.h"
+
+// Same block size as pigz. Large enough to amortize the synchronization cost,
+// small enough to keep all workers busy for small files.
+#define GZIP_BLOCK_SIZE         (128 * 1024)
+// Size of the deflate window that each block is primed with
+#define GZIP_DICT_SIZE          (32 * 1024)
+
+// Largest block size allowed by the LZ4 frame format
+#define LZ4_BLOCK_SIZE          (4 * 1024 * 1024)
+
+// LZ4 frame descriptor: version 01, independent blocks, no checksums, 4 MiB
+// maximum block size. The last byte is (XXH32(FLG, BD) >> 8) & 0xff.
+#define LZ4_FRAME_MAGIC         0x184D2204u
+#define LZ4_FRAME_FLG           0x60
+#define LZ4_FRAME_BD            0x70
+#define LZ4_FRAME_HC            0x73
+#define LZ4_UNCOMPRESSED_FLAG   0x80000000u
+
+namespace mb
+{
+namespace util
+{
+
+struct ParallelCompressor::Job
+{
+    std::vector<unsigned char> in;
+    std::vector<unsigned char> out;
+    // Tail of the previous block (gzip only)
+    std::vector<unsigned char> dict;
+    uint32_t crc;
+    bool last;
+    bool done;
+    bool failed;
+};
+
+static inline void put_le32(std::vector<unsigned char> &buf, uint32_t value)
+{
+    buf.push_back(value & 0xff);
+    buf.push_back((value >> 8) & 0xff);
+    buf.push_back((value >> 16) & 0xff);
+    buf.push_back((value >> 24) & 0xff);
+}
+
+/*!
+ * \class ParallelCompressor
+ *
+ * \brief Block-parallel gzip/lz4 compressor
+ *
+ * The input stream is split into fixed-size blocks that are compressed
+ * independently on a pool of worker threads and written to the output in
+ * order.
+ *
+ * - gzip: The output is a single standard gzip member. Every block except the
+ *   last one is terminated with a sync flush so that the raw deflate streams
+ *   can be concatenated. Like pigz, each block is primed with the last 32 KiB
+ *   of the previous block to avoid losing much compression ratio.
+ * - lz4: The output is a single LZ4 frame with independent blocks.
+ *
+ * Both are readable by the regular libarchive gzip and lz4 read filters.
+ */
+
+/*!
+ * \brief Construct a new compressor
+ *
+ * \param type Compression type (must satisfy is_supported())
+ * \param threads Number of worker threads
+ */
+ParallelCompressor::ParallelCompressor(compression_type type,
+                                       unsigned int threads)
+    : _type(type)
+    , _threads(std::max(threads, 1u))
+    , _block_size(type == compression_type::LZ4
+            ? LZ4_BLOCK_SIZE : GZIP_BLOCK_SIZE)
+    , _fd(-1)
+    , _error(0)
+    , _open(false)
+    , _stop(false)
+    , _crc(0)
+    , _total_in(0)
+{
+}
+
+ParallelCompressor::~ParallelCompressor()
+{
+    stop_workers();
+}
+
+/*!
+ * \brief Set a function to be called with all data written to the output
+ *
+ * The observer is called from the thread that calls open(), write(), and
+ * close(), in stream order. This allows the output to be hashed without
+ * reading it back.
+ */
+void ParallelCompressor::set_output_observer(OutputObserver observer)
+{
+    _observer = std::move(observer);
+}
+
+/*!
+ * \brief Check whether a compression type can be compressed in parallel
+ */
+bool ParallelCompressor::is_supported(compression_type type)
+{
+    return type == compression_type::GZIP || type == compression_type::LZ4;
+}
+
+/*!
+ * \brief Start compressing to a file descriptor
+ *
+ * The file descriptor is not closed by the compressor.
+ *
+ * \return Whether the stream header was written and the workers were started
+ */
+bool ParallelCompressor::open(int fd)
+{
+    if (_open || !is_supported(_type)) {
+        _error = EINVAL;
+        return false;
+    }
+
+    _fd = fd;
+    _error = 0;
+    _crc = crc32(0, nullptr, 0);
+    _total_in = 0;
+
+    std::vector<unsigned char> header;
+
+    if (_type == compression_type::GZIP) {
+        // ID1, ID2, CM (deflate), FLG, MTIME (4 bytes), XFL, OS (Unix)
+        header = { 0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03 };
+    } else {
+        put_le32(header, LZ4_FRAME_MAGIC);
+        header.push_back(LZ4_FRAME_FLG);
+        header.push_back(LZ4_FRAME_BD);
+        header.push_back(LZ4_FRAME_HC);
+    }
+
+    if (!write_fully(header.data(), header.size())) {
+        return false;
+    }
+
+    _stop = false;
+    for (unsigned int i = 0; i < _threads; ++i) {
+        _workers.emplace_back(&ParallelCompressor::worker_loop, this);
+    }
+
+    _cur = std::make_shared<Job>();
+    _cur->in.reserve(_block_size);
+    _open = true;
+
+    return true;
+}
+
+/*!
+ * \brief Compress data
+ *
+ * \return Whether the data was queued for compression and all completed blocks
+ *         were successfully written
+ */
+bool ParallelCompressor::write(const void *data, size_t size)
+{
+    if (!_open) {
+        _error = EBADF;
+        return false;
+    }
+
+    auto ptr = static_cast<const unsigned char *>(data);
+
+    while (size > 0) {
+        size_t n = std::min(size, _block_size - _cur->in.size());
+        _cur->in.insert(_cur->in.end(), ptr, ptr + n);
+        ptr += n;
+        size -= n;
+
+        if (_cur->in.size() == _block_size && !submit(false)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Flush remaining data, write the stream trailer, and stop the workers
+ *
+ * \return Whether all data was successfully compressed and written
+ */
+bool ParallelCompressor::close()
+{
+    if (!_open) {
+        _error = EBADF;
+        return false;
+    }
+
+    // gzip needs a final block (possibly empty) to terminate the deflate
+    // stream. LZ4 frames have no such requirement.
+    bool ret = true;
+    if (_type == compression_type::GZIP || !_cur->in.empty()) {
+        ret = submit(true);
+    }
+
+    while (ret && !_in_flight.empty()) {
+        ret = drain_one();
+    }
+
+    if (ret) {
+        std::vector<unsigned char> trailer;
+
+        if (_type == compression_type::GZIP) {
+            put_le32(trailer, _crc);
+            put_le32(trailer, static_cast<uint32_t>(_total_in));
+        } else {
+            // End mark
+            put_le32(trailer, 0);
+        }
+
+        ret = write_fully(trailer.data(), trailer.size());
+    }
+
+    stop_workers();
+    _in_flight.clear();
+    _pending.clear();
+    _cur.reset();
+    _open = false;
+
+    return ret;
+}
+
+/*!
+ * \brief Get errno value for the last error
+ */
+int ParallelCompressor::error() const
+{
+    return _error;
+}
+
+bool ParallelCompressor::write_fully(const void *data, size_t size)
+{
+    if (_observer) {
+        _observer(data, size);
+    }
+
+    auto ptr = static_cast<const unsigned char *>(data);
+
+    while (size > 0) {
+        ssize_t n = ::write(_fd, ptr, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            _error = errno;
+            return false;
+        }
+        ptr += n;
+        size -= n;
+
+        throttle_write(static_cast<size_t>(n));
+    }
+
+    return true;
+}
+
+bool ParallelCompressor::submit(bool last)
+{
+    auto job = std::move(_cur);
+    job->last = last;
+    job->done = false;
+    job->failed = false;
+
+    if (!last) {
+        _cur = std::make_shared<Job>();
+        _cur->in.reserve(_block_size);
+
+        if (_type == compression_type::GZIP) {
+            size_t dict_size = std::min<size_t>(job->in.size(), GZIP_DICT_SIZE);
+            _cur->dict.assign(job->in.end() - dict_size, job->in.end());
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _pending.push_back(job);
+        _in_flight.push_back(job);
+    }
+    _work_cv.notify_one();
+
+    // Bound memory usage by keeping at most two blocks per worker in flight
+    while (_in_flight.size() > 2 * _threads) {
+        if (!drain_one()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool ParallelCompressor::drain_one()
+{
+    std::shared_ptr<Job> job = _in_flight.front();
+
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _done_cv.wait(lock, [&]{ return job->done; });
+    }
+
+    _in_flight.pop_front();
+
+    if (job->failed) {
+        LOGE("Failed to compress %zu byte block", job->in.size());
+        _error = EIO;
+        return false;
+    }
+
+    if (_type == compression_type::GZIP) {
+        _crc = crc32_combine(_crc, job->crc, job->in.size());
+        _total_in += job->in.size();
+    }
+
+    return write_fully(job->out.data(), job->out.size());
+}
+
+void ParallelCompressor::stop_workers()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _work_cv.notify_all();
+
+    for (auto &t : _workers) {
+        t.join();
+    }
+    _workers.clear();
+}
+
+void ParallelCompressor::worker_loop()
+{
+    while (true) {
+        std::shared_ptr<Job> job;
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _work_cv.wait(lock, [&]{ return _stop || !_pending.empty(); });
+            if (_pending.empty()) {
+                return;
+            }
+            job = std::move(_pending.front());
+            _pending.pop_front();
+        }
+
+        bool ret = _type == compression_type::GZIP
+                ? compress_gzip(*job) : compress_lz4(*job);
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            job->failed = !ret;
+            job->done = true;
+        }
+        _done_cv.notify_all();
+    }
+}
+
+bool ParallelCompressor::compress_gzip(Job &job)
+{
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+
+    // Raw deflate stream since the gzip header and trailer are written
+    // separately
+    if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+
+    if (!job.dict.empty() && deflateSetDictionary(
+            &strm, job.dict.data(), job.dict.size()) != Z_OK) {
+        deflateEnd(&strm);
+        return false;
+    }
+
+    // deflateBound() does not account for the sync flush marker
+    job.out.resize(deflateBound(&strm, job.in.size()) + 16);
+
+    strm.next_in = job.in.data();
+    strm.avail_in = job.in.size();
+    strm.next_out = job.out.data();
+    strm.avail_out = job.out.size();
+
+    int ret = deflate(&strm, job.last ? Z_FINISH : Z_SYNC_FLUSH);
+    bool ok = (job.last ? ret == Z_STREAM_END : ret == Z_OK)
+            && strm.avail_in == 0;
+
+    job.out.resize(strm.total_out);
+    deflateEnd(&strm);
+
+    job.crc = crc32(0, job.in.data(), job.in.size());
+
+    return ok;
+}
+
+bool ParallelCompressor::compress_lz4(Job &job)
+{
+    int in_size = static_cast<int>(job.in.size());
+    int bound = LZ4_compressBound(in_size);
+
+    job.out.resize(4 + bound);
+
+    int n = LZ4_compress_default(
+            reinterpret_cast<const char *>(job.in.data()),
+            reinterpret_cast<char *>(job.out.data() + 4), in_size, bound);
+    uint32_t block_size;
+
+    if (n > 0 && n < in_size) {
+        block_size = n;
+        job.out.resize(4 + n);
+    } else {
+        // Incompressible data is stored as-is
+        block_size = in_size | LZ4_UNCOMPRESSED_FLAG;
+        job.out.resize(4);
+        job.out.insert(job.out.end(), job.in.begin(), job.in.end());
+    }
+
+    job.out[0] = block_size & 0xff;
+    job.out[1] = (block_size >> 8) & 0xff;
+    job.out[2] = (block_size >> 16) & 0xff;
+    job.out[3] = (block_size >> 24) & 0xff;
+
+    return true;
+}
+
+}
+}
@@ -19,17 +19,25 @@
 
 #include "mbutil/path.h"
 
+#include <algorithm>
 #include <vector>
 #include <cerrno>
+#include <climits>
 #include <cstdlib>
 #include <cstring>
 #include <libgen.h>
+#include <poll.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "mblog/logging.h"
+#include "mbutil/finally.h"
 #include "mbutil/time.h"
 
+// Interval for rechecking the path while waiting for inotify events
+#define WAIT_RECHECK_MS         1000
+
 namespace mb
 {
 namespace util
@@ -329,9 +337,27 @@ int path_compare(const std::string &path1, const std::string &path2)
     return path_join(path1_pieces).compare(path_join(path2_pieces));
 }
 
-bool wait_for_path(const char *path, unsigned int timeout_ms)
+/*!
+ * \brief Find the deepest existing directory that \p path would be created in
+ */
+static std::string existing_parent(const std::string &path)
+{
+    std::string dir = dir_name(path);
+    struct stat sb;
+
+    while (stat(dir.c_str(), &sb) < 0 || !S_ISDIR(sb.st_mode)) {
+        std::string parent = dir_name(dir);
+        if (parent == dir) {
+            break;
+        }
+        dir = std::move(parent);
+    }
+
+    return dir;
+}
+
+static bool wait_for_path_polling(const char *path, uint64_t until)
 {
-    uint64_t until = util::current_time_ms() + timeout_ms;
     struct stat sb;
     int ret;
 
@@ -342,6 +368,88 @@ bool wait_for_path(const char *path, unsigned int timeout_ms)
     return ret == 0;
 }
 
+/*!
+ * \brief Wait for a path to exist
+ *
+ * The deepest existing parent directory of \p path is watched with inotify,
+ * so this returns as soon as the path (or a missing intermediate directory) is
+ * created instead of after a polling interval. The path is also rechecked
+ * every WAIT_RECHECK_MS in case it appears without generating an event on the
+ * watched directory (eg. a symlink whose target is created later). If inotify
+ * is unavailable, the path is polled every 10ms.
+ *
+ * \param path Path to wait for
+ * \param timeout_ms Maximum time to wait in milliseconds
+ *
+ * \return True if the path exists. False if the timeout was reached.
+ */
+bool wait_for_path(const char *path, unsigned int timeout_ms)
+{
+    uint64_t until = util::current_time_ms() + timeout_ms;
+    struct stat sb;
+
+    if (stat(path, &sb) == 0) {
+        return true;
+    }
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        return wait_for_path_polling(path, until);
+    }
+
+    auto close_fd = finally([&] {
+        close(fd);
+    });
+
+    std::string watched;
+    int wd = -1;
+    // Large enough for at least one event with a maximum length name
+    alignas(struct inotify_event) char buf[sizeof(struct inotify_event)
+                                           + NAME_MAX + 1];
+
+    while (true) {
+        // Move the watch down as intermediate directories are created
+        std::string dir = existing_parent(path);
+        if (dir != watched) {
+            if (wd >= 0) {
+                inotify_rm_watch(fd, wd);
+            }
+
+            wd = inotify_add_watch(fd, dir.c_str(),
+                                   IN_CREATE | IN_MOVED_TO | IN_DELETE_SELF
+                                   | IN_MOVE_SELF);
+            if (wd < 0) {
+                return wait_for_path_polling(path, until);
+            }
+
+            watched = std::move(dir);
+        }
+
+        // Check after the watch is in place so no event can be missed
+        if (stat(path, &sb) == 0) {
+            return true;
+        }
+
+        uint64_t now = util::current_time_ms();
+        if (now >= until) {
+            return false;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+
+        int ret = poll(&pfd, 1, static_cast<int>(
+                std::min<uint64_t>(until - now, WAIT_RECHECK_MS)));
+        if (ret < 0 && errno != EINTR) {
+            return wait_for_path_polling(path, until);
+        }
+
+        // The events themselves don't matter since the path is rechecked
+        while (read(fd, buf, sizeof(buf)) > 0);
+    }
+}
+
 bool path_exists(const char *path, bool follow_symlinks)
 {
     struct stat sb;
@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/progress.h"
+
+#include <utility>
+
+#include <time.h>
+
+namespace mb
+{
+namespace util
+{
+
+static uint64_t monotonic_ms()
+{
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    // The coarse clock is resolved entirely in the vDSO and its resolution is
+    // far finer than the reporting interval
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*!
+ * \class ProgressTracker
+ *
+ * \brief Thread-safe file and byte counters with periodic progress reports
+ *
+ * The counters are updated with relaxed atomics, so they can be updated from
+ * any number of worker threads. Whichever thread updates a counter after the
+ * reporting interval has elapsed calls the callback. The callback is never
+ * called concurrently with itself.
+ */
+
+/*!
+ * \brief Construct a progress tracker
+ *
+ * \param cb Callback to report progress to (may be empty)
+ * \param interval_ms Minimum time between reports
+ */
+ProgressTracker::ProgressTracker(ProgressCallback cb, unsigned int interval_ms)
+    : _cb(std::move(cb))
+    , _interval_ms(interval_ms)
+    , _start_ms(monotonic_ms())
+    , _files(0)
+    , _bytes(0)
+    , _total_bytes(0)
+    , _next_report_ms(_start_ms + interval_ms)
+    , _last_report_ms(_start_ms)
+    , _last_report_bytes(0)
+{
+}
+
+/*!
+ * \brief Set the total number of bytes for computing the ETA
+ */
+void ProgressTracker::set_total_bytes(uint64_t total)
+{
+    _total_bytes.store(total, std::memory_order_relaxed);
+}
+
+void ProgressTracker::add_file()
+{
+    _files.fetch_add(1, std::memory_order_relaxed);
+    maybe_report();
+}
+
+void ProgressTracker::add_bytes(uint64_t n)
+{
+    _bytes.fetch_add(n, std::memory_order_relaxed);
+    maybe_report();
+}
+
+/*!
+ * \brief Set the absolute number of bytes processed
+ *
+ * This is useful when the position is known, eg. the number of bytes
+ * consumed from a compressed stream.
+ */
+void ProgressTracker::set_bytes(uint64_t n)
+{
+    _bytes.store(n, std::memory_order_relaxed);
+    maybe_report();
+}
+
+/*!
+ * \brief Get the current counters
+ *
+ * The rate is the average since the tracker was created.
+ */
+ProgressStats ProgressTracker::stats() const
+{
+    ProgressStats s;
+    s.files = _files.load(std::memory_order_relaxed);
+    s.bytes = _bytes.load(std::memory_order_relaxed);
+    s.total_bytes = _total_bytes.load(std::memory_order_relaxed);
+    s.elapsed_s = (monotonic_ms() - _start_ms) / 1000.0;
+    s.bytes_per_sec = s.elapsed_s > 0 ? s.bytes / s.elapsed_s : 0;
+    s.eta_s = -1;
+    s.finished = false;
+
+    if (s.total_bytes > 0 && s.bytes_per_sec > 0
+            && s.bytes <= s.total_bytes) {
+        s.eta_s = (s.total_bytes - s.bytes) / s.bytes_per_sec;
+    }
+
+    return s;
+}
+
+/*!
+ * \brief Report the final counters
+ *
+ * The callback is always called, regardless of the interval.
+ */
+void ProgressTracker::finish()
+{
+    std::lock_guard<std::mutex> lock(_report_lock);
+    report(monotonic_ms(), true);
+}
+
+void ProgressTracker::maybe_report()
+{
+    if (!_cb) {
+        return;
+    }
+
+    uint64_t now = monotonic_ms();
+    if (now < _next_report_ms.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(_report_lock, std::try_to_lock);
+    if (!lock.owns_lock()
+            || now < _next_report_ms.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    report(now, false);
+}
+
+// Must be called with _report_lock held
+void ProgressTracker::report(uint64_t now_ms, bool finished)
+{
+    _next_report_ms.store(now_ms + _interval_ms, std::memory_order_relaxed);
+
+    ProgressStats s = stats();
+    s.finished = finished;
+
+    // The current rate rather than the average so that stalls are visible
+    if (now_ms > _last_report_ms) {
+        uint64_t delta = s.bytes >= _last_report_bytes
+                ? s.bytes - _last_report_bytes : 0;
+        s.bytes_per_sec = delta * 1000.0 / (now_ms - _last_report_ms);
+    }
+
+    _last_report_ms = now_ms;
+    _last_report_bytes = s.bytes;
+
+    if (_cb) {
+        _cb(s);
+    }
+}
+
+}
+}
@@ -23,9 +23,14 @@
 #include <mutex>
 #include <vector>
 
+#include <cerrno>
 #include <cstdio>
 #include <cstring>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "mbcommon/common.h"
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
@@ -224,100 +229,371 @@ bool property_list(PropertyListCb prop_fn, void *cookie)
 
 bool property_get_all(std::unordered_map<std::string, std::string> &map)
 {
-    return libc_system_property_foreach(
-            [](const prop_info *pi, void *cookie) {
-        auto *map = static_cast<std::unordered_map<std::string, std::string> *>(cookie);
-        std::string name;
-        std::string value;
+    PropertySnapshot snapshot;
+    if (!snapshot.update()) {
+        return false;
+    }
 
-        read_property(pi, name, value);
-        (*map)[name] = value;
-    }, &map);
+    for (auto &prop : snapshot.properties()) {
+        map[prop.name] = prop.value;
+    }
+
+    return true;
+}
+
+PropertySnapshot::PropertySnapshot()
+    : _valid(false)
+    , _area_serial(0)
+    , _changed(nullptr)
+{
+}
+
+/*!
+ * \brief Refresh the snapshot
+ *
+ * \param[out] changed If not null, the indexes (into properties()) of the
+ *                     properties that were added or changed are appended
+ *
+ * \return Whether the property area could be iterated
+ */
+bool PropertySnapshot::update(std::vector<size_t> *changed)
+{
+    initialize_properties();
+
+    uint32_t area_serial = mb__system_property_area_serial();
+    if (_valid && area_serial != static_cast<uint32_t>(-1)
+            && area_serial == _area_serial) {
+        return true;
+    }
+
+    _changed = changed;
+    int ret = mb__system_property_foreach(&update_cb, this);
+    _changed = nullptr;
+
+    if (ret < 0) {
+        return false;
+    }
+
+    // The area serial was read before iterating, so changes made during the
+    // iteration will cause the next update() to iterate again
+    _valid = true;
+    _area_serial = area_serial;
+
+    return true;
+}
+
+const std::vector<PropertySnapshot::Property> &
+PropertySnapshot::properties() const
+{
+    return _props;
+}
+
+void PropertySnapshot::update_cb(const prop_info *pi, void *cookie)
+{
+    auto *snapshot = static_cast<PropertySnapshot *>(cookie);
+    const char *name = mb__system_property_name(pi);
+    size_t index;
+    bool added = false;
+
+    auto it = snapshot->_index.find(pi);
+    if (it != snapshot->_index.end()) {
+        index = it->second;
+
+        // Properties in old areas have no usable serial, so always reread
+        if (name && mb__system_property_serial(pi)
+                == snapshot->_props[index].serial) {
+            return;
+        }
+    } else {
+        index = snapshot->_props.size();
+        snapshot->_props.push_back({pi, name, {}, 0});
+        snapshot->_index[pi] = index;
+        added = true;
+    }
+
+    struct Ctx
+    {
+        Property *prop;
+        std::vector<std::unique_ptr<std::string>> *names;
+        bool changed;
+    };
+
+    Ctx ctx{&snapshot->_props[index], &snapshot->_names, added};
+
+    mb__system_property_read_callback(
+            pi, [](void *cookie, const char *name, const char *value,
+                   uint32_t serial) {
+        auto *ctx = static_cast<Ctx *>(cookie);
+
+        if (!ctx->prop->name) {
+            ctx->names->emplace_back(new std::string(name));
+            ctx->prop->name = ctx->names->back()->c_str();
+        }
+
+        if (ctx->prop->serial != serial || ctx->prop->value != value) {
+            ctx->prop->value = value;
+            ctx->prop->serial = serial;
+            ctx->changed = true;
+        }
+    }, &ctx);
+
+    if (ctx.changed && snapshot->_changed) {
+        snapshot->_changed->push_back(index);
+    }
 }
 
 // Properties file functions
 
-enum class PropIterAction
+// Upper bound on the number of cached files. The cache is simply cleared when
+// it is full since only a handful of files are read in practice.
+#define PROPERTY_FILE_CACHE_MAX     16
+
+static size_t hash_key(const char *key, size_t size)
 {
-    CONTINUE,
-    STOP,
-};
+    // FNV-1a
+    size_t hash = static_cast<size_t>(14695981039346656037ULL);
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char>(key[i]);
+        hash *= static_cast<size_t>(1099511628211ULL);
+    }
+    return hash;
+}
 
-typedef PropIterAction (*PropIterCb)(const std::string &key,
-                                     const std::string &value,
-                                     void *cookie);
+PropertyFile::PropertyFile()
+    : _dev(0)
+    , _ino(0)
+    , _size(-1)
+    , _mtime_sec(0)
+    , _mtime_nsec(0)
+{
+}
 
-static bool iterate_property_file(const std::string &path, PropIterCb cb,
-                                  void *cookie)
+bool PropertyFile::load(const std::string &path)
 {
-    ScopedFILE fp(fopen(path.c_str(), "r"), &fclose);
-    if (!fp) {
+    _buf.clear();
+    _entries.clear();
+    _index.clear();
+    _size = -1;
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
         return false;
     }
 
-    char *line = nullptr;
-    size_t len = 0;
-    ssize_t read;
-
-    auto free_line = finally([&] {
-        free(line);
+    auto close_fd = finally([&] {
+        close(fd);
     });
 
-    while ((read = getline(&line, &len, fp.get())) >= 0) {
-        if (read == 0 || line[0] == '#') {
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        return false;
+    }
+
+    // st_size is just a hint (eg. for files in /proc)
+    _buf.reserve(static_cast<size_t>(sb.st_size) + 1);
+
+    char buf[8192];
+    ssize_t n;
+
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            _buf.clear();
+            return false;
+        }
+        _buf.append(buf, static_cast<size_t>(n));
+    }
+
+    _dev = sb.st_dev;
+    _ino = sb.st_ino;
+    _size = sb.st_size;
+    _mtime_sec = sb.st_mtim.tv_sec;
+    _mtime_nsec = sb.st_mtim.tv_nsec;
+
+    parse();
+    build_index();
+
+    return true;
+}
+
+bool PropertyFile::is_stale(const std::string &path) const
+{
+    struct stat sb;
+
+    if (stat(path.c_str(), &sb) < 0) {
+        return true;
+    }
+
+    return _size < 0
+            || sb.st_dev != _dev
+            || sb.st_ino != _ino
+            || sb.st_size != _size
+            || sb.st_mtim.tv_sec != _mtime_sec
+            || sb.st_mtim.tv_nsec != _mtime_nsec;
+}
+
+void PropertyFile::parse()
+{
+    size_t pos = 0;
+
+    while (pos < _buf.size()) {
+        size_t end = _buf.find('\n', pos);
+        if (end == std::string::npos) {
+            end = _buf.size();
+        }
+
+        size_t line = pos;
+        size_t line_end = end;
+        pos = end + 1;
+
+        // Values end at the first NUL byte and lines with a NUL byte before
+        // the equals sign have no key, as with the C string parsing in earlier
+        // versions
+        size_t nul = _buf.find('\0', line);
+        if (nul < line_end) {
+            line_end = nul;
+        }
+
+        if (line == line_end || _buf[line] == '#') {
             // Skip empty and comment lines
             continue;
         }
 
-        char *equals = strchr(line, '=');
-        if (!equals) {
+        size_t equals = _buf.find('=', line);
+        if (equals >= line_end) {
             // No equals in line
             continue;
         }
 
-        *equals = '\0';
+        Entry entry;
+        entry.key_offset = line;
+        entry.key_size = equals - line;
+        entry.value_offset = equals + 1;
+        entry.value_size = line_end - equals - 1;
+
+        _entries.push_back(entry);
+    }
+}
+
+void PropertyFile::build_index()
+{
+    // Keep the load factor at or below 0.5
+    size_t capacity = 16;
+    while (capacity < _entries.size() * 2) {
+        capacity *= 2;
+    }
+
+    _index.assign(capacity, 0);
 
-        if (line[read - 1] == '\n') {
-            line[read - 1] = '\0';
+    for (size_t i = 0; i < _entries.size(); ++i) {
+        const Entry &entry = _entries[i];
+        const char *key = _buf.data() + entry.key_offset;
+
+        // First occurrence wins
+        if (find(key, entry.key_size)) {
+            continue;
         }
 
-        if (cb(line, equals + 1, cookie) == PropIterAction::STOP) {
-            return true;
+        size_t slot = hash_key(key, entry.key_size) & (capacity - 1);
+        while (_index[slot] != 0) {
+            slot = (slot + 1) & (capacity - 1);
         }
+        _index[slot] = i + 1;
     }
+}
+
+const PropertyFile::Entry * PropertyFile::find(const char *key,
+                                                size_t key_size) const
+{
+    if (_index.empty()) {
+        return nullptr;
+    }
+
+    size_t mask = _index.size() - 1;
+    size_t slot = hash_key(key, key_size) & mask;
 
-    return !ferror(fp.get());
+    while (_index[slot] != 0) {
+        const Entry &entry = _entries[_index[slot] - 1];
+        if (entry.key_size == key_size
+                && memcmp(_buf.data() + entry.key_offset, key, key_size) == 0) {
+            return &entry;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    return nullptr;
 }
 
-bool property_file_get(const std::string &path, const std::string &key,
-                       std::string &value_out)
+bool PropertyFile::get(const std::string &key, std::string &value_out) const
 {
-    struct Ctx
-    {
-        const std::string *key;
-        std::string *value_out;
-        bool found;
-    };
+    const Entry *entry = find(key.data(), key.size());
+    if (!entry) {
+        return false;
+    }
 
-    Ctx ctx{&key, &value_out, false};
+    value_out.assign(_buf, entry->value_offset, entry->value_size);
+    return true;
+}
 
-    bool ret = iterate_property_file(
-            path, [](const std::string &key, const std::string &value,
-                     void *cookie){
-        auto *ctx = static_cast<Ctx *>(cookie);
-        if (key == *ctx->key) {
-            *ctx->value_out = value;
-            ctx->found = true;
-            return PropIterAction::STOP;
+bool PropertyFile::list(PropertyListCb prop_fn, void *cookie) const
+{
+    std::string key;
+    std::string value;
+
+    for (auto const &entry : _entries) {
+        key.assign(_buf, entry.key_offset, entry.key_size);
+        value.assign(_buf, entry.value_offset, entry.value_size);
+        prop_fn(key, value, cookie);
+    }
+
+    return true;
+}
+
+static std::mutex property_file_cache_lock;
+static std::unordered_map<std::string, std::shared_ptr<const PropertyFile>>
+        property_file_cache;
+
+static std::shared_ptr<const PropertyFile>
+get_property_file(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(property_file_cache_lock);
+
+    auto it = property_file_cache.find(path);
+    if (it != property_file_cache.end()) {
+        if (!it->second->is_stale(path)) {
+            return it->second;
         }
-        return PropIterAction::CONTINUE;
-    }, &ctx);
+        property_file_cache.erase(it);
+    }
+
+    std::shared_ptr<PropertyFile> file = std::make_shared<PropertyFile>();
+    if (!file->load(path)) {
+        return {};
+    }
+
+    if (property_file_cache.size() >= PROPERTY_FILE_CACHE_MAX) {
+        property_file_cache.clear();
+    }
+    property_file_cache[path] = file;
+
+    return file;
+}
+
+bool property_file_get(const std::string &path, const std::string &key,
+                       std::string &value_out)
+{
+    auto file = get_property_file(path);
+    if (!file) {
+        return false;
+    }
 
-    if (!ctx.found) {
+    if (!file->get(key, value_out)) {
         value_out.clear();
     }
 
-    return ret;
+    return true;
 }
 
 std::string property_file_get_string(const std::string &path,
@@ -349,21 +625,12 @@ bool property_file_get_bool(const std::string &path, const std::string &key,
 bool property_file_list(const std::string &path, PropertyListCb prop_fn,
                         void *cookie)
 {
-    struct Ctx
-    {
-        PropertyListCb prop_fn;
-        void *cookie;
-    };
-
-    Ctx ctx{prop_fn, cookie};
+    auto file = get_property_file(path);
+    if (!file) {
+        return false;
+    }
 
-    return iterate_property_file(
-            path, [](const std::string &key, const std::string &value,
-                     void *cookie){
-        auto *ctx = static_cast<Ctx *>(cookie);
-        ctx->prop_fn(key, value, ctx->cookie);
-        return PropIterAction::CONTINUE;
-    }, &ctx);
+    return file->list(prop_fn, cookie);
 }
 
 bool property_file_get_all(const std::string &path,
@@ -379,6 +646,12 @@ bool property_file_get_all(const std::string &path,
 bool property_file_write_all(const std::string &path,
                              const std::unordered_map<std::string, std::string> &map)
 {
+    {
+        // Don't rely on the mtime changing for the cached copy
+        std::lock_guard<std::mutex> lock(property_file_cache_lock);
+        property_file_cache.erase(path);
+    }
+
     ScopedFILE fp(fopen(path.c_str(), "wb"), fclose);
     if (!fp) {
         return false;
@@ -396,5 +669,11 @@ bool property_file_write_all(const std::string &path,
     return true;
 }
 
+void property_file_cache_clear()
+{
+    std::lock_guard<std::mutex> lock(property_file_cache_lock);
+    property_file_cache.clear();
+}
+
 }
 }
@@ -0,0 +1,488 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/sched_policy.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "mbcommon/string.h"
+#include "mblog/logging.h"
+#include "mbutil/autoclose/file.h"
+#include "mbutil/integer.h"
+#include "mbutil/string.h"
+
+// From linux/ioprio.h, which is not exported by all toolchains
+#define SCHED_IOPRIO_WHO_PROCESS    1
+#define SCHED_IOPRIO_CLASS_SHIFT    13
+#define SCHED_IOPRIO_PRIO_MASK      ((1 << SCHED_IOPRIO_CLASS_SHIFT) - 1)
+
+// Amount of unused bandwidth (in seconds) that a writer may save up and spend
+// in a single burst after being idle
+#define WRITE_BURST_SECS            0.25
+
+namespace mb
+{
+namespace util
+{
+
+typedef std::chrono::steady_clock ThrottleClock;
+
+static std::atomic<uint64_t> g_write_limit{0};
+static std::mutex g_throttle_lock;
+static ThrottleClock::time_point g_throttle_deadline;
+
+static pid_t get_tid()
+{
+    return static_cast<pid_t>(syscall(SYS_gettid));
+}
+
+static int ioprio_value(IoPriorityClass io_class, int level)
+{
+    switch (io_class) {
+    case IoPriorityClass::None:
+        return 0;
+    case IoPriorityClass::Idle:
+        level = 0;
+        break;
+    default:
+        if (level < 0) {
+            level = 0;
+        } else if (level > 7) {
+            level = 7;
+        }
+        break;
+    }
+
+    return (static_cast<int>(io_class) << SCHED_IOPRIO_CLASS_SHIFT) | level;
+}
+
+static bool set_task_priority(pid_t tid, const SchedPolicy &policy)
+{
+    bool ret = true;
+
+    // On Linux, these only affect the given thread, not the whole process
+    if (setpriority(PRIO_PROCESS, static_cast<id_t>(tid), policy.nice) < 0) {
+        LOGW("%d: Failed to set nice level to %d: %s",
+             tid, policy.nice, strerror(errno));
+        ret = false;
+    }
+    if (syscall(SYS_ioprio_set, SCHED_IOPRIO_WHO_PROCESS, tid,
+                ioprio_value(policy.io_class, policy.io_level)) < 0) {
+        LOGW("%d: Failed to set I/O priority: %s", tid, strerror(errno));
+        ret = false;
+    }
+
+    return ret;
+}
+
+static std::string cgroup_dir(const CgroupPlacement &cgroup)
+{
+    std::string path = cgroup.mount_point;
+    if (!cgroup.group.empty()) {
+        path += '/';
+        path += cgroup.group;
+    }
+    return path;
+}
+
+/*!
+ * \brief Write a PID or TID into a cgroup control file
+ *
+ * \return 1 on success, 0 if the group does not exist on this device, or -1
+ *         on failure
+ */
+static int write_cgroup_file(const CgroupPlacement &cgroup, const char *name,
+                             pid_t id)
+{
+    std::string path = cgroup_dir(cgroup);
+    path += '/';
+    path += name;
+
+    int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            LOGV("%s: Group does not exist", path.c_str());
+            return 0;
+        }
+        LOGW("%s: Failed to open: %s", path.c_str(), strerror(errno));
+        return -1;
+    }
+
+    std::string value = format("%d", id);
+    ssize_t n = write(fd, value.data(), value.size());
+    int saved_errno = errno;
+    close(fd);
+
+    if (n != static_cast<ssize_t>(value.size())) {
+        LOGW("%s: Failed to add %d: %s",
+             path.c_str(), id, strerror(saved_errno));
+        return -1;
+    }
+
+    return 1;
+}
+
+/*!
+ * \brief Find the groups that a thread currently belongs to
+ *
+ * Only the hierarchies referenced by \p cgroups are looked up. The returned
+ * placements have the same mount points and controllers as \p cgroups, but
+ * with the group replaced by the thread's current group.
+ */
+static std::vector<CgroupPlacement>
+current_cgroups(pid_t tid, const std::vector<CgroupPlacement> &cgroups)
+{
+    std::vector<CgroupPlacement> result;
+
+    if (cgroups.empty()) {
+        return result;
+    }
+
+    std::string path = format("/proc/self/task/%d/cgroup", tid);
+    autoclose::file fp(autoclose::fopen(path.c_str(), "re"));
+    if (!fp) {
+        LOGW("%s: Failed to open: %s", path.c_str(), strerror(errno));
+        return result;
+    }
+
+    char *buf = nullptr;
+    size_t len = 0;
+    ssize_t read;
+
+    // Each line is of the form <hierarchy ID>:<controllers>:<path>
+    while ((read = getline(&buf, &len, fp.get())) >= 0) {
+        std::string line(buf, static_cast<size_t>(read));
+        if (!line.empty() && line.back() == '\n') {
+            line.pop_back();
+        }
+
+        auto first = line.find(':');
+        if (first == std::string::npos) {
+            continue;
+        }
+        auto second = line.find(':', first + 1);
+        if (second == std::string::npos) {
+            continue;
+        }
+
+        auto controllers = split(line.substr(first + 1, second - first - 1),
+                                 ",");
+        std::string group = line.substr(second + 1);
+        while (!group.empty() && group[0] == '/') {
+            group.erase(0, 1);
+        }
+
+        for (auto const &cgroup : cgroups) {
+            for (auto const &controller : controllers) {
+                if (controller == cgroup.controller) {
+                    result.push_back({cgroup.mount_point, cgroup.controller,
+                                      group});
+                    break;
+                }
+            }
+        }
+    }
+
+    free(buf);
+
+    return result;
+}
+
+/*!
+ * \brief Get the policy for a common type of workload
+ *
+ * * SchedPreset::Foreground: Normal CPU priority and the highest best-effort
+ *   I/O priority. Meant for operations that the user is actively waiting for.
+ * * SchedPreset::Background: Low CPU priority, idle I/O priority, and the
+ *   Android background cpuset, schedtune, cpuctl, and blkio groups (where
+ *   available). Meant for long operations that should not make the device
+ *   laggy, such as scheduled backups.
+ *
+ * Neither preset limits write bandwidth.
+ */
+SchedPolicy sched_policy_preset(SchedPreset preset)
+{
+    SchedPolicy policy;
+
+    switch (preset) {
+    case SchedPreset::Foreground:
+        policy.io_class = IoPriorityClass::BestEffort;
+        policy.io_level = 0;
+        policy.nice = 0;
+        break;
+    case SchedPreset::Background:
+        policy.io_class = IoPriorityClass::Idle;
+        policy.io_level = 0;
+        policy.nice = 10;
+        policy.cgroups = {
+            { "/dev/cpuset", "cpuset", "background" },
+            { "/dev/stune", "schedtune", "background" },
+            { "/dev/cpuctl", "cpu", "bg_non_interactive" },
+            { "/dev/blkio", "blkio", "background" },
+        };
+        break;
+    }
+
+    return policy;
+}
+
+/*!
+ * \brief Parse preset name ("foreground" or "background")
+ *
+ * \return Whether \p str is a valid preset name
+ */
+bool parse_sched_preset(const char *str, SchedPreset &preset)
+{
+    if (strcmp(str, "foreground") == 0) {
+        preset = SchedPreset::Foreground;
+    } else if (strcmp(str, "background") == 0) {
+        preset = SchedPreset::Background;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/*!
+ * \brief Apply scheduling policy to the calling thread
+ *
+ * The CPU priority, I/O priority, and cgroups are only changed for the calling
+ * thread. Threads and processes created afterwards by the calling thread
+ * inherit all three. The write limit in \p policy is ignored.
+ *
+ * Cgroups that do not exist on the device are silently skipped.
+ *
+ * \return Whether the entire policy was applied. If false is returned, the
+ *         parts that could be applied are left in effect.
+ */
+bool apply_thread_sched_policy(const SchedPolicy &policy)
+{
+    pid_t tid = get_tid();
+    bool ret = set_task_priority(tid, policy);
+
+    for (auto const &cgroup : policy.cgroups) {
+        if (write_cgroup_file(cgroup, "tasks", tid) < 0) {
+            ret = false;
+        }
+    }
+
+    return ret;
+}
+
+/*!
+ * \brief Apply scheduling policy to the whole process
+ *
+ * Unlike apply_thread_sched_policy(), this changes the priorities and cgroups
+ * of every existing thread in the process and sets the process-wide write
+ * limit (see set_write_limit()).
+ *
+ * \return Whether the entire policy was applied. If false is returned, the
+ *         parts that could be applied are left in effect.
+ */
+bool apply_process_sched_policy(const SchedPolicy &policy)
+{
+    bool ret = true;
+
+    DIR *dp = opendir("/proc/self/task");
+    if (!dp) {
+        LOGW("Failed to list threads: %s", strerror(errno));
+        ret = set_task_priority(get_tid(), policy);
+    } else {
+        struct dirent *ent;
+        while ((ent = readdir(dp))) {
+            pid_t tid;
+            if (ent->d_name[0] == '.'
+                    || !str_to_snum(ent->d_name, 10, &tid)) {
+                continue;
+            }
+            if (!set_task_priority(tid, policy)) {
+                ret = false;
+            }
+        }
+        closedir(dp);
+    }
+
+    for (auto const &cgroup : policy.cgroups) {
+        if (write_cgroup_file(cgroup, "cgroup.procs", getpid()) < 0) {
+            ret = false;
+        }
+    }
+
+    set_write_limit(policy.write_limit);
+
+    return ret;
+}
+
+/*!
+ * \class ScopedThreadSchedPolicy
+ * \brief Temporarily apply scheduling policy to the calling thread
+ *
+ * The constructor saves the thread's current CPU priority, I/O priority, and
+ * the groups it belongs to in the hierarchies referenced by the policy before
+ * calling apply_thread_sched_policy(). The destructor restores them.
+ *
+ * If the policy has a write limit, it replaces the process-wide limit for the
+ * lifetime of the object.
+ *
+ * The object must be destroyed on the thread that created it.
+ */
+
+ScopedThreadSchedPolicy::ScopedThreadSchedPolicy(const SchedPolicy &policy)
+    : _write_limit(write_limit())
+{
+    pid_t tid = get_tid();
+
+    errno = 0;
+    _nice = getpriority(PRIO_PROCESS, static_cast<id_t>(tid));
+    if (_nice == -1 && errno != 0) {
+        LOGW("Failed to get nice level: %s", strerror(errno));
+        _nice = 0;
+    }
+
+    _ioprio = static_cast<int>(syscall(
+            SYS_ioprio_get, SCHED_IOPRIO_WHO_PROCESS, tid));
+    if (_ioprio < 0) {
+        LOGW("Failed to get I/O priority: %s", strerror(errno));
+        _ioprio = 0;
+    }
+
+    _cgroups = current_cgroups(tid, policy.cgroups);
+
+    apply_thread_sched_policy(policy);
+
+    if (policy.write_limit != 0) {
+        set_write_limit(policy.write_limit);
+    }
+}
+
+ScopedThreadSchedPolicy::~ScopedThreadSchedPolicy()
+{
+    pid_t tid = get_tid();
+
+    for (auto const &cgroup : _cgroups) {
+        write_cgroup_file(cgroup, "tasks", tid);
+    }
+
+    if (setpriority(PRIO_PROCESS, static_cast<id_t>(tid), _nice) < 0) {
+        LOGW("Failed to restore nice level to %d: %s",
+             _nice, strerror(errno));
+    }
+    if (syscall(SYS_ioprio_set, SCHED_IOPRIO_WHO_PROCESS, tid, _ioprio) < 0) {
+        LOGW("Failed to restore I/O priority: %s", strerror(errno));
+    }
+
+    if (write_limit() != _write_limit) {
+        set_write_limit(_write_limit);
+    }
+}
+
+/*!
+ * \brief Set the process-wide write bandwidth limit
+ *
+ * The limit is shared by all threads that call throttle_write(), which
+ * includes the copy and archive functions in libmbutil.
+ *
+ * \param bytes_per_sec Maximum write rate (0 for unlimited)
+ */
+void set_write_limit(uint64_t bytes_per_sec)
+{
+    std::lock_guard<std::mutex> lock(g_throttle_lock);
+
+    g_write_limit = bytes_per_sec;
+    g_throttle_deadline = ThrottleClock::now();
+}
+
+/*!
+ * \brief Get the process-wide write bandwidth limit
+ *
+ * \return Maximum write rate in bytes per second or 0 if unlimited
+ */
+uint64_t write_limit()
+{
+    return g_write_limit;
+}
+
+/*!
+ * \brief Account for written data and sleep if over the write limit
+ *
+ * This implements a token bucket that is refilled at the rate set by
+ * set_write_limit() and holds up to WRITE_BURST_SECS worth of data. Writers
+ * call this after each write. If the bucket does not have enough tokens, the
+ * write is still accounted for and the calling thread sleeps until the bucket
+ * is no longer in debt. This allows write chunks larger than the bucket.
+ *
+ * Does nothing if no limit is set.
+ *
+ * \param size Number of bytes that were just written
+ */
+void throttle_write(size_t size)
+{
+    uint64_t limit = g_write_limit;
+    if (limit == 0 || size == 0) {
+        return;
+    }
+
+    ThrottleClock::duration wait;
+
+    {
+        std::lock_guard<std::mutex> lock(g_throttle_lock);
+
+        // The limit may have been changed while waiting for the lock
+        limit = g_write_limit;
+        if (limit == 0) {
+            return;
+        }
+
+        auto now = ThrottleClock::now();
+        auto burst = std::chrono::duration_cast<ThrottleClock::duration>(
+                std::chrono::duration<double>(WRITE_BURST_SECS));
+        auto cost = std::chrono::duration_cast<ThrottleClock::duration>(
+                std::chrono::duration<double>(
+                        static_cast<double>(size)
+                        / static_cast<double>(limit)));
+
+        // Saved up bandwidth is capped at the burst size
+        if (g_throttle_deadline < now - burst) {
+            g_throttle_deadline = now - burst;
+        }
+
+        g_throttle_deadline += cost;
+        wait = g_throttle_deadline - now;
+    }
+
+    if (wait > ThrottleClock::duration::zero()) {
+        std::this_thread::sleep_for(wait);
+    }
+}
+
+}
+}
@@ -19,8 +19,18 @@
 
 #include "mbutil/selinux.h"
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include <cerrno>
+#include <cstdio>
 #include <cstring>
+#include <dirent.h>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -30,60 +40,249 @@
 
 #include <sepol/sepol.h>
 
+#include "mbcommon/string.h"
+#include "mbcommon/thread_pool.h"
 #include "mblog/logging.h"
 #include "mbutil/finally.h"
-#include "mbutil/fts.h"
 
 #define SELINUX_XATTR           "security.selinux"
+// Contexts longer than this are compared by rewriting the label
+#define SELINUX_CONTEXT_MAX     256
+#define SET_CONTEXT_MAX_THREADS 4
 
 #define OPEN_ATTEMPTS           5
 
+// stdio buffer size for streaming policies to regular files
+#define POLICY_WRITE_BUF_SIZE   (1024 * 1024)
+
 
 namespace mb
 {
 namespace util
 {
 
-class RecursiveSetContext : public FTSWrapper {
+/*!
+ * \brief Recursively set the SELinux label of a tree in parallel
+ *
+ * Entries are enumerated through directory fds and, when /proc is available,
+ * labeled via /proc/self/fd/<dirfd>/<name> so that the full path does not need
+ * to be resolved for every entry. Subdirectories are handed to idle worker
+ * threads when there are any and are otherwise processed depth-first by the
+ * current thread. Like the previous FTS-based implementation, symlinks are not
+ * traversed, mountpoints are labeled but not descended into, and entries that
+ * already have the correct label are not touched.
+ */
+class ParallelSetContext
+{
 public:
-    RecursiveSetContext(std::string path, std::string context,
-                        bool follow_symlinks)
-        : FTSWrapper(path, FTS_GroupSpecialFiles),
-        _context(std::move(context)),
-        _follow_symlinks(follow_symlinks)
+    ParallelSetContext(std::string context, bool follow_symlinks)
+        : _context(std::move(context)), _follow_symlinks(follow_symlinks)
     {
     }
 
-    virtual int on_reached_directory_post() override
+    bool run(const std::string &path)
     {
-        return set_context() ? Action::FTS_OK : Action::FTS_Fail;
+        struct stat sb;
+        if (lstat(path.c_str(), &sb) < 0) {
+            return false;
+        }
+
+        if (!set_context(path)) {
+            _failed = true;
+        }
+
+        if (!S_ISDIR(sb.st_mode)) {
+            return !_failed;
+        }
+
+        int dfd = open(path.c_str(),
+                       O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dfd < 0) {
+            return false;
+        }
+
+        _dev = sb.st_dev;
+        _use_proc_fd = access("/proc/self/fd", X_OK) == 0;
+
+        _queue.push_back({ dfd, path });
+        _pending = 1;
+
+        unsigned int n_threads = std::min(std::max(
+                std::thread::hardware_concurrency(), 1u),
+                static_cast<unsigned int>(SET_CONTEXT_MAX_THREADS));
+
+        run_concurrently(n_threads, [this] { worker_thread(); });
+
+        return !_failed;
     }
 
-    virtual int on_reached_file() override
+private:
+    struct Dir
     {
-        return set_context() ? Action::FTS_OK : Action::FTS_Fail;
-    }
+        int fd;
+        std::string path;
+    };
 
-    virtual int on_reached_symlink() override
+    std::string _context;
+    bool _follow_symlinks;
+    dev_t _dev;
+    bool _use_proc_fd;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<Dir> _queue;
+    unsigned int _idle = 0;
+    // Number of queued directories that have not been fully processed
+    unsigned int _pending = 0;
+    std::atomic_bool _failed{false};
+
+    void worker_thread()
     {
-        return set_context() ? Action::FTS_OK : Action::FTS_Fail;
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        while (true) {
+            ++_idle;
+            _cv.wait(lock, [&] {
+                return !_queue.empty() || _pending == 0;
+            });
+            --_idle;
+
+            if (_queue.empty()) {
+                break;
+            }
+
+            Dir dir = std::move(_queue.front());
+            _queue.pop_front();
+
+            lock.unlock();
+            set_context_contents(dir);
+            lock.lock();
+
+            if (--_pending == 0) {
+                _cv.notify_all();
+            }
+        }
     }
 
-    virtual int on_reached_special_file() override
+    bool try_queue(Dir &dir)
     {
-        return set_context() ? Action::FTS_OK : Action::FTS_Fail;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_queue.size() >= _idle) {
+                return false;
+            }
+            _queue.push_back(std::move(dir));
+            ++_pending;
+        }
+        _cv.notify_one();
+        return true;
     }
 
-private:
-    std::string _context;
-    bool _follow_symlinks;
+    // Takes ownership of dir.fd
+    void set_context_contents(Dir &dir)
+    {
+        DIR *dp = fdopendir(dir.fd);
+        if (!dp) {
+            LOGE("%s: Failed to open directory: %s",
+                 dir.path.c_str(), strerror(errno));
+            close(dir.fd);
+            _failed = true;
+            return;
+        }
+
+        std::string entry_path;
+        std::string proc_prefix;
+        if (_use_proc_fd) {
+            proc_prefix = format("/proc/self/fd/%d/", dir.fd);
+        }
+
+        struct dirent *ent;
+        while ((ent = readdir(dp))) {
+            if (strcmp(ent->d_name, ".") == 0
+                    || strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
 
-    bool set_context()
+            if (_use_proc_fd) {
+                entry_path = proc_prefix;
+            } else {
+                entry_path = dir.path;
+                entry_path += '/';
+            }
+            entry_path += ent->d_name;
+
+            if (!set_context(entry_path)) {
+                _failed = true;
+            }
+
+            bool is_dir;
+            if (ent->d_type != DT_UNKNOWN) {
+                is_dir = ent->d_type == DT_DIR;
+            } else {
+                struct stat sb;
+                if (fstatat(dir.fd, ent->d_name, &sb,
+                            AT_SYMLINK_NOFOLLOW) < 0) {
+                    _failed = true;
+                    continue;
+                }
+                is_dir = S_ISDIR(sb.st_mode);
+            }
+
+            if (!is_dir) {
+                continue;
+            }
+
+            Dir child;
+            child.fd = openat(dir.fd, ent->d_name, O_RDONLY | O_DIRECTORY
+                              | O_NOFOLLOW | O_CLOEXEC);
+            if (child.fd < 0) {
+                _failed = true;
+                continue;
+            }
+
+            // Don't descend into mountpoints
+            struct stat sb;
+            if (fstat(child.fd, &sb) < 0 || sb.st_dev != _dev) {
+                close(child.fd);
+                continue;
+            }
+
+            child.path = dir.path;
+            child.path += '/';
+            child.path += ent->d_name;
+
+            if (!try_queue(child)) {
+                set_context_contents(child);
+            }
+        }
+
+        closedir(dp);
+    }
+
+    bool set_context(const std::string &path)
     {
+        // Don't touch the inode (and its ctime) if nothing would change
+        char current[SELINUX_CONTEXT_MAX];
+        ssize_t n = _follow_symlinks
+                ? getxattr(path.c_str(), SELINUX_XATTR,
+                           current, sizeof(current))
+                : lgetxattr(path.c_str(), SELINUX_XATTR,
+                            current, sizeof(current));
+        if (n > 0) {
+            size_t len = static_cast<size_t>(n);
+            if (current[len - 1] == '\0') {
+                --len;
+            }
+            if (len == _context.size()
+                    && memcmp(current, _context.data(), len) == 0) {
+                return true;
+            }
+        }
+
         if (_follow_symlinks) {
-            return selinux_set_context(_curr->fts_accpath, _context);
+            return selinux_set_context(path, _context);
         } else {
-            return selinux_lset_context(_curr->fts_accpath, _context);
+            return selinux_lset_context(path, _context);
         }
     }
 };
@@ -141,14 +340,53 @@ bool selinux_read_policy(const std::string &path, policydb_t *pdb)
     return policydb_read(pdb, &pf, 0) == 0;
 }
 
+/*!
+ * \brief Serialize a policy directly to a regular file
+ *
+ * libsepol writes the policy through a large stdio buffer, so the policy image
+ * never has to exist in memory as a whole.
+ */
+static bool write_policy_stream(const std::string &path, int fd,
+                                sepol_handle_t *handle, policydb_t *pdb)
+{
+    FILE *fp = fdopen(fd, "wb");
+    if (!fp) {
+        LOGE("%s: Failed to open stream: %s", path.c_str(), strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    setvbuf(fp, nullptr, _IOFBF, POLICY_WRITE_BUF_SIZE);
+
+    struct policy_file pf;
+    policy_file_init(&pf);
+    pf.type = PF_USE_STDIO;
+    pf.fp = fp;
+    pf.handle = handle;
+
+    bool ret = policydb_write(pdb, &pf) == 0;
+    if (!ret) {
+        LOGE("%s: Failed to write sepolicy", path.c_str());
+    }
+
+    if (fclose(fp) != 0 && ret) {
+        LOGE("%s: Failed to close sepolicy: %s", path.c_str(), strerror(errno));
+        ret = false;
+    }
+
+    return ret;
+}
+
 // /sys/fs/selinux/load requires the entire policy to be written in a single
-// write(2) call.
+// write(2) call. Regular files have no such restriction, so the policy is
+// streamed to them instead of being serialized to memory first.
 // See: http://marc.info/?l=selinux&m=141882521027239&w=2
 bool selinux_write_policy(const std::string &path, policydb_t *pdb)
 {
     void *data;
     size_t len;
     sepol_handle_t *handle;
+    struct stat sb;
     int fd;
 
     // Don't print warnings to stderr
@@ -159,15 +397,6 @@ bool selinux_write_policy(const std::string &path, policydb_t *pdb)
         sepol_handle_destroy(handle);
     });
 
-    if (policydb_to_image(handle, pdb, &data, &len) < 0) {
-        LOGE("Failed to write policydb to memory");
-        return false;
-    }
-
-    auto free_data = finally([&] {
-        free(data);
-    });
-
     for (int i = 0; i < OPEN_ATTEMPTS; ++i) {
         fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644);
         if (fd < 0) {
@@ -183,13 +412,32 @@ bool selinux_write_policy(const std::string &path, policydb_t *pdb)
         break;
     }
 
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+        // Takes ownership of fd
+        return write_policy_stream(path, fd, handle, pdb);
+    }
+
     auto close_fd = finally([&] {
         close(fd);
     });
 
-    if (write(fd, data, len) < 0) {
+    if (policydb_to_image(handle, pdb, &data, &len) < 0) {
+        LOGE("Failed to write policydb to memory");
+        return false;
+    }
+
+    auto free_data = finally([&] {
+        free(data);
+    });
+
+    ssize_t n = write(fd, data, len);
+    if (n < 0) {
         LOGE("%s: Failed to write sepolicy: %s", path.c_str(), strerror(errno));
         return false;
+    } else if (static_cast<size_t>(n) != len) {
+        LOGE("%s: Policy was only partially written (%zd/%zu bytes)",
+             path.c_str(), n, len);
+        return false;
     }
 
     return true;
@@ -285,13 +533,13 @@ bool selinux_fset_context(int fd, const std::string &context)
 bool selinux_set_context_recursive(const std::string &path,
                                    const std::string &context)
 {
-    return RecursiveSetContext(path, context, true).run();
+    return ParallelSetContext(context, true).run(path);
 }
 
 bool selinux_lset_context_recursive(const std::string &path,
                                     const std::string &context)
 {
-    return RecursiveSetContext(path, context, false).run();
+    return ParallelSetContext(context, false).run(path);
 }
 
 bool selinux_get_enforcing(int *value)
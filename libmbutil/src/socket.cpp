@@ -19,12 +19,17 @@
 
 #include "mbutil/socket.h"
 
+#include <cerrno>
 #include <climits>
 #include <cstdlib>
 #include <cstring>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+// Initial buffer size for SocketFramedReader
+#define FRAMED_READER_BUF_SIZE          (16 * 1024)
+
 namespace mb
 {
 namespace util
@@ -82,6 +87,56 @@ ssize_t socket_write(int fd, const void *buf, size_t size)
     return bytes_written;
 }
 
+/*!
+ * \brief Write all data from a set of buffers
+ *
+ * \note The iovec array is modified to track partial writes.
+ *
+ * \return Number of bytes written (which is only less than the total size if
+ *         the peer stopped reading) or -1 if an error occurs
+ */
+ssize_t socket_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t bytes_written = 0;
+    ssize_t n;
+
+    while (iovcnt > 0) {
+        if (iov->iov_len == 0) {
+            ++iov;
+            --iovcnt;
+            continue;
+        }
+
+        n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            return n;
+        } else if (n == 0) {
+            break;
+        }
+
+        bytes_written += n;
+
+        // Skip over the buffers that were completely written
+        while (iovcnt > 0 && static_cast<size_t>(n) >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return bytes_written;
+}
+
+/*!
+ * \brief Read a message written by socket_write_bytes()
+ *
+ * \note The existing capacity of \p result is reused. The contents of
+ *       \p result are unspecified if this function fails.
+ */
 bool socket_read_bytes(int fd, std::vector<uint8_t> *result)
 {
     int32_t len;
@@ -93,25 +148,27 @@ bool socket_read_bytes(int fd, std::vector<uint8_t> *result)
         return false;
     }
 
-    std::vector<uint8_t> buf(len);
+    result->resize(len);
 
-    if (socket_read(fd, buf.data(), len) == (ssize_t) len) {
-        result->swap(buf);
-        return true;
-    }
-    return false;
+    return socket_read(fd, result->data(), len) == (ssize_t) len;
 }
 
 bool socket_write_bytes(int fd, const uint8_t *data, size_t len)
 {
-    if (!socket_write_int32(fd, len)) {
+    if (len > INT32_MAX) {
+        errno = EINVAL;
         return false;
     }
 
-    if (socket_write(fd, data, len) == (ssize_t) len) {
-        return true;
-    }
-    return false;
+    // Send the length and the data with a single syscall
+    int32_t len32 = len;
+    struct iovec iov[2];
+    iov[0].iov_base = &len32;
+    iov[0].iov_len = sizeof(len32);
+    iov[1].iov_base = const_cast<uint8_t *>(data);
+    iov[1].iov_len = len;
+
+    return socket_writev(fd, iov, 2) == (ssize_t) (sizeof(len32) + len);
 }
 
 template<typename TYPE>
@@ -342,5 +399,80 @@ bool socket_send_fds(int fd, const std::vector<int> &fds)
     return false;
 }
 
+SocketFramedReader::SocketFramedReader(int fd)
+    : _fd(fd), _buf(FRAMED_READER_BUF_SIZE), _begin(0), _end(0)
+{
+}
+
+/*!
+ * \brief Read the next message
+ *
+ * \param[out] data Pointer to message payload. The pointer is valid until the
+ *                  next call to read().
+ * \param[out] size Size of message payload
+ *
+ * \return Whether a message was successfully read
+ */
+bool SocketFramedReader::read(const uint8_t **data, size_t *size)
+{
+    int32_t len;
+
+    if (!fill(sizeof(len))) {
+        return false;
+    }
+
+    memcpy(&len, _buf.data() + _begin, sizeof(len));
+    if (len < 0) {
+        errno = EINVAL;
+        return false;
+    }
+
+    if (!fill(sizeof(len) + len)) {
+        return false;
+    }
+
+    *data = _buf.data() + _begin + sizeof(len);
+    *size = len;
+    _begin += sizeof(len) + len;
+
+    return true;
+}
+
+// Make sure at least `size` bytes are available starting at _begin. This keeps
+// the length prefix at offset 4 (mod 8) so that the payload is 8-byte aligned.
+bool SocketFramedReader::fill(size_t size)
+{
+    if (_begin == _end) {
+        _begin = _end = sizeof(int32_t);
+    } else if (_begin % 8 != sizeof(int32_t)
+            || _buf.size() - _begin < size) {
+        memmove(_buf.data() + sizeof(int32_t), _buf.data() + _begin,
+                _end - _begin);
+        _end -= _begin - sizeof(int32_t);
+        _begin = sizeof(int32_t);
+    }
+
+    if (_buf.size() - _begin < size) {
+        _buf.resize(_begin + size);
+    }
+
+    while (_end - _begin < size) {
+        ssize_t n = ::read(_fd, _buf.data() + _end, _buf.size() - _end);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            // Connection closed in the middle of a message
+            errno = ECONNRESET;
+            return false;
+        }
+        _end += n;
+    }
+
+    return true;
+}
+
+}
 }
-}
\ No newline at end of file
@@ -0,0 +1,718 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "mbutil/zip_index.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "mblog/logging.h"
+#include "mbutil/directory.h"
+#include "mbutil/finally.h"
+#include "mbutil/path.h"
+
+#define ZIP_LOCAL_HEADER_MAGIC          0x04034b50u
+#define ZIP_LOCAL_HEADER_SIZE           30
+#define ZIP_CD_HEADER_MAGIC             0x02014b50u
+#define ZIP_CD_HEADER_SIZE              46
+#define ZIP_EOCD_MAGIC                  0x06054b50u
+#define ZIP_EOCD_SIZE                   22
+#define ZIP64_EOCD_LOCATOR_MAGIC        0x07064b50u
+#define ZIP64_EOCD_LOCATOR_SIZE         20
+#define ZIP64_EOCD_MAGIC                0x06064b50u
+#define ZIP64_EOCD_SIZE                 56
+#define ZIP64_EXTRA_ID                  0x0001
+
+// EOCD record plus the largest possible archive comment
+#define ZIP_EOCD_SEARCH_SIZE            (ZIP_EOCD_SIZE + 0xffff)
+
+// Refuse to load central directories larger than this. Even ROM zips with
+// tens of thousands of entries are only a few MiB.
+#define ZIP_CD_MAX_SIZE                 (64 * 1024 * 1024)
+
+#define ZIP_FLAG_ENCRYPTED              0x0001
+
+#define ZIP_METHOD_STORED               0
+#define ZIP_METHOD_DEFLATED             8
+
+// Host system in the upper byte of "version made by"
+#define ZIP_HOST_UNIX                   3
+
+#define ZIP_READ_BUF_SIZE               (64 * 1024)
+
+namespace mb
+{
+namespace util
+{
+
+static inline uint16_t get_le16(const unsigned char *p)
+{
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t get_le32(const unsigned char *p)
+{
+    return static_cast<uint32_t>(p[0])
+            | (static_cast<uint32_t>(p[1]) << 8)
+            | (static_cast<uint32_t>(p[2]) << 16)
+            | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static inline uint64_t get_le64(const unsigned char *p)
+{
+    return static_cast<uint64_t>(get_le32(p))
+            | (static_cast<uint64_t>(get_le32(p + 4)) << 32);
+}
+
+static bool pread_fully(int fd, void *buf, size_t size, uint64_t offset)
+{
+    size_t total = 0;
+
+    while (total < size) {
+        ssize_t n = pread64(fd, static_cast<char *>(buf) + total,
+                            size - total, offset + total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return false;
+        } else if (n == 0) {
+            errno = EIO;
+            return false;
+        }
+        total += n;
+    }
+
+    return true;
+}
+
+static bool write_fully(int fd, const void *buf, size_t size)
+{
+    size_t total = 0;
+
+    while (total < size) {
+        ssize_t n = write(fd, static_cast<const char *>(buf) + total,
+                          size - total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        total += n;
+    }
+
+    return true;
+}
+
+static mode_t entry_mode(const ZipEntryInfo &entry)
+{
+    if ((entry.version_made_by >> 8) == ZIP_HOST_UNIX) {
+        return static_cast<mode_t>(entry.external_attrs >> 16);
+    }
+    return 0;
+}
+
+static bool entry_is_dir(const ZipEntryInfo &entry)
+{
+    mode_t mode = entry_mode(entry);
+    return (!entry.name.empty() && entry.name.back() == '/')
+            || (mode != 0 && S_ISDIR(mode));
+}
+
+static bool entry_is_symlink(const ZipEntryInfo &entry)
+{
+    mode_t mode = entry_mode(entry);
+    return mode != 0 && S_ISLNK(mode);
+}
+
+/*!
+ * \class ZipIndex
+ *
+ * \brief Random access reader for zip files
+ *
+ * Unlike streaming the archive through libarchive, opening a ZipIndex only
+ * reads the end of central directory record and the central directory itself.
+ * Each extracted entry then costs a read of its local header and its data.
+ * Pulling a few small files out of a multi-GB ROM zip no longer requires
+ * reading the whole zip.
+ *
+ * The file is memory mapped when possible, so the central directory is parsed
+ * in place and stored entries are copied straight from the page cache. A
+ * single instance can be shared by everything that needs to look inside the
+ * same zip.
+ *
+ * Only stored and deflated entries are supported. Callers should fall back to
+ * libarchive for anything that can_extract() rejects.
+ */
+
+ZipIndex::ZipIndex()
+    : _fd(-1)
+    , _file_size(0)
+    , _map(nullptr)
+{
+}
+
+ZipIndex::~ZipIndex()
+{
+    close();
+}
+
+/*!
+ * \brief Open a zip file and load its central directory
+ *
+ * \param path Path to zip file
+ *
+ * \return Whether the file was opened and its central directory was parsed
+ */
+bool ZipIndex::open(const std::string &path)
+{
+    close();
+
+    _fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_LARGEFILE);
+    if (_fd < 0) {
+        LOGE("%s: Failed to open: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    struct stat64 sb;
+    if (fstat64(_fd, &sb) < 0) {
+        LOGE("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+        close();
+        return false;
+    }
+
+    _path = path;
+    _file_size = sb.st_size;
+
+    // Multi-GB zips may not fit in the address space of 32-bit devices, in
+    // which case everything is read with pread()
+    if (_file_size > 0 && _file_size <= SIZE_MAX) {
+        void *map = mmap(nullptr, static_cast<size_t>(_file_size), PROT_READ,
+                         MAP_SHARED, _fd, 0);
+        if (map != MAP_FAILED) {
+            _map = static_cast<const unsigned char *>(map);
+        }
+    }
+
+    if (!read_central_directory()) {
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void ZipIndex::close()
+{
+    if (_map) {
+        munmap(const_cast<unsigned char *>(_map),
+               static_cast<size_t>(_file_size));
+        _map = nullptr;
+    }
+    if (_fd >= 0) {
+        ::close(_fd);
+        _fd = -1;
+    }
+    _file_size = 0;
+    _path.clear();
+    _entries.clear();
+}
+
+bool ZipIndex::is_open() const
+{
+    return _fd >= 0;
+}
+
+/*!
+ * \brief Path of the opened zip file
+ */
+const std::string & ZipIndex::path() const
+{
+    return _path;
+}
+
+/*!
+ * \brief Number of unique entry names in the zip
+ */
+size_t ZipIndex::size() const
+{
+    return _entries.size();
+}
+
+/*!
+ * \brief Look up an entry by its full path in the zip
+ *
+ * If the zip contains duplicate names, the last one wins (the same as
+ * extracting the whole archive in order).
+ *
+ * \return Entry or nullptr if the zip does not contain \p name
+ */
+const ZipEntryInfo * ZipIndex::find(const std::string &name) const
+{
+    auto it = _entries.find(name);
+    return it == _entries.end() ? nullptr : &it->second;
+}
+
+/*!
+ * \brief Check whether extract() supports an entry
+ */
+bool ZipIndex::can_extract(const ZipEntryInfo &entry)
+{
+    if (entry.flags & ZIP_FLAG_ENCRYPTED) {
+        return false;
+    }
+    if (entry_is_dir(entry)) {
+        return true;
+    }
+    return entry.method == ZIP_METHOD_STORED
+            || entry.method == ZIP_METHOD_DEFLATED;
+}
+
+bool ZipIndex::read_at(void *buf, size_t size, uint64_t offset) const
+{
+    if (_map) {
+        if (offset > _file_size || size > _file_size - offset) {
+            errno = EIO;
+            return false;
+        }
+        memcpy(buf, _map + offset, size);
+        return true;
+    }
+
+    return pread_fully(_fd, buf, size, offset);
+}
+
+bool ZipIndex::read_central_directory()
+{
+    size_t search_size = static_cast<size_t>(
+            std::min<uint64_t>(_file_size, ZIP_EOCD_SEARCH_SIZE));
+    if (search_size < ZIP_EOCD_SIZE) {
+        LOGE("%s: Too small to be a zip file", _path.c_str());
+        return false;
+    }
+
+    uint64_t search_offset = _file_size - search_size;
+    std::vector<unsigned char> buf(search_size);
+
+    if (!read_at(buf.data(), buf.size(), search_offset)) {
+        LOGE("%s: Failed to read end of central directory: %s",
+             _path.c_str(), strerror(errno));
+        return false;
+    }
+
+    // Search backwards in case the comment contains the signature
+    size_t eocd = SIZE_MAX;
+    for (size_t i = search_size - ZIP_EOCD_SIZE + 1; i-- > 0;) {
+        if (get_le32(&buf[i]) == ZIP_EOCD_MAGIC
+                && i + ZIP_EOCD_SIZE + get_le16(&buf[i + 20])
+                        <= search_size) {
+            eocd = i;
+            break;
+        }
+    }
+    if (eocd == SIZE_MAX) {
+        LOGE("%s: End of central directory not found", _path.c_str());
+        return false;
+    }
+
+    uint64_t num_entries = get_le16(&buf[eocd + 10]);
+    uint64_t cd_size = get_le32(&buf[eocd + 12]);
+    uint64_t cd_offset = get_le32(&buf[eocd + 16]);
+    uint64_t eocd_offset = search_offset + eocd;
+
+    // Zip64 archives have a locator immediately before the EOCD record
+    if (eocd_offset >= ZIP64_EOCD_LOCATOR_SIZE) {
+        unsigned char locator[ZIP64_EOCD_LOCATOR_SIZE];
+        unsigned char record[ZIP64_EOCD_SIZE];
+
+        if (!read_at(locator, sizeof(locator),
+                         eocd_offset - ZIP64_EOCD_LOCATOR_SIZE)) {
+            LOGE("%s: Failed to read zip64 locator: %s",
+                 _path.c_str(), strerror(errno));
+            return false;
+        }
+
+        if (get_le32(locator) == ZIP64_EOCD_LOCATOR_MAGIC) {
+            uint64_t record_offset = get_le64(locator + 8);
+
+            if (!read_at(record, sizeof(record), record_offset)
+                    || get_le32(record) != ZIP64_EOCD_MAGIC) {
+                LOGE("%s: Invalid zip64 end of central directory",
+                     _path.c_str());
+                return false;
+            }
+
+            num_entries = get_le64(record + 32);
+            cd_size = get_le64(record + 40);
+            cd_offset = get_le64(record + 48);
+        }
+    }
+
+    if (cd_size > ZIP_CD_MAX_SIZE || cd_offset > _file_size
+            || cd_size > _file_size - cd_offset) {
+        LOGE("%s: Invalid central directory location", _path.c_str());
+        return false;
+    }
+
+    // Parse the central directory in place if the file is mapped
+    std::vector<unsigned char> cd_buf;
+    const unsigned char *cd_data;
+    size_t cd_len = static_cast<size_t>(cd_size);
+
+    if (_map) {
+        cd_data = _map + cd_offset;
+    } else {
+        cd_buf.resize(cd_len);
+        if (!pread_fully(_fd, cd_buf.data(), cd_len, cd_offset)) {
+            LOGE("%s: Failed to read central directory: %s",
+                 _path.c_str(), strerror(errno));
+            return false;
+        }
+        cd_data = cd_buf.data();
+    }
+
+    // Don't trust the entry count for the reservation
+    _entries.reserve(static_cast<size_t>(
+            std::min<uint64_t>(num_entries, cd_size / ZIP_CD_HEADER_SIZE)));
+
+    size_t pos = 0;
+    for (uint64_t i = 0; i < num_entries; ++i) {
+        if (cd_len - pos < ZIP_CD_HEADER_SIZE
+                || get_le32(cd_data + pos) != ZIP_CD_HEADER_MAGIC) {
+            LOGE("%s: Invalid central directory entry %" PRIu64,
+                 _path.c_str(), i);
+            return false;
+        }
+
+        const unsigned char *h = cd_data + pos;
+        size_t name_len = get_le16(h + 28);
+        size_t extra_len = get_le16(h + 30);
+        size_t comment_len = get_le16(h + 32);
+
+        if (cd_len - pos - ZIP_CD_HEADER_SIZE
+                < name_len + extra_len + comment_len) {
+            LOGE("%s: Truncated central directory entry %" PRIu64,
+                 _path.c_str(), i);
+            return false;
+        }
+
+        ZipEntryInfo entry;
+        entry.name.assign(reinterpret_cast<const char *>(
+                h + ZIP_CD_HEADER_SIZE), name_len);
+        entry.version_made_by = get_le16(h + 4);
+        entry.flags = get_le16(h + 8);
+        entry.method = get_le16(h + 10);
+        entry.crc32 = get_le32(h + 16);
+        entry.compressed_size = get_le32(h + 20);
+        entry.uncompressed_size = get_le32(h + 24);
+        entry.external_attrs = get_le32(h + 38);
+        entry.local_header_offset = get_le32(h + 42);
+
+        // Fields that overflowed are stored in the zip64 extra field in this
+        // order, but only if the corresponding field above is 0xffffffff
+        const unsigned char *extra = h + ZIP_CD_HEADER_SIZE + name_len;
+        const unsigned char *extra_end = extra + extra_len;
+        while (extra_end - extra >= 4) {
+            uint16_t id = get_le16(extra);
+            uint16_t size = get_le16(extra + 2);
+            const unsigned char *data = extra + 4;
+
+            if (extra_end - data < size) {
+                break;
+            }
+
+            if (id == ZIP64_EXTRA_ID) {
+                const unsigned char *p = data;
+                const unsigned char *end = data + size;
+
+                if (entry.uncompressed_size == UINT32_MAX && end - p >= 8) {
+                    entry.uncompressed_size = get_le64(p);
+                    p += 8;
+                }
+                if (entry.compressed_size == UINT32_MAX && end - p >= 8) {
+                    entry.compressed_size = get_le64(p);
+                    p += 8;
+                }
+                if (entry.local_header_offset == UINT32_MAX && end - p >= 8) {
+                    entry.local_header_offset = get_le64(p);
+                    p += 8;
+                }
+                break;
+            }
+
+            extra = data + size;
+        }
+
+        pos += ZIP_CD_HEADER_SIZE + name_len + extra_len + comment_len;
+
+        std::string name = entry.name;
+        _entries[std::move(name)] = std::move(entry);
+    }
+
+    return true;
+}
+
+bool ZipIndex::entry_data_offset(const ZipEntryInfo &entry,
+                                 uint64_t *offset) const
+{
+    unsigned char header[ZIP_LOCAL_HEADER_SIZE];
+
+    if (!read_at(header, sizeof(header), entry.local_header_offset)) {
+        LOGE("%s: %s: Failed to read local header: %s",
+             _path.c_str(), entry.name.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (get_le32(header) != ZIP_LOCAL_HEADER_MAGIC) {
+        LOGE("%s: %s: Invalid local header", _path.c_str(), entry.name.c_str());
+        return false;
+    }
+
+    // The local extra field may differ from the central directory's copy
+    uint64_t data_offset = entry.local_header_offset + ZIP_LOCAL_HEADER_SIZE
+            + get_le16(header + 26) + get_le16(header + 28);
+
+    if (data_offset > _file_size
+            || entry.compressed_size > _file_size - data_offset) {
+        LOGE("%s: %s: Entry data extends past end of file",
+             _path.c_str(), entry.name.c_str());
+        return false;
+    }
+
+    *offset = data_offset;
+    return true;
+}
+
+/*
+ * Decompress an entry and either write it to fd_out or append it to data_out.
+ */
+bool ZipIndex::read_entry_data(const ZipEntryInfo &entry, int fd_out,
+                               std::string *data_out) const
+{
+    uint64_t offset;
+    if (!entry_data_offset(entry, &offset)) {
+        return false;
+    }
+
+    std::vector<unsigned char> in_buf(ZIP_READ_BUF_SIZE);
+    std::vector<unsigned char> out_buf(ZIP_READ_BUF_SIZE);
+    uint64_t remaining = entry.compressed_size;
+    uint64_t total_out = 0;
+    uLong crc = crc32(0L, Z_NULL, 0);
+
+    auto emit = [&](const unsigned char *data, size_t size) {
+        crc = crc32(crc, data, static_cast<uInt>(size));
+        total_out += size;
+
+        if (data_out) {
+            data_out->append(reinterpret_cast<const char *>(data), size);
+        } else if (!write_fully(fd_out, data, size)) {
+            LOGE("%s: Failed to write data: %s",
+                 entry.name.c_str(), strerror(errno));
+            return false;
+        }
+        return true;
+    };
+
+    if (entry.method == ZIP_METHOD_STORED) {
+        while (remaining > 0) {
+            size_t n = static_cast<size_t>(
+                    std::min<uint64_t>(remaining, in_buf.size()));
+            const unsigned char *data = _map ? _map + offset : in_buf.data();
+            if (!_map && !pread_fully(_fd, in_buf.data(), n, offset)) {
+                LOGE("%s: %s: Failed to read data: %s",
+                     _path.c_str(), entry.name.c_str(), strerror(errno));
+                return false;
+            }
+            if (!emit(data, n)) {
+                return false;
+            }
+            offset += n;
+            remaining -= n;
+        }
+    } else {
+        z_stream strm;
+        memset(&strm, 0, sizeof(strm));
+
+        // Raw deflate stream without a zlib header
+        if (inflateInit2(&strm, -MAX_WBITS) != Z_OK) {
+            LOGE("%s: Failed to initialize inflater", entry.name.c_str());
+            return false;
+        }
+
+        auto end_inflate = finally([&] {
+            inflateEnd(&strm);
+        });
+
+        int ret = Z_OK;
+        while (ret != Z_STREAM_END) {
+            if (strm.avail_in == 0 && remaining > 0) {
+                size_t n = static_cast<size_t>(
+                        std::min<uint64_t>(remaining, in_buf.size()));
+                const unsigned char *data =
+                        _map ? _map + offset : in_buf.data();
+                if (!_map && !pread_fully(_fd, in_buf.data(), n, offset)) {
+                    LOGE("%s: %s: Failed to read data: %s",
+                         _path.c_str(), entry.name.c_str(), strerror(errno));
+                    return false;
+                }
+                offset += n;
+                remaining -= n;
+
+                // zlib doesn't modify the input
+                strm.next_in = const_cast<unsigned char *>(data);
+                strm.avail_in = static_cast<uInt>(n);
+            }
+
+            strm.next_out = out_buf.data();
+            strm.avail_out = static_cast<uInt>(out_buf.size());
+
+            ret = inflate(&strm, Z_NO_FLUSH);
+            if (ret == Z_BUF_ERROR && remaining == 0) {
+                LOGE("%s: %s: Truncated deflate stream",
+                     _path.c_str(), entry.name.c_str());
+                return false;
+            } else if (ret != Z_OK && ret != Z_STREAM_END) {
+                LOGE("%s: %s: Failed to inflate: %s", _path.c_str(),
+                     entry.name.c_str(), strm.msg ? strm.msg : "(no message)");
+                return false;
+            }
+
+            if (!emit(out_buf.data(), out_buf.size() - strm.avail_out)) {
+                return false;
+            }
+        }
+    }
+
+    if (total_out != entry.uncompressed_size
+            || static_cast<uint32_t>(crc) != entry.crc32) {
+        LOGE("%s: %s: Size or CRC32 mismatch", _path.c_str(),
+             entry.name.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Extract an entry to a path
+ *
+ * Parent directories of \p target are created as needed and an existing file
+ * at \p target is replaced. Unix permissions stored in the zip are applied;
+ * otherwise, files are created with mode 0644 and directories with 0755.
+ *
+ * \param entry Entry returned by find()
+ * \param target Output path
+ *
+ * \return Whether the entry was successfully extracted
+ */
+bool ZipIndex::extract(const ZipEntryInfo &entry,
+                       const std::string &target) const
+{
+    if (!can_extract(entry)) {
+        LOGE("%s: %s: Unsupported entry (method %u, flags 0x%x)",
+             _path.c_str(), entry.name.c_str(), entry.method, entry.flags);
+        return false;
+    }
+
+    mode_t mode = entry_mode(entry) & 07777;
+
+    if (entry_is_dir(entry)) {
+        if (!mkdir_recursive(target, mode ? mode : 0755)) {
+            LOGE("%s: Failed to create directory: %s",
+                 target.c_str(), strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    std::string parent = dir_name(target);
+    if (!mkdir_recursive(parent, 0755)) {
+        LOGE("%s: Failed to create directory: %s",
+             parent.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (unlink(target.c_str()) < 0 && errno != ENOENT) {
+        LOGE("%s: Failed to remove existing file: %s",
+             target.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (entry_is_symlink(entry)) {
+        std::string link_target;
+        if (!read_entry_data(entry, -1, &link_target)) {
+            return false;
+        }
+        if (symlink(link_target.c_str(), target.c_str()) < 0) {
+            LOGE("%s: Failed to create symlink: %s",
+                 target.c_str(), strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    int fd = ::open(target.c_str(),
+                    O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_LARGEFILE,
+                    0600);
+    if (fd < 0) {
+        LOGE("%s: Failed to open for writing: %s",
+             target.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd = finally([&] {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    });
+
+    if (!read_entry_data(entry, fd, nullptr)) {
+        return false;
+    }
+
+    // Applied explicitly so that the umask does not affect it
+    if (fchmod(fd, mode ? mode : 0644) < 0) {
+        LOGE("%s: Failed to chmod: %s", target.c_str(), strerror(errno));
+        return false;
+    }
+
+    int ret = ::close(fd);
+    fd = -1;
+    if (ret < 0) {
+        LOGE("%s: Failed to close file: %s", target.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+}
+}
@@ -18,21 +18,31 @@
  */
 
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 
 #include <cerrno>
+#include <cinttypes>
 #include <cstdarg>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
+#include <sys/stat.h>
+
 #include <archive.h>
 #include <archive_entry.h>
 
 #include <jni.h>
 
 #include "mbcommon/common.h"
+#include "mbcommon/string.h"
 
+#include "mbbootimg/compare.h"
 #include "mbbootimg/entry.h"
 #include "mbbootimg/header.h"
+#include "mbbootimg/ramdisk.h"
 #include "mbbootimg/reader.h"
 
 #include "mblog/android_logger.h"
@@ -43,10 +53,77 @@
     Java_com_github_chenxiaolong_dualbootpatcher_nativelib_libmiscstuff_LibMiscStuff_ ## method
 
 #define IOException             "java/io/IOException"
+#define IllegalArgumentException "java/lang/IllegalArgumentException"
 #define OutOfMemoryError        "java/lang/OutOfMemoryError"
 
-typedef std::unique_ptr<archive, decltype(archive_free) *> ScopedArchive;
+// Maximum number of boot image results to cache
+#define BOOT_IMAGE_CACHE_SIZE   64
+
 typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+typedef std::unique_ptr<MbBiRamdiskReader,
+                        decltype(mb_bi_ramdisk_reader_free) *>
+        ScopedRamdiskReader;
+
+struct RomIdResult
+{
+    bool found;
+    std::string rom_id;
+};
+
+// The app queries the same boot images every time the ROM list is shown, so
+// results are cached by path and stat() values. Entries for files that have
+// changed are never looked up again.
+static std::mutex g_cache_lock;
+static std::unordered_map<std::string, bool> g_equal_cache;
+static std::unordered_map<std::string, RomIdResult> g_rom_id_cache;
+
+static bool get_cache_key(const char *path, std::string &key)
+{
+    struct stat sb;
+    if (stat(path, &sb) < 0) {
+        return false;
+    }
+
+    char buf[128];
+    snprintf(buf, sizeof(buf), "\n%" PRIu64 ":%" PRIu64 ":%" PRId64
+             ":%" PRId64 ".%09ld",
+             static_cast<uint64_t>(sb.st_dev),
+             static_cast<uint64_t>(sb.st_ino),
+             static_cast<int64_t>(sb.st_size),
+             static_cast<int64_t>(sb.st_mtim.tv_sec), sb.st_mtim.tv_nsec);
+
+    key = path;
+    key += buf;
+    return true;
+}
+
+template<typename T>
+static bool cache_lookup(const std::unordered_map<std::string, T> &cache,
+                         const std::string &key, T &value)
+{
+    std::lock_guard<std::mutex> lock(g_cache_lock);
+
+    auto it = cache.find(key);
+    if (it == cache.end()) {
+        return false;
+    }
+
+    value = it->second;
+    return true;
+}
+
+template<typename T>
+static void cache_insert(std::unordered_map<std::string, T> &cache,
+                         const std::string &key, T value)
+{
+    std::lock_guard<std::mutex> lock(g_cache_lock);
+
+    if (cache.size() >= BOOT_IMAGE_CACHE_SIZE) {
+        cache.clear();
+    }
+
+    cache[key] = std::move(value);
+}
 
 extern "C" {
 
@@ -215,271 +292,306 @@ CLASS_METHOD(mblogSetLogcat)(JNIEnv *env, jclass clazz)
     mb::log::log_set_logger(std::make_shared<mb::log::AndroidLogger>());
 }
 
-struct LaBootImgCtx
-{
-    MbBiReader *bir;
-    char buf[10240];
-};
-
-static la_ssize_t laBootImgReadCb(archive *a, void *userdata,
-                                  const void **buffer)
+/*!
+ * \brief Read /romid from the ramdisk of a boot image
+ *
+ * \param[in] filename Boot image path
+ * \param[out] result Whether /romid exists and its contents
+ * \param[out] error Error message if this function fails
+ *
+ * \return Whether the boot image was successfully read
+ */
+static bool get_rom_id(const char *filename, RomIdResult &result,
+                       std::string &error)
 {
-    (void) a;
-    LaBootImgCtx *ctx = static_cast<LaBootImgCtx *>(userdata);
-    size_t bytesRead;
-    int ret;
-
-    ret = mb_bi_reader_read_data(ctx->bir, ctx->buf, sizeof(ctx->buf),
-                                 &bytesRead);
-    if (ret == MB_BI_EOF) {
-        return 0;
-    } else if (ret != MB_BI_OK) {
-        return -1;
+    std::string cacheKey;
+    bool haveCacheKey = get_cache_key(filename, cacheKey);
+    if (haveCacheKey && cache_lookup(g_rom_id_cache, cacheKey, result)) {
+        return true;
     }
 
-    *buffer = ctx->buf;
-    return static_cast<la_ssize_t>(bytesRead);
-}
-
-JNIEXPORT jstring JNICALL
-CLASS_METHOD(getBootImageRomId)(JNIEnv *env, jclass clazz, jstring jfilename)
-{
-    (void) clazz;
-
     ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
+    ScopedRamdiskReader brr(mb_bi_ramdisk_reader_new(),
+                            &mb_bi_ramdisk_reader_free);
     MbBiHeader *header;
-    MbBiEntry *entry;
-    ScopedArchive a(archive_read_new(), &archive_read_free);
-    archive_entry *aEntry;
-    LaBootImgCtx ctx;
+    MbBiRamdiskMember *member;
     int ret;
-    const char *filename;
-    jstring romId = nullptr;
-
-    filename = env->GetStringUTFChars(jfilename, nullptr);
-    if (!filename) {
-        goto done;
-    }
 
     if (!bir) {
-        throw_exception(env, IOException, "Failed to allocate MbBiReader");
-        goto done;
-    } else if (!a) {
-        throw_exception(env, IOException, "Failed to allocate archive");
-        goto done;
+        error = "Failed to allocate MbBiReader";
+        return false;
+    } else if (!brr) {
+        error = "Failed to allocate MbBiRamdiskReader";
+        return false;
     }
 
     // Open input boot image
     ret = mb_bi_reader_enable_format_all(bir.get());
     if (ret != MB_BI_OK) {
-        throw_exception(env, IOException,
-                        "Failed to enable all boot image formats: %s",
-                        mb_bi_reader_error_string(bir.get()));
-        goto done;
+        error = mb::format("Failed to enable all boot image formats: %s",
+                           mb_bi_reader_error_string(bir.get()));
+        return false;
     }
     ret = mb_bi_reader_open_filename(bir.get(), filename);
     if (ret != MB_BI_OK) {
-        throw_exception(env, IOException,
-                        "%s: Failed to open boot image for reading: %s",
-                        filename, mb_bi_reader_error_string(bir.get()));
-        goto done;
+        error = mb::format("%s: Failed to open boot image for reading: %s",
+                           filename, mb_bi_reader_error_string(bir.get()));
+        return false;
     }
 
     // Read header
     ret = mb_bi_reader_read_header(bir.get(), &header);
     if (ret != MB_BI_OK) {
-        throw_exception(env, IOException,
-                        "%s: Failed to read header: %s",
-                        filename, mb_bi_reader_error_string(bir.get()));
-        goto done;
+        error = mb::format("%s: Failed to read header: %s",
+                           filename, mb_bi_reader_error_string(bir.get()));
+        return false;
     }
 
-    // Go to ramdisk
-    ret = mb_bi_reader_go_to_entry(bir.get(), &entry, MB_BI_ENTRY_RAMDISK);
-    if (ret == MB_BI_EOF) {
-        throw_exception(env, IOException,
-                        "%s: Boot image is missing ramdisk", filename);
-        goto done;
-    } else if (ret != MB_BI_OK) {
-        throw_exception(env, IOException,
-                        "%s: Failed to find ramdisk entry: %s",
-                        filename, mb_bi_reader_error_string(bir.get()));
-        goto done;
+    // Open ramdisk
+    ret = mb_bi_ramdisk_reader_open(brr.get(), bir.get());
+    if (ret != MB_BI_OK) {
+        error = mb::format("%s: Failed to open ramdisk: %s",
+                           filename, mb_bi_ramdisk_reader_error_string(
+                                   brr.get()));
+        return false;
     }
 
-    // Enable support for common ramdisk formats
-    archive_read_support_filter_gzip(a.get());
-    archive_read_support_filter_lz4(a.get());
-    archive_read_support_filter_lzma(a.get());
-    archive_read_support_filter_xz(a.get());
-    archive_read_support_format_cpio(a.get());
+    result.found = false;
+    result.rom_id.clear();
 
-    // Open ramdisk archive
-    ctx.bir = bir.get();
-    ret = archive_read_open(a.get(), &ctx, nullptr, &laBootImgReadCb, nullptr);
-    if (ret != ARCHIVE_OK) {
-        throw_exception(env, IOException,
-                        "%s: Failed to open ramdisk: %s",
-                        filename, archive_error_string(a.get()));
-        goto done;
-    }
+    // Stops at /romid without decompressing the rest of the ramdisk
+    ret = mb_bi_ramdisk_reader_go_to_member(brr.get(), &member, "romid");
+    if (ret == MB_BI_OK) {
+        char buf[32];
+        size_t n_read;
 
-    while ((ret = archive_read_next_header(a.get(), &aEntry)) == ARCHIVE_OK) {
-        const char *path = archive_entry_pathname(aEntry);
-        if (!path) {
-            throw_exception(env, IOException,
-                            "%s: Ramdisk entry has no path", filename);
-            goto done;
+        if (mb_bi_ramdisk_member_size(member) > sizeof(buf) - 1) {
+            error = mb::format("%s: /romid in ramdisk is too large",
+                               filename);
+            return false;
         }
 
-        if (strcmp(path, "romid") == 0) {
-            char buf[32];
-            char dummy;
-            la_ssize_t n_read;
-
-            n_read = archive_read_data(a.get(), buf, sizeof(buf) - 1);
-            if (n_read < 0) {
-                throw_exception(env, IOException,
-                                "%s: Failed to read ramdisk entry: %s",
-                                filename, archive_error_string(a.get()));
-                goto done;
-            }
-
-            // NULL-terminate
-            buf[n_read] = '\0';
-
-            // Ensure that EOF is reached
-            n_read = archive_read_data(a.get(), &dummy, 1);
-            if (n_read != 0) {
-                throw_exception(env, IOException,
-                                "%s: /romid in ramdisk is too large",
-                                filename);
-                goto done;
-            }
-
-            romId = env->NewStringUTF(buf);
-            goto done;
+        ret = mb_bi_ramdisk_reader_read_data(brr.get(), buf, sizeof(buf) - 1,
+                                             &n_read);
+        if (ret == MB_BI_EOF) {
+            n_read = 0;
+        } else if (ret != MB_BI_OK) {
+            error = mb::format("%s: Failed to read ramdisk entry: %s",
+                               filename, mb_bi_ramdisk_reader_error_string(
+                                       brr.get()));
+            return false;
         }
-    }
 
-    if (ret != ARCHIVE_EOF) {
-        throw_exception(env, IOException,
-                        "%s: Failed to read ramdisk entry header: %s",
-                        filename, archive_error_string(a.get()));
-        goto done;
+        // NULL-terminate
+        buf[n_read] = '\0';
+
+        result.found = true;
+        result.rom_id = buf;
+    } else if (ret != MB_BI_EOF) {
+        error = mb::format("%s: Failed to read ramdisk entry header: %s",
+                           filename, mb_bi_ramdisk_reader_error_string(
+                                   brr.get()));
+        return false;
     }
 
-done:
-    if (filename) {
-        env->ReleaseStringUTFChars(jfilename, filename);
+    if (haveCacheKey) {
+        cache_insert(g_rom_id_cache, cacheKey, result);
     }
 
-    return romId;
+    return true;
 }
 
-static bool bootImgHeadersEqual(MbBiHeader *header1, MbBiHeader *header2)
+/*!
+ * \brief Check if two boot images are equal
+ *
+ * \param[in] filename1 First boot image path
+ * \param[in] filename2 Second boot image path
+ * \param[out] equal Whether the boot images are equal
+ * \param[out] error Error message if this function fails
+ *
+ * \return Whether the boot images were successfully compared
+ */
+static bool compare_boot_images(const char *filename1, const char *filename2,
+                                bool &equal, std::string &error)
 {
-#define CHECK_COMPARABLE_VALUES(ISSET1, ISSET2, VALUE1, VALUE2) \
-    do { \
-        bool isset1 = (ISSET1); \
-        bool isset2 = (ISSET2); \
-        if (isset1 != isset2 \
-                || (isset1 && isset2 && (VALUE1) != (VALUE2))) { \
-            return false; \
-        } \
-    } while (0)
+    std::string cacheKey;
+    std::string cacheKey2;
+    bool haveCacheKey = get_cache_key(filename1, cacheKey)
+            && get_cache_key(filename2, cacheKey2);
+    if (haveCacheKey) {
+        cacheKey += '\0';
+        cacheKey += cacheKey2;
+
+        if (cache_lookup(g_equal_cache, cacheKey, equal)) {
+            return true;
+        }
+    }
 
-#define CHECK_STRING_VALUES(ISSET1, ISSET2, STR1, STR2) \
-    do { \
-        bool isset1 = (ISSET1); \
-        bool isset2 = (ISSET2); \
-        if (isset1 != isset2 \
-                || (isset1 && isset2 && strcmp(STR1, STR2) != 0)) { \
-            return false; \
-        } \
-    } while (0)
+    ScopedReader bir1(mb_bi_reader_new(), &mb_bi_reader_free);
+    ScopedReader bir2(mb_bi_reader_new(), &mb_bi_reader_free);
+    int ret;
+    int result;
 
-    // Board name
+    if (!bir1 || !bir2) {
+        error = "Failed to allocate MbBiReader instances";
+        return false;
+    }
 
-    const char *name1 = mb_bi_header_board_name(header1);
-    const char *name2 = mb_bi_header_board_name(header2);
+    // Set up reader formats
+    ret = mb_bi_reader_enable_format_all(bir1.get());
+    if (ret != MB_BI_OK) {
+        error = mb::format("Failed to enable all boot image formats: %s",
+                           mb_bi_reader_error_string(bir1.get()));
+        return false;
+    }
+    ret = mb_bi_reader_enable_format_all(bir2.get());
+    if (ret != MB_BI_OK) {
+        error = mb::format("Failed to enable all boot image formats: %s",
+                           mb_bi_reader_error_string(bir2.get()));
+        return false;
+    }
 
-    CHECK_STRING_VALUES(!!name1, !!name2, name1, name2);
+    // Open boot images
+    ret = mb_bi_reader_open_filename(bir1.get(), filename1);
+    if (ret != MB_BI_OK) {
+        error = mb::format("%s: Failed to open boot image for reading: %s",
+                           filename1, mb_bi_reader_error_string(bir1.get()));
+        return false;
+    }
+    ret = mb_bi_reader_open_filename(bir2.get(), filename2);
+    if (ret != MB_BI_OK) {
+        error = mb::format("%s: Failed to open boot image for reading: %s",
+                           filename2, mb_bi_reader_error_string(bir2.get()));
+        return false;
+    }
 
-    // Kernel cmdline
+    // Compare headers, then entry sizes, then entry data
+    ret = mb_bi_reader_compare(bir1.get(), bir2.get(), &result);
+    if (ret != MB_BI_OK) {
+        error = mb::format("%s, %s: Failed to compare boot images: %s",
+                           filename1, filename2,
+                           mb_bi_reader_error_string(bir1.get()));
+        return false;
+    }
 
-    const char *cmdline1 = mb_bi_header_kernel_cmdline(header1);
-    const char *cmdline2 = mb_bi_header_kernel_cmdline(header2);
+    equal = !!result;
 
-    CHECK_STRING_VALUES(!!cmdline1, !!cmdline2, cmdline1, cmdline2);
+    if (haveCacheKey) {
+        cache_insert(g_equal_cache, cacheKey, equal);
+    }
 
-    // Page size
+    return true;
+}
 
-    CHECK_COMPARABLE_VALUES(mb_bi_header_page_size_is_set(header1),
-                            mb_bi_header_page_size_is_set(header2),
-                            mb_bi_header_page_size(header1),
-                            mb_bi_header_page_size(header2));
+/*!
+ * \brief RAII wrapper for the UTF-8 characters of a jstring
+ */
+class ScopedUtfChars
+{
+public:
+    ScopedUtfChars(JNIEnv *env, jstring str)
+        : _env(env), _str(str)
+        , _chars(str ? env->GetStringUTFChars(str, nullptr) : nullptr)
+    {
+    }
 
-    // Kernel address
+    ~ScopedUtfChars()
+    {
+        if (_chars) {
+            _env->ReleaseStringUTFChars(_str, _chars);
+        }
+    }
 
-    CHECK_COMPARABLE_VALUES(mb_bi_header_kernel_address_is_set(header1),
-                            mb_bi_header_kernel_address_is_set(header2),
-                            mb_bi_header_kernel_address(header1),
-                            mb_bi_header_kernel_address(header2));
+    const char * get() const
+    {
+        return _chars;
+    }
 
-    // Ramdisk address
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(ScopedUtfChars)
 
-    CHECK_COMPARABLE_VALUES(mb_bi_header_ramdisk_address_is_set(header1),
-                            mb_bi_header_ramdisk_address_is_set(header2),
-                            mb_bi_header_ramdisk_address(header1),
-                            mb_bi_header_ramdisk_address(header2));
+private:
+    JNIEnv *_env;
+    jstring _str;
+    const char *_chars;
+};
 
-    // Second bootloader address
+JNIEXPORT jstring JNICALL
+CLASS_METHOD(getBootImageRomId)(JNIEnv *env, jclass clazz, jstring jfilename)
+{
+    (void) clazz;
 
-    CHECK_COMPARABLE_VALUES(mb_bi_header_secondboot_address_is_set(header1),
-                            mb_bi_header_secondboot_address_is_set(header2),
-                            mb_bi_header_secondboot_address(header1),
-                            mb_bi_header_secondboot_address(header2));
+    ScopedUtfChars filename(env, jfilename);
+    if (!filename.get()) {
+        return nullptr;
+    }
 
-    // Kernel tags address
+    RomIdResult result;
+    std::string error;
 
-    CHECK_COMPARABLE_VALUES(mb_bi_header_kernel_tags_address_is_set(header1),
-                            mb_bi_header_kernel_tags_address_is_set(header2),
-                            mb_bi_header_kernel_tags_address(header1),
-                            mb_bi_header_kernel_tags_address(header2));
+    if (!get_rom_id(filename.get(), result, error)) {
+        throw_exception(env, IOException, "%s", error.c_str());
+        return nullptr;
+    }
 
-    // Sony IPL address
+    return result.found ? env->NewStringUTF(result.rom_id.c_str()) : nullptr;
+}
 
-    CHECK_COMPARABLE_VALUES(mb_bi_header_sony_ipl_address_is_set(header1),
-                            mb_bi_header_sony_ipl_address_is_set(header2),
-                            mb_bi_header_sony_ipl_address(header1),
-                            mb_bi_header_sony_ipl_address(header2));
+/*!
+ * Batch version of getBootImageRomId(). Each element of the returned array is
+ * the ROM ID, an empty string if the ramdisk has no /romid, or null if the
+ * boot image could not be read. Errors are logged instead of thrown so that
+ * one bad image does not fail the whole batch.
+ */
+JNIEXPORT jobjectArray JNICALL
+CLASS_METHOD(getBootImageRomIds)(JNIEnv *env, jclass clazz,
+                                 jobjectArray jfilenames)
+{
+    (void) clazz;
 
-    // Sony RPM address
+    jsize count = env->GetArrayLength(jfilenames);
 
-    CHECK_COMPARABLE_VALUES(mb_bi_header_sony_rpm_address_is_set(header1),
-                            mb_bi_header_sony_rpm_address_is_set(header2),
-                            mb_bi_header_sony_rpm_address(header1),
-                            mb_bi_header_sony_rpm_address(header2));
+    jclass stringClass = env->FindClass("java/lang/String");
+    if (!stringClass) {
+        return nullptr;
+    }
+
+    jobjectArray results = env->NewObjectArray(count, stringClass, nullptr);
+    if (!results) {
+        return nullptr;
+    }
 
-    // Sony APPSBL address
+    for (jsize i = 0; i < count; ++i) {
+        jstring jfilename = static_cast<jstring>(
+                env->GetObjectArrayElement(jfilenames, i));
+        RomIdResult result;
+        std::string error;
+        bool ok;
 
-    CHECK_COMPARABLE_VALUES(mb_bi_header_sony_appsbl_address_is_set(header1),
-                            mb_bi_header_sony_appsbl_address_is_set(header2),
-                            mb_bi_header_sony_appsbl_address(header1),
-                            mb_bi_header_sony_appsbl_address(header2));
+        {
+            ScopedUtfChars filename(env, jfilename);
+            if (!filename.get()) {
+                return nullptr;
+            }
 
-    // Entrypoint address
+            ok = get_rom_id(filename.get(), result, error);
+        }
 
-    CHECK_COMPARABLE_VALUES(mb_bi_header_entrypoint_address_is_set(header1),
-                            mb_bi_header_entrypoint_address_is_set(header2),
-                            mb_bi_header_entrypoint_address(header1),
-                            mb_bi_header_entrypoint_address(header2));
+        // Large batches would otherwise overflow the local reference table
+        env->DeleteLocalRef(jfilename);
 
-    return true;
+        if (ok) {
+            jstring romId = env->NewStringUTF(result.rom_id.c_str());
+            if (!romId) {
+                return nullptr;
+            }
+            env->SetObjectArrayElement(results, i, romId);
+            env->DeleteLocalRef(romId);
+        } else {
+            LOGE("%s", error.c_str());
+        }
+    }
 
-#undef CHECK_COMPARABLE_VALUES
-#undef CHECK_STRING_VALUES
+    return results;
 }
 
 JNIEXPORT jboolean JNICALL
@@ -488,173 +600,90 @@ CLASS_METHOD(bootImagesEqual)(JNIEnv *env, jclass clazz, jstring jfilename1,
 {
     (void) clazz;
 
-    ScopedReader bir1(mb_bi_reader_new(), &mb_bi_reader_free);
-    ScopedReader bir2(mb_bi_reader_new(), &mb_bi_reader_free);
-    MbBiHeader *header1;
-    MbBiHeader *header2;
-    MbBiEntry *entry1;
-    MbBiEntry *entry2;
-    size_t entries = 0;
-    int ret;
-    const char *filename1 = nullptr;
-    const char *filename2 = nullptr;
-    jboolean result = false;
-
-    filename1 = env->GetStringUTFChars(jfilename1, nullptr);
-    if (!filename1) {
-        goto done;
+    ScopedUtfChars filename1(env, jfilename1);
+    if (!filename1.get()) {
+        return false;
     }
-    filename2 = env->GetStringUTFChars(jfilename2, nullptr);
-    if (!filename2) {
-        goto done;
+    ScopedUtfChars filename2(env, jfilename2);
+    if (!filename2.get()) {
+        return false;
     }
 
-    if (!bir1 || !bir2) {
-        throw_exception(env, IOException,
-                        "Failed to allocate MbBiReader instances");
-        goto done;
-    }
+    bool equal;
+    std::string error;
 
-    // Set up reader formats
-    ret = mb_bi_reader_enable_format_all(bir1.get());
-    if (ret != MB_BI_OK) {
-        throw_exception(env, IOException,
-                        "Failed to enable all boot image formats: %s",
-                        mb_bi_reader_error_string(bir1.get()));
-        goto done;
-    }
-    ret = mb_bi_reader_enable_format_all(bir2.get());
-    if (ret != MB_BI_OK) {
-        throw_exception(env, IOException,
-                        "Failed to enable all boot image formats: %s",
-                        mb_bi_reader_error_string(bir2.get()));
-        goto done;
+    if (!compare_boot_images(filename1.get(), filename2.get(), equal, error)) {
+        throw_exception(env, IOException, "%s", error.c_str());
+        return false;
     }
 
-    // Open boot images
-    ret = mb_bi_reader_open_filename(bir1.get(), filename1);
-    if (ret != MB_BI_OK) {
-        throw_exception(env, IOException,
-                        "%s: Failed to open boot image for reading: %s",
-                        filename1, mb_bi_reader_error_string(bir1.get()));
-        goto done;
-    }
-    ret = mb_bi_reader_open_filename(bir2.get(), filename2);
-    if (ret != MB_BI_OK) {
-        throw_exception(env, IOException,
-                        "%s: Failed to open boot image for reading: %s",
-                        filename2, mb_bi_reader_error_string(bir2.get()));
-        goto done;
-    }
+    return equal;
+}
 
-    // Read headers
-    ret = mb_bi_reader_read_header(bir1.get(), &header1);
-    if (ret != MB_BI_OK) {
-        throw_exception(env, IOException,
-                        "%s: Failed to read header: %s",
-                        filename1, mb_bi_reader_error_string(bir1.get()));
-        goto done;
-    }
-    ret = mb_bi_reader_read_header(bir2.get(), &header2);
-    if (ret != MB_BI_OK) {
-        throw_exception(env, IOException,
-                        "%s: Failed to read header: %s",
-                        filename1, mb_bi_reader_error_string(bir2.get()));
-        goto done;
-    }
+/*!
+ * Batch version of bootImagesEqual(). Element i of the returned array
+ * compares element i of both arrays and is 1 if the boot images are equal, 0
+ * if they differ, or -1 if either could not be read (the error is logged).
+ */
+JNIEXPORT jintArray JNICALL
+CLASS_METHOD(bootImagesEqualBatch)(JNIEnv *env, jclass clazz,
+                                   jobjectArray jfilenames1,
+                                   jobjectArray jfilenames2)
+{
+    (void) clazz;
 
-    // Compare headers
-    if (!bootImgHeadersEqual(header1, header2)) {
-        goto done;
+    jsize count = env->GetArrayLength(jfilenames1);
+    if (env->GetArrayLength(jfilenames2) != count) {
+        throw_exception(env, IllegalArgumentException,
+                        "Arrays have different lengths");
+        return nullptr;
     }
 
-    // Count entries in first boot image
-    {
-        while ((ret = mb_bi_reader_read_entry(bir1.get(), &entry1))
-                == MB_BI_OK) {
-            ++entries;
-        }
-
-        if (ret != MB_BI_EOF) {
-            throw_exception(env, IOException,
-                            "%s: Failed to read entry: %s",
-                            filename1, mb_bi_reader_error_string(bir1.get()));
-            goto done;
-        }
+    jintArray results = env->NewIntArray(count);
+    if (!results) {
+        return nullptr;
     }
 
-    // Compare each entry in second image to first
-    {
-        while ((ret = mb_bi_reader_read_entry(bir2.get(), &entry2))
-                == MB_BI_OK) {
-            if (entries == 0) {
-                // Too few entries in second image
-                goto done;
-            }
-            --entries;
+    jint *values = env->GetIntArrayElements(results, nullptr);
+    if (!values) {
+        return nullptr;
+    }
 
-            // Find the same entry in first image
-            ret = mb_bi_reader_go_to_entry(bir1.get(), &entry1,
-                                           mb_bi_entry_type(entry2));
-            if (ret == MB_BI_EOF) {
-                // Cannot be equal if entry is missing
-                goto done;
-            } else if (ret != MB_BI_OK) {
-                throw_exception(env, IOException,
-                                "%s: Failed to seek to entry: %s", filename1,
-                                mb_bi_reader_error_string(bir1.get()));
-                goto done;
-            }
+    for (jsize i = 0; i < count; ++i) {
+        jstring jfilename1 = static_cast<jstring>(
+                env->GetObjectArrayElement(jfilenames1, i));
+        jstring jfilename2 = static_cast<jstring>(
+                env->GetObjectArrayElement(jfilenames2, i));
+        bool equal;
+        std::string error;
+        bool ok;
 
-            // Compare data
-            char buf1[10240];
-            char buf2[10240];
-            size_t n1;
-            size_t n2;
-
-            while ((ret = mb_bi_reader_read_data(
-                    bir1.get(), buf1, sizeof(buf1), &n1)) == MB_BI_OK) {
-                ret = mb_bi_reader_read_data(bir2.get(), buf2, n1, &n2);
-                if (ret != MB_BI_OK) {
-                    throw_exception(env, IOException,
-                                    "%s: Failed to read data: %s", filename2,
-                                    mb_bi_reader_error_string(bir2.get()));
-                    goto done;
-                }
-
-                if (n1 != n2 || memcmp(buf1, buf2, n1) != 0) {
-                    // Data is not equivalent
-                    goto done;
-                }
+        {
+            ScopedUtfChars filename1(env, jfilename1);
+            ScopedUtfChars filename2(env, jfilename2);
+            if (!filename1.get() || !filename2.get()) {
+                env->ReleaseIntArrayElements(results, values, JNI_ABORT);
+                return nullptr;
             }
 
-            if (ret != MB_BI_EOF) {
-                throw_exception(env, IOException,
-                                "%s: Failed to read data: %s", filename1,
-                                mb_bi_reader_error_string(bir1.get()));
-                goto done;
-            }
+            ok = compare_boot_images(filename1.get(), filename2.get(), equal,
+                                     error);
         }
 
-        if (ret != MB_BI_EOF) {
-            throw_exception(env, IOException,
-                            "%s: Failed to read entry: %s",
-                            filename2, mb_bi_reader_error_string(bir2.get()));
-            goto done;
+        env->DeleteLocalRef(jfilename1);
+        env->DeleteLocalRef(jfilename2);
+
+        if (ok) {
+            values[i] = equal ? 1 : 0;
+        } else {
+            LOGE("%s", error.c_str());
+            values[i] = -1;
         }
     }
 
-    result = true;
-
-done:
-    if (filename1) {
-        env->ReleaseStringUTFChars(jfilename1, filename1);
-    }
-    if (filename2) {
-        env->ReleaseStringUTFChars(jfilename2, filename2);
-    }
+    env->ReleaseIntArrayElements(results, values, 0);
 
-    return result;
+    return results;
 }
 
 }
@@ -44,6 +44,7 @@ const char *tw_resource_path = "/bootui/theme";
 const char *tw_settings_path = "/bootui/settings.bin";
 const char *tw_screenshots_path = "/bootui/screenshots";
 const char *tw_theme_zip_path = "/bootui/theme.zip";
+const char *tw_image_cache_path = nullptr;
 
 int tw_android_sdk_version = 0;
 
@@ -114,6 +114,8 @@ extern const char *tw_resource_path;
 extern const char *tw_settings_path;
 extern const char *tw_screenshots_path;
 extern const char *tw_theme_zip_path;
+// Directory for caching scaled theme images or nullptr to disable the cache
+extern const char *tw_image_cache_path;
 
 // TODO: Make TW_USE_KEY_CODE_TOUCH_SYNC an option
 
@@ -17,8 +17,11 @@
 
 #include "daemon_connection.h"
 
+#include <unordered_map>
+
 #include <cstring>
 
+#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -52,90 +55,218 @@ MbtoolInterface *mbtool_interface = nullptr;
 namespace v3 = mbtool::daemon::v3;
 namespace fb = flatbuffers;
 
+template<typename T>
+struct CachedQuery
+{
+    typedef std::function<void(bool, const T &)> Callback;
+
+    bool valid = false;
+    bool in_flight = false;
+    T value;
+    std::vector<Callback> waiters;
+};
+
 class MbtoolInterfaceV3 : public MbtoolInterface
 {
 public:
-    MbtoolInterfaceV3(int fd) : _fd(fd)
+    MbtoolInterfaceV3(int fd)
+        : _fd(fd)
+        , _reader(fd)
+        , _next_id(1)
+        , _thread_started(false)
+        , _dead(false)
     {
+        pthread_mutex_init(&_lock, nullptr);
+        pthread_mutex_init(&_write_lock, nullptr);
+        pthread_cond_init(&_cond, nullptr);
     }
 
     virtual ~MbtoolInterfaceV3()
     {
+        if (_thread_started) {
+            // Wake up the reader thread
+            ::shutdown(_fd, SHUT_RDWR);
+            pthread_join(_thread, nullptr);
+        }
+
+        pthread_cond_destroy(&_cond);
+        pthread_mutex_destroy(&_write_lock);
+        pthread_mutex_destroy(&_lock);
     }
 
-    virtual bool get_installed_roms(std::vector<Rom> *result)
+    bool start()
     {
-        fb::FlatBufferBuilder builder;
+        if (pthread_create(&_thread, nullptr, &reader_thread_wrapper,
+                           this) != 0) {
+            LOGE("Failed to create daemon reader thread");
+            return false;
+        }
 
-        std::vector<fb::Offset<v3::MbRom>> fb_roms;
+        _thread_started = true;
+        return true;
+    }
+
+    virtual void get_installed_roms_async(InstalledRomsCallback cb)
+    {
+        if (!begin_query(_roms, std::move(cb))) {
+            return;
+        }
+
+        fb::FlatBufferBuilder builder;
 
         // Create request
         auto request = v3::CreateMbGetInstalledRomsRequest(builder);
 
         // Send request
-        std::vector<uint8_t> buf;
-        const v3::MbGetInstalledRomsResponse *response;
-        if (!send_request(&buf, &builder, request.Union(),
-                          v3::RequestType_MbGetInstalledRomsRequest,
-                          v3::ResponseType_MbGetInstalledRomsResponse,
-                          (const void **) &response)) {
-            return false;
-        }
-
-        std::vector<Rom> roms;
+        bool ret = send_request(
+                &builder, request.Union(),
+                v3::RequestType_MbGetInstalledRomsRequest,
+                v3::ResponseType_MbGetInstalledRomsResponse,
+                [this](const void *data) {
+            if (!data) {
+                finish_query(_roms, false, std::vector<Rom>());
+                return;
+            }
 
-        if (response->roms()) {
-            for (auto const &mb_rom : *response->roms()) {
-                roms.emplace_back();
-                if (mb_rom->id()) {
-                    roms.back().id = mb_rom->id()->str();
-                }
-                if (mb_rom->system_path()) {
-                    roms.back().system_path = mb_rom->system_path()->str();
-                }
-                if (mb_rom->cache_path()) {
-                    roms.back().cache_path = mb_rom->cache_path()->str();
-                }
-                if (mb_rom->data_path()) {
-                    roms.back().data_path = mb_rom->data_path()->str();
-                }
-                if (mb_rom->version()) {
-                    roms.back().version = mb_rom->version()->str();
-                }
-                if (mb_rom->build()) {
-                    roms.back().build = mb_rom->build()->str();
+            auto response =
+                    static_cast<const v3::MbGetInstalledRomsResponse *>(data);
+            std::vector<Rom> roms;
+
+            if (response->roms()) {
+                for (auto const &mb_rom : *response->roms()) {
+                    roms.emplace_back();
+                    if (mb_rom->id()) {
+                        roms.back().id = mb_rom->id()->str();
+                    }
+                    if (mb_rom->system_path()) {
+                        roms.back().system_path = mb_rom->system_path()->str();
+                    }
+                    if (mb_rom->cache_path()) {
+                        roms.back().cache_path = mb_rom->cache_path()->str();
+                    }
+                    if (mb_rom->data_path()) {
+                        roms.back().data_path = mb_rom->data_path()->str();
+                    }
+                    if (mb_rom->version()) {
+                        roms.back().version = mb_rom->version()->str();
+                    }
+                    if (mb_rom->build()) {
+                        roms.back().build = mb_rom->build()->str();
+                    }
                 }
             }
-        }
 
-        result->swap(roms);
-        return true;
+            finish_query(_roms, true, std::move(roms));
+        });
+        if (!ret) {
+            finish_query(_roms, false, std::vector<Rom>());
+        }
     }
 
-    virtual bool get_booted_rom_id(std::string *result)
+    virtual void get_booted_rom_id_async(StringCallback cb)
     {
+        if (!begin_query(_booted_rom_id, std::move(cb))) {
+            return;
+        }
+
         fb::FlatBufferBuilder builder;
 
         // Create request
         auto request = v3::CreateMbGetBootedRomIdRequest(builder);
 
         // Send request
-        std::vector<uint8_t> buf;
-        const v3::MbGetBootedRomIdResponse *response;
-        if (!send_request(&buf, &builder, request.Union(),
-                          v3::RequestType_MbGetBootedRomIdRequest,
-                          v3::ResponseType_MbGetBootedRomIdResponse,
-                          (const void **) &response)) {
-            return false;
+        bool ret = send_request(
+                &builder, request.Union(),
+                v3::RequestType_MbGetBootedRomIdRequest,
+                v3::ResponseType_MbGetBootedRomIdResponse,
+                [this](const void *data) {
+            if (!data) {
+                finish_query(_booted_rom_id, false, std::string());
+                return;
+            }
+
+            auto response =
+                    static_cast<const v3::MbGetBootedRomIdResponse *>(data);
+            std::string rom_id;
+            if (response->rom_id()) {
+                rom_id = response->rom_id()->str();
+            }
+
+            finish_query(_booted_rom_id, true, std::move(rom_id));
+        });
+        if (!ret) {
+            finish_query(_booted_rom_id, false, std::string());
         }
+    }
 
-        if (response->rom_id()) {
-            *result = response->rom_id()->str();
-        } else {
-            result->clear();
+    virtual void version_async(StringCallback cb)
+    {
+        if (!begin_query(_version, std::move(cb))) {
+            return;
         }
 
-        return true;
+        fb::FlatBufferBuilder builder;
+
+        // Create request
+        auto request = v3::CreateMbGetVersionRequest(builder);
+
+        // Send request
+        bool ret = send_request(
+                &builder, request.Union(),
+                v3::RequestType_MbGetVersionRequest,
+                v3::ResponseType_MbGetVersionResponse,
+                [this](const void *data) {
+            if (!data) {
+                finish_query(_version, false, std::string());
+                return;
+            }
+
+            auto response =
+                    static_cast<const v3::MbGetVersionResponse *>(data);
+            std::string version;
+            if (response->version()) {
+                version = response->version()->str();
+            }
+
+            finish_query(_version, true, std::move(version));
+        });
+        if (!ret) {
+            finish_query(_version, false, std::string());
+        }
+    }
+
+    virtual void prefetch()
+    {
+        // These are independent requests, so the daemon answers them
+        // concurrently
+        version_async([](bool, const std::string &) {});
+        get_booted_rom_id_async([](bool, const std::string &) {});
+        get_installed_roms_async([](bool, const std::vector<Rom> &) {});
+    }
+
+    virtual void invalidate()
+    {
+        pthread_mutex_lock(&_lock);
+        _roms.valid = false;
+        _booted_rom_id.valid = false;
+        _version.valid = false;
+        pthread_mutex_unlock(&_lock);
+    }
+
+    virtual bool get_installed_roms(std::vector<Rom> *result)
+    {
+        using namespace std::placeholders;
+        return wait_for_query<std::vector<Rom>>(std::bind(
+                &MbtoolInterfaceV3::get_installed_roms_async, this, _1),
+                result);
+    }
+
+    virtual bool get_booted_rom_id(std::string *result)
+    {
+        using namespace std::placeholders;
+        return wait_for_query<std::string>(std::bind(
+                &MbtoolInterfaceV3::get_booted_rom_id_async, this, _1),
+                result);
     }
 
     virtual bool switch_rom(const std::string &id,
@@ -161,30 +292,39 @@ public:
                                                     force_checksums_update);
 
         // Send request
-        std::vector<uint8_t> buf;
-        const v3::MbSwitchRomResponse *response;
-        if (!send_request(&buf, &builder, request.Union(),
-                          v3::RequestType_MbSwitchRomRequest,
-                          v3::ResponseType_MbSwitchRomResponse,
-                          (const void **) &response)) {
-            return false;
-        }
+        SwitchRomResult srr = SwitchRomResult::FAILED;
+        bool ret = send_request_sync(
+                &builder, request.Union(),
+                v3::RequestType_MbSwitchRomRequest,
+                v3::ResponseType_MbSwitchRomResponse,
+                [&](const void *data) {
+            auto response =
+                    static_cast<const v3::MbSwitchRomResponse *>(data);
+
+            switch (response->result()) {
+            case v3::MbSwitchRomResult_SUCCEEDED:
+                srr = SwitchRomResult::SUCCEEDED;
+                break;
+            case v3::MbSwitchRomResult_FAILED:
+                srr = SwitchRomResult::FAILED;
+                break;
+            case v3::MbSwitchRomResult_CHECKSUM_INVALID:
+                srr = SwitchRomResult::CHECKSUM_INVALID;
+                break;
+            case v3::MbSwitchRomResult_CHECKSUM_NOT_FOUND:
+                srr = SwitchRomResult::CHECKSUM_NOT_FOUND;
+                break;
+            default:
+                return false;
+            }
+
+            return true;
+        });
 
-        SwitchRomResult srr;
-        switch (response->result()) {
-        case v3::MbSwitchRomResult_SUCCEEDED:
-            srr = SwitchRomResult::SUCCEEDED;
-            break;
-        case v3::MbSwitchRomResult_FAILED:
-            srr = SwitchRomResult::FAILED;
-            break;
-        case v3::MbSwitchRomResult_CHECKSUM_INVALID:
-            srr = SwitchRomResult::CHECKSUM_INVALID;
-            break;
-        case v3::MbSwitchRomResult_CHECKSUM_NOT_FOUND:
-            srr = SwitchRomResult::CHECKSUM_NOT_FOUND;
-            break;
-        default:
+        // The daemon state may have changed
+        invalidate();
+
+        if (!ret) {
             return false;
         }
 
@@ -202,17 +342,14 @@ public:
                                                v3::RebootType_DIRECT, false);
 
         // Send request
-        std::vector<uint8_t> buf;
-        const v3::RebootResponse *response;
-        if (!send_request(&buf, &builder, request.Union(),
-                          v3::RequestType_RebootRequest,
-                          v3::ResponseType_RebootResponse,
-                          (const void **) &response)) {
-            return false;
-        }
-
-        *result = response->success();
-        return true;
+        return send_request_sync(
+                &builder, request.Union(),
+                v3::RequestType_RebootRequest,
+                v3::ResponseType_RebootResponse,
+                [&](const void *data) {
+            *result = static_cast<const v3::RebootResponse *>(data)->success();
+            return true;
+        });
     }
 
     virtual bool shutdown(bool *result)
@@ -224,98 +361,288 @@ public:
                                                  v3::ShutdownType_DIRECT);
 
         // Send request
-        std::vector<uint8_t> buf;
-        const v3::ShutdownResponse *response;
-        if (!send_request(&buf, &builder, request.Union(),
-                          v3::RequestType_ShutdownRequest,
-                          v3::ResponseType_ShutdownResponse,
-                          (const void **) &response)) {
+        return send_request_sync(
+                &builder, request.Union(),
+                v3::RequestType_ShutdownRequest,
+                v3::ResponseType_ShutdownResponse,
+                [&](const void *data) {
+            *result = static_cast<const v3::ShutdownResponse *>(data)
+                    ->success();
+            return true;
+        });
+    }
+
+    virtual bool version(std::string *result)
+    {
+        using namespace std::placeholders;
+        return wait_for_query<std::string>(std::bind(
+                &MbtoolInterfaceV3::version_async, this, _1), result);
+    }
+
+private:
+    // Called with the response table or nullptr if the request failed. The
+    // data is only valid for the duration of the call.
+    typedef std::function<void(const void *)> ResponseHandler;
+
+    struct PendingRequest
+    {
+        v3::RequestType request_type;
+        v3::ResponseType expected_type;
+        ResponseHandler handler;
+    };
+
+    template<typename T>
+    bool begin_query(CachedQuery<T> &query,
+                     typename CachedQuery<T>::Callback cb)
+    {
+        pthread_mutex_lock(&_lock);
+
+        if (query.valid) {
+            T value = query.value;
+            pthread_mutex_unlock(&_lock);
+            cb(true, value);
             return false;
         }
 
-        *result = response->success();
-        return true;
+        query.waiters.push_back(std::move(cb));
+
+        // Coalesce with the request that's already in flight
+        bool send = !query.in_flight;
+        query.in_flight = true;
+
+        pthread_mutex_unlock(&_lock);
+        return send;
     }
 
-    virtual bool version(std::string *result)
+    template<typename T>
+    void finish_query(CachedQuery<T> &query, bool ok, T value)
     {
-        fb::FlatBufferBuilder builder;
+        std::vector<typename CachedQuery<T>::Callback> waiters;
 
-        // Create request
-        auto request = v3::CreateMbGetVersionRequest(builder);
+        pthread_mutex_lock(&_lock);
+        query.in_flight = false;
+        if (ok) {
+            query.valid = true;
+            query.value = value;
+        }
+        waiters.swap(query.waiters);
+        pthread_mutex_unlock(&_lock);
 
-        // Send request
-        std::vector<uint8_t> buf;
-        const v3::MbGetVersionResponse *response;
-        if (!send_request(&buf, &builder, request.Union(),
-                          v3::RequestType_MbGetVersionRequest,
-                          v3::ResponseType_MbGetVersionResponse,
-                          (const void **) &response)) {
+        for (auto const &cb : waiters) {
+            cb(ok, value);
+        }
+    }
+
+    template<typename T>
+    bool wait_for_query(
+            const std::function<void(typename CachedQuery<T>::Callback)> &fn,
+            T *result)
+    {
+        bool done = false;
+        bool ret = false;
+
+        fn([&](bool ok, const T &value) {
+            pthread_mutex_lock(&_lock);
+            if (ok) {
+                *result = value;
+            }
+            ret = ok;
+            done = true;
+            pthread_cond_broadcast(&_cond);
+            pthread_mutex_unlock(&_lock);
+        });
+
+        pthread_mutex_lock(&_lock);
+        while (!done) {
+            pthread_cond_wait(&_cond, &_lock);
+        }
+        pthread_mutex_unlock(&_lock);
+
+        return ret;
+    }
+
+    bool send_request_sync(fb::FlatBufferBuilder *builder,
+                           const fb::Offset<void> &fb_request,
+                           v3::RequestType request_type,
+                           v3::ResponseType expected_type,
+                           const std::function<bool(const void *)> &parse)
+    {
+        bool done = false;
+        bool ret = false;
+
+        auto handler = [&](const void *data) {
+            // The parser fills in the caller's variables, which are not
+            // touched again until done is set
+            bool ok = data && parse(data);
+
+            pthread_mutex_lock(&_lock);
+            ret = ok;
+            done = true;
+            pthread_cond_broadcast(&_cond);
+            pthread_mutex_unlock(&_lock);
+        };
+
+        if (!send_request(builder, fb_request, request_type, expected_type,
+                          handler)) {
             return false;
         }
 
-        if (response->version()) {
-            *result = response->version()->str();
-        } else {
-            result->clear();
+        pthread_mutex_lock(&_lock);
+        while (!done) {
+            pthread_cond_wait(&_cond, &_lock);
         }
+        pthread_mutex_unlock(&_lock);
 
-        return true;
+        return ret;
     }
 
-private:
-    bool send_request(std::vector<uint8_t> *buf,
-                      fb::FlatBufferBuilder *builder,
+    bool send_request(fb::FlatBufferBuilder *builder,
                       const fb::Offset<void> &fb_request,
                       v3::RequestType request_type,
                       v3::ResponseType expected_type,
-                      const void **result)
+                      ResponseHandler handler)
     {
+        pthread_mutex_lock(&_lock);
+
+        if (_dead) {
+            pthread_mutex_unlock(&_lock);
+            return false;
+        }
+
+        uint32_t id = _next_id++;
+        if (_next_id == 0) {
+            // 0 means that the request is not pipelined
+            _next_id = 1;
+        }
+
+        _pending[id] = { request_type, expected_type, std::move(handler) };
+
+        pthread_mutex_unlock(&_lock);
+
         // Build request table
         v3::RequestBuilder rb(*builder);
         rb.add_request_type(request_type);
         rb.add_request(fb_request);
+        rb.add_request_id(id);
         builder->Finish(rb.Finish());
 
         // Send request
-        if (!mb::util::socket_write_bytes(
-                _fd, builder->GetBufferPointer(), builder->GetSize())) {
-            return false;
-        }
+        pthread_mutex_lock(&_write_lock);
+        bool ret = mb::util::socket_write_bytes(
+                _fd, builder->GetBufferPointer(), builder->GetSize());
+        pthread_mutex_unlock(&_write_lock);
 
-        // Read response
-        if (!mb::util::socket_read_bytes(_fd, buf)) {
-            return false;
+        if (!ret) {
+            LOGE("Failed to send request: %s", strerror(errno));
+
+            // The reader thread may have already failed the request if the
+            // connection was lost
+            pthread_mutex_lock(&_lock);
+            bool removed = _pending.erase(id) > 0;
+            pthread_mutex_unlock(&_lock);
+
+            return !removed;
         }
 
+        return true;
+    }
+
+    void handle_response(const uint8_t *data, size_t size)
+    {
         // Verify response
-        auto verifier = fb::Verifier(buf->data(), buf->size());
+        auto verifier = fb::Verifier(data, size);
         if (!v3::VerifyResponseBuffer(verifier)) {
             LOGE("Received invalid buffer");
-            return false;
+            return;
+        }
+
+        const v3::Response *response = v3::GetResponse(data);
+
+        PendingRequest pending;
+
+        pthread_mutex_lock(&_lock);
+        auto it = _pending.find(response->request_id());
+        if (it == _pending.end()) {
+            pthread_mutex_unlock(&_lock);
+            LOGW("Received response for unknown request ID: %u",
+                 response->request_id());
+            return;
         }
+        pending = std::move(it->second);
+        _pending.erase(it);
+        pthread_mutex_unlock(&_lock);
 
         // Verify response type
-        const v3::Response *response = v3::GetResponse(buf->data());
         v3::ResponseType type = response->response_type();
 
         if (type == v3::ResponseType_Unsupported) {
-            LOGE("Daemon does not support request type: %d", request_type);
-            return false;
+            LOGE("Daemon does not support request type: %d",
+                 pending.request_type);
+            pending.handler(nullptr);
         } else if (type == v3::ResponseType_Invalid) {
-            LOGE("Daemon says request is invalid: %d", request_type);
-            return false;
-        } else if (type != expected_type) {
+            LOGE("Daemon says request is invalid: %d", pending.request_type);
+            pending.handler(nullptr);
+        } else if (type != pending.expected_type) {
             LOGE("Unexpected response type (actual=%d, expected=%d)",
-                 type, expected_type);
-            return false;
+                 type, pending.expected_type);
+            pending.handler(nullptr);
+        } else {
+            pending.handler(response->response());
         }
+    }
 
-        *result = response->response();
-        return true;
+    void reader_thread()
+    {
+        const uint8_t *data;
+        size_t size;
+
+        // The data remains valid until the next read
+        while (_reader.read(&data, &size)) {
+            handle_response(data, size);
+        }
+
+        // Fail all outstanding requests
+        std::unordered_map<uint32_t, PendingRequest> pending;
+
+        pthread_mutex_lock(&_lock);
+        _dead = true;
+        pending.swap(_pending);
+        pthread_mutex_unlock(&_lock);
+
+        if (!pending.empty()) {
+            LOGE("Lost connection to daemon with %zu pending requests",
+                 pending.size());
+        }
+
+        for (auto &p : pending) {
+            p.second.handler(nullptr);
+        }
+    }
+
+    static void * reader_thread_wrapper(void *userdata)
+    {
+        static_cast<MbtoolInterfaceV3 *>(userdata)->reader_thread();
+        return nullptr;
     }
 
     int _fd;
+    mb::util::SocketFramedReader _reader;
+
+    pthread_t _thread;
+    // Protects everything below and is used with _cond for synchronous calls
+    pthread_mutex_t _lock;
+    pthread_cond_t _cond;
+    // Serializes writes to the socket
+    pthread_mutex_t _write_lock;
+
+    uint32_t _next_id;
+    bool _thread_started;
+    bool _dead;
+    std::unordered_map<uint32_t, PendingRequest> _pending;
+
+    CachedQuery<std::vector<Rom>> _roms;
+    CachedQuery<std::string> _booted_rom_id;
+    CachedQuery<std::string> _version;
 };
 
 MbtoolConnection::MbtoolConnection() : _fd(-1), _iface(nullptr)
@@ -325,7 +652,6 @@ MbtoolConnection::MbtoolConnection() : _fd(-1), _iface(nullptr)
 MbtoolConnection::MbtoolConnection::~MbtoolConnection()
 {
     disconnect();
-    delete _iface;
 }
 
 bool MbtoolConnection::connect()
@@ -403,8 +729,14 @@ bool MbtoolConnection::connect()
         return ret = false;
     }
 
+    MbtoolInterfaceV3 *iface = new MbtoolInterfaceV3(fd);
+    if (!iface->start()) {
+        delete iface;
+        return ret = false;
+    }
+
     _fd = fd;
-    _iface = new MbtoolInterfaceV3(_fd);
+    _iface = iface;
 
     return ret = true;
 }
@@ -413,6 +745,10 @@ bool MbtoolConnection::disconnect()
 {
     int ret = 0;
 
+    // Stop the reader thread before closing the socket
+    delete _iface;
+    _iface = nullptr;
+
     if (_fd >= 0) {
         ret = close(_fd);
         _fd = -1;
@@ -17,6 +17,7 @@
 
 #pragma once
 
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -44,8 +45,28 @@ enum class SwitchRomResult
 class MbtoolInterface
 {
 public:
+    typedef std::function<void(bool ok, const std::vector<Rom> &roms)>
+            InstalledRomsCallback;
+    typedef std::function<void(bool ok, const std::string &value)>
+            StringCallback;
+
     virtual ~MbtoolInterface() {}
 
+    // Asynchronous queries. The results are cached and concurrent requests
+    // for the same query share a single daemon call. Callbacks are invoked
+    // either immediately (if the result is cached) or from the connection's
+    // reader thread, so they must not block or touch GUI state directly.
+    virtual void get_installed_roms_async(InstalledRomsCallback cb) = 0;
+    virtual void get_booted_rom_id_async(StringCallback cb) = 0;
+    virtual void version_async(StringCallback cb) = 0;
+
+    // Start all cacheable queries without waiting for them
+    virtual void prefetch() = 0;
+    // Discard cached query results
+    virtual void invalidate() = 0;
+
+    // Synchronous calls. The queries above return cached results if
+    // available.
     virtual bool get_installed_roms(std::vector<Rom> *result) = 0;
     virtual bool get_booted_rom_id(std::string *result) = 0;
     virtual bool switch_rom(const std::string &id,
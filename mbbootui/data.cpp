@@ -18,8 +18,10 @@
 
 #include "data.hpp"
 
+#include <atomic>
 #include <fstream>
 #include <sstream>
+#include <unordered_map>
 
 #include <cstdlib>
 #include <cstring>
@@ -47,6 +49,8 @@
 
 #define FILE_VERSION 0x00010010 // Do not set to 0
 
+#define MAX_VAR_HANDLES 1024
+
 std::string DataManager::mBackingFile;
 int         DataManager::mInitialized = 0;
 InfoManager DataManager::mPersist;  // Data that that is not constant and will be saved to the settings file
@@ -61,12 +65,27 @@ pthread_mutex_t DataManager::m_valuesLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
 pthread_mutex_t DataManager::m_valuesLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 #endif
 
+// Interned variables. Slots are never removed or moved, so a slot's name is
+// immutable once it is visible through g_var_handle_count and its version can
+// be read without holding m_valuesLock.
+struct VarSlot
+{
+    std::string name;
+    std::atomic<unsigned int> version;
+};
+
+static VarSlot g_var_slots[MAX_VAR_HANDLES];
+static std::atomic<int> g_var_handle_count(0);
+// Protected by m_valuesLock
+static std::unordered_map<std::string, int> g_var_handles;
+
 int DataManager::ResetDefaults()
 {
     pthread_mutex_lock(&m_valuesLock);
     mPersist.Clear();
     mData.Clear();
     mConst.Clear();
+    BumpAllVersions();
     pthread_mutex_unlock(&m_valuesLock);
 
     SetDefaultValues();
@@ -89,6 +108,7 @@ int DataManager::LoadValues(const std::string& filename)
     // Read in the file, if possible
     pthread_mutex_lock(&m_valuesLock);
     mPersist.LoadValues();
+    BumpAllVersions();
 
     if (!(tw_flags & TW_FLAG_NO_SCREEN_TIMEOUT)) {
         blankTimer.setTime(mPersist.GetIntValue(TW_SCREEN_TIMEOUT_SECS));
@@ -149,23 +169,110 @@ int DataManager::GetValue(const std::string& varName, std::string& value)
         return 0;
     }
 
+    return GetStoredValue(localStr, value);
+}
+
+int DataManager::GetStoredValue(const std::string& varName, std::string& value)
+{
+    int ret;
+
     pthread_mutex_lock(&m_valuesLock);
-    ret = mConst.GetValue(localStr, value);
+    ret = mConst.GetValue(varName, value);
     if (ret == 0) {
         goto exit;
     }
 
-    ret = mPersist.GetValue(localStr, value);
+    ret = mPersist.GetValue(varName, value);
     if (ret == 0) {
         goto exit;
     }
 
-    ret = mData.GetValue(localStr, value);
+    ret = mData.GetValue(varName, value);
 exit:
     pthread_mutex_unlock(&m_valuesLock);
     return ret;
 }
 
+int DataManager::GetHandle(const std::string& varName)
+{
+    std::string localStr = varName;
+    std::string value;
+
+    if (!mInitialized) {
+        SetDefaultValues();
+    }
+
+    // Strip off leading and trailing '%' if provided
+    if (localStr.length() > 2 && localStr[0] == '%' && localStr[localStr.length()-1] == '%') {
+        localStr.erase(0, 1);
+        localStr.erase(localStr.length() - 1, 1);
+    }
+
+    // Magic values and properties are computed every time they are read
+    if (localStr.empty() || GetMagicValue(localStr, value) == 0
+            || (localStr.length() > 9 && localStr.substr(0, 9) == "property.")) {
+        return -1;
+    }
+
+    int handle = -1;
+
+    pthread_mutex_lock(&m_valuesLock);
+    auto it = g_var_handles.find(localStr);
+    if (it != g_var_handles.end()) {
+        handle = it->second;
+    } else {
+        int count = g_var_handle_count.load(std::memory_order_relaxed);
+        if (count < MAX_VAR_HANDLES) {
+            handle = count;
+            g_var_slots[handle].name = localStr;
+            g_var_slots[handle].version.store(1, std::memory_order_relaxed);
+            g_var_handles[localStr] = handle;
+            g_var_handle_count.store(count + 1, std::memory_order_release);
+        } else {
+            LOGW("Too many interned variables; not tracking '%s'", localStr.c_str());
+        }
+    }
+    pthread_mutex_unlock(&m_valuesLock);
+
+    return handle;
+}
+
+int DataManager::GetValue(int handle, std::string& value)
+{
+    if (handle < 0 || handle >= g_var_handle_count.load(std::memory_order_acquire)) {
+        return -1;
+    }
+
+    return GetStoredValue(g_var_slots[handle].name, value);
+}
+
+unsigned int DataManager::GetVersion(int handle)
+{
+    if (handle < 0 || handle >= g_var_handle_count.load(std::memory_order_acquire)) {
+        return 0;
+    }
+
+    return g_var_slots[handle].version.load(std::memory_order_acquire);
+}
+
+// Must be called with m_valuesLock held
+void DataManager::BumpVersion(const std::string& varName)
+{
+    auto it = g_var_handles.find(varName);
+    if (it != g_var_handles.end()) {
+        g_var_slots[it->second].version.fetch_add(1, std::memory_order_release);
+    }
+}
+
+// Must be called with m_valuesLock held
+void DataManager::BumpAllVersions()
+{
+    int count = g_var_handle_count.load(std::memory_order_relaxed);
+    for (int i = 0; i < count; ++i) {
+        g_var_slots[i].version.fetch_add(1, std::memory_order_release);
+    }
+}
+
 int DataManager::GetValue(const std::string& varName, int& value)
 {
     std::string data;
@@ -258,6 +365,7 @@ int DataManager::SetValue(const std::string& varName, const std::string& value,
             mData.SetValue(varName, value);
         }
     }
+    BumpVersion(varName);
 
     pthread_mutex_unlock(&m_valuesLock);
 
@@ -472,6 +580,8 @@ void DataManager::SetDefaultValues()
     // Set default autoboot timeout to 5 seconds
     mPersist.SetValue(TW_AUTOBOOT_TIMEOUT, 5);
 
+    BumpAllVersions();
+
     pthread_mutex_unlock(&m_valuesLock);
 }
 
@@ -40,6 +40,15 @@ public:
     static std::string GetStrValue(const std::string& varName);
     static int GetIntValue(const std::string& varName);
 
+    // Interned variables. A handle is resolved once (eg. when a page is
+    // loaded) and its version can be checked without locking to find out if
+    // the variable was set since it was last read. GetHandle() returns -1 for
+    // variables that are computed when read (magic values and properties) and
+    // therefore cannot be tracked.
+    static int GetHandle(const std::string& varName);
+    static int GetValue(int handle, std::string& value);
+    static unsigned int GetVersion(int handle);
+
     // Core set routines
     static int SetValue(const std::string& varName, const std::string& value, const int persist = 0);
     static int SetValue(const std::string& varName, const int value, const int persist = 0);
@@ -67,6 +76,9 @@ protected:
     static int SaveValues();
 
     static int GetMagicValue(const std::string& varName, std::string& value);
+    static int GetStoredValue(const std::string& varName, std::string& value);
+    static void BumpVersion(const std::string& varName);
+    static void BumpAllVersions();
 
 private:
     static pthread_mutex_t m_valuesLock;
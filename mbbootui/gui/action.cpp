@@ -18,6 +18,13 @@
 
 #include "gui/action.hpp"
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <cinttypes>
 #include <cstring>
 
 #include <linux/input.h>
@@ -32,6 +39,7 @@
 #include "mbutil/path.h"
 #include "mbutil/properties.h"
 #include "mbutil/string.h"
+#include "mbutil/time.h"
 
 #include "config/config.hpp"
 
@@ -52,85 +60,143 @@ pthread_mutex_t GUIAction::s_autoboot_mutex = PTHREAD_MUTEX_INITIALIZER;
 volatile GUIAction::AutobootSignal GUIAction::s_autoboot_signal =
     GUIAction::AutobootSignal::NONE;
 
-static void *ActionThread_work_wrapper(void *data);
-
-class ActionThread
+/*
+ * Runs batches of threaded actions in order on a single long-lived worker
+ * thread, so that long operations never block the render loop.
+ *
+ * A batch that is identical to one that is already pending or running (eg.
+ * from repeated taps on the same button) is dropped. Pending batches can be
+ * cancelled, which must be done before the GUIAction objects they refer to are
+ * destroyed. When a batch finishes, its completion is posted back to the
+ * render loop.
+ */
+class ActionQueue
 {
 public:
-    ActionThread();
-    ~ActionThread();
+    ActionQueue(const char *name);
+    ~ActionQueue();
+
+    void enqueue(GUIAction *act);
+    size_t cancelPending();
 
-    void threadActions(GUIAction *act);
-    void run(void *data);
 private:
-    friend void *ActionThread_work_wrapper(void*);
-    struct ThreadData
-    {
-        ActionThread *this_;
-        GUIAction *act;
-        ThreadData(ActionThread *this_, GUIAction *act) : this_(this_), act(act) {}
-    };
-
-    pthread_t m_thread;
-    bool m_thread_running;
-    pthread_mutex_t m_act_lock;
+    void worker();
+
+    const char *m_name;
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<GUIAction *> m_pending;
+    GUIAction *m_running;
+    bool m_stop;
 };
 
-static ActionThread action_thread; // for all kinds of longer running actions
-static ActionThread cancel_thread; // for longer running "cancel" actions
+static ActionQueue action_queue("action"); // for all kinds of longer running actions
+static ActionQueue cancel_queue("cancel"); // for longer running "cancel" actions
 
-static void *ActionThread_work_wrapper(void *data)
+ActionQueue::ActionQueue(const char *name)
+    : m_name(name)
+    , m_running(nullptr)
+    , m_stop(false)
 {
-    static_cast<ActionThread::ThreadData*>(data)->this_->run(data);
-    return nullptr;
 }
 
-ActionThread::ActionThread()
+ActionQueue::~ActionQueue()
 {
-    m_thread_running = false;
-    pthread_mutex_init(&m_act_lock, nullptr);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+        m_pending.clear();
+    }
+    m_cond.notify_all();
+
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
 }
 
-ActionThread::~ActionThread()
+void ActionQueue::enqueue(GUIAction *act)
 {
-    pthread_mutex_lock(&m_act_lock);
-    if (m_thread_running) {
-        pthread_mutex_unlock(&m_act_lock);
-        pthread_join(m_thread, nullptr);
-    } else {
-        pthread_mutex_unlock(&m_act_lock);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (act == m_running || std::find(m_pending.begin(), m_pending.end(),
+                                          act) != m_pending.end()) {
+            LOGW("Ignoring duplicate %zu actions starting with '%s'",
+                 act->mActions.size(), act->mActions[0].mFunction.c_str());
+            return;
+        }
+
+        if (m_running || !m_pending.empty()) {
+            LOGI("Queueing %zu actions starting with '%s' in %s queue",
+                 act->mActions.size(), act->mActions[0].mFunction.c_str(),
+                 m_name);
+        }
+
+        m_pending.push_back(act);
+
+        // The worker is started on first use so that it does not exist before
+        // the GUI does
+        if (!m_thread.joinable()) {
+            m_thread = std::thread(&ActionQueue::worker, this);
+        }
     }
-    pthread_mutex_destroy(&m_act_lock);
+    m_cond.notify_one();
 }
 
-void ActionThread::threadActions(GUIAction *act)
+size_t ActionQueue::cancelPending()
 {
-    pthread_mutex_lock(&m_act_lock);
-    if (m_thread_running) {
-        pthread_mutex_unlock(&m_act_lock);
-        LOGE("Another threaded action is already running -- not running %zu actions starting with '%s'",
-             act->mActions.size(), act->mActions[0].mFunction.c_str());
-    } else {
-        m_thread_running = true;
-        pthread_mutex_unlock(&m_act_lock);
-        ThreadData *d = new ThreadData(this, act);
-        pthread_create(&m_thread, nullptr, &ActionThread_work_wrapper, d);
-    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t n = m_pending.size();
+    m_pending.clear();
+    return n;
 }
 
-void ActionThread::run(void *data)
+void ActionQueue::worker()
 {
-    ThreadData *d = (ThreadData*) data;
-    GUIAction* act = d->act;
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (true) {
+        m_cond.wait(lock, [&]{ return m_stop || !m_pending.empty(); });
+        if (m_stop) {
+            break;
+        }
+
+        GUIAction *act = m_pending.front();
+        m_pending.pop_front();
+        m_running = act;
+
+        std::string first = act->mActions[0].mFunction;
+
+        lock.unlock();
+
+        timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
 
-    for (auto it = act->mActions.begin(); it != act->mActions.end(); ++it) {
-        act->doAction(*it);
+        for (auto it = act->mActions.begin(); it != act->mActions.end(); ++it) {
+            act->doAction(*it);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        int64_t duration = mb::util::timespec_diff_ms(start, end);
+
+        lock.lock();
+        m_running = nullptr;
+
+        gui_post([first, duration]{
+            LOGI("Actions starting with '%s' finished in %" PRId64 " ms",
+                 first.c_str(), duration);
+            gui_forceRender();
+        });
     }
+}
 
-    pthread_mutex_lock(&m_act_lock);
-    m_thread_running = false;
-    pthread_mutex_unlock(&m_act_lock);
-    delete d;
+void GUIAction::CancelPendingActions()
+{
+    size_t n = action_queue.cancelPending() + cancel_queue.cancelPending();
+    if (n > 0) {
+        LOGW("Cancelled %zu pending action batches", n);
+    }
 }
 
 GUIAction::GUIAction(xml_node<>* node)
@@ -319,7 +385,7 @@ int GUIAction::doActions()
     }
 
     // Determine in which thread to run the actions.
-    // Do it for all actions at once before starting, so that we can cancel the whole batch if the thread is already busy.
+    // Do it for all actions at once before starting, so that the whole batch is queued together.
     ThreadType threadType = THREAD_NONE;
     for (auto it = mActions.begin(); it != mActions.end(); ++it) {
         ThreadType tt = getThreadType(*it);
@@ -339,11 +405,11 @@ int GUIAction::doActions()
     // Now run the actions in the desired thread.
     switch (threadType) {
     case THREAD_ACTION:
-        action_thread.threadActions(this);
+        action_queue.enqueue(this);
         break;
 
     case THREAD_CANCEL:
-        cancel_thread.threadActions(this);
+        cancel_queue.enqueue(this);
         break;
 
     default: {
@@ -395,11 +461,16 @@ void GUIAction::operation_end(const int operation_status)
     }
     DataManager::SetValue(TW_OPERATION_STATE, 1);
     DataManager::SetValue(TW_ACTION_BUSY, 0);
-    blankTimer.resetTimerAndUnblank();
     time(&Stop);
-    if ((int) difftime(Stop, Start) > 10) {
-        DataManager::Vibrate(TW_ACTION_VIBRATE);
-    }
+    bool vibrate = (int) difftime(Stop, Start) > 10;
+    // This may be called from an action thread, so leave the screen to the
+    // render loop
+    gui_post([vibrate]{
+        blankTimer.resetTimerAndUnblank();
+        if (vibrate) {
+            DataManager::Vibrate(TW_ACTION_VIBRATE);
+        }
+    });
     LOGI("operation_end - status=%d", operation_status);
 }
 
@@ -27,7 +27,7 @@
 // GUIAction - Used for standard actions
 class GUIAction : public GUIObject, public ActionObject
 {
-    friend class ActionThread;
+    friend class ActionQueue;
 
 public:
     GUIAction(xml_node<>* node);
@@ -40,6 +40,10 @@ public:
 
     int doActions();
 
+    // Drop all queued (but not running) threaded actions. Must be called
+    // before the page set containing the actions is destroyed.
+    static void CancelPendingActions();
+
 protected:
     class Action
     {
@@ -85,6 +85,33 @@ void blanktimer::checkForTimeout()
     }
 }
 
+bool blanktimer::getNextTimeout(timespec *deadline)
+{
+    if (tw_flags & TW_FLAG_NO_SCREEN_TIMEOUT) {
+        return false;
+    }
+
+    bool ret = true;
+    long secs = 0;
+
+    pthread_mutex_lock(&mutex);
+    // checkForTimeout() acts once a full second past the threshold elapsed
+    if (sleepTimer > 2 && state == kOn) {
+        secs = sleepTimer - 1;
+    } else if (sleepTimer && state < kOff) {
+        secs = sleepTimer + 1;
+    } else {
+        ret = false;
+    }
+    if (ret) {
+        *deadline = btimer;
+        deadline->tv_sec += secs;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return ret;
+}
+
 std::string blanktimer::getBrightness()
 {
     std::string result;
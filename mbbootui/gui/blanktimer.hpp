@@ -39,6 +39,10 @@ public:
 
     bool isScreenOff();
 
+    // get the time at which checkForTimeout() will next change the screen
+    // state. Returns false if there is no pending timeout
+    bool getNextTimeout(timespec *deadline);
+
 private:
     void setTimer();
     std::string getBrightness();
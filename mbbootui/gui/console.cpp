@@ -57,6 +57,9 @@ extern "C" void __gui_print(const char *color, char *buf)
         gConsole.push_back(start);
         gConsoleColor.push_back(color);
     }
+
+    // Show the output even if the GUI is idle
+    ev_wake();
 }
 
 extern "C" void gui_print(const char *fmt, ...)
@@ -19,6 +19,7 @@
 #include "gui/fileselector.hpp"
 
 #include <algorithm>
+#include <iterator>
 
 #include <cstring>
 
@@ -41,6 +42,9 @@ GUIFileSelector::GUIFileSelector(xml_node<>* node) : GUIScrollList(node)
     mUpdate = 0;
     mPathVar = "cwd";
     updateFileList = false;
+    mListThreadRunning = false;
+    mListCancel = mListDone = mListFailed = mListReplace = false;
+    pthread_mutex_init(&mListLock, nullptr);
 
     // Load filter for filtering files (e.g. *.zip for only zips)
     child = FindNode(node, "filter");
@@ -131,6 +135,8 @@ GUIFileSelector::GUIFileSelector(xml_node<>* node) : GUIScrollList(node)
 
 GUIFileSelector::~GUIFileSelector()
 {
+    StopFileList();
+    pthread_mutex_destroy(&mListLock);
 }
 
 int GUIFileSelector::Update()
@@ -147,12 +153,16 @@ int GUIFileSelector::Update()
         DataManager::GetValue(mPathVar, value);
         if (GetFileList(value) == 0) {
             updateFileList = false;
-            mUpdate = 1;
         } else {
             return 0;
         }
     }
 
+    // Pick up the entries that the listing thread has read so far
+    if (MergeFileList()) {
+        mUpdate = 1;
+    }
+
     if (mUpdate) {
         mUpdate = 0;
         if (Render() == 0) {
@@ -177,22 +187,25 @@ int GUIFileSelector::NotifyVarChange(const std::string& varName,
     }
     if (varName == mPathVar || varName == mSortVariable) {
         if (varName == mSortVariable) {
+            // The entries don't change, so there's no need to read the folder
+            // again
             DataManager::GetValue(mSortVariable, mSortOrder);
+            SortFileList();
         } else {
             // Reset the list to the top
             SetVisibleListLocation(0);
             if (value.empty()) {
                 DataManager::SetValue(mPathVar, mPathDefault);
             }
+            updateFileList = true;
         }
-        updateFileList = true;
         mUpdate = 1;
         return 0;
     }
     return 0;
 }
 
-bool GUIFileSelector::fileSort(FileData d1, FileData d2)
+bool GUIFileSelector::fileSort(const FileData& d1, const FileData& d2)
 {
     if (d1.fileName == ".") {
         return -1;
@@ -244,17 +257,100 @@ bool GUIFileSelector::fileSort(FileData d1, FileData d2)
 
 int GUIFileSelector::GetFileList(const std::string& folder)
 {
-    DIR* d;
-    struct dirent* de;
-    struct stat st;
+    StopFileList();
+
+    // The current entries stay visible until the new listing produces results
+    mListFolder = folder;
+    mListReplace = true;
+    mListCancel = false;
+    mListDone = false;
+    mListFailed = false;
+    mPendingFolders.clear();
+    mPendingFiles.clear();
+
+    if (pthread_create(&mListThread, nullptr,
+                       &GUIFileSelector::ListThreadWrapper, this) != 0) {
+        LOGE("Failed to create thread for listing '%s'", folder.c_str());
+        return -1;
+    }
+    mListThreadRunning = true;
 
-    // Clear all data
-    mFolderList.clear();
-    mFileList.clear();
+    return 0;
+}
 
-    d = opendir(folder.c_str());
-    if (d == nullptr) {
-        LOGI("Unable to open '%s'", folder.c_str());
+void GUIFileSelector::StopFileList()
+{
+    if (!mListThreadRunning) {
+        return;
+    }
+
+    pthread_mutex_lock(&mListLock);
+    mListCancel = true;
+    pthread_mutex_unlock(&mListLock);
+
+    pthread_join(mListThread, nullptr);
+    mListThreadRunning = false;
+}
+
+template<typename T>
+static void appendEntries(std::vector<T>* list, std::vector<T>* batch)
+{
+    list->insert(list->end(), std::make_move_iterator(batch->begin()),
+                 std::make_move_iterator(batch->end()));
+}
+
+// Sort batch and merge it into the already sorted list
+template<typename T, typename Compare>
+static void mergeSorted(std::vector<T>* list, std::vector<T>* batch,
+                        Compare compare)
+{
+    if (batch->empty()) {
+        return;
+    }
+
+    std::sort(batch->begin(), batch->end(), compare);
+
+    size_t mid = list->size();
+    appendEntries(list, batch);
+    std::inplace_merge(list->begin(), list->begin() + mid, list->end(),
+                       compare);
+}
+
+bool GUIFileSelector::MergeFileList()
+{
+    if (!mListThreadRunning) {
+        return false;
+    }
+
+    std::vector<FileData> folders;
+    std::vector<FileData> files;
+    bool done;
+    bool failed;
+
+    pthread_mutex_lock(&mListLock);
+    folders.swap(mPendingFolders);
+    files.swap(mPendingFiles);
+    done = mListDone;
+    failed = mListFailed;
+    pthread_mutex_unlock(&mListLock);
+
+    if (folders.empty() && files.empty() && !done) {
+        return false;
+    }
+
+    if (done) {
+        pthread_join(mListThread, nullptr);
+        mListThreadRunning = false;
+    }
+
+    if (mListReplace) {
+        mFolderList.clear();
+        mFileList.clear();
+        mListReplace = false;
+    }
+
+    if (failed) {
+        const std::string& folder = mListFolder;
         if (folder != "/" && (mShowNavFolders != 0 || mShowFiles != 0)) {
             size_t found;
             found = folder.find_last_of('/');
@@ -267,7 +363,49 @@ int GUIFileSelector::GetFileList(const std::string& folder)
                 DataManager::SetValue(mPathVar, new_folder);
             }
         }
-        return -1;
+        updateFileList = true;
+        return true;
+    }
+
+    mergeSorted(&mFolderList, &folders, &fileSort);
+    mergeSorted(&mFileList, &files, &fileSort);
+
+    return true;
+}
+
+void GUIFileSelector::SortFileList()
+{
+    std::sort(mFolderList.begin(), mFolderList.end(), fileSort);
+    std::sort(mFileList.begin(), mFileList.end(), fileSort);
+}
+
+void* GUIFileSelector::ListThreadWrapper(void* data)
+{
+    static_cast<GUIFileSelector*>(data)->ListThread();
+    return nullptr;
+}
+
+void GUIFileSelector::ListThread()
+{
+    // Number of entries to read before handing them to the GUI thread. They
+    // are sorted on the GUI thread since the sort order can change at any time.
+    static const size_t batch_size = 64;
+
+    const std::string& folder = mListFolder;
+    std::vector<FileData> folders;
+    std::vector<FileData> files;
+    DIR* d;
+    struct dirent* de;
+    struct stat st;
+
+    d = opendir(folder.c_str());
+    if (d == nullptr) {
+        LOGI("Unable to open '%s'", folder.c_str());
+        pthread_mutex_lock(&mListLock);
+        mListFailed = true;
+        mListDone = true;
+        pthread_mutex_unlock(&mListLock);
+        return;
     }
 
     while ((de = readdir(d)) != nullptr) {
@@ -284,7 +422,10 @@ int GUIFileSelector::GetFileList(const std::string& folder)
         data.fileType = de->d_type;
 
         std::string path = folder + "/" + data.fileName;
-        stat(path.c_str(), &st);
+        bool have_stat = stat(path.c_str(), &st) == 0;
+        if (!have_stat) {
+            memset(&st, 0, sizeof(st));
+        }
         data.protection = st.st_mode;
         data.userId = st.st_uid;
         data.groupId = st.st_gid;
@@ -293,42 +434,58 @@ int GUIFileSelector::GetFileList(const std::string& folder)
         data.lastModified = st.st_mtime;
         data.lastStatChange = st.st_ctime;
 
-        if (data.fileType == DT_UNKNOWN) {
-            struct stat sb;
-            if (stat(path.c_str(), &sb) == 0) {
-                if (sb.st_mode & S_IFDIR) {
-                    data.fileType = DT_DIR;
-                } else if (sb.st_mode & S_IFBLK) {
-                    data.fileType = DT_BLK;
-                } else if (sb.st_mode & S_IFCHR) {
-                    data.fileType = DT_CHR;
-                } else if (sb.st_mode & S_IFIFO) {
-                    data.fileType = DT_FIFO;
-                } else if (sb.st_mode & S_IFLNK) {
-                    data.fileType = DT_LNK;
-                } else if (sb.st_mode & S_IFREG) {
-                    data.fileType = DT_REG;
-                } else if (sb.st_mode & S_IFSOCK) {
-                    data.fileType = DT_SOCK;
-                }
+        if (data.fileType == DT_UNKNOWN && have_stat) {
+            if (st.st_mode & S_IFDIR) {
+                data.fileType = DT_DIR;
+            } else if (st.st_mode & S_IFBLK) {
+                data.fileType = DT_BLK;
+            } else if (st.st_mode & S_IFCHR) {
+                data.fileType = DT_CHR;
+            } else if (st.st_mode & S_IFIFO) {
+                data.fileType = DT_FIFO;
+            } else if (st.st_mode & S_IFLNK) {
+                data.fileType = DT_LNK;
+            } else if (st.st_mode & S_IFREG) {
+                data.fileType = DT_REG;
+            } else if (st.st_mode & S_IFSOCK) {
+                data.fileType = DT_SOCK;
             }
         }
         if (data.fileType == DT_DIR) {
             if (mShowNavFolders || (data.fileName != "." && data.fileName != "..")) {
-                mFolderList.push_back(data);
+                folders.push_back(std::move(data));
             }
         } else if (data.fileType == DT_REG || data.fileType == DT_LNK || data.fileType == DT_BLK) {
             if (mExtn.empty() || (data.fileName.length() > mExtn.length() && data.fileName.substr(data.fileName.length() - mExtn.length()) == mExtn)) {
-                mFileList.push_back(data);
+                files.push_back(std::move(data));
             }
         }
+
+        if (folders.size() + files.size() >= batch_size) {
+            bool cancel;
+
+            pthread_mutex_lock(&mListLock);
+            cancel = mListCancel;
+            if (!cancel) {
+                appendEntries(&mPendingFolders, &folders);
+                appendEntries(&mPendingFiles, &files);
+            }
+            pthread_mutex_unlock(&mListLock);
+
+            if (cancel) {
+                break;
+            }
+            folders.clear();
+            files.clear();
+        }
     }
     closedir(d);
 
-    std::sort(mFolderList.begin(), mFolderList.end(), fileSort);
-    std::sort(mFileList.begin(), mFileList.end(), fileSort);
-
-    return 0;
+    pthread_mutex_lock(&mListLock);
+    appendEntries(&mPendingFolders, &folders);
+    appendEntries(&mPendingFiles, &files);
+    mListDone = true;
+    pthread_mutex_unlock(&mListLock);
 }
 
 void GUIFileSelector::SetPageFocus(int inFocus)
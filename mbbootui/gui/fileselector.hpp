@@ -20,6 +20,8 @@
 
 #include "gui/scrolllist.hpp"
 
+#include <pthread.h>
+
 class GUIFileSelector : public GUIScrollList
 {
 public:
@@ -55,12 +57,33 @@ protected:
     };
 
 protected:
+    // Start listing the folder on a background thread. The entries are merged
+    // into mFolderList and mFileList by MergeFileList() as they are read.
     virtual int GetFileList(const std::string& folder);
-    static bool fileSort(FileData d1, FileData d2);
+    void StopFileList();
+    bool MergeFileList();
+    void SortFileList();
+    static void* ListThreadWrapper(void* data);
+    void ListThread();
+    static bool fileSort(const FileData& d1, const FileData& d2);
 
 protected:
     std::vector<FileData> mFolderList;
     std::vector<FileData> mFileList;
+
+    // Background directory listing state. mListThread, mListThreadRunning,
+    // mListReplace, and mListFolder are only used by the GUI thread while the
+    // listing thread is not running. The rest is protected by mListLock.
+    pthread_t mListThread;
+    pthread_mutex_t mListLock;
+    bool mListThreadRunning;
+    bool mListCancel; // tells the listing thread to stop early
+    bool mListDone; // the listing thread has read the whole folder
+    bool mListFailed; // the folder could not be opened
+    bool mListReplace; // the current entries belong to the previous listing
+    std::string mListFolder;
+    std::vector<FileData> mPendingFolders;
+    std::vector<FileData> mPendingFiles;
     std::string mPathVar; // current path displayed, saved in the data manager
     std::string mPathDefault; // default value for the path if none is set in mPathVar
     std::string mExtn; // used for filtering the file list, for example, *.zip
@@ -19,6 +19,8 @@
 #include "gui/gui.h"
 
 #include <atomic>
+#include <mutex>
+#include <vector>
 
 #include <linux/input.h>
 #include <unistd.h>
@@ -60,8 +62,10 @@ static float scale_theme_h = 1;
 // Needed by pages.cpp too
 int gGuiRunning = 0;
 
-int g_pty_fd = -1;  // set by terminal on init
-void terminal_pty_read();
+// Functions posted to the render thread by other threads
+static std::mutex gPostedMutex;
+static std::vector<std::function<void()>> gPosted;
+
 
 static int gRecorder = -1;
 
@@ -75,7 +79,14 @@ void flip()
         write(gRecorder, &time, sizeof(timespec));
         gr_write_frame_to_file(gRecorder);
     }
-    gr_flip();
+
+    // Only push out what PageManager repainted, if the backend allows it
+    int x, y, w, h;
+    if (PageManager::TakeDirtyRegion(x, y, w, h)) {
+        gr_flip_region(x, y, w, h);
+    } else {
+        gr_flip();
+    }
 }
 
 void rapidxml::parse_error_handler(const char *what, void *where)
@@ -114,6 +125,10 @@ public:
     // process input events. returns true if any event was received.
     bool processInput(int timeout_ms);
 
+    // get the time of the next touch/key hold or repeat. returns false if
+    // nothing is being held
+    bool getHoldDeadline(timespec *deadline);
+
     void handleDrag();
 
 private:
@@ -161,6 +176,19 @@ InputHandler input_handler;
 
 bool InputHandler::processInput(int timeout_ms)
 {
+    // Sleep until input arrives or the next hold/repeat or screen timeout
+    timespec deadline;
+    bool has_deadline = getHoldDeadline(&deadline);
+    timespec blank_deadline;
+    if (blankTimer.getNextTimeout(&blank_deadline)) {
+        if (!has_deadline
+                || mb::util::timespec_diff_ns(blank_deadline, deadline) > 0) {
+            deadline = blank_deadline;
+        }
+        has_deadline = true;
+    }
+    ev_set_timer(has_deadline ? &deadline : nullptr);
+
     input_event ev;
     int ret = ev_get(&ev, timeout_ms);
 
@@ -171,7 +199,9 @@ bool InputHandler::processInput(int timeout_ms)
         if (touch_status || key_status) {
             processHoldAndRepeat();
         }
-        return (ret != -2);  // -2 means no more events in the queue
+        // -2 means no more events in the queue and -3 means that we were
+        // woken up by a timer or another thread
+        return ret == -1;
     }
 
     switch (ev.type) {
@@ -192,6 +222,29 @@ bool InputHandler::processInput(int timeout_ms)
     return true;  // we got an event, so there might be more in the queue
 }
 
+bool InputHandler::getHoldDeadline(timespec *deadline)
+{
+    int delay_ms;
+
+    if (touch_status == TS_TOUCH_AND_HOLD) {
+        delay_ms = touch_hold_ms;
+    } else if (touch_status == TS_TOUCH_REPEAT) {
+        delay_ms = touch_repeat_ms;
+    } else if (key_status == KS_KEY_PRESSED) {
+        delay_ms = key_hold_ms;
+    } else if (key_status == KS_KEY_REPEAT) {
+        delay_ms = key_repeat_ms;
+    } else {
+        return false;
+    }
+
+    // processHoldAndRepeat() acts once the delay is exceeded
+    long nsec = touchStart.tv_nsec + (delay_ms + 1) * 1000000L;
+    deadline->tv_sec = touchStart.tv_sec + nsec / 1000000000L;
+    deadline->tv_nsec = nsec % 1000000000L;
+    return true;
+}
+
 void InputHandler::processHoldAndRepeat()
 {
     HardwareKeyboard *kb = PageManager::GetHardwareKeyboard();
@@ -394,13 +447,37 @@ static void loopTimer(int input_timeout_ms)
             return;
         }
 
-        // We need to sleep some period time microseconds
-        //unsigned int sleepTime = 33333 -(diff.tv_nsec / 1000);
-        //usleep(sleepTime); // removed so we can scan for input
-        input_timeout_ms = 0;
+        if (got_event) {
+            // Drain the queue before drawing the next frame
+            input_timeout_ms = 0;
+        } else {
+            // Sleep until the next frame is due unless more input arrives
+            input_timeout_ms = (timeout - diff.tv_nsec) / 1000000 + 1;
+        }
     } while (1);
 }
 
+void gui_post(std::function<void()> fn)
+{
+    {
+        std::lock_guard<std::mutex> lock(gPostedMutex);
+        gPosted.push_back(std::move(fn));
+    }
+    ev_wake();
+}
+
+static void runPosted()
+{
+    std::vector<std::function<void()>> posted;
+    {
+        std::lock_guard<std::mutex> lock(gPostedMutex);
+        posted.swap(gPosted);
+    }
+    for (auto &fn : posted) {
+        fn();
+    }
+}
+
 static int runPages(const char *page_name, const int stop_on_page_done)
 {
     DataManager::SetValue(TW_PAGE_DONE, 0);
@@ -415,26 +492,12 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 
     DataManager::SetValue(TW_LOADED, 1);
 
-    struct timeval timeout;
-    fd_set fdset;
-    int has_data = 0;
-
     int input_timeout_ms = 0;
     int idle_frames = 0;
 
     for (;;) {
         loopTimer(input_timeout_ms);
-        if (g_pty_fd > 0) {
-            // TODO: this is not nice, we should have one central select for input, pty
-            FD_ZERO(&fdset);
-            FD_SET(g_pty_fd, &fdset);
-            timeout.tv_sec = 0;
-            timeout.tv_usec = 1;
-            has_data = select(g_pty_fd + 1, &fdset, nullptr, nullptr, &timeout);
-            if (has_data > 0) {
-                terminal_pty_read();
-            }
-        }
+        runPosted();
 
         if (!gForceRender) {
             int ret = PageManager::Update();
@@ -446,7 +509,14 @@ static int runPages(const char *page_name, const int stop_on_page_done)
                 idle_frames = 0;
             }
             // due to possible animation objects, we need to delay activating the input timeout
-            input_timeout_ms = idle_frames > 15 ? 1000 : 0;
+            // once the screen is off, only input or other threads wake us up
+            if (idle_frames <= 15) {
+                input_timeout_ms = 0;
+            } else if (blankTimer.isScreenOff()) {
+                input_timeout_ms = -1;
+            } else {
+                input_timeout_ms = 1000;
+            }
 
 #ifndef PRINT_RENDER_TIME
             if (ret > 1) {
@@ -477,6 +547,7 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 #endif
         } else {
             gForceRender = 0;
+            PageManager::Invalidate();
             PageManager::Render();
             flip();
             input_timeout_ms = 0;
@@ -498,6 +569,7 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 int gui_forceRender()
 {
     gForceRender = 1;
+    ev_wake();
     return 0;
 }
 
@@ -506,6 +578,7 @@ int gui_changePage(std::string newPage)
     LOGI("Set page: '%s'", newPage.c_str());
     PageManager::ChangePage(newPage);
     gForceRender = 1;
+    ev_wake();
     return 0;
 }
 
@@ -580,6 +653,43 @@ std::string gui_parse_text(std::string str)
     }
 }
 
+bool gui_get_text_variables(const std::string& text, std::vector<int>* handles)
+{
+    // Same syntax as gui_parse_text()
+    if (text.find("{@") != std::string::npos) {
+        return false;
+    }
+
+    size_t pos = 0, next, end;
+
+    while (1) {
+        next = text.find('%', pos);
+        if (next == std::string::npos) {
+            return true;
+        }
+
+        end = text.find('%', next + 1);
+        if (end == std::string::npos) {
+            return true;
+        }
+
+        if (next + 1 != end) {
+            if (text[next + 1] == '@') {
+                return false;
+            }
+
+            int handle = DataManager::GetHandle(
+                    text.substr(next + 1, (end - next) - 1));
+            if (handle < 0) {
+                return false;
+            }
+            handles->push_back(handle);
+        }
+
+        pos = end + 1;
+    }
+}
+
 std::string gui_lookup(const std::string& resource_name,
                        const std::string& default_value)
 {
@@ -19,6 +19,8 @@
 #ifndef _GUI_HPP_HEADER
 #define _GUI_HPP_HEADER
 
+#include <functional>
+
 #include "twmsg.h"
 
 void gui_msg(const char* text);
@@ -28,6 +30,14 @@ void gui_highlight(const char* text);
 void gui_msg(Message msg);
 
 std::string gui_parse_text(std::string inText);
+// Collect the DataManager handles of the variables used by the text. Returns
+// false if the value can change without any of them changing (eg. string
+// resources, magic values, or properties).
+bool gui_get_text_variables(const std::string& text, std::vector<int>* handles);
 std::string gui_lookup(const std::string& resource_name, const std::string& default_value);
 
+// Run a function on the render thread before the next frame. May be called
+// from any thread.
+void gui_post(std::function<void()> fn);
+
 #endif //_GUI_HPP_HEADER
@@ -60,6 +60,26 @@ public:
         return 0;
     }
 
+    // GetDirtyRect - Returns the screen area covered by the object when it
+    // renders its current state. Called before and after Update() so both the
+    // old and new contents get repainted
+    //  Return 0 on success, <0 if the area is unknown
+    virtual int GetDirtyRect(int& x, int& y, int& w, int& h)
+    {
+        GetRenderPos(x, y, w, h);
+        return (w > 0 && h > 0) ? 0 : -1;
+    }
+
+    // GetUpdateRect - Returns the part of the object that changed in the last
+    // call to Update(), for objects that can repaint less than their whole
+    // area. Used instead of the areas from GetDirtyRect() if available
+    //  Return 0 on success, <0 if the whole object must be repainted
+    virtual int GetUpdateRect(int& x __unused, int& y __unused,
+                              int& w __unused, int& h __unused)
+    {
+        return -1;
+    }
+
     // SetRenderPos - Update the position of the object
     //  Return 0 on success, <0 on error
     virtual int SetRenderPos(int x, int y, int w = 0, int h = 0)
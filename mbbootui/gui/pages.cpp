@@ -79,6 +79,7 @@ std::unordered_map<std::string, PageSet*> PageManager::mPageSets;
 PageSet* PageManager::mCurrentSet;
 MouseCursor *PageManager::mMouseCursor = nullptr;
 HardwareKeyboard *PageManager::mHardwareKeyboard = nullptr;
+DirtyRect PageManager::mDirty;
 bool PageManager::mReloadTheme = false;
 std::string PageManager::mStartPage = "main";
 std::vector<language_struct> Language_List;
@@ -321,6 +322,33 @@ int ActionObject::SetActionPos(int x, int y, int w, int h)
     return 0;
 }
 
+void DirtyRect::Add(int x, int y, int w, int h)
+{
+    if (full || w <= 0 || h <= 0) {
+        return;
+    }
+
+    if (x1 >= x2 || y1 >= y2) {
+        x1 = x;
+        y1 = y;
+        x2 = x + w;
+        y2 = y + h;
+    } else {
+        x1 = std::min(x1, x);
+        y1 = std::min(y1, y);
+        x2 = std::max(x2, x + w);
+        y2 = std::max(y2, y + h);
+    }
+}
+
+bool DirtyRect::Intersects(int x, int y, int w, int h) const
+{
+    if (full) {
+        return true;
+    }
+    return x < x2 && x + w > x1 && y < y2 && y + h > y1;
+}
+
 Page::Page(xml_node<>* page, std::vector<xml_node<>*> *templates)
 {
     mTouchStart = nullptr;
@@ -334,6 +362,7 @@ Page::Page(xml_node<>* page, std::vector<xml_node<>*> *templates)
 
         GUIConsole* element = new GUIConsole(nullptr);
         mRenders.push_back(element);
+        mRenderConditions.push_back(element);
         mActions.push_back(element);
         return;
     }
@@ -383,15 +412,18 @@ bool Page::ProcessNode(xml_node<>* page, std::vector<xml_node<>*> *templates, in
             GUIText* element = new GUIText(child);
             mObjects.push_back(element);
             mRenders.push_back(element);
+            mRenderConditions.push_back(element);
             mActions.push_back(element);
         } else if (type == "image") {
             GUIImage* element = new GUIImage(child);
             mObjects.push_back(element);
             mRenders.push_back(element);
+            mRenderConditions.push_back(element);
         } else if (type == "fill") {
             GUIFill* element = new GUIFill(child);
             mObjects.push_back(element);
             mRenders.push_back(element);
+            mRenderConditions.push_back(element);
         } else if (type == "action") {
             GUIAction* element = new GUIAction(child);
             mObjects.push_back(element);
@@ -400,72 +432,86 @@ bool Page::ProcessNode(xml_node<>* page, std::vector<xml_node<>*> *templates, in
             GUIConsole* element = new GUIConsole(child);
             mObjects.push_back(element);
             mRenders.push_back(element);
+            mRenderConditions.push_back(element);
             mActions.push_back(element);
         } else if (type == "terminal") {
             GUITerminal* element = new GUITerminal(child);
             mObjects.push_back(element);
             mRenders.push_back(element);
+            mRenderConditions.push_back(element);
             mActions.push_back(element);
             mInputs.push_back(element);
         } else if (type == "button") {
             GUIButton* element = new GUIButton(child);
             mObjects.push_back(element);
             mRenders.push_back(element);
+            mRenderConditions.push_back(element);
             mActions.push_back(element);
         } else if (type == "checkbox") {
             GUICheckbox* element = new GUICheckbox(child);
             mObjects.push_back(element);
             mRenders.push_back(element);
+            mRenderConditions.push_back(element);
             mActions.push_back(element);
         } else if (type == "fileselector") {
             GUIFileSelector* element = new GUIFileSelector(child);
             mObjects.push_back(element);
             mRenders.push_back(element);
+            mRenderConditions.push_back(element);
             mActions.push_back(element);
         } else if (type == "animation") {
             GUIAnimation* element = new GUIAnimation(child);
             mObjects.push_back(element);
             mRenders.push_back(element);
+            mRenderConditions.push_back(element);
         } else if (type == "progressbar") {
             GUIProgressBar* element = new GUIProgressBar(child);
             mObjects.push_back(element);
             mRenders.push_back(element);
+            mRenderConditions.push_back(element);
             mActions.push_back(element);
         } else if (type == "slider") {
             GUISlider* element = new GUISlider(child);
             mObjects.push_back(element);
             mRenders.push_back(element);
+            mRenderConditions.push_back(element);
             mActions.push_back(element);
         } else if (type == "slidervalue") {
             GUISliderValue *element = new GUISliderValue(child);
             mObjects.push_back(element);
             mRenders.push_back(element);
+            mRenderConditions.push_back(element);
             mActions.push_back(element);
         } else if (type == "listbox") {
             GUIListBox* element = new GUIListBox(child);
             mObjects.push_back(element);
             mRenders.push_back(element);
+            mRenderConditions.push_back(element);
             mActions.push_back(element);
         } else if (type == "keyboard") {
             GUIKeyboard* element = new GUIKeyboard(child);
             mObjects.push_back(element);
             mRenders.push_back(element);
+            mRenderConditions.push_back(element);
             mActions.push_back(element);
         } else if (type == "input") {
             GUIInput* element = new GUIInput(child);
             mObjects.push_back(element);
             mRenders.push_back(element);
+            mRenderConditions.push_back(element);
             mActions.push_back(element);
             mInputs.push_back(element);
         } else if (type == "patternpassword") {
             GUIPatternPassword* element = new GUIPatternPassword(child);
             mObjects.push_back(element);
             mRenders.push_back(element);
+            mRenderConditions.push_back(element);
             mActions.push_back(element);
         } else if (type == "textbox") {
             GUITextBox* element = new GUITextBox(child);
             mObjects.push_back(element);
             mRenders.push_back(element);
+            mRenderConditions.push_back(element);
             mActions.push_back(element);
         } else if (type == "template") {
             if (!templates || !child->first_attribute("name")) {
@@ -507,14 +553,27 @@ bool Page::ProcessNode(xml_node<>* page, std::vector<xml_node<>*> *templates, in
     return true;
 }
 
-int Page::Render()
+int Page::Render(const DirtyRect& dirty)
 {
     // Render background
     gr_color(mBackground.red, mBackground.green, mBackground.blue, mBackground.alpha);
-    gr_fill(0, 0, gr_fb_width(), gr_fb_height());
+    if (dirty.full) {
+        gr_fill(0, 0, gr_fb_width(), gr_fb_height());
+    } else {
+        gr_fill(dirty.x1, dirty.y1, dirty.x2 - dirty.x1, dirty.y2 - dirty.y1);
+    }
 
     // Render remaining objects
     for (auto iter = mRenders.begin(); iter != mRenders.end(); iter++) {
+        if (!dirty.full) {
+            // Objects outside of the damaged area are still on screen
+            int x, y, w, h;
+            if ((*iter)->GetDirtyRect(x, y, w, h) == 0
+                    && !dirty.Intersects(x, y, w, h)) {
+                continue;
+            }
+        }
+
         if ((*iter)->Render()) {
             LOGE("A render request has failed.");
         }
@@ -522,17 +581,58 @@ int Page::Render()
     return 0;
 }
 
-int Page::Update()
+int Page::Update(DirtyRect& dirty)
 {
     int retCode = 0;
 
-    for (auto iter = mRenders.begin(); iter != mRenders.end(); iter++) {
-        int ret = (*iter)->Update();
+    mRenderVisible.resize(mRenders.size(), true);
+
+    for (size_t i = 0; i < mRenders.size(); ++i) {
+        RenderObject* obj = mRenders[i];
+        int x, y, w, h;
+
+        // Objects hidden or shown by a variable change don't report it from
+        // Update(), so their area must be repainted here
+        bool visible = mRenderConditions[i]->isConditionTrue();
+        if (visible != mRenderVisible[i]) {
+            mRenderVisible[i] = visible;
+            if (obj->GetDirtyRect(x, y, w, h) == 0) {
+                dirty.Add(x, y, w, h);
+            } else {
+                dirty.AddAll();
+            }
+            retCode = std::max(retCode, 2);
+        }
+
+        int oldRet = obj->GetDirtyRect(x, y, w, h);
+        int ret = obj->Update();
         if (ret < 0) {
             LOGE("An update request has failed.");
+            continue;
+        } else if (ret == 0) {
+            continue;
         } else if (ret > retCode) {
             retCode = ret;
         }
+
+        // Repaint only what the object says has changed, if it knows
+        int ux, uy, uw, uh;
+        if (obj->GetUpdateRect(ux, uy, uw, uh) == 0) {
+            dirty.Add(ux, uy, uw, uh);
+            continue;
+        }
+
+        // Repaint both the old and the new contents
+        if (oldRet == 0) {
+            dirty.Add(x, y, w, h);
+        } else {
+            dirty.AddAll();
+        }
+        if (obj->GetDirtyRect(x, y, w, h) == 0) {
+            dirty.Add(x, y, w, h);
+        } else {
+            dirty.AddAll();
+        }
     }
 
     return retCode;
@@ -657,6 +757,9 @@ struct LoadingContext
 
     ~LoadingContext()
     {
+        for (auto it = xmldocs.begin(); it != xmldocs.end(); ++it) {
+            delete *it;
+        }
         // free all xml buffers
         for (auto it = xmlbuffers.begin(); it != xmlbuffers.end(); ++it) {
             free(*it);
@@ -672,6 +775,10 @@ PageSet::PageSet()
 {
     mResources = new ResourceManager;
     mCurrentPage = nullptr;
+    mZip = nullptr;
+    mContext = nullptr;
+    mScaleW = mScaleH = 1;
+    mXOffset = mYOffset = 0;
 
     set_scale_values(1, 1); // Reset any previous scaling values
 }
@@ -684,6 +791,29 @@ PageSet::~PageSet()
     }
 
     delete mResources;
+    delete mContext;
+
+    // Resources may reference the zip, so it must be closed last
+    if (mZip) {
+        mzCloseZipArchive(mZip);
+        sysReleaseMap(&mZipMap);
+        delete mZip;
+    }
+}
+
+void PageSet::AdoptArchive(ZipArchive* zip, const MemMapping& map)
+{
+    mZip = zip;
+    mZipMap = map;
+}
+
+void PageSet::AdoptContext(LoadingContext* ctx)
+{
+    mContext = ctx;
+    mScaleW = get_scale_w();
+    mScaleH = get_scale_h();
+    mXOffset = tw_x_offset;
+    mYOffset = tw_y_offset;
 }
 
 int PageSet::Load(LoadingContext& ctx, const std::string& filename)
@@ -755,7 +885,7 @@ int PageSet::Load(LoadingContext& ctx, const std::string& filename)
     // Load pages
     child = root->first_node("pages");
     if (child) {
-        if (LoadPages(ctx, child)) {
+        if (LoadPages(child)) {
             LOGE("PageSet::Load returning -1");
             return -1;
         }
@@ -788,7 +918,7 @@ int PageSet::Load(LoadingContext& ctx, const std::string& filename)
 
 void PageSet::MakeEmergencyConsoleIfNeeded()
 {
-    if (mPages.empty()) {
+    if (mPages.empty() && mPendingPages.empty()) {
         mCurrentPage = new Page(nullptr, nullptr); // fallback console page
         // TODO: since removal of non-TTF fonts, the emergency console doesn't work without a font, which might be missing too
         mPages.push_back(mCurrentPage);
@@ -919,6 +1049,7 @@ int PageSet::SetPage(const std::string& page)
         mCurrentPage = tmp;
         mCurrentPage->SetPageFocus(1);
         mCurrentPage->NotifyVarChange("", "");
+        PageManager::Invalidate();
         return 0;
     } else {
         LOGE("Unable to locate page (%s)", page.c_str());
@@ -962,6 +1093,7 @@ int PageSet::SetOverlay(Page* page)
             }
         }
     }
+    PageManager::Invalidate();
     return 0;
 }
 
@@ -977,9 +1109,48 @@ Page* PageSet::FindPage(const std::string& name)
             return (*iter);
         }
     }
+
+    for (auto iter = mPendingPages.begin(); iter != mPendingPages.end(); iter++) {
+        if (name == (*iter)->first_attribute("name")->value()) {
+            xml_node<>* node = *iter;
+            mPendingPages.erase(iter);
+            return CreatePage(node);
+        }
+    }
     return nullptr;
 }
 
+Page* PageSet::CreatePage(xml_node<>* node)
+{
+    // Objects use the theme's scaling and styles while they are being
+    // created, so temporarily restore the state from when the theme was loaded
+    float scale_w = get_scale_w();
+    float scale_h = get_scale_h();
+    int x_offset = tw_x_offset;
+    int y_offset = tw_y_offset;
+    LoadingContext* ctx = PageManager::currentLoadingContext;
+    PageSet* current_set = PageManager::mCurrentSet;
+
+    if (mContext) {
+        set_scale_values(mScaleW, mScaleH);
+        tw_x_offset = mXOffset;
+        tw_y_offset = mYOffset;
+        PageManager::currentLoadingContext = mContext;
+    }
+    PageManager::mCurrentSet = this;
+
+    Page* page = new Page(node, mContext ? &mContext->templates : &ctx->templates);
+    mPages.push_back(page);
+
+    PageManager::mCurrentSet = current_set;
+    PageManager::currentLoadingContext = ctx;
+    tw_x_offset = x_offset;
+    tw_y_offset = y_offset;
+    set_scale_values(scale_w, scale_h);
+
+    return page;
+}
+
 int PageSet::LoadVariables(xml_node<>* vars)
 {
     xml_node<>* child;
@@ -1036,7 +1207,7 @@ int PageSet::LoadVariables(xml_node<>* vars)
     return 0;
 }
 
-int PageSet::LoadPages(LoadingContext& ctx, xml_node<>* pages)
+int PageSet::LoadPages(xml_node<>* pages)
 {
     xml_node<>* child;
 
@@ -1044,18 +1215,19 @@ int PageSet::LoadPages(LoadingContext& ctx, xml_node<>* pages)
         return -1;
     }
 
+    // Pages are only created when they are first shown
     child = pages->first_node("page");
     while (child != nullptr) {
-        Page* page = new Page(child, &ctx.templates);
-        if (page->GetName().empty()) {
+        xml_attribute<>* attr = child->first_attribute("name");
+        if (!attr || !*attr->value()) {
+            LOGE("No page name attribute found!");
             LOGE("Unable to process load page");
-            delete page;
         } else {
-            mPages.push_back(page);
+            mPendingPages.push_back(child);
         }
         child = child->next_sibling("page");
     }
-    if (mPages.size() > 0) {
+    if (mPendingPages.size() > 0) {
         return 0;
     }
     return -1;
@@ -1071,17 +1243,17 @@ std::string PageSet::GetCurrentPage() const
     return mCurrentPage ? mCurrentPage->GetName() : "";
 }
 
-int PageSet::Render()
+int PageSet::Render(const DirtyRect& dirty)
 {
     int ret;
 
-    ret = (mCurrentPage ? mCurrentPage->Render() : -1);
+    ret = (mCurrentPage ? mCurrentPage->Render(dirty) : -1);
     if (ret < 0) {
         return ret;
     }
 
     for (auto iter = mOverlays.begin(); iter != mOverlays.end(); iter++) {
-        ret = ((*iter) ? (*iter)->Render() : -1);
+        ret = ((*iter) ? (*iter)->Render(dirty) : -1);
         if (ret < 0) {
             return ret;
         }
@@ -1089,17 +1261,17 @@ int PageSet::Render()
     return ret;
 }
 
-int PageSet::Update()
+int PageSet::Update(DirtyRect& dirty)
 {
     int ret;
 
-    ret = (mCurrentPage ? mCurrentPage->Update() : -1);
+    ret = (mCurrentPage ? mCurrentPage->Update(dirty) : -1);
     if (ret < 0 || ret > 1) {
         return ret;
     }
 
     for (auto iter = mOverlays.begin(); iter != mOverlays.end(); iter++) {
-        ret = ((*iter) ? (*iter)->Update() : -1);
+        ret = ((*iter) ? (*iter)->Update(dirty) : -1);
         if (ret < 0) {
             return ret;
         }
@@ -1325,7 +1497,7 @@ int PageManager::LoadPackage(const std::string& name,
                              const std::string& startpage)
 {
     std::string mainxmlfilename = package;
-    ZipArchive zip;
+    ZipArchive* zip = nullptr;
     char* languageFile = nullptr;
     char* baseLanguageFile = nullptr;
     PageSet* pageSet = nullptr;
@@ -1335,8 +1507,10 @@ int PageManager::LoadPackage(const std::string& name,
     mReloadTheme = false;
     mStartPage = startpage;
 
-    // init the loading context
-    LoadingContext ctx;
+    // init the loading context. It is kept by the page set afterwards so
+    // that pages can be created when they are first shown.
+    LoadingContext* ctxp = new LoadingContext();
+    LoadingContext& ctx = *ctxp;
 
     // Open the XML file
     LOGI("Loading package: %s (%s)", name.c_str(), package.c_str());
@@ -1355,18 +1529,21 @@ int PageManager::LoadPackage(const std::string& name,
         tw_x_offset = 0;
         tw_y_offset = 0;
         if (!mb::util::path_exists(package.c_str(), false)) {
+            delete ctxp;
             return -1;
         }
         if (sysMapFile(package.c_str(), &map) != 0) {
             LOGE("Failed to map '%s'", package.c_str());
             goto error;
         }
-        if (mzOpenZipArchive(map.addr, map.length, &zip)) {
+        zip = new ZipArchive();
+        if (mzOpenZipArchive(map.addr, map.length, zip)) {
             LOGE("Unable to open zip archive '%s'", package.c_str());
             sysReleaseMap(&map);
+            delete zip;
             goto error;
         }
-        ctx.zip = &zip;
+        ctx.zip = zip;
         mainxmlfilename = "ui.xml";
         LoadLanguageList(ctx.zip);
         languageFile = LoadFileToBuffer("languages/en.xml", ctx.zip);
@@ -1393,8 +1570,15 @@ int PageManager::LoadPackage(const std::string& name,
     currentLoadingContext = nullptr;
 
     if (ret == 0) {
+        mCurrentSet->AdoptContext(ctxp);
+        ctxp = nullptr;
         mCurrentSet->SetPage(startpage);
         mPageSets.insert(std::pair<std::string, PageSet*>(name, mCurrentSet));
+        if (ctx.zip) {
+            // Images are decoded from the zip when they are first used
+            mCurrentSet->AdoptArchive(ctx.zip, map);
+            ctx.zip = nullptr;
+        }
     } else {
         if (ret != TW_THEME_VER_ERR) {
             LOGE("Package %s failed to load.", name.c_str());
@@ -1405,17 +1589,24 @@ int PageManager::LoadPackage(const std::string& name,
     mCurrentSet = pageSet;
 
     if (ctx.zip) {
+        // Resources of a set that failed to load may still be decoding
+        Resource::CancelDecodes(ctx.zip);
         mzCloseZipArchive(ctx.zip);
         sysReleaseMap(&map);
+        delete ctx.zip;
     }
+    delete ctxp;
     return ret;
 
 error:
     // Sometimes we get here without a real error
     if (ctx.zip) {
+        Resource::CancelDecodes(ctx.zip);
         mzCloseZipArchive(ctx.zip);
         sysReleaseMap(&map);
+        delete ctx.zip;
     }
+    delete ctxp;
     return -1;
 }
 
@@ -1440,6 +1631,7 @@ PageSet* PageManager::SelectPackage(const std::string& name)
         mCurrentSet = tmp;
         mCurrentSet->MakeEmergencyConsoleIfNeeded();
         mCurrentSet->NotifyVarChange("", "");
+        Invalidate();
     } else {
         LOGE("Unable to find package.");
     }
@@ -1472,6 +1664,7 @@ int PageManager::ReloadPackage(const std::string& name,
     if (mCurrentSet == set) {
         SelectPackage(name);
     }
+    GUIAction::CancelPendingActions();
     delete set;
     GUIConsole::Translate_Now();
     return 0;
@@ -1486,6 +1679,7 @@ void PageManager::ReleasePackage(const std::string& name)
 
     PageSet* set = (*iter).second;
     mPageSets.erase(iter);
+    GUIAction::CancelPendingActions();
     delete set;
     if (set == mCurrentSet) {
         mCurrentSet = nullptr;
@@ -1576,13 +1770,49 @@ int PageManager::Render()
         return 0;
     }
 
-    int res = (mCurrentSet ? mCurrentSet->Render() : -1);
+    // Without partial flips, the drawing surface may hold an older frame
+    if (!gr_has_partial_flip()) {
+        mDirty.AddAll();
+    }
+    if (mDirty.IsEmpty()) {
+        return 0;
+    }
+    if (!mDirty.full) {
+        gr_set_render_bounds(mDirty.x1, mDirty.y1,
+                             mDirty.x2 - mDirty.x1, mDirty.y2 - mDirty.y1);
+    }
+
+    int res = (mCurrentSet ? mCurrentSet->Render(mDirty) : -1);
     if (mMouseCursor) {
         mMouseCursor->Render();
     }
+
+    if (!mDirty.full) {
+        gr_clear_render_bounds();
+    }
     return res;
 }
 
+void PageManager::Invalidate()
+{
+    mDirty.AddAll();
+}
+
+// Returns the region to flip and resets the damage for the next frame. Returns
+// false if the whole screen must be flipped.
+bool PageManager::TakeDirtyRegion(int& x, int& y, int& w, int& h)
+{
+    bool partial = !mDirty.full;
+
+    x = mDirty.x1;
+    y = mDirty.y1;
+    w = mDirty.x2 - mDirty.x1;
+    h = mDirty.y2 - mDirty.y1;
+
+    mDirty.Clear();
+    return partial;
+}
+
 HardwareKeyboard *PageManager::GetHardwareKeyboard()
 {
     if (!mHardwareKeyboard) {
@@ -1642,10 +1872,17 @@ int PageManager::Update()
         return -2;
     }
 
-    int res = (mCurrentSet ? mCurrentSet->Update() : -1);
+    int res = (mCurrentSet ? mCurrentSet->Update(mDirty) : -1);
 
     if (mMouseCursor) {
+        int x, y, w, h;
+        mMouseCursor->GetRenderPos(x, y, w, h);
         int c_res = mMouseCursor->Update();
+        if (c_res > 0) {
+            mDirty.Add(x, y, w, h);
+            mMouseCursor->GetRenderPos(x, y, w, h);
+            mDirty.Add(x, y, w, h);
+        }
         if (c_res > res) {
             res = c_res;
         }
@@ -1692,4 +1929,7 @@ extern "C" void gui_notifyVarChange(const char *name, const char* value)
     }
 
     PageManager::NotifyVarChange(name, value);
+
+    // The change may have come from another thread
+    ev_wake();
 }
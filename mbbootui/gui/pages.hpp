@@ -49,6 +49,37 @@ inline bool operator < (const language_struct& language1,
 
 extern std::vector<language_struct> Language_List;
 
+// Bounding box of the screen areas that must be repainted on the next render
+struct DirtyRect
+{
+    int x1;
+    int y1;
+    int x2;
+    int y2;
+    bool full;
+
+    DirtyRect() { Clear(); }
+
+    void Clear()
+    {
+        x1 = y1 = x2 = y2 = 0;
+        full = false;
+    }
+
+    bool IsEmpty() const
+    {
+        return !full && (x1 >= x2 || y1 >= y2);
+    }
+
+    void AddAll()
+    {
+        full = true;
+    }
+
+    void Add(int x, int y, int w, int h);
+    bool Intersects(int x, int y, int w, int h) const;
+};
+
 // Utility Functions
 int ConvertStrToColor(std::string str, COLOR* color);
 int gui_forceRender();
@@ -76,8 +107,8 @@ public:
     }
 
 public:
-    virtual int Render();
-    virtual int Update();
+    virtual int Render(const DirtyRect& dirty);
+    virtual int Update(DirtyRect& dirty);
     virtual int NotifyTouch(TOUCH_STATE state, int x, int y);
     virtual int NotifyKey(int key, bool down);
     virtual int NotifyCharInput(int ch);
@@ -93,6 +124,10 @@ protected:
     std::vector<ActionObject*> mActions;
     std::vector<InputObject*> mInputs;
 
+    // Conditions and last known visibility of each entry in mRenders
+    std::vector<GUIObject*> mRenderConditions;
+    std::vector<bool> mRenderVisible;
+
     ActionObject* mTouchStart;
     COLOR mBackground;
 
@@ -113,6 +148,14 @@ public:
     int LoadLanguage(char* languageFile, ZipArchive* package);
     void MakeEmergencyConsoleIfNeeded();
 
+    // Keep the theme zip open for the lifetime of the page set so resources
+    // can be decoded when they are first used. Takes ownership of both.
+    void AdoptArchive(ZipArchive* zip, const MemMapping& map);
+
+    // Keep the parsed XML so that pages can be created when they are first
+    // shown. Takes ownership of the context.
+    void AdoptContext(LoadingContext* ctx);
+
     Page* FindPage(const std::string& name);
     int SetPage(const std::string& page);
     int SetOverlay(Page* page);
@@ -123,8 +166,8 @@ public:
     std::string GetCurrentPage() const;
 
     // These are routing routines
-    int Render();
-    int Update();
+    int Render(const DirtyRect& dirty);
+    int Update(DirtyRect& dirty);
     int NotifyTouch(TOUCH_STATE state, int x, int y);
     int NotifyKey(int key, bool down);
     int NotifyCharInput(int ch);
@@ -135,18 +178,30 @@ public:
 
 protected:
     int LoadDetails(LoadingContext& ctx, xml_node<>* root);
-    int LoadPages(LoadingContext& ctx, xml_node<>* pages);
+    int LoadPages(xml_node<>* pages);
     int LoadVariables(xml_node<>* vars);
+    Page* CreatePage(xml_node<>* node);
 
 protected:
     ResourceManager* mResources;
     std::vector<Page*> mPages;
     Page* mCurrentPage;
     std::vector<Page*> mOverlays; // Special case for popup dialogs and the lock screen
+    ZipArchive* mZip;
+    MemMapping mZipMap;
+
+    // Pages that have not been created yet
+    std::vector<xml_node<>*> mPendingPages;
+    LoadingContext* mContext;
+    // Scaling and offsets used by this page set's theme
+    float mScaleW, mScaleH;
+    int mXOffset, mYOffset;
 };
 
 class PageManager
 {
+    friend class PageSet;
+
 public:
     // Used by GUI
     static char* LoadFileToBuffer(const std::string &filename, ZipArchive* package);
@@ -174,6 +229,11 @@ public:
     // These are routing routines
     static int Render();
     static int Update();
+
+    // Damage tracking. Render() only repaints what Update() reported as
+    // changed unless everything has been invalidated
+    static void Invalidate();
+    static bool TakeDirtyRegion(int& x, int& y, int& w, int& h);
     static int NotifyTouch(TOUCH_STATE state, int x, int y);
     static int NotifyKey(int key, bool down);
     static int NotifyCharInput(int ch);
@@ -197,6 +257,7 @@ protected:
     static PageSet* mCurrentSet;
     static MouseCursor *mMouseCursor;
     static HardwareKeyboard *mHardwareKeyboard;
+    static DirtyRect mDirty;
     static bool mReloadTheme;
     static std::string mStartPage;
     static LoadingContext* currentLoadingContext;
@@ -2,21 +2,196 @@
 
 #include "gui/objects.hpp"
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
 
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "mblog/logging.h"
 
 #include "twrp-functions.hpp"
 
+#include "config/config.hpp"
+
 #include "gui/gui.h"
 
-#define TMP_RESOURCE_NAME   "/tmp/extract.bin"
+// Maximum number of background image decode threads
+#define MAX_DECODE_THREADS  8
 
-Resource::Resource(xml_node<>* node, ZipArchive* pZip __unused)
+struct ImageDecodeJob
+{
+    enum class State
+    {
+        Queued,
+        Running,
+        Done,
+    };
+
+    ZipArchive* zip;
+    std::string file;
+    int retain_aspect;
+
+    State state;
+    gr_surface surface;
+};
+
+/*
+ * Pool of threads that decode and scale theme images in the background.
+ *
+ * Jobs are queued when a theme is loaded. A resource that is needed before its
+ * job has started takes the job and decodes it on the calling thread, so a page
+ * render only waits for the images it actually uses. Pixelflinger contexts used
+ * for scaling are independent of each other, so scaling can run concurrently
+ * with drawing.
+ */
+class ImageDecodePool
+{
+public:
+    static ImageDecodePool& Get()
+    {
+        static ImageDecodePool pool;
+        return pool;
+    }
+
+    void Queue(const std::shared_ptr<ImageDecodeJob>& job)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        if (mThreads.empty()) {
+            unsigned int n = std::thread::hardware_concurrency();
+            // The GUI thread also decodes images that are needed right away
+            n = std::max(1u, std::min(n > 1 ? n - 1 : 1,
+                                      static_cast<unsigned int>(
+                                              MAX_DECODE_THREADS)));
+            for (unsigned int i = 0; i < n; ++i) {
+                mThreads.emplace_back(&ImageDecodePool::Worker, this);
+            }
+        }
+
+        mQueue.push_back(job);
+        mQueueCv.notify_one();
+    }
+
+    // Returns true if the caller now owns the (queued) job and must run it
+    bool Claim(const std::shared_ptr<ImageDecodeJob>& job)
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+
+        if (job->state == ImageDecodeJob::State::Queued) {
+            job->state = ImageDecodeJob::State::Running;
+            return true;
+        }
+
+        mDoneCv.wait(lock, [&] {
+            return job->state == ImageDecodeJob::State::Done;
+        });
+        return false;
+    }
+
+    void Complete(const std::shared_ptr<ImageDecodeJob>& job,
+                  gr_surface surface)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            job->surface = surface;
+            job->state = ImageDecodeJob::State::Done;
+        }
+        mDoneCv.notify_all();
+    }
+
+    // Claim all jobs for zip that have not started and wait for the rest
+    void CancelAll(ZipArchive* zip)
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+
+        for (auto const& job : mQueue) {
+            if (job->zip == zip
+                    && job->state == ImageDecodeJob::State::Queued) {
+                job->state = ImageDecodeJob::State::Done;
+                job->surface = nullptr;
+            }
+        }
+
+        mDoneCv.wait(lock, [&] {
+            return mRunning.find(zip) == mRunning.end();
+        });
+    }
+
+private:
+    ImageDecodePool() : mStop(false)
+    {
+    }
+
+    ~ImageDecodePool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mQueueCv.notify_all();
+
+        for (auto& t : mThreads) {
+            t.join();
+        }
+    }
+
+    void Worker()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+
+        while (true) {
+            mQueueCv.wait(lock, [&] {
+                return mStop || !mQueue.empty();
+            });
+            if (mStop) {
+                return;
+            }
+
+            std::shared_ptr<ImageDecodeJob> job = std::move(mQueue.front());
+            mQueue.pop_front();
+
+            if (job->state != ImageDecodeJob::State::Queued) {
+                // Claimed by its resource or cancelled
+                continue;
+            }
+
+            job->state = ImageDecodeJob::State::Running;
+            mRunning.insert(job->zip);
+            lock.unlock();
+
+            gr_surface surface = nullptr;
+            Resource::LoadScaledImage(job->zip, job->file, job->retain_aspect,
+                                      &surface);
+
+            lock.lock();
+            mRunning.erase(mRunning.find(job->zip));
+            job->surface = surface;
+            job->state = ImageDecodeJob::State::Done;
+            mDoneCv.notify_all();
+        }
+    }
+
+    std::mutex mMutex;
+    std::condition_variable mQueueCv;
+    std::condition_variable mDoneCv;
+    std::deque<std::shared_ptr<ImageDecodeJob>> mQueue;
+    // Zips that running jobs are reading from
+    std::unordered_multiset<ZipArchive*> mRunning;
+    std::vector<std::thread> mThreads;
+    bool mStop;
+};
+
+Resource::Resource(xml_node<>* node, ZipArchive* pZip)
+    : mZip(pZip)
 {
     if (node && node->first_attribute("name")) {
         mName = node->first_attribute("name")->value();
@@ -59,14 +234,34 @@ void Resource::LoadImage(ZipArchive* pZip, const std::string& file,
                          gr_surface* surface)
 {
     int rc = 0;
-    if (ExtractResource(pZip, "images", file, ".png", TMP_RESOURCE_NAME) == 0) {
-        rc = res_create_surface(TMP_RESOURCE_NAME, surface);
-        unlink(TMP_RESOURCE_NAME);
-    } else if (ExtractResource(pZip, "images", file, "", TMP_RESOURCE_NAME) == 0) {
-        // JPG includes the .jpg extension in the filename so extension should be blank
-        rc = res_create_surface(TMP_RESOURCE_NAME, surface);
-        unlink(TMP_RESOURCE_NAME);
-    } else if (!pZip) {
+
+    if (pZip) {
+        const ZipEntry* entry = mzFindZipEntry(
+                pZip, ("images/" + file + ".png").c_str());
+        if (!entry) {
+            // JPG includes the .jpg extension in the filename so extension
+            // should be blank
+            entry = mzFindZipEntry(pZip, ("images/" + file).c_str());
+        }
+
+        if (entry) {
+            // Stored images are decoded straight from the mapped zip. Only
+            // compressed ones need to be inflated into a buffer first.
+            size_t len = mzGetZipEntryUncompLen(entry);
+            const unsigned char* data = mzGetStoredZipEntryData(pZip, entry);
+            if (data) {
+                rc = res_create_surface_from_memory(data, len, surface);
+            } else {
+                std::vector<unsigned char> buf(len);
+                if (mzExtractZipEntryToBuffer(pZip, entry, buf.data())) {
+                    rc = res_create_surface_from_memory(
+                            buf.data(), buf.size(), surface);
+                } else {
+                    rc = -1;
+                }
+            }
+        }
+    } else {
         // File name in xml may have included .png so try without adding .png
         rc = res_create_surface(file.c_str(), surface);
     }
@@ -99,6 +294,118 @@ void Resource::CheckAndScaleImage(gr_surface source, gr_surface* destination, in
     }
 }
 
+bool Resource::ImageExists(ZipArchive* pZip, const std::string& file)
+{
+    if (pZip) {
+        // Same lookup order as LoadImage()
+        return mzFindZipEntry(pZip, ("images/" + file + ".png").c_str())
+                || mzFindZipEntry(pZip, ("images/" + file).c_str());
+    }
+
+    // Same lookup order as res_create_surface()
+    std::string images_dir(tw_resource_path);
+    images_dir += "/images/";
+
+    struct stat sb;
+    return stat((images_dir + file + ".png").c_str(), &sb) == 0
+            || stat(file.c_str(), &sb) == 0
+            || stat((images_dir + file).c_str(), &sb) == 0;
+}
+
+void Resource::LoadScaledImage(ZipArchive* pZip, const std::string& file,
+                               int retain_aspect, gr_surface* surface)
+{
+    gr_surface temp_surface = nullptr;
+    std::string cache_file;
+
+    // Scaled images of the stock theme are cached on disk. The cache directory
+    // is specific to the theme, so only the screen size needs to be part of
+    // the name.
+    if (!pZip && tw_image_cache_path
+            && get_scale_w() != 0 && get_scale_h() != 0) {
+        std::string name = file;
+        std::replace(name.begin(), name.end(), '/', '_');
+
+        cache_file = tw_image_cache_path;
+        cache_file += '/';
+        cache_file += std::to_string(gr_fb_width());
+        cache_file += 'x';
+        cache_file += std::to_string(gr_fb_height());
+        cache_file += '-';
+        cache_file += name;
+        if (retain_aspect) {
+            cache_file += "-aspect";
+        }
+        cache_file += ".bin";
+
+        if (res_read_surface_cache(cache_file.c_str(), surface) == 0) {
+            return;
+        }
+    }
+
+    LoadImage(pZip, file, &temp_surface);
+    CheckAndScaleImage(temp_surface, surface, retain_aspect);
+
+    if (*surface && !cache_file.empty() && *surface != temp_surface
+            && res_write_surface_cache(cache_file.c_str(), *surface) != 0) {
+        LOGW("Failed to cache scaled image: %s", cache_file.c_str());
+    }
+}
+
+void Resource::CancelDecodes(ZipArchive* pZip)
+{
+    ImageDecodePool::Get().CancelAll(pZip);
+}
+
+std::shared_ptr<ImageDecodeJob> Resource::QueueDecode(ZipArchive* pZip,
+                                                      const std::string& file,
+                                                      int retain_aspect)
+{
+    auto job = std::make_shared<ImageDecodeJob>();
+    job->zip = pZip;
+    job->file = file;
+    job->retain_aspect = retain_aspect;
+    job->state = ImageDecodeJob::State::Queued;
+    job->surface = nullptr;
+
+    ImageDecodePool::Get().Queue(job);
+    return job;
+}
+
+gr_surface Resource::FinishDecode(std::shared_ptr<ImageDecodeJob>& job)
+{
+    ImageDecodePool& pool = ImageDecodePool::Get();
+
+    if (pool.Claim(job)) {
+        gr_surface surface = nullptr;
+        LoadScaledImage(job->zip, job->file, job->retain_aspect, &surface);
+        pool.Complete(job, surface);
+    }
+
+    gr_surface surface = job->surface;
+    job.reset();
+    return surface;
+}
+
+void Resource::DiscardDecode(std::shared_ptr<ImageDecodeJob>& job)
+{
+    if (!job) {
+        return;
+    }
+
+    ImageDecodePool& pool = ImageDecodePool::Get();
+
+    // Skip decoding if it hasn't started yet
+    if (pool.Claim(job)) {
+        pool.Complete(job, nullptr);
+    }
+
+    if (job->surface) {
+        res_free_surface(job->surface);
+    }
+    job.reset();
+}
+
 FontResource::FontResource(xml_node<>* node, ZipArchive* pZip)
     : Resource(node, pZip)
 {
@@ -149,9 +456,19 @@ void FontResource::LoadFont(xml_node<>* node, ZipArchive* pZip)
             dpi = atoi(attr->value());
         }
 
-        // we can't use TMP_RESOURCE_NAME here because the ttf subsystem is caching the name and scaling needs to reload the font
+        // Stored fonts are loaded straight from the mapped zip, which the
+        // owning PageSet keeps open for longer than any of its fonts
+        const ZipEntry* entry = pZip
+                ? mzFindZipEntry(pZip, ("fonts/" + file).c_str()) : nullptr;
+        const unsigned char* data = entry
+                ? mzGetStoredZipEntryData(pZip, entry) : nullptr;
+        // Compressed fonts are extracted to a file instead of memory because
+        // the ttf subsystem caches the name and scaling needs to reload the font
         std::string tmpname = "/tmp/" + file;
-        if (ExtractResource(pZip, "fonts", file, "", tmpname) == 0) {
+        if (data) {
+            mFont = gr_ttf_loadFontFromMemory(("zip:fonts/" + file).c_str(),
+                    data, mzGetZipEntryUncompLen(entry), font_size, dpi);
+        } else if (ExtractResource(pZip, "fonts", file, "", tmpname) == 0) {
             mFont = gr_ttf_loadFont(tmpname.c_str(), font_size, dpi);
         } else {
             file = TWFunc::get_resource_path("fonts/" + file);
@@ -193,30 +510,50 @@ FontResource::~FontResource()
 ImageResource::ImageResource(xml_node<>* node, ZipArchive* pZip)
     : Resource(node, pZip)
 {
-    std::string file;
-    gr_surface temp_surface = nullptr;
-
     mSurface = nullptr;
+    mRetainAspect = false;
+    mLoaded = true;
+    mValid = false;
     if (!node) {
         LOGE("ImageResource node is NULL");
         return;
     }
 
     if (node->first_attribute("filename")) {
-        file = node->first_attribute("filename")->value();
+        mFile = node->first_attribute("filename")->value();
     } else {
         LOGE("No filename specified for image resource.");
         return;
     }
 
-    bool retain_aspect = (node->first_attribute("retainaspect") != nullptr);
     // the value does not matter, if retainaspect is present, we assume that we want to retain it
-    LoadImage(pZip, file, &temp_surface);
-    CheckAndScaleImage(temp_surface, &mSurface, retain_aspect);
+    mRetainAspect = (node->first_attribute("retainaspect") != nullptr);
+
+    // Only check that the image exists for now. It is decoded in the background
+    // and waited for when first used.
+    mValid = ImageExists(pZip, mFile);
+    mLoaded = !mValid;
+    if (mValid) {
+        mJob = QueueDecode(pZip, mFile, mRetainAspect);
+    }
+}
+
+void ImageResource::DoLoad()
+{
+    mLoaded = true;
+    if (mJob) {
+        mSurface = FinishDecode(mJob);
+    } else {
+        LoadScaledImage(mZip, mFile, mRetainAspect, &mSurface);
+    }
+    if (!mSurface) {
+        LOGE("Image resource (%s) failed to load", GetName().c_str());
+    }
 }
 
 ImageResource::~ImageResource()
 {
+    DiscardDecode(mJob);
     if (mSurface) {
         res_free_surface(mSurface);
     }
@@ -225,47 +562,72 @@ ImageResource::~ImageResource()
 AnimationResource::AnimationResource(xml_node<>* node, ZipArchive* pZip)
     : Resource(node, pZip)
 {
-    std::string file;
     int fileNum = 1;
 
+    mRetainAspect = false;
+
     if (!node) {
         return;
     }
 
     if (node->first_attribute("filename")) {
-        file = node->first_attribute("filename")->value();
+        mFile = node->first_attribute("filename")->value();
     } else {
         LOGE("No filename specified for image resource.");
         return;
     }
 
-    bool retain_aspect = (node->first_attribute("retainaspect") != nullptr);
     // the value does not matter, if retainaspect is present, we assume that we want to retain it
-    for (;;) {
-        std::ostringstream fileName;
-        fileName << file << std::setfill ('0') << std::setw (3) << fileNum;
-
-        gr_surface surface, temp_surface = nullptr;
-        LoadImage(pZip, fileName.str(), &temp_surface);
-        CheckAndScaleImage(temp_surface, &surface, retain_aspect);
-        if (surface) {
-            mSurfaces.push_back(surface);
-            fileNum++;
-        } else {
-            break; // Done loading animation images
-        }
+    mRetainAspect = (node->first_attribute("retainaspect") != nullptr);
+
+    // Count the frames. They are decoded when first used.
+    while (ImageExists(pZip, FrameFileName(mFile, fileNum))) {
+        mSurfaces.push_back(nullptr);
+        mFrameLoaded.push_back(false);
+        mJobs.push_back(QueueDecode(pZip, FrameFileName(mFile, fileNum),
+                                    mRetainAspect));
+        fileNum++;
     }
 }
 
 AnimationResource::~AnimationResource()
 {
+    for (auto& job : mJobs) {
+        DiscardDecode(job);
+    }
+
     for (auto it = mSurfaces.begin(); it != mSurfaces.end(); ++it) {
-        res_free_surface(*it);
+        if (*it) {
+            res_free_surface(*it);
+        }
     }
 
     mSurfaces.clear();
 }
 
+std::string AnimationResource::FrameFileName(const std::string& file,
+                                             int fileNum)
+{
+    std::ostringstream fileName;
+    fileName << file << std::setfill ('0') << std::setw (3) << fileNum;
+    return fileName.str();
+}
+
+gr_surface AnimationResource::GetFrame(size_t entry)
+{
+    gr_surface surface = mSurfaces.at(entry);
+    if (!mFrameLoaded[entry]) {
+        mFrameLoaded[entry] = true;
+        surface = FinishDecode(mJobs[entry]);
+        if (!surface) {
+            LOGE("Animation resource (%s) frame %zu failed to load",
+                 GetName().c_str(), entry + 1);
+        }
+        mSurfaces[entry] = surface;
+    }
+    return surface;
+}
+
 FontResource* ResourceManager::FindFont(const std::string& name) const
 {
     for (auto it = mFonts.begin(); it != mFonts.end(); ++it) {
@@ -409,7 +771,7 @@ void ResourceManager::LoadResources(xml_node<>* resList, ZipArchive* pZip,
             }
         } else if (type == "image") {
             ImageResource* res = new ImageResource(child, pZip);
-            if (res->GetResource()) {
+            if (res->IsValid()) {
                 mImages.push_back(res);
             } else {
                 error = true;
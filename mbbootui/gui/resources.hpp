@@ -3,15 +3,20 @@
 #ifndef _RESOURCE_HEADER
 #define _RESOURCE_HEADER
 
+#include <memory>
+
 #include "minuitwrp/minui.h"
 
 #include "gui/rapidxml.hpp"
 
 struct ZipArchive;
+struct ImageDecodeJob;
 
 // Base Objects
 class Resource
 {
+    friend class ImageDecodePool;
+
 public:
     Resource(xml_node<>* node, ZipArchive* pZip);
     virtual ~Resource() {}
@@ -22,10 +27,18 @@ public:
         return mName;
     }
 
+    // Cancel or wait for all background decodes that read from pZip. Must be
+    // called before a theme zip is closed.
+    static void CancelDecodes(ZipArchive* pZip);
+
 private:
     std::string mName;
 
 protected:
+    // Theme zip to decode resources from when they are first used, or NULL for
+    // the stock theme. The zip is kept open by the owning PageSet.
+    ZipArchive* mZip;
+
     static int ExtractResource(ZipArchive* pZip,
                                const std::string& folderName,
                                const std::string& fileName,
@@ -35,6 +48,19 @@ protected:
                           const std::string& file, gr_surface* surface);
     static void CheckAndScaleImage(gr_surface source, gr_surface* destination,
                                    int retain_aspect);
+    static bool ImageExists(ZipArchive* pZip, const std::string& file);
+    static void LoadScaledImage(ZipArchive* pZip, const std::string& file,
+                                int retain_aspect, gr_surface* surface);
+
+    // Queue an image to be decoded and scaled by the background decode threads
+    static std::shared_ptr<ImageDecodeJob> QueueDecode(ZipArchive* pZip,
+                                                       const std::string& file,
+                                                       int retain_aspect);
+    // Get the surface of a queued image. If it has not been started yet, it is
+    // decoded on the calling thread instead of waiting for the decode threads.
+    static gr_surface FinishDecode(std::shared_ptr<ImageDecodeJob>& job);
+    // Discard a queued image that is no longer needed
+    static void DiscardDecode(std::shared_ptr<ImageDecodeJob>& job);
 };
 
 class FontResource : public Resource
@@ -88,6 +114,7 @@ public:
 #if 0
         return this ? mSurface : nullptr;
 #else
+        Load();
         return mSurface;
 #endif
     }
@@ -97,7 +124,7 @@ public:
 #if 0
         return gr_get_width(this ? mSurface : nullptr);
 #else
-        return gr_get_width(mSurface);
+        return gr_get_width(GetResource());
 #endif
     }
 
@@ -106,12 +133,35 @@ public:
 #if 0
         return gr_get_height(this ? mSurface : nullptr);
 #else
-        return gr_get_height(mSurface);
+        return gr_get_height(GetResource());
 #endif
     }
 
+    // Whether the image file exists. This does not decode the image.
+    bool IsValid()
+    {
+        return mValid;
+    }
+
 protected:
     gr_surface mSurface;
+
+private:
+    // Decode the image the first time it is used
+    void Load()
+    {
+        if (!mLoaded) {
+            DoLoad();
+        }
+    }
+    void DoLoad();
+
+private:
+    std::string mFile;
+    bool mRetainAspect;
+    bool mLoaded;
+    bool mValid;
+    std::shared_ptr<ImageDecodeJob> mJob;
 };
 
 class AnimationResource : public Resource
@@ -126,7 +176,7 @@ public:
 #if 0
         return (!this || mSurfaces.empty()) ? nullptr : mSurfaces.at(0);
 #else
-        return mSurfaces.empty() ? nullptr : mSurfaces.at(0);
+        return mSurfaces.empty() ? nullptr : GetFrame(0);
 #endif
     }
 
@@ -135,7 +185,7 @@ public:
 #if 0
         return (!this || mSurfaces.empty()) ? nullptr : mSurfaces.at(entry);
 #else
-        return mSurfaces.empty() ? nullptr : mSurfaces.at(entry);
+        return mSurfaces.empty() ? nullptr : GetFrame(entry);
 #endif
     }
 
@@ -163,7 +213,18 @@ public:
     }
 
 protected:
+    // Frames are decoded the first time they are used
     std::vector<gr_surface> mSurfaces;
+    std::vector<bool> mFrameLoaded;
+    std::vector<std::shared_ptr<ImageDecodeJob>> mJobs;
+
+private:
+    gr_surface GetFrame(size_t entry);
+    static std::string FrameFileName(const std::string& file, int fileNum);
+
+private:
+    std::string mFile;
+    bool mRetainAspect;
 };
 
 class ResourceManager
@@ -23,14 +23,19 @@
 #include <vector>
 
 #include <cstring>
+#include <ctime>
 
 #include <fcntl.h>
 #include <linux/input.h>
+#include <pthread.h>
 #include <sys/wait.h>
 #include <termio.h>
 #include <unistd.h>
 
 #include "mblog/logging.h"
+#include "mbutil/time.h"
+
+#include "minuitwrp/minui.h"
 
 #include "data.hpp"
 #include "variables.h"
@@ -41,7 +46,11 @@
 #define debug_printf(...)
 #endif
 
-extern int g_pty_fd; // in gui.cpp where the select is
+// Maximum number of lines kept in the terminal's scrollback buffer
+#define MAX_SCROLLBACK_LINES 1000
+
+// Minimum time between two terminal redraws while output is arriving
+#define REDRAW_INTERVAL_MS 50
 
 /*
 Pseudoterminal handler.
@@ -77,10 +86,9 @@ public:
             pid = 0;
             return false;
         } else if (pid) {
-            // child started, now someone needs to periodically read from fdMaster
-            // and write it to the terminal
-            // this currently works through gui.cpp calling terminal_pty_read below
-            g_pty_fd = fdMaster;
+            // child started, now someone needs to read from fdMaster and
+            // write it to the terminal. This is done by the TerminalEngine's
+            // reader thread.
             return true;
         } else {
             int fdSlave = open(ptsname(fdMaster), O_RDWR);
@@ -120,14 +128,17 @@ public:
             LOGE("someone tried to read from pty, but it was not started");
             return -1;
         }
-        int rc = ::read(fdMaster, buffer, size);
+        int rc;
+        do {
+            rc = ::read(fdMaster, buffer, size);
+        } while (rc < 0 && errno == EINTR);
         debug_printf("pty read: %d bytes\n", rc);
         if (rc < 0) {
             // assume child has died (usual errno when shell exits seems to be EIO == 5)
+            // the caller is responsible for stopping the pty
             if (errno != EIO) {
                 LOGE("pty read failed: %d", errno);
             }
-            stop();
         }
         return rc;
     }
@@ -141,19 +152,12 @@ public:
         int rc = ::write(fdMaster, buffer, size);
         debug_printf("pty write: %d bytes -> %d\n", size, rc);
         if (rc < 0) {
+            // the child has likely died, which the reader thread will notice
             LOGE("pty write failed: %d", errno);
-            // assume child has died
-            stop();
         }
         return rc;
     }
 
-    template<size_t n>
-    inline int write(const char (&literal)[n])
-    {
-        return write(literal, n - 1);
-    }
-
     void resize(int xChars, int yChars, int w, int h)
     {
         struct winsize ws;
@@ -173,7 +177,7 @@ public:
             return;
         }
         close(fdMaster);
-        g_pty_fd = fdMaster = -1;
+        fdMaster = -1;
         int status;
         // avoid zombies but don't hang if the child is still alive and we got
         // here due to some error
@@ -255,6 +259,9 @@ It does not care about visual things like rendering, fonts, windows etc.
 The idea is that 0 to n GUITerminal instances (e.g. on different pages) can connect
 to one TerminalEngine to interact with the terminal, and that the TerminalEngine
 survives things like page changes or even theme reloads.
+
+The pty is read and the output is parsed on a separate thread, so the buffer
+must be locked while it is being accessed from the GUI.
 */
 class TerminalEngine
 {
@@ -266,143 +273,164 @@ public:
         COLOR bgcolor;
         // could add bold, underline, blink, etc.
     };
+#endif
+    typedef uint32_t CodePoint; // Unicode code point
 
-    struct AttributeRange
+    // A single character cell with a Unicode code point
+    struct Cell
     {
-        size_t start; // start position inside text (in bytes)
-        Attributes a;
+        Cell() : cp(' ') {}
+        Cell(CodePoint cp) : cp(cp) {}
+        CodePoint cp;
+        //Attributes a;
     };
-#endif
-    typedef uint32_t CodePoint; // Unicode code point
 
-    // A line of text, optimized for rendering and storage in the buffer
+    // A line of character cells. The UTF-8 text used for rendering is only
+    // rebuilt when the line has changed.
     struct Line
     {
+        std::vector<Cell> cells;
+        int generation; // update counter value of the last change
         std::string text; // in UTF-8 format
-        //std::vector<AttributeRange> attrs;
+        bool textValid;
 
-        Line() {}
+        Line() : generation(0), textValid(true) {}
 
-        size_t utf8forward(size_t start) const
+        void reset()
         {
-            if (start >= text.size()) {
-                return start;
-            }
-            uint32_t u8state = 0, u8cp = 0;
-            size_t i = start;
-            uint32_t rc;
-            do {
-                rc = utf8decode(&u8state, &u8cp, (unsigned char) text[i]);
-                ++i;
-            } while (rc != UTF8_ACCEPT && rc != UTF8_REJECT && i < text.size());
-            return i;
+            cells.clear();
+            text.clear();
+            textValid = true;
         }
 
-        std::string substr(size_t start, size_t n) const
+        void eraseFrom(size_t x)
         {
-            size_t i = 0;
-            for (; start && i < text.size(); i = utf8forward(i)) {
-                --start;
-            }
-            size_t s = i;
-            for (; n && i < text.size(); i = utf8forward(i)) {
-                --n;
+            if (cells.size() > x) {
+                cells.erase(cells.begin() + x, cells.end());
             }
-            return text.substr(s, i - s);
         }
 
-        size_t length() const
+        void eraseTo(size_t x)
         {
-            size_t n = 0;
-            for (size_t i = 0; i < text.size(); i = utf8forward(i)) {
-                ++n;
+            // Characters before the cursor become blank
+            x = std::min(x + 1, cells.size());
+            for (size_t i = 0; i < x; ++i) {
+                cells[i].cp = ' ';
             }
-            return n;
         }
-    };
-
-    // A single character cell with a Unicode code point
-    struct Cell
-    {
-        Cell() : cp(' ') {}
-        Cell(CodePoint cp) : cp(cp) {}
-        CodePoint cp;
-        //Attributes a;
-    };
 
-    // A line of text, optimized for editing single characters
-    struct UnpackedLine
-    {
-        std::vector<Cell> cells;
-
-        void eraseFrom(size_t x)
+        const std::string& getText()
         {
-            if (cells.size() > x) {
-                cells.erase(cells.begin() + x, cells.end());
+            if (!textValid) {
+                text.clear();
+                for (size_t i = 0; i < cells.size(); ++i) {
+                    utf8add(text, cells[i].cp);
+                    // later: if attributes changed, add attributes
+                }
+                textValid = true;
             }
+            return text;
         }
 
-        void eraseTo(size_t x)
+        std::string substr(size_t start, size_t n)
         {
-            if (x > 0) {
-                cells.erase(cells.begin(), cells.begin() + x);
+            std::string s;
+            for (size_t i = start; i < start + n && i < cells.size(); ++i) {
+                utf8add(s, cells[i].cp);
             }
+            return s;
+        }
+
+        size_t length() const
+        {
+            return cells.size();
         }
     };
 
     TerminalEngine()
     {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+
         // the default size will be overwritten by the GUI window when the size is known
         width = 40;
         height = 10;
 
-        clear();
+        firstLine = 0;
+        lineCount = 0;
         updateCounter = 0;
+        layoutCounter = 0;
+        clear();
         state = kStateGround;
         utf8state = utf8codepoint = 0;
+        readerStarted = false;
+    }
+
+    // Must be held while accessing the buffer outside of the reader thread
+    void lock()
+    {
+        pthread_mutex_lock(&mutex);
+    }
+
+    void unlock()
+    {
+        pthread_mutex_unlock(&mutex);
     }
 
     void setSize(int xChars, int yChars, int w, int h)
     {
+        lock();
         width = xChars;
         height = yChars;
         if (pty.started()) {
             pty.resize(width, height, w, h);
         }
+        layoutCounter = ++updateCounter;
+        unlock();
         debug_printf("setSize: %d*%d chars, %d*%d pixels\n",
                      xChars, yChars, w, h);
     }
 
     void initPty()
     {
-        if (!pty.started()) {
-            pty.start();
-            pty.resize(width, height, 0, 0);
+        lock();
+        bool started = pty.started();
+        unlock();
+
+        if (started) {
+            return;
         }
-    }
 
-    void readPty()
-    {
-        char buffer[1024];
-        int rc = pty.read(buffer, sizeof(buffer));
-        debug_printf("readPty: %d bytes\n", rc);
-        if (rc < 0) {
-            output("\r\nChild process exited.\r\n");
-            // TODO: maybe exit terminal here
-        } else {
-            for (int i = 0; i < rc; ++i) {
-                output(buffer[i]);
+        // Reap the reader thread of the previous shell
+        if (readerStarted) {
+            pthread_join(reader, nullptr);
+            readerStarted = false;
+        }
+
+        lock();
+        if (pty.start()) {
+            pty.resize(width, height, 0, 0);
+            if (pthread_create(&reader, nullptr, &readerThreadWrapper,
+                               this) == 0) {
+                readerStarted = true;
+            } else {
+                LOGE("Failed to create pty reader thread");
+                pty.stop();
             }
         }
+        unlock();
     }
 
     void clear()
     {
         cursorX = cursorY = 0;
-        lines.clear();
+        firstLine = 0;
+        lineCount = 0;
         setY(0);
-        unpackLine(0);
-        ++updateCounter;
+        layoutCounter = ++updateCounter;
     }
 
     void output(const char *buf)
@@ -446,42 +474,45 @@ public:
         // encode the char as UTF-8 and send it to the pty
         std::string c;
         utf8add(c, (uint32_t) ch);
+        lock();
         pty.write(c.c_str(), c.size());
+        unlock();
         return true;
     }
 
     bool inputKey(int key)
     {
         debug_printf("inputKey: %d\n", key);
+        const char *seq;
         switch (key) {
-            case KEY_UP: pty.write("\e[A"); break;
-            case KEY_DOWN: pty.write("\e[B"); break;
-            case KEY_RIGHT: pty.write("\e[C"); break;
-            case KEY_LEFT: pty.write("\e[D"); break;
-            case KEY_HOME: pty.write("\eOH"); break;
-            case KEY_END: pty.write("\eOF"); break;
-            case KEY_INSERT: pty.write("\e[2~"); break;
-            case KEY_DELETE: pty.write("\e[3~"); break;
-            case KEY_PAGEUP: pty.write("\e[5~"); break;
-            case KEY_PAGEDOWN: pty.write("\e[6~"); break;
+            case KEY_UP: seq = "\e[A"; break;
+            case KEY_DOWN: seq = "\e[B"; break;
+            case KEY_RIGHT: seq = "\e[C"; break;
+            case KEY_LEFT: seq = "\e[D"; break;
+            case KEY_HOME: seq = "\eOH"; break;
+            case KEY_END: seq = "\eOF"; break;
+            case KEY_INSERT: seq = "\e[2~"; break;
+            case KEY_DELETE: seq = "\e[3~"; break;
+            case KEY_PAGEUP: seq = "\e[5~"; break;
+            case KEY_PAGEDOWN: seq = "\e[6~"; break;
             // TODO: other keys
             default:
                 return false;
         }
+        lock();
+        pty.write(seq, strlen(seq));
+        unlock();
         return true;
     }
 
     size_t getLinesCount() const
     {
-        return lines.size();
+        return lineCount;
     }
 
-    const Line& getLine(size_t n)
+    Line& getLine(size_t n)
     {
-        if (unpackedY == n) {
-            packLine();
-        }
-        return lines[n];
+        return lines[(firstLine + n) % lines.size()];
     }
 
     int getCursorX() const
@@ -494,27 +525,42 @@ public:
         return cursorY;
     }
 
+    // Changes whenever the terminal could require a redraw
     int getUpdateCounter() const
     {
         return updateCounter;
     }
 
+    // Update counter value of the last change that moved lines around or
+    // affected the whole screen
+    int getLayoutCounter() const
+    {
+        return layoutCounter;
+    }
+
     void setX(int x)
     {
         x = std::min(width, std::max(x, 0));
         cursorX = x;
-        ++updateCounter;
+        touchLine(cursorY);
     }
 
     void setY(int y)
     {
         //y = min(height, max(y, 0));
         y = std::max(y, 0);
-        cursorY = y;
-        while (lines.size() <= (size_t) y) {
-            lines.push_back(Line());
+        if ((size_t) cursorY < lineCount) {
+            // the cursor is no longer shown on the old line
+            touchLine(cursorY);
+        }
+        while (lineCount <= (size_t) y) {
+            if (appendLine()) {
+                // the oldest line was dropped from the scrollback
+                --y;
+            }
         }
-        ++updateCounter;
+        cursorY = y;
+        touchLine(cursorY);
     }
 
     void up(int n = 1)
@@ -538,39 +584,81 @@ public:
     }
 
 private:
-    void packLine()
+    void touchLine(size_t y)
     {
-        std::string& s = lines[unpackedY].text;
-        s.clear();
-        for (size_t i = 0; i < unpackedLine.cells.size(); ++i) {
-            Cell& c = unpackedLine.cells[i];
-            utf8add(s, c.cp);
-            // later: if attributes changed, add attributes
-        }
+        Line& line = getLine(y);
+        line.generation = ++updateCounter;
+        line.textValid = false;
     }
 
-    void unpackLine(size_t y)
+    // Add an empty line at the bottom. Returns true if the buffer was full
+    // and the oldest line had to be dropped to make room for it.
+    bool appendLine()
     {
-        uint32_t u8state = 0, u8cp = 0;
-        std::string& s = lines[y].text;
-        unpackedLine.cells.clear();
-        for (size_t i = 0; i < s.size(); ++i) {
-            uint32_t rc = utf8decode(&u8state, &u8cp, (unsigned char) s[i]);
-            if (rc == UTF8_ACCEPT) {
-                unpackedLine.cells.push_back(Cell(u8cp));
+        if (lineCount < lines.size()) {
+            // reuse a slot left over from lines that were erased
+            ++lineCount;
+            getLine(lineCount - 1).reset();
+            touchLine(lineCount - 1);
+            return false;
+        } else if (lines.size() < MAX_SCROLLBACK_LINES) {
+            // the ring is only rotated once it is full, so firstLine is 0
+            lines.push_back(Line());
+            ++lineCount;
+            touchLine(lineCount - 1);
+            return false;
+        } else {
+            firstLine = (firstLine + 1) % lines.size();
+            if (cursorY > 0) {
+                --cursorY;
             }
+            getLine(lineCount - 1).reset();
+            touchLine(lineCount - 1);
+            layoutCounter = updateCounter;
+            return true;
         }
-        if (unpackedLine.cells.size() < (size_t) width) {
-            unpackedLine.cells.resize(width);
+    }
+
+    // Remove the lines after line y
+    void truncateAfter(size_t y)
+    {
+        if (lineCount > y + 1) {
+            lineCount = y + 1;
+            layoutCounter = ++updateCounter;
         }
-        unpackedY = y;
     }
 
-    void ensureUnpacked(size_t y)
+    static void * readerThreadWrapper(void *userdata)
+    {
+        static_cast<TerminalEngine *>(userdata)->readerThread();
+        return nullptr;
+    }
+
+    void readerThread()
     {
-        if (unpackedY != y) {
-            packLine();
-            unpackLine(y);
+        char buffer[4096];
+
+        for (;;) {
+            int rc = pty.read(buffer, sizeof(buffer));
+            debug_printf("readPty: %d bytes\n", rc);
+
+            lock();
+            if (rc <= 0) {
+                output("\r\nChild process exited.\r\n");
+                // TODO: maybe exit terminal here
+                pty.stop();
+                unlock();
+                break;
+            }
+            // parse the whole chunk at once so the GUI only sees complete
+            // updates
+            for (int i = 0; i < rc; ++i) {
+                output(buffer[i]);
+            }
+            unlock();
+
+            // wake up the GUI thread if it is idle
+            ev_wake();
         }
     }
 
@@ -612,7 +700,6 @@ private:
 
     void processCodePoint(CodePoint cp)
     {
-        ++updateCounter;
         debug_printf("codepoint: %u\n", cp);
         if (cp == 0x9b) { // CSI
             state = kStateCsi;
@@ -634,12 +721,12 @@ private:
 
     void processChar(CodePoint cp)
     {
-        ensureUnpacked(cursorY);
-        // extend unpackedLine if needed, write ch into cell
-        if (unpackedLine.cells.size() <= (size_t) cursorX) {
-            unpackedLine.cells.resize(cursorX + 1);
+        Line& line = getLine(cursorY);
+        // extend the line if needed, write ch into cell
+        if (line.cells.size() <= (size_t) cursorX) {
+            line.cells.resize(cursorX + 1);
         }
-        unpackedLine.cells[cursorX].cp = cp;
+        line.cells[cursorX].cp = cp;
 
         right();
         if (cursorX >= width) {
@@ -648,7 +735,6 @@ private:
             down();
             setX(0);
         }
-        // TODO: update all GUI objects that display this terminal engine
     }
 
     void processEsc(CodePoint cp)
@@ -746,20 +832,21 @@ private:
             break;
         case 'J': { // ED - erase in page
             int param = parseArg(ctlseq, 0);
-            ensureUnpacked(cursorY);
+            Line& line = getLine(cursorY);
             switch (param) {
             default:
             case 0:
-                unpackedLine.eraseFrom(cursorX);
-                if (lines.size() > (size_t) cursorY + 1) {
-                    lines.erase(lines.begin() + cursorY + 1, lines.end());
-                }
+                line.eraseFrom(cursorX);
+                touchLine(cursorY);
+                truncateAfter(cursorY);
                 break;
             case 1:
-                unpackedLine.eraseTo(cursorX);
-                if (cursorY > 0) {
-                    lines.erase(lines.begin(), lines.begin() + cursorY - 1);
-                    cursorY = 0;
+                line.eraseTo(cursorX);
+                for (int y = 0; y <= cursorY; ++y) {
+                    if (y < cursorY) {
+                        getLine(y).reset();
+                    }
+                    touchLine(y);
                 }
                 break;
             case 2: // clear
@@ -771,19 +858,20 @@ private:
         }
         case 'K': { // EL - erase in line
             int param = parseArg(ctlseq, 0);
-            ensureUnpacked(cursorY);
+            Line& line = getLine(cursorY);
             switch (param) {
             default:
             case 0:
-                unpackedLine.eraseFrom(cursorX);
+                line.eraseFrom(cursorX);
                 break;
             case 1:
-                unpackedLine.eraseTo(cursorX);
+                line.eraseTo(cursorX);
                 break;
             case 2:
-                unpackedLine.cells.clear();
+                line.cells.clear();
                 break;
             }
+            touchLine(cursorY);
             break;
         }
         // case 'L': // IL - insert line
@@ -795,14 +883,18 @@ private:
     }
 
 private:
-    int cursorX, cursorY; // 0-based, char based. TODO: decide how to handle scrollback
+    pthread_mutex_t mutex; // protects everything below except reader
+    int cursorX, cursorY; // 0-based, char based, relative to the oldest line
     int width, height; // window size in chars
-    std::vector<Line> lines; // the text buffer
-    UnpackedLine unpackedLine; // current line for editing
-    size_t unpackedY; // number of current line
+    std::vector<Line> lines; // the text buffer (ring of up to MAX_SCROLLBACK_LINES)
+    size_t firstLine; // index of the oldest line in lines
+    size_t lineCount; // number of lines in use
     int updateCounter; // changes whenever terminal could require redraw
+    int layoutCounter; // value of updateCounter when lines last moved
 
     Pseudoterminal pty;
+    pthread_t reader;
+    bool readerStarted; // only accessed from the GUI thread
     enum { kStateGround, kStateEsc, kStateCsi } state;
 
     // for accumulating a full UTF-8 character from individual bytes
@@ -816,11 +908,6 @@ private:
 // The one and only terminal engine for now
 TerminalEngine gEngine;
 
-void terminal_pty_read()
-{
-    gEngine.readPty();
-}
-
 
 GUITerminal::GUITerminal(xml_node<>* node) : GUIScrollList(node)
 {
@@ -836,10 +923,18 @@ GUITerminal::GUITerminal(xml_node<>* node) : GUIScrollList(node)
 
     engine = &gEngine;
     updateCounter = 0;
+    lastLinesCount = 0;
+    lastRedraw.tv_sec = 0;
+    lastRedraw.tv_nsec = 0;
+    hasUpdateRect = false;
+    updateY = 0;
+    updateH = 0;
 }
 
 int GUITerminal::Update()
 {
+    hasUpdateRect = false;
+
     if (!isConditionTrue()) {
         lastCondition = false;
         return 0;
@@ -851,23 +946,108 @@ int GUITerminal::Update()
         InitAndResize();
     }
 
-    if (updateCounter != engine->getUpdateCounter()) {
+    engine->lock();
+
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    // Coalesce bursts of output into at most one redraw per interval
+    if (updateCounter != engine->getUpdateCounter()
+            && mb::util::timespec_diff_ms(lastRedraw, now)
+                    >= REDRAW_INTERVAL_MS) {
+        int oldFirst = firstDisplayedItem;
+        int oldOffset = y_offset;
+        int oldUpdate = mUpdate;
+        size_t count = engine->getLinesCount();
+
         // try to keep the cursor in view
         SetVisibleListLocation(engine->getCursorY());
+
+        // Only repaint the changed lines if nothing moved
+        if (!oldUpdate
+                && engine->getLayoutCounter() <= updateCounter
+                && firstDisplayedItem == oldFirst && y_offset == oldOffset
+                && (count == lastLinesCount
+                        || count <= (size_t) GetDisplayItemCount())) {
+            FindChangedLines();
+            mUpdate = hasUpdateRect;
+        }
+
         updateCounter = engine->getUpdateCounter();
+        lastLinesCount = count;
+        lastRedraw = now;
     }
 
+    engine->unlock();
+
+    int oldFirst = firstDisplayedItem;
+    int oldOffset = y_offset;
+
     GUIScrollList::Update();
 
+    if (firstDisplayedItem != oldFirst || y_offset != oldOffset) {
+        // kinetic scrolling moved everything
+        hasUpdateRect = false;
+    }
+
     if (mUpdate) {
         mUpdate = 0;
-        if (Render() == 0) {
-            return 2;
-        }
+        return 2;
     }
+    hasUpdateRect = false;
     return 0;
 }
 
+int GUITerminal::GetUpdateRect(int& x, int& y, int& w, int& h)
+{
+    if (!hasUpdateRect) {
+        return -1;
+    }
+
+    x = mRenderX;
+    y = updateY;
+    w = mRenderW;
+    h = updateH;
+    return 0;
+}
+
+int GUITerminal::Render()
+{
+    engine->lock();
+    int ret = GUIScrollList::Render();
+    engine->unlock();
+    return ret;
+}
+
+void GUITerminal::FindChangedLines()
+{
+    size_t first = firstDisplayedItem;
+    // include the partially visible rows
+    size_t end = std::min(first + GetDisplayItemCount() + 2,
+                          engine->getLinesCount());
+    int minY = mRenderY + mRenderH;
+    int maxY = mRenderY + mHeaderH;
+
+    for (size_t i = first; i < end; ++i) {
+        if (engine->getLine(i).generation <= updateCounter) {
+            continue;
+        }
+
+        int yPos = mRenderY + mHeaderH + y_offset
+                + (int) (i - first) * actualItemHeight;
+        minY = std::min(minY, yPos);
+        maxY = std::max(maxY, yPos + actualItemHeight);
+    }
+
+    // Lines past the end of the buffer are blank and never change here
+    minY = std::max(minY, mRenderY + mHeaderH);
+    maxY = std::min(maxY, mRenderY + mRenderH);
+
+    hasUpdateRect = maxY > minY;
+    updateY = minY;
+    updateH = maxY - minY;
+}
+
 // NotifyTouch - Notify of a touch event
 //  Return 0 on success, >0 to ignore remainder of touch, and <0 on error
 int GUITerminal::NotifyTouch(TOUCH_STATE state, int x, int y)
@@ -915,19 +1095,30 @@ size_t GUITerminal::GetItemCount()
 
 void GUITerminal::RenderItem(size_t itemindex, int yPos, bool selected __unused)
 {
-    const TerminalEngine::Line& line = engine->getLine(itemindex);
+    // Skip lines outside of the area that is being repainted
+    int bx, by, bw, bh;
+    if (gr_get_render_bounds(&bx, &by, &bw, &bh)
+            && (yPos >= by + bh || yPos + actualItemHeight <= by)) {
+        return;
+    }
+
+    TerminalEngine::Line& line = engine->getLine(itemindex);
 
     gr_color(mFontColor.red, mFontColor.green, mFontColor.blue, mFontColor.alpha);
     // later: handle attributes here
 
     // render text
-    const char* text = line.text.c_str();
+    const char* text = line.getText().c_str();
     gr_textEx_scaleW(mRenderX, yPos, text, mFont->GetResource(), mRenderW, TOP_LEFT, 0);
 
     if (itemindex == (size_t) engine->getCursorY()) {
         // render cursor
         int cursorX = engine->getCursorX();
         std::string leftOfCursor = line.substr(0, cursorX);
+        if ((size_t) cursorX > line.length()) {
+            // the cursor is past the end of the line
+            leftOfCursor.append(cursorX - line.length(), ' ');
+        }
         int x = gr_ttf_measureEx(leftOfCursor.c_str(), mFont->GetResource());
         // note that this single character can be a UTF-8 sequence
         std::string atCursor = (size_t) cursorX < line.length() ? line.substr(cursorX, 1) : " ";
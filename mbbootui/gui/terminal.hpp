@@ -18,6 +18,8 @@
 
 #pragma once
 
+#include <ctime>
+
 #include "gui/scrolllist.hpp"
 
 class TerminalEngine;
@@ -31,6 +33,13 @@ public:
     //  Return 0 if nothing to update, 1 on success and contiue, >1 if full render required, and <0 on error
     virtual int Update();
 
+    // Render - Render the full object to the GL surface
+    //  Return 0 on success, <0 on error
+    virtual int Render();
+
+    // GetUpdateRect - Returns the changed lines after a call to Update()
+    virtual int GetUpdateRect(int& x, int& y, int& w, int& h);
+
     // NotifyTouch - Notify of a touch event
     //  Return 0 on success, >0 to ignore remainder of touch, and <0 on error (Return error to allow other handlers)
     virtual int NotifyTouch(TOUCH_STATE state, int x, int y);
@@ -52,8 +61,14 @@ public:
 
 protected:
     void InitAndResize();
+    void FindChangedLines();
 
     TerminalEngine* engine; // non-visual parts of the terminal (text buffer etc.), not owned
     int updateCounter; // to track if anything changed in the back-end
+    size_t lastLinesCount; // number of lines when the terminal was last updated
+    timespec lastRedraw; // to limit how often the terminal is redrawn
+    bool hasUpdateRect; // if only the rows in updateY..updateY+updateH changed
+    int updateY;
+    int updateH;
     bool lastCondition; // to track if the condition became true and we might need to resize the terminal engine
 };
@@ -20,12 +20,16 @@
 
 #include "gui/text.hpp"
 
+#include "data.hpp"
+
 GUIText::GUIText(xml_node<>* node) : GUIObject(node)
 {
     mFont = nullptr;
     mIsStatic = 1;
     mVarChanged = 0;
     mFontHeight = 0;
+    mTextChanged = false;
+    mDynamic = true;
     maxWidth = 0;
     scaleWidth = true;
     isHighlighted = false;
@@ -75,6 +79,7 @@ GUIText::GUIText(xml_node<>* node) : GUIObject(node)
     }
 
     // Simple way to check for static state
+    ResolveVariables();
     mLastValue = gui_parse_text(mText);
     if (mLastValue != mText) {
         mIsStatic = 0;
@@ -96,7 +101,9 @@ int GUIText::Render()
         return -1;
     }
 
-    mLastValue = gui_parse_text(mText);
+    if (NeedsUpdate()) {
+        mLastValue = gui_parse_text(mText);
+    }
 
     mVarChanged = 0;
 
@@ -134,7 +141,7 @@ int GUIText::Update()
         updateCounter = 3;
     }
 
-    if (mIsStatic || !mVarChanged) {
+    if (mIsStatic || !NeedsUpdate()) {
         return 0;
     }
 
@@ -156,11 +163,62 @@ int GUIText::GetCurrentBounds(int& w, int& h)
     }
 
     h = mFontHeight;
-    mLastValue = gui_parse_text(mText);
+    if (NeedsUpdate()) {
+        mLastValue = gui_parse_text(mText);
+    }
     w = gr_ttf_measureEx(mLastValue.c_str(), fontResource);
     return 0;
 }
 
+int GUIText::GetDirtyRect(int& x, int& y, int& w, int& h)
+{
+    if (!mFont) {
+        return -1;
+    }
+
+    void* fontResource = mFont->GetResource();
+
+    x = mRenderX;
+    y = mRenderY;
+    w = 0;
+    h = 0;
+
+    if (mLastValue.empty()) {
+        return 0;
+    }
+
+    // Mirror the placement logic in gr_textEx_scaleW()
+    int measuredWidth = gr_ttf_measureEx(mLastValue.c_str(), fontResource);
+    int adjWidth = measuredWidth;
+    if (measuredWidth > (int) maxWidth) {
+        adjWidth = maxWidth;
+        if (scaleWidth) {
+            measuredWidth = maxWidth;
+        }
+    }
+
+    if (mPlacement != TOP_LEFT && mPlacement != BOTTOM_LEFT
+            && mPlacement != TEXT_ONLY_RIGHT) {
+        if (mPlacement == CENTER || mPlacement == CENTER_X_ONLY) {
+            x -= adjWidth / 2;
+        } else {
+            x -= adjWidth;
+        }
+    }
+
+    if (mPlacement != TOP_LEFT && mPlacement != TOP_RIGHT) {
+        if (mPlacement == CENTER || mPlacement == TEXT_ONLY_RIGHT) {
+            y -= mFontHeight / 2;
+        } else if (mPlacement == BOTTOM_LEFT || mPlacement == BOTTOM_RIGHT) {
+            y -= mFontHeight;
+        }
+    }
+
+    w = measuredWidth;
+    h = mFontHeight;
+    return 0;
+}
+
 int GUIText::NotifyVarChange(const std::string& varName, const std::string& value)
 {
     GUIObject::NotifyVarChange(varName, value);
@@ -182,4 +240,37 @@ int GUIText::SetMaxWidth(unsigned width)
 void GUIText::SetText(std::string newtext)
 {
     mText = std::move(newtext);
+    ResolveVariables();
+}
+
+void GUIText::ResolveVariables()
+{
+    mVarHandles.clear();
+    mDynamic = !gui_get_text_variables(mText, &mVarHandles);
+    mVarVersions.resize(mVarHandles.size());
+    for (size_t i = 0; i < mVarHandles.size(); ++i) {
+        mVarVersions[i] = DataManager::GetVersion(mVarHandles[i]);
+    }
+    mTextChanged = true;
+}
+
+bool GUIText::NeedsUpdate()
+{
+    if (mDynamic) {
+        bool changed = mVarChanged || mTextChanged;
+        mTextChanged = false;
+        return changed;
+    }
+
+    // Only parse the text again if one of its variables was set
+    bool changed = mTextChanged;
+    for (size_t i = 0; i < mVarHandles.size(); ++i) {
+        unsigned int version = DataManager::GetVersion(mVarHandles[i]);
+        if (version != mVarVersions[i]) {
+            mVarVersions[i] = version;
+            changed = true;
+        }
+    }
+    mTextChanged = false;
+    return changed;
 }
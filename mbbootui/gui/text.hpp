@@ -40,6 +40,9 @@ public:
     // Retrieve the size of the current string (dynamic strings may change per call)
     virtual int GetCurrentBounds(int& w, int& h);
 
+    // Returns the area covered by the last rendered string
+    virtual int GetDirtyRect(int& x, int& y, int& w, int& h);
+
     // Notify of a variable change
     virtual int NotifyVarChange(const std::string& varName, const std::string& value);
 
@@ -48,6 +51,12 @@ public:
 
     void SetText(std::string newtext);
 
+protected:
+    // Look up the variables used by mText
+    void ResolveVariables();
+    // Returns true if the text needs to be parsed again
+    bool NeedsUpdate();
+
 public:
     bool isHighlighted;
     bool scaleWidth;
@@ -62,4 +71,8 @@ protected:
     int mIsStatic;
     int mVarChanged;
     int mFontHeight;
+    bool mTextChanged;
+    bool mDynamic; // the value can change without a tracked variable changing
+    std::vector<int> mVarHandles;
+    std::vector<unsigned int> mVarVersions;
 };
@@ -13,9 +13,11 @@
  * along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cerrno>
 #include <cinttypes>
 #include <cstring>
 
+#include <dirent.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <signal.h>
@@ -31,9 +33,11 @@
 #include "mbpatcher/patcherconfig.h"
 #include "mbutil/autoclose/archive.h"
 #include "mbutil/copy.h"
+#include "mbutil/delete.h"
 #include "mbutil/directory.h"
 #include "mbutil/file.h"
 #include "mbutil/finally.h"
+#include "mbutil/hash.h"
 #include "mbutil/integer.h"
 #include "mbutil/properties.h"
 #include "mbutil/string.h"
@@ -61,6 +65,7 @@
 #define MBBOOTUI_LOG_PATH           MBBOOTUI_BASE_PATH "/exec.log"
 #define MBBOOTUI_SCREENSHOTS_PATH   MBBOOTUI_BASE_PATH "/screenshots";
 #define MBBOOTUI_SETTINGS_PATH      MBBOOTUI_BASE_PATH "/settings.bin"
+#define MBBOOTUI_IMAGE_CACHE_PATH   MBBOOTUI_BASE_PATH "/image_cache"
 
 #define MBBOOTUI_RUNTIME_PATH       "/mbbootui"
 #define MBBOOTUI_THEME_PATH         MBBOOTUI_RUNTIME_PATH "/theme"
@@ -221,6 +226,57 @@ static bool extract_theme(const std::string &path, const std::string &target,
     return true;
 }
 
+static bool setup_image_cache(const std::string &path,
+                              const std::string &theme_name)
+{
+    // The cache directory is specific to the theme contents so that scaled
+    // images from a previous version of the theme are never used
+    unsigned char digest[SHA512_DIGEST_LENGTH];
+    if (!mb::util::sha512_hash(path, digest)) {
+        LOGW("%s: Failed to compute theme hash", path.c_str());
+        return false;
+    }
+
+    std::string id = mb::util::hex_string(digest, 16);
+    id += '-';
+    id += theme_name;
+
+    // Remove caches for other themes
+    DIR *dp = opendir(MBBOOTUI_IMAGE_CACHE_PATH);
+    if (dp) {
+        auto close_dp = mb::util::finally([&]{
+            closedir(dp);
+        });
+
+        struct dirent *ent;
+        while ((ent = readdir(dp))) {
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0
+                    || id == ent->d_name) {
+                continue;
+            }
+
+            std::string stale(MBBOOTUI_IMAGE_CACHE_PATH);
+            stale += '/';
+            stale += ent->d_name;
+            mb::util::delete_recursive(stale);
+        }
+    }
+
+    static std::string cache_path;
+    cache_path = MBBOOTUI_IMAGE_CACHE_PATH;
+    cache_path += '/';
+    cache_path += id;
+
+    if (!mb::util::mkdir_recursive(cache_path, 0700)) {
+        LOGW("%s: Failed to create directory: %s",
+             cache_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    tw_image_cache_path = cache_path.c_str();
+    return true;
+}
+
 static void wait_forever()
 {
     while (true) {
@@ -509,6 +565,10 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    if (!setup_image_cache(argv[optind], mb_device_tw_theme(tw_device))) {
+        LOGW("Scaled theme images will not be cached");
+    }
+
     // Connect to daemon
     if (!mbtool_connection.connect()) {
         LOGE("Failed to connect to mbtool");
@@ -516,6 +576,9 @@ int main(int argc, char *argv[])
     }
     mbtool_interface = mbtool_connection.interface();
 
+    // Fetch everything the first pages need while the GUI is loading
+    mbtool_interface->prefetch();
+
     LOGV("Loading default values...");
     DataManager::SetDefaultValues();
 
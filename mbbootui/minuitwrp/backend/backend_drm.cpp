@@ -15,7 +15,9 @@
  */
 
 #include <drm_fourcc.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,6 +30,8 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include <algorithm>
+
 #include "backend/backend.h"
 #include "backend/backend.gen.h"
 #include "config/config.hpp"
@@ -44,8 +48,51 @@ struct drm_surface
     uint32_t handle;
 };
 
-static drm_surface *drm_surfaces[2];
-static int current_buffer;
+// Triple buffering: one buffer is scanned out, one may be waiting for a
+// pending flip, and at least one is always free for the next frame
+#define DRM_NUM_BUFFERS 3
+
+// Give up on a flip event after this long so a broken driver can't hang the UI
+#define DRM_FLIP_TIMEOUT_MS 1000
+
+static drm_surface *drm_surfaces[DRM_NUM_BUFFERS];
+// Buffer being scanned out
+static int displayed_buffer;
+// Buffer submitted for the next vblank or -1 if no flip is pending
+static int pending_buffer = -1;
+
+// Drawing into the dumb buffers directly is slow and their contents are
+// several frames old when they are reused, so draw into memory and copy
+// changes over
+static GRSurface *shadow_surface;
+
+// Rows that changed since each buffer was last updated
+static int buffer_dirty_y1[DRM_NUM_BUFFERS];
+static int buffer_dirty_y2[DRM_NUM_BUFFERS];
+
+// Atomic modesetting state. If the driver doesn't support atomic commits,
+// primary_plane_id is 0 and the legacy page flip ioctl is used.
+static uint32_t primary_plane_id;
+static uint32_t plane_fb_id_prop;
+// 0 if the plane doesn't support damage clips
+static uint32_t plane_damage_clips_prop;
+
+// Same layout as struct drm_mode_rect, which the kernel headers used for
+// building don't have yet
+struct drm_damage_rect
+{
+    int32_t x1;
+    int32_t y1;
+    int32_t x2;
+    int32_t y2;
+};
+
+#ifndef DRM_MODE_ATOMIC_NONBLOCK
+#define DRM_MODE_ATOMIC_NONBLOCK 0x0200
+#endif
+#ifndef DRM_PLANE_TYPE_PRIMARY
+#define DRM_PLANE_TYPE_PRIMARY 1
+#endif
 
 static drmModeCrtc *main_monitor_crtc;
 static drmModeConnector *main_monitor_connector;
@@ -81,13 +128,147 @@ static void drm_enable_crtc(int drm_fd, drmModeCrtc *crtc,
     }
 }
 
+static void drm_page_flip_handler(int fd __unused,
+                                  unsigned int sequence __unused,
+                                  unsigned int tv_sec __unused,
+                                  unsigned int tv_usec __unused,
+                                  void *user_data __unused)
+{
+    displayed_buffer = pending_buffer;
+    pending_buffer = -1;
+}
+
+// Wait for the pending flip, if any, to complete
+static void drm_wait_for_flip()
+{
+    drmEventContext evctx;
+    memset(&evctx, 0, sizeof(evctx));
+    evctx.version = 2;
+    evctx.page_flip_handler = drm_page_flip_handler;
+
+    while (pending_buffer >= 0) {
+        struct pollfd pfd;
+        pfd.fd = drm_fd;
+        pfd.events = POLLIN;
+
+        int ret = poll(&pfd, 1, DRM_FLIP_TIMEOUT_MS);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            printf("Timed out waiting for page flip event\n");
+            drm_page_flip_handler(drm_fd, 0, 0, 0, nullptr);
+            break;
+        }
+
+        drmHandleEvent(drm_fd, &evctx);
+    }
+}
+
 static void drm_blank(minui_backend* backend __unused, bool blank)
 {
+    drm_wait_for_flip();
+
     if (blank) {
         drm_disable_crtc(drm_fd, main_monitor_crtc);
     } else {
         drm_enable_crtc(drm_fd, main_monitor_crtc,
-                        drm_surfaces[current_buffer]);
+                        drm_surfaces[displayed_buffer]);
+    }
+}
+
+static uint32_t drm_find_property(uint32_t object_id, uint32_t object_type,
+                                  const char *name, uint64_t *value)
+{
+    drmModeObjectProperties *props;
+    uint32_t prop_id = 0;
+
+    props = drmModeObjectGetProperties(drm_fd, object_id, object_type);
+    if (!props) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < props->count_props && !prop_id; i++) {
+        drmModePropertyRes *prop = drmModeGetProperty(drm_fd, props->props[i]);
+        if (!prop) {
+            continue;
+        }
+
+        if (strcmp(prop->name, name) == 0) {
+            prop_id = prop->prop_id;
+            if (value) {
+                *value = props->prop_values[i];
+            }
+        }
+
+        drmModeFreeProperty(prop);
+    }
+
+    drmModeFreeObjectProperties(props);
+    return prop_id;
+}
+
+// Set up atomic commits on the primary plane of the CRTC if supported
+static void drm_init_atomic(drmModeRes *res, drmModeCrtc *crtc)
+{
+    drmModePlaneRes *plane_res;
+    int crtc_index = -1;
+
+    primary_plane_id = 0;
+    plane_fb_id_prop = 0;
+    plane_damage_clips_prop = 0;
+
+    if (drmSetClientCap(drm_fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1)
+            || drmSetClientCap(drm_fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+        printf("DRM atomic modesetting not supported\n");
+        return;
+    }
+
+    for (int i = 0; i < res->count_crtcs; i++) {
+        if (res->crtcs[i] == crtc->crtc_id) {
+            crtc_index = i;
+            break;
+        }
+    }
+
+    plane_res = drmModeGetPlaneResources(drm_fd);
+    if (crtc_index < 0 || !plane_res) {
+        drmModeFreePlaneResources(plane_res);
+        return;
+    }
+
+    for (uint32_t i = 0; i < plane_res->count_planes && !primary_plane_id; i++) {
+        drmModePlane *plane = drmModeGetPlane(drm_fd, plane_res->planes[i]);
+        uint64_t type;
+
+        if (!plane) {
+            continue;
+        }
+
+        if ((plane->possible_crtcs & (1u << crtc_index))
+                && drm_find_property(plane->plane_id, DRM_MODE_OBJECT_PLANE,
+                                     "type", &type)
+                && type == DRM_PLANE_TYPE_PRIMARY) {
+            plane_fb_id_prop = drm_find_property(
+                    plane->plane_id, DRM_MODE_OBJECT_PLANE, "FB_ID", nullptr);
+            if (plane_fb_id_prop) {
+                primary_plane_id = plane->plane_id;
+                plane_damage_clips_prop = drm_find_property(
+                        plane->plane_id, DRM_MODE_OBJECT_PLANE,
+                        "FB_DAMAGE_CLIPS", nullptr);
+            }
+        }
+
+        drmModeFreePlane(plane);
+    }
+
+    drmModeFreePlaneResources(plane_res);
+
+    if (primary_plane_id) {
+        printf("Using DRM atomic commits on plane %u (damage clips: %s)\n",
+               primary_plane_id, plane_damage_clips_prop ? "yes" : "no");
+    } else {
+        // Legacy page flips don't need the atomic client cap
+        drmSetClientCap(drm_fd, DRM_CLIENT_CAP_ATOMIC, 0);
     }
 }
 
@@ -471,44 +652,189 @@ static GRSurface* drm_init(minui_backend* backend __unused)
     width = main_monitor_crtc->mode.hdisplay;
     height = main_monitor_crtc->mode.vdisplay;
 
+    drm_init_atomic(res, main_monitor_crtc);
+
     drmModeFreeResources(res);
 
-    drm_surfaces[0] = drm_create_surface(width, height);
-    drm_surfaces[1] = drm_create_surface(width, height);
-    if (!drm_surfaces[0] || !drm_surfaces[1]) {
-        drm_destroy_surface(drm_surfaces[0]);
-        drm_destroy_surface(drm_surfaces[1]);
-        drmModeFreeResources(res);
+    for (i = 0; i < DRM_NUM_BUFFERS; i++) {
+        drm_surfaces[i] = drm_create_surface(width, height);
+        if (!drm_surfaces[i]) {
+            for (int j = 0; j < i; j++) {
+                drm_destroy_surface(drm_surfaces[j]);
+                drm_surfaces[j] = nullptr;
+            }
+            close(drm_fd);
+            return nullptr;
+        }
+    }
+
+    shadow_surface = (GRSurface*) malloc(sizeof(GRSurface));
+    if (shadow_surface) {
+        memcpy(shadow_surface, &drm_surfaces[0]->base, sizeof(GRSurface));
+        shadow_surface->data = (unsigned char*) calloc(
+                shadow_surface->height * shadow_surface->row_bytes, 1);
+    }
+    if (!shadow_surface || !shadow_surface->data) {
+        printf("failed to allocate in-memory surface\n");
+        free(shadow_surface);
+        shadow_surface = nullptr;
+        for (i = 0; i < DRM_NUM_BUFFERS; i++) {
+            drm_destroy_surface(drm_surfaces[i]);
+            drm_surfaces[i] = nullptr;
+        }
         close(drm_fd);
         return nullptr;
     }
 
-    current_buffer = 0;
+    for (i = 0; i < DRM_NUM_BUFFERS; i++) {
+        buffer_dirty_y1[i] = 0;
+        buffer_dirty_y2[i] = shadow_surface->height;
+    }
 
-    drm_enable_crtc(drm_fd, main_monitor_crtc, drm_surfaces[1]);
+    displayed_buffer = 0;
+    pending_buffer = -1;
 
-    return &(drm_surfaces[0]->base);
+    drm_enable_crtc(drm_fd, main_monitor_crtc, drm_surfaces[0]);
+
+    return shadow_surface;
 }
 
-static GRSurface* drm_flip(minui_backend* backend __unused)
+// Submit a flip to buffer without waiting for vblank. damage may be null.
+static bool drm_submit_flip(int buffer, const drm_damage_rect *damage)
 {
+    uint32_t fb_id = drm_surfaces[buffer]->fb_id;
     int ret;
 
-    ret = drmModePageFlip(drm_fd, main_monitor_crtc->crtc_id,
-                          drm_surfaces[current_buffer]->fb_id, 0, nullptr);
+    if (primary_plane_id) {
+        drmModeAtomicReq *req = drmModeAtomicAlloc();
+        uint32_t blob_id = 0;
+
+        if (!req) {
+            return false;
+        }
+
+        drmModeAtomicAddProperty(req, primary_plane_id, plane_fb_id_prop,
+                                 fb_id);
+
+        if (damage && plane_damage_clips_prop
+                && drmModeCreatePropertyBlob(drm_fd, damage, sizeof(*damage),
+                                             &blob_id) == 0) {
+            drmModeAtomicAddProperty(req, primary_plane_id,
+                                     plane_damage_clips_prop, blob_id);
+        }
+
+        ret = drmModeAtomicCommit(drm_fd, req,
+                                  DRM_MODE_ATOMIC_NONBLOCK
+                                  | DRM_MODE_PAGE_FLIP_EVENT, nullptr);
+
+        drmModeAtomicFree(req);
+        if (blob_id) {
+            // The commit holds its own reference
+            drmModeDestroyPropertyBlob(drm_fd, blob_id);
+        }
+
+        if (ret < 0) {
+            printf("drmModeAtomicCommit failed ret=%d\n", ret);
+        }
+    } else {
+        ret = drmModePageFlip(drm_fd, main_monitor_crtc->crtc_id, fb_id,
+                              DRM_MODE_PAGE_FLIP_EVENT, nullptr);
+        if (ret < 0) {
+            printf("drmModePageFlip failed ret=%d\n", ret);
+        }
+    }
+
     if (ret < 0) {
-        printf("drmModePageFlip failed ret=%d\n", ret);
-        return nullptr;
+        return false;
+    }
+
+    pending_buffer = buffer;
+    return true;
+}
+
+// Copy the changed rows into a free buffer and flip to it. The caller can start
+// drawing the next frame into the shadow surface while the flip is pending.
+static void drm_present(int y1, int y2, const drm_damage_rect *damage)
+{
+    int buffer = -1;
+
+    for (int i = 0; i < DRM_NUM_BUFFERS; i++) {
+        if (y1 < y2) {
+            if (buffer_dirty_y1[i] < buffer_dirty_y2[i]) {
+                buffer_dirty_y1[i] = std::min(buffer_dirty_y1[i], y1);
+                buffer_dirty_y2[i] = std::max(buffer_dirty_y2[i], y2);
+            } else {
+                buffer_dirty_y1[i] = y1;
+                buffer_dirty_y2[i] = y2;
+            }
+        }
+
+        if (buffer < 0 && i != displayed_buffer && i != pending_buffer) {
+            buffer = i;
+        }
+    }
+
+    // Whole rows are copied since they are contiguous in both surfaces
+    int copy_y1 = buffer_dirty_y1[buffer];
+    int copy_y2 = buffer_dirty_y2[buffer];
+    if (copy_y1 < copy_y2) {
+        memcpy(drm_surfaces[buffer]->base.data
+                       + copy_y1 * shadow_surface->row_bytes,
+               shadow_surface->data + copy_y1 * shadow_surface->row_bytes,
+               (copy_y2 - copy_y1) * shadow_surface->row_bytes);
+    }
+    buffer_dirty_y1[buffer] = 0;
+    buffer_dirty_y2[buffer] = 0;
+
+    // Only one flip can be queued at a time
+    drm_wait_for_flip();
+
+    if (!drm_submit_flip(buffer, damage)) {
+        // Rewrite this buffer completely next time
+        buffer_dirty_y1[buffer] = 0;
+        buffer_dirty_y2[buffer] = shadow_surface->height;
+    }
+}
+
+static GRSurface* drm_flip(minui_backend* backend __unused)
+{
+    drm_present(0, shadow_surface->height, nullptr);
+    return shadow_surface;
+}
+
+static GRSurface* drm_flip_region(minui_backend* backend __unused,
+                                  int x, int y, int w, int h)
+{
+    if (w <= 0 || h <= 0) {
+        // Nothing changed, so the displayed buffer is still current
+        return shadow_surface;
     }
-    current_buffer = 1 - current_buffer;
-    return &(drm_surfaces[current_buffer]->base);
+
+    // Damage is relative to the buffer that is currently displayed (or about
+    // to be), which contains the previous frame
+    drm_damage_rect damage;
+    damage.x1 = x;
+    damage.y1 = y;
+    damage.x2 = x + w;
+    damage.y2 = y + h;
+
+    drm_present(y, y + h, &damage);
+    return shadow_surface;
 }
 
 static void drm_exit(minui_backend* backend __unused)
 {
+    drm_wait_for_flip();
     drm_disable_crtc(drm_fd, main_monitor_crtc);
-    drm_destroy_surface(drm_surfaces[0]);
-    drm_destroy_surface(drm_surfaces[1]);
+    for (int i = 0; i < DRM_NUM_BUFFERS; i++) {
+        drm_destroy_surface(drm_surfaces[i]);
+        drm_surfaces[i] = nullptr;
+    }
+    if (shadow_surface) {
+        free(shadow_surface->data);
+        free(shadow_surface);
+        shadow_surface = nullptr;
+    }
     drmModeFreeCrtc(main_monitor_crtc);
     drmModeFreeConnector(main_monitor_connector);
     close(drm_fd);
@@ -520,6 +846,7 @@ static minui_backend drm_backend = {
     .flip = drm_flip,
     .blank = drm_blank,
     .exit = drm_exit,
+    .flip_region = drm_flip_region,
 };
 
 extern "C" struct minui_backend * BACKEND_FUNCTION(drm)() {
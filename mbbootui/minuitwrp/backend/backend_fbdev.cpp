@@ -30,6 +30,8 @@
 #include <linux/fb.h>
 #include <linux/kd.h>
 
+#include <algorithm>
+
 #include "backend/backend.h"
 #include "backend/backend.gen.h"
 #include "config/config.hpp"
@@ -39,6 +41,7 @@
 
 static GRSurface* fbdev_init(minui_backend*);
 static GRSurface* fbdev_flip(minui_backend*);
+static GRSurface* fbdev_flip_region(minui_backend*, int, int, int, int);
 static void fbdev_blank(minui_backend*, bool);
 static void fbdev_exit(minui_backend*);
 
@@ -47,6 +50,11 @@ static bool double_buffered;
 static GRSurface* gr_draw = nullptr;
 static int displayed_buffer;
 
+// Rows of the in-memory surface that changed in the previous flip. With double
+// buffering, the back buffer is missing these in addition to the new changes.
+static int prev_dirty_y1;
+static int prev_dirty_y2;
+
 static fb_var_screeninfo vi;
 static int fb_fd = -1;
 static __u32 smem_len;
@@ -56,6 +64,7 @@ static minui_backend my_backend = {
     .flip = fbdev_flip,
     .blank = fbdev_blank,
     .exit = fbdev_exit,
+    .flip_region = fbdev_flip_region,
 };
 
 extern "C" struct minui_backend * BACKEND_FUNCTION(fbdev)()
@@ -255,6 +264,16 @@ static GRSurface* fbdev_init(minui_backend* backend)
     if (tw_pixel_format == TW_PXFMT_BGRA_8888) {
         printf("RECOVERY_BGRA\n");
     }
+
+    // Byte swapping and rotating modify or bypass the in-memory surface, so
+    // the whole frame has to be converted on every flip
+    if (tw_pixel_format == TW_PXFMT_BGRA_8888
+            || (tw_flags & TW_FLAG_BOARD_HAS_FLIPPED_SCREEN)) {
+        my_backend.flip_region = nullptr;
+    }
+    prev_dirty_y1 = 0;
+    prev_dirty_y2 = gr_draw->height;
+
     fb_fd = fd;
     set_displayed_framebuffer(0);
 
@@ -323,6 +342,46 @@ static GRSurface* fbdev_flip(minui_backend* backend __unused)
             set_displayed_framebuffer(1-displayed_buffer);
         }
     }
+    prev_dirty_y1 = 0;
+    prev_dirty_y2 = gr_draw->height;
+    return gr_draw;
+}
+
+static GRSurface* fbdev_flip_region(minui_backend* backend __unused,
+                                    int x __unused, int y,
+                                    int w, int h)
+{
+    // Whole rows are copied since they are contiguous in both surfaces
+    int y1 = y;
+    int y2 = (w > 0 && h > 0) ? y + h : y;
+    int copy_y1 = y1;
+    int copy_y2 = y2;
+    GRSurface *target = &gr_framebuffer[0];
+
+    if (double_buffered) {
+        if (prev_dirty_y1 < prev_dirty_y2) {
+            if (copy_y1 < copy_y2) {
+                copy_y1 = std::min(copy_y1, prev_dirty_y1);
+                copy_y2 = std::max(copy_y2, prev_dirty_y2);
+            } else {
+                copy_y1 = prev_dirty_y1;
+                copy_y2 = prev_dirty_y2;
+            }
+        }
+        target = &gr_framebuffer[1-displayed_buffer];
+    }
+
+    if (copy_y1 < copy_y2) {
+        memcpy(target->data + copy_y1 * gr_draw->row_bytes,
+               gr_draw->data + copy_y1 * gr_draw->row_bytes,
+               (copy_y2 - copy_y1) * gr_draw->row_bytes);
+    }
+    if (double_buffered) {
+        set_displayed_framebuffer(1-displayed_buffer);
+    }
+
+    prev_dirty_y1 = y1;
+    prev_dirty_y2 = y2;
     return gr_draw;
 }
 
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -21,6 +22,10 @@
 #include <sys/poll.h>
 #include <limits.h>
 #include <linux/input.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -35,6 +40,11 @@
 
 #define MAX_DEVICES         32
 
+// epoll data for the non-device file descriptors
+#define EV_ID_TIMER         (MAX_DEVICES)
+#define EV_ID_WAKE          (MAX_DEVICES + 1)
+#define EV_ID_INOTIFY       (MAX_DEVICES + 2)
+
 #define VIBRATOR_TIMEOUT_FILE "/sys/class/timed_output/vibrator/enable"
 #define VIBRATOR_TIME_MS    50
 
@@ -107,6 +117,16 @@ static struct timespec lastInputStat;
 static unsigned long lastInputMTime;
 static int has_mouse = 0;
 
+// ev_get() sleeps in epoll_wait() until a device has input, the timer set by
+// ev_set_timer() expires, ev_wake() is called or an input device is added or
+// removed
+static int epoll_fd = -1;
+static int timer_fd = -1;
+static int wake_fd = -1;
+static int inotify_fd = -1;
+static struct timespec timer_deadline;
+static bool timer_armed = false;
+
 static inline int ABS(int x)
 {
     return x < 0 ? -x : x;
@@ -321,12 +341,62 @@ int ev_has_mouse(void)
     return has_mouse;
 }
 
+static void ev_add_fd(int fd, uint32_t id)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = id;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        printf("Failed to add fd %d to epoll: %s\n", fd, strerror(errno));
+    }
+}
+
+static void ev_init_wakeup(void)
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        printf("Failed to create epoll fd: %s\n", strerror(errno));
+        return;
+    }
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd >= 0) {
+        ev_add_fd(timer_fd, EV_ID_TIMER);
+    } else {
+        printf("Failed to create timer fd: %s\n", strerror(errno));
+    }
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd >= 0) {
+        ev_add_fd(wake_fd, EV_ID_WAKE);
+    } else {
+        printf("Failed to create event fd: %s\n", strerror(errno));
+    }
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd >= 0) {
+        if (inotify_add_watch(inotify_fd, "/dev/input",
+                              IN_CREATE | IN_DELETE) >= 0) {
+            ev_add_fd(inotify_fd, EV_ID_INOTIFY);
+        } else {
+            close(inotify_fd);
+            inotify_fd = -1;
+        }
+    }
+}
+
 int ev_init(void)
 {
     DIR *dir;
     struct dirent *de;
     int fd;
 
+    if (epoll_fd < 0) {
+        ev_init_wakeup();
+    }
+
     has_mouse = 0;
 
     dir = opendir("/dev/input");
@@ -345,6 +415,10 @@ int ev_init(void)
             ev_fds[ev_count].events = POLLIN;
             evs[ev_count].fd = &ev_fds[ev_count];
 
+            if (epoll_fd >= 0) {
+                ev_add_fd(fd, ev_count);
+            }
+
             /* Load virtualkeys if there are any */
             vk_init(&evs[ev_count]);
 
@@ -367,18 +441,93 @@ int ev_init(void)
     return 0;
 }
 
-void ev_exit(void)
+static void ev_close_devices(void)
 {
     while (ev_count-- > 0) {
         if (evs[ev_count].vk_count) {
             free(evs[ev_count].vks);
             evs[ev_count].vk_count = 0;
         }
+        // Closing the fd also removes it from the epoll set
         close(ev_fds[ev_count].fd);
     }
     ev_count = 0;
 }
 
+void ev_exit(void)
+{
+    ev_close_devices();
+
+    if (inotify_fd >= 0) {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+    if (wake_fd >= 0) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+    if (timer_fd >= 0) {
+        close(timer_fd);
+        timer_fd = -1;
+    }
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+    timer_armed = false;
+}
+
+static void ev_reload(void)
+{
+    printf("Reloading input devices\n");
+    ev_close_devices();
+    ev_init();
+}
+
+void ev_set_timer(const struct timespec *deadline)
+{
+    if (timer_fd < 0) {
+        return;
+    }
+
+    if (!deadline) {
+        if (timer_armed) {
+            struct itimerspec spec;
+            memset(&spec, 0, sizeof(spec));
+            timerfd_settime(timer_fd, 0, &spec, nullptr);
+            timer_armed = false;
+        }
+        return;
+    }
+
+    if (timer_armed && timer_deadline.tv_sec == deadline->tv_sec
+            && timer_deadline.tv_nsec == deadline->tv_nsec) {
+        return;
+    }
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value = *deadline;
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+        // A zero value would disarm the timer
+        spec.it_value.tv_nsec = 1;
+    }
+
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr) == 0) {
+        timer_deadline = *deadline;
+        timer_armed = true;
+    }
+}
+
+void ev_wake(void)
+{
+    if (wake_fd >= 0) {
+        uint64_t value = 1;
+        // Can only fail if the counter would overflow, which still wakes us up
+        (void) !write(wake_fd, &value, sizeof(value));
+    }
+}
+
 #if 0 // Unused
 static int vk_inside_display(__s32 value, struct input_absinfo *info, int screen_size)
 {
@@ -761,40 +910,65 @@ static int vk_modify(struct ev *e, struct input_event *ev)
 
 int ev_get(struct input_event *ev, int timeout_ms)
 {
+    struct epoll_event events[MAX_DEVICES + 3];
     int r;
-    unsigned n;
-    struct timespec curr;
-
-    clock_gettime(CLOCK_MONOTONIC, &curr);
-    if (curr.tv_sec - lastInputStat.tv_sec >= 2) {
-        struct stat st;
-        stat("/dev/input", &st);
-        if (st.st_mtime > lastInputMTime) {
-            printf("Reloading input devices\n");
-            ev_exit();
-            ev_init();
-            lastInputMTime = st.st_mtime;
+    bool woken = false;
+
+    if (epoll_fd < 0) {
+        return -2;
+    }
+
+    if (inotify_fd < 0) {
+        // No notifications for new devices, so check now and then
+        struct timespec curr;
+        clock_gettime(CLOCK_MONOTONIC, &curr);
+        if (curr.tv_sec - lastInputStat.tv_sec >= 2) {
+            struct stat st;
+            stat("/dev/input", &st);
+            if (st.st_mtime > lastInputMTime) {
+                ev_reload();
+                lastInputMTime = st.st_mtime;
+            }
+            lastInputStat = curr;
         }
-        lastInputStat = curr;
     }
 
-    r = poll(ev_fds, ev_count, timeout_ms);
+    r = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]),
+                   timeout_ms);
+    if (r <= 0) {
+        return -2;
+    }
 
-    if (r > 0) {
-        for (n = 0; n < ev_count; n++) {
-            if (ev_fds[n].revents & POLLIN) {
-                r = read(ev_fds[n].fd, ev, sizeof(*ev));
-                if (r == sizeof(*ev)) {
-                    if (!vk_modify(&evs[n], ev)) {
-                        return 0;
-                    }
+    for (int i = 0; i < r; ++i) {
+        uint32_t id = events[i].data.u32;
+        uint64_t value;
+
+        if (id == EV_ID_TIMER) {
+            (void) !read(timer_fd, &value, sizeof(value));
+            timer_armed = false;
+            woken = true;
+        } else if (id == EV_ID_WAKE) {
+            (void) !read(wake_fd, &value, sizeof(value));
+            woken = true;
+        } else if (id == EV_ID_INOTIFY) {
+            char buf[4096];
+            while (read(inotify_fd, buf, sizeof(buf)) > 0) {
+                // Drain all queued notifications
+            }
+            // The device indices in the remaining events are now stale
+            ev_reload();
+            return -3;
+        } else if (id < ev_count && (events[i].events & EPOLLIN)) {
+            r = read(ev_fds[id].fd, ev, sizeof(*ev));
+            if (r == sizeof(*ev)) {
+                if (!vk_modify(&evs[id], ev)) {
+                    return 0;
                 }
             }
         }
-        return -1;
     }
 
-    return -2;
+    return woken ? -3 : -1;
 }
 
 int ev_wait(int timeout)
@@ -31,12 +31,15 @@
 
 #include <time.h>
 
+#include <algorithm>
+
 #include <pixelflinger/pixelflinger.h>
 
 #include "config/config.hpp"
 #include "backend/backend.h"
 #include "minui.h"
 #include "graphics.h"
+#include "graphics_fast.h"
 #include "gui/placement.h"
 
 struct GRFont
@@ -71,6 +74,18 @@ static GGLContext *gr_context = 0;
 GGLSurface gr_mem_surface;
 static int gr_is_curr_clr_opaque = 0;
 
+// Current color in the channel order passed to pixelflinger and the scissor
+// region, tracked for the specialized drawing paths
+static uint8_t gr_fast_color[4] = { 255, 255, 255, 255 };
+static bool gr_scissor_enabled = false;
+static GRFastClip gr_scissor;
+
+static bool gr_bounds_enabled = false;
+static int gr_bounds_x;
+static int gr_bounds_y;
+static int gr_bounds_w;
+static int gr_bounds_h;
+
 #if 0 // unused
 static bool outside(int x, int y)
 {
@@ -136,15 +151,78 @@ int gr_textEx_scaleW(int x, int y, const char *s, void* pFont, int max_width, in
 void gr_clip(int x, int y, int w, int h)
 {
     GGLContext *gl = gr_context;
+
+    // Objects clipping themselves must stay within the render bounds
+    if (gr_bounds_enabled) {
+        int x2 = std::min(x + w, gr_bounds_x + gr_bounds_w);
+        int y2 = std::min(y + h, gr_bounds_y + gr_bounds_h);
+        x = std::max(x, gr_bounds_x);
+        y = std::max(y, gr_bounds_y);
+        w = std::max(x2 - x, 0);
+        h = std::max(y2 - y, 0);
+    }
+
     gl->scissor(gl, x, y, w, h);
     gl->enable(gl, GGL_SCISSOR_TEST);
+    gr_scissor_enabled = true;
+    gr_scissor = { x, y, x + w, y + h };
 }
 
 void gr_noclip()
 {
     GGLContext *gl = gr_context;
-    gl->scissor(gl, 0, 0, gr_fb_width(), gr_fb_height());
-    gl->disable(gl, GGL_SCISSOR_TEST);
+    if (gr_bounds_enabled) {
+        gl->scissor(gl, gr_bounds_x, gr_bounds_y, gr_bounds_w, gr_bounds_h);
+        gl->enable(gl, GGL_SCISSOR_TEST);
+        gr_scissor_enabled = true;
+        gr_scissor = { gr_bounds_x, gr_bounds_y,
+                       gr_bounds_x + gr_bounds_w, gr_bounds_y + gr_bounds_h };
+    } else {
+        gl->scissor(gl, 0, 0, gr_fb_width(), gr_fb_height());
+        gl->disable(gl, GGL_SCISSOR_TEST);
+        gr_scissor_enabled = false;
+    }
+}
+
+static GRFastClip gr_fast_clip()
+{
+    if (gr_scissor_enabled) {
+        return gr_scissor;
+    }
+    return { 0, 0, static_cast<int>(gr_mem_surface.width),
+             static_cast<int>(gr_mem_surface.height) };
+}
+
+// Restrict all drawing to the given region until gr_clear_render_bounds() is
+// called. Used for repainting only the damaged part of the screen.
+void gr_set_render_bounds(int x, int y, int w, int h)
+{
+    gr_bounds_enabled = true;
+    gr_bounds_x = x;
+    gr_bounds_y = y;
+    gr_bounds_w = w;
+    gr_bounds_h = h;
+    gr_noclip();
+}
+
+void gr_clear_render_bounds()
+{
+    gr_bounds_enabled = false;
+    gr_noclip();
+}
+
+// Get the region set by gr_set_render_bounds(). Returns false if drawing is
+// not restricted.
+bool gr_get_render_bounds(int *x, int *y, int *w, int *h)
+{
+    if (!gr_bounds_enabled) {
+        return false;
+    }
+    *x = gr_bounds_x;
+    *y = gr_bounds_y;
+    *w = gr_bounds_w;
+    *h = gr_bounds_h;
+    return true;
 }
 
 void gr_line(int x0, int y0, int x1, int y1, int width)
@@ -215,6 +293,17 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
     }
     gl->color4xv(gl, color);
 
+    if (tw_pixel_format == TW_PXFMT_ABGR_8888
+            || tw_pixel_format == TW_PXFMT_BGRA_8888) {
+        gr_fast_color[0] = b;
+        gr_fast_color[2] = r;
+    } else {
+        gr_fast_color[0] = r;
+        gr_fast_color[2] = b;
+    }
+    gr_fast_color[1] = g;
+    gr_fast_color[3] = a;
+
     gr_is_curr_clr_opaque = (a == 255);
 }
 
@@ -246,6 +335,11 @@ void gr_fill(int x, int y, int w, int h)
 {
     GGLContext *gl = gr_context;
 
+    if (gr_fast_fill(&gr_mem_surface, gr_fast_clip(), x, y, w, h,
+                     gr_fast_color, !gr_is_curr_clr_opaque)) {
+        return;
+    }
+
     if (gr_is_curr_clr_opaque) {
         gl->disable(gl, GGL_BLEND);
     }
@@ -266,6 +360,11 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy)
     GGLContext *gl = gr_context;
     GGLSurface *surface = (GGLSurface*)source;
 
+    if (gr_fast_blit(&gr_mem_surface, gr_fast_clip(), surface,
+                     sx, sy, w, h, dx, dy)) {
+        return;
+    }
+
     if (surface->format == GGL_PIXEL_FORMAT_RGBX_8888) {
         gl->disable(gl, GGL_BLEND);
     }
@@ -284,6 +383,17 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy)
     }
 }
 
+bool gr_fast_draw_mask(const GGLSurface *mask, int sx, int sy, int w, int h,
+                       int dx, int dy)
+{
+    if (gr_context == nullptr) {
+        return false;
+    }
+
+    return gr_fast_blit_mask(&gr_mem_surface, gr_fast_clip(), mask,
+                             sx, sy, w, h, dx, dy, gr_fast_color);
+}
+
 unsigned int gr_get_width(gr_surface surface)
 {
     if (surface == nullptr) {
@@ -309,6 +419,32 @@ void gr_flip()
     gr_context->colorBuffer(gr_context, &gr_mem_surface);
 }
 
+void gr_flip_region(int x, int y, int w, int h)
+{
+    if (!gr_backend->flip_region) {
+        gr_flip();
+        return;
+    }
+
+    int x2 = std::min(x + w, gr_draw->width);
+    int y2 = std::min(y + h, gr_draw->height);
+    x = std::max(x, 0);
+    y = std::max(y, 0);
+
+    gr_draw = gr_backend->flip_region(gr_backend, x, y,
+                                      std::max(x2 - x, 0),
+                                      std::max(y2 - y, 0));
+    gr_mem_surface.data = (GGLubyte*)gr_draw->data;
+    gr_context->colorBuffer(gr_context, &gr_mem_surface);
+}
+
+// Whether the drawing surface keeps the previous frame across flips, allowing
+// only the changed parts of the screen to be redrawn
+bool gr_has_partial_flip()
+{
+    return gr_backend && gr_backend->flip_region;
+}
+
 static void get_memory_surface(GGLSurface* ms)
 {
     ms->version = sizeof(*ms);
@@ -35,6 +35,13 @@ struct minui_backend
 
     // Device cleanup when drawing is done.
     void (*exit)(minui_backend*);
+
+    // Like flip(), but only the given region of the drawing surface has
+    // changed since the previous flip. Backends that implement this must
+    // return a drawing surface that still holds the frame that was just
+    // displayed, both here and from flip(), so that callers can redraw
+    // incrementally. May be null if partial updates are not supported.
+    GRSurface* (*flip_region)(minui_backend*, int x, int y, int w, int h);
 };
 
 #endif
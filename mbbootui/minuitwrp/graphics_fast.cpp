@@ -0,0 +1,574 @@
+/*
+ * Copyright (C) 2017 Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "graphics_fast.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#  include <emmintrin.h>
+#  define HAVE_SSE2_KERNELS 1
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && defined(__GNUC__)
+#  include <arm_neon.h>
+#  define HAVE_NEON_KERNELS 1
+#endif
+
+// Byte order of a destination pixel
+enum DstLayout
+{
+    LAYOUT_RGBA,        // RGBA_8888 and RGBX_8888
+    LAYOUT_BGRA,        // BGRA_8888
+    LAYOUT_RGB_565,     // RGB_565
+    LAYOUT_UNSUPPORTED,
+};
+
+static DstLayout dst_layout(const GGLSurface *dst)
+{
+    switch (dst->format) {
+    case GGL_PIXEL_FORMAT_RGBA_8888:
+    case GGL_PIXEL_FORMAT_RGBX_8888:
+        return LAYOUT_RGBA;
+    case GGL_PIXEL_FORMAT_BGRA_8888:
+        return LAYOUT_BGRA;
+    case GGL_PIXEL_FORMAT_RGB_565:
+        return LAYOUT_RGB_565;
+    default:
+        return LAYOUT_UNSUPPORTED;
+    }
+}
+
+// Scale factor in [0, 256] so that blending is a multiply and a shift, exact
+// for alpha values of 0 and 255
+static inline unsigned alpha_factor(uint8_t a)
+{
+    return a + (a >> 7);
+}
+
+static inline uint8_t blend_channel(uint8_t s, uint8_t d, unsigned f)
+{
+    return static_cast<uint8_t>((s * f + d * (256 - f)) >> 8);
+}
+
+// Clip the destination rectangle to the clip region and the surface, shifting
+// the source origin along with it. Returns false if nothing is left to draw.
+static bool clip_rect(const GGLSurface *dst, const GRFastClip &clip,
+                      int &x, int &y, int &w, int &h, int &sx, int &sy)
+{
+    int x1 = std::max({ x, clip.x1, 0 });
+    int y1 = std::max({ y, clip.y1, 0 });
+    int x2 = std::min({ x + w, clip.x2, static_cast<int>(dst->width) });
+    int y2 = std::min({ y + h, clip.y2, static_cast<int>(dst->height) });
+
+    if (x1 >= x2 || y1 >= y2) {
+        return false;
+    }
+
+    sx += x1 - x;
+    sy += y1 - y;
+    x = x1;
+    y = y1;
+    w = x2 - x1;
+    h = y2 - y1;
+    return true;
+}
+
+// 32-bit kernels. Colors are already in destination byte order.
+
+static void fill_row_32(uint8_t *dst, const uint8_t color[4], int n)
+{
+    uint32_t px;
+    memcpy(&px, color, sizeof(px));
+    int i = 0;
+
+#if HAVE_SSE2_KERNELS
+    __m128i v = _mm_set1_epi32(static_cast<int>(px));
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i * 4), v);
+    }
+#elif HAVE_NEON_KERNELS
+    uint32x4_t v = vdupq_n_u32(px);
+    for (; i + 4 <= n; i += 4) {
+        vst1q_u32(reinterpret_cast<uint32_t *>(dst + i * 4), v);
+    }
+#endif
+
+    for (; i < n; ++i) {
+        memcpy(dst + i * 4, &px, sizeof(px));
+    }
+}
+
+static void blend_color_row_32(uint8_t *dst, const uint8_t color[4], int n)
+{
+    unsigned f = alpha_factor(color[3]);
+    int i = 0;
+
+#if HAVE_SSE2_KERNELS
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i vf = _mm_set1_epi16(static_cast<short>(f));
+    const __m128i vinv = _mm_set1_epi16(static_cast<short>(256 - f));
+    uint32_t px;
+    memcpy(&px, color, sizeof(px));
+    const __m128i vs = _mm_mullo_epi16(
+            _mm_unpacklo_epi8(_mm_set1_epi32(static_cast<int>(px)), zero), vf);
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i *p = reinterpret_cast<__m128i *>(dst + i * 4);
+        __m128i d = _mm_loadu_si128(p);
+        __m128i lo = _mm_srli_epi16(_mm_add_epi16(
+                vs, _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), vinv)), 8);
+        __m128i hi = _mm_srli_epi16(_mm_add_epi16(
+                vs, _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), vinv)), 8);
+        _mm_storeu_si128(p, _mm_packus_epi16(lo, hi));
+    }
+#elif HAVE_NEON_KERNELS
+    const uint16x8_t vinv = vdupq_n_u16(256 - f);
+    uint16x8_t vs[4];
+    for (int c = 0; c < 4; ++c) {
+        vs[c] = vdupq_n_u16(color[c] * f);
+    }
+
+    for (; i + 8 <= n; i += 8) {
+        uint8x8x4_t d = vld4_u8(dst + i * 4);
+        for (int c = 0; c < 4; ++c) {
+            d.val[c] = vshrn_n_u16(
+                    vmlaq_u16(vs[c], vmovl_u8(d.val[c]), vinv), 8);
+        }
+        vst4_u8(dst + i * 4, d);
+    }
+#endif
+
+    for (; i < n; ++i) {
+        for (int c = 0; c < 4; ++c) {
+            dst[i * 4 + c] = blend_channel(color[c], dst[i * 4 + c], f);
+        }
+    }
+}
+
+static inline void swap_rb_px(uint8_t *dst, const uint8_t *src)
+{
+    uint8_t r = src[0];
+    dst[0] = src[2];
+    dst[1] = src[1];
+    dst[2] = r;
+    dst[3] = src[3];
+}
+
+static void copy_row_32(uint8_t *dst, const uint8_t *src, int n, bool swap_rb)
+{
+    if (!swap_rb) {
+        memcpy(dst, src, n * 4);
+        return;
+    }
+
+    int i = 0;
+
+#if HAVE_SSE2_KERNELS
+    const __m128i mask_ga = _mm_set1_epi32(static_cast<int>(0xff00ff00));
+    const __m128i mask_b = _mm_set1_epi32(0xff);
+    for (; i + 4 <= n; i += 4) {
+        __m128i s = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(src + i * 4));
+        __m128i d = _mm_or_si128(
+                _mm_and_si128(s, mask_ga),
+                _mm_or_si128(_mm_and_si128(_mm_srli_epi32(s, 16), mask_b),
+                             _mm_slli_epi32(_mm_and_si128(s, mask_b), 16)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i * 4), d);
+    }
+#elif HAVE_NEON_KERNELS
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x4_t s = vld4q_u8(src + i * 4);
+        uint8x16_t tmp = s.val[0];
+        s.val[0] = s.val[2];
+        s.val[2] = tmp;
+        vst4q_u8(dst + i * 4, s);
+    }
+#endif
+
+    for (; i < n; ++i) {
+        swap_rb_px(dst + i * 4, src + i * 4);
+    }
+}
+
+static void blend_row_32(uint8_t *dst, const uint8_t *src, int n, bool swap_rb)
+{
+    int i = 0;
+
+#if HAVE_SSE2_KERNELS
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i v256 = _mm_set1_epi16(256);
+    const __m128i mask_ga = _mm_set1_epi32(static_cast<int>(0xff00ff00));
+    const __m128i mask_b = _mm_set1_epi32(0xff);
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i s = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(src + i * 4));
+        __m128i *p = reinterpret_cast<__m128i *>(dst + i * 4);
+        __m128i d = _mm_loadu_si128(p);
+
+        if (swap_rb) {
+            s = _mm_or_si128(
+                    _mm_and_si128(s, mask_ga),
+                    _mm_or_si128(_mm_and_si128(_mm_srli_epi32(s, 16), mask_b),
+                                 _mm_slli_epi32(_mm_and_si128(s, mask_b), 16)));
+        }
+
+        __m128i s_lo = _mm_unpacklo_epi8(s, zero);
+        __m128i s_hi = _mm_unpackhi_epi8(s, zero);
+
+        // Broadcast each pixel's alpha to all of its channels
+        __m128i a_lo = _mm_shufflehi_epi16(
+                _mm_shufflelo_epi16(s_lo, _MM_SHUFFLE(3, 3, 3, 3)),
+                _MM_SHUFFLE(3, 3, 3, 3));
+        __m128i a_hi = _mm_shufflehi_epi16(
+                _mm_shufflelo_epi16(s_hi, _MM_SHUFFLE(3, 3, 3, 3)),
+                _MM_SHUFFLE(3, 3, 3, 3));
+        __m128i f_lo = _mm_add_epi16(a_lo, _mm_srli_epi16(a_lo, 7));
+        __m128i f_hi = _mm_add_epi16(a_hi, _mm_srli_epi16(a_hi, 7));
+
+        __m128i lo = _mm_srli_epi16(_mm_add_epi16(
+                _mm_mullo_epi16(s_lo, f_lo),
+                _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero),
+                                _mm_sub_epi16(v256, f_lo))), 8);
+        __m128i hi = _mm_srli_epi16(_mm_add_epi16(
+                _mm_mullo_epi16(s_hi, f_hi),
+                _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero),
+                                _mm_sub_epi16(v256, f_hi))), 8);
+        _mm_storeu_si128(p, _mm_packus_epi16(lo, hi));
+    }
+#elif HAVE_NEON_KERNELS
+    const uint16x8_t v256 = vdupq_n_u16(256);
+
+    for (; i + 8 <= n; i += 8) {
+        uint8x8x4_t s = vld4_u8(src + i * 4);
+        uint8x8x4_t d = vld4_u8(dst + i * 4);
+
+        if (swap_rb) {
+            uint8x8_t tmp = s.val[0];
+            s.val[0] = s.val[2];
+            s.val[2] = tmp;
+        }
+
+        uint16x8_t f = vaddw_u8(vmovl_u8(s.val[3]), vshr_n_u8(s.val[3], 7));
+        uint16x8_t inv = vsubq_u16(v256, f);
+
+        for (int c = 0; c < 4; ++c) {
+            d.val[c] = vshrn_n_u16(vmlaq_u16(vmulq_u16(vmovl_u8(s.val[c]), f),
+                                             vmovl_u8(d.val[c]), inv), 8);
+        }
+        vst4_u8(dst + i * 4, d);
+    }
+#endif
+
+    for (; i < n; ++i) {
+        uint8_t px[4];
+        if (swap_rb) {
+            swap_rb_px(px, src + i * 4);
+        } else {
+            memcpy(px, src + i * 4, sizeof(px));
+        }
+
+        unsigned f = alpha_factor(px[3]);
+        for (int c = 0; c < 4; ++c) {
+            dst[i * 4 + c] = blend_channel(px[c], dst[i * 4 + c], f);
+        }
+    }
+}
+
+static void blend_mask_row_32(uint8_t *dst, const uint8_t *mask,
+                              const uint8_t color[4], int n)
+{
+    int i = 0;
+
+#if HAVE_SSE2_KERNELS
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i v256 = _mm_set1_epi16(256);
+    uint32_t px;
+    memcpy(&px, color, sizeof(px));
+    const __m128i vs = _mm_unpacklo_epi8(
+            _mm_set1_epi32(static_cast<int>(px)), zero);
+    const __m128i alpha_lanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+
+    for (; i + 4 <= n; i += 4) {
+        uint32_t m;
+        memcpy(&m, mask + i, sizeof(m));
+        if (m == 0) {
+            continue;
+        }
+
+        // [m0 m0 m1 m1 m2 m2 m3 m3] as 16-bit lanes
+        __m128i a = _mm_unpacklo_epi8(_mm_cvtsi32_si128(static_cast<int>(m)),
+                                      zero);
+        a = _mm_unpacklo_epi16(a, a);
+        __m128i a_lo = _mm_unpacklo_epi32(a, a);
+        __m128i a_hi = _mm_unpackhi_epi32(a, a);
+        __m128i f_lo = _mm_add_epi16(a_lo, _mm_srli_epi16(a_lo, 7));
+        __m128i f_hi = _mm_add_epi16(a_hi, _mm_srli_epi16(a_hi, 7));
+
+        // The source alpha is the coverage value
+        __m128i s_lo = _mm_or_si128(_mm_andnot_si128(alpha_lanes, vs),
+                                    _mm_and_si128(alpha_lanes, a_lo));
+        __m128i s_hi = _mm_or_si128(_mm_andnot_si128(alpha_lanes, vs),
+                                    _mm_and_si128(alpha_lanes, a_hi));
+
+        __m128i *p = reinterpret_cast<__m128i *>(dst + i * 4);
+        __m128i d = _mm_loadu_si128(p);
+        __m128i lo = _mm_srli_epi16(_mm_add_epi16(
+                _mm_mullo_epi16(s_lo, f_lo),
+                _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero),
+                                _mm_sub_epi16(v256, f_lo))), 8);
+        __m128i hi = _mm_srli_epi16(_mm_add_epi16(
+                _mm_mullo_epi16(s_hi, f_hi),
+                _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero),
+                                _mm_sub_epi16(v256, f_hi))), 8);
+        _mm_storeu_si128(p, _mm_packus_epi16(lo, hi));
+    }
+#elif HAVE_NEON_KERNELS
+    const uint16x8_t v256 = vdupq_n_u16(256);
+    uint16x8_t vs[3];
+    for (int c = 0; c < 3; ++c) {
+        vs[c] = vdupq_n_u16(color[c]);
+    }
+
+    for (; i + 8 <= n; i += 8) {
+        uint8x8_t m = vld1_u8(mask + i);
+        if (vget_lane_u64(vreinterpret_u64_u8(m), 0) == 0) {
+            continue;
+        }
+
+        uint16x8_t f = vaddw_u8(vmovl_u8(m), vshr_n_u8(m, 7));
+        uint16x8_t inv = vsubq_u16(v256, f);
+        uint8x8x4_t d = vld4_u8(dst + i * 4);
+
+        for (int c = 0; c < 3; ++c) {
+            d.val[c] = vshrn_n_u16(vmlaq_u16(vmulq_u16(vs[c], f),
+                                             vmovl_u8(d.val[c]), inv), 8);
+        }
+        // The source alpha is the coverage value
+        d.val[3] = vshrn_n_u16(vmlaq_u16(vmulq_u16(vmovl_u8(m), f),
+                                         vmovl_u8(d.val[3]), inv), 8);
+        vst4_u8(dst + i * 4, d);
+    }
+#endif
+
+    for (; i < n; ++i) {
+        if (mask[i] == 0) {
+            continue;
+        }
+
+        unsigned f = alpha_factor(mask[i]);
+        for (int c = 0; c < 3; ++c) {
+            dst[i * 4 + c] = blend_channel(color[c], dst[i * 4 + c], f);
+        }
+        dst[i * 4 + 3] = blend_channel(mask[i], dst[i * 4 + 3], f);
+    }
+}
+
+// RGB_565 kernels. These convert from the 8-bit RGB source channels.
+
+static inline uint16_t pack_565(uint8_t r, uint8_t g, uint8_t b)
+{
+    return static_cast<uint16_t>(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+}
+
+static inline uint16_t blend_565(uint16_t d, const uint8_t *rgb, unsigned f)
+{
+    uint8_t r = (d >> 11) & 0x1f;
+    uint8_t g = (d >> 5) & 0x3f;
+    uint8_t b = d & 0x1f;
+    r = static_cast<uint8_t>((r << 3) | (r >> 2));
+    g = static_cast<uint8_t>((g << 2) | (g >> 4));
+    b = static_cast<uint8_t>((b << 3) | (b >> 2));
+
+    return pack_565(blend_channel(rgb[0], r, f),
+                    blend_channel(rgb[1], g, f),
+                    blend_channel(rgb[2], b, f));
+}
+
+static void fill_row_565(uint16_t *dst, const uint8_t color[4], int n,
+                         bool blend)
+{
+    if (!blend) {
+        std::fill(dst, dst + n, pack_565(color[0], color[1], color[2]));
+        return;
+    }
+
+    unsigned f = alpha_factor(color[3]);
+    for (int i = 0; i < n; ++i) {
+        dst[i] = blend_565(dst[i], color, f);
+    }
+}
+
+static void blit_row_565(uint16_t *dst, const uint8_t *src, int n, bool blend)
+{
+    for (int i = 0; i < n; ++i) {
+        const uint8_t *px = src + i * 4;
+        if (!blend) {
+            dst[i] = pack_565(px[0], px[1], px[2]);
+        } else if (px[3] != 0) {
+            dst[i] = blend_565(dst[i], px, alpha_factor(px[3]));
+        }
+    }
+}
+
+static void blend_mask_row_565(uint16_t *dst, const uint8_t *mask,
+                               const uint8_t color[4], int n)
+{
+    for (int i = 0; i < n; ++i) {
+        if (mask[i] != 0) {
+            dst[i] = blend_565(dst[i], color, alpha_factor(mask[i]));
+        }
+    }
+}
+
+static inline uint8_t * dst_pixel(GGLSurface *dst, int x, int y,
+                                  int pixel_bytes)
+{
+    return dst->data + (static_cast<size_t>(y) * dst->stride + x) * pixel_bytes;
+}
+
+// Reorder an (R, G, B, A) color to the destination's byte order
+static void color_to_layout(DstLayout layout, const uint8_t color[4],
+                            uint8_t out[4])
+{
+    if (layout == LAYOUT_BGRA) {
+        swap_rb_px(out, color);
+    } else {
+        memcpy(out, color, 4);
+    }
+}
+
+bool gr_fast_fill(GGLSurface *dst, const GRFastClip &clip,
+                  int x, int y, int w, int h,
+                  const uint8_t color[4], bool blend)
+{
+    DstLayout layout = dst_layout(dst);
+    if (layout == LAYOUT_UNSUPPORTED) {
+        return false;
+    }
+
+    int sx = 0;
+    int sy = 0;
+    if (!clip_rect(dst, clip, x, y, w, h, sx, sy)) {
+        return true;
+    }
+
+    if (layout == LAYOUT_RGB_565) {
+        for (int row = 0; row < h; ++row) {
+            fill_row_565(reinterpret_cast<uint16_t *>(
+                    dst_pixel(dst, x, y + row, 2)), color, w, blend);
+        }
+        return true;
+    }
+
+    uint8_t c[4];
+    color_to_layout(layout, color, c);
+
+    for (int row = 0; row < h; ++row) {
+        uint8_t *p = dst_pixel(dst, x, y + row, 4);
+        if (blend) {
+            blend_color_row_32(p, c, w);
+        } else {
+            fill_row_32(p, c, w);
+        }
+    }
+    return true;
+}
+
+bool gr_fast_blit(GGLSurface *dst, const GRFastClip &clip,
+                  const GGLSurface *src, int sx, int sy, int w, int h,
+                  int dx, int dy)
+{
+    DstLayout layout = dst_layout(dst);
+    if (layout == LAYOUT_UNSUPPORTED) {
+        return false;
+    }
+
+    bool blend;
+    if (src->format == GGL_PIXEL_FORMAT_RGBX_8888) {
+        blend = false;
+    } else if (src->format == GGL_PIXEL_FORMAT_RGBA_8888) {
+        blend = true;
+    } else {
+        return false;
+    }
+
+    // pixelflinger wraps texture coordinates, which is not handled here
+    if (sx < 0 || sy < 0 || w < 0 || h < 0
+            || sx + w > static_cast<int>(src->width)
+            || sy + h > static_cast<int>(src->height)) {
+        return false;
+    }
+
+    if (!clip_rect(dst, clip, dx, dy, w, h, sx, sy)) {
+        return true;
+    }
+
+    bool swap_rb = layout == LAYOUT_BGRA;
+
+    for (int row = 0; row < h; ++row) {
+        const uint8_t *s = src->data
+                + (static_cast<size_t>(sy + row) * src->stride + sx) * 4;
+
+        if (layout == LAYOUT_RGB_565) {
+            blit_row_565(reinterpret_cast<uint16_t *>(
+                    dst_pixel(dst, dx, dy + row, 2)), s, w, blend);
+        } else if (blend) {
+            blend_row_32(dst_pixel(dst, dx, dy + row, 4), s, w, swap_rb);
+        } else {
+            copy_row_32(dst_pixel(dst, dx, dy + row, 4), s, w, swap_rb);
+        }
+    }
+    return true;
+}
+
+bool gr_fast_blit_mask(GGLSurface *dst, const GRFastClip &clip,
+                       const GGLSurface *mask, int sx, int sy, int w, int h,
+                       int dx, int dy, const uint8_t color[4])
+{
+    DstLayout layout = dst_layout(dst);
+    if (layout == LAYOUT_UNSUPPORTED
+            || mask->format != GGL_PIXEL_FORMAT_A_8) {
+        return false;
+    }
+
+    if (sx < 0 || sy < 0 || w < 0 || h < 0
+            || sx + w > static_cast<int>(mask->width)
+            || sy + h > static_cast<int>(mask->height)) {
+        return false;
+    }
+
+    if (!clip_rect(dst, clip, dx, dy, w, h, sx, sy)) {
+        return true;
+    }
+
+    uint8_t c[4];
+    color_to_layout(layout, color, c);
+
+    for (int row = 0; row < h; ++row) {
+        const uint8_t *m = mask->data
+                + static_cast<size_t>(sy + row) * mask->stride + sx;
+
+        if (layout == LAYOUT_RGB_565) {
+            blend_mask_row_565(reinterpret_cast<uint16_t *>(
+                    dst_pixel(dst, dx, dy + row, 2)), m, color, w);
+        } else {
+            blend_mask_row_32(dst_pixel(dst, dx, dy + row, 4), m, c, w);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2017 Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <pixelflinger/pixelflinger.h>
+
+// Specialized software rendering for the common draw operations. Each function
+// returns false without drawing anything if the surface formats or parameters
+// are not supported, in which case the caller must fall back to pixelflinger.
+//
+// Blending matches pixelflinger's GGL_SRC_ALPHA, GGL_ONE_MINUS_SRC_ALPHA mode.
+// Colors are given in the channel order passed to pixelflinger (R, G, B, A).
+
+// Drawable area of the destination surface (scissor test)
+struct GRFastClip
+{
+    int x1;
+    int y1;
+    int x2;
+    int y2;
+};
+
+// Fill a rectangle with a solid color, blending it if blend is true
+bool gr_fast_fill(GGLSurface *dst, const GRFastClip &clip,
+                  int x, int y, int w, int h,
+                  const uint8_t color[4], bool blend);
+
+// Copy (RGBX source) or blend (RGBA source) a region of an image
+bool gr_fast_blit(GGLSurface *dst, const GRFastClip &clip,
+                  const GGLSurface *src, int sx, int sy, int w, int h,
+                  int dx, int dy);
+
+// Blend a solid color through an A_8 coverage mask (eg. rendered glyphs)
+bool gr_fast_blit_mask(GGLSurface *dst, const GRFastClip &clip,
+                       const GGLSurface *mask, int sx, int sy, int w, int h,
+                       int dx, int dy, const uint8_t color[4]);
+
+// Draw an A_8 mask with the current gr_color() and clip into the current
+// drawing surface. Returns false if the caller must use pixelflinger.
+bool gr_fast_draw_mask(const GGLSurface *mask, int sx, int sy, int w, int h,
+                       int dx, int dy);
@@ -49,11 +49,16 @@ int gr_fb_width(void);
 int gr_fb_height(void);
 gr_pixel *gr_fb_data(void);
 void gr_flip(void);
+void gr_flip_region(int x, int y, int w, int h);
+bool gr_has_partial_flip(void);
 void gr_fb_blank(bool blank);
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
 void gr_clip(int x, int y, int w, int h);
 void gr_noclip();
+void gr_set_render_bounds(int x, int y, int w, int h);
+void gr_clear_render_bounds();
+bool gr_get_render_bounds(int *x, int *y, int *w, int *h);
 void gr_fill(int x, int y, int w, int h);
 void gr_line(int x0, int y0, int x1, int y1, int width);
 gr_surface gr_render_circle(int radius, unsigned char r, unsigned char g, unsigned char b, unsigned char a);
@@ -63,6 +68,7 @@ int gr_textEx_scaleW(int x, int y, const char *s, void* pFont, int max_width, in
 int gr_getMaxFontHeight(void *font);
 
 void *gr_ttf_loadFont(const char *filename, int size, int dpi);
+void *gr_ttf_loadFontFromMemory(const char *name, const void *data, size_t data_size, int size, int dpi);
 void *gr_ttf_scaleFont(void *font, int max_width, int measured_width);
 void gr_ttf_freeFont(void *font);
 int gr_ttf_textExWH(void *context, int x, int y, const char *s, void *pFont, int max_width, int max_height);
@@ -86,16 +92,28 @@ struct input_event;
 
 int ev_init(void);
 void ev_exit(void);
+// Returns 0 if an event was read, -1 if there was input that did not produce
+// an event, -2 on timeout and -3 if woken up by the timer or ev_wake()
 int ev_get(struct input_event *ev, int timeout_ms);
 int ev_has_mouse(void);
+// Wake up ev_get() at the given CLOCK_MONOTONIC time or never if nullptr
+void ev_set_timer(const struct timespec *deadline);
+// Wake up ev_get() from any thread
+void ev_wake(void);
 
 // Resources
 
 // Returns 0 if no error, else negative.
 int res_create_surface(const char* name, gr_surface* pSurface);
+int res_create_surface_from_memory(const void* data, size_t size, gr_surface* pSurface);
 void res_free_surface(gr_surface surface);
 int res_scale_surface(gr_surface source, gr_surface* destination, float scale_w, float scale_h);
 
+// Raw surface dumps used to cache decoded and scaled images across runs.
+// Returns 0 if no error, else negative.
+int res_read_surface_cache(const char* path, gr_surface* pSurface);
+int res_write_surface_cache(const char* path, gr_surface surface);
+
 int vibrate(int timeout_ms);
 
 #ifdef __cplusplus
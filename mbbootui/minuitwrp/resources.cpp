@@ -54,24 +54,31 @@ static GGLSurface* malloc_surface(size_t data_size)
     return surface;
 }
 
-static int open_png(const char* name, png_structp* png_ptr, png_infop* info_ptr,
-                    png_uint_32* width, png_uint_32* height, png_byte* channels, FILE** fpp)
+static FILE* open_png_file(const char* name)
 {
     char resPath[256];
-    unsigned char header[8];
-    int result = 0;
-    int color_type, bit_depth;
-    size_t bytesRead;
 
     snprintf(resPath, sizeof(resPath)-1, "%s/images/%s.png", tw_resource_path, name);
     resPath[sizeof(resPath)-1] = '\0';
     FILE* fp = fopen(resPath, "rb");
     if (fp == nullptr) {
         fp = fopen(name, "rb");
-        if (fp == nullptr) {
-            result = -1;
-            goto exit;
-        }
+    }
+    return fp;
+}
+
+// Takes ownership of fp
+static int open_png(FILE* fp, png_structp* png_ptr, png_infop* info_ptr,
+                    png_uint_32* width, png_uint_32* height, png_byte* channels, FILE** fpp)
+{
+    unsigned char header[8];
+    int result = 0;
+    int color_type, bit_depth;
+    size_t bytesRead;
+
+    if (fp == nullptr) {
+        result = -1;
+        goto exit;
     }
 
     bytesRead = fread(header, 1, sizeof(header), fp);
@@ -211,7 +218,8 @@ static void transform_rgb_to_draw(unsigned char* input_row,
     }
 }
 
-int res_create_surface_png(const char* name, gr_surface* pSurface)
+// Takes ownership of fp
+static int res_create_surface_png_fp(FILE* fp_in, gr_surface* pSurface)
 {
     GGLSurface* surface = nullptr;
     int result = 0;
@@ -225,7 +233,7 @@ int res_create_surface_png(const char* name, gr_surface* pSurface)
 
     *pSurface = nullptr;
 
-    result = open_png(name, &png_ptr, &info_ptr, &width, &height, &channels, &fp);
+    result = open_png(fp_in, &png_ptr, &info_ptr, &width, &height, &channels, &fp);
     if (result < 0) {
         return result;
     }
@@ -270,7 +278,8 @@ exit:
 }
 
 #ifdef TW_INCLUDE_JPEG
-int res_create_surface_jpg(const char* name, gr_surface* pSurface)
+// Takes ownership of fp
+static int res_create_surface_jpg_fp(FILE* fp, gr_surface* pSurface)
 {
     GGLSurface* surface = nullptr;
     int result = 0, y;
@@ -279,17 +288,9 @@ int res_create_surface_jpg(const char* name, gr_surface* pSurface)
     unsigned char* pData;
     size_t width, height, stride, pixelSize;
 
-    FILE* fp = fopen(name, "rb");
     if (fp == nullptr) {
-        char resPath[256];
-
-        snprintf(resPath, sizeof(resPath)-1, "%s/images/%s", tw_resource_path, name);
-        resPath[sizeof(resPath)-1] = '\0';
-        fp = fopen(resPath, "rb");
-        if (fp == nullptr) {
-            result = -1;
-            goto exit;
-        }
+        result = -1;
+        goto exit;
     }
 
     cinfo.err = jpeg_std_error(&jerr);
@@ -369,6 +370,49 @@ exit:
 }
 #endif
 
+int res_create_surface_png(const char* name, gr_surface* pSurface)
+{
+    return res_create_surface_png_fp(open_png_file(name), pSurface);
+}
+
+#ifdef TW_INCLUDE_JPEG
+int res_create_surface_jpg(const char* name, gr_surface* pSurface)
+{
+    FILE* fp = fopen(name, "rb");
+    if (fp == nullptr) {
+        char resPath[256];
+
+        snprintf(resPath, sizeof(resPath)-1, "%s/images/%s", tw_resource_path, name);
+        resPath[sizeof(resPath)-1] = '\0';
+        fp = fopen(resPath, "rb");
+    }
+    return res_create_surface_jpg_fp(fp, pSurface);
+}
+#endif
+
+// Decode a PNG (or JPEG) image that is already in memory, such as an entry
+// stored in the mapped theme zip. The data is read in place and not modified.
+int res_create_surface_from_memory(const void* data, size_t size, gr_surface* pSurface)
+{
+    *pSurface = nullptr;
+
+    if (!data || size == 0) {
+        return -1;
+    }
+
+#ifdef TW_INCLUDE_JPEG
+    static const unsigned char png_magic[] = { 0x89, 'P', 'N', 'G' };
+
+    if (size < sizeof(png_magic) || memcmp(data, png_magic, sizeof(png_magic)) != 0) {
+        return res_create_surface_jpg_fp(
+                fmemopen(const_cast<void*>(data), size, "rb"), pSurface);
+    }
+#endif
+
+    return res_create_surface_png_fp(
+            fmemopen(const_cast<void*>(data), size, "rb"), pSurface);
+}
+
 int res_create_surface(const char* name, gr_surface* pSurface)
 {
     int ret;
@@ -476,3 +520,102 @@ int res_scale_surface(gr_surface source, gr_surface* destination, float scale_w,
     source = nullptr;
     return 0;
 }
+
+#define SURFACE_CACHE_MAGIC "MBSC"
+#define SURFACE_CACHE_VERSION 1
+
+struct SurfaceCacheHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;
+};
+
+static bool surface_cache_format_supported(int format)
+{
+    return format == GGL_PIXEL_FORMAT_RGBA_8888
+            || format == GGL_PIXEL_FORMAT_RGBX_8888
+            || format == GGL_PIXEL_FORMAT_BGRA_8888;
+}
+
+int res_read_surface_cache(const char* path, gr_surface* pSurface)
+{
+    *pSurface = nullptr;
+
+    FILE* fp = fopen(path, "rb");
+    if (fp == nullptr) {
+        return -1;
+    }
+
+    SurfaceCacheHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1
+            || memcmp(header.magic, SURFACE_CACHE_MAGIC, sizeof(header.magic)) != 0
+            || header.version != SURFACE_CACHE_VERSION
+            || header.width == 0 || header.width > 16384
+            || header.height == 0 || header.height > 16384
+            || !surface_cache_format_supported(header.format)) {
+        fclose(fp);
+        return -2;
+    }
+
+    GGLSurface* surface = init_display_surface(header.width, header.height);
+    if (surface == nullptr) {
+        fclose(fp);
+        return -3;
+    }
+    surface->format = header.format;
+
+    size_t size = (size_t) header.width * header.height * 4;
+    if (fread(surface->data, 1, size, fp) != size) {
+        free(surface);
+        fclose(fp);
+        return -4;
+    }
+
+    fclose(fp);
+    *pSurface = (gr_surface) surface;
+    return 0;
+}
+
+int res_write_surface_cache(const char* path, gr_surface surface)
+{
+    GGLSurface* pSurface = (GGLSurface*) surface;
+    if (pSurface == nullptr || !surface_cache_format_supported(pSurface->format)) {
+        return -1;
+    }
+
+    // Write to a temporary file first so that a partially written cache entry
+    // is never picked up
+    char tmpPath[256];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+
+    FILE* fp = fopen(tmpPath, "wb");
+    if (fp == nullptr) {
+        return -2;
+    }
+
+    SurfaceCacheHeader header;
+    memcpy(header.magic, SURFACE_CACHE_MAGIC, sizeof(header.magic));
+    header.version = SURFACE_CACHE_VERSION;
+    header.width = pSurface->width;
+    header.height = pSurface->height;
+    header.format = pSurface->format;
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    for (unsigned int y = 0; ok && y < pSurface->height; ++y) {
+        ok = fwrite(pSurface->data + y * pSurface->stride * 4, 4,
+                    pSurface->width, fp) == pSurface->width;
+    }
+    if (fclose(fp) != 0) {
+        ok = false;
+    }
+
+    if (!ok || rename(tmpPath, path) != 0) {
+        unlink(tmpPath);
+        return -3;
+    }
+
+    return 0;
+}
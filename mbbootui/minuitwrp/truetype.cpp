@@ -6,6 +6,7 @@
 #include <stdio.h>
 
 #include "minui.h"
+#include "graphics_fast.h"
 
 #include <cutils/hashmap.h>
 #include <ft2build.h>
@@ -18,14 +19,47 @@
 #define STRING_CACHE_MAX_ENTRIES 400
 #define STRING_CACHE_TRUNCATE_ENTRIES 150
 
+// Rendered glyphs of each font are packed into rows ("shelves") of a single
+// A_8 surface. When it runs out of space, the least recently drawn shelf is
+// cleared and reused.
+#define GLYPH_ATLAS_WIDTH 512
+#define GLYPH_ATLAS_HEIGHT 512
+#define GLYPH_ATLAS_MAX_SHELVES 64
+
+// Special values for TrueTypeCacheEntry::atlas_shelf
+#define GLYPH_NOT_RENDERED -1
+#define GLYPH_TOO_LARGE -2
+#define GLYPH_EMPTY -3
+
+typedef struct
+{
+    int y;
+    int height;
+    int next_x;
+    unsigned int last_used;
+} GlyphAtlasShelf;
+
+typedef struct
+{
+    GGLSurface surface;
+    GlyphAtlasShelf shelves[GLYPH_ATLAS_MAX_SHELVES];
+    int shelves_len;
+    int used_height;
+    unsigned int clock;
+} GlyphAtlas;
+
 typedef struct
 {
     int size;
     int dpi;
     char *path;
+    // For fonts loaded from memory, the font file data. It is not copied and
+    // path is only used as a name.
+    const unsigned char *data;
+    size_t data_size;
 } TrueTypeFontKey;
 
-typedef struct
+typedef struct TrueTypeFont
 {
     int type;
     int refcount;
@@ -35,17 +69,32 @@ typedef struct
     int base;
     FT_Face face;
     Hashmap *glyph_cache;
+    GlyphAtlas *atlas;
     Hashmap *string_cache;
     struct StringCacheEntry *string_cache_head;
     struct StringCacheEntry *string_cache_tail;
     pthread_mutex_t mutex;
     TrueTypeFontKey *key;
+    // Scaled variants are owned by the font they were created from, so that
+    // they never outlive its (possibly memory-backed) face data
+    struct TrueTypeFont *scaled_from;
+    struct TrueTypeFont *scaled_head;
+    struct TrueTypeFont *scaled_next;
 } TrueTypeFont;
 
 typedef struct
 {
     FT_BBox bbox;
-    FT_BitmapGlyph glyph;
+    int advance;
+    // Position of the rendered bitmap in the atlas. atlas_shelf is
+    // GLYPH_NOT_RENDERED if the glyph has not been rendered or was evicted.
+    int atlas_shelf;
+    int atlas_x;
+    int atlas_y;
+    int left;
+    int top;
+    int width;
+    int height;
 } TrueTypeCacheEntry;
 
 typedef struct
@@ -54,9 +103,17 @@ typedef struct
     int max_width;
 } StringCacheKey;
 
+typedef struct
+{
+    int char_index;
+    int x;
+} GlyphPosition;
+
 struct StringCacheEntry
 {
-    GGLSurface surface;
+    int width;
+    GlyphPosition *glyphs;
+    int glyphs_len;
     int rendered_bytes; // number of bytes from C string rendered, not number of UTF8 characters!
     StringCacheKey *key;
     struct StringCacheEntry *prev;
@@ -165,7 +222,9 @@ static bool gr_ttf_font_cache_equals(void *keyA, void *keyB)
 {
     TrueTypeFontKey *a = (TrueTypeFontKey *)keyA;
     TrueTypeFontKey *b = (TrueTypeFontKey *)keyB;
-    return (a->size == b->size) && (a->dpi == b->dpi) && !strcmp(a->path, b->path);
+    return (a->size == b->size) && (a->dpi == b->dpi)
+            && (a->data == b->data) && (a->data_size == b->data_size)
+            && !strcmp(a->path, b->path);
 }
 
 static int gr_ttf_font_cache_hash(void *key)
@@ -175,58 +234,50 @@ static int gr_ttf_font_cache_hash(void *key)
     uint32_t hash = fnv_hash(k->path, strlen(k->path));
     hash = fnv_hash_add(hash, k->size);
     hash = fnv_hash_add(hash, k->dpi);
+    hash = fnv_hash_add(hash, (uint32_t)(uintptr_t)k->data);
     return hash;
 }
 
-void *gr_ttf_loadFont(const char *filename, int size, int dpi)
+// Must be called with font_data.mutex held. The new font is not added to the
+// font cache.
+static TrueTypeFont *gr_ttf_createFont(const TrueTypeFontKey *k)
 {
     int error;
-    TrueTypeFont *res = nullptr;
-    TrueTypeFontKey *key = nullptr;
-
-    pthread_mutex_lock(&font_data.mutex);
-
-    if (font_data.fonts) {
-        TrueTypeFontKey k = {
-            .size = size,
-            .dpi = dpi,
-            .path = (char*)filename
-        };
-
-        res = (TrueTypeFont *)hashmapGet(font_data.fonts, &k);
-        if (res) {
-            ++res->refcount;
-            goto exit;
-        }
-    }
+    TrueTypeFont *res;
+    TrueTypeFontKey *key;
 
     if (!font_data.ft_library) {
         error = FT_Init_FreeType(&font_data.ft_library);
         if (error) {
             fprintf(stderr, "Failed to init libfreetype! %d\n", error);
-            goto exit;
+            return nullptr;
         }
     }
 
     FT_Face face;
-    error = FT_New_Face(font_data.ft_library, filename, 0, &face);
+    if (k->data) {
+        error = FT_New_Memory_Face(font_data.ft_library, k->data,
+                                   (FT_Long) k->data_size, 0, &face);
+    } else {
+        error = FT_New_Face(font_data.ft_library, k->path, 0, &face);
+    }
     if (error) {
-        fprintf(stderr, "Failed to load truetype face %s: %d\n", filename, error);
-        goto exit;
+        fprintf(stderr, "Failed to load truetype face %s: %d\n", k->path, error);
+        return nullptr;
     }
 
-    error = FT_Set_Char_Size(face, 0, size * 16, dpi, dpi);
+    error = FT_Set_Char_Size(face, 0, k->size * 16, k->dpi, k->dpi);
     if (error) {
-         fprintf(stderr, "Failed to set truetype face size to %d, dpi %d: %d\n", size, dpi, error);
+         fprintf(stderr, "Failed to set truetype face size to %d, dpi %d: %d\n", k->size, k->dpi, error);
          FT_Done_Face(face);
-         goto exit;
+         return nullptr;
     }
 
     res = (TrueTypeFont *)malloc(sizeof(TrueTypeFont));
     memset(res, 0, sizeof(TrueTypeFont));
     res->type = FONT_TYPE_TTF;
-    res->size = size;
-    res->dpi = dpi;
+    res->size = k->size;
+    res->dpi = k->dpi;
     res->face = face;
     res->max_height = -1;
     res->base = -1;
@@ -235,25 +286,79 @@ void *gr_ttf_loadFont(const char *filename, int size, int dpi)
     res->string_cache = hashmapCreate(128, gr_ttf_string_cache_hash, gr_ttf_string_cache_equals);
     pthread_mutex_init(&res->mutex, 0);
 
-    if (!font_data.fonts) {
-        font_data.fonts = hashmapCreate(4, gr_ttf_font_cache_hash, gr_ttf_font_cache_equals);
-    }
-
     key = (TrueTypeFontKey *) malloc(sizeof(TrueTypeFontKey));
     memset(key, 0, sizeof(TrueTypeFontKey));
-    key->path = strdup(filename);
-    key->size = size;
-    key->dpi = dpi;
+    key->path = strdup(k->path);
+    key->size = k->size;
+    key->dpi = k->dpi;
+    key->data = k->data;
+    key->data_size = k->data_size;
 
     res->key = key;
 
-    hashmapPut(font_data.fonts, key, res);
+    return res;
+}
+
+static void *gr_ttf_loadFontKey(const TrueTypeFontKey *k)
+{
+    TrueTypeFont *res = nullptr;
+
+    pthread_mutex_lock(&font_data.mutex);
+
+    if (font_data.fonts) {
+        res = (TrueTypeFont *)hashmapGet(font_data.fonts, (void *)k);
+        if (res) {
+            ++res->refcount;
+            goto exit;
+        }
+    }
+
+    res = gr_ttf_createFont(k);
+    if (!res) {
+        goto exit;
+    }
+
+    if (!font_data.fonts) {
+        font_data.fonts = hashmapCreate(4, gr_ttf_font_cache_hash, gr_ttf_font_cache_equals);
+    }
+
+    hashmapPut(font_data.fonts, res->key, res);
 
 exit:
     pthread_mutex_unlock(&font_data.mutex);
     return res;
 }
 
+void *gr_ttf_loadFont(const char *filename, int size, int dpi)
+{
+    TrueTypeFontKey k = {
+        .size = size,
+        .dpi = dpi,
+        .path = (char*)filename,
+        .data = nullptr,
+        .data_size = 0
+    };
+
+    return gr_ttf_loadFontKey(&k);
+}
+
+// The data is used in place, so it must remain valid until the font is freed.
+// name identifies the font in the cache and in messages.
+void *gr_ttf_loadFontFromMemory(const char *name, const void *data,
+                                size_t data_size, int size, int dpi)
+{
+    TrueTypeFontKey k = {
+        .size = size,
+        .dpi = dpi,
+        .path = (char*)name,
+        .data = (const unsigned char *)data,
+        .data_size = data_size
+    };
+
+    return gr_ttf_loadFontKey(&k);
+}
+
+// The returned font belongs to font and is freed along with it.
 void *gr_ttf_scaleFont(void *font, int max_width, int measured_width)
 {
     if (!font) {
@@ -266,15 +371,38 @@ void *gr_ttf_scaleFont(void *font, int max_width, int measured_width)
     if (new_size < 1) {
         new_size = 1;
     }
-    const char* file = f->key->path;
-    int dpi = f->dpi;
-    return gr_ttf_loadFont(file, new_size, dpi);
+
+    TrueTypeFont *base = f->scaled_from ? f->scaled_from : f;
+    TrueTypeFont *res;
+
+    pthread_mutex_lock(&font_data.mutex);
+
+    for (res = base->scaled_head; res; res = res->scaled_next) {
+        if (res->size == new_size) {
+            goto exit;
+        }
+    }
+
+    {
+        TrueTypeFontKey k = *base->key;
+        k.size = new_size;
+
+        res = gr_ttf_createFont(&k);
+        if (res) {
+            res->scaled_from = base;
+            res->scaled_next = base->scaled_head;
+            base->scaled_head = res;
+        }
+    }
+
+exit:
+    pthread_mutex_unlock(&font_data.mutex);
+    return res;
 }
 
 static bool gr_ttf_freeFontCache(void *key, void *value, void *context __unused)
 {
     TrueTypeCacheEntry *e = (TrueTypeCacheEntry *)value;
-    FT_Done_Glyph((FT_Glyph)e->glyph);
     free(e);
     free(key);
     return true;
@@ -287,18 +415,44 @@ static bool gr_ttf_freeStringCache(void *key, void *value, void *context __unuse
     free(k);
 
     StringCacheEntry *e = (StringCacheEntry *)value;
-    free(e->surface.data);
+    free(e->glyphs);
     free(e);
     return true;
 }
 
+// Must be called with font_data.mutex held
+static void gr_ttf_destroyFont(TrueTypeFont *d)
+{
+    while (d->scaled_head) {
+        TrueTypeFont *next = d->scaled_head->scaled_next;
+        gr_ttf_destroyFont(d->scaled_head);
+        d->scaled_head = next;
+    }
+
+    free(d->key->path);
+    free(d->key);
+
+    FT_Done_Face(d->face);
+    hashmapForEach(d->string_cache, gr_ttf_freeStringCache, nullptr);
+    hashmapFree(d->string_cache);
+    hashmapForEach(d->glyph_cache, gr_ttf_freeFontCache, nullptr);
+    hashmapFree(d->glyph_cache);
+    if (d->atlas) {
+        free(d->atlas->surface.data);
+        free(d->atlas);
+    }
+    pthread_mutex_destroy(&d->mutex);
+    free(d);
+}
+
 void gr_ttf_freeFont(void *font)
 {
     pthread_mutex_lock(&font_data.mutex);
 
     TrueTypeFont *d = (TrueTypeFont *)font;
 
-    if (--d->refcount == 0) {
+    // Scaled fonts are freed with the font they were created from
+    if (!d->scaled_from && --d->refcount == 0) {
         hashmapRemove(font_data.fonts, d->key);
 
         if (hashmapSize(font_data.fonts) == 0) {
@@ -306,16 +460,7 @@ void gr_ttf_freeFont(void *font)
             font_data.fonts = nullptr;
         }
 
-        free(d->key->path);
-        free(d->key);
-
-        FT_Done_Face(d->face);
-        hashmapForEach(d->string_cache, gr_ttf_freeStringCache, nullptr);
-        hashmapFree(d->string_cache);
-        hashmapForEach(d->glyph_cache, gr_ttf_freeFontCache, nullptr);
-        hashmapFree(d->glyph_cache);
-        pthread_mutex_destroy(&d->mutex);
-        free(d);
+        gr_ttf_destroyFont(d);
     }
 
     pthread_mutex_unlock(&font_data.mutex);
@@ -326,18 +471,20 @@ static TrueTypeCacheEntry *gr_ttf_glyph_cache_peek(TrueTypeFont *font, int char_
     return (TrueTypeCacheEntry *)hashmapGet(font->glyph_cache, &char_index);
 }
 
+// Only loads the glyph metrics. The bitmap is rendered into the atlas when the
+// glyph is first drawn.
 static TrueTypeCacheEntry *gr_ttf_glyph_cache_get(TrueTypeFont *font, int char_index)
 {
     TrueTypeCacheEntry *res = (TrueTypeCacheEntry *)hashmapGet(font->glyph_cache, &char_index);
     if (!res) {
-        int error = FT_Load_Glyph(font->face, char_index, FT_LOAD_RENDER);
+        int error = FT_Load_Glyph(font->face, char_index, FT_LOAD_DEFAULT);
         if (error) {
             fprintf(stderr, "Failed to load glyph idx %d: %d\n", char_index, error);
             return nullptr;
         }
 
-        FT_BitmapGlyph glyph;
-        error = FT_Get_Glyph(font->face->glyph, (FT_Glyph*)&glyph);
+        FT_Glyph glyph;
+        error = FT_Get_Glyph(font->face->glyph, &glyph);
         if (error) {
             fprintf(stderr, "Failed to copy glyph %d: %d\n", char_index, error);
             return nullptr;
@@ -345,8 +492,10 @@ static TrueTypeCacheEntry *gr_ttf_glyph_cache_get(TrueTypeFont *font, int char_i
 
         res = (TrueTypeCacheEntry *)malloc(sizeof(TrueTypeCacheEntry));
         memset(res, 0, sizeof(TrueTypeCacheEntry));
-        res->glyph = glyph;
-        FT_Glyph_Get_CBox((FT_Glyph)glyph, FT_GLYPH_BBOX_PIXELS, &res->bbox);
+        res->advance = glyph->advance.x >> 16;
+        res->atlas_shelf = GLYPH_NOT_RENDERED;
+        FT_Glyph_Get_CBox(glyph, FT_GLYPH_BBOX_PIXELS, &res->bbox);
+        FT_Done_Glyph(glyph);
 
         int *key = (int *)malloc(sizeof(int));
         *key = char_index;
@@ -357,31 +506,146 @@ static TrueTypeCacheEntry *gr_ttf_glyph_cache_get(TrueTypeFont *font, int char_i
     return res;
 }
 
-static int gr_ttf_copy_glyph_to_surface(GGLSurface *dest, FT_BitmapGlyph glyph, int offX, int offY, int base)
+static bool gr_ttf_atlas_evict_glyph(void *key __unused, void *value, void *context)
 {
-    unsigned y;
-    uint8_t *src_itr = glyph->bitmap.buffer;
-    uint8_t *dest_itr = dest->data;
+    TrueTypeCacheEntry *e = (TrueTypeCacheEntry *)value;
+    int shelf = *(int *)context;
+    if (e->atlas_shelf >= 0 && (shelf < 0 || e->atlas_shelf == shelf)) {
+        e->atlas_shelf = GLYPH_NOT_RENDERED;
+    }
+    return true;
+}
 
-    if (glyph->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY) {
-        fprintf(stderr, "Unsupported pixel mode in FT_BitmapGlyph %d\n", glyph->bitmap.pixel_mode);
-        return -1;
+// Returns the index of a shelf with room for a w x h bitmap, evicting the
+// glyphs on the least recently used shelf if necessary
+static int gr_ttf_atlas_find_shelf(TrueTypeFont *font, int w, int h)
+{
+    GlyphAtlas *atlas = font->atlas;
+    int best = -1;
+    int i;
+
+    // Reuse the shortest shelf that fits without wasting too much height
+    for (i = 0; i < atlas->shelves_len; ++i) {
+        GlyphAtlasShelf *shelf = &atlas->shelves[i];
+        if (shelf->height >= h && shelf->height <= h + h / 4 + 2
+                && shelf->next_x + w <= GLYPH_ATLAS_WIDTH
+                && (best < 0 || shelf->height < atlas->shelves[best].height)) {
+            best = i;
+        }
+    }
+    if (best >= 0) {
+        return best;
+    }
+
+    if (atlas->shelves_len < GLYPH_ATLAS_MAX_SHELVES
+            && atlas->used_height + h <= GLYPH_ATLAS_HEIGHT) {
+        GlyphAtlasShelf *shelf = &atlas->shelves[atlas->shelves_len];
+        shelf->y = atlas->used_height;
+        shelf->height = h;
+        shelf->next_x = 0;
+        shelf->last_used = atlas->clock;
+        atlas->used_height += h;
+        return atlas->shelves_len++;
     }
 
-    dest_itr += (offY + base - glyph->top)*dest->stride + (offX + glyph->left);
+    for (i = 0; i < atlas->shelves_len; ++i) {
+        GlyphAtlasShelf *shelf = &atlas->shelves[i];
+        if (shelf->height >= h && (best < 0
+                || shelf->last_used < atlas->shelves[best].last_used)) {
+            best = i;
+        }
+    }
 
-    // FIXME: if glyph->left is negative and everything else is 0 (e.g. letter 'j' in Roboto-Regular),
-    // the result might end up being before the buffer - I'm not sure how to properly handle this.
-    if (dest_itr < dest->data) {
-        dest_itr = dest->data;
+    if (best < 0) {
+        // No shelf is tall enough, so start over with an empty atlas
+        int all = -1;
+        hashmapForEach(font->glyph_cache, gr_ttf_atlas_evict_glyph, &all);
+        atlas->shelves_len = 0;
+        atlas->used_height = 0;
+        return gr_ttf_atlas_find_shelf(font, w, h);
     }
 
-    for (y = 0; y < glyph->bitmap.rows; ++y) {
-        memcpy(dest_itr, src_itr, glyph->bitmap.width);
-        src_itr += glyph->bitmap.pitch;
-        dest_itr += dest->stride;
+    hashmapForEach(font->glyph_cache, gr_ttf_atlas_evict_glyph, &best);
+    atlas->shelves[best].next_x = 0;
+    return best;
+}
+
+// Renders the glyph into the atlas if it isn't already there. Returns false
+// if the glyph can't be drawn from the atlas.
+static bool gr_ttf_atlas_add_glyph(TrueTypeFont *font, int char_index,
+                                   TrueTypeCacheEntry *ent)
+{
+    if (ent->atlas_shelf != GLYPH_NOT_RENDERED) {
+        return ent->atlas_shelf >= 0;
     }
-    return 0;
+
+    int error = FT_Load_Glyph(font->face, char_index, FT_LOAD_RENDER);
+    if (error) {
+        fprintf(stderr, "Failed to render glyph idx %d: %d\n", char_index, error);
+        return false;
+    }
+
+    FT_GlyphSlot slot = font->face->glyph;
+    if (slot->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY) {
+        fprintf(stderr, "Unsupported pixel mode in FT_BitmapGlyph %d\n", slot->bitmap.pixel_mode);
+        return false;
+    }
+
+    int w = slot->bitmap.width;
+    int h = slot->bitmap.rows;
+
+    ent->left = slot->bitmap_left;
+    ent->top = slot->bitmap_top;
+    ent->width = w;
+    ent->height = h;
+
+    if (w == 0 || h == 0) {
+        ent->atlas_shelf = GLYPH_EMPTY;
+        return false;
+    } else if (w > GLYPH_ATLAS_WIDTH || h > GLYPH_ATLAS_HEIGHT) {
+        // Too large for the atlas. These are drawn straight from FreeType.
+        ent->atlas_shelf = GLYPH_TOO_LARGE;
+        return false;
+    }
+
+    if (!font->atlas) {
+        font->atlas = (GlyphAtlas *)calloc(1, sizeof(GlyphAtlas));
+        if (!font->atlas) {
+            return false;
+        }
+        font->atlas->surface.version = sizeof(GGLSurface);
+        font->atlas->surface.width = GLYPH_ATLAS_WIDTH;
+        font->atlas->surface.height = GLYPH_ATLAS_HEIGHT;
+        font->atlas->surface.stride = GLYPH_ATLAS_WIDTH;
+        font->atlas->surface.format = GGL_PIXEL_FORMAT_A_8;
+        font->atlas->surface.data = (GGLubyte*)calloc(
+                GLYPH_ATLAS_WIDTH * GLYPH_ATLAS_HEIGHT, 1);
+        if (!font->atlas->surface.data) {
+            free(font->atlas);
+            font->atlas = nullptr;
+            return false;
+        }
+    }
+
+    GlyphAtlas *atlas = font->atlas;
+    int index = gr_ttf_atlas_find_shelf(font, w, h);
+    GlyphAtlasShelf *shelf = &atlas->shelves[index];
+
+    ent->atlas_shelf = index;
+    ent->atlas_x = shelf->next_x;
+    ent->atlas_y = shelf->y;
+    shelf->next_x += w;
+
+    uint8_t *src_itr = slot->bitmap.buffer;
+    uint8_t *dest_itr = atlas->surface.data
+            + ent->atlas_y * atlas->surface.stride + ent->atlas_x;
+    for (int y = 0; y < h; ++y) {
+        memcpy(dest_itr, src_itr, w);
+        src_itr += slot->bitmap.pitch;
+        dest_itr += atlas->surface.stride;
+    }
+
+    return true;
 }
 
 static void gr_ttf_calcMaxFontHeight(TrueTypeFont *f)
@@ -435,8 +699,9 @@ static void gr_ttf_calcMaxFontHeight(TrueTypeFont *f)
     f->base += f->size / 4;
 }
 
-// returns number of bytes from const char *text rendered to fit max_width, not number of UTF8 characters!
-static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const char *text, int max_width)
+// Computes the glyph positions for the text. Returns number of bytes from const
+// char *text laid out to fit max_width, not number of UTF8 characters!
+static int gr_ttf_layout_text(TrueTypeFont *font, StringCacheEntry *entry, const char *text, int max_width)
 {
     TrueTypeFont *f = font;
     TrueTypeCacheEntry *ent;
@@ -444,9 +709,7 @@ static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const cha
     int utf_bytes = 0;
     unsigned int unicode = 0;
     int i, x, diff, char_idx, prev_idx = 0;
-    int height;
     FT_Vector delta;
-    uint8_t *data = nullptr;
     const char *text_itr = text;
     int *char_idxs;
     int char_idxs_len = 0;
@@ -463,7 +726,7 @@ static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const cha
 
         ent = gr_ttf_glyph_cache_get(f, char_idx);
         if (ent) {
-            diff = ent->glyph->root.advance.x >> 16;
+            diff = ent->advance;
 
             if (FT_HAS_KERNING(f->face) && prev_idx && char_idx) {
                 FT_Get_Kerning(f->face, prev_idx, char_idx, FT_KERNING_DEFAULT, &delta);
@@ -489,20 +752,13 @@ static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const cha
         return -1;
     }
 
-    height = font->max_height;
-
-    data = (uint8_t *) malloc(total_w*height);
-    memset(data, 0, total_w*height);
+    entry->width = total_w;
+    entry->glyphs = (GlyphPosition *) malloc(
+            MAX(char_idxs_len, 1) * sizeof(GlyphPosition));
+    entry->glyphs_len = 0;
     x = 0;
     prev_idx = 0;
 
-    surface->version = sizeof(*surface);
-    surface->width = total_w;
-    surface->height = height;
-    surface->stride = total_w;
-    surface->data = (GGLubyte*)data;
-    surface->format = GGL_PIXEL_FORMAT_A_8;
-
     for (i = 0; i < char_idxs_len; ++i) {
         char_idx = char_idxs[i];
         if (FT_HAS_KERNING(f->face) && prev_idx && char_idx) {
@@ -512,8 +768,10 @@ static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const cha
 
         ent = gr_ttf_glyph_cache_get(f, char_idx);
         if (ent) {
-            gr_ttf_copy_glyph_to_surface(surface, ent->glyph, x, 0, font->base);
-            x += ent->glyph->root.advance.x >> 16;
+            entry->glyphs[entry->glyphs_len].char_index = char_idx;
+            entry->glyphs[entry->glyphs_len].x = x;
+            ++entry->glyphs_len;
+            x += ent->advance;
         }
 
         prev_idx = char_idx;
@@ -545,7 +803,7 @@ static StringCacheEntry *gr_ttf_string_cache_get(TrueTypeFont *font, const char
     if (!res) {
         res = (StringCacheEntry *)malloc(sizeof(StringCacheEntry));
         memset(res, 0, sizeof(StringCacheEntry));
-        res->rendered_bytes = gr_ttf_render_text(font, &res->surface, text, max_width);
+        res->rendered_bytes = gr_ttf_layout_text(font, res, text, max_width);
         if (res->rendered_bytes < 0) {
             free(res);
             return nullptr;
@@ -612,7 +870,7 @@ int gr_ttf_measureEx(const char *s, void *font)
     pthread_mutex_lock(&f->mutex);
     StringCacheEntry *e = gr_ttf_string_cache_get(f, s, -1);
     if (e) {
-        res = e->surface.width;
+        res = e->width;
     }
     pthread_mutex_unlock(&f->mutex);
 
@@ -661,13 +919,74 @@ int gr_ttf_maxExW(const char *s, void *font, int max_width)
             continue;
         }
 
-        total_w += ent->glyph->root.advance.x >> 16;
+        total_w += ent->advance;
         max_bytes += utf_bytes;
     }
     pthread_mutex_unlock(&f->mutex);
     return max_bytes;
 }
 
+// Blend a region of an A_8 surface with the current color, clipped to the given
+// box
+static void gr_ttf_draw_mask(GGLContext *gl, GGLSurface *surface,
+                             int sx, int sy, int w, int h, int dx, int dy,
+                             int clip_x1, int clip_y1, int clip_x2, int clip_y2)
+{
+    int x1 = MAX(dx, clip_x1);
+    int y1 = MAX(dy, clip_y1);
+    int x2 = MIN(dx + w, clip_x2);
+    int y2 = MIN(dy + h, clip_y2);
+    if (x1 >= x2 || y1 >= y2) {
+        return;
+    }
+
+    sx += x1 - dx;
+    sy += y1 - dy;
+
+    if (gr_fast_draw_mask(surface, sx, sy, x2 - x1, y2 - y1, x1, y1)) {
+        return;
+    }
+
+    gl->bindTexture(gl, surface);
+    gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
+    gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+    gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+
+    gl->enable(gl, GGL_TEXTURE_2D);
+    gl->texCoord2i(gl, sx - x1, sy - y1);
+    gl->recti(gl, x1, y1, x2, y2);
+    gl->disable(gl, GGL_TEXTURE_2D);
+}
+
+// Draw a glyph that doesn't fit in the atlas directly from FreeType's bitmap
+static void gr_ttf_draw_large_glyph(GGLContext *gl, TrueTypeFont *font,
+                                    int char_index, int x, int y,
+                                    int clip_x1, int clip_y1,
+                                    int clip_x2, int clip_y2)
+{
+    if (FT_Load_Glyph(font->face, char_index, FT_LOAD_RENDER) != 0) {
+        return;
+    }
+
+    FT_GlyphSlot slot = font->face->glyph;
+    if (slot->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY || slot->bitmap.pitch <= 0) {
+        return;
+    }
+
+    GGLSurface surface;
+    memset(&surface, 0, sizeof(surface));
+    surface.version = sizeof(surface);
+    surface.width = slot->bitmap.width;
+    surface.height = slot->bitmap.rows;
+    surface.stride = slot->bitmap.pitch;
+    surface.data = (GGLubyte*)slot->bitmap.buffer;
+    surface.format = GGL_PIXEL_FORMAT_A_8;
+
+    gr_ttf_draw_mask(gl, &surface, 0, 0, surface.width, surface.height,
+                     x + slot->bitmap_left, y + font->base - slot->bitmap_top,
+                     clip_x1, clip_y1, clip_x2, clip_y2);
+}
+
 int gr_ttf_textExWH(void *context, int x, int y, const char *s, void *pFont, int max_width, int max_height)
 {
     GGLContext *gl = (GGLContext *)context;
@@ -689,7 +1008,7 @@ int gr_ttf_textExWH(void *context, int x, int y, const char *s, void *pFont, int
         return -1;
     }
 
-    int y_bottom = y + e->surface.height;
+    int y_bottom = y + font->max_height;
     int res = e->rendered_bytes;
 
     if (max_height != -1 && max_height < y_bottom) {
@@ -700,15 +1019,38 @@ int gr_ttf_textExWH(void *context, int x, int y, const char *s, void *pFont, int
         }
     }
 
-    gl->bindTexture(gl, &e->surface);
-    gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
-    gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+    // Glyphs are clipped to the box the whole string would occupy
+    int x_right = x + e->width;
 
-    gl->enable(gl, GGL_TEXTURE_2D);
-    gl->texCoord2i(gl, -x, -y);
-    gl->recti(gl, x, y, x + e->surface.width, y_bottom);
-    gl->disable(gl, GGL_TEXTURE_2D);
+    for (int i = 0; i < e->glyphs_len; ++i) {
+        int char_idx = e->glyphs[i].char_index;
+        int gx = x + e->glyphs[i].x;
+
+        TrueTypeCacheEntry *ent = gr_ttf_glyph_cache_get(font, char_idx);
+        if (!ent) {
+            continue;
+        }
+
+        if (!gr_ttf_atlas_add_glyph(font, char_idx, ent)) {
+            if (ent->atlas_shelf == GLYPH_TOO_LARGE) {
+                gr_ttf_draw_large_glyph(gl, font, char_idx, gx, y,
+                                        x, y, x_right, y_bottom);
+            }
+            continue;
+        }
+
+        GlyphAtlas *atlas = font->atlas;
+        atlas->shelves[ent->atlas_shelf].last_used = atlas->clock;
+
+        gr_ttf_draw_mask(gl, &atlas->surface, ent->atlas_x, ent->atlas_y,
+                         ent->width, ent->height,
+                         gx + ent->left, y + font->base - ent->top,
+                         x, y, x_right, y_bottom);
+    }
+
+    if (font->atlas) {
+        ++font->atlas->clock;
+    }
 
     pthread_mutex_unlock(&font->mutex);
     return res;
@@ -734,7 +1076,7 @@ static bool gr_ttf_dump_stats_count_string_cache(void *key __unused, void *value
 {
     int *string_cache_size = (int *) context;
     StringCacheEntry *e = (StringCacheEntry *) value;
-    *string_cache_size += e->surface.height*e->surface.width + sizeof(StringCacheEntry);
+    *string_cache_size += e->glyphs_len * sizeof(GlyphPosition) + sizeof(StringCacheEntry);
     return true;
 }
 
@@ -754,10 +1096,13 @@ static bool gr_ttf_dump_stats_font(void *key, void *value, void *context)
            "    max_height: %d\n"
            "    base: %d\n"
            "    glyph_cache: %zu entries\n"
+           "    glyph_atlas: %d shelves, %d/%d rows used\n"
            "    string_cache: %zu entries (%.2f kB)\n",
            k->path, k->size, k->dpi,
            f->refcount, f->max_height, f->base,
            hashmapSize(f->glyph_cache),
+           f->atlas ? f->atlas->shelves_len : 0,
+           f->atlas ? f->atlas->used_height : 0, GLYPH_ATLAS_HEIGHT,
            hashmapSize(f->string_cache), ((double)string_cache_size)/1024);
 
     pthread_mutex_unlock(&f->mutex);
@@ -494,13 +494,34 @@ static bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
     return false;
 }
 
+/*
+ * Return a pointer into the mapping for a STORED entry.  The offset and
+ * compressed length were bounds checked when the archive was opened, so the
+ * only other requirement is that the lengths agree.
+ */
+const unsigned char* mzGetStoredZipEntryData(const ZipArchive* pArchive,
+        const ZipEntry* pEntry)
+{
+    if (pEntry->compression != STORED
+            || pEntry->compLen != pEntry->uncompLen) {
+        return NULL;
+    }
+    return pArchive->addr + pEntry->offset;
+}
+
 /* Call processFunction on the uncompressed data of a STORED entry.
  */
 static bool processStoredEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
-    return processFunction(pArchive->addr + pEntry->offset, pEntry->uncompLen, cookie);
+    const unsigned char *data = mzGetStoredZipEntryData(pArchive, pEntry);
+    if (data == NULL) {
+        LOGE("Invalid stored entry '%.*s'\n",
+                (int)pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+    return processFunction(data, pEntry->uncompLen, cookie);
 }
 
 static bool processDeflatedEntry(const ZipArchive *pArchive,
@@ -94,6 +94,14 @@ INLINE long mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
     return pEntry->uncompLen;
 }
 
+/*
+ * Return a pointer to the contents of a STORED entry within the mapped
+ * archive, or NULL if the entry is compressed.  No data is copied; the
+ * pointer is valid until the archive's mapping is released.
+ */
+const unsigned char* mzGetStoredZipEntryData(const ZipArchive* pArchive,
+        const ZipEntry* pEntry);
+
 /*
  * Type definition for the callback function used by
  * mzProcessZipEntryContents().
@@ -104,7 +112,9 @@ typedef bool (*ProcessZipEntryContentsFunction)(const unsigned char *data,
 /*
  * Stream the uncompressed data through the supplied function,
  * passing cookie to it each time it gets called.  processFunction
- * may be called more than once.
+ * may be called more than once.  STORED entries are passed directly
+ * from the mapping in a single call; DEFLATED entries are inflated in
+ * 32 KiB chunks, so neither needs a buffer for the whole entry.
  *
  * If processFunction returns false, the operation is abandoned and
  * mzProcessZipEntryContents() immediately returns false.
@@ -0,0 +1,483 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include "mblog/binary_logger.h"
+
+struct Segment
+{
+    uint64_t offset;
+    uint64_t vaddr;
+    uint64_t filesz;
+};
+
+struct Image
+{
+    std::vector<unsigned char> data;
+    std::vector<Segment> segments;
+    uint64_t base;
+};
+
+struct Arg
+{
+    uint8_t type;
+    uint64_t value;
+    std::string str;
+};
+
+static void usage(FILE *stream)
+{
+    fprintf(stream,
+            "Usage: mblogdecode <executable> <binary log file>\n\n"
+            "Decodes a log written by mb::log::BinaryLogger. The executable\n"
+            "must be the exact (stripped or unstripped) build that wrote the\n"
+            "log since the format strings are read from it.\n");
+}
+
+static bool read_file(const char *path, std::vector<unsigned char> &data)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "%s: Failed to open file: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    unsigned char buf[65536];
+    size_t n;
+
+    data.clear();
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        data.insert(data.end(), buf, buf + n);
+    }
+
+    bool ret = !ferror(fp);
+    if (!ret) {
+        fprintf(stderr, "%s: Failed to read file\n", path);
+    }
+
+    fclose(fp);
+    return ret;
+}
+
+static uint64_t read_le(const unsigned char *ptr, size_t size)
+{
+    uint64_t value = 0;
+    for (size_t i = size; i > 0; --i) {
+        value = (value << 8) | ptr[i - 1];
+    }
+    return value;
+}
+
+static bool load_image(const char *path, Image &image)
+{
+    if (!read_file(path, image.data)) {
+        return false;
+    }
+
+    const std::vector<unsigned char> &d = image.data;
+
+    if (d.size() < 52 || memcmp(d.data(), "\x7f" "ELF", 4) != 0) {
+        fprintf(stderr, "%s: Not an ELF file\n", path);
+        return false;
+    } else if (d[5] != 1) {
+        fprintf(stderr, "%s: Only little endian ELF files are supported\n",
+                path);
+        return false;
+    }
+
+    bool is_64 = d[4] == 2;
+    uint64_t phoff;
+    uint64_t phentsize;
+    uint64_t phnum;
+
+    if (is_64) {
+        if (d.size() < 64) {
+            fprintf(stderr, "%s: Truncated ELF header\n", path);
+            return false;
+        }
+        phoff = read_le(&d[32], 8);
+        phentsize = read_le(&d[54], 2);
+        phnum = read_le(&d[56], 2);
+    } else {
+        phoff = read_le(&d[28], 4);
+        phentsize = read_le(&d[42], 2);
+        phnum = read_le(&d[44], 2);
+    }
+
+    if (phentsize < (is_64 ? 56u : 32u) || phoff > d.size()
+            || phnum > (d.size() - phoff) / phentsize) {
+        fprintf(stderr, "%s: Invalid program headers\n", path);
+        return false;
+    }
+
+    bool have_base = false;
+
+    for (uint64_t i = 0; i < phnum; ++i) {
+        const unsigned char *ph = &d[phoff + i * phentsize];
+        Segment seg;
+
+        // PT_LOAD
+        if (read_le(ph, 4) != 1) {
+            continue;
+        }
+
+        if (is_64) {
+            seg.offset = read_le(ph + 8, 8);
+            seg.vaddr = read_le(ph + 16, 8);
+            seg.filesz = read_le(ph + 32, 8);
+        } else {
+            seg.offset = read_le(ph + 4, 4);
+            seg.vaddr = read_le(ph + 8, 4);
+            seg.filesz = read_le(ph + 16, 4);
+        }
+
+        if (seg.offset > d.size() || seg.filesz > d.size() - seg.offset) {
+            fprintf(stderr, "%s: Segment extends past end of file\n", path);
+            return false;
+        }
+
+        // __executable_start is the address of the ELF header, which is at
+        // the beginning of the first loadable segment
+        if (!have_base) {
+            image.base = seg.vaddr - seg.offset;
+            have_base = true;
+        }
+
+        image.segments.push_back(seg);
+    }
+
+    if (!have_base) {
+        fprintf(stderr, "%s: No loadable segments\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+static const char * lookup_format(const Image &image, uint64_t fmt_offset)
+{
+    uint64_t vaddr = image.base + fmt_offset;
+
+    for (const Segment &seg : image.segments) {
+        if (vaddr >= seg.vaddr && vaddr - seg.vaddr < seg.filesz) {
+            uint64_t offset = seg.offset + (vaddr - seg.vaddr);
+            uint64_t end = seg.offset + seg.filesz;
+            auto ptr = reinterpret_cast<const char *>(&image.data[offset]);
+
+            // Must be NULL-terminated within the segment
+            if (memchr(ptr, '\0', end - offset)) {
+                return ptr;
+            }
+            return nullptr;
+        }
+    }
+
+    return nullptr;
+}
+
+static void append_printf(std::string &out, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+
+    va_list copy;
+    va_copy(copy, ap);
+    int n = vsnprintf(nullptr, 0, fmt, copy);
+    va_end(copy);
+
+    if (n > 0) {
+        std::vector<char> buf(static_cast<size_t>(n) + 1);
+        vsnprintf(buf.data(), buf.size(), fmt, ap);
+        out.append(buf.data(), static_cast<size_t>(n));
+    }
+
+    va_end(ap);
+}
+
+// Reformat the message by replaying each conversion with the recorded argument
+static bool format_message(const char *fmt, const std::vector<Arg> &args,
+                           std::string &out)
+{
+    size_t arg = 0;
+
+    for (const char *p = fmt; *p; ++p) {
+        if (*p != '%') {
+            out += *p;
+            continue;
+        }
+
+        const char *start = p++;
+        if (*p == '%') {
+            out += '%';
+            continue;
+        }
+
+        // Rebuild the conversion specification without the length modifier
+        // and with '*' replaced by the recorded values
+        std::string spec(start, p);
+
+        while (*p && strchr("-+ #0'", *p)) {
+            spec += *p++;
+        }
+
+        for (int i = 0; i < 2; ++i) {
+            if (i == 1) {
+                if (*p != '.') {
+                    break;
+                }
+                spec += *p++;
+            }
+
+            if (*p == '*') {
+                if (arg >= args.size()) {
+                    return false;
+                }
+                spec += std::to_string(
+                        static_cast<int64_t>(args[arg++].value));
+                ++p;
+            } else {
+                while (*p >= '0' && *p <= '9') {
+                    spec += *p++;
+                }
+            }
+        }
+
+        while (*p && strchr("hljztLq", *p)) {
+            ++p;
+        }
+
+        if (!*p || arg >= args.size()) {
+            return false;
+        }
+
+        const Arg &a = args[arg++];
+        char conv = *p;
+
+        switch (a.type) {
+        case MBLOG_BINARY_ARG_INT:
+            if (conv == 'c') {
+                spec += conv;
+                append_printf(out, spec.c_str(), static_cast<int>(a.value));
+            } else {
+                spec += "ll";
+                spec += conv;
+                append_printf(out, spec.c_str(),
+                              static_cast<long long>(a.value));
+            }
+            break;
+        case MBLOG_BINARY_ARG_UINT:
+            spec += "ll";
+            spec += conv;
+            append_printf(out, spec.c_str(),
+                          static_cast<unsigned long long>(a.value));
+            break;
+        case MBLOG_BINARY_ARG_DOUBLE: {
+            double value;
+            memcpy(&value, &a.value, sizeof(value));
+            spec += conv;
+            append_printf(out, spec.c_str(), value);
+            break;
+        }
+        case MBLOG_BINARY_ARG_STRING:
+            spec += 's';
+            append_printf(out, spec.c_str(), a.str.c_str());
+            break;
+        case MBLOG_BINARY_ARG_POINTER:
+            append_printf(out, "0x%" PRIx64, a.value);
+            break;
+        default:
+            return false;
+        }
+    }
+
+    return arg == args.size();
+}
+
+static bool parse_args(const unsigned char *ptr, size_t size,
+                       std::vector<Arg> &args)
+{
+    if (size < 1) {
+        return false;
+    }
+
+    size_t argc = ptr[0];
+    size_t pos = 1;
+
+    args.clear();
+
+    for (size_t i = 0; i < argc; ++i) {
+        Arg a;
+
+        if (pos >= size) {
+            return false;
+        }
+        a.type = ptr[pos++];
+
+        if (a.type == MBLOG_BINARY_ARG_STRING) {
+            if (size - pos < 4) {
+                return false;
+            }
+            uint64_t len = read_le(ptr + pos, 4);
+            pos += 4;
+            if (size - pos < len) {
+                return false;
+            }
+            a.str.assign(reinterpret_cast<const char *>(ptr + pos), len);
+            pos += len;
+            a.value = 0;
+        } else {
+            if (size - pos < 8) {
+                return false;
+            }
+            a.value = read_le(ptr + pos, 8);
+            pos += 8;
+        }
+
+        args.push_back(std::move(a));
+    }
+
+    return pos == size;
+}
+
+static const char * level_string(uint8_t level)
+{
+    switch (level) {
+    case 0: return "[E]";
+    case 1: return "[W]";
+    case 2: return "[I]";
+    case 3: return "[D]";
+    case 4: return "[V]";
+    default: return "[?]";
+    }
+}
+
+static std::string format_timestamp(uint64_t ns)
+{
+    time_t sec = static_cast<time_t>(ns / 1000000000u);
+    unsigned int ms = static_cast<unsigned int>(ns % 1000000000u / 1000000u);
+    struct tm tm;
+    char buf[64];
+
+#ifdef _WIN32
+    localtime_s(&tm, &sec);
+#else
+    localtime_r(&sec, &tm);
+#endif
+    strftime(buf, sizeof(buf), "%Y/%m/%d %H:%M:%S", &tm);
+
+    std::string result(buf);
+    snprintf(buf, sizeof(buf), ".%03u", ms);
+    result += buf;
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3) {
+        usage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    const char *file_exe = argv[1];
+    const char *file_log = argv[2];
+    Image image;
+    std::vector<unsigned char> log;
+
+    if (!load_image(file_exe, image) || !read_file(file_log, log)) {
+        return EXIT_FAILURE;
+    }
+
+    if (log.size() < 16 || memcmp(log.data(), MBLOG_BINARY_MAGIC,
+                                  MBLOG_BINARY_MAGIC_SIZE) != 0) {
+        fprintf(stderr, "%s: Not a binary log file\n", file_log);
+        return EXIT_FAILURE;
+    } else if (read_le(&log[8], 4) != MBLOG_BINARY_VERSION) {
+        fprintf(stderr, "%s: Unsupported version: %" PRIu64 "\n",
+                file_log, read_le(&log[8], 4));
+        return EXIT_FAILURE;
+    }
+
+    size_t pos = 16;
+    std::vector<Arg> args;
+    bool ret = true;
+
+    while (pos < log.size()) {
+        if (log.size() - pos < 4) {
+            fprintf(stderr, "%s: Truncated record at offset %zu\n",
+                    file_log, pos);
+            ret = false;
+            break;
+        }
+
+        uint64_t size = read_le(&log[pos], 4);
+        if (size < 12 || log.size() - pos - 4 < size) {
+            fprintf(stderr, "%s: Truncated record at offset %zu\n",
+                    file_log, pos);
+            ret = false;
+            break;
+        }
+
+        const unsigned char *rec = &log[pos + 4];
+        uint8_t level = rec[0];
+        uint8_t kind = rec[1];
+        uint64_t timestamp = read_le(rec + 4, 8);
+        const unsigned char *body = rec + 12;
+        size_t body_size = static_cast<size_t>(size - 12);
+        std::string msg;
+
+        if (kind == MBLOG_BINARY_RECORD_TEXT) {
+            msg.assign(reinterpret_cast<const char *>(body), body_size);
+        } else if (kind == MBLOG_BINARY_RECORD_FORMAT && body_size >= 8) {
+            uint64_t fmt_offset = read_le(body, 8);
+            const char *fmt = lookup_format(image, fmt_offset);
+
+            if (!fmt) {
+                msg = "<format string not found in executable>";
+                ret = false;
+            } else if (!parse_args(body + 8, body_size - 8, args)
+                    || !format_message(fmt, args, msg)) {
+                msg = "<arguments do not match format: ";
+                msg += fmt;
+                msg += ">";
+                ret = false;
+            }
+        } else {
+            msg = "<unknown record type>";
+            ret = false;
+        }
+
+        printf("[%s]%s %s\n", format_timestamp(timestamp).c_str(),
+               level_string(level), msg.c_str());
+
+        pos += 4 + static_cast<size_t>(size);
+    }
+
+    return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -25,11 +25,13 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <memory>
+#include <unordered_map>
 
 #include <fcntl.h>
 #include <getopt.h>
-#include <poll.h>
 #include <signal.h>
+#include <sys/epoll.h>
 #include <sys/mount.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -157,6 +159,8 @@ static bool prepare_appsync()
 
     uint64_t start = util::current_time_ms(), stop;
 
+    std::vector<SharedDataMount> mounts;
+
     for (auto it = config.shared_pkgs.begin();
             it != config.shared_pkgs.end();) {
         SharedPackage &shared_pkg = *it;
@@ -170,25 +174,17 @@ static bool prepare_appsync()
             continue;
         }
 
-        // Ensure that the data directory exists if data sharing is enabled
-        if (shared_pkg.share_data
-                && !AppSyncManager::create_shared_data_directory(
-                        shared_pkg.pkg_id, pkg->get_uid())) {
-            LOGW("Failed to create shared data directory for package %s. "
-                 "App data will not be shared", shared_pkg.pkg_id.c_str());
-            shared_pkg.share_data = false;
+        if (shared_pkg.share_data) {
+            mounts.push_back({ pkg->name, pkg->get_uid(), true });
         }
 
         ++it;
     }
 
-    // Ensure that the shared data is under the u:object_r:app_data_file:s0
-    // context. Otherwise, apps won't be able to write to the shared directory
-    bool disable_data_sharing = false;
-    if (!AppSyncManager::fix_shared_data_permissions()) {
+    // Create the shared data directories and mount targets in parallel
+    if (!AppSyncManager::prepare_shared_data(mounts)) {
         LOGW("Failed to fix permissions on shared data directory");
         LOGW("Data sharing will be disabled for all packages");
-        disable_data_sharing = true;
     }
 
     stop = util::current_time_ms();
@@ -197,16 +193,20 @@ static bool prepare_appsync()
     start = util::current_time_ms();
 
     // Actually share the data
-    for (SharedPackage &shared_pkg : config.shared_pkgs) {
-        auto pkg = packages.find_by_pkg(shared_pkg.pkg_id);
+    AppSyncManager::mount_shared_data(mounts);
 
-        if (disable_data_sharing) {
-            shared_pkg.share_data = false;
+    for (SharedPackage &shared_pkg : config.shared_pkgs) {
+        if (!shared_pkg.share_data) {
+            continue;
         }
 
-        if (shared_pkg.share_data && !AppSyncManager::mount_shared_directory(
-                pkg->name, pkg->get_uid())) {
-            LOGW("Failed to mount shared data directory");
+        auto it = std::find_if(mounts.begin(), mounts.end(),
+                               [&](const SharedDataMount &m) {
+            return m.pkg == shared_pkg.pkg_id;
+        });
+        if (it == mounts.end() || !it->ok) {
+            LOGW("Data will not be shared for package %s",
+                 shared_pkg.pkg_id.c_str());
             shared_pkg.share_data = false;
         }
     }
@@ -214,6 +214,24 @@ static bool prepare_appsync()
     stop = util::current_time_ms();
     LOGD("Initialization stage 2 took %" PRIu64 "ms", stop - start);
 
+    start = util::current_time_ms();
+
+    // Share identical APKs and libraries with the other ROMs. This only needs
+    // to read files that changed since the last boot.
+    auto current_rom = Roms::get_current_rom();
+    if (current_rom) {
+        AppDedupStats stats;
+        AppSyncManager::dedup_app_files(cfg_pkgs_list, current_rom->id, stats);
+
+        if (stats.files > 0) {
+            LOGI("Shared %" PRIu64 " app files (%" PRIu64 " bytes) with"
+                 " other ROMs", stats.files, stats.bytes);
+        }
+    }
+
+    stop = util::current_time_ms();
+    LOGD("Initialization stage 3 took %" PRIu64 "ms", stop - start);
+
     return true;
 }
 
@@ -298,76 +316,12 @@ static int create_new_socket()
 }
 
 /*
- * Socket messages are prefixed with 16-bit unsigned value (little-endian)
+ * Socket messages are prefixed with 16-bit unsigned value (host byte order)
  * indicating the number of bytes that follow. The data should be treated as
- * a string and a null terminator must be added to the end.
+ * a string and a null terminator must be added to the end. CyanogenMod's async
+ * installd additionally prefixes each message with a 32-bit transaction ID.
  */
 
-/*!
- * \brief Receive a message from a socket
- */
-static bool receive_message(int fd, char *buf, std::size_t size,
-                            bool is_async, int *async_id)
-{
-    unsigned short count;
-
-    if (is_async) {
-        assert(async_id != nullptr);
-
-        if (!util::socket_read_int32(fd, async_id)) {
-            LOGE("Failed to receive async command ID: %s", strerror(errno));
-            return false;
-        }
-    }
-
-    if (!util::socket_read_uint16(fd, &count)) {
-        LOGE("Failed to read command size: %s", strerror(errno));
-        return false;
-    }
-
-    if (count < 1 || count >= size) {
-        LOGE("Invalid size %u", count);
-        return false;
-    }
-
-    if (util::socket_read(fd, buf, count) != count) {
-        LOGE("Failed to read command: %s", strerror(errno));
-        return false;
-    }
-
-    buf[count] = 0;
-
-    return true;
-}
-
-/*!
- * \brief Send a message to a socket
- */
-static bool send_message(int fd, const char *command,
-                         bool is_async, int async_id)
-{
-    unsigned short count = strlen(command);
-
-    if (is_async) {
-        if (!util::socket_write_int32(fd, async_id)) {
-            LOGE("Failed to write async command ID: %s", strerror(errno));
-            return false;
-        }
-    }
-
-    if (!util::socket_write_uint16(fd, count)) {
-        LOGE("Failed to write command size: %s", strerror(errno));
-        return false;
-    }
-
-    if (util::socket_write(fd, command, count) != count) {
-        LOGE("Failed to write command: %s", strerror(errno));
-        return false;
-    }
-
-    return true;
-}
-
 /*!
  * \brief Connect to the installd socket at INSTALLD_SOCKET_PATH
  *
@@ -534,254 +488,375 @@ static void handle_command(const std::vector<std::string> &args)
     }
 }
 
-static bool handle_installd_event(int client_fd, int installd_fd,
-                                  bool is_async)
-{
-    // Use the same buffer size as installd
-    char buf[COMMAND_BUF_SIZE];
-
-    uint64_t time_start, time_stop;
-    uint64_t time_start_installd, time_stop_installd;
-    uint64_t time_start_send, time_stop_send;
-
-    int async_id;
+// Stop reading from one side of a session while this many bytes are still
+// waiting to be written to the other side
+#define PROXY_MAX_PENDING               (64 * 1024)
+#define PROXY_READ_SIZE                 4096
+#define PROXY_MAX_EVENTS                16
 
-    time_start = util::current_time_ms();
+/*
+ * Bytes flowing in one direction of a proxied connection. Data is read into
+ * and written out of the same buffer, so messages that are not hooked are
+ * forwarded without being parsed or copied again.
+ */
+struct ProxyStream
+{
+    std::vector<char> buf;
+    // Bytes that may be written (ie. complete messages that have been checked
+    // for hooks)
+    size_t ready = 0;
+    // Bytes that have already been written
+    size_t written = 0;
+};
 
-    time_start_installd = util::current_time_ms();
-    if (!receive_message(
-            installd_fd, buf, sizeof(buf), is_async, &async_id)) {
-        LOGE("Failed to receive reply from installd");
-        return false;
+struct ProxySession
+{
+    int client_fd = -1;
+    int installd_fd = -1;
+    // Requests from the client to installd
+    ProxyStream requests;
+    // Replies from installd to the client
+    ProxyStream replies;
+
+    ~ProxySession()
+    {
+        if (client_fd >= 0) {
+            close(client_fd);
+        }
+        if (installd_fd >= 0) {
+            close(installd_fd);
+        }
     }
-    time_stop_installd = util::current_time_ms();
-
-    std::vector<std::string> args = parse_args(buf);
-    LOGD("Received async (probably) reply: %s", args_to_string(args).c_str());
+};
 
-    time_start_send = util::current_time_ms();
-    if (!send_message(client_fd, buf, is_async, async_id)) {
-        LOGE("Failed to send reply to client");
-        return false;
-    }
-    time_stop_send = util::current_time_ms();
+static bool set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
 
-    time_stop = util::current_time_ms();
+static const CommandInfo * find_hooked_command(const char *msg, size_t size)
+{
+    const char *space = static_cast<const char *>(memchr(msg, ' ', size));
+    size_t len = space ? static_cast<size_t>(space - msg) : size;
 
-    LOGD("Command stats:");
-    LOGD("- Time to send result back to client:  %" PRIu64 "ms",
-         time_stop_send - time_start_send);
-    LOGD("- Time to receive reply from installd: %" PRIu64 "ms",
-         time_stop_installd - time_start_installd);
-    LOGD("- Time to complete entire proxy logic: %" PRIu64 "ms",
-         time_stop - time_start);
-    LOGD("---");
+    for (std::size_t i = 0; i < sizeof(cmds) / sizeof(cmds[0]); ++i) {
+        if (strlen(cmds[i].name) == len
+                && memcmp(cmds[i].name, msg, len) == 0) {
+            return &cmds[i];
+        }
+    }
 
-    return true;
+    return nullptr;
 }
 
-static bool handle_android_event(int client_fd, int installd_fd,
-                                 bool can_appsync, bool is_async)
+/*
+ * Mark complete requests as ready to send to installd. Only commands that are
+ * hooked (eg. "remove") are parsed. The hook runs before the request is
+ * forwarded so that installd sees the result (eg. an unmounted shared data
+ * directory).
+ */
+static bool scan_requests(ProxyStream &stream, bool can_appsync,
+                          bool is_async)
 {
-    // Use the same buffer size as installd
-    char buf[COMMAND_BUF_SIZE];
+    const size_t header_size = (is_async ? sizeof(int32_t) : 0)
+            + sizeof(uint16_t);
 
-    uint64_t time_start, time_stop;
-    uint64_t time_start_installd, time_stop_installd;
-    uint64_t time_start_hook = 0, time_stop_hook = 0;
-    uint64_t time_start_send, time_stop_send;
+    while (stream.buf.size() - stream.ready >= header_size) {
+        const char *header = stream.buf.data() + stream.ready;
+        uint16_t count;
+        memcpy(&count, header + header_size - sizeof(count), sizeof(count));
 
-    int async_id;
+        // Use the same limits as installd
+        if (count < 1 || count >= COMMAND_BUF_SIZE) {
+            LOGE("Invalid size %u", count);
+            return false;
+        }
 
-    if (!receive_message(client_fd, buf, sizeof(buf), is_async, &async_id)) {
-        LOGE("Failed to receive request from client");
-        return false;
-    }
+        if (stream.buf.size() - stream.ready < header_size + count) {
+            // Wait for the rest of the message
+            break;
+        }
 
-    time_start = util::current_time_ms();
+        const char *msg = header + header_size;
 
-    std::vector<std::string> args = parse_args(buf);
+        if (count != 7 || memcmp(msg, "getsize", 7) != 0) {
+            LOGD("Received command: %.*s", static_cast<int>(count), msg);
+        }
 
-    bool log_result = true;
+        const CommandInfo *info;
+        if (can_appsync && (info = find_hooked_command(msg, count))) {
+            uint64_t time_start = util::current_time_ms();
+            handle_command(parse_args(std::string(msg, count).c_str()));
+            uint64_t time_stop = util::current_time_ms();
 
-    if (args.empty()) {
-        LOGE("Invalid command (empty message)");
-    } else {
-        const std::string &cmd = args[0];
-
-        if (cmd == "ping"
-                || cmd == "freecache") {
-            LOGD("Received unimportant command: [%s, ...]", cmd.c_str());
-        } else if (cmd == "aapt"
-                || cmd == "aapt_with_common") {
-            LOGD("Received CyanogenMod-specific command: %s",
-                 args_to_string(args).c_str());
-        } else if (cmd == "rmrcl"
-                || cmd == "asyncDexopt"
-                || cmd == "changeDexOwner") {
-            LOGD("Received Touchwiz-specific command: %s",
-                 args_to_string(args).c_str());
-            if (cmd == "asyncDexopt") {
-                LOGD("Expecting future installd reply for 'asyncDexopt'");
-            }
-        } else if (cmd == "getsize") {
-            // Get size is so annoying we don't want it to show... EVER!
-            log_result = false;
-        } else if (cmd == "install"
-                || cmd == "dexopt"
-                || cmd == "markbootcomplete"
-                || cmd == "movedex"
-                || cmd == "rmdex"
-                || cmd == "remove"
-                || cmd == "rename"
-                || cmd == "fixuid"
-                || cmd == "rmcache"
-                || cmd == "rmcodecache"
-                || cmd == "rmuserdata"
-                || cmd == "movefiles"
-                || cmd == "linklib"
-                || cmd == "mkuserdata"
-                || cmd == "mkuserconfig"
-                || cmd == "rmuser"
-                || cmd == "idmap"
-                || cmd == "restorecondata"
-                || cmd == "patchoat") {
-            LOGD("Received command: %s", args_to_string(args).c_str());
-
-            if (can_appsync) {
-                time_start_hook = util::current_time_ms();
-                handle_command(args);
-                time_stop_hook = util::current_time_ms();
-            }
-        } else {
-            LOGW("Unrecognized command: %s", args_to_string(args).c_str());
+            LOGD("- Time to hook installd command: %" PRIu64 "ms",
+                 time_stop - time_start);
         }
+
+        stream.ready += header_size + count;
     }
 
-    time_start_installd = util::current_time_ms();
-    if (!send_message(installd_fd, buf, is_async, async_id)) {
-        LOGE("Failed to send request to installd");
-        return false;
+    return true;
+}
+
+/*
+ * Write as much of the ready data as possible without blocking.
+ */
+static bool flush_stream(int fd, ProxyStream &stream)
+{
+    while (stream.written < stream.ready) {
+        ssize_t n = send(fd, stream.buf.data() + stream.written,
+                         stream.ready - stream.written, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (n < 0) {
+            LOGE("Failed to write to socket: %s", strerror(errno));
+            return false;
+        }
+        stream.written += n;
     }
-    if (!receive_message(
-            installd_fd, buf, sizeof(buf), is_async, &async_id)) {
-        LOGE("Failed to receive reply from installd");
-        return false;
+
+    // Drop whatever has been written
+    if (stream.written > 0 && (stream.written == stream.ready
+            || stream.written >= PROXY_MAX_PENDING)) {
+        stream.buf.erase(stream.buf.begin(),
+                         stream.buf.begin() + stream.written);
+        stream.ready -= stream.written;
+        stream.written = 0;
     }
-    time_stop_installd = util::current_time_ms();
 
-    args = parse_args(buf);
+    return true;
+}
 
-    if (log_result) {
-        LOGD("Sending reply: %s", args_to_string(args).c_str());
+/*
+ * Read whatever is available into the stream. Returns false on EOF or error.
+ */
+static bool fill_stream(int fd, ProxyStream &stream, const char *name)
+{
+    size_t old_size = stream.buf.size();
+    stream.buf.resize(old_size + PROXY_READ_SIZE);
+
+    ssize_t n;
+    do {
+        n = recv(fd, stream.buf.data() + old_size, PROXY_READ_SIZE, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        n = 0;
+    } else if (n < 0) {
+        LOGE("Failed to read from %s: %s", name, strerror(errno));
+        stream.buf.resize(old_size);
+        return false;
+    } else if (n == 0) {
+        LOGD("%s closed the connection", name);
+        stream.buf.resize(old_size);
+        return false;
     }
 
-    time_start_send = util::current_time_ms();
-    if (!send_message(client_fd, buf, is_async, async_id)) {
-        LOGE("Failed to send reply to client");
+    stream.buf.resize(old_size + n);
+    return true;
+}
+
+static bool update_epoll(int epfd, int fd, bool want_read, bool want_write)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (want_read ? static_cast<uint32_t>(EPOLLIN) : 0u)
+            | (want_write ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+    ev.data.fd = fd;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        LOGE("Failed to update epoll events: %s", strerror(errno));
         return false;
     }
-    time_stop_send = util::current_time_ms();
+    return true;
+}
 
-    time_stop = util::current_time_ms();
+static bool handle_session_event(int epfd, ProxySession &session, int fd,
+                                 uint32_t events, bool can_appsync,
+                                 bool is_async)
+{
+    bool is_client = fd == session.client_fd;
 
-    if (log_result) {
-        LOGD("Command stats:");
-        LOGD("- Time to send result back to client:  %" PRIu64 "ms",
-             time_stop_send - time_start_send);
-        LOGD("- Time to complete installd command:   %" PRIu64 "ms",
-             time_stop_installd - time_start_installd);
-        if (can_appsync) {
-            LOGD("- Time to hook installd command:       %" PRIu64 "ms",
-                 time_stop_hook - time_start_hook);
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        if (is_client) {
+            if (!fill_stream(fd, session.requests, "client")
+                    || !scan_requests(session.requests, can_appsync,
+                                      is_async)) {
+                return false;
+            }
+        } else {
+            if (!fill_stream(fd, session.replies, "installd")) {
+                return false;
+            }
+            // Replies are never hooked
+            session.replies.ready = session.replies.buf.size();
         }
-        LOGD("- Time to complete entire proxy logic: %" PRIu64 "ms",
-             time_stop - time_start);
-        LOGD("---");
     }
 
-    return true;
+    if (!flush_stream(session.installd_fd, session.requests)
+            || !flush_stream(session.client_fd, session.replies)) {
+        return false;
+    }
+
+    size_t pending_requests = session.requests.ready
+            - session.requests.written;
+    size_t pending_replies = session.replies.ready - session.replies.written;
+
+    return update_epoll(epfd, session.client_fd,
+                        pending_requests < PROXY_MAX_PENDING,
+                        pending_replies > 0)
+            && update_epoll(epfd, session.installd_fd,
+                            pending_replies < PROXY_MAX_PENDING,
+                            pending_requests > 0);
 }
 
 /**
  * \brief Main function for capturing and relaying the daemon commands
  *
- * This function will not return under normal conditions. It runs through the
- * following loop infinitely:
+ * This function will not return under normal conditions. Every client that
+ * connects to the original installd socket gets its own connection to the real
+ * installd and all connections are serviced from a single epoll loop, so a
+ * slow command on one connection never holds up another.
  *
- * 1. Accept a connection on the original installd socket
- * 2. Run installd
- * 3. Connect to the installd
- * 4. Capture and proxy commands
+ * Requests and replies are forwarded as raw bytes. Only requests for hooked
+ * commands (see cmds) are parsed, and the hook runs before the request is
+ * passed on to installd. Because nothing waits for a reply, CyanogenMod's async
+ * installd works too.
  *
- * If installd crashes or connection between mbtool and installd breaks in some
- * way, it will simply loop again. If this function fails to accept a connection
- * on the original socket, then it will return false.
+ * If installd crashes, its connections are closed and the next client will
+ * connect to it again. If this function fails to accept a connection on the
+ * original socket or cannot connect to installd, then it will return false.
  *
  * \return False if accepting the socket connection fails. Otherwise, does not
  *         return
  */
 static bool proxy_process(int fd, bool can_appsync)
 {
-    while (true) {
-        int client_fd = accept(fd, nullptr, nullptr);
-        if (client_fd < 0) {
-            LOGE("Failed to accept client connection: %s", strerror(errno));
-            return false;
-        }
-
-        auto close_client_fd = util::finally([&]{
-            LOGD("Closing client connection");
-            close(client_fd);
-        });
-
-        LOGD("Accepted new client connection");
+    // Check if we're using some variant of the CyanogenMood async installd
+    // See: https://github.com/CyanogenMod/android_frameworks_native/commit/8124b181d4b5a3a44796fdb0e3ea4e4171f102c7
+    bool is_async = util::file_find_one_of(
+            INSTALLD_PATH, { "failed to read transaction id" });
+    LOGD("installd is CyanogenMod async version: %d", is_async);
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        LOGE("Failed to create epoll fd: %s", strerror(errno));
+        return false;
+    }
 
-        // Connect to installd
-        int installd_fd = connect_to_installd();
-        if (installd_fd < 0) {
-            return false;
-        }
+    auto close_epfd = util::finally([&]{
+        close(epfd);
+    });
 
-        auto close_installd_fd = util::finally([&]{
-            LOGD("Closing installd connection");
-            close(installd_fd);
-        });
+    if (!set_nonblocking(fd)) {
+        LOGE("Failed to make socket non-blocking: %s", strerror(errno));
+        return false;
+    }
 
-        // Check if we're using some variant of the CyanogenMood async installd
-        // NOTE: We'll effectively make the connection sychronous because we
-        //       always wait for a reply before receiving the next command.
-        // See: https://github.com/CyanogenMod/android_frameworks_native/commit/8124b181d4b5a3a44796fdb0e3ea4e4171f102c7
-        bool is_async = util::file_find_one_of(
-                INSTALLD_PATH, { "failed to read transaction id" });
-        LOGD("installd is CyanogenMod async version: %d", is_async);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        LOGE("Failed to add socket to epoll: %s", strerror(errno));
+        return false;
+    }
 
-        LOGD("---");
+    // Sessions indexed by both their client and installd fds
+    std::unordered_map<int, std::shared_ptr<ProxySession>> sessions;
 
-        struct pollfd fds[2];
-        memset(fds, 0, sizeof(fds));
+    auto close_session = [&](const std::shared_ptr<ProxySession> &session) {
+        LOGD("Closing client and installd connections");
+        sessions.erase(session->client_fd);
+        sessions.erase(session->installd_fd);
+        // Closing the fds removes them from the epoll set
+    };
 
-        fds[0].fd = client_fd;
-        fds[0].events = POLLIN;
-        fds[1].fd = installd_fd;
-        fds[1].events = POLLIN;
+    struct epoll_event events[PROXY_MAX_EVENTS];
 
-        while (true) {
-            fds[0].revents = 0;
-            fds[1].revents = 1;
+    while (true) {
+        int n = epoll_wait(epfd, events, PROXY_MAX_EVENTS, -1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            LOGE("Failed to wait for events: %s", strerror(errno));
+            return false;
+        }
 
-            if (poll(fds, 2, -1) < 0) {
-                LOGE("Failed to poll() fds: %s", strerror(errno));
-                break;
+        for (int i = 0; i < n; ++i) {
+            int event_fd = events[i].data.fd;
+
+            if (event_fd == fd) {
+                int client_fd = accept4(fd, nullptr, nullptr,
+                                        SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (client_fd < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK
+                            || errno == EINTR || errno == ECONNABORTED) {
+                        continue;
+                    }
+                    LOGE("Failed to accept client connection: %s",
+                         strerror(errno));
+                    return false;
+                }
+
+                auto session = std::make_shared<ProxySession>();
+                session->client_fd = client_fd;
+
+                LOGD("Accepted new client connection");
+
+                // Connect to installd
+                session->installd_fd = connect_to_installd();
+                if (session->installd_fd < 0) {
+                    return false;
+                }
+
+                if (!set_nonblocking(session->installd_fd)) {
+                    LOGE("Failed to make socket non-blocking: %s",
+                         strerror(errno));
+                    continue;
+                }
+
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLIN;
+                ev.data.fd = session->client_fd;
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, session->client_fd,
+                              &ev) < 0) {
+                    LOGE("Failed to add client to epoll: %s", strerror(errno));
+                    continue;
+                }
+                ev.data.fd = session->installd_fd;
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, session->installd_fd,
+                              &ev) < 0) {
+                    LOGE("Failed to add installd to epoll: %s",
+                         strerror(errno));
+                    continue;
+                }
+
+                sessions[session->client_fd] = session;
+                sessions[session->installd_fd] = session;
+
+                LOGD("Proxying %zu client connections", sessions.size() / 2);
+                LOGD("---");
+                continue;
             }
 
-            if (fds[0].revents & POLLIN && !handle_android_event(
-                    client_fd, installd_fd, can_appsync, is_async)) {
-                break;
+            auto it = sessions.find(event_fd);
+            if (it == sessions.end()) {
+                // Closed earlier in this batch of events
+                continue;
             }
-            if (fds[1].revents & POLLIN && !handle_installd_event(
-                    client_fd, installd_fd, is_async)) {
-                break;
+
+            // Keep the session alive until we're done with it
+            std::shared_ptr<ProxySession> session = it->second;
+
+            if (!handle_session_event(epfd, *session, event_fd,
+                                      events[i].events, can_appsync,
+                                      is_async)) {
+                close_session(session);
             }
         }
     }
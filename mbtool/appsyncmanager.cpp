@@ -20,16 +20,25 @@
 #include "appsyncmanager.h"
 
 #include <algorithm>
+#include <thread>
 
 #include <cerrno>
+#include <cstring>
 
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "mbcommon/string.h"
+#include "mbcommon/thread_pool.h"
 #include "mblog/logging.h"
 #include "mbutil/chown.h"
+#include "mbutil/copy.h"
 #include "mbutil/directory.h"
+#include "mbutil/finally.h"
 #include "mbutil/fts.h"
 #include "mbutil/selinux.h"
 
@@ -37,6 +46,13 @@
 
 #define USER_DATA_DIR                   "/data/data"
 
+#define PREPARE_MAX_THREADS             8
+
+// Only APKs and native libraries below this directory are deduplicated
+#define APP_CODE_DIR_PREFIX             "/data/"
+#define DEDUP_TEMP_SUFFIX               ".mbtool-dedup"
+#define DEDUP_COMPARE_BUF_SIZE          (1024 * 1024)
+
 static std::string _as_data_dir;
 static std::string _user_data_dir;
 
@@ -73,6 +89,32 @@ public:
     }
 };
 
+/*!
+ * Collect the relative paths of the APKs and native libraries in an app's code
+ * directory.
+ */
+class AppCodeScanner : public util::FTSWrapper {
+public:
+    AppCodeScanner(std::string path, std::vector<std::string> &files)
+        : FTSWrapper(path, FTS_GroupSpecialFiles | FTS_NoStat | FTS_Parallel),
+        _files(files)
+    {
+    }
+
+    virtual int on_reached_file() override
+    {
+        const char *name = _curr->fts_name;
+        if (mb::ends_with(name, ".apk") || mb::ends_with(name, ".so")) {
+            // fts_path is always _path + '/' + relative path
+            _files.push_back(_curr->fts_path + _root->fts_pathlen + 1);
+        }
+        return Action::FTS_OK;
+    }
+
+private:
+    std::vector<std::string> &_files;
+};
+
 void AppSyncManager::detect_directories()
 {
     _as_data_dir = get_raw_path(APP_SHARING_DATA_DIR);
@@ -144,9 +186,8 @@ bool AppSyncManager::fix_shared_data_permissions()
     return true;
 }
 
-bool AppSyncManager::mount_shared_directory(const std::string &pkg, uid_t uid)
+bool AppSyncManager::prepare_mount_target(const std::string &pkg, uid_t uid)
 {
-    std::string data_path = get_shared_data_path(pkg);
     std::string target(_user_data_dir);
     target += "/";
     target += pkg;
@@ -162,6 +203,16 @@ bool AppSyncManager::mount_shared_directory(const std::string &pkg, uid_t uid)
         return false;
     }
 
+    return true;
+}
+
+bool AppSyncManager::bind_mount_shared_directory(const std::string &pkg)
+{
+    std::string data_path = get_shared_data_path(pkg);
+    std::string target(_user_data_dir);
+    target += "/";
+    target += pkg;
+
     LOGV("[%s] Bind mounting data directory:", pkg.c_str());
     LOGV("[%s] - Source: %s", pkg.c_str(), data_path.c_str());
     LOGV("[%s] - Target: %s", pkg.c_str(), target.c_str());
@@ -176,6 +227,11 @@ bool AppSyncManager::mount_shared_directory(const std::string &pkg, uid_t uid)
     return true;
 }
 
+bool AppSyncManager::mount_shared_directory(const std::string &pkg, uid_t uid)
+{
+    return prepare_mount_target(pkg, uid) && bind_mount_shared_directory(pkg);
+}
+
 bool AppSyncManager::unmount_shared_directory(const std::string &pkg)
 {
     std::string target(_user_data_dir);
@@ -191,4 +247,360 @@ bool AppSyncManager::unmount_shared_directory(const std::string &pkg)
     return true;
 }
 
+
+/*!
+ * \brief Prepare shared data directories for a batch of packages
+ *
+ * The shared data directory and the mount target of each package are created
+ * and chowned by a pool of worker threads. Afterwards, the whole shared data
+ * directory is relabeled in a single (parallel) pass.
+ *
+ * \param mounts Packages to prepare. \a ok is cleared for entries that failed.
+ *
+ * \return False if relabeling failed, in which case \a ok is cleared for all
+ *         entries. Otherwise, true
+ */
+bool AppSyncManager::prepare_shared_data(std::vector<SharedDataMount> &mounts)
+{
+    unsigned int n_threads = std::min(
+            std::max(std::thread::hardware_concurrency(), 1u),
+            static_cast<unsigned int>(PREPARE_MAX_THREADS));
+
+    parallel_for(mounts.size(), [&](size_t i) {
+        SharedDataMount &m = mounts[i];
+        m.ok = create_shared_data_directory(m.pkg, m.uid)
+                && prepare_mount_target(m.pkg, m.uid);
+        return true;
+    }, n_threads, CoreHint::Efficiency);
+
+    // Ensure that the shared data is under the u:object_r:app_data_file:s0
+    // context. Otherwise, apps won't be able to write to the shared directory
+    if (!fix_shared_data_permissions()) {
+        for (SharedDataMount &m : mounts) {
+            m.ok = false;
+        }
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Bind mount the shared data directories prepared by
+ *        prepare_shared_data()
+ *
+ * \param mounts Packages to mount. Entries where \a ok is false are skipped and
+ *               \a ok is cleared for entries that fail to mount.
+ */
+void AppSyncManager::mount_shared_data(std::vector<SharedDataMount> &mounts)
+{
+    for (SharedDataMount &m : mounts) {
+        if (m.ok && !bind_mount_shared_directory(m.pkg)) {
+            m.ok = false;
+        }
+    }
+}
+
+/*!
+ * \brief Get the code directory of a package in a ROM
+ *
+ * \return Path to the code directory through the ROM's data mountpoint or an
+ *         empty string if the package is not installed in /data
+ */
+static std::string get_code_dir(const std::shared_ptr<Rom> &rom,
+                                const Package &pkg)
+{
+    if (!mb::starts_with(pkg.code_path, APP_CODE_DIR_PREFIX)) {
+        return std::string();
+    }
+
+    std::string data_path = rom->full_data_path();
+    if (data_path.empty()) {
+        return std::string();
+    }
+
+    // Strip the "/data" prefix
+    data_path.append(pkg.code_path, sizeof(APP_CODE_DIR_PREFIX) - 2,
+                     std::string::npos);
+    return data_path;
+}
+
+static ssize_t read_full(int fd, char *buf, size_t size)
+{
+    size_t total = 0;
+
+    while (total < size) {
+        ssize_t n = read(fd, buf + total, size - total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        } else if (n == 0) {
+            break;
+        }
+        total += static_cast<size_t>(n);
+    }
+
+    return static_cast<ssize_t>(total);
+}
+
+static bool files_equal(const std::string &path1, const std::string &path2,
+                        bool *equal)
+{
+    int fd1 = open(path1.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd1 < 0) {
+        LOGW("%s: Failed to open: %s", path1.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd1 = util::finally([&] {
+        close(fd1);
+    });
+
+    int fd2 = open(path2.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd2 < 0) {
+        LOGW("%s: Failed to open: %s", path2.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd2 = util::finally([&] {
+        close(fd2);
+    });
+
+    posix_fadvise(fd1, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd2, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    std::vector<char> buf1(DEDUP_COMPARE_BUF_SIZE);
+    std::vector<char> buf2(DEDUP_COMPARE_BUF_SIZE);
+
+    while (true) {
+        ssize_t n1 = read_full(fd1, buf1.data(), buf1.size());
+        if (n1 < 0) {
+            LOGW("%s: Failed to read: %s", path1.c_str(), strerror(errno));
+            return false;
+        }
+
+        ssize_t n2 = read_full(fd2, buf2.data(), buf2.size());
+        if (n2 < 0) {
+            LOGW("%s: Failed to read: %s", path2.c_str(), strerror(errno));
+            return false;
+        }
+
+        if (n1 != n2 || memcmp(buf1.data(), buf2.data(),
+                               static_cast<size_t>(n1)) != 0) {
+            *equal = false;
+            return true;
+        } else if (n1 == 0) {
+            *equal = true;
+            return true;
+        }
+    }
+}
+
+/*!
+ * \brief Replace \a target with a file sharing the contents of \a source
+ *
+ * If the ownership, mode, and SELinux label of both files match, \a target
+ * becomes a hard link to \a source so that both ROMs also share the page cache.
+ * Otherwise, the data is reflinked into a new file with \a target's metadata,
+ * which is copy-on-write. If neither is possible, \a target is left as is.
+ *
+ * The replacement is atomic since it's created next to \a target and renamed
+ * over it.
+ */
+static bool share_file(const std::string &source, const struct stat &sb_source,
+                       const std::string &target, const struct stat &sb_target)
+{
+    std::string temp(target);
+    temp += DEDUP_TEMP_SUFFIX;
+
+    std::string context_source;
+    std::string context_target;
+    bool same_context =
+            util::selinux_lget_context(source, &context_source)
+            && util::selinux_lget_context(target, &context_target)
+            && context_source == context_target;
+
+    if (unlink(temp.c_str()) < 0 && errno != ENOENT) {
+        LOGW("%s: Failed to remove: %s", temp.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (same_context
+            && sb_source.st_uid == sb_target.st_uid
+            && sb_source.st_gid == sb_target.st_gid
+            && sb_source.st_mode == sb_target.st_mode) {
+        if (link(source.c_str(), temp.c_str()) < 0) {
+            LOGW("%s: Failed to hard link to %s: %s",
+                 source.c_str(), temp.c_str(), strerror(errno));
+            return false;
+        }
+    } else {
+        int fd_source = open(source.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (fd_source < 0) {
+            LOGW("%s: Failed to open: %s", source.c_str(), strerror(errno));
+            return false;
+        }
+
+        auto close_source = util::finally([&] {
+            close(fd_source);
+        });
+
+        int fd_temp = open(temp.c_str(),
+                           O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd_temp < 0) {
+            LOGW("%s: Failed to create: %s", temp.c_str(), strerror(errno));
+            return false;
+        }
+
+        auto close_temp = util::finally([&] {
+            close(fd_temp);
+        });
+
+        struct timespec times[2];
+        times[0] = sb_target.st_atim;
+        times[1] = sb_target.st_mtim;
+
+        if (ioctl(fd_temp, FICLONE, fd_source) < 0) {
+            // Not supported by the filesystem. Keep the separate copy.
+            LOGV("%s: Cannot reflink: %s", target.c_str(), strerror(errno));
+            unlink(temp.c_str());
+            return false;
+        }
+
+        if (!util::copy_stat(target, temp)
+                || !util::copy_xattrs(target, temp)
+                || futimens(fd_temp, times) < 0) {
+            LOGW("%s: Failed to copy metadata to %s",
+                 target.c_str(), temp.c_str());
+            unlink(temp.c_str());
+            return false;
+        }
+    }
+
+    if (rename(temp.c_str(), target.c_str()) < 0) {
+        LOGW("%s: Failed to rename to %s: %s",
+             temp.c_str(), target.c_str(), strerror(errno));
+        unlink(temp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Share identical APKs and native libraries with other ROMs
+ *
+ * For each app installed in the current ROM and at least one other ROM, the
+ * APKs and native libraries are compared byte-by-byte with the other ROMs'
+ * copies at the same relative path. Identical files are replaced as described
+ * in share_file(). Files that already share an inode are skipped without
+ * reading them, so only newly installed or updated apps are compared.
+ *
+ * All paths go through the ROMs' data mountpoints since hard links cannot
+ * cross mountpoints. Files on different filesystems (eg. data images) are
+ * never compared.
+ *
+ * \param roms Installed ROMs and their packages
+ * \param current_rom_id ID of the ROM whose files should be replaced
+ * \param stats Number of files and bytes that were deduplicated
+ */
+void AppSyncManager::dedup_app_files(const std::vector<RomConfigAndPackages> &roms,
+                                     const std::string &current_rom_id,
+                                     AppDedupStats &stats)
+{
+    stats.files = 0;
+    stats.bytes = 0;
+
+    auto current = std::find_if(roms.begin(), roms.end(),
+                                [&](const RomConfigAndPackages &r) {
+        return r.rom->id == current_rom_id;
+    });
+    if (current == roms.end()) {
+        return;
+    }
+
+    for (auto const &pkg : current->packages.pkgs) {
+        std::string code_dir = get_code_dir(current->rom, *pkg);
+        if (code_dir.empty()) {
+            continue;
+        }
+
+        std::vector<std::string> other_dirs;
+
+        for (auto const &other : roms) {
+            if (&other == &*current) {
+                continue;
+            }
+
+            auto other_pkg = other.packages.find_by_pkg(pkg->name);
+            if (!other_pkg) {
+                continue;
+            }
+
+            std::string other_dir = get_code_dir(other.rom, *other_pkg);
+            if (!other_dir.empty()) {
+                other_dirs.push_back(std::move(other_dir));
+            }
+        }
+
+        if (other_dirs.empty()) {
+            continue;
+        }
+
+        std::vector<std::string> files;
+        AppCodeScanner scanner(code_dir, files);
+        if (!scanner.run()) {
+            LOGW("[%s] %s: Failed to scan: %s", pkg->name.c_str(),
+                 code_dir.c_str(), scanner.error().c_str());
+            continue;
+        }
+
+        for (auto const &file : files) {
+            std::string target(code_dir);
+            target += '/';
+            target += file;
+
+            struct stat sb_target;
+            if (lstat(target.c_str(), &sb_target) < 0
+                    || !S_ISREG(sb_target.st_mode)) {
+                continue;
+            }
+
+            for (auto const &other_dir : other_dirs) {
+                std::string source(other_dir);
+                source += '/';
+                source += file;
+
+                struct stat sb_source;
+                if (lstat(source.c_str(), &sb_source) < 0
+                        || !S_ISREG(sb_source.st_mode)
+                        || sb_source.st_dev != sb_target.st_dev
+                        || sb_source.st_size != sb_target.st_size) {
+                    continue;
+                }
+
+                if (sb_source.st_ino == sb_target.st_ino) {
+                    // Already shared
+                    break;
+                }
+
+                bool equal;
+                if (!files_equal(source, target, &equal) || !equal) {
+                    continue;
+                }
+
+                if (share_file(source, sb_source, target, sb_target)) {
+                    LOGV("[%s] Sharing %s with %s", pkg->name.c_str(),
+                         target.c_str(), source.c_str());
+                    ++stats.files;
+                    stats.bytes += static_cast<uint64_t>(sb_target.st_size);
+                    break;
+                }
+            }
+        }
+    }
+}
+
 }
@@ -20,6 +20,9 @@
 #pragma once
 
 #include <string>
+#include <vector>
+
+#include <cstdint>
 
 #include "packages.h"
 #include "roms.h"
@@ -35,6 +38,21 @@ struct RomConfigAndPackages
     Packages packages;
 };
 
+struct AppDedupStats
+{
+    // Files that now share their contents with another ROM's copy
+    uint64_t files;
+    uint64_t bytes;
+};
+
+struct SharedDataMount
+{
+    std::string pkg;
+    uid_t uid;
+    // Cleared if any step fails for this package
+    bool ok;
+};
+
 class AppSyncManager
 {
 public:
@@ -48,6 +66,17 @@ public:
 
     static bool mount_shared_directory(const std::string &pkg, uid_t uid);
     static bool unmount_shared_directory(const std::string &pkg);
+
+    static bool prepare_shared_data(std::vector<SharedDataMount> &mounts);
+    static void mount_shared_data(std::vector<SharedDataMount> &mounts);
+
+    static void dedup_app_files(const std::vector<RomConfigAndPackages> &roms,
+                                const std::string &current_rom_id,
+                                AppDedupStats &stats);
+
+private:
+    static bool prepare_mount_target(const std::string &pkg, uid_t uid);
+    static bool bind_mount_shared_directory(const std::string &pkg);
 };
 
 }
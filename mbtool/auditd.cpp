@@ -19,23 +19,237 @@
 
 #include "auditd.h"
 
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
 #include <cerrno>
+#include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
 #include <getopt.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#include "mblog/async_logger.h"
 #include "mblog/logging.h"
+#include "mblog/stdio_logger.h"
 #include "mbutil/finally.h"
+#include "mbutil/time.h"
 
 #include "external/audit/libaudit.h"
 
 
+// Maximum number of netlink messages received per recvmmsg() call
+#define AUDIT_BATCH_SIZE        16
+// Interval for writing out coalesced AVC records
+#define AUDIT_FLUSH_INTERVAL_MS 1000
+// Maximum number of distinct AVC records held before writing them out
+#define AUDIT_MAX_PENDING       256
+// Sustained number of log lines per second and the allowed burst
+#define AUDIT_RATE_PER_SEC      50
+#define AUDIT_RATE_BURST        200
+
 namespace mb
 {
 
+/*!
+ * \brief Coalesces and rate limits audit records before they are logged
+ *
+ * AVC records that only differ in their timestamp are counted instead of being
+ * logged individually. They are written out every AUDIT_FLUSH_INTERVAL_MS. All
+ * lines go through a token bucket. Lines that exceed the rate are dropped and
+ * the number of dropped lines is logged once tokens are available again.
+ */
+class AuditLog
+{
+public:
+    AuditLog()
+        : _tokens(AUDIT_RATE_BURST)
+        , _last_refill(util::current_time_ms())
+        , _suppressed(0)
+        , _flush_deadline(0)
+    {
+    }
+
+    void add(int type, const char *data, size_t len)
+    {
+        if (type != AUDIT_AVC) {
+            emit(type, data, len, 1);
+            return;
+        }
+
+        // Strip "audit(<time>:<serial>): " so that repeated denials match
+        const char *end = data + len;
+        const char *body = static_cast<const char *>(memchr(data, ')', len));
+        if (body && end - body >= 3 && body[1] == ':' && body[2] == ' ') {
+            body += 3;
+        } else {
+            body = data;
+        }
+
+        std::string key(body, end);
+
+        auto it = _index.find(key);
+        if (it != _index.end()) {
+            ++_pending[it->second].count;
+            return;
+        }
+
+        if (_pending.empty()) {
+            _flush_deadline = util::current_time_ms() + AUDIT_FLUSH_INTERVAL_MS;
+        }
+
+        _index.emplace(key, _pending.size());
+        _pending.push_back({std::move(key), 1});
+
+        if (_pending.size() >= AUDIT_MAX_PENDING) {
+            flush();
+        }
+    }
+
+    void flush()
+    {
+        for (auto const &avc : _pending) {
+            emit(AUDIT_AVC, avc.msg.data(), avc.msg.size(), avc.count);
+        }
+
+        _pending.clear();
+        _index.clear();
+    }
+
+    // Milliseconds until the pending records must be written or -1 if there
+    // are none
+    int flush_timeout() const
+    {
+        if (_pending.empty()) {
+            return -1;
+        }
+
+        uint64_t now = util::current_time_ms();
+        return now >= _flush_deadline
+                ? 0 : static_cast<int>(_flush_deadline - now);
+    }
+
+private:
+    struct PendingAvc
+    {
+        std::string msg;
+        unsigned int count;
+    };
+
+    bool take_token()
+    {
+        uint64_t now = util::current_time_ms();
+
+        _tokens = std::min<double>(
+                AUDIT_RATE_BURST,
+                _tokens + (now - _last_refill) * AUDIT_RATE_PER_SEC / 1000.0);
+        _last_refill = now;
+
+        if (_tokens < 1) {
+            return false;
+        }
+
+        _tokens -= 1;
+        return true;
+    }
+
+    void emit(int type, const char *data, size_t len, unsigned int count)
+    {
+        if (!take_token()) {
+            ++_suppressed;
+            return;
+        }
+
+        if (_suppressed > 0) {
+            LOGW("Rate limit dropped %" PRIu64 " audit records", _suppressed);
+            _suppressed = 0;
+        }
+
+        if (count > 1) {
+            LOGV("type=%d %.*s (x%u)",
+                 type, static_cast<int>(len), data, count);
+        } else {
+            LOGV("type=%d %.*s", type, static_cast<int>(len), data);
+        }
+    }
+
+    std::unordered_map<std::string, size_t> _index;
+    std::vector<PendingAvc> _pending;
+
+    double _tokens;
+    uint64_t _last_refill;
+    uint64_t _suppressed;
+    uint64_t _flush_deadline;
+};
+
+/*!
+ * \brief Receive a batch of audit records and pass them to \p log
+ *
+ * \return Whether the socket is still usable
+ */
+static bool receive_batch(int fd, AuditLog &log)
+{
+    static audit_message msgs[AUDIT_BATCH_SIZE];
+    struct sockaddr_nl addrs[AUDIT_BATCH_SIZE];
+    struct iovec iovs[AUDIT_BATCH_SIZE];
+    struct mmsghdr hdrs[AUDIT_BATCH_SIZE];
+
+    memset(hdrs, 0, sizeof(hdrs));
+
+    for (size_t i = 0; i < AUDIT_BATCH_SIZE; ++i) {
+        iovs[i].iov_base = &msgs[i];
+        iovs[i].iov_len = sizeof(msgs[i]);
+        hdrs[i].msg_hdr.msg_name = &addrs[i];
+        hdrs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        hdrs[i].msg_hdr.msg_iov = &iovs[i];
+        hdrs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int n = recvmmsg(fd, hdrs, AUDIT_BATCH_SIZE, MSG_DONTWAIT, nullptr);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return true;
+        } else if (errno == ENOBUFS) {
+            LOGW("Audit socket overflowed; some records were lost");
+            return true;
+        }
+        LOGE("Failed to receive from audit socket: %s", strerror(errno));
+        return false;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        const audit_message &msg = msgs[i];
+        size_t msg_len = hdrs[i].msg_len;
+
+        // Make sure the netlink message was not spoofed
+        if (hdrs[i].msg_hdr.msg_namelen != sizeof(addrs[i])
+                || addrs[i].nl_pid != 0) {
+            LOGW("Ignoring audit message from invalid sender");
+            continue;
+        }
+
+        if (!NLMSG_OK(&msg.nlh, msg_len)) {
+            LOGW("Ignoring malformed audit message");
+            continue;
+        }
+
+        // As before, nlmsg_len is treated as the payload size
+        size_t len = std::min<size_t>(msg.nlh.nlmsg_len, sizeof(msg.data));
+        len = strnlen(msg.data, len);
+
+        log.add(msg.nlh.nlmsg_type, msg.data, len);
+    }
+
+    return true;
+}
+
 static bool audit_mainloop()
 {
     int fd = audit_open();
@@ -52,19 +266,26 @@ static bool audit_mainloop()
         return false;
     }
 
+    AuditLog log;
+
     while (true) {
-        struct audit_message reply;
-        reply.nlh.nlmsg_type = 0;
-        reply.nlh.nlmsg_len = 0;
-        reply.data[0] = '\0';
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
 
-        if (audit_get_reply(fd, &reply, GET_REPLY_BLOCKING, 0) < 0) {
-            LOGE("Failed to get reply from audit socket: %s", strerror(errno));
+        int ret = poll(&pfd, 1, log.flush_timeout());
+        if (ret < 0 && errno != EINTR) {
+            LOGE("Failed to poll audit socket: %s", strerror(errno));
             return false;
         }
 
-        LOGV("type=%d %.*s",
-             reply.nlh.nlmsg_type, reply.nlh.nlmsg_len, reply.data);
+        if (ret > 0 && !receive_batch(fd, log)) {
+            return false;
+        }
+
+        if (log.flush_timeout() == 0) {
+            log.flush();
+        }
     }
 
     return false;
@@ -109,6 +330,11 @@ int auditd_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    // Write the records from a background thread so that a flood of denials
+    // does not stall the intake
+    log::log_set_logger(std::make_shared<log::AsyncLogger>(
+            std::make_shared<log::StdioLogger>(stdout, false), 512, true));
+
     return audit_mainloop() ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
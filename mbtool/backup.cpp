@@ -20,20 +20,33 @@
 #include "backup.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cinttypes>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <archive.h>
 #include <archive_entry.h>
 
+#include "mbcommon/file/standard.h"
+#include "mbcommon/file_util.h"
 #include "mbcommon/string.h"
+#include "mbcommon/thread_pool.h"
+#include "mblog/kmsg_logger.h"
 #include "mblog/logging.h"
 #include "mbutil/autoclose/archive.h"
 #include "mbutil/autoclose/dir.h"
@@ -43,12 +56,21 @@
 #include "mbutil/directory.h"
 #include "mbutil/file.h"
 #include "mbutil/finally.h"
+#include "mbutil/hash.h"
+#include "mbutil/integer.h"
 #include "mbutil/mount.h"
 #include "mbutil/path.h"
+#include "mbutil/progress.h"
+#include "mbutil/sched_policy.h"
 #include "mbutil/selinux.h"
 #include "mbutil/string.h"
 #include "mbutil/time.h"
 
+#include "mbsparse/sparse.h"
+#include "mbsparse/writer.h"
+
+#include "backup_manifest.h"
+#include "backup_store.h"
 #include "installer_util.h"
 #include "image.h"
 #include "multiboot.h"
@@ -78,6 +100,27 @@ namespace mb
 #define BACKUP_NAME_CONFIG              "config.json"
 #define BACKUP_NAME_THUMBNAIL           "thumbnail.webp"
 
+// Per-partition files for incremental backups: "<prefix>.manifest" lists the
+// partition contents and "<prefix>.parent" names the parent backup
+#define BACKUP_SUFFIX_MANIFEST          ".manifest"
+#define BACKUP_SUFFIX_PARENT            ".parent"
+// Block-level copies of ext4 images
+#define BACKUP_SUFFIX_SPARSE_IMAGE      ".sparse.img"
+// Marks archives whose regular file contents are in the backup store
+#define BACKUP_SUFFIX_DEDUP             ".dedup"
+// "<archive>.sha512" holds the SHA512 hash and size of the archive, computed
+// while the archive was written
+#define BACKUP_SUFFIX_DIGEST            ".sha512"
+// Content-addressed store shared by all deduplicated backups
+#define BACKUP_STORE_DIR                ".store"
+// Granularity for skipping zero-filled regions when restoring sparse images
+#define BACKUP_SPARSE_SKIP_SIZE         4096
+// Block size for block copies of images that aren't ext4
+#define BACKUP_RAW_BLOCK_SIZE           4096
+#define BACKUP_MAX_CHAIN_LENGTH         64
+// Maximum number of partition targets processed concurrently by default
+#define BACKUP_DEFAULT_JOBS             2
+
 enum class Result
 {
     SUCCEEDED,
@@ -98,6 +141,38 @@ struct compression_map {
     { util::compression_type::NONE, nullptr, nullptr }
 };
 
+struct BackupOptions
+{
+    util::compression_type compression;
+    unsigned int threads;
+    // Whether to store SHA512 checksums in the manifests
+    bool checksums;
+    // Whether to copy the allocated blocks of images instead of archiving
+    // their contents
+    bool block_copy;
+    // Parent backup for incremental backups (empty for full backups)
+    std::string parent_name;
+    std::string parent_dir;
+    // Store for the contents of regular files (empty to keep them in the
+    // archives)
+    std::string store_dir;
+    // Maximum number of partition targets to back up concurrently
+    unsigned int jobs;
+};
+
+struct BackupArchive
+{
+    std::string path;
+    util::compression_type compression;
+    // If the archive only contains metadata, the store and manifest to restore
+    // the regular file contents from
+    std::string store_dir;
+    std::string store_manifest;
+    // Checksum of the archive file (missing for older backups)
+    bool has_digest;
+    util::ArchiveDigest digest;
+};
+
 static int parse_targets_string(const std::string &targets)
 {
     std::vector<std::string> targets_list = util::split(targets, ",");
@@ -166,10 +241,322 @@ static std::string find_compressed_backup(const std::string &backup_dir,
     return std::string();
 }
 
-static bool backup_directory(const std::string &output_file,
-                             const std::string &directory,
-                             const std::vector<std::string> &exclusions,
-                             util::compression_type compression)
+static bool is_valid_backup_name(const std::string &name)
+{
+    // No empty strings, hidden paths, '..', or directory separators
+    return !name.empty()                            // Must be non-empty
+            && name.find('/') == std::string::npos  // and contain no slashes
+            && name != "."                          // and not current directory
+            && name != ".."                         // and not parent directory
+            && name != BACKUP_STORE_DIR;            // and not the store
+}
+
+static bool write_archive_digest(const std::string &archive,
+                                 const util::ArchiveDigest &digest)
+{
+    std::string path(archive);
+    path += BACKUP_SUFFIX_DIGEST;
+
+    std::string data = format("%s %" PRIu64 "\n",
+                              util::hex_string(digest.sha512.data(),
+                                               digest.sha512.size()).c_str(),
+                              digest.size);
+
+    if (!util::file_write_data(path, data.data(), data.size())) {
+        LOGE("%s: Failed to write file: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Read the checksum of an archive
+ *
+ * \return Result::SUCCEEDED if the checksum was read
+ *         Result::FAILED if the checksum file is invalid
+ *         Result::FILES_MISSING if the archive has no checksum file
+ */
+static Result read_archive_digest(const std::string &archive,
+                                  util::ArchiveDigest &digest)
+{
+    std::string path(archive);
+    path += BACKUP_SUFFIX_DIGEST;
+
+    if (access(path.c_str(), F_OK) < 0) {
+        if (errno == ENOENT) {
+            return Result::FILES_MISSING;
+        }
+        LOGE("%s: Failed to access: %s", path.c_str(), strerror(errno));
+        return Result::FAILED;
+    }
+
+    std::string line;
+    char hex[2 * SHA512_DIGEST_LENGTH + 1];
+    unsigned int byte;
+
+    if (!util::file_first_line(path, &line)
+            || sscanf(line.c_str(), "%128s %" SCNu64, hex, &digest.size) != 2
+            || strlen(hex) != sizeof(hex) - 1) {
+        LOGE("%s: Invalid checksum file", path.c_str());
+        return Result::FAILED;
+    }
+
+    for (size_t i = 0; i < digest.sha512.size(); ++i) {
+        if (!isxdigit(hex[2 * i]) || !isxdigit(hex[2 * i + 1])
+                || sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+            LOGE("%s: Invalid checksum file", path.c_str());
+            return Result::FAILED;
+        }
+        digest.sha512[i] = static_cast<unsigned char>(byte);
+    }
+
+    return Result::SUCCEEDED;
+}
+
+// How often backup and restore progress is logged
+#define PROGRESS_INTERVAL_MS    5000
+
+static void log_progress(const std::string &label,
+                         const util::ProgressStats &s)
+{
+    double mib = s.bytes / 1024.0 / 1024.0;
+
+    if (s.finished) {
+        LOGI("- %s: %" PRIu64 " files, %.1f MiB in %.1f s (%.1f MiB/s)",
+             label.c_str(), s.files, mib, s.elapsed_s,
+             s.elapsed_s > 0 ? mib / s.elapsed_s : 0);
+    } else if (s.eta_s >= 0) {
+        LOGI("- %s: %" PRIu64 " files, %.1f of %.1f MiB"
+             " (%.1f MiB/s, %.0f s left)",
+             label.c_str(), s.files, mib, s.total_bytes / 1024.0 / 1024.0,
+             s.bytes_per_sec / 1024 / 1024, s.eta_s);
+    } else {
+        LOGI("- %s: %" PRIu64 " files, %.1f MiB (%.1f MiB/s)",
+             label.c_str(), s.files, mib, s.bytes_per_sec / 1024 / 1024);
+    }
+}
+
+/*!
+ * \brief Combines the progress of targets that are processed concurrently
+ *
+ * Each target reports to its own slot. Intermediate reports are merged into a
+ * single line covering all unfinished targets, logged at most once every
+ * PROGRESS_INTERVAL_MS. Final reports are logged per target.
+ */
+class ProgressAggregator
+{
+public:
+    ProgressAggregator() : _last_log_ms(0)
+    {
+    }
+
+    ProgressAggregator(const ProgressAggregator &) = delete;
+    ProgressAggregator & operator=(const ProgressAggregator &) = delete;
+
+    util::ProgressCallback callback(const std::string &name)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+
+        size_t index = _slots.size();
+        _slots.emplace_back();
+        _slots.back().name = name;
+        _slots.back().active = false;
+
+        return [this, index](const util::ProgressStats &s) {
+            update(index, s);
+        };
+    }
+
+private:
+    struct Slot
+    {
+        std::string name;
+        util::ProgressStats stats;
+        // Whether the target has reported and not finished yet
+        bool active;
+    };
+
+    static uint64_t now_ms()
+    {
+        return static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch())
+                        .count());
+    }
+
+    void update(size_t index, const util::ProgressStats &s)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+
+        Slot &slot = _slots[index];
+        slot.stats = s;
+        slot.active = !s.finished;
+
+        if (s.finished) {
+            log_progress(slot.name, s);
+            return;
+        }
+
+        uint64_t now = now_ms();
+        if (_last_log_ms != 0 && now - _last_log_ms < PROGRESS_INTERVAL_MS) {
+            return;
+        }
+        _last_log_ms = now;
+
+        std::string label;
+        util::ProgressStats total{};
+        bool total_known = true;
+
+        for (auto const &other : _slots) {
+            if (!other.active) {
+                continue;
+            }
+            if (!label.empty()) {
+                label += '+';
+            }
+            label += other.name;
+
+            total.files += other.stats.files;
+            total.bytes += other.stats.bytes;
+            total.total_bytes += other.stats.total_bytes;
+            total.bytes_per_sec += other.stats.bytes_per_sec;
+            total.elapsed_s = std::max(total.elapsed_s, other.stats.elapsed_s);
+            total_known = total_known && other.stats.total_bytes > 0;
+        }
+
+        if (total_known && total.bytes_per_sec > 0
+                && total.total_bytes >= total.bytes) {
+            total.eta_s = (total.total_bytes - total.bytes)
+                    / total.bytes_per_sec;
+        } else {
+            total.eta_s = -1;
+        }
+
+        log_progress(label, total);
+    }
+
+    std::mutex _lock;
+    std::vector<Slot> _slots;
+    uint64_t _last_log_ms;
+};
+
+/*!
+ * \brief Backup or restore job for a single partition target
+ */
+struct TargetJob
+{
+    // Target name for log messages
+    std::string name;
+    // Storage device that the job reads from (backup) or writes to (restore)
+    dev_t device;
+    std::function<bool(const util::ProgressCallback &)> run;
+};
+
+/*!
+ * \brief Get the storage device that holds a path
+ *
+ * If \a path does not exist yet, the device of the closest existing parent
+ * directory is returned.
+ */
+static dev_t storage_device(std::string path)
+{
+    struct stat sb;
+
+    while (stat(path.c_str(), &sb) < 0) {
+        if (path.empty() || path == "/" || path == ".") {
+            return 0;
+        }
+        path = util::dir_name(path);
+    }
+
+    return sb.st_dev;
+}
+
+/*!
+ * \brief Run partition jobs with bounded concurrency
+ *
+ * Jobs whose paths are on the same storage device are run one after another in
+ * their original order, so two jobs never compete for the same disk. Up to
+ * \a max_jobs devices are processed concurrently. After a job fails, no new
+ * jobs are started, but the jobs that are already running are allowed to
+ * finish.
+ *
+ * \return Whether all jobs succeeded
+ */
+static bool run_target_jobs(const std::vector<TargetJob> &jobs,
+                            unsigned int max_jobs)
+{
+    std::vector<std::vector<const TargetJob *>> groups;
+    std::vector<dev_t> group_devices;
+
+    for (auto const &job : jobs) {
+        auto it = std::find(group_devices.begin(), group_devices.end(),
+                            job.device);
+        if (it == group_devices.end()) {
+            group_devices.push_back(job.device);
+            groups.emplace_back();
+            groups.back().push_back(&job);
+        } else {
+            groups[static_cast<size_t>(it - group_devices.begin())]
+                    .push_back(&job);
+        }
+    }
+
+    ProgressAggregator progress;
+    std::vector<util::ProgressCallback> callbacks;
+    for (auto const &job : jobs) {
+        callbacks.push_back(progress.callback(job.name));
+    }
+
+    std::atomic<size_t> next_group(0);
+    std::atomic_bool failed(false);
+
+    auto worker = [&] {
+        size_t index;
+        while ((index = next_group++) < groups.size()) {
+            for (auto const *job : groups[index]) {
+                if (failed) {
+                    return;
+                }
+                if (!job->run(callbacks[static_cast<size_t>(
+                        job - jobs.data())])) {
+                    failed = true;
+                }
+            }
+        }
+    };
+
+    size_t n_threads = std::min<size_t>(std::max(max_jobs, 1u),
+                                        groups.size());
+
+    if (n_threads > 1) {
+        LOGI("Processing %zu targets on %zu storage devices"
+             " (%zu concurrently)", jobs.size(), groups.size(), n_threads);
+    }
+
+    // The calling thread is one of the workers
+    run_concurrently(static_cast<unsigned int>(n_threads), worker);
+
+    return !failed;
+}
+
+/*!
+ * \brief Backup a directory
+ *
+ * A manifest of the directory contents is always written to \a manifest_file.
+ * If \a parent is not null, only the entries that changed relative to the
+ * parent backup's manifest are stored in the archive.
+ *
+ * If \a options specifies a store, the contents of regular files are copied
+ * to the store instead and the archive only contains the metadata.
+ */
+/*!
+ * \brief List the top-level entries of a directory that should be archived
+ */
+static bool list_directory(const std::string &directory,
+                           const std::vector<std::string> &exclusions,
+                           std::vector<std::string> &contents)
 {
     autoclose::dir dp(autoclose::opendir(directory.c_str()));
     if (!dp) {
@@ -178,7 +565,6 @@ static bool backup_directory(const std::string &output_file,
         return false;
     }
 
-    std::vector<std::string> contents;
     dirent *ent;
     errno = 0;
 
@@ -198,59 +584,461 @@ static bool backup_directory(const std::string &output_file,
         return false;
     }
 
-    return util::libarchive_tar_create(output_file, directory, contents,
-                                       compression);
+    return true;
 }
 
-static bool restore_directory(const std::string &input_file,
+static bool backup_directory(const std::string &output_file,
+                             const std::string &directory,
+                             const std::vector<std::string> &exclusions,
+                             const BackupOptions &options,
+                             const std::string &manifest_file,
+                             const BackupManifest *parent,
+                             const util::ProgressCallback &progress_cb)
+{
+    bool dedup = !options.store_dir.empty();
+
+    // The store is keyed by the checksums
+    BackupManifest manifest;
+    if (!manifest.scan(directory, exclusions, options.checksums || dedup)) {
+        return false;
+    }
+
+    std::vector<std::string> contents;
+
+    if (parent) {
+        contents = manifest.changed_since(*parent);
+
+        LOGI("%zu of %zu entries changed since the parent backup",
+             contents.size(), manifest.entries().size());
+    } else if (!list_directory(directory, exclusions, contents)) {
+        return false;
+    }
+
+    // The manifest already has the size of everything that will be archived
+    uint64_t total_bytes = 0;
+    if (parent) {
+        for (auto const &path : contents) {
+            auto entry = manifest.find(path);
+            if (entry && S_ISREG(entry->mode)) {
+                total_bytes += entry->size;
+            }
+        }
+    } else {
+        for (auto const &entry : manifest.entries()) {
+            if (S_ISREG(entry.mode)) {
+                total_bytes += entry.size;
+            }
+        }
+    }
+
+    util::ProgressTracker progress(progress_cb, PROGRESS_INTERVAL_MS);
+    progress.set_total_bytes(total_bytes);
+
+    if (dedup) {
+        BackupStore store(options.store_dir);
+        uint64_t bytes_added;
+
+        if (!store.add_files(directory, manifest, &progress, &bytes_added)) {
+            return false;
+        }
+
+        progress.finish();
+
+        LOGI("%" PRIu64 " of %" PRIu64 " bytes were not in the store yet",
+             bytes_added, total_bytes);
+    }
+
+    // The archive is checksummed while it is written so that verifying it
+    // later doesn't need a separate pass right after the backup
+    util::ArchiveDigest digest;
+
+    // Incremental archives list every changed entry explicitly, so
+    // directories must not be descended into
+    if (!util::libarchive_tar_create(output_file, directory, contents,
+                                     options.compression, options.threads,
+                                     !parent, !dedup,
+                                     dedup ? nullptr : &progress, &digest)
+            || !write_archive_digest(output_file, digest)) {
+        return false;
+    }
+
+    if (!dedup) {
+        progress.finish();
+    }
+
+    return manifest.save(manifest_file);
+}
+
+/*!
+ * \brief Restore a directory from a chain of backup archives
+ *
+ * The archives are extracted in order, oldest first. If there is more than one
+ * archive, the entries that are not in \a manifest_file (ie. the ones that were
+ * deleted between backups) are removed afterwards.
+ *
+ * Archives from deduplicated backups only contain metadata. The regular file
+ * contents are filled in from the store right after such an archive is
+ * extracted.
+ *
+ * If \a swap_delete is true, the old contents are moved aside instead of being
+ * deleted up front. They are deleted by a low-priority thread while the
+ * archives are extracted. This needs enough free space for both the old and
+ * the new contents in the worst case.
+ */
+static bool restore_directory(const std::vector<BackupArchive> &chain,
                               const std::string &directory,
                               const std::vector<std::string> &exclusions,
-                              util::compression_type compression)
+                              const std::string &manifest_file,
+                              bool swap_delete,
+                              const util::ProgressCallback &progress_cb)
+{
+    // Waits for the old contents to be deleted on every return path
+    util::TrashDeleter trash;
+
+    if (swap_delete) {
+        if (!wipe_directory(directory, exclusions, trash)) {
+            return false;
+        }
+    } else if (!wipe_directory(directory, exclusions)) {
+        return false;
+    }
+
+    for (auto const &archive : chain) {
+        util::ProgressTracker progress(progress_cb, PROGRESS_INTERVAL_MS);
+
+        // One writer thread per CPU. Restoring is bound by per-file syscalls,
+        // not decompression.
+        if (!archive.has_digest) {
+            LOGW("%s: No checksum; restoring without verification",
+                 archive.path.c_str());
+        }
+
+        // The archive is verified while it is extracted instead of in a
+        // separate pass beforehand
+        if (!util::libarchive_tar_extract_parallel(
+                archive.path, directory, {}, archive.compression, 0,
+                &progress, archive.has_digest ? &archive.digest : nullptr)) {
+            return false;
+        }
+
+        if (!archive.store_manifest.empty()) {
+            BackupManifest manifest;
+            BackupStore store(archive.store_dir);
+
+            if (!manifest.load(archive.store_manifest)
+                    || !store.restore_files(directory, manifest, &progress)) {
+                return false;
+            }
+        }
+
+        progress.finish();
+    }
+
+    if (chain.size() > 1) {
+        // The trash is still being deleted
+        std::vector<std::string> prune_exclusions(exclusions);
+        if (!trash.trash_name().empty()) {
+            prune_exclusions.push_back(trash.trash_name());
+        }
+
+        BackupManifest manifest;
+        if (!manifest.load(manifest_file)
+                || !manifest.prune(directory, prune_exclusions)) {
+            return false;
+        }
+    }
+
+    return trash.wait();
+}
+
+// Each target gets its own mount point so that images can be mounted
+// concurrently
+static std::string get_mount_dir(const std::string &prefix)
+{
+    std::string mount_dir(BACKUP_MNT_DIR);
+    mount_dir += '/';
+    mount_dir += prefix;
+    return mount_dir;
+}
+
+static void remove_mount_dir(const std::string &mount_dir)
+{
+    rmdir(mount_dir.c_str());
+    // Fails if another target's image is still mounted
+    rmdir(BACKUP_MNT_DIR);
+}
+
+static bool mount_image_ro(const std::string &image,
+                           const std::string &mount_dir)
 {
-    if (!wipe_directory(directory, exclusions)) {
+    if (!util::mkdir_recursive(mount_dir, 0755) && errno != EEXIST) {
+        LOGE("%s: Failed to create directory: %s",
+             mount_dir.c_str(), strerror(errno));
         return false;
     }
 
-    return util::libarchive_tar_extract(input_file, directory, {}, compression);
+    bool compressed = false;
+    CompressedImageType type;
+    get_compressed_image_type(image, compressed, type);
+
+    if (!compressed) {
+        fsck_ext4_image(image);
+    }
+
+    if (!util::mount(image.c_str(), mount_dir.c_str(), "auto", MS_RDONLY,
+                     "")) {
+        LOGE("Failed to mount %s at %s: %s", image.c_str(), mount_dir.c_str(),
+             strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static bool unmount_image(const std::string &mount_dir)
+{
+    if (!util::umount(mount_dir.c_str())) {
+        LOGE("Failed to unmount %s: %s", mount_dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    remove_mount_dir(mount_dir);
+
+    return true;
 }
 
 static bool backup_image(const std::string &output_file,
                          const std::string &image,
+                         const std::string &mount_dir,
                          const std::vector<std::string> &exclusions,
-                         util::compression_type compression)
+                         const BackupOptions &options,
+                         const std::string &manifest_file,
+                         const BackupManifest *parent,
+                         const util::ProgressCallback &progress_cb)
 {
-    if (!util::mkdir_recursive(BACKUP_MNT_DIR, 0755) && errno != EEXIST) {
-        LOGE("%s: Failed to create directory: %s",
-             BACKUP_MNT_DIR, strerror(errno));
+    if (!mount_image_ro(image, mount_dir)) {
         return false;
     }
 
+    bool ret = backup_directory(output_file, mount_dir, exclusions,
+                                options, manifest_file, parent, progress_cb);
+
+    return unmount_image(mount_dir) && ret;
+}
+
+/*!
+ * \brief Backup the allocated blocks of an ext4 image as a sparse image
+ *
+ * Unlike backup_image(), this does not need to mount the image or go through
+ * the VFS.
+ *
+ * If the allocated blocks cannot be determined (eg. for non-ext4 images), the
+ * entire image is copied instead. In both cases, zero-filled blocks are stored
+ * as "don't care" chunks since restore_image_blocks() always recreates the
+ * image from scratch.
+ */
+static bool backup_image_blocks(const std::string &output_file,
+                                const std::string &image)
+{
+    uint32_t block_size;
+    uint64_t block_count;
+    std::vector<sparse::BlockRange> ranges;
+
     fsck_ext4_image(image);
 
-    if (!util::mount(image.c_str(), BACKUP_MNT_DIR, "ext4", MS_RDONLY, "")) {
-        LOGE("Failed to mount %s at %s: %s", image.c_str(), BACKUP_MNT_DIR,
-             strerror(errno));
+    if (!ext4_image_allocated_blocks(image, block_size, block_count, ranges)) {
+        struct stat sb;
+        if (stat(image.c_str(), &sb) < 0) {
+            LOGE("%s: Failed to stat: %s", image.c_str(), strerror(errno));
+            return false;
+        }
+
+        uint64_t size = static_cast<uint64_t>(sb.st_size);
+        if (size % BACKUP_RAW_BLOCK_SIZE != 0) {
+            LOGE("%s: Size %" PRIu64 " is not a multiple of %d bytes",
+                 image.c_str(), size, BACKUP_RAW_BLOCK_SIZE);
+            return false;
+        }
+
+        LOGW("%s: Copying all blocks of the image", image.c_str());
+
+        block_size = BACKUP_RAW_BLOCK_SIZE;
+        block_count = size / BACKUP_RAW_BLOCK_SIZE;
+        ranges.clear();
+        if (block_count > 0) {
+            ranges.push_back({0, block_count});
+        }
+    }
+
+    uint64_t used = 0;
+    for (auto const &r : ranges) {
+        used += r.end - r.begin;
+    }
+
+    LOGI("Copying %" PRIu64 " of %" PRIu64 " blocks (%" PRIu32 " bytes each)",
+         used, block_count, block_size);
+
+    StandardFile fin;
+    StandardFile fout;
+
+    if (!fin.open(image, FileOpenMode::READ_ONLY)) {
+        LOGE("%s: Failed to open for reading: %s",
+             image.c_str(), fin.error_string().c_str());
         return false;
     }
 
-    bool ret = backup_directory(output_file, BACKUP_MNT_DIR, exclusions,
-                                compression);
+    if (!fout.open(output_file, FileOpenMode::WRITE_ONLY)) {
+        LOGE("%s: Failed to open for writing: %s",
+             output_file.c_str(), fout.error_string().c_str());
+        return false;
+    }
 
-    if (!util::umount(BACKUP_MNT_DIR)) {
-        LOGE("Failed to unmount %s: %s", BACKUP_MNT_DIR, strerror(errno));
+    if (!sparse::write_sparse_file(fin, fout, block_size, block_count,
+                                   ranges, true)) {
+        LOGE("%s: Failed to write sparse image: %s",
+             output_file.c_str(), fout.error_string().c_str());
         return false;
     }
 
-    rmdir(BACKUP_MNT_DIR);
+    if (!fout.close()) {
+        LOGE("%s: Failed to close file: %s",
+             output_file.c_str(), fout.error_string().c_str());
+        return false;
+    }
 
-    return ret;
+    return true;
+}
+
+/*!
+ * \brief Restore an ext4 image from a sparse image
+ *
+ * The image is recreated from scratch. Blocks that are not stored in the sparse
+ * image (or are all zeros) are left as holes. "Don't care" regions are skipped
+ * entirely, so restoring a mostly empty image only reads its data chunks.
+ */
+static bool restore_image_blocks(const std::string &input_file,
+                                 const std::string &image)
+{
+    if (!util::mkdir_parent(image, S_IRWXU)) {
+        LOGE("%s: Failed to create parent directory: %s",
+             image.c_str(), strerror(errno));
+        return false;
+    }
+
+    StandardFile fin;
+    sparse::SparseFile sparse_file;
+    StandardFile fout;
+
+    if (!fin.open(input_file, FileOpenMode::READ_ONLY)) {
+        LOGE("%s: Failed to open for reading: %s",
+             input_file.c_str(), fin.error_string().c_str());
+        return false;
+    }
+
+    if (!sparse_file.open(&fin)) {
+        LOGE("%s: Failed to open sparse image: %s",
+             input_file.c_str(), sparse_file.error_string().c_str());
+        return false;
+    }
+
+    if (!fout.open(image, FileOpenMode::WRITE_ONLY)) {
+        LOGE("%s: Failed to open for writing: %s",
+             image.c_str(), fout.error_string().c_str());
+        return false;
+    }
+
+    uint64_t size = sparse_file.size();
+
+    if (!fout.truncate(size)) {
+        LOGE("%s: Failed to set size to %" PRIu64 ": %s",
+             image.c_str(), size, fout.error_string().c_str());
+        return false;
+    }
+
+    std::vector<unsigned char> buf(1024 * 1024);
+    std::vector<unsigned char> zeros(BACKUP_SPARSE_SKIP_SIZE);
+    uint64_t offset = 0;
+
+    while (offset < size) {
+        uint64_t region_size;
+        bool dont_care;
+        size_t n;
+
+        if (!sparse_file.region(region_size, dont_care)) {
+            LOGE("%s: Failed to read sparse image: %s",
+                 input_file.c_str(), sparse_file.error_string().c_str());
+            return false;
+        } else if (region_size == 0) {
+            LOGE("%s: Unexpected EOF in sparse image", input_file.c_str());
+            return false;
+        }
+
+        // "Don't care" regions are already holes in the truncated image, so
+        // skip them without reading back their zeros
+        if (dont_care) {
+            offset += region_size;
+
+            if (!sparse_file.seek(static_cast<int64_t>(offset), SEEK_SET,
+                                  nullptr)) {
+                LOGE("%s: Failed to seek sparse image: %s",
+                     input_file.c_str(), sparse_file.error_string().c_str());
+                return false;
+            }
+            continue;
+        }
+
+        size_t to_read = static_cast<size_t>(
+                std::min<uint64_t>(region_size, buf.size()));
+
+        if (!file_read_fully(sparse_file, buf.data(), to_read, n)) {
+            LOGE("%s: Failed to read sparse image: %s",
+                 input_file.c_str(), sparse_file.error_string().c_str());
+            return false;
+        } else if (n == 0) {
+            LOGE("%s: Unexpected EOF in sparse image", input_file.c_str());
+            return false;
+        }
+
+        // Only write chunks that contain data so that the image stays sparse
+        for (size_t pos = 0; pos < n; pos += zeros.size()) {
+            size_t chunk = std::min(n - pos, zeros.size());
+
+            if (memcmp(buf.data() + pos, zeros.data(), chunk) == 0) {
+                continue;
+            }
+
+            size_t written;
+            if (!fout.seek(static_cast<int64_t>(offset + pos), SEEK_SET,
+                           nullptr)
+                    || !file_write_fully(fout, buf.data() + pos, chunk,
+                                         written)
+                    || written != chunk) {
+                LOGE("%s: Failed to write image: %s",
+                     image.c_str(), fout.error_string().c_str());
+                return false;
+            }
+        }
+
+        offset += n;
+    }
+
+    if (!fout.close()) {
+        LOGE("%s: Failed to close file: %s",
+             image.c_str(), fout.error_string().c_str());
+        return false;
+    }
+
+    return true;
 }
 
-static bool restore_image(const std::string &input_file,
+static bool restore_image(const std::vector<BackupArchive> &chain,
                           const std::string &image,
+                          const std::string &mount_dir,
                           uint64_t size,
                           const std::vector<std::string> &exclusions,
-                          util::compression_type compression)
+                          const std::string &manifest_file,
+                          bool swap_delete,
+                          const util::ProgressCallback &progress_cb)
 {
     if (!util::mkdir_parent(image, S_IRWXU)) {
         LOGE("%s: Failed to create parent directory: %s",
@@ -271,29 +1059,29 @@ static bool restore_image(const std::string &input_file,
         }
     }
 
-    if (!util::mkdir_recursive(BACKUP_MNT_DIR, 0755) && errno != EEXIST) {
+    if (!util::mkdir_recursive(mount_dir, 0755) && errno != EEXIST) {
         LOGE("%s: Failed to create directory: %s",
-             BACKUP_MNT_DIR, strerror(errno));
+             mount_dir.c_str(), strerror(errno));
         return false;
     }
 
     fsck_ext4_image(image);
 
-    if (!util::mount(image.c_str(), BACKUP_MNT_DIR, "ext4", 0, "")) {
-        LOGE("Failed to mount %s at %s: %s", image.c_str(), BACKUP_MNT_DIR,
+    if (!util::mount(image.c_str(), mount_dir.c_str(), "ext4", 0, "")) {
+        LOGE("Failed to mount %s at %s: %s", image.c_str(), mount_dir.c_str(),
              strerror(errno));
         return false;
     }
 
-    bool ret = restore_directory(input_file, BACKUP_MNT_DIR, exclusions,
-                                 compression);
+    bool ret = restore_directory(chain, mount_dir, exclusions, manifest_file,
+                                 swap_delete, progress_cb);
 
-    if (!util::umount(BACKUP_MNT_DIR)) {
-        LOGE("Failed to unmount %s: %s", BACKUP_MNT_DIR, strerror(errno));
+    if (!util::umount(mount_dir.c_str())) {
+        LOGE("Failed to unmount %s: %s", mount_dir.c_str(), strerror(errno));
         return false;
     }
 
-    rmdir(BACKUP_MNT_DIR);
+    remove_mount_dir(mount_dir);
 
     return ret;
 }
@@ -459,22 +1247,143 @@ static Result restore_configs(const std::shared_ptr<Rom> &rom,
         if (!util::copy_file(thumbnail_backup, thumbnail_path, 0)) {
             return Result::FAILED;
         }
-    } else {
-        LOGW("=== %s does not exist ===", thumbnail_backup.c_str());
-        ret = Result::FILES_MISSING;
+    } else {
+        LOGW("=== %s does not exist ===", thumbnail_backup.c_str());
+        ret = Result::FILES_MISSING;
+    }
+
+    return ret;
+}
+
+// Remove a file left over from an older backup with the same name
+static bool remove_stale_file(const std::string &path)
+{
+    if (unlink(path.c_str()) < 0 && errno != ENOENT) {
+        LOGE("%s: Failed to remove file: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/*!
+ * \brief Find the archives needed to restore a partition
+ *
+ * Follows the parent references of incremental backups until a full backup is
+ * reached. Parent backups are looked up next to \a backup_dir.
+ *
+ * \param[in] backup_dir Backup directory
+ * \param[in] prefix Backup archive name prefix
+ * \param[out] chain Archives to extract, oldest first
+ *
+ * \return Result::SUCCEEDED if the whole chain was found
+ *         Result::FAILED if a parent backup is missing or invalid
+ *         Result::FILES_MISSING if \a backup_dir has no archive for \a prefix
+ */
+static Result find_backup_chain(const std::string &backup_dir,
+                                const std::string &prefix,
+                                std::vector<BackupArchive> &chain)
+{
+    std::string backups_root = util::dir_name(backup_dir);
+    std::string dir = backup_dir;
+
+    chain.clear();
+
+    while (true) {
+        BackupArchive archive;
+
+        std::string name = find_compressed_backup(
+                dir, prefix, &archive.compression);
+        if (name.empty()) {
+            if (chain.empty()) {
+                return Result::FILES_MISSING;
+            }
+            LOGE("%s: Parent backup has no %s archive",
+                 dir.c_str(), prefix.c_str());
+            return Result::FAILED;
+        }
+
+        archive.path = dir;
+        archive.path += '/';
+        archive.path += name;
+
+        Result digest_result = read_archive_digest(archive.path,
+                                                   archive.digest);
+        if (digest_result == Result::FAILED) {
+            return Result::FAILED;
+        }
+        archive.has_digest = digest_result == Result::SUCCEEDED;
+
+        std::string dedup_file(dir);
+        dedup_file += '/';
+        dedup_file += prefix;
+        dedup_file += BACKUP_SUFFIX_DEDUP;
+
+        if (access(dedup_file.c_str(), F_OK) == 0) {
+            archive.store_dir = backups_root;
+            archive.store_dir += '/';
+            archive.store_dir += BACKUP_STORE_DIR;
+            archive.store_manifest = dir;
+            archive.store_manifest += '/';
+            archive.store_manifest += prefix;
+            archive.store_manifest += BACKUP_SUFFIX_MANIFEST;
+        } else if (errno != ENOENT) {
+            LOGE("%s: Failed to access: %s",
+                 dedup_file.c_str(), strerror(errno));
+            return Result::FAILED;
+        }
+
+        chain.insert(chain.begin(), std::move(archive));
+
+        std::string parent_file(dir);
+        parent_file += '/';
+        parent_file += prefix;
+        parent_file += BACKUP_SUFFIX_PARENT;
+
+        if (access(parent_file.c_str(), F_OK) < 0) {
+            if (errno != ENOENT) {
+                LOGE("%s: Failed to access: %s",
+                     parent_file.c_str(), strerror(errno));
+                return Result::FAILED;
+            }
+            // Full backup
+            break;
+        }
+
+        std::string parent_name;
+        if (!util::file_first_line(parent_file, &parent_name)
+                || !is_valid_backup_name(parent_name)) {
+            LOGE("%s: Invalid parent backup reference", parent_file.c_str());
+            return Result::FAILED;
+        }
+
+        if (chain.size() >= BACKUP_MAX_CHAIN_LENGTH) {
+            LOGE("%s: Backup chain is too long or cyclic", backup_dir.c_str());
+            return Result::FAILED;
+        }
+
+        dir = backups_root;
+        dir += '/';
+        dir += parent_name;
     }
 
-    return ret;
+    return Result::SUCCEEDED;
 }
 
 /*!
  * \brief Backup a partition for a ROM
  *
+ * If \a options specifies a parent backup and the parent has a manifest for
+ * this partition, an incremental backup is created. Deduplicated backups are
+ * always full backups since unchanged files are not copied into the store
+ * again anyway.
+ *
  * \param path Path to mountpoint/directory or image
  * \param backup_dir Backup directory
- * \param archive_name Backup archive name
+ * \param prefix Backup archive name prefix
  * \param is_image Whether \a path is an ext4 image
  * \param exclusions List of top-level directories to exclude from the backup
+ * \param options Backup options
+ * \param progress_cb Callback for progress reports
  *
  * \return Result::SUCCEEDED if the directory/image was successfully backed up
  *         Result::FAILED if an error occured
@@ -482,28 +1391,132 @@ static Result restore_configs(const std::shared_ptr<Rom> &rom,
  */
 static Result backup_partition(const std::string &path,
                                const std::string &backup_dir,
-                               const std::string &archive_name,
+                               const std::string &prefix,
                                bool is_image,
                                const std::vector<std::string> &exclusions,
-                               util::compression_type compression)
+                               const BackupOptions &options,
+                               const util::ProgressCallback &progress_cb)
 {
     std::string archive(backup_dir);
     archive += '/';
-    archive += archive_name;
+    archive += get_compressed_backup_name(prefix, options.compression);
+
+    std::string manifest_file(backup_dir);
+    manifest_file += '/';
+    manifest_file += prefix;
+    manifest_file += BACKUP_SUFFIX_MANIFEST;
 
-    bool ret = false;
+    std::string parent_file(backup_dir);
+    parent_file += '/';
+    parent_file += prefix;
+    parent_file += BACKUP_SUFFIX_PARENT;
+
+    std::string sparse_image(backup_dir);
+    sparse_image += '/';
+    sparse_image += prefix;
+    sparse_image += BACKUP_SUFFIX_SPARSE_IMAGE;
+
+    std::string dedup_file(backup_dir);
+    dedup_file += '/';
+    dedup_file += prefix;
+    dedup_file += BACKUP_SUFFIX_DEDUP;
 
     struct stat sb;
-    if (stat(path.c_str(), &sb) == 0) {
-        LOGI("=== Backing up %s ===", path.c_str());
-        if (is_image) {
-            ret = backup_image(archive, path, exclusions, compression);
+    if (stat(path.c_str(), &sb) < 0) {
+        LOGW("=== %s does not exist ===", path.c_str());
+        return Result::FILES_MISSING;
+    }
+
+    bool compressed = false;
+    CompressedImageType type;
+    if (is_image && options.block_copy
+            && get_compressed_image_type(path, compressed, type)
+            && compressed) {
+        LOGW("%s: Compressed image; backing up files instead of blocks",
+             prefix.c_str());
+    }
+
+    if (is_image && options.block_copy && !compressed) {
+        LOGI("=== Backing up %s (block copy) ===", path.c_str());
+
+        if (!options.parent_name.empty()) {
+            LOGW("%s: Block copies are always full backups", prefix.c_str());
+        }
+
+        // Block copies have no manifest, so they can't be used as a parent
+        bool ret = backup_image_blocks(sparse_image, path)
+                && remove_stale_file(archive)
+                && remove_stale_file(archive + BACKUP_SUFFIX_DIGEST)
+                && remove_stale_file(manifest_file)
+                && remove_stale_file(parent_file)
+                && remove_stale_file(dedup_file);
+
+        return ret ? Result::SUCCEEDED : Result::FAILED;
+    }
+
+    BackupManifest parent;
+    bool incremental = false;
+    bool dedup = !options.store_dir.empty();
+
+    if (!options.parent_name.empty() && dedup) {
+        LOGW("%s: Deduplicated backups are always full backups",
+             prefix.c_str());
+    } else if (!options.parent_name.empty()) {
+        std::string parent_manifest(options.parent_dir);
+        parent_manifest += '/';
+        parent_manifest += prefix;
+        parent_manifest += BACKUP_SUFFIX_MANIFEST;
+
+        if (access(parent_manifest.c_str(), R_OK) == 0) {
+            if (!parent.load(parent_manifest)) {
+                return Result::FAILED;
+            }
+            incremental = true;
         } else {
-            ret = backup_directory(archive, path, exclusions, compression);
+            LOGW("%s: No manifest in parent backup; creating full backup",
+                 prefix.c_str());
         }
+    }
+
+    LOGI("=== Backing up %s (%s) ===", path.c_str(),
+         dedup ? "deduplicated" : incremental ? "incremental" : "full");
+
+    bool ret;
+    if (is_image) {
+        ret = backup_image(archive, path, get_mount_dir(prefix), exclusions,
+                           options, manifest_file,
+                           incremental ? &parent : nullptr, progress_cb);
     } else {
-        LOGW("=== %s does not exist ===", path.c_str());
-        return Result::FILES_MISSING;
+        ret = backup_directory(archive, path, exclusions, options,
+                               manifest_file, incremental ? &parent : nullptr,
+                               progress_cb);
+    }
+
+    // Restoring prefers block copies, so remove any from an older backup
+    ret = ret && remove_stale_file(sparse_image);
+
+    if (ret && dedup) {
+        if (!util::file_write_data(dedup_file, "", 0)) {
+            LOGE("%s: Failed to write file: %s",
+                 dedup_file.c_str(), strerror(errno));
+            ret = false;
+        }
+    } else if (ret) {
+        ret = remove_stale_file(dedup_file);
+    }
+
+    if (ret && !incremental) {
+        // Don't leave a stale reference behind when overwriting a backup
+        ret = remove_stale_file(parent_file);
+    } else if (ret) {
+        std::string data(options.parent_name);
+        data += '\n';
+
+        if (!util::file_write_data(parent_file, data.data(), data.size())) {
+            LOGE("%s: Failed to write file: %s",
+                 parent_file.c_str(), strerror(errno));
+            ret = false;
+        }
     }
 
     return ret ? Result::SUCCEEDED : Result::FAILED;
@@ -512,44 +1525,68 @@ static Result backup_partition(const std::string &path,
 /*!
  * \brief Restore a partition for a ROM
  *
+ * If the backup is incremental, the parent backups are extracted first.
+ *
  * \param path Path to mountpoint/directory or image
  * \param backup_dir Backup directory
- * \param archive_name Backup archive name
+ * \param prefix Backup archive name prefix
  * \param is_image Whether \a path is an ext4 image
  * \param exclusions List of top-level directories to exclude from the wipe
  *                   process before restoring
+ * \param progress_cb Callback for progress reports
  *
  * \return Result::SUCCEEDED if the directory/image was successfully restored
  *         Result::FAILED if an error occured
- *         Result::FILES_MISSING if \a archive_name does not exist in
+ *         Result::FILES_MISSING if there is no archive for \a prefix in
  *         \a backup_dir
  */
 static Result restore_partition(const std::string &path,
                                 const std::string &backup_dir,
-                                const std::string &archive_name,
+                                const std::string &prefix,
                                 bool is_image,
                                 uint64_t image_size,
                                 const std::vector<std::string> &exclusions,
-                                util::compression_type compression)
+                                bool swap_delete,
+                                const util::ProgressCallback &progress_cb)
 {
-    std::string archive(backup_dir);
-    archive += '/';
-    archive += archive_name;
+    if (is_image) {
+        std::string sparse_image(backup_dir);
+        sparse_image += '/';
+        sparse_image += prefix;
+        sparse_image += BACKUP_SUFFIX_SPARSE_IMAGE;
+
+        if (access(sparse_image.c_str(), R_OK) == 0) {
+            LOGI("=== Restoring to %s (block copy) ===", path.c_str());
+            return restore_image_blocks(sparse_image, path)
+                    ? Result::SUCCEEDED : Result::FAILED;
+        }
+    }
 
-    bool ret = false;
+    std::vector<BackupArchive> chain;
 
-    struct stat sb;
-    if (stat(archive.c_str(), &sb) == 0) {
-        LOGI("=== Restoring to %s ===", path.c_str());
-        if (is_image) {
-            ret = restore_image(archive, path, image_size, exclusions,
-                                compression);
-        } else {
-            ret = restore_directory(archive, path, exclusions, compression);
-        }
+    Result result = find_backup_chain(backup_dir, prefix, chain);
+    if (result != Result::SUCCEEDED) {
+        return result;
+    }
+
+    std::string manifest_file(backup_dir);
+    manifest_file += '/';
+    manifest_file += prefix;
+    manifest_file += BACKUP_SUFFIX_MANIFEST;
+
+    LOGI("=== Restoring to %s ===", path.c_str());
+    for (auto const &archive : chain) {
+        LOGI("- %s", archive.path.c_str());
+    }
+
+    bool ret;
+    if (is_image) {
+        ret = restore_image(chain, path, get_mount_dir(prefix), image_size,
+                            exclusions, manifest_file, swap_delete,
+                            progress_cb);
     } else {
-        LOGW("=== %s does not exist ===", archive.c_str());
-        return Result::FILES_MISSING;
+        ret = restore_directory(chain, path, exclusions, manifest_file,
+                                swap_delete, progress_cb);
     }
 
     return ret ? Result::SUCCEEDED : Result::FAILED;
@@ -557,7 +1594,7 @@ static Result restore_partition(const std::string &path,
 
 static bool backup_rom(const std::shared_ptr<Rom> &rom,
                        const std::string &output_dir, int targets,
-                       util::compression_type compression)
+                       const BackupOptions &options)
 {
     if (!targets) {
         LOGE("No backup targets specified");
@@ -591,13 +1628,14 @@ static bool backup_rom(const std::shared_ptr<Rom> &rom,
         LOGI("             %s", thumbnail_path.c_str());
     }
     LOGI("- Backup directory: %s", output_dir.c_str());
-
-    std::string output_system = get_compressed_backup_name(
-            BACKUP_NAME_PREFIX_SYSTEM, compression);
-    std::string output_cache = get_compressed_backup_name(
-            BACKUP_NAME_PREFIX_CACHE, compression);
-    std::string output_data = get_compressed_backup_name(
-            BACKUP_NAME_PREFIX_DATA, compression);
+    LOGI("- Compression threads: %u", options.threads);
+    LOGI("- Concurrent jobs: %u", options.jobs);
+    if (!options.parent_name.empty()) {
+        LOGI("- Parent backup: %s", options.parent_dir.c_str());
+    }
+    if (!options.store_dir.empty()) {
+        LOGI("- Backup store: %s", options.store_dir.c_str());
+    }
 
     // Backup boot image
     if (targets & BACKUP_TARGET_BOOT
@@ -611,41 +1649,165 @@ static bool backup_rom(const std::shared_ptr<Rom> &rom,
         return false;
     }
 
+    std::vector<TargetJob> jobs;
+
     // Backup system
     if (targets & BACKUP_TARGET_SYSTEM) {
-        Result ret = backup_partition(
-                system_path, output_dir, output_system,
-                rom->system_is_image, { "multiboot" }, compression);
-        if (ret == Result::FAILED) {
-            return false;
-        }
+        jobs.push_back({ BACKUP_NAME_PREFIX_SYSTEM,
+                         storage_device(system_path),
+                         [&](const util::ProgressCallback &cb) {
+            return backup_partition(
+                    system_path, output_dir, BACKUP_NAME_PREFIX_SYSTEM,
+                    rom->system_is_image, { "multiboot" }, options, cb)
+                    != Result::FAILED;
+        } });
     }
 
     // Backup cache
     if (targets & BACKUP_TARGET_CACHE) {
-        Result ret = backup_partition(
-                cache_path, output_dir, output_cache,
-                rom->cache_is_image, { "multiboot" }, compression);
-        if (ret == Result::FAILED) {
-            return false;
-        }
+        jobs.push_back({ BACKUP_NAME_PREFIX_CACHE,
+                         storage_device(cache_path),
+                         [&](const util::ProgressCallback &cb) {
+            return backup_partition(
+                    cache_path, output_dir, BACKUP_NAME_PREFIX_CACHE,
+                    rom->cache_is_image, { "multiboot" }, options, cb)
+                    != Result::FAILED;
+        } });
     }
 
-    // Backup data
+    // Backup data. A block copy would include the internal storage, which is
+    // always excluded, so data images are always backed up as archives.
+    BackupOptions data_options(options);
+    data_options.block_copy = false;
+
     if (targets & BACKUP_TARGET_DATA) {
-        Result ret = backup_partition(
-                data_path, output_dir, output_data,
-                rom->data_is_image, { "media", "multiboot" }, compression);
-        if (ret == Result::FAILED) {
+        jobs.push_back({ BACKUP_NAME_PREFIX_DATA,
+                         storage_device(data_path),
+                         [&](const util::ProgressCallback &cb) {
+            return backup_partition(
+                    data_path, output_dir, BACKUP_NAME_PREFIX_DATA,
+                    rom->data_is_image, { "media", "multiboot" },
+                    data_options, cb) != Result::FAILED;
+        } });
+    }
+
+    return run_target_jobs(jobs, options.jobs);
+}
+
+static bool stream_boot_image(const std::shared_ptr<Rom> &rom, int fd)
+{
+    std::string boot_image_path(rom->boot_image_path());
+
+    LOGI("=== Streaming %s ===", boot_image_path.c_str());
+
+    int boot_fd = open(boot_image_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (boot_fd < 0) {
+        LOGE("%s: Failed to open: %s",
+             boot_image_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_boot_fd = util::finally([&]{
+        close(boot_fd);
+    });
+
+    if (!util::copy_data_fd(boot_fd, fd)) {
+        LOGE("%s: Failed to write to fd %d: %s",
+             boot_image_path.c_str(), fd, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Write the backup of a single target to a file descriptor
+ *
+ * System, cache, and data are written as the same archive that a full backup
+ * would contain. The boot image is written as is. Nothing is stored in the
+ * backup directory, so incremental and deduplicated backups and block copies,
+ * which need the manifests or the store, are not available.
+ */
+static bool stream_target(const std::shared_ptr<Rom> &rom, int target,
+                          const BackupOptions &options, int fd)
+{
+    std::string path;
+    std::string prefix;
+    bool is_image;
+    std::vector<std::string> exclusions;
+
+    switch (target) {
+    case BACKUP_TARGET_SYSTEM:
+        path = rom->full_system_path();
+        prefix = BACKUP_NAME_PREFIX_SYSTEM;
+        is_image = rom->system_is_image;
+        exclusions = { "multiboot" };
+        break;
+    case BACKUP_TARGET_CACHE:
+        path = rom->full_cache_path();
+        prefix = BACKUP_NAME_PREFIX_CACHE;
+        is_image = rom->cache_is_image;
+        exclusions = { "multiboot" };
+        break;
+    case BACKUP_TARGET_DATA:
+        path = rom->full_data_path();
+        prefix = BACKUP_NAME_PREFIX_DATA;
+        is_image = rom->data_is_image;
+        exclusions = { "media", "multiboot" };
+        break;
+    case BACKUP_TARGET_BOOT:
+        return stream_boot_image(rom, fd);
+    default:
+        LOGE("Only one of system, cache, data, or boot can be streamed");
+        return false;
+    }
+
+    struct stat sb;
+    if (stat(path.c_str(), &sb) < 0) {
+        LOGE("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    LOGI("=== Streaming %s ===", path.c_str());
+
+    std::string directory(path);
+    if (is_image) {
+        directory = get_mount_dir(prefix);
+        if (!mount_image_ro(path, directory)) {
             return false;
         }
     }
 
-    return true;
+    util::ProgressTracker progress([&](const util::ProgressStats &s) {
+        log_progress(prefix, s);
+    }, PROGRESS_INTERVAL_MS);
+    util::ArchiveDigest digest;
+    std::vector<std::string> contents;
+
+    bool ret = list_directory(directory, exclusions, contents)
+            && util::libarchive_tar_create_fd(
+                    fd, directory, contents, options.compression,
+                    options.threads, true, true, &progress, &digest);
+
+    if (is_image && !unmount_image(directory)) {
+        ret = false;
+    }
+
+    if (ret) {
+        progress.finish();
+
+        // The receiver has no checksum file, so log what it should compute
+        LOGI("%s: %" PRIu64 " bytes with SHA512 %s", prefix.c_str(),
+             digest.size, util::hex_string(digest.sha512.data(),
+                                           digest.sha512.size()).c_str());
+    }
+
+    return ret;
 }
 
 static bool restore_rom(const std::shared_ptr<Rom> &rom,
-                        const std::string &input_dir, int targets)
+                        const std::string &input_dir, int targets,
+                        unsigned int jobs, bool swap_delete)
 {
     if (!targets) {
         LOGE("No restore targets specified");
@@ -679,6 +1841,9 @@ static bool restore_rom(const std::shared_ptr<Rom> &rom,
         LOGI("             %s", thumbnail_path.c_str());
     }
     LOGI("- Backup directory: %s", input_dir.c_str());
+    LOGI("- Concurrent jobs: %u", jobs);
+    LOGI("- Delete old files while extracting: %s",
+         swap_delete ? "yes" : "no");
 
     std::string multiboot_dir(MULTIBOOT_DIR);
     multiboot_dir += '/';
@@ -703,6 +1868,26 @@ static bool restore_rom(const std::shared_ptr<Rom> &rom,
 
     fix_multiboot_permissions();
 
+    // Restoring a partition is only successful if its backup exists
+    auto restore_job = [&](const std::string &path, const char *prefix,
+                           bool is_image, uint64_t image_size,
+                           const std::vector<std::string> &exclusions,
+                           const char *desc) {
+        return [&, path, prefix, is_image, image_size, exclusions, desc](
+                const util::ProgressCallback &cb) {
+            Result ret = restore_partition(path, input_dir, prefix, is_image,
+                                           image_size, exclusions, swap_delete,
+                                           cb);
+            if (ret == Result::FILES_MISSING) {
+                LOGE("Backup of %s not found", desc);
+                return false;
+            }
+            return ret != Result::FAILED;
+        };
+    };
+
+    std::vector<TargetJob> target_jobs;
+
     // Restore system
     if (targets & BACKUP_TARGET_SYSTEM) {
         uint64_t image_size = util::mount_get_total_size(
@@ -712,59 +1897,129 @@ static bool restore_rom(const std::shared_ptr<Rom> &rom,
             return false;
         }
 
-        util::compression_type compression;
-        std::string path = find_compressed_backup(
-                input_dir, BACKUP_NAME_PREFIX_SYSTEM, &compression);
-        if (path.empty()) {
-            LOGE("Backup of /system not found");
-            return false;
-        }
-
-        Result ret = restore_partition(
-                system_path, input_dir, path,
-                rom->system_is_image, image_size, {}, compression);
-        if (ret == Result::FAILED) {
-            return false;
-        }
+        target_jobs.push_back({ BACKUP_NAME_PREFIX_SYSTEM,
+                                storage_device(system_path),
+                                restore_job(system_path,
+                                            BACKUP_NAME_PREFIX_SYSTEM,
+                                            rom->system_is_image, image_size,
+                                            {}, "/system") });
     }
 
     // Restore cache
     if (targets & BACKUP_TARGET_CACHE) {
-        util::compression_type compression;
-        std::string path = find_compressed_backup(
-                input_dir, BACKUP_NAME_PREFIX_CACHE, &compression);
-        if (path.empty()) {
-            LOGE("Backup of /cache not found");
-            return false;
-        }
-
-        Result ret = restore_partition(
-                cache_path, input_dir, path,
-                rom->cache_is_image, DEFAULT_IMAGE_SIZE, {}, compression);
-        if (ret == Result::FAILED) {
-            return false;
-        }
+        target_jobs.push_back({ BACKUP_NAME_PREFIX_CACHE,
+                                storage_device(cache_path),
+                                restore_job(cache_path,
+                                            BACKUP_NAME_PREFIX_CACHE,
+                                            rom->cache_is_image,
+                                            DEFAULT_IMAGE_SIZE, {},
+                                            "/cache") });
     }
 
     // Restore data
     if (targets & BACKUP_TARGET_DATA) {
-        util::compression_type compression;
-        std::string path = find_compressed_backup(
-                input_dir, BACKUP_NAME_PREFIX_DATA, &compression);
-        if (path.empty()) {
-            LOGE("Backup of /data not found");
-            return false;
+        target_jobs.push_back({ BACKUP_NAME_PREFIX_DATA,
+                                storage_device(data_path),
+                                restore_job(data_path,
+                                            BACKUP_NAME_PREFIX_DATA,
+                                            rom->data_is_image,
+                                            DEFAULT_IMAGE_SIZE, { "media" },
+                                            "/data") });
+    }
+
+    return run_target_jobs(target_jobs, jobs);
+}
+
+/*!
+ * \brief Check archives against the checksums written during the backup
+ *
+ * Every archive that a restore of \a targets would extract, including those of
+ * parent backups, is read sequentially and compared against its checksum.
+ * Block copies, archives from older backups without checksums, and the
+ * contents of the backup store are not verified.
+ *
+ * \return Whether all checksummed archives are intact
+ */
+static bool verify_backup(const std::string &input_dir, int targets)
+{
+    static const char *prefixes[] = {
+        BACKUP_NAME_PREFIX_SYSTEM,
+        BACKUP_NAME_PREFIX_CACHE,
+        BACKUP_NAME_PREFIX_DATA,
+    };
+    static const int prefix_targets[] = {
+        BACKUP_TARGET_SYSTEM,
+        BACKUP_TARGET_CACHE,
+        BACKUP_TARGET_DATA,
+    };
+
+    LOGI("Verifying backup: %s", input_dir.c_str());
+
+    bool ret = true;
+
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); ++i) {
+        if (!(targets & prefix_targets[i])) {
+            continue;
         }
 
-        Result ret = restore_partition(
-                data_path, input_dir, path,
-                rom->data_is_image, DEFAULT_IMAGE_SIZE, { "media" }, compression);
-        if (ret == Result::FAILED) {
-            return false;
+        std::string sparse_image(input_dir);
+        sparse_image += '/';
+        sparse_image += prefixes[i];
+        sparse_image += BACKUP_SUFFIX_SPARSE_IMAGE;
+
+        if (access(sparse_image.c_str(), F_OK) == 0) {
+            LOGW("%s: Block copies are not checksummed", sparse_image.c_str());
+            continue;
+        }
+
+        std::vector<BackupArchive> chain;
+
+        Result result = find_backup_chain(input_dir, prefixes[i], chain);
+        if (result == Result::FILES_MISSING) {
+            LOGW("=== No %s archive ===", prefixes[i]);
+            continue;
+        } else if (result != Result::SUCCEEDED) {
+            ret = false;
+            continue;
+        }
+
+        for (auto const &archive : chain) {
+            if (!archive.has_digest) {
+                LOGW("%s: No checksum; skipping", archive.path.c_str());
+                continue;
+            }
+
+            LOGI("=== Verifying %s ===", archive.path.c_str());
+
+            struct stat sb;
+            if (stat(archive.path.c_str(), &sb) < 0) {
+                LOGE("%s: Failed to stat: %s",
+                     archive.path.c_str(), strerror(errno));
+                ret = false;
+                continue;
+            }
+
+            // Truncated archives don't need to be read
+            if (static_cast<uint64_t>(sb.st_size) != archive.digest.size) {
+                LOGE("%s: Size is %" PRIu64 " bytes, but expected %" PRIu64,
+                     archive.path.c_str(), static_cast<uint64_t>(sb.st_size),
+                     archive.digest.size);
+                ret = false;
+                continue;
+            }
+
+            util::Sha512Digest digest;
+            if (!util::sha512_hash(archive.path, digest.data())) {
+                ret = false;
+            } else if (digest != archive.digest.sha512) {
+                LOGE("%s: Archive does not match its checksum",
+                     archive.path.c_str());
+                ret = false;
+            }
         }
     }
 
-    return true;
+    return ret;
 }
 
 static bool ensure_partitions_mounted()
@@ -800,15 +2055,6 @@ static bool remount_partitions_writable()
             && mount("", data_partition.c_str(), "", MS_REMOUNT, "") == 0;
 }
 
-static bool is_valid_backup_name(const std::string &name)
-{
-    // No empty strings, hidden paths, '..', or directory separators
-    return !name.empty()                            // Must be non-empty
-            && name.find('/') == std::string::npos  // and contain no slashes
-            && name != "."                          // and not current directory
-            && name != "..";                        // and not parent directory
-}
-
 static void warn_selinux_context()
 {
     // We do not need to patch the SELinux policy or switch to mb_exec because
@@ -824,6 +2070,12 @@ static void warn_selinux_context()
     }
 }
 
+static unsigned int default_compression_threads()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? static_cast<unsigned int>(n) : 1;
+}
+
 static void backup_usage(FILE *stream)
 {
     fprintf(stream,
@@ -840,17 +2092,46 @@ static void backup_usage(FILE *stream)
             "  -c, --compression <compression type>\n"
             "                   Compression type (none, lz4, gzip, xz)\n"
             "                   (Default: lz4)\n"
+            "  -j, --threads <count>\n"
+            "                   Number of compression threads\n"
+            "                   (Default: number of CPUs)\n"
+            "  -J, --jobs <count>\n"
+            "                   Number of targets to back up concurrently.\n"
+            "                   Targets on the same storage device are always\n"
+            "                   backed up one at a time.\n"
+            "                   (Default: %u)\n"
+            "  -p, --parent <name>\n"
+            "                   Create an incremental backup that only stores\n"
+            "                   files that changed since the named backup\n"
+            "  -s, --checksums  Store SHA512 checksums in the backup manifests\n"
+            "                   and use them to detect changed files\n"
+            "  -b, --block-copy Back up system and cache images as sparse copies\n"
+            "                   of their allocated, non-zero blocks\n"
+            "  -D, --dedup      Store file contents once in a store shared by\n"
+            "                   all deduplicated backups in the backup directory\n"
             "  -d, --backupdir <directory>\n"
             "                   Directory to store backups\n"
             "                   (Default: " MULTIBOOT_BACKUP_DIR ")\n"
             "  -f, --force      Allow overwriting old backup with the same name\n"
+            "  --stream-fd <fd>\n"
+            "                   Write the backup of a single target (system,\n"
+            "                   cache, data, or boot) to <fd> instead of the\n"
+            "                   backup directory. If <fd> is 1, messages are\n"
+            "                   logged to the kernel log.\n"
+            "  --sched <policy>\n"
+            "                   CPU and I/O scheduling policy (foreground,\n"
+            "                   background). The background policy keeps the\n"
+            "                   device responsive at the cost of speed.\n"
+            "  --io-limit <bytes per second>\n"
+            "                   Maximum rate at which data is written\n"
             "  -h, --help       Display this help message\n"
             "\n"
             "Valid backup targets: 'all' or some combination of the following:\n"
             "  system,cache,data,boot,config\n"
             "\n"
             "NOTE: This tool is still in development and the arguments above\n"
-            "have not yet been finalized.\n");
+            "have not yet been finalized.\n",
+            BACKUP_DEFAULT_JOBS);
 }
 
 static void restore_usage(FILE *stream)
@@ -865,30 +2146,87 @@ static void restore_usage(FILE *stream)
             "                   (Default: 'all')\n"
             "  -n, --name <name>\n"
             "                   Name of backup to restore\n"
+            "  -V, --verify-only\n"
+            "                   Only check the backup archives against the\n"
+            "                   checksums stored during the backup. No ROM ID is\n"
+            "                   needed.\n"
+            "  -J, --jobs <count>\n"
+            "                   Number of targets to restore concurrently.\n"
+            "                   Targets on the same storage device are always\n"
+            "                   restored one at a time.\n"
+            "                   (Default: %u)\n"
+            "  -S, --swap-delete\n"
+            "                   Move the old files aside and delete them in the\n"
+            "                   background while the backup is extracted. Needs\n"
+            "                   free space for both the old and new files in the\n"
+            "                   worst case.\n"
             "  -d, --backupdir <directory>\n"
             "                   Directory containing backups\n"
             "                   (Default: " MULTIBOOT_BACKUP_DIR ")\n"
+            "  --sched <policy>\n"
+            "                   CPU and I/O scheduling policy (foreground,\n"
+            "                   background). The background policy keeps the\n"
+            "                   device responsive at the cost of speed.\n"
+            "  --io-limit <bytes per second>\n"
+            "                   Maximum rate at which data is written\n"
             "  -h, --help       Display this help message\n"
             "\n"
             "Valid backup targets: 'all' or some combination of the following:\n"
             "  system,cache,data,boot,config\n"
             "\n"
             "NOTE: This tool is still in development and the arguments above\n"
-            "have not yet been finalized.\n");
+            "have not yet been finalized.\n",
+            BACKUP_DEFAULT_JOBS);
+}
+
+/*!
+ * \brief Apply the scheduling policy selected with --sched and --io-limit
+ *
+ * Failures are only logged since the operation can still run with the default
+ * policy.
+ */
+static void apply_sched_options(const util::SchedPreset *preset,
+                                uint64_t io_limit)
+{
+    if (preset) {
+        auto policy = util::sched_policy_preset(*preset);
+        policy.write_limit = io_limit;
+
+        if (!util::apply_process_sched_policy(policy)) {
+            LOGW("Failed to fully apply scheduling policy");
+        }
+    } else if (io_limit != 0) {
+        util::set_write_limit(io_limit);
+    }
 }
 
 int backup_main(int argc, char *argv[])
 {
     int opt;
 
-    static const char *short_options = "r:t:n:c:d:fh";
+    enum {
+        OPT_STREAM_FD = 1000,
+        OPT_SCHED,
+        OPT_IO_LIMIT,
+    };
+
+    static const char *short_options = "r:t:n:c:j:J:p:sbDd:fh";
     static struct option long_options[] = {
         {"romid",       required_argument, 0, 'r'},
         {"targets",     required_argument, 0, 't'},
         {"name",        required_argument, 0, 'n'},
         {"compression", required_argument, 0, 'c'},
+        {"threads",     required_argument, 0, 'j'},
+        {"jobs",        required_argument, 0, 'J'},
+        {"parent",      required_argument, 0, 'p'},
+        {"checksums",   no_argument,       0, 's'},
+        {"block-copy",  no_argument,       0, 'b'},
+        {"dedup",       no_argument,       0, 'D'},
         {"backupdir",   required_argument, 0, 'd'},
         {"force",       no_argument,       0, 'f'},
+        {"stream-fd",   required_argument, 0, OPT_STREAM_FD},
+        {"sched",       required_argument, 0, OPT_SCHED},
+        {"io-limit",    required_argument, 0, OPT_IO_LIMIT},
         {"help",        no_argument,       0, 'h'},
         {0, 0, 0, 0}
     };
@@ -898,9 +2236,19 @@ int backup_main(int argc, char *argv[])
     std::string romid;
     std::string targets_str("all");
     std::string name;
+    int stream_fd = -1;
     std::string backupdir(MULTIBOOT_BACKUP_DIR);
-    util::compression_type compression = util::compression_type::LZ4;
+    BackupOptions options;
+    options.compression = util::compression_type::LZ4;
+    options.threads = default_compression_threads();
+    options.checksums = false;
+    options.block_copy = false;
+    options.jobs = BACKUP_DEFAULT_JOBS;
+    bool dedup = false;
     bool force = false;
+    util::SchedPreset sched_preset;
+    bool have_sched = false;
+    uint64_t io_limit = 0;
 
     if (!util::format_time("%Y.%m.%d-%H.%M.%S", &name)) {
         fprintf(stderr, "Failed to format current time\n");
@@ -920,17 +2268,66 @@ int backup_main(int argc, char *argv[])
             name = optarg;
             break;
         case 'c':
-            if (!parse_compression_type(optarg, &compression)) {
+            if (!parse_compression_type(optarg, &options.compression)) {
                 fprintf(stderr, "Invalid compression type: %s\n", optarg);
                 return EXIT_FAILURE;
             }
             break;
+        case 'j':
+            if (!util::str_to_unum(optarg, 10, &options.threads)
+                    || options.threads == 0) {
+                fprintf(stderr, "Invalid thread count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'J':
+            if (!util::str_to_unum(optarg, 10, &options.jobs)
+                    || options.jobs == 0) {
+                fprintf(stderr, "Invalid job count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p':
+            options.parent_name = optarg;
+            break;
+        case 's':
+            options.checksums = true;
+            break;
+        case 'b':
+            options.block_copy = true;
+            break;
+        case 'D':
+            dedup = true;
+            break;
         case 'd':
             backupdir = optarg;
             break;
         case 'f':
             force = true;
             break;
+        case OPT_STREAM_FD:
+            // stderr is reserved for errors that happen before logging is
+            // redirected
+            if (!util::str_to_snum(optarg, 10, &stream_fd)
+                    || stream_fd == STDIN_FILENO || stream_fd == STDERR_FILENO
+                    || fcntl(stream_fd, F_GETFD) < 0) {
+                fprintf(stderr, "Invalid stream fd: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_SCHED:
+            if (!util::parse_sched_preset(optarg, sched_preset)) {
+                fprintf(stderr, "Invalid scheduling policy: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            have_sched = true;
+            break;
+        case OPT_IO_LIMIT:
+            if (!util::str_to_unum(optarg, 10, &io_limit) || io_limit == 0) {
+                fprintf(stderr, "Invalid I/O limit: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
         case 'h':
             backup_usage(stdout);
             return EXIT_SUCCESS;
@@ -957,11 +2354,91 @@ int backup_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    apply_sched_options(have_sched ? &sched_preset : nullptr, io_limit);
+
+    if (stream_fd >= 0) {
+        if (targets != BACKUP_TARGET_SYSTEM && targets != BACKUP_TARGET_CACHE
+                && targets != BACKUP_TARGET_DATA
+                && targets != BACKUP_TARGET_BOOT) {
+            fprintf(stderr, "Only one of system, cache, data, or boot can be"
+                    " streamed\n");
+            return EXIT_FAILURE;
+        }
+        if (!options.parent_name.empty() || dedup || options.block_copy) {
+            fprintf(stderr, "--stream-fd cannot be used with -p/--parent,"
+                    " -D/--dedup, or -b/--block-copy\n");
+            return EXIT_FAILURE;
+        }
+
+        if (stream_fd == STDOUT_FILENO) {
+            // stderr may end up in the same place (eg. with adb exec-out), so
+            // nothing else can be written to it
+            int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+            if (null_fd < 0 || dup2(null_fd, STDERR_FILENO) < 0) {
+                fprintf(stderr, "Failed to redirect output to /dev/null: %s\n",
+                        strerror(errno));
+                return EXIT_FAILURE;
+            }
+            close(null_fd);
+
+            log::log_set_logger(std::make_shared<log::KmsgLogger>(false));
+        }
+
+        warn_selinux_context();
+
+        if (!ensure_partitions_mounted()) {
+            return EXIT_FAILURE;
+        }
+
+        Roms roms;
+        roms.add_installed();
+
+        auto rom = roms.find_by_id(romid);
+        if (!rom) {
+            LOGE("ROM '%s' is not installed", romid.c_str());
+            return EXIT_FAILURE;
+        }
+
+        if (stream_target(rom, targets, options, stream_fd)) {
+            LOGI("=== Finished ===");
+            return EXIT_SUCCESS;
+        } else {
+            LOGI("=== Failed ===");
+            return EXIT_FAILURE;
+        }
+    }
+
     if (!is_valid_backup_name(name)) {
         fprintf(stderr, "Invalid backup name: %s\n", name.c_str());
         return EXIT_FAILURE;
     }
 
+    if (!options.parent_name.empty()) {
+        if (!is_valid_backup_name(options.parent_name)
+                || options.parent_name == name) {
+            fprintf(stderr, "Invalid parent backup name: %s\n",
+                    options.parent_name.c_str());
+            return EXIT_FAILURE;
+        }
+
+        options.parent_dir = backupdir;
+        options.parent_dir += "/";
+        options.parent_dir += options.parent_name;
+
+        struct stat sb;
+        if (stat(options.parent_dir.c_str(), &sb) < 0 || !S_ISDIR(sb.st_mode)) {
+            fprintf(stderr, "Parent backup '%s' does not exist\n",
+                    options.parent_name.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (dedup) {
+        options.store_dir = backupdir;
+        options.store_dir += "/";
+        options.store_dir += BACKUP_STORE_DIR;
+    }
+
     warn_selinux_context();
 
     if (!ensure_partitions_mounted()) {
@@ -994,7 +2471,7 @@ int backup_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    bool ret = backup_rom(rom, output_dir, targets, compression);
+    bool ret = backup_rom(rom, output_dir, targets, options);
     if (ret) {
         LOGI("=== Finished ===");
         return EXIT_SUCCESS;
@@ -1008,12 +2485,22 @@ int restore_main(int argc, char *argv[])
 {
     int opt;
 
-    static const char *short_options = "r:t:n:d:h";
+    enum {
+        OPT_SCHED = 1000,
+        OPT_IO_LIMIT,
+    };
+
+    static const char *short_options = "r:t:n:J:VSd:h";
     static struct option long_options[] = {
         {"romid",     required_argument, 0, 'r'},
         {"targets",   required_argument, 0, 't'},
         {"name",      required_argument, 0, 'n'},
+        {"jobs",      required_argument, 0, 'J'},
+        {"verify-only", no_argument,     0, 'V'},
+        {"swap-delete", no_argument,     0, 'S'},
         {"backupdir", required_argument, 0, 'd'},
+        {"sched",     required_argument, 0, OPT_SCHED},
+        {"io-limit",  required_argument, 0, OPT_IO_LIMIT},
         {"help",      no_argument,       0, 'h'},
         {0, 0, 0, 0}
     };
@@ -1024,6 +2511,12 @@ int restore_main(int argc, char *argv[])
     std::string targets_str("all");
     std::string name;
     std::string backupdir(MULTIBOOT_BACKUP_DIR);
+    unsigned int jobs = BACKUP_DEFAULT_JOBS;
+    bool verify_only = false;
+    bool swap_delete = false;
+    util::SchedPreset sched_preset;
+    bool have_sched = false;
+    uint64_t io_limit = 0;
 
     while ((opt = getopt_long(argc, argv, short_options,
             long_options, &long_index)) != -1) {
@@ -1037,9 +2530,34 @@ int restore_main(int argc, char *argv[])
         case 'n':
             name = optarg;
             break;
+        case 'J':
+            if (!util::str_to_unum(optarg, 10, &jobs) || jobs == 0) {
+                fprintf(stderr, "Invalid job count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'V':
+            verify_only = true;
+            break;
+        case 'S':
+            swap_delete = true;
+            break;
         case 'd':
             backupdir = optarg;
             break;
+        case OPT_SCHED:
+            if (!util::parse_sched_preset(optarg, sched_preset)) {
+                fprintf(stderr, "Invalid scheduling policy: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            have_sched = true;
+            break;
+        case OPT_IO_LIMIT:
+            if (!util::str_to_unum(optarg, 10, &io_limit) || io_limit == 0) {
+                fprintf(stderr, "Invalid I/O limit: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
         case 'h':
             restore_usage(stdout);
             return EXIT_SUCCESS;
@@ -1055,7 +2573,7 @@ int restore_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    if (romid.empty()) {
+    if (romid.empty() && !verify_only) {
         fprintf(stderr, "No ROM ID specified\n");
         return EXIT_FAILURE;
     }
@@ -1076,24 +2594,14 @@ int restore_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    apply_sched_options(have_sched ? &sched_preset : nullptr, io_limit);
+
     warn_selinux_context();
 
     if (!ensure_partitions_mounted()) {
         return EXIT_FAILURE;
     }
 
-    if (!remount_partitions_writable()) {
-        fprintf(stderr, "Failed to remount partitions as writable: %s\n",
-                strerror(errno));
-        return EXIT_FAILURE;
-    }
-
-    auto rom = Roms::create_rom(romid);
-    if (!rom) {
-        fprintf(stderr, "Invalid ROM ID: '%s'\n", romid.c_str());
-        return EXIT_FAILURE;
-    }
-
     std::string input_dir(backupdir);
     input_dir += "/";
     input_dir += name;
@@ -1104,7 +2612,26 @@ int restore_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    bool ret = restore_rom(rom, input_dir, targets);
+    bool ret;
+
+    if (verify_only) {
+        ret = verify_backup(input_dir, targets);
+    } else {
+        if (!remount_partitions_writable()) {
+            fprintf(stderr, "Failed to remount partitions as writable: %s\n",
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        auto rom = Roms::create_rom(romid);
+        if (!rom) {
+            fprintf(stderr, "Invalid ROM ID: '%s'\n", romid.c_str());
+            return EXIT_FAILURE;
+        }
+
+        ret = restore_rom(rom, input_dir, targets, jobs, swap_delete);
+    }
+
     if (ret) {
         LOGI("=== Finished ===");
         return EXIT_SUCCESS;
@@ -0,0 +1,488 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "backup_manifest.h"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+#include "mbutil/autoclose/file.h"
+#include "mbutil/delete.h"
+#include "mbutil/finally.h"
+#include "mbutil/fts.h"
+#include "mbutil/hash.h"
+#include "mbutil/string.h"
+
+#define MANIFEST_HEADER         "# mbtool backup manifest v1"
+
+namespace mb
+{
+
+// Paths are written verbatim except for backslashes and newlines
+static std::string escape_path(const std::string &path)
+{
+    std::string result;
+    result.reserve(path.size());
+
+    for (char c : path) {
+        if (c == '\\') {
+            result += "\\\\";
+        } else if (c == '\n') {
+            result += "\\n";
+        } else {
+            result += c;
+        }
+    }
+
+    return result;
+}
+
+static bool unescape_path(const char *str, size_t size, std::string &out)
+{
+    out.clear();
+    out.reserve(size);
+
+    for (size_t i = 0; i < size; ++i) {
+        if (str[i] != '\\') {
+            out += str[i];
+        } else if (i + 1 < size && str[i + 1] == '\\') {
+            out += '\\';
+            ++i;
+        } else if (i + 1 < size && str[i + 1] == 'n') {
+            out += '\n';
+            ++i;
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool is_excluded(const std::vector<std::string> &exclusions,
+                        const char *name)
+{
+    return std::find(exclusions.begin(), exclusions.end(), name)
+            != exclusions.end();
+}
+
+class ManifestScanner : public util::FTSWrapper {
+public:
+    ManifestScanner(std::string path,
+                    const std::vector<std::string> &exclusions,
+                    std::vector<BackupManifest::Entry> &entries)
+        // Match libarchive's disk reader, which crosses mountpoints
+        : FTSWrapper(path, FTS_GroupSpecialFiles
+                | FTS_CrossMountPointBoundaries | FTS_Parallel),
+        _exclusions(exclusions),
+        _entries(entries)
+    {
+    }
+
+    int on_changed_path() override
+    {
+        if (_curr->fts_level == 0) {
+            return Action::FTS_OK;
+        }
+
+        if (_curr->fts_level == 1
+                && is_excluded(_exclusions, _curr->fts_name)) {
+            return Action::FTS_Skip;
+        }
+
+        return Action::FTS_OK;
+    }
+
+    int on_reached_directory_pre() override
+    {
+        return _curr->fts_level == 0 ? Action::FTS_OK : add();
+    }
+
+    int on_reached_file() override
+    {
+        return add();
+    }
+
+    int on_reached_symlink() override
+    {
+        return add();
+    }
+
+    int on_reached_special_file() override
+    {
+        // Sockets are not stored in the archive either
+        if (S_ISSOCK(_curr->fts_statp->st_mode)) {
+            return Action::FTS_OK;
+        }
+        return add();
+    }
+
+private:
+    const std::vector<std::string> &_exclusions;
+    std::vector<BackupManifest::Entry> &_entries;
+
+    int add()
+    {
+        const struct stat *sb = _curr->fts_statp;
+        BackupManifest::Entry entry;
+
+        // fts_path is always _path + '/' + relative path
+        entry.path = _curr->fts_path + _root->fts_pathlen + 1;
+        entry.mode = sb->st_mode;
+        entry.uid = sb->st_uid;
+        entry.gid = sb->st_gid;
+        entry.size = S_ISREG(sb->st_mode) ? sb->st_size : 0;
+        entry.mtime_sec = sb->st_mtim.tv_sec;
+        entry.mtime_nsec = sb->st_mtim.tv_nsec;
+
+        _entries.push_back(std::move(entry));
+        return Action::FTS_OK;
+    }
+};
+
+class ManifestPruner : public util::FTSWrapper {
+public:
+    ManifestPruner(std::string path,
+                   const std::vector<std::string> &exclusions,
+                   const BackupManifest &manifest)
+        : FTSWrapper(path, FTS_GroupSpecialFiles
+                | FTS_CrossMountPointBoundaries),
+        _exclusions(exclusions),
+        _manifest(manifest)
+    {
+    }
+
+    int on_changed_path() override
+    {
+        // Only act once per directory
+        if (_curr->fts_level == 0 || _curr->fts_info == FTS_DP) {
+            return Action::FTS_Next;
+        }
+
+        if (_curr->fts_level == 1
+                && is_excluded(_exclusions, _curr->fts_name)) {
+            return Action::FTS_Skip;
+        }
+
+        const char *relpath = _curr->fts_path + _root->fts_pathlen + 1;
+        if (_manifest.find(relpath)) {
+            return Action::FTS_Next;
+        }
+
+        LOGV("Removing %s", relpath);
+
+        bool ret;
+        if (_curr->fts_info == FTS_D) {
+            ret = util::delete_recursive(_curr->fts_accpath);
+        } else {
+            ret = unlink(_curr->fts_accpath) == 0 || errno == ENOENT;
+        }
+
+        if (!ret) {
+            LOGE("%s: Failed to remove: %s", _curr->fts_path, strerror(errno));
+            return Action::FTS_Fail | Action::FTS_Stop;
+        }
+
+        return Action::FTS_Skip;
+    }
+
+private:
+    const std::vector<std::string> &_exclusions;
+    const BackupManifest &_manifest;
+};
+
+/*!
+ * \brief Build manifest from the contents of a directory
+ *
+ * \param base_dir Directory to scan
+ * \param exclusions Top-level entries to skip
+ * \param checksums Whether to compute SHA512 checksums of regular files
+ *
+ * \return Whether the directory was successfully scanned
+ */
+bool BackupManifest::scan(const std::string &base_dir,
+                          const std::vector<std::string> &exclusions,
+                          bool checksums)
+{
+    std::vector<Entry> entries;
+
+    // Strip trailing slashes so that relative paths can be computed from the
+    // length of the root path
+    std::string path(base_dir);
+    while (path.size() > 1 && path.back() == '/') {
+        path.pop_back();
+    }
+
+    ManifestScanner scanner(path, exclusions, entries);
+    if (!scanner.run()) {
+        LOGE("%s: Failed to scan directory: %s",
+             base_dir.c_str(), scanner.error().c_str());
+        return false;
+    }
+
+    if (checksums) {
+        // Hash the regular files concurrently after the (cheap) traversal
+        std::vector<Entry *> hashed;
+        std::vector<std::string> paths;
+
+        for (auto &entry : entries) {
+            if (S_ISREG(entry.mode)) {
+                hashed.push_back(&entry);
+                paths.push_back(path + "/" + entry.path);
+            }
+        }
+
+        std::vector<util::Sha512Digest> digests;
+        if (!util::sha512_hash_files(paths, digests, 0)) {
+            LOGE("%s: Failed to compute SHA512 checksums", base_dir.c_str());
+            return false;
+        }
+
+        for (size_t i = 0; i < hashed.size(); ++i) {
+            hashed[i]->sha512 = util::hex_string(digests[i].data(),
+                                                 digests[i].size());
+        }
+    }
+
+    _entries.clear();
+    _index.clear();
+    for (auto &entry : entries) {
+        add(std::move(entry));
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Load manifest from a file
+ *
+ * Each line contains the octal mode, uid, gid, size, mtime (seconds and
+ * nanoseconds), SHA512 checksum (or "-"), and escaped path, separated by a
+ * single space.
+ */
+bool BackupManifest::load(const std::string &path)
+{
+    autoclose::file fp(autoclose::fopen(path.c_str(), "rbe"));
+    if (!fp) {
+        LOGE("%s: Failed to open manifest: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    char *line = nullptr;
+    size_t len = 0;
+    ssize_t read;
+    bool first = true;
+
+    auto free_line = util::finally([&]{
+        free(line);
+    });
+
+    _entries.clear();
+    _index.clear();
+
+    while ((read = getline(&line, &len, fp.get())) >= 0) {
+        if (read > 0 && line[read - 1] == '\n') {
+            line[--read] = '\0';
+        }
+
+        if (first) {
+            if (strcmp(line, MANIFEST_HEADER) != 0) {
+                LOGE("%s: Unsupported manifest version", path.c_str());
+                return false;
+            }
+            first = false;
+            continue;
+        }
+
+        unsigned int mode;
+        unsigned int uid;
+        unsigned int gid;
+        uint64_t size;
+        int64_t mtime_sec;
+        long mtime_nsec;
+        char sha512[2 * 64 + 1];
+        int path_offset = -1;
+
+        if (sscanf(line, "%o %u %u %" SCNu64 " %" SCNd64 ".%ld %128s%n",
+                   &mode, &uid, &gid, &size, &mtime_sec, &mtime_nsec,
+                   sha512, &path_offset) != 7 || path_offset < 0
+                || line[path_offset] != ' ') {
+            LOGE("%s: Malformed manifest line: %s", path.c_str(), line);
+            return false;
+        }
+        // Skip separator (the path itself may begin with whitespace)
+        ++path_offset;
+
+        Entry entry;
+        if (!unescape_path(line + path_offset, read - path_offset,
+                           entry.path) || entry.path.empty()) {
+            LOGE("%s: Malformed path in manifest line: %s", path.c_str(), line);
+            return false;
+        }
+        entry.mode = mode;
+        entry.uid = uid;
+        entry.gid = gid;
+        entry.size = size;
+        entry.mtime_sec = mtime_sec;
+        entry.mtime_nsec = mtime_nsec;
+        if (strcmp(sha512, "-") != 0) {
+            entry.sha512 = sha512;
+        }
+
+        add(std::move(entry));
+    }
+
+    if (ferror(fp.get())) {
+        LOGE("%s: Failed to read manifest: %s", path.c_str(), strerror(errno));
+        return false;
+    } else if (first) {
+        LOGE("%s: Manifest is empty", path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Save manifest to a file
+ */
+bool BackupManifest::save(const std::string &path) const
+{
+    autoclose::file fp(autoclose::fopen(path.c_str(), "wbe"));
+    if (!fp) {
+        LOGE("%s: Failed to open manifest for writing: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    fputs(MANIFEST_HEADER "\n", fp.get());
+
+    for (auto const &entry : _entries) {
+        fprintf(fp.get(), "%o %u %u %" PRIu64 " %" PRId64 ".%09ld %s %s\n",
+                static_cast<unsigned int>(entry.mode),
+                static_cast<unsigned int>(entry.uid),
+                static_cast<unsigned int>(entry.gid),
+                entry.size, entry.mtime_sec, entry.mtime_nsec,
+                entry.sha512.empty() ? "-" : entry.sha512.c_str(),
+                escape_path(entry.path).c_str());
+    }
+
+    if (ferror(fp.get()) || fclose(fp.release()) != 0) {
+        LOGE("%s: Failed to write manifest: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+const BackupManifest::Entry * BackupManifest::find(const std::string &path) const
+{
+    auto it = _index.find(path);
+    return it == _index.end() ? nullptr : &_entries[it->second];
+}
+
+/*!
+ * \brief Get entries that are new or modified relative to a parent manifest
+ *
+ * An entry is considered modified if its type, permissions, ownership, size,
+ * or mtime changed, or if both manifests have checksums for it and they
+ * differ. Modified directories are included so that their metadata is
+ * restored, but their contents are only included if they changed too.
+ *
+ * \return Relative paths in traversal order (parents before children)
+ */
+std::vector<std::string>
+BackupManifest::changed_since(const BackupManifest &parent) const
+{
+    std::vector<std::string> result;
+
+    for (auto const &entry : _entries) {
+        const Entry *old = parent.find(entry.path);
+
+        if (!old
+                || old->mode != entry.mode
+                || old->uid != entry.uid
+                || old->gid != entry.gid
+                || old->size != entry.size
+                || old->mtime_sec != entry.mtime_sec
+                || old->mtime_nsec != entry.mtime_nsec
+                || (!old->sha512.empty() && !entry.sha512.empty()
+                        && old->sha512 != entry.sha512)) {
+            result.push_back(entry.path);
+        }
+    }
+
+    return result;
+}
+
+/*!
+ * \brief Remove everything in a directory that is not in the manifest
+ *
+ * This is used after an incremental backup chain is extracted to remove files
+ * that were deleted between the backups.
+ *
+ * \param base_dir Directory to prune
+ * \param exclusions Top-level entries to leave untouched
+ *
+ * \return Whether all extra entries were removed
+ */
+bool BackupManifest::prune(const std::string &base_dir,
+                           const std::vector<std::string> &exclusions) const
+{
+    std::string path(base_dir);
+    while (path.size() > 1 && path.back() == '/') {
+        path.pop_back();
+    }
+
+    ManifestPruner pruner(path, exclusions, *this);
+    if (!pruner.run()) {
+        LOGE("%s: Failed to prune directory: %s",
+             base_dir.c_str(), pruner.error().c_str());
+        return false;
+    }
+
+    return true;
+}
+
+const std::vector<BackupManifest::Entry> & BackupManifest::entries() const
+{
+    return _entries;
+}
+
+void BackupManifest::add(Entry entry)
+{
+    auto it = _index.find(entry.path);
+    if (it != _index.end()) {
+        _entries[it->second] = std::move(entry);
+    } else {
+        _index.emplace(entry.path, _entries.size());
+        _entries.push_back(std::move(entry));
+    }
+}
+
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cstdint>
+
+#include <sys/types.h>
+
+namespace mb
+{
+
+class BackupManifest
+{
+public:
+    struct Entry
+    {
+        // Path relative to the base directory
+        std::string path;
+        mode_t mode;
+        uid_t uid;
+        gid_t gid;
+        uint64_t size;
+        int64_t mtime_sec;
+        long mtime_nsec;
+        // Hex SHA512 digest of regular files (empty if not computed)
+        std::string sha512;
+    };
+
+    bool scan(const std::string &base_dir,
+              const std::vector<std::string> &exclusions,
+              bool checksums);
+    bool load(const std::string &path);
+    bool save(const std::string &path) const;
+
+    const Entry * find(const std::string &path) const;
+    std::vector<std::string> changed_since(const BackupManifest &parent) const;
+    bool prune(const std::string &base_dir,
+               const std::vector<std::string> &exclusions) const;
+
+    const std::vector<Entry> & entries() const;
+
+private:
+    void add(Entry entry);
+
+    std::vector<Entry> _entries;
+    std::unordered_map<std::string, size_t> _index;
+};
+
+}
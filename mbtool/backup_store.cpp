@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "backup_store.h"
+
+#include <utility>
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mbcommon/string.h"
+#include "mblog/logging.h"
+#include "mbutil/copy.h"
+#include "mbutil/directory.h"
+#include "mbutil/finally.h"
+#include "mbutil/hash.h"
+#include "mbutil/path.h"
+#include "mbutil/progress.h"
+#include "mbutil/string.h"
+
+namespace mb
+{
+
+static bool is_valid_digest(const std::string &sha512)
+{
+    if (sha512.size() != SHA512_DIGEST_LENGTH * 2) {
+        return false;
+    }
+    for (char c : sha512) {
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+BackupStore::BackupStore(std::string path)
+    : _path(std::move(path))
+{
+}
+
+/*!
+ * \brief Get path of the object with the specified SHA512 digest
+ */
+std::string BackupStore::object_path(const std::string &sha512) const
+{
+    std::string path(_path);
+    path += '/';
+    path.append(sha512, 0, 2);
+    path += '/';
+    path += sha512;
+    return path;
+}
+
+/*!
+ * \brief Copy a file into the store if no object with its digest exists yet
+ *
+ * The file is copied to a temporary file, which is hashed again before being
+ * renamed into place. This guarantees that an object's contents always match
+ * its name, even if the source file was modified after the manifest was
+ * created.
+ */
+bool BackupStore::add_object(const std::string &source,
+                             const std::string &sha512, bool *added)
+{
+    std::string target = object_path(sha512);
+
+    *added = false;
+
+    if (access(target.c_str(), F_OK) == 0) {
+        return true;
+    } else if (errno != ENOENT) {
+        LOGE("%s: Failed to access: %s", target.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::string dir = util::dir_name(target);
+    if (!util::mkdir_recursive(dir, 0755)) {
+        LOGE("%s: Failed to create directory: %s",
+             dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::string temp = format("%s/.%s.%d.tmp", dir.c_str(),
+                              sha512.c_str(), getpid());
+
+    int fd_source = open(source.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd_source < 0) {
+        LOGE("%s: Failed to open for reading: %s",
+             source.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_source = util::finally([&] {
+        close(fd_source);
+    });
+
+    int fd_temp = open(temp.c_str(),
+                       O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_temp < 0) {
+        LOGE("%s: Failed to open for writing: %s",
+             temp.c_str(), strerror(errno));
+        return false;
+    }
+
+    bool keep_temp = false;
+
+    auto close_temp = util::finally([&] {
+        close(fd_temp);
+        if (!keep_temp) {
+            unlink(temp.c_str());
+        }
+    });
+
+    if (!util::copy_data_fd(fd_source, fd_temp)) {
+        LOGE("%s: Failed to copy to %s: %s",
+             source.c_str(), temp.c_str(), strerror(errno));
+        return false;
+    }
+
+    unsigned char digest[SHA512_DIGEST_LENGTH];
+
+    if (lseek(fd_temp, 0, SEEK_SET) < 0
+            || !util::sha512_hash(fd_temp, digest)) {
+        LOGE("%s: Failed to compute SHA512 checksum: %s",
+             temp.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (util::hex_string(digest, sizeof(digest)) != sha512) {
+        LOGE("%s: File changed while it was being backed up", source.c_str());
+        return false;
+    }
+
+    if (fsync(fd_temp) < 0) {
+        LOGE("%s: Failed to sync: %s", temp.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (rename(temp.c_str(), target.c_str()) < 0) {
+        LOGE("%s: Failed to rename to %s: %s",
+             temp.c_str(), target.c_str(), strerror(errno));
+        return false;
+    }
+
+    keep_temp = true;
+    *added = true;
+    return true;
+}
+
+/*!
+ * \brief Store the contents of the regular files listed in a manifest
+ *
+ * \param base_dir Directory that \a manifest was created from
+ * \param manifest Manifest with SHA512 checksums for all regular files
+ * \param progress Progress tracker that is updated after each file (may be
+ *                 NULL)
+ * \param[out] bytes_added Number of bytes that weren't already in the store
+ *
+ * \return Whether all files were stored
+ */
+bool BackupStore::add_files(const std::string &base_dir,
+                            const BackupManifest &manifest,
+                            util::ProgressTracker *progress,
+                            uint64_t *bytes_added)
+{
+    *bytes_added = 0;
+
+    for (auto const &entry : manifest.entries()) {
+        if (!S_ISREG(entry.mode)) {
+            continue;
+        }
+
+        if (!is_valid_digest(entry.sha512)) {
+            LOGE("%s: Manifest has no valid checksum", entry.path.c_str());
+            return false;
+        }
+
+        bool added;
+        if (!add_object(base_dir + "/" + entry.path, entry.sha512, &added)) {
+            return false;
+        }
+
+        if (added) {
+            *bytes_added += entry.size;
+        }
+
+        if (progress) {
+            progress->add_bytes(entry.size);
+            progress->add_file();
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Fill in the contents of the regular files listed in a manifest
+ *
+ * The files must already exist in \a base_dir with the correct metadata (eg.
+ * extracted from an archive created with `file_data` disabled). Since writing
+ * the contents changes the modification time, it is reset to the one in the
+ * manifest afterwards.
+ *
+ * \param base_dir Directory to restore to
+ * \param manifest Manifest with SHA512 checksums for all regular files
+ * \param progress Progress tracker that is updated after each file (may be
+ *                 NULL)
+ *
+ * \return Whether all files were restored
+ */
+bool BackupStore::restore_files(const std::string &base_dir,
+                                const BackupManifest &manifest,
+                                util::ProgressTracker *progress) const
+{
+    for (auto const &entry : manifest.entries()) {
+        if (!S_ISREG(entry.mode)) {
+            continue;
+        }
+
+        if (!is_valid_digest(entry.sha512)) {
+            LOGE("%s: Manifest has no valid checksum", entry.path.c_str());
+            return false;
+        }
+
+        std::string source = object_path(entry.sha512);
+        std::string target(base_dir);
+        target += '/';
+        target += entry.path;
+
+        int fd_source = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd_source < 0) {
+            LOGE("%s: Failed to open object for %s: %s",
+                 source.c_str(), entry.path.c_str(), strerror(errno));
+            return false;
+        }
+
+        auto close_source = util::finally([&] {
+            close(fd_source);
+        });
+
+        struct stat sb;
+        if (fstat(fd_source, &sb) < 0) {
+            LOGE("%s: Failed to stat: %s", source.c_str(), strerror(errno));
+            return false;
+        } else if (static_cast<uint64_t>(sb.st_size) != entry.size) {
+            LOGE("%s: Object size does not match manifest", source.c_str());
+            return false;
+        }
+
+        int fd_target = open(target.c_str(),
+                             O_WRONLY | O_TRUNC | O_CLOEXEC | O_NOFOLLOW);
+        if (fd_target < 0) {
+            LOGE("%s: Failed to open for writing: %s",
+                 target.c_str(), strerror(errno));
+            return false;
+        }
+
+        auto close_target = util::finally([&] {
+            close(fd_target);
+        });
+
+        struct timespec times[2];
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1].tv_sec = static_cast<time_t>(entry.mtime_sec);
+        times[1].tv_nsec = entry.mtime_nsec;
+
+        if (!util::copy_data_fd(fd_source, fd_target)) {
+            LOGE("%s: Failed to copy to %s: %s",
+                 source.c_str(), target.c_str(), strerror(errno));
+            return false;
+        }
+
+        if (futimens(fd_target, times) < 0) {
+            LOGE("%s: Failed to set modification time: %s",
+                 target.c_str(), strerror(errno));
+            return false;
+        }
+
+        if (progress) {
+            progress->add_bytes(entry.size);
+            progress->add_file();
+        }
+    }
+
+    return true;
+}
+
+}
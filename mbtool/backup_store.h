@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+
+#include <cstdint>
+
+#include "backup_manifest.h"
+
+namespace mb
+{
+
+namespace util
+{
+class ProgressTracker;
+}
+
+/*!
+ * \brief Content-addressed store for regular file contents
+ *
+ * Each object is stored once as `<path>/<first 2 hex digits>/<SHA512>`
+ * regardless of how many backups reference it. Backups sharing a store only
+ * have to copy the files that no other backup has stored yet.
+ */
+class BackupStore
+{
+public:
+    explicit BackupStore(std::string path);
+
+    bool add_files(const std::string &base_dir,
+                   const BackupManifest &manifest,
+                   util::ProgressTracker *progress,
+                   uint64_t *bytes_added);
+    bool restore_files(const std::string &base_dir,
+                       const BackupManifest &manifest,
+                       util::ProgressTracker *progress) const;
+
+    std::string object_path(const std::string &sha512) const;
+
+private:
+    bool add_object(const std::string &source, const std::string &sha512,
+                    bool *added);
+
+    std::string _path;
+};
+
+}
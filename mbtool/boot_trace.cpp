@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "boot_trace.h"
+
+#include <atomic>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+#include "mbutil/autoclose/file.h"
+
+namespace mb
+{
+
+struct BootTraceSpan
+{
+    const char *name;
+    char arg[BOOT_TRACE_ARG_MAX];
+    uint64_t start_ns;
+    uint64_t end_ns;
+    pid_t tid;
+};
+
+// Preallocated so that recording a span never allocates
+static BootTraceSpan g_spans[BOOT_TRACE_MAX_SPANS];
+static std::atomic<uint64_t> g_next_span{0};
+
+/*!
+ * \brief Get the current CLOCK_MONOTONIC time in nanoseconds
+ */
+uint64_t boot_trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/*!
+ * \brief Record a completed span
+ *
+ * Each caller claims its own slot in the ring buffer, so this is safe to call
+ * from any thread without locking. Once the buffer is full, the oldest spans
+ * are overwritten.
+ *
+ * \param name Span name (not copied)
+ * \param arg Optional argument to attach to the span (copied and truncated to
+ *            `BOOT_TRACE_ARG_MAX - 1` characters)
+ * \param start_ns Start time from boot_trace_now()
+ * \param end_ns End time from boot_trace_now()
+ */
+void boot_trace_record(const char *name, const char *arg,
+                       uint64_t start_ns, uint64_t end_ns)
+{
+    uint64_t index = g_next_span.fetch_add(1, std::memory_order_relaxed);
+    BootTraceSpan &span = g_spans[index % BOOT_TRACE_MAX_SPANS];
+
+    span.name = name;
+    if (arg) {
+        strncpy(span.arg, arg, sizeof(span.arg) - 1);
+        span.arg[sizeof(span.arg) - 1] = '\0';
+    } else {
+        span.arg[0] = '\0';
+    }
+    span.start_ns = start_ns;
+    span.end_ns = end_ns;
+    span.tid = static_cast<pid_t>(syscall(SYS_gettid));
+}
+
+static void write_json_string(FILE *fp, const char *str)
+{
+    fputc('"', fp);
+    for (const char *p = str; *p; ++p) {
+        unsigned char c = static_cast<unsigned char>(*p);
+        if (c == '"' || c == '\\') {
+            fputc('\\', fp);
+            fputc(c, fp);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+/*!
+ * \brief Write the recorded spans as a Chrome trace JSON file
+ *
+ * The output can be loaded in chrome://tracing or Perfetto. Timestamps are in
+ * microseconds since CLOCK_MONOTONIC's epoch, so the first event's offset
+ * shows how long the kernel took to hand off to mbtool.
+ *
+ * \note Threads that record spans must have finished before this is called.
+ *
+ * \param path Output file
+ *
+ * \return Whether the file was successfully written
+ */
+bool boot_trace_dump(const char *path)
+{
+    autoclose::file fp(autoclose::fopen(path, "wbe"));
+    if (!fp) {
+        LOGW("%s: Failed to open for writing: %s", path, strerror(errno));
+        return false;
+    }
+
+    uint64_t end = g_next_span.load(std::memory_order_acquire);
+    uint64_t begin = end > BOOT_TRACE_MAX_SPANS
+            ? end - BOOT_TRACE_MAX_SPANS : 0;
+    pid_t pid = getpid();
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", fp.get());
+
+    for (uint64_t i = begin; i < end; ++i) {
+        const BootTraceSpan &span = g_spans[i % BOOT_TRACE_MAX_SPANS];
+
+        fputs(i == begin ? "\n{\"name\":" : ",\n{\"name\":", fp.get());
+        write_json_string(fp.get(), span.name);
+        fprintf(fp.get(), ",\"cat\":\"boot\",\"ph\":\"X\","
+                "\"ts\":%" PRIu64 ".%03" PRIu64 ","
+                "\"dur\":%" PRIu64 ".%03" PRIu64 ","
+                "\"pid\":%d,\"tid\":%d",
+                span.start_ns / 1000, span.start_ns % 1000,
+                (span.end_ns - span.start_ns) / 1000,
+                (span.end_ns - span.start_ns) % 1000,
+                pid, span.tid);
+        if (span.arg[0]) {
+            fputs(",\"args\":{\"arg\":", fp.get());
+            write_json_string(fp.get(), span.arg);
+            fputc('}', fp.get());
+        }
+        fputc('}', fp.get());
+    }
+
+    fputs("\n]}\n", fp.get());
+
+    if (end > BOOT_TRACE_MAX_SPANS) {
+        LOGW("Boot trace overflowed; dropped %" PRIu64 " oldest spans",
+             end - BOOT_TRACE_MAX_SPANS);
+    }
+
+    if (fflush(fp.get()) != 0 || ferror(fp.get())) {
+        LOGW("%s: Failed to write boot trace: %s", path, strerror(errno));
+        return false;
+    }
+
+    LOGV("Wrote %" PRIu64 " boot trace spans to %s", end - begin, path);
+    return true;
+}
+
+}
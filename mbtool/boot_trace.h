@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+
+#include "mbcommon/common.h"
+
+// Number of spans kept in memory. Older spans are overwritten once full.
+#define BOOT_TRACE_MAX_SPANS            4096
+// Longest span argument (eg. a mount point) that is kept, including the NUL
+#define BOOT_TRACE_ARG_MAX              64
+
+namespace mb
+{
+
+uint64_t boot_trace_now();
+void boot_trace_record(const char *name, const char *arg,
+                       uint64_t start_ns, uint64_t end_ns);
+bool boot_trace_dump(const char *path);
+
+/*!
+ * \brief Record a span covering the lifetime of the object
+ *
+ * \note \p name must be a string literal (or otherwise outlive the trace).
+ *       \p arg is copied.
+ */
+class BootTraceScope
+{
+public:
+    BootTraceScope(const char *name, const char *arg = nullptr)
+        : _name(name), _arg(arg), _start(boot_trace_now())
+    {
+    }
+
+    ~BootTraceScope()
+    {
+        boot_trace_record(_name, _arg, _start, boot_trace_now());
+    }
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(BootTraceScope)
+
+private:
+    const char *_name;
+    const char *_arg;
+    uint64_t _start;
+};
+
+}
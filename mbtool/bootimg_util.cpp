@@ -20,14 +20,15 @@
 #include "bootimg_util.h"
 
 #include <cerrno>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
 
 #include <unistd.h>
 
-#include "mblog/logging.h"
+#include "mbbootimg/transform.h"
 
-#define BUF_SIZE    10240
+#include "mblog/logging.h"
 
 typedef std::unique_ptr<FILE, decltype(fclose) *> ScopedFILE;
 
@@ -37,13 +38,14 @@ namespace mb
 bool bi_copy_data_to_fd(MbBiReader *bir, int fd)
 {
     int ret;
-    char buf[BUF_SIZE];
+    const void *data;
     size_t n_read;
     ssize_t n_written;
     size_t remain;
 
-    while ((ret = mb_bi_reader_read_data(bir, buf, sizeof(buf), &n_read))
+    while ((ret = mb_bi_reader_read_data_view(bir, &data, SIZE_MAX, &n_read))
             == MB_BI_OK) {
+        const char *buf = static_cast<const char *>(data);
         remain = n_read;
 
         while (remain > 0) {
@@ -113,12 +115,12 @@ bool bi_copy_data_to_file(MbBiReader *bir, const std::string &path)
     }
 
     int ret;
-    char buf[10240];
+    const void *data;
     size_t n;
 
-    while ((ret = mb_bi_reader_read_data(bir, buf, sizeof(buf), &n))
+    while ((ret = mb_bi_reader_read_data_view(bir, &data, SIZE_MAX, &n))
             == MB_BI_OK) {
-        if (fwrite(buf, 1, n, fp.get()) != n) {
+        if (fwrite(data, 1, n, fp.get()) != n) {
             LOGE("%s: Failed to write data: %s",
                  path.c_str(), strerror(errno));
             return false;
@@ -142,24 +144,9 @@ bool bi_copy_data_to_file(MbBiReader *bir, const std::string &path)
 
 bool bi_copy_data_to_data(MbBiReader *bir, MbBiWriter *biw)
 {
-    int ret;
-    char buf[10240];
-    size_t n_read;
-    size_t n_written;
-
-    while ((ret = mb_bi_reader_read_data(bir, buf, sizeof(buf), &n_read))
-            == MB_BI_OK) {
-        ret = mb_bi_writer_write_data(biw, buf, n_read, &n_written);
-        if (ret != MB_BI_OK || n_read != n_written) {
-            LOGE("Failed to write entry data: %s",
-                 mb_bi_writer_error_string(biw));
-            return false;
-        }
-    }
-
-    if (ret != MB_BI_EOF) {
-        LOGE("Failed to read boot image entry data: %s",
-             mb_bi_reader_error_string(bir));
+    if (mb_bi_copy_data(bir, biw) != MB_BI_OK) {
+        LOGE("Failed to copy entry data: %s",
+             mb_bi_writer_error_string(biw));
         return false;
     }
 
@@ -0,0 +1,343 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "chroot_template.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include "mbcommon/string.h"
+#include "mblog/logging.h"
+#include "mbutil/autoclose/dir.h"
+#include "mbutil/copy.h"
+#include "mbutil/delete.h"
+#include "mbutil/file.h"
+#include "mbutil/finally.h"
+
+// The template lives for the whole recovery session since /tmp is a tmpfs.
+// Instances must be on the same filesystem so that they can be hardlinked.
+#define CHROOT_TEMPLATE_ROOT    "/tmp/.mbtool-chroot"
+#define CHROOT_TEMPLATE_DIR     CHROOT_TEMPLATE_ROOT "/template"
+#define CHROOT_TEMPLATE_LOCK    CHROOT_TEMPLATE_ROOT "/.lock"
+#define CHROOT_TEMPLATE_STAMP   CHROOT_TEMPLATE_ROOT "/template.stamp"
+#define INSTANCE_PREFIX         "instance."
+
+#define BOOT_ID_PATH            "/proc/sys/kernel/random/boot_id"
+
+namespace mb
+{
+
+/*!
+ * \brief Append a line for each entry in a tree to a stamp
+ *
+ * Anything that writes to a template file through a hardlink changes its
+ * mtime and anything that replaces it changes its inode, so comparing stamps
+ * detects templates that were modified by a previous install.
+ */
+static bool stamp_tree(const std::string &root, const std::string &rel,
+                       std::string &stamp)
+{
+    std::string dir_path(root + rel);
+
+    autoclose::dir dp(autoclose::opendir(dir_path.c_str()));
+    if (!dp) {
+        LOGE("%s: Failed to open directory: %s",
+             dir_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::vector<std::string> names;
+    struct dirent *ent;
+    while ((ent = readdir(dp.get()))) {
+        if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
+            names.push_back(ent->d_name);
+        }
+    }
+    dp.reset();
+
+    std::sort(names.begin(), names.end());
+
+    for (auto const &name : names) {
+        std::string entry_rel(rel + "/" + name);
+        std::string path(root + entry_rel);
+
+        struct stat sb;
+        if (lstat(path.c_str(), &sb) < 0) {
+            LOGE("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+            return false;
+        }
+
+        append_format(stamp, "%s %llu %o %u %u %lld %lld.%09ld\n",
+                      entry_rel.c_str(),
+                      static_cast<unsigned long long>(sb.st_ino),
+                      sb.st_mode, sb.st_uid, sb.st_gid,
+                      static_cast<long long>(sb.st_size),
+                      static_cast<long long>(sb.st_mtim.tv_sec),
+                      sb.st_mtim.tv_nsec);
+
+        if (S_ISDIR(sb.st_mode) && !stamp_tree(root, entry_rel, stamp)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool compute_stamp(std::string &stamp)
+{
+    stamp.clear();
+
+    if (!util::file_first_line(BOOT_ID_PATH, &stamp)) {
+        LOGW("%s: Failed to read boot ID: %s", BOOT_ID_PATH, strerror(errno));
+    }
+    stamp += '\n';
+
+    return stamp_tree(CHROOT_TEMPLATE_DIR, "", stamp);
+}
+
+static bool template_is_valid()
+{
+    std::vector<unsigned char> saved;
+    if (!util::file_read_all(CHROOT_TEMPLATE_STAMP, &saved)) {
+        return false;
+    }
+
+    std::string stamp;
+    return compute_stamp(stamp)
+            && stamp.size() == saved.size()
+            && memcmp(stamp.data(), saved.data(), saved.size()) == 0;
+}
+
+static bool build_template(ChrootTemplatePopulateFn populate)
+{
+    unlink(CHROOT_TEMPLATE_STAMP);
+
+    if (!util::delete_recursive(CHROOT_TEMPLATE_DIR)) {
+        LOGE("%s: Failed to remove old template: %s",
+             CHROOT_TEMPLATE_DIR, strerror(errno));
+        return false;
+    }
+
+    if (mkdir(CHROOT_TEMPLATE_DIR, 0700) < 0
+            || mkdir(CHROOT_TEMPLATE_DIR "/sbin", 0755) < 0
+            || mkdir(CHROOT_TEMPLATE_DIR "/dev", 0755) < 0) {
+        LOGE("%s: Failed to create template directories: %s",
+             CHROOT_TEMPLATE_DIR, strerror(errno));
+        return false;
+    }
+
+    if (!populate(CHROOT_TEMPLATE_DIR)) {
+        return false;
+    }
+
+    std::string stamp;
+    if (!compute_stamp(stamp)
+            || !util::file_write_data(CHROOT_TEMPLATE_STAMP,
+                                      stamp.data(), stamp.size())) {
+        LOGE("%s: Failed to write stamp: %s",
+             CHROOT_TEMPLATE_STAMP, strerror(errno));
+        return false;
+    }
+
+    LOGD("Created chroot template in %s", CHROOT_TEMPLATE_DIR);
+    return true;
+}
+
+/*!
+ * \brief Recreate a template tree with hardlinks
+ *
+ * Directories are recreated so that new files created in an instance don't
+ * affect the template. Files that cannot be hardlinked are copied.
+ */
+static bool link_tree(const std::string &source, const std::string &target)
+{
+    autoclose::dir dp(autoclose::opendir(source.c_str()));
+    if (!dp) {
+        LOGE("%s: Failed to open directory: %s",
+             source.c_str(), strerror(errno));
+        return false;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dp.get()))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+
+        std::string source_path(source + "/" + ent->d_name);
+        std::string target_path(target + "/" + ent->d_name);
+
+        struct stat sb;
+        if (lstat(source_path.c_str(), &sb) < 0) {
+            LOGE("%s: Failed to stat: %s", source_path.c_str(), strerror(errno));
+            return false;
+        }
+
+        if (S_ISDIR(sb.st_mode)) {
+            if (mkdir(target_path.c_str(), sb.st_mode & 07777) < 0
+                    || !util::copy_stat(source_path, target_path)
+                    || !util::copy_xattrs(source_path, target_path)
+                    || !link_tree(source_path, target_path)) {
+                LOGE("%s: Failed to recreate directory: %s",
+                     target_path.c_str(), strerror(errno));
+                return false;
+            }
+        } else if (link(source_path.c_str(), target_path.c_str()) < 0
+                && !util::copy_file(source_path, target_path,
+                                    util::COPY_ATTRIBUTES
+                                  | util::COPY_XATTRS)) {
+            LOGE("%s: Failed to link or copy to %s: %s", source_path.c_str(),
+                 target_path.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Remove instances left behind by installers that did not clean up
+static void remove_stale_instances()
+{
+    autoclose::dir dp(autoclose::opendir(CHROOT_TEMPLATE_ROOT));
+    if (!dp) {
+        return;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dp.get()))) {
+        if (strncmp(ent->d_name, INSTANCE_PREFIX,
+                    sizeof(INSTANCE_PREFIX) - 1) != 0) {
+            continue;
+        }
+
+        pid_t pid = static_cast<pid_t>(
+                strtol(ent->d_name + sizeof(INSTANCE_PREFIX) - 1, nullptr, 10));
+        if (pid > 0 && kill(pid, 0) < 0 && errno == ESRCH) {
+            util::delete_recursive(format("%s/%s", CHROOT_TEMPLATE_ROOT,
+                                          ent->d_name));
+        }
+    }
+}
+
+/*!
+ * \brief Create the chroot's /sbin and /dev from the session-wide template
+ *
+ * The template is created by \p populate on first use and then reused by
+ * every installer run until the recovery reboots. It is rebuilt if anything
+ * in it was modified. Each instance contains `sbin/` and `dev/` directories
+ * that hardlink to the template and should be bind mounted into the chroot.
+ *
+ * \param populate Function to fill in the template
+ * \param[out] instance_out Path to the instance directory
+ *
+ * \return Whether the instance was created. If this fails (eg. because /tmp
+ *         is mounted noexec or nodev), the caller should populate the chroot
+ *         directly.
+ */
+bool chroot_template_create_instance(ChrootTemplatePopulateFn populate,
+                                     std::string *instance_out)
+{
+    if (mkdir(CHROOT_TEMPLATE_ROOT, 0700) < 0 && errno != EEXIST) {
+        LOGW("%s: Failed to create directory: %s",
+             CHROOT_TEMPLATE_ROOT, strerror(errno));
+        return false;
+    }
+
+    struct statvfs sfs;
+    if (statvfs(CHROOT_TEMPLATE_ROOT, &sfs) < 0) {
+        LOGW("%s: Failed to stat filesystem: %s",
+             CHROOT_TEMPLATE_ROOT, strerror(errno));
+        return false;
+    } else if (sfs.f_flag & (ST_NOEXEC | ST_NODEV)) {
+        // The binaries and device nodes would not be usable in the chroot
+        LOGW("%s: Filesystem is mounted noexec or nodev", CHROOT_TEMPLATE_ROOT);
+        return false;
+    }
+
+    int lock_fd = open(CHROOT_TEMPLATE_LOCK,
+                       O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock_fd < 0) {
+        LOGW("%s: Failed to open lock file: %s",
+             CHROOT_TEMPLATE_LOCK, strerror(errno));
+        return false;
+    }
+
+    auto close_lock_fd = util::finally([&] {
+        close(lock_fd);
+    });
+
+    if (flock(lock_fd, LOCK_EX) < 0) {
+        LOGW("%s: Failed to lock: %s", CHROOT_TEMPLATE_LOCK, strerror(errno));
+        return false;
+    }
+
+    remove_stale_instances();
+
+    if (template_is_valid()) {
+        LOGD("Reusing chroot template in %s", CHROOT_TEMPLATE_DIR);
+    } else if (!build_template(populate)) {
+        util::delete_recursive(CHROOT_TEMPLATE_DIR);
+        return false;
+    }
+
+    std::string instance = format("%s/" INSTANCE_PREFIX "%d",
+                                  CHROOT_TEMPLATE_ROOT, getpid());
+
+    if (!util::delete_recursive(instance)
+            || mkdir(instance.c_str(), 0700) < 0
+            || !link_tree(CHROOT_TEMPLATE_DIR, instance)) {
+        LOGW("%s: Failed to create chroot template instance",
+             instance.c_str());
+        util::delete_recursive(instance);
+        return false;
+    }
+
+    *instance_out = std::move(instance);
+    return true;
+}
+
+/*!
+ * \brief Remove an instance created by chroot_template_create_instance()
+ *
+ * The instance must no longer be mounted anywhere. The template is kept for
+ * the next installer run.
+ */
+bool chroot_template_remove_instance(const std::string &instance)
+{
+    if (!util::delete_recursive(instance)) {
+        LOGE("%s: Failed to remove chroot template instance: %s",
+             instance.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,523 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cpio_archive.h"
+
+#include <memory>
+#include <utility>
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/stat.h>
+
+#include <archive.h>
+#include <archive_entry.h>
+
+#include "mblog/logging.h"
+#include "mbutil/file.h"
+
+typedef std::unique_ptr<archive, decltype(archive_free) *> ScopedArchive;
+typedef std::unique_ptr<archive_entry, decltype(archive_entry_free) *> ScopedArchiveEntry;
+
+namespace mb
+{
+
+CpioArchive::CpioArchive()
+    : _format(ARCHIVE_FORMAT_CPIO_SVR4_NOCRC)
+{
+}
+
+/*!
+ * \brief Load archive from memory
+ *
+ * Any compression filters supported by the boot image ramdisks (gzip, lz4,
+ * lzma, xz) are detected automatically and reused when saving. The previous
+ * contents of the archive are discarded.
+ *
+ * \param data Archive data
+ * \param size Size of \p data
+ *
+ * \return Whether the archive was successfully loaded
+ */
+bool CpioArchive::load(const void *data, size_t size)
+{
+    ScopedArchive a(archive_read_new(), archive_read_free);
+    archive_entry *entry;
+    int ret;
+
+    if (!a) {
+        LOGE("Failed to allocate archive reader instance");
+        return false;
+    }
+
+    archive_read_support_filter_gzip(a.get());
+    archive_read_support_filter_lz4(a.get());
+    archive_read_support_filter_lzma(a.get());
+    archive_read_support_filter_xz(a.get());
+    archive_read_support_format_cpio(a.get());
+
+    if (archive_read_open_memory(a.get(), const_cast<void *>(data), size)
+            != ARCHIVE_OK) {
+        LOGE("Failed to open cpio archive: %s", archive_error_string(a.get()));
+        return false;
+    }
+
+    _entries.clear();
+    _index.clear();
+    _arena.clear();
+
+    while (true) {
+        ret = archive_read_next_header(a.get(), &entry);
+        if (ret == ARCHIVE_EOF) {
+            break;
+        } else if (ret == ARCHIVE_RETRY) {
+            continue;
+        } else if (ret != ARCHIVE_OK) {
+            LOGE("Failed to read cpio header: %s",
+                 archive_error_string(a.get()));
+            return false;
+        }
+
+        const char *c_path = archive_entry_pathname(entry);
+        if (!c_path || !*c_path) {
+            LOGE("Cpio header has null or empty filename");
+            return false;
+        }
+
+        std::string path = normalize(c_path);
+        if (path.empty()) {
+            // Root directory
+            continue;
+        }
+
+        Entry &e = add_entry(path, archive_entry_mode(entry));
+        e.uid = archive_entry_uid(entry);
+        e.gid = archive_entry_gid(entry);
+        e.mtime = archive_entry_mtime(entry);
+        e.rdev = archive_entry_rdev(entry);
+
+        if (const char *target = archive_entry_symlink(entry)) {
+            e.symlink = target;
+        }
+
+        // Hard links are stored as independent copies of the target's data
+        const char *hardlink = archive_entry_hardlink(entry);
+        if (hardlink) {
+            const Entry *target = find(hardlink);
+            if (target && target != &e) {
+                e.mode = target->mode;
+                e.data_offset = target->data_offset;
+                e.data_size = target->data_size;
+            }
+        }
+
+        if (archive_entry_size(entry) > 0) {
+            char buf[10240];
+            la_ssize_t n;
+            size_t offset = _arena.size();
+
+            while ((n = archive_read_data(a.get(), buf, sizeof(buf))) > 0) {
+                _arena.insert(_arena.end(), buf, buf + n);
+            }
+
+            if (n < 0) {
+                LOGE("%s: Failed to read cpio entry data: %s",
+                     path.c_str(), archive_error_string(a.get()));
+                return false;
+            }
+
+            e.data_offset = offset;
+            e.data_size = _arena.size() - offset;
+        }
+    }
+
+    _format = archive_format(a.get());
+    _filters.clear();
+    for (int i = 0; i < archive_filter_count(a.get()); ++i) {
+        int code = archive_filter_code(a.get(), i);
+        if (code != ARCHIVE_FILTER_NONE) {
+            _filters.push_back(code);
+        }
+    }
+
+    if (archive_read_close(a.get()) != ARCHIVE_OK) {
+        LOGE("Failed to close cpio archive: %s",
+             archive_error_string(a.get()));
+        return false;
+    }
+
+    return true;
+}
+
+static la_ssize_t write_to_vector_cb(archive *a, void *userdata,
+                                     const void *buf, size_t size)
+{
+    (void) a;
+    auto *out = static_cast<std::vector<unsigned char> *>(userdata);
+    auto *ptr = static_cast<const unsigned char *>(buf);
+    out->insert(out->end(), ptr, ptr + size);
+    return static_cast<la_ssize_t>(size);
+}
+
+/*!
+ * \brief Save archive to memory
+ *
+ * The archive is written with the same format and filters that it was loaded
+ * with.
+ *
+ * \param[out] data_out Buffer for storing the archive data
+ *
+ * \return Whether the archive was successfully saved
+ */
+bool CpioArchive::save(std::vector<unsigned char> &data_out) const
+{
+    ScopedArchive a(archive_write_new(), archive_write_free);
+    ScopedArchiveEntry entry(archive_entry_new(), archive_entry_free);
+    std::vector<unsigned char> buf;
+
+    if (!a || !entry) {
+        LOGE("Failed to allocate archive writer or entry instance");
+        return false;
+    }
+
+    if (archive_write_set_format(a.get(), _format) != ARCHIVE_OK) {
+        LOGE("Failed to set output archive format: %s",
+             archive_error_string(a.get()));
+        return false;
+    }
+    for (const int &filter : _filters) {
+        if (archive_write_add_filter(a.get(), filter) != ARCHIVE_OK) {
+            LOGE("Failed to add output archive filter: %s",
+                 archive_error_string(a.get()));
+            return false;
+        }
+    }
+
+    archive_write_set_bytes_per_block(a.get(), 512);
+
+    if (archive_write_open(a.get(), &buf, nullptr, &write_to_vector_cb,
+                           nullptr) != ARCHIVE_OK) {
+        LOGE("Failed to open cpio archive for writing: %s",
+             archive_error_string(a.get()));
+        return false;
+    }
+
+    for (auto const &e : _entries) {
+        archive_entry_clear(entry.get());
+
+        archive_entry_set_pathname(entry.get(), e.path.c_str());
+        archive_entry_set_mode(entry.get(), e.mode);
+        archive_entry_set_uid(entry.get(), e.uid);
+        archive_entry_set_gid(entry.get(), e.gid);
+        archive_entry_set_mtime(entry.get(), e.mtime, 0);
+        archive_entry_set_rdev(entry.get(), e.rdev);
+        archive_entry_set_nlink(entry.get(), S_ISDIR(e.mode) ? 2 : 1);
+
+        if (S_ISLNK(e.mode)) {
+            archive_entry_set_symlink(entry.get(), e.symlink.c_str());
+        }
+
+        bool has_data = S_ISREG(e.mode) && e.data_size > 0;
+        archive_entry_set_size(entry.get(), has_data ? e.data_size : 0);
+
+        if (archive_write_header(a.get(), entry.get()) != ARCHIVE_OK) {
+            LOGE("%s: Failed to write cpio header: %s",
+                 e.path.c_str(), archive_error_string(a.get()));
+            return false;
+        }
+
+        if (has_data) {
+            la_ssize_t n = archive_write_data(
+                    a.get(), _arena.data() + e.data_offset, e.data_size);
+            if (n < 0 || static_cast<size_t>(n) != e.data_size) {
+                LOGE("%s: Failed to write cpio entry data: %s",
+                     e.path.c_str(), archive_error_string(a.get()));
+                return false;
+            }
+        }
+    }
+
+    if (archive_write_close(a.get()) != ARCHIVE_OK) {
+        LOGE("Failed to close cpio archive: %s",
+             archive_error_string(a.get()));
+        return false;
+    }
+
+    data_out.swap(buf);
+
+    return true;
+}
+
+const CpioArchive::Entry * CpioArchive::find(const std::string &path) const
+{
+    auto it = _index.find(normalize(path));
+    return it == _index.end() ? nullptr : &_entries[it->second];
+}
+
+bool CpioArchive::exists(const std::string &path) const
+{
+    return find(path) != nullptr;
+}
+
+bool CpioArchive::is_symlink(const std::string &path) const
+{
+    const Entry *e = find(path);
+    return e && S_ISLNK(e->mode);
+}
+
+/*!
+ * \brief Get contents of a regular file
+ *
+ * \return Whether the file exists and is a regular file
+ */
+bool CpioArchive::read(const std::string &path, std::string &data_out) const
+{
+    const Entry *e = find(path);
+    if (!e || !S_ISREG(e->mode)) {
+        return false;
+    }
+
+    auto begin = _arena.begin() + e->data_offset;
+    data_out.assign(begin, begin + e->data_size);
+    return true;
+}
+
+bool CpioArchive::read(const std::string &path,
+                       std::vector<unsigned char> &data_out) const
+{
+    const Entry *e = find(path);
+    if (!e || !S_ISREG(e->mode)) {
+        return false;
+    }
+
+    auto begin = _arena.begin() + e->data_offset;
+    data_out.assign(begin, begin + e->data_size);
+    return true;
+}
+
+/*!
+ * \brief Replace contents of an existing regular file
+ *
+ * The metadata of the file is preserved.
+ *
+ * \return Whether the file exists and is a regular file
+ */
+bool CpioArchive::set_data(const std::string &path,
+                           const void *data, size_t size)
+{
+    Entry *e = find_mutable(path);
+    if (!e || !S_ISREG(e->mode)) {
+        return false;
+    }
+
+    append_data(*e, data, size);
+    return true;
+}
+
+/*!
+ * \brief Add or replace a regular file
+ *
+ * If an entry already exists at \p path, it is replaced in place and keeps its
+ * ownership. Otherwise, a new root-owned entry is added to the end of the
+ * archive.
+ */
+bool CpioArchive::add_file(const std::string &path,
+                           const void *data, size_t size, mode_t perms)
+{
+    Entry &e = add_entry(normalize(path), S_IFREG | (perms & 07777));
+    e.symlink.clear();
+    append_data(e, data, size);
+    return true;
+}
+
+/*!
+ * \brief Add or replace a regular file with the contents of a file on disk
+ */
+bool CpioArchive::add_file_from_path(const std::string &path,
+                                     const std::string &source, mode_t perms)
+{
+    std::vector<unsigned char> data;
+
+    if (!util::file_read_all(source, &data)) {
+        LOGE("%s: Failed to read file: %s", source.c_str(), strerror(errno));
+        return false;
+    }
+
+    return add_file(path, data.data(), data.size(), perms);
+}
+
+/*!
+ * \brief Add or replace a symlink
+ */
+bool CpioArchive::add_symlink(const std::string &path,
+                              const std::string &target)
+{
+    Entry &e = add_entry(normalize(path), S_IFLNK | 0777);
+    e.symlink = target;
+    e.data_offset = 0;
+    e.data_size = 0;
+    return true;
+}
+
+/*!
+ * \brief Remove an entry
+ *
+ * \return Whether the entry existed
+ */
+bool CpioArchive::remove(const std::string &path)
+{
+    auto it = _index.find(normalize(path));
+    if (it == _index.end()) {
+        return false;
+    }
+
+    _entries.erase(_entries.begin() + it->second);
+    rebuild_index();
+    return true;
+}
+
+/*!
+ * \brief Rename an entry
+ *
+ * \return Whether \p from exists and \p to does not exist
+ */
+bool CpioArchive::rename(const std::string &from, const std::string &to)
+{
+    std::string norm_to = normalize(to);
+
+    auto it = _index.find(normalize(from));
+    if (it == _index.end() || norm_to.empty() || _index.count(norm_to) > 0) {
+        return false;
+    }
+
+    size_t index = it->second;
+    _index.erase(it);
+    _entries[index].path = norm_to;
+    _index.emplace(norm_to, index);
+    return true;
+}
+
+const std::vector<CpioArchive::Entry> & CpioArchive::entries() const
+{
+    return _entries;
+}
+
+/*!
+ * \brief libarchive filter codes of the loaded archive
+ */
+const std::vector<int> & CpioArchive::filters() const
+{
+    return _filters;
+}
+
+/*!
+ * \brief Set the libarchive filters used by save()
+ *
+ * \param filters Filter codes (empty for an uncompressed archive)
+ */
+void CpioArchive::set_filters(std::vector<int> filters)
+{
+    _filters = std::move(filters);
+}
+
+/*!
+ * \brief Normalize path for lookup
+ *
+ * Strips leading "./" and "/" components and trailing slashes.
+ */
+std::string CpioArchive::normalize(const std::string &path)
+{
+    size_t begin = 0;
+    size_t end = path.size();
+
+    while (begin < end) {
+        if (path[begin] == '/') {
+            ++begin;
+        } else if (path.compare(begin, 2, "./") == 0) {
+            begin += 2;
+        } else if (end - begin == 1 && path[begin] == '.') {
+            ++begin;
+        } else {
+            break;
+        }
+    }
+
+    while (end > begin && path[end - 1] == '/') {
+        --end;
+    }
+
+    return path.substr(begin, end - begin);
+}
+
+CpioArchive::Entry * CpioArchive::find_mutable(const std::string &path)
+{
+    auto it = _index.find(normalize(path));
+    return it == _index.end() ? nullptr : &_entries[it->second];
+}
+
+/*!
+ * \brief Get existing entry at normalized path or append a new one
+ *
+ * The file type and permissions of the entry are set to \p mode.
+ */
+CpioArchive::Entry & CpioArchive::add_entry(const std::string &path,
+                                            mode_t mode)
+{
+    auto it = _index.find(path);
+    if (it != _index.end()) {
+        Entry &e = _entries[it->second];
+        e.mode = mode;
+        return e;
+    }
+
+    _entries.emplace_back();
+    Entry &e = _entries.back();
+    e.path = path;
+    e.mode = mode;
+    e.uid = 0;
+    e.gid = 0;
+    e.mtime = 0;
+    e.rdev = 0;
+    e.data_offset = 0;
+    e.data_size = 0;
+
+    _index.emplace(path, _entries.size() - 1);
+
+    return e;
+}
+
+void CpioArchive::append_data(Entry &entry, const void *data, size_t size)
+{
+    auto ptr = static_cast<const unsigned char *>(data);
+
+    entry.data_offset = _arena.size();
+    entry.data_size = size;
+    _arena.insert(_arena.end(), ptr, ptr + size);
+}
+
+void CpioArchive::rebuild_index()
+{
+    _index.clear();
+    for (size_t i = 0; i < _entries.size(); ++i) {
+        _index.emplace(_entries[i].path, i);
+    }
+}
+
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace mb
+{
+
+/*!
+ * \brief In-memory cpio archive
+ *
+ * The archive is loaded from and saved to memory buffers with libarchive. The
+ * compression format of the original archive is remembered so that saving the
+ * archive produces an archive with the same format and filters.
+ *
+ * Entries are stored in their original order in an index. The file data of
+ * all entries lives in a single contiguous arena and each entry references a
+ * range of it. Replacing an entry's data appends the new data to the arena.
+ */
+class CpioArchive
+{
+public:
+    struct Entry
+    {
+        std::string path;
+        // File type and permissions
+        mode_t mode;
+        uid_t uid;
+        gid_t gid;
+        time_t mtime;
+        dev_t rdev;
+        // Symlink target
+        std::string symlink;
+        // Range of the file data in the arena
+        size_t data_offset;
+        size_t data_size;
+    };
+
+    CpioArchive();
+
+    bool load(const void *data, size_t size);
+    bool save(std::vector<unsigned char> &data_out) const;
+
+    const Entry * find(const std::string &path) const;
+    bool exists(const std::string &path) const;
+    bool is_symlink(const std::string &path) const;
+
+    bool read(const std::string &path, std::string &data_out) const;
+    bool read(const std::string &path,
+              std::vector<unsigned char> &data_out) const;
+
+    bool set_data(const std::string &path, const void *data, size_t size);
+    bool add_file(const std::string &path, const void *data, size_t size,
+                  mode_t perms);
+    bool add_file_from_path(const std::string &path,
+                            const std::string &source, mode_t perms);
+    bool add_symlink(const std::string &path, const std::string &target);
+    bool remove(const std::string &path);
+    bool rename(const std::string &from, const std::string &to);
+
+    const std::vector<Entry> & entries() const;
+
+    const std::vector<int> & filters() const;
+    void set_filters(std::vector<int> filters);
+
+private:
+    std::vector<Entry> _entries;
+    std::unordered_map<std::string, size_t> _index;
+    std::vector<unsigned char> _arena;
+
+    int _format;
+    std::vector<int> _filters;
+
+    static std::string normalize(const std::string &path);
+
+    Entry * find_mutable(const std::string &path);
+    Entry & add_entry(const std::string &path, mode_t mode);
+    void append_data(Entry &entry, const void *data, size_t size);
+    void rebuild_index();
+};
+
+}
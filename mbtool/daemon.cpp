@@ -34,16 +34,19 @@
 
 #include "mbcommon/common.h"
 #include "mbcommon/version.h"
+#include "mblog/async_logger.h"
 #include "mblog/logging.h"
 #include "mblog/kmsg_logger.h"
 #include "mblog/stdio_logger.h"
 #include "mbutil/autoclose/file.h"
+#include "mbutil/delete.h"
 #include "mbutil/directory.h"
 #include "mbutil/finally.h"
 #include "mbutil/process.h"
 #include "mbutil/selinux.h"
 #include "mbutil/socket.h"
 
+#include "daemon_stats.h"
 #include "daemon_v3.h"
 #include "multiboot.h"
 #include "packages.h"
@@ -78,13 +81,13 @@ static bool verify_credentials(uid_t uid)
     // the connection will terminate. Or, the client already has root access, in
     // which case, there's not much we can do to prevent damage.
 
-    Packages pkgs;
-    if (!pkgs.load_xml(PACKAGES_XML)) {
+    std::shared_ptr<const Packages> pkgs = Packages::load_cached(PACKAGES_XML);
+    if (!pkgs) {
         LOGE("Failed to load " PACKAGES_XML);
         return false;
     }
 
-    std::shared_ptr<Package> pkg = pkgs.find_by_uid(uid);
+    std::shared_ptr<Package> pkg = pkgs->find_by_uid(uid);
     if (!pkg) {
         LOGE("Failed to find package for UID %u", uid);
         return false;
@@ -94,12 +97,13 @@ static bool verify_credentials(uid_t uid)
     LOGD("%s has %zu signatures", pkg->name.c_str(), pkg->sig_indexes.size());
 
     for (const std::string &index : pkg->sig_indexes) {
-        if (pkgs.sigs.find(index) == pkgs.sigs.end()) {
+        auto it = pkgs->sigs.find(index);
+        if (it == pkgs->sigs.end()) {
             LOGW("Signature index %s has no key", index.c_str());
             continue;
         }
 
-        const std::string &key = pkgs.sigs[index];
+        const std::string &key = it->second;
         if (std::find(valid_certs.begin(), valid_certs.end(), key)
                 != valid_certs.end()) {
             LOGV("%s matches whitelisted signatures", pkg->name.c_str());
@@ -168,6 +172,7 @@ static bool client_connection(int fd)
             return false;
         }
 
+        daemon_stats_add_connection();
         connection_version_3(fd);
         return true;
     } else {
@@ -211,7 +216,10 @@ static bool run_daemon()
         return false;
     }
 
-    if (listen(fd, 3) < 0) {
+    // mbbootui, the app and appsync may all connect at the same time during
+    // boot. Each connection is handed off to its own process right away, but
+    // make sure the backlog doesn't overflow in the meantime.
+    if (listen(fd, 16) < 0) {
         LOGE("Failed to listen on socket: %s", strerror(errno));
         return false;
     }
@@ -239,6 +247,9 @@ static bool run_daemon()
         return false;
     }
 
+    // Statistics are optional, so don't fail if they can't be recorded
+    daemon_stats_init();
+
     LOGD("Socket ready, waiting for connections");
 
     int client_fd;
@@ -284,6 +295,11 @@ static bool run_daemon()
 
             bool ret = client_connection(client_fd);
             close(client_fd);
+
+            // Wiping ROMs may have left deletions running in the background.
+            // Let them finish so no trash directories are left behind.
+            util::wait_for_background_deletes();
+
             _exit(ret ? EXIT_SUCCESS : EXIT_FAILURE);
         }
         close(client_fd);
@@ -342,7 +358,8 @@ static bool daemon_init()
     if (log_to_stdio) {
         // Default; do nothing
     } else if (log_to_kmsg) {
-        log::log_set_logger(std::make_shared<log::KmsgLogger>(false));
+        log::log_set_logger(std::make_shared<log::AsyncLogger>(
+                std::make_shared<log::KmsgLogger>(false), 512, true));
     } else {
         if (!util::mkdir_parent(MULTIBOOT_LOG_DAEMON, 0775)
                 && errno != EEXIST) {
@@ -462,7 +479,9 @@ static void daemon_usage(bool error)
             "                   fully initialized\n"
             "  --log-to-kmsg    Send log output to kernel log instead of file\n"
             "  --log-to-stdio   Send log output to stdout/stderr\n"
-            "  --no-unshare     Don't unshare mount namespace\n");
+            "  --no-unshare     Don't unshare mount namespace\n"
+            "  --stats          Print request statistics of the running daemon\n"
+            "                   and exit\n");
 }
 
 int daemon_main(int argc, char *argv[])
@@ -479,6 +498,7 @@ int daemon_main(int argc, char *argv[])
         OPT_LOG_TO_KMSG = 1003,
         OPT_LOG_TO_STDIO = 1004,
         OPT_NO_UNSHARE = 1005,
+        OPT_STATS = 1006,
     };
 
     static struct option long_options[] = {
@@ -491,6 +511,7 @@ int daemon_main(int argc, char *argv[])
         {"log-to-kmsg",        no_argument, 0, OPT_LOG_TO_KMSG},
         {"log-to-stdio",       no_argument, 0, OPT_LOG_TO_STDIO},
         {"no-unshare",         no_argument, 0, OPT_NO_UNSHARE},
+        {"stats",              no_argument, 0, OPT_STATS},
         {0, 0, 0, 0}
     };
 
@@ -534,6 +555,9 @@ int daemon_main(int argc, char *argv[])
             no_unshare = true;
             break;
 
+        case OPT_STATS:
+            return daemon_stats_dump(stdout) ? EXIT_SUCCESS : EXIT_FAILURE;
+
         default:
             daemon_usage(1);
             return EXIT_FAILURE;
@@ -0,0 +1,739 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "daemon_bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+#include "mbutil/finally.h"
+#include "mbutil/integer.h"
+#include "mbutil/socket.h"
+#include "mbutil/string.h"
+
+// flatbuffers
+#include "protocol/request_generated.h"
+#include "protocol/response_generated.h"
+
+#define SOCKET_ADDRESS                  "mbtool.daemon"
+#define PROTOCOL_VERSION                3
+
+#define HANDSHAKE_RESPONSE_ALLOW        "ALLOW"
+#define HANDSHAKE_RESPONSE_OK           "OK"
+
+namespace mb
+{
+
+namespace v3 = mbtool::daemon::v3;
+namespace fb = flatbuffers;
+
+typedef std::chrono::steady_clock Clock;
+
+// Request types that can be part of the mix. FileSeek is not selectable; it is
+// only sent to rewind the file after a FileRead hits EOF.
+enum BenchOp
+{
+    OP_FILE_READ,
+    OP_FILE_STAT,
+    OP_DIRECTORY_SIZE,
+    OP_INSTALLED_ROMS,
+    OP_FILE_SEEK,
+    OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = {
+    "FileRead",
+    "FileStat",
+    "PathGetDirectorySize",
+    "MbGetInstalledRoms",
+    "FileSeek",
+};
+
+// Names accepted by --mix
+static const char *op_mix_names[OP_COUNT] = {
+    "read",
+    "stat",
+    "dirsize",
+    "roms",
+    nullptr,
+};
+
+struct BenchOptions
+{
+    unsigned int connections = 4;
+    unsigned int depth = 8;
+    unsigned int requests = 10000;
+    uint64_t read_size = 16384;
+    // Send request ID 0 so that the daemon processes every request in order
+    bool sequential = false;
+    std::string file = "/system/build.prop";
+    std::string directory = "/system/etc";
+    unsigned int weights[OP_COUNT] = { 4, 4, 1, 1, 0 };
+};
+
+struct ConnectionResult
+{
+    bool success = false;
+    // Latencies in microseconds, indexed by BenchOp
+    std::vector<uint64_t> latencies[OP_COUNT];
+    uint64_t failures[OP_COUNT] = {};
+    uint64_t response_bytes = 0;
+};
+
+static int connect_to_daemon()
+{
+    int fd = socket(AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        LOGE("Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    bool ret = false;
+
+    auto close_fd = util::finally([&]{
+        if (!ret) {
+            close(fd);
+        }
+    });
+
+    char abs_name[] = "\0" SOCKET_ADDRESS;
+    size_t abs_name_len = sizeof(abs_name) - 1;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_LOCAL;
+    memcpy(addr.sun_path, abs_name, abs_name_len);
+
+    // Calculate correct length so the trailing junk is not included in the
+    // abstract socket name
+    socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + abs_name_len;
+
+    if (connect(fd, (struct sockaddr *) &addr, addr_len) < 0) {
+        LOGE("Failed to connect to socket: %s", strerror(errno));
+        return -1;
+    }
+
+    std::string result;
+    if (!util::socket_read_string(fd, &result)) {
+        LOGE("Failed to receive authorization result: %s", strerror(errno));
+        return -1;
+    } else if (result != HANDSHAKE_RESPONSE_ALLOW) {
+        LOGE("Daemon denied authorization: %s", result.c_str());
+        LOGE("Is the daemon running with --allow-root-client?");
+        return -1;
+    }
+
+    if (!util::socket_write_int32(fd, PROTOCOL_VERSION)) {
+        LOGE("Failed to send interface version: %s", strerror(errno));
+        return -1;
+    }
+
+    if (!util::socket_read_string(fd, &result)) {
+        LOGE("Failed to receive interface request result: %s",
+             strerror(errno));
+        return -1;
+    } else if (result != HANDSHAKE_RESPONSE_OK) {
+        LOGE("Daemon does not support interface version %d: %s",
+             PROTOCOL_VERSION, result.c_str());
+        return -1;
+    }
+
+    ret = true;
+    return fd;
+}
+
+static bool send_request(int fd, fb::FlatBufferBuilder &builder,
+                         v3::RequestType type, fb::Offset<void> request,
+                         uint32_t request_id)
+{
+    v3::RequestBuilder rb(builder);
+    rb.add_request_type(type);
+    rb.add_request(request);
+    rb.add_request_id(request_id);
+    builder.Finish(rb.Finish());
+
+    if (!util::socket_write_bytes(
+            fd, builder.GetBufferPointer(), builder.GetSize())) {
+        LOGE("Failed to send request: %s", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static const v3::Response * read_response(util::SocketFramedReader &reader,
+                                          size_t *size)
+{
+    const uint8_t *data;
+
+    if (!reader.read(&data, size)) {
+        LOGE("Failed to read response: %s", strerror(errno));
+        return nullptr;
+    }
+
+    auto verifier = fb::Verifier(data, *size);
+    if (!v3::VerifyResponseBuffer(verifier)) {
+        LOGE("Received invalid buffer");
+        return nullptr;
+    }
+
+    return v3::GetResponse(data);
+}
+
+template<typename T>
+static const T * response_as(const v3::Response *response,
+                             v3::ResponseType type)
+{
+    if (response->response_type() != type) {
+        return nullptr;
+    }
+    return static_cast<const T *>(response->response());
+}
+
+// Open the benchmark file without pipelining so that its ID is known before
+// any load is generated
+static bool open_bench_file(int fd, util::SocketFramedReader &reader,
+                            const std::string &path, int32_t *id)
+{
+    fb::FlatBufferBuilder builder;
+    std::vector<int16_t> flags{ v3::FileOpenFlag_RDONLY };
+
+    auto request = v3::CreateFileOpenRequestDirect(
+            builder, path.c_str(), &flags, 0);
+
+    if (!send_request(fd, builder, v3::RequestType_FileOpenRequest,
+                      request.Union(), 0)) {
+        return false;
+    }
+
+    size_t size;
+    auto response = read_response(reader, &size);
+    if (!response) {
+        return false;
+    }
+
+    auto open_response = response_as<v3::FileOpenResponse>(
+            response, v3::ResponseType_FileOpenResponse);
+    if (!open_response) {
+        LOGE("Unexpected response type: %s",
+             v3::EnumNameResponseType(response->response_type()));
+        return false;
+    } else if (!open_response->success()) {
+        LOGE("%s: Failed to open: %s", path.c_str(),
+             open_response->error_msg()
+                     ? open_response->error_msg()->c_str() : "(unknown)");
+        return false;
+    }
+
+    *id = open_response->id();
+    return true;
+}
+
+class BenchConnection
+{
+public:
+    BenchConnection(const BenchOptions &opts, unsigned int index)
+        : _opts(opts)
+        , _gen(index + 1)
+        , _weight_dist(0, total_weight(opts) - 1)
+    {
+    }
+
+    void run(ConnectionResult *result)
+    {
+        _result = result;
+
+        _fd = connect_to_daemon();
+        if (_fd < 0) {
+            return;
+        }
+
+        auto close_fd = util::finally([&]{
+            close(_fd);
+        });
+
+        util::SocketFramedReader reader(_fd);
+
+        if (!open_bench_file(_fd, reader, _opts.file, &_file_id)) {
+            return;
+        }
+
+        unsigned int depth = _opts.sequential ? 1 : _opts.depth;
+        unsigned int sent = 0;
+
+        while (sent < _opts.requests || !_pending.empty()) {
+            while (sent < _opts.requests && _pending.size() < depth) {
+                BenchOp op = _rewind ? OP_FILE_SEEK : pick_op();
+                if (!send_op(op)) {
+                    return;
+                }
+                if (op == OP_FILE_SEEK) {
+                    _rewind = false;
+                } else {
+                    ++sent;
+                }
+            }
+
+            if (!receive_one(reader)) {
+                return;
+            }
+        }
+
+        _result->success = true;
+    }
+
+private:
+    struct Pending
+    {
+        BenchOp op;
+        Clock::time_point start;
+    };
+
+    static unsigned int total_weight(const BenchOptions &opts)
+    {
+        unsigned int total = 0;
+        for (unsigned int w : opts.weights) {
+            total += w;
+        }
+        return total;
+    }
+
+    BenchOp pick_op()
+    {
+        unsigned int n = _weight_dist(_gen);
+        for (int op = 0; op < OP_COUNT; ++op) {
+            if (n < _opts.weights[op]) {
+                return static_cast<BenchOp>(op);
+            }
+            n -= _opts.weights[op];
+        }
+        return OP_FILE_READ;
+    }
+
+    bool send_op(BenchOp op)
+    {
+        _builder.Clear();
+
+        v3::RequestType type;
+        fb::Offset<void> request;
+
+        switch (op) {
+        case OP_FILE_READ:
+            type = v3::RequestType_FileReadRequest;
+            request = v3::CreateFileReadRequest(
+                    _builder, _file_id, _opts.read_size).Union();
+            break;
+        case OP_FILE_STAT:
+            type = v3::RequestType_FileStatRequest;
+            request = v3::CreateFileStatRequest(_builder, _file_id).Union();
+            break;
+        case OP_DIRECTORY_SIZE:
+            type = v3::RequestType_PathGetDirectorySizeRequest;
+            request = v3::CreatePathGetDirectorySizeRequestDirect(
+                    _builder, _opts.directory.c_str()).Union();
+            break;
+        case OP_INSTALLED_ROMS:
+            type = v3::RequestType_MbGetInstalledRomsRequest;
+            request = v3::CreateMbGetInstalledRomsRequest(_builder).Union();
+            break;
+        case OP_FILE_SEEK:
+            type = v3::RequestType_FileSeekRequest;
+            request = v3::CreateFileSeekRequest(
+                    _builder, _file_id, 0, v3::FileSeekWhence_SEEK_SET)
+                    .Union();
+            break;
+        default:
+            return false;
+        }
+
+        uint32_t id = 0;
+        if (!_opts.sequential) {
+            id = _next_id++;
+            if (_next_id == 0) {
+                // 0 means that the request is not pipelined
+                _next_id = 1;
+            }
+        }
+
+        _pending[id] = { op, Clock::now() };
+
+        return send_request(_fd, _builder, type, request, id);
+    }
+
+    bool receive_one(util::SocketFramedReader &reader)
+    {
+        size_t size;
+        auto response = read_response(reader, &size);
+        if (!response) {
+            return false;
+        }
+
+        auto now = Clock::now();
+
+        auto it = _pending.find(response->request_id());
+        if (it == _pending.end()) {
+            LOGE("Received response for unknown request ID: %u",
+                 response->request_id());
+            return false;
+        }
+
+        Pending pending = it->second;
+        _pending.erase(it);
+
+        _result->latencies[pending.op].push_back(static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                        now - pending.start).count()));
+        _result->response_bytes += size;
+
+        if (!check_response(pending.op, response)) {
+            ++_result->failures[pending.op];
+        }
+
+        return true;
+    }
+
+    bool check_response(BenchOp op, const v3::Response *response)
+    {
+        switch (op) {
+        case OP_FILE_READ: {
+            auto r = response_as<v3::FileReadResponse>(
+                    response, v3::ResponseType_FileReadResponse);
+            if (!r || !r->success()) {
+                return false;
+            }
+            // Rewind once the benchmark file has been read completely. Reads
+            // that were already queued behind the one that hit EOF also
+            // return no data, so only one seek is sent for them.
+            if (r->bytes_read() == 0 && !_seek_pending) {
+                _rewind = true;
+                _seek_pending = true;
+            }
+            return true;
+        }
+        case OP_FILE_STAT: {
+            auto r = response_as<v3::FileStatResponse>(
+                    response, v3::ResponseType_FileStatResponse);
+            return r && r->success();
+        }
+        case OP_DIRECTORY_SIZE: {
+            auto r = response_as<v3::PathGetDirectorySizeResponse>(
+                    response, v3::ResponseType_PathGetDirectorySizeResponse);
+            return r && r->success();
+        }
+        case OP_INSTALLED_ROMS:
+            return response_as<v3::MbGetInstalledRomsResponse>(
+                    response, v3::ResponseType_MbGetInstalledRomsResponse)
+                    != nullptr;
+        case OP_FILE_SEEK: {
+            _seek_pending = false;
+            auto r = response_as<v3::FileSeekResponse>(
+                    response, v3::ResponseType_FileSeekResponse);
+            return r && r->success();
+        }
+        default:
+            return false;
+        }
+    }
+
+    const BenchOptions &_opts;
+    std::mt19937 _gen;
+    std::uniform_int_distribution<unsigned int> _weight_dist;
+    ConnectionResult *_result = nullptr;
+    fb::FlatBufferBuilder _builder;
+    int _fd = -1;
+    int32_t _file_id = -1;
+    uint32_t _next_id = 1;
+    bool _rewind = false;
+    bool _seek_pending = false;
+    std::unordered_map<uint32_t, Pending> _pending;
+};
+
+static uint64_t percentile(const std::vector<uint64_t> &sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+static void print_results(const BenchOptions &opts,
+                          std::vector<ConnectionResult> &results,
+                          double elapsed_s)
+{
+    uint64_t total_requests = 0;
+    uint64_t total_failures = 0;
+    uint64_t total_bytes = 0;
+
+    printf("Connections: %u, depth: %u, requests per connection: %u%s\n\n",
+           opts.connections, opts.sequential ? 1 : opts.depth, opts.requests,
+           opts.sequential ? " (sequential)" : "");
+    printf("%-22s %9s %8s %10s %10s %10s %10s %10s\n",
+           "Request", "Count", "Failed", "Req/s", "p50 (us)", "p90 (us)",
+           "p99 (us)", "Max (us)");
+
+    for (int op = 0; op < OP_COUNT; ++op) {
+        std::vector<uint64_t> latencies;
+        uint64_t failures = 0;
+
+        for (auto &r : results) {
+            latencies.insert(latencies.end(), r.latencies[op].begin(),
+                             r.latencies[op].end());
+            failures += r.failures[op];
+        }
+
+        if (latencies.empty()) {
+            continue;
+        }
+
+        std::sort(latencies.begin(), latencies.end());
+
+        printf("%-22s %9zu %8" PRIu64 " %10.0f %10" PRIu64 " %10" PRIu64
+               " %10" PRIu64 " %10" PRIu64 "\n",
+               op_names[op], latencies.size(), failures,
+               latencies.size() / elapsed_s,
+               percentile(latencies, 0.5), percentile(latencies, 0.9),
+               percentile(latencies, 0.99), latencies.back());
+
+        total_requests += latencies.size();
+        total_failures += failures;
+    }
+
+    for (auto &r : results) {
+        total_bytes += r.response_bytes;
+    }
+
+    printf("\nTotal: %" PRIu64 " requests (%" PRIu64 " failed) in %.3f s:"
+           " %.0f req/s, %.2f MiB/s of responses\n",
+           total_requests, total_failures, elapsed_s,
+           total_requests / elapsed_s,
+           total_bytes / elapsed_s / 1024 / 1024);
+}
+
+static bool parse_mix(const char *str, unsigned int weights[OP_COUNT])
+{
+    unsigned int new_weights[OP_COUNT] = {};
+    unsigned int total = 0;
+
+    for (auto const &item : util::split(str, ",")) {
+        auto pos = item.find('=');
+        if (pos == std::string::npos) {
+            return false;
+        }
+
+        std::string name = item.substr(0, pos);
+        unsigned int weight;
+        if (!util::str_to_unum(item.c_str() + pos + 1, 10, &weight)) {
+            return false;
+        }
+
+        int op;
+        for (op = 0; op < OP_COUNT; ++op) {
+            if (op_mix_names[op] && name == op_mix_names[op]) {
+                break;
+            }
+        }
+        if (op == OP_COUNT) {
+            return false;
+        }
+
+        new_weights[op] = weight;
+        total += weight;
+    }
+
+    if (total == 0) {
+        return false;
+    }
+
+    std::copy(std::begin(new_weights), std::end(new_weights), weights);
+    return true;
+}
+
+static void daemon_bench_usage(bool error)
+{
+    FILE *stream = error ? stderr : stdout;
+
+    fprintf(stream,
+            "Usage: daemon-bench [OPTION...]\n"
+            "\n"
+            "Options:\n"
+            "  -c, --connections <n>\n"
+            "                   Number of concurrent connections (default: 4)\n"
+            "  -d, --depth <n>  Requests in flight per connection (default: 8)\n"
+            "  -n, --requests <n>\n"
+            "                   Requests per connection (default: 10000)\n"
+            "  -m, --mix <mix>  Weighted request mix\n"
+            "                   (default: read=4,stat=4,dirsize=1,roms=1)\n"
+            "  --file <path>    File for FileRead and FileStat requests\n"
+            "                   (default: /system/build.prop)\n"
+            "  --directory <path>\n"
+            "                   Directory for PathGetDirectorySize requests\n"
+            "                   (default: /system/etc)\n"
+            "  --read-size <bytes>\n"
+            "                   FileRead request size (default: 16384)\n"
+            "  --sequential     Send requests without request IDs so that the\n"
+            "                   daemon processes them in order (implies -d 1)\n"
+            "  -h, --help       Display this help message\n"
+            "\n"
+            "This tool generates load against a running mbtool daemon using\n"
+            "the v3 protocol and reports the latency percentiles and throughput\n"
+            "of each request type. The daemon only accepts connections from\n"
+            "root if it was started with --allow-root-client.\n");
+}
+
+int daemon_bench_main(int argc, char *argv[])
+{
+    BenchOptions opts;
+    int opt;
+
+    enum : int
+    {
+        OPT_FILE       = 1000,
+        OPT_DIRECTORY  = 1001,
+        OPT_READ_SIZE  = 1002,
+        OPT_SEQUENTIAL = 1003,
+    };
+
+    static struct option long_options[] = {
+        {"connections", required_argument, 0, 'c'},
+        {"depth",       required_argument, 0, 'd'},
+        {"requests",    required_argument, 0, 'n'},
+        {"mix",         required_argument, 0, 'm'},
+        {"file",        required_argument, 0, OPT_FILE},
+        {"directory",   required_argument, 0, OPT_DIRECTORY},
+        {"read-size",   required_argument, 0, OPT_READ_SIZE},
+        {"sequential",  no_argument,       0, OPT_SEQUENTIAL},
+        {"help",        no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, "c:d:n:m:h", long_options,
+                              &long_index)) != -1) {
+        switch (opt) {
+        case 'c':
+            if (!util::str_to_unum(optarg, 10, &opts.connections)
+                    || opts.connections == 0) {
+                fprintf(stderr, "Invalid connection count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'd':
+            if (!util::str_to_unum(optarg, 10, &opts.depth)
+                    || opts.depth == 0) {
+                fprintf(stderr, "Invalid depth: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            if (!util::str_to_unum(optarg, 10, &opts.requests)) {
+                fprintf(stderr, "Invalid request count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'm':
+            if (!parse_mix(optarg, opts.weights)) {
+                fprintf(stderr, "Invalid request mix: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_FILE:
+            opts.file = optarg;
+            break;
+        case OPT_DIRECTORY:
+            opts.directory = optarg;
+            break;
+        case OPT_READ_SIZE:
+            if (!util::str_to_unum(optarg, 10, &opts.read_size)
+                    || opts.read_size == 0) {
+                fprintf(stderr, "Invalid read size: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_SEQUENTIAL:
+            opts.sequential = true;
+            break;
+        case 'h':
+            daemon_bench_usage(false);
+            return EXIT_SUCCESS;
+        default:
+            daemon_bench_usage(true);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // There should be no other arguments
+    if (argc - optind != 0) {
+        daemon_bench_usage(true);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<ConnectionResult> results(opts.connections);
+    std::vector<std::thread> threads;
+
+    auto start = Clock::now();
+
+    for (unsigned int i = 0; i < opts.connections; ++i) {
+        threads.emplace_back([&opts, &results, i]{
+            BenchConnection(opts, i).run(&results[i]);
+        });
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    double elapsed_s = std::chrono::duration<double>(
+            Clock::now() - start).count();
+
+    bool ret = true;
+    for (auto const &r : results) {
+        if (!r.success) {
+            ret = false;
+        }
+    }
+
+    if (!ret) {
+        fprintf(stderr, "One or more connections failed\n");
+    }
+
+    print_results(opts, results, elapsed_s);
+
+    return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+}
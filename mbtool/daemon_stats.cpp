@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "daemon_stats.h"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+
+// flatbuffers
+#include "protocol/request_generated.h"
+
+namespace mb
+{
+
+namespace v3 = mbtool::daemon::v3;
+
+// Mapped (MAP_SHARED) before the daemon starts accepting connections, so the
+// per-connection processes update the same counters
+static DaemonStats *g_stats = nullptr;
+
+/*!
+ * \brief Create the shared statistics block
+ *
+ * The counters are plain relaxed atomics in a shared mapping, so recording a
+ * request never takes a lock or makes a syscall. If the file cannot be
+ * created, statistics are simply not recorded.
+ */
+bool daemon_stats_init()
+{
+    int fd = open(DAEMON_STATS_PATH, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0600);
+    if (fd < 0) {
+        LOGW("%s: Failed to open: %s", DAEMON_STATS_PATH, strerror(errno));
+        return false;
+    }
+
+    if (ftruncate(fd, sizeof(DaemonStats)) < 0) {
+        LOGW("%s: Failed to truncate: %s", DAEMON_STATS_PATH, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    void *ptr = mmap(nullptr, sizeof(DaemonStats), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (ptr == MAP_FAILED) {
+        LOGW("%s: Failed to mmap: %s", DAEMON_STATS_PATH, strerror(errno));
+        return false;
+    }
+
+    // The file is zero-filled, which is a valid initial state for the counters
+    g_stats = static_cast<DaemonStats *>(ptr);
+    g_stats->magic = DAEMON_STATS_MAGIC;
+    g_stats->version = DAEMON_STATS_VERSION;
+
+    return true;
+}
+
+DaemonStats * daemon_stats()
+{
+    return g_stats;
+}
+
+void daemon_stats_add_connection()
+{
+    if (g_stats) {
+        g_stats->connections.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+static unsigned int latency_bucket(uint64_t latency_us)
+{
+    unsigned int bucket = 0;
+    while (bucket < DAEMON_STATS_LATENCY_BUCKETS - 1
+            && latency_us >= (UINT64_C(1) << bucket)) {
+        ++bucket;
+    }
+    return bucket;
+}
+
+void daemon_stats_record(unsigned int type, uint64_t latency_us,
+                         uint64_t bytes_in, uint64_t bytes_out)
+{
+    if (!g_stats || type >= DAEMON_STATS_MAX_TYPES) {
+        return;
+    }
+
+    DaemonRequestStats &s = g_stats->types[type];
+
+    s.count.fetch_add(1, std::memory_order_relaxed);
+    s.total_latency_us.fetch_add(latency_us, std::memory_order_relaxed);
+    s.bytes_in.fetch_add(bytes_in, std::memory_order_relaxed);
+    s.bytes_out.fetch_add(bytes_out, std::memory_order_relaxed);
+    s.latency_buckets[latency_bucket(latency_us)].fetch_add(
+            1, std::memory_order_relaxed);
+
+    uint64_t max = s.max_latency_us.load(std::memory_order_relaxed);
+    while (latency_us > max && !s.max_latency_us.compare_exchange_weak(
+            max, latency_us, std::memory_order_relaxed)) {
+    }
+}
+
+/*!
+ * \brief Print the statistics of the running daemon
+ */
+bool daemon_stats_dump(FILE *fp)
+{
+    int fd = open(DAEMON_STATS_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "%s: Failed to open: %s\n",
+                DAEMON_STATS_PATH, strerror(errno));
+        return false;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || sb.st_size < (off_t) sizeof(DaemonStats)) {
+        fprintf(stderr, "%s: Invalid statistics file\n", DAEMON_STATS_PATH);
+        close(fd);
+        return false;
+    }
+
+    void *ptr = mmap(nullptr, sizeof(DaemonStats), PROT_READ, MAP_SHARED,
+                     fd, 0);
+    close(fd);
+
+    if (ptr == MAP_FAILED) {
+        fprintf(stderr, "%s: Failed to mmap: %s\n",
+                DAEMON_STATS_PATH, strerror(errno));
+        return false;
+    }
+
+    auto *stats = static_cast<const DaemonStats *>(ptr);
+
+    if (stats->magic != DAEMON_STATS_MAGIC
+            || stats->version != DAEMON_STATS_VERSION) {
+        fprintf(stderr, "%s: Unsupported statistics version\n",
+                DAEMON_STATS_PATH);
+        munmap(ptr, sizeof(DaemonStats));
+        return false;
+    }
+
+    fprintf(fp, "Connections: %" PRIu64 "\n\n", stats->connections.load());
+    fprintf(fp, "%-30s %10s %12s %12s %12s %12s\n", "Request", "Count",
+            "Avg (us)", "Max (us)", "Bytes in", "Bytes out");
+
+    for (unsigned int type = 0; type < DAEMON_STATS_MAX_TYPES; ++type) {
+        const DaemonRequestStats &s = stats->types[type];
+        uint64_t count = s.count.load();
+        if (count == 0) {
+            continue;
+        }
+
+        const char *name = nullptr;
+        if (type <= v3::RequestType_MAX) {
+            name = v3::EnumNameRequestType(
+                    static_cast<v3::RequestType>(type));
+        }
+
+        char unknown[32];
+        if (!name) {
+            snprintf(unknown, sizeof(unknown), "Unknown (%u)", type);
+            name = unknown;
+        }
+
+        fprintf(fp, "%-30s %10" PRIu64 " %12" PRIu64 " %12" PRIu64
+                " %12" PRIu64 " %12" PRIu64 "\n",
+                name, count, s.total_latency_us.load() / count,
+                s.max_latency_us.load(), s.bytes_in.load(),
+                s.bytes_out.load());
+
+        fprintf(fp, "    Latency histogram:");
+        for (unsigned int i = 0; i < DAEMON_STATS_LATENCY_BUCKETS; ++i) {
+            uint64_t n = s.latency_buckets[i].load();
+            if (n == 0) {
+                continue;
+            }
+            if (i == DAEMON_STATS_LATENCY_BUCKETS - 1) {
+                fprintf(fp, " >=%" PRIu64 "us:%" PRIu64,
+                        UINT64_C(1) << (i - 1), n);
+            } else {
+                fprintf(fp, " <%" PRIu64 "us:%" PRIu64,
+                        UINT64_C(1) << i, n);
+            }
+        }
+        fprintf(fp, "\n");
+    }
+
+    munmap(ptr, sizeof(DaemonStats));
+    return true;
+}
+
+}
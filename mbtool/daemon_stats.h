@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <atomic>
+
+#include <cstdint>
+#include <cstdio>
+
+// Shared with the per-connection processes and `mbtool daemon --stats`
+#define DAEMON_STATS_PATH               "/dev/.mbtool_daemon_stats"
+
+#define DAEMON_STATS_MAGIC              0x5354424d
+#define DAEMON_STATS_VERSION            1
+
+// Number of request types that can be tracked (indexed by v3::RequestType)
+#define DAEMON_STATS_MAX_TYPES          64
+// Bucket n counts requests that took less than 2^n microseconds (and at least
+// 2^(n-1) microseconds). The last bucket counts everything slower.
+#define DAEMON_STATS_LATENCY_BUCKETS    24
+
+namespace mb
+{
+
+struct DaemonRequestStats
+{
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> total_latency_us;
+    std::atomic<uint64_t> max_latency_us;
+    std::atomic<uint64_t> bytes_in;
+    std::atomic<uint64_t> bytes_out;
+    std::atomic<uint64_t> latency_buckets[DAEMON_STATS_LATENCY_BUCKETS];
+};
+
+struct DaemonStats
+{
+    uint32_t magic;
+    uint32_t version;
+    std::atomic<uint64_t> connections;
+    DaemonRequestStats types[DAEMON_STATS_MAX_TYPES];
+};
+
+bool daemon_stats_init();
+DaemonStats * daemon_stats();
+void daemon_stats_add_connection();
+void daemon_stats_record(unsigned int type, uint64_t latency_us,
+                         uint64_t bytes_in, uint64_t bytes_out);
+bool daemon_stats_dump(FILE *fp);
+
+}
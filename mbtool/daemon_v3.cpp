@@ -19,16 +19,28 @@
 
 #include "daemon_v3.h"
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 
+#include <dirent.h>
 #include <fcntl.h>
+#include <sys/inotify.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "mbcommon/string.h"
+#include "mbcommon/thread_pool.h"
 #include "mbcommon/version.h"
 #include "mblog/logging.h"
 #include "mbutil/command.h"
@@ -36,13 +48,15 @@
 #include "mbutil/delete.h"
 #include "mbutil/directory.h"
 #include "mbutil/finally.h"
-#include "mbutil/fts.h"
+#include "mbutil/hash.h"
 #include "mbutil/path.h"
 #include "mbutil/properties.h"
+#include "mbutil/sched_policy.h"
 #include "mbutil/selinux.h"
 #include "mbutil/socket.h"
 #include "mbutil/string.h"
 
+#include "daemon_stats.h"
 #include "init.h"
 #include "packages.h"
 #include "reboot.h"
@@ -61,38 +75,88 @@ namespace mb
 namespace v3 = mbtool::daemon::v3;
 namespace fb = flatbuffers;
 
+// Number of threads used for processing fast requests with a non-zero
+// request ID
+#define V3_MAX_WORKERS          4
+// Number of threads used for processing slow requests with a non-zero
+// request ID
+#define V3_MAX_SLOW_WORKERS     1
+
+// File descriptors opened by FileOpenRequest. Only accessed from the
+// connection's main thread (File* requests are never run concurrently).
 static std::unordered_map<int, int> fd_map;
 static int fd_count = 0;
 
+// Serializes writes to the socket when responses are sent from multiple
+// threads
+static std::mutex write_lock;
+
+// Number of bytes sent for the request currently being processed by this
+// thread (for statistics)
+static thread_local uint64_t response_bytes = 0;
+
 static bool v3_send_response(int fd, const fb::FlatBufferBuilder &builder)
 {
+    response_bytes += builder.GetSize();
+
+    std::lock_guard<std::mutex> lock(write_lock);
+
     return util::socket_write_bytes(
             fd, builder.GetBufferPointer(), builder.GetSize());
 }
 
-static bool v3_send_response_invalid(int fd)
+static bool v3_send_response_invalid(int fd, const v3::Request *msg)
 {
     fb::FlatBufferBuilder builder;
     auto response = v3::CreateResponse(builder, v3::ResponseType_Invalid,
-                                       v3::CreateInvalid(builder).Union());
+                                       v3::CreateInvalid(builder).Union(),
+                                       msg->request_id());
     builder.Finish(response);
     return v3_send_response(fd, builder);
 }
 
-static bool v3_send_response_unsupported(int fd)
+static bool v3_send_response_unsupported(int fd, const v3::Request *msg)
 {
     fb::FlatBufferBuilder builder;
     auto response = v3::CreateResponse(builder, v3::ResponseType_Unsupported,
-                                       v3::CreateUnsupported(builder).Union());
+                                       v3::CreateUnsupported(builder).Union(),
+                                       msg->request_id());
     builder.Finish(response);
     return v3_send_response(fd, builder);
 }
 
+static int v3_open_flags(const fb::Vector<int16_t> *open_flags)
+{
+    int flags = O_CLOEXEC;
+
+    if (open_flags) {
+        for (short openflag : *open_flags) {
+            if (openflag == v3::FileOpenFlag_APPEND) {
+                flags |= O_APPEND;
+            } else if (openflag == v3::FileOpenFlag_CREAT) {
+                flags |= O_CREAT;
+            } else if (openflag == v3::FileOpenFlag_EXCL) {
+                flags |= O_EXCL;
+            } else if (openflag == v3::FileOpenFlag_RDONLY) {
+                flags |= O_RDONLY;
+            } else if (openflag == v3::FileOpenFlag_RDWR) {
+                flags |= O_RDWR;
+            } else if (openflag == v3::FileOpenFlag_TRUNC) {
+                flags |= O_TRUNC;
+            } else if (openflag == v3::FileOpenFlag_WRONLY) {
+                flags |= O_WRONLY;
+            }
+        }
+    }
+
+    return flags;
+}
+
 static bool v3_file_chmod(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::FileChmodRequest *>(msg->request());
     if (fd_map.find(request->id()) == fd_map.end()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     int ffd = fd_map[request->id()];
@@ -101,7 +165,7 @@ static bool v3_file_chmod(int fd, const v3::Request *msg)
     uint32_t mode = request->mode();
     uint32_t masked = mode & (S_IRWXU | S_IRWXG | S_IRWXO);
     if (masked != mode) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     fb::FlatBufferBuilder builder;
@@ -120,7 +184,8 @@ static bool v3_file_chmod(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_FileChmodResponse, response.Union()));
+            builder, v3::ResponseType_FileChmodResponse, response.Union(),
+            msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
@@ -130,7 +195,7 @@ static bool v3_file_close(int fd, const v3::Request *msg)
     auto request = static_cast<const v3::FileCloseRequest *>(msg->request());
     auto it = fd_map.find(request->id());
     if (it == fd_map.end()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     // Remove ID from map
@@ -153,40 +218,149 @@ static bool v3_file_close(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_FileCloseResponse, response.Union()));
+            builder, v3::ResponseType_FileCloseResponse, response.Union(),
+            msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
 
-static bool v3_file_open(int fd, const v3::Request *msg)
+static bool v3_file_copy_range(int fd, const v3::Request *msg)
 {
-    auto request = static_cast<const v3::FileOpenRequest *>(msg->request());
-    if (!request->path()) {
-        return v3_send_response_invalid(fd);
+    auto request = static_cast<const v3::FileCopyRangeRequest *>(
+            msg->request());
+    auto source = fd_map.find(request->source_id());
+    auto target = fd_map.find(request->target_id());
+    if (source == fd_map.end() || target == fd_map.end()
+            || source == target) {
+        return v3_send_response_invalid(fd, msg);
     }
 
-    int flags = O_CLOEXEC;
+    int source_fd = source->second;
+    int target_fd = target->second;
 
-    if (request->flags()) {
-        for (short openflag : *request->flags()) {
-            if (openflag == v3::FileOpenFlag_APPEND) {
-                flags |= O_APPEND;
-            } else if (openflag == v3::FileOpenFlag_CREAT) {
-                flags |= O_CREAT;
-            } else if (openflag == v3::FileOpenFlag_EXCL) {
-                flags |= O_EXCL;
-            } else if (openflag == v3::FileOpenFlag_RDONLY) {
-                flags |= O_RDONLY;
-            } else if (openflag == v3::FileOpenFlag_RDWR) {
-                flags |= O_RDWR;
-            } else if (openflag == v3::FileOpenFlag_TRUNC) {
-                flags |= O_TRUNC;
-            } else if (openflag == v3::FileOpenFlag_WRONLY) {
-                flags |= O_WRONLY;
-            }
+    fb::FlatBufferBuilder builder;
+    fb::Offset<v3::FileCopyRangeError> error;
+
+    // Negative offsets refer to the current file offsets. The target's file
+    // offset is saved either way because the copy may move it.
+    off64_t source_pos = lseek64(source_fd, 0, SEEK_CUR);
+    off64_t target_pos = source_pos < 0 ? -1 : lseek64(target_fd, 0, SEEK_CUR);
+    uint64_t copied = 0;
+    bool ret = false;
+
+    if (target_pos >= 0) {
+        off64_t source_offset = request->source_offset() < 0
+                ? source_pos : request->source_offset();
+        off64_t target_offset = request->target_offset() < 0
+                ? target_pos : request->target_offset();
+
+        ret = util::copy_data_fd_range(
+                source_fd, static_cast<uint64_t>(source_offset),
+                target_fd, static_cast<uint64_t>(target_offset),
+                request->count(), copied);
+    }
+    int saved_errno = errno;
+
+    if (target_pos >= 0) {
+        if (request->source_offset() < 0) {
+            lseek64(source_fd, source_pos + static_cast<off64_t>(copied),
+                    SEEK_SET);
         }
+        lseek64(target_fd, request->target_offset() < 0
+                ? target_pos + static_cast<off64_t>(copied) : target_pos,
+                SEEK_SET);
+    }
+
+    if (!ret) {
+        error = v3::CreateFileCopyRangeErrorDirect(
+                builder, saved_errno, strerror(saved_errno));
     }
 
+    auto response = v3::CreateFileCopyRangeResponse(builder, copied, error);
+
+    // Wrap response
+    builder.Finish(v3::CreateResponse(
+            builder, v3::ResponseType_FileCopyRangeResponse,
+            response.Union(), msg->request_id()));
+
+    return v3_send_response(fd, builder);
+}
+
+static bool v3_file_hash(int fd, const v3::Request *msg)
+{
+    auto request = static_cast<const v3::FileHashRequest *>(msg->request());
+
+    util::HashAlgorithm algorithm;
+    switch (request->algorithm()) {
+    case v3::FileHashAlgorithm_SHA256:
+        algorithm = util::HashAlgorithm::Sha256;
+        break;
+    case v3::FileHashAlgorithm_SHA512:
+        algorithm = util::HashAlgorithm::Sha512;
+        break;
+    default:
+        return v3_send_response_invalid(fd, msg);
+    }
+
+    int hfd;
+
+    if (request->path()) {
+        hfd = open(request->path()->c_str(), O_RDONLY | O_CLOEXEC);
+    } else {
+        auto it = fd_map.find(request->id());
+        if (it == fd_map.end()) {
+            return v3_send_response_invalid(fd, msg);
+        }
+        hfd = it->second;
+    }
+
+    auto close_hfd = util::finally([&]{
+        if (request->path() && hfd >= 0) {
+            close(hfd);
+        }
+    });
+
+    fb::FlatBufferBuilder builder;
+    fb::Offset<v3::FileHashError> error;
+    fb::Offset<fb::Vector<unsigned char>> digest;
+
+    // A count of 0 means the rest of the file
+    uint64_t count = request->count() == 0
+            ? static_cast<uint64_t>(-1) : request->count();
+    std::vector<unsigned char> result;
+    uint64_t hashed = 0;
+
+    bool ret = hfd >= 0 && util::hash_fd_range(
+            hfd, algorithm, request->offset(), count, result, hashed);
+    int saved_errno = errno;
+
+    if (ret) {
+        digest = builder.CreateVector(result);
+    } else {
+        error = v3::CreateFileHashErrorDirect(
+                builder, saved_errno, strerror(saved_errno));
+    }
+
+    auto response = v3::CreateFileHashResponse(
+            builder, digest, hashed, error);
+
+    // Wrap response
+    builder.Finish(v3::CreateResponse(
+            builder, v3::ResponseType_FileHashResponse, response.Union(),
+            msg->request_id()));
+
+    return v3_send_response(fd, builder);
+}
+
+static bool v3_file_open(int fd, const v3::Request *msg)
+{
+    auto request = static_cast<const v3::FileOpenRequest *>(msg->request());
+    if (!request->path()) {
+        return v3_send_response_invalid(fd, msg);
+    }
+
+    int flags = v3_open_flags(request->flags());
+
     fb::FlatBufferBuilder builder;
     fb::Offset<v3::FileOpenError> error;
     int id = -1;
@@ -209,28 +383,93 @@ static bool v3_file_open(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_FileOpenResponse, response.Union()));
+            builder, v3::ResponseType_FileOpenResponse, response.Union(),
+            msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
 
+static bool v3_file_open_fd(int fd, const v3::Request *msg)
+{
+    auto request = static_cast<const v3::FileOpenFdRequest *>(msg->request());
+    if (!request->path()) {
+        return v3_send_response_invalid(fd, msg);
+    }
+
+    int flags = v3_open_flags(request->flags());
+
+    fb::FlatBufferBuilder builder;
+    fb::Offset<v3::FileOpenFdError> error;
+
+    int ffd = open(request->path()->c_str(), flags, request->perms());
+    int saved_errno = errno;
+
+    auto close_ffd = util::finally([&]{
+        if (ffd >= 0) {
+            close(ffd);
+        }
+    });
+
+    if (ffd < 0) {
+        error = v3::CreateFileOpenFdErrorDirect(
+                builder, saved_errno, strerror(saved_errno));
+    }
+
+    auto response = v3::CreateFileOpenFdResponse(builder, error);
+
+    // Wrap response
+    builder.Finish(v3::CreateResponse(
+            builder, v3::ResponseType_FileOpenFdResponse, response.Union(),
+            msg->request_id()));
+
+    response_bytes += builder.GetSize();
+
+    // The fd must immediately follow its response, so don't let another
+    // thread write in between
+    std::lock_guard<std::mutex> lock(write_lock);
+
+    if (!util::socket_write_bytes(
+            fd, builder.GetBufferPointer(), builder.GetSize())) {
+        return false;
+    }
+
+    // Our copy of the fd is closed once it has been sent. The client becomes
+    // responsible for the file and no FileCloseRequest is needed.
+    return ffd < 0 || util::socket_send_fds(fd, { ffd });
+}
+
+// Maximum number of bytes returned by a single FileReadRequest. Clients must
+// already handle short reads, so larger requests are simply truncated. This
+// bounds the size of the reused buffers below.
+#define V3_MAX_FILE_READ_SIZE   (1024 * 1024)
+
 static bool v3_file_read(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::FileReadRequest *>(msg->request());
     auto it = fd_map.find(request->id());
     if (it == fd_map.end()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     int ffd = it->second;
 
-    std::vector<unsigned char> buf(request->count());
+    // Reuse the read buffer and builder across requests. Clients read files
+    // in many small chunks, so this avoids allocating (and zeroing) two
+    // buffers for every chunk.
+    static std::vector<unsigned char> buf;
+    static fb::FlatBufferBuilder builder;
+
+    size_t count = std::min<uint64_t>(request->count(), V3_MAX_FILE_READ_SIZE);
+
+    if (buf.size() < count) {
+        buf.resize(count);
+    }
+    builder.Clear();
 
-    fb::FlatBufferBuilder builder;
     fb::Offset<v3::FileReadError> error;
     fb::Offset<fb::Vector<unsigned char>> data;
 
-    ssize_t ret = read(ffd, buf.data(), buf.size());
+    ssize_t ret = read(ffd, buf.data(), count);
     int saved_errno = errno;
 
     if (ret >= 0) {
@@ -247,7 +486,8 @@ static bool v3_file_read(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_FileReadResponse, response.Union()));
+            builder, v3::ResponseType_FileReadResponse, response.Union(),
+            msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
@@ -257,7 +497,7 @@ static bool v3_file_seek(int fd, const v3::Request *msg)
     auto request = static_cast<const v3::FileSeekRequest *>(msg->request());
     auto it = fd_map.find(request->id());
     if (it == fd_map.end()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     int ffd = it->second;
@@ -271,7 +511,7 @@ static bool v3_file_seek(int fd, const v3::Request *msg)
     } else if (request->whence() == v3::FileSeekWhence_SEEK_END) {
         whence = SEEK_END;
     } else {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     fb::FlatBufferBuilder builder;
@@ -294,7 +534,8 @@ static bool v3_file_seek(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_FileSeekResponse, response.Union()));
+            builder, v3::ResponseType_FileSeekResponse, response.Union(),
+            msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
@@ -305,7 +546,7 @@ static bool v3_file_selinux_get_label(int fd, const v3::Request *msg)
             msg->request());
     auto it = fd_map.find(request->id());
     if (it == fd_map.end()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     int ffd = it->second;
@@ -329,7 +570,7 @@ static bool v3_file_selinux_get_label(int fd, const v3::Request *msg)
     // Wrap response
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_PathSELinuxGetLabelResponse,
-            response.Union()));
+            response.Union(), msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
@@ -340,7 +581,7 @@ static bool v3_file_selinux_set_label(int fd, const v3::Request *msg)
             msg->request());
     auto it = fd_map.find(request->id());
     if (it == fd_map.end() || !request->label()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     int ffd = it->second;
@@ -362,17 +603,37 @@ static bool v3_file_selinux_set_label(int fd, const v3::Request *msg)
     // Wrap response
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_FileSELinuxSetLabelResponse,
-            response.Union()));
+            response.Union(), msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
 
+static fb::Offset<v3::StructStat>
+v3_create_struct_stat(fb::FlatBufferBuilder &builder, const struct stat &sb)
+{
+    v3::StructStatBuilder ssb(builder);
+    ssb.add_dev(sb.st_dev);
+    ssb.add_ino(sb.st_ino);
+    ssb.add_mode(sb.st_mode);
+    ssb.add_nlink(sb.st_nlink);
+    ssb.add_uid(sb.st_uid);
+    ssb.add_gid(sb.st_gid);
+    ssb.add_rdev(sb.st_rdev);
+    ssb.add_size(sb.st_size);
+    ssb.add_blksize(sb.st_blksize);
+    ssb.add_blocks(sb.st_blocks);
+    ssb.add_atime(sb.st_atime);
+    ssb.add_mtime(sb.st_mtime);
+    ssb.add_ctime(sb.st_ctime);
+    return ssb.Finish();
+}
+
 static bool v3_file_stat(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::FileStatRequest *>(msg->request());
     auto it = fd_map.find(request->id());
     if (it == fd_map.end()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     int ffd = it->second;
@@ -386,21 +647,7 @@ static bool v3_file_stat(int fd, const v3::Request *msg)
     int saved_errno = errno;
 
     if (ret) {
-        v3::StructStatBuilder ssb(builder);
-        ssb.add_dev(sb.st_dev);
-        ssb.add_ino(sb.st_ino);
-        ssb.add_mode(sb.st_mode);
-        ssb.add_nlink(sb.st_nlink);
-        ssb.add_uid(sb.st_uid);
-        ssb.add_gid(sb.st_gid);
-        ssb.add_rdev(sb.st_rdev);
-        ssb.add_size(sb.st_size);
-        ssb.add_blksize(sb.st_blksize);
-        ssb.add_blocks(sb.st_blocks);
-        ssb.add_atime(sb.st_atime);
-        ssb.add_mtime(sb.st_mtime);
-        ssb.add_ctime(sb.st_ctime);
-        statbuf = ssb.Finish();
+        statbuf = v3_create_struct_stat(builder, sb);
     } else {
         error = v3::CreateFileStatErrorDirect(
                 builder, saved_errno, strerror(saved_errno));
@@ -412,7 +659,8 @@ static bool v3_file_stat(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_FileStatResponse, response.Union()));
+            builder, v3::ResponseType_FileStatResponse, response.Union(),
+            msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
@@ -422,7 +670,7 @@ static bool v3_file_write(int fd, const v3::Request *msg)
     auto request = static_cast<const v3::FileWriteRequest *>(msg->request());
     auto it = fd_map.find(request->id());
     if (it == fd_map.end() || !request->data()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     int ffd = it->second;
@@ -444,7 +692,8 @@ static bool v3_file_write(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_FileWriteResponse, response.Union()));
+            builder, v3::ResponseType_FileWriteResponse, response.Union(),
+            msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
@@ -453,14 +702,14 @@ static bool v3_path_chmod(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::PathChmodRequest *>(msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     // Don't allow setting setuid or setgid permissions
     uint32_t mode = request->mode();
     uint32_t masked = mode & (S_IRWXU | S_IRWXG | S_IRWXO);
     if (masked != mode) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     fb::FlatBufferBuilder builder;
@@ -479,7 +728,8 @@ static bool v3_path_chmod(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_PathChmodResponse, response.Union()));
+            builder, v3::ResponseType_PathChmodResponse, response.Union(),
+            msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
@@ -488,7 +738,7 @@ static bool v3_path_copy(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::PathCopyRequest *>(msg->request());
     if (!request->source() || !request->target()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     fb::FlatBufferBuilder builder;
@@ -508,7 +758,8 @@ static bool v3_path_copy(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_PathCopyResponse, response.Union()));
+            builder, v3::ResponseType_PathCopyResponse, response.Union(),
+            msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
@@ -517,7 +768,7 @@ static bool v3_path_delete(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::PathDeleteRequest *>(msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     bool ret;
@@ -541,7 +792,7 @@ static bool v3_path_delete(int fd, const v3::Request *msg)
         saved_errno = errno;
         break;
     default:
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     fb::FlatBufferBuilder builder;
@@ -557,7 +808,132 @@ static bool v3_path_delete(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_PathDeleteResponse, response.Union()));
+            builder, v3::ResponseType_PathDeleteResponse, response.Union(),
+            msg->request_id()));
+
+    return v3_send_response(fd, builder);
+}
+
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/*!
+ * \brief Read the names of all entries in a directory
+ *
+ * This uses getdents64() directly with a large buffer to avoid the per-entry
+ * overhead of readdir().
+ */
+static bool list_directory_names(int dfd, std::vector<std::string> *names)
+{
+    std::vector<char> buf(64 * 1024);
+
+    while (true) {
+        long n = syscall(SYS_getdents64, dfd, buf.data(), buf.size());
+        if (n < 0) {
+            return false;
+        } else if (n == 0) {
+            return true;
+        }
+
+        for (long pos = 0; pos < n;) {
+            auto *d = reinterpret_cast<struct linux_dirent64 *>(
+                    buf.data() + pos);
+            pos += d->d_reclen;
+
+            if (strcmp(d->d_name, ".") != 0 && strcmp(d->d_name, "..") != 0) {
+                names->push_back(d->d_name);
+            }
+        }
+    }
+}
+
+static bool v3_path_list_directory(int fd, const v3::Request *msg)
+{
+    auto request = static_cast<const v3::PathListDirectoryRequest *>(
+            msg->request());
+    if (!request->path()) {
+        return v3_send_response_invalid(fd, msg);
+    }
+
+    std::string dir_path = request->path()->c_str();
+    std::vector<std::string> names;
+
+    int dfd = open(dir_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    bool ret = dfd >= 0 && list_directory_names(dfd, &names);
+    int saved_errno = errno;
+
+    auto close_dfd = util::finally([&]{
+        if (dfd >= 0) {
+            close(dfd);
+        }
+    });
+
+    fb::FlatBufferBuilder builder;
+    fb::Offset<v3::PathListDirectoryError> error;
+    fb::Offset<fb::Vector<fb::Offset<v3::PathListDirectoryEntry>>> entries;
+
+    if (ret) {
+        std::vector<fb::Offset<v3::PathListDirectoryEntry>> fb_entries;
+        fb_entries.reserve(names.size());
+
+        std::string label;
+        std::string target;
+
+        for (auto const &name : names) {
+            fb::Offset<v3::StructStat> statbuf;
+            fb::Offset<fb::String> fb_label;
+            fb::Offset<fb::String> fb_target;
+            struct stat sb;
+
+            if (fstatat(dfd, name.c_str(), &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+                statbuf = v3_create_struct_stat(builder, sb);
+
+                if (S_ISLNK(sb.st_mode)) {
+                    target.resize(sb.st_size > 0 ? sb.st_size + 1 : 256);
+
+                    while (true) {
+                        ssize_t len = readlinkat(dfd, name.c_str(), &target[0],
+                                                 target.size());
+                        if (len < 0) {
+                            break;
+                        } else if (static_cast<size_t>(len) < target.size()) {
+                            fb_target = builder.CreateString(target.data(),
+                                                             len);
+                            break;
+                        }
+                        target.resize(target.size() * 2);
+                    }
+                }
+            }
+
+            if (util::selinux_lget_context(dir_path + "/" + name, &label)) {
+                fb_label = builder.CreateString(label);
+            }
+
+            fb_entries.push_back(v3::CreatePathListDirectoryEntry(
+                    builder, builder.CreateString(name), statbuf, fb_label,
+                    fb_target));
+        }
+
+        entries = builder.CreateVector(fb_entries);
+    } else {
+        error = v3::CreatePathListDirectoryErrorDirect(
+                builder, saved_errno, strerror(saved_errno));
+    }
+
+    auto response = v3::CreatePathListDirectoryResponse(
+            builder, entries, error);
+
+    // Wrap response
+    builder.Finish(v3::CreateResponse(
+            builder, v3::ResponseType_PathListDirectoryResponse,
+            response.Union(), msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
@@ -566,14 +942,14 @@ static bool v3_path_mkdir(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::PathMkdirRequest *>(msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     // Don't allow setting setuid or setgid permissions
     uint32_t mode = request->mode();
     uint32_t masked = mode & (S_IRWXU | S_IRWXG | S_IRWXO);
     if (masked != mode) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     fb::FlatBufferBuilder builder;
@@ -597,7 +973,8 @@ static bool v3_path_mkdir(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_PathMkdirResponse, response.Union()));
+            builder, v3::ResponseType_PathMkdirResponse, response.Union(),
+            msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
@@ -606,7 +983,7 @@ static bool v3_path_readlink(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::PathReadlinkRequest *>(msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     std::string target;
@@ -626,7 +1003,8 @@ static bool v3_path_readlink(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_PathReadlinkResponse, response.Union()));
+            builder, v3::ResponseType_PathReadlinkResponse, response.Union(),
+            msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
@@ -636,7 +1014,7 @@ static bool v3_path_selinux_get_label(int fd, const v3::Request *msg)
     auto request = static_cast<const v3::PathSELinuxGetLabelRequest *>(
             msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     std::string label;
@@ -663,7 +1041,7 @@ static bool v3_path_selinux_get_label(int fd, const v3::Request *msg)
     // Wrap response
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_PathSELinuxGetLabelResponse,
-            response.Union()));
+            response.Union(), msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
@@ -673,7 +1051,7 @@ static bool v3_path_selinux_set_label(int fd, const v3::Request *msg)
     auto request = static_cast<const v3::PathSELinuxSetLabelRequest *>(
             msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     bool ret;
@@ -700,66 +1078,483 @@ static bool v3_path_selinux_set_label(int fd, const v3::Request *msg)
     // Wrap response
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_PathSELinuxSetLabelResponse,
-            response.Union()));
+            response.Union(), msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
 
-class DirectorySizeGetter : public util::FTSWrapper {
+// Maximum number of threads used for computing directory sizes
+#define DIRECTORY_SIZE_MAX_THREADS      8
+
+/*!
+ * \brief Compute the total size of the regular files in a directory tree
+ *
+ * Subdirectories are handed to idle worker threads when there are any and are
+ * otherwise walked depth-first by the current thread. Files with more than one
+ * hard link are only counted once.
+ */
+class ParallelDirectorySizeGetter
+{
 public:
-    DirectorySizeGetter(std::string path, std::vector<std::string> exclusions)
-        : FTSWrapper(path, FTS_GroupSpecialFiles),
-        _exclusions(std::move(exclusions)),
-        _total(0)
+    typedef void (*DirectoryCallback)(const std::string &path, void *userdata);
+
+    ParallelDirectorySizeGetter(std::string path,
+                                std::vector<std::string> exclusions)
+        : _path(std::move(path)), _exclusions(std::move(exclusions))
     {
     }
 
-    virtual int on_changed_path() override
+    /*!
+     * \brief Set a function to be called for every directory before it is read
+     *
+     * The callback may be called from multiple threads at the same time.
+     */
+    void set_directory_callback(DirectoryCallback cb, void *userdata)
     {
-        // Exclude first-level directories
-        if (_curr->fts_level == 1) {
-            if (std::find(_exclusions.begin(), _exclusions.end(), _curr->fts_name)
-                    != _exclusions.end()) {
-                return Action::FTS_Skip;
-            }
-        }
-
-        return Action::FTS_OK;
+        _dir_cb = cb;
+        _dir_cb_userdata = userdata;
     }
 
-    virtual int on_reached_file() override
+    bool run()
     {
-        dev_t dev = _curr->fts_statp->st_dev;
-        ino_t ino = _curr->fts_statp->st_ino;
+        int dfd = open(_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dfd < 0) {
+            return false;
+        }
 
-        // If this file has been visited before (hard link), then skip it
-        if (_links.find(dev) != _links.end()
-                && _links[dev].find(ino) != _links[dev].end()) {
-            return Action::FTS_OK;
+        struct stat sb;
+        if (fstat(dfd, &sb) < 0) {
+            int saved_errno = errno;
+            close(dfd);
+            errno = saved_errno;
+            return false;
         }
+        _dev = sb.st_dev;
+
+        unsigned int n_threads = std::min(
+                std::max(std::thread::hardware_concurrency(), 2u),
+                static_cast<unsigned int>(DIRECTORY_SIZE_MAX_THREADS));
 
-        _total += _curr->fts_statp->st_size;
-        _links[dev].emplace(ino);
+        _outstanding = 1;
+        _queue.push_back({ dfd, _path });
 
-        return Action::FTS_OK;
+        run_concurrently(n_threads, [this] { worker_thread(); });
+
+        if (_error != 0) {
+            errno = _error;
+            return false;
+        }
+        return true;
     }
 
-    uint64_t total() const {
+    uint64_t total() const
+    {
         return _total;
     }
 
 private:
+    struct Dir
+    {
+        int fd;
+        std::string path;
+    };
+
+    std::string _path;
     std::vector<std::string> _exclusions;
+    // Device of the root directory. Mountpoints are not descended into.
+    dev_t _dev = 0;
+    DirectoryCallback _dir_cb = nullptr;
+    void *_dir_cb_userdata = nullptr;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<Dir> _queue;
+    unsigned int _idle = 0;
+    unsigned int _outstanding = 0;
+
+    // Only files with multiple hard links need to be tracked
+    std::mutex _links_mutex;
     std::unordered_map<dev_t, std::unordered_set<ino_t>> _links;
-    uint64_t _total;
+
+    std::atomic<uint64_t> _total{0};
+    std::atomic_int _error{0};
+
+    void worker_thread()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        while (true) {
+            ++_idle;
+            _cv.wait(lock, [&] {
+                return !_queue.empty() || _outstanding == 0;
+            });
+            --_idle;
+
+            if (_queue.empty()) {
+                break;
+            }
+
+            Dir dir = std::move(_queue.front());
+            _queue.pop_front();
+
+            lock.unlock();
+            walk(dir);
+            lock.lock();
+
+            if (--_outstanding == 0) {
+                _cv.notify_all();
+            }
+        }
+    }
+
+    bool try_queue(Dir &dir)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_queue.size() >= _idle) {
+                return false;
+            }
+            _queue.push_back(std::move(dir));
+            ++_outstanding;
+        }
+        _cv.notify_one();
+        return true;
+    }
+
+    // Takes ownership of dir.fd
+    void walk(Dir &dir)
+    {
+        if (_dir_cb) {
+            _dir_cb(dir.path, _dir_cb_userdata);
+        }
+
+        DIR *dp = fdopendir(dir.fd);
+        if (!dp) {
+            _error = errno;
+            close(dir.fd);
+            return;
+        }
+
+        bool is_root = dir.path == _path;
+        uint64_t total = 0;
+        struct dirent *ent;
+
+        while ((ent = readdir(dp))) {
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0
+                    || (is_root && std::find(_exclusions.begin(),
+                                             _exclusions.end(), ent->d_name)
+                            != _exclusions.end())) {
+                continue;
+            }
+
+            if (ent->d_type != DT_UNKNOWN && ent->d_type != DT_DIR
+                    && ent->d_type != DT_REG) {
+                continue;
+            }
+
+            struct stat sb;
+            if (fstatat(dirfd(dp), ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+                if (errno != ENOENT) {
+                    _error = errno;
+                }
+                continue;
+            }
+
+            if (S_ISREG(sb.st_mode)) {
+                if (sb.st_nlink > 1) {
+                    std::lock_guard<std::mutex> lock(_links_mutex);
+                    if (!_links[sb.st_dev].emplace(sb.st_ino).second) {
+                        continue;
+                    }
+                }
+                total += sb.st_size;
+            } else if (S_ISDIR(sb.st_mode)) {
+                // Don't descend into mountpoints
+                if (sb.st_dev != _dev) {
+                    continue;
+                }
+
+                Dir child;
+                child.fd = openat(dirfd(dp), ent->d_name, O_RDONLY
+                                  | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (child.fd < 0) {
+                    if (errno != ENOENT) {
+                        _error = errno;
+                    }
+                    continue;
+                }
+                child.path = dir.path;
+                child.path += '/';
+                child.path += ent->d_name;
+
+                if (!try_queue(child)) {
+                    walk(child);
+                }
+            }
+        }
+
+        closedir(dp);
+
+        _total += total;
+    }
 };
 
+// Maximum number of inotify watches used by the directory size cache
+#define DIRECTORY_SIZE_CACHE_MAX_WATCHES        4096
+
+/*!
+ * \brief Cache of directory sizes, invalidated by inotify
+ *
+ * Every directory in a cached tree is watched. Any change in a directory
+ * invalidates all cached results that include it. If the trees are too large
+ * to watch, the results are simply not cached.
+ *
+ * The daemon forks for every connection, so the cache lives for the duration
+ * of a connection.
+ */
+class DirectorySizeCache
+{
+public:
+    ~DirectorySizeCache()
+    {
+        if (_inotify_fd >= 0) {
+            close(_inotify_fd);
+        }
+    }
+
+    bool get(const std::string &key, uint64_t *total)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        process_events();
+
+        auto it = _entries.find(key);
+        if (it == _entries.end()) {
+            return false;
+        }
+
+        *total = it->second.total;
+        return true;
+    }
+
+    bool compute(const std::string &path,
+                 const std::vector<std::string> &exclusions,
+                 uint64_t *total)
+    {
+        std::string key = make_key(path, exclusions);
+
+        if (get(key, total)) {
+            return true;
+        }
+
+        Walk walk;
+        walk.cache = this;
+
+        ParallelDirectorySizeGetter dsg(path, exclusions);
+        dsg.set_directory_callback(&on_directory, &walk);
+
+        bool ret = dsg.run();
+        int saved_errno = errno;
+
+        *total = dsg.total();
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+
+            // Anything that changed during the walk makes the result stale
+            bool changed = process_events(&walk.wds);
+
+            if (ret && walk.ok && !changed) {
+                // Another thread may have computed the same size concurrently
+                invalidate(key);
+
+                for (int wd : walk.wds) {
+                    _watches[wd].insert(key);
+                }
+                _entries[key] = { *total, std::move(walk.wds) };
+            } else {
+                for (int wd : walk.wds) {
+                    release_watch(wd);
+                }
+            }
+        }
+
+        errno = saved_errno;
+        return ret;
+    }
+
+private:
+    struct Entry
+    {
+        uint64_t total;
+        std::unordered_set<int> wds;
+    };
+
+    struct Walk
+    {
+        DirectorySizeCache *cache;
+        std::mutex mutex;
+        std::unordered_set<int> wds;
+        bool ok = true;
+    };
+
+    std::mutex _mutex;
+    int _inotify_fd = -1;
+    std::unordered_map<std::string, Entry> _entries;
+    // Keys of the entries that depend on each watch
+    std::unordered_map<int, std::unordered_set<std::string>> _watches;
+    // Number of walks (in progress or cached) using each watch
+    std::unordered_map<int, unsigned int> _watch_refs;
+
+    static std::string make_key(const std::string &path,
+                                const std::vector<std::string> &exclusions)
+    {
+        std::vector<std::string> sorted(exclusions);
+        std::sort(sorted.begin(), sorted.end());
+
+        std::string key(path);
+        for (auto const &exclusion : sorted) {
+            key += '\0';
+            key += exclusion;
+        }
+        return key;
+    }
+
+    static void on_directory(const std::string &path, void *userdata)
+    {
+        Walk *walk = static_cast<Walk *>(userdata);
+        DirectorySizeCache *cache = walk->cache;
+
+        {
+            std::lock_guard<std::mutex> lock(walk->mutex);
+            if (!walk->ok) {
+                return;
+            }
+        }
+
+        int wd = -1;
+        {
+            std::lock_guard<std::mutex> lock(cache->_mutex);
+
+            if (cache->_watch_refs.size() < DIRECTORY_SIZE_CACHE_MAX_WATCHES
+                    && cache->init_inotify()) {
+                wd = inotify_add_watch(
+                        cache->_inotify_fd, path.c_str(),
+                        IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM
+                        | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF
+                        | IN_ONLYDIR | IN_DONT_FOLLOW);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(walk->mutex);
+
+        if (wd < 0) {
+            walk->ok = false;
+            return;
+        }
+
+        if (walk->wds.insert(wd).second) {
+            std::lock_guard<std::mutex> cache_lock(cache->_mutex);
+            ++cache->_watch_refs[wd];
+        }
+    }
+
+    bool init_inotify()
+    {
+        if (_inotify_fd < 0) {
+            _inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        }
+        return _inotify_fd >= 0;
+    }
+
+    void release_watch(int wd)
+    {
+        auto it = _watch_refs.find(wd);
+        if (it != _watch_refs.end() && --it->second == 0) {
+            _watch_refs.erase(it);
+            _watches.erase(wd);
+            inotify_rm_watch(_inotify_fd, wd);
+        }
+    }
+
+    void invalidate(const std::string &key)
+    {
+        auto it = _entries.find(key);
+        if (it == _entries.end()) {
+            return;
+        }
+
+        for (int wd : it->second.wds) {
+            auto watch = _watches.find(wd);
+            if (watch != _watches.end()) {
+                watch->second.erase(key);
+            }
+            release_watch(wd);
+        }
+        _entries.erase(it);
+    }
+
+    // Drain the inotify queue and invalidate the affected entries. Returns
+    // whether any of the watches in `wds` were affected.
+    bool process_events(const std::unordered_set<int> *wds = nullptr)
+    {
+        if (_inotify_fd < 0) {
+            return false;
+        }
+
+        bool affected = false;
+        alignas(struct inotify_event) char buf[4096];
+
+        while (true) {
+            ssize_t n = read(_inotify_fd, buf, sizeof(buf));
+            if (n <= 0) {
+                break;
+            }
+
+            for (char *ptr = buf; ptr < buf + n;) {
+                auto *event = reinterpret_cast<struct inotify_event *>(ptr);
+                ptr += sizeof(struct inotify_event) + event->len;
+
+                if (event->mask & IN_Q_OVERFLOW) {
+                    // Events were lost, so nothing can be trusted
+                    std::vector<std::string> keys;
+                    for (auto const &entry : _entries) {
+                        keys.push_back(entry.first);
+                    }
+                    for (auto const &key : keys) {
+                        invalidate(key);
+                    }
+                    affected = true;
+                    continue;
+                }
+
+                if (wds && wds->find(event->wd) != wds->end()) {
+                    affected = true;
+                }
+
+                auto watch = _watches.find(event->wd);
+                if (watch != _watches.end()) {
+                    std::vector<std::string> keys(watch->second.begin(),
+                                                  watch->second.end());
+                    for (auto const &key : keys) {
+                        invalidate(key);
+                    }
+                }
+            }
+        }
+
+        return affected;
+    }
+};
+
+static DirectorySizeCache directory_size_cache;
+
 static bool v3_path_get_directory_size(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::PathGetDirectorySizeRequest *>(
             msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     std::vector<std::string> exclusions;
@@ -769,8 +1564,9 @@ static bool v3_path_get_directory_size(int fd, const v3::Request *msg)
         }
     }
 
-    DirectorySizeGetter dsg(request->path()->c_str(), std::move(exclusions));
-    bool ret = dsg.run();
+    uint64_t total;
+    bool ret = directory_size_cache.compute(
+            request->path()->c_str(), exclusions, &total);
     int saved_errno = errno;
 
     fb::FlatBufferBuilder builder;
@@ -782,23 +1578,28 @@ static bool v3_path_get_directory_size(int fd, const v3::Request *msg)
     }
 
     auto response = v3::CreatePathGetDirectorySizeResponseDirect(
-            builder, ret, ret ? nullptr : strerror(saved_errno), dsg.total(),
+            builder, ret, ret ? nullptr : strerror(saved_errno), total,
             error);
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_PathGetDirectorySizeResponse,
-            response.Union()));
+            response.Union(), msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
 
+struct SignedExecOutputCtx
+{
+    int fd;
+    uint32_t request_id;
+};
+
 static void signed_exec_output_cb(const char *line, bool error, void *userdata)
 {
     (void) error;
 
-    int *fd_ptr = (int *) userdata;
-    // TODO: Send line
+    auto *ctx = static_cast<SignedExecOutputCtx *>(userdata);
 
     fb::FlatBufferBuilder builder;
     fb::Offset<fb::String> line_id = builder.CreateString(line);
@@ -809,19 +1610,43 @@ static void signed_exec_output_cb(const char *line, bool error, void *userdata)
     // Wrap response
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_SignedExecOutputResponse,
-            response.Union()));
+            response.Union(), ctx->request_id));
 
-    if (!v3_send_response(*fd_ptr, builder)) {
+    if (!v3_send_response(ctx->fd, builder)) {
         // Can't kill the connection from this callback (yet...)
         LOGE("Failed to send output line: %s", strerror(errno));
     }
 }
 
+static bool signed_exec_send_stream_fd(int fd, uint32_t request_id,
+                                       int stream_fd)
+{
+    fb::FlatBufferBuilder builder;
+
+    // Create response
+    auto response = v3::CreateSignedExecOutputResponse(builder, 0, true);
+
+    // Wrap response
+    builder.Finish(v3::CreateResponse(
+            builder, v3::ResponseType_SignedExecOutputResponse,
+            response.Union(), request_id));
+
+    response_bytes += builder.GetSize();
+
+    // The fd must immediately follow its response, so don't let another
+    // thread write in between
+    std::lock_guard<std::mutex> lock(write_lock);
+
+    return util::socket_write_bytes(
+            fd, builder.GetBufferPointer(), builder.GetSize())
+            && util::socket_send_fds(fd, { stream_fd });
+}
+
 static bool v3_signed_exec(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::SignedExecRequest *>(msg->request());
     if (!request->binary_path() || !request->signature_path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     static const char *temp_dir = "/mbtool_exec_tmp";
@@ -833,6 +1658,7 @@ static bool v3_signed_exec(int fd, const v3::Request *msg)
     int status;
     SigVerifyResult sig_result;
     bool mounted_tmpfs = false;
+    int stream_pipe[2] = { -1, -1 };
     // Variables that are part of the response
     v3::SignedExecResult result = v3::SignedExecResult_OTHER_ERROR;
     std::string error_msg;
@@ -851,6 +1677,14 @@ static bool v3_signed_exec(int fd, const v3::Request *msg)
         }
     });
 
+    auto close_stream_pipe = util::finally([&]{
+        for (int pipe_fd : stream_pipe) {
+            if (pipe_fd >= 0) {
+                close(pipe_fd);
+            }
+        }
+    });
+
     if (mount("", "/", "", MS_REMOUNT, "") < 0) {
         result = v3::SignedExecResult_OTHER_ERROR;
         mb::format(error_msg, "Failed to remount / as rw: %s", strerror(errno));
@@ -924,6 +1758,26 @@ static bool v3_signed_exec(int fd, const v3::Request *msg)
         goto done;
     }
 
+    // Binary output gets its own pipe so that it does not have to go through
+    // the line reader below and the client can read it directly
+    if (request->stream_fd()) {
+        if (pipe2(stream_pipe, O_CLOEXEC) < 0) {
+            result = v3::SignedExecResult_OTHER_ERROR;
+            mb::format(error_msg, "Failed to create stream pipe: %s",
+                       strerror(errno));
+            LOGE("%s", error_msg.c_str());
+            goto done;
+        }
+
+        if (!signed_exec_send_stream_fd(fd, msg->request_id(),
+                                        stream_pipe[0])) {
+            return false;
+        }
+
+        close(stream_pipe[0]);
+        stream_pipe[0] = -1;
+    }
+
     // Build arguments
     nargs = 2; // argv[0] + NULL-terminator
     if (request->args()) {
@@ -957,8 +1811,43 @@ static bool v3_signed_exec(int fd, const v3::Request *msg)
     // TODO: Update libmbutil's command.cpp so the callback can return a bool
     //       Right now, if the connection is broken, the command will continue
     //       executing.
-    status = util::run_command(target_binary.c_str(), argv, nullptr, nullptr,
-                               &signed_exec_output_cb, &fd);
+    {
+        SignedExecOutputCtx output_ctx{fd, msg->request_id()};
+        util::CommandCtx ctx;
+        ctx.path = target_binary.c_str();
+        ctx.argv = argv;
+        ctx.redirect_stdio = true;
+        ctx.pass_fd = stream_pipe[1];
+
+        bool started;
+        {
+            // The process inherits the priorities and cgroups of the thread
+            // that forks it, so the policy only needs to last until then
+            std::unique_ptr<util::ScopedThreadSchedPolicy> sched;
+            if (request->background()) {
+                sched.reset(new util::ScopedThreadSchedPolicy(
+                        util::sched_policy_preset(
+                                util::SchedPreset::Background)));
+            }
+
+            started = util::command_start(&ctx);
+        }
+
+        if (started) {
+            // The client only sees EOF once the process is the last holder of
+            // the write end
+            if (stream_pipe[1] >= 0) {
+                close(stream_pipe[1]);
+                stream_pipe[1] = -1;
+            }
+
+            util::command_line_reader(&ctx, &signed_exec_output_cb,
+                                      &output_ctx);
+            status = util::command_wait(&ctx);
+        } else {
+            status = -1;
+        }
+    }
 
     free(argv);
 
@@ -991,7 +1880,8 @@ done:
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_SignedExecResponse, response.Union()));
+            builder, v3::ResponseType_SignedExecResponse, response.Union(),
+            msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
@@ -1013,7 +1903,7 @@ static bool v3_mb_get_booted_rom_id(int fd, const v3::Request *msg)
     // Wrap response
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_MbGetBootedRomIdResponse,
-            response.Union()));
+            response.Union(), msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
@@ -1024,12 +1914,11 @@ static bool v3_mb_get_installed_roms(int fd, const v3::Request *msg)
 
     fb::FlatBufferBuilder builder;
 
-    Roms roms;
-    roms.add_installed();
+    auto roms = Roms::get_installed();
 
     std::vector<fb::Offset<v3::MbRom>> fb_roms;
 
-    for (auto r : roms.roms) {
+    for (auto r : roms->roms) {
         std::string system_path = r->full_system_path();
         std::string cache_path = r->full_cache_path();
         std::string data_path = r->full_data_path();
@@ -1081,7 +1970,7 @@ static bool v3_mb_get_installed_roms(int fd, const v3::Request *msg)
     // Wrap response
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_MbGetInstalledRomsResponse,
-            response.Union()));
+            response.Union(), msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
@@ -1098,7 +1987,53 @@ static bool v3_mb_get_version(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_MbGetVersionResponse, response.Union()));
+            builder, v3::ResponseType_MbGetVersionResponse, response.Union(),
+            msg->request_id()));
+
+    return v3_send_response(fd, builder);
+}
+
+static bool v3_mb_get_stats(int fd, const v3::Request *msg)
+{
+    fb::FlatBufferBuilder builder;
+    std::vector<fb::Offset<v3::MbRequestStats>> fb_stats;
+    uint64_t connections = 0;
+
+    DaemonStats *stats = daemon_stats();
+    if (stats) {
+        connections = stats->connections.load();
+
+        for (unsigned int type = 0; type < DAEMON_STATS_MAX_TYPES; ++type) {
+            const DaemonRequestStats &s = stats->types[type];
+            uint64_t count = s.count.load();
+            if (count == 0) {
+                continue;
+            }
+
+            std::vector<uint64_t> histogram;
+            for (auto const &bucket : s.latency_buckets) {
+                histogram.push_back(bucket.load());
+            }
+
+            const char *name = type <= v3::RequestType_MAX
+                    ? v3::EnumNameRequestType(
+                            static_cast<v3::RequestType>(type))
+                    : nullptr;
+
+            fb_stats.push_back(v3::CreateMbRequestStatsDirect(
+                    builder, type, name, count, s.total_latency_us.load(),
+                    s.max_latency_us.load(), &histogram, s.bytes_in.load(),
+                    s.bytes_out.load()));
+        }
+    }
+
+    auto response = v3::CreateMbGetStatsResponseDirect(
+            builder, connections, &fb_stats);
+
+    // Wrap response
+    builder.Finish(v3::CreateResponse(
+            builder, v3::ResponseType_MbGetStatsResponse, response.Union(),
+            msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
@@ -1107,7 +2042,7 @@ static bool v3_mb_set_kernel(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::MbSetKernelRequest *>(msg->request());
     if (!request->rom_id() || !request->boot_blockdev()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     fb::FlatBufferBuilder builder;
@@ -1125,7 +2060,8 @@ static bool v3_mb_set_kernel(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_MbSetKernelResponse, response.Union()));
+            builder, v3::ResponseType_MbSetKernelResponse, response.Union(),
+            msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
@@ -1134,7 +2070,7 @@ static bool v3_mb_switch_rom(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::MbSwitchRomRequest *>(msg->request());
     if (!request->rom_id() || !request->boot_blockdev()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     std::vector<const char *> block_dev_dirs;
@@ -1182,7 +2118,8 @@ static bool v3_mb_switch_rom(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_MbSwitchRomResponse, response.Union()));
+            builder, v3::ResponseType_MbSwitchRomResponse, response.Union(),
+            msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
@@ -1191,7 +2128,7 @@ static bool v3_mb_wipe_rom(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::MbWipeRomRequest *>(msg->request());
     if (!request->rom_id()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     // Find and verify ROM is installed
@@ -1202,40 +2139,54 @@ static bool v3_mb_wipe_rom(int fd, const v3::Request *msg)
     if (!rom) {
         LOGE("Tried to wipe non-installed or invalid ROM ID: %s",
              request->rom_id()->c_str());
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     // The GUI should check this, but we'll enforce it here
     auto current_rom = Roms::get_current_rom();
     if (current_rom && current_rom->id == rom->id) {
         LOGE("Cannot wipe currently booted ROM: %s", rom->id.c_str());
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     // Wipe the selected targets
     std::vector<int16_t> succeeded;
     std::vector<int16_t> failed;
 
+    // Opt-in since trimming can take a while on large filesystems
+    std::unique_ptr<WipeTrimmer> trimmer;
+
     if (request->targets()) {
+        // This thread may be reused for other requests afterwards
+        std::unique_ptr<util::ScopedThreadSchedPolicy> sched;
+        if (request->background()) {
+            sched.reset(new util::ScopedThreadSchedPolicy(
+                    util::sched_policy_preset(util::SchedPreset::Background)));
+        }
+
         std::string raw_system = get_raw_path("/system");
         if (mount("", raw_system.c_str(), "", MS_REMOUNT, "") < 0) {
             LOGW("Failed to mount %s as writable: %s",
                  raw_system.c_str(), strerror(errno));
         }
 
+        if (request->trim()) {
+            trimmer.reset(new WipeTrimmer());
+        }
+
         for (short target : *request->targets()) {
             bool success = false;
 
             if (target == v3::MbWipeTarget_SYSTEM) {
-                success = wipe_system(rom);
+                success = wipe_system(rom, true, trimmer.get());
             } else if (target == v3::MbWipeTarget_CACHE) {
-                success = wipe_cache(rom);
+                success = wipe_cache(rom, true, trimmer.get());
             } else if (target == v3::MbWipeTarget_DATA) {
-                success = wipe_data(rom);
+                success = wipe_data(rom, true, trimmer.get());
             } else if (target == v3::MbWipeTarget_DALVIK_CACHE) {
-                success = wipe_dalvik_cache(rom);
+                success = wipe_dalvik_cache(rom, true, trimmer.get());
             } else if (target == v3::MbWipeTarget_MULTIBOOT) {
-                success = wipe_multiboot(rom);
+                success = wipe_multiboot(rom, true, trimmer.get());
             } else {
                 LOGE("Unknown wipe target %d", target);
             }
@@ -1256,9 +2207,19 @@ static bool v3_mb_wipe_rom(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_MbWipeRomResponse, response.Union()));
+            builder, v3::ResponseType_MbWipeRomResponse, response.Union(),
+            msg->request_id()));
 
-    return v3_send_response(fd, builder);
+    bool ret = v3_send_response(fd, builder);
+
+    // Trim after responding so the client isn't kept waiting. This can't be
+    // done in a detached thread since this process exits when the client
+    // disconnects.
+    if (trimmer) {
+        trimmer->run();
+    }
+
+    return ret;
 }
 
 static bool v3_mb_get_packages_count(int fd, const v3::Request *msg)
@@ -1266,7 +2227,7 @@ static bool v3_mb_get_packages_count(int fd, const v3::Request *msg)
     auto request = static_cast<const v3::MbGetPackagesCountRequest *>(
             msg->request());
     if (!request->rom_id()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     // Find and verify ROM is installed
@@ -1275,7 +2236,7 @@ static bool v3_mb_get_packages_count(int fd, const v3::Request *msg)
 
     auto rom = roms.find_by_id(request->rom_id()->c_str());
     if (!rom) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     std::string packages_xml(rom->full_data_path());
@@ -1287,11 +2248,11 @@ static bool v3_mb_get_packages_count(int fd, const v3::Request *msg)
     unsigned int update_pkgs = 0;
     unsigned int other_pkgs = 0;
 
-    Packages pkgs;
-    bool ret = pkgs.load_xml(packages_xml);
+    std::shared_ptr<const Packages> pkgs = Packages::load_cached(packages_xml);
+    bool ret = !!pkgs;
 
     if (ret) {
-        for (std::shared_ptr<Package> pkg : pkgs.pkgs) {
+        for (const std::shared_ptr<Package> &pkg : pkgs->pkgs) {
             bool is_system = (pkg->pkg_flags & Package::FLAG_SYSTEM)
                     || (pkg->pkg_public_flags & Package::PUBLIC_FLAG_SYSTEM);
             bool is_update = (pkg->pkg_flags & Package::FLAG_UPDATED_SYSTEM_APP)
@@ -1315,7 +2276,7 @@ static bool v3_mb_get_packages_count(int fd, const v3::Request *msg)
     // Wrap response
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_MbGetPackagesCountResponse,
-            response.Union()));
+            response.Union(), msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
@@ -1347,7 +2308,7 @@ static bool v3_reboot(int fd, const v3::Request *msg)
         break;
     default:
         LOGE("Invalid reboot type: %d", request->type());
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     if (!ret) {
@@ -1359,7 +2320,8 @@ static bool v3_reboot(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_RebootResponse, response.Union()));
+            builder, v3::ResponseType_RebootResponse, response.Union(),
+            msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
@@ -1383,7 +2345,7 @@ static bool v3_shutdown(int fd, const v3::Request *msg)
         break;
     default:
         LOGE("Invalid shutdown type: %d", request->type());
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     if (!ret) {
@@ -1395,48 +2357,245 @@ static bool v3_shutdown(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_ShutdownResponse, response.Union()));
+            builder, v3::ResponseType_ShutdownResponse, response.Union(),
+            msg->request_id()));
 
     return v3_send_response(fd, builder);
 }
 
 typedef bool (*request_handler_fn)(int, const v3::Request *);
 
+// How a request with a non-zero request ID is processed. Requests with an ID
+// of 0 are always processed inline.
+enum DispatchMode
+{
+    // Processed by the connection's main thread after all outstanding requests
+    // have completed. File* requests share fd_map and file offsets and
+    // rebooting/shutting down must not overlap with anything else.
+    DISPATCH_INLINE,
+    // Processed concurrently by the fast worker pool
+    DISPATCH_FAST,
+    // Long-running global operations. These are processed one at a time by a
+    // separate worker so that they never overlap with each other and never
+    // hold up fast requests.
+    DISPATCH_SLOW,
+};
+
 struct RequestMap
 {
     v3::RequestType type;
     request_handler_fn fn;
+    DispatchMode mode;
 };
 
 static RequestMap request_map[] = {
-    { v3::RequestType_FileChmodRequest, v3_file_chmod },
-    { v3::RequestType_FileCloseRequest, v3_file_close },
-    { v3::RequestType_FileOpenRequest, v3_file_open },
-    { v3::RequestType_FileReadRequest, v3_file_read },
-    { v3::RequestType_FileSeekRequest, v3_file_seek },
-    { v3::RequestType_FileSELinuxGetLabelRequest, v3_file_selinux_get_label },
-    { v3::RequestType_FileSELinuxSetLabelRequest, v3_file_selinux_set_label },
-    { v3::RequestType_FileStatRequest, v3_file_stat },
-    { v3::RequestType_FileWriteRequest, v3_file_write },
-    { v3::RequestType_PathChmodRequest, v3_path_chmod },
-    { v3::RequestType_PathCopyRequest, v3_path_copy },
-    { v3::RequestType_PathDeleteRequest, v3_path_delete },
-    { v3::RequestType_PathMkdirRequest, v3_path_mkdir },
-    { v3::RequestType_PathReadlinkRequest, v3_path_readlink },
-    { v3::RequestType_PathSELinuxGetLabelRequest, v3_path_selinux_get_label },
-    { v3::RequestType_PathSELinuxSetLabelRequest, v3_path_selinux_set_label },
-    { v3::RequestType_PathGetDirectorySizeRequest, v3_path_get_directory_size },
-    { v3::RequestType_SignedExecRequest, v3_signed_exec },
-    { v3::RequestType_MbGetBootedRomIdRequest, v3_mb_get_booted_rom_id },
-    { v3::RequestType_MbGetInstalledRomsRequest, v3_mb_get_installed_roms },
-    { v3::RequestType_MbGetVersionRequest, v3_mb_get_version },
-    { v3::RequestType_MbSetKernelRequest, v3_mb_set_kernel },
-    { v3::RequestType_MbSwitchRomRequest, v3_mb_switch_rom },
-    { v3::RequestType_MbWipeRomRequest, v3_mb_wipe_rom },
-    { v3::RequestType_MbGetPackagesCountRequest, v3_mb_get_packages_count },
-    { v3::RequestType_RebootRequest, v3_reboot },
-    { v3::RequestType_ShutdownRequest, v3_shutdown },
-    { v3::RequestType_NONE, nullptr }
+    { v3::RequestType_FileChmodRequest, v3_file_chmod, DISPATCH_INLINE },
+    { v3::RequestType_FileCloseRequest, v3_file_close, DISPATCH_INLINE },
+    { v3::RequestType_FileCopyRangeRequest,
+      v3_file_copy_range, DISPATCH_INLINE },
+    { v3::RequestType_FileHashRequest, v3_file_hash, DISPATCH_INLINE },
+    { v3::RequestType_FileOpenRequest, v3_file_open, DISPATCH_INLINE },
+    { v3::RequestType_FileOpenFdRequest, v3_file_open_fd, DISPATCH_FAST },
+    { v3::RequestType_FileReadRequest, v3_file_read, DISPATCH_INLINE },
+    { v3::RequestType_FileSeekRequest, v3_file_seek, DISPATCH_INLINE },
+    { v3::RequestType_FileSELinuxGetLabelRequest,
+      v3_file_selinux_get_label, DISPATCH_INLINE },
+    { v3::RequestType_FileSELinuxSetLabelRequest,
+      v3_file_selinux_set_label, DISPATCH_INLINE },
+    { v3::RequestType_FileStatRequest, v3_file_stat, DISPATCH_INLINE },
+    { v3::RequestType_FileWriteRequest, v3_file_write, DISPATCH_INLINE },
+    { v3::RequestType_PathChmodRequest, v3_path_chmod, DISPATCH_FAST },
+    { v3::RequestType_PathCopyRequest, v3_path_copy, DISPATCH_FAST },
+    { v3::RequestType_PathDeleteRequest, v3_path_delete, DISPATCH_FAST },
+    { v3::RequestType_PathListDirectoryRequest,
+      v3_path_list_directory, DISPATCH_FAST },
+    { v3::RequestType_PathMkdirRequest, v3_path_mkdir, DISPATCH_FAST },
+    { v3::RequestType_PathReadlinkRequest, v3_path_readlink, DISPATCH_FAST },
+    { v3::RequestType_PathSELinuxGetLabelRequest,
+      v3_path_selinux_get_label, DISPATCH_FAST },
+    { v3::RequestType_PathSELinuxSetLabelRequest,
+      v3_path_selinux_set_label, DISPATCH_FAST },
+    { v3::RequestType_PathGetDirectorySizeRequest,
+      v3_path_get_directory_size, DISPATCH_FAST },
+    { v3::RequestType_SignedExecRequest, v3_signed_exec, DISPATCH_SLOW },
+    { v3::RequestType_MbGetBootedRomIdRequest,
+      v3_mb_get_booted_rom_id, DISPATCH_FAST },
+    { v3::RequestType_MbGetInstalledRomsRequest,
+      v3_mb_get_installed_roms, DISPATCH_FAST },
+    { v3::RequestType_MbGetVersionRequest, v3_mb_get_version, DISPATCH_FAST },
+    { v3::RequestType_MbSetKernelRequest, v3_mb_set_kernel, DISPATCH_SLOW },
+    { v3::RequestType_MbSwitchRomRequest, v3_mb_switch_rom, DISPATCH_SLOW },
+    { v3::RequestType_MbWipeRomRequest, v3_mb_wipe_rom, DISPATCH_SLOW },
+    { v3::RequestType_MbGetPackagesCountRequest,
+      v3_mb_get_packages_count, DISPATCH_FAST },
+    { v3::RequestType_MbGetStatsRequest, v3_mb_get_stats, DISPATCH_FAST },
+    { v3::RequestType_RebootRequest, v3_reboot, DISPATCH_INLINE },
+    { v3::RequestType_ShutdownRequest, v3_shutdown, DISPATCH_INLINE },
+    { v3::RequestType_NONE, nullptr, DISPATCH_INLINE }
+};
+
+static const RequestMap * find_handler(v3::RequestType type)
+{
+    // Lookup table indexed by the request type
+    static const std::vector<const RequestMap *> table = []{
+        std::vector<const RequestMap *> t(v3::RequestType_MAX + 1, nullptr);
+        for (auto iter = request_map; iter->fn; ++iter) {
+            t[iter->type] = iter;
+        }
+        return t;
+    }();
+
+    if (type < v3::RequestType_MIN || type > v3::RequestType_MAX) {
+        return nullptr;
+    }
+    return table[type];
+}
+
+static uint64_t monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// NOTE: A false return value indicates a connection error, not a command
+//       failure!
+static bool v3_process_request(int fd, const RequestMap *entry,
+                               const v3::Request *request, size_t size)
+{
+    uint64_t start = monotonic_us();
+    response_bytes = 0;
+
+    bool ret;
+    if (entry) {
+        ret = entry->fn(fd, request);
+    } else {
+        // Invalid command; allow further commands
+        ret = v3_send_response_unsupported(fd, request);
+    }
+
+    daemon_stats_record(request->request_type(), monotonic_us() - start,
+                        size, response_bytes);
+
+    return ret;
+}
+
+// Maximum number of concurrent requests that can be queued before the
+// connection stops reading more requests
+#define V3_MAX_QUEUED           64
+
+/*!
+ * \brief Runs requests with a non-zero request ID on a small pool of threads
+ *
+ * The threads are only started when the first such request is received, so
+ * clients that do not use request IDs keep the old strictly sequential
+ * behavior.
+ */
+class ConcurrentDispatcher
+{
+public:
+    ConcurrentDispatcher(int fd, unsigned int n_threads)
+        : _fd(fd), _n_threads(n_threads)
+    {
+    }
+
+    ~ConcurrentDispatcher()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _stop = true;
+            _queue.clear();
+        }
+        _cv_work.notify_all();
+
+        for (auto &t : _threads) {
+            t.join();
+        }
+    }
+
+    // The request is copied since the reader's buffer is reused
+    void submit(const uint8_t *data, size_t size, const RequestMap *entry)
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+
+        if (_threads.empty()) {
+            for (unsigned int i = 0; i < _n_threads; ++i) {
+                _threads.emplace_back(&ConcurrentDispatcher::worker_loop,
+                                      this);
+            }
+        }
+
+        _cv_idle.wait(lock, [&]{
+            return _queue.size() < V3_MAX_QUEUED || _failed;
+        });
+
+        _queue.push_back({ std::vector<uint8_t>(data, data + size), entry });
+        ++_pending;
+        _cv_work.notify_one();
+    }
+
+    // Wait for all queued and running requests to complete
+    bool wait_idle()
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+        _cv_idle.wait(lock, [&]{
+            return _pending == 0;
+        });
+        return !_failed;
+    }
+
+    bool failed()
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        return _failed;
+    }
+
+private:
+    struct Task
+    {
+        std::vector<uint8_t> data;
+        const RequestMap *entry;
+    };
+
+    void worker_loop()
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+
+        while (true) {
+            _cv_work.wait(lock, [&]{
+                return _stop || !_queue.empty();
+            });
+            if (_stop) {
+                break;
+            }
+
+            Task task = std::move(_queue.front());
+            _queue.pop_front();
+
+            lock.unlock();
+            bool ret = v3_process_request(_fd, task.entry,
+                                          v3::GetRequest(task.data.data()),
+                                          task.data.size());
+            lock.lock();
+
+            if (!ret) {
+                _failed = true;
+            }
+            --_pending;
+            _cv_idle.notify_all();
+        }
+    }
+
+    int _fd;
+    unsigned int _n_threads;
+    std::mutex _lock;
+    std::condition_variable _cv_work;
+    std::condition_variable _cv_idle;
+    std::deque<Task> _queue;
+    std::vector<std::thread> _threads;
+    std::size_t _pending = 0;
+    bool _stop = false;
+    bool _failed = false;
 };
 
 bool connection_version_3(int fd)
@@ -1451,41 +2610,49 @@ bool connection_version_3(int fd)
         fd_map.clear();
     });
 
+    // Destroyed before close_all_fds runs
+    ConcurrentDispatcher fast_dispatcher(fd, V3_MAX_WORKERS);
+    ConcurrentDispatcher slow_dispatcher(fd, V3_MAX_SLOW_WORKERS);
+
+    util::SocketFramedReader reader(fd);
+
     while (1) {
-        std::vector<uint8_t> data;
-        if (!util::socket_read_bytes(fd, &data)) {
+        const uint8_t *data;
+        size_t size;
+        if (!reader.read(&data, &size)) {
+            return false;
+        }
+
+        if (fast_dispatcher.failed() || slow_dispatcher.failed()) {
             return false;
         }
 
-        auto verifier = fb::Verifier(data.data(), data.size());
+        auto verifier = fb::Verifier(data, size);
         if (!v3::VerifyRequestBuffer(verifier)) {
             LOGE("Received invalid buffer");
             return false;
         }
 
-        const v3::Request *request = v3::GetRequest(data.data());
-        v3::RequestType type = request->request_type();
-        request_handler_fn fn = nullptr;
+        const v3::Request *request = v3::GetRequest(data);
+        const RequestMap *entry = find_handler(request->request_type());
 
-        for (auto iter = request_map; iter->fn; ++iter) {
-            if (type == iter->type) {
-                fn = iter->fn;
-                break;
+        if (entry && request->request_id() != 0) {
+            if (entry->mode == DISPATCH_FAST) {
+                fast_dispatcher.submit(data, size, entry);
+                continue;
+            } else if (entry->mode == DISPATCH_SLOW) {
+                slow_dispatcher.submit(data, size, entry);
+                continue;
             }
         }
 
-        // NOTE: A false return value indicates a connection error, not a
-        //       command failure!
-        bool ret = true;
-
-        if (fn) {
-            ret = fn(fd, request);
-        } else {
-            // Invalid command; allow further commands
-            ret = v3_send_response_unsupported(fd);
+        // Everything else is processed in order, after all outstanding
+        // concurrent requests have completed
+        if (!slow_dispatcher.wait_idle() || !fast_dispatcher.wait_idle()) {
+            return false;
         }
 
-        if (!ret) {
+        if (!v3_process_request(fd, entry, request, size)) {
             return false;
         }
     }
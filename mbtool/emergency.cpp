@@ -265,6 +265,8 @@ bool emergency_reboot()
         LOGI("Dumping kernel log to %s", log_path.c_str());
 
         rename(log_path.c_str(), log_path_old.c_str());
+        // Make sure queued messages have reached the kernel log
+        log::log_flush();
         dump_kernel_log(log_path.c_str());
         sync();
 
@@ -0,0 +1,1098 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "ext4_extract.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "mbcommon/common.h"
+#include "mbcommon/endian.h"
+#include "mblog/logging.h"
+#include "mbutil/finally.h"
+
+#define EXT4_SUPERBLOCK_OFFSET          1024
+#define EXT4_SUPERBLOCK_SIZE            1024
+#define EXT4_SUPER_MAGIC                0xef53
+#define EXT4_ROOT_INO                   2
+#define EXT4_GOOD_OLD_INODE_SIZE        128
+#define EXT4_N_BLOCKS_SIZE              60
+
+#define EXT4_SB_INODES_COUNT            0x00
+#define EXT4_SB_BLOCKS_COUNT_LO         0x04
+#define EXT4_SB_FIRST_DATA_BLOCK        0x14
+#define EXT4_SB_LOG_BLOCK_SIZE          0x18
+#define EXT4_SB_BLOCKS_PER_GROUP        0x20
+#define EXT4_SB_INODES_PER_GROUP        0x28
+#define EXT4_SB_MAGIC                   0x38
+#define EXT4_SB_REV_LEVEL               0x4c
+#define EXT4_SB_INODE_SIZE              0x58
+#define EXT4_SB_FEATURE_INCOMPAT        0x60
+#define EXT4_SB_FEATURE_RO_COMPAT       0x64
+#define EXT4_SB_DESC_SIZE               0xfe
+#define EXT4_SB_BLOCKS_COUNT_HI         0x150
+
+#define EXT4_GD_INODE_TABLE_LO          0x08
+#define EXT4_GD_INODE_TABLE_HI          0x28
+
+#define EXT4_INODE_MODE                 0x00
+#define EXT4_INODE_UID                  0x02
+#define EXT4_INODE_SIZE_LO              0x04
+#define EXT4_INODE_GID                  0x18
+#define EXT4_INODE_LINKS_COUNT          0x1a
+#define EXT4_INODE_BLOCKS_LO            0x1c
+#define EXT4_INODE_FLAGS                0x20
+#define EXT4_INODE_BLOCK                0x28
+#define EXT4_INODE_FILE_ACL_LO          0x68
+#define EXT4_INODE_SIZE_HIGH            0x6c
+#define EXT4_INODE_BLOCKS_HIGH          0x74
+#define EXT4_INODE_FILE_ACL_HIGH        0x76
+#define EXT4_INODE_UID_HIGH             0x78
+#define EXT4_INODE_GID_HIGH             0x7a
+#define EXT4_INODE_EXTRA_ISIZE          0x80
+
+#define EXT4_FEATURE_INCOMPAT_FILETYPE  0x0002
+#define EXT4_FEATURE_INCOMPAT_RECOVER   0x0004
+#define EXT4_FEATURE_INCOMPAT_EXTENTS   0x0040
+#define EXT4_FEATURE_INCOMPAT_64BIT     0x0080
+#define EXT4_FEATURE_INCOMPAT_MMP       0x0100
+#define EXT4_FEATURE_INCOMPAT_FLEX_BG   0x0200
+#define EXT4_FEATURE_INCOMPAT_CSUM_SEED 0x2000
+#define EXT4_FEATURE_INCOMPAT_LARGEDIR  0x4000
+#define EXT4_FEATURE_RO_COMPAT_HUGE_FILE 0x0008
+
+// Anything else (eg. meta_bg, inline_data, encryption) changes how the
+// metadata or data needs to be read
+#define EXT4_SUPPORTED_INCOMPAT \
+    (EXT4_FEATURE_INCOMPAT_FILETYPE \
+    | EXT4_FEATURE_INCOMPAT_EXTENTS \
+    | EXT4_FEATURE_INCOMPAT_64BIT \
+    | EXT4_FEATURE_INCOMPAT_MMP \
+    | EXT4_FEATURE_INCOMPAT_FLEX_BG \
+    | EXT4_FEATURE_INCOMPAT_CSUM_SEED \
+    | EXT4_FEATURE_INCOMPAT_LARGEDIR)
+
+#define EXT4_HUGE_FILE_FL               0x00040000
+#define EXT4_EXTENTS_FL                 0x00080000
+#define EXT4_INLINE_DATA_FL             0x10000000
+
+#define EXT4_EXT_MAGIC                  0xf30a
+#define EXT4_EXT_HEADER_SIZE            12
+#define EXT4_EXT_ENTRY_SIZE             12
+#define EXT4_EXT_MAX_DEPTH              5
+#define EXT4_EXT_INIT_MAX_LEN           32768
+
+#define EXT4_NDIR_BLOCKS                12
+#define EXT4_IND_BLOCK                  12
+#define EXT4_DIND_BLOCK                 13
+#define EXT4_TIND_BLOCK                 14
+
+#define EXT4_DIRENT_HEADER_SIZE         8
+
+#define EXT4_XATTR_MAGIC                0xea020000
+#define EXT4_XATTR_BLOCK_HEADER_SIZE    32
+#define EXT4_XATTR_ENTRY_SIZE           16
+
+#define EXT4_XATTR_INDEX_USER           1
+#define EXT4_XATTR_INDEX_TRUSTED        4
+#define EXT4_XATTR_INDEX_SECURITY       6
+#define EXT4_XATTR_INDEX_SYSTEM         7
+
+// Maximum amount of file data read or written per syscall
+#define EXTRACT_BUF_SIZE                (1024 * 1024)
+
+namespace mb
+{
+
+static inline uint16_t get_le16(const unsigned char *buf, size_t offset = 0)
+{
+    uint16_t value;
+    memcpy(&value, buf + offset, sizeof(value));
+    return mb_le16toh(value);
+}
+
+static inline uint32_t get_le32(const unsigned char *buf, size_t offset = 0)
+{
+    uint32_t value;
+    memcpy(&value, buf + offset, sizeof(value));
+    return mb_le32toh(value);
+}
+
+static bool pread_fully(int fd, void *buf, size_t size, uint64_t offset)
+{
+    size_t total = 0;
+
+    while (total < size) {
+        ssize_t n = pread64(fd, static_cast<char *>(buf) + total,
+                            size - total, offset + total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return false;
+        } else if (n == 0) {
+            errno = EIO;
+            return false;
+        }
+        total += n;
+    }
+
+    return true;
+}
+
+static bool pwrite_fully(int fd, const void *buf, size_t size, uint64_t offset)
+{
+    size_t total = 0;
+
+    while (total < size) {
+        ssize_t n = pwrite64(fd, static_cast<const char *>(buf) + total,
+                             size - total, offset + total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        total += n;
+    }
+
+    return true;
+}
+
+// Contiguous range of file blocks
+struct Ext4Run
+{
+    uint64_t logical;
+    uint64_t physical;
+    uint64_t length;
+    // Preallocated, but unwritten (reads as zeros)
+    bool uninit;
+};
+
+struct Ext4Inode
+{
+    uint32_t ino;
+    uint16_t mode;
+    uid_t uid;
+    gid_t gid;
+    uint64_t size;
+    uint16_t links_count;
+    uint32_t flags;
+    uint64_t blocks;
+    uint64_t file_acl;
+    unsigned char block[EXT4_N_BLOCKS_SIZE];
+    // In-inode xattr area (after i_extra_isize)
+    std::vector<unsigned char> xattr_area;
+};
+
+struct Ext4Xattr
+{
+    std::string name;
+    std::string value;
+};
+
+class Ext4Extractor
+{
+public:
+    Ext4Extractor(const std::string &image, const std::string &target);
+    ~Ext4Extractor();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(Ext4Extractor)
+
+    bool run();
+
+private:
+    bool read_superblock();
+    bool read_inode(uint32_t ino, Ext4Inode &inode);
+    bool get_runs(const Ext4Inode &inode, std::vector<Ext4Run> &runs);
+    bool add_extent_node(const unsigned char *node, size_t size,
+                         int depth_limit, std::vector<Ext4Run> &runs);
+    bool add_indirect_block(uint64_t block, int level, uint64_t &logical,
+                            std::vector<Ext4Run> &runs);
+    void add_block(uint64_t logical, uint64_t physical,
+                   std::vector<Ext4Run> &runs);
+    bool read_data(const Ext4Inode &inode, std::vector<unsigned char> &data);
+    bool read_xattrs(const Ext4Inode &inode, std::vector<Ext4Xattr> &xattrs);
+
+    bool extract_inode(uint32_t ino, const std::string &path, int level);
+    bool extract_dir(const Ext4Inode &inode, const std::string &path,
+                     int level);
+    bool extract_file(const Ext4Inode &inode, const std::string &path);
+    bool extract_symlink(const Ext4Inode &inode, const std::string &path);
+    bool extract_special(const Ext4Inode &inode, const std::string &path);
+    bool apply_attrs(const Ext4Inode &inode, const std::string &path);
+
+    std::string _image;
+    std::string _target;
+    int _fd;
+
+    uint32_t _block_size;
+    uint64_t _block_count;
+    uint32_t _inodes_count;
+    uint32_t _inodes_per_group;
+    uint32_t _inode_size;
+    uint32_t _ro_compat;
+    std::vector<uint64_t> _inode_tables;
+
+    std::vector<unsigned char> _buf;
+    // Inodes with multiple links that have already been extracted
+    std::unordered_map<uint32_t, std::string> _links;
+    // Directories currently being extracted (to detect loops)
+    std::unordered_set<uint32_t> _dirs;
+};
+
+Ext4Extractor::Ext4Extractor(const std::string &image,
+                             const std::string &target)
+    : _image(image)
+    , _target(target)
+    , _fd(-1)
+    , _block_size(0)
+    , _block_count(0)
+    , _inodes_count(0)
+    , _inodes_per_group(0)
+    , _inode_size(0)
+    , _ro_compat(0)
+{
+}
+
+Ext4Extractor::~Ext4Extractor()
+{
+    if (_fd >= 0) {
+        close(_fd);
+    }
+}
+
+bool Ext4Extractor::run()
+{
+    _fd = open(_image.c_str(), O_RDONLY | O_CLOEXEC | O_LARGEFILE);
+    if (_fd < 0) {
+        LOGE("%s: Failed to open for reading: %s",
+             _image.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!read_superblock()) {
+        return false;
+    }
+
+    _buf.resize(EXTRACT_BUF_SIZE);
+
+    return extract_inode(EXT4_ROOT_INO, _target, 0);
+}
+
+bool Ext4Extractor::read_superblock()
+{
+    unsigned char sb[EXT4_SUPERBLOCK_SIZE];
+
+    if (!pread_fully(_fd, sb, sizeof(sb), EXT4_SUPERBLOCK_OFFSET)) {
+        LOGE("%s: Failed to read superblock: %s",
+             _image.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (get_le16(sb, EXT4_SB_MAGIC) != EXT4_SUPER_MAGIC) {
+        LOGE("%s: Not an ext4 image", _image.c_str());
+        return false;
+    }
+
+    uint32_t incompat = get_le32(sb, EXT4_SB_FEATURE_INCOMPAT);
+    if (incompat & EXT4_FEATURE_INCOMPAT_RECOVER) {
+        LOGE("%s: Journal needs to be recovered", _image.c_str());
+        return false;
+    } else if (incompat & ~EXT4_SUPPORTED_INCOMPAT) {
+        LOGE("%s: Unsupported ext4 features: 0x%" PRIx32, _image.c_str(),
+             incompat & ~EXT4_SUPPORTED_INCOMPAT);
+        return false;
+    }
+
+    uint32_t log_block_size = get_le32(sb, EXT4_SB_LOG_BLOCK_SIZE);
+    if (log_block_size > 6) {
+        LOGE("%s: Invalid block size", _image.c_str());
+        return false;
+    }
+
+    bool is_64bit = incompat & EXT4_FEATURE_INCOMPAT_64BIT;
+    uint32_t first_data_block = get_le32(sb, EXT4_SB_FIRST_DATA_BLOCK);
+    uint32_t blocks_per_group = get_le32(sb, EXT4_SB_BLOCKS_PER_GROUP);
+    uint32_t desc_size = is_64bit ? get_le16(sb, EXT4_SB_DESC_SIZE) : 32;
+
+    _block_size = 1024u << log_block_size;
+    _block_count = get_le32(sb, EXT4_SB_BLOCKS_COUNT_LO);
+    if (is_64bit) {
+        _block_count |= static_cast<uint64_t>(
+                get_le32(sb, EXT4_SB_BLOCKS_COUNT_HI)) << 32;
+    }
+    _inodes_count = get_le32(sb, EXT4_SB_INODES_COUNT);
+    _inodes_per_group = get_le32(sb, EXT4_SB_INODES_PER_GROUP);
+    _inode_size = get_le32(sb, EXT4_SB_REV_LEVEL) == 0
+            ? EXT4_GOOD_OLD_INODE_SIZE : get_le16(sb, EXT4_SB_INODE_SIZE);
+    _ro_compat = get_le32(sb, EXT4_SB_FEATURE_RO_COMPAT);
+
+    if (blocks_per_group == 0 || _inodes_per_group == 0
+            || _block_count <= first_data_block
+            || _inode_size < EXT4_GOOD_OLD_INODE_SIZE
+            || _inode_size > _block_size
+            || desc_size < 32 || desc_size > _block_size) {
+        LOGE("%s: Invalid ext4 superblock", _image.c_str());
+        return false;
+    }
+
+    uint64_t group_count = (_block_count - first_data_block
+            + blocks_per_group - 1) / blocks_per_group;
+    if (static_cast<uint64_t>(_inodes_count)
+            > group_count * _inodes_per_group) {
+        LOGE("%s: Invalid inode count", _image.c_str());
+        return false;
+    }
+
+    std::vector<unsigned char> gdt(group_count * desc_size);
+    if (!pread_fully(_fd, gdt.data(), gdt.size(),
+                     (static_cast<uint64_t>(first_data_block) + 1)
+                     * _block_size)) {
+        LOGE("%s: Failed to read group descriptors: %s",
+             _image.c_str(), strerror(errno));
+        return false;
+    }
+
+    _inode_tables.resize(group_count);
+    for (uint64_t group = 0; group < group_count; ++group) {
+        const unsigned char *desc = gdt.data() + group * desc_size;
+        uint64_t table = get_le32(desc, EXT4_GD_INODE_TABLE_LO);
+        if (is_64bit) {
+            table |= static_cast<uint64_t>(
+                    get_le32(desc, EXT4_GD_INODE_TABLE_HI)) << 32;
+        }
+        _inode_tables[group] = table;
+    }
+
+    return true;
+}
+
+bool Ext4Extractor::read_inode(uint32_t ino, Ext4Inode &inode)
+{
+    if (ino == 0 || ino > _inodes_count) {
+        LOGE("%s: Invalid inode number %" PRIu32, _image.c_str(), ino);
+        return false;
+    }
+
+    uint32_t group = (ino - 1) / _inodes_per_group;
+    uint32_t index = (ino - 1) % _inodes_per_group;
+    uint64_t offset = _inode_tables[group] * _block_size
+            + static_cast<uint64_t>(index) * _inode_size;
+
+    std::vector<unsigned char> raw(_inode_size);
+    if (!pread_fully(_fd, raw.data(), raw.size(), offset)) {
+        LOGE("%s: Failed to read inode %" PRIu32 ": %s",
+             _image.c_str(), ino, strerror(errno));
+        return false;
+    }
+
+    const unsigned char *p = raw.data();
+
+    inode.ino = ino;
+    inode.mode = get_le16(p, EXT4_INODE_MODE);
+    inode.uid = get_le16(p, EXT4_INODE_UID)
+            | (static_cast<uint32_t>(get_le16(p, EXT4_INODE_UID_HIGH)) << 16);
+    inode.gid = get_le16(p, EXT4_INODE_GID)
+            | (static_cast<uint32_t>(get_le16(p, EXT4_INODE_GID_HIGH)) << 16);
+    inode.size = get_le32(p, EXT4_INODE_SIZE_LO)
+            | (static_cast<uint64_t>(get_le32(p, EXT4_INODE_SIZE_HIGH)) << 32);
+    inode.links_count = get_le16(p, EXT4_INODE_LINKS_COUNT);
+    inode.flags = get_le32(p, EXT4_INODE_FLAGS);
+    inode.blocks = get_le32(p, EXT4_INODE_BLOCKS_LO);
+    if (_ro_compat & EXT4_FEATURE_RO_COMPAT_HUGE_FILE) {
+        inode.blocks |= static_cast<uint64_t>(
+                get_le16(p, EXT4_INODE_BLOCKS_HIGH)) << 32;
+        if (inode.flags & EXT4_HUGE_FILE_FL) {
+            // Counted in filesystem blocks instead of 512-byte sectors
+            inode.blocks *= _block_size / 512;
+        }
+    }
+    inode.file_acl = get_le32(p, EXT4_INODE_FILE_ACL_LO)
+            | (static_cast<uint64_t>(
+                    get_le16(p, EXT4_INODE_FILE_ACL_HIGH)) << 32);
+    memcpy(inode.block, p + EXT4_INODE_BLOCK, sizeof(inode.block));
+
+    inode.xattr_area.clear();
+    if (_inode_size > EXT4_GOOD_OLD_INODE_SIZE) {
+        uint32_t xattr_offset = EXT4_GOOD_OLD_INODE_SIZE
+                + get_le16(p, EXT4_INODE_EXTRA_ISIZE);
+        if (xattr_offset + 4 <= _inode_size) {
+            inode.xattr_area.assign(p + xattr_offset, p + _inode_size);
+        }
+    }
+
+    if (inode.flags & EXT4_INLINE_DATA_FL) {
+        LOGE("%s: Inode %" PRIu32 " has unsupported inline data",
+             _image.c_str(), ino);
+        return false;
+    }
+
+    return true;
+}
+
+void Ext4Extractor::add_block(uint64_t logical, uint64_t physical,
+                              std::vector<Ext4Run> &runs)
+{
+    if (!runs.empty()) {
+        Ext4Run &last = runs.back();
+        if (!last.uninit && last.logical + last.length == logical
+                && last.physical + last.length == physical) {
+            ++last.length;
+            return;
+        }
+    }
+    runs.push_back({ logical, physical, 1, false });
+}
+
+bool Ext4Extractor::add_indirect_block(uint64_t block, int level,
+                                       uint64_t &logical,
+                                       std::vector<Ext4Run> &runs)
+{
+    uint64_t per_block = _block_size / 4;
+    uint64_t span = 1;
+    for (int i = 0; i < level; ++i) {
+        span *= per_block;
+    }
+
+    if (block == 0) {
+        // Hole
+        logical += span * per_block;
+        return true;
+    } else if (block >= _block_count) {
+        LOGE("%s: Invalid indirect block %" PRIu64, _image.c_str(), block);
+        return false;
+    }
+
+    std::vector<unsigned char> buf(_block_size);
+    if (!pread_fully(_fd, buf.data(), buf.size(), block * _block_size)) {
+        LOGE("%s: Failed to read indirect block: %s",
+             _image.c_str(), strerror(errno));
+        return false;
+    }
+
+    for (uint64_t i = 0; i < per_block; ++i) {
+        uint32_t entry = get_le32(buf.data(), i * 4);
+
+        if (level == 0) {
+            if (entry != 0) {
+                if (entry >= _block_count) {
+                    LOGE("%s: Invalid data block %" PRIu32,
+                         _image.c_str(), entry);
+                    return false;
+                }
+                add_block(logical, entry, runs);
+            }
+            ++logical;
+        } else if (!add_indirect_block(entry, level - 1, logical, runs)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Ext4Extractor::add_extent_node(const unsigned char *node, size_t size,
+                                    int depth_limit,
+                                    std::vector<Ext4Run> &runs)
+{
+    if (size < EXT4_EXT_HEADER_SIZE || get_le16(node) != EXT4_EXT_MAGIC) {
+        LOGE("%s: Invalid extent header", _image.c_str());
+        return false;
+    }
+
+    uint16_t entries = get_le16(node, 2);
+    uint16_t depth = get_le16(node, 6);
+
+    if (depth > depth_limit
+            || EXT4_EXT_HEADER_SIZE + static_cast<size_t>(entries)
+                    * EXT4_EXT_ENTRY_SIZE > size) {
+        LOGE("%s: Invalid extent node", _image.c_str());
+        return false;
+    }
+
+    for (uint16_t i = 0; i < entries; ++i) {
+        const unsigned char *e = node + EXT4_EXT_HEADER_SIZE
+                + i * EXT4_EXT_ENTRY_SIZE;
+
+        if (depth == 0) {
+            uint64_t logical = get_le32(e);
+            uint64_t length = get_le16(e, 4);
+            uint64_t physical = get_le32(e, 8)
+                    | (static_cast<uint64_t>(get_le16(e, 6)) << 32);
+            bool uninit = length > EXT4_EXT_INIT_MAX_LEN;
+
+            if (uninit) {
+                length -= EXT4_EXT_INIT_MAX_LEN;
+            }
+
+            if (physical >= _block_count
+                    || length > _block_count - physical) {
+                LOGE("%s: Extent extends past end of filesystem",
+                     _image.c_str());
+                return false;
+            }
+
+            runs.push_back({ logical, physical, length, uninit });
+        } else {
+            uint64_t leaf = get_le32(e, 4)
+                    | (static_cast<uint64_t>(get_le16(e, 8)) << 32);
+
+            if (leaf >= _block_count) {
+                LOGE("%s: Invalid extent index block %" PRIu64,
+                     _image.c_str(), leaf);
+                return false;
+            }
+
+            std::vector<unsigned char> buf(_block_size);
+            if (!pread_fully(_fd, buf.data(), buf.size(),
+                             leaf * _block_size)) {
+                LOGE("%s: Failed to read extent block: %s",
+                     _image.c_str(), strerror(errno));
+                return false;
+            }
+
+            if (!add_extent_node(buf.data(), buf.size(), depth - 1, runs)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Get the file's data blocks, sorted by logical block number. Holes are not
+ * included.
+ */
+bool Ext4Extractor::get_runs(const Ext4Inode &inode,
+                             std::vector<Ext4Run> &runs)
+{
+    runs.clear();
+
+    if (inode.flags & EXT4_EXTENTS_FL) {
+        if (!add_extent_node(inode.block, sizeof(inode.block),
+                             EXT4_EXT_MAX_DEPTH, runs)) {
+            return false;
+        }
+    } else {
+        uint64_t logical = 0;
+
+        for (int i = 0; i < EXT4_NDIR_BLOCKS; ++i, ++logical) {
+            uint32_t block = get_le32(inode.block, i * 4);
+            if (block == 0) {
+                continue;
+            } else if (block >= _block_count) {
+                LOGE("%s: Invalid data block %" PRIu32, _image.c_str(), block);
+                return false;
+            }
+            add_block(logical, block, runs);
+        }
+
+        static const int levels[] = { EXT4_IND_BLOCK, EXT4_DIND_BLOCK,
+                                      EXT4_TIND_BLOCK };
+        for (int i = 0; i < 3; ++i) {
+            uint32_t block = get_le32(inode.block, levels[i] * 4);
+            if (!add_indirect_block(block, i, logical, runs)) {
+                return false;
+            }
+        }
+    }
+
+    std::sort(runs.begin(), runs.end(),
+              [](const Ext4Run &a, const Ext4Run &b) {
+        return a.logical < b.logical;
+    });
+
+    return true;
+}
+
+bool Ext4Extractor::read_data(const Ext4Inode &inode,
+                              std::vector<unsigned char> &data)
+{
+    std::vector<Ext4Run> runs;
+    if (!get_runs(inode, runs)) {
+        return false;
+    }
+
+    data.assign(static_cast<size_t>(inode.size), 0);
+
+    for (const Ext4Run &run : runs) {
+        uint64_t offset = run.logical * _block_size;
+        if (run.uninit || offset >= inode.size) {
+            continue;
+        }
+
+        size_t n = static_cast<size_t>(std::min<uint64_t>(
+                run.length * _block_size, inode.size - offset));
+        if (!pread_fully(_fd, data.data() + offset, n,
+                         run.physical * _block_size)) {
+            LOGE("%s: Failed to read data for inode %" PRIu32 ": %s",
+                 _image.c_str(), inode.ino, strerror(errno));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool parse_xattr_entries(const unsigned char *entries,
+                                const unsigned char *end,
+                                const unsigned char *values,
+                                size_t values_size,
+                                std::vector<Ext4Xattr> &xattrs)
+{
+    const unsigned char *p = entries;
+
+    while (end - p >= 4 && get_le32(p) != 0) {
+        if (end - p < EXT4_XATTR_ENTRY_SIZE) {
+            return false;
+        }
+
+        uint8_t name_len = p[0];
+        uint8_t name_index = p[1];
+        uint16_t value_offset = get_le16(p, 2);
+        uint32_t value_inum = get_le32(p, 4);
+        uint32_t value_size = get_le32(p, 8);
+        size_t entry_size = (EXT4_XATTR_ENTRY_SIZE + name_len + 3) & ~3u;
+
+        if (static_cast<size_t>(end - p) < entry_size
+                || value_inum != 0
+                || value_offset > values_size
+                || value_size > values_size - value_offset) {
+            return false;
+        }
+
+        std::string name(reinterpret_cast<const char *>(
+                p + EXT4_XATTR_ENTRY_SIZE), name_len);
+        const char *prefix = nullptr;
+
+        switch (name_index) {
+        case EXT4_XATTR_INDEX_USER:
+            prefix = "user.";
+            break;
+        case EXT4_XATTR_INDEX_TRUSTED:
+            prefix = "trusted.";
+            break;
+        case EXT4_XATTR_INDEX_SECURITY:
+            prefix = "security.";
+            break;
+        case EXT4_XATTR_INDEX_SYSTEM:
+            // system.data holds inline data, which is not supported anyway
+            if (name != "data") {
+                prefix = "system.";
+            }
+            break;
+        default:
+            // POSIX ACLs use a different on-disk format. Android does not use
+            // them.
+            break;
+        }
+
+        if (prefix) {
+            xattrs.push_back({
+                prefix + name,
+                std::string(reinterpret_cast<const char *>(
+                        values + value_offset), value_size)
+            });
+        }
+
+        p += entry_size;
+    }
+
+    return true;
+}
+
+bool Ext4Extractor::read_xattrs(const Ext4Inode &inode,
+                                std::vector<Ext4Xattr> &xattrs)
+{
+    xattrs.clear();
+
+    // In-inode xattrs. Value offsets are relative to the first entry.
+    if (inode.xattr_area.size() >= 4
+            && get_le32(inode.xattr_area.data()) == EXT4_XATTR_MAGIC) {
+        const unsigned char *entries = inode.xattr_area.data() + 4;
+        const unsigned char *end = inode.xattr_area.data()
+                + inode.xattr_area.size();
+
+        if (!parse_xattr_entries(entries, end, entries, end - entries,
+                                 xattrs)) {
+            LOGE("%s: Invalid in-inode xattrs for inode %" PRIu32,
+                 _image.c_str(), inode.ino);
+            return false;
+        }
+    }
+
+    // External xattr block. Value offsets are relative to the block.
+    if (inode.file_acl != 0) {
+        if (inode.file_acl >= _block_count) {
+            LOGE("%s: Invalid xattr block for inode %" PRIu32,
+                 _image.c_str(), inode.ino);
+            return false;
+        }
+
+        std::vector<unsigned char> buf(_block_size);
+        if (!pread_fully(_fd, buf.data(), buf.size(),
+                         inode.file_acl * _block_size)) {
+            LOGE("%s: Failed to read xattr block: %s",
+                 _image.c_str(), strerror(errno));
+            return false;
+        }
+
+        if (get_le32(buf.data()) != EXT4_XATTR_MAGIC
+                || !parse_xattr_entries(
+                        buf.data() + EXT4_XATTR_BLOCK_HEADER_SIZE,
+                        buf.data() + buf.size(), buf.data(), buf.size(),
+                        xattrs)) {
+            LOGE("%s: Invalid xattr block for inode %" PRIu32,
+                 _image.c_str(), inode.ino);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Ext4Extractor::apply_attrs(const Ext4Inode &inode,
+                                const std::string &path)
+{
+    if (lchown(path.c_str(), inode.uid, inode.gid) < 0) {
+        LOGE("%s: Failed to chown: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!S_ISLNK(inode.mode) && chmod(path.c_str(), inode.mode & 07777) < 0) {
+        LOGE("%s: Failed to chmod: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::vector<Ext4Xattr> xattrs;
+    if (!read_xattrs(inode, xattrs)) {
+        return false;
+    }
+
+    for (const Ext4Xattr &xattr : xattrs) {
+        if (lsetxattr(path.c_str(), xattr.name.c_str(), xattr.value.data(),
+                      xattr.value.size(), 0) < 0) {
+            if (errno == ENOTSUP) {
+                LOGV("%s: xattrs not supported on target filesystem",
+                     path.c_str());
+                break;
+            } else {
+                LOGE("%s: Failed to set xattr %s: %s", path.c_str(),
+                     xattr.name.c_str(), strerror(errno));
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool Ext4Extractor::extract_dir(const Ext4Inode &inode,
+                                const std::string &path, int level)
+{
+    if (!_dirs.insert(inode.ino).second) {
+        LOGE("%s: Directory loop at inode %" PRIu32,
+             _image.c_str(), inode.ino);
+        return false;
+    }
+
+    auto leave_dir = util::finally([&] {
+        _dirs.erase(inode.ino);
+    });
+
+    if (mkdir(path.c_str(), 0700) < 0 && errno != EEXIST) {
+        LOGE("%s: Failed to create directory: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::vector<unsigned char> data;
+    if (!read_data(inode, data)) {
+        return false;
+    }
+
+    // If a directory is indexed, the htree nodes look like empty entries, so
+    // the blocks can still be read linearly
+    for (size_t block = 0; block < data.size(); block += _block_size) {
+        size_t block_end = std::min<size_t>(block + _block_size, data.size());
+        size_t pos = block;
+
+        while (block_end - pos >= EXT4_DIRENT_HEADER_SIZE) {
+            const unsigned char *d = data.data() + pos;
+            uint32_t child = get_le32(d);
+            uint16_t rec_len = get_le16(d, 4);
+            uint8_t name_len = d[6];
+
+            if (rec_len < EXT4_DIRENT_HEADER_SIZE || rec_len > block_end - pos
+                    || name_len > rec_len - EXT4_DIRENT_HEADER_SIZE) {
+                LOGE("%s: Invalid directory entry in inode %" PRIu32,
+                     _image.c_str(), inode.ino);
+                return false;
+            }
+
+            pos += rec_len;
+
+            if (child == 0) {
+                continue;
+            }
+
+            std::string name(reinterpret_cast<const char *>(
+                    d + EXT4_DIRENT_HEADER_SIZE), name_len);
+
+            if (name == "." || name == ".."
+                    || name.find('/') != std::string::npos) {
+                continue;
+            }
+
+            // Same as copy_system()
+            if (level == 0 && name == "multiboot") {
+                continue;
+            }
+
+            if (!extract_inode(child, path + "/" + name, level + 1)) {
+                return false;
+            }
+        }
+    }
+
+    // Set attributes last so that a read-only directory can still be
+    // populated and the SELinux label does not affect its children
+    return apply_attrs(inode, path);
+}
+
+bool Ext4Extractor::extract_file(const Ext4Inode &inode,
+                                 const std::string &path)
+{
+    std::vector<Ext4Run> runs;
+    if (!get_runs(inode, runs)) {
+        return false;
+    }
+
+    if (unlink(path.c_str()) < 0 && errno != ENOENT) {
+        LOGE("%s: Failed to remove existing file: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    int fd = open(path.c_str(),
+                  O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_LARGEFILE, 0600);
+    if (fd < 0) {
+        LOGE("%s: Failed to open for writing: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd = util::finally([&] {
+        close(fd);
+    });
+
+    // Copy each run with large sequential reads. Holes and unwritten extents
+    // are left as holes in the output file.
+    for (const Ext4Run &run : runs) {
+        uint64_t offset = run.logical * _block_size;
+        if (run.uninit || offset >= inode.size) {
+            continue;
+        }
+
+        uint64_t remaining = std::min<uint64_t>(
+                run.length * _block_size, inode.size - offset);
+        uint64_t source = run.physical * _block_size;
+
+        while (remaining > 0) {
+            size_t n = static_cast<size_t>(
+                    std::min<uint64_t>(remaining, _buf.size()));
+
+            if (!pread_fully(_fd, _buf.data(), n, source)) {
+                LOGE("%s: Failed to read data for %s: %s", _image.c_str(),
+                     path.c_str(), strerror(errno));
+                return false;
+            }
+            if (!pwrite_fully(fd, _buf.data(), n, offset)) {
+                LOGE("%s: Failed to write data: %s",
+                     path.c_str(), strerror(errno));
+                return false;
+            }
+
+            source += n;
+            offset += n;
+            remaining -= n;
+        }
+    }
+
+    if (ftruncate64(fd, static_cast<off64_t>(inode.size)) < 0) {
+        LOGE("%s: Failed to set file size: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return apply_attrs(inode, path);
+}
+
+bool Ext4Extractor::extract_symlink(const Ext4Inode &inode,
+                                    const std::string &path)
+{
+    std::string target;
+    uint64_t xattr_blocks = inode.file_acl ? _block_size / 512 : 0;
+
+    if (inode.size >= _block_size) {
+        LOGE("%s: Symlink target too long for inode %" PRIu32,
+             _image.c_str(), inode.ino);
+        return false;
+    } else if (inode.size < EXT4_N_BLOCKS_SIZE
+            && inode.blocks <= xattr_blocks) {
+        // Fast symlink stored in i_block
+        target.assign(reinterpret_cast<const char *>(inode.block),
+                      static_cast<size_t>(inode.size));
+    } else {
+        std::vector<unsigned char> data;
+        if (!read_data(inode, data)) {
+            return false;
+        }
+        target.assign(data.begin(), data.end());
+    }
+
+    if (unlink(path.c_str()) < 0 && errno != ENOENT) {
+        LOGE("%s: Failed to remove existing file: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (symlink(target.c_str(), path.c_str()) < 0) {
+        LOGE("%s: Failed to create symlink: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return apply_attrs(inode, path);
+}
+
+bool Ext4Extractor::extract_special(const Ext4Inode &inode,
+                                    const std::string &path)
+{
+    dev_t dev = 0;
+
+    if (S_ISCHR(inode.mode) || S_ISBLK(inode.mode)) {
+        uint32_t old_dev = get_le32(inode.block, 0);
+        uint32_t new_dev = get_le32(inode.block, 4);
+
+        if (old_dev != 0) {
+            dev = makedev((old_dev >> 8) & 0xff, old_dev & 0xff);
+        } else {
+            dev = makedev((new_dev >> 8) & 0xfff,
+                          (new_dev & 0xff) | ((new_dev >> 12) & 0xfff00));
+        }
+    }
+
+    if (unlink(path.c_str()) < 0 && errno != ENOENT) {
+        LOGE("%s: Failed to remove existing file: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (mknod(path.c_str(), (inode.mode & S_IFMT) | 0600, dev) < 0) {
+        LOGE("%s: Failed to create special file: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return apply_attrs(inode, path);
+}
+
+bool Ext4Extractor::extract_inode(uint32_t ino, const std::string &path,
+                                  int level)
+{
+    Ext4Inode inode;
+    if (!read_inode(ino, inode)) {
+        return false;
+    }
+
+    if (S_ISDIR(inode.mode)) {
+        return extract_dir(inode, path, level);
+    }
+
+    if (inode.links_count > 1) {
+        auto it = _links.find(ino);
+        if (it != _links.end()) {
+            if (unlink(path.c_str()) < 0 && errno != ENOENT) {
+                LOGE("%s: Failed to remove existing file: %s",
+                     path.c_str(), strerror(errno));
+                return false;
+            }
+            if (link(it->second.c_str(), path.c_str()) < 0) {
+                LOGE("%s: Failed to hard link to %s: %s", path.c_str(),
+                     it->second.c_str(), strerror(errno));
+                return false;
+            }
+            return true;
+        }
+        _links[ino] = path;
+    }
+
+    if (S_ISREG(inode.mode)) {
+        return extract_file(inode, path);
+    } else if (S_ISLNK(inode.mode)) {
+        return extract_symlink(inode, path);
+    } else if (S_ISCHR(inode.mode) || S_ISBLK(inode.mode)
+            || S_ISFIFO(inode.mode) || S_ISSOCK(inode.mode)) {
+        return extract_special(inode, path);
+    } else {
+        LOGE("%s: Inode %" PRIu32 " has invalid mode 0%o",
+             _image.c_str(), ino, inode.mode);
+        return false;
+    }
+}
+
+/*!
+ * \brief Extract the contents of an ext4 image to a directory
+ *
+ * The image is read directly, without loop-mounting it. File data is copied
+ * extent by extent with large sequential reads, and holes are preserved.
+ * Ownership, permissions, and xattrs (including SELinux labels and
+ * capabilities) are restored. Like copy_system(), the top-level `multiboot`
+ * directory is skipped.
+ *
+ * Images with features that change the on-disk layout in ways that are not
+ * handled here (eg. inline_data, meta_bg, encryption) or that need their
+ * journal replayed are rejected. Callers should fall back to mounting the
+ * image in that case.
+ *
+ * \param image Path to ext4 image
+ * \param target Target directory (created if it does not exist)
+ *
+ * \return Whether the image was successfully extracted
+ */
+bool ext4_extract_image(const std::string &image, const std::string &target)
+{
+    Ext4Extractor extractor(image, target);
+    return extractor.run();
+}
+
+}
@@ -17,13 +17,14 @@
  * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #pragma once
 
-#include <archive.h>
+#include <string>
 
 namespace mb
 {
 
-bool la_copy_data_to_fd(archive *a, int fd);
+bool ext4_extract_image(const std::string &image, const std::string &target);
 
 }
@@ -113,6 +113,15 @@ out:
 static workspace pa_workspace;
 static prop_info *pa_info_array;
 
+/* Open addressing hash index over the names in pa_info_array. It is private to
+ * this process and does not change the shared memory layout. Each slot holds
+ * (index into pa_info_array + 1) or 0 if it is empty. Entries are never
+ * removed, so linear probing needs no tombstones. */
+
+#define PA_INDEX_SIZE 512 /* Power of 2, more than twice PA_COUNT_MAX */
+
+static unsigned short pa_index[PA_INDEX_SIZE];
+
 prop_area *__legacy_property_area__;
 
 static int init_property_area(void)
@@ -151,29 +160,37 @@ static void update_prop_info(prop_info *pi, const char *value, unsigned len)
     __futex_wake(&pi->serial, INT32_MAX);
 }
 
-static const prop_info *__legacy_property_find(const char *name)
+/* FNV-1a */
+static unsigned hash_name(const char *name, unsigned len)
+{
+    unsigned hash = 2166136261u;
+
+    for (unsigned i = 0; i < len; ++i) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/* Returns the slot containing name or the empty slot where it belongs */
+static unsigned __legacy_property_slot(const char *name, unsigned len)
 {
     prop_area *pa = __legacy_property_area__;
-    unsigned count = pa->count;
-    unsigned *toc = pa->toc;
-    unsigned len = strlen(name);
-    prop_info *pi;
+    unsigned slot = hash_name(name, len) & (PA_INDEX_SIZE - 1);
 
-    while (count--) {
-        unsigned entry = *toc++;
-        if (TOC_NAME_LEN(entry) != len) {
-            continue;
-        }
+    while (pa_index[slot] != 0) {
+        unsigned entry = pa->toc[pa_index[slot] - 1];
 
-        pi = TOC_TO_INFO(pa, entry);
-        if (memcmp(name, pi->name, len) != 0) {
-            continue;
+        if (TOC_NAME_LEN(entry) == len
+                && memcmp(name, TOC_TO_INFO(pa, entry)->name, len) == 0) {
+            break;
         }
 
-        return pi;
+        slot = (slot + 1) & (PA_INDEX_SIZE - 1);
     }
 
-    return 0;
+    return slot;
 }
 
 int legacy_property_set(const char *name, const char *value)
@@ -190,20 +207,21 @@ int legacy_property_set(const char *name, const char *value)
         return -1;
     }
 
-    pi = (prop_info *) __legacy_property_find(name);
+    pa = __legacy_property_area__;
+
+    unsigned slot = __legacy_property_slot(name, namelen);
 
-    if (pi != 0) {
+    if (pa_index[slot] != 0) {
         // ro.* properties may NEVER be modified once set
         if (strncmp(name, "ro.", 3) == 0) {
             return -1;
         }
 
-        pa = __legacy_property_area__;
+        pi = TOC_TO_INFO(pa, pa->toc[pa_index[slot] - 1]);
         update_prop_info(pi, value, valuelen);
         pa->serial++;
         __futex_wake(&pa->serial, INT32_MAX);
     } else {
-        pa = __legacy_property_area__;
         if (pa->count == PA_COUNT_MAX) {
             return -1;
         }
@@ -217,6 +235,7 @@ int legacy_property_set(const char *name, const char *value)
                 (namelen << 24) | ((unsigned long) pi - (unsigned long) pa);
 
         pa->count++;
+        pa_index[slot] = pa->count;
         pa->serial++;
         __futex_wake(&pa->serial, INT32_MAX);
     }
@@ -19,12 +19,24 @@
 
 #include "image.h"
 
+#include <algorithm>
+
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
 #include <inttypes.h>
+#include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <unistd.h>
 
+#include "mbcommon/endian.h"
+#include "mbcommon/file/standard.h"
+#include "mbcommon/file_util.h"
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
+#include "mbutil/blkid.h"
 #include "mbutil/command.h"
 #include "mbutil/directory.h"
 #include "mbutil/mount.h"
@@ -42,7 +54,76 @@ static void output_cb(const char *line, bool error, void *userdata)
     LOGV("%s: %s", args[0], line);
 }
 
-CreateImageResult create_ext4_image(const std::string &path, uint64_t size)
+// mke2fs gained -d (populate from a directory, including xattrs) in 1.43
+#define MKE2FS_MIN_MAJOR                1
+#define MKE2FS_MIN_MINOR                43
+
+// Fixed feature set that the kernels we run on (3.x and newer) can mount.
+// Newer mke2fs versions enable features like metadata_csum, 64bit, and
+// orphan_file by default. uninit_bg allows lazy inode table initialization.
+#define MKE2FS_FEATURES                 "none,has_journal,ext_attr," \
+                                        "resize_inode,dir_index,filetype," \
+                                        "extent,flex_bg,sparse_super," \
+                                        "large_file,huge_file,uninit_bg," \
+                                        "dir_nlink,extra_isize"
+
+struct Mke2fsVersion
+{
+    int major = 0;
+    int minor = 0;
+};
+
+static void mke2fs_version_cb(const char *line, bool error, void *userdata)
+{
+    (void) error;
+
+    Mke2fsVersion *version = static_cast<Mke2fsVersion *>(userdata);
+    int major;
+    int minor;
+
+    // eg. "mke2fs 1.43.3 (04-Sep-2016)"
+    if (version->major == 0
+            && sscanf(line, "mke2fs %d.%d", &major, &minor) == 2) {
+        version->major = major;
+        version->minor = minor;
+    }
+}
+
+/*!
+ * \brief Check if mke2fs is available and new enough
+ *
+ * The result is cached since it cannot change while we are running.
+ */
+static bool have_usable_mke2fs()
+{
+    static int have_mke2fs = -1;
+
+    if (have_mke2fs < 0) {
+        Mke2fsVersion version;
+        const char *argv[] = { "mke2fs", "-V", nullptr };
+
+        int ret = util::run_command(argv[0], argv, nullptr, nullptr,
+                                    &mke2fs_version_cb, &version);
+        have_mke2fs = ret >= 0 && WIFEXITED(ret) && WEXITSTATUS(ret) == 0
+                && (version.major > MKE2FS_MIN_MAJOR
+                        || (version.major == MKE2FS_MIN_MAJOR
+                                && version.minor >= MKE2FS_MIN_MINOR));
+
+        if (have_mke2fs) {
+            LOGV("Using mke2fs %d.%d to create images",
+                 version.major, version.minor);
+        } else {
+            LOGV("mke2fs >= %d.%d not found; using make_ext4fs",
+                 MKE2FS_MIN_MAJOR, MKE2FS_MIN_MINOR);
+        }
+    }
+
+    return have_mke2fs;
+}
+
+// Ensure that the image can be created at the path
+static CreateImageResult check_new_image(const std::string &path,
+                                         uint64_t size)
 {
     // Ensure we have enough space since we're creating a sparse file that may
     // get bigger
@@ -55,31 +136,333 @@ CreateImageResult create_ext4_image(const std::string &path, uint64_t size)
     }
 
     struct stat sb;
-    if (stat(path.c_str(), &sb) < 0) {
-        if (errno != ENOENT) {
-            LOGE("%s: Failed to stat: %s", path.c_str(), strerror(errno));
-            return CreateImageResult::FAILED;
+    if (stat(path.c_str(), &sb) == 0) {
+        LOGE("%s: File already exists", path.c_str());
+        return CreateImageResult::IMAGE_EXISTS;
+    } else if (errno != ENOENT) {
+        LOGE("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+        return CreateImageResult::FAILED;
+    }
+
+    return CreateImageResult::SUCCEEDED;
+}
+
+static bool run_mke2fs(const std::string &path, uint64_t size,
+                       const char *source_dir)
+{
+    char size_str[64];
+    snprintf(size_str, sizeof(size_str), "%" PRIu64 "k", size / 1024);
+
+    std::vector<const char *> argv{
+        "mke2fs", "-t", "ext4", "-F", "-q", "-b", "4096",
+        "-O", MKE2FS_FEATURES,
+        // Leave zeroing the inode tables and journal to the kernel
+        "-E", "lazy_itable_init=1,lazy_journal_init=1",
+    };
+    if (source_dir) {
+        argv.push_back("-d");
+        argv.push_back(source_dir);
+    }
+    argv.push_back(path.c_str());
+    argv.push_back(size_str);
+    argv.push_back(nullptr);
+
+    int ret = util::run_command(argv[0], argv.data(), nullptr, nullptr,
+                                &output_cb, argv.data());
+    if (ret < 0 || !WIFEXITED(ret) || WEXITSTATUS(ret) != 0) {
+        LOGE("%s: Failed to create image with mke2fs", path.c_str());
+        unlink(path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+static bool run_make_ext4fs(const std::string &path, uint64_t size)
+{
+    char size_str[64];
+    snprintf(size_str, sizeof(size_str), "%" PRIu64, size);
+
+    const char *argv[] =
+            { "make_ext4fs", "-l", size_str, path.c_str(), nullptr };
+    int ret = util::run_command(argv[0], argv, nullptr, nullptr,
+                                &output_cb, argv);
+    if (ret < 0 || WEXITSTATUS(ret) != 0) {
+        LOGE("%s: Failed to create image", path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Reserve the rest of the (sparse) image so that writes to the loop-mounted
+ * filesystem cannot fail with ENOSPC later. The unwritten extents are not
+ * zeroed, so this is fast on filesystems that support fallocate(). On those
+ * that don't (eg. vfat), the image stays sparse.
+ */
+static void reserve_image_space(const std::string &path, uint64_t size)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC | O_LARGEFILE);
+    if (fd < 0) {
+        LOGW("%s: Failed to open for reserving space: %s",
+             path.c_str(), strerror(errno));
+        return;
+    }
+
+    if (fallocate64(fd, 0, 0, static_cast<off64_t>(size)) < 0) {
+        if (errno == EOPNOTSUPP || errno == ENOSYS) {
+            LOGV("%s: fallocate() not supported; image will be sparse",
+                 path.c_str());
         } else {
-            char size_str[64];
-            snprintf(size_str, sizeof(size_str), "%" PRIu64, size);
-
-            LOGD("%s: Creating new %s ext4 image", path.c_str(), size_str);
-
-            // Create new image
-            const char *argv[] =
-                    { "make_ext4fs", "-l", size_str, path.c_str(), nullptr };
-            int ret = util::run_command(argv[0], argv, nullptr, nullptr,
-                                        &output_cb, argv);
-            if (ret < 0 || WEXITSTATUS(ret) != 0) {
-                LOGE("%s: Failed to create image", path.c_str());
-                return CreateImageResult::FAILED;
-            }
-            return CreateImageResult::SUCCEEDED;
+            LOGW("%s: Failed to reserve space: %s",
+                 path.c_str(), strerror(errno));
         }
     }
 
-    LOGE("%s: File already exists", path.c_str());
-    return CreateImageResult::IMAGE_EXISTS;
+    close(fd);
+}
+
+/*!
+ * \brief Create an empty ext4 image
+ *
+ * If mke2fs 1.43 or newer is available, the image is created with lazy inode
+ * table and journal initialization. Otherwise, make_ext4fs is used. The space
+ * for the image is reserved with fallocate() if possible.
+ *
+ * \param path Path to new image
+ * \param size Size of new image in bytes
+ */
+CreateImageResult create_ext4_image(const std::string &path, uint64_t size)
+{
+    CreateImageResult result = check_new_image(path, size);
+    if (result != CreateImageResult::SUCCEEDED) {
+        return result;
+    }
+
+    LOGD("%s: Creating new %" PRIu64 " byte ext4 image", path.c_str(), size);
+
+    if (have_usable_mke2fs()) {
+        if (!run_mke2fs(path, size, nullptr)) {
+            return CreateImageResult::FAILED;
+        }
+    } else if (!run_make_ext4fs(path, size)) {
+        return CreateImageResult::FAILED;
+    }
+
+    reserve_image_space(path, size);
+
+    return CreateImageResult::SUCCEEDED;
+}
+
+/*!
+ * \brief Create an ext4 image populated with the contents of a directory
+ *
+ * This avoids having to mount the new image and copy the files into it. The
+ * ownership, permissions, and xattrs (including SELinux labels and
+ * capabilities) of the files are preserved.
+ *
+ * Only mke2fs 1.43 and newer can do this. Like copy_system(), the top-level
+ * `multiboot` directory must not end up in the image. mke2fs cannot exclude
+ * paths, so directories containing it are not supported either.
+ *
+ * \param path Path to new image
+ * \param size Size of new image in bytes
+ * \param source_dir Directory to copy into the image
+ *
+ * \return CreateImageResult::UNSUPPORTED if the image must be populated some
+ *         other way (eg. by create_ext4_image() and copy_system())
+ */
+CreateImageResult create_ext4_image_from_dir(const std::string &path,
+                                             uint64_t size,
+                                             const std::string &source_dir)
+{
+    if (!have_usable_mke2fs()) {
+        return CreateImageResult::UNSUPPORTED;
+    }
+
+    struct stat sb;
+    if (lstat((source_dir + "/multiboot").c_str(), &sb) == 0) {
+        LOGV("%s: Contains multiboot directory; cannot populate image directly",
+             source_dir.c_str());
+        return CreateImageResult::UNSUPPORTED;
+    }
+
+    CreateImageResult result = check_new_image(path, size);
+    if (result != CreateImageResult::SUCCEEDED) {
+        return result;
+    }
+
+    LOGD("%s: Creating new %" PRIu64 " byte ext4 image from %s",
+         path.c_str(), size, source_dir.c_str());
+
+    if (!run_mke2fs(path, size, source_dir.c_str())) {
+        return CreateImageResult::FAILED;
+    }
+
+    reserve_image_space(path, size);
+
+    return CreateImageResult::SUCCEEDED;
+}
+
+/*!
+ * \brief Parse compressed image type name
+ *
+ * \param name "erofs" or "squashfs"
+ * \param type Output image type
+ *
+ * \return Whether \p name is a known type
+ */
+bool compressed_image_type_from_name(const std::string &name,
+                                     CompressedImageType &type)
+{
+    if (name == "erofs") {
+        type = CompressedImageType::EROFS_IMAGE;
+    } else if (name == "squashfs") {
+        type = CompressedImageType::SQUASHFS_IMAGE;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/*!
+ * \brief Create a compressed read-only image from a directory
+ *
+ * The image is built by mkfs.erofs or mksquashfs, so the matching tool must be
+ * in the PATH. Both preserve ownership, permissions, and xattrs (including
+ * SELinux labels and capabilities). LZ4HC is used because an image is written
+ * once, but decompressed on every cold read. Like copy_system(), the top-level
+ * `multiboot` directory is excluded.
+ *
+ * \param path Path to new image
+ * \param source_dir Directory to copy into the image
+ * \param type Filesystem type of the new image
+ */
+CreateImageResult create_compressed_image(const std::string &path,
+                                          const std::string &source_dir,
+                                          CompressedImageType type)
+{
+    struct stat sb;
+    if (stat(path.c_str(), &sb) == 0) {
+        LOGE("%s: File already exists", path.c_str());
+        return CreateImageResult::IMAGE_EXISTS;
+    } else if (errno != ENOENT) {
+        LOGE("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+        return CreateImageResult::FAILED;
+    }
+
+    std::vector<const char *> argv;
+
+    if (type == CompressedImageType::EROFS_IMAGE) {
+        argv = {
+            "mkfs.erofs", "-zlz4hc", "--exclude-path=multiboot",
+            path.c_str(), source_dir.c_str(), nullptr
+        };
+    } else {
+        argv = {
+            "mksquashfs", source_dir.c_str(), path.c_str(),
+            "-comp", "lz4", "-Xhc", "-noappend", "-no-progress",
+            "-e", "multiboot", nullptr
+        };
+    }
+
+    LOGD("%s: Creating new %s image from %s", path.c_str(),
+         type == CompressedImageType::EROFS_IMAGE ? "erofs" : "squashfs",
+         source_dir.c_str());
+
+    int ret = util::run_command(argv[0], argv.data(), nullptr, nullptr,
+                                &output_cb, argv.data());
+    if (ret < 0 || !WIFEXITED(ret) || WEXITSTATUS(ret) != 0) {
+        LOGE("%s: Failed to create image with %s", path.c_str(), argv[0]);
+        unlink(path.c_str());
+        return CreateImageResult::FAILED;
+    }
+
+    return CreateImageResult::SUCCEEDED;
+}
+
+/*!
+ * \brief Check if an image is a compressed read-only image
+ *
+ * \param[in] image Path to image
+ * \param[out] compressed Whether the image is an erofs or squashfs image
+ * \param[out] type Filesystem type (only set if \p compressed is true)
+ *
+ * \return Whether the image could be probed
+ */
+bool get_compressed_image_type(const std::string &image, bool &compressed,
+                               CompressedImageType &type)
+{
+    const char *fstype;
+
+    if (!util::blkid_get_fs_type(image.c_str(), &fstype)) {
+        LOGE("%s: Failed to probe filesystem: %s",
+             image.c_str(), strerror(errno));
+        return false;
+    }
+
+    compressed = fstype && compressed_image_type_from_name(fstype, type);
+    return true;
+}
+
+/*!
+ * \brief Replace an ext4 image with a compressed read-only copy
+ *
+ * The ext4 image is mounted read-only at \p mount_dir and its contents are
+ * packed into a temporary image next to it, which is then renamed over the
+ * original. If anything fails, the original image is left untouched.
+ *
+ * \param image Path to ext4 image (must not be mounted)
+ * \param mount_dir Temporary mount point
+ * \param type Filesystem type of the new image
+ */
+bool compress_ext4_image(const std::string &image, const std::string &mount_dir,
+                         CompressedImageType type)
+{
+    std::string temp_path(image);
+    temp_path += ".compressed.tmp";
+    unlink(temp_path.c_str());
+
+    if (!util::mkdir_recursive(mount_dir, 0755) && errno != EEXIST) {
+        LOGE("%s: Failed to create directory: %s",
+             mount_dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!util::mount(image.c_str(), mount_dir.c_str(), "ext4", MS_RDONLY, "")) {
+        LOGE("Failed to mount %s at %s: %s",
+             image.c_str(), mount_dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto result = create_compressed_image(temp_path, mount_dir, type);
+
+    if (!util::umount(mount_dir.c_str())) {
+        LOGW("Failed to unmount %s: %s", mount_dir.c_str(), strerror(errno));
+    }
+
+    if (result != CreateImageResult::SUCCEEDED) {
+        return false;
+    }
+
+    struct stat old_sb;
+    struct stat new_sb;
+    if (stat(image.c_str(), &old_sb) == 0
+            && stat(temp_path.c_str(), &new_sb) == 0) {
+        LOGD("%s: Compressed %" PRIu64 " allocated bytes to %" PRIu64 " bytes",
+             image.c_str(), static_cast<uint64_t>(old_sb.st_blocks) * 512,
+             static_cast<uint64_t>(new_sb.st_size));
+    }
+
+    if (rename(temp_path.c_str(), image.c_str()) < 0) {
+        LOGE("Failed to rename %s to %s: %s",
+             temp_path.c_str(), image.c_str(), strerror(errno));
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    return true;
 }
 
 bool fsck_ext4_image(const std::string &image)
@@ -94,4 +477,328 @@ bool fsck_ext4_image(const std::string &image)
     return true;
 }
 
+// ext4 superblock fields used by ext4_image_allocated_blocks()
+#define EXT4_SUPERBLOCK_OFFSET          1024
+#define EXT4_SUPERBLOCK_SIZE            1024
+#define EXT4_SUPER_MAGIC                0xef53
+
+#define EXT4_SB_BLOCKS_COUNT_LO         0x04
+#define EXT4_SB_FIRST_DATA_BLOCK        0x14
+#define EXT4_SB_LOG_BLOCK_SIZE          0x18
+#define EXT4_SB_BLOCKS_PER_GROUP        0x20
+#define EXT4_SB_INODES_PER_GROUP        0x28
+#define EXT4_SB_MAGIC                   0x38
+#define EXT4_SB_FEATURE_COMPAT          0x5c
+#define EXT4_SB_FEATURE_INCOMPAT        0x60
+#define EXT4_SB_FEATURE_RO_COMPAT       0x64
+#define EXT4_SB_INODE_SIZE              0x58
+#define EXT4_SB_RESERVED_GDT_BLOCKS     0xce
+#define EXT4_SB_DESC_SIZE               0xfe
+#define EXT4_SB_BLOCKS_COUNT_HI         0x150
+
+#define EXT4_GD_BLOCK_BITMAP_LO         0x00
+#define EXT4_GD_INODE_BITMAP_LO         0x04
+#define EXT4_GD_INODE_TABLE_LO          0x08
+#define EXT4_GD_FLAGS                   0x12
+#define EXT4_GD_BLOCK_BITMAP_HI         0x20
+#define EXT4_GD_INODE_BITMAP_HI         0x24
+#define EXT4_GD_INODE_TABLE_HI          0x28
+
+#define EXT4_FEATURE_COMPAT_SPARSE_SUPER2       0x0200
+#define EXT4_FEATURE_INCOMPAT_META_BG           0x0010
+#define EXT4_FEATURE_INCOMPAT_64BIT             0x0080
+#define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER     0x0001
+#define EXT4_FEATURE_RO_COMPAT_GDT_CSUM         0x0010
+#define EXT4_FEATURE_RO_COMPAT_METADATA_CSUM    0x0400
+
+#define EXT4_BG_BLOCK_UNINIT            0x0002
+
+#define EXT4_MIN_DESC_SIZE              32
+#define EXT4_MIN_DESC_SIZE_64BIT        64
+
+static inline uint16_t get_le16(const unsigned char *buf, size_t offset)
+{
+    uint16_t value;
+    memcpy(&value, buf + offset, sizeof(value));
+    return mb_le16toh(value);
+}
+
+static inline uint32_t get_le32(const unsigned char *buf, size_t offset)
+{
+    uint32_t value;
+    memcpy(&value, buf + offset, sizeof(value));
+    return mb_le32toh(value);
+}
+
+static bool read_at(StandardFile &file, const std::string &path,
+                    uint64_t offset, void *buf, size_t size)
+{
+    size_t n;
+
+    if (!file.seek(static_cast<int64_t>(offset), SEEK_SET, nullptr)) {
+        LOGE("%s: Failed to seek to %" PRIu64 ": %s",
+             path.c_str(), offset, file.error_string().c_str());
+        return false;
+    } else if (!file_read_fully(file, buf, size, n)) {
+        LOGE("%s: Failed to read %" PRIu64 ": %s",
+             path.c_str(), offset, file.error_string().c_str());
+        return false;
+    } else if (n != size) {
+        LOGE("%s: Unexpected EOF at %" PRIu64, path.c_str(), offset + n);
+        return false;
+    }
+
+    return true;
+}
+
+static bool is_power_of(uint64_t n, uint64_t base)
+{
+    while (n > 1 && n % base == 0) {
+        n /= base;
+    }
+    return n == 1;
+}
+
+// Whether the block group contains a backup of the superblock and GDT
+static bool group_has_super(uint64_t group, uint32_t ro_compat)
+{
+    if (group <= 1 || !(ro_compat & EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER)) {
+        return true;
+    }
+    return is_power_of(group, 3) || is_power_of(group, 5)
+            || is_power_of(group, 7);
+}
+
+// Sort and merge overlapping/adjacent ranges
+static void merge_ranges(std::vector<sparse::BlockRange> &ranges)
+{
+    std::sort(ranges.begin(), ranges.end(),
+              [](const sparse::BlockRange &a, const sparse::BlockRange &b) {
+        return a.begin < b.begin;
+    });
+
+    std::vector<sparse::BlockRange> merged;
+    for (auto const &r : ranges) {
+        if (!merged.empty() && r.begin <= merged.back().end) {
+            merged.back().end = std::max(merged.back().end, r.end);
+        } else {
+            merged.push_back(r);
+        }
+    }
+
+    ranges.swap(merged);
+}
+
+/*!
+ * \brief Get the block size of an ext4 image
+ *
+ * \param[in] image Path to ext4 image
+ * \param[out] block_size Filesystem block size
+ *
+ * \return Whether \a image has a valid ext4 superblock
+ */
+bool ext4_image_block_size(const std::string &image, uint32_t &block_size)
+{
+    StandardFile file;
+    unsigned char sb[EXT4_SUPERBLOCK_SIZE];
+
+    if (!file.open(image, FileOpenMode::READ_ONLY)) {
+        LOGE("%s: Failed to open for reading: %s",
+             image.c_str(), file.error_string().c_str());
+        return false;
+    }
+
+    if (!read_at(file, image, EXT4_SUPERBLOCK_OFFSET, sb, sizeof(sb))) {
+        return false;
+    }
+
+    if (get_le16(sb, EXT4_SB_MAGIC) != EXT4_SUPER_MAGIC) {
+        LOGE("%s: Not an ext4 image", image.c_str());
+        return false;
+    }
+
+    uint32_t log_block_size = get_le32(sb, EXT4_SB_LOG_BLOCK_SIZE);
+    if (log_block_size > 6) {
+        LOGE("%s: Invalid block size", image.c_str());
+        return false;
+    }
+
+    block_size = 1024u << log_block_size;
+    return true;
+}
+
+/*!
+ * \brief Find the allocated blocks of an ext4 image
+ *
+ * The block bitmaps of all initialized block groups are read. Groups with
+ * uninitialized block bitmaps only contribute their metadata (superblock and
+ * GDT backups, and any bitmaps or inode tables that live in them).
+ *
+ * Filesystems with features that change the location of the metadata
+ * (meta_bg, sparse_super2) are not supported.
+ *
+ * \param[in] image Path to ext4 image
+ * \param[out] block_size Filesystem block size
+ * \param[out] block_count Number of blocks in the filesystem
+ * \param[out] ranges Sorted ranges of allocated blocks
+ *
+ * \return Whether the allocated blocks were successfully determined
+ */
+bool ext4_image_allocated_blocks(const std::string &image,
+                                 uint32_t &block_size, uint64_t &block_count,
+                                 std::vector<sparse::BlockRange> &ranges)
+{
+    StandardFile file;
+    unsigned char sb[EXT4_SUPERBLOCK_SIZE];
+
+    if (!file.open(image, FileOpenMode::READ_ONLY)) {
+        LOGE("%s: Failed to open for reading: %s",
+             image.c_str(), file.error_string().c_str());
+        return false;
+    }
+
+    if (!read_at(file, image, EXT4_SUPERBLOCK_OFFSET, sb, sizeof(sb))) {
+        return false;
+    }
+
+    if (get_le16(sb, EXT4_SB_MAGIC) != EXT4_SUPER_MAGIC) {
+        LOGE("%s: Not an ext4 image", image.c_str());
+        return false;
+    }
+
+    uint32_t log_block_size = get_le32(sb, EXT4_SB_LOG_BLOCK_SIZE);
+    uint32_t first_data_block = get_le32(sb, EXT4_SB_FIRST_DATA_BLOCK);
+    uint32_t blocks_per_group = get_le32(sb, EXT4_SB_BLOCKS_PER_GROUP);
+    uint32_t inodes_per_group = get_le32(sb, EXT4_SB_INODES_PER_GROUP);
+    uint16_t inode_size = get_le16(sb, EXT4_SB_INODE_SIZE);
+    uint32_t compat = get_le32(sb, EXT4_SB_FEATURE_COMPAT);
+    uint32_t incompat = get_le32(sb, EXT4_SB_FEATURE_INCOMPAT);
+    uint32_t ro_compat = get_le32(sb, EXT4_SB_FEATURE_RO_COMPAT);
+    uint16_t reserved_gdt_blocks = get_le16(sb, EXT4_SB_RESERVED_GDT_BLOCKS);
+    bool is_64bit = incompat & EXT4_FEATURE_INCOMPAT_64BIT;
+    bool has_uninit = ro_compat & (EXT4_FEATURE_RO_COMPAT_GDT_CSUM
+            | EXT4_FEATURE_RO_COMPAT_METADATA_CSUM);
+
+    if (log_block_size > 6) {
+        LOGE("%s: Invalid block size", image.c_str());
+        return false;
+    }
+    block_size = 1024u << log_block_size;
+
+    block_count = get_le32(sb, EXT4_SB_BLOCKS_COUNT_LO);
+    if (is_64bit) {
+        block_count |= static_cast<uint64_t>(
+                get_le32(sb, EXT4_SB_BLOCKS_COUNT_HI)) << 32;
+    }
+
+    uint32_t desc_size = is_64bit
+            ? get_le16(sb, EXT4_SB_DESC_SIZE) : EXT4_MIN_DESC_SIZE;
+
+    if ((incompat & EXT4_FEATURE_INCOMPAT_META_BG)
+            || (compat & EXT4_FEATURE_COMPAT_SPARSE_SUPER2)) {
+        LOGE("%s: Unsupported ext4 features for block-level copy",
+             image.c_str());
+        return false;
+    } else if (blocks_per_group == 0 || blocks_per_group > block_size * 8
+            || block_count <= first_data_block
+            || desc_size < (is_64bit ? EXT4_MIN_DESC_SIZE_64BIT
+                                     : EXT4_MIN_DESC_SIZE)
+            || desc_size > block_size) {
+        LOGE("%s: Invalid ext4 superblock", image.c_str());
+        return false;
+    }
+
+    uint64_t group_count = (block_count - first_data_block
+            + blocks_per_group - 1) / blocks_per_group;
+    uint64_t gdt_blocks = (group_count * desc_size + block_size - 1)
+            / block_size;
+    uint64_t inode_table_blocks =
+            (static_cast<uint64_t>(inodes_per_group) * inode_size
+            + block_size - 1) / block_size;
+
+    std::vector<unsigned char> gdt(gdt_blocks * block_size);
+    if (!read_at(file, image,
+                 static_cast<uint64_t>(first_data_block + 1) * block_size,
+                 gdt.data(), gdt.size())) {
+        return false;
+    }
+
+    std::vector<unsigned char> bitmap(block_size);
+    ranges.clear();
+
+    // Boot block(s) before the first block group
+    ranges.push_back({0, static_cast<uint64_t>(first_data_block) + 1});
+
+    for (uint64_t group = 0; group < group_count; ++group) {
+        const unsigned char *desc = gdt.data() + group * desc_size;
+        uint64_t group_start = first_data_block + group * blocks_per_group;
+        uint64_t group_end = std::min<uint64_t>(
+                group_start + blocks_per_group, block_count);
+
+        uint64_t block_bitmap = get_le32(desc, EXT4_GD_BLOCK_BITMAP_LO);
+        uint64_t inode_bitmap = get_le32(desc, EXT4_GD_INODE_BITMAP_LO);
+        uint64_t inode_table = get_le32(desc, EXT4_GD_INODE_TABLE_LO);
+        if (is_64bit) {
+            block_bitmap |= static_cast<uint64_t>(
+                    get_le32(desc, EXT4_GD_BLOCK_BITMAP_HI)) << 32;
+            inode_bitmap |= static_cast<uint64_t>(
+                    get_le32(desc, EXT4_GD_INODE_BITMAP_HI)) << 32;
+            inode_table |= static_cast<uint64_t>(
+                    get_le32(desc, EXT4_GD_INODE_TABLE_HI)) << 32;
+        }
+
+        if (block_bitmap >= block_count || inode_bitmap >= block_count
+                || inode_table + inode_table_blocks > block_count) {
+            LOGE("%s: Invalid descriptor for block group %" PRIu64,
+                 image.c_str(), group);
+            return false;
+        }
+
+        // Metadata is always copied, even if flex_bg placed it in a group
+        // with an uninitialized bitmap
+        ranges.push_back({block_bitmap, block_bitmap + 1});
+        ranges.push_back({inode_bitmap, inode_bitmap + 1});
+        ranges.push_back({inode_table, inode_table + inode_table_blocks});
+
+        if (group_has_super(group, ro_compat)) {
+            ranges.push_back({group_start, std::min<uint64_t>(
+                    group_start + 1 + gdt_blocks + reserved_gdt_blocks,
+                    group_end)});
+        }
+
+        if (has_uninit
+                && (get_le16(desc, EXT4_GD_FLAGS) & EXT4_BG_BLOCK_UNINIT)) {
+            continue;
+        }
+
+        if (!read_at(file, image, block_bitmap * block_size,
+                     bitmap.data(), bitmap.size())) {
+            return false;
+        }
+
+        uint64_t run_start = 0;
+        bool in_run = false;
+
+        for (uint64_t block = group_start; block < group_end; ++block) {
+            uint64_t bit = block - group_start;
+            bool used = bitmap[bit / 8] & (1 << (bit % 8));
+
+            if (used && !in_run) {
+                run_start = block;
+                in_run = true;
+            } else if (!used && in_run) {
+                ranges.push_back({run_start, block});
+                in_run = false;
+            }
+        }
+        if (in_run) {
+            ranges.push_back({run_start, group_end});
+        }
+    }
+
+    merge_ranges(ranges);
+
+    return true;
+}
+
 }
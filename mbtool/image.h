@@ -20,6 +20,11 @@
 #pragma once
 
 #include <string>
+#include <vector>
+
+#include <cstdint>
+
+#include "mbsparse/writer.h"
 
 #define DEFAULT_IMAGE_SIZE ((uint64_t) 4 * 1024 * 1024 * 1024)
 
@@ -31,10 +36,34 @@ enum class CreateImageResult
     SUCCEEDED,
     NOT_ENOUGH_SPACE,
     IMAGE_EXISTS,
+    UNSUPPORTED,
     FAILED
 };
 
+enum class CompressedImageType
+{
+    // Not EROFS, which is an errno macro
+    EROFS_IMAGE,
+    SQUASHFS_IMAGE
+};
+
 CreateImageResult create_ext4_image(const std::string &path, uint64_t size);
+CreateImageResult create_ext4_image_from_dir(const std::string &path,
+                                             uint64_t size,
+                                             const std::string &source_dir);
+bool compressed_image_type_from_name(const std::string &name,
+                                     CompressedImageType &type);
+CreateImageResult create_compressed_image(const std::string &path,
+                                          const std::string &source_dir,
+                                          CompressedImageType type);
+bool get_compressed_image_type(const std::string &image, bool &compressed,
+                               CompressedImageType &type);
+bool compress_ext4_image(const std::string &image, const std::string &mount_dir,
+                         CompressedImageType type);
 bool fsck_ext4_image(const std::string &image);
+bool ext4_image_block_size(const std::string &image, uint32_t &block_size);
+bool ext4_image_allocated_blocks(const std::string &image,
+                                 uint32_t &block_size, uint64_t &block_count,
+                                 std::vector<sparse::BlockRange> &ranges);
 
 }
\ No newline at end of file
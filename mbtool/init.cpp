@@ -36,6 +36,8 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <openssl/sha.h>
+
 #include "minizip/ioandroid.h"
 #include "minizip/ioapi_buf.h"
 #include "minizip/unzip.h"
@@ -44,6 +46,7 @@
 #include "mbcommon/version.h"
 #include "mbdevice/json.h"
 #include "mbdevice/validate.h"
+#include "mblog/async_logger.h"
 #include "mblog/kmsg_logger.h"
 #include "mblog/logging.h"
 #include "mbutil/autoclose/dir.h"
@@ -66,10 +69,12 @@
 
 #include "initwrapper/devices.h"
 #include "initwrapper/util.h"
+#include "boot_trace.h"
 #include "daemon.h"
 #include "emergency.h"
 #include "mount_fstab.h"
 #include "multiboot.h"
+#include "profile.h"
 #include "romconfig.h"
 #include "sepolpatch.h"
 #include "signature.h"
@@ -309,61 +314,101 @@ static bool replace_file(const char *replace, const char *with)
     return true;
 }
 
+static const char *multiboot_file_contexts =
+        "\n"
+        "/data/media              <<none>>\n"
+        "/data/media/[0-9]+(/.*)? <<none>>\n"
+        "/raw(/.*)?               <<none>>\n"
+        "/data/multiboot(/.*)?    <<none>>\n"
+        "/cache/multiboot(/.*)?   <<none>>\n"
+        "/system/multiboot(/.*)?  <<none>>\n";
+
 static bool fix_file_contexts(const char *path)
 {
     std::string new_path(path);
     new_path += ".new";
 
-    autoclose::file fp_old(autoclose::fopen(path, "rb"));
-    if (!fp_old) {
+    std::vector<unsigned char> data;
+    if (!util::file_read_all(path, &data)) {
         if (errno == ENOENT) {
             return true;
         } else {
-            LOGE("%s: Failed to open for reading: %s",
-                 path, strerror(errno));
+            LOGE("%s: Failed to read file: %s", path, strerror(errno));
             return false;
         }
     }
 
-    autoclose::file fp_new(autoclose::fopen(new_path.c_str(), "wb"));
-    if (!fp_new) {
-        LOGE("%s: Failed to open for writing: %s",
-             new_path.c_str(), strerror(errno));
-        return false;
-    }
+    // Transform the whole file in memory and write it out in one go
+    std::string output;
+    output.reserve(data.size() + strlen(multiboot_file_contexts) + 64);
 
-    char *line = nullptr;
-    size_t len = 0;
-    ssize_t read = 0;
+    const char *begin = reinterpret_cast<const char *>(data.data());
+    const char *end = begin + data.size();
 
-    auto free_line = util::finally([&]{
-        free(line);
-    });
+    for (const char *line = begin; line != end;) {
+        const char *line_end = static_cast<const char *>(
+                memchr(line, '\n', end - line));
+        line_end = line_end ? line_end + 1 : end;
 
-    while ((read = getline(&line, &len, fp_old.get())) >= 0) {
-        if (mb::starts_with(line, "/data/media(")
-                && !strstr(line, "<<none>>")) {
-            fputc('#', fp_new.get());
+        if (mb::starts_with_n(line, line_end - line, "/data/media(", 12)
+                && !memmem(line, line_end - line, "<<none>>", 8)) {
+            output += '#';
         }
+        output.append(line, line_end);
 
-        if (fwrite(line, 1, read, fp_new.get()) != (std::size_t) read) {
-            LOGE("%s: Failed to write file: %s",
-                 new_path.c_str(), strerror(errno));
+        line = line_end;
+    }
+
+    output += multiboot_file_contexts;
+
+    if (!util::file_write_data(new_path, output.data(), output.size())) {
+        LOGE("%s: Failed to write file: %s", new_path.c_str(), strerror(errno));
+        unlink(new_path.c_str());
+        return false;
+    }
+
+    return replace_file(path, new_path.c_str());
+}
+
+/*!
+ * \brief Compute cache key for a patched binary file_contexts
+ *
+ * The compiled regexes depend on the system's libpcre, so it is part of the
+ * key along with the input file and the mbtool version.
+ */
+static bool file_contexts_cache_key(const char *path, std::string *key_out)
+{
+    unsigned char digest[SHA512_DIGEST_LENGTH];
+    SHA512_CTX ctx;
+    std::vector<unsigned char> data;
+
+    SHA512_Init(&ctx);
+    SHA512_Update(&ctx, version(), strlen(version()) + 1);
+    SHA512_Update(&ctx, git_version(), strlen(git_version()) + 1);
+    SHA512_Update(&ctx, multiboot_file_contexts,
+                  strlen(multiboot_file_contexts) + 1);
+
+    for (const char *file : { path, PCRE_PATH }) {
+        if (!util::file_read_all(file, &data)) {
+            LOGW("%s: Failed to read file: %s", file, strerror(errno));
             return false;
         }
+
+        SHA512_Update(&ctx, data.data(), data.size());
     }
 
-    static const char *new_contexts =
-            "\n"
-            "/data/media              <<none>>\n"
-            "/data/media/[0-9]+(/.*)? <<none>>\n"
-            "/raw(/.*)?               <<none>>\n"
-            "/data/multiboot(/.*)?    <<none>>\n"
-            "/cache/multiboot(/.*)?   <<none>>\n"
-            "/system/multiboot(/.*)?  <<none>>\n";
-    fputs(new_contexts, fp_new.get());
+    SHA512_Final(digest, &ctx);
+    *key_out = util::hex_string(digest, SHA512_DIGEST_LENGTH);
+    return true;
+}
 
-    return replace_file(path, new_path.c_str());
+static bool copy_file_data(const std::string &source, const std::string &target)
+{
+    std::vector<unsigned char> data;
+
+    return util::file_read_all(source, &data) && !data.empty()
+            && util::file_write_data(target, reinterpret_cast<char *>(
+                    data.data()), data.size());
 }
 
 static bool fix_binary_file_contexts(const char *path)
@@ -373,6 +418,21 @@ static bool fix_binary_file_contexts(const char *path)
     std::string tmp_path(path);
     tmp_path += ".tmp";
 
+    // Reuse the result from a previous boot if the inputs have not changed to
+    // avoid running file-contexts-tool twice
+    std::string key;
+    std::string cache_path;
+    if (file_contexts_cache_key(path, &key)) {
+        cache_path = FILE_CONTEXTS_CACHE_DIR "/";
+        cache_path += key;
+
+        if (copy_file_data(cache_path, new_path)) {
+            LOGD("%s: Using cached binary file_contexts", cache_path.c_str());
+            return replace_file(path, new_path.c_str());
+        }
+        unlink(new_path.c_str());
+    }
+
     // Check signature
     SigVerifyResult result;
     result = verify_signature("/sbin/file-contexts-tool",
@@ -416,6 +476,22 @@ static bool fix_binary_file_contexts(const char *path)
 
     unlink(tmp_path.c_str());
 
+    if (!cache_path.empty()) {
+        // Only keep the latest entry
+        util::delete_recursive(FILE_CONTEXTS_CACHE_DIR);
+
+        std::string cache_tmp_path(cache_path);
+        cache_tmp_path += ".tmp";
+
+        if (!util::mkdir_recursive(FILE_CONTEXTS_CACHE_DIR, 0700)
+                || !copy_file_data(new_path, cache_tmp_path)
+                || rename(cache_tmp_path.c_str(), cache_path.c_str()) < 0) {
+            LOGW("%s: Failed to cache binary file_contexts: %s",
+                 cache_path.c_str(), strerror(errno));
+            unlink(cache_tmp_path.c_str());
+        }
+    }
+
     return replace_file(path, new_path.c_str());
 }
 
@@ -1133,8 +1209,21 @@ static bool critical_failure()
     return emergency_reboot();
 }
 
+static void dump_boot_trace()
+{
+    if (!util::mkdir_recursive(BOOT_TRACE_DIR, 0755) && errno != EEXIST) {
+        LOGW("%s: Failed to create directory: %s",
+             BOOT_TRACE_DIR, strerror(errno));
+        return;
+    }
+
+    boot_trace_dump(BOOT_TRACE_PATH);
+}
+
 int init_main(int argc, char *argv[])
 {
+    uint64_t init_start = boot_trace_now();
+
     // Some devices actually receive arguments, so ignore them during boot
     if (getppid() != 0) {
         static struct option long_options[] = {
@@ -1186,8 +1275,10 @@ int init_main(int argc, char *argv[])
     // Redirect std{in,out,err} to /dev/null
     open_devnull_stdio();
 
-    // Log to kmsg
-    log::log_set_logger(std::make_shared<log::KmsgLogger>(true));
+    // Log to kmsg from a background thread so that verbose logging does not
+    // slow down booting
+    log::log_set_logger(std::make_shared<log::AsyncLogger>(
+            std::make_shared<log::KmsgLogger>(true), 512, true));
     if (klogctl(KLOG_CONSOLE_LEVEL, nullptr, 7) < 0) {
         LOGE("Failed to set loglevel: %s", strerror(errno));
     }
@@ -1201,7 +1292,10 @@ int init_main(int argc, char *argv[])
 
     // Start probing for devices so we have somewhere to write logs for
     // critical_failure()
-    device_init(false);
+    {
+        BootTraceScope trace("device_init");
+        device_init(false);
+    }
 
     MbDeviceJsonError error;
     Device *device = mb_device_new_from_json((char *) contents.data(), &error);
@@ -1251,7 +1345,12 @@ int init_main(int argc, char *argv[])
             | MOUNT_FLAG_MOUNT_CACHE
             | MOUNT_FLAG_MOUNT_DATA
             | MOUNT_FLAG_MOUNT_EXTERNAL_SD;
-    if (!mount_fstab(fstab.c_str(), rom, device, flags)) {
+    bool mounted;
+    {
+        BootTraceScope trace("mount_fstab");
+        mounted = mount_fstab(fstab.c_str(), rom, device, flags);
+    }
+    if (!mounted) {
         LOGE("Failed to mount fstab");
         critical_failure();
         return EXIT_FAILURE;
@@ -1259,19 +1358,29 @@ int init_main(int argc, char *argv[])
 
     LOGV("Successfully mounted fstab");
 
-    if (!launch_boot_menu()) {
-        LOGE("Failed to run boot menu");
-        // Continue anyway since boot menu might not run on every device
+    {
+        BootTraceScope trace("launch_boot_menu");
+        if (!launch_boot_menu()) {
+            LOGE("Failed to run boot menu");
+            // Continue anyway since boot menu might not run on every device
+        }
     }
 
     // Mount selinuxfs
     selinux_mount();
     // Load pre-boot policy
-    patch_sepolicy(SELINUX_DEFAULT_POLICY_FILE, SELINUX_LOAD_FILE,
-                   SELinuxPatch::PRE_BOOT);
+    {
+        BootTraceScope trace("sepolicy_pre_boot");
+        patch_sepolicy_cached(SELINUX_DEFAULT_POLICY_FILE, SELINUX_LOAD_FILE,
+                              SELinuxPatch::PRE_BOOT, SEPOLICY_CACHE_DIR);
+    }
 
     // Mount ROM (bind mount directory or mount images, etc.)
-    if (!mount_rom(rom)) {
+    {
+        BootTraceScope trace("mount_rom");
+        mounted = mount_rom(rom);
+    }
+    if (!mounted) {
         LOGE("Failed to mount ROM directories and images");
         critical_failure();
         return EXIT_FAILURE;
@@ -1287,14 +1396,20 @@ int init_main(int argc, char *argv[])
     LOGD("Enable appsync: %d", config.indiv_app_sharing);
 
     // Make runtime ramdisk modifications
-    if (access(FILE_CONTEXTS, R_OK) == 0) {
-        fix_file_contexts(FILE_CONTEXTS);
-    }
-    if (access(FILE_CONTEXTS_BIN, R_OK) == 0) {
-        fix_binary_file_contexts(FILE_CONTEXTS_BIN);
+    {
+        BootTraceScope trace("fix_file_contexts");
+        if (access(FILE_CONTEXTS, R_OK) == 0) {
+            fix_file_contexts(FILE_CONTEXTS);
+        }
+        if (access(FILE_CONTEXTS_BIN, R_OK) == 0) {
+            fix_binary_file_contexts(FILE_CONTEXTS_BIN);
+        }
     }
     write_fstab_hack(fstab.c_str());
-    add_mbtool_services(config.indiv_app_sharing);
+    {
+        BootTraceScope trace("add_mbtool_services");
+        add_mbtool_services(config.indiv_app_sharing);
+    }
     strip_manual_mounts();
 
     // Data modifications
@@ -1306,9 +1421,15 @@ int init_main(int argc, char *argv[])
     // Patch SELinux policy
     struct stat sb;
     if (stat(SELINUX_DEFAULT_POLICY_FILE, &sb) == 0) {
-        if (!patch_sepolicy(SELINUX_DEFAULT_POLICY_FILE,
-                            SELINUX_DEFAULT_POLICY_FILE,
-                            SELinuxPatch::MAIN)) {
+        bool patched;
+        {
+            BootTraceScope trace("sepolicy_main");
+            patched = patch_sepolicy_cached(SELINUX_DEFAULT_POLICY_FILE,
+                                            SELINUX_DEFAULT_POLICY_FILE,
+                                            SELinuxPatch::MAIN,
+                                            SEPOLICY_CACHE_DIR);
+        }
+        if (!patched) {
             LOGW("Failed to patch " SELINUX_DEFAULT_POLICY_FILE);
             critical_failure();
             return EXIT_FAILURE;
@@ -1321,6 +1442,13 @@ int init_main(int argc, char *argv[])
     // Kill properties service and clean up
     properties_cleanup();
 
+    // No other threads are recording spans at this point. /raw/cache is still
+    // mounted until the real init takes over.
+    boot_trace_record("init", nullptr, init_start, boot_trace_now());
+    dump_boot_trace();
+    // /proc is still mounted, so this is the last chance to write the profile
+    profile_finish();
+
     // Remove mbtool init symlink and restore original binary
     unlink("/init");
     rename("/init.orig", "/init");
@@ -1344,6 +1472,7 @@ int init_main(int argc, char *argv[])
 
     // Start real init
     LOGD("Launching real init ...");
+    log::log_flush();
     execlp("/init", "/init", nullptr);
     LOGE("Failed to exec real init: %s", strerror(errno));
     critical_failure();
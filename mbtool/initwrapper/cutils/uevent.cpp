@@ -18,6 +18,7 @@
 #include "initwrapper/cutils/uevent.h"
 
 #include <cerrno>
+#include <cstring>
 #include <strings.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -47,6 +48,48 @@ ssize_t uevent_kernel_multicast_uid_recv(int socket, void *buffer, size_t length
     return uevent_kernel_recv(socket, buffer, length, true, uid);
 }
 
+/**
+ * Check that a received netlink message originates from the kernel.
+ */
+static bool uevent_kernel_check(struct msghdr *hdr, const struct sockaddr_nl *addr,
+                                void *buffer, size_t length, bool require_group,
+                                uid_t *uid)
+{
+    struct cmsghdr *cmsg;
+    struct ucred *cred;
+
+    *uid = -1;
+
+    cmsg = CMSG_FIRSTHDR(hdr);
+    if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS) {
+        // Ignoring netlink message with no sender credentials
+        goto out;
+    }
+
+    cred = (struct ucred *) CMSG_DATA(cmsg);
+    *uid = cred->uid;
+    if (cred->uid != 0) {
+        // Ignoring netlink message from non-root user
+        goto out;
+    }
+
+    if (addr->nl_pid != 0) {
+        // Ignore non-kernel
+        goto out;
+    }
+    if (require_group && addr->nl_groups == 0) {
+        // Ignore unicast messages when requested
+        goto out;
+    }
+
+    return true;
+
+out:
+    // Clear residual potentially malicious data
+    bzero(buffer, length);
+    return false;
+}
+
 ssize_t uevent_kernel_recv(int socket, void *buffer, size_t length, bool require_group, uid_t *uid)
 {
     struct iovec iov = { buffer, length };
@@ -68,38 +111,67 @@ ssize_t uevent_kernel_recv(int socket, void *buffer, size_t length, bool require
         return n;
     }
 
-    struct cmsghdr *cmsg;
-    struct ucred *cred;
+    if (!uevent_kernel_check(&hdr, &addr, buffer, length, require_group, uid)) {
+        errno = EIO;
+        return -1;
+    }
 
-    cmsg = CMSG_FIRSTHDR(&hdr);
-    if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS) {
-        // Ignoring netlink message with no sender credentials
-        goto out;
+    return n;
+}
+
+#define UEVENT_RECVMMSG_MAX 64
+
+/**
+ * Receive up to "count" multicast messages from the kernel with a single
+ * recvmmsg() call. The size of each received message is stored in "sizes".
+ * Messages that did not originate from the kernel are cleared and have their
+ * size set to -1.
+ *
+ * Returns the number of messages received (at most UEVENT_RECVMMSG_MAX) or -1
+ * with errno set if recvmmsg() fails.
+ */
+int uevent_kernel_multicast_recvmmsg(int socket, void * const *buffers, size_t length,
+                                     ssize_t *sizes, unsigned int count)
+{
+    struct mmsghdr msgs[UEVENT_RECVMMSG_MAX];
+    struct iovec iovs[UEVENT_RECVMMSG_MAX];
+    struct sockaddr_nl addrs[UEVENT_RECVMMSG_MAX];
+    char controls[UEVENT_RECVMMSG_MAX][CMSG_SPACE(sizeof(struct ucred))];
+
+    if (count > UEVENT_RECVMMSG_MAX) {
+        count = UEVENT_RECVMMSG_MAX;
     }
 
-    cred = (struct ucred *) CMSG_DATA(cmsg);
-    *uid = cred->uid;
-    if (cred->uid != 0) {
-        // Ignoring netlink message from non-root user
-        goto out;
+    memset(msgs, 0, sizeof(msgs[0]) * count);
+
+    for (unsigned int i = 0; i < count; ++i) {
+        iovs[i].iov_base = buffers[i];
+        iovs[i].iov_len = length;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = controls[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
     }
 
-    if (addr.nl_pid != 0) {
-        // Ignore non-kernel
-        goto out;
+    int n = recvmmsg(socket, msgs, count, 0, nullptr);
+    if (n <= 0) {
+        return n;
     }
-    if (require_group && addr.nl_groups == 0) {
-        // Ignore unicast messages when requested
-        goto out;
+
+    for (int i = 0; i < n; ++i) {
+        uid_t uid;
+
+        if (uevent_kernel_check(&msgs[i].msg_hdr, &addrs[i], buffers[i], length,
+                                true, &uid)) {
+            sizes[i] = msgs[i].msg_len;
+        } else {
+            sizes[i] = -1;
+        }
     }
 
     return n;
-
-out:
-    // Clear residual potentially malicious data
-    bzero(buffer, length);
-    errno = EIO;
-    return -1;
 }
 
 int uevent_open_socket(int buf_sz, bool passcred)
@@ -22,4 +22,6 @@
 int uevent_open_socket(int buf_sz, bool passcred);
 ssize_t uevent_kernel_multicast_recv(int socket, void *buffer, size_t length);
 ssize_t uevent_kernel_multicast_uid_recv(int socket, void *buffer, size_t length, uid_t *uid);
-ssize_t uevent_kernel_recv(int socket, void *buffer, size_t length, bool require_group, uid_t *uid);
\ No newline at end of file
+ssize_t uevent_kernel_recv(int socket, void *buffer, size_t length, bool require_group, uid_t *uid);
+int uevent_kernel_multicast_recvmmsg(int socket, void * const *buffers, size_t length,
+                                     ssize_t *sizes, unsigned int count);
\ No newline at end of file
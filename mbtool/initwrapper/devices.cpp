@@ -17,8 +17,15 @@
 
 #include "initwrapper/devices.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <algorithm>
 #include <mutex>
+#include <unordered_set>
+#include <vector>
 
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 
@@ -39,6 +46,7 @@
 #include "mbutil/string.h"
 #include "mbutil/external/system_properties.h"
 
+#include "boot_trace.h"
 #include "initwrapper/cutils/uevent.h"
 #include "initwrapper/util.h"
 
@@ -46,6 +54,15 @@
 
 #define UEVENT_LOGGING 0
 
+// Is 256K enough? udev uses 16MB!
+#define UEVENT_RCVBUF_SIZE      (256 * 1024)
+// Coldboot produces a burst of events faster than they can be handled, so give
+// the socket a larger buffer until it is over
+#define COLDBOOT_RCVBUF_SIZE    (16 * 1024 * 1024)
+#define COLDBOOT_MAX_WALKERS    8
+#define COLDBOOT_POLL_MS        10
+#define UEVENT_BATCH_SIZE       32
+
 static char bootdevice[PROP_VALUE_MAX];
 static int device_fd = -1;
 static int pipe_fd[2];
@@ -56,6 +73,7 @@ static bool dry_run = false;
 struct uevent {
     const char *action;
     const char *path;
+    size_t path_len;
     const char *subsystem;
     const char *firmware;
     const char *partition_name;
@@ -66,15 +84,30 @@ struct uevent {
 };
 
 struct platform_node {
-    char *name;
-    char *path;
+    // Points into the platform_names key
+    const char *name;
     int path_len;
+    // Insertion order, used to return the most recently added devices first
+    uint64_t seq;
 };
 
-static std::vector<platform_node> platform_names;
+// Keyed by device path so that prefixes can be looked up directly
+static std::unordered_multimap<std::string, platform_node> platform_names;
+static uint64_t platform_seq = 0;
 
-static std::unordered_map<std::string, BlockDevInfo> block_dev_mappings;
-static std::mutex block_dev_mappings_guard;
+// Directories under /dev that have already been created
+static std::unordered_set<std::string> created_dirs;
+
+// Block device index being built by the event handlers and the snapshot that
+// was last published to readers. The working copy is only accessed by the
+// thread handling events.
+static BlockDevIndex block_dev_index;
+static bool block_dev_index_dirty = false;
+static BlockDevIndexPtr block_dev_index_published =
+        std::make_shared<const BlockDevIndex>();
+// Signalled whenever a new snapshot is published
+static std::mutex block_dev_index_mutex;
+static std::condition_variable block_dev_index_cv;
 
 static mode_t get_device_perm(const char *path,
                               const std::vector<std::string> &links,
@@ -120,9 +153,15 @@ static void make_device(const char *path,
     }
 }
 
+static void mkdir_cached(const char *path)
+{
+    if (!dry_run && created_dirs.insert(path).second) {
+        mkdir(path, 0755);
+    }
+}
+
 static void add_platform_device(const char *path)
 {
-    int path_len = strlen(path);
     const char *name = path;
 
     if (strncmp(path, "/devices/", 9) == 0) {
@@ -136,49 +175,66 @@ static void add_platform_device(const char *path)
     LOGI("Adding platform device %s (%s)", name, path);
 #endif
 
-    platform_names.emplace_back();
-    struct platform_node &bus = platform_names.back();
-    bus.path = strdup(path);
-    bus.path_len = path_len;
-    bus.name = bus.path + (name - path);
+    platform_node bus;
+    bus.name = nullptr;
+    bus.path_len = strlen(path);
+    bus.seq = platform_seq++;
+
+    auto it = platform_names.emplace(path, bus);
+    it->second.name = it->first.c_str() + (name - path);
 }
 
 /*
- * Given a path that may start with a platform device, find the length of the
- * platform device prefix.  If it doesn't start with a platform device, return
- * 0.
+ * Given a path that may start with a platform device, find the platform devices
+ * that are a prefix of the path, most recently added first. Instead of
+ * comparing against every known device, each '/'-delimited prefix of the path
+ * is looked up in the index.
  */
-static std::vector<struct platform_node *> find_platform_devices(const char *path)
+static std::vector<struct platform_node *> find_platform_devices(const char *path,
+                                                                 size_t path_len)
 {
     std::vector<struct platform_node *> nodes;
-    int path_len = strlen(path);
 
-    for (auto it = platform_names.rbegin(); it != platform_names.rend(); ++it) {
-        struct platform_node &bus = *it;
+    if (platform_names.empty()) {
+        return nodes;
+    }
+
+    std::string prefix;
+    prefix.reserve(path_len);
+
+    for (const char *p = strchr(path, '/'); p; p = strchr(p + 1, '/')) {
+        prefix.assign(path, p - path);
 
-        if ((bus.path_len < path_len) &&
-                (path[bus.path_len] == '/') &&
-                strncmp(path, bus.path, bus.path_len) == 0) {
-            nodes.push_back(&bus);
+        auto range = platform_names.equal_range(prefix);
+        for (auto it = range.first; it != range.second; ++it) {
+            nodes.push_back(&it->second);
         }
     }
 
+    std::sort(nodes.begin(), nodes.end(),
+              [](const platform_node *a, const platform_node *b) {
+        return a->seq > b->seq;
+    });
+
     return nodes;
 }
 
 static void remove_platform_device(const char *path)
 {
-    for (auto it = platform_names.rbegin(); it != platform_names.rend(); ++it) {
-        const struct platform_node &bus = *it;
+    auto range = platform_names.equal_range(path);
+    auto latest = range.second;
+
+    for (auto it = range.first; it != range.second; ++it) {
+        if (latest == range.second || it->second.seq > latest->second.seq) {
+            latest = it;
+        }
+    }
 
-        if (strcmp(path, bus.path) == 0) {
+    if (latest != range.second) {
 #if UEVENT_LOGGING
-            LOGI("Removing platform device %s", bus.name);
+        LOGI("Removing platform device %s", latest->second.name);
 #endif
-            free(bus.path);
-            platform_names.erase((it + 1).base());
-            return;
-        }
+        platform_names.erase(latest);
     }
 }
 
@@ -269,10 +325,14 @@ static void dump_uevent(struct uevent *uevent)
 }
 #endif
 
+#define UEVENT_KEY_IS(key, len, str) \
+    ((len) == sizeof(str) - 1 && memcmp(key, str, sizeof(str) - 1) == 0)
+
 static void parse_event(const char *msg, struct uevent *uevent)
 {
     uevent->action = "";
     uevent->path = "";
+    uevent->path_len = 0;
     uevent->subsystem = "";
     uevent->firmware = "";
     uevent->major = -1;
@@ -283,43 +343,58 @@ static void parse_event(const char *msg, struct uevent *uevent)
 
     // Currently ignoring SEQNUM
     while (*msg) {
-        if (strncmp(msg, "ACTION=", 7) == 0) {
-            msg += 7;
-            uevent->action = msg;
-        } else if (strncmp(msg, "DEVPATH=", 8) == 0) {
-            msg += 8;
-            uevent->path = msg;
-        } else if (strncmp(msg, "SUBSYSTEM=", 10) == 0) {
-            msg += 10;
-            uevent->subsystem = msg;
-        } else if (strncmp(msg, "FIRMWARE=", 9) == 0) {
-            msg += 9;
-            uevent->firmware = msg;
-        } else if (strncmp(msg, "MAJOR=", 6) == 0) {
-            msg += 6;
-            uevent->major = atoi(msg);
-        } else if (strncmp(msg, "MINOR=", 6) == 0) {
-            msg += 6;
-            uevent->minor = atoi(msg);
-        } else if (strncmp(msg, "PARTN=", 6) == 0) {
-            msg += 6;
-            uevent->partition_num = atoi(msg);
-        } else if (strncmp(msg, "PARTNAME=", 9) == 0) {
-            msg += 9;
-            uevent->partition_name = msg;
-        } else if (strncmp(msg, "DEVNAME=", 8) == 0) {
-            msg += 8;
-            uevent->device_name = msg;
-        } else {
+        size_t len = strlen(msg);
+        const char *eq = static_cast<const char *>(memchr(msg, '=', len));
+        size_t key_len = eq ? eq - msg : 0;
+        const char *value = eq ? eq + 1 : nullptr;
+
+        // Values point into the message buffer, so only the key is compared
+        switch (key_len) {
+        case 5:
+            if (UEVENT_KEY_IS(msg, key_len, "MAJOR")) {
+                uevent->major = atoi(value);
+            } else if (UEVENT_KEY_IS(msg, key_len, "MINOR")) {
+                uevent->minor = atoi(value);
+            } else if (UEVENT_KEY_IS(msg, key_len, "PARTN")) {
+                uevent->partition_num = atoi(value);
+            }
+            break;
+        case 6:
+            if (UEVENT_KEY_IS(msg, key_len, "ACTION")) {
+                uevent->action = value;
+            }
+            break;
+        case 7:
+            if (UEVENT_KEY_IS(msg, key_len, "DEVPATH")) {
+                uevent->path = value;
+                uevent->path_len = len - (key_len + 1);
+            } else if (UEVENT_KEY_IS(msg, key_len, "DEVNAME")) {
+                uevent->device_name = value;
+            }
+            break;
+        case 8:
+            if (UEVENT_KEY_IS(msg, key_len, "FIRMWARE")) {
+                uevent->firmware = value;
+            } else if (UEVENT_KEY_IS(msg, key_len, "PARTNAME")) {
+                uevent->partition_name = value;
+            }
+            break;
+        case 9:
+            if (UEVENT_KEY_IS(msg, key_len, "SUBSYSTEM")) {
+                uevent->subsystem = value;
+            }
+            break;
+        default:
 #if UEVENT_LOGGING
             if (strcmp(uevent->subsystem, "block") == 0) {
                 LOGW("Unknown message: '%s'", msg);
             }
 #endif
+            break;
         }
 
         // Advance to after the next \0
-        while (*msg++);
+        msg += len + 1;
     }
 
 #if UEVENT_LOGGING
@@ -334,7 +409,7 @@ static std::vector<std::string> get_character_device_symlinks(struct uevent *uev
     int width;
     std::vector<struct platform_node *> pdevs;
 
-    pdevs = find_platform_devices(uevent->path);
+    pdevs = find_platform_devices(uevent->path, uevent->path_len);
     if (pdevs.empty()) {
         return {};
     }
@@ -369,9 +444,7 @@ static std::vector<std::string> get_character_device_symlinks(struct uevent *uev
             links.push_back(mb::format("/dev/usb/%s%.*s",
                                        uevent->subsystem, width, parent));
 
-            if (!dry_run) {
-                mkdir("/dev/usb", 0755);
-            }
+            mkdir_cached("/dev/usb");
         }
     }
 
@@ -393,7 +466,7 @@ static std::vector<std::string> get_block_device_symlinks(struct uevent *uevent)
     char mtd_name_path[256];
     char mtd_name[64];
 
-    pdevs = find_platform_devices(uevent->path);
+    pdevs = find_platform_devices(uevent->path, uevent->path_len);
     if (!pdevs.empty()) {
         for (auto *pdev : pdevs) {
             devices.push_back(pdev->name);
@@ -555,6 +628,88 @@ static const char * parse_device_name(struct uevent *uevent, unsigned int len)
     return name;
 }
 
+static inline uint64_t block_dev_key(int major, int minor)
+{
+    return (static_cast<uint64_t>(static_cast<uint32_t>(major)) << 32)
+            | static_cast<uint32_t>(minor);
+}
+
+template<typename Map, typename Key>
+static void erase_if_same(Map &map, const Key &key, const BlockDevInfoPtr &info)
+{
+    auto it = map.find(key);
+    if (it != map.end() && it->second == info) {
+        map.erase(it);
+    }
+}
+
+static void block_dev_index_add(const char *sysfs_path, BlockDevInfoPtr info)
+{
+    // Keep the first mapping for a sysfs path
+    auto ret = block_dev_index.by_sysfs_path.emplace(sysfs_path, info);
+    if (!ret.second) {
+        return;
+    }
+
+    if (!info->partition_name.empty()) {
+        block_dev_index.by_partition_name[info->partition_name] = info;
+    }
+    block_dev_index.by_dev[block_dev_key(info->major, info->minor)] = info;
+    block_dev_index.by_path[info->path] = info;
+    for (const std::string &link : info->links) {
+        block_dev_index.by_path[link] = info;
+    }
+
+    block_dev_index_dirty = true;
+}
+
+static void block_dev_index_remove(const char *sysfs_path)
+{
+    auto it = block_dev_index.by_sysfs_path.find(sysfs_path);
+    if (it == block_dev_index.by_sysfs_path.end()) {
+        return;
+    }
+
+    BlockDevInfoPtr info = std::move(it->second);
+    block_dev_index.by_sysfs_path.erase(it);
+
+    // Only remove entries that were not replaced by a newer device
+    if (!info->partition_name.empty()) {
+        erase_if_same(block_dev_index.by_partition_name,
+                      info->partition_name, info);
+    }
+    erase_if_same(block_dev_index.by_dev,
+                  block_dev_key(info->major, info->minor), info);
+    erase_if_same(block_dev_index.by_path, info->path, info);
+    for (const std::string &link : info->links) {
+        erase_if_same(block_dev_index.by_path, link, info);
+    }
+
+    block_dev_index_dirty = true;
+}
+
+/*
+ * Publish a snapshot of the working index if it changed. Only the maps are
+ * copied; the BlockDevInfo instances are shared between snapshots.
+ */
+static void block_dev_index_publish()
+{
+    if (!block_dev_index_dirty) {
+        return;
+    }
+
+    std::atomic_store(&block_dev_index_published,
+                      BlockDevIndexPtr(std::make_shared<const BlockDevIndex>(
+                              block_dev_index)));
+    block_dev_index_dirty = false;
+
+    {
+        // Waiters check the snapshot while holding the mutex
+        std::lock_guard<std::mutex> lock(block_dev_index_mutex);
+    }
+    block_dev_index_cv.notify_all();
+}
+
 static void handle_block_device_event(struct uevent *uevent)
 {
     const char *base = "/dev/block/";
@@ -568,9 +723,7 @@ static void handle_block_device_event(struct uevent *uevent)
     }
 
     snprintf(devpath, sizeof(devpath), "%s%s", base, name);
-    if (!dry_run) {
-        mkdir(base, 0755);
-    }
+    mkdir_cached(base);
 
     if (strncmp(uevent->path, "/devices/", 9) == 0) {
         links = get_block_device_symlinks(uevent);
@@ -581,22 +734,20 @@ static void handle_block_device_event(struct uevent *uevent)
 
     // Add/remove block device mapping
     if (strcmp(uevent->action, "add") == 0) {
-        BlockDevInfo info;
-        info.path = devpath;
-        info.partition_num = uevent->partition_num;
-        info.major = uevent->major;
-        info.minor = uevent->minor;
+        std::shared_ptr<BlockDevInfo> info = std::make_shared<BlockDevInfo>();
+        info->path = devpath;
+        info->partition_num = uevent->partition_num;
+        info->major = uevent->major;
+        info->minor = uevent->minor;
+        info->links = std::move(links);
 
         if (uevent->partition_name) {
-            info.partition_name = uevent->partition_name;
+            info->partition_name = uevent->partition_name;
         }
 
-        std::lock_guard<std::mutex> lock(block_dev_mappings_guard);
-        block_dev_mappings.emplace(
-                std::make_pair(uevent->path, std::move(info)));
+        block_dev_index_add(uevent->path, std::move(info));
     } else if (strcmp(uevent->action, "remove") == 0) {
-        std::lock_guard<std::mutex> lock(block_dev_mappings_guard);
-        block_dev_mappings.erase(uevent->path);
+        block_dev_index_remove(uevent->path);
     }
 }
 
@@ -664,53 +815,35 @@ static void handle_generic_device_event(struct uevent *uevent)
         }
     } else if (strncmp(uevent->subsystem, "graphics", 8) == 0) {
         base = "/dev/graphics/";
-        if (!dry_run) {
-            mkdir(base, 0755);
-        }
+        mkdir_cached(base);
     } else if (strncmp(uevent->subsystem, "drm", 3) == 0) {
         base = "/dev/dri/";
-        if (!dry_run) {
-            mkdir(base, 0755);
-        }
+        mkdir_cached(base);
     } else if (strncmp(uevent->subsystem, "oncrpc", 6) == 0) {
         base = "/dev/oncrpc/";
-        if (!dry_run) {
-            mkdir(base, 0755);
-        }
+        mkdir_cached(base);
     } else if (strncmp(uevent->subsystem, "adsp", 4) == 0) {
         base = "/dev/adsp/";
-        if (!dry_run) {
-            mkdir(base, 0755);
-        }
+        mkdir_cached(base);
     } else if (strncmp(uevent->subsystem, "msm_camera", 10) == 0) {
         base = "/dev/msm_camera/";
-        if (!dry_run) {
-            mkdir(base, 0755);
-        }
+        mkdir_cached(base);
     } else if (strncmp(uevent->subsystem, "input", 5) == 0) {
         base = "/dev/input/";
-        if (!dry_run) {
-            mkdir(base, 0755);
-        }
+        mkdir_cached(base);
     } else if (strncmp(uevent->subsystem, "mtd", 3) == 0) {
         base = "/dev/mtd/";
-        if (!dry_run) {
-            mkdir(base, 0755);
-        }
+        mkdir_cached(base);
     } else if (strncmp(uevent->subsystem, "sound", 5) == 0) {
         base = "/dev/snd/";
-        if (!dry_run) {
-            mkdir(base, 0755);
-        }
+        mkdir_cached(base);
     } else if (strncmp(uevent->subsystem, "misc", 4) == 0
             && strncmp(name, "log_", 4) == 0) {
 #if UEVENT_LOGGING
         LOGI("kernel logger is deprecated");
 #endif
         base = "/dev/log/";
-        if (!dry_run) {
-            mkdir(base, 0755);
-        }
+        mkdir_cached(base);
         name += 4;
     } else {
         base = "/dev/";
@@ -737,29 +870,95 @@ static void handle_device_event(struct uevent *uevent)
 }
 
 #define UEVENT_MSG_LEN  2048
+
+static void handle_uevent_msg(char *msg, ssize_t n)
+{
+    if (n >= UEVENT_MSG_LEN) {
+        // overflow -- discard
+        return;
+    }
+
+    msg[n] = '\0';
+    msg[n + 1] = '\0';
+
+    struct uevent uevent;
+    parse_event(msg, &uevent);
+
+    if (uevent.path && strstr(uevent.path, "sec-battery")) {
+        // sec-battery causes boot delays on the Galaxy S4
+        return;
+    }
+
+    handle_device_event(&uevent);
+}
+
+// Preallocated buffers for batched receiving. Only one thread handles events
+// at a time.
+static char uevent_msgs[UEVENT_BATCH_SIZE][UEVENT_MSG_LEN + 2];
+static bool have_recvmmsg = true;
+
+/*
+ * Record a boot trace span for a drain of the netlink socket. Drains that did
+ * not receive anything (most of them during coldboot) are not recorded so they
+ * don't push the interesting spans out of the trace buffer.
+ */
+static void trace_device_fd(uint64_t start, unsigned int handled)
+{
+    if (handled > 0) {
+        char arg[16];
+        snprintf(arg, sizeof(arg), "%u", handled);
+        mb::boot_trace_record("handle_device_fd", arg, start,
+                              mb::boot_trace_now());
+    }
+}
+
+/*
+ * Drain the netlink socket, receiving up to UEVENT_BATCH_SIZE messages per
+ * syscall. Returns once the socket would block.
+ */
 void handle_device_fd()
 {
-    char msg[UEVENT_MSG_LEN + 2];
+    void *buffers[UEVENT_BATCH_SIZE];
+    ssize_t sizes[UEVENT_BATCH_SIZE];
     int n;
-    while ((n = uevent_kernel_multicast_recv(device_fd, msg, UEVENT_MSG_LEN)) > 0) {
-        if (n >= UEVENT_MSG_LEN) {
-            // overflow -- discard
-            continue;
-        }
-
-        msg[n] = '\0';
-        msg[n + 1] = '\0';
+    uint64_t start = mb::boot_trace_now();
+    unsigned int handled = 0;
 
-        struct uevent uevent;
-        parse_event(msg, &uevent);
+    for (int i = 0; i < UEVENT_BATCH_SIZE; ++i) {
+        buffers[i] = uevent_msgs[i];
+    }
 
-        if (uevent.path && strstr(uevent.path, "sec-battery")) {
-            // sec-battery causes boot delays on the Galaxy S4
+    while (have_recvmmsg) {
+        n = uevent_kernel_multicast_recvmmsg(
+                device_fd, buffers, UEVENT_MSG_LEN, sizes, UEVENT_BATCH_SIZE);
+        if (n < 0 && errno == EINTR) {
             continue;
+        } else if (n < 0 && errno == ENOSYS) {
+            // Kernels older than 2.6.33
+            have_recvmmsg = false;
+            break;
+        } else if (n <= 0) {
+            block_dev_index_publish();
+            trace_device_fd(start, handled);
+            return;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            if (sizes[i] > 0) {
+                handle_uevent_msg(uevent_msgs[i], sizes[i]);
+                ++handled;
+            }
         }
+    }
 
-        handle_device_event(&uevent);
+    while ((n = uevent_kernel_multicast_recv(
+            device_fd, uevent_msgs[0], UEVENT_MSG_LEN)) > 0) {
+        handle_uevent_msg(uevent_msgs[0], n);
+        ++handled;
     }
+
+    block_dev_index_publish();
+    trace_device_fd(start, handled);
 }
 
 /*
@@ -817,6 +1016,184 @@ static void coldboot(const char *path)
     }
 }
 
+/*
+ * Parallel coldboot splits the work between several walker threads, which only
+ * poke uevent files, and a single consumer thread, which is the only thread
+ * that receives and handles events (the handlers are not thread safe).
+ *
+ * Walkers share a stack of directories. A directory's uevent file is always
+ * written before its subdirectories are pushed, so a parent device's add event
+ * is always emitted before those of its children. Since the kernel queues the
+ * event synchronously during the write, once all walkers have exited, draining
+ * the socket until it would block handles every coldboot event.
+ */
+
+struct ColdbootState
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    // Directories that still need to be walked
+    std::vector<std::string> dirs;
+    // Number of walkers currently processing a directory
+    unsigned int busy = 0;
+    // Set once all walkers have exited
+    std::atomic_bool done{false};
+};
+
+static void coldboot_walk_dir(const std::string &path,
+                              std::vector<std::string> &children)
+{
+    struct dirent *de;
+    DIR *d;
+    int dfd, fd;
+
+    dfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) {
+        return;
+    }
+
+    fd = openat(dfd, "uevent", O_WRONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        write(fd, "add\n", 4);
+        close(fd);
+    }
+
+    d = fdopendir(dfd);
+    if (!d) {
+        close(dfd);
+        return;
+    }
+
+    while ((de = readdir(d))) {
+        if (de->d_type != DT_DIR || de->d_name[0] == '.') {
+            continue;
+        }
+
+        children.push_back(path);
+        children.back() += '/';
+        children.back() += de->d_name;
+    }
+
+    closedir(d);
+}
+
+static void * coldboot_walker(void *userdata)
+{
+    ColdbootState *state = static_cast<ColdbootState *>(userdata);
+    std::vector<std::string> children;
+    std::string path;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(state->mutex);
+
+            // Another walker may still push more directories
+            state->cv.wait(lock, [&]{
+                return !state->dirs.empty() || state->busy == 0;
+            });
+            if (state->dirs.empty()) {
+                return nullptr;
+            }
+
+            path.swap(state->dirs.back());
+            state->dirs.pop_back();
+            ++state->busy;
+        }
+
+        coldboot_walk_dir(path, children);
+
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+
+            // Push in reverse so that directories are popped in readdir order
+            for (auto it = children.rbegin(); it != children.rend(); ++it) {
+                state->dirs.push_back(std::move(*it));
+            }
+            --state->busy;
+        }
+
+        children.clear();
+        state->cv.notify_all();
+    }
+}
+
+static void * coldboot_consumer(void *userdata)
+{
+    ColdbootState *state = static_cast<ColdbootState *>(userdata);
+    struct pollfd fds[1];
+    fds[0].fd = device_fd;
+    fds[0].events = POLLIN;
+
+    while (true) {
+        // Check before draining so that the final drain happens after the
+        // last uevent write
+        bool done = state->done.load();
+
+        handle_device_fd();
+
+        if (done) {
+            break;
+        }
+
+        fds[0].revents = 0;
+        poll(fds, 1, COLDBOOT_POLL_MS);
+    }
+
+    return nullptr;
+}
+
+static bool parallel_coldboot(const std::vector<const char *> &paths)
+{
+    ColdbootState state;
+    std::vector<pthread_t> walkers;
+    pthread_t consumer;
+    long n_walkers;
+    int ret;
+
+    n_walkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_walkers < 1) {
+        n_walkers = 1;
+    } else if (n_walkers > COLDBOOT_MAX_WALKERS) {
+        n_walkers = COLDBOOT_MAX_WALKERS;
+    }
+
+    for (auto it = paths.rbegin(); it != paths.rend(); ++it) {
+        state.dirs.push_back(*it);
+    }
+
+    ret = pthread_create(&consumer, nullptr, &coldboot_consumer, &state);
+    if (ret != 0) {
+        LOGW("Failed to create coldboot consumer thread: %s", strerror(ret));
+        return false;
+    }
+
+    // The calling thread is also a walker
+    for (long i = 1; i < n_walkers; ++i) {
+        pthread_t walker;
+
+        ret = pthread_create(&walker, nullptr, &coldboot_walker, &state);
+        if (ret != 0) {
+            LOGW("Failed to create coldboot walker thread: %s", strerror(ret));
+            break;
+        }
+
+        walkers.push_back(walker);
+    }
+
+    coldboot_walker(&state);
+
+    for (pthread_t walker : walkers) {
+        pthread_join(walker, nullptr);
+    }
+
+    state.done = true;
+    pthread_join(consumer, nullptr);
+
+    LOGV("Coldboot completed with %zu walker threads", walkers.size() + 1);
+
+    return true;
+}
+
 void * device_thread(void *)
 {
     struct pollfd fds[2];
@@ -854,17 +1231,22 @@ void device_init(bool dry_run_)
         strlcpy(bootdevice, value.c_str(), sizeof(bootdevice));
     }
 
-    // Is 256K enough? udev uses 16MB!
-    device_fd = uevent_open_socket(256 * 1024, true);
+    device_fd = uevent_open_socket(COLDBOOT_RCVBUF_SIZE, true);
     if (device_fd < 0) {
         return;
     }
 
     fcntl(device_fd, F_SETFL, O_NONBLOCK);
 
-    coldboot("/sys/class");
-    coldboot("/sys/block");
-    coldboot("/sys/devices");
+    if (!parallel_coldboot({ "/sys/class", "/sys/block", "/sys/devices" })) {
+        coldboot("/sys/class");
+        coldboot("/sys/block");
+        coldboot("/sys/devices");
+    }
+
+    // Shrinking the buffer does not drop messages that are already queued
+    int buf_sz = UEVENT_RCVBUF_SIZE;
+    setsockopt(device_fd, SOL_SOCKET, SO_RCVBUFFORCE, &buf_sz, sizeof(buf_sz));
 
     run_thread = true;
     pipe(pipe_fd);
@@ -889,8 +1271,43 @@ int get_device_fd()
     return device_fd;
 }
 
-std::unordered_map<std::string, BlockDevInfo> get_block_dev_mappings()
+const BlockDevInfo * BlockDevIndex::find_by_partition_name(const std::string &name) const
+{
+    auto it = by_partition_name.find(name);
+    return it == by_partition_name.end() ? nullptr : it->second.get();
+}
+
+const BlockDevInfo * BlockDevIndex::find_by_dev(int major, int minor) const
 {
-    std::lock_guard<std::mutex> lock(block_dev_mappings_guard);
-    return block_dev_mappings;
+    auto it = by_dev.find(block_dev_key(major, minor));
+    return it == by_dev.end() ? nullptr : it->second.get();
+}
+
+const BlockDevInfo * BlockDevIndex::find_by_path(const std::string &path) const
+{
+    auto it = by_path.find(path);
+    return it == by_path.end() ? nullptr : it->second.get();
+}
+
+BlockDevIndexPtr get_block_dev_index()
+{
+    return std::atomic_load(&block_dev_index_published);
+}
+
+/*
+ * Wait for a snapshot newer than `current` to be published by the uevent
+ * thread. Returns the latest snapshot, which is `current` if the timeout was
+ * reached.
+ */
+BlockDevIndexPtr wait_for_block_dev_index(const BlockDevIndexPtr &current,
+                                          unsigned int timeout_ms)
+{
+    std::unique_lock<std::mutex> lock(block_dev_index_mutex);
+
+    block_dev_index_cv.wait_for(
+            lock, std::chrono::milliseconds(timeout_ms), [&] {
+        return std::atomic_load(&block_dev_index_published) != current;
+    });
+
+    return std::atomic_load(&block_dev_index_published);
 }
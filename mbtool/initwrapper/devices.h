@@ -17,8 +17,12 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
 #include <unordered_map>
+#include <vector>
+
+#include <cstdint>
 
 #include <sys/stat.h>
 
@@ -29,11 +33,39 @@ struct BlockDevInfo
     int partition_num = -1;     // Partition number
     int major = -1;             // Block device major number
     int minor = -1;             // Block device minor number
+    std::vector<std::string> links; // Symlinks (by-name, by-num, etc.)
 };
 
+typedef std::shared_ptr<const BlockDevInfo> BlockDevInfoPtr;
+
+/*
+ * Immutable snapshot of the known block devices. A new snapshot is published
+ * by the uevent thread whenever block devices are added or removed, so readers
+ * can keep using a snapshot without copying or locking.
+ */
+struct BlockDevIndex
+{
+    // Keyed by sysfs path
+    std::unordered_map<std::string, BlockDevInfoPtr> by_sysfs_path;
+    // Keyed by partition name
+    std::unordered_map<std::string, BlockDevInfoPtr> by_partition_name;
+    // Keyed by (major << 32) | minor
+    std::unordered_map<uint64_t, BlockDevInfoPtr> by_dev;
+    // Keyed by device node path and symlink paths
+    std::unordered_map<std::string, BlockDevInfoPtr> by_path;
+
+    const BlockDevInfo * find_by_partition_name(const std::string &name) const;
+    const BlockDevInfo * find_by_dev(int major, int minor) const;
+    const BlockDevInfo * find_by_path(const std::string &path) const;
+};
+
+typedef std::shared_ptr<const BlockDevIndex> BlockDevIndexPtr;
+
 void handle_device_fd();
 void device_init(bool dry_run);
 void device_close();
 int get_device_fd();
 
-std::unordered_map<std::string, BlockDevInfo> get_block_dev_mappings();
+BlockDevIndexPtr get_block_dev_index();
+BlockDevIndexPtr wait_for_block_dev_index(const BlockDevIndexPtr &current,
+                                          unsigned int timeout_ms);
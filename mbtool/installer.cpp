@@ -21,6 +21,11 @@
 
 // C++
 #include <algorithm>
+#include <condition_variable>
+#include <iterator>
+#include <mutex>
+#include <system_error>
+#include <thread>
 
 // C
 #include <cstring>
@@ -72,6 +77,8 @@
 #include "mbutil/time.h"
 
 // Local
+#include "chroot_template.h"
+#include "ext4_extract.h"
 #include "image.h"
 #include "installer_util.h"
 #include "multiboot.h"
@@ -100,6 +107,10 @@
 
 #define HELPER_TOOL             "/update-binary-tool"
 
+// Matches the old fgets() buffer size
+#define UPDATER_MAX_LINE        1023
+#define UPDATER_READ_SIZE       65536
+
 
 namespace mb {
 
@@ -115,6 +126,9 @@ Installer::Installer(std::string zip_file, std::string chroot_dir,
     , _interface(interface)
     , _output_fd(output_fd)
     , _flags(flags)
+    , _system_is_overlay(false)
+    , _system_compress(false)
+    , _system_compress_type(CompressedImageType::EROFS_IMAGE)
     , _ran(false)
 {
     _passthrough = _output_fd >= 0;
@@ -200,7 +214,7 @@ static bool log_delete_recursive(const std::string &path)
 static bool log_copy_dir(const std::string &source,
                          const std::string &target, int flags)
 {
-    bool ret = util::copy_dir(source, target, flags);
+    bool ret = util::copy_dir(source, target, flags | util::COPY_PARALLEL);
     if (!ret) {
         LOGE("Failed to copy contents of %s/ to %s/",
              source.c_str(), target.c_str());
@@ -209,6 +223,72 @@ static bool log_copy_dir(const std::string &source,
 }
 
 
+/*!
+ * \brief Fill in the parts of the chroot that don't depend on the zip file
+ *
+ * \param root Chroot or chroot template to populate. The `sbin/` and `dev/`
+ *             directories must already exist.
+ */
+static bool populate_chroot_template(const std::string &root)
+{
+    // Copy the contents of sbin since we need to mess with some of the binaries
+    // there. Also, for whatever reason, bind mounting /sbin results in EINVAL
+    // no matter if it's done from here or from busybox.
+    if (!log_copy_dir("/sbin", root + "/sbin",
+                      util::COPY_ATTRIBUTES
+                    | util::COPY_XATTRS
+                    | util::COPY_EXCLUDE_TOP_LEVEL)) {
+        return false;
+    }
+
+    // Remove reboot binary
+    remove((root + "/sbin/reboot").c_str());
+
+    // Don't create unnecessary special files in /dev to avoid install scripts
+    // from overwriting partitions
+    if (log_mknod((root + "/dev/console").c_str(), S_IFCHR | 0644, makedev(5, 1)) < 0
+            || log_mknod((root + "/dev/null").c_str(), S_IFCHR | 0644, makedev(1, 3)) < 0
+            || log_mknod((root + "/dev/ptmx").c_str(), S_IFCHR | 0644, makedev(5, 2)) < 0
+            || log_mknod((root + "/dev/random").c_str(), S_IFCHR | 0644, makedev(1, 8)) < 0
+            || log_mknod((root + "/dev/tty").c_str(), S_IFCHR | 0644, makedev(5, 0)) < 0
+            || log_mknod((root + "/dev/urandom").c_str(), S_IFCHR | 0644, makedev(1, 9)) < 0
+            || log_mknod((root + "/dev/zero").c_str(), S_IFCHR | 0644, makedev(1, 5)) < 0
+            || log_mknod((root + "/dev/loop-control").c_str(), S_IFCHR | 0644, makedev(10, 237)) < 0
+            || log_mknod((root + "/dev/fuse").c_str(), S_IFCHR | 0644, makedev(10, 229))) {
+        return false;
+    }
+
+    // Create a few loopback devices since some installers expect them to exist,
+    // but don't create them. They are not necessary for mbtool to work.
+    if (log_mkdir((root + "/dev/block").c_str(), 0755) < 0
+            || log_mknod((root + "/dev/block/loop0").c_str(), S_IFBLK | 0644, makedev(7, 0)) < 0
+            || log_mknod((root + "/dev/block/loop1").c_str(), S_IFBLK | 0644, makedev(7, 1)) < 0
+            || log_mknod((root + "/dev/block/loop2").c_str(), S_IFBLK | 0644, makedev(7, 2)) < 0
+            || log_mknod((root + "/dev/block/loop3").c_str(), S_IFBLK | 0644, makedev(7, 3)) < 0
+            || log_mknod((root + "/dev/block/loop4").c_str(), S_IFBLK | 0644, makedev(7, 4)) < 0
+            || log_mknod((root + "/dev/block/loop5").c_str(), S_IFBLK | 0644, makedev(7, 5)) < 0
+            || log_mknod((root + "/dev/block/loop6").c_str(), S_IFBLK | 0644, makedev(7, 6)) < 0
+            || log_mknod((root + "/dev/block/loop7").c_str(), S_IFBLK | 0644, makedev(7, 7)) < 0) {
+        return false;
+    }
+
+    // We need /dev/input/* and /dev/graphics/* for AROMA
+    if (!log_copy_dir("/dev/input", root + "/dev/input",
+                      util::COPY_ATTRIBUTES
+                    | util::COPY_XATTRS
+                    | util::COPY_EXCLUDE_TOP_LEVEL)) {
+        return false;
+    }
+    if (!log_copy_dir("/dev/graphics", root + "/dev/graphics",
+                      util::COPY_ATTRIBUTES
+                    | util::COPY_XATTRS
+                    | util::COPY_EXCLUDE_TOP_LEVEL)) {
+        return false;
+    }
+
+    return true;
+}
+
 /*
  * Helper functions
  */
@@ -312,12 +392,31 @@ bool Installer::create_chroot()
         return false;
     }
 
+    // /sbin and /dev are the same for every installer run, so link them from
+    // a template that is only created once per recovery session
+    _chroot_instance.clear();
+    if (chroot_template_create_instance(&populate_chroot_template,
+                                        &_chroot_instance)) {
+        if (log_mount((_chroot_instance + "/dev").c_str(),
+                      in_chroot("/dev").c_str(), "", MS_BIND, "") < 0
+                || log_mount((_chroot_instance + "/sbin").c_str(),
+                             in_chroot("/sbin").c_str(), "", MS_BIND, "") < 0) {
+            return false;
+        }
+    } else {
+        LOGW("Failed to use chroot template; populating chroot directly");
+
+        if (log_mount("none", in_chroot("/dev").c_str(), "tmpfs", 0, "") < 0
+                || log_mount("none", in_chroot("/sbin").c_str(), "tmpfs", 0, "") < 0
+                || !populate_chroot_template(_chroot)) {
+            return false;
+        }
+    }
+
     // Other mounts
-    if (log_mount("none", in_chroot("/dev").c_str(), "tmpfs", 0, "") < 0
-            || log_mkdir(in_chroot("/dev/pts").c_str(), 0755) < 0
+    if (log_mkdir(in_chroot("/dev/pts").c_str(), 0755) < 0
             || log_mount("none", in_chroot("/dev/pts").c_str(), "devpts", 0, "") < 0
             || log_mount("none", in_chroot("/proc").c_str(), "proc", 0, "") < 0
-            || log_mount("none", in_chroot("/sbin").c_str(), "tmpfs", 0, "") < 0
             || log_mount("none", in_chroot("/sys").c_str(), "sysfs", 0, "") < 0
             || log_mount("none", in_chroot("/tmp").c_str(), "tmpfs", 0, "") < 0) {
         return false;
@@ -333,61 +432,6 @@ bool Installer::create_chroot()
         return false;
     }
 
-    // Copy the contents of sbin since we need to mess with some of the binaries
-    // there. Also, for whatever reason, bind mounting /sbin results in EINVAL
-    // no matter if it's done from here or from busybox.
-    if (!log_copy_dir("/sbin", in_chroot("/sbin"),
-                      util::COPY_ATTRIBUTES
-                    | util::COPY_XATTRS
-                    | util::COPY_EXCLUDE_TOP_LEVEL)) {
-        return false;
-    }
-
-    // Remove reboot binary
-    remove(in_chroot("/sbin/reboot").c_str());
-
-    // Don't create unnecessary special files in /dev to avoid install scripts
-    // from overwriting partitions
-    if (log_mknod(in_chroot("/dev/console").c_str(), S_IFCHR | 0644, makedev(5, 1)) < 0
-            || log_mknod(in_chroot("/dev/null").c_str(), S_IFCHR | 0644, makedev(1, 3)) < 0
-            || log_mknod(in_chroot("/dev/ptmx").c_str(), S_IFCHR | 0644, makedev(5, 2)) < 0
-            || log_mknod(in_chroot("/dev/random").c_str(), S_IFCHR | 0644, makedev(1, 8)) < 0
-            || log_mknod(in_chroot("/dev/tty").c_str(), S_IFCHR | 0644, makedev(5, 0)) < 0
-            || log_mknod(in_chroot("/dev/urandom").c_str(), S_IFCHR | 0644, makedev(1, 9)) < 0
-            || log_mknod(in_chroot("/dev/zero").c_str(), S_IFCHR | 0644, makedev(1, 5)) < 0
-            || log_mknod(in_chroot("/dev/loop-control").c_str(), S_IFCHR | 0644, makedev(10, 237)) < 0
-            || log_mknod(in_chroot("/dev/fuse").c_str(), S_IFCHR | 0644, makedev(10, 229))) {
-        return false;
-    }
-
-    // Create a few loopback devices since some installers expect them to exist,
-    // but don't create them. They are not necessary for mbtool to work.
-    if (log_mkdir(in_chroot("/dev/block").c_str(), 0755) < 0
-            || log_mknod(in_chroot("/dev/block/loop0").c_str(), S_IFBLK | 0644, makedev(7, 0)) < 0
-            || log_mknod(in_chroot("/dev/block/loop1").c_str(), S_IFBLK | 0644, makedev(7, 1)) < 0
-            || log_mknod(in_chroot("/dev/block/loop2").c_str(), S_IFBLK | 0644, makedev(7, 2)) < 0
-            || log_mknod(in_chroot("/dev/block/loop3").c_str(), S_IFBLK | 0644, makedev(7, 3)) < 0
-            || log_mknod(in_chroot("/dev/block/loop4").c_str(), S_IFBLK | 0644, makedev(7, 4)) < 0
-            || log_mknod(in_chroot("/dev/block/loop5").c_str(), S_IFBLK | 0644, makedev(7, 5)) < 0
-            || log_mknod(in_chroot("/dev/block/loop6").c_str(), S_IFBLK | 0644, makedev(7, 6)) < 0
-            || log_mknod(in_chroot("/dev/block/loop7").c_str(), S_IFBLK | 0644, makedev(7, 7)) < 0) {
-        return false;
-    }
-
-    // We need /dev/input/* and /dev/graphics/* for AROMA
-    if (!log_copy_dir("/dev/input", in_chroot("/dev/input"),
-                      util::COPY_ATTRIBUTES
-                    | util::COPY_XATTRS
-                    | util::COPY_EXCLUDE_TOP_LEVEL)) {
-        return false;
-    }
-    if (!log_copy_dir("/dev/graphics", in_chroot("/dev/graphics"),
-                      util::COPY_ATTRIBUTES
-                    | util::COPY_XATTRS
-                    | util::COPY_EXCLUDE_TOP_LEVEL)) {
-        return false;
-    }
-
     // Mount EFS partition so patched Odin images can properly set up multi-CSC
     if (!mount_efs()) {
         return false;
@@ -437,6 +481,10 @@ bool Installer::destroy_chroot() const
         return false;
     }
 
+    if (!_chroot_instance.empty()) {
+        chroot_template_remove_instance(_chroot_instance);
+    }
+
     util::delete_recursive(_chroot);
 
     if (log_is_mounted("/efs")) {
@@ -477,32 +525,28 @@ bool Installer::mount_efs() const
         if (stat("/twres", &sb) == 0 && S_ISDIR(sb.st_mode)) {
             LOGD("Looking for /efs entry in TWRP-format fstab");
 
-            std::vector<util::twrp_fstab_rec> recs =
-                    util::read_twrp_fstab("/etc/recovery.fstab");
-            for (const util::twrp_fstab_rec &rec : recs) {
-                if (util::path_compare(rec.mount_point, "/efs") == 0
-                        || util::path_compare(rec.mount_point, "/efs1") == 0) {
-                    LOGD("Found /efs fstab entry");
-                    for (const std::string &dev : rec.blk_devices) {
-                        if (stat(dev.c_str(), &sb) == 0) {
-                            efs_dev = dev.c_str();
-                            break;
-                        }
+            auto fstab = util::load_twrp_fstab("/etc/recovery.fstab");
+            const util::twrp_fstab_rec *rec = nullptr;
+            if (fstab && !(rec = fstab->find("/efs"))) {
+                rec = fstab->find("/efs1");
+            }
+            if (rec) {
+                LOGD("Found /efs fstab entry");
+                for (const std::string &dev : rec->blk_devices) {
+                    if (stat(dev.c_str(), &sb) == 0) {
+                        efs_dev = dev.c_str();
+                        break;
                     }
-                    break;
                 }
             }
         } else {
             LOGE("Looking for /efs entry in non-TWRP-format fstab");
 
-            std::vector<util::fstab_rec> recs =
-                    util::read_fstab("/etc/recovery.fstab");
-            for (const util::fstab_rec &rec : recs) {
-                if (util::path_compare(rec.mount_point, "/efs") == 0) {
-                    LOGD("Found /efs fstab entry");
-                    efs_dev = rec.blk_device;
-                    break;
-                }
+            auto fstab = util::load_fstab("/etc/recovery.fstab");
+            const util::fstab_rec *rec = fstab ? fstab->find("/efs") : nullptr;
+            if (rec) {
+                LOGD("Found /efs fstab entry");
+                efs_dev = rec->blk_device;
             }
         }
 
@@ -582,7 +626,9 @@ bool Installer::extract_multiboot_files()
         });
     }
 
-    if (!util::extract_files2(_zip_file, files)) {
+    if (!(_zip_index.is_open()
+            ? util::extract_files2(_zip_index, files)
+            : util::extract_files2(_zip_file, files))) {
         LOGE("Failed to extract all multiboot files");
         return false;
     }
@@ -596,16 +642,22 @@ bool Installer::extract_multiboot_files()
         _temp + "/binaries/mount.exfat",
     };
 
+    std::vector<std::pair<std::string, std::string>> sig_items;
     for (auto const &item : sigcheck) {
-        SigVerifyResult result =
-                verify_signature(item.c_str(), (item + ".sig").c_str());
-        if (result != SigVerifyResult::VALID) {
-            LOGE("%s: Signature verification failed", item.c_str());
-            return false;
+        sig_items.emplace_back(item, item + ".sig");
+    }
+
+    auto results = verify_signatures_batch(sig_items);
+    bool ret = true;
+
+    for (size_t i = 0; i < sigcheck.size(); ++i) {
+        if (results[i] != SigVerifyResult::VALID) {
+            LOGE("%s: Signature verification failed", sigcheck[i].c_str());
+            ret = false;
         }
     }
 
-    return true;
+    return ret;
 }
 
 /*!
@@ -639,15 +691,37 @@ bool Installer::set_up_busybox_wrapper()
  *
  * \param path Image file path
  */
-bool Installer::create_image(const std::string &path, uint64_t size)
+bool Installer::create_image(const std::string &path, uint64_t size,
+                             const std::string &source_dir, bool *populated)
 {
+    if (populated) {
+        *populated = false;
+    }
+
     if (!util::mkdir_parent(path, S_IRWXU)) {
         LOGE("%s: Failed to create parent directory: %s",
              path.c_str(), strerror(errno));
         return false;
     }
 
-    auto result = create_ext4_image(path, size);
+    auto result = CreateImageResult::UNSUPPORTED;
+
+    if (!source_dir.empty()) {
+        result = create_ext4_image_from_dir(path, size, source_dir);
+        if (result == CreateImageResult::SUCCEEDED) {
+            if (populated) {
+                *populated = true;
+            }
+        } else if (result == CreateImageResult::FAILED) {
+            LOGW("%s: Failed to create image from %s; creating empty image",
+                 path.c_str(), source_dir.c_str());
+            result = CreateImageResult::UNSUPPORTED;
+        }
+    }
+
+    if (result == CreateImageResult::UNSUPPORTED) {
+        result = create_ext4_image(path, size);
+    }
     if (result == CreateImageResult::NOT_ENOUGH_SPACE) {
         uint64_t avail = util::mount_get_avail_size(util::dir_name(path).c_str());
         display_msg(std::string());
@@ -685,6 +759,15 @@ bool Installer::system_image_copy(const std::string &source,
         return false;
     }
 
+    // Read the image directly instead of going through a loop device
+    if (reverse) {
+        if (ext4_extract_image(image, source)) {
+            return true;
+        }
+        LOGW("%s: Failed to extract image directly; mounting it instead",
+             image.c_str());
+    }
+
     if (stat(temp_mnt.c_str(), &sb) < 0
             && mkdir(temp_mnt.c_str(), 0755) < 0) {
         LOGE("Failed to create %s: %s", temp_mnt.c_str(), strerror(errno));
@@ -718,6 +801,125 @@ bool Installer::system_image_copy(const std::string &source,
     return true;
 }
 
+/*!
+ * \brief Replace the contents of an overlay slot's /system with an image
+ *
+ * The upper layer is reset first, so the overlay must not be mounted. The image
+ * is then synced to the overlay so that only the files that differ from the
+ * lower layer end up in the upper layer.
+ *
+ * \param image Source image file
+ */
+bool Installer::system_image_sync_overlay(const std::string &image)
+{
+    std::string temp_mnt(_temp);
+    temp_mnt += "/.system.tmp";
+
+    auto done = util::finally([&] {
+        util::umount(temp_mnt.c_str());
+        util::umount(_system_overlay_mnt.c_str());
+    });
+
+    if (!reset_system_overlay(_system_overlay)
+            || !mount_system_overlay(_system_overlay, _system_overlay_mnt)) {
+        return false;
+    }
+
+    if (!util::mkdir_recursive(temp_mnt, 0755) && errno != EEXIST) {
+        LOGE("Failed to create %s: %s", temp_mnt.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!util::mount(image.c_str(), temp_mnt.c_str(), "auto", MS_RDONLY, "")) {
+        LOGE("Failed to mount %s: %s", image.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!sync_to_overlay(temp_mnt, _system_overlay_mnt)) {
+        LOGE("Failed to sync system files from %s to %s",
+             temp_mnt.c_str(), _system_overlay_mnt.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Replace a compressed system image with a writable ext4 image
+ *
+ * Does nothing if the system image does not exist or is already an ext4 image.
+ * Otherwise, the compressed image is mounted read-only and copied into a new
+ * ext4 image, which then replaces it. The system image is compressed with the
+ * same type again once the installation completes.
+ *
+ * \param size Size of the new ext4 image
+ */
+bool Installer::system_image_expand(uint64_t size)
+{
+    if (access(_system_path.c_str(), F_OK) < 0) {
+        return true;
+    }
+
+    bool compressed;
+    CompressedImageType type;
+    if (!get_compressed_image_type(_system_path, compressed, type)) {
+        return false;
+    } else if (!compressed) {
+        return true;
+    }
+
+    if (!_system_compress) {
+        _system_compress = true;
+        _system_compress_type = type;
+    }
+
+    std::string temp_mnt(_temp);
+    temp_mnt += "/.system.ro";
+    std::string temp_image(_system_path);
+    temp_image += ".ext4.tmp";
+    remove(temp_image.c_str());
+
+    auto done = util::finally([&] {
+        util::umount(temp_mnt.c_str());
+    });
+
+    if (!util::mkdir_recursive(temp_mnt, 0755) && errno != EEXIST) {
+        LOGE("Failed to create %s: %s", temp_mnt.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!util::mount(_system_path.c_str(), temp_mnt.c_str(), "auto",
+                     MS_RDONLY, "")) {
+        LOGE("Failed to mount %s: %s", _system_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    bool populated;
+    if (!create_image(temp_image, size, temp_mnt, &populated)) {
+        return false;
+    }
+
+    if (!populated && !system_image_copy(temp_mnt, temp_image, false)) {
+        remove(temp_image.c_str());
+        return false;
+    }
+
+    if (!util::umount(temp_mnt.c_str())) {
+        LOGE("Failed to unmount %s: %s", temp_mnt.c_str(), strerror(errno));
+        remove(temp_image.c_str());
+        return false;
+    }
+
+    if (rename(temp_image.c_str(), _system_path.c_str()) < 0) {
+        LOGE("Failed to rename %s to %s: %s", temp_image.c_str(),
+             _system_path.c_str(), strerror(errno));
+        remove(temp_image.c_str());
+        return false;
+    }
+
+    return true;
+}
+
 /*!
  * \brief Bind mount directory or create and mount image
  *
@@ -857,69 +1059,190 @@ bool Installer::set_up_legacy_properties()
     return true;
 }
 
-bool Installer::updater_fd_reader(int stdio_fd, int command_fd)
+/*
+ * Lines read from the updater, waiting to be dispatched to the UI. The reader
+ * threads only split and parse lines, so they keep draining the pipes (and the
+ * updater keeps running) even while the UI is slow.
+ */
+class UpdaterOutputQueue
 {
-    int status;
-    pid_t pid = fork();
-
-    if (pid < 0) {
-        LOGE("Failed to fork updater fd reader process");
-    } else if (pid == 0) {
-        // Don't need command_fd in the child process
-        close(command_fd);
+public:
+    enum class Type
+    {
+        OUTPUT,
+        PRINT,
+        UNKNOWN_COMMAND,
+    };
 
-        // Read program output in child process (stdout, stderr)
-        char buf[1024];
+    struct Item
+    {
+        Type type;
+        std::string text;
+    };
 
-        autoclose::file fp(fdopen(stdio_fd, "rb"), fclose);
+    explicit UpdaterOutputQueue(int readers) : _readers(readers)
+    {
+    }
 
-        while (fgets(buf, sizeof(buf), fp.get())) {
-            command_output(buf);
+    void push(std::vector<Item> &items, bool done)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            std::move(items.begin(), items.end(), std::back_inserter(_items));
+            if (done) {
+                --_readers;
+            }
         }
+        items.clear();
+        _cv.notify_one();
+    }
+
+    // Take everything that's queued. Returns false once all readers are done
+    // and nothing is left.
+    bool pop_all(std::vector<Item> &items)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [&]{
+            return !_items.empty() || _readers == 0;
+        });
+        items.swap(_items);
+        return !items.empty();
+    }
 
-        _exit(EXIT_SUCCESS);
+private:
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::vector<Item> _items;
+    int _readers;
+};
+
+static void parse_updater_line(std::string &line, bool is_command,
+                               std::vector<UpdaterOutputQueue::Item> &items)
+{
+    using Type = UpdaterOutputQueue::Type;
+
+    if (!is_command) {
+        items.push_back({ Type::OUTPUT, std::move(line) });
+        return;
+    }
+
+    char *save_ptr;
+    char *buf = &line[0];
+
+    // Similar parsing to AOSP recovery
+    char *cmd = strtok_r(buf, " \n", &save_ptr);
+    if (!cmd) {
+        return;
+    } else if (strcmp(cmd, "progress") == 0
+            || strcmp(cmd, "set_progress") == 0
+            || strcmp(cmd, "wipe_cache") == 0
+            || strcmp(cmd, "clear_display") == 0
+            || strcmp(cmd, "enable_reboot") == 0) {
+        // Ignore. These are dropped here so that progress spam from block
+        // based OTAs never reaches the queue.
+    } else if (strcmp(cmd, "ui_print") == 0) {
+        char *str = strtok_r(nullptr, "\n", &save_ptr);
+        items.push_back({ Type::PRINT, str ? str : "\n" });
     } else {
-        // Read special command fd in parent process
-
-        char buf[1024];
-        char *save_ptr;
-
-        // Similar parsing to AOSP recovery
-        autoclose::file fp(fdopen(command_fd, "rb"), fclose);
-
-        while (fgets(buf, sizeof(buf), fp.get())) {
-            char *cmd = strtok_r(buf, " \n", &save_ptr);
-            if (!cmd) {
-                continue;
-            } else if (strcmp(cmd, "progress") == 0
-                    || strcmp(cmd, "set_progress") == 0
-                    || strcmp(cmd, "wipe_cache") == 0
-                    || strcmp(cmd, "clear_display") == 0
-                    || strcmp(cmd, "enable_reboot") == 0) {
-                // Ignore
-            } else if (strcmp(cmd, "ui_print") == 0) {
-                char *str = strtok_r(nullptr, "\n", &save_ptr);
-                if (str) {
-                    updater_print(str);
-                } else {
-                    updater_print("\n");
-                }
-            } else {
-                LOGE("Unknown updater command: %s", cmd);
+        items.push_back({ Type::UNKNOWN_COMMAND, cmd });
+    }
+}
+
+static void read_updater_fd(int fd, bool is_command, UpdaterOutputQueue *queue)
+{
+    std::vector<char> buf(UPDATER_READ_SIZE);
+    std::vector<UpdaterOutputQueue::Item> items;
+    std::string line;
+
+    while (true) {
+        ssize_t n = read(fd, buf.data(), buf.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            LOGE("Failed to read updater output: %s", strerror(errno));
+            break;
+        } else if (n == 0) {
+            break;
+        }
+
+        const char *ptr = buf.data();
+        const char *end = ptr + n;
+
+        while (ptr < end) {
+            size_t take = std::min<size_t>(UPDATER_MAX_LINE - line.size(),
+                                           end - ptr);
+            const char *newline = static_cast<const char *>(
+                    memchr(ptr, '\n', take));
+            if (newline) {
+                take = newline - ptr + 1;
+            }
+
+            line.append(ptr, take);
+            ptr += take;
+
+            if (newline || line.size() == UPDATER_MAX_LINE) {
+                parse_updater_line(line, is_command, items);
+                line.clear();
             }
         }
 
-        do {
-            if (waitpid(pid, &status, 0) < 0) {
-                LOGE("Failed to waitpid(): %s", strerror(errno));
-                return false;
+        queue->push(items, false);
+    }
+
+    if (!line.empty()) {
+        parse_updater_line(line, is_command, items);
+    }
+
+    queue->push(items, true);
+}
+
+bool Installer::updater_fd_reader(int stdio_fd, int command_fd)
+{
+    UpdaterOutputQueue queue(2);
+    std::thread stdio_thread;
+    std::thread command_thread;
+
+    try {
+        stdio_thread = std::thread(&read_updater_fd, stdio_fd, false, &queue);
+    } catch (const std::system_error &e) {
+        LOGE("Failed to start updater output reader: %s", e.what());
+        return false;
+    }
+
+    // Read the command fd on this thread if no more threads can be created
+    try {
+        command_thread = std::thread(
+                &read_updater_fd, command_fd, true, &queue);
+    } catch (const std::system_error &e) {
+        LOGW("Failed to start updater command reader: %s", e.what());
+        read_updater_fd(command_fd, true, &queue);
+    }
+
+    std::vector<UpdaterOutputQueue::Item> items;
+
+    while (queue.pop_all(items)) {
+        for (const UpdaterOutputQueue::Item &item : items) {
+            switch (item.type) {
+            case UpdaterOutputQueue::Type::OUTPUT:
+                command_output(item.text);
+                break;
+            case UpdaterOutputQueue::Type::PRINT:
+                updater_print(item.text);
+                break;
+            case UpdaterOutputQueue::Type::UNKNOWN_COMMAND:
+                LOGE("Unknown updater command: %s", item.text.c_str());
+                break;
             }
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+        }
+        items.clear();
+    }
 
-        return true;
+    stdio_thread.join();
+    if (command_thread.joinable()) {
+        command_thread.join();
     }
 
-    return false;
+    return true;
 }
 
 /*!
@@ -961,7 +1284,7 @@ bool Installer::run_real_updater()
 
     pid_t parent = getppid();
 
-    bool aroma = is_aroma(chroot_updater);
+    bool aroma = updater_is_aroma(chroot_updater);
     LOGD("update-binary is AROMA: %d", aroma);
 
     if (aroma) {
@@ -1159,6 +1482,21 @@ bool Installer::is_aroma(const std::string &path)
     });
 }
 
+/*!
+ * \brief Check if the zip uses the AROMA installer
+ *
+ * AROMA zips always contain their config file, which is much cheaper to look
+ * up in the zip index than scanning the updater binary.
+ */
+bool Installer::updater_is_aroma(const std::string &path) const
+{
+    if (_zip_index.is_open()
+            && _zip_index.find("META-INF/com/google/android/aroma-config")) {
+        return true;
+    }
+    return is_aroma(path);
+}
+
 
 /*
  * Default hooks
@@ -1252,17 +1590,27 @@ void Installer::on_cleanup(Installer::ProceedState ret)
 
 Installer::ProceedState Installer::install_stage_initialize()
 {
+    InstallerStats::Scope stage(_stats, "initialize");
+
     LOGD("Installer version: %s (%s)", mb::version(), mb::git_version());
 
     LOGD("[Installer] Initialization stage");
 
+    // Every later lookup in the zip reuses this index
+    if (!_zip_index.open(_zip_file)) {
+        LOGW("%s: Failed to index zip; reading sequentially",
+             _zip_file.c_str());
+    }
+
     std::vector<util::exists_info> info{
         { "system.transfer.list", false },
         { "system.new.dat", false },
         { "system.img", false },
         { "system.img.sparse", false },
     };
-    if (!util::archive_exists(_zip_file, info)) {
+    if (!(_zip_index.is_open()
+            ? util::archive_exists(_zip_index, info)
+            : util::archive_exists(_zip_file, info))) {
         LOGE("Failed to read zip file");
     } else {
         _has_block_image = false;
@@ -1286,6 +1634,8 @@ Installer::ProceedState Installer::install_stage_initialize()
 
 Installer::ProceedState Installer::install_stage_create_chroot()
 {
+    InstallerStats::Scope stage(_stats, "create_chroot");
+
     LOGD("[Installer] Chroot creation stage");
 
     display_msg("Creating chroot environment");
@@ -1302,6 +1652,8 @@ Installer::ProceedState Installer::install_stage_create_chroot()
 
 Installer::ProceedState Installer::install_stage_set_up_environment()
 {
+    InstallerStats::Scope stage(_stats, "set_up_environment");
+
     LOGD("[Installer] Environment set up stage");
 
     if (!log_delete_recursive(_temp)) {
@@ -1311,9 +1663,13 @@ Installer::ProceedState Installer::install_stage_set_up_environment()
         return ProceedState::Fail;
     }
 
-    if (!extract_multiboot_files()) {
-        display_msg("Failed to extract multiboot files from zip");
-        return ProceedState::Fail;
+    {
+        InstallerStats::Scope op(_stats, "extract_multiboot_files");
+
+        if (!extract_multiboot_files()) {
+            display_msg("Failed to extract multiboot files from zip");
+            return ProceedState::Fail;
+        }
     }
 
     // Load info.prop
@@ -1327,6 +1683,8 @@ Installer::ProceedState Installer::install_stage_set_up_environment()
 
 Installer::ProceedState Installer::install_stage_check_device()
 {
+    InstallerStats::Scope stage(_stats, "check_device");
+
     LOGD("[Installer] Device verification stage");
 
     std::vector<unsigned char> contents;
@@ -1511,6 +1869,8 @@ Installer::ProceedState Installer::install_stage_check_device()
 
 Installer::ProceedState Installer::install_stage_get_install_type()
 {
+    InstallerStats::Scope stage(_stats, "get_install_type");
+
     LOGD("[Installer] Retrieve install type stage");
 
     std::string install_type = get_install_type();
@@ -1547,7 +1907,39 @@ Installer::ProceedState Installer::install_stage_get_install_type()
         return ProceedState::Fail;
     }
 
+    // Let the zip turn the slot into an overlay of another ROM
+    const std::string &lower_id = _prop["mbtool.installer.system-overlay"];
+    if (!lower_id.empty() && !set_system_overlay(_rom, lower_id)) {
+        display_msg("Cannot use %s as the base for %s",
+                    lower_id.c_str(), _rom->id.c_str());
+        return ProceedState::Fail;
+    }
+
+    if (!get_system_overlay(_rom, _system_is_overlay, _system_overlay)) {
+        display_msg("Invalid overlay configuration for %s", _rom->id.c_str());
+        return ProceedState::Fail;
+    }
+
+    // Let the zip ask for the system image to be compressed afterwards
+    const std::string &compress_type = _prop["mbtool.installer.system-compress"];
+    if (!compress_type.empty()) {
+        if (!_rom->system_is_image) {
+            LOGW("%s: Not an image; ignoring system-compress property",
+                 _system_path.c_str());
+        } else if (!compressed_image_type_from_name(compress_type,
+                                                    _system_compress_type)) {
+            display_msg("Unknown compressed image type: %s",
+                        compress_type.c_str());
+            return ProceedState::Fail;
+        } else {
+            _system_compress = true;
+        }
+    }
+
     display_msg("- /system: " + _system_path);
+    if (_system_is_overlay) {
+        display_msg("- /system overlays: " + _system_overlay.lower);
+    }
     display_msg("- /cache: " + _cache_path);
     display_msg("- /data: " + _data_path);
     display_msg("- System is image file: %s",
@@ -1563,6 +1955,8 @@ Installer::ProceedState Installer::install_stage_get_install_type()
 
 Installer::ProceedState Installer::install_stage_set_up_chroot()
 {
+    InstallerStats::Scope stage(_stats, "set_up_chroot");
+
     LOGD("[Installer] Chroot set up stage");
 
     // Calculate SHA512 hash of the boot partition
@@ -1624,6 +2018,8 @@ Installer::ProceedState Installer::install_stage_set_up_chroot()
 
 Installer::ProceedState Installer::install_stage_mount_filesystems()
 {
+    InstallerStats::Scope stage(_stats, "mount_filesystems");
+
     LOGD("[Installer] Filesystem mounting stage");
 
     if (_flags & InstallerFlags::INSTALLER_SKIP_MOUNTING_VOLUMES) {
@@ -1665,6 +2061,26 @@ Installer::ProceedState Installer::install_stage_mount_filesystems()
     bool system_is_image = _rom->system_is_image;
     std::string system_path = _system_path;
 
+    // Everything below reads and writes the merged view of an overlay slot
+    if (_system_is_overlay) {
+        _system_overlay_mnt = _temp;
+        _system_overlay_mnt += "/.system.overlay";
+
+        if (!mount_system_overlay(_system_overlay, _system_overlay_mnt)) {
+            display_msg("Failed to mount overlay for %s", _system_path.c_str());
+            return ProceedState::Fail;
+        }
+
+        system_path = _system_overlay_mnt;
+    }
+
+    // Compressed images are read-only
+    if (_rom->system_is_image && !system_image_expand(system_size)) {
+        display_msg("Failed to expand compressed image %s",
+                    _system_path.c_str());
+        return ProceedState::Fail;
+    }
+
     // Create temporary system image if needed
     if (!_rom->system_is_image && (_has_block_image || _rom->id == "primary")) {
         // Try /data/.system.img.tmp and if /data doesn't have enough space,
@@ -1674,7 +2090,15 @@ Installer::ProceedState Installer::install_stage_mount_filesystems()
         _temp_image_path += "/.system.img.tmp";
         remove(_temp_image_path.c_str());
 
-        if (!create_image(_temp_image_path, system_size)) {
+        // Build the image directly from the current /system files if possible
+        std::string source_dir;
+        if (_copy_to_temp_image) {
+            source_dir = system_path;
+        }
+        bool populated = false;
+
+        if (!create_image(_temp_image_path, system_size, source_dir,
+                          &populated)) {
             display_msg("Failed to create temporary image %s",
                         _temp_image_path.c_str());
 
@@ -1688,7 +2112,8 @@ Installer::ProceedState Installer::install_stage_mount_filesystems()
                 _temp_image_path += "/.system.img.tmp";
                 remove(_temp_image_path.c_str());
 
-                if (!create_image(_temp_image_path, system_size)) {
+                if (!create_image(_temp_image_path, system_size, source_dir,
+                                  &populated)) {
                     return ProceedState::Fail;
                 }
             } else {
@@ -1696,13 +2121,15 @@ Installer::ProceedState Installer::install_stage_mount_filesystems()
             }
         }
 
-        if (_copy_to_temp_image) {
+        if (_copy_to_temp_image && !populated) {
             display_msg("Copying system to temporary image");
 
+            InstallerStats::Scope op(_stats, "system_image_copy (to image)");
+
             // Copy current /system files to the image
-            if (!system_image_copy(_system_path, _temp_image_path, false)) {
+            if (!system_image_copy(system_path, _temp_image_path, false)) {
                 display_msg("Failed to copy %s to %s",
-                            _system_path.c_str(), _temp_image_path.c_str());
+                            system_path.c_str(), _temp_image_path.c_str());
                 return ProceedState::Fail;
             }
         }
@@ -1730,6 +2157,8 @@ Installer::ProceedState Installer::install_stage_mount_filesystems()
 
 Installer::ProceedState Installer::install_stage_installation()
 {
+    InstallerStats::Scope stage(_stats, "installation");
+
     LOGD("[Installer] Installation stage");
 
     ProceedState hook_ret = on_pre_install();
@@ -1754,7 +2183,10 @@ Installer::ProceedState Installer::install_stage_installation()
     if (lstat(in_chroot("/.skip-install").c_str(), &sb) < 0
             && errno == ENOENT) {
         uint64_t start = util::current_time_ms();
-        updater_ret = run_real_updater();
+        {
+            InstallerStats::Scope op(_stats, "run_real_updater");
+            updater_ret = run_real_updater();
+        }
         uint64_t stop = util::current_time_ms();
         uint64_t remainder = stop - start;
 
@@ -1804,6 +2236,8 @@ Installer::ProceedState Installer::install_stage_installation()
 
 Installer::ProceedState Installer::install_stage_unmount_filesystems()
 {
+    InstallerStats::Scope stage(_stats, "unmount_filesystems");
+
     LOGD("[Installer] Filesystem unmounting stage");
 
     // Umount filesystems from inside the chroot
@@ -1830,22 +2264,60 @@ Installer::ProceedState Installer::install_stage_unmount_filesystems()
         display_msg("Failed to unmount %s", in_chroot("/data").c_str());
     }
 
+    // Without a temporary image, the chroot's bind mount keeps the overlay busy
+    if (_system_is_overlay && !_system_overlay_mnt.empty()) {
+        if (_temp_image_path.empty()) {
+            util::umount(in_chroot(CHROOT_SYSTEM_BIND_MOUNT).c_str());
+        }
+        if (!util::umount(_system_overlay_mnt.c_str())) {
+            display_msg("Failed to unmount %s", _system_overlay_mnt.c_str());
+        }
+    }
+
     if (_rom->system_is_image) {
         // Run file system checks
         if (!fsck_ext4_image(_system_path)) {
             display_msg("Failed to run e2fsck on image");
         }
+
+        if (_system_compress) {
+            display_msg("Compressing system image");
+
+            InstallerStats::Scope op(_stats, "compress_ext4_image");
+
+            // The ext4 image is kept if this fails, so the ROM still boots
+            if (!compress_ext4_image(_system_path, _temp + "/.system.tmp",
+                                     _system_compress_type)) {
+                display_msg("Failed to compress %s", _system_path.c_str());
+            }
+        }
     } else {
         if (!(_flags & InstallerFlags::INSTALLER_SKIP_MOUNTING_VOLUMES)
                 && (_has_block_image || _rom->id == "primary")) {
             display_msg("Copying temporary image to system");
 
+            if (_system_is_overlay) {
+                InstallerStats::Scope op(_stats, "system_image_sync_overlay");
+
+                // Only write the changes relative to the lower ROM
+                if (!system_image_sync_overlay(_temp_image_path)) {
+                    display_msg("Failed to sync %s to %s",
+                                _temp_image_path.c_str(),
+                                _system_path.c_str());
+                    return ProceedState::Fail;
+                }
+
+                return on_unmounted_filesystems();
+            }
+
             // Format system directory
             if (!wipe_directory(_system_path, {})) {
                 display_msg("Failed to wipe %s", _system_path.c_str());
                 return ProceedState::Fail;
             }
 
+            InstallerStats::Scope op(_stats, "system_image_copy (from image)");
+
             // Copy image back to system directory
             if (!system_image_copy(_system_path, _temp_image_path, true)) {
                 display_msg("Failed to copy %s to %s",
@@ -1861,6 +2333,8 @@ Installer::ProceedState Installer::install_stage_unmount_filesystems()
 
 Installer::ProceedState Installer::install_stage_finish()
 {
+    InstallerStats::Scope stage(_stats, "finish");
+
     LOGD("[Installer] Finalization stage");
 
     // Calculate SHA512 hash of the boot partition after installation
@@ -1895,8 +2369,9 @@ Installer::ProceedState Installer::install_stage_finish()
         rps.push_back(rp_symlink_init());
         rps.push_back(rp_add_device_json(_temp + "/device.json"));
 
-        if (!InstallerUtil::patch_boot_image(_boot_block_dev, temp_boot_img,
-                                             rps)) {
+        if (!InstallerUtil::patch_boot_image(
+                _boot_block_dev, temp_boot_img, rps,
+                InstallerUtil::ramdisk_compression(_device))) {
             display_msg("Failed to patch boot image");
             return ProceedState::Fail;
         }
@@ -1950,27 +2425,40 @@ Installer::ProceedState Installer::install_stage_finish()
 
 void Installer::install_stage_cleanup(Installer::ProceedState ret)
 {
-    LOGD("[Installer] Cleanup stage");
+    {
+        InstallerStats::Scope stage(_stats, "cleanup");
 
-    if (ret == ProceedState::Fail) {
-        display_msg("Failed to flash zip file.");
-    }
+        LOGD("[Installer] Cleanup stage");
 
-    display_msg("Destroying chroot environment");
+        if (ret == ProceedState::Fail) {
+            display_msg("Failed to flash zip file.");
+        }
 
-    remove(_temp_image_path.c_str());
+        display_msg("Destroying chroot environment");
 
-    if (ret == ProceedState::Fail && !_boot_block_dev.empty()
-            && !util::copy_contents(_temp + "/boot.orig", _boot_block_dev)) {
-        LOGE("Failed to restore boot partition: %s", strerror(errno));
-        display_msg("Failed to restore boot partition");
-    }
+        remove(_temp_image_path.c_str());
 
-    if (!destroy_chroot()) {
-        display_msg("Failed to destroy chroot environment. You should "
-                    "reboot into recovery again to avoid flashing issues.");
+        if (!_system_overlay_mnt.empty()) {
+            util::umount(_system_overlay_mnt.c_str());
+        }
+
+        if (ret == ProceedState::Fail && !_boot_block_dev.empty()
+                && !util::copy_contents(_temp + "/boot.orig",
+                                        _boot_block_dev)) {
+            LOGE("Failed to restore boot partition: %s", strerror(errno));
+            display_msg("Failed to restore boot partition");
+        }
+
+        InstallerStats::Scope op(_stats, "destroy_chroot");
+
+        if (!destroy_chroot()) {
+            display_msg("Failed to destroy chroot environment. You should "
+                        "reboot into recovery again to avoid flashing issues.");
+        }
     }
 
+    _stats.log_summary();
+
     on_cleanup(ret);
 
     LOGV("Finished cleanup");
@@ -26,7 +26,11 @@
 #include "mbcommon/common.h"
 #include "mbdevice/device.h"
 #include "mbutil/hash.h"
+#include "mbutil/zip_index.h"
 
+#include "image.h"
+#include "installer_stats.h"
+#include "overlay.h"
 #include "roms.h"
 
 namespace mb
@@ -75,7 +79,11 @@ protected:
     virtual void on_cleanup(ProceedState ret);
 
     std::string _zip_file;
+    // Central directory of _zip_file, parsed once per install
+    util::ZipIndex _zip_index;
     std::string _chroot;
+    // Template instance bind mounted at the chroot's /sbin and /dev
+    std::string _chroot_instance;
     std::string _temp;
     int _interface;
     int _output_fd;
@@ -93,6 +101,17 @@ protected:
     std::string _cache_path;
     std::string _data_path;
 
+    // Overlay slots only write the changes to the lower ROM's /system. The
+    // merged view is mounted at _system_overlay_mnt during the installation.
+    bool _system_is_overlay;
+    SystemOverlay _system_overlay;
+    std::string _system_overlay_mnt;
+
+    // Image slots can be stored as compressed read-only images. They are
+    // expanded to ext4 for the installation and compressed again afterwards.
+    bool _system_compress;
+    CompressedImageType _system_compress_type;
+
     std::unordered_map<std::string, std::string> _prop;
     std::unordered_map<std::string, std::string> _chroot_prop;
 
@@ -104,9 +123,14 @@ protected:
 
     std::vector<std::string> _associated_loop_devs;
 
+    // Timing and I/O of each install stage. The summary is logged before
+    // on_cleanup() is called.
+    InstallerStats _stats;
+
     std::string in_chroot(const std::string &path) const;
 
     static bool is_aroma(const std::string &path);
+    bool updater_is_aroma(const std::string &path) const;
 
 
 private:
@@ -123,9 +147,13 @@ private:
 
     bool extract_multiboot_files();
     bool set_up_busybox_wrapper();
-    bool create_image(const std::string &path, uint64_t size);
+    bool create_image(const std::string &path, uint64_t size,
+                      const std::string &source_dir = std::string(),
+                      bool *populated = nullptr);
     bool system_image_copy(const std::string &source,
                            const std::string &image, bool reverse);
+    bool system_image_sync_overlay(const std::string &image);
+    bool system_image_expand(uint64_t size);
     bool mount_dir_or_image(const std::string &source,
                             const std::string &mount_point,
                             const std::string &loop_target,
@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "installer_stats.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include <time.h>
+
+#include "mblog/logging.h"
+
+namespace mb
+{
+
+static uint64_t monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+InstallerStats::Scope::Scope(InstallerStats &stats, std::string name)
+    : _stats(stats), _index(stats.begin(std::move(name)))
+{
+}
+
+InstallerStats::Scope::~Scope()
+{
+    _stats.end(_index);
+}
+
+InstallerStats::InstallerStats()
+    : _depth(0), _created_us(monotonic_us())
+{
+}
+
+/*!
+ * \brief Take a snapshot of the time and the process' I/O counters
+ *
+ * The counters in /proc/self/io include the I/O of child processes that have
+ * been waited for, so the updater and other commands are accounted to the
+ * stage that ran them. If the file cannot be read (eg. no
+ * CONFIG_TASK_IO_ACCOUNTING), the I/O counters are left at zero.
+ */
+InstallerStats::Snapshot InstallerStats::snapshot()
+{
+    Snapshot s = {};
+    s.time_us = monotonic_us();
+
+    FILE *fp = fopen("/proc/self/io", "re");
+    if (!fp) {
+        return s;
+    }
+
+    char key[32];
+    uint64_t value;
+
+    while (fscanf(fp, "%31[^:]: %" SCNu64 "\n", key, &value) == 2) {
+        if (strcmp(key, "rchar") == 0) {
+            s.io_read = value;
+        } else if (strcmp(key, "wchar") == 0) {
+            s.io_written = value;
+        } else if (strcmp(key, "read_bytes") == 0) {
+            s.storage_read = value;
+        } else if (strcmp(key, "write_bytes") == 0) {
+            s.storage_written = value;
+        }
+    }
+
+    fclose(fp);
+
+    return s;
+}
+
+/*!
+ * \brief Start timing a stage
+ *
+ * Stages that are started while another stage is running are recorded as
+ * nested operations of that stage.
+ *
+ * \return Index to pass to end()
+ */
+size_t InstallerStats::begin(std::string name)
+{
+    InstallerStageStats stage = {};
+    stage.name = std::move(name);
+    stage.depth = _depth++;
+
+    _stages.push_back(std::move(stage));
+    _starts.push_back(snapshot());
+
+    return _stages.size() - 1;
+}
+
+void InstallerStats::end(size_t index)
+{
+    Snapshot now = snapshot();
+    const Snapshot &start = _starts[index];
+    InstallerStageStats &stage = _stages[index];
+
+    stage.finished = true;
+    stage.elapsed_us = now.time_us - start.time_us;
+    stage.io_read = now.io_read - start.io_read;
+    stage.io_written = now.io_written - start.io_written;
+    stage.storage_read = now.storage_read - start.storage_read;
+    stage.storage_written = now.storage_written - start.storage_written;
+
+    --_depth;
+}
+
+const std::vector<InstallerStageStats> & InstallerStats::stages() const
+{
+    return _stages;
+}
+
+/*!
+ * \brief Time since the installation started
+ */
+uint64_t InstallerStats::total_elapsed_us() const
+{
+    return monotonic_us() - _created_us;
+}
+
+/*!
+ * \brief Sum of all finished install stages
+ *
+ * Nested operations are not counted separately since they are already
+ * included in their stage.
+ */
+InstallerStageStats InstallerStats::totals() const
+{
+    InstallerStageStats total = {};
+    total.name = "total";
+    total.finished = true;
+
+    for (auto const &s : _stages) {
+        if (s.depth != 0 || !s.finished) {
+            continue;
+        }
+
+        total.elapsed_us += s.elapsed_us;
+        total.io_read += s.io_read;
+        total.io_written += s.io_written;
+        total.storage_read += s.storage_read;
+        total.storage_written += s.storage_written;
+    }
+
+    return total;
+}
+
+void InstallerStats::log_summary() const
+{
+    LOGD("[Installer] Stage summary:");
+    LOGD("  %-34s %10s %10s %10s %10s %10s",
+         "Stage", "Time (ms)", "Read (KiB)", "Wrtn (KiB)",
+         "Disk R KiB", "Disk W KiB");
+
+    for (auto const &s : _stages) {
+        char name[64];
+        snprintf(name, sizeof(name), "%*s%s", s.depth * 2, "",
+                 s.name.c_str());
+
+        if (!s.finished) {
+            LOGD("  %-34s %10s", name, "(running)");
+            continue;
+        }
+
+        LOGD("  %-34s %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+             " %10" PRIu64 " %10" PRIu64,
+             name, s.elapsed_us / 1000, s.io_read / 1024,
+             s.io_written / 1024, s.storage_read / 1024,
+             s.storage_written / 1024);
+    }
+
+    InstallerStageStats t = totals();
+
+    LOGD("  %-34s %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+         " %10" PRIu64 " %10" PRIu64,
+         t.name.c_str(), total_elapsed_us() / 1000, t.io_read / 1024,
+         t.io_written / 1024, t.storage_read / 1024,
+         t.storage_written / 1024);
+}
+
+}
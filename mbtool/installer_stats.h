@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace mb
+{
+
+struct InstallerStageStats
+{
+    std::string name;
+    // 0 for install stages, 1 for operations within a stage
+    unsigned int depth;
+    bool finished;
+    uint64_t elapsed_us;
+    // Bytes passed to read()/write() and friends (rchar/wchar)
+    uint64_t io_read;
+    uint64_t io_written;
+    // Bytes that actually hit the storage layer (read_bytes/write_bytes)
+    uint64_t storage_read;
+    uint64_t storage_written;
+};
+
+class InstallerStats
+{
+public:
+    class Scope
+    {
+    public:
+        Scope(InstallerStats &stats, std::string name);
+        ~Scope();
+
+        Scope(const Scope &) = delete;
+        Scope & operator=(const Scope &) = delete;
+
+    private:
+        InstallerStats &_stats;
+        size_t _index;
+    };
+
+    InstallerStats();
+
+    size_t begin(std::string name);
+    void end(size_t index);
+
+    const std::vector<InstallerStageStats> & stages() const;
+    uint64_t total_elapsed_us() const;
+    InstallerStageStats totals() const;
+
+    void log_summary() const;
+
+private:
+    struct Snapshot
+    {
+        uint64_t time_us;
+        uint64_t io_read;
+        uint64_t io_written;
+        uint64_t storage_read;
+        uint64_t storage_written;
+    };
+
+    static Snapshot snapshot();
+
+    std::vector<InstallerStageStats> _stages;
+    // Starting snapshot of each entry in _stages
+    std::vector<Snapshot> _starts;
+    unsigned int _depth;
+    uint64_t _created_us;
+};
+
+}
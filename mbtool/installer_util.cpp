@@ -19,6 +19,8 @@
 
 #include "installer_util.h"
 
+#include <algorithm>
+#include <iterator>
 #include <memory>
 
 #include <cerrno>
@@ -27,15 +29,21 @@
 #include <cstring>
 
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <archive.h>
 #include <archive_entry.h>
 
+#include <lz4.h>
+#include <lz4hc.h>
+
 #include "mbbootimg/entry.h"
 #include "mbbootimg/header.h"
 #include "mbbootimg/reader.h"
+#include "mbbootimg/transform.h"
 #include "mbbootimg/writer.h"
 
+#include "mbcommon/buffer_pool.h"
 #include "mbcommon/file.h"
 #include "mbcommon/file_util.h"
 #include "mbcommon/file/standard.h"
@@ -44,10 +52,10 @@
 #include "mblog/logging.h"
 
 #include "mbutil/delete.h"
+#include "mbutil/file.h"
 #include "mbutil/finally.h"
 #include "mbutil/path.h"
 
-#include "bootimg_util.h"
 #include "multiboot.h"
 
 typedef std::unique_ptr<archive, decltype(archive_free) *> ScopedArchive;
@@ -214,6 +222,9 @@ bool InstallerUtil::pack_ramdisk(const std::string &input_dir,
         return false;
     }
 
+    // Allocated when the first regular file is found
+    IoBuffer buf;
+
     while (true) {
         // libarchive doesn't clear the entry automatically
         archive_entry_clear(entry.get());
@@ -255,12 +266,17 @@ bool InstallerUtil::pack_ramdisk(const std::string &input_dir,
             return false;
         }
 
-        char buf[10240];
         la_ssize_t n;
 
         if (archive_entry_size(entry.get()) > 0) {
-            while ((n = archive_read_data(ain.get(), buf, sizeof(buf))) > 0) {
-                if (archive_write_data(aout.get(), buf, n) != n) {
+            if (!buf && !buf.allocate()) {
+                LOGE("Failed to allocate buffer: %s", strerror(errno));
+                return false;
+            }
+
+            while ((n = archive_read_data(
+                    ain.get(), buf.data(), buf.size())) > 0) {
+                if (archive_write_data(aout.get(), buf.data(), n) != n) {
                     LOGE("Failed to write archive entry data: %s",
                          archive_error_string(aout.get()));
                     return false;
@@ -285,27 +301,146 @@ bool InstallerUtil::pack_ramdisk(const std::string &input_dir,
     return true;
 }
 
-bool InstallerUtil::patch_boot_image(const std::string &input_file,
-                                     const std::string &output_file,
-                                     std::vector<std::function<RamdiskPatcherFn>> &rps)
+// Magic and uncompressed block size of the LZ4 legacy format. The kernel's
+// unlz4 expects exactly 8 MiB blocks.
+#define LZ4_LEGACY_MAGIC        0x184C2102u
+#define LZ4_LEGACY_BLOCK_SIZE   (8 * 1024 * 1024)
+
+static void write_le32(std::vector<unsigned char> &buf, size_t offset,
+                       uint32_t value)
 {
-    std::string tmpdir = format("%s.XXXXXX", output_file.c_str());
+    buf[offset] = value & 0xff;
+    buf[offset + 1] = (value >> 8) & 0xff;
+    buf[offset + 2] = (value >> 16) & 0xff;
+    buf[offset + 3] = (value >> 24) & 0xff;
+}
 
-    // std::string is guaranteed to be contiguous in C++11
-    if (!mkdtemp(&tmpdir[0])) {
-        LOGE("Failed to create temporary directory: %s", strerror(errno));
-        return false;
+/*!
+ * \brief Compress data with the LZ4 legacy format
+ *
+ * This is the format produced by `lz4 -l`, which is the only LZ4 format that
+ * the kernel's initramfs unpacker understands.
+ */
+static bool compress_lz4_legacy(const std::vector<unsigned char> &in,
+                                std::vector<unsigned char> &out)
+{
+    out.resize(4);
+    write_le32(out, 0, LZ4_LEGACY_MAGIC);
+
+    for (size_t offset = 0; offset < in.size();
+            offset += LZ4_LEGACY_BLOCK_SIZE) {
+        int in_size = static_cast<int>(std::min<size_t>(
+                LZ4_LEGACY_BLOCK_SIZE, in.size() - offset));
+        int bound = LZ4_compressBound(in_size);
+        size_t header = out.size();
+
+        out.resize(header + 4 + bound);
+
+        int n = LZ4_compress_HC(
+                reinterpret_cast<const char *>(in.data() + offset),
+                reinterpret_cast<char *>(out.data() + header + 4),
+                in_size, bound, LZ4HC_CLEVEL_DEFAULT);
+        if (n <= 0) {
+            LOGE("Failed to LZ4 compress ramdisk");
+            return false;
+        }
+
+        out.resize(header + 4 + n);
+        write_le32(out, header, static_cast<uint32_t>(n));
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Get the ramdisk compression preferred by a device
+ *
+ * An uncompressed ramdisk is the fastest to unpack, but is only used if the
+ * device declares that the boot partition has room for it.
+ */
+RamdiskCompression InstallerUtil::ramdisk_compression(const Device *device)
+{
+    uint64_t flags = device ? mb_device_flags(device) : 0;
+
+    if (flags & FLAG_RAMDISK_UNCOMPRESSED) {
+        return RamdiskCompression::None;
+    } else if (flags & FLAG_RAMDISK_LZ4_LEGACY) {
+        return RamdiskCompression::Lz4Legacy;
+    } else {
+        return RamdiskCompression::Original;
+    }
+}
+
+struct PatchBootImageCtx
+{
+    std::vector<std::function<RamdiskPatcherFn>> &rps;
+    RamdiskCompression compression;
+    MbBiWriter *biw;
+};
+
+static int patch_boot_image_select_cb(int type, void *userdata)
+{
+    (void) userdata;
+
+    switch (type) {
+    case MB_BI_ENTRY_ABOOT:
+        // Replaced with the aboot partition
+        return MB_BI_TRANSFORM_REPLACE;
+    case MB_BI_ENTRY_KERNEL:
+    case MB_BI_ENTRY_RAMDISK:
+        return MB_BI_TRANSFORM_REWRITE;
+    default:
+        return MB_BI_TRANSFORM_COPY;
+    }
+}
+
+static int patch_boot_image_rewrite_cb(int type, bool exists,
+                                       std::vector<unsigned char> &data,
+                                       void *userdata)
+{
+    PatchBootImageCtx *ctx = static_cast<PatchBootImageCtx *>(userdata);
+
+    // Special case for loki aboot
+    if (type == MB_BI_ENTRY_ABOOT) {
+        if (!util::file_read_all(ABOOT_PARTITION, &data)) {
+            mb_bi_writer_set_error(ctx->biw, -errno,
+                                   "%s: Failed to read aboot partition: %s",
+                                   ABOOT_PARTITION, strerror(errno));
+            return MB_BI_FAILED;
+        }
+        return MB_BI_OK;
+    }
+
+    if (!exists) {
+        LOGV("Skipping non existent boot image entry: %d", type);
+        return MB_BI_OK;
     }
 
-    auto delete_temp_dir = util::finally([&]{
-        util::delete_recursive(tmpdir);
-    });
+    if (type == MB_BI_ENTRY_KERNEL) {
+        if (!InstallerUtil::patch_kernel_rkp(data)) {
+            mb_bi_writer_set_error(ctx->biw, MB_BI_ERROR_INTERNAL_ERROR,
+                                   "Failed to patch kernel");
+            return MB_BI_FAILED;
+        }
+    } else if (type == MB_BI_ENTRY_RAMDISK) {
+        if (!InstallerUtil::patch_ramdisk(data, 0, ctx->rps,
+                                          ctx->compression)) {
+            mb_bi_writer_set_error(ctx->biw, MB_BI_ERROR_INTERNAL_ERROR,
+                                   "Failed to patch ramdisk");
+            return MB_BI_FAILED;
+        }
+    }
+
+    return MB_BI_OK;
+}
 
+bool InstallerUtil::patch_boot_image(const std::string &input_file,
+                                     const std::string &output_file,
+                                     std::vector<std::function<RamdiskPatcherFn>> &rps,
+                                     RamdiskCompression compression)
+{
     ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
     ScopedWriter biw(mb_bi_writer_new(), &mb_bi_writer_free);
-    MbBiHeader *header;
-    MbBiEntry *in_entry;
-    MbBiEntry *out_entry;
     int ret;
 
     if (!bir || !biw) {
@@ -348,102 +483,17 @@ bool InstallerUtil::patch_boot_image(const std::string &input_file,
     LOGD("- Output: %s", output_file.c_str());
     LOGD("- Format: %s", mb_bi_reader_format_name(bir.get()));
 
-    // Copy header
-    ret = mb_bi_reader_read_header(bir.get(), &header);
-    if (ret != MB_BI_OK) {
-        LOGE("%s: Failed to read header: %s",
-             input_file.c_str(), mb_bi_reader_error_string(bir.get()));
-        return false;
-    }
-    ret = mb_bi_writer_write_header(biw.get(), header);
+    // Copy the header and entries, patching the kernel and ramdisk in memory
+    PatchBootImageCtx ctx{rps, compression, biw.get()};
+
+    ret = mb_bi_transform(bir.get(), biw.get(), &patch_boot_image_select_cb,
+                          &patch_boot_image_rewrite_cb, &ctx);
     if (ret != MB_BI_OK) {
-        LOGE("%s: Failed to write header: %s",
+        LOGE("%s: Failed to patch boot image: %s",
              output_file.c_str(), mb_bi_writer_error_string(biw.get()));
         return false;
     }
 
-    // Write entries
-    while ((ret = mb_bi_writer_get_entry(biw.get(), &out_entry)) == MB_BI_OK) {
-        int type = mb_bi_entry_type(out_entry);
-
-        // Write entry metadata
-        ret = mb_bi_writer_write_entry(biw.get(), out_entry);
-        if (ret != MB_BI_OK) {
-            LOGE("%s: Failed to write entry: %s",
-                 output_file.c_str(), mb_bi_writer_error_string(biw.get()));
-            return false;
-        }
-
-        // Special case for loki aboot
-        if (type == MB_BI_ENTRY_ABOOT) {
-            if (bi_copy_file_to_data(ABOOT_PARTITION, biw.get())) {
-                return false;
-            }
-        } else {
-            ret = mb_bi_reader_go_to_entry(bir.get(), &in_entry, type);
-            if (ret == MB_BI_EOF) {
-                LOGV("Skipping non existent boot image entry: %d", type);
-                continue;
-            } else if (ret != MB_BI_OK) {
-                LOGE("%s: Failed to go to entry: %d: %s",
-                     input_file.c_str(), type,
-                     mb_bi_reader_error_string(bir.get()));
-                return false;
-            }
-
-            if (type == MB_BI_ENTRY_RAMDISK) {
-                std::string ramdisk_in(tmpdir);
-                ramdisk_in += "/ramdisk.in";
-                std::string ramdisk_out(tmpdir);
-                ramdisk_out += "/ramdisk.out";
-
-                auto delete_temp_files = util::finally([&]{
-                    unlink(ramdisk_in.c_str());
-                    unlink(ramdisk_out.c_str());
-                });
-
-                if (!bi_copy_data_to_file(bir.get(), ramdisk_in)) {
-                    return false;
-                }
-
-                if (!patch_ramdisk(ramdisk_in, ramdisk_out, 0, rps)) {
-                    return false;
-                }
-
-                if (!bi_copy_file_to_data(ramdisk_out, biw.get())) {
-                    return false;
-                }
-            } else if (type == MB_BI_ENTRY_KERNEL) {
-                std::string kernel_in(tmpdir);
-                kernel_in += "/kernel.in";
-                std::string kernel_out(tmpdir);
-                kernel_out += "/kernel.out";
-
-                auto delete_temp_files = util::finally([&]{
-                    unlink(kernel_in.c_str());
-                    unlink(kernel_out.c_str());
-                });
-
-                if (!bi_copy_data_to_file(bir.get(), kernel_in)) {
-                    return false;
-                }
-
-                if (!patch_kernel_rkp(kernel_in, kernel_out)) {
-                    return false;
-                }
-
-                if (!bi_copy_file_to_data(kernel_out, biw.get())) {
-                    return false;
-                }
-            } else {
-                // Copy entry directly
-                if (!bi_copy_data_to_data(bir.get(), biw.get())) {
-                    return false;
-                }
-            }
-        }
-    }
-
     if (mb_bi_writer_close(biw.get()) != MB_BI_OK) {
         LOGE("%s: Failed to close boot image: %s",
              output_file.c_str(), mb_bi_writer_error_string(biw.get()));
@@ -453,94 +503,93 @@ bool InstallerUtil::patch_boot_image(const std::string &input_file,
     return true;
 }
 
-bool InstallerUtil::patch_ramdisk(const std::string &input_file,
-                                  const std::string &output_file,
+/*!
+ * \brief Patch a ramdisk in memory
+ *
+ * \p compression only applies to the outermost ramdisk since nested ramdisks
+ * are unpacked by their own init instead of the kernel.
+ */
+bool InstallerUtil::patch_ramdisk(std::vector<unsigned char> &data,
                                   unsigned int depth,
-                                  std::vector<std::function<RamdiskPatcherFn>> &rps)
+                                  std::vector<std::function<RamdiskPatcherFn>> &rps,
+                                  RamdiskCompression compression)
 {
+    static const char *nested_path = "sbin/ramdisk.cpio";
+
     if (depth > 1) {
         LOGV("Ignoring doubly-nested ramdisk");
         return true;
     }
 
-    std::string tmpdir = format("%s.XXXXXX", output_file.c_str());
+    CpioArchive cpio;
+    std::vector<unsigned char> nested;
 
-    if (!mkdtemp(&tmpdir[0])) {
-        LOGE("Failed to create temporary directory: %s", strerror(errno));
-        return false;
-    }
-
-    auto delete_temp_dir = util::finally([&]{
-        util::delete_recursive(tmpdir);
-    });
-
-    int format;
-    std::vector<int> filters;
-
-    // Extract ramdisk
-    if (!unpack_ramdisk(input_file, tmpdir, format, filters)) {
+    if (!cpio.load(data.data(), data.size())) {
         return false;
     }
 
     // Patch ramdisk
-    std::string nested(tmpdir);
-    nested += "/sbin/ramdisk.cpio";
-    struct stat sb;
-    bool ret;
-
-    if (stat(nested.c_str(), &sb) == 0) {
-        ret = patch_ramdisk(nested, nested, depth + 1, rps);
+    if (cpio.read(nested_path, nested)) {
+        if (!patch_ramdisk(nested, depth + 1, rps)
+                || !cpio.set_data(nested_path, nested.data(), nested.size())) {
+            return false;
+        }
     } else {
-        ret = patch_ramdisk_dir(tmpdir, rps);
+        for (auto const &rp : rps) {
+            if (!rp(cpio)) {
+                return false;
+            }
+        }
+    }
+
+    if (compression != RamdiskCompression::Original) {
+        cpio.set_filters({});
     }
 
     // Pack ramdisk
-    if (!pack_ramdisk(tmpdir, output_file, format, filters)) {
+    if (!cpio.save(data)) {
         return false;
     }
 
-    return ret;
-}
-
-bool InstallerUtil::patch_ramdisk_dir(const std::string &ramdisk_dir,
-                                      std::vector<std::function<RamdiskPatcherFn>> &rps)
-{
-    for (auto const &rp : rps) {
-        if (!rp(ramdisk_dir)) {
+    if (compression == RamdiskCompression::Lz4Legacy) {
+        std::vector<unsigned char> compressed;
+        if (!compress_lz4_legacy(data, compressed)) {
             return false;
         }
+        LOGD("Recompressed ramdisk with LZ4 legacy: %zu -> %zu bytes",
+             data.size(), compressed.size());
+        data.swap(compressed);
     }
 
     return true;
 }
 
+// We'll use SuperSU's patch for negating the effects of
+// CONFIG_RKP_NS_PROT=y in newer Samsung kernels. This kernel feature
+// prevents exec()'ing anything as a privileged user unless the binary
+// resides in rootfs or whichever filesystem was first mounted at /system.
+//
+// It is trivial to update mbtool to only use rootfs, but we need to
+// override fsck tools by bind-mounting dummy binaries from an ext4 image
+// when booting from an external SD. Unless we patch the SELinux policy to
+// allow vold to execute u:r:rootfs:s0-labeled fsck binaries, this patch
+// must remain.
+static const unsigned char rkp_source_pattern[] = {
+    0x49, 0x01, 0x00, 0x54, 0x01, 0x14, 0x40, 0xB9, 0x3F, 0xA0,
+    0x0F, 0x71, 0xE9, 0x00, 0x00, 0x54, 0x01, 0x08, 0x40, 0xB9,
+    0x3F, 0xA0, 0x0F, 0x71, 0x89, 0x00, 0x00, 0x54, 0x00, 0x18,
+    0x40, 0xB9, 0x1F, 0xA0, 0x0F, 0x71, 0x88, 0x01, 0x00, 0x54,
+};
+static const unsigned char rkp_target_pattern[] = {
+    0xA1, 0x02, 0x00, 0x54, 0x01, 0x14, 0x40, 0xB9, 0x3F, 0xA0,
+    0x0F, 0x71, 0x40, 0x02, 0x00, 0x54, 0x01, 0x08, 0x40, 0xB9,
+    0x3F, 0xA0, 0x0F, 0x71, 0xE0, 0x01, 0x00, 0x54, 0x00, 0x18,
+    0x40, 0xB9, 0x1F, 0xA0, 0x0F, 0x71, 0x81, 0x01, 0x00, 0x54,
+};
+
 bool InstallerUtil::patch_kernel_rkp(const std::string &input_file,
                                      const std::string &output_file)
 {
-    // We'll use SuperSU's patch for negating the effects of
-    // CONFIG_RKP_NS_PROT=y in newer Samsung kernels. This kernel feature
-    // prevents exec()'ing anything as a privileged user unless the binary
-    // resides in rootfs or whichever filesystem was first mounted at /system.
-    //
-    // It is trivial to update mbtool to only use rootfs, but we need to
-    // override fsck tools by bind-mounting dummy binaries from an ext4 image
-    // when booting from an external SD. Unless we patch the SELinux policy to
-    // allow vold to execute u:r:rootfs:s0-labeled fsck binaries, this patch
-    // must remain.
-
-    static const unsigned char source_pattern[] = {
-        0x49, 0x01, 0x00, 0x54, 0x01, 0x14, 0x40, 0xB9, 0x3F, 0xA0,
-        0x0F, 0x71, 0xE9, 0x00, 0x00, 0x54, 0x01, 0x08, 0x40, 0xB9,
-        0x3F, 0xA0, 0x0F, 0x71, 0x89, 0x00, 0x00, 0x54, 0x00, 0x18,
-        0x40, 0xB9, 0x1F, 0xA0, 0x0F, 0x71, 0x88, 0x01, 0x00, 0x54,
-    };
-    static const unsigned char target_pattern[] = {
-        0xA1, 0x02, 0x00, 0x54, 0x01, 0x14, 0x40, 0xB9, 0x3F, 0xA0,
-        0x0F, 0x71, 0x40, 0x02, 0x00, 0x54, 0x01, 0x08, 0x40, 0xB9,
-        0x3F, 0xA0, 0x0F, 0x71, 0xE0, 0x01, 0x00, 0x54, 0x00, 0x18,
-        0x40, 0xB9, 0x1F, 0xA0, 0x0F, 0x71, 0x81, 0x01, 0x00, 0x54,
-    };
-
     StandardFile fin;
     StandardFile fout;
     // TODO: Replace with std::optional after switching to C++17
@@ -571,8 +620,8 @@ bool InstallerUtil::patch_kernel_rkp(const std::string &input_file,
         return FileSearchAction::Stop;
     };
 
-    if (!file_search(fin, -1, -1, 0, source_pattern, sizeof(source_pattern), 1,
-                     result_cb, &offset)) {
+    if (!file_search(fin, -1, -1, 0, rkp_source_pattern,
+                     sizeof(rkp_source_pattern), 1, result_cb, &offset)) {
         LOGE("%s: Error when searching for pattern: %s",
              input_file.c_str(), fin.error_string().c_str());
         return false;
@@ -592,15 +641,16 @@ bool InstallerUtil::patch_kernel_rkp(const std::string &input_file,
             return false;
         }
 
-        if (!fin.seek(sizeof(source_pattern), SEEK_CUR, nullptr)) {
+        if (!fin.seek(sizeof(rkp_source_pattern), SEEK_CUR, nullptr)) {
             LOGE("%s: Failed to skip pattern: %s",
                  input_file.c_str(), fin.error_string().c_str());
             return false;
         }
 
         size_t n;
-        if (!file_write_fully(fout, target_pattern, sizeof(target_pattern), n)
-                || n != sizeof(target_pattern)) {
+        if (!file_write_fully(fout, rkp_target_pattern,
+                              sizeof(rkp_target_pattern), n)
+                || n != sizeof(rkp_target_pattern)) {
             LOGE("%s: Failed to write target pattern: %s",
                  output_file.c_str(), fout.error_string().c_str());
             return false;
@@ -620,6 +670,22 @@ bool InstallerUtil::patch_kernel_rkp(const std::string &input_file,
     return true;
 }
 
+bool InstallerUtil::patch_kernel_rkp(std::vector<unsigned char> &data)
+{
+    auto it = std::search(data.begin(), data.end(),
+                          std::begin(rkp_source_pattern),
+                          std::end(rkp_source_pattern));
+    if (it != data.end()) {
+        LOGD("RKP pattern found at offset: 0x%zx",
+             static_cast<size_t>(it - data.begin()));
+
+        std::copy(std::begin(rkp_target_pattern),
+                  std::end(rkp_target_pattern), it);
+    }
+
+    return true;
+}
+
 bool InstallerUtil::replace_file(const std::string &replace,
                                  const std::string &with)
 {
@@ -658,18 +724,25 @@ bool InstallerUtil::replace_file(const std::string &replace,
 
 bool InstallerUtil::copy_file_to_file(File &fin, File &fout, uint64_t to_copy)
 {
-    char buf[10240];
+    IoBuffer buf;
     size_t n;
 
+    if (!buf.allocate()) {
+        LOGE("Failed to allocate buffer: %s", strerror(errno));
+        return false;
+    }
+
     while (to_copy > 0) {
-        size_t to_read = std::min<uint64_t>(to_copy, sizeof(buf));
+        size_t to_read = std::min<uint64_t>(to_copy, buf.size());
 
-        if (!mb::file_read_fully(fin, buf, to_read, n) || n != to_read) {
+        if (!mb::file_read_fully(fin, buf.data(), to_read, n)
+                || n != to_read) {
             LOGE("Failed to read data: %s", fin.error_string().c_str());
             return false;
         }
 
-        if (!mb::file_write_fully(fout, buf, to_read, n) || n != to_read) {
+        if (!mb::file_write_fully(fout, buf.data(), to_read, n)
+                || n != to_read) {
             LOGE("Failed to write data: %s", fout.error_string().c_str());
             return false;
         }
@@ -682,19 +755,24 @@ bool InstallerUtil::copy_file_to_file(File &fin, File &fout, uint64_t to_copy)
 
 bool InstallerUtil::copy_file_to_file_eof(File &fin, File &fout)
 {
-    char buf[10240];
+    IoBuffer buf;
     size_t n_read;
     size_t n_written;
 
+    if (!buf.allocate()) {
+        LOGE("Failed to allocate buffer: %s", strerror(errno));
+        return false;
+    }
+
     while (true) {
-        if (!mb::file_read_fully(fin, buf, sizeof(buf), n_read)) {
+        if (!mb::file_read_fully(fin, buf.data(), buf.size(), n_read)) {
             LOGE("Failed to read data: %s", fin.error_string().c_str());
             return false;
         } else if (n_read == 0) {
             break;
         }
 
-        if (!mb::file_write_fully(fout, buf, n_read, n_written)
+        if (!mb::file_write_fully(fout, buf.data(), n_read, n_written)
                 || n_written != n_read) {
             LOGE("Failed to write data: %s", fout.error_string().c_str());
             return false;
@@ -22,6 +22,8 @@
 #include <string>
 #include <vector>
 
+#include "mbdevice/device.h"
+
 #include "ramdisk_patcher.h"
 
 struct MbBiReader;
@@ -32,6 +34,16 @@ namespace mb
 
 class File;
 
+enum class RamdiskCompression
+{
+    // Keep the compression of the original ramdisk
+    Original,
+    // LZ4 legacy format, which the kernel unpacks much faster than gzip
+    Lz4Legacy,
+    // No compression
+    None,
+};
+
 class InstallerUtil
 {
 public:
@@ -44,17 +56,21 @@ public:
                              int format,
                              const std::vector<int> &filters);
 
+    static RamdiskCompression ramdisk_compression(const Device *device);
+
     static bool patch_boot_image(const std::string &input_file,
                                  const std::string &output_file,
-                                 std::vector<std::function<RamdiskPatcherFn>> &rps);
-    static bool patch_ramdisk(const std::string &input_file,
-                              const std::string &output_file,
+                                 std::vector<std::function<RamdiskPatcherFn>> &rps,
+                                 RamdiskCompression compression
+                                         = RamdiskCompression::Original);
+    static bool patch_ramdisk(std::vector<unsigned char> &data,
                               unsigned int depth,
-                              std::vector<std::function<RamdiskPatcherFn>> &rps);
-    static bool patch_ramdisk_dir(const std::string &ramdisk_dir,
-                                  std::vector<std::function<RamdiskPatcherFn>> &rps);
+                              std::vector<std::function<RamdiskPatcherFn>> &rps,
+                              RamdiskCompression compression
+                                      = RamdiskCompression::Original);
     static bool patch_kernel_rkp(const std::string &input_file,
                                  const std::string &output_file);
+    static bool patch_kernel_rkp(std::vector<unsigned char> &data);
 
     static bool replace_file(const std::string &replace,
                              const std::string &with);
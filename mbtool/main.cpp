@@ -17,6 +17,9 @@
  * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string>
+#include <vector>
+
 #include <clocale>
 #include <cstdio>
 #include <cstdlib>
@@ -35,6 +38,7 @@
 #include "appsync.h"
 #include "auditd.h"
 #include "daemon.h"
+#include "daemon_bench.h"
 #include "init.h"
 #include "miniadbd.h"
 #include "properties.h"
@@ -48,46 +52,59 @@
 #include "mbutil/process.h"
 #include "mbutil/string.h"
 
+#include "profile.h"
+
 
 int main_multicall(int argc, char *argv[]);
 int main_normal(int argc, char *argv[]);
 static int mbtool_main(int argc, char *argv[]);
 
 
-#define TOOL(name) { #name, mb::name##_main }
+#define TOOL(name) { #name, mb::name##_main, 0 }
+
+// Tool needs set_process_title() to work
+#define TOOL_FLAG_PROCESS_TITLE         0x1
 
 struct tool {
     const char *name;
     int (*func)(int, char **);
+    // Global state that must be initialized before the tool runs. Everything
+    // else is left alone so that short-lived helpers start quickly.
+    int flags;
 };
 
 struct tool tools[] = {
-    { "mbtool", mbtool_main },
-    { "mbtool_recovery", mbtool_main },
+    { "mbtool", mbtool_main, 0 },
+    { "mbtool_recovery", mbtool_main, 0 },
     // Tools
 #ifdef RECOVERY
-    { "backup", mb::backup_main },
-    { "restore", mb::restore_main },
-    { "rom-installer", mb::rom_installer_main },
-    { "updater", mb::update_binary_main }, // TWRP
-    { "update_binary", mb::update_binary_main }, // CWM, Philz
-    { "update-binary-tool", mb::update_binary_tool_main },
-    { "utilities", mb::utilities_main },
+    { "backup", mb::backup_main, 0 },
+    { "restore", mb::restore_main, 0 },
+    { "rom-installer", mb::rom_installer_main, 0 },
+    { "updater", mb::update_binary_main, 0 }, // TWRP
+    { "update_binary", mb::update_binary_main, 0 }, // CWM, Philz
+    { "update-binary-tool", mb::update_binary_tool_main, 0 },
+    { "utilities", mb::utilities_main, 0 },
 #else
-    { "adbd", mb::miniadbd_main },
-    { "appsync", mb::appsync_main },
-    { "auditd", mb::auditd_main },
-    { "daemon", mb::daemon_main },
-    { "init", mb::init_main },
-    { "miniadbd", mb::miniadbd_main },
-    { "properties", mb::properties_main },
-    { "sepolpatch", mb::sepolpatch_main },
-    { "sigverify", mb::sigverify_main },
-    { "uevent_dump", mb::uevent_dump_main },
+    { "adbd", mb::miniadbd_main, 0 },
+    { "appsync", mb::appsync_main, 0 },
+    { "auditd", mb::auditd_main, 0 },
+    { "daemon", mb::daemon_main, TOOL_FLAG_PROCESS_TITLE },
+    { "daemon-bench", mb::daemon_bench_main, 0 },
+    { "init", mb::init_main, 0 },
+    { "miniadbd", mb::miniadbd_main, 0 },
+    { "properties", mb::properties_main, 0 },
+    { "sepolpatch", mb::sepolpatch_main, 0 },
+    { "sigverify", mb::sigverify_main, 0 },
+    { "uevent_dump", mb::uevent_dump_main, 0 },
 #endif
-    { nullptr, nullptr }
+    { nullptr, nullptr, 0 }
 };
 
+// Original arguments, which set_process_title_init() needs
+static int orig_argc;
+static char **orig_argv;
+
 
 static void mbtool_usage(int error)
 {
@@ -96,12 +113,15 @@ static void mbtool_usage(int error)
     fprintf(stream,
             "Version: %s\n"
             "Git version: %s\n\n"
-            "Usage: mbtool [tool] [tool arguments ...]\n\n"
+            "Usage: mbtool [--profile=<file>] [tool] [tool arguments ...]\n\n"
             "This is a multicall binary. The individual tools can be invoked\n"
             "by passing the tool name as the first argument to mbtool or by\n"
             "creating a symbolic link with from the tool name to mbtool.\n\n"
             "To see the usage and other help text for a tool, pass --help to\n"
             "the tool.\n\n"
+            "If --profile=<file> is passed as the first argument (or the\n"
+            "MBTOOL_PROFILE environment variable is set), CPU, memory, and I/O\n"
+            "usage of the tool is written to <file> as JSON when it exits.\n\n"
             "Available tools:\n",
             mb::version(),
             mb::git_version());
@@ -123,6 +143,22 @@ static int mbtool_main(int argc, char *argv[])
     }
 }
 
+/*!
+ * \brief Initialize the global state needed by a tool and run it
+ */
+static int run_tool(struct tool *tool, int argc, char *argv[])
+{
+    if (tool->flags & TOOL_FLAG_PROCESS_TITLE) {
+        if (!mb::util::set_process_title_init(orig_argc, orig_argv)) {
+            fprintf(stderr, "set_process_title_init() failed: %s\n",
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    return tool->func(argc, argv);
+}
+
 struct tool * find_tool(const char *name)
 {
     for (int i = 0; tools[i].name; ++i) {
@@ -148,7 +184,7 @@ int main_multicall(int argc, char *argv[])
 
     struct tool *tool = find_tool(name);
     if (tool) {
-        return tool->func(argc, argv);
+        return run_tool(tool, argc, argv);
     } else {
         fprintf(stderr, "%s: tool not found\n", name);
         return EXIT_FAILURE;
@@ -165,7 +201,7 @@ int main_normal(int argc, char *argv[])
     char *name = argv[1];
     struct tool *tool = find_tool(name);
     if (tool) {
-        return tool->func(argc - 1, argv + 1);
+        return run_tool(tool, argc - 1, argv + 1);
     } else {
         fprintf(stderr, "%s: tool not found\n", name);
         return EXIT_FAILURE;
@@ -181,11 +217,10 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    if (!mb::util::set_process_title_init(argc, argv)) {
-        fprintf(stderr, "set_process_title_init() failed: %s\n",
-                strerror(errno));
-        return EXIT_FAILURE;
-    }
+    // set_process_title_init() clobbers argv, so it is only called for the
+    // tools that need it. See run_tool().
+    orig_argc = argc;
+    orig_argv = argv;
 
     umask(0);
 
@@ -193,6 +228,26 @@ int main(int argc, char *argv[])
         fprintf(stderr, "Failed to set default locale\n");
     }
 
+    // Strip --profile=<file> (which must be the first argument) so that the
+    // tools never see it. The environment variable is for init, which cannot
+    // receive arguments.
+    const char *profile_env = getenv("MBTOOL_PROFILE");
+    std::string profile_path = profile_env ? profile_env : "";
+    if (argc > 1 && strncmp(argv_copy[1], "--profile=", 10) == 0) {
+        profile_path = argv_copy[1] + 10;
+        free(argv_copy[1]);
+        // Also moves the terminating NULL
+        memmove(argv_copy + 1, argv_copy + 2, sizeof(char *) * (argc - 1));
+        --argc;
+    }
+    if (!profile_path.empty()) {
+        std::string command = mb::util::join(
+                std::vector<std::string>(argv_copy, argv_copy + argc), " ");
+        if (!mb::profile_start(profile_path.c_str(), command.c_str())) {
+            fprintf(stderr, "Failed to start profiling\n");
+        }
+    }
+
     int ret;
 
     char *no_multicall = getenv("MBTOOL_NO_MULTICALL");
@@ -202,6 +257,8 @@ int main(int argc, char *argv[])
         ret = main_multicall(argc, argv_copy);
     }
 
+    mb::profile_finish();
+
     mb::util::free_cstring_list(argv_copy);
 
     return ret;
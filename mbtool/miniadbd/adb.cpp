@@ -58,14 +58,18 @@ void fatal_errno(const char *fmt, ...)
     exit(-1);
 }
 
-apacket* get_apacket(void)
+apacket* get_apacket(size_t payload)
 {
-    apacket* p = reinterpret_cast<apacket*>(malloc(sizeof(apacket)));
+    // The payload buffer immediately follows the packet header so that a
+    // packet remains a single allocation
+    apacket* p = reinterpret_cast<apacket*>(malloc(sizeof(apacket) + payload));
     if (p == nullptr) {
       fatal("failed to allocate an apacket");
     }
 
-    memset(p, 0, sizeof(apacket) - MAX_PAYLOAD);
+    memset(p, 0, sizeof(apacket));
+    p->capacity = payload;
+    p->data = reinterpret_cast<unsigned char*>(p + 1);
     return p;
 }
 
@@ -179,10 +183,10 @@ void send_connect(atransport *t)
     ADB_LOGD(ADB_CONN, "Calling send_connect");
     apacket *cp = get_apacket();
     cp->msg.command = A_CNXN;
-    cp->msg.arg0 = A_VERSION;
-    cp->msg.arg1 = MAX_PAYLOAD;
+    cp->msg.arg0 = t->protocol_version;
+    cp->msg.arg1 = static_cast<unsigned>(t->max_payload);
     cp->msg.data_length = fill_connect_data((char *)cp->data,
-                                            sizeof(cp->data));
+                                            cp->capacity);
     send_packet(cp, t);
 }
 
@@ -263,6 +267,7 @@ void handle_packet(apacket *p, atransport *t)
             handle_offline(t);
         }
 
+        t->update_version(p->msg.arg0, p->msg.arg1);
         parse_banner(reinterpret_cast<const char*>(p->data), t);
 
         handle_online(t);
@@ -17,9 +17,14 @@
 #ifndef __ADB_H
 #define __ADB_H
 
+#include <cstddef>
+
 #include "fdevent.h"
 
-#define MAX_PAYLOAD 4096
+// Maximum payload of the original protocol. Always supported by the host.
+#define MAX_PAYLOAD_V1  (4 * 1024)
+// Maximum payload we advertise. The host may negotiate it down.
+#define MAX_PAYLOAD     (256 * 1024)
 
 #define A_SYNC 0x434e5953
 #define A_CNXN 0x4e584e43
@@ -29,7 +34,11 @@
 #define A_WRTE 0x45545257
 
 // ADB protocol version.
-#define A_VERSION 0x01000000
+// Version with mandatory payload checksums
+#define A_VERSION_MIN 0x01000000
+// Version where payload checksums are no longer sent or verified
+#define A_VERSION_SKIP_CHECKSUM 0x01000001
+#define A_VERSION 0x01000001
 
 struct atransport;
 struct usb_handle;
@@ -51,7 +60,10 @@ struct apacket
     unsigned char *ptr;
 
     amessage msg;
-    unsigned char data[MAX_PAYLOAD];
+
+    // Payload buffer (allocated together with the packet) and its size
+    size_t capacity;
+    unsigned char *data;
 };
 
 /* An asocket represents one half of a connection between a local and
@@ -123,6 +135,11 @@ struct asocket {
 
         /* A socket is bound to atransport */
     atransport *transport;
+
+        /* largest payload that can be sent through this socket (and its
+        ** peer's transport)
+        */
+    size_t get_max_payload() const;
 };
 
 
@@ -195,7 +212,15 @@ struct atransport
     void *key;
     unsigned char token[TOKEN_SIZE];
 
+        /* negotiated protocol version and maximum payload size. These start
+        ** at A_VERSION_MIN and MAX_PAYLOAD and are lowered to what the host
+        ** supports when it connects.
+        */
+    unsigned protocol_version;
+    size_t max_payload;
+
     const char* connection_state_name() const;
+    void update_version(unsigned version, size_t payload);
 };
 
 
@@ -246,7 +271,7 @@ void init_usb_transport(atransport *t, usb_handle *usb, int state);
 int service_to_fd(const char *name);
 
 /* packet allocator */
-apacket *get_apacket(void);
+apacket *get_apacket(size_t payload = MAX_PAYLOAD_V1);
 void put_apacket(apacket *p);
 
 // Define it if you want to dump packets.
@@ -17,10 +17,14 @@
 #include "sysdeps.h"
 #include "file_sync_service.h"
 
+#include <algorithm>
+
 #include <cstdlib>
 #include <cstring>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
 #include <utime.h>
 
 #include "adb_io.h"
@@ -154,8 +158,97 @@ static int fail_errno(int s)
     return fail_message(s, strerror(errno));
 }
 
+static void close_pipe(int *pipe_fds)
+{
+    if (pipe_fds[0] >= 0) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        pipe_fds[0] = pipe_fds[1] = -1;
+    }
+}
+
+/*
+ * Copy |len| bytes from the socket |s| to |fd|. The data is moved through
+ * |pipe_fds| with splice() so that it never passes through userspace. If
+ * splice() is not supported, the pipe is closed and |buffer| is used instead.
+ *
+ * Returns 0 on success, -1 if reading from |s| failed, or 1 if writing to |fd|
+ * failed. In the last case, errno is set and the rest of the chunk has been
+ * consumed so the connection remains usable.
+ */
+static int copy_to_file(int s, int fd, int *pipe_fds, char *buffer,
+                        size_t len)
+{
+    size_t remain = len;
+
+    while (remain > 0 && pipe_fds[0] >= 0) {
+        ssize_t n = splice(s, nullptr, pipe_fds[1], nullptr, remain,
+                           SPLICE_F_MOVE);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL && remain == len) {
+                // Kernel can't splice from sockets. Nothing was consumed yet.
+                ADB_LOGD(ADB_SERV, "sync: splice unsupported; copying data");
+                close_pipe(pipe_fds);
+                break;
+            }
+            return -1;
+        } else if (n == 0) {
+            errno = EIO;
+            return -1;
+        }
+        remain -= n;
+
+        size_t pending = n;
+        while (pending > 0) {
+            ssize_t w = splice(pipe_fds[0], nullptr, fd, nullptr, pending,
+                               SPLICE_F_MOVE);
+            if (w > 0) {
+                pending -= w;
+                continue;
+            } else if (w < 0 && errno == EINTR) {
+                continue;
+            }
+
+            int saved_errno = w < 0 ? errno : EIO;
+
+            // Get the data back out of the pipe
+            if (!ReadFdExactly(pipe_fds[0], buffer, pending)) {
+                return -1;
+            }
+
+            if (saved_errno == EINVAL) {
+                // Target doesn't support splice(). Write what we already have
+                // and copy the rest of the chunk.
+                ADB_LOGD(ADB_SERV, "sync: splice unsupported; copying data");
+                close_pipe(pipe_fds);
+                if (!WriteFdExactly(fd, buffer, pending)) {
+                    saved_errno = errno;
+                    if (!ReadFdExactly(s, buffer, remain)) return -1;
+                    errno = saved_errno;
+                    return 1;
+                }
+                break;
+            }
+
+            if (!ReadFdExactly(s, buffer, remain)) {
+                return -1;
+            }
+            errno = saved_errno;
+            return 1;
+        }
+    }
+
+    if (remain > 0) {
+        if (!ReadFdExactly(s, buffer, remain)) return -1;
+        if (!WriteFdExactly(fd, buffer, remain)) return 1;
+    }
+
+    return 0;
+}
+
 static int handle_send_file(int s, char *path, uid_t uid,
-        gid_t gid, mode_t mode, char *buffer, bool do_unlink)
+        gid_t gid, mode_t mode, char *buffer, int *pipe_fds, bool do_unlink)
 {
     syncmsg msg;
     unsigned int timestamp = 0;
@@ -211,12 +304,16 @@ static int handle_send_file(int s, char *path, uid_t uid,
             fail_message(s, "oversize data message");
             goto fail;
         }
-        if (!ReadFdExactly(s, buffer, len))
-            goto fail;
-
-        if (fd < 0)
+        if (fd < 0) {
+            if (!ReadFdExactly(s, buffer, len))
+                goto fail;
             continue;
-        if (!WriteFdExactly(fd, buffer, len)) {
+        }
+
+        int ret = copy_to_file(s, fd, pipe_fds, buffer, len);
+        if (ret < 0)
+            goto fail;
+        if (ret > 0) {
             int saved_errno = errno;
             close(fd);
             if (do_unlink) unlink(path);
@@ -299,7 +396,7 @@ static int handle_send_link(int s, char *path, char *buffer)
     return 0;
 }
 
-static int do_send(int s, char *path, char *buffer)
+static int do_send(int s, char *path, char *buffer, int *pipe_fds)
 {
     unsigned int mode;
     bool is_link = false;
@@ -341,7 +438,8 @@ static int do_send(int s, char *path, char *buffer)
     if (*tmp == '/') {
         tmp++;
     }
-    return handle_send_file(s, path, uid, gid, mode, buffer, do_unlink);
+    return handle_send_file(s, path, uid, gid, mode, buffer, pipe_fds,
+                            do_unlink);
 }
 
 static int do_recv(int s, const char *path, char *buffer)
@@ -356,8 +454,45 @@ static int do_recv(int s, const char *path, char *buffer)
     }
 
     msg.data.id = ID_DATA;
+
+    // Let the kernel copy regular files straight into the socket. Chunk sizes
+    // are announced before the data, so this only covers the size at the time
+    // of the stat. Anything appended afterwards is sent by the loop below.
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        uint64_t remain = st.st_size;
+
+        while (remain > 0) {
+            size_t chunk = std::min<uint64_t>(remain, SYNC_DATA_SEND_MAX);
+            size_t sent = 0;
+
+            msg.data.size = htoll(chunk);
+            if (!WriteFdExactly(s, &msg.data, sizeof(msg.data))) {
+                close(fd);
+                return -1;
+            }
+
+            while (sent < chunk) {
+                ssize_t n = sendfile(s, fd, nullptr, chunk - sent);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                } else if (n <= 0) {
+                    // The chunk size was already sent, so the only way to
+                    // report this is to drop the connection
+                    ADB_LOGE(ADB_SERV, "sync: sendfile failed for %s: %s",
+                             path, n < 0 ? strerror(errno) : "file shrank");
+                    close(fd);
+                    return -1;
+                }
+                sent += n;
+            }
+
+            remain -= chunk;
+        }
+    }
+
     for (;;) {
-        r = adb_read(fd, buffer, SYNC_DATA_MAX);
+        r = adb_read(fd, buffer, SYNC_DATA_SEND_MAX);
         if (r <= 0) {
             if (r == 0) break;
             if (errno == EINTR) continue;
@@ -390,9 +525,19 @@ void file_sync_service(int fd, void *cookie)
     char name[1025];
     unsigned namelen;
 
+    int pipe_fds[2];
+
     char *buffer = reinterpret_cast<char*>(malloc(SYNC_DATA_MAX));
     if (buffer == 0) goto fail;
 
+    // Pushed data is spliced through this pipe. It's sized to hold a full
+    // chunk so that each chunk needs only one pair of splice() calls.
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+        pipe_fds[0] = pipe_fds[1] = -1;
+    } else {
+        fcntl(pipe_fds[0], F_SETPIPE_SZ, SYNC_DATA_MAX);
+    }
+
     for (;;) {
         ADB_LOGD(ADB_SERV, "sync: waiting for command");
 
@@ -422,7 +567,7 @@ void file_sync_service(int fd, void *cookie)
             if (do_list(fd, name)) goto fail;
             break;
         case ID_SEND:
-            if (do_send(fd, name, buffer)) goto fail;
+            if (do_send(fd, name, buffer, pipe_fds)) goto fail;
             break;
         case ID_RECV:
             if (do_recv(fd, name, buffer)) goto fail;
@@ -436,7 +581,10 @@ void file_sync_service(int fd, void *cookie)
     }
 
 fail:
-    if (buffer != 0) free(buffer);
+    if (buffer != 0) {
+        close_pipe(pipe_fds);
+        free(buffer);
+    }
     ADB_LOGD(ADB_SERV, "sync: done");
     close(fd);
 }
@@ -68,6 +68,10 @@ union syncmsg {
 
 void file_sync_service(int fd, void *cookie);
 
-#define SYNC_DATA_MAX (64*1024)
+// Largest DATA chunk accepted from the host. This matches the adb payload size
+// so that a chunk never needs more than one packet.
+#define SYNC_DATA_MAX (256*1024)
+// Largest DATA chunk sent to the host. Hosts reject chunks over 64 KiB.
+#define SYNC_DATA_SEND_MAX (64*1024)
 
 #endif
@@ -16,6 +16,8 @@
 
 #include "sysdeps.h"
 
+#include <algorithm>
+
 #include <cstdlib>
 #include <cstring>
 
@@ -43,6 +45,18 @@ static asocket local_socket_closing_list = {
     .prev = &local_socket_closing_list,
 };
 
+size_t asocket::get_max_payload() const
+{
+    size_t max_payload = MAX_PAYLOAD;
+    if (transport) {
+        max_payload = std::min(max_payload, transport->max_payload);
+    }
+    if (peer && peer->transport) {
+        max_payload = std::min(max_payload, peer->transport->max_payload);
+    }
+    return max_payload;
+}
+
 // Parse the global list of sockets to find one with id |local_id|.
 // If |peer_id| is not 0, also check that it is connected to a peer
 // with id |peer_id|. Returns an asocket handle on success, NULL on failure.
@@ -323,9 +337,10 @@ static void local_socket_event_func(int fd, unsigned ev, void* _s)
 
 
     if (ev & FDE_READ) {
-        apacket *p = get_apacket();
+        const size_t max_payload = s->get_max_payload();
+        apacket *p = get_apacket(max_payload);
         unsigned char *x = p->data;
-        size_t avail = MAX_PAYLOAD;
+        size_t avail = max_payload;
         int r;
         int is_eof = 0;
 
@@ -351,10 +366,10 @@ static void local_socket_event_func(int fd, unsigned ev, void* _s)
         ADB_LOGD(ADB_SOCK,
                  "LS(%d): fd=%d post avail loop. r=%d is_eof=%d forced_eof=%d",
                  s->id, s->fd, r, is_eof, s->fde.force_eof);
-        if ((avail == MAX_PAYLOAD) || (s->peer == 0)) {
+        if ((avail == max_payload) || (s->peer == 0)) {
             put_apacket(p);
         } else {
-            p->len = MAX_PAYLOAD - avail;
+            p->len = max_payload - avail;
 
             r = s->peer->enqueue(s->peer, p);
             ADB_LOGD(ADB_SOCK, "LS(%d): fd=%d post peer->enqueue(). r=%d",
@@ -17,6 +17,8 @@
 #include "sysdeps.h"
 #include "transport.h"
 
+#include <algorithm>
+
 #include <cstdlib>
 #include <cstring>
 
@@ -208,13 +210,20 @@ void send_packet(apacket *p, atransport *t)
 
     p->msg.magic = p->msg.command ^ 0xffffffff;
 
-    count = p->msg.data_length;
-    x = (unsigned char *) p->data;
-    sum = 0;
-    while (count-- > 0) {
-        sum += *x++;
+    // The host has not seen our version yet when it receives our CNXN, so
+    // that packet is always checksummed
+    if (t && t->protocol_version >= A_VERSION_SKIP_CHECKSUM
+            && p->msg.command != A_CNXN) {
+        p->msg.data_check = 0;
+    } else {
+        count = p->msg.data_length;
+        x = (unsigned char *) p->data;
+        sum = 0;
+        while (count-- > 0) {
+            sum += *x++;
+        }
+        p->msg.data_check = sum;
     }
-    p->msg.data_check = sum;
 
     print_packet("send", p);
 
@@ -264,7 +273,7 @@ static void *output_thread(void *_t)
 
     ADB_LOGD(ADB_TSPT, "%s: data pump started", t->serial);
     for (;;) {
-        p = get_apacket();
+        p = get_apacket(t->max_payload);
 
         if (t->read_from_remote(p, t) == 0) {
             ADB_LOGD(ADB_TSPT,
@@ -609,6 +618,13 @@ void remove_transport_disconnect(atransport*  t, adisconnect*  dis)
     dis->next = dis->prev = dis;
 }
 
+void atransport::update_version(unsigned version, size_t payload) {
+    protocol_version = std::min(version, static_cast<unsigned>(A_VERSION));
+    max_payload = std::min(payload, static_cast<size_t>(MAX_PAYLOAD));
+    ADB_LOGD(ADB_TSPT, "%s: protocol version %08x, max payload %zu",
+             serial ? serial : "", protocol_version, max_payload);
+}
+
 const char* atransport::connection_state_name() const {
     switch (connection_state) {
     case CS_OFFLINE: return "offline";
@@ -623,6 +639,8 @@ void register_usb_transport(usb_handle *usb, const char *serial, const char *dev
 {
     atransport *t = reinterpret_cast<atransport*>(calloc(1, sizeof(atransport)));
     if (t == nullptr) fatal("cannot allocate USB atransport");
+    t->protocol_version = A_VERSION_MIN;
+    t->max_payload = MAX_PAYLOAD;
     ADB_LOGD(ADB_TSPT, "transport: %p init'ing for usb_handle %p (sn='%s')",
              t, usb, serial ? serial : "");
     init_usb_transport(t, usb, (writeable ? CS_OFFLINE : CS_NOPERM));
@@ -665,9 +683,9 @@ int check_header(apacket *p)
         return -1;
     }
 
-    if (p->msg.data_length > MAX_PAYLOAD) {
-        ADB_LOGE(ADB_TSPT, "check_header(): %d > MAX_PAYLOAD",
-                 p->msg.data_length);
+    if (p->msg.data_length > p->capacity) {
+        ADB_LOGE(ADB_TSPT, "check_header(): %u > max payload (%zu)",
+                 p->msg.data_length, p->capacity);
         return -1;
     }
 
@@ -38,7 +38,7 @@ static int remote_read(apacket *p, atransport *t)
         }
     }
 
-    if (check_data(p)) {
+    if (t->protocol_version < A_VERSION_SKIP_CHECKSUM && check_data(p)) {
         ADB_LOGE(ADB_TSPT, "remote usb: check_data failed");
         return -1;
     }
@@ -55,7 +55,7 @@ static int remote_write(apacket *p, atransport *t)
         return -1;
     }
     if (p->msg.data_length == 0) return 0;
-    if (usb_write(t->usb, &p->data, size)) {
+    if (usb_write(t->usb, p->data, size)) {
         ADB_LOGE(ADB_TSPT, "remote usb: 2 - write terminated");
         return -1;
     }
@@ -16,11 +16,15 @@
 
 #include "sysdeps.h"
 
+#include <algorithm>
+
 #include <cstdlib>
 #include <cstring>
 
 #include <endian.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
 #include <linux/usb/ch9.h>
 #include <linux/usb/functionfs.h>
 
@@ -32,9 +36,31 @@
 #define MAX_PACKET_SIZE_HS      512
 #define MAX_PACKET_SIZE_SS      1024
 
+// The legacy f_adb kernel driver rejects reads larger than its 4 KiB bulk
+// buffer
+#define USB_ADB_MAX_READ        4096
+// The kernel allocates a contiguous buffer for each functionfs transfer, which
+// can fail for large transfers due to fragmentation
+#define USB_FFS_MAX_READ        16384
+#define USB_FFS_MAX_WRITE       16384
+// FunctionFS AIO splits each transfer into USB_FFS_MAX_READ/USB_FFS_MAX_WRITE
+// sized requests and keeps up to this many in flight per endpoint. This covers
+// a full MAX_PAYLOAD packet.
+#define USB_FFS_NUM_AIO         (MAX_PAYLOAD / USB_FFS_MAX_READ)
+
 #define cpu_to_le16(x)  htole16(x)
 #define cpu_to_le32(x)  htole32(x)
 
+struct aio_block
+{
+    aio_context_t ctx;
+    // False if AIO is unavailable and blocking I/O should be used
+    bool enabled;
+    struct iocb iocb[USB_FFS_NUM_AIO];
+    struct iocb *iocbs[USB_FFS_NUM_AIO];
+    struct io_event events[USB_FFS_NUM_AIO];
+};
+
 struct usb_handle
 {
     pthread_cond_t notify;
@@ -51,6 +77,10 @@ struct usb_handle
     int control;
     int bulk_out; /* "out" from the host's perspective => source for adbd */
     int bulk_in;  /* "in" from the host's perspective => sink for adbd */
+
+    // Separate contexts since reads and writes happen on different threads
+    aio_block read_aiob;
+    aio_block write_aiob;
 };
 
 struct func_desc {
@@ -271,11 +301,16 @@ static int usb_adb_read(usb_handle *h, void *data, int len)
     int n;
 
     ADB_LOGD(ADB_USB, "about to read (fd=%d, len=%d)", h->fd, len);
-    n = adb_read(h->fd, data, len);
-    if (n != len) {
-        ADB_LOGE(ADB_USB, "ERROR: fd = %d, n = %d, errno = %d (%s)",
-                 h->fd, n, errno, strerror(errno));
-        return -1;
+    while (len > 0) {
+        int to_read = std::min(len, USB_ADB_MAX_READ);
+        n = adb_read(h->fd, data, to_read);
+        if (n != to_read) {
+            ADB_LOGE(ADB_USB, "ERROR: fd = %d, n = %d, errno = %d (%s)",
+                     h->fd, n, errno, strerror(errno));
+            return -1;
+        }
+        len -= n;
+        data = reinterpret_cast<char *>(data) + n;
     }
     ADB_LOGD(ADB_USB, "[ done fd=%d ]", h->fd);
     return 0;
@@ -436,13 +471,147 @@ static void *usb_ffs_open_thread(void *x)
     return 0;
 }
 
+static int io_setup(unsigned nr, aio_context_t *ctx)
+{
+    return syscall(__NR_io_setup, nr, ctx);
+}
+
+static int io_submit(aio_context_t ctx, long nr, struct iocb **iocbs)
+{
+    return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static int io_getevents(aio_context_t ctx, long min_nr, long max_nr,
+                        struct io_event *events, struct timespec *timeout)
+{
+    return syscall(__NR_io_getevents, ctx, min_nr, max_nr, events, timeout);
+}
+
+static void aio_block_init(aio_block *aiob)
+{
+    memset(aiob, 0, sizeof(*aiob));
+
+    if (io_setup(USB_FFS_NUM_AIO, &aiob->ctx) < 0) {
+        ADB_LOGW(ADB_USB, "[ aio: io_setup failed (%s); using blocking I/O ]",
+                 strerror(errno));
+        return;
+    }
+
+    for (int i = 0; i < USB_FFS_NUM_AIO; ++i) {
+        aiob->iocbs[i] = &aiob->iocb[i];
+    }
+    aiob->enabled = true;
+}
+
+// Wait for all submitted requests to complete. The buffers must stay valid
+// until then, even if the transfer has already failed.
+static int aio_block_wait(aio_block *aiob, int count)
+{
+    int done = 0;
+
+    while (done < count) {
+        int ret = io_getevents(aiob->ctx, count - done, count - done,
+                               aiob->events + done, nullptr);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Transfer |length| bytes with up to USB_FFS_NUM_AIO requests in flight.
+ * Returns the number of bytes transferred, -1 on error, or -2 if the endpoint
+ * does not support AIO (in which case nothing was transferred).
+ */
+static int usb_ffs_do_aio(aio_block *aiob, int fd, uint8_t* buf,
+                          size_t length, bool read)
+{
+    const size_t max_size = read ? USB_FFS_MAX_READ : USB_FFS_MAX_WRITE;
+    size_t count = 0;
+
+    while (count < length) {
+        int num = 0;
+        size_t offset = count;
+
+        for (; num < USB_FFS_NUM_AIO && offset < length; ++num) {
+            size_t size = std::min(length - offset, max_size);
+            struct iocb *iocb = &aiob->iocb[num];
+
+            memset(iocb, 0, sizeof(*iocb));
+            iocb->aio_fildes = fd;
+            iocb->aio_lio_opcode = read ? IOCB_CMD_PREAD : IOCB_CMD_PWRITE;
+            iocb->aio_buf = reinterpret_cast<uintptr_t>(buf + offset);
+            iocb->aio_nbytes = size;
+
+            offset += size;
+        }
+
+        int submitted;
+        do {
+            submitted = io_submit(aiob->ctx, num, aiob->iocbs);
+        } while (submitted < 0 && errno == EINTR);
+
+        if (submitted < 0) {
+            if (errno == EINVAL && count == 0) {
+                return -2;
+            }
+            ADB_LOGE(ADB_USB, "[ aio: io_submit failed fd=%d: %s ]",
+                     fd, strerror(errno));
+            return -1;
+        }
+
+        if (aio_block_wait(aiob, submitted) < 0) {
+            ADB_LOGE(ADB_USB, "[ aio: io_getevents failed fd=%d: %s ]",
+                     fd, strerror(errno));
+            return -1;
+        }
+
+        int saved_errno = 0;
+
+        for (int i = 0; i < submitted; ++i) {
+            struct io_event *event = &aiob->events[i];
+            struct iocb *iocb = reinterpret_cast<struct iocb *>(event->obj);
+
+            if (event->res < 0) {
+                saved_errno = static_cast<int>(-event->res);
+            } else if (static_cast<uint64_t>(event->res) != iocb->aio_nbytes) {
+                // A short transfer would leave a hole before the data of the
+                // following requests
+                saved_errno = EIO;
+            }
+        }
+
+        if (submitted != num) {
+            saved_errno = EIO;
+        }
+
+        if (saved_errno != 0) {
+            ADB_LOGE(ADB_USB, "[ aio: %s failed fd=%d: %s ]",
+                     read ? "read" : "write", fd, strerror(saved_errno));
+            errno = saved_errno;
+            return -1;
+        }
+
+        count = offset;
+    }
+
+    return count;
+}
+
 static int bulk_write(int bulk_in, const uint8_t* buf, size_t length)
 {
     size_t count = 0;
     int ret;
 
     do {
-        ret = adb_write(bulk_in, buf + count, length - count);
+        ret = adb_write(bulk_in, buf + count,
+                        std::min<size_t>(length - count, USB_FFS_MAX_WRITE));
         if (ret < 0) {
             if (errno != EINTR)
                 return ret;
@@ -458,7 +627,21 @@ static int bulk_write(int bulk_in, const uint8_t* buf, size_t length)
 static int usb_ffs_write(usb_handle* h, const void* data, int len)
 {
     ADB_LOGD(ADB_USB, "about to write (fd=%d, len=%d)", h->bulk_in, len);
-    int n = bulk_write(h->bulk_in, reinterpret_cast<const uint8_t*>(data), len);
+    int n = -2;
+    if (h->write_aiob.enabled) {
+        // The data is only read from
+        n = usb_ffs_do_aio(&h->write_aiob, h->bulk_in,
+                           const_cast<uint8_t*>(
+                                   reinterpret_cast<const uint8_t*>(data)),
+                           len, false);
+        if (n == -2) {
+            ADB_LOGW(ADB_USB, "[ aio: writes not supported; disabling ]");
+            h->write_aiob.enabled = false;
+        }
+    }
+    if (n == -2) {
+        n = bulk_write(h->bulk_in, reinterpret_cast<const uint8_t*>(data), len);
+    }
     if (n != len) {
         ADB_LOGE(ADB_USB, "ERROR: fd = %d, n = %d: %s",
                  h->bulk_in, n, strerror(errno));
@@ -474,7 +657,8 @@ static int bulk_read(int bulk_out, uint8_t* buf, size_t length)
     int ret;
 
     do {
-        ret = adb_read(bulk_out, buf + count, length - count);
+        ret = adb_read(bulk_out, buf + count,
+                       std::min<size_t>(length - count, USB_FFS_MAX_READ));
         if (ret < 0) {
             if (errno != EINTR) {
                 ADB_LOGE(ADB_USB,
@@ -493,7 +677,18 @@ static int bulk_read(int bulk_out, uint8_t* buf, size_t length)
 static int usb_ffs_read(usb_handle* h, void* data, int len)
 {
     ADB_LOGD(ADB_USB, "about to read (fd=%d, len=%d)", h->bulk_out, len);
-    int n = bulk_read(h->bulk_out, reinterpret_cast<uint8_t*>(data), len);
+    int n = -2;
+    if (h->read_aiob.enabled) {
+        n = usb_ffs_do_aio(&h->read_aiob, h->bulk_out,
+                           reinterpret_cast<uint8_t*>(data), len, true);
+        if (n == -2) {
+            ADB_LOGW(ADB_USB, "[ aio: reads not supported; disabling ]");
+            h->read_aiob.enabled = false;
+        }
+    }
+    if (n == -2) {
+        n = bulk_read(h->bulk_out, reinterpret_cast<uint8_t*>(data), len);
+    }
     if (n != len) {
         ADB_LOGE(ADB_USB, "ERROR: fd = %d, n = %d: %s",
                  h->bulk_out, n, strerror(errno));
@@ -540,7 +735,10 @@ static void usb_ffs_init()
     h->kick = usb_ffs_kick;
     h->control = -1;
     h->bulk_out = -1;
-    h->bulk_out = -1;
+    h->bulk_in = -1;
+
+    aio_block_init(&h->read_aiob);
+    aio_block_init(&h->write_aiob);
 
     pthread_cond_init(&h->notify, 0);
     pthread_mutex_init(&h->lock, 0);
@@ -20,6 +20,12 @@
 #include "mount_fstab.h"
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <system_error>
+#include <thread>
 
 #include <cerrno>
 #include <cstdio>
@@ -48,14 +54,20 @@
 #include "mbutil/file.h"
 #include "mbutil/finally.h"
 #include "mbutil/fstab.h"
+#include "mbutil/loopdev.h"
 #include "mbutil/mount.h"
 #include "mbutil/path.h"
 #include "mbutil/properties.h"
 #include "mbutil/selinux.h"
 #include "mbutil/string.h"
+#include "mbutil/time.h"
 
+#include "boot_trace.h"
+#include "image.h"
 #include "multiboot.h"
+#include "overlay.h"
 #include "reboot.h"
+#include "romconfig.h"
 #include "roms.h"
 #include "sepolpatch.h"
 #include "signature.h"
@@ -93,6 +105,8 @@ static bool create_dir_and_mount(const std::vector<util::fstab_rec> &recs,
         return false;
     }
 
+    BootTraceScope trace("mount", mount_point);
+
     LOGD("%s: Has %zu fstab entries", mount_point, recs.size());
 
     if (mkdir(mount_point, perms) < 0) {
@@ -275,14 +289,15 @@ static bool mount_exfat_fuse(const char *source, const char *target)
     uid_t uid = get_media_rw_uid();
 
     // Check signatures
-    SigVerifyResult result;
-    result = verify_signature("/sbin/fsck.exfat", "/sbin/fsck.exfat.sig");
-    if (result != SigVerifyResult::VALID) {
+    auto results = verify_signatures_batch({
+        { "/sbin/fsck.exfat", "/sbin/fsck.exfat.sig" },
+        { "/sbin/mount.exfat", "/sbin/mount.exfat.sig" },
+    });
+    if (results[0] != SigVerifyResult::VALID) {
         LOGE("Invalid fsck.exfat signature");
         return false;
     }
-    result = verify_signature("/sbin/mount.exfat", "/sbin/mount.exfat.sig");
-    if (result != SigVerifyResult::VALID) {
+    if (results[1] != SigVerifyResult::VALID) {
         LOGE("Invalid mount.exfat signature");
         return false;
     }
@@ -396,12 +411,8 @@ static bool mount_ext4(const char *source, const char *target)
     }
 }
 
-static bool try_extsd_mount(const char *block_dev, const char *mount_point)
+static bool detect_use_fuse_exfat()
 {
-    // Vold ignores the fstab fstype field and uses blkid to determine the
-    // filesystem. We don't link in blkid, so we'll use a trial and error
-    // approach.
-
     bool use_fuse_exfat =
             util::file_find_one_of("/init.orig", { "EXFAT   ", "exfat" });
     std::string value = util::property_file_get_string(
@@ -418,40 +429,58 @@ static bool try_extsd_mount(const char *block_dev, const char *mount_point)
         }
     }
 
-    const char *fstype;
-    if (!util::blkid_get_fs_type(block_dev, &fstype)) {
+    LOGD("Using fuse-exfat: %d", use_fuse_exfat);
+
+    return use_fuse_exfat;
+}
+
+static bool try_extsd_mount(const char *block_dev, const char *mount_point)
+{
+    BootTraceScope trace("mount_extsd", block_dev);
+
+    // Vold ignores the fstab fstype field and uses blkid to determine the
+    // filesystem. We don't link in blkid, so we use our own superblock probe,
+    // which returns every matching filesystem ordered from most to least
+    // likely.
+
+    // Scanning /init.orig is expensive and the result never changes, so only
+    // do it once
+    static const bool use_fuse_exfat = detect_use_fuse_exfat();
+
+    std::vector<const char *> fstypes;
+    if (!util::blkid_probe_fs_types(block_dev, &fstypes)) {
         LOGE("%s: Failed to detect filesystem type: %s",
              block_dev, strerror(errno));
-    } else if (!fstype) {
+        return false;
+    } else if (fstypes.empty()) {
         LOGE("%s: Unknown filesystem", block_dev);
-    } else if (strcmp(fstype, "exfat") == 0) {
-        LOGD("Using fuse-exfat: %d", use_fuse_exfat);
+        return false;
+    }
 
-        auto func = use_fuse_exfat ? &mount_exfat_fuse : &mount_exfat_kernel;
-        if (func(block_dev, mount_point)) {
-            return true;
-        }
-    } else if (strcmp(fstype, "vfat") == 0) {
-        if (mount_vfat(block_dev, mount_point)) {
-            return true;
-        }
-    } else if (strcmp(fstype, "ext") == 0) {
-        // Assume ext4
-        if (mount_ext4(block_dev, mount_point)) {
-            return true;
+    for (const char *fstype : fstypes) {
+        if (strcmp(fstype, "exfat") == 0) {
+            auto func = use_fuse_exfat
+                    ? &mount_exfat_fuse : &mount_exfat_kernel;
+            if (func(block_dev, mount_point)) {
+                return true;
+            }
+        } else if (strcmp(fstype, "vfat") == 0) {
+            if (mount_vfat(block_dev, mount_point)) {
+                return true;
+            }
+        } else if (strcmp(fstype, "ext") == 0) {
+            // Assume ext4
+            if (mount_ext4(block_dev, mount_point)) {
+                return true;
+            }
+        } else {
+            LOGE("%s: Cannot handle filesystem: %s", block_dev, fstype);
         }
-    } else {
-        LOGE("%s: Cannot handle filesystem: %s", block_dev, fstype);
     }
 
     return false;
 }
 
-/*!
- * \brief Split list of globs from a list of glob strings
- *
- * Splits \a patterns by commas only if the following character is a slash
- */
 static std::vector<std::string> split_patterns(const char *patterns)
 {
     const char *begin = patterns;
@@ -482,7 +511,8 @@ static std::vector<std::string> split_patterns(const char *patterns)
  * It relies an the sysfs -> block devices map created by initwrapper/devices.cpp
  */
 static bool mount_extsd_fstab_entries(const std::vector<util::fstab_rec> &extsd_recs,
-                                      const char *mount_point, mode_t perms)
+                                      const char *mount_point, mode_t perms,
+                                      const std::atomic_bool &abort)
 {
     if (extsd_recs.empty()) {
         LOGD("No external SD fstab entries to mount");
@@ -498,15 +528,19 @@ static bool mount_extsd_fstab_entries(const std::vector<util::fstab_rec> &extsd_
     }
 
     // We can't wait for a block device path to appear since we don't know the
-    // block device path. Thus, we'll match the paths a number of times with a
-    // delay between each attempt.
-    static const int max_attempts = 10;
+    // block device path. Thus, we'll match the paths again each time the
+    // uevent thread publishes new block devices, until the time limit is hit.
+    // The wait is capped at 1 second so that abort is noticed quickly.
+    static const uint64_t max_wait_ms = 10 * 1000;
+    static const uint64_t max_interval_ms = 1000;
 
-    for (int i = 0; i < max_attempts; ++i) {
-        LOGV("[Attempt %d/%d] Finding and mounting external SD",
-             i + 1, max_attempts);
+    uint64_t until = util::current_time_ms() + max_wait_ms;
+    BlockDevIndexPtr index = get_block_dev_index();
+    int attempt = 0;
 
-        auto devices_map = get_block_dev_mappings();
+    while (true) {
+        ++attempt;
+        LOGV("[Attempt %d] Finding and mounting external SD", attempt);
 
         for (const util::fstab_rec &rec : extsd_recs) {
             std::vector<std::string> patterns =
@@ -516,8 +550,8 @@ static bool mount_extsd_fstab_entries(const std::vector<util::fstab_rec> &extsd_
             for (const std::string &pattern : patterns) {
                 LOGD("Matching devices against pattern: %s", pattern.c_str());
 
-                for (auto const &pair : devices_map) {
-                    const BlockDevInfo &info = pair.second;
+                for (auto const &pair : index->by_sysfs_path) {
+                    const BlockDevInfo &info = *pair.second;
 
                     if (path_matches(pair.first.c_str(), pattern.c_str())) {
                         LOGV("Matched external SD block dev: "
@@ -540,19 +574,29 @@ static bool mount_extsd_fstab_entries(const std::vector<util::fstab_rec> &extsd_
             }
         }
 
-        if (i < max_attempts - 1) {
-            LOGW("No external SD patterns were matched; waiting 1 second");
-            sleep(1);
+        if (abort) {
+            LOGW("Another mount failed; no longer looking for external SD");
+            return false;
+        }
+
+        uint64_t now = util::current_time_ms();
+        if (now >= until) {
+            break;
         }
+
+        LOGW("No external SD patterns were matched; waiting for new block devices");
+        index = wait_for_block_dev_index(
+                index, static_cast<unsigned int>(
+                        std::min(until - now, max_interval_ms)));
     }
 
-    LOGE("No external SD patterns were matched after %d attempts",
-         max_attempts);
+    LOGE("No external SD patterns were matched after %d attempts", attempt);
 
     return false;
 }
 
-static bool mount_target(const char *source, const char *target, bool bind)
+static bool mount_target(const char *source, const char *target, bool bind,
+                         unsigned long flags = 0)
 {
     struct stat sb;
 
@@ -577,7 +621,7 @@ static bool mount_target(const char *source, const char *target, bool bind)
     if (bind) {
         ret = util::mount(source, target, "", MS_BIND, "");
     } else {
-        ret = util::mount(source, target, "auto", 0, "");
+        ret = util::mount(source, target, "auto", flags, "");
     }
 
     if (!ret) {
@@ -588,6 +632,63 @@ static bool mount_target(const char *source, const char *target, bool bind)
     return true;
 }
 
+/*!
+ * \brief Loop mount an image with direct I/O
+ *
+ * The loop device's logical block size is matched to the filesystem's block
+ * size (up to the page size), so that the I/O passed on to the backing file is
+ * aligned. If the kernel or the backing filesystem can't do direct I/O, the
+ * loop device still works, but goes through the page cache.
+ */
+static bool mount_image_direct_io(const char *source, const char *target)
+{
+    uint32_t block_size = 0;
+    if (ext4_image_block_size(source, block_size)) {
+        uint32_t page_size = static_cast<uint32_t>(sysconf(_SC_PAGESIZE));
+        block_size = std::min(block_size, page_size);
+    } else {
+        block_size = 0;
+    }
+
+    if (!util::mkdir_recursive(target, 0755) && errno != EEXIST) {
+        LOGE("%s: Failed to create directory: %s", target, strerror(errno));
+        return false;
+    }
+
+    std::string loopdev = util::loopdev_find_unused();
+    if (loopdev.empty()) {
+        LOGE("Failed to find unused loop device: %s", strerror(errno));
+        return false;
+    }
+
+    if (!util::loopdev_set_up_device(loopdev, source, 0, false,
+                                     util::LOOPDEV_DIRECT_IO, block_size)) {
+        LOGE("Failed to set up loop device %s: %s",
+             loopdev.c_str(), strerror(errno));
+        return false;
+    }
+
+    util::LoopDevInfo info;
+    if (util::loopdev_get_info(loopdev, info)) {
+        LOGD("%s: Attached to %s (direct I/O: %s, block size: %u)",
+             source, loopdev.c_str(), info.direct_io ? "on" : "off",
+             info.block_size);
+        if (!info.direct_io) {
+            LOGW("%s: Direct I/O is not supported; using the page cache",
+                 source);
+        }
+    }
+
+    if (!util::mount(loopdev.c_str(), target, "auto", 0, "")) {
+        LOGE("%s: Failed to mount: %s: %s",
+             target, loopdev.c_str(), strerror(errno));
+        util::loopdev_remove_device(loopdev);
+        return false;
+    }
+
+    return true;
+}
+
 /*!
  * \brief Mount all system image files to /raw/images/[ROM ID]
  */
@@ -605,6 +706,37 @@ static bool mount_all_system_images()
             mount_point += rom->id;
             std::string system_path(rom->full_system_path());
 
+            RomConfig config;
+            std::string config_path(rom->config_path());
+            if (access(config_path.c_str(), F_OK) == 0
+                    && !config.load_file(config_path)) {
+                LOGW("%s: Failed to load config for ROM %s",
+                     config_path.c_str(), rom->id.c_str());
+            }
+
+            // Read-only loop devices always use direct I/O
+            bool compressed = false;
+            CompressedImageType type;
+            get_compressed_image_type(system_path, compressed, type);
+
+            if (compressed) {
+                if (!mount_target(system_path.c_str(), mount_point.c_str(),
+                                  false, MS_RDONLY)) {
+                    LOGW("Failed to mount image for %s", rom->id.c_str());
+                    failed = true;
+                }
+                continue;
+            }
+
+            if (config.loop_direct_io) {
+                if (mount_image_direct_io(system_path.c_str(),
+                                          mount_point.c_str())) {
+                    continue;
+                }
+                LOGW("Falling back to regular loop device for %s",
+                     rom->id.c_str());
+            }
+
             if (!mount_target(system_path.c_str(), mount_point.c_str(), false)) {
                 LOGW("Failed to mount image for %s", rom->id.c_str());
                 failed = true;
@@ -767,12 +899,14 @@ bool process_fstab(const char *path, const std::shared_ptr<Rom> &rom,
     recs->data.clear();
     recs->extsd.clear();
 
-    // Read original fstab file
-    fstab = util::read_fstab(path);
-    if (fstab.empty()) {
+    // Read original fstab file. The records are modified below, so work on a
+    // copy of the shared parsed fstab
+    auto parsed = util::load_fstab(path);
+    if (!parsed) {
         LOGE("%s: Failed to read fstab", path);
         return false;
     }
+    fstab = parsed->recs();
 
     bool include_sdcard0 = !(mb_device_flags(device) & FLAG_FSTAB_SKIP_SDCARD0);
 
@@ -864,6 +998,108 @@ bool process_fstab(const char *path, const std::shared_ptr<Rom> &rom,
     return true;
 }
 
+struct MountTask
+{
+    const char *mount_point;
+    std::function<bool()> mount;
+    // Indexes of tasks whose mount points are parents of this one
+    std::vector<size_t> deps;
+    bool done = false;
+    bool success = false;
+};
+
+/*!
+ * \brief Run mount tasks concurrently, ordered by mount point nesting
+ *
+ * A task only starts once every task with a parent mount point has finished
+ * successfully. Tasks that do not depend on each other (eg. /raw/cache and
+ * /raw/extsd) run in their own threads. If a thread cannot be created, the
+ * task runs on the calling thread instead. Returns once all tasks have
+ * finished.
+ *
+ * \param tasks Tasks to run
+ * \param abort Set to true once a task fails
+ *
+ * \return Whether all tasks succeeded
+ */
+static bool run_mount_tasks(std::vector<MountTask> &tasks,
+                            std::atomic_bool &abort)
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    // Parents must come before their children
+    std::stable_sort(tasks.begin(), tasks.end(),
+                     [](const MountTask &a, const MountTask &b) {
+        return strlen(a.mount_point) < strlen(b.mount_point);
+    });
+
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        for (size_t j = 0; j < i; ++j) {
+            if (starts_with(tasks[i].mount_point,
+                            std::string(tasks[j].mount_point) + "/")) {
+                tasks[i].deps.push_back(j);
+            }
+        }
+    }
+
+    auto run_task = [&](size_t i) {
+        MountTask &task = tasks[i];
+        bool deps_ok = true;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]{
+                for (size_t dep : task.deps) {
+                    if (!tasks[dep].done) {
+                        return false;
+                    }
+                }
+                return true;
+            });
+            for (size_t dep : task.deps) {
+                deps_ok = deps_ok && tasks[dep].success;
+            }
+        }
+
+        bool success = deps_ok && !abort && task.mount();
+        if (!success) {
+            LOGE("Failed to mount %s", task.mount_point);
+            abort = true;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task.done = true;
+            task.success = success;
+        }
+        cv.notify_all();
+    };
+
+    std::vector<std::thread> threads;
+
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        try {
+            threads.emplace_back(run_task, i);
+        } catch (const std::system_error &e) {
+            LOGW("%s: Failed to create mount thread: %s",
+                 tasks[i].mount_point, e.what());
+            // Parents are sorted first, so this cannot deadlock
+            run_task(i);
+        }
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    bool ret = true;
+    for (const MountTask &task : tasks) {
+        ret = ret && task.success;
+    }
+    return ret;
+}
+
 /*!
  * \brief Mount system, cache, and data entries from fstab
  *
@@ -888,38 +1124,34 @@ bool mount_fstab(const char *path, const std::shared_ptr<Rom> &rom,
         return false;
     }
 
-    bool ret = true;
+    std::vector<MountTask> tasks;
 
-    // Mount system
-    if (ret && !recs.system.empty()) {
-        if (create_dir_and_mount(recs.system, SYSTEM_MOUNT_POINT, 0755)) {
-            successful.push_back(SYSTEM_MOUNT_POINT);
-        } else {
-            LOGE("Failed to mount " SYSTEM_MOUNT_POINT);
-            ret = false;
-        }
+    if (!recs.system.empty()) {
+        tasks.emplace_back();
+        tasks.back().mount_point = SYSTEM_MOUNT_POINT;
+        tasks.back().mount = [&]{
+            return create_dir_and_mount(recs.system, SYSTEM_MOUNT_POINT, 0755);
+        };
     }
 
-    // Mount cache
-    if (ret && !recs.cache.empty()) {
-        if (create_dir_and_mount(recs.cache, CACHE_MOUNT_POINT, 0755)) {
-            successful.push_back(CACHE_MOUNT_POINT);
-        } else {
-            LOGE("Failed to mount " CACHE_MOUNT_POINT);
-            ret = false;
-        }
+    if (!recs.cache.empty()) {
+        tasks.emplace_back();
+        tasks.back().mount_point = CACHE_MOUNT_POINT;
+        tasks.back().mount = [&]{
+            return create_dir_and_mount(recs.cache, CACHE_MOUNT_POINT, 0755);
+        };
     }
 
-    // Mount data
-    if (ret && !recs.data.empty()) {
-        if (create_dir_and_mount(recs.data, DATA_MOUNT_POINT, 0755)) {
-            successful.push_back(DATA_MOUNT_POINT);
-        } else {
-            LOGE("Failed to mount " DATA_MOUNT_POINT);
-            ret = false;
-        }
+    if (!recs.data.empty()) {
+        tasks.emplace_back();
+        tasks.back().mount_point = DATA_MOUNT_POINT;
+        tasks.back().mount = [&]{
+            return create_dir_and_mount(recs.data, DATA_MOUNT_POINT, 0755);
+        };
     }
 
+    std::atomic_bool abort{false};
+
     // Mount external SD only if ROM is installed on the external SD. This is
     // necessary because mount_extsd_fstab_entries() blocks until an SD card is
     // found or a timeout occurs.
@@ -930,20 +1162,31 @@ bool mount_fstab(const char *path, const std::shared_ptr<Rom> &rom,
         LOGV("Skipping extsd mount because ROM is not an extsd-slot");
     }
 
-    if (ret && !recs.extsd.empty() && require_extsd) {
-        if (mount_extsd_fstab_entries(recs.extsd, EXTSD_MOUNT_POINT, 0755)) {
-            successful.push_back(EXTSD_MOUNT_POINT);
-        } else {
-            LOGE("Failed to mount " EXTSD_MOUNT_POINT);
-            ret = false;
+    if (!recs.extsd.empty() && require_extsd) {
+        tasks.emplace_back();
+        tasks.back().mount_point = EXTSD_MOUNT_POINT;
+        tasks.back().mount = [&]{
+            return mount_extsd_fstab_entries(recs.extsd, EXTSD_MOUNT_POINT,
+                                             0755, abort);
+        };
+    }
+
+    // The partitions are mounted concurrently since each mount may spend a
+    // while waiting for its block device or running fsck
+    bool ret = run_mount_tasks(tasks, abort);
+
+    for (const MountTask &task : tasks) {
+        if (task.success) {
+            successful.push_back(task.mount_point);
         }
     }
 
     if (ret) {
         LOGI("Successfully mounted partitions");
     } else if (flags & MOUNT_FLAG_UNMOUNT_ON_FAILURE) {
-        for (const std::string &mount_point : successful) {
-            util::umount(mount_point.c_str());
+        // Unmount children before their parents
+        for (auto it = successful.rbegin(); it != successful.rend(); ++it) {
+            util::umount(it->c_str());
         }
     }
 
@@ -979,10 +1222,32 @@ bool mount_rom(const std::shared_ptr<Rom> &rom)
         return false;
     }
 
-    if (!mount_target(target_system.c_str(), "/system", !rom->system_is_image)) {
+    bool system_is_overlay;
+    SystemOverlay overlay;
+    if (!get_system_overlay(rom, system_is_overlay, overlay)) {
         return false;
     }
 
+    if (system_is_overlay) {
+        LOGV("Mounting /system as overlay of %s", overlay.lower.c_str());
+
+        if (!mount_system_overlay(overlay, "/system")) {
+            return false;
+        }
+    } else {
+        bool compressed = false;
+        CompressedImageType type;
+        if (rom->system_is_image) {
+            get_compressed_image_type(target_system, compressed, type);
+        }
+
+        if (!mount_target(target_system.c_str(), "/system",
+                          !rom->system_is_image,
+                          compressed ? MS_RDONLY : 0)) {
+            return false;
+        }
+    }
+
     if (!mount_target(target_cache.c_str(), "/cache", !rom->cache_is_image)) {
         return false;
     }
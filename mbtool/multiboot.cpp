@@ -21,15 +21,16 @@
 
 #include <cerrno>
 #include <cstring>
+
+#include <pwd.h>
 #include <sys/stat.h>
 
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
-#include "mbutil/chmod.h"
-#include "mbutil/chown.h"
 #include "mbutil/copy.h"
 #include "mbutil/file.h"
 #include "mbutil/fts.h"
+#include "mbutil/metadata.h"
 #include "mbutil/selinux.h"
 #include "mbutil/string.h"
 
@@ -79,7 +80,8 @@ public:
         // _target is the correct parameter here (or pathbuf and
         // COPY_EXCLUDE_TOP_LEVEL flag)
         if (!util::copy_dir(_curr->fts_accpath, _target,
-                            util::COPY_ATTRIBUTES | util::COPY_XATTRS)) {
+                            util::COPY_ATTRIBUTES | util::COPY_XATTRS
+                            | util::COPY_PARALLEL)) {
             mb::format(_error_msg, "%s: Failed to copy directory: %s",
                        _curr->fts_path, strerror(errno));
             LOGW("%s", _error_msg.c_str());
@@ -172,22 +174,28 @@ bool fix_multiboot_permissions(void)
 {
     util::create_empty_file(MULTIBOOT_DIR "/.nomedia");
 
-    if (!util::chown(MULTIBOOT_DIR, "media_rw", "media_rw",
-                     util::CHOWN_RECURSIVE)) {
-        LOGE("Failed to chown %s", MULTIBOOT_DIR);
+    errno = 0;
+    struct passwd *pw = getpwnam("media_rw");
+    if (!pw) {
+        LOGE("Failed to look up media_rw user: %s",
+             errno ? strerror(errno) : "User does not exist");
         return false;
     }
 
-    if (!util::chmod(MULTIBOOT_DIR, 0775, util::CHMOD_RECURSIVE)) {
-        LOGE("Failed to chmod %s", MULTIBOOT_DIR);
-        return false;
+    util::MetadataRules rules;
+    rules.flags = util::METADATA_SET_OWNER | util::METADATA_SET_MODE;
+    rules.uid = pw->pw_uid;
+    rules.gid = pw->pw_gid;
+    rules.dir_mode = 0775;
+    rules.file_mode = 0775;
+
+    if (util::selinux_lget_context(INTERNAL_STORAGE, &rules.context)) {
+        rules.flags |= util::METADATA_SET_CONTEXT;
     }
 
-    std::string context;
-    if (util::selinux_lget_context(INTERNAL_STORAGE, &context)
-            && !util::selinux_lset_context_recursive(MULTIBOOT_DIR, context)) {
-        LOGE("%s: Failed to set context to %s: %s",
-             MULTIBOOT_DIR, context.c_str(), strerror(errno));
+    if (!util::apply_metadata_recursive(MULTIBOOT_DIR, rules)) {
+        LOGE("%s: Failed to fix permissions: %s",
+             MULTIBOOT_DIR, strerror(errno));
         return false;
     }
 
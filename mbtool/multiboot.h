@@ -53,6 +53,14 @@
 #define PROP_MULTIBOOT_VERSION          "ro.multiboot.version"
 #define PROP_MULTIBOOT_ROM_ID           "ro.multiboot.romid"
 
+// SELinux
+#define SEPOLICY_CACHE_DIR              "/raw/cache/multiboot/sepolicy"
+#define FILE_CONTEXTS_CACHE_DIR         "/raw/cache/multiboot/file_contexts"
+
+// Boot tracing
+#define BOOT_TRACE_DIR                  "/raw/cache/multiboot/logs"
+#define BOOT_TRACE_PATH                 BOOT_TRACE_DIR "/boot_trace.json"
+
 // Boot UI
 #define BOOT_UI_SKIP_PATH               "/raw/cache/multiboot/bootui/skip"
 #define BOOT_UI_ZIP_PATH                "/raw/cache/multiboot/bootui.zip"
@@ -0,0 +1,587 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "overlay.h"
+
+#include <map>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "mbcommon/string.h"
+#include "mblog/logging.h"
+#include "mbutil/copy.h"
+#include "mbutil/delete.h"
+#include "mbutil/directory.h"
+#include "mbutil/file.h"
+#include "mbutil/finally.h"
+#include "mbutil/fts.h"
+#include "mbutil/mount.h"
+#include "mbutil/path.h"
+
+#include "wipe.h"
+
+// Files next to an overlay slot's system directory
+#define SYSTEM_OVERLAY_LOWER_FILE       "system.lower"
+#define SYSTEM_OVERLAY_WORK_DIR         "system.work"
+
+#define OVERLAY_COMPARE_BUF_SIZE        (1024 * 1024)
+
+namespace mb
+{
+
+typedef std::map<std::string, std::vector<char>> XattrMap;
+
+static bool read_xattrs(const std::string &path, XattrMap &xattrs)
+{
+    xattrs.clear();
+
+    ssize_t size = llistxattr(path.c_str(), nullptr, 0);
+    if (size < 0) {
+        return errno == ENOTSUP;
+    } else if (size == 0) {
+        return true;
+    }
+
+    std::vector<char> names(static_cast<size_t>(size));
+    size = llistxattr(path.c_str(), names.data(), names.size());
+    if (size < 0) {
+        return false;
+    }
+
+    // xattr names are in a NULL-separated list
+    for (const char *name = names.data(); name < names.data() + size;
+            name += strlen(name) + 1) {
+        ssize_t value_size = lgetxattr(path.c_str(), name, nullptr, 0);
+        if (value_size < 0) {
+            return false;
+        }
+
+        std::vector<char> value(static_cast<size_t>(value_size));
+        value_size = lgetxattr(path.c_str(), name, value.data(), value.size());
+        if (value_size < 0) {
+            return false;
+        }
+        value.resize(static_cast<size_t>(value_size));
+
+        xattrs[name] = std::move(value);
+    }
+
+    return true;
+}
+
+static bool metadata_equal(const std::string &path1, const struct stat &sb1,
+                           const std::string &path2, const struct stat &sb2)
+{
+    if (sb1.st_mode != sb2.st_mode
+            || sb1.st_uid != sb2.st_uid
+            || sb1.st_gid != sb2.st_gid) {
+        return false;
+    }
+
+    XattrMap xattrs1;
+    XattrMap xattrs2;
+
+    return read_xattrs(path1, xattrs1)
+            && read_xattrs(path2, xattrs2)
+            && xattrs1 == xattrs2;
+}
+
+static bool contents_equal(const std::string &path1, const std::string &path2)
+{
+    int fd1 = open(path1.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd1 < 0) {
+        return false;
+    }
+
+    auto close_fd1 = util::finally([&] {
+        close(fd1);
+    });
+
+    int fd2 = open(path2.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd2 < 0) {
+        return false;
+    }
+
+    auto close_fd2 = util::finally([&] {
+        close(fd2);
+    });
+
+    std::vector<char> buf1(OVERLAY_COMPARE_BUF_SIZE);
+    std::vector<char> buf2(OVERLAY_COMPARE_BUF_SIZE);
+
+    while (true) {
+        ssize_t n1 = read(fd1, buf1.data(), buf1.size());
+        if (n1 < 0) {
+            return false;
+        } else if (n1 == 0) {
+            // Sizes were already compared
+            return true;
+        }
+
+        // Regular files on local filesystems never return short reads before
+        // EOF, but handle them anyway
+        size_t total = 0;
+        while (total < static_cast<size_t>(n1)) {
+            ssize_t n2 = read(fd2, buf2.data() + total,
+                              static_cast<size_t>(n1) - total);
+            if (n2 <= 0) {
+                return false;
+            }
+            total += static_cast<size_t>(n2);
+        }
+
+        if (memcmp(buf1.data(), buf2.data(), total) != 0) {
+            return false;
+        }
+    }
+}
+
+static bool entry_equal(const std::string &source, const struct stat &sb_source,
+                        const std::string &target, const struct stat &sb_target)
+{
+    if (!metadata_equal(source, sb_source, target, sb_target)) {
+        return false;
+    }
+
+    switch (sb_source.st_mode & S_IFMT) {
+    case S_IFREG:
+        return sb_source.st_size == sb_target.st_size
+                && contents_equal(source, target);
+    case S_IFLNK: {
+        std::string link_source;
+        std::string link_target;
+        return util::read_link(source, &link_source)
+                && util::read_link(target, &link_target)
+                && link_source == link_target;
+    }
+    case S_IFBLK:
+    case S_IFCHR:
+        return sb_source.st_rdev == sb_target.st_rdev;
+    default:
+        return true;
+    }
+}
+
+static bool remove_path(const std::string &path, const struct stat &sb)
+{
+    bool ret = S_ISDIR(sb.st_mode)
+            ? util::delete_recursive(path)
+            : unlink(path.c_str()) == 0 || errno == ENOENT;
+    if (!ret) {
+        LOGE("%s: Failed to remove: %s", path.c_str(), strerror(errno));
+    }
+    return ret;
+}
+
+/*!
+ * Make a directory tree identical to another one, only writing the entries that
+ * differ. Like copy_system(), the top-level `multiboot` directory is skipped.
+ */
+class OverlaySyncer : public util::FTSWrapper {
+public:
+    OverlaySyncer(std::string path, std::string target)
+        : FTSWrapper(path, FTS_GroupSpecialFiles),
+        _target(std::move(target)),
+        _copied(0),
+        _unchanged(0)
+    {
+    }
+
+    int on_changed_path() override
+    {
+        if (_curr->fts_level == 0) {
+            _curtgtpath = _target;
+            return Action::FTS_OK;
+        }
+
+        if (_curr->fts_level == 1
+                && strcmp(_curr->fts_name, "multiboot") == 0) {
+            return Action::FTS_Skip;
+        }
+
+        // fts_path is always _path + '/' + relative path
+        _curtgtpath = _target;
+        _curtgtpath += _curr->fts_path + _root->fts_pathlen;
+
+        return Action::FTS_OK;
+    }
+
+    int on_reached_directory_pre() override
+    {
+        struct stat sb;
+        bool exists = lstat(_curtgtpath.c_str(), &sb) == 0;
+
+        if (exists && !S_ISDIR(sb.st_mode)) {
+            if (!remove_path(_curtgtpath, sb)) {
+                return Action::FTS_Fail | Action::FTS_Stop;
+            }
+            exists = false;
+        }
+
+        if (!exists && mkdir(_curtgtpath.c_str(), 0700) < 0) {
+            LOGE("%s: Failed to create directory: %s",
+                 _curtgtpath.c_str(), strerror(errno));
+            return Action::FTS_Fail | Action::FTS_Stop;
+        }
+
+        if (exists && metadata_equal(_curr->fts_accpath, *_curr->fts_statp,
+                                     _curtgtpath, sb)) {
+            return Action::FTS_OK;
+        }
+
+        // Only copies up the directory itself, not its children
+        if (!util::copy_stat(_curr->fts_accpath, _curtgtpath)
+                || !util::copy_xattrs(_curr->fts_accpath, _curtgtpath)) {
+            return Action::FTS_Fail | Action::FTS_Stop;
+        }
+
+        return Action::FTS_OK;
+    }
+
+    int on_reached_file() override
+    {
+        return sync_path();
+    }
+
+    int on_reached_symlink() override
+    {
+        return sync_path();
+    }
+
+    int on_reached_special_file() override
+    {
+        // copy_file() can't copy sockets
+        if (S_ISSOCK(_curr->fts_statp->st_mode)) {
+            return Action::FTS_OK;
+        }
+        return sync_path();
+    }
+
+    uint64_t copied() const
+    {
+        return _copied;
+    }
+
+    uint64_t unchanged() const
+    {
+        return _unchanged;
+    }
+
+private:
+    std::string _target;
+    std::string _curtgtpath;
+    uint64_t _copied;
+    uint64_t _unchanged;
+
+    int sync_path()
+    {
+        struct stat sb;
+
+        if (lstat(_curtgtpath.c_str(), &sb) == 0) {
+            if (entry_equal(_curr->fts_accpath, *_curr->fts_statp,
+                            _curtgtpath, sb)) {
+                ++_unchanged;
+                return Action::FTS_OK;
+            } else if (S_ISDIR(sb.st_mode)
+                    && !remove_path(_curtgtpath, sb)) {
+                return Action::FTS_Fail | Action::FTS_Stop;
+            }
+        }
+
+        if (!util::copy_file(_curr->fts_accpath, _curtgtpath,
+                             util::COPY_ATTRIBUTES | util::COPY_XATTRS)) {
+            LOGE("%s: Failed to copy to %s: %s", _curr->fts_path,
+                 _curtgtpath.c_str(), strerror(errno));
+            return Action::FTS_Fail | Action::FTS_Stop;
+        }
+
+        ++_copied;
+        return Action::FTS_OK;
+    }
+};
+
+/*!
+ * Remove entries from a directory tree that don't exist in another one.
+ */
+class OverlayPruner : public util::FTSWrapper {
+public:
+    OverlayPruner(std::string path, std::string source)
+        : FTSWrapper(path, FTS_GroupSpecialFiles),
+        _source(std::move(source))
+    {
+    }
+
+    int on_changed_path() override
+    {
+        // Only act once per directory
+        if (_curr->fts_level == 0 || _curr->fts_info == FTS_DP) {
+            return Action::FTS_Next;
+        }
+
+        if (_curr->fts_level == 1
+                && strcmp(_curr->fts_name, "multiboot") == 0) {
+            return Action::FTS_Skip;
+        }
+
+        std::string source(_source);
+        source += _curr->fts_path + _root->fts_pathlen;
+
+        struct stat sb;
+        if (lstat(source.c_str(), &sb) == 0) {
+            return Action::FTS_Next;
+        } else if (errno != ENOENT) {
+            LOGE("%s: Failed to stat: %s", source.c_str(), strerror(errno));
+            return Action::FTS_Fail | Action::FTS_Stop;
+        }
+
+        if (!remove_path(_curr->fts_accpath, *_curr->fts_statp)) {
+            return Action::FTS_Fail | Action::FTS_Stop;
+        }
+
+        return Action::FTS_Skip;
+    }
+
+private:
+    std::string _source;
+};
+
+/*!
+ * \brief Get the overlayfs layers of a ROM's /system
+ *
+ * \param[in] rom ROM
+ * \param[out] enabled Whether \a rom is an overlay slot
+ * \param[out] overlay Layers if \a rom is an overlay slot
+ *
+ * \return False if \a rom is an overlay slot, but the lower ROM is invalid.
+ *         Otherwise, true
+ */
+bool get_system_overlay(const std::shared_ptr<Rom> &rom, bool &enabled,
+                        SystemOverlay &overlay)
+{
+    enabled = false;
+
+    if (rom->id == "primary" || rom->system_is_image) {
+        return true;
+    }
+
+    std::string upper = rom->full_system_path();
+    if (upper.empty()) {
+        return true;
+    }
+
+    std::string slot_dir = util::dir_name(upper);
+    std::string lower_file(slot_dir);
+    lower_file += "/" SYSTEM_OVERLAY_LOWER_FILE;
+
+    if (access(lower_file.c_str(), F_OK) < 0) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        LOGE("%s: Failed to access: %s", lower_file.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::string lower_id;
+    if (!util::file_first_line(lower_file, &lower_id)) {
+        LOGE("%s: Failed to read file: %s",
+             lower_file.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto lower_rom = Roms::create_rom(lower_id);
+    if (!lower_rom || lower_rom->id == rom->id) {
+        LOGE("%s: Invalid lower ROM ID: '%s'",
+             lower_file.c_str(), lower_id.c_str());
+        return false;
+    }
+
+    // Overlays are not stacked and images would have to be mounted first
+    bool lower_is_overlay;
+    SystemOverlay lower_overlay;
+    if (lower_rom->system_is_image
+            || !get_system_overlay(lower_rom, lower_is_overlay, lower_overlay)
+            || lower_is_overlay) {
+        LOGE("%s: Lower ROM %s must have a plain system directory",
+             lower_file.c_str(), lower_id.c_str());
+        return false;
+    }
+
+    overlay.lower = lower_rom->full_system_path();
+    overlay.upper = std::move(upper);
+    overlay.work = slot_dir;
+    overlay.work += "/" SYSTEM_OVERLAY_WORK_DIR;
+
+    if (overlay.lower.empty()) {
+        LOGE("Could not determine system path of lower ROM %s",
+             lower_id.c_str());
+        return false;
+    }
+
+    enabled = true;
+    return true;
+}
+
+/*!
+ * \brief Turn a ROM into an overlay slot
+ *
+ * The existing contents of the ROM's system directory become the upper layer.
+ * They should be wiped if they are not meant to be changes to the lower ROM.
+ */
+bool set_system_overlay(const std::shared_ptr<Rom> &rom,
+                        const std::string &lower_id)
+{
+    std::string upper = rom->full_system_path();
+    if (rom->id == "primary" || rom->system_is_image || upper.empty()) {
+        LOGE("%s: ROM cannot be an overlay slot", rom->id.c_str());
+        return false;
+    }
+
+    std::string lower_file = util::dir_name(upper);
+    lower_file += "/" SYSTEM_OVERLAY_LOWER_FILE;
+
+    std::string data(lower_id);
+    data += '\n';
+
+    if (!util::mkdir_parent(lower_file, 0755)
+            || !util::file_write_data(lower_file, data.data(), data.size())) {
+        LOGE("%s: Failed to write file: %s",
+             lower_file.c_str(), strerror(errno));
+        return false;
+    }
+
+    bool enabled;
+    SystemOverlay overlay;
+    if (!get_system_overlay(rom, enabled, overlay)) {
+        unlink(lower_file.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Mount overlayfs for a ROM's /system at \a target
+ */
+bool mount_system_overlay(const SystemOverlay &overlay,
+                          const std::string &target)
+{
+    // overlayfs uses commas and colons as separators in its options
+    for (auto const *path : { &overlay.lower, &overlay.upper, &overlay.work }) {
+        if (path->find_first_of(",:") != std::string::npos) {
+            LOGE("%s: Path cannot be used as an overlayfs layer",
+                 path->c_str());
+            return false;
+        }
+    }
+
+    // Same as mount_target() in mount_fstab.cpp
+    struct stat sb;
+    if (lstat(target.c_str(), &sb) == 0 && S_ISLNK(sb.st_mode)) {
+        unlink(target.c_str());
+    }
+
+    for (auto const *path : { &overlay.upper, &overlay.work, &target }) {
+        if (!util::mkdir_recursive(*path, 0755) && errno != EEXIST) {
+            LOGE("%s: Failed to create directory: %s",
+                 path->c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    std::string options = format("lowerdir=%s,upperdir=%s,workdir=%s",
+                                 overlay.lower.c_str(), overlay.upper.c_str(),
+                                 overlay.work.c_str());
+
+    if (!util::mount("overlay", target.c_str(), "overlay", 0,
+                     options.c_str())) {
+        LOGE("%s: Failed to mount overlayfs (%s): %s",
+             target.c_str(), options.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Discard all changes to the lower layer
+ *
+ * The overlay must not be mounted.
+ */
+bool reset_system_overlay(const SystemOverlay &overlay)
+{
+    // Like copy_system(), the top-level multiboot directory is left alone
+    if (!wipe_directory(overlay.upper, { "multiboot" })) {
+        LOGE("%s: Failed to wipe directory", overlay.upper.c_str());
+        return false;
+    }
+
+    // The work directory must be empty when the overlay is mounted
+    if (!util::delete_recursive(overlay.work)) {
+        LOGE("%s: Failed to remove directory: %s",
+             overlay.work.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Make a mounted overlay identical to a directory tree
+ *
+ * Entries that are identical in \a source and \a target (including metadata
+ * and xattrs) are left alone, so files that came from the lower layer are not
+ * copied up. Entries that are not in \a source are removed, which creates
+ * whiteouts in the upper layer. Like copy_system(), the top-level `multiboot`
+ * directory is skipped.
+ *
+ * \param source Source directory
+ * \param target Mount point of the overlay
+ */
+bool sync_to_overlay(const std::string &source, const std::string &target)
+{
+    OverlayPruner pruner(target, source);
+    if (!pruner.run()) {
+        LOGE("%s: Failed to remove stale entries: %s",
+             target.c_str(), pruner.error().c_str());
+        return false;
+    }
+
+    OverlaySyncer syncer(source, target);
+    if (!syncer.run()) {
+        LOGE("%s: Failed to sync from %s: %s", target.c_str(),
+             source.c_str(), syncer.error().c_str());
+        return false;
+    }
+
+    LOGI("%s: %" PRIu64 " entries written, %" PRIu64 " unchanged",
+         target.c_str(), syncer.copied(), syncer.unchanged());
+
+    return true;
+}
+
+}
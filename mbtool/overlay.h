@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "roms.h"
+
+namespace mb
+{
+
+/*!
+ * Overlay slots mount /system as an overlayfs. The system directory of another
+ * ROM is the read-only lower layer and the slot's own system directory only
+ * holds the files that differ from it.
+ *
+ * A slot becomes an overlay slot when `system.lower`, containing the ID of the
+ * lower ROM, exists next to its system directory.
+ */
+struct SystemOverlay
+{
+    std::string lower;
+    std::string upper;
+    std::string work;
+};
+
+bool get_system_overlay(const std::shared_ptr<Rom> &rom, bool &enabled,
+                        SystemOverlay &overlay);
+bool set_system_overlay(const std::shared_ptr<Rom> &rom,
+                        const std::string &lower_id);
+
+bool mount_system_overlay(const SystemOverlay &overlay,
+                          const std::string &target);
+bool reset_system_overlay(const SystemOverlay &overlay);
+bool sync_to_overlay(const std::string &source, const std::string &target);
+
+}
@@ -20,12 +20,18 @@
 #include "packages.h"
 
 #include <algorithm>
+#include <mutex>
 
 #include <cassert>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
 
+#include <sys/stat.h>
+
 #include <pugixml.hpp>
 
 #include "mblog/logging.h"
@@ -330,10 +336,479 @@ void Package::dump()
         LOGD(fmt_string, "Installer:", installer.c_str());
 }
 
+static void set_package_attr(Package *pkg, const char *name, const char *value)
+{
+    if (strcmp(name, ATTR_CODE_PATH) == 0) {
+        pkg->code_path = value;
+    } else if (strcmp(name, ATTR_CPU_ABI_OVERRIDE) == 0) {
+        pkg->cpu_abi_override = value;
+    } else if (strcmp(name, ATTR_FLAGS) == 0) {
+        pkg->pkg_flags = static_cast<Package::Flags>(
+                strtoll(value, nullptr, 10));
+    } else if (strcmp(name, ATTR_PUBLIC_FLAGS) == 0) {
+        pkg->pkg_public_flags = static_cast<Package::PublicFlags>(
+                strtoll(value, nullptr, 10));
+    } else if (strcmp(name, ATTR_PRIVATE_FLAGS) == 0) {
+        pkg->pkg_private_flags = static_cast<Package::PrivateFlags>(
+                strtoll(value, nullptr, 10));
+    } else if (strcmp(name, ATTR_FT) == 0) {
+        pkg->timestamp = strtoull(value, nullptr, 16);
+    } else if (strcmp(name, ATTR_INSTALL_STATUS) == 0) {
+        pkg->install_status = value;
+    } else if (strcmp(name, ATTR_INSTALLER) == 0) {
+        pkg->installer = value;
+    } else if (strcmp(name, ATTR_IT) == 0) {
+        pkg->first_install_time = strtoull(value, nullptr, 16);
+    } else if (strcmp(name, ATTR_NAME) == 0) {
+        pkg->name = value;
+    } else if (strcmp(name, ATTR_NATIVE_LIBRARY_PATH) == 0) {
+        pkg->native_library_path = value;
+    } else if (strcmp(name, ATTR_PRIMARY_CPU_ABI) == 0) {
+        pkg->primary_cpu_abi = value;
+    } else if (strcmp(name, ATTR_REAL_NAME) == 0) {
+        pkg->real_name = value;
+    } else if (strcmp(name, ATTR_RESOURCE_PATH) == 0) {
+        pkg->resource_path = value;
+    } else if (strcmp(name, ATTR_SECONDARY_CPU_ABI) == 0) {
+        pkg->secondary_cpu_abi = value;
+    } else if (strcmp(name, ATTR_SHARED_USER_ID) == 0) {
+        pkg->shared_user_id = strtol(value, nullptr, 10);
+        pkg->is_shared_user = 1;
+    } else if (strcmp(name, ATTR_UID_ERROR) == 0) {
+        pkg->uid_error = value;
+    } else if (strcmp(name, ATTR_USER_ID) == 0) {
+        pkg->user_id = strtol(value, nullptr, 10);
+        pkg->is_shared_user = 0;
+    } else if (strcmp(name, ATTR_UT) == 0) {
+        pkg->last_update_time = strtoull(value, nullptr, 16);
+    } else if (strcmp(name, ATTR_VERSION) == 0) {
+        pkg->version = strtol(value, nullptr, 10);
+    } else if (strcmp(name, ATTR_SAMSUNG_DM) == 0
+            || strcmp(name, ATTR_SAMSUNG_DT) == 0
+            || strcmp(name, ATTR_SAMSUNG_NATIVE_LIBRARY_DIR) == 0
+            || strcmp(name, ATTR_SAMSUNG_NATIVE_LIBRARY_ROOT_DIR) == 0
+            || strcmp(name, ATTR_SAMSUNG_NATIVE_LIBRARY_ROOT_REQUIRES_ISA) == 0
+            || strcmp(name, ATTR_SAMSUNG_SECONDARY_NATIVE_LIBRARY_DIR) == 0) {
+        // Ignore Samsung-specific attributes
+    } else {
+        LOGW("Unrecognized attribute '%s' in <%s>", name, TAG_PACKAGE);
+    }
+}
+
+static bool add_package_cert(Packages *pkgs, Package *pkg, std::string index,
+                             std::string key)
+{
+    if (index.empty()) {
+        LOGW("Missing or empty index in <%s>", TAG_CERT);
+    } else {
+        pkg->sig_indexes.push_back(index);
+    }
+    if (!index.empty() && !key.empty()) {
+        auto it = pkgs->sigs.find(index);
+        if (it != pkgs->sigs.end()) {
+            // Make sure key matches if it's already in the map
+            if (it->second != key) {
+                LOGE("Error: Index \"%s\" assigned to multiple keys",
+                     index.c_str());
+                return false;
+            }
+        } else {
+            // Otherwise, add it to the map
+            pkgs->sigs.insert(std::make_pair(std::move(index), std::move(key)));
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Android's binary XML (ABX) format, used for packages.xml since Android 12.
+ * See frameworks/base/core/java/com/android/internal/util/BinaryXmlSerializer.java
+ *
+ * The file is a stream of events. The low nibble of each event byte is the
+ * token and the high nibble is the type of the data that follows. Tag and
+ * attribute names are interned: the first occurrence is written inline and
+ * later ones refer back to it by index.
+ */
+
+static const char ABX_MAGIC[4] = { 'A', 'B', 'X', '\0' };
+
+enum AbxToken : uint8_t
+{
+    ABX_START_DOCUMENT         = 0,
+    ABX_END_DOCUMENT           = 1,
+    ABX_START_TAG              = 2,
+    ABX_END_TAG                = 3,
+    ABX_TEXT                   = 4,
+    ABX_CDSECT                 = 5,
+    ABX_ENTITY_REF             = 6,
+    ABX_IGNORABLE_WHITESPACE   = 7,
+    ABX_PROCESSING_INSTRUCTION = 8,
+    ABX_COMMENT                = 9,
+    ABX_DOCDECL                = 10,
+    ABX_ATTRIBUTE              = 15,
+};
+
+enum AbxType : uint8_t
+{
+    ABX_TYPE_NULL              = 1 << 4,
+    ABX_TYPE_STRING            = 2 << 4,
+    ABX_TYPE_STRING_INTERNED   = 3 << 4,
+    ABX_TYPE_BYTES_HEX         = 4 << 4,
+    ABX_TYPE_BYTES_BASE64      = 5 << 4,
+    ABX_TYPE_INT               = 6 << 4,
+    ABX_TYPE_INT_HEX           = 7 << 4,
+    ABX_TYPE_LONG              = 8 << 4,
+    ABX_TYPE_LONG_HEX          = 9 << 4,
+    ABX_TYPE_FLOAT             = 10 << 4,
+    ABX_TYPE_DOUBLE            = 11 << 4,
+    ABX_TYPE_BOOLEAN_TRUE      = 12 << 4,
+    ABX_TYPE_BOOLEAN_FALSE     = 13 << 4,
+};
+
+#define ABX_INTERNED_NEW        0xffff
+
+class AbxReader
+{
+public:
+    explicit AbxReader(FILE *fp) : _fp(fp)
+    {
+    }
+
+    bool eof() const
+    {
+        return feof(_fp);
+    }
+
+    bool read_u8(uint8_t &out)
+    {
+        return fread(&out, 1, 1, _fp) == 1;
+    }
+
+    // All integers are big endian
+    bool read_be(uint64_t &out, size_t size)
+    {
+        unsigned char buf[8];
+        if (size > sizeof(buf) || fread(buf, size, 1, _fp) != 1) {
+            return false;
+        }
+        out = 0;
+        for (size_t i = 0; i < size; ++i) {
+            out = (out << 8) | buf[i];
+        }
+        return true;
+    }
+
+    bool read_bytes(std::string &out)
+    {
+        uint64_t size;
+        if (!read_be(size, 2)) {
+            return false;
+        }
+        out.resize(size);
+        return size == 0 || fread(&out[0], size, 1, _fp) == 1;
+    }
+
+    bool read_interned(size_t &index)
+    {
+        uint64_t value;
+        if (!read_be(value, 2)) {
+            return false;
+        }
+        if (value == ABX_INTERNED_NEW) {
+            _interned.emplace_back();
+            if (!read_bytes(_interned.back())) {
+                return false;
+            }
+            index = _interned.size() - 1;
+        } else if (value < _interned.size()) {
+            index = value;
+        } else {
+            LOGE("Invalid interned string index: %" PRIu64, value);
+            return false;
+        }
+        return true;
+    }
+
+    const std::string & interned(size_t index) const
+    {
+        return _interned[index];
+    }
+
+    /*!
+     * \brief Read a typed value and convert it to its textual XML form
+     */
+    bool read_value(uint8_t type, std::string &out)
+    {
+        static const char hex[] = "0123456789abcdef";
+        uint64_t value;
+        size_t index;
+        char buf[32];
+
+        switch (type) {
+        case ABX_TYPE_NULL:
+            out.clear();
+            return true;
+        case ABX_TYPE_STRING:
+            return read_bytes(out);
+        case ABX_TYPE_STRING_INTERNED:
+            if (!read_interned(index)) {
+                return false;
+            }
+            out = _interned[index];
+            return true;
+        case ABX_TYPE_BYTES_HEX:
+        case ABX_TYPE_BYTES_BASE64: {
+            std::string data;
+            if (!read_bytes(data)) {
+                return false;
+            }
+            out.clear();
+            if (type == ABX_TYPE_BYTES_HEX) {
+                for (unsigned char c : data) {
+                    out += hex[c >> 4];
+                    out += hex[c & 0xf];
+                }
+            } else {
+                encode_base64(data, out);
+            }
+            return true;
+        }
+        case ABX_TYPE_INT:
+            if (!read_be(value, 4)) {
+                return false;
+            }
+            snprintf(buf, sizeof(buf), "%" PRId32,
+                     static_cast<int32_t>(value));
+            break;
+        case ABX_TYPE_INT_HEX:
+            if (!read_be(value, 4)) {
+                return false;
+            }
+            snprintf(buf, sizeof(buf), "%" PRIx32,
+                     static_cast<uint32_t>(value));
+            break;
+        case ABX_TYPE_LONG:
+            if (!read_be(value, 8)) {
+                return false;
+            }
+            snprintf(buf, sizeof(buf), "%" PRId64,
+                     static_cast<int64_t>(value));
+            break;
+        case ABX_TYPE_LONG_HEX:
+            if (!read_be(value, 8)) {
+                return false;
+            }
+            snprintf(buf, sizeof(buf), "%" PRIx64, value);
+            break;
+        case ABX_TYPE_FLOAT: {
+            if (!read_be(value, 4)) {
+                return false;
+            }
+            uint32_t bits = static_cast<uint32_t>(value);
+            float f;
+            memcpy(&f, &bits, sizeof(f));
+            snprintf(buf, sizeof(buf), "%g", f);
+            break;
+        }
+        case ABX_TYPE_DOUBLE: {
+            if (!read_be(value, 8)) {
+                return false;
+            }
+            double d;
+            memcpy(&d, &value, sizeof(d));
+            snprintf(buf, sizeof(buf), "%g", d);
+            break;
+        }
+        case ABX_TYPE_BOOLEAN_TRUE:
+            out = "true";
+            return true;
+        case ABX_TYPE_BOOLEAN_FALSE:
+            out = "false";
+            return true;
+        default:
+            LOGE("Invalid binary XML value type: 0x%02x", type);
+            return false;
+        }
+
+        out = buf;
+        return true;
+    }
+
+private:
+    FILE *_fp;
+    std::vector<std::string> _interned;
+
+    static void encode_base64(const std::string &in, std::string &out)
+    {
+        static const char table[] =
+                "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+        size_t i = 0;
+        for (; i + 2 < in.size(); i += 3) {
+            uint32_t n = (static_cast<unsigned char>(in[i]) << 16)
+                    | (static_cast<unsigned char>(in[i + 1]) << 8)
+                    | static_cast<unsigned char>(in[i + 2]);
+            out += table[(n >> 18) & 0x3f];
+            out += table[(n >> 12) & 0x3f];
+            out += table[(n >> 6) & 0x3f];
+            out += table[n & 0x3f];
+        }
+        if (i < in.size()) {
+            uint32_t n = static_cast<unsigned char>(in[i]) << 16;
+            if (i + 1 < in.size()) {
+                n |= static_cast<unsigned char>(in[i + 1]) << 8;
+            }
+            out += table[(n >> 18) & 0x3f];
+            out += table[(n >> 12) & 0x3f];
+            out += i + 1 < in.size() ? table[(n >> 6) & 0x3f] : '=';
+            out += '=';
+        }
+    }
+};
+
+/*
+ * Stream the events in an ABX packages.xml. Only <package> elements directly
+ * below the root <packages> element and their <sigs>/<cert> children are
+ * looked at. Everything else is skipped as it is read.
+ */
+static bool read_abx(FILE *fp, Packages *pkgs)
+{
+    AbxReader reader(fp);
+    // Interned indexes of the currently open tags
+    std::vector<size_t> stack;
+    std::shared_ptr<Package> pkg;
+    std::string cert_index;
+    std::string cert_key;
+    std::string value;
+
+    auto tag_is = [&](size_t depth, const char *name) {
+        return reader.interned(stack[depth]) == name;
+    };
+    auto in_cert = [&]{
+        return pkg && stack.size() == 4
+                && tag_is(2, TAG_SIGS) && tag_is(3, TAG_CERT);
+    };
+
+    while (true) {
+        uint8_t event;
+        if (!reader.read_u8(event)) {
+            if (reader.eof() && stack.empty()) {
+                return true;
+            }
+            LOGE("Unexpected end of binary XML file");
+            return false;
+        }
+
+        uint8_t token = event & 0x0f;
+        uint8_t type = event & 0xf0;
+        size_t name;
+
+        switch (token) {
+        case ABX_START_DOCUMENT:
+            break;
+        case ABX_END_DOCUMENT:
+            return stack.empty();
+        case ABX_START_TAG:
+            if (!reader.read_interned(name)) {
+                return false;
+            }
+            stack.push_back(name);
+            if (stack.size() == 2 && tag_is(0, TAG_PACKAGES)
+                    && tag_is(1, TAG_PACKAGE)) {
+                pkg = std::make_shared<Package>();
+            } else if (in_cert()) {
+                cert_index.clear();
+                cert_key.clear();
+            }
+            break;
+        case ABX_END_TAG:
+            if (!reader.read_interned(name)) {
+                return false;
+            }
+            if (stack.empty() || stack.back() != name) {
+                LOGE("Mismatched end tag: %s", reader.interned(name).c_str());
+                return false;
+            }
+            if (in_cert()) {
+                if (!add_package_cert(pkgs, pkg.get(), std::move(cert_index),
+                                      std::move(cert_key))) {
+                    return false;
+                }
+            } else if (pkg && stack.size() == 2) {
+                pkgs->pkgs.push_back(std::move(pkg));
+                pkg.reset();
+            }
+            stack.pop_back();
+            break;
+        case ABX_ATTRIBUTE:
+            if (!reader.read_interned(name) || !reader.read_value(type, value)) {
+                return false;
+            }
+            if (pkg && stack.size() == 2) {
+                set_package_attr(pkg.get(), reader.interned(name).c_str(),
+                                 value.c_str());
+            } else if (in_cert()) {
+                const std::string &attr = reader.interned(name);
+                if (attr == ATTR_INDEX) {
+                    cert_index = value;
+                } else if (attr == ATTR_KEY) {
+                    cert_key = value;
+                } else {
+                    LOGW("Unrecognized attribute '%s' in <%s>",
+                         attr.c_str(), TAG_CERT);
+                }
+            }
+            break;
+        case ABX_TEXT:
+        case ABX_CDSECT:
+        case ABX_ENTITY_REF:
+        case ABX_IGNORABLE_WHITESPACE:
+        case ABX_PROCESSING_INSTRUCTION:
+        case ABX_COMMENT:
+        case ABX_DOCDECL:
+            if (!reader.read_value(type, value)) {
+                return false;
+            }
+            break;
+        default:
+            LOGE("Invalid binary XML token: 0x%02x", token);
+            return false;
+        }
+    }
+}
+
 bool Packages::load_xml(const std::string &path)
 {
     pkgs.clear();
     sigs.clear();
+    _by_name.clear();
+    _by_uid.clear();
+
+    // Android 12+ may store packages.xml in the binary ABX format, which is
+    // read as a stream of events instead of being loaded into a DOM
+    FILE *fp = fopen(path.c_str(), "rbe");
+    if (!fp) {
+        LOGE("%s: Failed to open file: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    char magic[sizeof(ABX_MAGIC)];
+    bool is_abx = fread(magic, sizeof(magic), 1, fp) == 1
+            && memcmp(magic, ABX_MAGIC, sizeof(magic)) == 0;
+
+    if (is_abx) {
+        bool ret = read_abx(fp, this);
+        fclose(fp);
+        if (!ret) {
+            LOGE("Failed to parse binary XML file: %s", path.c_str());
+            return false;
+        }
+        build_indexes();
+        return true;
+    }
+
+    fclose(fp);
 
     pugi::xml_document doc;
     pugi::xml_parse_result result = doc.load_file(path.c_str());
@@ -359,9 +834,73 @@ bool Packages::load_xml(const std::string &path)
         }
     }
 
+    build_indexes();
+
     return true;
 }
 
+struct CachedPackages
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    std::shared_ptr<const Packages> pkgs;
+};
+
+static std::mutex cache_lock;
+static std::unordered_map<std::string, CachedPackages> cache;
+
+/*!
+ * \brief Load packages.xml, reusing the previous result if it did not change
+ *
+ * The file is only reparsed if its inode, size, or modification time differ
+ * from when it was last loaded. The returned snapshot is immutable and may be
+ * shared between threads.
+ *
+ * \return Loaded packages or nullptr if the file could not be parsed
+ */
+std::shared_ptr<const Packages> Packages::load_cached(const std::string &path)
+{
+    struct stat sb;
+    if (stat(path.c_str(), &sb) < 0) {
+        LOGE("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+        return {};
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(cache_lock);
+
+        auto it = cache.find(path);
+        if (it != cache.end()
+                && it->second.dev == sb.st_dev
+                && it->second.ino == sb.st_ino
+                && it->second.size == sb.st_size
+                && it->second.mtime.tv_sec == sb.st_mtim.tv_sec
+                && it->second.mtime.tv_nsec == sb.st_mtim.tv_nsec) {
+            return it->second.pkgs;
+        }
+    }
+
+    // Parse without holding the lock. If multiple threads race here, the last
+    // one wins, which is harmless.
+    std::shared_ptr<Packages> pkgs = std::make_shared<Packages>();
+    if (!pkgs->load_xml(path)) {
+        return {};
+    }
+
+    std::lock_guard<std::mutex> lock(cache_lock);
+
+    CachedPackages &entry = cache[path];
+    entry.dev = sb.st_dev;
+    entry.ino = sb.st_ino;
+    entry.size = sb.st_size;
+    entry.mtime = sb.st_mtim;
+    entry.pkgs = std::move(pkgs);
+
+    return entry.pkgs;
+}
+
 static bool parse_tag_cert(pugi::xml_node node, Packages *pkgs,
                            std::shared_ptr<Package> pkg)
 {
@@ -383,27 +922,7 @@ static bool parse_tag_cert(pugi::xml_node node, Packages *pkgs,
         }
     }
 
-    if (index.empty()) {
-        LOGW("Missing or empty index in <%s>", TAG_CERT);
-    } else {
-        pkg->sig_indexes.push_back(index);
-    }
-    if (!index.empty() && !key.empty()) {
-        auto it = pkgs->sigs.find(index);
-        if (it != pkgs->sigs.end()) {
-            // Make sure key matches if it's already in the map
-            if (it->second != key) {
-                LOGE("Error: Index \"%s\" assigned to multiple keys",
-                     index.c_str());
-                return false;
-            }
-        } else {
-            // Otherwise, add it to the map
-            pkgs->sigs.insert(std::make_pair(std::move(index), std::move(key)));
-        }
-    }
-
-    return true;
+    return add_package_cert(pkgs, pkg.get(), std::move(index), std::move(key));
 }
 
 static bool parse_tag_sigs(pugi::xml_node node, Packages *pkgs,
@@ -437,64 +956,7 @@ static bool parse_tag_package(pugi::xml_node node, Packages *pkgs)
     std::shared_ptr<Package> pkg(new Package());
 
     for (pugi::xml_attribute attr : node.attributes()) {
-        const pugi::char_t *name = attr.name();
-        const pugi::char_t *value = attr.value();
-
-        if (strcmp(name, ATTR_CODE_PATH) == 0) {
-            pkg->code_path = value;
-        } else if (strcmp(name, ATTR_CPU_ABI_OVERRIDE) == 0) {
-            pkg->cpu_abi_override = value;
-        } else if (strcmp(name, ATTR_FLAGS) == 0) {
-            pkg->pkg_flags = static_cast<Package::Flags>(
-                    strtoll(value, nullptr, 10));
-        } else if (strcmp(name, ATTR_PUBLIC_FLAGS) == 0) {
-            pkg->pkg_public_flags = static_cast<Package::PublicFlags>(
-                    strtoll(value, nullptr, 10));
-        } else if (strcmp(name, ATTR_PRIVATE_FLAGS) == 0) {
-            pkg->pkg_private_flags = static_cast<Package::PrivateFlags>(
-                    strtoll(value, nullptr, 10));
-        } else if (strcmp(name, ATTR_FT) == 0) {
-            pkg->timestamp = strtoull(value, nullptr, 16);
-        } else if (strcmp(name, ATTR_INSTALL_STATUS) == 0) {
-            pkg->install_status = value;
-        } else if (strcmp(name, ATTR_INSTALLER) == 0) {
-            pkg->installer = value;
-        } else if (strcmp(name, ATTR_IT) == 0) {
-            pkg->first_install_time = strtoull(value, nullptr, 16);
-        } else if (strcmp(name, ATTR_NAME) == 0) {
-            pkg->name = value;
-        } else if (strcmp(name, ATTR_NATIVE_LIBRARY_PATH) == 0) {
-            pkg->native_library_path = value;
-        } else if (strcmp(name, ATTR_PRIMARY_CPU_ABI) == 0) {
-            pkg->primary_cpu_abi = value;
-        } else if (strcmp(name, ATTR_REAL_NAME) == 0) {
-            pkg->real_name = value;
-        } else if (strcmp(name, ATTR_RESOURCE_PATH) == 0) {
-            pkg->resource_path = value;
-        } else if (strcmp(name, ATTR_SECONDARY_CPU_ABI) == 0) {
-            pkg->secondary_cpu_abi = value;
-        } else if (strcmp(name, ATTR_SHARED_USER_ID) == 0) {
-            pkg->shared_user_id = strtol(value, nullptr, 10);
-            pkg->is_shared_user = 1;
-        } else if (strcmp(name, ATTR_UID_ERROR) == 0) {
-            pkg->uid_error = value;
-        } else if (strcmp(name, ATTR_USER_ID) == 0) {
-            pkg->user_id = strtol(value, nullptr, 10);
-            pkg->is_shared_user = 0;
-        } else if (strcmp(name, ATTR_UT) == 0) {
-            pkg->last_update_time = strtoull(value, nullptr, 16);
-        } else if (strcmp(name, ATTR_VERSION) == 0) {
-            pkg->version = strtol(value, nullptr, 10);
-        } else if (strcmp(name, ATTR_SAMSUNG_DM) == 0
-                || strcmp(name, ATTR_SAMSUNG_DT) == 0
-                || strcmp(name, ATTR_SAMSUNG_NATIVE_LIBRARY_DIR) == 0
-                || strcmp(name, ATTR_SAMSUNG_NATIVE_LIBRARY_ROOT_DIR) == 0
-                || strcmp(name, ATTR_SAMSUNG_NATIVE_LIBRARY_ROOT_REQUIRES_ISA) == 0
-                || strcmp(name, ATTR_SAMSUNG_SECONDARY_NATIVE_LIBRARY_DIR) == 0) {
-            // Ignore Samsung-specific attributes
-        } else {
-            LOGW("Unrecognized attribute '%s' in <%s>", name, TAG_PACKAGE);
-        }
+        set_package_attr(pkg.get(), attr.name(), attr.value());
     }
 
     for (pugi::xml_node cur_node : node.children()) {
@@ -558,22 +1020,53 @@ static bool parse_tag_packages(pugi::xml_node node, Packages *pkgs)
     return true;
 }
 
+void Packages::build_indexes()
+{
+    _by_name.resize(pkgs.size());
+    _by_uid.clear();
+
+    for (uint32_t i = 0; i < pkgs.size(); ++i) {
+        _by_name[i] = i;
+        if (!pkgs[i]->is_shared_user) {
+            _by_uid.push_back(i);
+        }
+    }
+
+    // Stable sorts keep the first of any duplicates first, which is what the
+    // old linear search returned
+    std::stable_sort(_by_name.begin(), _by_name.end(),
+                     [&](uint32_t a, uint32_t b) {
+        return pkgs[a]->name < pkgs[b]->name;
+    });
+    std::stable_sort(_by_uid.begin(), _by_uid.end(),
+                     [&](uint32_t a, uint32_t b) {
+        return pkgs[a]->user_id < pkgs[b]->user_id;
+    });
+}
+
 std::shared_ptr<Package> Packages::find_by_uid(uid_t uid) const
 {
-    auto it = std::find_if(pkgs.begin(), pkgs.end(),
-                           [&](const std::shared_ptr<Package> &pkg) {
-        return !pkg->is_shared_user && pkg->user_id == static_cast<int>(uid);
+    int user_id = static_cast<int>(uid);
+    auto it = std::lower_bound(_by_uid.begin(), _by_uid.end(), user_id,
+                               [&](uint32_t i, int id) {
+        return pkgs[i]->user_id < id;
     });
-    return it == pkgs.end() ? std::shared_ptr<Package>() : *it;
+    if (it != _by_uid.end() && pkgs[*it]->user_id == user_id) {
+        return pkgs[*it];
+    }
+    return {};
 }
 
 std::shared_ptr<Package> Packages::find_by_pkg(const std::string &pkg_id) const
 {
-    auto it = std::find_if(pkgs.begin(), pkgs.end(),
-                           [&](const std::shared_ptr<Package> &pkg) {
-        return pkg->name == pkg_id;
+    auto it = std::lower_bound(_by_name.begin(), _by_name.end(), pkg_id,
+                               [&](uint32_t i, const std::string &name) {
+        return pkgs[i]->name < name;
     });
-    return it == pkgs.end() ? std::shared_ptr<Package>() : *it;
+    if (it != _by_name.end() && pkgs[*it]->name == pkg_id) {
+        return pkgs[*it];
+    }
+    return {};
 }
 
 }
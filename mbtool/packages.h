@@ -154,8 +154,17 @@ public:
 
     bool load_xml(const std::string &path);
 
+    static std::shared_ptr<const Packages> load_cached(const std::string &path);
+
     std::shared_ptr<Package> find_by_uid(uid_t uid) const;
     std::shared_ptr<Package> find_by_pkg(const std::string &pkg_id) const;
+
+private:
+    void build_indexes();
+
+    // Indexes into pkgs, sorted by name and by (non-shared) user ID
+    std::vector<uint32_t> _by_name;
+    std::vector<uint32_t> _by_uid;
 };
 
 }
@@ -0,0 +1,418 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "profile.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <dirent.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+#include "mbutil/autoclose/dir.h"
+#include "mbutil/autoclose/file.h"
+
+#include "boot_trace.h"
+
+namespace mb
+{
+
+struct ProfileThread
+{
+    std::string name;
+    uint64_t utime_ticks;
+    uint64_t stime_ticks;
+    uint64_t minflt;
+    uint64_t majflt;
+    uint64_t voluntary_ctxt_switches;
+    uint64_t nonvoluntary_ctxt_switches;
+    // Whether the thread was present in the latest sample
+    bool alive;
+};
+
+struct ProfileSample
+{
+    uint64_t time_ns;
+    struct rusage usage;
+};
+
+struct ProfileState
+{
+    std::string path;
+    std::string command;
+    pid_t pid;
+    uint64_t start_ns;
+
+    std::mutex lock;
+    std::condition_variable cv;
+    bool stop;
+    std::thread sampler;
+
+    // Last values seen for every thread, including threads that have exited
+    std::map<pid_t, ProfileThread> threads;
+    std::vector<ProfileSample> samples;
+};
+
+// Intentionally leaked so that nothing is destroyed before the atexit handler
+// runs
+static ProfileState *g_profile = nullptr;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static bool read_thread_stat(pid_t tid, ProfileThread &thread)
+{
+    char path[64];
+    char buf[512];
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+
+    autoclose::file fp(autoclose::fopen(path, "re"));
+    if (!fp || !fgets(buf, sizeof(buf), fp.get())) {
+        return false;
+    }
+
+    // The thread name may contain spaces and parentheses, so find the last ')'
+    char *name_begin = strchr(buf, '(');
+    char *name_end = strrchr(buf, ')');
+    if (!name_begin || !name_end || name_end < name_begin) {
+        return false;
+    }
+
+    // Fields 3-15: state, ppid, pgrp, session, tty_nr, tpgid, flags, minflt,
+    // cminflt, majflt, cmajflt, utime, stime
+    if (sscanf(name_end + 1, " %*c %*d %*d %*d %*d %*d %*u %" SCNu64
+               " %*u %" SCNu64 " %*u %" SCNu64 " %" SCNu64,
+               &thread.minflt, &thread.majflt,
+               &thread.utime_ticks, &thread.stime_ticks) != 4) {
+        return false;
+    }
+
+    thread.name.assign(name_begin + 1, name_end);
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/status", tid);
+
+    fp = autoclose::fopen(path, "re");
+    if (!fp) {
+        return false;
+    }
+
+    while (fgets(buf, sizeof(buf), fp.get())) {
+        uint64_t value;
+
+        if (sscanf(buf, "voluntary_ctxt_switches: %" SCNu64, &value) == 1) {
+            thread.voluntary_ctxt_switches = value;
+        } else if (sscanf(buf, "nonvoluntary_ctxt_switches: %" SCNu64,
+                          &value) == 1) {
+            thread.nonvoluntary_ctxt_switches = value;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Record the rusage and the counters of all live threads
+ *
+ * Per-thread counters disappear from /proc when a thread exits, so the last
+ * sampled values are kept. Threads that ran for less than one sampling interval
+ * may not show up in the profile, but are still accounted for in the process'
+ * rusage.
+ *
+ * \note \p state.lock must be held or the sampler thread must have exited
+ */
+static void take_sample(ProfileState &state)
+{
+    if (state.samples.size() < PROFILE_MAX_SAMPLES) {
+        ProfileSample sample;
+        sample.time_ns = now_ns();
+        if (getrusage(RUSAGE_SELF, &sample.usage) == 0) {
+            state.samples.push_back(sample);
+        }
+    }
+
+    for (auto &item : state.threads) {
+        item.second.alive = false;
+    }
+
+    autoclose::dir dp(autoclose::opendir("/proc/self/task"));
+    if (!dp) {
+        return;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dp.get()))) {
+        char *end;
+        long tid = strtol(ent->d_name, &end, 10);
+        if (ent->d_name[0] == '.' || *end) {
+            continue;
+        }
+
+        ProfileThread thread = {};
+        if (read_thread_stat(static_cast<pid_t>(tid), thread)) {
+            thread.alive = true;
+            state.threads[static_cast<pid_t>(tid)] = std::move(thread);
+        }
+    }
+}
+
+static void sampler_thread(ProfileState *state)
+{
+    std::unique_lock<std::mutex> lock(state->lock);
+
+    while (!state->stop) {
+        take_sample(*state);
+        state->cv.wait_for(lock, std::chrono::milliseconds(
+                PROFILE_SAMPLE_INTERVAL_MS), [&] { return state->stop; });
+    }
+}
+
+static void write_json_string(FILE *fp, const char *str)
+{
+    fputc('"', fp);
+    for (const char *p = str; *p; ++p) {
+        unsigned char c = static_cast<unsigned char>(*p);
+        if (c == '"' || c == '\\') {
+            fputc('\\', fp);
+            fputc(c, fp);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+static double timeval_to_s(const struct timeval &tv)
+{
+    return static_cast<double>(tv.tv_sec)
+            + static_cast<double>(tv.tv_usec) / 1000000;
+}
+
+static void write_rusage(FILE *fp, const struct rusage &usage)
+{
+    fprintf(fp, "{\"utime_s\":%.6f,\"stime_s\":%.6f,\"maxrss_kib\":%ld,"
+            "\"minflt\":%ld,\"majflt\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld,"
+            "\"inblock\":%ld,\"oublock\":%ld}",
+            timeval_to_s(usage.ru_utime), timeval_to_s(usage.ru_stime),
+            usage.ru_maxrss, usage.ru_minflt, usage.ru_majflt,
+            usage.ru_nvcsw, usage.ru_nivcsw,
+            usage.ru_inblock, usage.ru_oublock);
+}
+
+static void write_io(FILE *fp)
+{
+    fputc('{', fp);
+
+    autoclose::file io_fp(autoclose::fopen("/proc/self/io", "re"));
+    if (io_fp) {
+        char key[32];
+        uint64_t value;
+        bool first = true;
+
+        while (fscanf(io_fp.get(), "%31[^:]: %" SCNu64 "\n",
+                      key, &value) == 2) {
+            fputs(first ? "" : ",", fp);
+            write_json_string(fp, key);
+            fprintf(fp, ":%" PRIu64, value);
+            first = false;
+        }
+    }
+
+    fputc('}', fp);
+}
+
+static bool write_profile(ProfileState &state, const std::string &trace_path)
+{
+    autoclose::file fp(autoclose::fopen(state.path.c_str(), "wbe"));
+    if (!fp) {
+        LOGW("%s: Failed to open for writing: %s",
+             state.path.c_str(), strerror(errno));
+        return false;
+    }
+
+    uint64_t end_ns = now_ns();
+    double tick = 1.0 / static_cast<double>(sysconf(_SC_CLK_TCK));
+    struct rusage self_usage = {};
+    struct rusage children_usage = {};
+
+    getrusage(RUSAGE_SELF, &self_usage);
+    getrusage(RUSAGE_CHILDREN, &children_usage);
+
+    fputs("{\"command\":", fp.get());
+    write_json_string(fp.get(), state.command.c_str());
+    fprintf(fp.get(), ",\"pid\":%d,\"wall_time_s\":%.6f",
+            state.pid, static_cast<double>(end_ns - state.start_ns) / 1e9);
+
+    fputs(",\n\"rusage_self\":", fp.get());
+    write_rusage(fp.get(), self_usage);
+    fputs(",\n\"rusage_children\":", fp.get());
+    write_rusage(fp.get(), children_usage);
+    fputs(",\n\"io\":", fp.get());
+    write_io(fp.get());
+
+    fputs(",\n\"threads\":[", fp.get());
+    bool first = true;
+    for (auto const &item : state.threads) {
+        const ProfileThread &thread = item.second;
+
+        fprintf(fp.get(), "%s\n{\"tid\":%d,\"name\":", first ? "" : ",",
+                item.first);
+        write_json_string(fp.get(), thread.name.c_str());
+        fprintf(fp.get(), ",\"utime_s\":%.2f,\"stime_s\":%.2f,"
+                "\"minflt\":%" PRIu64 ",\"majflt\":%" PRIu64 ","
+                "\"nvcsw\":%" PRIu64 ",\"nivcsw\":%" PRIu64 ","
+                "\"exited\":%s}",
+                static_cast<double>(thread.utime_ticks) * tick,
+                static_cast<double>(thread.stime_ticks) * tick,
+                thread.minflt, thread.majflt,
+                thread.voluntary_ctxt_switches,
+                thread.nonvoluntary_ctxt_switches,
+                thread.alive ? "false" : "true");
+        first = false;
+    }
+    fputs("\n]", fp.get());
+
+    fputs(",\n\"samples\":[", fp.get());
+    first = true;
+    for (auto const &sample : state.samples) {
+        fprintf(fp.get(), "%s\n{\"t_s\":%.3f,\"usage\":", first ? "" : ",",
+                static_cast<double>(sample.time_ns - state.start_ns) / 1e9);
+        write_rusage(fp.get(), sample.usage);
+        fputc('}', fp.get());
+        first = false;
+    }
+    fputs("\n]", fp.get());
+
+    fputs(",\n\"trace\":", fp.get());
+    write_json_string(fp.get(), trace_path.c_str());
+    fputs("}\n", fp.get());
+
+    if (fflush(fp.get()) != 0 || ferror(fp.get())) {
+        LOGW("%s: Failed to write profile: %s",
+             state.path.c_str(), strerror(errno));
+        return false;
+    }
+
+    LOGV("Wrote profile to %s", state.path.c_str());
+    return true;
+}
+
+static void profile_atexit()
+{
+    profile_finish();
+}
+
+/*!
+ * \brief Start profiling the current process
+ *
+ * A background thread samples the process' rusage and the CPU time, page
+ * faults, and context switches of each thread every
+ * `PROFILE_SAMPLE_INTERVAL_MS` milliseconds. The profile is written to \p path
+ * as JSON when profile_finish() is called or when the process exits normally.
+ * Spans recorded with the boot tracer are written next to it as
+ * `<path>.trace.json`.
+ *
+ * \note Forked children are not profiled. Their resource usage is included in
+ *       `rusage_children` once they have been waited for.
+ *
+ * \param path Output file
+ * \param command Command line to record in the profile
+ *
+ * \return Whether profiling was started
+ */
+bool profile_start(const char *path, const char *command)
+{
+    if (g_profile) {
+        return false;
+    }
+
+    ProfileState *state = new ProfileState();
+    state->path = path;
+    state->command = command;
+    state->pid = getpid();
+    state->start_ns = now_ns();
+    state->stop = false;
+
+    try {
+        state->sampler = std::thread(&sampler_thread, state);
+    } catch (const std::system_error &e) {
+        LOGW("Failed to start profile sampler thread: %s", e.what());
+        delete state;
+        return false;
+    }
+
+    g_profile = state;
+    atexit(&profile_atexit);
+
+    return true;
+}
+
+/*!
+ * \brief Stop profiling and write the profile
+ *
+ * This is a no-op if profiling was not started, if the profile was already
+ * written, or if called from a forked child.
+ */
+void profile_finish()
+{
+    ProfileState *state = g_profile;
+    if (!state || state->pid != getpid()) {
+        return;
+    }
+    g_profile = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock(state->lock);
+        state->stop = true;
+    }
+    state->cv.notify_one();
+    state->sampler.join();
+
+    // Final sample so that the main thread's counters are current
+    take_sample(*state);
+
+    std::string trace_path = state->path + ".trace.json";
+    boot_trace_dump(trace_path.c_str());
+    write_profile(*state, trace_path);
+
+    delete state;
+}
+
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// Interval at which rusage and per-thread counters are sampled
+#define PROFILE_SAMPLE_INTERVAL_MS      1000
+// Maximum number of rusage samples kept. Sampling stops once reached.
+#define PROFILE_MAX_SAMPLES             3600
+
+namespace mb
+{
+
+bool profile_start(const char *path, const char *command);
+void profile_finish();
+
+}
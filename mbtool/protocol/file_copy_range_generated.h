@@ -0,0 +1,215 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+
+#ifndef FLATBUFFERS_GENERATED_FILECOPYRANGE_MBTOOL_DAEMON_V3_H_
+#define FLATBUFFERS_GENERATED_FILECOPYRANGE_MBTOOL_DAEMON_V3_H_
+
+#include "flatbuffers/flatbuffers.h"
+
+namespace mbtool {
+namespace daemon {
+namespace v3 {
+
+struct FileCopyRangeError;
+
+struct FileCopyRangeRequest;
+
+struct FileCopyRangeResponse;
+
+struct FileCopyRangeError FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_ERRNO_VALUE = 4,
+    VT_MSG = 6
+  };
+  int32_t errno_value() const {
+    return GetField<int32_t>(VT_ERRNO_VALUE, 0);
+  }
+  const flatbuffers::String *msg() const {
+    return GetPointer<const flatbuffers::String *>(VT_MSG);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<int32_t>(verifier, VT_ERRNO_VALUE) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_MSG) &&
+           verifier.Verify(msg()) &&
+           verifier.EndTable();
+  }
+};
+
+struct FileCopyRangeErrorBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_errno_value(int32_t errno_value) {
+    fbb_.AddElement<int32_t>(FileCopyRangeError::VT_ERRNO_VALUE, errno_value, 0);
+  }
+  void add_msg(flatbuffers::Offset<flatbuffers::String> msg) {
+    fbb_.AddOffset(FileCopyRangeError::VT_MSG, msg);
+  }
+  FileCopyRangeErrorBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  FileCopyRangeErrorBuilder &operator=(const FileCopyRangeErrorBuilder &);
+  flatbuffers::Offset<FileCopyRangeError> Finish() {
+    const auto end = fbb_.EndTable(start_, 2);
+    auto o = flatbuffers::Offset<FileCopyRangeError>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<FileCopyRangeError> CreateFileCopyRangeError(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    int32_t errno_value = 0,
+    flatbuffers::Offset<flatbuffers::String> msg = 0) {
+  FileCopyRangeErrorBuilder builder_(_fbb);
+  builder_.add_msg(msg);
+  builder_.add_errno_value(errno_value);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<FileCopyRangeError> CreateFileCopyRangeErrorDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    int32_t errno_value = 0,
+    const char *msg = nullptr) {
+  return mbtool::daemon::v3::CreateFileCopyRangeError(
+      _fbb,
+      errno_value,
+      msg ? _fbb.CreateString(msg) : 0);
+}
+
+struct FileCopyRangeRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_SOURCE_ID = 4,
+    VT_TARGET_ID = 6,
+    VT_SOURCE_OFFSET = 8,
+    VT_TARGET_OFFSET = 10,
+    VT_COUNT = 12
+  };
+  int32_t source_id() const {
+    return GetField<int32_t>(VT_SOURCE_ID, 0);
+  }
+  int32_t target_id() const {
+    return GetField<int32_t>(VT_TARGET_ID, 0);
+  }
+  int64_t source_offset() const {
+    return GetField<int64_t>(VT_SOURCE_OFFSET, -1);
+  }
+  int64_t target_offset() const {
+    return GetField<int64_t>(VT_TARGET_OFFSET, -1);
+  }
+  uint64_t count() const {
+    return GetField<uint64_t>(VT_COUNT, 0);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<int32_t>(verifier, VT_SOURCE_ID) &&
+           VerifyField<int32_t>(verifier, VT_TARGET_ID) &&
+           VerifyField<int64_t>(verifier, VT_SOURCE_OFFSET) &&
+           VerifyField<int64_t>(verifier, VT_TARGET_OFFSET) &&
+           VerifyField<uint64_t>(verifier, VT_COUNT) &&
+           verifier.EndTable();
+  }
+};
+
+struct FileCopyRangeRequestBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_source_id(int32_t source_id) {
+    fbb_.AddElement<int32_t>(FileCopyRangeRequest::VT_SOURCE_ID, source_id, 0);
+  }
+  void add_target_id(int32_t target_id) {
+    fbb_.AddElement<int32_t>(FileCopyRangeRequest::VT_TARGET_ID, target_id, 0);
+  }
+  void add_source_offset(int64_t source_offset) {
+    fbb_.AddElement<int64_t>(FileCopyRangeRequest::VT_SOURCE_OFFSET, source_offset, -1);
+  }
+  void add_target_offset(int64_t target_offset) {
+    fbb_.AddElement<int64_t>(FileCopyRangeRequest::VT_TARGET_OFFSET, target_offset, -1);
+  }
+  void add_count(uint64_t count) {
+    fbb_.AddElement<uint64_t>(FileCopyRangeRequest::VT_COUNT, count, 0);
+  }
+  FileCopyRangeRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  FileCopyRangeRequestBuilder &operator=(const FileCopyRangeRequestBuilder &);
+  flatbuffers::Offset<FileCopyRangeRequest> Finish() {
+    const auto end = fbb_.EndTable(start_, 5);
+    auto o = flatbuffers::Offset<FileCopyRangeRequest>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<FileCopyRangeRequest> CreateFileCopyRangeRequest(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    int32_t source_id = 0,
+    int32_t target_id = 0,
+    int64_t source_offset = -1,
+    int64_t target_offset = -1,
+    uint64_t count = 0) {
+  FileCopyRangeRequestBuilder builder_(_fbb);
+  builder_.add_count(count);
+  builder_.add_target_offset(target_offset);
+  builder_.add_source_offset(source_offset);
+  builder_.add_target_id(target_id);
+  builder_.add_source_id(source_id);
+  return builder_.Finish();
+}
+
+struct FileCopyRangeResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_BYTES_COPIED = 4,
+    VT_ERROR = 6
+  };
+  uint64_t bytes_copied() const {
+    return GetField<uint64_t>(VT_BYTES_COPIED, 0);
+  }
+  const FileCopyRangeError *error() const {
+    return GetPointer<const FileCopyRangeError *>(VT_ERROR);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<uint64_t>(verifier, VT_BYTES_COPIED) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_ERROR) &&
+           verifier.VerifyTable(error()) &&
+           verifier.EndTable();
+  }
+};
+
+struct FileCopyRangeResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_bytes_copied(uint64_t bytes_copied) {
+    fbb_.AddElement<uint64_t>(FileCopyRangeResponse::VT_BYTES_COPIED, bytes_copied, 0);
+  }
+  void add_error(flatbuffers::Offset<FileCopyRangeError> error) {
+    fbb_.AddOffset(FileCopyRangeResponse::VT_ERROR, error);
+  }
+  FileCopyRangeResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  FileCopyRangeResponseBuilder &operator=(const FileCopyRangeResponseBuilder &);
+  flatbuffers::Offset<FileCopyRangeResponse> Finish() {
+    const auto end = fbb_.EndTable(start_, 2);
+    auto o = flatbuffers::Offset<FileCopyRangeResponse>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<FileCopyRangeResponse> CreateFileCopyRangeResponse(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    uint64_t bytes_copied = 0,
+    flatbuffers::Offset<FileCopyRangeError> error = 0) {
+  FileCopyRangeResponseBuilder builder_(_fbb);
+  builder_.add_bytes_copied(bytes_copied);
+  builder_.add_error(error);
+  return builder_.Finish();
+}
+
+}  // namespace v3
+}  // namespace daemon
+}  // namespace mbtool
+
+#endif  // FLATBUFFERS_GENERATED_FILECOPYRANGE_MBTOOL_DAEMON_V3_H_
@@ -0,0 +1,276 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+
+#ifndef FLATBUFFERS_GENERATED_FILEHASH_MBTOOL_DAEMON_V3_H_
+#define FLATBUFFERS_GENERATED_FILEHASH_MBTOOL_DAEMON_V3_H_
+
+#include "flatbuffers/flatbuffers.h"
+
+namespace mbtool {
+namespace daemon {
+namespace v3 {
+
+struct FileHashError;
+
+struct FileHashRequest;
+
+struct FileHashResponse;
+
+enum FileHashAlgorithm {
+  FileHashAlgorithm_SHA256 = 0,
+  FileHashAlgorithm_SHA512 = 1,
+  FileHashAlgorithm_MIN = FileHashAlgorithm_SHA256,
+  FileHashAlgorithm_MAX = FileHashAlgorithm_SHA512
+};
+
+inline const char **EnumNamesFileHashAlgorithm() {
+  static const char *names[] = {
+    "SHA256",
+    "SHA512",
+    nullptr
+  };
+  return names;
+}
+
+inline const char *EnumNameFileHashAlgorithm(FileHashAlgorithm e) {
+  const size_t index = static_cast<int>(e);
+  return EnumNamesFileHashAlgorithm()[index];
+}
+
+struct FileHashError FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_ERRNO_VALUE = 4,
+    VT_MSG = 6
+  };
+  int32_t errno_value() const {
+    return GetField<int32_t>(VT_ERRNO_VALUE, 0);
+  }
+  const flatbuffers::String *msg() const {
+    return GetPointer<const flatbuffers::String *>(VT_MSG);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<int32_t>(verifier, VT_ERRNO_VALUE) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_MSG) &&
+           verifier.Verify(msg()) &&
+           verifier.EndTable();
+  }
+};
+
+struct FileHashErrorBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_errno_value(int32_t errno_value) {
+    fbb_.AddElement<int32_t>(FileHashError::VT_ERRNO_VALUE, errno_value, 0);
+  }
+  void add_msg(flatbuffers::Offset<flatbuffers::String> msg) {
+    fbb_.AddOffset(FileHashError::VT_MSG, msg);
+  }
+  FileHashErrorBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  FileHashErrorBuilder &operator=(const FileHashErrorBuilder &);
+  flatbuffers::Offset<FileHashError> Finish() {
+    const auto end = fbb_.EndTable(start_, 2);
+    auto o = flatbuffers::Offset<FileHashError>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<FileHashError> CreateFileHashError(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    int32_t errno_value = 0,
+    flatbuffers::Offset<flatbuffers::String> msg = 0) {
+  FileHashErrorBuilder builder_(_fbb);
+  builder_.add_msg(msg);
+  builder_.add_errno_value(errno_value);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<FileHashError> CreateFileHashErrorDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    int32_t errno_value = 0,
+    const char *msg = nullptr) {
+  return mbtool::daemon::v3::CreateFileHashError(
+      _fbb,
+      errno_value,
+      msg ? _fbb.CreateString(msg) : 0);
+}
+
+struct FileHashRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_ID = 4,
+    VT_PATH = 6,
+    VT_OFFSET = 8,
+    VT_COUNT = 10,
+    VT_ALGORITHM = 12
+  };
+  int32_t id() const {
+    return GetField<int32_t>(VT_ID, 0);
+  }
+  const flatbuffers::String *path() const {
+    return GetPointer<const flatbuffers::String *>(VT_PATH);
+  }
+  uint64_t offset() const {
+    return GetField<uint64_t>(VT_OFFSET, 0);
+  }
+  uint64_t count() const {
+    return GetField<uint64_t>(VT_COUNT, 0);
+  }
+  FileHashAlgorithm algorithm() const {
+    return static_cast<FileHashAlgorithm>(GetField<int16_t>(VT_ALGORITHM, 0));
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<int32_t>(verifier, VT_ID) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_PATH) &&
+           verifier.Verify(path()) &&
+           VerifyField<uint64_t>(verifier, VT_OFFSET) &&
+           VerifyField<uint64_t>(verifier, VT_COUNT) &&
+           VerifyField<int16_t>(verifier, VT_ALGORITHM) &&
+           verifier.EndTable();
+  }
+};
+
+struct FileHashRequestBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_id(int32_t id) {
+    fbb_.AddElement<int32_t>(FileHashRequest::VT_ID, id, 0);
+  }
+  void add_path(flatbuffers::Offset<flatbuffers::String> path) {
+    fbb_.AddOffset(FileHashRequest::VT_PATH, path);
+  }
+  void add_offset(uint64_t offset) {
+    fbb_.AddElement<uint64_t>(FileHashRequest::VT_OFFSET, offset, 0);
+  }
+  void add_count(uint64_t count) {
+    fbb_.AddElement<uint64_t>(FileHashRequest::VT_COUNT, count, 0);
+  }
+  void add_algorithm(FileHashAlgorithm algorithm) {
+    fbb_.AddElement<int16_t>(FileHashRequest::VT_ALGORITHM, static_cast<int16_t>(algorithm), 0);
+  }
+  FileHashRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  FileHashRequestBuilder &operator=(const FileHashRequestBuilder &);
+  flatbuffers::Offset<FileHashRequest> Finish() {
+    const auto end = fbb_.EndTable(start_, 5);
+    auto o = flatbuffers::Offset<FileHashRequest>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<FileHashRequest> CreateFileHashRequest(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    int32_t id = 0,
+    flatbuffers::Offset<flatbuffers::String> path = 0,
+    uint64_t offset = 0,
+    uint64_t count = 0,
+    FileHashAlgorithm algorithm = FileHashAlgorithm_SHA256) {
+  FileHashRequestBuilder builder_(_fbb);
+  builder_.add_count(count);
+  builder_.add_offset(offset);
+  builder_.add_path(path);
+  builder_.add_id(id);
+  builder_.add_algorithm(algorithm);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<FileHashRequest> CreateFileHashRequestDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    int32_t id = 0,
+    const char *path = nullptr,
+    uint64_t offset = 0,
+    uint64_t count = 0,
+    FileHashAlgorithm algorithm = FileHashAlgorithm_SHA256) {
+  return mbtool::daemon::v3::CreateFileHashRequest(
+      _fbb,
+      id,
+      path ? _fbb.CreateString(path) : 0,
+      offset,
+      count,
+      algorithm);
+}
+
+struct FileHashResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_DIGEST = 4,
+    VT_BYTES_HASHED = 6,
+    VT_ERROR = 8
+  };
+  const flatbuffers::Vector<uint8_t> *digest() const {
+    return GetPointer<const flatbuffers::Vector<uint8_t> *>(VT_DIGEST);
+  }
+  uint64_t bytes_hashed() const {
+    return GetField<uint64_t>(VT_BYTES_HASHED, 0);
+  }
+  const FileHashError *error() const {
+    return GetPointer<const FileHashError *>(VT_ERROR);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_DIGEST) &&
+           verifier.Verify(digest()) &&
+           VerifyField<uint64_t>(verifier, VT_BYTES_HASHED) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_ERROR) &&
+           verifier.VerifyTable(error()) &&
+           verifier.EndTable();
+  }
+};
+
+struct FileHashResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_digest(flatbuffers::Offset<flatbuffers::Vector<uint8_t>> digest) {
+    fbb_.AddOffset(FileHashResponse::VT_DIGEST, digest);
+  }
+  void add_bytes_hashed(uint64_t bytes_hashed) {
+    fbb_.AddElement<uint64_t>(FileHashResponse::VT_BYTES_HASHED, bytes_hashed, 0);
+  }
+  void add_error(flatbuffers::Offset<FileHashError> error) {
+    fbb_.AddOffset(FileHashResponse::VT_ERROR, error);
+  }
+  FileHashResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  FileHashResponseBuilder &operator=(const FileHashResponseBuilder &);
+  flatbuffers::Offset<FileHashResponse> Finish() {
+    const auto end = fbb_.EndTable(start_, 3);
+    auto o = flatbuffers::Offset<FileHashResponse>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<FileHashResponse> CreateFileHashResponse(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::Vector<uint8_t>> digest = 0,
+    uint64_t bytes_hashed = 0,
+    flatbuffers::Offset<FileHashError> error = 0) {
+  FileHashResponseBuilder builder_(_fbb);
+  builder_.add_bytes_hashed(bytes_hashed);
+  builder_.add_error(error);
+  builder_.add_digest(digest);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<FileHashResponse> CreateFileHashResponseDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const std::vector<uint8_t> *digest = nullptr,
+    uint64_t bytes_hashed = 0,
+    flatbuffers::Offset<FileHashError> error = 0) {
+  return mbtool::daemon::v3::CreateFileHashResponse(
+      _fbb,
+      digest ? _fbb.CreateVector<uint8_t>(*digest) : 0,
+      bytes_hashed,
+      error);
+}
+
+}  // namespace v3
+}  // namespace daemon
+}  // namespace mbtool
+
+#endif  // FLATBUFFERS_GENERATED_FILEHASH_MBTOOL_DAEMON_V3_H_
@@ -0,0 +1,247 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+
+#ifndef FLATBUFFERS_GENERATED_MBGETSTATS_MBTOOL_DAEMON_V3_H_
+#define FLATBUFFERS_GENERATED_MBGETSTATS_MBTOOL_DAEMON_V3_H_
+
+#include "flatbuffers/flatbuffers.h"
+
+namespace mbtool {
+namespace daemon {
+namespace v3 {
+
+struct MbRequestStats;
+
+struct MbGetStatsRequest;
+
+struct MbGetStatsResponse;
+
+struct MbRequestStats FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_REQUEST_TYPE = 4,
+    VT_NAME = 6,
+    VT_COUNT = 8,
+    VT_TOTAL_LATENCY_US = 10,
+    VT_MAX_LATENCY_US = 12,
+    VT_LATENCY_HISTOGRAM = 14,
+    VT_BYTES_IN = 16,
+    VT_BYTES_OUT = 18
+  };
+  uint32_t request_type() const {
+    return GetField<uint32_t>(VT_REQUEST_TYPE, 0);
+  }
+  const flatbuffers::String *name() const {
+    return GetPointer<const flatbuffers::String *>(VT_NAME);
+  }
+  uint64_t count() const {
+    return GetField<uint64_t>(VT_COUNT, 0);
+  }
+  uint64_t total_latency_us() const {
+    return GetField<uint64_t>(VT_TOTAL_LATENCY_US, 0);
+  }
+  uint64_t max_latency_us() const {
+    return GetField<uint64_t>(VT_MAX_LATENCY_US, 0);
+  }
+  const flatbuffers::Vector<uint64_t> *latency_histogram() const {
+    return GetPointer<const flatbuffers::Vector<uint64_t> *>(VT_LATENCY_HISTOGRAM);
+  }
+  uint64_t bytes_in() const {
+    return GetField<uint64_t>(VT_BYTES_IN, 0);
+  }
+  uint64_t bytes_out() const {
+    return GetField<uint64_t>(VT_BYTES_OUT, 0);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<uint32_t>(verifier, VT_REQUEST_TYPE) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_NAME) &&
+           verifier.Verify(name()) &&
+           VerifyField<uint64_t>(verifier, VT_COUNT) &&
+           VerifyField<uint64_t>(verifier, VT_TOTAL_LATENCY_US) &&
+           VerifyField<uint64_t>(verifier, VT_MAX_LATENCY_US) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_LATENCY_HISTOGRAM) &&
+           verifier.Verify(latency_histogram()) &&
+           VerifyField<uint64_t>(verifier, VT_BYTES_IN) &&
+           VerifyField<uint64_t>(verifier, VT_BYTES_OUT) &&
+           verifier.EndTable();
+  }
+};
+
+struct MbRequestStatsBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_request_type(uint32_t request_type) {
+    fbb_.AddElement<uint32_t>(MbRequestStats::VT_REQUEST_TYPE, request_type, 0);
+  }
+  void add_name(flatbuffers::Offset<flatbuffers::String> name) {
+    fbb_.AddOffset(MbRequestStats::VT_NAME, name);
+  }
+  void add_count(uint64_t count) {
+    fbb_.AddElement<uint64_t>(MbRequestStats::VT_COUNT, count, 0);
+  }
+  void add_total_latency_us(uint64_t total_latency_us) {
+    fbb_.AddElement<uint64_t>(MbRequestStats::VT_TOTAL_LATENCY_US, total_latency_us, 0);
+  }
+  void add_max_latency_us(uint64_t max_latency_us) {
+    fbb_.AddElement<uint64_t>(MbRequestStats::VT_MAX_LATENCY_US, max_latency_us, 0);
+  }
+  void add_latency_histogram(flatbuffers::Offset<flatbuffers::Vector<uint64_t>> latency_histogram) {
+    fbb_.AddOffset(MbRequestStats::VT_LATENCY_HISTOGRAM, latency_histogram);
+  }
+  void add_bytes_in(uint64_t bytes_in) {
+    fbb_.AddElement<uint64_t>(MbRequestStats::VT_BYTES_IN, bytes_in, 0);
+  }
+  void add_bytes_out(uint64_t bytes_out) {
+    fbb_.AddElement<uint64_t>(MbRequestStats::VT_BYTES_OUT, bytes_out, 0);
+  }
+  MbRequestStatsBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  MbRequestStatsBuilder &operator=(const MbRequestStatsBuilder &);
+  flatbuffers::Offset<MbRequestStats> Finish() {
+    const auto end = fbb_.EndTable(start_, 8);
+    auto o = flatbuffers::Offset<MbRequestStats>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<MbRequestStats> CreateMbRequestStats(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    uint32_t request_type = 0,
+    flatbuffers::Offset<flatbuffers::String> name = 0,
+    uint64_t count = 0,
+    uint64_t total_latency_us = 0,
+    uint64_t max_latency_us = 0,
+    flatbuffers::Offset<flatbuffers::Vector<uint64_t>> latency_histogram = 0,
+    uint64_t bytes_in = 0,
+    uint64_t bytes_out = 0) {
+  MbRequestStatsBuilder builder_(_fbb);
+  builder_.add_bytes_out(bytes_out);
+  builder_.add_bytes_in(bytes_in);
+  builder_.add_max_latency_us(max_latency_us);
+  builder_.add_total_latency_us(total_latency_us);
+  builder_.add_count(count);
+  builder_.add_latency_histogram(latency_histogram);
+  builder_.add_name(name);
+  builder_.add_request_type(request_type);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<MbRequestStats> CreateMbRequestStatsDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    uint32_t request_type = 0,
+    const char *name = nullptr,
+    uint64_t count = 0,
+    uint64_t total_latency_us = 0,
+    uint64_t max_latency_us = 0,
+    const std::vector<uint64_t> *latency_histogram = nullptr,
+    uint64_t bytes_in = 0,
+    uint64_t bytes_out = 0) {
+  return mbtool::daemon::v3::CreateMbRequestStats(
+      _fbb,
+      request_type,
+      name ? _fbb.CreateString(name) : 0,
+      count,
+      total_latency_us,
+      max_latency_us,
+      latency_histogram ? _fbb.CreateVector<uint64_t>(*latency_histogram) : 0,
+      bytes_in,
+      bytes_out);
+}
+
+struct MbGetStatsRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           verifier.EndTable();
+  }
+};
+
+struct MbGetStatsRequestBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  MbGetStatsRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  MbGetStatsRequestBuilder &operator=(const MbGetStatsRequestBuilder &);
+  flatbuffers::Offset<MbGetStatsRequest> Finish() {
+    const auto end = fbb_.EndTable(start_, 0);
+    auto o = flatbuffers::Offset<MbGetStatsRequest>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<MbGetStatsRequest> CreateMbGetStatsRequest(
+    flatbuffers::FlatBufferBuilder &_fbb) {
+  MbGetStatsRequestBuilder builder_(_fbb);
+  return builder_.Finish();
+}
+
+struct MbGetStatsResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_CONNECTIONS = 4,
+    VT_STATS = 6
+  };
+  uint64_t connections() const {
+    return GetField<uint64_t>(VT_CONNECTIONS, 0);
+  }
+  const flatbuffers::Vector<flatbuffers::Offset<MbRequestStats>> *stats() const {
+    return GetPointer<const flatbuffers::Vector<flatbuffers::Offset<MbRequestStats>> *>(VT_STATS);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<uint64_t>(verifier, VT_CONNECTIONS) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_STATS) &&
+           verifier.Verify(stats()) &&
+           verifier.VerifyVectorOfTables(stats()) &&
+           verifier.EndTable();
+  }
+};
+
+struct MbGetStatsResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_connections(uint64_t connections) {
+    fbb_.AddElement<uint64_t>(MbGetStatsResponse::VT_CONNECTIONS, connections, 0);
+  }
+  void add_stats(flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<MbRequestStats>>> stats) {
+    fbb_.AddOffset(MbGetStatsResponse::VT_STATS, stats);
+  }
+  MbGetStatsResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  MbGetStatsResponseBuilder &operator=(const MbGetStatsResponseBuilder &);
+  flatbuffers::Offset<MbGetStatsResponse> Finish() {
+    const auto end = fbb_.EndTable(start_, 2);
+    auto o = flatbuffers::Offset<MbGetStatsResponse>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<MbGetStatsResponse> CreateMbGetStatsResponse(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    uint64_t connections = 0,
+    flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<MbRequestStats>>> stats = 0) {
+  MbGetStatsResponseBuilder builder_(_fbb);
+  builder_.add_connections(connections);
+  builder_.add_stats(stats);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<MbGetStatsResponse> CreateMbGetStatsResponseDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    uint64_t connections = 0,
+    const std::vector<flatbuffers::Offset<MbRequestStats>> *stats = nullptr) {
+  return mbtool::daemon::v3::CreateMbGetStatsResponse(
+      _fbb,
+      connections,
+      stats ? _fbb.CreateVector<flatbuffers::Offset<MbRequestStats>>(*stats) : 0);
+}
+
+}  // namespace v3
+}  // namespace daemon
+}  // namespace mbtool
+
+#endif  // FLATBUFFERS_GENERATED_MBGETSTATS_MBTOOL_DAEMON_V3_H_
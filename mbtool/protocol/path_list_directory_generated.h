@@ -0,0 +1,288 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+
+#ifndef FLATBUFFERS_GENERATED_PATHLISTDIRECTORY_MBTOOL_DAEMON_V3_H_
+#define FLATBUFFERS_GENERATED_PATHLISTDIRECTORY_MBTOOL_DAEMON_V3_H_
+
+#include "flatbuffers/flatbuffers.h"
+
+#include "file_stat_generated.h"
+
+namespace mbtool {
+namespace daemon {
+namespace v3 {
+
+struct PathListDirectoryError;
+
+struct PathListDirectoryEntry;
+
+struct PathListDirectoryRequest;
+
+struct PathListDirectoryResponse;
+
+struct PathListDirectoryError FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_ERRNO_VALUE = 4,
+    VT_MSG = 6
+  };
+  int32_t errno_value() const {
+    return GetField<int32_t>(VT_ERRNO_VALUE, 0);
+  }
+  const flatbuffers::String *msg() const {
+    return GetPointer<const flatbuffers::String *>(VT_MSG);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<int32_t>(verifier, VT_ERRNO_VALUE) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_MSG) &&
+           verifier.Verify(msg()) &&
+           verifier.EndTable();
+  }
+};
+
+struct PathListDirectoryErrorBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_errno_value(int32_t errno_value) {
+    fbb_.AddElement<int32_t>(PathListDirectoryError::VT_ERRNO_VALUE, errno_value, 0);
+  }
+  void add_msg(flatbuffers::Offset<flatbuffers::String> msg) {
+    fbb_.AddOffset(PathListDirectoryError::VT_MSG, msg);
+  }
+  PathListDirectoryErrorBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  PathListDirectoryErrorBuilder &operator=(const PathListDirectoryErrorBuilder &);
+  flatbuffers::Offset<PathListDirectoryError> Finish() {
+    const auto end = fbb_.EndTable(start_, 2);
+    auto o = flatbuffers::Offset<PathListDirectoryError>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<PathListDirectoryError> CreatePathListDirectoryError(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    int32_t errno_value = 0,
+    flatbuffers::Offset<flatbuffers::String> msg = 0) {
+  PathListDirectoryErrorBuilder builder_(_fbb);
+  builder_.add_msg(msg);
+  builder_.add_errno_value(errno_value);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<PathListDirectoryError> CreatePathListDirectoryErrorDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    int32_t errno_value = 0,
+    const char *msg = nullptr) {
+  return mbtool::daemon::v3::CreatePathListDirectoryError(
+      _fbb,
+      errno_value,
+      msg ? _fbb.CreateString(msg) : 0);
+}
+
+struct PathListDirectoryEntry FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_NAME = 4,
+    VT_STAT = 6,
+    VT_SELINUX_LABEL = 8,
+    VT_SYMLINK_TARGET = 10
+  };
+  const flatbuffers::String *name() const {
+    return GetPointer<const flatbuffers::String *>(VT_NAME);
+  }
+  const StructStat *stat() const {
+    return GetPointer<const StructStat *>(VT_STAT);
+  }
+  const flatbuffers::String *selinux_label() const {
+    return GetPointer<const flatbuffers::String *>(VT_SELINUX_LABEL);
+  }
+  const flatbuffers::String *symlink_target() const {
+    return GetPointer<const flatbuffers::String *>(VT_SYMLINK_TARGET);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_NAME) &&
+           verifier.Verify(name()) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_STAT) &&
+           verifier.VerifyTable(stat()) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_SELINUX_LABEL) &&
+           verifier.Verify(selinux_label()) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_SYMLINK_TARGET) &&
+           verifier.Verify(symlink_target()) &&
+           verifier.EndTable();
+  }
+};
+
+struct PathListDirectoryEntryBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_name(flatbuffers::Offset<flatbuffers::String> name) {
+    fbb_.AddOffset(PathListDirectoryEntry::VT_NAME, name);
+  }
+  void add_stat(flatbuffers::Offset<StructStat> stat) {
+    fbb_.AddOffset(PathListDirectoryEntry::VT_STAT, stat);
+  }
+  void add_selinux_label(flatbuffers::Offset<flatbuffers::String> selinux_label) {
+    fbb_.AddOffset(PathListDirectoryEntry::VT_SELINUX_LABEL, selinux_label);
+  }
+  void add_symlink_target(flatbuffers::Offset<flatbuffers::String> symlink_target) {
+    fbb_.AddOffset(PathListDirectoryEntry::VT_SYMLINK_TARGET, symlink_target);
+  }
+  PathListDirectoryEntryBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  PathListDirectoryEntryBuilder &operator=(const PathListDirectoryEntryBuilder &);
+  flatbuffers::Offset<PathListDirectoryEntry> Finish() {
+    const auto end = fbb_.EndTable(start_, 4);
+    auto o = flatbuffers::Offset<PathListDirectoryEntry>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<PathListDirectoryEntry> CreatePathListDirectoryEntry(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::String> name = 0,
+    flatbuffers::Offset<StructStat> stat = 0,
+    flatbuffers::Offset<flatbuffers::String> selinux_label = 0,
+    flatbuffers::Offset<flatbuffers::String> symlink_target = 0) {
+  PathListDirectoryEntryBuilder builder_(_fbb);
+  builder_.add_symlink_target(symlink_target);
+  builder_.add_selinux_label(selinux_label);
+  builder_.add_stat(stat);
+  builder_.add_name(name);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<PathListDirectoryEntry> CreatePathListDirectoryEntryDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const char *name = nullptr,
+    flatbuffers::Offset<StructStat> stat = 0,
+    const char *selinux_label = nullptr,
+    const char *symlink_target = nullptr) {
+  return mbtool::daemon::v3::CreatePathListDirectoryEntry(
+      _fbb,
+      name ? _fbb.CreateString(name) : 0,
+      stat,
+      selinux_label ? _fbb.CreateString(selinux_label) : 0,
+      symlink_target ? _fbb.CreateString(symlink_target) : 0);
+}
+
+struct PathListDirectoryRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_PATH = 4
+  };
+  const flatbuffers::String *path() const {
+    return GetPointer<const flatbuffers::String *>(VT_PATH);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_PATH) &&
+           verifier.Verify(path()) &&
+           verifier.EndTable();
+  }
+};
+
+struct PathListDirectoryRequestBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_path(flatbuffers::Offset<flatbuffers::String> path) {
+    fbb_.AddOffset(PathListDirectoryRequest::VT_PATH, path);
+  }
+  PathListDirectoryRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  PathListDirectoryRequestBuilder &operator=(const PathListDirectoryRequestBuilder &);
+  flatbuffers::Offset<PathListDirectoryRequest> Finish() {
+    const auto end = fbb_.EndTable(start_, 1);
+    auto o = flatbuffers::Offset<PathListDirectoryRequest>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<PathListDirectoryRequest> CreatePathListDirectoryRequest(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::String> path = 0) {
+  PathListDirectoryRequestBuilder builder_(_fbb);
+  builder_.add_path(path);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<PathListDirectoryRequest> CreatePathListDirectoryRequestDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const char *path = nullptr) {
+  return mbtool::daemon::v3::CreatePathListDirectoryRequest(
+      _fbb,
+      path ? _fbb.CreateString(path) : 0);
+}
+
+struct PathListDirectoryResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_ENTRIES = 4,
+    VT_ERROR = 6
+  };
+  const flatbuffers::Vector<flatbuffers::Offset<PathListDirectoryEntry>> *entries() const {
+    return GetPointer<const flatbuffers::Vector<flatbuffers::Offset<PathListDirectoryEntry>> *>(VT_ENTRIES);
+  }
+  const PathListDirectoryError *error() const {
+    return GetPointer<const PathListDirectoryError *>(VT_ERROR);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_ENTRIES) &&
+           verifier.Verify(entries()) &&
+           verifier.VerifyVectorOfTables(entries()) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_ERROR) &&
+           verifier.VerifyTable(error()) &&
+           verifier.EndTable();
+  }
+};
+
+struct PathListDirectoryResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_entries(flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<PathListDirectoryEntry>>> entries) {
+    fbb_.AddOffset(PathListDirectoryResponse::VT_ENTRIES, entries);
+  }
+  void add_error(flatbuffers::Offset<PathListDirectoryError> error) {
+    fbb_.AddOffset(PathListDirectoryResponse::VT_ERROR, error);
+  }
+  PathListDirectoryResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  PathListDirectoryResponseBuilder &operator=(const PathListDirectoryResponseBuilder &);
+  flatbuffers::Offset<PathListDirectoryResponse> Finish() {
+    const auto end = fbb_.EndTable(start_, 2);
+    auto o = flatbuffers::Offset<PathListDirectoryResponse>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<PathListDirectoryResponse> CreatePathListDirectoryResponse(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<PathListDirectoryEntry>>> entries = 0,
+    flatbuffers::Offset<PathListDirectoryError> error = 0) {
+  PathListDirectoryResponseBuilder builder_(_fbb);
+  builder_.add_error(error);
+  builder_.add_entries(entries);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<PathListDirectoryResponse> CreatePathListDirectoryResponseDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const std::vector<flatbuffers::Offset<PathListDirectoryEntry>> *entries = nullptr,
+    flatbuffers::Offset<PathListDirectoryError> error = 0) {
+  return mbtool::daemon::v3::CreatePathListDirectoryResponse(
+      _fbb,
+      entries ? _fbb.CreateVector<flatbuffers::Offset<PathListDirectoryEntry>>(*entries) : 0,
+      error);
+}
+
+}  // namespace v3
+}  // namespace daemon
+}  // namespace mbtool
+
+#endif  // FLATBUFFERS_GENERATED_PATHLISTDIRECTORY_MBTOOL_DAEMON_V3_H_
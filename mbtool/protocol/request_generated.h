@@ -10,7 +10,10 @@
 #include "crypto_get_pw_type_generated.h"
 #include "file_chmod_generated.h"
 #include "file_close_generated.h"
+#include "file_copy_range_generated.h"
+#include "file_hash_generated.h"
 #include "file_open_generated.h"
+#include "file_open_fd_generated.h"
 #include "file_read_generated.h"
 #include "file_seek_generated.h"
 #include "file_selinux_get_label_generated.h"
@@ -20,6 +23,7 @@
 #include "mb_get_booted_rom_id_generated.h"
 #include "mb_get_installed_roms_generated.h"
 #include "mb_get_packages_count_generated.h"
+#include "mb_get_stats_generated.h"
 #include "mb_get_version_generated.h"
 #include "mb_set_kernel_generated.h"
 #include "mb_switch_rom_generated.h"
@@ -28,6 +32,7 @@
 #include "path_copy_generated.h"
 #include "path_delete_generated.h"
 #include "path_get_directory_size_generated.h"
+#include "path_list_directory_generated.h"
 #include "path_mkdir_generated.h"
 #include "path_readlink_generated.h"
 #include "path_selinux_get_label_generated.h"
@@ -73,8 +78,13 @@ enum RequestType {
   RequestType_CryptoDecryptRequest = 27,
   RequestType_CryptoGetPwTypeRequest = 28,
   RequestType_PathReadlinkRequest = 29,
+  RequestType_FileOpenFdRequest = 30,
+  RequestType_PathListDirectoryRequest = 31,
+  RequestType_MbGetStatsRequest = 32,
+  RequestType_FileCopyRangeRequest = 33,
+  RequestType_FileHashRequest = 34,
   RequestType_MIN = RequestType_NONE,
-  RequestType_MAX = RequestType_PathReadlinkRequest
+  RequestType_MAX = RequestType_FileHashRequest
 };
 
 inline const char **EnumNamesRequestType() {
@@ -109,6 +119,11 @@ inline const char **EnumNamesRequestType() {
     "CryptoDecryptRequest",
     "CryptoGetPwTypeRequest",
     "PathReadlinkRequest",
+    "FileOpenFdRequest",
+    "PathListDirectoryRequest",
+    "MbGetStatsRequest",
+    "FileCopyRangeRequest",
+    "FileHashRequest",
     nullptr
   };
   return names;
@@ -239,13 +254,34 @@ template<> struct RequestTypeTraits<mbtool::daemon::v3::PathReadlinkRequest> {
   static const RequestType enum_value = RequestType_PathReadlinkRequest;
 };
 
+template<> struct RequestTypeTraits<mbtool::daemon::v3::FileOpenFdRequest> {
+  static const RequestType enum_value = RequestType_FileOpenFdRequest;
+};
+
+template<> struct RequestTypeTraits<mbtool::daemon::v3::PathListDirectoryRequest> {
+  static const RequestType enum_value = RequestType_PathListDirectoryRequest;
+};
+
+template<> struct RequestTypeTraits<mbtool::daemon::v3::MbGetStatsRequest> {
+  static const RequestType enum_value = RequestType_MbGetStatsRequest;
+};
+
+template<> struct RequestTypeTraits<mbtool::daemon::v3::FileCopyRangeRequest> {
+  static const RequestType enum_value = RequestType_FileCopyRangeRequest;
+};
+
+template<> struct RequestTypeTraits<mbtool::daemon::v3::FileHashRequest> {
+  static const RequestType enum_value = RequestType_FileHashRequest;
+};
+
 bool VerifyRequestType(flatbuffers::Verifier &verifier, const void *obj, RequestType type);
 bool VerifyRequestTypeVector(flatbuffers::Verifier &verifier, const flatbuffers::Vector<flatbuffers::Offset<void>> *values, const flatbuffers::Vector<uint8_t> *types);
 
 struct Request FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   enum {
     VT_REQUEST_TYPE = 4,
-    VT_REQUEST = 6
+    VT_REQUEST = 6,
+    VT_REQUEST_ID = 8
   };
   RequestType request_type() const {
     return static_cast<RequestType>(GetField<uint8_t>(VT_REQUEST_TYPE, 0));
@@ -253,11 +289,15 @@ struct Request FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   const void *request() const {
     return GetPointer<const void *>(VT_REQUEST);
   }
+  uint32_t request_id() const {
+    return GetField<uint32_t>(VT_REQUEST_ID, 0);
+  }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<uint8_t>(verifier, VT_REQUEST_TYPE) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_REQUEST) &&
            VerifyRequestType(verifier, request(), request_type()) &&
+           VerifyField<uint32_t>(verifier, VT_REQUEST_ID) &&
            verifier.EndTable();
   }
 };
@@ -271,13 +311,16 @@ struct RequestBuilder {
   void add_request(flatbuffers::Offset<void> request) {
     fbb_.AddOffset(Request::VT_REQUEST, request);
   }
+  void add_request_id(uint32_t request_id) {
+    fbb_.AddElement<uint32_t>(Request::VT_REQUEST_ID, request_id, 0);
+  }
   RequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
         : fbb_(_fbb) {
     start_ = fbb_.StartTable();
   }
   RequestBuilder &operator=(const RequestBuilder &);
   flatbuffers::Offset<Request> Finish() {
-    const auto end = fbb_.EndTable(start_, 2);
+    const auto end = fbb_.EndTable(start_, 3);
     auto o = flatbuffers::Offset<Request>(end);
     return o;
   }
@@ -286,8 +329,10 @@ struct RequestBuilder {
 inline flatbuffers::Offset<Request> CreateRequest(
     flatbuffers::FlatBufferBuilder &_fbb,
     RequestType request_type = RequestType_NONE,
-    flatbuffers::Offset<void> request = 0) {
+    flatbuffers::Offset<void> request = 0,
+    uint32_t request_id = 0) {
   RequestBuilder builder_(_fbb);
+  builder_.add_request_id(request_id);
   builder_.add_request(request);
   builder_.add_request_type(request_type);
   return builder_.Finish();
@@ -414,6 +459,26 @@ inline bool VerifyRequestType(flatbuffers::Verifier &verifier, const void *obj,
       auto ptr = reinterpret_cast<const mbtool::daemon::v3::PathReadlinkRequest *>(obj);
       return verifier.VerifyTable(ptr);
     }
+    case RequestType_FileOpenFdRequest: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::FileOpenFdRequest *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case RequestType_PathListDirectoryRequest: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::PathListDirectoryRequest *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case RequestType_MbGetStatsRequest: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::MbGetStatsRequest *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case RequestType_FileCopyRangeRequest: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::FileCopyRangeRequest *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case RequestType_FileHashRequest: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::FileHashRequest *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
     default: return false;
   }
 }
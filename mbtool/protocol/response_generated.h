@@ -10,7 +10,10 @@
 #include "crypto_get_pw_type_generated.h"
 #include "file_chmod_generated.h"
 #include "file_close_generated.h"
+#include "file_copy_range_generated.h"
+#include "file_hash_generated.h"
 #include "file_open_generated.h"
+#include "file_open_fd_generated.h"
 #include "file_read_generated.h"
 #include "file_seek_generated.h"
 #include "file_selinux_get_label_generated.h"
@@ -20,6 +23,7 @@
 #include "mb_get_booted_rom_id_generated.h"
 #include "mb_get_installed_roms_generated.h"
 #include "mb_get_packages_count_generated.h"
+#include "mb_get_stats_generated.h"
 #include "mb_get_version_generated.h"
 #include "mb_set_kernel_generated.h"
 #include "mb_switch_rom_generated.h"
@@ -28,6 +32,7 @@
 #include "path_copy_generated.h"
 #include "path_delete_generated.h"
 #include "path_get_directory_size_generated.h"
+#include "path_list_directory_generated.h"
 #include "path_mkdir_generated.h"
 #include "path_readlink_generated.h"
 #include "path_selinux_get_label_generated.h"
@@ -80,8 +85,13 @@ enum ResponseType {
   ResponseType_CryptoDecryptResponse = 30,
   ResponseType_CryptoGetPwTypeResponse = 31,
   ResponseType_PathReadlinkResponse = 32,
+  ResponseType_FileOpenFdResponse = 33,
+  ResponseType_PathListDirectoryResponse = 34,
+  ResponseType_MbGetStatsResponse = 35,
+  ResponseType_FileCopyRangeResponse = 36,
+  ResponseType_FileHashResponse = 37,
   ResponseType_MIN = ResponseType_NONE,
-  ResponseType_MAX = ResponseType_PathReadlinkResponse
+  ResponseType_MAX = ResponseType_FileHashResponse
 };
 
 inline const char **EnumNamesResponseType() {
@@ -119,6 +129,11 @@ inline const char **EnumNamesResponseType() {
     "CryptoDecryptResponse",
     "CryptoGetPwTypeResponse",
     "PathReadlinkResponse",
+    "FileOpenFdResponse",
+    "PathListDirectoryResponse",
+    "MbGetStatsResponse",
+    "FileCopyRangeResponse",
+    "FileHashResponse",
     nullptr
   };
   return names;
@@ -261,6 +276,26 @@ template<> struct ResponseTypeTraits<mbtool::daemon::v3::PathReadlinkResponse> {
   static const ResponseType enum_value = ResponseType_PathReadlinkResponse;
 };
 
+template<> struct ResponseTypeTraits<mbtool::daemon::v3::FileOpenFdResponse> {
+  static const ResponseType enum_value = ResponseType_FileOpenFdResponse;
+};
+
+template<> struct ResponseTypeTraits<mbtool::daemon::v3::PathListDirectoryResponse> {
+  static const ResponseType enum_value = ResponseType_PathListDirectoryResponse;
+};
+
+template<> struct ResponseTypeTraits<mbtool::daemon::v3::MbGetStatsResponse> {
+  static const ResponseType enum_value = ResponseType_MbGetStatsResponse;
+};
+
+template<> struct ResponseTypeTraits<mbtool::daemon::v3::FileCopyRangeResponse> {
+  static const ResponseType enum_value = ResponseType_FileCopyRangeResponse;
+};
+
+template<> struct ResponseTypeTraits<mbtool::daemon::v3::FileHashResponse> {
+  static const ResponseType enum_value = ResponseType_FileHashResponse;
+};
+
 bool VerifyResponseType(flatbuffers::Verifier &verifier, const void *obj, ResponseType type);
 bool VerifyResponseTypeVector(flatbuffers::Verifier &verifier, const flatbuffers::Vector<flatbuffers::Offset<void>> *values, const flatbuffers::Vector<uint8_t> *types);
 
@@ -323,7 +358,8 @@ inline flatbuffers::Offset<Unsupported> CreateUnsupported(
 struct Response FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   enum {
     VT_RESPONSE_TYPE = 4,
-    VT_RESPONSE = 6
+    VT_RESPONSE = 6,
+    VT_REQUEST_ID = 8
   };
   ResponseType response_type() const {
     return static_cast<ResponseType>(GetField<uint8_t>(VT_RESPONSE_TYPE, 0));
@@ -331,11 +367,15 @@ struct Response FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   const void *response() const {
     return GetPointer<const void *>(VT_RESPONSE);
   }
+  uint32_t request_id() const {
+    return GetField<uint32_t>(VT_REQUEST_ID, 0);
+  }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<uint8_t>(verifier, VT_RESPONSE_TYPE) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_RESPONSE) &&
            VerifyResponseType(verifier, response(), response_type()) &&
+           VerifyField<uint32_t>(verifier, VT_REQUEST_ID) &&
            verifier.EndTable();
   }
 };
@@ -349,13 +389,16 @@ struct ResponseBuilder {
   void add_response(flatbuffers::Offset<void> response) {
     fbb_.AddOffset(Response::VT_RESPONSE, response);
   }
+  void add_request_id(uint32_t request_id) {
+    fbb_.AddElement<uint32_t>(Response::VT_REQUEST_ID, request_id, 0);
+  }
   ResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
         : fbb_(_fbb) {
     start_ = fbb_.StartTable();
   }
   ResponseBuilder &operator=(const ResponseBuilder &);
   flatbuffers::Offset<Response> Finish() {
-    const auto end = fbb_.EndTable(start_, 2);
+    const auto end = fbb_.EndTable(start_, 3);
     auto o = flatbuffers::Offset<Response>(end);
     return o;
   }
@@ -364,8 +407,10 @@ struct ResponseBuilder {
 inline flatbuffers::Offset<Response> CreateResponse(
     flatbuffers::FlatBufferBuilder &_fbb,
     ResponseType response_type = ResponseType_NONE,
-    flatbuffers::Offset<void> response = 0) {
+    flatbuffers::Offset<void> response = 0,
+    uint32_t request_id = 0) {
   ResponseBuilder builder_(_fbb);
+  builder_.add_request_id(request_id);
   builder_.add_response(response);
   builder_.add_response_type(response_type);
   return builder_.Finish();
@@ -504,6 +549,26 @@ inline bool VerifyResponseType(flatbuffers::Verifier &verifier, const void *obj,
       auto ptr = reinterpret_cast<const mbtool::daemon::v3::PathReadlinkResponse *>(obj);
       return verifier.VerifyTable(ptr);
     }
+    case ResponseType_FileOpenFdResponse: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::FileOpenFdResponse *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case ResponseType_PathListDirectoryResponse: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::PathListDirectoryResponse *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case ResponseType_MbGetStatsResponse: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::MbGetStatsResponse *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case ResponseType_FileCopyRangeResponse: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::FileCopyRangeResponse *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case ResponseType_FileHashResponse: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::FileHashResponse *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
     default: return false;
   }
 }
@@ -97,7 +97,9 @@ struct SignedExecRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
     VT_BINARY_PATH = 4,
     VT_SIGNATURE_PATH = 6,
     VT_ARGS = 8,
-    VT_ARG0 = 10
+    VT_ARG0 = 10,
+    VT_STREAM_FD = 12,
+    VT_BACKGROUND = 14
   };
   const flatbuffers::String *binary_path() const {
     return GetPointer<const flatbuffers::String *>(VT_BINARY_PATH);
@@ -111,6 +113,12 @@ struct SignedExecRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   const flatbuffers::String *arg0() const {
     return GetPointer<const flatbuffers::String *>(VT_ARG0);
   }
+  bool stream_fd() const {
+    return GetField<uint8_t>(VT_STREAM_FD, 0) != 0;
+  }
+  bool background() const {
+    return GetField<uint8_t>(VT_BACKGROUND, 0) != 0;
+  }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_BINARY_PATH) &&
@@ -122,6 +130,8 @@ struct SignedExecRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
            verifier.VerifyVectorOfStrings(args()) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_ARG0) &&
            verifier.Verify(arg0()) &&
+           VerifyField<uint8_t>(verifier, VT_STREAM_FD) &&
+           VerifyField<uint8_t>(verifier, VT_BACKGROUND) &&
            verifier.EndTable();
   }
 };
@@ -141,13 +151,19 @@ struct SignedExecRequestBuilder {
   void add_arg0(flatbuffers::Offset<flatbuffers::String> arg0) {
     fbb_.AddOffset(SignedExecRequest::VT_ARG0, arg0);
   }
+  void add_stream_fd(bool stream_fd) {
+    fbb_.AddElement<uint8_t>(SignedExecRequest::VT_STREAM_FD, static_cast<uint8_t>(stream_fd), 0);
+  }
+  void add_background(bool background) {
+    fbb_.AddElement<uint8_t>(SignedExecRequest::VT_BACKGROUND, static_cast<uint8_t>(background), 0);
+  }
   SignedExecRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
         : fbb_(_fbb) {
     start_ = fbb_.StartTable();
   }
   SignedExecRequestBuilder &operator=(const SignedExecRequestBuilder &);
   flatbuffers::Offset<SignedExecRequest> Finish() {
-    const auto end = fbb_.EndTable(start_, 4);
+    const auto end = fbb_.EndTable(start_, 6);
     auto o = flatbuffers::Offset<SignedExecRequest>(end);
     return o;
   }
@@ -158,12 +174,16 @@ inline flatbuffers::Offset<SignedExecRequest> CreateSignedExecRequest(
     flatbuffers::Offset<flatbuffers::String> binary_path = 0,
     flatbuffers::Offset<flatbuffers::String> signature_path = 0,
     flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<flatbuffers::String>>> args = 0,
-    flatbuffers::Offset<flatbuffers::String> arg0 = 0) {
+    flatbuffers::Offset<flatbuffers::String> arg0 = 0,
+    bool stream_fd = false,
+    bool background = false) {
   SignedExecRequestBuilder builder_(_fbb);
   builder_.add_arg0(arg0);
   builder_.add_args(args);
   builder_.add_signature_path(signature_path);
   builder_.add_binary_path(binary_path);
+  builder_.add_background(background);
+  builder_.add_stream_fd(stream_fd);
   return builder_.Finish();
 }
 
@@ -172,26 +192,35 @@ inline flatbuffers::Offset<SignedExecRequest> CreateSignedExecRequestDirect(
     const char *binary_path = nullptr,
     const char *signature_path = nullptr,
     const std::vector<flatbuffers::Offset<flatbuffers::String>> *args = nullptr,
-    const char *arg0 = nullptr) {
+    const char *arg0 = nullptr,
+    bool stream_fd = false,
+    bool background = false) {
   return mbtool::daemon::v3::CreateSignedExecRequest(
       _fbb,
       binary_path ? _fbb.CreateString(binary_path) : 0,
       signature_path ? _fbb.CreateString(signature_path) : 0,
       args ? _fbb.CreateVector<flatbuffers::Offset<flatbuffers::String>>(*args) : 0,
-      arg0 ? _fbb.CreateString(arg0) : 0);
+      arg0 ? _fbb.CreateString(arg0) : 0,
+      stream_fd,
+      background);
 }
 
 struct SignedExecOutputResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   enum {
-    VT_LINE = 4
+    VT_LINE = 4,
+    VT_STREAM_FD = 6
   };
   const flatbuffers::String *line() const {
     return GetPointer<const flatbuffers::String *>(VT_LINE);
   }
+  bool stream_fd() const {
+    return GetField<uint8_t>(VT_STREAM_FD, 0) != 0;
+  }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_LINE) &&
            verifier.Verify(line()) &&
+           VerifyField<uint8_t>(verifier, VT_STREAM_FD) &&
            verifier.EndTable();
   }
 };
@@ -202,13 +231,16 @@ struct SignedExecOutputResponseBuilder {
   void add_line(flatbuffers::Offset<flatbuffers::String> line) {
     fbb_.AddOffset(SignedExecOutputResponse::VT_LINE, line);
   }
+  void add_stream_fd(bool stream_fd) {
+    fbb_.AddElement<uint8_t>(SignedExecOutputResponse::VT_STREAM_FD, static_cast<uint8_t>(stream_fd), 0);
+  }
   SignedExecOutputResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
         : fbb_(_fbb) {
     start_ = fbb_.StartTable();
   }
   SignedExecOutputResponseBuilder &operator=(const SignedExecOutputResponseBuilder &);
   flatbuffers::Offset<SignedExecOutputResponse> Finish() {
-    const auto end = fbb_.EndTable(start_, 1);
+    const auto end = fbb_.EndTable(start_, 2);
     auto o = flatbuffers::Offset<SignedExecOutputResponse>(end);
     return o;
   }
@@ -216,18 +248,22 @@ struct SignedExecOutputResponseBuilder {
 
 inline flatbuffers::Offset<SignedExecOutputResponse> CreateSignedExecOutputResponse(
     flatbuffers::FlatBufferBuilder &_fbb,
-    flatbuffers::Offset<flatbuffers::String> line = 0) {
+    flatbuffers::Offset<flatbuffers::String> line = 0,
+    bool stream_fd = false) {
   SignedExecOutputResponseBuilder builder_(_fbb);
   builder_.add_line(line);
+  builder_.add_stream_fd(stream_fd);
   return builder_.Finish();
 }
 
 inline flatbuffers::Offset<SignedExecOutputResponse> CreateSignedExecOutputResponseDirect(
     flatbuffers::FlatBufferBuilder &_fbb,
-    const char *line = nullptr) {
+    const char *line = nullptr,
+    bool stream_fd = false) {
   return mbtool::daemon::v3::CreateSignedExecOutputResponse(
       _fbb,
-      line ? _fbb.CreateString(line) : 0);
+      line ? _fbb.CreateString(line) : 0,
+      stream_fd);
 }
 
 struct SignedExecResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
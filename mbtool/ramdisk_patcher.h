@@ -21,12 +21,13 @@
 
 #include <functional>
 #include <string>
-//#include <vector>
+
+#include "cpio_archive.h"
 
 namespace mb
 {
 
-typedef bool (RamdiskPatcherFn)(const std::string &dir);
+typedef bool (RamdiskPatcherFn)(CpioArchive &cpio);
 
 std::function<RamdiskPatcherFn>
 rp_write_rom_id(const std::string &rom_id);
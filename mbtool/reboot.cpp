@@ -49,6 +49,8 @@ bool reboot_via_init(const std::string &reboot_arg)
 
 bool reboot_directly(const std::string &reboot_arg)
 {
+    log::log_flush();
+
     if (!util::reboot_via_syscall(reboot_arg.c_str())) {
         return false;
     }
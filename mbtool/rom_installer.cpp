@@ -40,11 +40,12 @@
 #include "mbutil/copy.h"
 #include "mbutil/file.h"
 #include "mbutil/finally.h"
+#include "mbutil/integer.h"
 #include "mbutil/properties.h"
+#include "mbutil/sched_policy.h"
 #include "mbutil/selinux.h"
 #include "mbutil/string.h"
 
-#include "archive_util.h"
 #include "bootimg_util.h"
 #include "installer.h"
 #include "multiboot.h"
@@ -65,6 +66,7 @@ public:
     RomInstaller(std::string zip_file, std::string rom_id, std::FILE *log_fp,
                  int flags);
 
+    using Installer::display_msg;
     virtual void display_msg(const std::string& msg) override;
     virtual void updater_print(const std::string &msg) override;
     virtual void command_output(const std::string &line) override;
@@ -225,7 +227,7 @@ Installer::ProceedState RomInstaller::on_checked_device()
 
 Installer::ProceedState RomInstaller::on_pre_install()
 {
-    if (is_aroma(_temp + "/updater")) {
+    if (updater_is_aroma(_temp + "/updater")) {
         display_msg("ZIP files using the AROMA installer can only be flashed "
                     "from recovery");
         return ProceedState::Cancel;
@@ -275,6 +277,11 @@ void RomInstaller::on_cleanup(Installer::ProceedState ret)
 {
     (void) ret;
 
+    InstallerStageStats total = _stats.totals();
+    display_msg("Install stages took %.1f seconds and wrote %.1f MiB",
+                total.elapsed_us / 1000000.0,
+                total.storage_written / 1024.0 / 1024.0);
+
     display_msg("The log file was saved as MultiBoot.log on the "
                 "internal storage.");
 }
@@ -371,7 +378,8 @@ bool RomInstaller::extract_ramdisk_fd(int fd, const std::string &output_dir,
     archive_read_support_filter_xz(in.get());
     archive_read_support_format_cpio(in.get());
 
-    if (archive_read_open_fd(in.get(), fd, 10240) != ARCHIVE_OK) {
+    if (archive_read_open_fd(in.get(), fd, LIBARCHIVE_READ_BLOCK_SIZE)
+            != ARCHIVE_OK) {
         LOGE("Failed to open archive: %s", archive_error_string(in.get()));
         return false;
     }
@@ -414,7 +422,8 @@ bool RomInstaller::extract_ramdisk_fd(int fd, const std::string &output_dir,
                     close(tmpfd);
                 });
 
-                return la_copy_data_to_fd(in.get(), tmpfd)
+                return util::libarchive_copy_data_to_fd(
+                                in.get(), entry, tmpfd, 0)
                         && extract_ramdisk_fd(tmpfd, output_dir, false);
             }
         } else {
@@ -464,7 +473,11 @@ static void rom_installer_usage(bool error)
             "  -r, --romid        ROM install type/ID (primary, dual, etc.)\n"
             "  -h, --help         Display this help message\n"
             "  --skip-mount       Skip filesystem mounting stage\n"
-            "  --allow-overwrite  Allow overwriting current ROM\n");
+            "  --allow-overwrite  Allow overwriting current ROM\n"
+            "  --sched <policy>   CPU and I/O scheduling policy (foreground,\n"
+            "                     background)\n"
+            "  --io-limit <bytes per second>\n"
+            "                     Maximum rate at which data is written\n");
 }
 
 int rom_installer_main(int argc, char *argv[])
@@ -487,12 +500,16 @@ int rom_installer_main(int argc, char *argv[])
     std::string zip_file;
     int flags = 0;
     bool allow_overwrite = false;
+    util::SchedPolicy sched_policy;
+    bool have_sched = false;
 
     int opt;
 
     enum options : int {
         OPTION_SKIP_MOUNT       = CHAR_MAX + 1,
         OPTION_ALLOW_OVERWRITE  = CHAR_MAX + 2,
+        OPTION_SCHED            = CHAR_MAX + 3,
+        OPTION_IO_LIMIT         = CHAR_MAX + 4,
     };
 
     static struct option long_options[] = {
@@ -500,6 +517,8 @@ int rom_installer_main(int argc, char *argv[])
         {"help",            no_argument,       0, 'h'},
         {"skip-mount",      no_argument,       0, OPTION_SKIP_MOUNT},
         {"allow-overwrite", no_argument,       0, OPTION_ALLOW_OVERWRITE},
+        {"sched",           required_argument, 0, OPTION_SCHED},
+        {"io-limit",        required_argument, 0, OPTION_IO_LIMIT},
         {0, 0, 0, 0}
     };
 
@@ -526,6 +545,27 @@ int rom_installer_main(int argc, char *argv[])
             allow_overwrite = true;
             break;
 
+        case OPTION_SCHED: {
+            util::SchedPreset preset;
+            if (!util::parse_sched_preset(optarg, preset)) {
+                fprintf(stderr, "Invalid scheduling policy: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            uint64_t write_limit = sched_policy.write_limit;
+            sched_policy = util::sched_policy_preset(preset);
+            sched_policy.write_limit = write_limit;
+            have_sched = true;
+            break;
+        }
+
+        case OPTION_IO_LIMIT:
+            if (!util::str_to_unum(optarg, 10, &sched_policy.write_limit)
+                    || sched_policy.write_limit == 0) {
+                fprintf(stderr, "Invalid I/O limit: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
         default:
             rom_installer_usage(true);
             return EXIT_FAILURE;
@@ -574,6 +614,15 @@ int rom_installer_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    if (have_sched) {
+        if (!util::apply_process_sched_policy(sched_policy)) {
+            fprintf(stderr, "WARNING: Failed to fully apply scheduling"
+                    " policy\n");
+        }
+    } else if (sched_policy.write_limit != 0) {
+        util::set_write_limit(sched_policy.write_limit);
+    }
+
     if (mount("", "/", "", MS_REMOUNT, "") < 0) {
         fprintf(stderr, "Failed to remount / as writable\n");
         return EXIT_FAILURE;
@@ -31,6 +31,7 @@
 #define CONFIG_KEY_PACKAGES                "packages"
 #define CONFIG_KEY_PACKAGE_ID              "pkg_id"
 #define CONFIG_KEY_SHARE_DATA              "share_data"
+#define CONFIG_KEY_LOOP_DIRECT_IO          "loop_direct_io"
 
 namespace mb {
 
@@ -40,6 +41,7 @@ namespace mb {
  * {
  *     "id": "primary",
  *     "name": "TouchWiz 5.0",
+ *     "loop_direct_io": true,
  *     "app_sharing": {
  *         "individual": true
  *         "packages": [
@@ -94,6 +96,16 @@ bool RomConfig::load_file(const std::string &path)
         name = json_string_value(j_name);
     }
 
+    // Direct I/O for image-based partitions
+    json_t *j_loop_direct_io = json_object_get(root, CONFIG_KEY_LOOP_DIRECT_IO);
+    if (j_loop_direct_io) {
+        if (!json_is_boolean(j_loop_direct_io)) {
+            LOGE("[root]->loop_direct_io: Not a boolean");
+            return false;
+        }
+        loop_direct_io = json_is_true(j_loop_direct_io);
+    }
+
     // App sharing
     json_t *j_app_sharing = json_object_get(root, CONFIG_KEY_APP_SHARING);
     if (j_app_sharing) {
@@ -37,6 +37,8 @@ struct RomConfig
     std::string name;
     bool indiv_app_sharing = false;
     std::vector<SharedPackage> shared_pkgs;
+    // Attach image-based partitions with direct I/O
+    bool loop_direct_io = false;
 
     bool load_file(const std::string &path);
 };
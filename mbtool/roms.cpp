@@ -20,18 +20,25 @@
 #include "roms.h"
 
 #include <algorithm>
+#include <mutex>
 
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 #include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
+#include <unistd.h>
 
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
 #include "mbutil/autoclose/file.h"
 #include "mbutil/finally.h"
 #include "mbutil/mount.h"
+#include "mbutil/path.h"
 #include "mbutil/properties.h"
 #include "mbutil/string.h"
 
@@ -39,7 +46,8 @@
 
 #define BUILD_PROP "build.prop"
 
-static std::vector<std::string> extsd_mount_points{
+// Plain array so that no static constructor runs on every mbtool invocation
+static const char *extsd_mount_points[] = {
     "/raw/extsd",
     "/external_sd",
     "/external_sdcard",
@@ -48,7 +56,7 @@ static std::vector<std::string> extsd_mount_points{
     "/storage/sdcard1",
     "/storage/extSdCard",
     "/storage/external_SD",
-    "/storage/MicroSD"
+    "/storage/MicroSD",
 };
 
 namespace mb
@@ -288,7 +296,7 @@ void Roms::add_extsd_roms()
     std::move(temp_roms.begin(), temp_roms.end(), std::back_inserter(roms));
 }
 
-void Roms::add_installed()
+void Roms::scan_installed(std::vector<std::string> *watch_paths)
 {
     Roms all_roms;
     all_roms.add_builtin();
@@ -297,10 +305,31 @@ void Roms::add_installed()
 
     struct stat sb;
 
+    if (watch_paths) {
+        // Directories whose entries determine the set of candidate ROMs
+        watch_paths->push_back(get_raw_path("/data/multiboot"));
+        watch_paths->push_back(get_raw_path(MULTIBOOT_DIR));
+
+        std::string extsd = get_extsd_partition();
+        if (!extsd.empty()) {
+            watch_paths->push_back(extsd + "/multiboot");
+        }
+    }
+
     for (auto rom : all_roms.roms) {
         std::string boot_path = get_raw_path(rom->boot_image_path());
         std::string system_path = rom->full_system_path();
 
+        if (watch_paths) {
+            // Directories containing the files checked below
+            watch_paths->push_back(util::dir_name(boot_path));
+            if (rom->system_is_image) {
+                watch_paths->push_back(util::dir_name(system_path));
+            } else if (!system_path.empty()) {
+                watch_paths->push_back(system_path);
+            }
+        }
+
         if (stat(boot_path.c_str(), &sb) == 0) {
             // If boot image exists, assume that the ROM is installed
             roms.push_back(rom);
@@ -321,6 +350,171 @@ void Roms::add_installed()
     }
 }
 
+/*!
+ * \brief Process-wide cache of the installed ROMs
+ *
+ * The snapshot is invalidated when:
+ * - an inotify watch on a directory consulted by Roms::scan_installed()
+ *   reports an entry being created, deleted, or renamed
+ * - the mount table changes (eg. the external SD card is mounted)
+ * - the process forks (the inotify fd would be shared with the parent)
+ */
+class InstalledRomCache
+{
+public:
+    InstalledRomCache()
+        : _pid(-1)
+        , _inotify_fd(-1)
+        , _mounts_fd(-1)
+    {
+    }
+
+    ~InstalledRomCache()
+    {
+        reset();
+    }
+
+    std::shared_ptr<const Roms> get()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        if (_pid != getpid()) {
+            reset();
+            _pid = getpid();
+        }
+
+        if (_snapshot && changed()) {
+            _snapshot.reset();
+        }
+
+        if (!_snapshot) {
+            rebuild();
+        }
+
+        return _snapshot;
+    }
+
+private:
+    void reset()
+    {
+        if (_inotify_fd >= 0) {
+            close(_inotify_fd);
+            _inotify_fd = -1;
+        }
+        if (_mounts_fd >= 0) {
+            close(_mounts_fd);
+            _mounts_fd = -1;
+        }
+        _snapshot.reset();
+    }
+
+    bool changed()
+    {
+        // If the watches could not be set up, the snapshot is never reused
+        if (_inotify_fd < 0 || _mounts_fd < 0) {
+            return true;
+        }
+
+        struct pollfd fds[2];
+        fds[0].fd = _inotify_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = _mounts_fd;
+        fds[1].events = POLLPRI;
+
+        int ret = poll(fds, 2, 0);
+        if (ret < 0) {
+            return true;
+        }
+
+        return ret > 0;
+    }
+
+    void rebuild()
+    {
+        // Start with fresh watches. The set of directories depends on the
+        // candidate ROMs, so it's simpler to recreate everything than to
+        // track individual watch descriptors.
+        reset();
+
+        _inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (_inotify_fd < 0) {
+            LOGW("Failed to initialize inotify: %s", strerror(errno));
+        }
+
+        // The mounts file reports POLLPRI whenever the mount table of the
+        // process' namespace changes. The first poll() sets the baseline.
+        _mounts_fd = open("/proc/self/mounts", O_RDONLY | O_CLOEXEC);
+        if (_mounts_fd < 0) {
+            LOGW("%s: Failed to open: %s", "/proc/self/mounts",
+                 strerror(errno));
+        } else {
+            struct pollfd pfd;
+            pfd.fd = _mounts_fd;
+            pfd.events = POLLPRI;
+            poll(&pfd, 1, 0);
+        }
+
+        std::vector<std::string> watch_paths;
+        std::shared_ptr<Roms> roms = std::make_shared<Roms>();
+        roms->scan_installed(_inotify_fd >= 0 ? &watch_paths : nullptr);
+
+        if (_inotify_fd >= 0) {
+            std::sort(watch_paths.begin(), watch_paths.end());
+            watch_paths.erase(std::unique(watch_paths.begin(),
+                                          watch_paths.end()),
+                              watch_paths.end());
+
+            for (auto const &path : watch_paths) {
+                add_watch(path);
+            }
+        }
+
+        _snapshot = std::move(roms);
+    }
+
+    void add_watch(const std::string &path)
+    {
+        static constexpr uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM
+                | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+        if (path.empty()) {
+            return;
+        }
+
+        if (inotify_add_watch(_inotify_fd, path.c_str(), mask) >= 0) {
+            return;
+        }
+
+        // If the directory doesn't exist yet, watch its parent so that its
+        // creation is noticed
+        if (errno == ENOENT || errno == ENOTDIR) {
+            std::string parent = util::dir_name(path);
+            if (!parent.empty() && parent != path) {
+                inotify_add_watch(_inotify_fd, parent.c_str(), mask);
+            }
+        }
+    }
+
+    std::mutex _mutex;
+    pid_t _pid;
+    int _inotify_fd;
+    int _mounts_fd;
+    std::shared_ptr<const Roms> _snapshot;
+};
+
+static InstalledRomCache installed_rom_cache;
+
+void Roms::add_installed()
+{
+    auto snapshot = get_installed();
+    roms.insert(roms.end(), snapshot->roms.begin(), snapshot->roms.end());
+}
+
+std::shared_ptr<const Roms> Roms::get_installed()
+{
+    return installed_rom_cache.get();
+}
+
 std::shared_ptr<Rom> Roms::find_by_id(const std::string &id) const
 {
     for (auto r : roms) {
@@ -334,8 +528,8 @@ std::shared_ptr<Rom> Roms::find_by_id(const std::string &id) const
 
 std::shared_ptr<Rom> Roms::get_current_rom()
 {
-    Roms roms;
-    roms.add_installed();
+    auto snapshot = get_installed();
+    const Roms &roms = *snapshot;
 
     // This is set if mbtool is handling the boot process
     std::string prop_id = util::property_get_string(PROP_MULTIBOOT_ROM_ID, {});
@@ -473,8 +667,8 @@ std::string Roms::get_extsd_partition()
 {
     // Try hard-coded mount points first
     struct stat sb;
-    for (const std::string &mount_point : extsd_mount_points) {
-        if (stat(mount_point.c_str(), &sb) == 0) {
+    for (const char *mount_point : extsd_mount_points) {
+        if (stat(mount_point, &sb) == 0) {
             if (util::is_mounted(mount_point)) {
                 return mount_point;
             }
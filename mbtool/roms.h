@@ -26,6 +26,8 @@
 namespace mb
 {
 
+class InstalledRomCache;
+
 class Rom
 {
 public:
@@ -64,6 +66,8 @@ public:
 class Roms
 {
 public:
+    friend class InstalledRomCache;
+
     std::vector<std::shared_ptr<Rom>> roms;
 
 private:
@@ -76,9 +80,15 @@ private:
     void add_builtin();
     void add_data_roms();
     void add_extsd_roms();
+    void scan_installed(std::vector<std::string> *watch_paths);
 public:
     void add_installed();
 
+    // Returns a shared, immutable snapshot of the installed ROMs. The snapshot
+    // is cached and only rebuilt when the multiboot directories or the mount
+    // table change.
+    static std::shared_ptr<const Roms> get_installed();
+
     std::shared_ptr<Rom> find_by_id(const std::string &id) const;
 
     static std::shared_ptr<Rom> get_current_rom();
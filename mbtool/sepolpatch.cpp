@@ -19,11 +19,15 @@
 
 #include "sepolpatch.h"
 
+#include <initializer_list>
+#include <map>
 #include <memory>
 
 #include <climits>
 #include <cstdio>
+#include <cstring>
 
+#include <dirent.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <sys/mman.h>
@@ -31,6 +35,8 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <openssl/sha.h>
+
 // libsepol is not very C++ friendly. 'bool' is a struct field in conditional.h
 #define bool bool2
 #include <sepol/policydb/expand.h>
@@ -39,8 +45,12 @@
 #undef bool
 
 #include "mbcommon/common.h"
+#include "mbcommon/string.h"
+#include "mbcommon/version.h"
 #include "mblog/logging.h"
 #include "mbutil/autoclose/file.h"
+#include "mbutil/directory.h"
+#include "mbutil/file.h"
 #include "mbutil/finally.h"
 #include "mbutil/selinux.h"
 #include "mbutil/string.h"
@@ -50,6 +60,10 @@
 
 extern "C" int policydb_index_decls(policydb_t *p);
 
+// Must be incremented whenever a patch produces a different policy for the
+// same input so that stale cached policies are not used
+#define SELINUX_PATCH_VERSION           1
+
 namespace mb
 {
 
@@ -71,6 +85,31 @@ SELinuxResult selinux_raw_set_avtab_rule(policydb_t *pdb,
                                          uint16_t class_val,
                                          uint32_t perm_val,
                                          bool remove)
+{
+    return selinux_raw_set_avtab_rules(pdb, source_type_val, target_type_val,
+                                       class_val, 1U << (perm_val - 1),
+                                       remove);
+}
+
+/*!
+ * Add or remove several permissions of a rule with a single avtab lookup.
+ *
+ * \param pdb Policy DB object
+ * \param source_type_val Source type for rule
+ * \param target_type_val Target type for rule
+ * \param class_val Class for rule
+ * \param perm_mask Bitmask of permissions for rule
+ * \param remove Whether to remove the permissions
+ *
+ * 
+eturn Whether a change was made
+ */
+SELinuxResult selinux_raw_set_avtab_rules(policydb_t *pdb,
+                                          uint16_t source_type_val,
+                                          uint16_t target_type_val,
+                                          uint16_t class_val,
+                                          uint32_t perm_mask,
+                                          bool remove)
 {
     avtab_datum_t *av;
     avtab_key_t key;
@@ -82,11 +121,12 @@ SELinuxResult selinux_raw_set_avtab_rule(policydb_t *pdb,
     av = avtab_search(&pdb->te_avtab, &key);
 
     if (!av) {
-        if (remove) {
+        if (remove || perm_mask == 0) {
             return SELinuxResult::UNCHANGED;
         } else {
             avtab_datum_t av_new;
-            av_new.data = (1U << (perm_val - 1));
+            memset(&av_new, 0, sizeof(av_new));
+            av_new.data = perm_mask;
             if (avtab_insert(&pdb->te_avtab, &key, &av_new) != 0) {
                 return SELinuxResult::ERROR;
             }
@@ -96,9 +136,9 @@ SELinuxResult selinux_raw_set_avtab_rule(policydb_t *pdb,
         auto old_data = av->data;
 
         if (remove) {
-            av->data &= ~(1U << (perm_val - 1));
+            av->data &= ~perm_mask;
         } else {
-            av->data |= (1U << (perm_val - 1));
+            av->data |= perm_mask;
         }
 
         return (av->data == old_data)
@@ -140,17 +180,12 @@ SELinuxResult selinux_raw_set_type_trans(policydb_t *pdb,
     }
 }
 
-SELinuxResult selinux_raw_grant_all_perms(policydb_t *pdb,
-                                          uint16_t source_type_val,
-                                          uint16_t target_type_val,
-                                          uint16_t class_val)
+/*!
+ * \brief Get bitmask of all permissions (including common ones) of a class
+ */
+static uint32_t class_perm_mask(class_datum_t *clazz)
 {
-    SELinuxResult result(SELinuxResult::UNCHANGED);
-
-    auto clazz = pdb->class_val_to_struct[class_val - 1];
-    if (!clazz) {
-        return SELinuxResult::ERROR;
-    }
+    uint32_t mask = 0;
 
     // Class-specific permissions
     hashtab_t tables[] = { clazz->permissions.table, nullptr, nullptr };
@@ -163,26 +198,27 @@ SELinuxResult selinux_raw_grant_all_perms(policydb_t *pdb,
             for (hashtab_ptr_t cur = (*table)->htable[bucket]; cur;
                     cur = cur->next) {
                 perm_datum_t *perm_datum = (perm_datum_t *) cur->datum;
-
-                SELinuxResult ret = selinux_raw_set_avtab_rule(
-                        pdb, source_type_val, target_type_val, class_val,
-                        perm_datum->s.value, false);
-
-                switch (ret) {
-                case SELinuxResult::ERROR:
-                    return ret;
-                case SELinuxResult::CHANGED:
-                    result = ret;
-                    break;
-                case SELinuxResult::UNCHANGED:
-                    // Ignore
-                    break;
-                }
+                mask |= 1U << (perm_datum->s.value - 1);
             }
         }
     }
 
-    return result;
+    return mask;
+}
+
+SELinuxResult selinux_raw_grant_all_perms(policydb_t *pdb,
+                                          uint16_t source_type_val,
+                                          uint16_t target_type_val,
+                                          uint16_t class_val)
+{
+    auto clazz = pdb->class_val_to_struct[class_val - 1];
+    if (!clazz) {
+        return SELinuxResult::ERROR;
+    }
+
+    return selinux_raw_set_avtab_rules(pdb, source_type_val, target_type_val,
+                                       class_val, class_perm_mask(clazz),
+                                       false);
 }
 
 SELinuxResult selinux_raw_grant_all_perms(policydb_t *pdb,
@@ -789,19 +825,126 @@ void selinux_strip_no_audit(policydb_t *pdb)
         if (!(expr)) return false; \
     } while (0)
 
-static inline bool add_rules(policydb_t *pdb,
-                             const char *source,
-                             const char *target,
-                             const char *clazz,
-                             const std::vector<std::string> &perms)
+/*!
+ * \brief Batch of allow rules resolved to numeric values
+ *
+ * Type, class, and permission names are resolved once when a rule is added.
+ * Rules with the same (source, target, class) key are merged into a single
+ * permission mask, so applying the batch only requires one avtab lookup per
+ * key instead of one per permission.
+ */
+class AllowRuleBatch
 {
-    for (auto const &perm : perms) {
-        if (!selinux_add_rule(pdb, source, target, clazz, perm.c_str())) {
+public:
+    explicit AllowRuleBatch(policydb_t *pdb) : _pdb(pdb)
+    {
+    }
+
+    bool add(const char *source_str, const char *target_str,
+             const char *class_str, std::initializer_list<const char *> perms)
+    {
+        type_datum_t *source, *target;
+        class_datum_t *clazz;
+        perm_datum_t *perm;
+        uint32_t mask = 0;
+
+        source = find_type(_pdb, source_str);
+        if (!source) {
+            LOGE("Source type %s does not exist", source_str);
             return false;
         }
+
+        target = find_type(_pdb, target_str);
+        if (!target) {
+            LOGE("Target type %s does not exist", target_str);
+            return false;
+        }
+
+        clazz = find_class(_pdb, class_str);
+        if (!clazz) {
+            LOGE("Class %s does not exist", class_str);
+            return false;
+        }
+
+        for (const char *perm_str : perms) {
+            perm = find_perm(clazz, perm_str);
+            if (!perm) {
+                LOGE("Perm %s does not exist in class %s", perm_str, class_str);
+                return false;
+            }
+
+            mask |= 1U << (perm->s.value - 1);
+        }
+
+        add_raw(source->s.value, target->s.value, clazz->s.value, mask);
+        return true;
     }
 
-    return true;
+    void add_raw(uint16_t source_type_val, uint16_t target_type_val,
+                 uint16_t class_val, uint32_t perm_mask)
+    {
+        uint64_t key = (static_cast<uint64_t>(source_type_val) << 32)
+                | (static_cast<uint64_t>(target_type_val) << 16)
+                | class_val;
+        _rules[key] |= perm_mask;
+    }
+
+    // Equivalent to selinux_raw_grant_all_perms() for every class
+    void grant_all_perms(uint16_t source_type_val, uint16_t target_type_val)
+    {
+        if (_class_masks.empty()) {
+            _class_masks.resize(_pdb->p_classes.nprim);
+            for (uint32_t class_val = 1; class_val <= _pdb->p_classes.nprim;
+                    ++class_val) {
+                auto clazz = _pdb->class_val_to_struct[class_val - 1];
+                _class_masks[class_val - 1] = clazz ? class_perm_mask(clazz) : 0;
+            }
+        }
+
+        for (uint32_t class_val = 1; class_val <= _class_masks.size();
+                ++class_val) {
+            add_raw(source_type_val, target_type_val, class_val,
+                    _class_masks[class_val - 1]);
+        }
+    }
+
+    // Apply all rules in key order
+    bool apply()
+    {
+        for (auto const &rule : _rules) {
+            auto ret = selinux_raw_set_avtab_rules(
+                    _pdb, rule.first >> 32, (rule.first >> 16) & 0xffff,
+                    rule.first & 0xffff, rule.second, false);
+            if (ret == SELinuxResult::ERROR) {
+                LOGE("Failed to add rule: allow %s %s:%s 0x%x;",
+                     _pdb->p_type_val_to_name[(rule.first >> 32) - 1],
+                     _pdb->p_type_val_to_name[((rule.first >> 16) & 0xffff) - 1],
+                     _pdb->p_class_val_to_name[(rule.first & 0xffff) - 1],
+                     rule.second);
+                return false;
+            }
+        }
+
+        _rules.clear();
+        return true;
+    }
+
+private:
+    policydb_t *_pdb;
+    // (source << 32) | (target << 16) | class -> permission mask
+    std::map<uint64_t, uint32_t> _rules;
+    std::vector<uint32_t> _class_masks;
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(AllowRuleBatch)
+};
+
+static inline bool add_rules(AllowRuleBatch &batch,
+                             const char *source,
+                             const char *target,
+                             const char *clazz,
+                             std::initializer_list<const char *> perms)
+{
+    return batch.add(source, target, clazz, perms);
 }
 
 MB_UNUSED
@@ -839,6 +982,8 @@ static bool apply_pre_boot_patches(policydb_t *pdb)
         return false;
     }
 
+    AllowRuleBatch batch(pdb);
+
     // For all attributes
     for (uint32_t type_val = 1; type_val <= pdb->p_types.nprim; ++type_val) {
         // Skip non-attributes
@@ -846,22 +991,13 @@ static bool apply_pre_boot_patches(policydb_t *pdb)
             continue;
         }
 
-        auto ret = selinux_raw_grant_all_perms(pdb, kernel->s.value, type_val);
-        switch (ret) {
-        case SELinuxResult::CHANGED:
-        case SELinuxResult::UNCHANGED:
-            break;
-        case SELinuxResult::ERROR:
-            LOGE("Failed to grant all perms for: %s -> %s",
-                 "kernel", pdb->p_type_val_to_name[type_val - 1]);
-            return false;
-        }
+        batch.grant_all_perms(kernel->s.value, type_val);
     }
 
     // Allow the real init to load the "secure" SELinux policy
-    ff(selinux_add_rule(pdb, "kernel", "kernel", "security", "load_policy"));
+    ff(add_rules(batch, "kernel", "kernel", "security", { "load_policy" }));
 
-    return true;
+    return batch.apply();
 }
 
 static bool copy_avtab_rules(policydb_t *pdb,
@@ -980,58 +1116,60 @@ static bool create_mbtool_types(policydb_t *pdb)
     ff(selinux_set_attribute(pdb, "mb_exec", "mlstrustedobject"));
     ff(selinux_set_attribute(pdb, "mb_exec", "mlstrustedsubject"));
 
+    AllowRuleBatch batch(pdb);
+
     // Allow setting the current process context from init to mb_exec
-    ff(add_rules(pdb, "init", "mb_exec", "process", {
+    ff(add_rules(batch, "init", "mb_exec", "process", {
         "noatsecure", "rlimitinh", "setcurrent", "siginh", "transition",
         //"dyntransition",
     }));
 
     // Allow installd to connect to appsync's socket
-    ff(add_rules(pdb, "installd", "mb_exec", "unix_stream_socket", {
+    ff(add_rules(batch, "installd", "mb_exec", "unix_stream_socket", {
         "accept", "listen", "read", "write",
     }));
     if (find_type(pdb, "system_server")) {
-        ff(add_rules(pdb, "system_server", "mb_exec", "unix_stream_socket", {
+        ff(add_rules(batch, "system_server", "mb_exec", "unix_stream_socket", {
             "connectto",
         }));
     } else {
-        ff(add_rules(pdb, "system", "mb_exec", "unix_stream_socket", {
+        ff(add_rules(batch, "system", "mb_exec", "unix_stream_socket", {
             "connectto",
         }));
     }
 
     // Allow apps to connect to the daemon
-    ff(add_rules(pdb, "untrusted_app", "mb_exec", "unix_stream_socket", {
+    ff(add_rules(batch, "untrusted_app", "mb_exec", "unix_stream_socket", {
         "connectto",
     }));
 
     // Allow zygote to write to our stdout pipe when rebooting
-    ff(add_rules(pdb, "zygote", "init", "fifo_file", { "write" }));
+    ff(add_rules(batch, "zygote", "init", "fifo_file", { "write" }));
 
     // Allow rebooting via the android.intent.action.REBOOT intent
     if (find_type(pdb, "activity_service")) {
-        ff(add_rules(pdb, "zygote", "activity_service", "service_manager", { "find" }));
+        ff(add_rules(batch, "zygote", "activity_service", "service_manager", { "find" }));
     }
     if (find_type(pdb, "system_server")) {
-        ff(add_rules(pdb, "zygote", "system_server", "binder", { "call" }));
+        ff(add_rules(batch, "zygote", "system_server", "binder", { "call" }));
     }
 
-    ff(add_rules(pdb, "zygote", "init", "unix_stream_socket", { "read", "write" }));
-    ff(add_rules(pdb, "zygote", "servicemanager", "binder", { "call" }));
+    ff(add_rules(batch, "zygote", "init", "unix_stream_socket", { "read", "write" }));
+    ff(add_rules(batch, "zygote", "servicemanager", "binder", { "call" }));
 
-    ff(add_rules(pdb, "servicemanager", "mb_exec", "binder", { "transfer" }));
-    ff(add_rules(pdb, "servicemanager", "mb_exec", "dir", { "search" }));
-    ff(add_rules(pdb, "servicemanager", "mb_exec", "file", { "open", "read" }));
-    ff(add_rules(pdb, "servicemanager", "mb_exec", "process", { "getattr" }));
-    ff(add_rules(pdb, "servicemanager", "zygote", "dir", { "search" }));
-    ff(add_rules(pdb, "servicemanager", "zygote", "file", { "open" }));
-    ff(add_rules(pdb, "servicemanager", "zygote", "file", { "read" }));
-    ff(add_rules(pdb, "servicemanager", "zygote", "process", { "getattr" }));
+    ff(add_rules(batch, "servicemanager", "mb_exec", "binder", { "transfer" }));
+    ff(add_rules(batch, "servicemanager", "mb_exec", "dir", { "search" }));
+    ff(add_rules(batch, "servicemanager", "mb_exec", "file", { "open", "read" }));
+    ff(add_rules(batch, "servicemanager", "mb_exec", "process", { "getattr" }));
+    ff(add_rules(batch, "servicemanager", "zygote", "dir", { "search" }));
+    ff(add_rules(batch, "servicemanager", "zygote", "file", { "open" }));
+    ff(add_rules(batch, "servicemanager", "zygote", "file", { "read" }));
+    ff(add_rules(batch, "servicemanager", "zygote", "process", { "getattr" }));
 
     // For in-app flashing
-    ff(add_rules(pdb, "rootfs", "tmpfs", "filesystem", { "associate" }));
-    ff(add_rules(pdb, "tmpfs",  "rootfs", "filesystem", { "associate" }));
-    ff(add_rules(pdb, "kernel", "mb_exec", "fd", { "use" }));
+    ff(add_rules(batch, "rootfs", "tmpfs", "filesystem", { "associate" }));
+    ff(add_rules(batch, "tmpfs",  "rootfs", "filesystem", { "associate" }));
+    ff(add_rules(batch, "kernel", "mb_exec", "fd", { "use" }));
 
     // Give mb_exec <insert diety here> permissions
     type_datum_t *mb_exec = find_type(pdb, "mb_exec");
@@ -1048,20 +1186,10 @@ static bool create_mbtool_types(policydb_t *pdb)
             continue;
         }
 
-        auto ret2 = selinux_raw_grant_all_perms(
-                pdb, mb_exec->s.value, type_val);
-        switch (ret2) {
-        case SELinuxResult::CHANGED:
-        case SELinuxResult::UNCHANGED:
-            break;
-        case SELinuxResult::ERROR:
-            LOGE("Failed to grant all perms for: %s -> %s",
-                 "mb_exec", pdb->p_type_val_to_name[type_val - 1]);
-            return false;
-        }
+        batch.grant_all_perms(mb_exec->s.value, type_val);
     }
 
-    return true;
+    return batch.apply();
 }
 
 static bool apply_main_patches(policydb_t *pdb)
@@ -1074,22 +1202,24 @@ static bool apply_main_patches(policydb_t *pdb)
 
 static bool apply_cwm_recovery_patches(policydb_t *pdb)
 {
-    // Debugging rules (for CWM and Philz)
-    ff(add_rules(pdb, "adbd",  "block_device",    "blk_file",   { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "graphics_device", "chr_file",   { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "graphics_device", "dir",        { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "input_device",    "chr_file",   { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "input_device",    "dir",        { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "rootfs",          "dir",        { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "rootfs",          "file",       { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "rootfs",          "lnk_file",   { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "system_file",     "file",       { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "tmpfs",           "file",       { "relabelto" }));
-
-    ff(add_rules(pdb, "rootfs", "tmpfs",          "filesystem", { "associate" }));
-    ff(add_rules(pdb, "tmpfs",  "rootfs",         "filesystem", { "associate" }));
+    AllowRuleBatch batch(pdb);
 
-    return true;
+    // Debugging rules (for CWM and Philz)
+    ff(add_rules(batch, "adbd",  "block_device",    "blk_file",   { "relabelto" }));
+    ff(add_rules(batch, "adbd",  "graphics_device", "chr_file",   { "relabelto" }));
+    ff(add_rules(batch, "adbd",  "graphics_device", "dir",        { "relabelto" }));
+    ff(add_rules(batch, "adbd",  "input_device",    "chr_file",   { "relabelto" }));
+    ff(add_rules(batch, "adbd",  "input_device",    "dir",        { "relabelto" }));
+    ff(add_rules(batch, "adbd",  "rootfs",          "dir",        { "relabelto" }));
+    ff(add_rules(batch, "adbd",  "rootfs",          "file",       { "relabelto" }));
+    ff(add_rules(batch, "adbd",  "rootfs",          "lnk_file",   { "relabelto" }));
+    ff(add_rules(batch, "adbd",  "system_file",     "file",       { "relabelto" }));
+    ff(add_rules(batch, "adbd",  "tmpfs",           "file",       { "relabelto" }));
+
+    ff(add_rules(batch, "rootfs", "tmpfs",          "filesystem", { "associate" }));
+    ff(add_rules(batch, "tmpfs",  "rootfs",         "filesystem", { "associate" }));
+
+    return batch.apply();
 }
 
 bool selinux_apply_patch(policydb_t *pdb, SELinuxPatch patch)
@@ -1152,6 +1282,222 @@ bool patch_sepolicy(const std::string &source,
     return true;
 }
 
+/*!
+ * \brief Compute the policy cache key for a policy and patch
+ *
+ * The key covers everything the patched output depends on: the input policy,
+ * the patch type and version, the mbtool version, and (for the main patch) the
+ * SELinux label of the internal storage directory.
+ */
+static std::string policy_cache_key(const std::vector<unsigned char> &policy,
+                                    SELinuxPatch patch)
+{
+    unsigned char digest[SHA512_DIGEST_LENGTH];
+    SHA512_CTX ctx;
+
+    std::string header = format("%d:%d:%s:%s", SELINUX_PATCH_VERSION,
+                                static_cast<int>(patch), version(),
+                                git_version());
+
+    SHA512_Init(&ctx);
+    SHA512_Update(&ctx, header.data(), header.size() + 1);
+    SHA512_Update(&ctx, policy.data(), policy.size());
+
+    if (patch == SELinuxPatch::MAIN) {
+        // See fix_data_media_rules()
+        for (const char *path : { INTERNAL_STORAGE, "/data/media" }) {
+            std::string context;
+            if (!util::selinux_lget_context(path, &context)) {
+                context.clear();
+            }
+            SHA512_Update(&ctx, context.c_str(), context.size() + 1);
+        }
+    }
+
+    SHA512_Final(digest, &ctx);
+
+    return util::hex_string(digest, SHA512_DIGEST_LENGTH);
+}
+
+/*!
+ * \brief Write a binary policy in a single write(2) call
+ *
+ * (See util::selinux_write_policy())
+ */
+static bool write_policy_image(const std::string &path,
+                               const void *data, size_t size)
+{
+    int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOGE("%s: Failed to open sepolicy: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd = util::finally([&]{
+        close(fd);
+    });
+
+    ssize_t n = write(fd, data, size);
+    if (n < 0) {
+        LOGE("%s: Failed to write sepolicy: %s", path.c_str(), strerror(errno));
+        return false;
+    } else if (static_cast<size_t>(n) != size) {
+        LOGE("%s: Short write of sepolicy", path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Store a patched policy in the cache, replacing older entries for the
+ *        same patch type
+ */
+static void store_cached_policy(const std::string &cache_dir,
+                                const std::string &prefix,
+                                const std::string &key,
+                                const void *data, size_t size)
+{
+    if (!util::mkdir_recursive(cache_dir, 0700)) {
+        LOGW("%s: Failed to create directory: %s",
+             cache_dir.c_str(), strerror(errno));
+        return;
+    }
+
+    // Remove stale entries
+    DIR *dir = opendir(cache_dir.c_str());
+    if (dir) {
+        struct dirent *ent;
+        while ((ent = readdir(dir))) {
+            if (starts_with(ent->d_name, prefix)) {
+                unlinkat(dirfd(dir), ent->d_name, 0);
+            }
+        }
+        closedir(dir);
+    }
+
+    std::string path(cache_dir);
+    path += '/';
+    path += prefix;
+    path += key;
+    std::string temp_path(path);
+    temp_path += ".tmp";
+
+    // Write to a temporary file first so an interrupted write is never used
+    if (!write_policy_image(temp_path, data, size)
+            || rename(temp_path.c_str(), path.c_str()) < 0) {
+        LOGW("%s: Failed to store cached policy: %s",
+             path.c_str(), strerror(errno));
+        unlink(temp_path.c_str());
+        return;
+    }
+
+    LOGD("%s: Stored patched policy in cache", path.c_str());
+}
+
+/*!
+ * \brief Patch SELinux policy, reusing a previously patched policy if possible
+ *
+ * The patched binary policy is cached in \a cache_dir, keyed by the SHA512 of
+ * the source policy and everything else the patch depends on (see
+ * policy_cache_key()). If a cached policy exists, it is written to \a target
+ * directly without parsing, patching, or serializing the policy.
+ *
+ * \param source Source policy path
+ * \param target Target policy path
+ * \param patch Patch type
+ * \param cache_dir Directory containing cached policies
+ *
+ * \return Whether the patched policy was successfully written to \a target
+ */
+bool patch_sepolicy_cached(const std::string &source,
+                           const std::string &target,
+                           SELinuxPatch patch,
+                           const std::string &cache_dir)
+{
+    std::vector<unsigned char> policy;
+
+    if (!util::file_read_all(source, &policy)) {
+        LOGW("%s: Failed to read policy for caching: %s",
+             source.c_str(), strerror(errno));
+        return patch_sepolicy(source, target, patch);
+    }
+
+    std::string prefix = format("%d-", static_cast<int>(patch));
+    std::string key = policy_cache_key(policy, patch);
+    std::string cache_path(cache_dir);
+    cache_path += '/';
+    cache_path += prefix;
+    cache_path += key;
+
+    std::vector<unsigned char> cached;
+    if (util::file_read_all(cache_path, &cached) && !cached.empty()) {
+        if (write_policy_image(target, cached.data(), cached.size())) {
+            LOGD("%s: Using cached patched policy", cache_path.c_str());
+            return true;
+        }
+        LOGW("%s: Failed to write cached policy; patching again",
+             target.c_str());
+    }
+
+    // Release memory before libsepol parses the policy
+    std::vector<unsigned char>().swap(policy);
+    std::vector<unsigned char>().swap(cached);
+
+    policydb_t pdb;
+
+    if (policydb_init(&pdb) < 0) {
+        LOGE("Failed to initialize policydb");
+        return false;
+    }
+
+    auto destroy_pdb = util::finally([&]{
+        policydb_destroy(&pdb);
+    });
+
+    if (!util::selinux_read_policy(source, &pdb)) {
+        LOGE("%s: Failed to load SELinux policy", source.c_str());
+        return false;
+    }
+
+    LOGD("Policy version: %u", pdb.policyvers);
+
+    if (!selinux_apply_patch(&pdb, patch)) {
+        LOGE("%s: Failed to apply policy patch", source.c_str());
+        return false;
+    }
+
+    void *data;
+    size_t len;
+    sepol_handle_t *handle;
+
+    // Don't print warnings to stderr
+    handle = sepol_handle_create();
+    sepol_msg_set_callback(handle, nullptr, nullptr);
+
+    auto destroy_handle = util::finally([&]{
+        sepol_handle_destroy(handle);
+    });
+
+    if (policydb_to_image(handle, &pdb, &data, &len) < 0) {
+        LOGE("Failed to write policydb to memory");
+        return false;
+    }
+
+    auto free_data = util::finally([&]{
+        free(data);
+    });
+
+    if (!write_policy_image(target, data, len)) {
+        LOGE("%s: Failed to write SELinux policy", target.c_str());
+        return false;
+    }
+
+    store_cached_policy(cache_dir, prefix, key, data, len);
+
+    return true;
+}
+
 bool patch_loaded_sepolicy(SELinuxPatch patch)
 {
     autoclose::file fp(autoclose::fopen(SELINUX_ENFORCE_FILE, "rbe"));
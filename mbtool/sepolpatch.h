@@ -39,6 +39,12 @@ SELinuxResult selinux_raw_set_allow_rule(policydb_t *pdb,
                                          uint16_t class_type_val,
                                          uint32_t perm_val,
                                          bool remove);
+SELinuxResult selinux_raw_set_avtab_rules(policydb_t *pdb,
+                                          uint16_t source_type_val,
+                                          uint16_t target_type_val,
+                                          uint16_t class_val,
+                                          uint32_t perm_mask,
+                                          bool remove);
 SELinuxResult selinux_raw_set_type_trans(policydb_t *pdb,
                                          uint16_t source_type_val,
                                          uint16_t target_type_val,
@@ -122,6 +128,10 @@ bool selinux_apply_patch(policydb_t *pdb, SELinuxPatch patch);
 bool patch_sepolicy(const std::string &source,
                     const std::string &target,
                     SELinuxPatch patch);
+bool patch_sepolicy_cached(const std::string &source,
+                           const std::string &target,
+                           SELinuxPatch patch,
+                           const std::string &cache_dir);
 bool patch_loaded_sepolicy(SELinuxPatch patch);
 
 int sepolpatch_main(int argc, char *argv[]);
@@ -19,14 +19,25 @@
 
 #include "signature.h"
 
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 
+#include <fcntl.h>
 #include <getopt.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <openssl/err.h>
 #include <openssl/x509.h>
 
+#include <mbcommon/thread_pool.h>
 #include <mblog/logging.h>
 #include <mbsign/mbsign.h>
 #include <mbutil/finally.h>
@@ -93,100 +104,260 @@ static void openssl_log_errors()
     ERR_print_errors_cb(&log_callback, nullptr);
 }
 
-static SigVerifyResult verify_signature_with_key(const char *path,
-                                                 const char *sig_path,
-                                                 EVP_PKEY *public_key)
+static std::vector<EVP_PKEY *> g_public_keys;
+static bool g_public_keys_loaded = false;
+static std::once_flag g_public_keys_once;
+
+/*!
+ * \brief Parse the public keys of all trusted certificates
+ *
+ * The certificates are only parsed once per process. Subsequent calls return
+ * the cached result.
+ */
+static bool load_public_keys()
 {
-    bool ret = false;
-    bool valid;
-    BIO *bio_data_in = nullptr;
-    BIO *bio_sig_in = nullptr;
+    std::call_once(g_public_keys_once, []{
+        std::vector<EVP_PKEY *> keys;
 
-    bio_data_in = BIO_new_file(path, "rb");
-    if (!bio_data_in) {
-        LOGE("%s: Failed to open input file", path);
-        openssl_log_errors();
-        goto error;
+        auto free_keys = mb::util::finally([&]{
+            for (EVP_PKEY *key : keys) {
+                EVP_PKEY_free(key);
+            }
+        });
+
+        for (const std::string &hex_der : valid_certs) {
+            std::string der;
+            if (!hex2bin(hex_der, &der)) {
+                LOGE("Failed to convert hex-encoded certificate to binary: %s",
+                     hex_der.c_str());
+                return;
+            }
+
+            X509 *cert = nullptr;
+            BIO *bio_x509_cert = nullptr;
+
+            auto free_openssl = mb::util::finally([&]{
+                X509_free(cert);
+                BIO_free(bio_x509_cert);
+            });
+
+            // Cast to (void *) is okay since BIO_new_mem_buf() creates a
+            // read-only BIO object
+            bio_x509_cert = BIO_new_mem_buf((void *) der.data(), der.size());
+            if (!bio_x509_cert) {
+                LOGE("Failed to create BIO for X509 certificate: %s",
+                     hex_der.c_str());
+                openssl_log_errors();
+                return;
+            }
+
+            // Load DER-encoded certificate
+            cert = d2i_X509_bio(bio_x509_cert, nullptr);
+            if (!cert) {
+                LOGE("Failed to load X509 certificate: %s", hex_der.c_str());
+                openssl_log_errors();
+                return;
+            }
+
+            // Get public key from certificate
+            EVP_PKEY *public_key = X509_get_pubkey(cert);
+            if (!public_key) {
+                LOGE("Failed to load public key from X509 certificate: %s",
+                     hex_der.c_str());
+                openssl_log_errors();
+                return;
+            }
+
+            keys.push_back(public_key);
+        }
+
+        // Keys are intentionally kept for the lifetime of the process
+        g_public_keys.swap(keys);
+        g_public_keys_loaded = true;
+    });
+
+    return g_public_keys_loaded;
+}
+
+struct SigCacheKey
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime_sec;
+    long mtime_nsec;
+
+    SigCacheKey(const struct stat &sb)
+        : dev(sb.st_dev)
+        , ino(sb.st_ino)
+        , size(sb.st_size)
+        , mtime_sec(sb.st_mtim.tv_sec)
+        , mtime_nsec(sb.st_mtim.tv_nsec)
+    {
+    }
+
+    bool operator==(const SigCacheKey &other) const
+    {
+        return dev == other.dev && ino == other.ino && size == other.size
+                && mtime_sec == other.mtime_sec
+                && mtime_nsec == other.mtime_nsec;
     }
-    bio_sig_in = BIO_new_file(sig_path, "rb");
+
+    bool operator<(const SigCacheKey &other) const
+    {
+        return std::tie(dev, ino, size, mtime_sec, mtime_nsec)
+                < std::tie(other.dev, other.ino, other.size, other.mtime_sec,
+                           other.mtime_nsec);
+    }
+};
+
+// Results are keyed by the identity of both the data file and the signature
+// file. Only conclusive results (VALID or INVALID) are cached.
+static std::map<std::pair<SigCacheKey, SigCacheKey>, SigVerifyResult> g_cache;
+static std::mutex g_cache_lock;
+
+static SigVerifyResult verify_signature_fds(int fd_data, const char *path,
+                                            int fd_sig, const char *sig_path)
+{
+    BIO *bio_sig_in = BIO_new_fd(fd_sig, BIO_NOCLOSE);
     if (!bio_sig_in) {
-        LOGE("%s: Failed to open signature file", sig_path);
+        LOGE("%s: Failed to create BIO for signature file", sig_path);
         openssl_log_errors();
-        goto error;
+        return SigVerifyResult::FAILURE;
     }
 
-    ret = mb::sign::verify_data(bio_data_in, bio_sig_in, public_key, &valid);
-
-    BIO_free(bio_data_in);
-    BIO_free(bio_sig_in);
+    auto free_bio = util::finally([&]{
+        BIO_free(bio_sig_in);
+    });
 
-    return ret ? (valid ? SigVerifyResult::VALID : SigVerifyResult::INVALID)
-            : SigVerifyResult::FAILURE;
+    // The file is hashed once (directly from a memory mapping) and the digest
+    // is checked against every key
+    bool valid;
+    if (!mb::sign::verify_data_fd(fd_data, bio_sig_in,
+                                  g_public_keys.data(), g_public_keys.size(),
+                                  &valid, nullptr)) {
+        LOGE("%s: Failed to verify signature", path);
+        return SigVerifyResult::FAILURE;
+    }
 
-error:
-    BIO_free(bio_data_in);
-    BIO_free(bio_sig_in);
-    return SigVerifyResult::FAILURE;
+    return valid ? SigVerifyResult::VALID : SigVerifyResult::INVALID;
 }
 
-SigVerifyResult verify_signature(const char *path, const char *sig_path)
+static SigVerifyResult verify_signature_cached(const char *path,
+                                               const char *sig_path)
 {
-    for (const std::string &hex_der : valid_certs) {
-        std::string der;
-        if (!hex2bin(hex_der, &der)) {
-            LOGE("Failed to convert hex-encoded certificate to binary: %s",
-                 hex_der.c_str());
-            return SigVerifyResult::FAILURE;
+    int fd_data = -1;
+    int fd_sig = -1;
+
+    auto close_fds = util::finally([&]{
+        if (fd_data >= 0) {
+            close(fd_data);
         }
+        if (fd_sig >= 0) {
+            close(fd_sig);
+        }
+    });
 
-        EVP_PKEY *public_key = nullptr;
-        X509 *cert = nullptr;
-        BIO *bio_x509_cert = nullptr;
+    fd_data = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd_data < 0) {
+        LOGE("%s: Failed to open input file: %s", path, strerror(errno));
+        return SigVerifyResult::FAILURE;
+    }
+    fd_sig = open(sig_path, O_RDONLY | O_CLOEXEC);
+    if (fd_sig < 0) {
+        LOGE("%s: Failed to open signature file: %s",
+             sig_path, strerror(errno));
+        return SigVerifyResult::FAILURE;
+    }
 
-        auto free_openssl = mb::util::finally([&]{
-            EVP_PKEY_free(public_key);
-            X509_free(cert);
-            BIO_free(bio_x509_cert);
-        });
+    struct stat sb_data;
+    struct stat sb_sig;
 
-        // Cast to (void *) is okay since BIO_new_mem_buf() creates a read-only
-        // BIO object
-        bio_x509_cert = BIO_new_mem_buf((void *) der.data(), der.size());
-        if (!bio_x509_cert) {
-            LOGE("Failed to create BIO for X509 certificate: %s",
-                 hex_der.c_str());
-            openssl_log_errors();
-            return SigVerifyResult::FAILURE;
-        }
-
-        // Load DER-encoded certificate
-        cert = d2i_X509_bio(bio_x509_cert, nullptr);
-        if (!cert) {
-            LOGE("Failed to load X509 certificate: %s", hex_der.c_str());
-            openssl_log_errors();
-            return SigVerifyResult::FAILURE;
-        }
+    if (fstat(fd_data, &sb_data) < 0) {
+        LOGE("%s: Failed to stat: %s", path, strerror(errno));
+        return SigVerifyResult::FAILURE;
+    }
+    if (fstat(fd_sig, &sb_sig) < 0) {
+        LOGE("%s: Failed to stat: %s", sig_path, strerror(errno));
+        return SigVerifyResult::FAILURE;
+    }
 
-        // Get public key from certificate
-        public_key = X509_get_pubkey(cert);
-        if (!public_key) {
-            LOGE("Failed to load public key from X509 certificate: %s",
-                 hex_der.c_str());
-            openssl_log_errors();
-            return SigVerifyResult::FAILURE;
-        }
+    auto key = std::make_pair(SigCacheKey(sb_data), SigCacheKey(sb_sig));
 
-        SigVerifyResult result =
-                verify_signature_with_key(path, sig_path, public_key);
-        if (result == SigVerifyResult::INVALID) {
-            // Keep trying ...
-            continue;
+    {
+        std::lock_guard<std::mutex> lock(g_cache_lock);
+        auto it = g_cache.find(key);
+        if (it != g_cache.end()) {
+            return it->second;
         }
+    }
 
+    SigVerifyResult result =
+            verify_signature_fds(fd_data, path, fd_sig, sig_path);
+    if (result == SigVerifyResult::FAILURE) {
         return result;
     }
 
-    return SigVerifyResult::INVALID;
+    // Do not cache the result if either file changed while it was being read
+    if (fstat(fd_data, &sb_data) == 0 && fstat(fd_sig, &sb_sig) == 0
+            && SigCacheKey(sb_data) == key.first
+            && SigCacheKey(sb_sig) == key.second) {
+        std::lock_guard<std::mutex> lock(g_cache_lock);
+        g_cache[key] = result;
+    }
+
+    return result;
+}
+
+/*!
+ * \brief Verify the signature of a file against the trusted certificates
+ *
+ * Results are cached for the lifetime of the process by the device, inode,
+ * size, and modification time of both \p path and \p sig_path.
+ */
+SigVerifyResult verify_signature(const char *path, const char *sig_path)
+{
+    if (!load_public_keys()) {
+        return SigVerifyResult::FAILURE;
+    }
+
+    if (g_public_keys.empty()) {
+        return SigVerifyResult::INVALID;
+    }
+
+    return verify_signature_cached(path, sig_path);
+}
+
+/*!
+ * \brief Verify the signatures of several files concurrently
+ *
+ * \param items List of (file path, signature path) pairs
+ *
+ * \return Verification result for each item, in the same order as \p items
+ */
+std::vector<SigVerifyResult> verify_signatures_batch(
+        const std::vector<std::pair<std::string, std::string>> &items)
+{
+    std::vector<SigVerifyResult> results(items.size(),
+                                         SigVerifyResult::FAILURE);
+
+    // Load keys before starting the workers so they can be shared read-only
+    if (!load_public_keys()) {
+        return results;
+    }
+
+    if (g_public_keys.empty()) {
+        std::fill(results.begin(), results.end(), SigVerifyResult::INVALID);
+        return results;
+    }
+
+    parallel_for(items.size(), [&](size_t i) {
+        results[i] = verify_signature_cached(items[i].first.c_str(),
+                                             items[i].second.c_str());
+        return true;
+    }, 0, CoreHint::Performance);
+
+    return results;
 }
 
 static void sigverify_usage(FILE *stream)
@@ -19,6 +19,10 @@
 
 #pragma once
 
+#include <string>
+#include <utility>
+#include <vector>
+
 namespace mb
 {
 
@@ -30,6 +34,8 @@ enum SigVerifyResult
 };
 
 SigVerifyResult verify_signature(const char *path, const char *sig_path);
+std::vector<SigVerifyResult> verify_signatures_batch(
+        const std::vector<std::pair<std::string, std::string>> &items);
 
 int sigverify_main(int argc, char *argv[]);
 
@@ -19,12 +19,20 @@
 
 #include "switcher.h"
 
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <openssl/sha.h>
 
@@ -35,15 +43,18 @@
 #include "mbutil/copy.h"
 #include "mbutil/directory.h"
 #include "mbutil/file.h"
+#include "mbutil/flash.h"
 #include "mbutil/finally.h"
 #include "mbutil/path.h"
 #include "mbutil/properties.h"
 #include "mbutil/string.h"
+#include "mbutil/time.h"
 
 #include "multiboot.h"
 #include "roms.h"
 
 #define CHECKSUMS_PATH "/data/multiboot/checksums.prop"
+#define CHECKSUMS_CACHE_PATH "/data/multiboot/checksums.cache"
 
 namespace mb
 {
@@ -135,6 +146,38 @@ bool checksums_read(std::unordered_map<std::string, std::string> *props)
     return true;
 }
 
+/*!
+ * \brief Write a properties file that is only accessible by root
+ */
+static bool write_root_only_props(const std::string &path,
+                                  const std::unordered_map<std::string, std::string> &props)
+{
+    if (remove(path.c_str()) < 0 && errno != ENOENT) {
+        LOGW("%s: Failed to remove file: %s",
+             path.c_str(), strerror(errno));
+    }
+
+    util::mkdir_parent(path, 0755);
+    util::create_empty_file(path);
+
+    if (!util::chown(path, 0, 0, 0)) {
+        LOGW("%s: Failed to chown file: %s",
+             path.c_str(), strerror(errno));
+    }
+    if (chmod(path.c_str(), 0700) < 0) {
+        LOGW("%s: Failed to chmod file: %s",
+             path.c_str(), strerror(errno));
+    }
+
+    if (!util::property_file_write_all(path, props)) {
+        LOGW("%s: Failed to write new properties: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
 /*!
  * \brief Write checksums properties to \a /data/multiboot/checksums.prop
  *
@@ -144,31 +187,185 @@ bool checksums_read(std::unordered_map<std::string, std::string> *props)
  */
 bool checksums_write(const std::unordered_map<std::string, std::string> &props)
 {
-    std::string checksums_path = get_raw_path(CHECKSUMS_PATH);
+    return write_root_only_props(get_raw_path(CHECKSUMS_PATH), props);
+}
 
-    if (remove(checksums_path.c_str()) < 0 && errno != ENOENT) {
-        LOGW("%s: Failed to remove file: %s",
-             checksums_path.c_str(), strerror(errno));
+/*!
+ * \brief Build the cache stamp for a file
+ *
+ * The stamp contains the device, inode, size, mtime, and ctime. The ctime
+ * cannot be set by userspace, so any write to the file (even one that restores
+ * the old mtime) invalidates the stamp.
+ */
+static std::string checksums_cache_stamp(const struct stat &sb)
+{
+    return mb::format("%" PRIu64 ":%" PRIu64 ":%" PRIu64
+                      ":%" PRId64 ".%09ld:%" PRId64 ".%09ld",
+                      static_cast<uint64_t>(sb.st_dev),
+                      static_cast<uint64_t>(sb.st_ino),
+                      static_cast<uint64_t>(sb.st_size),
+                      static_cast<int64_t>(sb.st_mtim.tv_sec),
+                      static_cast<long>(sb.st_mtim.tv_nsec),
+                      static_cast<int64_t>(sb.st_ctim.tv_sec),
+                      static_cast<long>(sb.st_ctim.tv_nsec));
+}
+
+/*!
+ * \brief Look up the cached hash of a file that has not changed
+ *
+ * \param cache Pointer to cache properties map
+ * \param rom_id ROM ID
+ * \param image Image filename (without directory)
+ * \param sb Current stat buffer of the image
+ * \param sha512_out SHA512 hex digest output
+ *
+ * \return True if the cache has a hash for the exact same file contents.
+ *         Otherwise, false.
+ */
+bool checksums_cache_get(std::unordered_map<std::string, std::string> *cache,
+                         const std::string &rom_id,
+                         const std::string &image,
+                         const struct stat &sb,
+                         std::string *sha512_out)
+{
+    std::string key(rom_id);
+    key += "/";
+    key += image;
+
+    auto it = cache->find(key);
+    if (it == cache->end()) {
+        return false;
     }
 
-    util::mkdir_parent(checksums_path, 0755);
-    util::create_empty_file(checksums_path);
+    std::string prefix = checksums_cache_stamp(sb);
+    prefix += ":sha512:";
 
-    if (!util::chown(checksums_path, 0, 0, 0)) {
-        LOGW("%s: Failed to chown file: %s",
-             checksums_path.c_str(), strerror(errno));
+    if (!starts_with(it->second, prefix)
+            || it->second.size() != prefix.size() + 2 * SHA512_DIGEST_LENGTH) {
+        return false;
     }
-    if (chmod(checksums_path.c_str(), 0700) < 0) {
-        LOGW("%s: Failed to chmod file: %s",
-             checksums_path.c_str(), strerror(errno));
+
+    *sha512_out = it->second.substr(prefix.size());
+    return true;
+}
+
+/*!
+ * \brief Record the hash of a file in the cache
+ *
+ * \param cache Pointer to cache properties map
+ * \param rom_id ROM ID
+ * \param image Image filename (without directory)
+ * \param sb Stat buffer of the image at the time it was hashed
+ * \param sha512 SHA512 hex digest
+ */
+void checksums_cache_update(std::unordered_map<std::string, std::string> *cache,
+                            const std::string &rom_id,
+                            const std::string &image,
+                            const struct stat &sb,
+                            const std::string &sha512)
+{
+    std::string key(rom_id);
+    key += "/";
+    key += image;
+
+    std::string &value = (*cache)[key];
+    value = checksums_cache_stamp(sb);
+    value += ":sha512:";
+    value += sha512;
+}
+
+/*!
+ * \brief Read cached checksums from \a /data/multiboot/checksums.cache
+ *
+ * \param cache Pointer to cache properties map
+ *
+ * \return True if the file was successfully read. Otherwise, false.
+ */
+bool checksums_cache_read(std::unordered_map<std::string, std::string> *cache)
+{
+    return util::property_file_get_all(get_raw_path(CHECKSUMS_CACHE_PATH),
+                                       *cache);
+}
+
+/*!
+ * \brief Write cached checksums to \a /data/multiboot/checksums.cache
+ *
+ * \param cache Cache properties map
+ *
+ * \return True if successfully written. Otherwise, false.
+ */
+bool checksums_cache_write(const std::unordered_map<std::string, std::string> &cache)
+{
+    return write_root_only_props(get_raw_path(CHECKSUMS_CACHE_PATH), cache);
+}
+
+/*!
+ * \brief Read a file into memory, ensuring it did not change while reading
+ *
+ * \param path Path to file
+ * \param data_out Pointer to store malloc()'d data
+ * \param size_out Pointer to store data size
+ * \param sb_out Stat buffer of the file (valid for the data that was read)
+ *
+ * \return True if the file was read. Otherwise, false and errno set
+ *         appropriately.
+ */
+static bool read_image(const std::string &path, unsigned char **data_out,
+                       std::size_t *size_out, struct stat *sb_out)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
     }
 
-    if (!util::property_file_write_all(checksums_path, props)) {
-        LOGW("%s: Failed to write new properties: %s",
-             checksums_path.c_str(), strerror(errno));
+    auto close_fd = util::finally([&]{
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    });
+
+    struct stat sb_before;
+    struct stat sb_after;
+
+    if (fstat(fd, &sb_before) < 0) {
         return false;
     }
 
+    std::size_t size = static_cast<std::size_t>(sb_before.st_size);
+    unsigned char *data = static_cast<unsigned char *>(malloc(size ? size : 1));
+    if (!data) {
+        return false;
+    }
+
+    std::size_t total = 0;
+    while (total < size) {
+        ssize_t n = read(fd, data + total, size - total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            free(data);
+            return false;
+        }
+        total += static_cast<std::size_t>(n);
+    }
+
+    if (fstat(fd, &sb_after) < 0) {
+        free(data);
+        return false;
+    }
+
+    if (checksums_cache_stamp(sb_before) != checksums_cache_stamp(sb_after)) {
+        free(data);
+        errno = EAGAIN;
+        return false;
+    }
+
+    *data_out = data;
+    *size_out = size;
+    *sb_out = sb_after;
     return true;
 }
 
@@ -180,8 +377,68 @@ struct Flashable
     std::string hash;
     unsigned char *data = nullptr;
     std::size_t size = 0;
+    struct stat sb;
+    bool hash_cached = false;
+
+    // Results of flashing the image
+    int flash_error = 0;
+    std::string flashed_hash;
+    util::FlashStats stats;
+
+    // Time spent on each step in milliseconds
+    uint64_t read_ms = 0;
+    uint64_t hash_ms = 0;
+    uint64_t flash_ms = 0;
 };
 
+/*!
+ * \brief Group flashables by the block device they are written to
+ *
+ * Images that target the same device (eg. through different symlinks) end up
+ * in the same group and must be flashed one after another. Different groups
+ * can be flashed concurrently.
+ *
+ * \param flashables List of flashables
+ *
+ * \return List of groups of indexes into \p flashables
+ */
+static std::vector<std::vector<std::size_t>>
+group_by_block_dev(const std::vector<Flashable> &flashables)
+{
+    std::vector<std::vector<std::size_t>> groups;
+    std::unordered_map<std::string, std::size_t> group_index;
+
+    for (std::size_t i = 0; i < flashables.size(); ++i) {
+        const std::string &path = flashables[i].block_dev;
+        struct stat sb;
+        std::string key;
+
+        if (stat(path.c_str(), &sb) == 0) {
+            if (S_ISBLK(sb.st_mode)) {
+                key = mb::format("b:%" PRIu64,
+                                 static_cast<uint64_t>(sb.st_rdev));
+            } else {
+                key = mb::format("f:%" PRIu64 ":%" PRIu64,
+                                 static_cast<uint64_t>(sb.st_dev),
+                                 static_cast<uint64_t>(sb.st_ino));
+            }
+        } else {
+            key = "p:" + path;
+        }
+
+        auto it = group_index.find(key);
+        if (it == group_index.end()) {
+            group_index[key] = groups.size();
+            groups.emplace_back();
+            groups.back().push_back(i);
+        } else {
+            groups[it->second].push_back(i);
+        }
+    }
+
+    return groups;
+}
+
 /*!
  * \brief Perform non-recursive search for a block device
  *
@@ -352,20 +609,71 @@ SwitchRomResult switch_rom(const char *id, const char *boot_blockdev,
     std::unordered_map<std::string, std::string> props;
     checksums_read(&props);
 
-    for (Flashable &f : flashables) {
-        // If memory becomes an issue, an alternative method is to create a
-        // temporary directory in /data/multiboot/ that's only writable by root
-        // and copy the images there.
-        if (!util::file_read_all(f.image, &f.data, &f.size)) {
+    std::unordered_map<std::string, std::string> cache;
+    checksums_cache_read(&cache);
+
+    // Read and hash the images concurrently. Each thread only touches its own
+    // Flashable and error slot.
+    std::vector<int> read_errors(flashables.size(), 0);
+    std::vector<std::thread> threads;
+
+    for (std::size_t i = 0; i < flashables.size(); ++i) {
+        threads.emplace_back([&flashables, &read_errors, &cache, id, i] {
+            Flashable &f = flashables[i];
+            uint64_t start = util::current_time_ms();
+
+            // If memory becomes an issue, an alternative method is to create a
+            // temporary directory in /data/multiboot/ that's only writable by
+            // root and copy the images there.
+            if (!read_image(f.image, &f.data, &f.size, &f.sb)) {
+                read_errors[i] = errno != 0 ? errno : EIO;
+                return;
+            }
+
+            f.read_ms = util::current_time_ms() - start;
+
+            // The data in memory matches f.sb, so if the file hasn't changed
+            // since it was last hashed, the cached hash is still valid
+            if (checksums_cache_get(&cache, id, util::base_name(f.image),
+                                    f.sb, &f.hash)) {
+                f.hash_cached = true;
+                return;
+            }
+
+            // Get actual sha512sum
+            start = util::current_time_ms();
+            unsigned char digest[SHA512_DIGEST_LENGTH];
+            SHA512(f.data, f.size, digest);
+            f.hash = util::hex_string(digest, SHA512_DIGEST_LENGTH);
+            f.hash_ms = util::current_time_ms() - start;
+        });
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    bool cache_dirty = false;
+
+    for (std::size_t i = 0; i < flashables.size(); ++i) {
+        Flashable &f = flashables[i];
+
+        if (read_errors[i] != 0) {
             LOGE("%s: Failed to read image: %s",
-                 f.image.c_str(), strerror(errno));
+                 f.image.c_str(), strerror(read_errors[i]));
             return SwitchRomResult::FAILED;
         }
 
-        // Get actual sha512sum
-        unsigned char digest[SHA512_DIGEST_LENGTH];
-        SHA512(f.data, f.size, digest);
-        f.hash = util::hex_string(digest, SHA512_DIGEST_LENGTH);
+        if (f.hash_cached) {
+            LOGD("%s: Read in %" PRIu64 "ms; using cached checksum",
+                 f.image.c_str(), f.read_ms);
+        } else {
+            LOGD("%s: Read in %" PRIu64 "ms; hashed in %" PRIu64 "ms",
+                 f.image.c_str(), f.read_ms, f.hash_ms);
+            checksums_cache_update(&cache, id, util::base_name(f.image),
+                                   f.sb, f.hash);
+            cache_dirty = true;
+        }
 
         if (force_update_checksums) {
             checksums_update(&props, id, util::base_name(f.image), f.hash);
@@ -396,22 +704,75 @@ SwitchRomResult switch_rom(const char *id, const char *boot_blockdev,
         }
     }
 
-    // Now we can flash the images
+    // Now we can flash the images. Regions that already match are not
+    // rewritten and the written regions are read back and verified. Images
+    // for different block devices are flashed concurrently.
+    threads.clear();
+
+    for (auto const &group : group_by_block_dev(flashables)) {
+        threads.emplace_back([&flashables, group] {
+            for (std::size_t i : group) {
+                Flashable &f = flashables[i];
+                uint64_t start = util::current_time_ms();
+                unsigned char digest[SHA512_DIGEST_LENGTH];
+
+                if (!util::flash_data(f.block_dev, f.data, f.size, digest,
+                                      &f.stats)) {
+                    f.flash_error = errno != 0 ? errno : EIO;
+                    return;
+                }
+
+                f.flashed_hash = util::hex_string(digest, SHA512_DIGEST_LENGTH);
+                f.flash_ms = util::current_time_ms() - start;
+            }
+        });
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    bool flash_failed = false;
+
     for (Flashable &f : flashables) {
-        // Cast is okay. The data is just passed to fwrite (ie. no signed
-        // extension issues)
-        if (!util::file_write_data(f.block_dev, (char *) f.data, f.size)) {
+        if (f.flash_error != 0) {
             LOGE("%s: Failed to write image: %s",
-                 f.block_dev.c_str(), strerror(errno));
-            return SwitchRomResult::FAILED;
+                 f.block_dev.c_str(), strerror(f.flash_error));
+            flash_failed = true;
+            continue;
+        } else if (f.flashed_hash.empty()) {
+            // Skipped because an earlier image for the same device failed
+            LOGE("%s: Not flashed due to previous error", f.block_dev.c_str());
+            flash_failed = true;
+            continue;
+        }
+
+        LOGD("%s: Wrote %" PRIu64 " bytes (%" PRIu64 " bytes unchanged)"
+             " in %" PRIu64 "ms", f.block_dev.c_str(), f.stats.bytes_written,
+             f.stats.bytes_unchanged, f.flash_ms);
+
+        // The digest covers the data now on the block device. If it doesn't
+        // match, the in-memory copy changed after it was verified.
+        if (f.flashed_hash != f.expected_hash) {
+            LOGE("%s: Checksum of flashed data does not match expected (%s)",
+                 f.block_dev.c_str(), f.expected_hash.c_str());
+            flash_failed = true;
         }
     }
 
+    if (flash_failed) {
+        return SwitchRomResult::FAILED;
+    }
+
     if (force_update_checksums) {
         LOGD("Updating checksums file");
         checksums_write(props);
     }
 
+    if (cache_dirty) {
+        checksums_cache_write(cache);
+    }
+
     if (!fix_multiboot_permissions()) {
         //return SwitchRomResult::FAILED;
     }
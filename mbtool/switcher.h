@@ -23,6 +23,8 @@
 #include <unordered_map>
 #include <vector>
 
+#include <sys/stat.h>
+
 namespace mb
 {
 
@@ -43,6 +45,18 @@ void checksums_update(std::unordered_map<std::string, std::string> *props,
                       const std::string &sha512);
 bool checksums_read(std::unordered_map<std::string, std::string> *props);
 bool checksums_write(const std::unordered_map<std::string, std::string> &props);
+bool checksums_cache_get(std::unordered_map<std::string, std::string> *cache,
+                         const std::string &rom_id,
+                         const std::string &image,
+                         const struct stat &sb,
+                         std::string *sha512_out);
+void checksums_cache_update(std::unordered_map<std::string, std::string> *cache,
+                            const std::string &rom_id,
+                            const std::string &image,
+                            const struct stat &sb,
+                            const std::string &sha512);
+bool checksums_cache_read(std::unordered_map<std::string, std::string> *cache);
+bool checksums_cache_write(const std::unordered_map<std::string, std::string> &cache);
 
 enum class SwitchRomResult
 {
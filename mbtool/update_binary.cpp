@@ -52,6 +52,7 @@ class RecoveryInstaller : public Installer
 public:
     RecoveryInstaller(std::string zip_file, int interface, int output_fd);
 
+    using Installer::display_msg;
     virtual void display_msg(const std::string& msg) override;
     virtual std::string get_install_type() override;
     virtual std::unordered_map<std::string, std::string> get_properties() override;
@@ -129,6 +130,11 @@ void RecoveryInstaller::on_cleanup(Installer::ProceedState ret)
 {
     (void) ret;
 
+    InstallerStageStats total = _stats.totals();
+    display_msg("Install stages took %.1f seconds and wrote %.1f MiB",
+                total.elapsed_us / 1000000.0,
+                total.storage_written / 1024.0 / 1024.0);
+
     if (!util::copy_file("/tmp/recovery.log", MULTIBOOT_LOG_INSTALLER, 0)) {
         LOGE("Failed to copy log file: %s", strerror(errno));
     }
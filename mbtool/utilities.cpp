@@ -33,18 +33,21 @@
 
 #include "mbcommon/string.h"
 #include "mbcommon/version.h"
+#include "mbdevice/database.h"
 #include "mbdevice/device.h"
 #include "mbdevice/validate.h"
 #include "mbdevice/json.h"
 #include "mblog/logging.h"
 #include "mblog/stdio_logger.h"
+#include "mbutil/autoclose/file.h"
 #include "mbutil/delete.h"
 #include "mbutil/file.h"
 #include "mbutil/finally.h"
 #include "mbutil/fts.h"
+#include "mbutil/loopdev.h"
+#include "mbutil/mount.h"
 #include "mbutil/path.h"
 #include "mbutil/properties.h"
-#include "mbutil/string.h"
 
 #include "multiboot.h"
 #include "romconfig.h"
@@ -67,6 +70,40 @@ static Device * get_device(const char *path)
     LOGD("ro.product.device = %s", prop_product_device.c_str());
     LOGD("ro.build.product = %s", prop_build_product.c_str());
 
+    // Compiled device databases can be queried without parsing every device
+    MbDeviceDb *db = mb_device_db_open(path);
+    if (db) {
+        auto close_db = util::finally([&]{
+            mb_device_db_close(db);
+        });
+
+        int index = mb_device_db_find_by_codename(
+                db, prop_product_device.c_str());
+        if (index < 0) {
+            index = mb_device_db_find_by_codename(
+                    db, prop_build_product.c_str());
+        }
+        if (index < 0) {
+            LOGE("Unknown device: %s", prop_product_device.c_str());
+            return nullptr;
+        }
+
+        Device *device = mb_device_db_get(db, index);
+        if (!device) {
+            LOGE("%s: Failed to load device: %s", path, strerror(errno));
+            return nullptr;
+        } else if (mb_device_validate(device) != 0) {
+            LOGE("%s: Device is invalid", mb_device_id(device));
+            mb_device_free(device);
+            return nullptr;
+        }
+
+        return device;
+    } else if (errno != EINVAL) {
+        LOGE("%s: Failed to open file: %s", path, strerror(errno));
+        return nullptr;
+    }
+
     std::vector<unsigned char> contents;
     if (!util::file_read_all(path, &contents)) {
         LOGE("%s: Failed to read file: %s", path, strerror(errno));
@@ -167,54 +204,85 @@ static bool utilities_switch_rom(const char *rom_id, bool force)
     return ret == SwitchRomResult::SUCCEEDED;
 }
 
-static bool utilities_wipe_system(const char *rom_id)
+static bool utilities_wipe_system(const char *rom_id,
+                                  WipeTrimmer *trimmer)
 {
     auto rom = Roms::create_rom(rom_id);
     if (!rom) {
         return false;
     }
 
-    return wipe_system(rom);
+    return wipe_system(rom, false, trimmer);
 }
 
-static bool utilities_wipe_cache(const char *rom_id)
+static bool utilities_wipe_cache(const char *rom_id,
+                                 WipeTrimmer *trimmer)
 {
     auto rom = Roms::create_rom(rom_id);
     if (!rom) {
         return false;
     }
 
-    return wipe_cache(rom);
+    return wipe_cache(rom, false, trimmer);
 }
 
-static bool utilities_wipe_data(const char *rom_id)
+static bool utilities_wipe_data(const char *rom_id,
+                                WipeTrimmer *trimmer)
 {
     auto rom = Roms::create_rom(rom_id);
     if (!rom) {
         return false;
     }
 
-    return wipe_data(rom);
+    return wipe_data(rom, false, trimmer);
 }
 
-static bool utilities_wipe_dalvik_cache(const char *rom_id)
+static bool utilities_wipe_dalvik_cache(const char *rom_id,
+                                        WipeTrimmer *trimmer)
 {
     auto rom = Roms::create_rom(rom_id);
     if (!rom) {
         return false;
     }
 
-    return wipe_dalvik_cache(rom);
+    return wipe_dalvik_cache(rom, false, trimmer);
 }
 
-static bool utilities_wipe_multiboot(const char *rom_id)
+static bool utilities_wipe_multiboot(const char *rom_id,
+                                     WipeTrimmer *trimmer)
 {
     auto rom = Roms::create_rom(rom_id);
     if (!rom) {
         return false;
     }
 
-    return wipe_multiboot(rom);
+    return wipe_multiboot(rom, false, trimmer);
+}
+
+/*!
+ * \brief Print the mode of every mounted loop device
+ */
+static bool utilities_loop_status()
+{
+    autoclose::file fp(std::fopen(PROC_MOUNTS, "r"), std::fclose);
+    if (!fp) {
+        LOGE(PROC_MOUNTS ": Failed to read file: %s", strerror(errno));
+        return false;
+    }
+
+    for (util::MountEntry entry; util::get_mount_entry(fp.get(), entry);) {
+        util::LoopDevInfo info;
+        if (!util::loopdev_get_info(entry.fsname, info)) {
+            continue;
+        }
+
+        printf("%s on %s\n", entry.fsname.c_str(), entry.dir.c_str());
+        printf("  Backing file: %s\n", info.backing_file.c_str());
+        printf("  Direct I/O:   %s\n", info.direct_io ? "enabled" : "disabled");
+        printf("  Block size:   %u\n", info.block_size);
+    }
+
+    return true;
 }
 
 static void generate_aroma_config(std::vector<unsigned char> *data)
@@ -238,10 +306,11 @@ static void generate_aroma_config(std::vector<unsigned char> *data)
             name = config.name;
         }
 
-        rom_menu_items += mb::format("\"%s\", \"\", \"@default\",\n",
-                                     name.c_str());
+        mb::append_format(rom_menu_items, "\"%s\", \"\", \"@default\",\n",
+                          name.c_str());
 
-        rom_selection_items += mb::format(
+        mb::append_format(
+                rom_selection_items,
                 "if prop(\"operations.prop\", \"selected\") == \"%zu\" then\n"
                 "    setvar(\"romid\", \"%s\");\n"
                 "    setvar(\"romname\", \"%s\");\n"
@@ -252,17 +321,31 @@ static void generate_aroma_config(std::vector<unsigned char> *data)
     std::string first_index = mb::format("%d", 2 + 1);
     std::string last_index = mb::format("%zu", 2 + roms.roms.size());
 
-    util::replace_all(&str_data, "\t", "\\t");
-    util::replace_all(&str_data, "@MBTOOL_VERSION@", version());
-    util::replace_all(&str_data, "@ROM_MENU_ITEMS@", rom_menu_items);
-    util::replace_all(&str_data, "@ROM_SELECTION_ITEMS@", rom_selection_items);
-    util::replace_all(&str_data, "@FIRST_INDEX@", first_index);
-    util::replace_all(&str_data, "@LAST_INDEX@", last_index);
+    std::string system_mount_point = Roms::get_system_partition();
+    std::string cache_mount_point = Roms::get_cache_partition();
+    std::string data_mount_point = Roms::get_data_partition();
+    std::string extsd_mount_point = Roms::get_extsd_partition();
+
+    const StrReplacement replacements[] = {
+        { "\t", "\\t" },
+        { "@MBTOOL_VERSION@", version() },
+        { "@ROM_MENU_ITEMS@", rom_menu_items.c_str() },
+        { "@ROM_SELECTION_ITEMS@", rom_selection_items.c_str() },
+        { "@FIRST_INDEX@", first_index.c_str() },
+        { "@LAST_INDEX@", last_index.c_str() },
+        { "@SYSTEM_MOUNT_POINT@", system_mount_point.c_str() },
+        { "@CACHE_MOUNT_POINT@", cache_mount_point.c_str() },
+        { "@DATA_MOUNT_POINT@", data_mount_point.c_str() },
+        { "@EXTSD_MOUNT_POINT@", extsd_mount_point.c_str() },
+    };
 
-    util::replace_all(&str_data, "@SYSTEM_MOUNT_POINT@", Roms::get_system_partition());
-    util::replace_all(&str_data, "@CACHE_MOUNT_POINT@", Roms::get_cache_partition());
-    util::replace_all(&str_data, "@DATA_MOUNT_POINT@", Roms::get_data_partition());
-    util::replace_all(&str_data, "@EXTSD_MOUNT_POINT@", Roms::get_extsd_partition());
+    // Single pass, so substituted values (eg. ROM names) are never rescanned
+    if (!str_replace_multi(str_data, replacements,
+                           sizeof(replacements) / sizeof(replacements[0]),
+                           nullptr)) {
+        LOGW("Failed to substitute AROMA config variables: %s",
+             strerror(errno));
+    }
 
     data->assign(str_data.begin(), str_data.end());
 }
@@ -469,10 +552,13 @@ static void utilities_usage(bool error)
             "   OR: utilities [opt...] wipe-data [ROM ID]\n"
             "   OR: utilities [opt...] wipe-dalvik-cache [ROM ID]\n"
             "   OR: utilities [opt...] wipe-multiboot [ROM ID]\n"
+            "   OR: utilities [opt...] loop-status\n"
             "\n"
             "Options:\n"
             "  -f, --force      Force (only for 'switch' action)\n"
-            "  -d, --devices    Path to device defintions file\n");
+            "  -d, --devices    Path to device defintions file\n"
+            "  -t, --trim       Discard freed blocks after wiping (only for\n"
+            "                   'wipe-*' actions)\n");
 }
 
 int utilities_main(int argc, char *argv[])
@@ -483,6 +569,7 @@ int utilities_main(int argc, char *argv[])
     log::log_set_logger(std::make_shared<log::StdioLogger>(stdout, false));
 
     bool force = false;
+    bool trim = false;
 
     int opt;
 
@@ -490,12 +577,13 @@ int utilities_main(int argc, char *argv[])
         {"help", no_argument, 0, 'h'},
         {"force", no_argument, 0, 'f'},
         {"devices", required_argument, 0, 'd'},
+        {"trim", no_argument, 0, 't'},
         {0, 0, 0, 0}
     };
 
     int long_index = 0;
 
-    while ((opt = getopt_long(argc, argv, "hfd:",
+    while ((opt = getopt_long(argc, argv, "hfd:t",
                               long_options, &long_index)) != -1) {
         switch (opt) {
         case 'f':
@@ -506,6 +594,10 @@ int utilities_main(int argc, char *argv[])
             devices_file = optarg;
             break;
 
+        case 't':
+            trim = true;
+            break;
+
         case 'h':
             utilities_usage(false);
             return EXIT_SUCCESS;
@@ -523,7 +615,9 @@ int utilities_main(int argc, char *argv[])
 
     const std::string action = argv[optind];
     if ((action == "generate" && argc - optind != 3)
-            || (action != "generate" && argc - optind != 2)) {
+            || (action == "loop-status" && argc - optind != 1)
+            || (action != "generate" && action != "loop-status"
+                    && argc - optind != 2)) {
         utilities_usage(true);
         return EXIT_FAILURE;
     }
@@ -533,6 +627,13 @@ int utilities_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    if (trim && !starts_with(action, "wipe-")) {
+        utilities_usage(true);
+        return EXIT_FAILURE;
+    }
+
+    WipeTrimmer trimmer;
+    WipeTrimmer *trimmer_ptr = trim ? &trimmer : nullptr;
     bool ret = false;
 
     if (action == "generate") {
@@ -541,19 +642,25 @@ int utilities_main(int argc, char *argv[])
     } else if (action == "switch") {
         ret = utilities_switch_rom(argv[optind + 1], force);
     } else if (action == "wipe-system") {
-        ret = utilities_wipe_system(argv[optind + 1]);
+        ret = utilities_wipe_system(argv[optind + 1], trimmer_ptr);
     } else if (action == "wipe-cache") {
-        ret = utilities_wipe_cache(argv[optind + 1]);
+        ret = utilities_wipe_cache(argv[optind + 1], trimmer_ptr);
     } else if (action == "wipe-data") {
-        ret = utilities_wipe_data(argv[optind + 1]);
+        ret = utilities_wipe_data(argv[optind + 1], trimmer_ptr);
     } else if (action == "wipe-dalvik-cache") {
-        ret = utilities_wipe_dalvik_cache(argv[optind + 1]);
+        ret = utilities_wipe_dalvik_cache(argv[optind + 1], trimmer_ptr);
     } else if (action == "wipe-multiboot") {
-        ret = utilities_wipe_multiboot(argv[optind + 1]);
+        ret = utilities_wipe_multiboot(argv[optind + 1], trimmer_ptr);
+    } else if (action == "loop-status") {
+        ret = utilities_loop_status();
     } else {
         LOGE("Unknown action: %s", action.c_str());
     }
 
+    if (trim) {
+        trimmer.run();
+    }
+
     return ret ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
@@ -22,16 +22,21 @@
 #include <algorithm>
 
 #include <cerrno>
+#include <cinttypes>
+#include <cstdio>
 #include <cstring>
 
 #include <sys/stat.h>
 #include <unistd.h>
 
-#include "mbcommon/string.h"
 #include "mblog/logging.h"
+#include "mbutil/autoclose/file.h"
 #include "mbutil/delete.h"
-#include "mbutil/fts.h"
+#include "mbutil/discard.h"
+#include "mbutil/loopdev.h"
 #include "mbutil/mount.h"
+#include "mbutil/path.h"
+#include "mbutil/sched_policy.h"
 #include "mbutil/string.h"
 
 #include "multiboot.h"
@@ -39,84 +44,202 @@
 namespace mb
 {
 
-class WipeDirectory : public util::FTSWrapper {
-public:
-    WipeDirectory(std::string path, std::vector<std::string> exclusions)
-        : FTSWrapper(path, FTS_GroupSpecialFiles),
-        _exclusions(std::move(exclusions))
-    {
-    }
+static bool wipe_directory(const std::string &directory,
+                           const std::vector<std::string> &exclusions,
+                           int flags)
+{
+    std::vector<std::string> new_exclusions{ "multiboot" };
+    new_exclusions.insert(new_exclusions.end(),
+                          exclusions.begin(), exclusions.end());
+
+    return util::delete_dir_contents(directory, new_exclusions, flags);
+}
+
+bool wipe_directory(const std::string &directory,
+                    const std::vector<std::string> &exclusions)
+{
+    return wipe_directory(directory, exclusions, util::DELETE_PARALLEL);
+}
 
-    virtual int on_changed_path() override
-    {
-        // Exclude first-level directories
-        if (_curr->fts_level == 1) {
-            if (std::find(_exclusions.begin(), _exclusions.end(), _curr->fts_name)
-                    != _exclusions.end()) {
-                return Action::FTS_Skip;
-            }
+/*!
+ * \brief Wipe a directory, leaving the deletion of its contents to \a trash
+ *
+ * The directory is empty (apart from the exclusions and the trash) when this
+ * returns, but the old contents are only gone once \a trash is waited for.
+ */
+bool wipe_directory(const std::string &directory,
+                    const std::vector<std::string> &exclusions,
+                    util::TrashDeleter &trash)
+{
+    std::vector<std::string> new_exclusions{ "multiboot" };
+    new_exclusions.insert(new_exclusions.end(),
+                          exclusions.begin(), exclusions.end());
+
+    return trash.start(directory, new_exclusions, util::DELETE_PARALLEL);
+}
+
+/*!
+ * \class WipeTrimmer
+ * \brief Discards the blocks freed by wipes
+ *
+ * Filesystems don't discard freed blocks unless they are mounted with the
+ * `discard` option, so the flash controller only learns that they are unused
+ * when Android's idle maintenance runs `fstrim`. Until then, writes (eg. when
+ * installing the next ROM) are slower on worn eMMC.
+ *
+ * The wipe functions record the paths that they wiped in the trimmer. Once all
+ * wipes are done, run() trims each affected filesystem once with the lowest
+ * CPU and I/O priority and logs the number of bytes that were reclaimed.
+ */
+
+void WipeTrimmer::add_path(const std::string &path)
+{
+    _paths.push_back(path);
+}
+
+void WipeTrimmer::add_discarded(uint64_t bytes)
+{
+    _discarded += bytes;
+}
+
+/*!
+ * \brief Find the closest existing ancestor of a (possibly deleted) path
+ */
+static std::string existing_dir(std::string path)
+{
+    struct stat sb;
+
+    while (!path.empty()) {
+        if (stat(path.c_str(), &sb) == 0 && S_ISDIR(sb.st_mode)) {
+            return path;
         }
 
-        return Action::FTS_OK;
+        std::string parent = util::dir_name(path);
+        if (parent == path) {
+            break;
+        }
+        path = std::move(parent);
     }
 
-    virtual int on_reached_directory_pre() override
-    {
-        // Do nothing. Need depth-first search, so directories are deleted
-        // in FTS_DP
-        return Action::FTS_OK;
-    }
+    return {};
+}
 
-    virtual int on_reached_directory_post() override
-    {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
+static void trim_filesystems(const std::vector<std::string> &paths,
+                             uint64_t discarded)
+{
+    util::ScopedThreadSchedPolicy sched(
+            util::sched_policy_preset(util::SchedPreset::Background));
+
+    // Blocks are only freed once the deferred deletions are done
+    util::wait_for_background_deletes();
+
+    uint64_t total = discarded;
+
+    for (auto const &path : paths) {
+        uint64_t trimmed;
 
-    virtual int on_reached_file() override
-    {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
+        if (util::fstrim(path, trimmed)) {
+            LOGI("%s: Trimmed %" PRIu64 " bytes", path.c_str(), trimmed);
+            total += trimmed;
+        } else if (errno == EOPNOTSUPP || errno == ENOTTY) {
+            LOGV("%s: Filesystem does not support trimming", path.c_str());
+        } else {
+            LOGW("%s: Failed to trim: %s", path.c_str(), strerror(errno));
+        }
     }
 
-    virtual int on_reached_symlink() override
-    {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
+    LOGI("Reclaimed %" PRIu64 " bytes after wiping", total);
+}
+
+/*!
+ * \brief Trim the filesystems containing the recorded paths
+ *
+ * This waits for any background deletions to finish first.
+ */
+void WipeTrimmer::run()
+{
+    // Trim each filesystem only once
+    std::vector<std::string> paths;
+    std::vector<dev_t> devs;
+
+    for (auto const &path : _paths) {
+        std::string dir = existing_dir(path);
+        struct stat sb;
+
+        if (dir.empty() || stat(dir.c_str(), &sb) < 0) {
+            continue;
+        }
+
+        if (std::find(devs.begin(), devs.end(), sb.st_dev) == devs.end()) {
+            devs.push_back(sb.st_dev);
+            paths.push_back(std::move(dir));
+        }
     }
 
-    virtual int on_reached_special_file() override
-    {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
+    uint64_t discarded = _discarded;
+
+    _paths.clear();
+    _discarded = 0;
+
+    trim_filesystems(paths, discarded);
+}
+
+/*!
+ * \brief Check if an image is the backing file of a mounted loop device
+ */
+static bool image_in_use(const std::string &path, const struct stat &sb)
+{
+    autoclose::file fp(std::fopen(PROC_MOUNTS, "r"), std::fclose);
+    if (!fp) {
+        // Assume the worst
+        return true;
     }
 
-private:
-    std::vector<std::string> _exclusions;
+    for (util::MountEntry entry; util::get_mount_entry(fp.get(), entry);) {
+        util::LoopDevInfo info;
+        if (!util::loopdev_get_info(entry.fsname, info)) {
+            continue;
+        }
 
-    bool delete_path()
-    {
-        if (_curr->fts_level >= 1 && remove(_curr->fts_accpath) < 0) {
-            mb::format(_error_msg, "%s: Failed to remove: %s",
-                       _curr->fts_path, strerror(errno));
-            LOGW("%s", _error_msg.c_str());
-            return false;
+        struct stat backing_sb;
+        if (stat(info.backing_file.c_str(), &backing_sb) == 0
+                ? (backing_sb.st_dev == sb.st_dev
+                        && backing_sb.st_ino == sb.st_ino)
+                : info.backing_file == path) {
+            return true;
         }
-        return true;
     }
-};
 
-bool wipe_directory(const std::string &directory,
-                    const std::vector<std::string> &exclusions)
+    return false;
+}
+
+/*!
+ * \brief Release the blocks of an image that is about to be deleted
+ *
+ * Images that are still mounted through a loop device are left alone so that
+ * the filesystem isn't pulled from under the mount. Their blocks are freed
+ * when the loop device is detached and discarded by the next trim.
+ */
+static void discard_image(const std::string &path, const struct stat &sb,
+                          WipeTrimmer &trimmer)
 {
-    struct stat sb;
-    if (stat(directory.c_str(), &sb) < 0 && errno == ENOENT) {
-        // Don't fail if directory does not exist
-        return true;
+    if (image_in_use(path, sb)) {
+        LOGW("%s: Image is still mounted; not discarding", path.c_str());
+        return;
     }
 
-    std::vector<std::string> new_exclusions{ "multiboot" };
-    new_exclusions.insert(new_exclusions.end(),
-                          exclusions.begin(), exclusions.end());
+    uint64_t discarded;
+    if (util::discard_file(path, discarded)) {
+        LOGV("%s: Discarded %" PRIu64 " bytes", path.c_str(), discarded);
+        trimmer.add_discarded(discarded);
+    } else {
+        LOGV("%s: Failed to discard: %s", path.c_str(), strerror(errno));
+    }
+}
 
-    WipeDirectory wd(directory, std::move(new_exclusions));
-    return wd.run();
+static int delete_flags(bool background)
+{
+    return util::DELETE_PARALLEL | (background ? util::DELETE_BACKGROUND : 0);
 }
 
 /*!
@@ -125,10 +248,12 @@ bool wipe_directory(const std::string &directory,
  * \note The path will be deleted only if it is a regular file.
  *
  * \param path File to delete
+ * \param trimmer Trimmer to record the path in (if not NULL). The file's blocks
+ *                are discarded before it is deleted.
  *
  * \return True if file was deleted or doesn't exist. False, otherwise.
  */
-static bool log_wipe_file(const std::string &path)
+static bool log_wipe_file(const std::string &path, WipeTrimmer *trimmer)
 {
     LOGV("Wiping file %s", path.c_str());
 
@@ -147,6 +272,11 @@ static bool log_wipe_file(const std::string &path)
         return false;
     }
 
+    if (trimmer) {
+        discard_image(path, sb, *trimmer);
+        trimmer->add_path(path);
+    }
+
     bool ret = unlink(path.c_str()) == 0 || errno == ENOENT;
     LOGV("-> %s", ret ? "Succeeded" : "Failed");
     return ret;
@@ -160,11 +290,14 @@ static bool log_wipe_file(const std::string &path)
  *
  * \param mountpoint Mountpoint root to wipe
  * \param wipe_media Whether the first-level "media" path should be deleted
+ * \param background Whether the contents can be deleted in the background
+ * \param trimmer Trimmer to record the path in (if not NULL)
  *
  * \return True if the path was wiped or doesn't exist. False, otherwise
  */
 static bool log_wipe_directory(const std::string &mountpoint,
-                               const std::vector<std::string> &exclusions)
+                               const std::vector<std::string> &exclusions,
+                               bool background, WipeTrimmer *trimmer)
 {
     if (exclusions.empty()) {
         LOGV("Wiping directory %s", mountpoint.c_str());
@@ -188,20 +321,29 @@ static bool log_wipe_directory(const std::string &mountpoint,
         return false;
     }
 
-    bool ret = wipe_directory(mountpoint, exclusions);
+    if (trimmer) {
+        trimmer->add_path(mountpoint);
+    }
+
+    bool ret = wipe_directory(mountpoint, exclusions, delete_flags(background));
     LOGV("-> %s", ret ? "Succeeded" : "Failed");
     return ret;
 }
 
-static bool log_delete_recursive(const std::string &path)
+static bool log_delete_recursive(const std::string &path, bool background,
+                                 WipeTrimmer *trimmer)
 {
     LOGV("Recursively deleting %s", path.c_str());
-    bool ret = util::delete_recursive(path);
+    if (trimmer) {
+        trimmer->add_path(path);
+    }
+    bool ret = util::delete_recursive(path, delete_flags(background));
     LOGV("-> %s", ret ? "Succeeded" : "Failed");
     return ret;
 }
 
-bool wipe_system(const std::shared_ptr<Rom> &rom)
+bool wipe_system(const std::shared_ptr<Rom> &rom, bool background,
+                 WipeTrimmer *trimmer)
 {
     std::string path = rom->full_system_path();
     if (path.empty()) {
@@ -216,16 +358,17 @@ bool wipe_system(const std::shared_ptr<Rom> &rom)
         mount_point += rom->id;
         util::umount(mount_point.c_str());
 
-        ret = log_wipe_file(path);
+        ret = log_wipe_file(path, trimmer);
     } else {
-        ret = log_wipe_directory(path, {});
+        ret = log_wipe_directory(path, {}, background, trimmer);
         // Try removing ROM's /system if it's empty
         remove(path.c_str());
     }
     return ret;
 }
 
-bool wipe_cache(const std::shared_ptr<Rom> &rom)
+bool wipe_cache(const std::shared_ptr<Rom> &rom, bool background,
+                WipeTrimmer *trimmer)
 {
     std::string path = rom->full_cache_path();
     if (path.empty()) {
@@ -235,16 +378,17 @@ bool wipe_cache(const std::shared_ptr<Rom> &rom)
 
     bool ret;
     if (rom->cache_is_image) {
-        ret = log_wipe_file(path);
+        ret = log_wipe_file(path, trimmer);
     } else {
-        ret = log_wipe_directory(path, {});
+        ret = log_wipe_directory(path, {}, background, trimmer);
         // Try removing ROM's /cache if it's empty
         remove(path.c_str());
     }
     return ret;
 }
 
-bool wipe_data(const std::shared_ptr<Rom> &rom)
+bool wipe_data(const std::shared_ptr<Rom> &rom, bool background,
+               WipeTrimmer *trimmer)
 {
     std::string path = rom->full_data_path();
     if (path.empty()) {
@@ -254,9 +398,10 @@ bool wipe_data(const std::shared_ptr<Rom> &rom)
 
     bool ret;
     if (rom->data_is_image) {
-        ret = log_wipe_file(path);
+        ret = log_wipe_file(path, trimmer);
     } else {
-        ret = log_wipe_directory(path, { "media" });
+        ret = log_wipe_directory(path, { "media" }, background,
+                                 trimmer);
         // Try removing ROM's /data/media and /data if they're empty
         remove((path + "/media").c_str());
         remove(path.c_str());
@@ -264,7 +409,8 @@ bool wipe_data(const std::shared_ptr<Rom> &rom)
     return ret;
 }
 
-bool wipe_dalvik_cache(const std::shared_ptr<Rom> &rom)
+bool wipe_dalvik_cache(const std::shared_ptr<Rom> &rom, bool background,
+                       WipeTrimmer *trimmer)
 {
     if (rom->data_is_image || rom->cache_is_image) {
         LOGE("Wiping dalvik-cache for ROMs that use data or cache images is "
@@ -291,17 +437,18 @@ bool wipe_dalvik_cache(const std::shared_ptr<Rom> &rom)
     // util::delete_recursive() returns true if the path does not
     // exist (ie. returns false only on errors), which is exactly
     // what we want
-    return log_delete_recursive(data_path)
-            && log_delete_recursive(cache_path);
+    return log_delete_recursive(data_path, background, trimmer)
+            && log_delete_recursive(cache_path, background, trimmer);
 }
 
-bool wipe_multiboot(const std::shared_ptr<Rom> &rom)
+bool wipe_multiboot(const std::shared_ptr<Rom> &rom, bool background,
+                    WipeTrimmer *trimmer)
 {
     // Delete /data/media/0/MultiBoot/[ROM ID]
     std::string multiboot_path(MULTIBOOT_DIR);
     multiboot_path += '/';
     multiboot_path += rom->id;
-    return log_delete_recursive(multiboot_path);
+    return log_delete_recursive(multiboot_path, background, trimmer);
 }
 
 }
@@ -19,17 +19,45 @@
 
 #pragma once
 
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+#include "mbutil/delete.h"
+
 #include "roms.h"
 
 namespace mb
 {
 
+class WipeTrimmer
+{
+public:
+    void add_path(const std::string &path);
+    void add_discarded(uint64_t bytes);
+
+    void run();
+
+private:
+    std::vector<std::string> _paths;
+    uint64_t _discarded = 0;
+};
+
 bool wipe_directory(const std::string &directory,
                     const std::vector<std::string> &exclusions);
-bool wipe_system(const std::shared_ptr<Rom> &rom);
-bool wipe_cache(const std::shared_ptr<Rom> &rom);
-bool wipe_data(const std::shared_ptr<Rom> &rom);
-bool wipe_dalvik_cache(const std::shared_ptr<Rom> &rom);
-bool wipe_multiboot(const std::shared_ptr<Rom> &rom);
+bool wipe_directory(const std::string &directory,
+                    const std::vector<std::string> &exclusions,
+                    util::TrashDeleter &trash);
+bool wipe_system(const std::shared_ptr<Rom> &rom, bool background,
+                 WipeTrimmer *trimmer = nullptr);
+bool wipe_cache(const std::shared_ptr<Rom> &rom, bool background,
+                WipeTrimmer *trimmer = nullptr);
+bool wipe_data(const std::shared_ptr<Rom> &rom, bool background,
+               WipeTrimmer *trimmer = nullptr);
+bool wipe_dalvik_cache(const std::shared_ptr<Rom> &rom, bool background,
+                       WipeTrimmer *trimmer = nullptr);
+bool wipe_multiboot(const std::shared_ptr<Rom> &rom, bool background,
+                    WipeTrimmer *trimmer = nullptr);
 
 }
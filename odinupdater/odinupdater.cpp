@@ -17,7 +17,15 @@
  * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <cerrno>
@@ -27,13 +35,18 @@
 #include <cstring>
 
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <unistd.h>
 
 // libmbcommon
+#include "mbcommon/buffer_pool.h"
+#include "mbcommon/endian.h"
 #include "mbcommon/file/callbacks.h"
-#include "mbcommon/file/standard.h"
+#include "mbcommon/file_util.h"
 
 // libmbsparse
 #include "mbsparse/sparse.h"
@@ -71,6 +84,28 @@
 
 #define EFS_SALES_CODE_FILE     "/efs/imei/mps_code.dat"
 
+// Size of the buffers passed between the sparse flashing threads
+#define SPARSE_BUF_SIZE         (1024 * 1024)
+// Number of buffers that can be queued between each pair of threads
+#define SPARSE_QUEUE_SIZE       8
+// Alignment of buffers, offsets, and sizes for O_DIRECT writes
+#define SPARSE_DIRECT_IO_ALIGNMENT 4096
+
+// Zip end of central directory records and central directory headers
+#define ZIP_EOCD_MAGIC          0x06054b50
+#define ZIP_EOCD_SIZE           22
+#define ZIP_EOCD_MAX_COMMENT    0xffff
+#define ZIP64_LOCATOR_MAGIC     0x07064b50
+#define ZIP64_LOCATOR_SIZE      20
+#define ZIP64_EOCD_MAGIC        0x06064b50
+#define ZIP64_EOCD_SIZE         56
+#define ZIP_CDH_MAGIC           0x02014b50
+#define ZIP_CDH_SIZE            46
+#define ZIP64_EXTRA_ID          0x0001
+
+// Maximum number of partitions flashed at the same time
+#define FLASH_MAX_JOBS          3
+
 #define PROP_SYSTEM_DEV         "system"
 #define PROP_BOOT_DEV           "boot"
 
@@ -87,6 +122,13 @@ static int interface;
 static int output_fd;
 static const char *zip_file;
 
+// Local header offset of each entry in zip_file, built from the central
+// directory by load_zip_index()
+static std::unordered_map<std::string, uint64_t> zip_index;
+
+// Partitions are flashed on multiple threads, so keep lines from interleaving
+static std::mutex output_mutex;
+
 static char sales_code[10];
 static std::string system_block_dev;
 static std::string boot_block_dev;
@@ -97,17 +139,19 @@ void ui_print(const char *fmt, ...)
     va_list ap;
     va_list copy;
 
+    std::lock_guard<std::mutex> lock(output_mutex);
+
     va_start(ap, fmt);
 
     dprintf(output_fd, "ui_print ");
     va_copy(copy, ap);
-    vdprintf(output_fd, fmt, ap);
+    vdprintf(output_fd, fmt, copy);
     va_end(copy);
     dprintf(output_fd, "\nui_print\n");
 
     fputs("[UI] ", stdout);
     va_copy(copy, ap);
-    vprintf(fmt, ap);
+    vprintf(fmt, copy);
     va_end(copy);
     fputc('\n', stdout);
 
@@ -116,12 +160,14 @@ void ui_print(const char *fmt, ...)
 
 void set_progress(double frac)
 {
+    std::lock_guard<std::mutex> lock(output_mutex);
     dprintf(output_fd, "set_progress %f\n", frac);
 }
 
 MB_PRINTF(1, 2)
 void error(const char *fmt, ...)
 {
+    std::lock_guard<std::mutex> lock(output_mutex);
     va_list ap;
     va_start(ap, fmt);
     vfprintf(stderr, fmt, ap);
@@ -132,6 +178,7 @@ void error(const char *fmt, ...)
 MB_PRINTF(1, 2)
 void info(const char *fmt, ...)
 {
+    std::lock_guard<std::mutex> lock(output_mutex);
     va_list ap;
     va_start(ap, fmt);
     vprintf(fmt, ap);
@@ -190,6 +237,318 @@ static bool la_open_zip(archive *a, const char *filename)
     return true;
 }
 
+static inline uint16_t get_le16(const unsigned char *buf)
+{
+    uint16_t value;
+    memcpy(&value, buf, sizeof(value));
+    return mb_le16toh(value);
+}
+
+static inline uint32_t get_le32(const unsigned char *buf)
+{
+    uint32_t value;
+    memcpy(&value, buf, sizeof(value));
+    return mb_le32toh(value);
+}
+
+static inline uint64_t get_le64(const unsigned char *buf)
+{
+    uint64_t value;
+    memcpy(&value, buf, sizeof(value));
+    return mb_le64toh(value);
+}
+
+static bool pread_fully(int fd, void *buf, size_t size, uint64_t offset)
+{
+    size_t total = 0;
+
+    while (total < size) {
+        ssize_t n = pread64(fd, static_cast<char *>(buf) + total, size - total,
+                            static_cast<off64_t>(offset + total));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return false;
+        } else if (n == 0) {
+            errno = EIO;
+            return false;
+        }
+        total += static_cast<size_t>(n);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Get the 64-bit local header offset from a zip64 extra field
+ *
+ * The zip64 extra field only contains the fields that overflowed in the
+ * central directory header, in the order: uncompressed size, compressed size,
+ * local header offset.
+ */
+static bool find_zip64_offset(const unsigned char *extra, size_t extra_size,
+                              bool has_usize, bool has_csize,
+                              uint64_t &offset)
+{
+    while (extra_size >= 4) {
+        uint16_t id = get_le16(extra);
+        uint16_t size = get_le16(extra + 2);
+
+        if (size > extra_size - 4) {
+            break;
+        }
+
+        if (id == ZIP64_EXTRA_ID) {
+            size_t pos = (has_usize ? 8 : 0) + (has_csize ? 8 : 0);
+            if (pos + 8 > size) {
+                break;
+            }
+            offset = get_le64(extra + 4 + pos);
+            return true;
+        }
+
+        extra += 4 + size;
+        extra_size -= 4 + size;
+    }
+
+    return false;
+}
+
+/*!
+ * \brief Index the entries of zip_file by name
+ *
+ * The central directory is read once, so that each extraction can start at the
+ * entry's local header instead of reading every header before it.
+ */
+static bool load_zip_index()
+{
+    zip_index.clear();
+
+    int fd = open64(zip_file, O_RDONLY | O_CLOEXEC | O_LARGEFILE);
+    if (fd < 0) {
+        error("%s: Failed to open: %s", zip_file, strerror(errno));
+        return false;
+    }
+
+    auto close_fd = mb::util::finally([fd]{
+        close(fd);
+    });
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        error("%s: Failed to stat: %s", zip_file, strerror(errno));
+        return false;
+    } else if (sb.st_size < ZIP_EOCD_SIZE) {
+        error("%s: Too small to be a zip", zip_file);
+        return false;
+    }
+
+    uint64_t file_size = static_cast<uint64_t>(sb.st_size);
+
+    // The EOCD record is followed by a comment of up to 64 KiB
+    size_t tail_size = static_cast<size_t>(std::min<uint64_t>(
+            file_size, ZIP_EOCD_SIZE + ZIP_EOCD_MAX_COMMENT));
+    uint64_t tail_offset = file_size - tail_size;
+    std::vector<unsigned char> tail(tail_size);
+
+    if (!pread_fully(fd, tail.data(), tail.size(), tail_offset)) {
+        error("%s: Failed to read: %s", zip_file, strerror(errno));
+        return false;
+    }
+
+    size_t eocd_pos = tail_size - ZIP_EOCD_SIZE;
+    while (get_le32(tail.data() + eocd_pos) != ZIP_EOCD_MAGIC) {
+        if (eocd_pos == 0) {
+            error("%s: Failed to find end of central directory", zip_file);
+            return false;
+        }
+        --eocd_pos;
+    }
+
+    const unsigned char *eocd = tail.data() + eocd_pos;
+    uint64_t eocd_offset = tail_offset + eocd_pos;
+    uint64_t cd_entries = get_le16(eocd + 10);
+    uint64_t cd_size = get_le32(eocd + 12);
+    uint64_t cd_offset = get_le32(eocd + 16);
+    // Offset of the record right after the central directory
+    uint64_t cd_end = eocd_offset;
+
+    if (cd_entries == 0xffff || cd_size == 0xffffffff
+            || cd_offset == 0xffffffff) {
+        unsigned char locator[ZIP64_LOCATOR_SIZE];
+        unsigned char record[ZIP64_EOCD_SIZE];
+
+        if (eocd_offset < ZIP64_LOCATOR_SIZE
+                || !pread_fully(fd, locator, sizeof(locator),
+                                eocd_offset - ZIP64_LOCATOR_SIZE)
+                || get_le32(locator) != ZIP64_LOCATOR_MAGIC) {
+            error("%s: Failed to find zip64 end of central directory locator",
+                  zip_file);
+            return false;
+        }
+
+        cd_end = get_le64(locator + 8);
+
+        if (!pread_fully(fd, record, sizeof(record), cd_end)
+                || get_le32(record) != ZIP64_EOCD_MAGIC) {
+            error("%s: Failed to read zip64 end of central directory",
+                  zip_file);
+            return false;
+        }
+
+        cd_entries = get_le64(record + 32);
+        cd_size = get_le64(record + 40);
+        cd_offset = get_le64(record + 48);
+    }
+
+    if (cd_size > cd_end || cd_offset > cd_end - cd_size) {
+        error("%s: Invalid central directory location", zip_file);
+        return false;
+    }
+
+    // Zips with data prepended to them have all offsets shifted
+    uint64_t bias = cd_end - cd_size - cd_offset;
+
+    std::vector<unsigned char> cd(static_cast<size_t>(cd_size));
+    if (!pread_fully(fd, cd.data(), cd.size(), cd_offset + bias)) {
+        error("%s: Failed to read central directory: %s",
+              zip_file, strerror(errno));
+        return false;
+    }
+
+    size_t pos = 0;
+
+    for (uint64_t i = 0; i < cd_entries; ++i) {
+        const unsigned char *cdh = cd.data() + pos;
+
+        if (cd.size() - pos < ZIP_CDH_SIZE
+                || get_le32(cdh) != ZIP_CDH_MAGIC) {
+            error("%s: Invalid central directory header", zip_file);
+            return false;
+        }
+
+        uint32_t csize = get_le32(cdh + 20);
+        uint32_t usize = get_le32(cdh + 24);
+        uint16_t name_size = get_le16(cdh + 28);
+        uint16_t extra_size = get_le16(cdh + 30);
+        uint16_t comment_size = get_le16(cdh + 32);
+        uint64_t offset = get_le32(cdh + 42);
+        size_t header_size = ZIP_CDH_SIZE + name_size + extra_size
+                + comment_size;
+
+        if (cd.size() - pos < header_size) {
+            error("%s: Truncated central directory header", zip_file);
+            return false;
+        }
+
+        if (offset == 0xffffffff && !find_zip64_offset(
+                cdh + ZIP_CDH_SIZE + name_size, extra_size,
+                usize == 0xffffffff, csize == 0xffffffff, offset)) {
+            error("%s: Missing zip64 local header offset", zip_file);
+            return false;
+        }
+
+        std::string name(reinterpret_cast<const char *>(cdh) + ZIP_CDH_SIZE,
+                         name_size);
+        // Like la_skip_to(), the first entry with a given name wins
+        zip_index.emplace(std::move(name), offset + bias);
+
+        pos += header_size;
+    }
+
+    info("Indexed %zu entries in %s", zip_index.size(), zip_file);
+    return true;
+}
+
+struct ZipEntryReader
+{
+    int fd;
+    mb::IoBuffer buf;
+};
+
+static la_ssize_t la_entry_read_cb(archive *a, void *userdata,
+                                   const void **buffer)
+{
+    ZipEntryReader *reader = static_cast<ZipEntryReader *>(userdata);
+    ssize_t n;
+
+    do {
+        n = read(reader->fd, reader->buf.data(), reader->buf.size());
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        archive_set_error(a, errno, "Failed to read: %s", strerror(errno));
+        return -1;
+    }
+
+    *buffer = reader->buf.data();
+    return n;
+}
+
+static int la_entry_close_cb(archive *a, void *userdata)
+{
+    (void) a;
+
+    ZipEntryReader *reader = static_cast<ZipEntryReader *>(userdata);
+    close(reader->fd);
+    delete reader;
+
+    return ARCHIVE_OK;
+}
+
+/*!
+ * \brief Open zip_file with the reader positioned at an entry
+ *
+ * If the entry is in the index, libarchive starts reading at its local header,
+ * so the next la_skip_to() call finds it immediately. Otherwise, the whole zip
+ * is opened and la_skip_to() falls back to walking the headers.
+ */
+static bool la_open_zip_entry(archive *a, const char *entry_name)
+{
+    auto it = zip_index.find(entry_name);
+    if (it == zip_index.end()) {
+        return la_open_zip(a, zip_file);
+    }
+
+    if (archive_read_support_format_zip_streamable(a) != ARCHIVE_OK) {
+        error("libarchive: Failed to enable zip support: %s",
+              archive_error_string(a));
+        return false;
+    }
+
+    int fd = open64(zip_file, O_RDONLY | O_CLOEXEC | O_LARGEFILE);
+    if (fd < 0) {
+        error("%s: Failed to open: %s", zip_file, strerror(errno));
+        return false;
+    }
+
+    if (lseek64(fd, static_cast<off64_t>(it->second), SEEK_SET) < 0) {
+        error("%s: Failed to seek: %s", zip_file, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    ZipEntryReader *reader = new ZipEntryReader();
+    reader->fd = fd;
+
+    if (!reader->buf.allocate()) {
+        error("Failed to allocate buffer: %s", strerror(errno));
+        close(fd);
+        delete reader;
+        return false;
+    }
+
+    // The close callback frees the reader, even if opening fails
+    if (archive_read_open(a, reader, nullptr, &la_entry_read_cb,
+                          &la_entry_close_cb) != ARCHIVE_OK) {
+        error("libarchive: %s: Failed to open zip at %s: %s",
+              zip_file, entry_name, archive_error_string(a));
+        return false;
+    }
+
+    return true;
+}
+
 static ExtractResult la_skip_to(archive *a, const char *filename,
                                 archive_entry **entry)
 {
@@ -264,7 +623,7 @@ static bool load_block_devs()
             archive_read_free(a);
         });
 
-        if (!la_open_zip(a, zip_file)) {
+        if (!la_open_zip_entry(a, DEVICE_JSON_FILE)) {
             return false;
         }
 
@@ -351,33 +710,316 @@ static bool load_block_devs()
     return true;
 }
 
-static bool cb_zip_read(mb::File &file, void *userdata,
-                        void *buf, size_t size, size_t &bytes_read)
+/*!
+ * \brief Queue with a fixed capacity for passing data between threads
+ *
+ * Closing the queue wakes up all waiting threads. Items that were already
+ * queued can still be popped after the queue is closed.
+ */
+template<typename T>
+class BoundedQueue
 {
-    (void) file;
+public:
+    BoundedQueue(size_t capacity) : _capacity(capacity), _closed(false)
+    {
+    }
 
-    archive *a = static_cast<archive *>(userdata);
-    uint64_t total = 0;
+    // Returns false if the queue was closed
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _not_full.wait(lock, [&]{
+            return _closed || _items.size() < _capacity;
+        });
+        if (_closed) {
+            return false;
+        }
+        _items.push_back(std::move(item));
+        _not_empty.notify_one();
+        return true;
+    }
 
-    while (size > 0) {
-        la_ssize_t n = archive_read_data(a, buf, size);
+    // Returns false if the queue was closed and is empty
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _not_empty.wait(lock, [&]{
+            return _closed || !_items.empty();
+        });
+        if (_items.empty()) {
+            return false;
+        }
+        item = std::move(_items.front());
+        _items.pop_front();
+        _not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closed = true;
+        _not_empty.notify_all();
+        _not_full.notify_all();
+    }
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _not_empty;
+    std::condition_variable _not_full;
+    std::deque<T> _items;
+    size_t _capacity;
+    bool _closed;
+};
+
+typedef std::unique_ptr<unsigned char, decltype(free) *> ScopedBuffer;
+
+struct WriteOp
+{
+    uint64_t offset;
+    uint64_t size;
+    // Data to write or nullptr for a "don't care" region
+    ScopedBuffer data{nullptr, &free};
+};
+
+/*!
+ * \brief State shared by the sparse image flashing pipeline
+ *
+ * The zip entry is inflated on one thread and written to the output file on
+ * another thread while the sparse image is decoded on the calling thread.
+ */
+struct SparseFlashCtx
+{
+    archive *a;
+    const char *out_filename;
+    int fd;
+    int direct_fd;
+    bool can_discard;
+
+    BoundedQueue<std::vector<unsigned char>> inflated{SPARSE_QUEUE_SIZE};
+    BoundedQueue<WriteOp> writes{SPARSE_QUEUE_SIZE};
+    std::atomic<bool> failed{false};
+
+    // Inflated data currently being consumed by the sparse decoder
+    std::vector<unsigned char> cur_buf;
+    size_t cur_pos = 0;
+};
+
+static void sparse_inflate_thread(SparseFlashCtx *ctx)
+{
+    while (true) {
+        std::vector<unsigned char> buf(SPARSE_BUF_SIZE);
+
+        la_ssize_t n = archive_read_data(ctx->a, buf.data(), buf.size());
         if (n < 0) {
             error("libarchive: Failed to read data: %s",
-                  archive_error_string(a));
-            return false;
+                  archive_error_string(ctx->a));
+            ctx->failed = true;
+            break;
         } else if (n == 0) {
             break;
         }
 
+        buf.resize(n);
+
+        if (!ctx->inflated.push(std::move(buf))) {
+            break;
+        }
+    }
+
+    ctx->inflated.close();
+}
+
+static bool write_region(SparseFlashCtx *ctx, const WriteOp &op)
+{
+    // O_DIRECT requires aligned offsets and sizes. Sparse images for block
+    // devices always use 4096-byte blocks, so this is only a fallback.
+    int fd = ctx->direct_fd >= 0
+            && op.offset % SPARSE_DIRECT_IO_ALIGNMENT == 0
+            && op.size % SPARSE_DIRECT_IO_ALIGNMENT == 0
+            ? ctx->direct_fd : ctx->fd;
+    unsigned char *ptr = op.data.get();
+    uint64_t offset = op.offset;
+    uint64_t remain = op.size;
+
+    while (remain > 0) {
+        ssize_t n = pwrite64(fd, ptr, remain, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error("%s: Failed to write: %s",
+                  ctx->out_filename, strerror(errno));
+            return false;
+        }
+
+        ptr += n;
+        offset += n;
+        remain -= n;
+    }
+
+    return true;
+}
+
+static void discard_region(SparseFlashCtx *ctx, const WriteOp &op)
+{
+    // "Don't care" regions are left as is if they can't be discarded
+    if (!ctx->can_discard) {
+        return;
+    }
+
+    uint64_t range[2] = { op.offset, op.size };
+
+    if (ioctl(ctx->fd, BLKDISCARD, &range) < 0) {
+        info("%s: Failed to discard blocks: %s; skipping instead",
+             ctx->out_filename, strerror(errno));
+        ctx->can_discard = false;
+    }
+}
+
+static void sparse_write_thread(SparseFlashCtx *ctx)
+{
+    WriteOp op;
+
+    while (ctx->writes.pop(op)) {
+        if (!op.data) {
+            discard_region(ctx, op);
+        } else if (!write_region(ctx, op)) {
+            ctx->failed = true;
+            // Stop the decoder
+            ctx->writes.close();
+            break;
+        }
+    }
+}
+
+static bool cb_pipeline_read(mb::File &file, void *userdata,
+                             void *buf, size_t size, size_t &bytes_read)
+{
+    (void) file;
+
+    SparseFlashCtx *ctx = static_cast<SparseFlashCtx *>(userdata);
+    uint64_t total = 0;
+
+    while (size > 0) {
+        if (ctx->cur_pos == ctx->cur_buf.size()) {
+            if (!ctx->inflated.pop(ctx->cur_buf)) {
+                break;
+            }
+            ctx->cur_pos = 0;
+            continue;
+        }
+
+        size_t n = std::min(size, ctx->cur_buf.size() - ctx->cur_pos);
+        memcpy(buf, ctx->cur_buf.data() + ctx->cur_pos, n);
+
+        ctx->cur_pos += n;
         total += n;
         size -= n;
-        buf = (char *) buf + n;
+        buf = static_cast<char *>(buf) + n;
+    }
+
+    // The inflate thread already printed the error
+    if (ctx->failed) {
+        return false;
     }
 
     bytes_read = total;
     return true;
 }
 
+static bool decode_sparse_file(SparseFlashCtx *ctx, const char *zip_filename,
+                               uint64_t &size_out)
+{
+    mb::CallbackFile file;
+    mb::sparse::SparseFile sparse_file;
+
+    if (!file.open(nullptr, nullptr, &cb_pipeline_read, nullptr, nullptr,
+                   nullptr, ctx)) {
+        error("Failed to open sparse file in zip: %s",
+              file.error_string().c_str());
+        return false;
+    }
+
+    // Catch corrupted images while flashing if they have CRC32 chunks
+    sparse_file.set_verify_crc32(true);
+
+    if (!sparse_file.open(&file)) {
+        error("Failed to open sparse file: %s",
+              sparse_file.error_string().c_str());
+        return false;
+    }
+
+    uint64_t cur_bytes = 0;
+    uint64_t max_bytes = sparse_file.size();
+    uint64_t old_bytes = 0;
+
+    set_progress(0);
+
+    while (true) {
+        uint64_t region_size;
+        bool dont_care;
+
+        if (!sparse_file.region(region_size, dont_care)) {
+            error("Failed to read sparse file %s: %s",
+                  zip_filename, sparse_file.error_string().c_str());
+            return false;
+        } else if (region_size == 0) {
+            break;
+        }
+
+        WriteOp op;
+        op.offset = cur_bytes;
+
+        if (dont_care) {
+            op.size = region_size;
+
+            if (!sparse_file.seek(static_cast<int64_t>(region_size), SEEK_CUR,
+                                  nullptr)) {
+                error("Failed to seek sparse file %s: %s",
+                      zip_filename, sparse_file.error_string().c_str());
+                return false;
+            }
+        } else {
+            op.size = std::min<uint64_t>(region_size, SPARSE_BUF_SIZE);
+
+            void *buf;
+            if (posix_memalign(&buf, SPARSE_DIRECT_IO_ALIGNMENT, op.size)
+                    != 0) {
+                error("Out of memory");
+                return false;
+            }
+            op.data.reset(static_cast<unsigned char *>(buf));
+
+            size_t n;
+            if (!mb::file_read_fully(sparse_file, op.data.get(), op.size, n)
+                    || n != op.size) {
+                error("Failed to read sparse file %s: %s",
+                      zip_filename, sparse_file.error_string().c_str());
+                return false;
+            }
+        }
+
+        cur_bytes += op.size;
+
+        if (!ctx->writes.push(std::move(op))) {
+            // The write thread already printed the error
+            return false;
+        }
+
+        // Rate limit: update progress only after difference exceeds 0.1%
+        double old_ratio = static_cast<double>(old_bytes) / max_bytes;
+        double new_ratio = static_cast<double>(cur_bytes) / max_bytes;
+        if (new_ratio - old_ratio >= 0.001) {
+            set_progress(new_ratio);
+            old_bytes = cur_bytes;
+        }
+    }
+
+    size_out = cur_bytes;
+    return true;
+}
+
 #if DEBUG_SKIP_FLASH_SYSTEM
 MB_UNUSED
 #endif
@@ -385,16 +1027,13 @@ static ExtractResult extract_sparse_file(const char *zip_filename,
                                          const char *out_filename)
 {
     ScopedArchive a{archive_read_new(), &archive_read_free};
-    mb::CallbackFile file;
-    mb::sparse::SparseFile sparse_file;
-    mb::StandardFile out_file;
 
     if (!a) {
         error("Out of memory");
         return ExtractResult::ERROR;
     }
 
-    if (!la_open_zip(a.get(), zip_file)) {
+    if (!la_open_zip_entry(a.get(), zip_filename)) {
         return ExtractResult::ERROR;
     }
 
@@ -404,67 +1043,70 @@ static ExtractResult extract_sparse_file(const char *zip_filename,
         return result;
     }
 
-    if (!file.open(nullptr, nullptr, &cb_zip_read, nullptr, nullptr, nullptr,
-                   a.get())) {
-        error("Failed to open sparse file in zip: %s",
-              file.error_string().c_str());
+    int fd = open64(out_filename,
+                    O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC | O_LARGEFILE,
+                    0600);
+    if (fd < 0) {
+        error("%s: Failed to open: %s", out_filename, strerror(errno));
         return ExtractResult::ERROR;
     }
 
-    if (!sparse_file.open(&file)) {
-        error("Failed to open sparse file: %s",
-              sparse_file.error_string().c_str());
+    auto close_fd = mb::util::finally([fd]{
+        close(fd);
+    });
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        error("%s: Failed to stat: %s", out_filename, strerror(errno));
         return ExtractResult::ERROR;
     }
 
-    if (!out_file.open(out_filename, mb::FileOpenMode::WRITE_ONLY)) {
-        error("%s: Failed to open for writing: %s",
-              out_filename, out_file.error_string().c_str());
-        return ExtractResult::ERROR;
+    // Bypass the page cache for the bulk of the data
+    int direct_fd = open64(out_filename,
+                           O_WRONLY | O_CLOEXEC | O_LARGEFILE | O_DIRECT);
+    if (direct_fd < 0) {
+        info("%s: Failed to open for direct I/O: %s",
+             out_filename, strerror(errno));
     }
 
-    char buf[10240];
-    size_t n;
-    bool ret;
-    uint64_t cur_bytes = 0;
-    uint64_t max_bytes = sparse_file.size();
-    uint64_t old_bytes = 0;
+    auto close_direct_fd = mb::util::finally([direct_fd]{
+        if (direct_fd >= 0) {
+            close(direct_fd);
+        }
+    });
 
-    set_progress(0);
+    SparseFlashCtx ctx;
+    ctx.a = a.get();
+    ctx.out_filename = out_filename;
+    ctx.fd = fd;
+    ctx.direct_fd = direct_fd;
+    ctx.can_discard = S_ISBLK(sb.st_mode);
 
-    while ((ret = sparse_file.read(buf, sizeof(buf), n)) && n > 0) {
-        // Rate limit: update progress only after difference exceeds 0.1%
-        double old_ratio = static_cast<double>(old_bytes) / max_bytes;
-        double new_ratio = static_cast<double>(cur_bytes) / max_bytes;
-        if (new_ratio - old_ratio >= 0.001) {
-            set_progress(new_ratio);
-            old_bytes = cur_bytes;
-        }
+    std::thread inflate_thread(&sparse_inflate_thread, &ctx);
+    std::thread write_thread(&sparse_write_thread, &ctx);
 
-        char *out_ptr = buf;
-        size_t nwritten;
+    uint64_t size = 0;
+    bool ret = decode_sparse_file(&ctx, zip_filename, size);
 
-        while (n > 0) {
-            if (!out_file.write(buf, n, nwritten)) {
-                error("%s: Failed to write file: %s",
-                      out_filename, out_file.error_string().c_str());
-                return ExtractResult::ERROR;
-            }
+    // Let the write thread finish the queued writes and stop the inflate
+    // thread if the decoder stopped early
+    ctx.writes.close();
+    write_thread.join();
+    ctx.inflated.close();
+    inflate_thread.join();
 
-            n -= nwritten;
-            out_ptr += nwritten;
-            cur_bytes += nwritten;
-        }
+    if (!ret || ctx.failed) {
+        return ExtractResult::ERROR;
     }
-    if (!ret) {
-        error("Failed to read sparse file %s: %s",
-              zip_filename, sparse_file.error_string().c_str());
+
+    // Skipped regions at the end of a regular file don't extend it
+    if (S_ISREG(sb.st_mode) && ftruncate64(fd, size) < 0) {
+        error("%s: Failed to truncate: %s", out_filename, strerror(errno));
         return ExtractResult::ERROR;
     }
 
-    if (!out_file.close()) {
-        error("%s: Failed to close file: %s",
-              out_filename, out_file.error_string().c_str());
+    if (fsync(fd) < 0) {
+        error("%s: Failed to sync: %s", out_filename, strerror(errno));
         return ExtractResult::ERROR;
     }
 
@@ -472,10 +1114,11 @@ static ExtractResult extract_sparse_file(const char *zip_filename,
 }
 
 static ExtractResult extract_raw_file(const char *zip_filename,
-                                      const char *out_filename)
+                                      const char *out_filename,
+                                      bool show_progress)
 {
     ScopedArchive a{archive_read_new(), &archive_read_free};
-    char buf[10240];
+    mb::IoBuffer buf;
     la_ssize_t n;
     int fd;
     uint64_t cur_bytes = 0;
@@ -484,12 +1127,12 @@ static ExtractResult extract_raw_file(const char *zip_filename,
     double old_ratio;
     double new_ratio;
 
-    if (!a) {
+    if (!a || !buf.allocate()) {
         error("Out of memory");
         return ExtractResult::ERROR;
     }
 
-    if (!la_open_zip(a.get(), zip_file)) {
+    if (!la_open_zip_entry(a.get(), zip_filename)) {
         return ExtractResult::ERROR;
     }
 
@@ -512,18 +1155,22 @@ static ExtractResult extract_raw_file(const char *zip_filename,
         close(fd);
     });
 
-    set_progress(0);
+    if (show_progress) {
+        set_progress(0);
+    }
 
-    while ((n = archive_read_data(a.get(), buf, sizeof(buf))) > 0) {
+    while ((n = archive_read_data(a.get(), buf.data(), buf.size())) > 0) {
         // Rate limit: update progress only after difference exceeds 0.1%
         old_ratio = (double) old_bytes / max_bytes;
         new_ratio = (double) cur_bytes / max_bytes;
-        if (new_ratio - old_ratio >= 0.001) {
+        if (show_progress && new_ratio - old_ratio >= 0.001) {
             set_progress(new_ratio);
             old_bytes = cur_bytes;
         }
 
-        char *out_ptr = buf;
+        cur_bytes += n;
+
+        char *out_ptr = buf.data<char>();
         ssize_t nwritten;
 
         do {
@@ -736,17 +1383,22 @@ static bool flash_csc_zip()
     return true;
 }
 
-static ExtractResult flash_csc()
+/*!
+ * \brief Extract the files needed for flashing the CSC
+ *
+ * This does not touch the system partition, so it can run while the system
+ * image is being flashed.
+ */
+static ExtractResult extract_csc()
 {
-    int status;
     ExtractResult result;
 
-    result = extract_raw_file(CACHE_SPARSE_FILE, TEMP_CACHE_SPARSE_FILE);
+    result = extract_raw_file(CACHE_SPARSE_FILE, TEMP_CACHE_SPARSE_FILE, false);
     if (result != ExtractResult::OK) {
         return result;
     }
 
-    result = extract_raw_file(FUSE_SPARSE_FILE, TEMP_FUSE_SPARSE_FILE);
+    result = extract_raw_file(FUSE_SPARSE_FILE, TEMP_FUSE_SPARSE_FILE, false);
     if (result != ExtractResult::OK) {
         return ExtractResult::ERROR;
     }
@@ -757,6 +1409,16 @@ static ExtractResult flash_csc()
         return ExtractResult::ERROR;
     }
 
+    return ExtractResult::OK;
+}
+
+/*!
+ * \brief Flash the CSC extracted by extract_csc() to the system partition
+ */
+static ExtractResult flash_csc()
+{
+    int status;
+
     // Create temporary file for fuse
     close(open(TEMP_CACHE_MOUNT_FILE, O_CREAT | O_WRONLY | O_CLOEXEC, 0600));
 
@@ -826,6 +1488,38 @@ static ExtractResult flash_csc()
     return ExtractResult::OK;
 }
 
+/*!
+ * \brief Run jobs on up to \p max_jobs threads
+ *
+ * The jobs are started in order and this returns once all of them have
+ * completed.
+ */
+static void run_jobs(const std::vector<std::function<void()>> &jobs,
+                     unsigned int max_jobs)
+{
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> threads;
+
+    auto worker = [&]{
+        size_t i;
+        while ((i = next++) < jobs.size()) {
+            jobs[i]();
+        }
+    };
+
+    size_t n_threads = std::min<size_t>(max_jobs, jobs.size());
+
+    // The calling thread is one of the workers
+    for (size_t i = 1; i < n_threads; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+
+    for (std::thread &t : threads) {
+        t.join();
+    }
+}
+
 static bool flash_zip()
 {
     struct stat sb;
@@ -841,6 +1535,13 @@ static bool flash_zip()
 
     ui_print("Patched Odin image flasher");
 
+    // Every file below is extracted with its own reader, so find their
+    // offsets up front
+    if (!load_zip_index()) {
+        info("Failed to index zip; entries will be found sequentially");
+        zip_index.clear();
+    }
+
     // Load sales code from EFS partition
     if (!load_sales_code()) {
         return false;
@@ -857,17 +1558,49 @@ static bool flash_zip()
         return false;
     }
 
-#if !DEBUG_SKIP_FLASH_SYSTEM || !DEBUG_SKIP_FLASH_CSC || !DEBUG_SKIP_FLASH_BOOT
-    ExtractResult result;
+    // The system, cache, and boot images are independent until the CSC is
+    // flashed to the system partition, so extract them at the same time. Each
+    // job has its own zip reader and writes to a different file or partition.
+    ExtractResult system_result = ExtractResult::OK;
+#if !DEBUG_SKIP_FLASH_CSC
+    ExtractResult csc_result = ExtractResult::OK;
 #endif
+    ExtractResult boot_result = ExtractResult::OK;
+    std::vector<std::function<void()>> jobs;
 
-    // Flash system.img.ext4
 #if DEBUG_SKIP_FLASH_SYSTEM
     ui_print("[DEBUG] Skipping flashing of system image");
 #else
     ui_print("Flashing system image");
-    result = extract_sparse_file(SYSTEM_SPARSE_FILE, system_block_dev.c_str());
-    switch (result) {
+    jobs.push_back([&]{
+        // This is the largest image, so it is the only one reporting progress
+        system_result = extract_sparse_file(SYSTEM_SPARSE_FILE,
+                                            system_block_dev.c_str());
+    });
+#endif
+
+#if DEBUG_SKIP_FLASH_CSC
+    ui_print("[DEBUG] Skipping flashing of CSC");
+#else
+    ui_print("Extracting CSC from cache image");
+    jobs.push_back([&]{
+        csc_result = extract_csc();
+    });
+#endif
+
+#if DEBUG_SKIP_FLASH_BOOT
+    ui_print("[DEBUG] Skipping flashing of boot image");
+#else
+    ui_print("Flashing boot image");
+    jobs.push_back([&]{
+        boot_result = extract_raw_file(BOOT_IMAGE_FILE, boot_block_dev.c_str(),
+                                       false);
+    });
+#endif
+
+    run_jobs(jobs, FLASH_MAX_JOBS);
+
+    switch (system_result) {
     case ExtractResult::ERROR:
         ui_print("Failed to flash system image");
         return false;
@@ -875,18 +1608,18 @@ static bool flash_zip()
         ui_print("[WARNING] System image not found");
         break;
     case ExtractResult::OK:
+#if !DEBUG_SKIP_FLASH_SYSTEM
         ui_print("Successfully flashed system image");
+#endif
         break;
     }
-#endif
 
-    // Flash CSC from cache.img.ext4
-#if DEBUG_SKIP_FLASH_CSC
-    ui_print("[DEBUG] Skipping flashing of CSC");
-#else
-    ui_print("Flashing CSC from cache image");
-    result = flash_csc();
-    switch (result) {
+#if !DEBUG_SKIP_FLASH_CSC
+    if (csc_result == ExtractResult::OK) {
+        ui_print("Flashing CSC from cache image");
+        csc_result = flash_csc();
+    }
+    switch (csc_result) {
     case ExtractResult::ERROR:
         ui_print("Failed to flash CSC");
         return false;
@@ -899,16 +1632,11 @@ static bool flash_zip()
     }
 #endif
 
-    // Flash boot.img
-#if DEBUG_SKIP_FLASH_BOOT
-    ui_print("[DEBUG] Skipping flashing of boot image");
-#else
-    ui_print("Flashing boot image");
-    result = extract_raw_file(BOOT_IMAGE_FILE, boot_block_dev.c_str());
-    if (result != ExtractResult::OK) {
+    if (boot_result != ExtractResult::OK) {
         ui_print("Failed to flash boot image");
         return false;
     }
+#if !DEBUG_SKIP_FLASH_BOOT
     ui_print("Successfully flashed boot image");
 #endif
 
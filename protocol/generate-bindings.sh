@@ -7,7 +7,10 @@ files=(
     v3/crypto_get_pw_type.fbs
     v3/file_chmod.fbs
     v3/file_close.fbs
+    v3/file_copy_range.fbs
+    v3/file_hash.fbs
     v3/file_open.fbs
+    v3/file_open_fd.fbs
     v3/file_read.fbs
     v3/file_seek.fbs
     v3/file_selinux_get_label.fbs
@@ -17,6 +20,7 @@ files=(
     v3/mb_get_booted_rom_id.fbs
     v3/mb_get_installed_roms.fbs
     v3/mb_get_packages_count.fbs
+    v3/mb_get_stats.fbs
     v3/mb_get_version.fbs
     v3/mb_set_kernel.fbs
     v3/mb_switch_rom.fbs
@@ -25,6 +29,7 @@ files=(
     v3/path_copy.fbs
     v3/path_delete.fbs
     v3/path_get_directory_size.fbs
+    v3/path_list_directory.fbs
     v3/path_mkdir.fbs
     v3/path_readlink.fbs
     v3/path_selinux_get_label.fbs
@@ -17,15 +17,27 @@
  * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
+#include <fcntl.h>
+#ifdef _WIN32
+#  include <io.h>
+#else
+#  include <unistd.h>
+#endif
+
 #include <openssl/err.h>
 
 // libmbsign
 #include "mbsign/mbsign.h"
 
+#ifndef O_BINARY
+#  define O_BINARY 0
+#endif
+
 static void openssl_log_errors()
 {
     ERR_print_errors_fp(stderr);
@@ -34,80 +46,92 @@ static void openssl_log_errors()
 static void usage(FILE *stream)
 {
     fprintf(stream,
-            "Usage: signtool <PKCS12 file> <input file> <output signature file>\n\n"
+            "Usage: signtool <PKCS12 file> <input file> <output signature file>\n"
+            "                [<input file> <output signature file>...]\n\n"
+            "Multiple input files can be signed at once. The private key is\n"
+            "only loaded once.\n\n"
             "NOTE: This is not a general purpose tool for signing files!\n"
             "It is only meant for use with mbtool.\n");
 }
 
+static bool sign_file(EVP_PKEY *private_key, const char *file_input,
+                      const char *file_output)
+{
+    int fd_input;
+    BIO *bio_sig_out = nullptr;
+    bool ret;
+
+    fd_input = open(file_input, O_RDONLY | O_BINARY);
+    if (fd_input < 0) {
+        fprintf(stderr, "%s: Failed to open input file: %s\n",
+                file_input, strerror(errno));
+        return false;
+    }
+    bio_sig_out = BIO_new_file(file_output, "wb");
+    if (!bio_sig_out) {
+        fprintf(stderr, "%s: Failed to open output file\n", file_output);
+        openssl_log_errors();
+        close(fd_input);
+        return false;
+    }
+
+    ret = mb::sign::sign_data_fd(fd_input, bio_sig_out, private_key);
+    if (!ret) {
+        fprintf(stderr, "%s: Failed to sign file\n", file_input);
+    }
+
+    if (close(fd_input) < 0) {
+        fprintf(stderr, "%s: Failed to close input file: %s\n",
+                file_input, strerror(errno));
+        ret = false;
+    }
+    if (!BIO_free(bio_sig_out)) {
+        fprintf(stderr, "%s: Failed to close output file\n", file_output);
+        openssl_log_errors();
+        ret = false;
+    }
+
+    return ret;
+}
+
 int main(int argc, char *argv[])
 {
     const char *file_pkcs12;
-    const char *file_input;
-    const char *file_output;
     EVP_PKEY *private_key = nullptr;
     const char *pass;
-    BIO *bio_data_in = nullptr;
-    BIO *bio_sig_out = nullptr;
-    bool ret;
+    bool ret = true;
 
     ERR_load_crypto_strings();
     OpenSSL_add_all_algorithms();
 
-    if (argc != 4) {
+    if (argc < 4 || (argc - 2) % 2 != 0) {
         usage(stderr);
         return EXIT_FAILURE;
     }
 
     file_pkcs12 = argv[1];
-    file_input = argv[2];
-    file_output = argv[3];
 
     pass = getenv("MBSIGN_PASSPHRASE");
     if (!pass) {
         fprintf(stderr,
                 "The MBSIGN_PASSPHRASE environment variable is not set\n");
-        goto error;
+        return EXIT_FAILURE;
     }
 
     private_key = mb::sign::load_private_key_from_file(
             file_pkcs12, mb::sign::KEY_FORMAT_PKCS12, pass);
     if (!private_key) {
-        goto error;
+        return EXIT_FAILURE;
     }
 
-    bio_data_in = BIO_new_file(file_input, "rb");
-    if (!bio_data_in) {
-        fprintf(stderr, "%s: Failed to open input file\n", file_input);
-        openssl_log_errors();
-        goto error;
+    for (int i = 2; i < argc; i += 2) {
+        if (!sign_file(private_key, argv[i], argv[i + 1])) {
+            ret = false;
+            break;
+        }
     }
-    bio_sig_out = BIO_new_file(file_output, "wb");
-    if (!bio_sig_out) {
-        fprintf(stderr, "%s: Failed to open output file\n", file_output);
-        openssl_log_errors();
-        goto error;
-    }
-
-    ret = mb::sign::sign_data(bio_data_in, bio_sig_out, private_key);
 
     EVP_PKEY_free(private_key);
 
-    if (!BIO_free(bio_data_in)) {
-        fprintf(stderr, "%s: Failed to close input file\n", file_input);
-        openssl_log_errors();
-        ret = false;
-    }
-    if (!BIO_free(bio_sig_out)) {
-        fprintf(stderr, "%s: Failed to close output file\n", file_output);
-        openssl_log_errors();
-        ret = false;
-    }
-
     return ret ? EXIT_SUCCESS : EXIT_FAILURE;
-
-error:
-    EVP_PKEY_free(private_key);
-    BIO_free(bio_data_in);
-    BIO_free(bio_sig_out);
-    return EXIT_FAILURE;
 }